@@ -14,6 +14,8 @@ HEADERS	= \
 	libradius.h \
 	md4.h \
 	md5.h \
+	memstats.h \
+	metrics.h \
 	missing.h \
 	modcall.h \
 	modules.h \
@@ -27,6 +29,7 @@ HEADERS	= \
 	stats.h \
 	sysutmp.h \
 	token.h \
+	trace.h \
 	udpfromto.h \
 	base64.h \
 	map.h
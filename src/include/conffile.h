@@ -161,6 +161,7 @@ int		cf_section_parse(CONF_SECTION *, void *base, CONF_PARSER const *variables);
 int		cf_section_parse_pass2(CONF_SECTION *, void *base, CONF_PARSER const *variables);
 const CONF_PARSER *cf_section_parse_table(CONF_SECTION *cs);
 CONF_SECTION	*cf_file_read(char const *file);
+CONF_SECTION	*cf_file_read_snapshot(char const *file, char const *snapshot);
 void		cf_file_free(CONF_SECTION *cs);
 int		cf_file_include(CONF_SECTION *cs, char const *file);
 
@@ -200,6 +201,7 @@ char const *cf_pair_filename(CONF_PAIR const *pair);
 char const *cf_section_filename(CONF_SECTION const *section);
 CONF_ITEM *cf_item_find_next(CONF_SECTION const *section, CONF_ITEM const *item);
 int cf_pair_count(CONF_SECTION const *cs);
+bool cf_section_equal(CONF_SECTION const *a, CONF_SECTION const *b);
 CONF_SECTION *cf_item_parent(CONF_ITEM const *ci);
 bool cf_item_is_section(CONF_ITEM const *item);
 bool cf_item_is_pair(CONF_ITEM const *item);
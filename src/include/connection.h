@@ -35,6 +35,38 @@ extern "C" {
 
 typedef struct fr_connection_pool_t fr_connection_pool_t;
 
+/** Number of buckets in the connection pool latency histograms
+ *
+ * Bucket 0 counts times under 10us, and each bucket after that covers
+ * ten times the range of the one before it.  The last bucket counts
+ * times of one second or more.
+ */
+#define FR_CONNECTION_POOL_HIST_BUCKETS	7
+
+/** The state of a connection pool
+ *
+ * @see fr_connection_pool_stats
+ */
+typedef struct fr_connection_pool_stats_t {
+	char const	*name;		//!< Name of the module which owns the pool.
+	char const	*log_prefix;	//!< Log prefix of the pool.
+	uint32_t	num;		//!< Number of connections in the pool.
+	uint32_t	active;		//!< Number of connections in use.
+	uint32_t	max;		//!< Maximum number of connections.
+	uint32_t	waiting;	//!< Requests waiting for a connection.
+	uint64_t	waits;		//!< Requests which have had to wait.
+	uint64_t	wait_timeouts;	//!< Requests which gave up waiting.
+	uint64_t	wait_time;	//!< Total time requests have waited (us).
+	uint32_t	max_wait_time;	//!< Longest wait (us).
+	uint64_t	spawn_failures;	//!< Connections which couldn't be opened.
+	uint64_t	reconnects;	//!< Connections which were re-opened.
+
+	uint64_t	wait_hist[FR_CONNECTION_POOL_HIST_BUCKETS];	//!< How long it took to get
+									//!< a connection.
+	uint64_t	hold_hist[FR_CONNECTION_POOL_HIST_BUCKETS];	//!< How long connections
+									//!< were held for.
+} fr_connection_pool_stats_t;
+
 /** Create a new connection handle
  *
  * This function will be called whenever the connection pool manager needs
@@ -84,6 +116,8 @@ fr_connection_pool_t *fr_connection_pool_init(CONF_SECTION *parent,
 					      char const *log_prefix,
 					      char const *trigger_prefix);
 void fr_connection_pool_delete(fr_connection_pool_t *pool);
+void fr_connection_pool_defer_start(void);
+int fr_connection_pool_start_all(void);
 
 void *fr_connection_get(fr_connection_pool_t *pool);
 int fr_connection_get_num(fr_connection_pool_t *pool);
@@ -91,6 +125,9 @@ void fr_connection_release(fr_connection_pool_t *pool, void *conn);
 void *fr_connection_reconnect(fr_connection_pool_t *pool, void *conn);
 int fr_connection_del(fr_connection_pool_t *pool, void *conn);
 
+void fr_connection_pool_stats(fr_connection_pool_t *pool, fr_connection_pool_stats_t *stats);
+int fr_connection_pool_stats_all(TALLOC_CTX *ctx, char const *name, fr_connection_pool_stats_t **out);
+
 #ifdef __cplusplus
 }
 #endif
@@ -36,19 +36,91 @@ typedef enum detail_state_t {
 #  endif
 #endif
 
+/*
+ *	Binary detail files are a series of records, each of which is a
+ *	header followed by "length" bytes of RADIUS attributes.  All of
+ *	the header fields are in network byte order.
+ */
+#define DETAIL_BINARY_MAGIC	(0xfdde7a11)
+
+typedef struct detail_binary_t {
+	uint32_t	magic;
+	uint32_t	length;			//!< Of the attributes following the header.
+	uint32_t	checksum;		//!< Of the header and attributes, with checksum and done zeroed.
+	uint32_t	timestamp;		//!< When the original packet was received.
+	uint8_t		done;			//!< Set by the reader when "track = yes".
+	uint8_t		code;			//!< Of the original packet.
+	uint8_t		af;			//!< 4 or 6, or 0 if there's no client address.
+	uint8_t		reserved;
+	uint8_t		ipaddr[16];		//!< Of the client which sent the original packet.
+} detail_binary_t;
+
+uint32_t detail_binary_checksum(detail_binary_t const *hdr, uint8_t const *attrs, size_t len);
+
+/*
+ *	Compressed detail files are a series of blocks, each of which
+ *	is a header followed by "length" bytes of zlib data.  Each block
+ *	holds complete binary records, so a crash while writing loses
+ *	at most the last block.
+ */
+#if defined(HAVE_ZLIB_H) && defined(HAVE_LIBZ)
+#  define WITH_DETAIL_COMPRESSION (1)
+#endif
+
+#define DETAIL_BLOCK_MAGIC	(0xfdde7a12)
+#define DETAIL_BLOCK_MAX	(16 * 1024 * 1024)	//!< Largest block, once decompressed.
+
+typedef struct detail_block_t {
+	uint32_t	magic;
+	uint32_t	length;			//!< Of the compressed data following the header.
+	uint32_t	raw_length;		//!< Of the records, once decompressed.
+	uint32_t	checksum;		//!< Of the header and compressed data, with checksum zeroed.
+} detail_block_t;
+
+uint32_t detail_block_checksum(detail_block_t const *hdr, uint8_t const *data, size_t len);
+
+#ifdef WITH_DETAIL_THREAD
+/*
+ *	An entry which has been read from the file, and is waiting
+ *	to be acknowledged.
+ */
+typedef struct detail_entry_t {
+	VALUE_PAIR	*vps;			//!< Copy of the entry, for retransmits.
+	fr_ipaddr_t	client_ip;
+	time_t		timestamp;
+	off_t		timestamp_offset;	//!< Where to mark the entry as "Done".
+	int		tries;
+	uint32_t	counter;		//!< Of the last packet sent for the entry.
+	time_t		retry_at;		//!< When to send it again, if there's no reply.
+} detail_entry_t;
+#endif
+
 typedef struct listen_detail_t {
 	fr_event_t	*ev;	/* has to be first entry (ugh) */
 	int		delay_time;
 	char const	*filename;
 	char const	*filename_work;
+	char const	*filename_work_base;	//!< Work file name of the first reader.
 	VALUE_PAIR	*vps;
 	int		work_fd;
 #ifdef WITH_DETAIL_THREAD
 	int		master_pipe[2];
 	int		child_pipe[2];
 	pthread_t	pthread_id;
+
+	detail_entry_t	*window;	//!< Ring of max_outstanding entries, in file order.
+	uint32_t	*acked;		//!< Bitmap of the acknowledged entries in the window.
+	uint32_t	head;		//!< Oldest entry in the window.
+	struct timeval	next_read;	//!< Don't read another entry before this.
 #endif
 	FILE		*fp;
+	bool		binary;		//!< File contains detail_binary_t records.
+	uint8_t		*map;		//!< Contents of a binary file, or the current block.
+	size_t		map_len;
+	bool		compressed;	//!< File contains detail_block_t blocks.
+	uint8_t		*zmap;		//!< Contents of a compressed file.
+	size_t		zmap_len;
+	size_t		zoffset;	//!< Of the next block.
 	off_t		offset;
 	detail_state_t 	state;
 	time_t		timestamp;
@@ -68,8 +140,10 @@ typedef struct listen_detail_t {
 	int		packets;
 	int		tries;
 	bool		one_shot;
-	int		outstanding;
-	int		max_outstanding;
+	uint32_t	outstanding;
+	uint32_t	max_outstanding;
+	uint32_t	readers;	//!< Number of files to read in parallel.
+	uint32_t	id;		//!< Of this reader, 0..readers - 1.
 	int		has_rtt;
 	int		srtt;
 	int		rttvar;
@@ -34,9 +34,27 @@ extern "C" {
 /*
  *	Not for production use.
  */
+int fr_dhcp_init(void);
 RADIUS_PACKET *fr_dhcp_recv(int sockfd);
 int fr_dhcp_send(RADIUS_PACKET *packet);
 
+#ifdef WITH_RADIUS_BATCH
+RADIUS_PACKET *fr_dhcp_batch_packet(rad_batch_t *batch, int i);
+int fr_dhcp_queue(rad_batch_t *batch, RADIUS_PACKET *packet);
+#endif
+
+#define DHCP_HW_ADDR_LEN	(6)
+
+/*
+ *	Replies can be sent as ethernet frames, which don't need an
+ *	ARP entry for the client.
+ */
+#ifdef __linux__
+#  define WITH_DHCP_RAW
+int fr_dhcp_raw_open(char const *interface, int *ifindex, uint8_t *mac);
+int fr_dhcp_send_raw(int fd, int ifindex, uint8_t const *mac, RADIUS_PACKET *packet);
+#endif
+
 int fr_dhcp_add_arp_entry(int fd, char const *interface, VALUE_PAIR *hwvp, VALUE_PAIR *clvp);
 
 int8_t fr_dhcp_attr_cmp(void const *a, void const *b);
@@ -38,6 +38,22 @@ uint32_t fr_hash(void const *, size_t);
 uint32_t fr_hash_update(void const *data, size_t size, uint32_t hash);
 uint32_t fr_hash_string(char const *p);
 
+/*
+ *	Keyed hash, with a random key chosen when the process starts.
+ *	Use it for hash tables whose keys come from the network, so
+ *	that the keys can't be chosen to collide.  The values differ
+ *	between runs, so never store them, or use them to pick a home
+ *	server.  Build with -DWITH_FNV_HASH to use fr_hash() instead.
+ */
+uint32_t fr_hash_keyed(void const *data, size_t size);
+uint32_t fr_hash_keyed_update(void const *data, size_t size, uint32_t hash);
+uint32_t fr_hash_keyed_string(char const *p);
+
+/*
+ *	The tables are not thread-safe.  However, lookups and walks
+ *	never modify the table, so any number of threads may read
+ *	it at the same time, so long as nothing is writing to it.
+ */
 typedef struct fr_hash_table_t fr_hash_table_t;
 typedef void (*fr_hash_table_free_t)(void *);
 typedef uint32_t (*fr_hash_table_hash_t)(void const *);
@@ -2,7 +2,7 @@
 #define LRAD_HEAP_H
 
 /*
- * heap.h	Structures and prototypes for binary heaps.
+ * heap.h	Structures and prototypes for heaps.
  * Version:	$Id$
  *
  *   This program is free software; you can redistribute it and/or modify
@@ -29,12 +29,15 @@ extern "C" {
 #endif
 
 typedef int (*fr_heap_cmp_t)(void const *, void const *);
+typedef uint64_t (*fr_heap_key_t)(void const *);
 
 typedef struct fr_heap_t fr_heap_t;
 fr_heap_t *fr_heap_create(fr_heap_cmp_t cmp, size_t offset);
+fr_heap_t *fr_heap_create_keyed(fr_heap_key_t key, size_t offset);
 void fr_heap_delete(fr_heap_t *hp);
 
 int fr_heap_insert(fr_heap_t *hp, void *data);
+int fr_heap_insert_bulk(fr_heap_t *hp, void **data, int num);
 int fr_heap_extract(fr_heap_t *hp, void *data);
 void *fr_heap_peek(fr_heap_t *hp);
 int fr_heap_num_elements(fr_heap_t *hp);
@@ -184,10 +184,25 @@ typedef struct attr_flags {
 
 	unsigned int	virtual : 1;				//!< for dynamic expansion
 
+	unsigned int	intern : 1;				//!< Decoded values are shared, see intern.c.
+
 	uint8_t		encrypt;      				//!< Ecryption method.
 	uint8_t		length;
 } ATTR_FLAGS;
 
+/** Pre-computed header for an attribute
+ *
+ * Filled in when the attribute is added to the dictionary, so that
+ * rad_vp2attr() doesn't have to work out the vendor format etc. for
+ * every attribute it encodes.  hdr_len is 0 for attributes which
+ * need the full encoder (TLVs, tags, encryption, extended formats...)
+ */
+typedef struct attr_encode {
+	uint8_t		hdr_len;				//!< Length of the header, or 0.
+	uint8_t		vsa_len;				//!< Offset of the VSA length field, or 0.
+	uint8_t		hdr[12];				//!< Header, with the lengths set for no data.
+} ATTR_ENCODE;
+
 /*
  *  Values of the encryption flags.
  */
@@ -202,11 +217,15 @@ extern const size_t dict_attr_sizes[PW_TYPE_MAX][2];
 /** dictionary attribute
  *
  */
+typedef struct fr_intern fr_intern_t;
+
 typedef struct dict_attr {
 	unsigned int		attr;
 	PW_TYPE			type;
 	unsigned int		vendor;
 	ATTR_FLAGS		flags;
+	ATTR_ENCODE		encode;
+	fr_intern_t		*intern;		//!< Shared values, if flags.intern is set.
 	char			name[1];
 } DICT_ATTR;
 
@@ -328,6 +347,15 @@ typedef struct vp_cursor {
 	VALUE_PAIR	*next;					//!< Next attribute to process.
 } vp_cursor_t;
 
+/** An index of the first VALUE_PAIR of each attribute in a list
+ *
+ * Built once with pairindex_alloc(), for callers which look up many
+ * attributes in a list which doesn't change.  VALUE_PAIRs may be
+ * appended to the list afterwards, but the index must be freed if
+ * any are removed.
+ */
+typedef struct vp_index vp_index_t;
+
 /** A VALUE_PAIR in string format.
  *
  * Used to represent pairs in the legacy 'users' file format.
@@ -391,6 +419,10 @@ typedef struct radius_packet {
 	size_t			data_len;
 	VALUE_PAIR		*vps;
 	ssize_t			offset;
+	void			*ring_buf;	//!< Receive buffer "data" points into, see rad_recv_ring().
+
+	bool			indexed;	//!< rad_packet_ok() has checked "data", and set ma_offset.
+	uint16_t		ma_offset;	//!< Offset of the Message-Authenticator, or 0 if none.
 #ifdef WITH_TCP
 	size_t			partial;
 	int			proto;
@@ -423,6 +455,7 @@ int		fr_check_lib_magic(uint64_t magic);
  *	Printing functions.
  */
 int		fr_utf8_char(uint8_t const *str);
+size_t		fr_utf8_valid(uint8_t const *str, size_t inlen);
 size_t		fr_print_string(char const *in, size_t inlen,
 				char *out, size_t outlen, char quote);
 	size_t		fr_print_string_len(char const *in, size_t inlen, char quote);
@@ -435,6 +468,8 @@ size_t		vp_data_prints_value(char *out, size_t outlen,
 size_t   	vp_prints_value(char *out, size_t outlen, VALUE_PAIR const *vp, char quote);
 size_t    	vp_prints_value_json(char *out, size_t outlen, VALUE_PAIR const *vp);
 size_t		vp_prints(char *out, size_t outlen, VALUE_PAIR const *vp);
+size_t		vp_prints_list(char *out, size_t outlen, VALUE_PAIR const *vps, char const *prefix,
+			       char const *suffix);
 void		vp_print(FILE *, VALUE_PAIR const *);
 void		vp_printlist(FILE *, VALUE_PAIR const *);
 char		*vp_aprint_type(TALLOC_CTX *ctx, PW_TYPE type);
@@ -460,7 +495,9 @@ int		dict_addvendor(char const *name, unsigned int value);
 int		dict_addattr(char const *name, int attr, unsigned int vendor, PW_TYPE type, ATTR_FLAGS flags);
 int		dict_addvalue(char const *namestr, char const *attrstr, int value);
 int		dict_init(char const *dir, char const *fn);
+void		dict_set_cache(char const *file);
 void		dict_free(void);
+size_t		dict_memory(uint32_t *num);
 int		dict_read(char const *dir, char const *filename);
 
 void 		dict_attr_free(DICT_ATTR const **da);
@@ -500,8 +537,34 @@ void		fr_md5_calc(uint8_t *, uint8_t const *, unsigned int);
 int		rad_send(RADIUS_PACKET *, RADIUS_PACKET const *, char const *secret);
 bool		rad_packet_ok(RADIUS_PACKET *packet, int flags, decode_fail_t *reason);
 RADIUS_PACKET	*rad_recv(int fd, int flags);
+
+typedef struct rad_ring rad_ring_t;
+
+rad_ring_t	*rad_ring_alloc(int num);
+void		rad_ring_free(rad_ring_t **ring);
+RADIUS_PACKET	*rad_recv_ring(rad_ring_t *ring, int fd, int flags);
+void		rad_packet_release(RADIUS_PACKET *packet);
+
 ssize_t rad_recv_header(int sockfd, fr_ipaddr_t *src_ipaddr, uint16_t *src_port, int *code);
+ssize_t		rad_recv_peek(int sockfd, RADIUS_PACKET *packet);
 void		rad_recv_discard(int sockfd);
+
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG)
+#  define WITH_RADIUS_BATCH
+typedef struct rad_batch rad_batch_t;
+
+rad_batch_t	*rad_batch_alloc(TALLOC_CTX *ctx, int num);
+int		rad_batch_size(rad_batch_t const *batch);
+int		rad_batch_recv(rad_batch_t *batch, int sockfd, rad_ring_t *ring);
+RADIUS_PACKET	*rad_batch_packet(rad_batch_t *batch, int i);
+int		rad_batch_peek(rad_batch_t *batch, int i, RADIUS_PACKET *packet);
+ssize_t		rad_batch_data(rad_batch_t *batch, int i, RADIUS_PACKET *packet, uint8_t **data);
+int		rad_batch_send(rad_batch_t *batch, RADIUS_PACKET *packet, RADIUS_PACKET const *original,
+			       char const *secret);
+int		rad_batch_queue(rad_batch_t *batch, RADIUS_PACKET *packet);
+int		rad_batch_flush(rad_batch_t *batch);
+#endif
+
 int		rad_verify(RADIUS_PACKET *packet, RADIUS_PACKET *original,
 			   char const *secret);
 int		rad_decode(RADIUS_PACKET *packet, RADIUS_PACKET *original, char const *secret);
@@ -578,6 +641,8 @@ int		pair2unknown(VALUE_PAIR *vp);
 void		pairfree(VALUE_PAIR **);
 VALUE_PAIR	*pairfind(VALUE_PAIR *, unsigned int attr, unsigned int vendor, int8_t tag);
 VALUE_PAIR	*pairfind_da(VALUE_PAIR *, DICT_ATTR const *da, int8_t tag);
+vp_index_t	*pairindex_alloc(TALLOC_CTX *ctx, VALUE_PAIR **first);
+VALUE_PAIR	*pairindex_find(vp_index_t const *index, DICT_ATTR const *da, int8_t tag);
 
 #define		fr_cursor_init(_x, _y)	_fr_cursor_init(_x,(VALUE_PAIR const * const *) _y)
 VALUE_PAIR	*_fr_cursor_init(vp_cursor_t *cursor, VALUE_PAIR const * const *node);
@@ -617,6 +682,7 @@ bool		pairvalidate(VALUE_PAIR const *failed[2], VALUE_PAIR *filter, VALUE_PAIR *
 bool 		pairvalidate_relaxed(VALUE_PAIR const *failed[2], VALUE_PAIR *filter, VALUE_PAIR *list);
 VALUE_PAIR	*paircopyvp(TALLOC_CTX *ctx, VALUE_PAIR const *vp);
 VALUE_PAIR	*paircopy(TALLOC_CTX *ctx, VALUE_PAIR *from);
+VALUE_PAIR	*paircopy_shared(TALLOC_CTX *ctx, VALUE_PAIR *from);
 VALUE_PAIR	*paircopy_by_num(TALLOC_CTX *ctx, VALUE_PAIR *from, unsigned int attr, unsigned int vendor, int8_t tag);
 void		pairsteal(TALLOC_CTX *ctx, VALUE_PAIR *vp);
 void		pairmemcpy(VALUE_PAIR *vp, uint8_t const * src, size_t len);
@@ -698,6 +764,21 @@ size_t		fr_prints_uint128(char *out, size_t outlen, uint128_t const num);
 int		fr_get_time(char const *date_str, time_t *date);
 int8_t		fr_pointer_cmp(void const *a, void const *b);
 void		fr_quick_sort(void const *to_sort[], int min_idx, int max_idx, fr_cmp_t cmp);
+
+/*
+ *	Hostname lookups, with a cache.
+ */
+typedef struct fr_dns_query fr_dns_query_t;
+
+int		fr_dns_cache_init(uint32_t size, uint32_t ttl, uint32_t negative_ttl, uint32_t prefetch,
+				  uint32_t threads);
+int		fr_dns_resolve(fr_ipaddr_t *out, int af, char const *hostname, bool fallback);
+int		fr_dns_lookup(fr_ipaddr_t *out, int af, char const *hostname, bool fallback);
+int		fr_dns_lookup_async(fr_ipaddr_t *out, int af, char const *hostname, bool fallback,
+				    fr_dns_query_t **query);
+int		fr_dns_query_fd(fr_dns_query_t const *query);
+int		fr_dns_query_result(fr_ipaddr_t *out, fr_dns_query_t *query);
+void		fr_dns_query_free(fr_dns_query_t *query);
 /*
  *	Define TALLOC_DEBUG to check overflows with talloc.
  *	we can't use valgrind, because the memory used by
@@ -733,6 +814,7 @@ void		fr_isaac(fr_randctx *ctx);
 void		fr_randinit(fr_randctx *ctx, int flag);
 uint32_t	fr_rand(void);	/* like rand(), but better. */
 void		fr_rand_seed(void const *, size_t ); /* seed the random pool */
+void		fr_rand_fill(void *out, size_t len);
 
 
 /* crypt wrapper from crypt.c */
@@ -855,6 +937,75 @@ void		*fr_fifo_pop(fr_fifo_t *fi);
 void		*fr_fifo_peek(fr_fifo_t *fi);
 int		fr_fifo_num_elements(fr_fifo_t *fi);
 
+/*
+ *	Bounded lock-free MPMC queues
+ */
+typedef struct	fr_atomic_queue_t fr_atomic_queue_t;
+fr_atomic_queue_t *fr_atomic_queue_create(TALLOC_CTX *ctx, int max_entries);
+int		fr_atomic_queue_push(fr_atomic_queue_t *aq, void *data);
+void		*fr_atomic_queue_pop(fr_atomic_queue_t *aq);
+int		fr_atomic_queue_push_batch(fr_atomic_queue_t *aq, void * const *data, int num);
+int		fr_atomic_queue_pop_batch(fr_atomic_queue_t *aq, void **data, int num);
+int		fr_atomic_queue_num_elements(fr_atomic_queue_t *aq);
+int		fr_atomic_queue_size(fr_atomic_queue_t *aq);
+
+/*
+ *	Shared attribute values in intern.c
+ */
+fr_intern_t	*fr_intern_create(TALLOC_CTX *ctx, PW_TYPE type);
+void const	*fr_intern_value(fr_intern_t *it, uint8_t const *data, size_t len);
+bool		fr_intern_is(void const *value);
+void		fr_intern_ref(void const *value);
+void		fr_intern_release(void const *value);
+
+/*
+ *	Cached time of day in clock.c
+ */
+void		fr_clock_coarse(bool coarse);
+void		fr_clock_update(void);
+void		fr_clock_gettime(struct timeval *tv);
+time_t		fr_clock_time(void);
+uint64_t	fr_clock_monotonic(void);
+
+/*
+ *	Incremental JSON parser in json.c
+ */
+#define FR_JSON_MAX_DEPTH	32
+
+typedef enum fr_json_event {
+	FR_JSON_OBJECT_START = 0,
+	FR_JSON_OBJECT_END,
+	FR_JSON_ARRAY_START,
+	FR_JSON_ARRAY_END,
+	FR_JSON_KEY,
+	FR_JSON_STRING,
+	FR_JSON_NUMBER,
+	FR_JSON_TRUE,
+	FR_JSON_FALSE,
+	FR_JSON_NULL,
+	FR_JSON_RAW				//!< Text of a captured container.
+} fr_json_event_t;
+
+typedef enum fr_json_action {
+	FR_JSON_ABORT = -1,			//!< Stop parsing, and return an error.
+	FR_JSON_CONTINUE = 0,
+	FR_JSON_SKIP,				//!< Ignore the value for this key, or this container.
+	FR_JSON_CAPTURE				//!< Return this container as a single FR_JSON_RAW event.
+} fr_json_action_t;
+
+/*
+ *	depth is the number of containers enclosing the key or value.
+ *	value is \0 terminated, and only valid until the callback returns.
+ */
+typedef fr_json_action_t (*fr_json_callback_t)(void *uctx, fr_json_event_t event, int depth,
+					       char const *value, size_t len);
+
+typedef struct fr_json_parser fr_json_parser_t;
+fr_json_parser_t *fr_json_parser_alloc(TALLOC_CTX *ctx, fr_json_callback_t callback, void *uctx);
+void		fr_json_parser_reset(fr_json_parser_t *jp);
+int		fr_json_parse(fr_json_parser_t *jp, char const *in, size_t inlen);
+int		fr_json_parse_end(fr_json_parser_t *jp);
+
 #ifdef __cplusplus
 }
 #endif
@@ -73,11 +73,17 @@ typedef struct fr_log_t {
 
 typedef		void (*radlog_func_t)(log_type_t lvl, log_debug_t priority, REQUEST *, char const *, va_list ap);
 
+typedef struct log_capture log_capture_t;
+
 extern FR_NAME_NUMBER const syslog_str2fac[];
 extern FR_NAME_NUMBER const log_str2dst[];
 extern fr_log_t default_log;
 
 int	radlog_init(fr_log_t *log, bool daemonize);
+int	radlog_async_start(uint32_t size);
+void	radlog_async_stop(void);
+void	radlog_async_forked(void);
+uint64_t radlog_dropped(void);
 
 int	vradlog(log_type_t lvl, char const *fmt, va_list ap)
 	CC_HINT(format (printf, 2, 0)) CC_HINT(nonnull);
@@ -97,6 +103,13 @@ void	vradlog_request(log_type_t type, log_debug_t lvl, REQUEST *request, char co
 void	radlog_request(log_type_t type, log_debug_t lvl, REQUEST *request, char const *msg, ...)
 	CC_HINT(format (printf, 4, 5)) CC_HINT(nonnull (3, 4));
 
+void	vradlog_request_capture(log_type_t type, log_debug_t lvl, REQUEST *request, char const *msg, va_list ap)
+	CC_HINT(format (printf, 4, 0)) CC_HINT(nonnull (3, 4));
+
+bool	log_capture_start(REQUEST *request, size_t size) CC_HINT(nonnull);
+
+void	log_capture_done(REQUEST *request, bool flush) CC_HINT(nonnull);
+
 void	radlog_request_error(log_type_t type, log_debug_t lvl, REQUEST *request, char const *msg, ...)
 	CC_HINT(format (printf, 4, 5)) CC_HINT(nonnull (3, 4));
 
@@ -115,6 +128,11 @@ fr_logfile_t *fr_logfile_init(TALLOC_CTX *ctx);
 int fr_logfile_open(fr_logfile_t *lf, char const *filename, mode_t permissions);
 int fr_logfile_close(fr_logfile_t *lf, int fd);
 int fr_logfile_unlock(fr_logfile_t *lf, int fd);
+int fr_logfile_async(fr_logfile_t *lf, uint32_t commit_interval, bool fsync, gid_t gid);
+int fr_logfile_write(fr_logfile_t *lf, char const *filename, mode_t permissions, void const *data, size_t len);
+
+typedef ssize_t (*fr_logfile_encode_t)(TALLOC_CTX *ctx, uint8_t **out, uint8_t const *data, size_t len, void *uctx);
+void fr_logfile_encoder(fr_logfile_t *lf, fr_logfile_encode_t encode, void *uctx);
 
 /*
  *	Logging macros.
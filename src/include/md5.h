@@ -91,6 +91,17 @@ USES_APPLE_DEPRECATED_API
 
 /* hmac.c */
 
+/*
+ *	HMAC-MD5 state after hashing the padded key.
+ */
+typedef struct fr_hmac_md5_ctx {
+	FR_MD5_CTX	inner;
+	FR_MD5_CTX	outer;
+} FR_HMAC_MD5_CTX;
+
+void fr_hmac_md5_init(FR_HMAC_MD5_CTX *ctx, uint8_t const *key, size_t key_len);
+void fr_hmac_md5_ctx(uint8_t digest[MD5_DIGEST_LENGTH], uint8_t const *text, size_t text_len,
+		     FR_HMAC_MD5_CTX const *ctx);
 void fr_hmac_md5(uint8_t digest[MD5_DIGEST_LENGTH], uint8_t const *text, size_t text_len,
 		 uint8_t const *key, size_t key_len);
 
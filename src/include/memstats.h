@@ -0,0 +1,46 @@
+#ifndef MEMSTATS_H
+#define MEMSTATS_H
+/*
+ *	memstats.h	Memory accounting for the server subsystems.
+ *
+ * Version:	$Id$
+ *
+ */
+
+RCSIDH(memstats_h, "$Id$")
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum memstats_type_t {
+	MEMSTATS_REQUEST = 0,		//!< Requests being processed.
+	MEMSTATS_EAP_SESSION,		//!< EAP sessions waiting for the next round.
+	MEMSTATS_TLS_SESSION,		//!< Entries in the TLS session caches.
+	MEMSTATS_CACHE,			//!< Entries in the rlm_cache "rbtree" drivers.
+	MEMSTATS_CONNECTION,		//!< Connections in the connection pools.
+	MEMSTATS_DICTIONARY,		//!< Attributes and values in the dictionaries.
+	MEMSTATS_CONFIG,		//!< The parsed configuration files.
+	MEMSTATS_NUM_TYPES
+} memstats_type_t;
+
+typedef struct memstats_t {
+	char const	*name;
+	uint64_t	num;		//!< Objects currently allocated.
+	uint64_t	max_num;	//!< Most objects ever allocated at once.
+	uint64_t	total;		//!< Objects allocated since the server started.
+	uint64_t	bytes;		//!< Bytes currently allocated.
+	uint64_t	max_bytes;	//!< Most bytes ever allocated at once.
+	uint64_t	avg_size;	//!< Sampled size of one object, or 0 if none have been sampled.
+} memstats_t;
+
+void	memstats_alloc(memstats_type_t type, TALLOC_CTX const *ctx);
+void	memstats_free(memstats_type_t type, TALLOC_CTX const *ctx);
+void	memstats_set(memstats_type_t type, uint64_t num, uint64_t bytes);
+void	memstats_get(memstats_type_t type, memstats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MEMSTATS_H */
@@ -0,0 +1,46 @@
+#ifndef METRICS_H
+#define METRICS_H
+/*
+ *	metrics.h	Serve the server statistics as OpenMetrics text.
+ *
+ * Version:	$Id$
+ *
+ */
+
+RCSIDH(metrics_h, "$Id$")
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ *	The exporter reads the statistics from its own thread, so it
+ *	needs both of them.
+ */
+#if defined(WITH_STATS) && defined(HAVE_PTHREAD_H)
+#  define WITH_METRICS (1)
+#endif
+
+#ifdef WITH_METRICS
+typedef struct listen_metrics_t {
+	fr_ipaddr_t	my_ipaddr;
+	uint16_t	my_port;
+
+	fr_ipaddr_t	*allow;		//!< Networks which may scrape, from the "allow" entries.
+	int		num_allow;
+
+	int		fd;		//!< Listening socket.  Not this->fd, as it's not in the event loop.
+	bool		exiting;	//!< Tells the thread to stop.
+	pthread_t	pthread_id;
+} listen_metrics_t;
+
+int metrics_parse(CONF_SECTION *cs, rad_listen_t *this);
+void metrics_free(rad_listen_t *this);
+int metrics_print(rad_listen_t const *this, char *buffer, size_t bufsize);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* METRICS_H */
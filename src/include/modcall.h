@@ -46,6 +46,13 @@ void add_to_modcallable(modcallable *parent, modcallable *this);
 
 void modcall_debug(modcallable *mc, int depth);
 
+/* Print a compiled section, e.g. for radmin. */
+typedef void (*modcall_print_t)(void *ctx, int depth, char const *line);
+void modcall_print(modcallable *mc, int depth, modcall_print_t print, void *ctx);
+
+/* Find the compiled section of a virtual server. */
+int virtual_server_section(modcallable **out, char const *name, rlm_components_t comp);
+
 #ifdef __cplusplus
 }
 #endif
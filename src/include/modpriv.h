@@ -35,6 +35,29 @@ typedef struct module_entry_t {
 } module_entry_t;
 
 typedef struct fr_module_hup_t fr_module_hup_t;
+typedef struct fr_module_file_t fr_module_file_t;
+
+#ifdef WITH_STATS
+/*
+ *	Run-time counters for a module instance, if profile_modules
+ *	is set.  call_modsingle() updates them from every thread, so
+ *	they're incremented atomically where the compiler can.  Only
+ *	one call in profile_modules_sample is timed.
+ */
+typedef struct module_stats_t {
+	uint64_t		calls[RLM_COMPONENT_COUNT];	//!< By section.
+	uint64_t		timed[RLM_COMPONENT_COUNT];	//!< Calls which were timed, by section.
+	uint64_t		usec[RLM_COMPONENT_COUNT];	//!< Total time of the timed calls.
+	uint64_t		rcode[RLM_MODULE_NUMCODES];
+	fr_uint_t		hist[FR_STATS_HIST_BUCKETS];	//!< Times of the timed calls.
+} module_stats_t;
+
+#ifdef __ATOMIC_RELAXED
+#  define MODULE_STATS_ADD(_x, _n) __atomic_add_fetch(&(_x), _n, __ATOMIC_RELAXED)
+#else
+#  define MODULE_STATS_ADD(_x, _n) ((_x) += (_n))
+#endif
+#endif
 
 /*
  *	Per-instance data structure, to correlate the modules
@@ -52,11 +75,22 @@ typedef struct module_instance_t {
 	bool			force;
 	rlm_rcode_t		code;
 	fr_module_hup_t	       	*mh;
+	fr_module_file_t	*files;		//!< Referenced by the configuration, for HUP.
+#ifdef WITH_STATS
+	module_stats_t		*stats;		//!< If profile_modules is set.
+#endif
 } module_instance_t;
 
 module_instance_t	*find_module_instance(CONF_SECTION *modules, char const *askedname, bool do_link);
 int			find_module_sibling_section(CONF_SECTION **out, CONF_SECTION *module, char const *name);
 int			module_hup_module(CONF_SECTION *cs, module_instance_t *node, time_t when);
+int			module_instance_walk(rb_walker_t callback, void *ctx);
+
+#ifdef WITH_STATS
+void			module_stats_record(module_stats_t *stats, rlm_components_t component,
+					    rlm_rcode_t rcode, struct timeval const *start);
+module_stats_t const	*module_section_stats(void);
+#endif
 
 #ifdef __cplusplus
 }
@@ -85,6 +85,9 @@ extern const section_type_value_t section_type_value[];
 						//!< Server will instantiated
 						//!< new instance, and then
 						//!< destroy old instance.
+#define RLM_TYPE_YIELD_SAFE	(1 << 3) 	//!< Module may give up its thread
+						//!< in module_yield() while
+						//!< waiting for I/O.
 
 
 /* Stop people using different module/library/server versions together */
@@ -104,8 +107,8 @@ typedef rlm_rcode_t (*packetmethod)(void *instance, REQUEST *request);
 /** Module instantiation callback
  *
  * Is called once per module instance. Is not called when new threads are
- * spawned. Modules that require separate thread contexts should use the
- * connection pool API.
+ * spawned. Modules that require separate thread contexts should use
+ * thread_instantiate, or the connection pool API.
  *
  * @param[in] mod_cs Module instance's configuration section.
  * @param[out] instance Module instance's configuration structure, should be
@@ -127,6 +130,41 @@ typedef int (*instantiate_t)(CONF_SECTION *mod_cs, void *instance);
  */
 typedef int (*detach_t)(void *instance);
 
+/** Module thread instantiation callback
+ *
+ * Is called the first time each thread uses the module instance, and lets
+ * thread-safe modules keep state which only that thread touches.  Modules
+ * which use it don't need a mutex for that state.
+ *
+ * @param[in] instance the module instance data, from instantiate.
+ * @param[out] thread per-thread data, thread_inst_size bytes, zeroed.  Freed
+ *	after thread_detach is called.
+ * @return -1 if instantiation failed, else 0.
+ */
+typedef int (*thread_instantiate_t)(void *instance, void *thread);
+
+/** Module thread detach callback
+ *
+ * Is called in the thread when it exits, and before the module instance
+ * is detached.
+ *
+ * @param[in] instance the module instance data.
+ * @param[in] thread per-thread data to clean up.
+ * @return -1 if detach failed, else 0.
+ */
+typedef int (*thread_detach_t)(void *instance, void *thread);
+
+/** Module cache flush callback
+ *
+ * Is called by "radmin flush module <module> [<key>]", and lets modules which
+ * keep the results of lookups discard them.
+ *
+ * @param[in] instance the module instance data.
+ * @param[in] key of the entries to discard, or NULL to discard all of them.
+ * @return the number of entries discarded, or -1 on error.
+ */
+typedef int (*cache_flush_t)(void *instance, char const *key);
+
 /** Metadata exported by the module
  *
  * This determines the capabilities of the module, and maps internal functions
@@ -144,11 +182,18 @@ typedef struct module_t {
 								//!< determines which function is mapped to
 								//!< which section.
 
+	size_t			thread_inst_size;		//!< Size of the per-thread data.
+	thread_instantiate_t	thread_instantiate;		//!< Function to set up per-thread data.
+	thread_detach_t		thread_detach;			//!< Function to clean up per-thread data.
+
+	cache_flush_t		cache_flush;			//!< Function to discard cached lookups.
 } module_t;
 
 int modules_init(CONF_SECTION *);
 int modules_free(void);
 int modules_hup(CONF_SECTION *modules);
+void *module_thread_instance(void *instance);
+void modules_thread_detach(void);
 rlm_rcode_t process_authorize(int type, REQUEST *request);
 rlm_rcode_t process_authenticate(int type, REQUEST *request);
 rlm_rcode_t module_preacct(REQUEST *request);
@@ -166,6 +211,7 @@ rlm_rcode_t process_send_coa(int type, REQUEST *request);
 #endif
 
 rlm_rcode_t indexed_modcall(rlm_components_t comp, int idx, REQUEST *request);
+int module_yield(REQUEST *request, int fd, struct timeval const *timeout);
 
 /*
  *	For now, these are strongly tied together.
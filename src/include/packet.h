@@ -31,6 +31,7 @@ extern "C" {
 #endif
 
 int fr_packet_cmp(RADIUS_PACKET const *a, RADIUS_PACKET const *b);
+uint32_t fr_packet_hash(RADIUS_PACKET const *packet);
 int fr_inaddr_any(fr_ipaddr_t *ipaddr);
 void fr_request_from_reply(RADIUS_PACKET *request,
 			     RADIUS_PACKET const *reply);
@@ -40,6 +41,7 @@ int fr_nonblock(int fd);
 typedef struct fr_packet_list_t fr_packet_list_t;
 
 fr_packet_list_t *fr_packet_list_create(int alloc_id);
+bool fr_packet_list_id_range(fr_packet_list_t *pl, int first, int step);
 void fr_packet_list_free(fr_packet_list_t *pl);
 bool fr_packet_list_insert(fr_packet_list_t *pl,
 			    RADIUS_PACKET **request_p);
@@ -53,6 +55,7 @@ bool fr_packet_list_yank(fr_packet_list_t *pl,
 uint32_t fr_packet_list_num_elements(fr_packet_list_t *pl);
 bool fr_packet_list_id_alloc(fr_packet_list_t *pl, int proto,
 			    RADIUS_PACKET **request_p, void **pctx);
+bool fr_packet_list_id_low(fr_packet_list_t *pl);
 bool fr_packet_list_id_free(fr_packet_list_t *pl,
 			    RADIUS_PACKET *request, bool yank);
 bool fr_packet_list_socket_add(fr_packet_list_t *pl, int sockfd, int proto,
@@ -54,6 +54,23 @@ typedef enum fr_cond_type_t {
 } fr_cond_type_t;
 
 
+/** Run-time counters for a condition
+ *
+ * Updated without locks, so the counts are approximate when
+ * there's no atomic support.
+ */
+typedef struct fr_cond_stats_t {
+	uint64_t	true_count;
+	uint64_t	false_count;
+	uint64_t	error_count;
+} fr_cond_stats_t;
+
+#ifdef __ATOMIC_RELAXED
+#  define FR_COND_STATS_INC(_stats, _field) __atomic_fetch_add(&(_stats)->_field, 1, __ATOMIC_RELAXED)
+#else
+#  define FR_COND_STATS_INC(_stats, _field) ((_stats)->_field++)
+#endif
+
 /*
  *	Allow for the following structures:
  *
@@ -75,8 +92,10 @@ struct fr_cond_t {
 
 	int		negate;
 	int		pass2_fixup;
+	int		cost;		//!< Estimated cost of evaluating this node, set in pass2.
 
 	DICT_ATTR const *cast;
+	fr_cond_stats_t	*stats;		//!< Run-time counters, if profile_conditions is set.
 
 	cond_op_t	next_op;
 	fr_cond_t	*next;
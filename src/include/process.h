@@ -51,6 +51,7 @@ int request_enqueue(REQUEST *request);
 
 int request_receive(rad_listen_t *listener, RADIUS_PACKET *packet,
 		    RADCLIENT *client, RAD_REQUEST_FUNP fun);
+bool request_receive_dup(rad_listen_t *listener, RADIUS_PACKET *packet);
 
 #ifdef WITH_PROXY
 int request_proxy_reply(RADIUS_PACKET *packet);
@@ -55,6 +55,31 @@ typedef struct rc_stats {
 	uint64_t failed;		//!< Requests which failed a fitler
 } rc_stats_t;
 
+/*
+ *	Log-linear latency histogram for the rate mode (-R), in
+ *	microseconds.  This has the same layout as the histogram in
+ *	the server's fr_stats_t.
+ */
+#define RC_HIST_SUB_BITS	(3)
+#define RC_HIST_SUB		(1 << RC_HIST_SUB_BITS)
+#define RC_HIST_MAX_BITS	(27)
+#define RC_HIST_BUCKETS		((RC_HIST_MAX_BITS - RC_HIST_SUB_BITS + 1) * RC_HIST_SUB)
+
+typedef struct rc_rate_stats {
+	uint64_t sent;			//!< Requests we sent.
+	uint64_t received;		//!< Replies which matched a request.
+	uint64_t accepted;		//!< Replies which were an accept, or an ACK.
+	uint64_t rejected;		//!< Replies which were a reject, or a NAK.
+	uint64_t lost;			//!< Requests to which we received no reply in time.
+	uint64_t no_id;			//!< Sends skipped because every Id was in use.
+	uint64_t invalid;		//!< Replies which were malformed, unexpected, or badly signed.
+	uint64_t lag_max;		//!< Longest a send was behind its schedule (usec).
+	uint64_t latency_min;		//!< Shortest reply time (usec).
+	uint64_t latency_max;		//!< Longest reply time (usec).
+	uint64_t latency_sum;		//!< Total of the reply times (usec).
+	uint64_t hist[RC_HIST_BUCKETS];	//!< Reply times.
+} rc_rate_stats_t;
+
 typedef struct rc_file_pair {
 	char const *packets;		//!< The file containing the request packet
 	char const *filters;		//!< The file containing the definition of the
@@ -100,6 +100,12 @@ typedef struct radclient {
 #endif
 
 	struct timeval		response_window;
+	struct timeval		deadline;	//!< Stop working on requests from this client after this long.
+
+	uint32_t		max_pps;	//!< Packets/s allowed from this client.  0 means no limit.
+	uint32_t		max_burst;	//!< Packets allowed in a burst above max_pps.
+	uint64_t		tokens;		//!< Tokens in the bucket, in packet-microseconds.
+	struct timeval		tokens_time;	//!< When the bucket was last refilled.
 
 	int			proto;
 #ifdef WITH_TCP
@@ -111,6 +117,7 @@ typedef struct radclient {
 
 #ifdef WITH_DYNAMIC_CLIENTS
 	uint32_t		lifetime;
+	uint32_t		negative_lifetime;	//!< How long to ignore sources which aren't clients.
 	uint32_t		dynamic; /* was dynamically defined */
 	time_t			created;
 	time_t			last_new_client;
@@ -140,6 +147,7 @@ typedef enum RAD_LISTEN_TYPE {
 	RAD_LISTEN_DHCP,
 	RAD_LISTEN_COMMAND,
 	RAD_LISTEN_COA,
+	RAD_LISTEN_METRICS,
 	RAD_LISTEN_MAX
 } RAD_LISTEN_TYPE;
 
@@ -207,19 +215,44 @@ typedef enum {
 } rad_child_state_t;
 #define REQUEST_CHILD_NUM_STATES (REQUEST_DONE + 1)
 
+#ifdef WITH_PROXY
+/** Proxy state for a request
+ *
+ * Most requests are never proxied, so this is kept out of the REQUEST,
+ * and is allocated the first time the request is proxied.
+ */
+typedef struct request_proxy {
+	struct timeval		proxy_retransmit;	//!< When the proxied packet was last sent.
+
+	uint32_t		num_proxied_requests;	//!< Including retransmits.
+	uint32_t		num_proxied_responses;
+
+	struct proxy_coalesce	*coalesce;	//!< Group of identical proxied requests this one is in.
+	REQUEST			*coalesce_next;	//!< Next request waiting for the same proxy reply.
+	bool			coalesced;	//!< Waiting for the reply to another request's proxied packet.
+
+#ifdef WITH_COA
+	uint32_t		num_coa_requests;//!< Counter for number of requests sent including
+						//!< retransmits.
+#endif
+} request_proxy_t;
+#endif
+
+/*
+ *	The fields used for every packet come first, so that the
+ *	server touches as few cache lines as possible per request.
+ *	The fields used only when proxying, originating CoA, or
+ *	debugging come after them.
+ */
 struct rad_request {
 #ifndef NDEBUG
 	uint32_t		magic; 		//!< Magic number used to detect memory corruption,
 						//!< or request structs that have not been properly initialised.
 #endif
+	unsigned int	       	number; 	//!< Monotonically increasing request number. Reset on server restart.
+
 	RADIUS_PACKET		*packet;	//!< Incoming request.
-#ifdef WITH_PROXY
-	RADIUS_PACKET		*proxy;		//!< Outgoing request.
-#endif
 	RADIUS_PACKET		*reply;		//!< Outgoing response.
-#ifdef WITH_PROXY
-	RADIUS_PACKET		*proxy_reply;	//!< Incoming response.
-#endif
 	VALUE_PAIR		*config_items;	//!< VALUE_PAIRs used to set per request parameters
 						//!< for modules and the server core at runtime.
 	VALUE_PAIR		*username;	//!< Cached username VALUE_PAIR.
@@ -230,60 +263,26 @@ struct rad_request {
 	RAD_REQUEST_FUNP	handle;		//!< The function to call to move the request through the
 						//!< various server configuration sections.
 
-	struct main_config_t	*root;		//!< Pointer to the main config hack to try and deal with hup.
-
-	request_data_t		*data;		//!< Request metadata.
-
 	RADCLIENT		*client;	//!< The client that originally sent us the request.
-
-#ifdef HAVE_PTHREAD_H
-	pthread_t    		child_pid;	//!< Current thread handling the request.
-#endif
-	time_t			timestamp;	//!< When the request was received.
-	unsigned int	       	number; 	//!< Monotonically increasing request number. Reset on server restart.
-
 	rad_listen_t		*listener;	//!< The listener that received the request.
-#ifdef WITH_PROXY
-	rad_listen_t		*proxy_listener;//!< Listener for outgoing requests.
-#endif
-
-	rlm_rcode_t		rcode;		//!< Last rcode returned by a module
-
-	int			simul_max;	//!< Maximum number of concurrent sessions for this user.
-#ifdef WITH_SESSION_MGMT
-	int			simul_count;	//!< The current number of sessions for this user.
-	int			simul_mpp; 	//!< WEIRD: 1 is false, 2 is true.
-#endif
-
-	char const		*module;	//!< Module the request is currently being processed by.
-	char const		*component; 	//!< Section the request is in.
-
-	int			delay;
 
 	rad_master_state_t	master_state;
 	rad_child_state_t	child_state;
 	RAD_LISTEN_TYPE		priority;
+	rlm_rcode_t		rcode;		//!< Last rcode returned by a module
 
-	int			response_delay;
-	int			timer_action;
+	time_t			timestamp;	//!< When the request was received.
+	struct timeval		queued;		//!< When the request was last added to the thread pool queue.
+	struct timeval		deadline;	//!< When the client stops waiting for a reply, or zero.
 	fr_event_t		*ev;
+	int			timer_action;
+	int			response_delay;
 
 	bool			in_request_hash;
 #ifdef WITH_PROXY
 	bool			in_proxy_hash;
-
-	home_server_t	       	*home_server;
-	home_pool_t		*home_pool;	//!< For dynamic failover
-
-	struct timeval		proxy_retransmit;
-
-	uint32_t		num_proxied_requests;
-	uint32_t		num_proxied_responses;
 #endif
 
-	char const		*server;
-	REQUEST			*parent;
-
 	struct {
 		radlog_func_t	func;		//!< Function to call to output log messages about this
 						//!< request.
@@ -293,13 +292,51 @@ struct rad_request {
 
 		uint8_t		indent;		//!< By how much to indent log messages. uin8_t so it's obvious
 						//!< when a request has been exdented too much.
+
+		log_capture_t	*capture;	//!< Debug messages held back until we know whether the
+						//!< request failed.  See log_capture_start().
 	} log;
 
+	request_data_t		*data;		//!< Request metadata.
+
+	char const		*server;
+	char const		*module;	//!< Module the request is currently being processed by.
+	char const		*component; 	//!< Section the request is in.
+
+#ifdef HAVE_PTHREAD_H
+	pthread_t    		child_pid;	//!< Current thread handling the request.
+#endif
+
+	/*
+	 *	Less frequently used fields.
+	 */
+	struct main_config_t	*root;		//!< Pointer to the main config hack to try and deal with hup.
+	REQUEST			*parent;
+
+	int			delay;
+
+	int			simul_max;	//!< Maximum number of concurrent sessions for this user.
+#ifdef WITH_SESSION_MGMT
+	int			simul_count;	//!< The current number of sessions for this user.
+	int			simul_mpp; 	//!< WEIRD: 1 is false, 2 is true.
+#endif
+
+#ifdef WITH_PROXY
+	RADIUS_PACKET		*proxy;		//!< Outgoing request.
+	RADIUS_PACKET		*proxy_reply;	//!< Incoming response.
+	rad_listen_t		*proxy_listener;//!< Listener for outgoing requests.
+	home_server_t	       	*home_server;
+	home_pool_t		*home_pool;	//!< For dynamic failover
+	int			proxy_shard;	//!< Which proxy list the request is in.
+
+	request_proxy_t		*proxy_info;	//!< Allocated when the request is first proxied.
+#endif
+
 #ifdef WITH_COA
 	REQUEST			*coa;		//!< CoA request originated by this request.
-	uint32_t		num_coa_requests;//!< Counter for number of requests sent including
-						//!< retransmits.
 #endif
+
+	struct fr_trace_t	*trace;		//!< Spans recorded for this request, if it's being traced.
 };				/* REQUEST typedef */
 
 #define RAD_REQUEST_OPTION_NONE		(0)
@@ -333,9 +370,16 @@ struct rad_listen_t {
 	bool		nodup;
 	bool		synchronous;
 	uint32_t	workers;
+	uint32_t	recv_batch;
+	uint32_t	recv_buffers;	//!< Size of the receive ring.
+	rad_ring_t	*ring;		//!< Receive buffers, shared by packets until they're decoded.
+	char const	*cpu_list;	//!< CPUs for the receive threads, e.g. "0-3".
+	int		cpu;		//!< CPU this listener's receive threads run on, or -1.
+	int		numa_node;	//!< NUMA node packets from this listener arrive on, or -1.
 
 #ifdef WITH_TLS
 	fr_tls_server_conf_t *tls;
+	uint32_t	tls_io_threads;	//!< Number of threads doing the TLS work, or 0 for the main thread.
 #endif
 
 	rad_listen_recv_t recv;
@@ -363,6 +407,7 @@ typedef struct listen_socket_t {
 	uint16_t	my_port;
 
 	char const	*interface;
+	uint32_t	num_sockets;	/* sharing the port via SO_REUSEPORT */
 #ifdef SO_BROADCAST
 	int		broadcast;
 #endif
@@ -381,6 +426,7 @@ typedef struct listen_socket_t {
 #ifdef WITH_TCP
 	/* for a proxy connecting to home servers */
 	time_t		last_packet;
+	time_t		last_keepalive;	//!< When we last sent Status-Server on the connection.
 	time_t		opened;
 	fr_event_t	*ev;
 
@@ -390,6 +436,8 @@ typedef struct listen_socket_t {
 	RADCLIENT	*client;
 
 	RADIUS_PACKET   *packet; /* for reading partial packets */
+	uint8_t		*buffer; /* data read, but not yet made into packets */
+	size_t		buffer_len;
 #endif
 
 #ifdef WITH_TLS
@@ -416,6 +464,8 @@ typedef struct main_config_t {
 	bool		log_auth;
 	bool		log_auth_badpass;
 	bool		log_auth_goodpass;
+	bool		log_async;		//!< Write log messages from a separate thread.
+	uint32_t	log_async_buffer;	//!< Size of each thread's log buffer.
 	bool		allow_core_dumps;
 	uint32_t	debug_level;
 	bool		daemonize;
@@ -431,8 +481,18 @@ typedef struct main_config_t {
 	uint32_t	max_request_time;
 	uint32_t	cleanup_delay;
 	uint32_t	max_requests;
+	uint32_t	num_workers;			//!< Server processes to fork.  1 means don't fork.
+	uint32_t	worker_id;			//!< Which of the worker processes this is, from 0.
+	bool		timer_wheel;
+	bool		coarse_clock;			//!< Use CLOCK_*_COARSE for the cached time.
+	bool		reorder_conditions;		//!< Evaluate cheap operands of && / || first.
+	bool		profile_conditions;		//!< Count how often conditions are true / false.
+	bool		profile_modules;		//!< Count module calls and their results.
+	uint32_t	profile_modules_sample;		//!< Time one module call in this many.
 	char const	*log_file;
 	char const	*dictionary_dir;
+	char const	*dictionary_cache;		//!< Compiled dictionaries, from -c.
+	char const	*config_snapshot;		//!< Pre-parsed configuration, from -S.
 	char const	*checkrad;
 	char const      *pid_file;
 	rad_listen_t	*listen;
@@ -446,6 +506,16 @@ typedef struct main_config_t {
 	char const	*panic_action;
 	char const	*denied_msg;
 	struct timeval	init_delay; /* initial request processing delay */
+
+	uint32_t	dns_cache_size;			//!< Hostnames to cache.  0 disables the cache.
+	uint32_t	dns_ttl;			//!< How long to cache addresses for.
+	uint32_t	dns_negative_ttl;		//!< How long to cache failed lookups for.
+	uint32_t	dns_prefetch;			//!< Refresh names this long before they expire.
+	uint32_t	dns_threads;			//!< Threads for background lookups.
+
+#ifdef WITH_DYNAMIC_CLIENTS
+	uint32_t	dynamic_client_threads;		//!< Threads for dynamic client lookups, 0 for inline.
+#endif
 } MAIN_CONFIG_T;
 
 #define SECONDS_PER_DAY		86400
@@ -495,7 +565,10 @@ typedef enum {
 	RADIUS_SIGNAL_SELF_EXIT		= (1 << 2),
 	RADIUS_SIGNAL_SELF_DETAIL	= (1 << 3),
 	RADIUS_SIGNAL_SELF_NEW_FD	= (1 << 4),
-	RADIUS_SIGNAL_SELF_MAX		= (1 << 5)
+	RADIUS_SIGNAL_SELF_TLS		= (1 << 5),
+	RADIUS_SIGNAL_SELF_PROXY	= (1 << 6),
+	RADIUS_SIGNAL_SELF_BFD		= (1 << 7),
+	RADIUS_SIGNAL_SELF_MAX		= (1 << 8)
 } radius_signal_t;
 /*
  *	Function prototypes.
@@ -528,9 +601,15 @@ int		rad_mkdir(char *directory, mode_t mode);
 void		*rad_malloc(size_t size); /* calls exit(1) on error! */
 void		rad_const_free(void const *ptr);
 char		*rad_ajoin(TALLOC_CTX *ctx, char const **array, char c);
+int		rad_cpu_list(TALLOC_CTX *ctx, int **out, char const *str);
+int		rad_cpu_node(int cpu);
 REQUEST		*request_alloc(TALLOC_CTX *ctx);
+REQUEST		*request_pool_alloc(void);
+void		request_pool_free(REQUEST *request);
 REQUEST		*request_alloc_fake(REQUEST *oldreq);
+REQUEST		*request_alloc_fake_ctx(TALLOC_CTX *ctx, REQUEST *oldreq);
 REQUEST		*request_alloc_coa(REQUEST *request);
+bool		request_expired(REQUEST *request);
 int		request_data_add(REQUEST *request,
 				 void *unique_ptr, int unique_int,
 				 void *opaque, bool free_opaque);
@@ -548,6 +627,7 @@ int		rad_expand_xlat(REQUEST *request, char const *cmd,
 #ifdef HAVE_REGEX
 void		rad_regcapture(REQUEST *request, int compare, char const *value,
 			       regmatch_t rxmatch[]);
+regex_t		*rad_regcomp(char const *pattern, int flags);
 #endif
 
 char const	*rad_default_log_dir(void);
@@ -560,14 +640,17 @@ char const	*rad_radacct_dir(void);
 void		verify_request(char const *file, int line, REQUEST *request);	/* only for special debug builds */
 #ifdef HAVE_GRP_H
 bool		fr_getgid(char const *name, gid_t *gid);
+bool		fr_getgid_any(char const *group, gid_t *gid);
 #endif
 
 /* client.c */
 RADCLIENT_LIST	*clients_init(CONF_SECTION *cs);
 void		clients_free(RADCLIENT_LIST *clients);
 RADCLIENT_LIST	*clients_parse_section(CONF_SECTION *section, bool tls_required);
+int		clients_hup(CONF_SECTION *config);
 void		client_free(RADCLIENT *client);
 int		client_add(RADCLIENT_LIST *clients, RADCLIENT *client);
+int		client_add_bulk(RADCLIENT_LIST *clients, RADCLIENT **array, int num, bool strict);
 #ifdef WITH_DYNAMIC_CLIENTS
 void		client_delete(RADCLIENT_LIST *clients, RADCLIENT *client);
 RADCLIENT	*client_afrom_request(RADCLIENT_LIST *clients, REQUEST *request);
@@ -585,12 +668,21 @@ RADCLIENT	*client_findbynumber(RADCLIENT_LIST const *clients,
 RADCLIENT	*client_find_old(fr_ipaddr_t const *ipaddr);
 bool		client_add_dynamic(RADCLIENT_LIST *clients, RADCLIENT *master, RADCLIENT *c);
 RADCLIENT	*client_read(char const *filename, int in_server, int flag);
+bool		client_rate_ok(RADCLIENT *client);
 
 
 /* files.c */
 int		pairlist_read(TALLOC_CTX *ctx, char const *file, PAIR_LIST **list, int complain);
 void		pairlist_free(PAIR_LIST **);
 
+typedef struct pairlist_index pairlist_index_t;
+typedef struct pairlist_cursor pairlist_cursor_t;
+
+pairlist_index_t *pairlist_index_alloc(TALLOC_CTX *ctx, PAIR_LIST *list);
+pairlist_cursor_t *pairlist_index_match(TALLOC_CTX *ctx, pairlist_index_t const *index, VALUE_PAIR *vps);
+int		pairlist_cursor_rematch(pairlist_cursor_t *cursor, VALUE_PAIR *vps);
+PAIR_LIST	*pairlist_cursor_next(pairlist_cursor_t *cursor);
+
 /* version.c */
 int		rad_check_lib_magic(uint64_t magic);
 int 		ssl_check_consistency(void);
@@ -604,6 +696,7 @@ char	*auth_name(char *buf, size_t buflen, REQUEST *request, bool do_cli);
 int		rad_authenticate (REQUEST *);
 int		rad_postauth(REQUEST *);
 int		rad_virtual_server(REQUEST *);
+int		rad_virtual_server_authenticate(REQUEST *);
 
 /* exec.c */
 pid_t radius_start_program(char const *cmd, REQUEST *request, bool exec_wait,
@@ -614,6 +707,12 @@ int radius_readfrom_program(int fd, pid_t pid, int timeout,
 int radius_exec_program(char *out, size_t outlen, VALUE_PAIR **output_pairs,
 			REQUEST *request, char const *cmd, VALUE_PAIR *input_pairs,
 			bool exec_wait, bool shell_escape, int timeout) CC_HINT(nonnull (4, 5));
+
+typedef struct fr_exec_helper fr_exec_helper_t;
+fr_exec_helper_t *radius_exec_helper_start(TALLOC_CTX *ctx, char const *cmd) CC_HINT(nonnull (2));
+bool radius_exec_helper_alive(fr_exec_helper_t *helper) CC_HINT(nonnull);
+int radius_exec_helper_call(fr_exec_helper_t *helper, REQUEST *request, VALUE_PAIR *input_pairs,
+			    char *out, size_t outlen, VALUE_PAIR **output_pairs, int timeout) CC_HINT(nonnull (1, 2));
 void exec_trigger(REQUEST *request, CONF_SECTION *cs, char const *name, int quench)
      CC_HINT(nonnull (3));
 
@@ -624,6 +723,8 @@ void		paircompare_unregister(DICT_ATTR const *attr, RAD_COMPARE_FUNC func);
 void		paircompare_unregister_instance(void *instance);
 int		paircompare(REQUEST *request, VALUE_PAIR *req_list,
 			    VALUE_PAIR *check, VALUE_PAIR **rep_list);
+int		paircompare_index(REQUEST *request, VALUE_PAIR *req_list, vp_index_t const *index,
+				  VALUE_PAIR *check, VALUE_PAIR **rep_list);
 value_pair_tmpl_t *radius_xlat2tmpl(TALLOC_CTX *ctx, xlat_exp_t *xlat);
 int		radius_xlat_do(REQUEST *request, VALUE_PAIR *vp);
 int radius_compare_vps(REQUEST *request, VALUE_PAIR *check, VALUE_PAIR *vp);
@@ -670,10 +771,25 @@ typedef ssize_t (*RAD_XLAT_FUNC)(void *instance, REQUEST *, char const *, char *
 int		xlat_register(char const *module, RAD_XLAT_FUNC func, RADIUS_ESCAPE_STRING escape,
 			      void *instance);
 void		xlat_unregister(char const *module, RAD_XLAT_FUNC func, void *instance);
+void		xlat_pure(char const *name);
+ssize_t		xlat_precompile(char const *fmt, char const **error);
+void		xlat_cache_publish(time_t keep);
 ssize_t		xlat_fmt_to_ref(uint8_t const **out, REQUEST *request, char const *fmt);
 void		xlat_free(void);
 
 /* threads.c */
+typedef struct thread_pool_stats_t {
+	uint32_t	total_threads;
+	uint32_t	active_threads;
+	uint32_t	max_threads;
+	uint32_t	num_queued;
+	uint32_t	target_queue_time;	//!< In milliseconds.  0 if the latency controller is off.
+	uint32_t	interval_queue_time;	//!< Mean queue time over the last interval, in microseconds.
+	uint32_t	avg_queue_time;		//!< Smoothed queue time, in microseconds.
+	uint32_t	controller_spawned;	//!< Threads spawned by the latency controller.
+	uint32_t	controller_deleted;	//!< Threads deleted by the latency controller.
+} thread_pool_stats_t;
+
 int	thread_pool_init(CONF_SECTION *cs, bool *spawn_flag);
 void	thread_pool_stop(void);
 int	thread_pool_addrequest(REQUEST *, RAD_REQUEST_FUNP);
@@ -683,6 +799,14 @@ int	total_active_threads(void);
 void	thread_pool_lock(void);
 void	thread_pool_unlock(void);
 void	thread_pool_queue_stats(int array[RAD_LISTEN_MAX], int pps[2]);
+bool	thread_pool_stats(thread_pool_stats_t *stats);
+int	thread_pool_wait_fd(int fd, struct timeval const *timeout);
+int	thread_pool_yield_fd(int fd, struct timeval const *timeout);
+void	thread_pool_yield_allow(bool allow);
+void	thread_pool_yield_block(bool block);
+#ifdef HAVE_PTHREAD_H
+int	rad_thread_cpu(pthread_t thread, int cpu);
+#endif
 
 #ifndef HAVE_PTHREAD_H
 #  define rad_fork(n) fork()
@@ -729,6 +853,25 @@ int radius_event_process(void);
 void radius_update_listener(rad_listen_t *listener);
 void revive_home_server(void *ctx);
 void mark_home_server_dead(home_server_t *home, struct timeval *when);
+void home_server_bfd_update(home_server_t *home, bool up);
+
+#if defined(WITH_COA) && defined(HAVE_PTHREAD_H)
+/* coa_bulk.c */
+typedef struct coa_bulk_stats_t {
+	char const	*filename;
+	time_t		started;
+	time_t		finished;	//!< 0 while the job is running.
+	uint32_t	total;
+	uint32_t	sent;
+	uint32_t	acks;
+	uint32_t	naks;
+	uint32_t	timeouts;
+	uint32_t	errors;
+} coa_bulk_stats_t;
+
+int coa_bulk_start(char const *filename, uint32_t window);
+int coa_bulk_stats(coa_bulk_stats_t *stats, int max);
+#endif
 
 /* evaluate.c */
 typedef struct fr_cond_t fr_cond_t;
@@ -749,6 +892,16 @@ int dual_tls_recv(rad_listen_t *listener);
 int dual_tls_send(rad_listen_t *listener, REQUEST *request);
 int proxy_tls_recv(rad_listen_t *listener);
 int proxy_tls_send(rad_listen_t *listener, REQUEST *request);
+
+/*
+ *	Largest number of TLS I/O threads.
+ */
+#define MAX_TLS_IO_THREADS (64)
+
+#ifdef HAVE_PTHREAD_H
+int tls_io_start(uint32_t num);
+void tls_io_process_done(void);
+#endif
 #endif
 
 /*
@@ -27,6 +27,10 @@ RCSIDH(radsniff_h, "$Id$")
 
 #include <sys/types.h>
 
+#ifdef HAVE_PTHREAD_H
+#  include <pthread.h>
+#endif
+
 #include <pcap/pcap.h>
 #include <freeradius-devel/libradius.h>
 #include <freeradius-devel/pcap.h>
@@ -43,6 +47,11 @@ RCSIDH(radsniff_h, "$Id$")
 #define RS_RETRANSMIT_MAX	5		//!< Maximum number of times we expect to see a packet retransmitted
 #define RS_MAX_ATTRS		50		//!< Maximum number of attributes we can filter on.
 #define RS_SOCKET_REOPEN_DELAY  5000		//!< How long we delay re-opening a collectd socket.
+#define RS_THREADS_MAX		64		//!< Maximum number of capture threads.
+#define RS_ANOMALY_RING		1000		//!< Default number of packets kept for anomaly captures.
+#define RS_LATENCY_BUCKETS	12		//!< Number of latency histogram buckets.
+#define RS_THREAD_PUBLISH	100		//!< How often (ms) capture threads hand their stats to the
+						//!< main thread.
 
 /*
  *	Logging macros
@@ -84,6 +93,7 @@ typedef enum {
 } stats_out_t;
 
 typedef struct rs rs_t;
+typedef struct rs_thread rs_thread_t;
 
 #ifdef HAVE_COLLECTDC_H
 typedef struct rs_stats_tmpl rs_stats_tmpl_t;
@@ -128,6 +138,10 @@ typedef struct rs_latency {
 
 		double			latency_high;		//!< Latency high water mark.
 		double			latency_low;		//!< Latency low water mark.
+
+		uint64_t		latency_hist_total[RS_LATENCY_BUCKETS];	//!< Linked packets by latency
+										//!< over interval.
+		double			latency_hist[RS_LATENCY_BUCKETS];	//!< Linked packets by latency.
 	} interval;
 } rs_latency_t;
 
@@ -165,6 +179,22 @@ typedef struct rs_capture {
 	uint8_t			*data;			//!< PCAP packet data.
 } rs_capture_t;
 
+/** Recently captured packets
+ *
+ * The packets are written out to the anomaly capture file when something
+ * unusual happens, so that the file shows what led up to it.
+ */
+typedef struct rs_ring {
+	struct pcap_pkthdr	*header;		//!< One PCAP header per slot.
+	uint8_t			*data;			//!< SNAPLEN bytes of packet data per slot.
+	uint32_t		size;			//!< Number of slots.
+	uint32_t		head;			//!< Next slot to write to.
+	uint32_t		used;			//!< Slots holding packets which haven't been written out.
+
+	time_t			reject_second;		//!< Second rejects is counting for.
+	uint32_t		rejects;		//!< Access-Rejects seen in reject_second.
+} rs_ring_t;
+
 /** Wrapper for RADIUS_PACKET
  *
  * Allows an event to be associated with a request packet.  This is required because we need to disarm
@@ -193,6 +223,8 @@ typedef struct rs_request {
 	rs_latency_t		*stats_req;		//!< Latency entry for the request type.
 	rs_latency_t		*stats_rsp;		//!< Latency entry for the request type.
 
+	rs_thread_t		*thread;		//!< Thread which owns the trees the request is in.
+
 	bool			silent_cleanup;		//!< Cleanup was forced before normal expiry period,
 							//!< ignore stats about packet loss.
 
@@ -212,6 +244,7 @@ typedef struct rs_event {
 	fr_pcap_t		*out;			//!< Where to write output.
 
 	rs_stats_t		*stats;			//!< Where to write stats.
+	rs_thread_t		*thread;		//!< Thread the handle is read by.
 } rs_event_t;
 
 /** FD data which gets passed to callbacks
@@ -222,8 +255,45 @@ typedef struct rs_update {
 
 	fr_pcap_t		*in;			//!< Linked list of PCAP handles to check for drops.
 	rs_stats_t		*stats;			//!< Stats to process.
+
+	rs_thread_t		**threads;		//!< Capture threads to collect stats from.
+	int			num_threads;		//!< Number of capture threads.
 } rs_update_t;
 
+/** Capture and correlation state
+ *
+ * Without -t there's a single instance of this, serviced by the main event loop.
+ *
+ * With -t each capture thread gets its own instance, and its own member of a PACKET_FANOUT
+ * group for each interface.  The kernel distributes packets between the members using a
+ * symmetric hash of the 5-tuple, so a request and its response are always seen by the same
+ * thread, and nothing on the packet path needs to be shared.
+ */
+struct rs_thread {
+	int			number;			//!< Thread number, used in debug messages.
+	fr_event_list_t		*list;			//!< Event list the capture handles are serviced by.
+	fr_pcap_t		*in;			//!< Capture handles read by this thread.
+
+	rbtree_t		*request_tree;		//!< Requests we're waiting for a response to.
+	rbtree_t		*link_tree;		//!< Requests indexed by the link attributes.
+
+	uint64_t		count;			//!< Packets seen.
+
+	rs_ring_t		*ring;			//!< Recent packets, for anomaly captures.
+
+	rs_stats_t		*stats;			//!< Stats updated by the packet path.
+
+#ifdef HAVE_PTHREAD_H
+	pthread_t		pthread_id;		//!< The capture thread.
+	bool			exit;			//!< Set by the main thread to stop the capture thread.
+	fr_event_t		*publish;		//!< Timer for handing stats to the main thread.
+
+	pthread_mutex_t		mutex;			//!< Protects published.
+	rs_stats_t		*published;		//!< Stats the thread has handed over, which haven't
+							//!< yet been merged by the main thread.
+#endif
+};
+
 
 struct rs {
 	bool			from_file;		//!< Were reading pcap data from files.
@@ -238,8 +308,8 @@ struct rs {
 	bool			from_auto;		//!< From list was auto-generated.
 	bool			promiscuous;		//!< Capture in promiscuous mode.
 	bool			print_packet;		//!< Print packet info, disabled with -W
-	bool			decode_attrs;		//!< Whether we should decode attributes in the request
-							//!< and response.
+	bool			decode_request;		//!< Whether we should decode attributes in requests.
+	bool			decode_response;	//!< Whether we should decode attributes in responses.
 	bool			verify_udp_checksum;	//!< Check UDP checksum in packets.
 
 	char const		*radius_secret;		//!< Secret to decode encrypted attributes.
@@ -266,8 +336,18 @@ struct rs {
 	rs_packet_logger_t	logger;			//!< Packet logger
 
 	int			buffer_pkts;		//!< Size of the ring buffer to setup for live capture.
+	int			threads;		//!< Number of capture threads (0 to capture in the
+							//!< main thread).
 	uint64_t		limit;			//!< Maximum number of packets to capture
 
+	struct {
+		char const		*file;			//!< Where to write the packets preceding anomalies.
+		fr_pcap_t		*out;			//!< Handle for the anomaly capture file.
+		int			size;			//!< Number of packets to keep.
+		int			latency;		//!< Latency (ms) at which a response is an anomaly.
+		int			rejects;		//!< Access-Rejects per second which are an anomaly.
+	} anomaly;
+
 	struct {
 		int			interval;		//!< Time between stats updates in seconds.
 		stats_out_t		out;			//!< Where to write stats.
@@ -282,6 +362,8 @@ struct rs {
 	} stats;
 };
 
+extern unsigned int const rs_latency_bounds[RS_LATENCY_BUCKETS - 1];
+
 #ifdef HAVE_COLLECTDC_H
 
 /** Callback for processing stats values.
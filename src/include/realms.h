@@ -38,12 +38,14 @@ typedef enum {
 } home_state_t;
 
 typedef struct fr_socket_limit_t {
+	uint32_t	min_connections;
 	uint32_t	max_connections;
 	uint32_t	num_connections;
 	uint32_t	max_requests;
 	uint32_t	num_requests;
 	uint32_t	lifetime;
 	uint32_t	idle_timeout;
+	uint32_t	keepalive;	//!< Send Status-Server on idle connections this often.  Home servers only.
 } fr_socket_limit_t;
 
 typedef struct home_server {
@@ -73,16 +75,27 @@ typedef struct home_server {
 	uint32_t	max_response_timeouts;
 	uint32_t	max_outstanding; /* don't overload it */
 	uint32_t	currently_outstanding;
+	uint32_t	latency;	//!< Moving average of the response time, in usec.
+	uint32_t	rttvar;		//!< Moving average of the deviation of the response time, in usec.
+	bool		adaptive_response_window;	//!< Derive the response window from the above.
+	struct timeval	min_response_window;	//!< Lower bound for the adaptive response window.
+	struct timeval	rto;		//!< Current adaptive response window.
+	char const	*coalesce_key;	//!< Requests which expand this to the same value share one proxied packet.
 
 	time_t		last_packet_sent;
 	time_t		last_packet_recv;
 	time_t		last_failed_open;
+	bool		open_socket;	//!< The main thread should open another socket in the background.
 	struct timeval	revive_time;
 	struct timeval	zombie_period_start;
 	uint32_t	zombie_period; /* unresponsive for T, mark it dead */
 
 	int		state;
 
+	bool		bfd;		//!< Liveness is taken from the BFD session to ipaddr.
+	bool		bfd_up;		//!< Last state reported by the BFD session.
+	bool		bfd_changed;	//!< The main thread should apply bfd_up.
+
 	int		ping_check;
 	char const	*ping_user_name;
 	char const	*ping_user_password;
@@ -93,6 +106,14 @@ typedef struct home_server {
 	uint32_t	num_received_pings;
 	uint32_t	ping_timeout;
 
+	struct timeval	ping_when;	//!< When the next status check is due.
+	int		ping_heap;	//!< Position in the status check schedule.
+	bool		ping_queued;	//!< In the status check schedule.
+	uint32_t	ping_slot;	//!< Where in ping_interval its checks are sent.
+	uint8_t		*ping_data;	//!< Encoded Status-Server, re-signed for every check.
+	size_t		ping_data_len;
+	ssize_t		ping_offset;	//!< Of the Message-Authenticator in ping_data.
+
 	uint32_t	revive_interval; /* if it doesn't support pings */
 	CONF_SECTION	*cs;
 #ifdef WITH_COA
@@ -121,7 +142,9 @@ typedef enum home_pool_type_t {
 	HOME_POOL_FAIL_OVER,
 	HOME_POOL_CLIENT_BALANCE,
 	HOME_POOL_CLIENT_PORT_BALANCE,
-	HOME_POOL_KEYED_BALANCE
+	HOME_POOL_KEYED_BALANCE,
+	HOME_POOL_LEAST_LATENCY,
+	HOME_POOL_CONSISTENT_HASH
 } home_pool_type_t;
 
 
@@ -167,16 +190,37 @@ void realm_pool_free(home_pool_t *pool);
 int realm_realm_add( REALM *r, CONF_SECTION *cs);
 
 void home_server_update_request(home_server_t *home, REQUEST *request);
+void home_server_latency(home_server_t *home, struct timeval const *sent, struct timeval const *received);
+void home_server_backoff(home_server_t *home);
 home_server_t *home_server_ldb(char const *realmname, home_pool_t *pool, REQUEST *request);
 home_server_t *home_server_find(fr_ipaddr_t *ipaddr, uint16_t port, int proto);
-#ifdef WITH_COA
 home_server_t *home_server_byname(char const *name, int type);
-#endif
+int home_server_walk(rb_walker_t callback, void *ctx);
 #ifdef WITH_STATS
 home_server_t *home_server_bynumber(int number);
 #endif
 home_pool_t *home_pool_byname(char const *name, int type);
 
+/*
+ *	cluster.c
+ */
+typedef enum {
+	CLUSTER_STATE_NONE = 0,		//!< Only the latency is being shared.
+	CLUSTER_STATE_ALIVE,
+	CLUSTER_STATE_ZOMBIE,
+	CLUSTER_STATE_DEAD
+} cluster_state_t;
+
+typedef void (*cluster_update_t)(home_server_t *home, int state, uint32_t latency);
+
+int cluster_init(CONF_SECTION *cs);
+int cluster_start(void);
+void cluster_free(void);
+uint32_t cluster_interval(void);
+void cluster_send(home_server_t const *home);
+void cluster_send_all(void);
+void cluster_recv(cluster_update_t update);
+
 #ifdef __cplusplus
 }
 #endif
@@ -36,6 +36,18 @@ typedef uint32_t fr_uint_t;
 #endif
 
 #ifdef WITH_STATS
+/*
+ *	Log-linear latency histogram, in microseconds.  Each power of
+ *	two is split into FR_STATS_HIST_SUB linear buckets, so every
+ *	bucket is within 1/FR_STATS_HIST_SUB of the times it counts.
+ *	Times of 2^FR_STATS_HIST_MAX_BITS usec (about 134s) or more go
+ *	into the last bucket.
+ */
+#define FR_STATS_HIST_SUB_BITS	(3)
+#define FR_STATS_HIST_SUB	(1 << FR_STATS_HIST_SUB_BITS)
+#define FR_STATS_HIST_MAX_BITS	(27)
+#define FR_STATS_HIST_BUCKETS	((FR_STATS_HIST_MAX_BITS - FR_STATS_HIST_SUB_BITS + 1) * FR_STATS_HIST_SUB)
+
 typedef struct fr_stats_t {
 	fr_uint_t	total_requests;
 	fr_uint_t	total_invalid_requests;
@@ -52,6 +64,7 @@ typedef struct fr_stats_t {
 	fr_uint_t	total_timeouts;
 	time_t		last_packet;
 	fr_uint_t	elapsed[8];
+	fr_uint_t	hist[FR_STATS_HIST_BUCKETS];
 } fr_stats_t;
 
 typedef struct fr_stats_ema_t {
@@ -81,10 +94,15 @@ extern fr_stats_t	proxy_dsc_stats;
 #endif
 
 void radius_stats_init(int flag);
+int radius_stats_shared_init(uint32_t num_workers);
+fr_stats_t const *radius_stats_total(fr_stats_t *total, fr_stats_t const *stats);
 void request_stats_final(REQUEST *request);
 void request_stats_reply(REQUEST *request);
 void radius_stats_ema(fr_stats_ema_t *ema,
 		      struct timeval *start, struct timeval *end);
+int radius_stats_hist_index(uint32_t usec);
+uint32_t radius_stats_hist_percentile(fr_uint_t const *hist, unsigned int permille);
+uint32_t radius_stats_percentile(fr_stats_t const *stats, unsigned int permille);
 
 #define FR_STATS_INC(_x, _y) radius_ ## _x ## _stats._y++;if (listener) listener->stats._y++;if (client) client->_x._y++;
 #define FR_STATS_TYPE_INC(_x) _x++
@@ -29,4 +29,6 @@ RCSIDH(tcp_h, "$Id$")
 int fr_tcp_client_socket(fr_ipaddr_t *src_ipaddr, fr_ipaddr_t *dst_ipaddr, uint16_t dst_port);
 int fr_tcp_read_packet(RADIUS_PACKET *packet, int flags);
 RADIUS_PACKET *fr_tcp_recv(int sockfd, int flags);
+ssize_t fr_tcp_read_buffer(int sockfd, uint8_t *buffer, size_t size);
+ssize_t fr_tcp_packet_from_buffer(RADIUS_PACKET *packet, uint8_t const *buffer, size_t len, int flags);
 #endif /* FR_TCP_H */
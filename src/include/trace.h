@@ -0,0 +1,47 @@
+#ifndef TRACE_H
+#define TRACE_H
+/*
+ *	trace.h	Sampled request tracing.
+ *
+ * Version:	$Id$
+ *
+ */
+
+RCSIDH(trace_h, "$Id$")
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum trace_span_type_t {
+	TRACE_SPAN_REQUEST = 0,		//!< The whole request, from receipt to reply.
+	TRACE_SPAN_MODULE,		//!< One call to a module.
+	TRACE_SPAN_XLAT,		//!< One string expansion.
+	TRACE_SPAN_PROXY,		//!< From sending a proxied packet to the reply.
+	TRACE_SPAN_CONNECTION		//!< A pool connection held by the request.
+} trace_span_type_t;
+
+typedef struct fr_trace_t fr_trace_t;
+
+int	trace_init(CONF_SECTION *config);
+int	trace_start(void);
+void	trace_free(void);
+
+void	trace_request_start(REQUEST *request);
+bool	trace_request_enable(REQUEST *request, bool enable);
+void	trace_request_done(REQUEST *request);
+void	trace_request_set(REQUEST *request);
+REQUEST	*trace_request_get(void);
+
+int	trace_span_start(REQUEST *request, trace_span_type_t type, char const *name);
+void	trace_span_end(REQUEST *request, int span, bool error);
+int	trace_span_add(REQUEST *request, trace_span_type_t type, char const *name,
+		       struct timeval const *start, struct timeval const *end, bool error);
+void	trace_span_attr(REQUEST *request, int span, char const *key, char const *fmt, ...)
+	CC_HINT(format (printf, 4, 5));
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TRACE_H */
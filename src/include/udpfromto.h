@@ -22,6 +22,8 @@ int recvfromto(int s, void *buf, size_t len, int flags,
 int sendfromto(int s, void *buf, size_t len, int flags,
 	       struct sockaddr *from, socklen_t fromlen,
 	       struct sockaddr *to, socklen_t tolen);
+void udpfromto_cmsg_dst(struct msghdr *msgh, struct sockaddr *to, socklen_t *tolen);
+int udpfromto_cmsg_src(struct msghdr *msgh, void *cbuf, size_t cbuf_len, struct sockaddr *from);
 #endif
 
 #ifdef __cplusplus
@@ -5,14 +5,18 @@
 #
 TARGET		:= libfreeradius-radius.a
 
-SOURCES		:= cbuff.c \
+SOURCES		:= atomic_queue.c \
+		   cbuff.c \
+		   clock.c \
 		   cursor.c \
 		   debug.c \
 		   dict.c \
+		   dns.c \
 		   filters.c \
 		   hash.c \
 		   hmacmd5.c \
 		   hmacsha1.c \
+		   intern.c \
 		   isaac.c \
 		   log.c \
 		   misc.c \
@@ -36,6 +40,7 @@ SOURCES		:= cbuff.c \
 		   event.c \
 		   getaddrinfo.c \
 		   heap.c \
+		   json.c \
 		   tcp.c \
 		   base64.c \
 		   version.c
@@ -0,0 +1,440 @@
+/*
+ * atomic_queue.c	Bounded, lock-free, multi-producer multi-consumer
+ *			queue of pointers.
+ *
+ * Version:	$Id$
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ *  Copyright 2016  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/libradius.h>
+
+/*
+ *	This is Dmitry Vyukov's bounded MPMC queue.  The queue is a
+ *	ring of slots, each of which has a sequence number.  A slot
+ *	whose sequence number is equal to the tail position is empty,
+ *	and can be written by the producer which claims that position.
+ *	A slot whose sequence number is one more than the head
+ *	position is full, and can be read by the consumer which claims
+ *	that position.
+ *
+ *	Producers and consumers claim positions with a CAS on the
+ *	tail and head counters.  The data itself is published by
+ *	storing the sequence number with release semantics, so a
+ *	slot is never read before it's written.
+ *
+ *	If the compiler doesn't have the __atomic builtins, we fall
+ *	back to a mutex around the same code.
+ */
+#ifdef __ATOMIC_ACQUIRE
+#  define AQ_LOAD(_x)		__atomic_load_n(&(_x), __ATOMIC_ACQUIRE)
+#  define AQ_LOAD_RELAXED(_x)	__atomic_load_n(&(_x), __ATOMIC_RELAXED)
+#  define AQ_STORE(_x, _v)	__atomic_store_n(&(_x), _v, __ATOMIC_RELEASE)
+#  define AQ_CAS(_x, _old, _new) __atomic_compare_exchange_n(&(_x), &(_old), _new, true, \
+							 __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+#  define AQ_LOCK(_aq)
+#  define AQ_UNLOCK(_aq)
+#else
+#  define AQ_LOAD(_x)		(_x)
+#  define AQ_LOAD_RELAXED(_x)	(_x)
+#  define AQ_STORE(_x, _v)	((_x) = (_v))
+#  define AQ_CAS(_x, _old, _new) (((_x) == (_old)) ? ((_x) = (_new), true) : ((_old) = (_x), false))
+#  ifdef HAVE_PTHREAD_H
+#    include <pthread.h>
+#    define AQ_LOCK(_aq)	pthread_mutex_lock(&(_aq)->mutex)
+#    define AQ_UNLOCK(_aq)	pthread_mutex_unlock(&(_aq)->mutex)
+#  else
+#    define AQ_LOCK(_aq)
+#    define AQ_UNLOCK(_aq)
+#  endif
+#endif
+
+/*
+ *	Keep the head and tail counters on their own cache lines, so
+ *	that producers and consumers don't fight over them.
+ */
+#define CACHE_LINE_SIZE (64)
+
+typedef struct fr_atomic_queue_slot_t {
+	size_t		seq;			//!< Position this slot is ready for.
+	void		*data;
+} fr_atomic_queue_slot_t;
+
+struct fr_atomic_queue_t {
+	size_t		head;			//!< Next position to pop.
+	char		pad_head[CACHE_LINE_SIZE - sizeof(size_t)];
+
+	size_t		tail;			//!< Next position to push.
+	char		pad_tail[CACHE_LINE_SIZE - sizeof(size_t)];
+
+	size_t		mask;			//!< Number of slots - 1.
+#if !defined(__ATOMIC_ACQUIRE) && defined(HAVE_PTHREAD_H)
+	pthread_mutex_t	mutex;
+#endif
+	fr_atomic_queue_slot_t *slots;
+};
+
+#if !defined(__ATOMIC_ACQUIRE) && defined(HAVE_PTHREAD_H)
+static int _atomic_queue_free(fr_atomic_queue_t *aq)
+{
+	pthread_mutex_destroy(&aq->mutex);
+	return 0;
+}
+#endif
+
+/** Create a bounded MPMC queue
+ *
+ * @param ctx to allocate the queue in.
+ * @param max number of entries.  Rounded up to a power of 2.
+ * @return the new queue, or NULL on error.
+ */
+fr_atomic_queue_t *fr_atomic_queue_create(TALLOC_CTX *ctx, int max)
+{
+	size_t i, size;
+	fr_atomic_queue_t *aq;
+
+	if ((max < 2) || (max > (1024 * 1024))) {
+		fr_strerror_printf("Invalid queue size %d", max);
+		return NULL;
+	}
+
+	size = 2;
+	while (size < (size_t) max) size <<= 1;
+
+	aq = talloc_zero(ctx, fr_atomic_queue_t);
+	if (!aq) {
+	oom:
+		fr_strerror_printf("Out of memory");
+		return NULL;
+	}
+
+	aq->slots = talloc_array(aq, fr_atomic_queue_slot_t, size);
+	if (!aq->slots) {
+		talloc_free(aq);
+		goto oom;
+	}
+
+	for (i = 0; i < size; i++) {
+		aq->slots[i].seq = i;
+		aq->slots[i].data = NULL;
+	}
+	aq->mask = size - 1;
+
+#if !defined(__ATOMIC_ACQUIRE) && defined(HAVE_PTHREAD_H)
+	pthread_mutex_init(&aq->mutex, NULL);
+	talloc_set_destructor(aq, _atomic_queue_free);
+#endif
+
+	return aq;
+}
+
+/** Push up to num entries onto the queue
+ *
+ * The entries are added in order, and are contiguous in the queue.
+ * Entries pushed by other threads may come before or after them,
+ * but not in between.
+ *
+ * @param aq to push onto.
+ * @param data array of pointers to push.  None may be NULL.
+ * @param num number of entries in data.
+ * @return the number of entries pushed, which is less than num if the
+ *	queue is full.
+ */
+int fr_atomic_queue_push_batch(fr_atomic_queue_t *aq, void * const *data, int num)
+{
+	size_t pos;
+	int i, count;
+	fr_atomic_queue_slot_t *slot;
+
+	if (!aq || !data || (num <= 0)) return 0;
+
+	AQ_LOCK(aq);
+	pos = AQ_LOAD_RELAXED(aq->tail);
+	for (;;) {
+		intptr_t diff = 0;
+
+		/*
+		 *	Count how many slots from "pos" are free.
+		 */
+		for (count = 0; count < num; count++) {
+			slot = &aq->slots[(pos + count) & aq->mask];
+			diff = (intptr_t) AQ_LOAD(slot->seq) - (intptr_t) (pos + count);
+			if (diff != 0) break;
+		}
+
+		if (count > 0) {
+			if (AQ_CAS(aq->tail, pos, pos + count)) break;
+			continue;
+		}
+
+		/*
+		 *	The slot still holds an entry from the
+		 *	previous time around.  The queue is full.
+		 */
+		if (diff < 0) {
+			AQ_UNLOCK(aq);
+			return 0;
+		}
+
+		/*
+		 *	Another producer has claimed "pos".
+		 */
+		pos = AQ_LOAD_RELAXED(aq->tail);
+	}
+
+	/*
+	 *	We own positions pos...pos + count - 1.
+	 */
+	for (i = 0; i < count; i++) {
+		slot = &aq->slots[(pos + i) & aq->mask];
+		slot->data = data[i];
+		AQ_STORE(slot->seq, pos + i + 1);
+	}
+	AQ_UNLOCK(aq);
+
+	return count;
+}
+
+/** Pop up to num entries from the queue
+ *
+ * @param aq to pop from.
+ * @param data array where the entries are written.
+ * @param num size of the data array.
+ * @return the number of entries popped, 0 if the queue is empty.
+ */
+int fr_atomic_queue_pop_batch(fr_atomic_queue_t *aq, void **data, int num)
+{
+	size_t pos;
+	int i, count;
+	fr_atomic_queue_slot_t *slot;
+
+	if (!aq || !data || (num <= 0)) return 0;
+
+	AQ_LOCK(aq);
+	pos = AQ_LOAD_RELAXED(aq->head);
+	for (;;) {
+		intptr_t diff = 0;
+
+		/*
+		 *	Count how many slots from "pos" are full.
+		 */
+		for (count = 0; count < num; count++) {
+			slot = &aq->slots[(pos + count) & aq->mask];
+			diff = (intptr_t) AQ_LOAD(slot->seq) - (intptr_t) (pos + count + 1);
+			if (diff != 0) break;
+		}
+
+		if (count > 0) {
+			if (AQ_CAS(aq->head, pos, pos + count)) break;
+			continue;
+		}
+
+		/*
+		 *	Nothing has been written to the slot.  The
+		 *	queue is empty.
+		 */
+		if (diff < 0) {
+			AQ_UNLOCK(aq);
+			return 0;
+		}
+
+		/*
+		 *	Another consumer has claimed "pos".
+		 */
+		pos = AQ_LOAD_RELAXED(aq->head);
+	}
+
+	/*
+	 *	Hand the slots back to the producers, one lap further on.
+	 */
+	for (i = 0; i < count; i++) {
+		slot = &aq->slots[(pos + i) & aq->mask];
+		data[i] = slot->data;
+		slot->data = NULL;
+		AQ_STORE(slot->seq, pos + i + aq->mask + 1);
+	}
+	AQ_UNLOCK(aq);
+
+	return count;
+}
+
+/** Push one entry onto the queue
+ *
+ * @param aq to push onto.
+ * @param data to push.  Must not be NULL.
+ * @return 1 on success, 0 if the queue is full.
+ */
+int fr_atomic_queue_push(fr_atomic_queue_t *aq, void *data)
+{
+	if (!data) return 0;
+
+	return fr_atomic_queue_push_batch(aq, &data, 1);
+}
+
+/** Pop one entry from the queue
+ *
+ * @param aq to pop from.
+ * @return the entry, or NULL if the queue is empty.
+ */
+void *fr_atomic_queue_pop(fr_atomic_queue_t *aq)
+{
+	void *data;
+
+	if (fr_atomic_queue_pop_batch(aq, &data, 1) != 1) return NULL;
+
+	return data;
+}
+
+/** Return the number of entries in the queue
+ *
+ * This is only a snapshot.  Other threads may push or pop entries
+ * while it's being read.
+ */
+int fr_atomic_queue_num_elements(fr_atomic_queue_t *aq)
+{
+	size_t head, tail;
+
+	if (!aq) return 0;
+
+	head = AQ_LOAD_RELAXED(aq->head);
+	tail = AQ_LOAD_RELAXED(aq->tail);
+
+	/*
+	 *	Popped entries may have been claimed after we read
+	 *	"tail".
+	 */
+	if ((intptr_t) (tail - head) <= 0) return 0;
+
+	return tail - head;
+}
+
+/** Return the number of slots in the queue
+ *
+ */
+int fr_atomic_queue_size(fr_atomic_queue_t *aq)
+{
+	if (!aq) return 0;
+
+	return aq->mask + 1;
+}
+
+#ifdef TESTING
+
+/*
+ *  cc -DTESTING -I .. atomic_queue.c -o atomic_queue -ltalloc -lpthread
+ *
+ *  ./atomic_queue
+ */
+#include <pthread.h>
+#include <sched.h>
+
+#define PRODUCERS	(4)
+#define CONSUMERS	(4)
+#define PER_PRODUCER	(1000000)
+
+static fr_atomic_queue_t *aq;
+static uintptr_t sums[CONSUMERS];
+static int counts[CONSUMERS];
+
+static void *producer(void *arg)
+{
+	uintptr_t i, base = (uintptr_t) arg * PER_PRODUCER;
+	void *batch[8];
+
+	for (i = 1; i <= PER_PRODUCER; ) {
+		int j, num, done;
+
+		num = (i % 3) ? 1 : 8;
+		if ((i + num) > (PER_PRODUCER + 1)) num = PER_PRODUCER + 1 - i;
+
+		for (j = 0; j < num; j++) batch[j] = (void *) (base + i + j);
+
+		for (done = 0; done < num; ) {
+			int pushed;
+
+			pushed = fr_atomic_queue_push_batch(aq, batch + done, num - done);
+			if (!pushed) sched_yield();
+			done += pushed;
+		}
+		i += num;
+	}
+
+	return NULL;
+}
+
+static void *consumer(void *arg)
+{
+	intptr_t id = (intptr_t) arg;
+	void *batch[8];
+
+	for (;;) {
+		int j, num;
+
+		num = fr_atomic_queue_pop_batch(aq, batch, (counts[id] & 1) ? 8 : 1);
+		if (!num) sched_yield();
+
+		for (j = 0; j < num; j++) {
+			if ((uintptr_t) batch[j] == UINTPTR_MAX) return NULL;
+			sums[id] += (uintptr_t) batch[j];
+			counts[id]++;
+		}
+	}
+}
+
+int main(int argc, char **argv)
+{
+	intptr_t i;
+	int total = 0;
+	uintptr_t sum = 0, expected = 0;
+	pthread_t p[PRODUCERS], c[CONSUMERS];
+
+	aq = fr_atomic_queue_create(NULL, 1000);
+	if (!aq) fr_exit(1);
+
+	for (i = 0; i < CONSUMERS; i++) pthread_create(&c[i], NULL, consumer, (void *) i);
+	for (i = 0; i < PRODUCERS; i++) pthread_create(&p[i], NULL, producer, (void *) i);
+	for (i = 0; i < PRODUCERS; i++) pthread_join(p[i], NULL);
+
+	for (i = 0; i < CONSUMERS; i++) {
+		while (!fr_atomic_queue_push(aq, (void *) UINTPTR_MAX)) sched_yield();
+	}
+	for (i = 0; i < CONSUMERS; i++) pthread_join(c[i], NULL);
+
+	for (i = 0; i < CONSUMERS; i++) {
+		sum += sums[i];
+		total += counts[i];
+	}
+
+	for (i = 0; i < PRODUCERS; i++) {
+		uintptr_t j;
+
+		for (j = 1; j <= PER_PRODUCER; j++) expected += (i * PER_PRODUCER) + j;
+	}
+
+	if ((total != (PRODUCERS * PER_PRODUCER)) || (sum != expected)) {
+		fprintf(stderr, "got %d entries sum %lu, expected %d sum %lu\n",
+			total, (unsigned long) sum, PRODUCERS * PER_PRODUCER, (unsigned long) expected);
+		fr_exit(1);
+	}
+
+	talloc_free(aq);
+
+	fr_exit(0);
+}
+#endif
@@ -0,0 +1,175 @@
+/*
+ * clock.c	Cached time of day, refreshed once per event loop
+ *		iteration, or once per request.
+ *
+ * Version:	$Id$
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ *  Copyright 2016  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/libradius.h>
+
+#include <time.h>
+
+#define USEC (1000000)
+
+/*
+ *	Each thread has its own copy of "now".  The thread which runs
+ *	the event loop refreshes it once per loop iteration, and the
+ *	worker threads refresh it when they pick up a request.  Code
+ *	running in that thread then reads the cached copy, instead of
+ *	calling gettimeofday() or time() again.
+ *
+ *	A thread which has never called fr_clock_update() reads the
+ *	system clock directly, so it always gets a sane answer.
+ */
+typedef struct fr_clock_cache_t {
+	struct timeval	real;		//!< Wall clock time.
+	uint64_t	mono;		//!< Monotonic time, in microseconds.
+} fr_clock_cache_t;
+
+fr_thread_local_setup(fr_clock_cache_t *, fr_clock_cache)	/* macro */
+
+/*
+ *	Use the CLOCK_*_COARSE clocks where available.  They're
+ *	read from the vDSO without touching the hardware clock, but
+ *	only have the resolution of the kernel tick.
+ */
+static bool clock_coarse = false;
+
+void fr_clock_coarse(bool coarse)
+{
+	clock_coarse = coarse;
+}
+
+static void _fr_clock_cache_free(void *arg)
+{
+	free(arg);
+}
+
+static void clock_read(struct timeval *real, uint64_t *mono)
+{
+#ifdef CLOCK_MONOTONIC
+	struct timespec ts;
+	clockid_t id;
+
+	id = CLOCK_REALTIME;
+#  ifdef CLOCK_REALTIME_COARSE
+	if (clock_coarse) id = CLOCK_REALTIME_COARSE;
+#  endif
+	if (clock_gettime(id, &ts) == 0) {
+		real->tv_sec = ts.tv_sec;
+		real->tv_usec = ts.tv_nsec / 1000;
+	} else {
+		gettimeofday(real, NULL);
+	}
+
+	if (!mono) return;
+
+	id = CLOCK_MONOTONIC;
+#  ifdef CLOCK_MONOTONIC_COARSE
+	if (clock_coarse) id = CLOCK_MONOTONIC_COARSE;
+#  endif
+	if (clock_gettime(id, &ts) == 0) {
+		*mono = ((uint64_t) ts.tv_sec * USEC) + (ts.tv_nsec / 1000);
+		return;
+	}
+#else
+	gettimeofday(real, NULL);
+	if (!mono) return;
+#endif
+
+	/*
+	 *	No monotonic clock.  The wall clock is the best we
+	 *	can do.
+	 */
+	*mono = ((uint64_t) real->tv_sec * USEC) + real->tv_usec;
+}
+
+static fr_clock_cache_t *clock_cache(void)
+{
+	return fr_thread_local_init(fr_clock_cache, _fr_clock_cache_free);
+}
+
+/** Refresh this thread's copy of the current time
+ *
+ */
+void fr_clock_update(void)
+{
+	fr_clock_cache_t *cache;
+
+	cache = clock_cache();
+	if (!cache) {
+		cache = malloc(sizeof(*cache));
+		if (!cache) return;
+
+		if (fr_thread_local_set(fr_clock_cache, cache) != 0) {
+			free(cache);
+			return;
+		}
+	}
+
+	clock_read(&cache->real, &cache->mono);
+}
+
+/** Get the wall clock time as of the last fr_clock_update() in this thread
+ *
+ */
+void fr_clock_gettime(struct timeval *tv)
+{
+	fr_clock_cache_t *cache;
+
+	cache = clock_cache();
+	if (!cache) {
+		clock_read(tv, NULL);
+		return;
+	}
+
+	*tv = cache->real;
+}
+
+/** Same as time(NULL), but from the cached time
+ *
+ */
+time_t fr_clock_time(void)
+{
+	struct timeval tv;
+
+	fr_clock_gettime(&tv);
+
+	return tv.tv_sec;
+}
+
+/** Get the monotonic time in microseconds, as of the last fr_clock_update()
+ *
+ * Only differences between two values mean anything.
+ */
+uint64_t fr_clock_monotonic(void)
+{
+	fr_clock_cache_t *cache;
+	struct timeval tv;
+	uint64_t mono;
+
+	cache = clock_cache();
+	if (cache) return cache->mono;
+
+	clock_read(&tv, &mono);
+
+	return mono;
+}
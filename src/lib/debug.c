@@ -971,8 +971,14 @@ inline void fr_verify_vp(char const *file, int line, VALUE_PAIR const *vp)
 			fr_exit_now(1);
 		}
 
+		/*
+		 *	Values shared by paircopy_shared() are
+		 *	parented by one of the VPs using them, and
+		 *	interned values by their table entry.
+		 */
 		parent = talloc_parent(vp->data.ptr);
-		if (parent != vp) {
+		if ((parent != vp) && !talloc_reference_count(vp->data.ptr) &&
+		    !fr_intern_is(vp->data.ptr)) {
 			FR_FAULT_LOG("CONSISTENCY CHECK FAILED %s[%u]: VALUE_PAIR \"%s\" char buffer is not "
 				     "parented by VALUE_PAIR %p, instead parented by %p (%s)\n",
 				     file, line, vp->da->name,
@@ -1009,8 +1015,14 @@ inline void fr_verify_vp(char const *file, int line, VALUE_PAIR const *vp)
 			fr_exit_now(1);
 		}
 
+		/*
+		 *	Values shared by paircopy_shared() are
+		 *	parented by one of the VPs using them, and
+		 *	interned values by their table entry.
+		 */
 		parent = talloc_parent(vp->data.ptr);
-		if (parent != vp) {
+		if ((parent != vp) && !talloc_reference_count(vp->data.ptr) &&
+		    !fr_intern_is(vp->data.ptr)) {
 			FR_FAULT_LOG("CONSISTENCY CHECK FAILED %s[%u]: VALUE_PAIR \"%s\" uint8_t buffer is not "
 				     "parented by VALUE_PAIR %p, instead parented by %p (%s)\n",
 				     file, line, vp->da->name,
@@ -28,6 +28,7 @@ RCSID("$Id$")
 #endif
 
 #include	<ctype.h>
+#include	<fcntl.h>
 
 #ifdef HAVE_MALLOC_H
 #include	<malloc.h>
@@ -50,6 +51,17 @@ static fr_hash_table_t *values_byname = NULL;
 
 static DICT_ATTR *dict_base_attrs[256];
 
+/*
+ *	Flat, open-addressed table of attributes by (vendor, attr).
+ *	Built once the dictionaries have been loaded, so that the
+ *	decoders can find vendor and TLV attributes with a single
+ *	array probe instead of walking the hash table chains.
+ *	It's kept at most half full, so probes are short.
+ */
+static DICT_ATTR const **attributes_flat = NULL;
+static uint32_t attributes_flat_mask = 0;
+static uint32_t attributes_flat_used = 0;
+
 /*
  *	For faster HUP's, we cache the stat information for
  *	files we've $INCLUDEd
@@ -74,6 +86,42 @@ typedef struct value_fixup_t {
  */
 static value_fixup_t *value_fixup = NULL;
 
+/*
+ *	Compiled dictionary cache.  While the text dictionaries are
+ *	parsed, every successful VENDOR, ATTRIBUTE, VALUE and
+ *	VALUE-ALIAS is recorded in its resolved form, along with the
+ *	stat information of each file read.  On the next start, if
+ *	none of the files have changed, the records are replayed
+ *	straight into the tables, skipping the tokenizing and parsing.
+ *
+ *	The format is native-endian and specific to the build which
+ *	wrote it.  Anything unexpected means we parse the text.
+ */
+#define DICT_CACHE_MAGIC	(0xfdc1c0de)
+#define DICT_CACHE_VERSION	(2)
+
+typedef enum dict_cache_op_t {
+	DICT_CACHE_FILE = 1,
+	DICT_CACHE_VENDOR,
+	DICT_CACHE_ATTR,
+	DICT_CACHE_VALUE,
+	DICT_CACHE_VALUE_ALIAS
+} dict_cache_op_t;
+
+typedef struct dict_cache_hdr_t {
+	uint32_t	magic;
+	uint32_t	version;
+	uint32_t	flags_size;		//!< sizeof(ATTR_FLAGS) of the writer.
+	uint32_t	length;			//!< Of the records following the header.
+	uint32_t	hash;			//!< fr_hash() of the records.
+} dict_cache_hdr_t;
+
+static char const *dict_cache = NULL;		//!< File to load the cache from, and save it to.
+static bool dict_cache_skip = false;		//!< Don't load the cache, but do write a new one.
+static uint8_t *dict_cache_buf = NULL;		//!< Records for the dictionaries being parsed.
+static size_t dict_cache_len = 0;
+static size_t dict_cache_size = 0;
+
 const FR_NAME_NUMBER dict_attr_types[] = {
 	{ "integer",	PW_TYPE_INTEGER },
 	{ "string",	PW_TYPE_STRING },
@@ -326,6 +374,67 @@ static int dict_value_value_cmp(void const *one, void const *two)
 }
 
 
+/*
+ *	Append data to the cache records.  If we run out of memory,
+ *	we just stop recording, and no cache is written.
+ */
+static void dict_cache_put(void const *data, size_t len)
+{
+	if (!dict_cache_buf) return;
+
+	if ((dict_cache_len + len) > dict_cache_size) {
+		uint8_t *buf;
+		size_t size = dict_cache_size * 2;
+
+		while (size < (dict_cache_len + len)) size *= 2;
+
+		buf = realloc(dict_cache_buf, size);
+		if (!buf) {
+			free(dict_cache_buf);
+			dict_cache_buf = NULL;
+			return;
+		}
+		dict_cache_buf = buf;
+		dict_cache_size = size;
+	}
+
+	memcpy(dict_cache_buf + dict_cache_len, data, len);
+	dict_cache_len += len;
+}
+
+static void dict_cache_put_op(dict_cache_op_t op)
+{
+	uint8_t byte = op;
+
+	dict_cache_put(&byte, sizeof(byte));
+}
+
+static void dict_cache_put_string(char const *str)
+{
+	uint16_t len = strlen(str);
+
+	dict_cache_put(&len, sizeof(len));
+	dict_cache_put(str, len);
+}
+
+static void dict_cache_put_file(char const *fn, struct stat const *stat_buf)
+{
+	uint64_t num;
+
+	if (!dict_cache_buf) return;
+
+	dict_cache_put_op(DICT_CACHE_FILE);
+	dict_cache_put_string(fn);
+	num = stat_buf->st_dev;
+	dict_cache_put(&num, sizeof(num));
+	num = stat_buf->st_ino;
+	dict_cache_put(&num, sizeof(num));
+	num = stat_buf->st_mtime;
+	dict_cache_put(&num, sizeof(num));
+	num = stat_buf->st_size;
+	dict_cache_put(&num, sizeof(num));
+}
+
 /*
  *	Free the list of stat buffers
  */
@@ -429,6 +538,7 @@ typedef struct fr_pool_t {
 #define FR_ALLOC_ALIGN (8)
 
 static fr_pool_t *dict_pool = NULL;
+static TALLOC_CTX *dict_intern_ctx = NULL;	//!< Tables of interned values.
 
 static fr_pool_t *fr_pool_create(void)
 {
@@ -497,9 +607,96 @@ static void fr_pool_free(UNUSED void *ptr)
 	 */
 }
 
+static inline uint32_t dict_flat_hash(unsigned int attr, unsigned int vendor)
+{
+	uint32_t hash;
+
+	hash = (attr * 0x9e3779b1) ^ (vendor * 0x85ebca6b);
+	return hash ^ (hash >> 16);
+}
+
+/*
+ *	Add (or replace) an attribute in the flat table.  The table
+ *	must have room for it.
+ */
+static void dict_flat_insert(DICT_ATTR const *da)
+{
+	uint32_t i;
+
+	for (i = dict_flat_hash(da->attr, da->vendor) & attributes_flat_mask;
+	     attributes_flat[i] != NULL;
+	     i = (i + 1) & attributes_flat_mask) {
+		if ((attributes_flat[i]->attr == da->attr) &&
+		    (attributes_flat[i]->vendor == da->vendor)) {
+			attributes_flat[i] = da;
+			return;
+		}
+	}
+
+	attributes_flat[i] = da;
+	attributes_flat_used++;
+}
+
+static int dict_flat_insert_cb(UNUSED void *ctx, void *data)
+{
+	dict_flat_insert(data);
+	return 0;
+}
+
+/*
+ *	(Re)build the flat table from the byvalue hash, sized so
+ *	that it's no more than half full.
+ */
+static int dict_flat_build(void)
+{
+	uint32_t size;
+	DICT_ATTR const **table;
+
+	size = 256;
+	while (size < (uint32_t) (fr_hash_table_num_elements(attributes_byvalue) * 2)) size <<= 1;
+
+	table = calloc(size, sizeof(*table));
+	if (!table) {
+		fr_strerror_printf("Out of memory");
+		return -1;
+	}
+
+	free(attributes_flat);
+	attributes_flat = table;
+	attributes_flat_mask = size - 1;
+	attributes_flat_used = 0;
+
+	fr_hash_table_walk(attributes_byvalue, dict_flat_insert_cb, NULL);
+
+	return 0;
+}
+
 /*
  *	Free the dictionary_attributes and dictionary_values lists.
  */
+/** Return how much memory the dictionaries use
+ *
+ * Vendors, attributes and values are all allocated from the
+ * dictionary pool, so its size covers them.  The hash tables which
+ * index them aren't counted.
+ *
+ * @param[out] num of attributes and values.
+ * @return the size of the dictionary pool, in bytes.
+ */
+size_t dict_memory(uint32_t *num)
+{
+	size_t size = 0;
+	fr_pool_t *fp;
+
+	for (fp = dict_pool; fp != NULL; fp = fp->page_next) size += FR_POOL_SIZE;
+
+	*num = 0;
+	if (attributes_byname) *num += fr_hash_table_num_elements(attributes_byname);
+	if (values_byname) *num += fr_hash_table_num_elements(values_byname);
+
+	return size;
+}
+
 void dict_free(void)
 {
 	/*
@@ -524,7 +721,12 @@ void dict_free(void)
 
 	memset(dict_base_attrs, 0, sizeof(dict_base_attrs));
 
+	free(attributes_flat);
+	attributes_flat = NULL;
+	attributes_flat_mask = attributes_flat_used = 0;
+
 	fr_pool_delete(&dict_pool);
+	TALLOC_FREE(dict_intern_ctx);
 
 	dict_stat_free();
 }
@@ -638,6 +840,115 @@ int dict_valid_name(char const *name)
 /*
  *	Add an attribute to the dictionary.
  */
+/*
+ *	Work out the header for attributes which don't need the
+ *	full encoder.  This has to match what rad_vp2rfc() and
+ *	vp2attr_vsa() produce.
+ */
+static void dict_attr_encode(DICT_ATTR *da, DICT_VENDOR const *dv)
+{
+	ATTR_ENCODE	*enc = &da->encode;
+	uint8_t		*p;
+	size_t		type_len = 1, len_len = 1;
+	uint32_t	lvalue;
+
+	memset(enc, 0, sizeof(*enc));
+
+	if (da->flags.is_unknown || da->flags.is_tlv || da->flags.has_tlv || da->flags.has_tag ||
+	    da->flags.extended || da->flags.long_extended || da->flags.evs || da->flags.wimax ||
+	    da->flags.concat || (da->flags.encrypt != FLAG_ENCRYPT_NONE)) return;
+
+	switch (da->type) {
+	case PW_TYPE_STRING:
+	case PW_TYPE_OCTETS:
+	case PW_TYPE_IFID:
+	case PW_TYPE_IPV4_ADDR:
+	case PW_TYPE_IPV6_ADDR:
+	case PW_TYPE_IPV6_PREFIX:
+	case PW_TYPE_IPV4_PREFIX:
+	case PW_TYPE_ABINARY:
+	case PW_TYPE_ETHERNET:
+	case PW_TYPE_BYTE:
+	case PW_TYPE_SHORT:
+	case PW_TYPE_INTEGER:
+	case PW_TYPE_INTEGER64:
+	case PW_TYPE_DATE:
+	case PW_TYPE_SIGNED:
+		break;
+
+	default:
+		return;
+	}
+
+	if (!da->vendor) {
+		if ((da->attr == 0) || (da->attr > 255) ||
+		    (da->attr == PW_MESSAGE_AUTHENTICATOR)) return;
+
+		enc->hdr[0] = da->attr;
+		enc->hdr[1] = 2;
+		enc->hdr_len = 2;
+		return;
+	}
+
+	if (da->vendor >= FR_MAX_VENDOR) return;
+
+	/*
+	 *	Vendors without a format use the RFC format.
+	 */
+	if (dv) {
+		type_len = dv->type;
+		len_len = dv->length;
+	}
+
+	p = enc->hdr;
+	p[0] = PW_VENDOR_SPECIFIC;
+	lvalue = htonl(da->vendor);
+	memcpy(p + 2, &lvalue, 4);
+	p += 6;
+
+	switch (type_len) {
+	case 4:
+		p[0] = 0;
+		p[1] = (da->attr >> 16) & 0xff;
+		p[2] = (da->attr >> 8) & 0xff;
+		p[3] = da->attr & 0xff;
+		break;
+
+	case 2:
+		p[0] = (da->attr >> 8) & 0xff;
+		p[1] = da->attr & 0xff;
+		break;
+
+	case 1:
+		p[0] = da->attr & 0xff;
+		break;
+
+	default:
+		return;
+	}
+
+	switch (len_len) {
+	case 0:
+		break;
+
+	case 2:
+		p[type_len] = 0;
+		p[type_len + 1] = type_len + 2;
+		break;
+
+	case 1:
+		p[type_len] = type_len + 1;
+		break;
+
+	default:
+		return;
+	}
+
+	enc->hdr_len = 6 + type_len + len_len;
+	enc->hdr[1] = enc->hdr_len;
+	if (len_len) enc->vsa_len = enc->hdr_len - 1;
+}
+
 int dict_addattr(char const *name, int attr, unsigned int vendor, PW_TYPE type,
 		 ATTR_FLAGS flags)
 {
@@ -645,6 +956,8 @@ int dict_addattr(char const *name, int attr, unsigned int vendor, PW_TYPE type,
 	static int      max_attr = 0;
 	DICT_ATTR const	*da;
 	DICT_ATTR *n;
+	DICT_VENDOR *dv = NULL;
+	bool rebuild = false;
 
 	namelen = strlen(name);
 	if (namelen >= DICT_ATTR_MAX_NAME_LEN) {
@@ -756,7 +1069,6 @@ int dict_addattr(char const *name, int attr, unsigned int vendor, PW_TYPE type,
 	}
 
 	if ((vendor & (FR_MAX_VENDOR -1)) != 0) {
-		DICT_VENDOR *dv;
 		static DICT_VENDOR *last_vendor = NULL;
 
 		if (flags.has_tlv && (flags.encrypt != FLAG_ENCRYPT_NONE)) {
@@ -877,6 +1189,17 @@ int dict_addattr(char const *name, int attr, unsigned int vendor, PW_TYPE type,
 	n->vendor = vendor;
 	n->type = type;
 	n->flags = flags;
+	dict_attr_encode(n, dv);
+
+	if (flags.intern) {
+		if (!dict_intern_ctx) {
+			dict_intern_ctx = talloc_init("dict_intern");
+			if (!dict_intern_ctx) goto oom;
+		}
+
+		n->intern = fr_intern_create(dict_intern_ctx, type);
+		if (!n->intern) goto oom;
+	}
 
 	/*
 	 *	Insert the attribute, only if it's not a duplicate.
@@ -906,6 +1229,7 @@ int dict_addattr(char const *name, int attr, unsigned int vendor, PW_TYPE type,
 
 
 		fr_hash_table_delete(attributes_byvalue, a);
+		rebuild = true;
 
 		if (!fr_hash_table_replace(attributes_byname, n)) {
 			fr_strerror_printf("dict_addattr: Internal error storing attribute %s", name);
@@ -928,6 +1252,18 @@ int dict_addattr(char const *name, int attr, unsigned int vendor, PW_TYPE type,
 		return -1;
 	}
 
+	/*
+	 *	Attributes added after the dictionaries were loaded
+	 *	(e.g. by modules) go into the flat table, too.
+	 */
+	if (attributes_flat) {
+		if (rebuild || ((attributes_flat_used + 1) * 2 > attributes_flat_mask + 1)) {
+			if (dict_flat_build() < 0) return -1;
+		} else {
+			dict_flat_insert(n);
+		}
+	}
+
 	/*
 	 *	Hacks for combo-IP
 	 */
@@ -1557,6 +1893,15 @@ static int process_attribute(char const* fn, int const line,
 					return -1;
 				}
 
+			} else if (strcmp(key, "intern") == 0) {
+				flags.intern = 1;
+
+				if ((type != PW_TYPE_STRING) && (type != PW_TYPE_OCTETS)) {
+					fr_strerror_printf( "dict_init: %s[%d] Only \"string\" and \"octets\" types can have the \"intern\" flag set.",
+							    fn, line);
+					return -1;
+				}
+
 			} else if (strncmp(key, "virtual", 8) == 0) {
 				flags.virtual = 1;
 
@@ -1607,6 +1952,15 @@ static int process_attribute(char const* fn, int const line,
 
 	if (block_vendor) vendor = block_vendor;
 
+	/*
+	 *	Decrypted values mustn't outlive the packet.
+	 */
+	if (flags.intern && flags.encrypt) {
+		fr_strerror_printf("dict_init: %s[%d]: Encrypted attributes cannot have the \"intern\" flag set.",
+				   fn, line);
+		return -1;
+	}
+
 	/*
 	 *	Special checks for tags, they make our life much more
 	 *	difficult.
@@ -1690,6 +2044,20 @@ static int process_attribute(char const* fn, int const line,
 		return -1;
 	}
 
+	if (dict_cache_buf) {
+		int32_t attr = value;
+		uint32_t num;
+
+		dict_cache_put_op(DICT_CACHE_ATTR);
+		dict_cache_put_string(argv[0]);
+		dict_cache_put(&attr, sizeof(attr));
+		num = vendor;
+		dict_cache_put(&num, sizeof(num));
+		num = type;
+		dict_cache_put(&num, sizeof(num));
+		dict_cache_put(&flags, sizeof(flags));
+	}
+
 	return 0;
 }
 
@@ -1732,6 +2100,15 @@ static int process_value(char const* fn, int const line, char **argv,
 		return -1;
 	}
 
+	if (dict_cache_buf) {
+		int32_t num = value;
+
+		dict_cache_put_op(DICT_CACHE_VALUE);
+		dict_cache_put_string(argv[1]);
+		dict_cache_put_string(argv[0]);
+		dict_cache_put(&num, sizeof(num));
+	}
+
 	return 0;
 }
 
@@ -1803,6 +2180,12 @@ static int process_value_alias(char const* fn, int const line, char **argv,
 		return -1;
 	}
 
+	if (dict_cache_buf) {
+		dict_cache_put_op(DICT_CACHE_VALUE_ALIAS);
+		dict_cache_put_string(argv[0]);
+		dict_cache_put_string(argv[1]);
+	}
+
 	return 0;
 }
 
@@ -1933,6 +2316,24 @@ static int process_vendor(char const* fn, int const line, char **argv,
 		dv->flags = continuation;
 	}
 
+	if (dict_cache_buf) {
+		DICT_VENDOR *dv;
+		uint32_t num = value;
+		uint8_t fmt[3];
+
+		dv = dict_vendorbyvalue(value);
+		if (!dv) return 0;
+
+		fmt[0] = dv->type;
+		fmt[1] = dv->length;
+		fmt[2] = dv->flags;
+
+		dict_cache_put_op(DICT_CACHE_VENDOR);
+		dict_cache_put_string(argv[0]);
+		dict_cache_put(&num, sizeof(num));
+		dict_cache_put(fmt, sizeof(fmt));
+	}
+
 	return 0;
 }
 
@@ -2108,6 +2509,7 @@ static int my_dict_init(char const *parent, char const *filename,
 #endif
 
 	dict_stat_add(&statbuf);
+	dict_cache_put_file(fn, &statbuf);
 
 	/*
 	 *	Seed the random pool with data.
@@ -2386,14 +2788,258 @@ static int my_dict_init(char const *parent, char const *filename,
 }
 
 
+/** Set the file used to cache the compiled dictionaries
+ *
+ * Must be called before dict_init().  The cache is read if it is
+ * newer than all of the dictionary files, and is written whenever
+ * the text dictionaries have to be parsed.
+ *
+ * @param file to cache the dictionaries in, or NULL to disable caching.
+ */
+void dict_set_cache(char const *file)
+{
+	dict_cache = file;
+}
+
+static bool dict_cache_get(uint8_t const **p, uint8_t const *end, void *out, size_t len)
+{
+	if ((size_t) (end - *p) < len) return false;
+
+	memcpy(out, *p, len);
+	*p += len;
+
+	return true;
+}
+
+static bool dict_cache_get_string(uint8_t const **p, uint8_t const *end, char *out, size_t outlen)
+{
+	uint16_t len;
+
+	if (!dict_cache_get(p, end, &len, sizeof(len))) return false;
+	if (len >= outlen) return false;
+	if (!dict_cache_get(p, end, out, len)) return false;
+	out[len] = '\0';
+
+	return true;
+}
+
 /*
- *	Empty callback for hash table initialization.
+ *	Walk over the cache records.  When checking, we verify that
+ *	the records are well formed, and that none of the files have
+ *	changed.  Otherwise, we add the records to the dictionaries.
  */
-static int null_callback(UNUSED void *ctx, UNUSED void *data)
+static int dict_cache_walk(uint8_t const *p, uint8_t const *end, bool check)
 {
+	while (p < end) {
+		uint8_t op;
+		char name[256], other[256];
+		uint32_t num;
+		int32_t value;
+
+		if (!dict_cache_get(&p, end, &op, sizeof(op))) return -1;
+
+		switch (op) {
+		case DICT_CACHE_FILE:
+		{
+			uint64_t dev, ino, mtime, size;
+			struct stat stat_buf;
+
+			if (!dict_cache_get_string(&p, end, name, sizeof(name)) ||
+			    !dict_cache_get(&p, end, &dev, sizeof(dev)) ||
+			    !dict_cache_get(&p, end, &ino, sizeof(ino)) ||
+			    !dict_cache_get(&p, end, &mtime, sizeof(mtime)) ||
+			    !dict_cache_get(&p, end, &size, sizeof(size))) return -1;
+
+			if (stat(name, &stat_buf) < 0) return -1;
+
+			if (check) {
+				if (((uint64_t) stat_buf.st_dev != dev) ||
+				    ((uint64_t) stat_buf.st_ino != ino) ||
+				    ((uint64_t) stat_buf.st_mtime != mtime) ||
+				    ((uint64_t) stat_buf.st_size != size)) return -1;
+				break;
+			}
+
+			dict_stat_add(&stat_buf);
+			fr_rand_seed(&stat_buf, sizeof(stat_buf));
+		}
+			break;
+
+		case DICT_CACHE_VENDOR:
+		{
+			uint8_t format[3];
+			DICT_VENDOR *dv;
+
+			if (!dict_cache_get_string(&p, end, name, sizeof(name)) ||
+			    !dict_cache_get(&p, end, &num, sizeof(num)) ||
+			    !dict_cache_get(&p, end, format, sizeof(format))) return -1;
+
+			if (check) break;
+
+			if (dict_addvendor(name, num) < 0) return -1;
+
+			dv = dict_vendorbyvalue(num);
+			if (!dv) return -1;
+
+			dv->type = format[0];
+			dv->length = format[1];
+			dv->flags = format[2];
+		}
+			break;
+
+		case DICT_CACHE_ATTR:
+		{
+			uint32_t type;
+			ATTR_FLAGS flags;
+
+			if (!dict_cache_get_string(&p, end, name, sizeof(name)) ||
+			    !dict_cache_get(&p, end, &value, sizeof(value)) ||
+			    !dict_cache_get(&p, end, &num, sizeof(num)) ||
+			    !dict_cache_get(&p, end, &type, sizeof(type)) ||
+			    !dict_cache_get(&p, end, &flags, sizeof(flags))) return -1;
+
+			if (check) break;
+
+			if (dict_addattr(name, value, num, type, flags) < 0) return -1;
+		}
+			break;
+
+		case DICT_CACHE_VALUE:
+			if (!dict_cache_get_string(&p, end, name, sizeof(name)) ||
+			    !dict_cache_get_string(&p, end, other, sizeof(other)) ||
+			    !dict_cache_get(&p, end, &value, sizeof(value))) return -1;
+
+			if (check) break;
+
+			if (dict_addvalue(name, other, value) < 0) return -1;
+			break;
+
+		case DICT_CACHE_VALUE_ALIAS:
+		{
+			char *argv[2];
+
+			if (!dict_cache_get_string(&p, end, name, sizeof(name)) ||
+			    !dict_cache_get_string(&p, end, other, sizeof(other))) return -1;
+
+			if (check) break;
+
+			argv[0] = name;
+			argv[1] = other;
+			if (process_value_alias(dict_cache, 0, argv, 2) < 0) return -1;
+		}
+			break;
+
+		default:
+			return -1;
+		}
+	}
+
 	return 0;
 }
 
+/*
+ *	Load the dictionaries from the cache.
+ *
+ *	Returns 1 if the cache was loaded, 0 if it's missing, stale
+ *	or corrupt, and -1 if it looked fine but we couldn't add its
+ *	contents to the dictionaries.
+ */
+static int dict_cache_load(char const *dir, char const *fn)
+{
+	int fd, rcode = 0;
+	struct stat stat_buf;
+	dict_cache_hdr_t hdr;
+	uint8_t *buf = NULL;
+	uint8_t const *p, *end;
+	char root[256], buffer[256];
+
+	fd = open(dict_cache, O_RDONLY);
+	if (fd < 0) return 0;
+
+	/*
+	 *	Apply the same rules as for the dictionaries.
+	 */
+	if ((fstat(fd, &stat_buf) < 0) || !S_ISREG(stat_buf.st_mode)) goto done;
+#ifdef S_IWOTH
+	if ((stat_buf.st_mode & S_IWOTH) != 0) goto done;
+#endif
+
+	if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) goto done;
+	if ((hdr.magic != DICT_CACHE_MAGIC) ||
+	    (hdr.version != DICT_CACHE_VERSION) ||
+	    (hdr.flags_size != sizeof(ATTR_FLAGS)) ||
+	    ((off_t) (hdr.length + sizeof(hdr)) != stat_buf.st_size)) goto done;
+
+	buf = malloc(hdr.length);
+	if (!buf) goto done;
+
+	if (read(fd, buf, hdr.length) != (ssize_t) hdr.length) goto done;
+	if (fr_hash(buf, hdr.length) != hdr.hash) goto done;
+
+	/*
+	 *	The cache must be for the same top-level dictionary.
+	 */
+	p = buf;
+	end = buf + hdr.length;
+	snprintf(buffer, sizeof(buffer), "%s/%s", dir, fn);
+	if (!dict_cache_get_string(&p, end, root, sizeof(root)) ||
+	    (strcmp(root, buffer) != 0)) goto done;
+
+	if (dict_cache_walk(p, end, true) < 0) goto done;
+
+	rcode = (dict_cache_walk(p, end, false) < 0) ? -1 : 1;
+
+done:
+	free(buf);
+	close(fd);
+
+	return rcode;
+}
+
+/*
+ *	Write the records we gathered while parsing the dictionaries.
+ *	Failures are ignored, the worst that happens is that we parse
+ *	the text again next time.
+ */
+static void dict_cache_save(void)
+{
+	int fd;
+	dict_cache_hdr_t hdr;
+	char tmp[1024];
+
+	if (!dict_cache_buf || (dict_cache_len > UINT32_MAX)) return;
+
+	hdr.magic = DICT_CACHE_MAGIC;
+	hdr.version = DICT_CACHE_VERSION;
+	hdr.flags_size = sizeof(ATTR_FLAGS);
+	hdr.length = dict_cache_len;
+	hdr.hash = fr_hash(dict_cache_buf, dict_cache_len);
+
+	/*
+	 *	Write to a temporary file, and rename it into place, so
+	 *	that nothing ever sees a partial cache.
+	 */
+	snprintf(tmp, sizeof(tmp), "%s.%u", dict_cache, (unsigned int) getpid());
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0640);
+	if (fd < 0) return;
+
+	if ((write(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) ||
+	    (write(fd, dict_cache_buf, dict_cache_len) != (ssize_t) dict_cache_len) ||
+	    (close(fd) < 0)) {
+		unlink(tmp);
+		return;
+	}
+
+	if (rename(tmp, dict_cache) < 0) unlink(tmp);
+}
+
+static void dict_cache_record_free(void)
+{
+	free(dict_cache_buf);
+	dict_cache_buf = NULL;
+	dict_cache_len = dict_cache_size = 0;
+}
+
 
 /*
  *	Initialize the directory, then fix the attr member of
@@ -2490,8 +3136,59 @@ int dict_init(char const *dir, char const *fn)
 
 	value_fixup = NULL;	/* just to be safe. */
 
-	if (my_dict_init(dir, fn, NULL, 0) < 0)
+	if (dict_cache && !dict_cache_skip) {
+		switch (dict_cache_load(dir, fn)) {
+		case 1:
+			goto fixup;
+
+		case -1:
+		{
+			value_fixup_t *this, *next;
+			int rcode;
+
+			/*
+			 *	Throw away whatever we added, and
+			 *	start again from the text files.
+			 */
+			for (this = value_fixup; this != NULL; this = next) {
+				next = this->next;
+				free(this);
+			}
+			value_fixup = NULL;
+			dict_free();
+
+			dict_cache_skip = true;
+			rcode = dict_init(dir, fn);
+			dict_cache_skip = false;
+
+			return rcode;
+		}
+
+		default:
+			break;
+		}
+	}
+
+	/*
+	 *	Record what we parse, so that we can write the cache.
+	 */
+	if (dict_cache) {
+		char buffer[256];
+
+		dict_cache_record_free();
+		dict_cache_buf = malloc(65536);
+		if (dict_cache_buf) dict_cache_size = 65536;
+
+		snprintf(buffer, sizeof(buffer), "%s/%s", dir, fn);
+		dict_cache_put_string(buffer);
+	}
+
+	if (my_dict_init(dir, fn, NULL, 0) < 0) {
+		dict_cache_record_free();
 		return -1;
+	}
+
+fixup:
 
 	if (value_fixup) {
 		DICT_ATTR const *a;
@@ -2537,20 +3234,12 @@ int dict_init(char const *dir, char const *fn)
 		}
 	}
 
-	/*
-	 *	Walk over all of the hash tables to ensure they're
-	 *	initialized.  We do this because the threads may perform
-	 *	lookups, and we don't want multi-threaded re-ordering
-	 *	of the table entries.  That would be bad.
-	 */
-	fr_hash_table_walk(vendors_byname, null_callback, NULL);
-	fr_hash_table_walk(vendors_byvalue, null_callback, NULL);
+	if (dict_flat_build() < 0) return -1;
 
-	fr_hash_table_walk(attributes_byname, null_callback, NULL);
-	fr_hash_table_walk(attributes_byvalue, null_callback, NULL);
-
-	fr_hash_table_walk(values_byvalue, null_callback, NULL);
-	fr_hash_table_walk(values_byname, null_callback, NULL);
+	if (dict_cache_buf) {
+		dict_cache_save();
+		dict_cache_record_free();
+	}
 
 	return 0;
 }
@@ -3012,6 +3701,21 @@ int dict_unknown_from_substr(DICT_ATTR *da, char const **name)
 	return 0;
 }
 
+static DICT_ATTR const *dict_flat_find(unsigned int attr, unsigned int vendor)
+{
+	uint32_t i;
+
+	for (i = dict_flat_hash(attr, vendor) & attributes_flat_mask;
+	     attributes_flat[i] != NULL;
+	     i = (i + 1) & attributes_flat_mask) {
+		if ((attributes_flat[i]->attr == attr) && (attributes_flat[i]->vendor == vendor)) {
+			return attributes_flat[i];
+		}
+	}
+
+	return NULL;
+}
+
 /*
  *	Get an attribute by its numerical value.
  */
@@ -3021,6 +3725,8 @@ DICT_ATTR const *dict_attrbyvalue(unsigned int attr, unsigned int vendor)
 
 	if ((attr > 0) && (attr < 256) && !vendor) return dict_base_attrs[attr];
 
+	if (attributes_flat) return dict_flat_find(attr, vendor);
+
 	da.attr = attr;
 	da.vendor = vendor;
 
@@ -3142,6 +3848,8 @@ DICT_ATTR const *dict_attrbyparent(DICT_ATTR const *parent, unsigned int attr, u
 
 	if (!dict_attr_child(parent, &my_attr, &my_vendor)) return NULL;
 
+	if (attributes_flat) return dict_flat_find(my_attr, my_vendor);
+
 	da.attr = my_attr;
 	da.vendor = my_vendor;
 
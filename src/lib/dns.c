@@ -0,0 +1,649 @@
+/*
+ * dns.c	Caching, non-blocking hostname resolution.
+ *
+ * Version:	$Id$
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2015  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include	<freeradius-devel/libradius.h>
+
+#include	<ctype.h>
+#include	<fcntl.h>
+
+/*
+ *	getaddrinfo() blocks, and every caller of ip_hton() pays for a
+ *	full lookup, every time.  When the cache is enabled, results
+ *	(including failures) are kept for a while, lookups for a name
+ *	which is already being resolved wait for that lookup instead of
+ *	starting another, and names which are still being used are
+ *	re-resolved in the background shortly before they expire.
+ *
+ *	getaddrinfo() doesn't tell us the TTL of the records it found,
+ *	so the cache uses the configured TTLs.
+ *
+ *	fr_dns_lookup_async() never blocks.  If the answer isn't cached
+ *	it returns a query, whose fd becomes readable when the lookup
+ *	has been done by one of the resolver threads.  The fd can be
+ *	given to module_yield(), or inserted into an event list.
+ */
+typedef struct fr_dns_entry fr_dns_entry_t;
+
+struct fr_dns_query {
+	int			fd[2];		//!< fd[0] becomes readable when the lookup is done.
+	int			refs;		//!< The resolver, and each waiter.
+	bool			done;
+	int			rcode;		//!< 0 if an address was found, else -1.
+	fr_ipaddr_t		ipaddr;
+
+	char const		*hostname;
+	int			af;
+	bool			fallback;
+
+	fr_dns_entry_t		*entry;		//!< Cache entry to update, if it still exists.
+	fr_dns_query_t		*next;		//!< Next query for the resolver threads.
+};
+
+struct fr_dns_entry {
+	char const		*hostname;
+	int			af;
+	bool			fallback;
+
+	int			rcode;		//!< 0 if an address was found, else -1.
+	fr_ipaddr_t		ipaddr;
+	time_t			expires;	//!< 0 if it's never been resolved.
+	fr_dns_query_t		*query;		//!< Lookup in progress.
+
+	fr_dns_entry_t		*prev;		//!< More recently used.
+	fr_dns_entry_t		*next;		//!< Less recently used.
+};
+
+static fr_hash_table_t	*dns_cache = NULL;
+static fr_dns_entry_t	*dns_lru_head = NULL;
+static fr_dns_entry_t	*dns_lru_tail = NULL;
+
+static uint32_t		dns_cache_size;
+static uint32_t		dns_ttl;
+static uint32_t		dns_negative_ttl;
+static uint32_t		dns_prefetch;
+static uint32_t		dns_max_threads;
+
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t	dns_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	dns_cond = PTHREAD_COND_INITIALIZER;
+static fr_dns_query_t	*dns_queue_head = NULL;
+static fr_dns_query_t	*dns_queue_tail = NULL;
+static uint32_t		dns_num_threads = 0;
+static pid_t		dns_threads_pid = 0;	//!< Threads don't survive fork().
+#  define DNS_LOCK pthread_mutex_lock(&dns_mutex)
+#  define DNS_UNLOCK pthread_mutex_unlock(&dns_mutex)
+#else
+#  define DNS_LOCK
+#  define DNS_UNLOCK
+#endif
+
+/** Look up a hostname, without the cache
+ *
+ * @see ip_hton
+ */
+int fr_dns_resolve(fr_ipaddr_t *out, int af, char const *hostname, bool fallback)
+{
+	int rcode;
+	struct addrinfo hints, *ai = NULL, *alt = NULL, *res = NULL;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = af;
+
+#ifdef TALLOC_DEBUG
+	/*
+	 *	Avoid malloc for IP addresses.  This helps us debug
+	 *	memory errors when using talloc.
+	 */
+	if (af == AF_INET) {
+		/*
+		 *	If it's all numeric, avoid getaddrinfo()
+		 */
+		if (inet_pton(af, hostname, &out->ipaddr.ip4addr) == 1) {
+			return 0;
+		}
+	}
+#endif
+
+	if ((rcode = getaddrinfo(hostname, NULL, &hints, &res)) != 0) {
+		fr_strerror_printf("ip_hton: %s", gai_strerror(rcode));
+		return -1;
+	}
+
+	for (ai = res; ai; ai = ai->ai_next) {
+		if ((af == ai->ai_family) || (af == AF_UNSPEC)) break;
+		if (!alt && fallback && ((ai->ai_family == AF_INET) || (ai->ai_family == AF_INET6))) alt = ai;
+	}
+
+	if (!ai) ai = alt;
+	if (!ai) {
+		fr_strerror_printf("ip_hton failed to find requested information for host %.100s", hostname);
+		freeaddrinfo(res);
+		return -1;
+	}
+
+	rcode = fr_sockaddr2ipaddr((struct sockaddr_storage *)ai->ai_addr,
+				   ai->ai_addrlen, out, NULL);
+	freeaddrinfo(res);
+	if (!rcode) return -1;
+
+	return 0;
+}
+
+/*
+ *	Don't fill the cache with addresses which don't need resolving.
+ */
+static bool dns_literal(fr_ipaddr_t *out, int af, char const *hostname)
+{
+	fr_ipaddr_t ipaddr;
+
+	memset(&ipaddr, 0, sizeof(ipaddr));
+
+	if ((af != AF_INET6) && (inet_pton(AF_INET, hostname, &ipaddr.ipaddr.ip4addr) == 1)) {
+		ipaddr.af = AF_INET;
+		ipaddr.prefix = 32;
+		*out = ipaddr;
+		return true;
+	}
+
+#ifdef HAVE_STRUCT_SOCKADDR_IN6
+	if ((af != AF_INET) && strchr(hostname, ':') &&
+	    (inet_pton(AF_INET6, hostname, &ipaddr.ipaddr.ip6addr) == 1)) {
+		ipaddr.af = AF_INET6;
+		ipaddr.prefix = 128;
+		*out = ipaddr;
+		return true;
+	}
+#endif
+
+	return false;
+}
+
+/*
+ *	Names are compared without regard to case, so they have to be
+ *	hashed that way, too.
+ */
+static uint32_t dns_entry_hash(void const *data)
+{
+	fr_dns_entry_t const *entry = data;
+	uint32_t hash;
+	char buffer[256];
+	size_t len;
+
+	for (len = 0; entry->hostname[len] && (len < sizeof(buffer)); len++) {
+		buffer[len] = tolower((uint8_t) entry->hostname[len]);
+	}
+
+	hash = fr_hash_keyed(buffer, len);
+	hash = fr_hash_keyed_update(&entry->af, sizeof(entry->af), hash);
+	return fr_hash_keyed_update(&entry->fallback, sizeof(entry->fallback), hash);
+}
+
+static int dns_entry_cmp(void const *one, void const *two)
+{
+	fr_dns_entry_t const *a = one;
+	fr_dns_entry_t const *b = two;
+
+	if (a->af != b->af) return a->af - b->af;
+	if (a->fallback != b->fallback) return a->fallback - b->fallback;
+
+	return strcasecmp(a->hostname, b->hostname);
+}
+
+static void dns_lru_unlink(fr_dns_entry_t *entry)
+{
+	if (entry->prev) {
+		entry->prev->next = entry->next;
+	} else {
+		dns_lru_head = entry->next;
+	}
+
+	if (entry->next) {
+		entry->next->prev = entry->prev;
+	} else {
+		dns_lru_tail = entry->prev;
+	}
+
+	entry->prev = entry->next = NULL;
+}
+
+static void dns_lru_insert(fr_dns_entry_t *entry)
+{
+	entry->prev = NULL;
+	entry->next = dns_lru_head;
+	if (dns_lru_head) dns_lru_head->prev = entry;
+	dns_lru_head = entry;
+	if (!dns_lru_tail) dns_lru_tail = entry;
+}
+
+/*
+ *	Any lookup in progress carries on, but its result is discarded.
+ */
+static void dns_entry_free(fr_dns_entry_t *entry)
+{
+	fr_hash_table_delete(dns_cache, entry);
+	dns_lru_unlink(entry);
+	if (entry->query) entry->query->entry = NULL;
+	talloc_free(entry);
+}
+
+static fr_dns_entry_t *dns_entry_alloc(int af, char const *hostname, bool fallback)
+{
+	fr_dns_entry_t *entry, *old;
+
+	/*
+	 *	Make room by forgetting the least recently used entry
+	 *	which isn't being resolved.
+	 */
+	if ((uint32_t) fr_hash_table_num_elements(dns_cache) >= dns_cache_size) {
+		for (old = dns_lru_tail; old; old = old->prev) {
+			if (old->query) continue;
+
+			dns_entry_free(old);
+			break;
+		}
+	}
+
+	entry = talloc_zero(NULL, fr_dns_entry_t);
+	if (!entry) return NULL;
+
+	entry->hostname = talloc_strdup(entry, hostname);
+	entry->af = af;
+	entry->fallback = fallback;
+	if (!entry->hostname || !fr_hash_table_insert(dns_cache, entry)) {
+		talloc_free(entry);
+		return NULL;
+	}
+	dns_lru_insert(entry);
+
+	return entry;
+}
+
+static int _dns_query_free(fr_dns_query_t *query)
+{
+	if (query->fd[0] >= 0) close(query->fd[0]);
+	if (query->fd[1] >= 0) close(query->fd[1]);
+
+	return 0;
+}
+
+/*
+ *	The query starts with one reference, which belongs to whoever
+ *	is going to resolve it.
+ */
+static fr_dns_query_t *dns_query_alloc(fr_dns_entry_t *entry)
+{
+	fr_dns_query_t *query;
+
+	query = talloc_zero(NULL, fr_dns_query_t);
+	if (!query) return NULL;
+
+	query->fd[0] = query->fd[1] = -1;
+	talloc_set_destructor(query, _dns_query_free);
+
+	query->hostname = talloc_strdup(query, entry->hostname);
+	if (!query->hostname || (pipe(query->fd) < 0)) {
+		talloc_free(query);
+		return NULL;
+	}
+
+	query->af = entry->af;
+	query->fallback = entry->fallback;
+	query->refs = 1;
+	query->entry = entry;
+	entry->query = query;
+
+	return query;
+}
+
+/*
+ *	Must be called with the mutex held.
+ */
+static void dns_query_release(fr_dns_query_t *query)
+{
+	if (--query->refs > 0) return;
+
+	if (query->entry) query->entry->query = NULL;
+	talloc_free(query);
+}
+
+/*
+ *	Record the result, wake up anyone waiting for it, and drop the
+ *	resolver's reference.
+ */
+static void dns_query_done(fr_dns_query_t *query, int rcode, fr_ipaddr_t const *ipaddr)
+{
+	fr_dns_entry_t *entry;
+
+	DNS_LOCK;
+	query->done = true;
+	query->rcode = rcode;
+	if (rcode == 0) query->ipaddr = *ipaddr;
+
+	entry = query->entry;
+	if (entry) {
+		entry->rcode = rcode;
+		if (rcode == 0) entry->ipaddr = *ipaddr;
+		entry->expires = time(NULL) + ((rcode == 0) ? dns_ttl : dns_negative_ttl);
+		entry->query = NULL;
+		query->entry = NULL;
+	}
+
+	if (write(query->fd[1], "", 1) < 0) {
+		/* nothing */
+	}
+
+	dns_query_release(query);
+	DNS_UNLOCK;
+}
+
+#ifdef HAVE_PTHREAD_H
+static void *dns_resolver(UNUSED void *arg)
+{
+	fr_dns_query_t	*query;
+	fr_ipaddr_t	ipaddr;
+	int		rcode;
+
+	for (;;) {
+		DNS_LOCK;
+		while (!dns_queue_head) pthread_cond_wait(&dns_cond, &dns_mutex);
+
+		query = dns_queue_head;
+		dns_queue_head = query->next;
+		if (!dns_queue_head) dns_queue_tail = NULL;
+		query->next = NULL;
+		DNS_UNLOCK;
+
+		rcode = fr_dns_resolve(&ipaddr, query->af, query->hostname, query->fallback);
+		dns_query_done(query, rcode, &ipaddr);
+	}
+
+	return NULL;
+}
+
+/*
+ *	Hand a query to the resolver threads, starting them if
+ *	necessary.  Must be called with the mutex held.
+ */
+static int dns_query_enqueue(fr_dns_query_t *query)
+{
+	pthread_attr_t	attr;
+	pthread_t	thread;
+
+	if (dns_threads_pid != getpid()) {
+		dns_threads_pid = getpid();
+		dns_num_threads = 0;
+	}
+
+	if (dns_num_threads < dns_max_threads) {
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		if (pthread_create(&thread, &attr, dns_resolver, NULL) == 0) dns_num_threads++;
+		pthread_attr_destroy(&attr);
+	}
+	if (dns_num_threads == 0) return -1;
+
+	if (dns_queue_tail) {
+		dns_queue_tail->next = query;
+	} else {
+		dns_queue_head = query;
+	}
+	dns_queue_tail = query;
+
+	pthread_cond_signal(&dns_cond);
+
+	return 0;
+}
+#else
+#  define dns_query_enqueue(_x) (-1)
+#endif
+
+static void dns_query_wait(fr_dns_query_t *query)
+{
+	fd_set fds;
+
+	for (;;) {
+		FD_ZERO(&fds);
+		FD_SET(query->fd[0], &fds);
+
+		if (select(query->fd[0] + 1, &fds, NULL, NULL, NULL) > 0) return;
+		if (errno != EINTR) return;
+	}
+}
+
+static int dns_lookup(fr_ipaddr_t *out, int af, char const *hostname, bool fallback, fr_dns_query_t **out_query)
+{
+	fr_dns_entry_t	my_entry, *entry;
+	fr_dns_query_t	*query;
+	fr_ipaddr_t	ipaddr;
+	time_t		now;
+	int		rcode;
+
+	if (dns_literal(out, af, hostname)) return 0;
+
+	memcpy(&my_entry.hostname, &hostname, sizeof(my_entry.hostname));
+	my_entry.af = af;
+	my_entry.fallback = fallback;
+
+	now = time(NULL);
+
+	DNS_LOCK;
+	if (!dns_cache) {
+		DNS_UNLOCK;
+		return fr_dns_resolve(out, af, hostname, fallback);
+	}
+
+	entry = fr_hash_table_finddata(dns_cache, &my_entry);
+	if (entry && (entry->expires > now)) {
+		rcode = entry->rcode;
+		if (rcode == 0) *out = entry->ipaddr;
+
+		dns_lru_unlink(entry);
+		dns_lru_insert(entry);
+
+		/*
+		 *	It's being used, and it's about to expire.
+		 *	Refresh it now, so that nobody has to wait.
+		 */
+		if ((rcode == 0) && dns_prefetch && !entry->query &&
+		    ((entry->expires - now) <= (time_t) dns_prefetch)) {
+			query = dns_query_alloc(entry);
+			if (query && (dns_query_enqueue(query) < 0)) {
+				entry->query = NULL;
+				talloc_free(query);
+			}
+		}
+		DNS_UNLOCK;
+
+		if (rcode < 0) fr_strerror_printf("ip_hton: No address found for host %.100s", hostname);
+		return rcode;
+	}
+
+	if (!entry) {
+		entry = dns_entry_alloc(af, hostname, fallback);
+		if (!entry) {
+			DNS_UNLOCK;
+			return fr_dns_resolve(out, af, hostname, fallback);
+		}
+	}
+
+	/*
+	 *	Someone else is already looking it up.
+	 */
+	if (entry->query) {
+		query = entry->query;
+		query->refs++;
+		DNS_UNLOCK;
+		goto wait;
+	}
+
+	query = dns_query_alloc(entry);
+	if (!query) {
+		DNS_UNLOCK;
+		return fr_dns_resolve(out, af, hostname, fallback);
+	}
+
+	if (out_query && (dns_query_enqueue(query) == 0)) {
+		query->refs++;
+		DNS_UNLOCK;
+		goto wait;
+	}
+	DNS_UNLOCK;
+
+	/*
+	 *	Blocking lookups, and lookups when there are no
+	 *	resolver threads, are done here.
+	 */
+	rcode = fr_dns_resolve(&ipaddr, af, hostname, fallback);
+	dns_query_done(query, rcode, &ipaddr);
+	if (rcode == 0) *out = ipaddr;
+
+	return rcode;
+
+wait:
+	if (out_query) {
+		*out_query = query;
+		return 1;
+	}
+
+	dns_query_wait(query);
+	return fr_dns_query_result(out, query);
+}
+
+/** Look up a hostname, using the cache if it's enabled
+ *
+ * Blocks until the lookup is done.
+ *
+ * @see ip_hton
+ */
+int fr_dns_lookup(fr_ipaddr_t *out, int af, char const *hostname, bool fallback)
+{
+	return dns_lookup(out, af, hostname, fallback, NULL);
+}
+
+/** Look up a hostname, without blocking
+ *
+ * If the cache is disabled, this blocks, just like fr_dns_lookup().
+ *
+ * @param[out] out Where to write the address.
+ * @param[in] af To search for in preference.
+ * @param[in] hostname to search for.
+ * @param[in] fallback to the other address family, if no records matching af, found.
+ * @param[out] query if the lookup is in progress.  Wait for fr_dns_query_fd()
+ *	to become readable, and then call fr_dns_query_result().
+ * @return 0 on success, -1 on failure, 1 if the lookup is in progress.
+ */
+int fr_dns_lookup_async(fr_ipaddr_t *out, int af, char const *hostname, bool fallback, fr_dns_query_t **query)
+{
+	return dns_lookup(out, af, hostname, fallback, query);
+}
+
+/** Return the fd which becomes readable when a lookup is done
+ *
+ */
+int fr_dns_query_fd(fr_dns_query_t const *query)
+{
+	return query->fd[0];
+}
+
+/** Get the result of a lookup started by fr_dns_lookup_async()
+ *
+ * The query is freed, unless the lookup is still in progress.
+ *
+ * @return 0 on success, -1 on failure, 1 if the lookup is still in progress.
+ */
+int fr_dns_query_result(fr_ipaddr_t *out, fr_dns_query_t *query)
+{
+	int rcode;
+
+	DNS_LOCK;
+	if (!query->done) {
+		DNS_UNLOCK;
+		return 1;
+	}
+
+	rcode = query->rcode;
+	if (rcode == 0) {
+		*out = query->ipaddr;
+	} else {
+		fr_strerror_printf("ip_hton: No address found for host %.100s", query->hostname);
+	}
+
+	dns_query_release(query);
+	DNS_UNLOCK;
+
+	return rcode;
+}
+
+/** Give up waiting for a lookup started by fr_dns_lookup_async()
+ *
+ */
+void fr_dns_query_free(fr_dns_query_t *query)
+{
+	DNS_LOCK;
+	dns_query_release(query);
+	DNS_UNLOCK;
+}
+
+/** Configure the DNS cache
+ *
+ * May be called again, e.g. on HUP.  Any cached entries are discarded.
+ *
+ * @param[in] size Maximum number of names to cache.  0 disables the cache.
+ * @param[in] ttl How long to cache addresses for.
+ * @param[in] negative_ttl How long to cache failed lookups for.
+ * @param[in] prefetch Re-resolve names which are used this many seconds
+ *	before they expire.  0 disables prefetching.
+ * @param[in] threads Number of threads to resolve names in the background.
+ * @return 0 on success, -1 on error.
+ */
+int fr_dns_cache_init(uint32_t size, uint32_t ttl, uint32_t negative_ttl, uint32_t prefetch, uint32_t threads)
+{
+	DNS_LOCK;
+	while (dns_lru_head) dns_entry_free(dns_lru_head);
+
+	dns_cache_size = size;
+	dns_ttl = ttl;
+	dns_negative_ttl = negative_ttl;
+	dns_prefetch = (prefetch < ttl) ? prefetch : 0;
+	dns_max_threads = threads;
+
+	if (!size) {
+		if (dns_cache) fr_hash_table_free(dns_cache);
+		dns_cache = NULL;
+		DNS_UNLOCK;
+		return 0;
+	}
+
+	if (!dns_cache) {
+		dns_cache = fr_hash_table_create(dns_entry_hash, dns_entry_cmp, NULL);
+		if (!dns_cache) {
+			DNS_UNLOCK;
+			fr_strerror_printf("Failed creating DNS cache");
+			return -1;
+		}
+	}
+	DNS_UNLOCK;
+
+	return 0;
+}
@@ -28,19 +28,56 @@ RCSID("$Id$")
 #include <freeradius-devel/heap.h>
 #include <freeradius-devel/event.h>
 
+/*
+ *	Pick the readiness backend.  epoll on Linux, kqueue on the
+ *	BSDs and OSX, and select() everywhere else.
+ */
+#if defined(HAVE_SYS_EPOLL_H)
+#  include <sys/epoll.h>
+#  define FR_EV_EPOLL
+#elif defined(HAVE_SYS_EVENT_H)
+#  include <sys/event.h>
+#  define FR_EV_KQUEUE
+#else
+#  define FR_EV_SELECT
+#endif
+
 typedef struct fr_event_fd_t {
 	int			fd;
 	fr_event_fd_handler_t	handler;
 	void			*ctx;
 } fr_event_fd_t;
 
-#define FR_EV_MAX_FDS (256)
+/*
+ *	The reader table is indexed by FD, and grows as needed.
+ */
+#define FR_EV_MIN_FDS (64)
+
+/*
+ *	Maximum number of ready FDs returned by one call
+ *	to epoll_wait() or kevent().
+ */
+#define FR_EV_BATCH_SIZE (64)
+
+/*
+ *	The timer wheel has one slot per millisecond.  Events more
+ *	than one revolution away share a slot with nearer ones, and
+ *	are skipped until their revolution comes around.
+ */
+#define FR_EV_WHEEL_SLOTS (4096)
+#define FR_EV_WHEEL_MASK (FR_EV_WHEEL_SLOTS - 1)
+
 #undef USEC
 #define USEC (1000000)
 
 struct fr_event_list_t {
 	fr_heap_t	*times;
 
+	fr_event_t	**wheel;	//!< Timer wheel slots, or NULL if timers are in the heap.
+	uint64_t	*wheel_used;	//!< Bitmap of non-empty slots.
+	uint64_t	wheel_tick;	//!< Every event before this tick has been run.
+	int		num_wheel;	//!< Number of events in the wheel.
+
 	bool		changed;
 
 	int		exit;
@@ -50,9 +87,14 @@ struct fr_event_list_t {
 	struct timeval  now;
 	bool		dispatch;
 
-	int		max_readers;
+	int		max_readers;	//!< Highest FD in use, plus one.
 	int		num_readers;
-	fr_event_fd_t	readers[FR_EV_MAX_FDS];
+	int		alloc_readers;	//!< Number of entries in the reader table.
+	fr_event_fd_t	*readers;
+
+#ifndef FR_EV_SELECT
+	int		kq;		//!< epoll or kqueue descriptor, opened by fr_event_loop().
+#endif
 };
 
 /*
@@ -64,23 +106,186 @@ struct fr_event_t {
 	struct timeval		when;
 	fr_event_t		**parent;
 	int			heap;
+
+	uint64_t		tick;		//!< Wheel slot (in milliseconds) the event is in.
+	fr_event_t		*next;		//!< Next event in the same wheel slot.
+	fr_event_t		*prev;		//!< Previous event in the same wheel slot.
 };
 
 
-static int fr_event_list_time_cmp(void const *one, void const *two)
+/*
+ *	Events are ordered by when they fire, in microseconds.  "when"
+ *	doesn't change while the event is in the heap.
+ */
+static uint64_t fr_event_list_time_key(void const *one)
 {
-	fr_event_t const *a = one;
-	fr_event_t const *b = two;
+	fr_event_t const *ev = one;
+
+	return ((uint64_t) ev->when.tv_sec * USEC) + ev->when.tv_usec;
+}
 
-	if (a->when.tv_sec < b->when.tv_sec) return -1;
-	if (a->when.tv_sec > b->when.tv_sec) return +1;
 
-	if (a->when.tv_usec < b->when.tv_usec) return -1;
-	if (a->when.tv_usec > b->when.tv_usec) return +1;
+static uint64_t fr_event_tick(struct timeval const *when)
+{
+	return ((uint64_t) when->tv_sec * 1000) + (when->tv_usec / 1000);
+}
 
-	return 0;
+static void fr_event_wheel_insert(fr_event_list_t *el, fr_event_t *ev)
+{
+	uint32_t slot;
+
+	/*
+	 *	Events in the past go into the current slot, so that
+	 *	they're run the next time round.
+	 */
+	ev->tick = fr_event_tick(&ev->when);
+	if (ev->tick < el->wheel_tick) ev->tick = el->wheel_tick;
+
+	slot = ev->tick & FR_EV_WHEEL_MASK;
+
+	ev->prev = NULL;
+	ev->next = el->wheel[slot];
+	if (ev->next) ev->next->prev = ev;
+	el->wheel[slot] = ev;
+
+	el->wheel_used[slot >> 6] |= ((uint64_t) 1) << (slot & 63);
+	el->num_wheel++;
 }
 
+static void fr_event_wheel_extract(fr_event_list_t *el, fr_event_t *ev)
+{
+	uint32_t slot = ev->tick & FR_EV_WHEEL_MASK;
+
+	if (ev->prev) {
+		ev->prev->next = ev->next;
+	} else {
+		el->wheel[slot] = ev->next;
+	}
+	if (ev->next) ev->next->prev = ev->prev;
+
+	ev->next = ev->prev = NULL;
+
+	if (!el->wheel[slot]) {
+		el->wheel_used[slot >> 6] &= ~(((uint64_t) 1) << (slot & 63));
+	}
+	el->num_wheel--;
+}
+
+/*
+ *	Return the distance from "tick" to the first non-empty slot,
+ *	or -1 if the wheel is empty.
+ */
+static int fr_event_wheel_find(fr_event_list_t *el, uint64_t tick)
+{
+	int distance = 0;
+
+	while (distance < FR_EV_WHEEL_SLOTS) {
+		uint32_t slot = (tick + distance) & FR_EV_WHEEL_MASK;
+		uint64_t used = el->wheel_used[slot >> 6] >> (slot & 63);
+
+		if (!used) {
+			distance += 64 - (slot & 63);
+			continue;
+		}
+
+		while (!(used & 0x01)) {
+			used >>= 1;
+			distance++;
+		}
+
+		return (distance < FR_EV_WHEEL_SLOTS) ? distance : -1;
+	}
+
+	return -1;
+}
+
+/*
+ *	Find when the next event in the wheel is due.  If nothing is
+ *	due this revolution, return the end of the revolution, which
+ *	is early, but cheap.
+ */
+static void fr_event_wheel_next(fr_event_list_t *el, struct timeval *when)
+{
+	int distance = 0;
+	uint64_t tick;
+
+	while (distance < FR_EV_WHEEL_SLOTS) {
+		int found;
+		fr_event_t *ev, *first = NULL;
+
+		found = fr_event_wheel_find(el, el->wheel_tick + distance);
+		if (found < 0) break;
+
+		tick = el->wheel_tick + distance + found;
+		if (tick >= (el->wheel_tick + FR_EV_WHEEL_SLOTS)) break;
+
+		for (ev = el->wheel[tick & FR_EV_WHEEL_MASK]; ev != NULL; ev = ev->next) {
+			if (ev->tick != tick) continue;
+
+			if (!first || timercmp(&ev->when, &first->when, <)) first = ev;
+		}
+
+		/*
+		 *	Events in the past were moved to a later slot,
+		 *	so they can't run before that slot starts.
+		 */
+		if (first) {
+			*when = first->when;
+			if (fr_event_tick(when) < tick) {
+				when->tv_sec = tick / 1000;
+				when->tv_usec = (tick % 1000) * 1000;
+			}
+			return;
+		}
+
+		distance += found + 1;
+	}
+
+	tick = el->wheel_tick + FR_EV_WHEEL_SLOTS;
+	when->tv_sec = tick / 1000;
+	when->tv_usec = (tick % 1000) * 1000;
+}
+
+/*
+ *	Find the next event which has to be run by "when".  Advances
+ *	the wheel past slots which have nothing left to run.
+ */
+static fr_event_t *fr_event_wheel_due(fr_event_list_t *el, struct timeval const *when)
+{
+	uint64_t now = fr_event_tick(when);
+
+	while (el->wheel_tick <= now) {
+		int found;
+		bool pending = false;
+		fr_event_t *ev;
+
+		for (ev = el->wheel[el->wheel_tick & FR_EV_WHEEL_MASK]; ev != NULL; ev = ev->next) {
+			if (ev->tick != el->wheel_tick) continue;
+
+			if (!timercmp(&ev->when, when, >)) return ev;
+
+			pending = true;
+		}
+
+		/*
+		 *	Something in this millisecond, but not yet.
+		 */
+		if (pending) return NULL;
+
+		/*
+		 *	Skip the empty slots.
+		 */
+		found = fr_event_wheel_find(el, el->wheel_tick + 1);
+		if ((found < 0) || ((el->wheel_tick + 1 + found) > now)) {
+			el->wheel_tick = now + 1;
+			break;
+		}
+
+		el->wheel_tick += found + 1;
+	}
+
+	return NULL;
+}
 
 static int _event_list_free(fr_event_list_t *list)
 {
@@ -91,8 +296,22 @@ static int _event_list_free(fr_event_list_t *list)
 		fr_event_delete(el, &ev);
 	}
 
+	if (el->wheel) {
+		int i;
+
+		for (i = 0; i < FR_EV_WHEEL_SLOTS; i++) {
+			while ((ev = el->wheel[i]) != NULL) {
+				fr_event_delete(el, &ev);
+			}
+		}
+	}
+
 	fr_heap_delete(el->times);
 
+#ifndef FR_EV_SELECT
+	if (el->kq >= 0) close(el->kq);
+#endif
+
 	return 0;
 }
 
@@ -108,22 +327,81 @@ fr_event_list_t *fr_event_list_create(TALLOC_CTX *ctx, fr_event_status_t status)
 	}
 	talloc_set_destructor(el, _event_list_free);
 
-	el->times = fr_heap_create(fr_event_list_time_cmp, offsetof(fr_event_t, heap));
+	el->times = fr_heap_create_keyed(fr_event_list_time_key, offsetof(fr_event_t, heap));
 	if (!el->times) {
 		talloc_free(el);
 		return NULL;
 	}
 
-	for (i = 0; i < FR_EV_MAX_FDS; i++) {
+	el->readers = talloc_array(el, fr_event_fd_t, FR_EV_MIN_FDS);
+	if (!el->readers) {
+		talloc_free(el);
+		return NULL;
+	}
+	el->alloc_readers = FR_EV_MIN_FDS;
+
+	for (i = 0; i < el->alloc_readers; i++) {
 		el->readers[i].fd = -1;
 	}
 
+#ifndef FR_EV_SELECT
+	/*
+	 *	The kernel queue is opened lazily by fr_event_loop().
+	 *	The server creates its event list before it forks
+	 *	into the background, and kqueue descriptors are not
+	 *	inherited by the child.
+	 */
+	el->kq = -1;
+#endif
+
 	el->status = status;
 	el->changed = true;	/* force re-set of fds's */
 
 	return el;
 }
 
+/** Keep the timers in a timer wheel instead of a heap
+ *
+ * Inserting and deleting timers is O(1) instead of O(log n), at the
+ * cost of millisecond granularity: an event may run up to a
+ * millisecond late, but never early.  Any events which have already
+ * been inserted are moved to the wheel.
+ *
+ * @param el to change.
+ * @return 0 on success, -1 on error.
+ */
+int fr_event_list_wheel(fr_event_list_t *el)
+{
+	fr_event_t *ev;
+	struct timeval now;
+
+	if (!el) {
+		fr_strerror_printf("Invalid arguments (NULL event list)");
+		return -1;
+	}
+
+	if (el->wheel) return 0;
+
+	el->wheel = talloc_zero_array(el, fr_event_t *, FR_EV_WHEEL_SLOTS);
+	el->wheel_used = talloc_zero_array(el, uint64_t, FR_EV_WHEEL_SLOTS / 64);
+	if (!el->wheel || !el->wheel_used) {
+		TALLOC_FREE(el->wheel);
+		TALLOC_FREE(el->wheel_used);
+		fr_strerror_printf("out of memory");
+		return -1;
+	}
+
+	gettimeofday(&now, NULL);
+	el->wheel_tick = fr_event_tick(&now);
+
+	while ((ev = fr_heap_peek(el->times)) != NULL) {
+		fr_heap_extract(el->times, ev);
+		fr_event_wheel_insert(el, ev);
+	}
+
+	return 0;
+}
+
 int fr_event_list_num_fds(fr_event_list_t *el)
 {
 	if (!el) return 0;
@@ -135,6 +413,8 @@ int fr_event_list_num_elements(fr_event_list_t *el)
 {
 	if (!el) return 0;
 
+	if (el->wheel) return el->num_wheel;
+
 	return fr_heap_num_elements(el->times);
 }
 
@@ -163,8 +443,13 @@ int fr_event_delete(fr_event_list_t *el, fr_event_t **parent)
 	}
 	*parent = NULL;
 
-	ret = fr_heap_extract(el->times, ev);
-	fr_assert(ret == 1);	/* events MUST be in the heap */
+	if (el->wheel) {
+		fr_event_wheel_extract(el, ev);
+		ret = 1;
+	} else {
+		ret = fr_heap_extract(el->times, ev);
+		fr_assert(ret == 1);	/* events MUST be in the heap */
+	}
 	talloc_free(ev);
 
 	return ret;
@@ -204,7 +489,10 @@ int fr_event_insert(fr_event_list_t *el, fr_event_callback_t callback, void *ctx
 	ev->when = *when;
 	ev->parent = parent;
 
-	if (!fr_heap_insert(el->times, ev)) {
+	if (el->wheel) {
+		fr_event_wheel_insert(el, ev);
+
+	} else if (!fr_heap_insert(el->times, ev)) {
 		talloc_free(ev);
 		return 0;
 	}
@@ -222,27 +510,36 @@ int fr_event_run(fr_event_list_t *el, struct timeval *when)
 
 	if (!el) return 0;
 
-	if (fr_heap_num_elements(el->times) == 0) {
+	if (fr_event_list_num_elements(el) == 0) {
 		when->tv_sec = 0;
 		when->tv_usec = 0;
 		return 0;
 	}
 
-	ev = fr_heap_peek(el->times);
-	if (!ev) {
-		when->tv_sec = 0;
-		when->tv_usec = 0;
-		return 0;
-	}
+	if (el->wheel) {
+		ev = fr_event_wheel_due(el, when);
+		if (!ev) {
+			fr_event_wheel_next(el, when);
+			return 0;
+		}
 
-	/*
-	 *	See if it's time to do this one.
-	 */
-	if ((ev->when.tv_sec > when->tv_sec) ||
-	    ((ev->when.tv_sec == when->tv_sec) &&
-	     (ev->when.tv_usec > when->tv_usec))) {
-		*when = ev->when;
-		return 0;
+	} else {
+		ev = fr_heap_peek(el->times);
+		if (!ev) {
+			when->tv_sec = 0;
+			when->tv_usec = 0;
+			return 0;
+		}
+
+		/*
+		 *	See if it's time to do this one.
+		 */
+		if ((ev->when.tv_sec > when->tv_sec) ||
+		    ((ev->when.tv_sec == when->tv_sec) &&
+		     (ev->when.tv_usec > when->tv_usec))) {
+			*when = ev->when;
+			return 0;
+		}
 	}
 
 	callback = ev->callback;
@@ -272,10 +569,99 @@ int fr_event_now(fr_event_list_t *el, struct timeval *when)
 }
 
 
+#ifndef FR_EV_SELECT
+/*
+ *	Tell the kernel to start (or stop) watching an FD.
+ */
+static int fr_event_kq_add(fr_event_list_t *el, int fd)
+{
+#ifdef FR_EV_EPOLL
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+
+	if (epoll_ctl(el->kq, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		if (errno == EEXIST) return 0;
+
+		fr_strerror_printf("Failed adding FD %i to epoll: %s", fd, fr_syserror(errno));
+		return -1;
+	}
+#else
+	struct kevent ev;
+
+	EV_SET(&ev, fd, EVFILT_READ, EV_ADD | EV_ENABLE, 0, 0, 0);
+	if (kevent(el->kq, &ev, 1, NULL, 0, NULL) < 0) {
+		fr_strerror_printf("Failed adding FD %i to kqueue: %s", fd, fr_syserror(errno));
+		return -1;
+	}
+#endif
+
+	return 0;
+}
+
+static void fr_event_kq_del(fr_event_list_t *el, int fd)
+{
+#ifdef FR_EV_EPOLL
+	struct epoll_event ev;
+
+	/*
+	 *	Ignore errors.  The caller may have closed the FD
+	 *	already, in which case the kernel has removed it.
+	 */
+	memset(&ev, 0, sizeof(ev));
+	(void) epoll_ctl(el->kq, EPOLL_CTL_DEL, fd, &ev);
+#else
+	struct kevent ev;
+
+	EV_SET(&ev, fd, EVFILT_READ, EV_DELETE, 0, 0, 0);
+	(void) kevent(el->kq, &ev, 1, NULL, 0, NULL);
+#endif
+}
+
+/*
+ *	Open the kernel queue, and add all of the current readers to it.
+ */
+static int fr_event_kq_open(fr_event_list_t *el)
+{
+	int i;
+
+#ifdef FR_EV_EPOLL
+#  ifdef EPOLL_CLOEXEC
+	el->kq = epoll_create1(EPOLL_CLOEXEC);
+#  else
+	el->kq = epoll_create(FR_EV_MIN_FDS);
+#  endif
+#else
+	el->kq = kqueue();
+#endif
+	if (el->kq < 0) {
+		fr_strerror_printf("Failed opening event queue: %s", fr_syserror(errno));
+		return -1;
+	}
+
+#if defined(FD_CLOEXEC) && !defined(EPOLL_CLOEXEC)
+	(void) fcntl(el->kq, F_SETFD, FD_CLOEXEC);
+#endif
+
+	for (i = 0; i < el->max_readers; i++) {
+		if (el->readers[i].fd < 0) continue;
+
+		if (fr_event_kq_add(el, el->readers[i].fd) < 0) {
+			close(el->kq);
+			el->kq = -1;
+			return -1;
+		}
+	}
+
+	return 0;
+}
+#endif	/* FR_EV_SELECT */
+
 int fr_event_fd_insert(fr_event_list_t *el, int type, int fd,
 		       fr_event_fd_handler_t handler, void *ctx)
 {
-	int i;
 	fr_event_fd_t *ef;
 
 	if (!el) {
@@ -303,47 +689,66 @@ int fr_event_fd_insert(fr_event_list_t *el, int type, int fd,
 		return 0;
 	}
 
-	if (el->max_readers >= FR_EV_MAX_FDS) {
-		fr_strerror_printf("Too many readers");
+#ifdef FR_EV_SELECT
+	if (fd >= FD_SETSIZE) {
+		fr_strerror_printf("FD %i is larger than FD_SETSIZE (%i)", fd, FD_SETSIZE);
 		return 0;
 	}
+#endif
 
-	ef = NULL;
-	for (i = 0; i <= el->max_readers; i++) {
-		/*
-		 *	Be fail-safe on multiple inserts.
-		 */
-		if (el->readers[i].fd == fd) {
-			if ((el->readers[i].handler != handler) ||
-			    (el->readers[i].ctx != ctx)) {
-				fr_strerror_printf("Multiple handlers for same FD");
-				return 0;
-			}
+	/*
+	 *	Grow the reader table so that it can be indexed by
+	 *	the new FD.
+	 */
+	if (fd >= el->alloc_readers) {
+		int i, alloc;
+		fr_event_fd_t *readers;
 
-			/*
-			 *	No change.
-			 */
-			return 1;
-		}
+		alloc = el->alloc_readers;
+		while (alloc <= fd) alloc <<= 1;
 
-		if (el->readers[i].fd < 0) {
-			ef = &el->readers[i];
-			el->num_readers++;
+		readers = talloc_realloc(el, el->readers, fr_event_fd_t, alloc);
+		if (!readers) {
+			fr_strerror_printf("Out of memory");
+			return 0;
+		}
 
-			if (i == el->max_readers) el->max_readers = i + 1;
-			break;
+		for (i = el->alloc_readers; i < alloc; i++) {
+			readers[i].fd = -1;
 		}
+
+		el->readers = readers;
+		el->alloc_readers = alloc;
 	}
 
-	if (!ef) {
-		fr_strerror_printf("Failed assigning FD");
-		return 0;
+	ef = &el->readers[fd];
+
+	/*
+	 *	Be fail-safe on multiple inserts.
+	 */
+	if (ef->fd == fd) {
+		if ((ef->handler != handler) || (ef->ctx != ctx)) {
+			fr_strerror_printf("Multiple handlers for same FD");
+			return 0;
+		}
+
+		/*
+		 *	No change.
+		 */
+		return 1;
 	}
 
+#ifndef FR_EV_SELECT
+	if ((el->kq >= 0) && (fr_event_kq_add(el, fd) < 0)) return 0;
+#endif
+
 	ef->handler = handler;
 	ef->ctx = ctx;
 	ef->fd = fd;
 
+	el->num_readers++;
+	if (fd >= el->max_readers) el->max_readers = fd + 1;
+
 	el->changed = true;
 
 	return 1;
@@ -351,24 +756,28 @@ int fr_event_fd_insert(fr_event_list_t *el, int type, int fd,
 
 int fr_event_fd_delete(fr_event_list_t *el, int type, int fd)
 {
-	int i;
-
 	if (!el || (fd < 0)) return 0;
 
 	if (type != 0) return 0;
 
-	for (i = 0; i < el->max_readers; i++) {
-		if (el->readers[i].fd == fd) {
-			el->readers[i].fd = -1;
-			el->num_readers--;
+	if ((fd >= el->max_readers) || (el->readers[fd].fd != fd)) return 0;
 
-			if ((i + 1) == el->max_readers) el->max_readers = i;
-			el->changed = true;
-			return 1;
+#ifndef FR_EV_SELECT
+	if (el->kq >= 0) fr_event_kq_del(el, fd);
+#endif
+
+	el->readers[fd].fd = -1;
+	el->num_readers--;
+
+	if ((fd + 1) == el->max_readers) {
+		while ((el->max_readers > 0) &&
+		       (el->readers[el->max_readers - 1].fd < 0)) {
+			el->max_readers--;
 		}
 	}
 
-	return 0;
+	el->changed = true;
+	return 1;
 }
 
 
@@ -386,15 +795,33 @@ bool fr_event_loop_exiting(fr_event_list_t *el)
 
 int fr_event_loop(fr_event_list_t *el)
 {
-	int i, rcode, maxfd = 0;
+	int i, rcode;
 	struct timeval when, *wake;
+#ifdef FR_EV_SELECT
+	int maxfd = 0;
 	fd_set read_fds, master_fds;
+#else
+#  ifdef FR_EV_EPOLL
+	struct epoll_event events[FR_EV_BATCH_SIZE];
+#  else
+	struct kevent events[FR_EV_BATCH_SIZE];
+	struct timespec ts, *ts_wake;
+#  endif
+#endif
 
 	el->exit = 0;
 	el->dispatch = true;
 	el->changed = true;
 
+#ifndef FR_EV_SELECT
+	if ((el->kq < 0) && (fr_event_kq_open(el) < 0)) {
+		el->dispatch = false;
+		return -1;
+	}
+#endif
+
 	while (!el->exit) {
+#ifdef FR_EV_SELECT
 		/*
 		 *	Cache the list of FD's to watch.
 		 */
@@ -404,6 +831,7 @@ int fr_event_loop(fr_event_list_t *el)
 #else
 			FD_ZERO(&master_fds);
 #endif
+			maxfd = 0;
 			for (i = 0; i < el->max_readers; i++) {
 				if (el->readers[i].fd < 0) continue;
 
@@ -415,6 +843,12 @@ int fr_event_loop(fr_event_list_t *el)
 
 			el->changed = false;
 		}
+#else
+		/*
+		 *	The kernel keeps track of the FDs for us.
+		 */
+		el->changed = false;
+#endif
 
 		/*
 		 *	Find the first event.  If there's none, we wait
@@ -423,18 +857,26 @@ int fr_event_loop(fr_event_list_t *el)
 		when.tv_sec = 0;
 		when.tv_usec = 0;
 
-		if (fr_heap_num_elements(el->times) > 0) {
-			fr_event_t *ev;
+		if (fr_event_list_num_elements(el) > 0) {
+			struct timeval next;
 
-			ev = fr_heap_peek(el->times);
-			if (!ev) {
-				fr_exit_now(42);
+			if (el->wheel) {
+				fr_event_wheel_next(el, &next);
+			} else {
+				fr_event_t *ev;
+
+				ev = fr_heap_peek(el->times);
+				if (!ev) {
+					fr_exit_now(42);
+				}
+				next = ev->when;
 			}
 
-			gettimeofday(&el->now, NULL);
+			fr_clock_update();
+			fr_clock_gettime(&el->now);
 
-			if (timercmp(&el->now, &ev->when, <)) {
-				when = ev->when;
+			if (timercmp(&el->now, &next, <)) {
+				when = next;
 				when.tv_sec -= el->now.tv_sec;
 
 				if (when.tv_sec > 0) {
@@ -463,23 +905,52 @@ int fr_event_loop(fr_event_list_t *el)
 		 */
 		if (el->status) el->status(wake);
 
+#if defined(FR_EV_SELECT)
 		read_fds = master_fds;
 		rcode = select(maxfd + 1, &read_fds, NULL, NULL, wake);
+#elif defined(FR_EV_EPOLL)
+		/*
+		 *	epoll has millisecond granularity.  Round up, so
+		 *	that we don't wake up before the timer fires.
+		 */
+		rcode = epoll_wait(el->kq, events, FR_EV_BATCH_SIZE,
+				   wake ? (wake->tv_sec * 1000) + ((wake->tv_usec + 999) / 1000) : -1);
+#else
+		if (wake) {
+			ts.tv_sec = wake->tv_sec;
+			ts.tv_nsec = wake->tv_usec * 1000;
+			ts_wake = &ts;
+		} else {
+			ts_wake = NULL;
+		}
+		rcode = kevent(el->kq, NULL, 0, events, FR_EV_BATCH_SIZE, ts_wake);
+#endif
 		if ((rcode < 0) && (errno != EINTR)) {
-			fr_strerror_printf("Failed in select: %s", fr_syserror(errno));
+			fr_strerror_printf("Failed waiting for events: %s", fr_syserror(errno));
 			el->dispatch = false;
 			return -1;
 		}
 
-		if (fr_heap_num_elements(el->times) > 0) {
-			do {
-				gettimeofday(&el->now, NULL);
+		/*
+		 *	Refresh the cached time once per wakeup.  The
+		 *	timers and socket handlers below read it with
+		 *	fr_event_now() or fr_clock_gettime().
+		 */
+		fr_clock_update();
+		fr_clock_gettime(&el->now);
+
+		if (fr_event_list_num_elements(el) > 0) {
+			when = el->now;
+			while (fr_event_run(el, &when) == 1) {
+				fr_clock_update();
+				fr_clock_gettime(&el->now);
 				when = el->now;
-			} while (fr_event_run(el, &when) == 1);
+			}
 		}
 
 		if (rcode <= 0) continue;
 
+#ifdef FR_EV_SELECT
 		for (i = 0; i < el->max_readers; i++) {
 			fr_event_fd_t *ef = &el->readers[i];
 
@@ -491,6 +962,33 @@ int fr_event_loop(fr_event_list_t *el)
 
 			if (el->changed) break;
 		}
+#else
+		for (i = 0; i < rcode; i++) {
+			fr_event_fd_t *ef;
+			int fd;
+
+#ifdef FR_EV_EPOLL
+			fd = events[i].data.fd;
+#else
+			fd = events[i].ident;
+#endif
+			if ((fd < 0) || (fd >= el->max_readers)) continue;
+
+			ef = &el->readers[fd];
+			if (ef->fd != fd) continue;
+
+			ef->handler(el, ef->fd, ef->ctx);
+
+			/*
+			 *	The handler added or removed an FD, so
+			 *	the rest of the events may be stale.
+			 *	They're level triggered, so anything we
+			 *	skip will be returned again on the next
+			 *	pass.
+			 */
+			if (el->changed) break;
+		}
+#endif
 	}
 
 	el->dispatch = false;
@@ -1,15 +1,18 @@
 /*
- * hash.c	Non-thread-safe split-ordered hash table.
+ * hash.c	Non-thread-safe open-addressing hash table.
  *
- *  The weird "reverse" function is based on an idea from
- *  "Split-Ordered Lists - Lock-free Resizable Hash Tables", with
- *  modifications so that they're not lock-free. :(
+ *  The table is a flat array of slots, using Robin Hood hashing
+ *  with linear probing.  On insert, an entry which is further from
+ *  its home slot than the incumbent takes the incumbent's place, and
+ *  the incumbent moves on.  That keeps the probe sequences short and
+ *  of similar length, and lets a failed lookup stop as soon as it
+ *  sees an entry which is closer to home than the one it's looking
+ *  for.  Deletes shift the following entries back, so there are no
+ *  tombstones.
  *
- *  However, the split-order idea allows a fast & easy splitting of the
- *  hash bucket chain when the hash table is resized.  Without it, we'd
- *  have to check & update the pointers for every node in the buck chain,
- *  rather than being able to move 1/2 of the entries in the chain with
- *  one update.
+ *  Each slot caches the hash of its entry, so that the comparison
+ *  function is only called on a probable match, and so that growing
+ *  the table never calls the hash function.
  *
  * Version:	$Id$
  *
@@ -34,224 +37,65 @@ RCSID("$Id$")
 
 #include <freeradius-devel/libradius.h>
 
+#ifdef HAVE_PTHREAD_H
+#  include <pthread.h>
+#endif
+
 /*
- *	A reasonable number of buckets to start off with.
- *	Should be a power of two.
+ *	A reasonable number of slots to start off with.
+ *	Must be a power of two.
  */
-#define FR_HASH_NUM_BUCKETS (64)
+#define FR_HASH_NUM_SLOTS (64)
 
-typedef struct fr_hash_entry_t {
-	struct fr_hash_entry_t *next;
-	uint32_t	reversed;
-	uint32_t	key;
-	void const 	*data;
-} fr_hash_entry_t;
+/*
+ *	Grow the table when it's 3/4 full.  Robin Hood hashing copes
+ *	well with high loads, but there's no point in pushing it.
+ */
+#define FR_HASH_MAX_LOAD(_slots) (((_slots) >> 1) + ((_slots) >> 2))
 
+typedef struct fr_hash_slot_t {
+	uint32_t	key;		//!< Mixed hash of the data.
+	void const	*data;		//!< NULL if the slot is empty.
+} fr_hash_slot_t;
 
 struct fr_hash_table_t {
-	int			num_elements;
-	int			num_buckets; /* power of 2 */
-	int			next_grow;
-	int			mask;
+	uint32_t		num_elements;
+	uint32_t		num_slots; /* power of 2 */
+	uint32_t		next_grow;
+	uint32_t		mask;
 
 	fr_hash_table_free_t	free;
 	fr_hash_table_hash_t	hash;
 	fr_hash_table_cmp_t	cmp;
 
-	fr_hash_entry_t	null;
-
-	fr_hash_entry_t	**buckets;
-};
-
-#ifdef TESTING
-static int grow = 0;
-#endif
-
-/*
- * perl -e 'foreach $i (0..255) {$r = 0; foreach $j (0 .. 7 ) { if (($i & ( 1<< $j)) != 0) { $r |= (1 << (7 - $j));}} print $r, ", ";if (($i & 7) == 7) {print "\n";}}'
- */
-static const uint8_t reversed_byte[256] = {
-	0,  128, 64, 192, 32, 160, 96,  224,
-	16, 144, 80, 208, 48, 176, 112, 240,
-	8,  136, 72, 200, 40, 168, 104, 232,
-	24, 152, 88, 216, 56, 184, 120, 248,
-	4,  132, 68, 196, 36, 164, 100, 228,
-	20, 148, 84, 212, 52, 180, 116, 244,
-	12, 140, 76, 204, 44, 172, 108, 236,
-	28, 156, 92, 220, 60, 188, 124, 252,
-	2,  130, 66, 194, 34, 162, 98,  226,
-	18, 146, 82, 210, 50, 178, 114, 242,
-	10, 138, 74, 202, 42, 170, 106, 234,
-	26, 154, 90, 218, 58, 186, 122, 250,
-	6,  134, 70, 198, 38, 166, 102, 230,
-	22, 150, 86, 214, 54, 182, 118, 246,
-	14, 142, 78, 206, 46, 174, 110, 238,
-	30, 158, 94, 222, 62, 190, 126, 254,
-	1,  129, 65, 193, 33, 161, 97,  225,
-	17, 145, 81, 209, 49, 177, 113, 241,
-	9,  137, 73, 201, 41, 169, 105, 233,
-	25, 153, 89, 217, 57, 185, 121, 249,
-	5,  133, 69, 197, 37, 165, 101, 229,
-	21, 149, 85, 213, 53, 181, 117, 245,
-	13, 141, 77, 205, 45, 173, 109, 237,
-	29, 157, 93, 221, 61, 189, 125, 253,
-	3,  131, 67, 195, 35, 163, 99,  227,
-	19, 147, 83, 211, 51, 179, 115, 243,
-	11, 139, 75, 203, 43, 171, 107, 235,
-	27, 155, 91, 219, 59, 187, 123, 251,
-	7,  135, 71, 199, 39, 167, 103, 231,
-	23, 151, 87, 215, 55, 183, 119, 247,
-	15, 143, 79, 207, 47, 175, 111, 239,
-	31, 159, 95, 223, 63, 191, 127, 255
-};
-
-
-/*
- * perl -e 'foreach $i (0..255) {$r = 0;foreach $j (0 .. 7) { $r = $i & (1 << (7 - $j)); last if ($r)} print $i & ~($r), ", ";if (($i & 7) == 7) {print "\n";}}'
- */
-static uint8_t parent_byte[256] = {
-	0, 0, 0, 1, 0, 1, 2, 3,
-	0, 1, 2, 3, 4, 5, 6, 7,
-	0, 1, 2, 3, 4, 5, 6, 7,
-	8, 9, 10, 11, 12, 13, 14, 15,
-	0, 1, 2, 3, 4, 5, 6, 7,
-	8, 9, 10, 11, 12, 13, 14, 15,
-	16, 17, 18, 19, 20, 21, 22, 23,
-	24, 25, 26, 27, 28, 29, 30, 31,
-	0, 1, 2, 3, 4, 5, 6, 7,
-	8, 9, 10, 11, 12, 13, 14, 15,
-	16, 17, 18, 19, 20, 21, 22, 23,
-	24, 25, 26, 27, 28, 29, 30, 31,
-	32, 33, 34, 35, 36, 37, 38, 39,
-	40, 41, 42, 43, 44, 45, 46, 47,
-	48, 49, 50, 51, 52, 53, 54, 55,
-	56, 57, 58, 59, 60, 61, 62, 63,
-	0, 1, 2, 3, 4, 5, 6, 7,
-	8, 9, 10, 11, 12, 13, 14, 15,
-	16, 17, 18, 19, 20, 21, 22, 23,
-	24, 25, 26, 27, 28, 29, 30, 31,
-	32, 33, 34, 35, 36, 37, 38, 39,
-	40, 41, 42, 43, 44, 45, 46, 47,
-	48, 49, 50, 51, 52, 53, 54, 55,
-	56, 57, 58, 59, 60, 61, 62, 63,
-	64, 65, 66, 67, 68, 69, 70, 71,
-	72, 73, 74, 75, 76, 77, 78, 79,
-	80, 81, 82, 83, 84, 85, 86, 87,
-	88, 89, 90, 91, 92, 93, 94, 95,
-	96, 97, 98, 99, 100, 101, 102, 103,
-	104, 105, 106, 107, 108, 109, 110, 111,
-	112, 113, 114, 115, 116, 117, 118, 119,
-	120, 121, 122, 123, 124, 125, 126, 127
+	fr_hash_slot_t		*slots;
 };
 
-
 /*
- *	Reverse a key.
+ *	Many of the hash functions we're given are weak in the low
+ *	bits, which are the ones we use to pick a slot.  So mix them.
  */
-static uint32_t reverse(uint32_t key)
+static inline uint32_t hash_mix(uint32_t key)
 {
-	return ((reversed_byte[key & 0xff] << 24) |
-		(reversed_byte[(key >> 8) & 0xff] << 16) |
-		(reversed_byte[(key >> 16) & 0xff] << 8) |
-		(reversed_byte[(key >> 24) & 0xff]));
-}
-
-/*
- *	Take the parent by discarding the highest bit that is set.
- */
-static uint32_t parent_of(uint32_t key)
-{
-	if (key > 0x00ffffff)
-		return (key & 0x00ffffff) | (parent_byte[key >> 24] << 24);
-
-	if (key > 0x0000ffff)
-		return (key & 0x0000ffff) | (parent_byte[key >> 16] << 16);
+	key ^= key >> 16;
+	key *= 0x85ebca6b;
+	key ^= key >> 13;
+	key *= 0xc2b2ae35;
+	key ^= key >> 16;
 
-	if (key > 0x000000ff)
-		return (key & 0x000000ff) | (parent_byte[key >> 8] << 8);
-
-	return parent_byte[key];
-}
-
-
-static fr_hash_entry_t *list_find(fr_hash_table_t *ht,
-				    fr_hash_entry_t *head,
-				    uint32_t reversed,
-				    void const *data)
-{
-	fr_hash_entry_t *cur;
-
-	for (cur = head; cur != &ht->null; cur = cur->next) {
-		if (cur->reversed == reversed) {
-			if (ht->cmp) {
-				int cmp = ht->cmp(data, cur->data);
-				if (cmp > 0) break;
-				if (cmp < 0) continue;
-			}
-			return cur;
-		}
-		if (cur->reversed > reversed) break;
-	}
-
-	return NULL;
+	return key;
 }
 
-
 /*
- *	Inserts a new entry into the list, in order.
+ *	How far the entry in slot i is from its home slot.
  */
-static int list_insert(fr_hash_table_t *ht,
-		       fr_hash_entry_t **head, fr_hash_entry_t *node)
-{
-	fr_hash_entry_t **last, *cur;
-
-	last = head;
-
-	for (cur = *head; cur != &ht->null; cur = cur->next) {
-		if (cur->reversed > node->reversed) break;
-		last = &(cur->next);
-
-		if (cur->reversed == node->reversed) {
-			if (ht->cmp) {
-				int cmp = ht->cmp(node->data, cur->data);
-				if (cmp > 0) break;
-				if (cmp < 0) continue;
-			}
-			return 0;
-		}
-	}
-
-	node->next = *last;
-	*last = node;
-
-	return 1;
-}
-
-
-/*
- *	Delete an entry from the list.
- */
-static int list_delete(fr_hash_table_t *ht,
-		       fr_hash_entry_t **head, fr_hash_entry_t *node)
-{
-	fr_hash_entry_t **last, *cur;
-
-	last = head;
-
-	for (cur = *head; cur != &ht->null; cur = cur->next) {
-		if (cur == node) break;
-		last = &(cur->next);
-	}
-
-	*last = node->next;
-	return 1;
-}
-
+#define DISTANCE(_ht, _i) (((_i) - (_ht)->slots[_i].key) & (_ht)->mask)
 
 /*
  *	Create the table.
  *
- *	Memory usage in bytes is (20/3) * number of entries.
+ *	Memory usage is at most (8/3) slots per entry, and in practice
+ *	about twice that, of 8 bytes (32-bit) or 16 bytes (64-bit).
  */
 fr_hash_table_t *fr_hash_table_create(fr_hash_table_hash_t hashNode,
 					  fr_hash_table_cmp_t cmpNode,
@@ -268,113 +112,113 @@ fr_hash_table_t *fr_hash_table_create(fr_hash_table_hash_t hashNode,
 	ht->free = freeNode;
 	ht->hash = hashNode;
 	ht->cmp = cmpNode;
-	ht->num_buckets = FR_HASH_NUM_BUCKETS;
-	ht->mask = ht->num_buckets - 1;
+	ht->num_slots = FR_HASH_NUM_SLOTS;
+	ht->mask = ht->num_slots - 1;
+	ht->next_grow = FR_HASH_MAX_LOAD(ht->num_slots);
 
-	/*
-	 *	Have a default load factor of 2.5.  In practice this
-	 *	means that the average load will hit 3 before the
-	 *	table grows.
-	 */
-	ht->next_grow = (ht->num_buckets << 1) + (ht->num_buckets >> 1);
-
-	ht->buckets = malloc(sizeof(*ht->buckets) * ht->num_buckets);
-	if (!ht->buckets) {
+	ht->slots = calloc(ht->num_slots, sizeof(*ht->slots));
+	if (!ht->slots) {
 		free(ht);
 		return NULL;
 	}
-	memset(ht->buckets, 0, sizeof(*ht->buckets) * ht->num_buckets);
-
-	ht->null.reversed = ~0;
-	ht->null.key = ~0;
-	ht->null.next = &ht->null;
-
-	ht->buckets[0] = &ht->null;
 
 	return ht;
 }
 
 
 /*
- *	If the current bucket is uninitialized, initialize it
- *	by recursively copying information from the parent.
- *
- *	We may have a situation where entry E is a parent to 2 other
- *	entries E' and E".  If we split E into E and E', then the
- *	nodes meant for E" end up in E or E', either of which is
- *	wrong.  To solve that problem, we walk down the whole chain,
- *	inserting the elements into the correct place.
+ *	Find the slot holding the data, or -1 if it isn't there.
  */
-static void fr_hash_table_fixup(fr_hash_table_t *ht, uint32_t entry)
+static int slot_find(fr_hash_table_t *ht, uint32_t key, void const *data)
 {
-	uint32_t parent_entry;
-	fr_hash_entry_t **last, *cur;
-	uint32_t this;
-
-	parent_entry = parent_of(entry);
+	uint32_t i, distance;
 
-	/* parent_entry == entry if and only if entry == 0 */
+	for (i = key & ht->mask, distance = 0;
+	     ht->slots[i].data != NULL;
+	     i = (i + 1) & ht->mask, distance++) {
+		/*
+		 *	If we had been inserted, we would have
+		 *	displaced this entry.
+		 */
+		if (DISTANCE(ht, i) < distance) break;
 
-	if (!ht->buckets[parent_entry]) {
-		fr_hash_table_fixup(ht, parent_entry);
+		if ((ht->slots[i].key == key) &&
+		    (!ht->cmp || (ht->cmp(data, ht->slots[i].data) == 0))) {
+			return i;
+		}
 	}
 
-	/*
-	 *	Keep walking down cur, trying to find entries that
-	 *	don't belong here any more.  There may be multiple
-	 *	ones, so we can't have a naive algorithm...
-	 */
-	last = &ht->buckets[parent_entry];
-	this = parent_entry;
+	return -1;
+}
 
-	for (cur = *last; cur != &ht->null; cur = cur->next) {
-		uint32_t real_entry;
 
-		real_entry = cur->key & ht->mask;
-		if (real_entry != this) { /* ht->buckets[real_entry] == NULL */
-			*last = &ht->null;
-			ht->buckets[real_entry] = cur;
-			this = real_entry;
-		}
+/*
+ *	Put data into the table.  It MUST NOT be in the table already,
+ *	and there MUST be a free slot.
+ */
+static void slot_insert(fr_hash_table_t *ht, uint32_t key, void const *data)
+{
+	uint32_t i, distance;
+	fr_hash_slot_t this, tmp;
+
+	this.key = key;
+	this.data = data;
+
+	for (i = key & ht->mask, distance = 0;
+	     ht->slots[i].data != NULL;
+	     i = (i + 1) & ht->mask, distance++) {
+		uint32_t their_distance;
 
-		last = &(cur->next);
+		their_distance = DISTANCE(ht, i);
+		if (their_distance >= distance) continue;
+
+		/*
+		 *	Take from the rich, and give to the poor.
+		 */
+		tmp = ht->slots[i];
+		ht->slots[i] = this;
+		this = tmp;
+		distance = their_distance;
 	}
 
-	/*
-	 *	We may NOT have initialized this bucket, so do it now.
-	 */
-	if (!ht->buckets[entry]) ht->buckets[entry] = &ht->null;
+	ht->slots[i] = this;
 }
 
+
 /*
- *	This should be a power of two.  Changing it to 4 doesn't seem
- *	to make any difference.
+ *	This should be a power of two.
  */
 #define GROW_FACTOR (2)
 
 /*
- *	Grow the hash table.
+ *	Grow the hash table.  The slots store the hashes, so this is
+ *	a single linear pass, with no calls to the hash function.
  */
 static void fr_hash_table_grow(fr_hash_table_t *ht)
 {
-	fr_hash_entry_t **buckets;
+	uint32_t i, num_slots;
+	fr_hash_slot_t *old;
 
-	buckets = malloc(sizeof(*buckets) * GROW_FACTOR * ht->num_buckets);
-	if (!buckets) return;
+	old = ht->slots;
+	num_slots = ht->num_slots;
 
-	memcpy(buckets, ht->buckets,
-	       sizeof(*buckets) * ht->num_buckets);
-	memset(&buckets[ht->num_buckets], 0,
-	       sizeof(*buckets) * ht->num_buckets);
+	ht->slots = calloc(num_slots * GROW_FACTOR, sizeof(*ht->slots));
+	if (!ht->slots) {
+		ht->slots = old;
+		return;
+	}
+
+	ht->num_slots = num_slots * GROW_FACTOR;
+	ht->next_grow = FR_HASH_MAX_LOAD(ht->num_slots);
+	ht->mask = ht->num_slots - 1;
+
+	for (i = 0; i < num_slots; i++) {
+		if (old[i].data) slot_insert(ht, old[i].key, old[i].data);
+	}
 
-	free(ht->buckets);
-	ht->buckets = buckets;
-	ht->num_buckets *= GROW_FACTOR;
-	ht->next_grow *= GROW_FACTOR;
-	ht->mask = ht->num_buckets - 1;
+	free(old);
 #ifdef TESTING
-	grow = 1;
-	fprintf(stderr, "GROW TO %d\n", ht->num_buckets);
+	fprintf(stderr, "GROW TO %u\n", ht->num_slots);
 #endif
 }
 
@@ -385,68 +229,28 @@ static void fr_hash_table_grow(fr_hash_table_t *ht)
 int fr_hash_table_insert(fr_hash_table_t *ht, void const *data)
 {
 	uint32_t key;
-	uint32_t entry;
-	uint32_t reversed;
-	fr_hash_entry_t *node;
 
 	if (!ht || !data) return 0;
 
-	key = ht->hash(data);
-	entry = key & ht->mask;
-	reversed = reverse(key);
-
-	if (!ht->buckets[entry]) fr_hash_table_fixup(ht, entry);
-
-	/*
-	 *	If we try to do our own memory allocation here, the
-	 *	speedup is only ~15% or so, which isn't worth it.
-	 */
-	node = malloc(sizeof(*node));
-	if (!node) return 0;
-	memset(node, 0, sizeof(*node));
-
-	node->next = &ht->null;
-	node->reversed = reversed;
-	node->key = key;
-	node->data = data;
+	key = hash_mix(ht->hash(data));
 
 	/* already in the table, can't insert it */
-	if (!list_insert(ht, &ht->buckets[entry], node)) {
-		free(node);
-		return 0;
-	}
+	if (slot_find(ht, key, data) >= 0) return 0;
 
 	/*
 	 *	Check the load factor, and grow the table if
-	 *	necessary.
+	 *	necessary.  If we can't grow it, keep on going
+	 *	until it's full.
 	 */
-	ht->num_elements++;
 	if (ht->num_elements >= ht->next_grow) {
 		fr_hash_table_grow(ht);
+		if ((ht->num_elements + 1) >= ht->num_slots) return 0;
 	}
 
-	return 1;
-}
-
-
-/*
- *	Internal find a node routine.
- */
-static fr_hash_entry_t *fr_hash_table_find(fr_hash_table_t *ht, void const *data)
-{
-	uint32_t key;
-	uint32_t entry;
-	uint32_t reversed;
-
-	if (!ht) return NULL;
-
-	key = ht->hash(data);
-	entry = key & ht->mask;
-	reversed = reverse(key);
-
-	if (!ht->buckets[entry]) fr_hash_table_fixup(ht, entry);
+	slot_insert(ht, key, data);
+	ht->num_elements++;
 
-	return list_find(ht, ht->buckets[entry], reversed, data);
+	return 1;
 }
 
 
@@ -455,21 +259,21 @@ static fr_hash_entry_t *fr_hash_table_find(fr_hash_table_t *ht, void const *data
  */
 int fr_hash_table_replace(fr_hash_table_t *ht, void const *data)
 {
-	fr_hash_entry_t *node;
+	int i;
 	void *tofree;
 
 	if (!ht || !data) return 0;
 
-	node = fr_hash_table_find(ht, data);
-	if (!node) {
+	i = slot_find(ht, hash_mix(ht->hash(data)), data);
+	if (i < 0) {
 		return fr_hash_table_insert(ht, data);
 	}
 
 	if (ht->free) {
-		memcpy(&tofree, &node->data, sizeof(tofree));
+		memcpy(&tofree, &ht->slots[i].data, sizeof(tofree));
 		ht->free(tofree);
 	}
-	node->data = data;
+	ht->slots[i].data = data;
 
 	return 1;
 }
@@ -480,13 +284,15 @@ int fr_hash_table_replace(fr_hash_table_t *ht, void const *data)
  */
 void *fr_hash_table_finddata(fr_hash_table_t *ht, void const *data)
 {
-	fr_hash_entry_t *node;
+	int i;
 	void *out;
 
-	node = fr_hash_table_find(ht, data);
-	if (!node) return NULL;
+	if (!ht) return NULL;
+
+	i = slot_find(ht, hash_mix(ht->hash(data)), data);
+	if (i < 0) return NULL;
 
-	memcpy(&out, &node->data, sizeof(out));
+	memcpy(&out, &ht->slots[i].data, sizeof(out));
 
 	return out;
 }
@@ -498,29 +304,33 @@ void *fr_hash_table_finddata(fr_hash_table_t *ht, void const *data)
  */
 void *fr_hash_table_yank(fr_hash_table_t *ht, void const *data)
 {
-	uint32_t key;
-	uint32_t entry;
-	uint32_t reversed;
+	int found;
+	uint32_t i, next;
 	void *old;
-	fr_hash_entry_t *node;
 
 	if (!ht) return NULL;
 
-	key = ht->hash(data);
-	entry = key & ht->mask;
-	reversed = reverse(key);
+	found = slot_find(ht, hash_mix(ht->hash(data)), data);
+	if (found < 0) return NULL;
 
-	if (!ht->buckets[entry]) fr_hash_table_fixup(ht, entry);
+	i = found;
+	memcpy(&old, &ht->slots[i].data, sizeof(old));
 
-	node = list_find(ht, ht->buckets[entry], reversed, data);
-	if (!node) return NULL;
+	/*
+	 *	Shift the following entries back by one, until we
+	 *	find an empty slot, or one which is already home.
+	 */
+	for (next = (i + 1) & ht->mask;
+	     (ht->slots[next].data != NULL) && (DISTANCE(ht, next) != 0);
+	     next = (next + 1) & ht->mask) {
+		ht->slots[i] = ht->slots[next];
+		i = next;
+	}
 
-	list_delete(ht, &ht->buckets[entry], node);
+	ht->slots[i].key = 0;
+	ht->slots[i].data = NULL;
 	ht->num_elements--;
 
-	memcpy(&old, &node->data, sizeof(old));
-	free(node);
-
 	return old;
 }
 
@@ -546,34 +356,20 @@ int fr_hash_table_delete(fr_hash_table_t *ht, void const *data)
  */
 void fr_hash_table_free(fr_hash_table_t *ht)
 {
-	int i;
-	fr_hash_entry_t *node, *next;
+	uint32_t i;
 
 	if (!ht) return;
 
-	/*
-	 *	Walk over the buckets, freeing them all.
-	 */
-	for (i = 0; i < ht->num_buckets; i++) {
-		if (ht->buckets[i]) for (node = ht->buckets[i];
-					 node != &ht->null;
-					 node = next) {
-			next = node->next;
-
-			if (!node->data) continue; /* dummy entry */
+	if (ht->free) for (i = 0; i < ht->num_slots; i++) {
+		void *tofree;
 
+		if (!ht->slots[i].data) continue;
 
-			if (ht->free) {
-				void *tofree;
-				memcpy(&tofree, &node->data, sizeof(tofree));
-				ht->free(tofree);
-			}
-
-			free(node);
-		}
+		memcpy(&tofree, &ht->slots[i].data, sizeof(tofree));
+		ht->free(tofree);
 	}
 
-	free(ht->buckets);
+	free(ht->slots);
 	free(ht);
 }
 
@@ -590,34 +386,38 @@ int fr_hash_table_num_elements(fr_hash_table_t *ht)
 
 
 /*
- *	Walk over the nodes, allowing deletes & inserts to happen.
+ *	Walk over the nodes, allowing the callback to delete the
+ *	entry it was given.
+ *
+ *	We walk backwards, so a delete only ever shifts entries we've
+ *	already seen into the slots we're yet to see.  We start just
+ *	below an empty slot, or one which is at home, so the shifting
+ *	can't wrap around and pull in entries from the end of the walk.
  */
 int fr_hash_table_walk(fr_hash_table_t *ht,
 			 fr_hash_table_walk_t callback,
 			 void *context)
 {
-	int i, rcode;;
+	uint32_t i, start, count;
+	int rcode;
 
 	if (!ht || !callback) return 0;
 
-	for (i = ht->num_buckets - 1; i >= 0; i--) {
-		fr_hash_entry_t *node, *next;
-
-		/*
-		 *	Ensure that the current bucket is filled.
-		 */
-		if (!ht->buckets[i]) fr_hash_table_fixup(ht, i);
+	for (start = ht->mask; start > 0; start--) {
+		i = (start + 1) & ht->mask;
+		if (!ht->slots[i].data || (DISTANCE(ht, i) == 0)) break;
+	}
 
-		for (node = ht->buckets[i]; node != &ht->null; node = next) {
-			void *arg;
+	for (count = 0; count < ht->num_slots; count++) {
+		void *arg;
 
-			next = node->next;
+		i = (start - count) & ht->mask;
+		if (!ht->slots[i].data) continue;
 
-			memcpy(&arg, node->data, sizeof(arg));
-			rcode = callback(context, arg);
+		memcpy(&arg, &ht->slots[i].data, sizeof(arg));
+		rcode = callback(context, arg);
 
-			if (rcode != 0) return rcode;
-		}
+		if (rcode != 0) return rcode;
 	}
 
 	return 0;
@@ -630,69 +430,35 @@ int fr_hash_table_walk(fr_hash_table_t *ht,
  */
 int fr_hash_table_info(fr_hash_table_t *ht)
 {
-	int i, a, collisions, uninitialized;
+	uint32_t i, distance, max = 0, total = 0;
 	int array[256];
 
 	if (!ht) return 0;
 
-	uninitialized = collisions = 0;
 	memset(array, 0, sizeof(array));
 
-	for (i = 0; i < ht->num_buckets; i++) {
-		uint32_t key;
-		int load;
-		fr_hash_entry_t *node, *next;
+	for (i = 0; i < ht->num_slots; i++) {
+		if (!ht->slots[i].data) continue;
 
-		/*
-		 *	If we haven't inserted or looked up an entry
-		 *	in a bucket, it's uninitialized.
-		 */
-		if (!ht->buckets[i]) {
-			uninitialized++;
-			continue;
-		}
+		distance = DISTANCE(ht, i);
+		total += distance;
+		if (distance > max) max = distance;
 
-		load = 0;
-		key = ~0;
-		for (node = ht->buckets[i]; node != &ht->null; node = next) {
-			if (node->reversed == key) {
-				collisions++;
-			} else {
-				key = node->reversed;
-			}
-			next = node->next;
-			load++;
-		}
-
-		if (load > 255) load = 255;
-		array[load]++;
+		if (distance > 255) distance = 255;
+		array[distance]++;
 	}
 
-	printf("HASH TABLE %p\tbuckets: %d\t(%d uninitialized)\n", ht,
-		ht->num_buckets, uninitialized);
-	printf("\tnum entries %d\thash collisions %d\n",
-		ht->num_elements, collisions);
+	printf("HASH TABLE %p\tslots: %u\n", ht, ht->num_slots);
+	printf("\tnum entries %u\tmax probe distance %u\n",
+		ht->num_elements, max);
 
-	a = 0;
-	for (i = 1; i < 256; i++) {
+	for (i = 0; i < 256; i++) {
 		if (!array[i]) continue;
-		printf("%d\t%d\n", i, array[i]);
-
-		/*
-		 *	Since the entries are ordered, the lookup cost
-		 *	for any one element in a chain is (on average)
-		 *	the cost of walking half of the chain.
-		 */
-		if (i > 1) {
-			a += array[i] * i;
-		}
+		printf("%u\t%d\n", i, array[i]);
 	}
-	a /= 2;
-	a += array[1];
 
-	printf("\texpected lookup cost = %d/%d or %f\n\n",
-	       ht->num_elements, a,
-	       (float) ht->num_elements / (float) a);
+	printf("\texpected lookup cost = %f\n\n",
+	       ht->num_elements ? 1.0 + ((float) total / (float) ht->num_elements) : 0.0);
 
 	return 0;
 }
@@ -773,6 +539,123 @@ uint32_t fr_hash_string(char const *p)
 	return hash;
 }
 
+#ifndef WITH_FNV_HASH
+/*
+ *	SipHash-1-3.  It reads the data 8 octets at a time, and with
+ *	a secret key, finding keys which collide is impractical.
+ *
+ *	See https://131002.net/siphash/
+ */
+#define ROTL64(_x, _b) (uint64_t)(((_x) << (_b)) | ((_x) >> (64 - (_b))))
+
+#define SIPROUND do { \
+	v0 += v1; v1 = ROTL64(v1, 13); v1 ^= v0; v0 = ROTL64(v0, 32); \
+	v2 += v3; v3 = ROTL64(v3, 16); v3 ^= v2; \
+	v0 += v3; v3 = ROTL64(v3, 21); v3 ^= v0; \
+	v2 += v1; v1 = ROTL64(v1, 17); v1 ^= v2; v2 = ROTL64(v2, 32); \
+} while (0)
+
+static uint64_t hash_key[2];
+
+static void hash_key_init(void)
+{
+	hash_key[0] = (((uint64_t) fr_rand()) << 32) | fr_rand();
+	hash_key[1] = (((uint64_t) fr_rand()) << 32) | fr_rand();
+}
+
+#ifdef HAVE_PTHREAD_H
+static pthread_once_t hash_key_once = PTHREAD_ONCE_INIT;
+#  define HASH_KEY_INIT pthread_once(&hash_key_once, hash_key_init)
+#else
+static bool hash_key_done = false;
+#  define HASH_KEY_INIT do { if (!hash_key_done) { hash_key_init(); hash_key_done = true; } } while (0)
+#endif
+
+static uint32_t hash_siphash(void const *data, size_t size, uint64_t k0, uint64_t k1)
+{
+	uint8_t const	*p = data;
+	uint8_t const	*end = p + (size & ~((size_t) 7));
+	uint64_t	v0 = k0 ^ 0x736f6d6570736575ULL;
+	uint64_t	v1 = k1 ^ 0x646f72616e646f6dULL;
+	uint64_t	v2 = k0 ^ 0x6c7967656e657261ULL;
+	uint64_t	v3 = k1 ^ 0x7465646279746573ULL;
+	uint64_t	m, b = ((uint64_t) size) << 56;
+
+	/*
+	 *	The values are never stored, so the byte order of
+	 *	the words doesn't matter.
+	 */
+	for (; p != end; p += 8) {
+		memcpy(&m, p, sizeof(m));
+		v3 ^= m;
+		SIPROUND;
+		v0 ^= m;
+	}
+
+	switch (size & 7) {
+	case 7: b |= ((uint64_t) p[6]) << 48;	/* FALL-THROUGH */
+	case 6: b |= ((uint64_t) p[5]) << 40;	/* FALL-THROUGH */
+	case 5: b |= ((uint64_t) p[4]) << 32;	/* FALL-THROUGH */
+	case 4: b |= ((uint64_t) p[3]) << 24;	/* FALL-THROUGH */
+	case 3: b |= ((uint64_t) p[2]) << 16;	/* FALL-THROUGH */
+	case 2: b |= ((uint64_t) p[1]) << 8;	/* FALL-THROUGH */
+	case 1: b |= ((uint64_t) p[0]);		/* FALL-THROUGH */
+	default: break;
+	}
+
+	v3 ^= b;
+	SIPROUND;
+	v0 ^= b;
+
+	v2 ^= 0xff;
+	SIPROUND;
+	SIPROUND;
+	SIPROUND;
+
+	m = v0 ^ v1 ^ v2 ^ v3;
+
+	return (uint32_t) (m ^ (m >> 32));
+}
+
+uint32_t fr_hash_keyed(void const *data, size_t size)
+{
+	HASH_KEY_INIT;
+
+	return hash_siphash(data, size, hash_key[0], hash_key[1]);
+}
+
+/*
+ *	The previous hash becomes part of the key, so that the
+ *	result depends on all of the data.
+ */
+uint32_t fr_hash_keyed_update(void const *data, size_t size, uint32_t hash)
+{
+	HASH_KEY_INIT;
+
+	return hash_siphash(data, size, hash_key[0] ^ hash, hash_key[1]);
+}
+
+uint32_t fr_hash_keyed_string(char const *p)
+{
+	return fr_hash_keyed(p, strlen(p));
+}
+#else
+uint32_t fr_hash_keyed(void const *data, size_t size)
+{
+	return fr_hash(data, size);
+}
+
+uint32_t fr_hash_keyed_update(void const *data, size_t size, uint32_t hash)
+{
+	return fr_hash_update(data, size, hash);
+}
+
+uint32_t fr_hash_keyed_string(char const *p)
+{
+	return fr_hash_string(p);
+}
+#endif
+
 
 #ifdef TESTING
 /*
@@ -4,34 +4,64 @@ RCSID("$Id$")
 #include <freeradius-devel/heap.h>
 
 /*
- *	A heap entry is made of a pointer to the object, which
- *	contains the key.  The heap itself is an array of pointers.
+ *	A heap entry is made of a pointer to the object, and (for
+ *	heaps created with fr_heap_create_keyed()) a copy of its key.
+ *	The heap itself is an array of entries.  Comparing keyed
+ *	entries never touches the objects, so sifting through a large
+ *	heap only reads the heap array.
  *
  *	Heaps normally support only ordered insert, and extraction
  *	of the minimum element.  The heap entry can contain an "int"
  *	field that holds the entries position in the heap.  The offset
  *	of the field is held inside of the heap structure.
  */
+typedef struct fr_heap_entry_t {
+	uint64_t	key;
+	void		*data;
+} fr_heap_entry_t;
 
 struct fr_heap_t {
 	int size;
 	int num_elements;
 	size_t offset;
 	fr_heap_cmp_t cmp;
-	void **p;
+	fr_heap_key_t key;
+	fr_heap_entry_t *p;
 };
 
 /*
- *	First node in a heap is element 0. Children of i are 2i+1 and
- *	2i+2.  These macros wrap the logic, so the code is more
- *	descriptive.
+ *	First node in a heap is element 0.  Each node has four
+ *	children, which are next to each other, so a sift down reads
+ *	one or two cache lines per level, and there are half as many
+ *	levels as in a binary heap.
  */
-#define HEAP_PARENT(x) ( ( (x) - 1 ) / 2 )
-#define HEAP_LEFT(x) ( 2*(x) + 1 )
-#define HEAP_RIGHT(x) ( 2*(x) + 2 )
-#define	HEAP_SWAP(a, b) { void *_tmp = a; a = b; b = _tmp; }
+#define HEAP_ARITY (4)
+#define HEAP_PARENT(x) ( ( (x) - 1 ) / HEAP_ARITY )
+#define HEAP_CHILD(x) ( HEAP_ARITY*(x) + 1 )
 
-static int fr_heap_bubble(fr_heap_t *hp, int child);
+/*
+ *	If offset > 0 the position (index, int) of the element in the
+ *	heap is also stored in the element itself at the given offset
+ *	in bytes.
+ */
+#define SET_OFFSET(heap, node) \
+    if (heap->offset) \
+	    *((int *)(((uint8_t *)heap->p[node].data) + heap->offset)) = node
+
+/*
+ *	RESET_OFFSET is used for sanity checks. It sets offset to an
+ *	invalid value.
+ */
+#define RESET_OFFSET(heap, node) \
+    if (heap->offset) \
+	    *((int *)(((uint8_t *)heap->p[node].data) + heap->offset)) = -1
+
+static inline bool heap_less(fr_heap_t const *hp, fr_heap_entry_t const *a, fr_heap_entry_t const *b)
+{
+	if (hp->key) return (a->key < b->key);
+
+	return (hp->cmp(a->data, b->data) < 0);
+}
 
 void fr_heap_delete(fr_heap_t *hp)
 {
@@ -41,12 +71,10 @@ void fr_heap_delete(fr_heap_t *hp)
 	free(hp);
 }
 
-fr_heap_t *fr_heap_create(fr_heap_cmp_t cmp, size_t offset)
+static fr_heap_t *heap_alloc(fr_heap_cmp_t cmp, fr_heap_key_t key, size_t offset)
 {
 	fr_heap_t *fh;
 
-	if (!cmp) return NULL;
-
 	fh = malloc(sizeof(*fh));
 	if (!fh) return NULL;
 
@@ -60,93 +88,182 @@ fr_heap_t *fr_heap_create(fr_heap_cmp_t cmp, size_t offset)
 	}
 
 	fh->cmp = cmp;
+	fh->key = key;
 	fh->offset = offset;
 
 	return fh;
 }
 
-/*
- *	Insert element in heap. Normally, p != NULL, we insert p in a
- *	new position and bubble up. If p == NULL, then the element is
- *	already in place, and key is the position where to start the
- *	bubble-up.
+fr_heap_t *fr_heap_create(fr_heap_cmp_t cmp, size_t offset)
+{
+	if (!cmp) return NULL;
+
+	return heap_alloc(cmp, NULL, offset);
+}
+
+/** Create a heap ordered by an integer key
  *
- *	Returns 1 on failure (cannot allocate new heap entry)
+ * The key is read once, when the element is inserted, and is kept
+ * in the heap.  It must not change while the element is in the heap.
  *
- *	If offset > 0 the position (index, int) of the element in the
- *	heap is also stored in the element itself at the given offset
- *	in bytes.
+ * @param key function returning the key of an element.  Smaller keys
+ *	are extracted first.
+ * @param offset of the "int" in the element which holds its position,
+ *	or 0.
+ * @return the new heap, or NULL on error.
  */
-#define SET_OFFSET(heap, node) \
-    if (heap->offset) \
-	    *((int *)(((uint8_t *)heap->p[node]) + heap->offset)) = node
+fr_heap_t *fr_heap_create_keyed(fr_heap_key_t key, size_t offset)
+{
+	if (!key) return NULL;
+
+	return heap_alloc(NULL, key, offset);
+}
 
 /*
- *	RESET_OFFSET is used for sanity checks. It sets offset to an
- *	invalid value.
+ *	Make room for "num" more elements.
  */
-#define RESET_OFFSET(heap, node) \
-    if (heap->offset) \
-	    *((int *)(((uint8_t *)heap->p[node]) + heap->offset)) = -1
-
-int fr_heap_insert(fr_heap_t *hp, void *data)
+static int heap_grow(fr_heap_t *hp, int num)
 {
-	int child = hp->num_elements;
+	int size = hp->size;
+	fr_heap_entry_t *p;
 
-	/*
-	 *	Heap is full.  Double it's size.
-	 */
-	if (child == hp->size) {
-		void **p;
+	if ((hp->num_elements + num) <= size) return 1;
 
-		p = malloc(2 * hp->size * sizeof(*p));
-		if (!p) return 0;
+	while ((hp->num_elements + num) > size) size *= 2;
 
-		memcpy(p, hp->p, sizeof(*p) * hp->size);
-		free(hp->p);
-		hp->p = p;
-		hp->size *= 2;
-	}
+	p = malloc(size * sizeof(*p));
+	if (!p) return 0;
 
-	hp->p[child] = data;
-	hp->num_elements++;
+	memcpy(p, hp->p, sizeof(*p) * hp->num_elements);
+	free(hp->p);
+	hp->p = p;
+	hp->size = size;
 
-	return fr_heap_bubble(hp, child);
+	return 1;
 }
 
-
-static int fr_heap_bubble(fr_heap_t *hp, int child)
+/*
+ *	Move the element at "child" up, until its parent is smaller.
+ */
+static void heap_sift_up(fr_heap_t *hp, int child)
 {
-	/*
-	 *	Bubble up the element.
-	 */
+	fr_heap_entry_t entry = hp->p[child];
+
 	while (child > 0) {
 		int parent = HEAP_PARENT(child);
 
 		/*
 		 *	Parent is smaller than the child.  We're done.
 		 */
-		if (hp->cmp(hp->p[parent], hp->p[child]) < 0) break;
+		if (heap_less(hp, &hp->p[parent], &entry)) break;
 
-		/*
-		 *	Child is smaller than the parent, repeat.
-		 */
-		HEAP_SWAP(hp->p[child], hp->p[parent]);
+		hp->p[child] = hp->p[parent];
 		SET_OFFSET(hp, child);
 		child = parent;
 	}
+
+	hp->p[child] = entry;
 	SET_OFFSET(hp, child);
+}
+
+/*
+ *	Move the element at "parent" down, until its smallest child
+ *	is larger.
+ */
+static void heap_sift_down(fr_heap_t *hp, int parent)
+{
+	fr_heap_entry_t entry = hp->p[parent];
+
+	while (true) {
+		int i, child, last;
+
+		child = HEAP_CHILD(parent);
+		if (child >= hp->num_elements) break;
+
+		last = child + HEAP_ARITY;
+		if (last > hp->num_elements) last = hp->num_elements;
+
+		for (i = child + 1; i < last; i++) {
+			if (heap_less(hp, &hp->p[i], &hp->p[child])) child = i;
+		}
+
+		if (!heap_less(hp, &hp->p[child], &entry)) break;
+
+		hp->p[parent] = hp->p[child];
+		SET_OFFSET(hp, parent);
+		parent = child;
+	}
+
+	hp->p[parent] = entry;
+	SET_OFFSET(hp, parent);
+}
+
+/*
+ *	Insert element in heap.
+ *
+ *	Returns 0 on failure (cannot allocate new heap entry)
+ */
+int fr_heap_insert(fr_heap_t *hp, void *data)
+{
+	int child = hp->num_elements;
+
+	if (!heap_grow(hp, 1)) return 0;
+
+	hp->p[child].data = data;
+	hp->p[child].key = hp->key ? hp->key(data) : 0;
+	hp->num_elements++;
+
+	heap_sift_up(hp, child);
 
 	return 1;
 }
 
+/** Insert many elements at once
+ *
+ * When there are more new elements than old ones, the heap is
+ * rebuilt bottom-up in one O(n) pass, instead of sifting each new
+ * element up.
+ *
+ * @param hp to insert into.
+ * @param data array of elements to insert.
+ * @param num number of elements in the array.
+ * @return 1 on success, 0 on failure (cannot allocate new heap entries).
+ */
+int fr_heap_insert_bulk(fr_heap_t *hp, void **data, int num)
+{
+	int i;
+
+	if (num <= 0) return 1;
+
+	if (!heap_grow(hp, num)) return 0;
+
+	if (num <= hp->num_elements) {
+		for (i = 0; i < num; i++) fr_heap_insert(hp, data[i]);
+
+		return 1;
+	}
+
+	for (i = 0; i < num; i++) {
+		int child = hp->num_elements++;
+
+		hp->p[child].data = data[i];
+		hp->p[child].key = hp->key ? hp->key(data[i]) : 0;
+		SET_OFFSET(hp, child);
+	}
+
+	for (i = HEAP_PARENT(hp->num_elements - 1); i >= 0; i--) {
+		heap_sift_down(hp, i);
+	}
+
+	return 1;
+}
 
 /*
  *	Remove the top element, or object.
  */
 int fr_heap_extract(fr_heap_t *hp, void *data)
 {
-	int child, parent;
+	int parent;
 	int max;
 
 	if (!hp || (hp->num_elements == 0)) return 0;
@@ -171,33 +288,23 @@ int fr_heap_extract(fr_heap_t *hp, void *data)
 	}
 
 	RESET_OFFSET(hp, parent);
-	child = HEAP_LEFT(parent);
-	while (child <= max) {
-		/*
-		 *	Maybe take the right child.
-		 */
-		if ((child != max) &&
-		    (hp->cmp(hp->p[child + 1], hp->p[child]) < 0)) {
-			child = child + 1;
-		}
-		hp->p[parent] = hp->p[child];
-		SET_OFFSET(hp, parent);
-		parent = child;
-		child = HEAP_LEFT(child);
-	}
 	hp->num_elements--;
 
 	/*
-	 *	We didn't end up at the last element in the heap.
-	 *	This element has to be re-inserted.
+	 *	It was the last element in the heap, so there's no
+	 *	hole to fill.
 	 */
-	if (parent != max) {
-		/*
-		 *	Fill hole with last entry and bubble up,
-		 *	reusing the insert code
-		 */
-		hp->p[parent] = hp->p[max];
-		return fr_heap_bubble(hp, parent);
+	if (parent == max) return 1;
+
+	/*
+	 *	Fill the hole with the last entry, and move it up or
+	 *	down to where it belongs.
+	 */
+	hp->p[parent] = hp->p[max];
+	if ((parent > 0) && heap_less(hp, &hp->p[parent], &hp->p[HEAP_PARENT(parent)])) {
+		heap_sift_up(hp, parent);
+	} else {
+		heap_sift_down(hp, parent);
 	}
 
 	return 1;
@@ -211,7 +318,7 @@ void *fr_heap_peek(fr_heap_t *hp)
 	/*
 	 *	If this is NULL, we have a problem.
 	 */
-	return hp->p[0];
+	return hp->p[0].data;
 }
 
 int fr_heap_num_elements(fr_heap_t *hp)
@@ -230,7 +337,7 @@ static bool fr_heap_check(fr_heap_t *hp, void *data)
 	if (!hp || (hp->num_elements == 0)) return false;
 
 	for (i = 0; i < hp->num_elements; i++) {
-		if (hp->p[i] == data) {
+		if (hp->p[i].data == data) {
 			return true;
 		}
 	}
@@ -238,6 +345,33 @@ static bool fr_heap_check(fr_heap_t *hp, void *data)
 	return false;
 }
 
+/*
+ *	Every child is no smaller than its parent, and every element
+ *	knows where it is.
+ */
+static bool fr_heap_verify(fr_heap_t *hp)
+{
+	int i;
+
+	for (i = 1; i < hp->num_elements; i++) {
+		if (heap_less(hp, &hp->p[i], &hp->p[HEAP_PARENT(i)])) {
+			fprintf(stderr, "Element %d is smaller than its parent %d\n", i, HEAP_PARENT(i));
+			return false;
+		}
+	}
+
+	if (!hp->offset) return true;
+
+	for (i = 0; i < hp->num_elements; i++) {
+		if (*((int *)(((uint8_t *)hp->p[i].data) + hp->offset)) != i) {
+			fprintf(stderr, "Element %d has the wrong offset\n", i);
+			return false;
+		}
+	}
+
+	return true;
+}
+
 typedef struct heap_thing {
 	int data;
 	int heap;		/* for the heap */
@@ -247,7 +381,7 @@ typedef struct heap_thing {
 /*
  *  cc -g -DTESTING -I .. heap.c -o heap
  *
- *  ./heap
+ *  ./heap [skip]
  */
 static int heap_cmp(void const *one, void const *two)
 {
@@ -261,45 +395,84 @@ static int heap_cmp(void const *one, void const *two)
 
 }
 
+static uint64_t heap_key(void const *one)
+{
+	heap_thing const *a = (heap_thing const *) one;
+
+	return a->data;
+}
+
 #define ARRAY_SIZE (1024)
 
-int main(int argc, char **argv)
+/*
+ *	Fill the heap, remove every "skip"th element from the middle,
+ *	then check that the rest come out in order.
+ *
+ *	"bulk" inserts the first eighth one at a time, the next
+ *	eighth in bulk (which sifts each one up, as there are no more
+ *	new elements than old), and the rest in bulk (which rebuilds
+ *	the heap).
+ */
+static void heap_test(fr_heap_t *hp, int skip, bool bulk)
 {
-	fr_heap_t *hp;
 	int i;
 	heap_thing array[ARRAY_SIZE];
-	int skip = 0;
-	int left;
+	void *data[ARRAY_SIZE];
+	int left, last;
 
-	if (argc > 1) {
-		skip = atoi(argv[1]);
+	/*
+	 *	Elements inserted in bulk are all smaller than the ones
+	 *	already in the heap, so they have to be moved to the top.
+	 */
+	for (i = 0; i < ARRAY_SIZE; i++) {
+		array[i].data = rand() % 32768;
+		if (bulk && (i < ARRAY_SIZE / 8)) array[i].data += 32768;
+		data[i] = &array[i];
 	}
 
-	hp = fr_heap_create(heap_cmp, offsetof(heap_thing, heap));
-	if (!hp) {
-		fprintf(stderr, "Failed creating heap!\n");
-		fr_exit(1);
-	}
+	if (!bulk) {
+		for (i = 0; i < ARRAY_SIZE; i++) {
+			if (!fr_heap_insert(hp, &array[i])) {
+				fprintf(stderr, "Failed inserting %d\n", i);
+				fr_exit(1);
+			}
 
-	for (i = 0; i < ARRAY_SIZE; i++) {
-		array[i].data = rand() % 65537;
-		if (!fr_heap_insert(hp, &array[i])) {
-			fprintf(stderr, "Failed inserting %d\n", i);
+			if (!fr_heap_check(hp, &array[i])) {
+				fprintf(stderr, "Inserted but not in heap %d\n", i);
+				fr_exit(1);
+			}
+		}
+	} else {
+		for (i = 0; i < ARRAY_SIZE / 8; i++) {
+			if (!fr_heap_insert(hp, &array[i])) {
+				fprintf(stderr, "Failed inserting %d\n", i);
+				fr_exit(1);
+			}
+		}
+
+		if (!fr_heap_insert_bulk(hp, &data[ARRAY_SIZE / 8], ARRAY_SIZE / 8) ||
+		    !fr_heap_verify(hp)) {
+			fprintf(stderr, "Failed inserting in bulk\n");
 			fr_exit(1);
 		}
 
-		if (!fr_heap_check(hp, &array[i])) {
-			fprintf(stderr, "Inserted but not in heap %d\n", i);
+		if (!fr_heap_insert_bulk(hp, &data[ARRAY_SIZE / 4], ARRAY_SIZE - (ARRAY_SIZE / 4))) {
+			fprintf(stderr, "Failed inserting in bulk\n");
 			fr_exit(1);
 		}
+
+		for (i = 0; i < ARRAY_SIZE; i++) {
+			if (!fr_heap_check(hp, &array[i])) {
+				fprintf(stderr, "Inserted but not in heap %d\n", i);
+				fr_exit(1);
+			}
+		}
 	}
 
-#if 0
-	for (i = 0; i < ARRAY_SIZE; i++) {
-		printf("Array %d has value %d at offset %d\n",
-		       i, array[i].data, array[i].heap);
+	if ((fr_heap_num_elements(hp) != ARRAY_SIZE) || !fr_heap_verify(hp)) {
+		fprintf(stderr, "Heap is wrong after inserting\n");
+		fr_exit(1);
 	}
-#endif
 
 	if (skip) {
 		int entry;
@@ -322,12 +495,18 @@ int main(int argc, char **argv)
 				fprintf(stderr, "heap offset is wrong %d\n", entry);
 				fr_exit(1);
 			}
+
+			if (!fr_heap_verify(hp)) {
+				fprintf(stderr, "Heap is wrong after removing %d\n", entry);
+				fr_exit(1);
+			}
 		}
 	}
 
 	left = fr_heap_num_elements(hp);
 	printf("%d elements left in the heap\n", left);
 
+	last = -1;
 	for (i = 0; i < left; i++) {
 		heap_thing *t = fr_heap_peek(hp);
 
@@ -336,7 +515,11 @@ int main(int argc, char **argv)
 			fr_exit(1);
 		}
 
-		printf("%d\t%d\n", i, t->data);
+		if (t->data < last) {
+			fprintf(stderr, "Extracted %d after %d\n", t->data, last);
+			fr_exit(1);
+		}
+		last = t->data;
 
 		if (!fr_heap_extract(hp, NULL)) {
 			fprintf(stderr, "Failed extracting %d\n", i);
@@ -348,7 +531,35 @@ int main(int argc, char **argv)
 		fprintf(stderr, "%d elements left at the end", fr_heap_num_elements(hp));
 		fr_exit(1);
 	}
+}
+
+int main(int argc, char **argv)
+{
+	fr_heap_t *hp;
+	int skip = 0;
+
+	if (argc > 1) {
+		skip = atoi(argv[1]);
+	}
+
+	hp = fr_heap_create(heap_cmp, offsetof(heap_thing, heap));
+	if (!hp) {
+		fprintf(stderr, "Failed creating heap!\n");
+		fr_exit(1);
+	}
+
+	heap_test(hp, skip, false);
+	heap_test(hp, skip, true);
+	fr_heap_delete(hp);
+
+	hp = fr_heap_create_keyed(heap_key, offsetof(heap_thing, heap));
+	if (!hp) {
+		fprintf(stderr, "Failed creating keyed heap!\n");
+		fr_exit(1);
+	}
 
+	heap_test(hp, skip, false);
+	heap_test(hp, skip, true);
 	fr_heap_delete(hp);
 
 	return 0;
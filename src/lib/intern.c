@@ -0,0 +1,348 @@
+/*
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ *  Copyright 2016  The FreeRADIUS server project
+ */
+
+/**
+ * $Id$
+ *
+ * @file intern.c
+ * @brief Shared, immutable copies of attribute values.
+ *
+ * Attributes such as Called-Station-Id and NAS-Identifier have the same
+ * few values in most packets.  For attributes with the "intern" flag,
+ * data2vp() asks the attribute's table for the value, and every VP with
+ * that value uses the same buffer, instead of allocating its own.
+ *
+ * Each buffer is the only child of an fr_intern_entry_t, which counts
+ * the VPs using it, plus one for the table while the entry is in it.
+ * The table is bounded.  When it's full, the least recently used entry
+ * is removed, and is freed once the last VP using it has been freed.
+ * The values come from the network, so they're hashed with
+ * fr_hash_keyed().
+ *
+ * The VPs may be freed by any thread, and talloc references aren't
+ * thread safe, so the counts are atomic, and are managed by the
+ * VALUE_PAIR code instead of by talloc.
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/libradius.h>
+
+#ifdef HAVE_PTHREAD_H
+#  include <pthread.h>
+#  define PTHREAD_MUTEX_LOCK	pthread_mutex_lock
+#  define PTHREAD_MUTEX_UNLOCK	pthread_mutex_unlock
+#else
+#  define PTHREAD_MUTEX_LOCK(_x)
+#  define PTHREAD_MUTEX_UNLOCK(_x)
+#endif
+
+/*
+ *	Entries per attribute.  Values which change in every packet
+ *	(e.g. Acct-Session-Id) shouldn't be interned, but if they
+ *	are, this limits the damage.
+ */
+#define FR_INTERN_MAX_ENTRIES	(1024)
+
+typedef struct fr_intern_entry_t {
+	uint32_t			refs;		//!< VPs using the value, plus one
+							//!< while it's in the table.
+	uint32_t			hash;		//!< Of the value.
+	size_t				length;		//!< Of the value.
+	void				*value;		//!< char or uint8_t buffer, parented
+							//!< by this entry.
+
+	struct fr_intern_entry_t	*prev;		//!< More recently used.
+	struct fr_intern_entry_t	*next;		//!< Less recently used.
+} fr_intern_entry_t;
+
+struct fr_intern {
+	PW_TYPE				type;		//!< PW_TYPE_STRING or PW_TYPE_OCTETS.
+	fr_hash_table_t			*ht;		//!< Of fr_intern_entry_t.
+	fr_intern_entry_t		*head;		//!< Most recently used.
+	fr_intern_entry_t		*tail;		//!< Least recently used.
+	uint32_t			num;		//!< Entries in the table.
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t			mutex;		//!< Protects everything but the
+							//!< reference counts.
+#endif
+};
+
+#ifdef __ATOMIC_ACQ_REL
+#  define INTERN_REF(_e)	(void) __atomic_add_fetch(&(_e)->refs, 1, __ATOMIC_RELAXED)
+#  define INTERN_UNREF(_e)	__atomic_sub_fetch(&(_e)->refs, 1, __ATOMIC_ACQ_REL)
+#else
+#  ifdef HAVE_PTHREAD_H
+static pthread_mutex_t intern_ref_mutex = PTHREAD_MUTEX_INITIALIZER;
+#  endif
+
+static void intern_ref(fr_intern_entry_t *entry)
+{
+	PTHREAD_MUTEX_LOCK(&intern_ref_mutex);
+	entry->refs++;
+	PTHREAD_MUTEX_UNLOCK(&intern_ref_mutex);
+}
+
+static uint32_t intern_unref(fr_intern_entry_t *entry)
+{
+	uint32_t refs;
+
+	PTHREAD_MUTEX_LOCK(&intern_ref_mutex);
+	refs = --entry->refs;
+	PTHREAD_MUTEX_UNLOCK(&intern_ref_mutex);
+
+	return refs;
+}
+#  define INTERN_REF(_e)	intern_ref(_e)
+#  define INTERN_UNREF(_e)	intern_unref(_e)
+#endif
+
+static uint32_t intern_hash(void const *data)
+{
+	fr_intern_entry_t const *entry = data;
+
+	return entry->hash;
+}
+
+static int intern_cmp(void const *one, void const *two)
+{
+	fr_intern_entry_t const *a = one;
+	fr_intern_entry_t const *b = two;
+
+	if (a->length < b->length) return -1;
+	if (a->length > b->length) return +1;
+
+	return memcmp(a->value, b->value, a->length);
+}
+
+static void intern_unlink(fr_intern_t *it, fr_intern_entry_t *entry)
+{
+	if (entry->prev) {
+		entry->prev->next = entry->next;
+	} else {
+		it->head = entry->next;
+	}
+
+	if (entry->next) {
+		entry->next->prev = entry->prev;
+	} else {
+		it->tail = entry->prev;
+	}
+
+	entry->prev = entry->next = NULL;
+}
+
+static void intern_push(fr_intern_t *it, fr_intern_entry_t *entry)
+{
+	entry->prev = NULL;
+	entry->next = it->head;
+	if (it->head) it->head->prev = entry;
+	it->head = entry;
+	if (!it->tail) it->tail = entry;
+}
+
+/*
+ *	Drop one reference, and free the entry if it was the last.
+ */
+static void intern_entry_release(fr_intern_entry_t *entry)
+{
+	if (INTERN_UNREF(entry) == 0) talloc_free(entry);
+}
+
+static int _intern_free(fr_intern_t *it)
+{
+	fr_intern_entry_t *entry, *next;
+
+	fr_hash_table_free(it->ht);
+
+	for (entry = it->head; entry != NULL; entry = next) {
+		next = entry->next;
+		intern_entry_release(entry);
+	}
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_destroy(&it->mutex);
+#endif
+
+	return 0;
+}
+
+/** Create a table of interned values for one attribute
+ *
+ * @param ctx to allocate the table in.
+ * @param type of the attribute.  Only string and octets values can be interned.
+ * @return the new table, or NULL on error.
+ */
+fr_intern_t *fr_intern_create(TALLOC_CTX *ctx, PW_TYPE type)
+{
+	fr_intern_t *it;
+
+	if ((type != PW_TYPE_STRING) && (type != PW_TYPE_OCTETS)) {
+		fr_strerror_printf("Only \"string\" and \"octets\" values can be interned");
+		return NULL;
+	}
+
+	it = talloc_zero(ctx, fr_intern_t);
+	if (!it) return NULL;
+
+	it->type = type;
+	it->ht = fr_hash_table_create(intern_hash, intern_cmp, NULL);
+	if (!it->ht) {
+		talloc_free(it);
+		return NULL;
+	}
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_init(&it->mutex, NULL);
+#endif
+	talloc_set_destructor(it, _intern_free);
+
+	return it;
+}
+
+/** Get the shared copy of a value
+ *
+ * The caller owns one reference to the returned buffer, which it must
+ * release with fr_intern_release().  The buffer must not be modified.
+ *
+ * @param it table of values for the attribute.
+ * @param data of the value.
+ * @param len of the value.
+ * @return the shared buffer, or NULL if the value couldn't be interned.
+ */
+void const *fr_intern_value(fr_intern_t *it, uint8_t const *data, size_t len)
+{
+	fr_intern_entry_t my_entry, *entry;
+
+	if (!len || (len > MAX_STRING_LEN)) return NULL;
+
+	memset(&my_entry, 0, sizeof(my_entry));
+	my_entry.hash = fr_hash_keyed(data, len);
+	my_entry.length = len;
+	memcpy(&my_entry.value, &data, sizeof(my_entry.value));
+
+	PTHREAD_MUTEX_LOCK(&it->mutex);
+
+	entry = fr_hash_table_finddata(it->ht, &my_entry);
+	if (entry) {
+		/*
+		 *	The table's reference keeps the entry alive
+		 *	while we hold the mutex.
+		 */
+		INTERN_REF(entry);
+		if (entry != it->head) {
+			intern_unlink(it, entry);
+			intern_push(it, entry);
+		}
+		PTHREAD_MUTEX_UNLOCK(&it->mutex);
+
+		return entry->value;
+	}
+
+	/*
+	 *	Make room by forgetting the least recently used
+	 *	value.  Any VPs using it keep it until they're freed.
+	 */
+	if (it->num >= FR_INTERN_MAX_ENTRIES) {
+		fr_intern_entry_t *old = it->tail;
+
+		fr_hash_table_yank(it->ht, old);
+		intern_unlink(it, old);
+		it->num--;
+		intern_entry_release(old);
+	}
+
+	entry = talloc_zero(NULL, fr_intern_entry_t);
+	if (!entry) goto error;
+
+	if (it->type == PW_TYPE_STRING) {
+		char *p;
+
+		entry->value = p = talloc_array(entry, char, len + 1);
+		if (!p) goto error;
+
+		memcpy(p, data, len);
+		p[len] = '\0';
+	} else {
+		entry->value = talloc_memdup(entry, data, len);
+		if (!entry->value) goto error;
+
+		talloc_set_type(entry->value, uint8_t);
+	}
+
+	entry->hash = my_entry.hash;
+	entry->length = len;
+	entry->refs = 2;	/* the table, and the caller */
+
+	if (!fr_hash_table_insert(it->ht, entry)) goto error;
+	intern_push(it, entry);
+	it->num++;
+
+	PTHREAD_MUTEX_UNLOCK(&it->mutex);
+
+	return entry->value;
+
+error:
+	PTHREAD_MUTEX_UNLOCK(&it->mutex);
+	talloc_free(entry);
+
+	return NULL;
+}
+
+/** Check whether a value buffer came from fr_intern_value()
+ *
+ * @param value buffer of a VALUE_PAIR.
+ * @return true if the buffer is interned, else false.
+ */
+bool fr_intern_is(void const *value)
+{
+	void *parent;
+
+	if (!value) return false;
+
+	parent = talloc_parent(value);
+	if (!parent) return false;
+
+	return (talloc_get_type(parent, fr_intern_entry_t) != NULL);
+}
+
+/** Take another reference to an interned value
+ *
+ * e.g. when a VP using it is copied.
+ *
+ * @param value returned by fr_intern_value().
+ */
+void fr_intern_ref(void const *value)
+{
+	fr_intern_entry_t *entry;
+
+	entry = talloc_get_type_abort(talloc_parent(value), fr_intern_entry_t);
+	INTERN_REF(entry);
+}
+
+/** Release a reference to an interned value
+ *
+ * @param value returned by fr_intern_value().
+ */
+void fr_intern_release(void const *value)
+{
+	fr_intern_entry_t *entry;
+
+	entry = talloc_get_type_abort(talloc_parent(value), fr_intern_entry_t);
+	intern_entry_release(entry);
+}
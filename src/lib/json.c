@@ -0,0 +1,714 @@
+/*
+ * json.c	Incremental (event based) JSON parser.
+ *
+ * Version:	$Id$
+ *
+ *   This library is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU Lesser General Public
+ *   License as published by the Free Software Foundation; either
+ *   version 2.1 of the License, or (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *   Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public
+ *   License along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ *  Copyright 2016  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/libradius.h>
+
+#include <ctype.h>
+
+/*
+ *	The parser is a byte at a time state machine, so the input
+ *	can be fed to it in whatever chunks it arrives in.  Nothing
+ *	is built from the document.  Instead, the callback is told
+ *	about each key, scalar value and container as it's seen.
+ *
+ *	Keys and string values are unescaped into a buffer which
+ *	belongs to the parser, and is re-used for every token.  The
+ *	callback must copy anything it wants to keep.
+ *
+ *	The callback may ask for the value which follows a key, or
+ *	a container it's just been told about, to be skipped.  The
+ *	parser then only tracks the nesting and the string quoting
+ *	until the end of that value, and doesn't call the callback
+ *	or write to the buffer.  It may also ask for a container to
+ *	be "captured", in which case the raw text of the container
+ *	is given to it as a single FR_JSON_RAW event.
+ */
+typedef enum json_state {
+	JSON_STATE_VALUE = 0,		//!< Expecting a value.
+	JSON_STATE_ARRAY_FIRST,		//!< Expecting the first value in an array, or ']'.
+	JSON_STATE_OBJECT_FIRST,	//!< Expecting the first key in an object, or '}'.
+	JSON_STATE_KEY,			//!< Expecting a key.
+	JSON_STATE_COLON,		//!< Expecting the ':' after a key.
+	JSON_STATE_NEXT,		//!< Expecting ',' or the end of the container.
+	JSON_STATE_STRING,
+	JSON_STATE_ESCAPE,
+	JSON_STATE_UNICODE,
+	JSON_STATE_NUMBER,
+	JSON_STATE_LITERAL,
+	JSON_STATE_DONE,		//!< Top level value is complete.
+	JSON_STATE_ERROR
+} json_state_t;
+
+struct fr_json_parser {
+	fr_json_callback_t	callback;
+	void			*uctx;
+
+	json_state_t		state;
+	size_t			offset;		//!< Of the current byte, for errors.
+
+	int			depth;
+	char			stack[FR_JSON_MAX_DEPTH];	//!< '{' or '[' for each open container.
+
+	bool			in_key;		//!< The string being parsed is a key.
+	bool			seen;		//!< Something other than whitespace was seen.
+
+	fr_json_action_t	quiet;		//!< FR_JSON_SKIP or FR_JSON_CAPTURE when ignoring a value.
+	int			quiet_depth;	//!< Depth at which the ignored value ends.
+
+	char const		*literal;	//!< "true", "false" or "null".
+	size_t			literal_len;
+	size_t			literal_pos;
+	fr_json_event_t		literal_event;
+
+	uint32_t		codepoint;	//!< Of the \u escape being parsed.
+	int			hex_digits;
+	uint32_t		surrogate;	//!< High surrogate waiting for its pair.
+
+	char			*buffer;
+	size_t			used;
+	size_t			alloc;
+};
+
+static int json_error(fr_json_parser_t *jp, char const *msg)
+{
+	fr_strerror_printf("JSON parse error at offset %zu: %s", jp->offset, msg);
+	jp->state = JSON_STATE_ERROR;
+
+	return -1;
+}
+
+static int json_append(fr_json_parser_t *jp, char const *in, size_t inlen)
+{
+	if ((jp->used + inlen + 1) > jp->alloc) {
+		size_t alloc = jp->alloc ? jp->alloc : 256;
+		char *buffer;
+
+		while (alloc < (jp->used + inlen + 1)) alloc *= 2;
+
+		buffer = talloc_realloc(jp, jp->buffer, char, alloc);
+		if (!buffer) return json_error(jp, "Out of memory");
+
+		jp->buffer = buffer;
+		jp->alloc = alloc;
+	}
+
+	memcpy(jp->buffer + jp->used, in, inlen);
+	jp->used += inlen;
+
+	return 0;
+}
+
+static int json_append_utf8(fr_json_parser_t *jp, uint32_t cp)
+{
+	char out[4];
+	size_t len;
+
+	if (cp < 0x80) {
+		out[0] = cp;
+		len = 1;
+	} else if (cp < 0x800) {
+		out[0] = 0xc0 | (cp >> 6);
+		out[1] = 0x80 | (cp & 0x3f);
+		len = 2;
+	} else if (cp < 0x10000) {
+		out[0] = 0xe0 | (cp >> 12);
+		out[1] = 0x80 | ((cp >> 6) & 0x3f);
+		out[2] = 0x80 | (cp & 0x3f);
+		len = 3;
+	} else {
+		out[0] = 0xf0 | (cp >> 18);
+		out[1] = 0x80 | ((cp >> 12) & 0x3f);
+		out[2] = 0x80 | ((cp >> 6) & 0x3f);
+		out[3] = 0x80 | (cp & 0x3f);
+		len = 4;
+	}
+
+	return json_append(jp, out, len);
+}
+
+/*
+ *	A high surrogate which isn't followed by a low surrogate
+ *	is replaced with U+FFFD, which is what most parsers do.
+ */
+static int json_surrogate_flush(fr_json_parser_t *jp)
+{
+	if (!jp->surrogate) return 0;
+
+	jp->surrogate = 0;
+	if (jp->quiet) return 0;
+
+	return json_append_utf8(jp, 0xfffd);
+}
+
+static fr_json_action_t json_emit(fr_json_parser_t *jp, fr_json_event_t event, char const *value, size_t len)
+{
+	fr_json_action_t action;
+
+	if (jp->quiet) return FR_JSON_CONTINUE;
+
+	action = jp->callback(jp->uctx, event, jp->depth, value, len);
+	if (action == FR_JSON_ABORT) {
+		fr_strerror_printf("JSON parsing aborted at offset %zu", jp->offset);
+		jp->state = JSON_STATE_ERROR;
+	}
+
+	return action;
+}
+
+static fr_json_action_t json_emit_token(fr_json_parser_t *jp, fr_json_event_t event)
+{
+	if (jp->quiet) return FR_JSON_CONTINUE;
+
+	if (json_append(jp, "", 1) < 0) return FR_JSON_ABORT;	/* \0 terminate */
+	jp->used--;
+
+	return json_emit(jp, event, jp->buffer, jp->used);
+}
+
+/*
+ *	Called whenever a value is complete, so that we can tell when a
+ *	skipped or captured value has ended.
+ */
+static int json_value_done(fr_json_parser_t *jp)
+{
+	jp->state = jp->depth ? JSON_STATE_NEXT : JSON_STATE_DONE;
+
+	if (jp->quiet && (jp->depth == jp->quiet_depth)) {
+		fr_json_action_t quiet = jp->quiet;
+
+		jp->quiet = FR_JSON_CONTINUE;
+		if ((quiet == FR_JSON_CAPTURE) && (json_emit_token(jp, FR_JSON_RAW) == FR_JSON_ABORT)) return -1;
+	}
+
+	return 0;
+}
+
+static bool json_number_valid(char const *p, char const *end)
+{
+	if ((p < end) && (*p == '-')) p++;
+
+	if (p == end) return false;
+	if (*p == '0') {
+		p++;
+	} else if (isdigit((int) *p)) {
+		while ((p < end) && isdigit((int) *p)) p++;
+	} else {
+		return false;
+	}
+
+	if ((p < end) && (*p == '.')) {
+		p++;
+		if ((p == end) || !isdigit((int) *p)) return false;
+		while ((p < end) && isdigit((int) *p)) p++;
+	}
+
+	if ((p < end) && ((*p == 'e') || (*p == 'E'))) {
+		p++;
+		if ((p < end) && ((*p == '+') || (*p == '-'))) p++;
+		if ((p == end) || !isdigit((int) *p)) return false;
+		while ((p < end) && isdigit((int) *p)) p++;
+	}
+
+	return (p == end);
+}
+
+static int json_number_done(fr_json_parser_t *jp)
+{
+	if (!jp->quiet) {
+		if (!json_number_valid(jp->buffer, jp->buffer + jp->used)) return json_error(jp, "Invalid number");
+		if (json_emit_token(jp, FR_JSON_NUMBER) == FR_JSON_ABORT) return -1;
+	}
+
+	return json_value_done(jp);
+}
+
+static int json_container_open(fr_json_parser_t *jp, char c)
+{
+	fr_json_action_t action;
+
+	if (jp->depth >= FR_JSON_MAX_DEPTH) return json_error(jp, "Too deeply nested");
+
+	action = json_emit(jp, (c == '{') ? FR_JSON_OBJECT_START : FR_JSON_ARRAY_START, NULL, 0);
+	switch (action) {
+	case FR_JSON_ABORT:
+		return -1;
+
+	case FR_JSON_CAPTURE:
+		jp->used = 0;
+		if (json_append(jp, &c, 1) < 0) return -1;
+		/* FALL-THROUGH */
+
+	case FR_JSON_SKIP:
+		jp->quiet = action;
+		jp->quiet_depth = jp->depth;
+		break;
+
+	default:
+		break;
+	}
+
+	jp->stack[jp->depth++] = c;
+	jp->state = (c == '{') ? JSON_STATE_OBJECT_FIRST : JSON_STATE_ARRAY_FIRST;
+
+	return 0;
+}
+
+static int json_container_close(fr_json_parser_t *jp, char c)
+{
+	char open = (c == '}') ? '{' : '[';
+
+	if (!jp->depth || (jp->stack[jp->depth - 1] != open)) return json_error(jp, "Mismatched brackets");
+	jp->depth--;
+
+	if (json_emit(jp, (c == '}') ? FR_JSON_OBJECT_END : FR_JSON_ARRAY_END, NULL, 0) == FR_JSON_ABORT) return -1;
+
+	return json_value_done(jp);
+}
+
+static int json_string_done(fr_json_parser_t *jp)
+{
+	fr_json_action_t action;
+
+	if (json_surrogate_flush(jp) < 0) return -1;
+
+	if (!jp->in_key) {
+		if (json_emit_token(jp, FR_JSON_STRING) == FR_JSON_ABORT) return -1;
+
+		return json_value_done(jp);
+	}
+
+	jp->state = JSON_STATE_COLON;
+
+	action = json_emit_token(jp, FR_JSON_KEY);
+	if (action == FR_JSON_ABORT) return -1;
+
+	/*
+	 *	Skip the value for this key.  It ends when we're
+	 *	back at this depth.
+	 */
+	if (action == FR_JSON_SKIP) {
+		jp->quiet = FR_JSON_SKIP;
+		jp->quiet_depth = jp->depth;
+	}
+
+	return 0;
+}
+
+static int json_value_start(fr_json_parser_t *jp, char c)
+{
+	switch (c) {
+	case '{':
+	case '[':
+		return json_container_open(jp, c);
+
+	case '"':
+		if (!jp->quiet) jp->used = 0;
+		jp->in_key = false;
+		jp->state = JSON_STATE_STRING;
+		return 0;
+
+	case 't':
+		jp->literal = "true";
+		jp->literal_event = FR_JSON_TRUE;
+		goto literal;
+
+	case 'f':
+		jp->literal = "false";
+		jp->literal_event = FR_JSON_FALSE;
+		goto literal;
+
+	case 'n':
+		jp->literal = "null";
+		jp->literal_event = FR_JSON_NULL;
+	literal:
+		jp->literal_len = strlen(jp->literal);
+		jp->literal_pos = 1;
+		jp->state = JSON_STATE_LITERAL;
+		return 0;
+
+	default:
+		if ((c == '-') || isdigit((int) c)) {
+			if (!jp->quiet) {
+				jp->used = 0;
+				if (json_append(jp, &c, 1) < 0) return -1;
+			}
+			jp->state = JSON_STATE_NUMBER;
+			return 0;
+		}
+		break;
+	}
+
+	return json_error(jp, "Expected value");
+}
+
+/** Allocate a new incremental JSON parser
+ *
+ * @param ctx to allocate the parser in.
+ * @param callback to call for each JSON event.
+ * @param uctx passed to the callback.
+ * @return the new parser, or NULL on error.
+ */
+fr_json_parser_t *fr_json_parser_alloc(TALLOC_CTX *ctx, fr_json_callback_t callback, void *uctx)
+{
+	fr_json_parser_t *jp;
+
+	if (!callback) return NULL;
+
+	jp = talloc_zero(ctx, fr_json_parser_t);
+	if (!jp) return NULL;
+
+	jp->callback = callback;
+	jp->uctx = uctx;
+
+	return jp;
+}
+
+/** Prepare a parser for a new document
+ *
+ * The token buffer is kept, so re-using a parser doesn't allocate memory.
+ */
+void fr_json_parser_reset(fr_json_parser_t *jp)
+{
+	jp->state = JSON_STATE_VALUE;
+	jp->offset = 0;
+	jp->depth = 0;
+	jp->seen = false;
+	jp->quiet = FR_JSON_CONTINUE;
+	jp->surrogate = 0;
+	jp->used = 0;
+}
+
+/** Parse the next chunk of a JSON document
+ *
+ * @param jp the parser.
+ * @param in the next chunk of the document.
+ * @param inlen the length of the chunk.
+ * @return 0 on success, -1 if the document is malformed, or the callback
+ *	aborted parsing.  Once an error has been returned, the parser must
+ *	be reset.
+ */
+int fr_json_parse(fr_json_parser_t *jp, char const *in, size_t inlen)
+{
+	char const *p, *end = in + inlen;
+
+	if (jp->state == JSON_STATE_ERROR) return -1;
+
+	for (p = in; p < end; p++, jp->offset++) {
+		char c = *p;
+
+		if ((jp->quiet == FR_JSON_CAPTURE) && (json_append(jp, p, 1) < 0)) return -1;
+
+	again:
+		switch (jp->state) {
+		case JSON_STATE_VALUE:
+		case JSON_STATE_ARRAY_FIRST:
+		case JSON_STATE_OBJECT_FIRST:
+		case JSON_STATE_KEY:
+		case JSON_STATE_COLON:
+		case JSON_STATE_NEXT:
+		case JSON_STATE_DONE:
+			if ((c == ' ') || (c == '\t') || (c == '\r') || (c == '\n')) continue;
+			break;
+
+		default:
+			break;
+		}
+
+		jp->seen = true;
+
+		switch (jp->state) {
+		case JSON_STATE_ARRAY_FIRST:
+			if (c == ']') {
+				if (json_container_close(jp, c) < 0) return -1;
+				continue;
+			}
+			/* FALL-THROUGH */
+
+		case JSON_STATE_VALUE:
+			if (json_value_start(jp, c) < 0) return -1;
+			continue;
+
+		case JSON_STATE_OBJECT_FIRST:
+			if (c == '}') {
+				if (json_container_close(jp, c) < 0) return -1;
+				continue;
+			}
+			/* FALL-THROUGH */
+
+		case JSON_STATE_KEY:
+			if (c != '"') return json_error(jp, "Expected key");
+
+			if (!jp->quiet) jp->used = 0;
+			jp->in_key = true;
+			jp->state = JSON_STATE_STRING;
+			continue;
+
+		case JSON_STATE_COLON:
+			if (c != ':') return json_error(jp, "Expected ':'");
+			jp->state = JSON_STATE_VALUE;
+			continue;
+
+		case JSON_STATE_NEXT:
+			switch (c) {
+			case ',':
+				jp->state = (jp->stack[jp->depth - 1] == '{') ? JSON_STATE_KEY : JSON_STATE_VALUE;
+				continue;
+
+			case '}':
+			case ']':
+				if (json_container_close(jp, c) < 0) return -1;
+				continue;
+
+			default:
+				return json_error(jp, "Expected ',' or end of container");
+			}
+
+		case JSON_STATE_STRING:
+			if (c == '"') {
+				if (json_string_done(jp) < 0) return -1;
+				continue;
+			}
+
+			if (c == '\\') {
+				jp->state = JSON_STATE_ESCAPE;
+				continue;
+			}
+
+			if (json_surrogate_flush(jp) < 0) return -1;
+			if (!jp->quiet && (json_append(jp, p, 1) < 0)) return -1;
+			continue;
+
+		case JSON_STATE_ESCAPE:
+		{
+			char unescaped;
+
+			switch (c) {
+			case '"':
+			case '\\':
+			case '/':
+				unescaped = c;
+				break;
+
+			case 'b':
+				unescaped = '\b';
+				break;
+
+			case 'f':
+				unescaped = '\f';
+				break;
+
+			case 'n':
+				unescaped = '\n';
+				break;
+
+			case 'r':
+				unescaped = '\r';
+				break;
+
+			case 't':
+				unescaped = '\t';
+				break;
+
+			case 'u':
+				jp->codepoint = 0;
+				jp->hex_digits = 0;
+				jp->state = JSON_STATE_UNICODE;
+				continue;
+
+			default:
+				return json_error(jp, "Invalid escape sequence");
+			}
+
+			if (json_surrogate_flush(jp) < 0) return -1;
+			if (!jp->quiet && (json_append(jp, &unescaped, 1) < 0)) return -1;
+			jp->state = JSON_STATE_STRING;
+			continue;
+		}
+
+		case JSON_STATE_UNICODE:
+		{
+			uint32_t cp;
+
+			if (!isxdigit((int) c)) return json_error(jp, "Invalid unicode escape");
+
+			jp->codepoint <<= 4;
+			jp->codepoint |= isdigit((int) c) ? (c - '0') : ((tolower((int) c) - 'a') + 10);
+			if (++jp->hex_digits < 4) continue;
+
+			jp->state = JSON_STATE_STRING;
+			cp = jp->codepoint;
+
+			if ((cp >= 0xdc00) && (cp <= 0xdfff)) {
+				if (!jp->surrogate) {
+					cp = 0xfffd;
+				} else {
+					cp = 0x10000 + ((jp->surrogate - 0xd800) << 10) + (cp - 0xdc00);
+					jp->surrogate = 0;
+				}
+			} else {
+				if (json_surrogate_flush(jp) < 0) return -1;
+
+				if ((cp >= 0xd800) && (cp <= 0xdbff)) {
+					jp->surrogate = cp;
+					continue;
+				}
+			}
+
+			if (!jp->quiet && (json_append_utf8(jp, cp) < 0)) return -1;
+			continue;
+		}
+
+		case JSON_STATE_NUMBER:
+			if (isdigit((int) c) || (c == '.') || (c == 'e') || (c == 'E') || (c == '+') || (c == '-')) {
+				if (!jp->quiet && (json_append(jp, p, 1) < 0)) return -1;
+				continue;
+			}
+
+			/*
+			 *	The number ends at the first character
+			 *	which can't be part of it.  That
+			 *	character then has to be processed
+			 *	in the new state.
+			 */
+			if (json_number_done(jp) < 0) return -1;
+			goto again;
+
+		case JSON_STATE_LITERAL:
+			if (c != jp->literal[jp->literal_pos]) return json_error(jp, "Invalid literal");
+			if (++jp->literal_pos < jp->literal_len) continue;
+
+			if (!jp->quiet && (json_emit(jp, jp->literal_event,
+						     jp->literal, jp->literal_len) == FR_JSON_ABORT)) return -1;
+			if (json_value_done(jp) < 0) return -1;
+			continue;
+
+		case JSON_STATE_DONE:
+			return json_error(jp, "Trailing data after JSON value");
+
+		case JSON_STATE_ERROR:
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/** Signal the end of a JSON document
+ *
+ * @param jp the parser.
+ * @return 1 if a complete JSON value was parsed, 0 if the document was
+ *	empty (or only whitespace), or -1 if the document was incomplete or
+ *	malformed.
+ */
+int fr_json_parse_end(fr_json_parser_t *jp)
+{
+	switch (jp->state) {
+	case JSON_STATE_DONE:
+		return 1;
+
+	case JSON_STATE_VALUE:
+		if (!jp->seen) return 0;
+		break;
+
+	/*
+	 *	A top level number is only terminated by the end
+	 *	of the document.
+	 */
+	case JSON_STATE_NUMBER:
+		if (jp->depth) break;
+		if (json_number_done(jp) < 0) return -1;
+		return 1;
+
+	case JSON_STATE_ERROR:
+		return -1;
+
+	default:
+		break;
+	}
+
+	return json_error(jp, "Unexpected end of JSON document");
+}
+
+#ifdef TESTING
+/*
+ *  cc -DTESTING -I .. json.c -o json -ltalloc
+ *
+ *  ./json '<json>' [<chunk size>]
+ */
+static char const *events[] = {
+	"object-start", "object-end", "array-start", "array-end", "key",
+	"string", "number", "true", "false", "null", "raw"
+};
+
+static fr_json_action_t json_print(UNUSED void *uctx, fr_json_event_t event, int depth, char const *value, size_t len)
+{
+	printf("%*s%s", depth * 2, "", events[event]);
+	if (value) printf(" \"%.*s\"", (int) len, value);
+	printf("\n");
+
+	/*
+	 *	Exercise skipping and capturing.
+	 */
+	if ((event == FR_JSON_KEY) && (strcmp(value, "skip") == 0)) return FR_JSON_SKIP;
+	if ((event == FR_JSON_OBJECT_START) && (depth == 2)) return FR_JSON_CAPTURE;
+
+	return FR_JSON_CONTINUE;
+}
+
+int main(int argc, char **argv)
+{
+	fr_json_parser_t *jp;
+	size_t len, chunk = 1, i;
+	int ret;
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: json <json> [<chunk size>]\n");
+		exit(1);
+	}
+	if (argc > 2) chunk = atoi(argv[2]);
+	if (!chunk) chunk = 1;
+
+	jp = fr_json_parser_alloc(NULL, json_print, NULL);
+	fr_json_parser_reset(jp);
+
+	len = strlen(argv[1]);
+	for (i = 0; i < len; i += chunk) {
+		if (fr_json_parse(jp, argv[1] + i, ((len - i) < chunk) ? (len - i) : chunk) < 0) {
+			fprintf(stderr, "%s\n", fr_strerror());
+			exit(1);
+		}
+	}
+
+	ret = fr_json_parse_end(jp);
+	if (ret < 0) {
+		fprintf(stderr, "%s\n", fr_strerror());
+		exit(1);
+	}
+	printf("%s\n", ret ? "complete" : "empty");
+
+	talloc_free(jp);
+
+	return 0;
+}
+#endif
@@ -817,12 +817,11 @@ char const *inet_ntop(int af, void const *src, char *dst, size_t cnt)
  * @param hostname to search for.
  * @param fallback to the other adress family, if no records matching af, found.
  * @return 0 on success, else -1 on failure.
+ *
+ * @see fr_dns_cache_init
  */
 int ip_hton(fr_ipaddr_t *out, int af, char const *hostname, bool fallback)
 {
-	int rcode;
-	struct addrinfo hints, *ai = NULL, *alt = NULL, *res = NULL;
-
 	if (!fr_hostname_lookups) {
 #ifdef HAVE_STRUCT_SOCKADDR_IN6
 		if (af == AF_UNSPEC) {
@@ -849,47 +848,7 @@ int ip_hton(fr_ipaddr_t *out, int af, char const *hostname, bool fallback)
 		return 0;
 	}
 
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = af;
-
-#ifdef TALLOC_DEBUG
-	/*
-	 *	Avoid malloc for IP addresses.  This helps us debug
-	 *	memory errors when using talloc.
-	 */
-	if (af == AF_INET) {
-		/*
-		 *	If it's all numeric, avoid getaddrinfo()
-		 */
-		if (inet_pton(af, hostname, &out->ipaddr.ip4addr) == 1) {
-			return 0;
-		}
-	}
-#endif
-
-	if ((rcode = getaddrinfo(hostname, NULL, &hints, &res)) != 0) {
-		fr_strerror_printf("ip_hton: %s", gai_strerror(rcode));
-		return -1;
-	}
-
-	for (ai = res; ai; ai = ai->ai_next) {
-		if ((af == ai->ai_family) || (af == AF_UNSPEC)) break;
-		if (!alt && fallback && ((ai->ai_family == AF_INET) || (ai->ai_family == AF_INET6))) alt = ai;
-	}
-
-	if (!ai) ai = alt;
-	if (!ai) {
-		fr_strerror_printf("ip_hton failed to find requested information for host %.100s", hostname);
-		freeaddrinfo(res);
-		return -1;
-	}
-
-	rcode = fr_sockaddr2ipaddr((struct sockaddr_storage *)ai->ai_addr,
-				   ai->ai_addrlen, out, NULL);
-	freeaddrinfo(res);
-	if (!rcode) return -1;
-
-	return 0;
+	return fr_dns_lookup(out, af, hostname, fallback);
 }
 
 /*
@@ -1000,7 +959,28 @@ void fr_ipaddr_mask(fr_ipaddr_t *addr, uint8_t prefix)
 	addr->prefix = prefix;
 }
 
-static char const hextab[] = "0123456789abcdef";
+/*
+ *	Value of each hex digit, plus one.  Zero means "not a hex digit".
+ */
+static uint8_t const hexdecode[256] = {
+	['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+	['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+	['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+	['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16
+};
+
+/*
+ *	Two hex digits for each byte value.
+ */
+static char const hexpairs[] =
+	"000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f"
+	"202122232425262728292a2b2c2d2e2f303132333435363738393a3b3c3d3e3f"
+	"404142434445464748494a4b4c4d4e4f505152535455565758595a5b5c5d5e5f"
+	"606162636465666768696a6b6c6d6e6f707172737475767778797a7b7c7d7e7f"
+	"808182838485868788898a8b8c8d8e8f909192939495969798999a9b9c9d9e9f"
+	"a0a1a2a3a4a5a6a7a8a9aaabacadaeafb0b1b2b3b4b5b6b7b8b9babbbcbdbebf"
+	"c0c1c2c3c4c5c6c7c8c9cacbcccdcecfd0d1d2d3d4d5d6d7d8d9dadbdcdddedf"
+	"e0e1e2e3e4e5e6e7e8e9eaebecedeeeff0f1f2f3f4f5f6f7f8f9fafbfcfdfeff";
 
 /** Convert hex strings to binary data
  *
@@ -1014,7 +994,7 @@ size_t fr_hex2bin(uint8_t *bin, size_t outlen, char const *hex, size_t inlen)
 {
 	size_t i;
 	size_t len;
-	char *c1, *c2;
+	uint8_t c1, c2;
 
 	/*
 	 *	Smartly truncate output, caller should check number of bytes
@@ -1024,10 +1004,11 @@ size_t fr_hex2bin(uint8_t *bin, size_t outlen, char const *hex, size_t inlen)
 	if (len > outlen) len = outlen;
 
 	for (i = 0; i < len; i++) {
-		if(!(c1 = memchr(hextab, tolower((int) hex[i << 1]), sizeof(hextab))) ||
-		   !(c2 = memchr(hextab, tolower((int) hex[(i << 1) + 1]), sizeof(hextab))))
-			break;
-		bin[i] = ((c1-hextab)<<4) + (c2-hextab);
+		c1 = hexdecode[(uint8_t) hex[i << 1]];
+		c2 = hexdecode[(uint8_t) hex[(i << 1) + 1]];
+		if (!c1 || !c2) break;
+
+		bin[i] = ((c1 - 1) << 4) | (c2 - 1);
 	}
 
 	return i;
@@ -1049,8 +1030,7 @@ size_t fr_bin2hex(char *hex, uint8_t const *bin, size_t inlen)
 	size_t i;
 
 	for (i = 0; i < inlen; i++) {
-		hex[0] = hextab[((*bin) >> 4) & 0x0f];
-		hex[1] = hextab[*bin & 0x0f];
+		memcpy(hex, &hexpairs[*bin << 1], 2);
 		hex += 2;
 		bin++;
 	}
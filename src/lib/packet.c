@@ -80,6 +80,45 @@ int fr_packet_cmp(RADIUS_PACKET const *a, RADIUS_PACKET const *b)
 	return rcode;
 }
 
+static uint32_t fr_ipaddr_hash(fr_ipaddr_t const *ipaddr, uint32_t hash)
+{
+	hash = fr_hash_keyed_update(&ipaddr->af, sizeof(ipaddr->af), hash);
+	hash = fr_hash_keyed_update(&ipaddr->prefix, sizeof(ipaddr->prefix), hash);
+
+	switch (ipaddr->af) {
+	case AF_INET:
+		return fr_hash_keyed_update(&ipaddr->ipaddr.ip4addr, sizeof(ipaddr->ipaddr.ip4addr), hash);
+
+#ifdef HAVE_STRUCT_SOCKADDR_IN6
+	case AF_INET6:
+		hash = fr_hash_keyed_update(&ipaddr->scope, sizeof(ipaddr->scope), hash);
+		return fr_hash_keyed_update(&ipaddr->ipaddr.ip6addr, sizeof(ipaddr->ipaddr.ip6addr), hash);
+#endif
+
+	default:
+		break;
+	}
+
+	return hash;
+}
+
+/*
+ *	Hash the fields which fr_packet_cmp() compares, so that
+ *	packets which compare as identical have the same hash.
+ */
+uint32_t fr_packet_hash(RADIUS_PACKET const *packet)
+{
+	uint32_t hash;
+
+	hash = fr_hash_keyed(&packet->id, sizeof(packet->id));
+	hash = fr_hash_keyed_update(&packet->src_port, sizeof(packet->src_port), hash);
+	hash = fr_ipaddr_hash(&packet->src_ipaddr, hash);
+	hash = fr_ipaddr_hash(&packet->dst_ipaddr, hash);
+	hash = fr_hash_keyed_update(&packet->dst_port, sizeof(packet->dst_port), hash);
+
+	return fr_hash_keyed_update(&packet->sockfd, sizeof(packet->sockfd), hash);
+}
+
 int fr_inaddr_any(fr_ipaddr_t *ipaddr)
 {
 
@@ -269,7 +308,12 @@ typedef struct fr_packet_socket_t {
 	int		proto;
 #endif
 
-	uint8_t		id[32];
+	uint32_t	id[8];			//!< Bitmap of allocated IDs.
+	uint8_t		id_next;		//!< Where to start looking for a free ID.
+
+	bool		ready;			//!< In the ring of sockets with free IDs.
+	int		ready_next;		//!< Next socket in the ready ring.
+	int		ready_prev;		//!< Previous socket in the ready ring.
 } fr_packet_socket_t;
 
 
@@ -280,6 +324,13 @@ typedef struct fr_packet_socket_t {
 
 #define MAX_QUEUES (8)
 
+/*
+ *	When a socket has fewer than this many free IDs, and there's
+ *	no other socket to the same destination with more, tell the
+ *	caller that it should open a new one.
+ */
+#define ID_LOW_WATER(_pl) ((_pl)->num_ids >> 3)
+
 /*
  *	Structure defining a list of packets (incoming or outgoing)
  *	that should be managed.
@@ -292,6 +343,12 @@ struct fr_packet_list_t {
 	int		last_recv;
 	int		num_sockets;
 
+	int		ready;			//!< First socket in the ready ring, or -1.
+	bool		id_low;			//!< Last allocation left few spare IDs.
+
+	int		num_ids;		//!< How many IDs we use on each socket.
+	uint32_t	id_reserved[8];		//!< IDs we never allocate.
+
 	fr_packet_socket_t sockets[MAX_SOCKETS];
 };
 
@@ -315,6 +372,88 @@ static fr_packet_socket_t *fr_socket_find(fr_packet_list_t *pl,
 	return NULL;
 }
 
+/*
+ *	Sockets which can be used for new packets (i.e. they're not
+ *	frozen, and still have free IDs) are kept in a circular list,
+ *	so that fr_packet_list_id_alloc() doesn't have to look at the
+ *	ones which are full.
+ */
+static void fr_socket_ready(fr_packet_list_t *pl, fr_packet_socket_t *ps)
+{
+	int i;
+	fr_packet_socket_t *head;
+
+	if (ps->ready || ps->dont_use || (ps->num_outgoing >= (uint32_t) pl->num_ids)) return;
+
+	i = ps - pl->sockets;
+	ps->ready = true;
+
+	if (pl->ready < 0) {
+		ps->ready_next = ps->ready_prev = i;
+		pl->ready = i;
+		return;
+	}
+
+	/*
+	 *	Insert it at the tail.
+	 */
+	head = &pl->sockets[pl->ready];
+	ps->ready_next = pl->ready;
+	ps->ready_prev = head->ready_prev;
+	pl->sockets[head->ready_prev].ready_next = i;
+	head->ready_prev = i;
+}
+
+static void fr_socket_unready(fr_packet_list_t *pl, fr_packet_socket_t *ps)
+{
+	int i;
+
+	if (!ps->ready) return;
+
+	i = ps - pl->sockets;
+	ps->ready = false;
+
+	if (ps->ready_next == i) {
+		pl->ready = -1;
+		return;
+	}
+
+	pl->sockets[ps->ready_prev].ready_next = ps->ready_next;
+	pl->sockets[ps->ready_next].ready_prev = ps->ready_prev;
+	if (pl->ready == i) pl->ready = ps->ready_next;
+}
+
+/*
+ *	Find a free ID, starting from where we left off last time.
+ *	This means that IDs are re-used as late as possible.
+ */
+static int fr_socket_id_alloc(fr_packet_socket_t *ps)
+{
+	int i, word, id;
+	uint32_t free_ids;
+
+	word = ps->id_next >> 5;
+	free_ids = ~ps->id[word] & (~(uint32_t) 0 << (ps->id_next & 0x1f));
+
+	for (i = 0; !free_ids && (i < 8); i++) {
+		word = (word + 1) & 0x07;
+		free_ids = ~ps->id[word];
+	}
+
+	if (!free_ids) return -1;
+
+	id = (word << 5) + ffs(free_ids) - 1;
+	ps->id[word] |= ((uint32_t) 1 << (id & 0x1f));
+	ps->id_next = id + 1;
+
+	return id;
+}
+
+static void fr_socket_id_free(fr_packet_socket_t *ps, int id)
+{
+	ps->id[(id >> 5) & 0x07] &= ~((uint32_t) 1 << (id & 0x1f));
+}
+
 bool fr_packet_list_socket_freeze(fr_packet_list_t *pl, int sockfd)
 {
 	fr_packet_socket_t *ps;
@@ -331,6 +470,7 @@ bool fr_packet_list_socket_freeze(fr_packet_list_t *pl, int sockfd)
 	}
 
 	ps->dont_use = true;
+	fr_socket_unready(pl, ps);
 	return true;
 }
 
@@ -344,6 +484,7 @@ bool fr_packet_list_socket_thaw(fr_packet_list_t *pl, int sockfd)
 	if (!ps) return false;
 
 	ps->dont_use = false;
+	fr_socket_ready(pl, ps);
 	return true;
 }
 
@@ -359,6 +500,7 @@ bool fr_packet_list_socket_del(fr_packet_list_t *pl, int sockfd)
 
 	if (ps->num_outgoing != 0) return false;
 
+	fr_socket_unready(pl, ps);
 	ps->sockfd = -1;
 	pl->num_sockets--;
 
@@ -411,6 +553,8 @@ bool fr_packet_list_socket_add(fr_packet_list_t *pl, int sockfd, int proto,
 
 	memset(ps, 0, sizeof(*ps));
 	ps->ctx = ctx;
+	memcpy(ps->id, pl->id_reserved, sizeof(ps->id));
+	ps->id_next = fr_rand() & 0xff;
 #ifdef WITH_TCP
 	ps->proto = proto;
 #endif
@@ -450,6 +594,7 @@ bool fr_packet_list_socket_add(fr_packet_list_t *pl, int sockfd, int proto,
 	 */
 	ps->sockfd = sockfd;
 	pl->num_sockets++;
+	fr_socket_ready(pl, ps);
 
 	return true;
 }
@@ -494,10 +639,50 @@ fr_packet_list_t *fr_packet_list_create(int alloc_id)
 	}
 
 	pl->alloc_id = alloc_id;
+	pl->ready = -1;
+	pl->num_ids = 256;
 
 	return pl;
 }
 
+/** Limit the IDs which a packet list will allocate
+ *
+ * Only IDs where (id % step) == first will be used.  This lets
+ * several packet lists share the same sockets, with each one
+ * owning a separate part of the ID space.
+ *
+ * @param pl to limit.  Must not have any sockets yet.
+ * @param first ID to allocate.
+ * @param step between IDs.
+ * @return true on success, false on error.
+ */
+bool fr_packet_list_id_range(fr_packet_list_t *pl, int first, int step)
+{
+	int id;
+
+	if (!pl || (step < 1) || (step > 256) || (first < 0) || (first >= step)) {
+		fr_strerror_printf("Invalid argument");
+		return false;
+	}
+
+	if (pl->num_sockets != 0) {
+		fr_strerror_printf("Cannot change ID range after sockets have been added");
+		return false;
+	}
+
+	pl->num_ids = 0;
+	for (id = 0; id < 256; id++) {
+		if ((id % step) == first) {
+			pl->id_reserved[id >> 5] &= ~((uint32_t) 1 << (id & 0x1f));
+			pl->num_ids++;
+		} else {
+			pl->id_reserved[id >> 5] |= ((uint32_t) 1 << (id & 0x1f));
+		}
+	}
+
+	return true;
+}
+
 
 /*
  *	If pl->alloc_id is set, then fr_packet_list_id_alloc() MUST
@@ -581,6 +766,65 @@ uint32_t fr_packet_list_num_elements(fr_packet_list_t *pl)
 }
 
 
+/*
+ *	See if a socket can be used to send a particular packet.
+ */
+static bool fr_socket_match(fr_packet_socket_t const *ps, UNUSED int proto,
+			    RADIUS_PACKET const *request, int src_any)
+{
+#ifdef WITH_TCP
+	if (ps->proto != proto) return false;
+#endif
+
+	/*
+	 *	Address families don't match, skip it.
+	 */
+	if (ps->src_ipaddr.af != request->dst_ipaddr.af) return false;
+
+	/*
+	 *	MUST match dst port, if we have one.
+	 */
+	if ((ps->dst_port != 0) &&
+	    (ps->dst_port != request->dst_port)) return false;
+
+	/*
+	 *	MUST match requested src port, if one has been given.
+	 */
+	if ((request->src_port != 0) &&
+	    (ps->src_port != request->src_port)) return false;
+
+	/*
+	 *	We're sourcing from *, and they asked for a
+	 *	specific source address: ignore it.
+	 */
+	if (ps->src_any && !src_any) return false;
+
+	/*
+	 *	We're sourcing from a specific IP, and they
+	 *	asked for a source IP that isn't us: ignore
+	 *	it.
+	 */
+	if (!ps->src_any && !src_any &&
+	    (fr_ipaddr_cmp(&request->src_ipaddr,
+			   &ps->src_ipaddr) != 0)) return false;
+
+	/*
+	 *	UDP sockets are allowed to match
+	 *	destination IPs exactly, OR a socket
+	 *	with destination * is allowed to match
+	 *	any requested destination.
+	 *
+	 *	TCP sockets must match the destination
+	 *	exactly.  They *always* have dst_any=0,
+	 *	so the first check always matches.
+	 */
+	if (!ps->dst_any &&
+	    (fr_ipaddr_cmp(&request->dst_ipaddr,
+			   &ps->dst_ipaddr) != 0)) return false;
+
+	return true;
+}
+
 /*
  *	1 == ID was allocated & assigned
  *	0 == couldn't allocate ID.
@@ -603,7 +847,7 @@ uint32_t fr_packet_list_num_elements(fr_packet_list_t *pl)
 bool fr_packet_list_id_alloc(fr_packet_list_t *pl, int proto,
 			    RADIUS_PACKET **request_p, void **pctx)
 {
-	int i, j, k, fd, id, start_i, start_j, start_k;
+	int i, j, id;
 	int src_any = 0;
 	fr_packet_socket_t *ps;
 	RADIUS_PACKET *request = *request_p;
@@ -644,136 +888,74 @@ bool fr_packet_list_id_alloc(fr_packet_list_t *pl, int proto,
 	}
 
 	/*
-	 *	FIXME: Go to an LRU system.  This prevents ID re-use
-	 *	for as long as possible.  The main problem with that
-	 *	approach is that it requires us to populate the
-	 *	LRU/FIFO when we add a new socket, or a new destination,
-	 *	which can be expensive.
-	 *
-	 *	The LRU can be avoided if the caller takes care to free
-	 *	Id's only when all responses have been received, OR after
-	 *	a timeout.
-	 *
-	 *	Right now, the random approach is almost OK... it's
-	 *	brute-force over all of the available ID's, BUT using
-	 *	random numbers for everything spreads the load a bit.
-	 *
-	 *	The old method had a hash lookup on allocation AND
-	 *	on free.  The new method has brute-force on allocation,
-	 *	and near-zero cost on free.
+	 *	Only sockets which have free IDs are in the ready
+	 *	ring, so we don't waste time looking at full ones.
 	 */
+	if (pl->ready < 0) goto no_socket;
 
-	id = fd = -1;
-	start_i = fr_rand() & SOCKOFFSET_MASK;
-
-#define ID_i ((i + start_i) & SOCKOFFSET_MASK)
-	for (i = 0; i < MAX_SOCKETS; i++) {
-		if (pl->sockets[ID_i].sockfd == -1) continue; /* paranoia */
-
-		ps = &(pl->sockets[ID_i]);
-
-		/*
-		 *	This socket is marked as "don't use for new
-		 *	packets".  But we can still receive packets
-		 *	that are outstanding.
-		 */
-		if (ps->dont_use) continue;
+	ps = NULL;
+	i = pl->ready;
+	do {
+		if (fr_socket_match(&pl->sockets[i], proto, request, src_any)) {
+			ps = &pl->sockets[i];
+			break;
+		}
 
-		/*
-		 *	All IDs are allocated: ignore it.
-		 */
-		if (ps->num_outgoing == 256) continue;
+		i = pl->sockets[i].ready_next;
+	} while (i != pl->ready);
 
 #ifdef WITH_TCP
-		if (ps->proto != proto) continue;
-#endif
-
-		/*
-		 *	Address families don't match, skip it.
-		 */
-		if (ps->src_ipaddr.af != request->dst_ipaddr.af) continue;
-
-		/*
-		 *	MUST match dst port, if we have one.
-		 */
-		if ((ps->dst_port != 0) &&
-		    (ps->dst_port != request->dst_port)) continue;
-
-		/*
-		 *	MUST match requested src port, if one has been given.
-		 */
-		if ((request->src_port != 0) &&
-		    (ps->src_port != request->src_port)) continue;
-
-		/*
-		 *	We're sourcing from *, and they asked for a
-		 *	specific source address: ignore it.
-		 */
-		if (ps->src_any && !src_any) continue;
-
-		/*
-		 *	We're sourcing from a specific IP, and they
-		 *	asked for a source IP that isn't us: ignore
-		 *	it.
-		 */
-		if (!ps->src_any && !src_any &&
-		    (fr_ipaddr_cmp(&request->src_ipaddr,
-				   &ps->src_ipaddr) != 0)) continue;
-
-		/*
-		 *	UDP sockets are allowed to match
-		 *	destination IPs exactly, OR a socket
-		 *	with destination * is allowed to match
-		 *	any requested destination.
-		 *
-		 *	TCP sockets must match the destination
-		 *	exactly.  They *always* have dst_any=0,
-		 *	so the first check always matches.
-		 */
-		if (!ps->dst_any &&
-		    (fr_ipaddr_cmp(&request->dst_ipaddr,
-				   &ps->dst_ipaddr) != 0)) continue;
-
-		/*
-		 *	Otherwise, this socket is OK to use.
-		 */
-
-		/*
-		 *	Look for a free Id, starting from a random number.
-		 */
-		start_j = fr_rand() & 0x1f;
-#define ID_j ((j + start_j) & 0x1f)
-		for (j = 0; j < 32; j++) {
-			if (ps->id[ID_j] == 0xff) continue;
-
-
-			start_k = fr_rand() & 0x07;
-#define ID_k ((k + start_k) & 0x07)
-			for (k = 0; k < 8; k++) {
-				if ((ps->id[ID_j] & (1 << ID_k)) != 0) continue;
-
-				ps->id[ID_j] |= (1 << ID_k);
-				id = (ID_j * 8) + ID_k;
-				fd = i;
-				break;
+	/*
+	 *	Home servers often read each TCP connection from one
+	 *	thread, so requests behind a slow one on the same
+	 *	connection wait for it.  Use the connection with the
+	 *	fewest requests outstanding, rather than the next one.
+	 */
+	if (ps && (ps->proto == IPPROTO_TCP) && (ps->num_outgoing > 0)) {
+		for (j = ps->ready_next; j != pl->ready; j = pl->sockets[j].ready_next) {
+			if (pl->sockets[j].num_outgoing >= ps->num_outgoing) continue;
+
+			if (fr_socket_match(&pl->sockets[j], proto, request, src_any)) {
+				ps = &pl->sockets[j];
+				i = j;
+				if (ps->num_outgoing == 0) break;
 			}
-			if (fd >= 0) break;
 		}
-#undef ID_i
-#undef ID_j
-#undef ID_k
-		if (fd >= 0) break;
-		break;
 	}
+#endif
 
 	/*
 	 *	Ask the caller to allocate a new ID.
 	 */
-	if (fd < 0) {
+	if (!ps) {
+	no_socket:
 		fr_strerror_printf("Failed finding socket, caller must allocate a new one");
 		return false;
 	}
 
+	id = fr_socket_id_alloc(ps);
+	if (id < 0) goto no_socket;	/* paranoia */
+
+	/*
+	 *	If this allocation takes the socket below the low
+	 *	water mark, see if there's another socket which can
+	 *	take over.  If not, tell the caller to open a new
+	 *	one before we run out.
+	 */
+	pl->id_low = false;
+	if ((ps->num_outgoing + 1) == (uint32_t) (pl->num_ids - ID_LOW_WATER(pl))) {
+		pl->id_low = true;
+
+		for (j = ps->ready_next; j != i; j = pl->sockets[j].ready_next) {
+			if (pl->sockets[j].num_outgoing >= (uint32_t) (pl->num_ids - ID_LOW_WATER(pl))) continue;
+
+			if (fr_socket_match(&pl->sockets[j], proto, request, src_any)) {
+				pl->id_low = false;
+				break;
+			}
+		}
+	}
+
 	/*
 	 *	Set the ID, source IP, and source port.
 	 */
@@ -790,6 +972,13 @@ bool fr_packet_list_id_alloc(fr_packet_list_t *pl, int proto,
 		if (pctx) *pctx = ps->ctx;
 		ps->num_outgoing++;
 		pl->num_outgoing++;
+
+		/*
+		 *	Spread the load across the sockets, and
+		 *	stop looking at this one if it's full.
+		 */
+		pl->ready = ps->ready_next;
+		if (ps->num_outgoing >= (uint32_t) pl->num_ids) fr_socket_unready(pl, ps);
 		return true;
 	}
 
@@ -797,7 +986,8 @@ bool fr_packet_list_id_alloc(fr_packet_list_t *pl, int proto,
 	 *	Mark the ID as free.  This is the one line from
 	 *	id_free() that we care about here.
 	 */
-	ps->id[(request->id >> 3) & 0x1f] &= ~(1 << (request->id & 0x07));
+	fr_socket_id_free(ps, request->id);
+	pl->id_low = false;
 
 	request->id = -1;
 	request->sockfd = -1;
@@ -807,6 +997,19 @@ bool fr_packet_list_id_alloc(fr_packet_list_t *pl, int proto,
 	return false;
 }
 
+/** Check whether the last ID allocation left the destination short of IDs
+ *
+ * @param pl to check.
+ * @return true if the caller should open a new socket for the destination
+ *	of the last packet passed to fr_packet_list_id_alloc().
+ */
+bool fr_packet_list_id_low(fr_packet_list_t *pl)
+{
+	if (!pl) return false;
+
+	return pl->id_low;
+}
+
 /*
  *	Should be called AFTER yanking it from the list, so that
  *	any newly inserted entries don't collide with this one.
@@ -824,15 +1027,16 @@ bool fr_packet_list_id_free(fr_packet_list_t *pl,
 	if (!ps) return false;
 
 #if 0
-	if (!ps->id[(request->id >> 3) & 0x1f] & (1 << (request->id & 0x07))) {
+	if (!(ps->id[(request->id >> 5) & 0x07] & ((uint32_t) 1 << (request->id & 0x1f)))) {
 		fr_exit(1);
 	}
 #endif
 
-	ps->id[(request->id >> 3) & 0x1f] &= ~(1 << (request->id & 0x07));
+	fr_socket_id_free(ps, request->id);
 
 	ps->num_outgoing--;
 	pl->num_outgoing--;
+	fr_socket_ready(pl, ps);
 
 	request->id = -1;
 	request->src_ipaddr.af = AF_UNSPEC; /* id_alloc checks this */
@@ -26,6 +26,13 @@
 #include <sys/ioctl.h>
 #include <freeradius-devel/pcap.h>
 
+#ifdef __linux__
+#  include <linux/if_packet.h>
+#  if defined(PACKET_FANOUT) && !defined(PACKET_FANOUT_FLAG_DEFRAG)
+#    define PACKET_FANOUT_FLAG_DEFRAG (0x8000)
+#  endif
+#endif
+
 const FR_NAME_NUMBER pcap_types[] = {
 	{ "interface",	PCAP_INTERFACE_IN },
 	{ "file",	PCAP_FILE_IN },
@@ -292,6 +299,41 @@ int fr_pcap_apply_filter(fr_pcap_t *pcap, char const *expression)
 	return 0;
 }
 
+/** Add a live capture handle to a PACKET_FANOUT group
+ *
+ * Every handle opened on the same interface with the same group id gets a share of the
+ * packets.  The kernel picks the handle using a hash of the flow, which is symmetric,
+ * so both directions of a UDP exchange are delivered to the same handle.
+ *
+ * @param pcap handle to add, must be open.
+ * @param group the fanout group id.  Must be the same for all handles on an interface,
+ *	and different for each interface.
+ * @return 0 on success, -1 on error.
+ */
+int fr_pcap_fanout(fr_pcap_t *pcap, uint16_t group)
+{
+#ifdef PACKET_FANOUT
+	int arg;
+
+	if (pcap->type != PCAP_INTERFACE_IN) {
+		fr_strerror_printf("Fanout is only possible on live capture handles");
+		return -1;
+	}
+
+	arg = group | ((PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG) << 16);
+	if (setsockopt(pcap->fd, SOL_PACKET, PACKET_FANOUT, &arg, sizeof(arg)) < 0) {
+		fr_strerror_printf("Failed joining fanout group %u on \"%s\": %s", group, pcap->name,
+				   fr_syserror(errno));
+		return -1;
+	}
+
+	return 0;
+#else
+	fr_strerror_printf("Fanout is not supported on this platform (\"%s\", group %u)", pcap->name, group);
+	return -1;
+#endif
+}
+
 char *fr_pcap_device_names(TALLOC_CTX *ctx, fr_pcap_t *pcap, char c)
 {
 	fr_pcap_t *pcap_p;
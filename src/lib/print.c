@@ -94,7 +94,7 @@ int fr_utf8_char(uint8_t const *str)
 	}
 
 	if ((str[0] >= 0xf1) &&	/* 6 */
-	    (str[1] <= 0xf3) &&
+	    (str[0] <= 0xf3) &&
 	    (str[1] >= 0x80) &&
 	    (str[1] <= 0xbf) &&
 	    (str[2] >= 0x80) &&
@@ -121,6 +121,69 @@ int fr_utf8_char(uint8_t const *str)
 	return 0;
 }
 
+/*
+ *	Word-at-a-time checks, from "Bit Twiddling Hacks".  A byte of
+ *	the result has its top bit set if the corresponding input byte
+ *	is < 0x20, == 0x7f, or >= 0x80.  i.e. if it's not a printable
+ *	ASCII character.
+ */
+#define UTF8_ONES	(0x0101010101010101ULL)
+#define UTF8_HIGHS	(0x8080808080808080ULL)
+#define UTF8_NOT_PRINTABLE(_w) ((((_w) - (UTF8_ONES * 0x20)) | \
+				 (((_w) ^ (UTF8_ONES * 0x7f)) - UTF8_ONES) | (_w)) & UTF8_HIGHS)
+
+/** Check that a buffer is entirely valid UTF-8
+ *
+ * Accepts the same characters as fr_utf8_char(), but checks runs of
+ * printable ASCII eight bytes at a time.  Unlike fr_utf8_char(), this
+ * never reads past the end of the input.
+ *
+ * @param[in] str to check.
+ * @param[in] inlen length of str.
+ * @return the length of the longest valid prefix of str.  If this is
+ *	inlen, the whole string is valid.
+ */
+size_t fr_utf8_valid(uint8_t const *str, size_t inlen)
+{
+	uint8_t const	*p = str, *end = str + inlen, *stop;
+	uint64_t	word;
+	int		len;
+
+	while (p < end) {
+		while ((end - p) >= 8) {
+			memcpy(&word, p, sizeof(word));
+			if (UTF8_NOT_PRINTABLE(word)) break;
+			p += 8;
+		}
+
+		/*
+		 *	Something in the next eight bytes isn't
+		 *	printable ASCII.  Check them one character at
+		 *	a time, then go back to checking words.
+		 */
+		stop = p + 8;
+		while ((p < end) && (p < stop)) {
+			if ((end - p) >= 4) {
+				len = fr_utf8_char(p);
+			} else {
+				uint8_t tail[4] = { 0, 0, 0, 0 };
+
+				/*
+				 *	Zero padding means a truncated
+				 *	multi-byte character is invalid.
+				 */
+				memcpy(tail, p, end - p);
+				len = fr_utf8_char(tail);
+			}
+			if (len == 0) return p - str;
+
+			p += len;
+		}
+	}
+
+	return p - str;
+}
+
 /** Escape any non printable or non-UTF8 characters in the input string
  *
  * @param[in] in string to escape.
@@ -312,6 +375,155 @@ size_t fr_print_string_len(char const *in, size_t inlen, char quote)
 	return outlen;
 }
 
+/*
+ *	"00" to "99", so that integers can be printed two digits at
+ *	a time.
+ */
+static char const digits2[] =
+	"0001020304050607080910111213141516171819"
+	"2021222324252627282930313233343536373839"
+	"4041424344454647484950515253545556575859"
+	"6061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";
+
+static char const hexdigits[] = "0123456789abcdef";
+
+/** Print an unsigned integer in decimal
+ *
+ * @param[out] out Where to write the digits, must have space for 21 bytes.
+ * @param[in] num to print.
+ * @return the number of digits written.
+ */
+static size_t print_uint64(char *out, uint64_t num)
+{
+	char	buf[20];
+	char	*p = buf + sizeof(buf);
+	size_t	len;
+
+	while (num >= 100) {
+		unsigned int i = (num % 100) << 1;
+
+		num /= 100;
+		*--p = digits2[i + 1];
+		*--p = digits2[i];
+	}
+
+	if (num >= 10) {
+		*--p = digits2[(num << 1) + 1];
+		*--p = digits2[num << 1];
+	} else {
+		*--p = '0' + num;
+	}
+
+	len = (buf + sizeof(buf)) - p;
+	memcpy(out, p, len);
+	out[len] = '\0';
+
+	return len;
+}
+
+static size_t print_int32(char *out, int32_t num)
+{
+	if (num < 0) {
+		*out = '-';
+		return print_uint64(out + 1, -((int64_t) num)) + 1;
+	}
+
+	return print_uint64(out, num);
+}
+
+/** Print an IPv4 address in dotted quad notation
+ *
+ * @param[out] out Where to write the address, must have space for 16 bytes.
+ * @param[in] addr in network byte order.
+ * @return the length of the address.
+ */
+static size_t print_ipv4(char *out, uint8_t const *addr)
+{
+	char	*p = out;
+	int	i;
+
+	for (i = 0; i < 4; i++) {
+		unsigned int octet = addr[i];
+
+		if (octet >= 100) {
+			*p++ = '0' + (octet / 100);
+			octet = (octet % 100) << 1;
+			*p++ = digits2[octet];
+			*p++ = digits2[octet + 1];
+		} else if (octet >= 10) {
+			*p++ = digits2[octet << 1];
+			*p++ = digits2[(octet << 1) + 1];
+		} else {
+			*p++ = '0' + octet;
+		}
+		*p++ = '.';
+	}
+
+	*--p = '\0';
+
+	return p - out;
+}
+
+/*
+ *	Dates are often printed many times in the same second, e.g.
+ *	Event-Timestamp in detail files.  Remember the last one
+ *	printed by this thread, so that localtime_r() and strftime()
+ *	don't need to be called again.
+ */
+typedef struct print_date_cache_t {
+	time_t		date;
+	char		quote;
+	size_t		len;
+	char		buf[128];
+} print_date_cache_t;
+
+fr_thread_local_setup(print_date_cache_t *, print_date_cache)	/* macro */
+
+static void _print_date_cache_free(void *arg)
+{
+	free(arg);
+}
+
+static size_t print_date(char *buf, size_t buflen, time_t t, char quote)
+{
+	struct tm		s_tm;
+	size_t			len;
+	print_date_cache_t	*cache;
+
+	cache = fr_thread_local_init(print_date_cache, _print_date_cache_free);
+	if (!cache) {
+		cache = calloc(1, sizeof(*cache));
+		if (cache && (fr_thread_local_set(print_date_cache, cache) != 0)) {
+			free(cache);
+			cache = NULL;
+		}
+	}
+
+	if (cache && cache->len && (cache->date == t) && (cache->quote == quote) && (cache->len < buflen)) {
+		memcpy(buf, cache->buf, cache->len + 1);
+		return cache->len;
+	}
+
+	if (quote > 0) {
+		len = strftime(buf, buflen - 1, "%%%b %e %Y %H:%M:%S %Z%%", localtime_r(&t, &s_tm));
+		buf[0] = (char) quote;
+		buf[len - 1] = (char) quote;
+		buf[len] = '\0';
+	} else {
+		len = strftime(buf, buflen, "%b %e %Y %H:%M:%S %Z", localtime_r(&t, &s_tm));
+	}
+
+	if (cache && (len > 0) && (len < sizeof(cache->buf))) {
+		cache->date = t;
+		cache->quote = quote;
+		cache->len = len;
+		memcpy(cache->buf, buf, len + 1);
+	}
+
+	return len;
+}
+
 /** Print the value of an attribute to a string
  *
  */
@@ -323,7 +535,6 @@ size_t vp_data_prints_value(char *out, size_t outlen,
 	char		buf[1024];	/* Interim buffer to use with poorly behaved printing functions */
 	char const	*a = NULL;
 	time_t		t;
-	struct tm	s_tm;
 	unsigned int	i;
 
 	size_t		len = 0, freespace = outlen;
@@ -386,35 +597,30 @@ print_int:
 			len = strlen(a);
 		} else {
 			/* should never be truncated */
-			len = snprintf(buf, sizeof(buf), "%u", i);
+			len = print_uint64(buf, i);
 			a = buf;
 		}
 		break;
 
 	case PW_TYPE_INTEGER64:
-		return snprintf(out, outlen, "%" PRIu64, data->integer64);
+		len = print_uint64(buf, data->integer64);
+		a = buf;
+		break;
 
 	case PW_TYPE_DATE:
 		t = data->date;
-		if (quote > 0) {
-			len = strftime(buf, sizeof(buf) - 1, "%%%b %e %Y %H:%M:%S %Z%%", localtime_r(&t, &s_tm));
-			buf[0] = (char) quote;
-			buf[len - 1] = (char) quote;
-			buf[len] = '\0';
-		} else {
-			len = strftime(buf, sizeof(buf), "%b %e %Y %H:%M:%S %Z", localtime_r(&t, &s_tm));
-		}
+		len = print_date(buf, sizeof(buf), t, quote);
 		a = buf;
 		break;
 
 	case PW_TYPE_SIGNED: /* Damned code for 1 WiMAX attribute */
-		len = snprintf(buf, sizeof(buf), "%d", data->sinteger);
+		len = print_int32(buf, data->sinteger);
 		a = buf;
 		break;
 
 	case PW_TYPE_IPV4_ADDR:
-		a = inet_ntop(AF_INET, &(data->ipaddr), buf, sizeof(buf));
-		len = strlen(buf);
+		len = print_ipv4(buf, (uint8_t const *) &data->ipaddr);
+		a = buf;
 		break;
 
 	case PW_TYPE_ABINARY:
@@ -497,22 +703,28 @@ print_int:
 		 */
 		memcpy(&addr, &(data->ipv4prefix[2]), sizeof(addr));
 
-		a = inet_ntop(AF_INET, &addr, buf, sizeof(buf));
-		if (a) {
-			char *p = buf;
-
-			len = strlen(buf);
-			p += len;
-			len += snprintf(p, sizeof(buf) - len, "/%u", (unsigned int) (data->ipv4prefix[1] & 0x3f));
-		}
+		len = print_ipv4(buf, (uint8_t const *) &addr);
+		buf[len++] = '/';
+		len += print_uint64(buf + len, data->ipv4prefix[1] & 0x3f);
+		a = buf;
 	}
 		break;
 
 	case PW_TYPE_ETHERNET:
-		return snprintf(out, outlen, "%02x:%02x:%02x:%02x:%02x:%02x",
-				data->ether[0], data->ether[1],
-				data->ether[2], data->ether[3],
-				data->ether[4], data->ether[5]);
+	{
+		char *p = buf;
+
+		for (i = 0; i < 6; i++) {
+			*p++ = hexdigits[data->ether[i] >> 4];
+			*p++ = hexdigits[data->ether[i] & 0x0f];
+			*p++ = ':';
+		}
+		*--p = '\0';
+
+		len = p - buf;
+		a = buf;
+	}
+		break;
 
 	default:
 		a = "UNKNOWN-TYPE";
@@ -780,7 +992,19 @@ size_t vp_prints(char *out, size_t outlen, VALUE_PAIR const *vp)
 	if (vp->da->flags.has_tag && (vp->tag != TAG_ANY)) {
 		len = snprintf(out, freespace, "%s:%d %s ", vp->da->name, vp->tag, token);
 	} else {
-		len = snprintf(out, freespace, "%s %s ", vp->da->name, token);
+		size_t name_len = strlen(vp->da->name);
+		size_t token_len = strlen(token);
+
+		len = name_len + token_len + 2;
+		if (len < freespace) {
+			memcpy(out, vp->da->name, name_len);
+			out[name_len] = ' ';
+			memcpy(out + name_len + 1, token, token_len);
+			out[len - 1] = ' ';
+			out[len] = '\0';
+		} else {
+			len = snprintf(out, freespace, "%s %s ", vp->da->name, token);
+		}
 	}
 
 	if (is_truncated(len, freespace)) return len;
@@ -831,17 +1055,106 @@ void vp_print(FILE *fp, VALUE_PAIR const *vp)
 }
 
 
+/*
+ *	Print one attribute and value, with a prefix and suffix.
+ */
+static size_t vp_prints_affix(char *out, size_t outlen, VALUE_PAIR const *vp,
+			      char const *prefix, size_t prefix_len, char const *suffix, size_t suffix_len)
+{
+	size_t len;
+
+	if (prefix_len >= outlen) return prefix_len + 1;
+	if (prefix_len) memcpy(out, prefix, prefix_len);
+
+	len = vp_prints(out + prefix_len, outlen - prefix_len, vp);
+	if (is_truncated(len, outlen - prefix_len)) return prefix_len + len;
+	len += prefix_len;
+
+	if (suffix_len >= (outlen - len)) return len + suffix_len;
+	if (suffix_len) memcpy(out + len, suffix, suffix_len + 1);
+
+	return len + suffix_len;
+}
+
+/** Print a list of attributes and values to a string
+ *
+ * Each attribute is printed as by vp_prints(), with an optional
+ * prefix and suffix, e.g. "\t" and "\n" for detail files.
+ *
+ * @param out Where to write the string.
+ * @param outlen Length of output buffer.
+ * @param vps to print.
+ * @param prefix printed before each attribute, may be NULL.
+ * @param suffix printed after each attribute, may be NULL.
+ * @return the length of data written to out, or a value >= outlen on truncation.
+ */
+size_t vp_prints_list(char *out, size_t outlen, VALUE_PAIR const *vps, char const *prefix, char const *suffix)
+{
+	vp_cursor_t	cursor;
+	VALUE_PAIR	*vp;
+	size_t		len, freespace = outlen;
+	size_t		prefix_len = prefix ? strlen(prefix) : 0;
+	size_t		suffix_len = suffix ? strlen(suffix) : 0;
+
+	if (!out || !outlen) return 0;
+	*out = '\0';
+
+	for (vp = fr_cursor_init(&cursor, &vps); vp; vp = fr_cursor_next(&cursor)) {
+		len = vp_prints_affix(out, freespace, vp, prefix, prefix_len, suffix, suffix_len);
+		if (is_truncated(len, freespace)) {
+			*out = '\0';
+			return (outlen - freespace) + len;
+		}
+		out += len;
+		freespace -= len;
+	}
+
+	return outlen - freespace;
+}
+
 /** Print a list of attributes and values
+ *
+ * The attributes are printed into a buffer, which is written to
+ * the file when it fills, instead of one write per attribute.
  *
  * @param fp to output to.
  * @param vp to print.
  */
 void vp_printlist(FILE *fp, VALUE_PAIR const *vp)
 {
-	vp_cursor_t cursor;
+	vp_cursor_t	cursor;
+	char		buf[8192];
+	size_t		len, used = 0;
+
 	for (vp = fr_cursor_init(&cursor, &vp); vp; vp = fr_cursor_next(&cursor)) {
+		len = vp_prints_affix(buf + used, sizeof(buf) - used, vp, "\t", 1, "\n", 1);
+		if (!is_truncated(len, sizeof(buf) - used)) {
+			used += len;
+			continue;
+		}
+
+		if (used) {
+			buf[used] = '\0';
+			fputs(buf, fp);
+			used = 0;
+
+			len = vp_prints_affix(buf, sizeof(buf), vp, "\t", 1, "\n", 1);
+			if (!is_truncated(len, sizeof(buf))) {
+				used = len;
+				continue;
+			}
+		}
+
+		/*
+		 *	Too big for the buffer, let vp_print() truncate it.
+		 */
 		vp_print(fp, vp);
 	}
+
+	if (used) {
+		buf[used] = '\0';
+		fputs(buf, fp);
+	}
 }
 
 
@@ -64,6 +64,16 @@ static void VP_HEXDUMP(char const *msg, uint8_t const *data, size_t len)
  */
 #define MAX_PACKET_LEN 4096
 
+/*
+ *	Received packets are allocated as talloc pools, so that the
+ *	packet data, the decoded attributes, and their values are
+ *	carved out of one block of memory, instead of needing a
+ *	malloc() each.  Anything which doesn't fit is allocated as
+ *	usual.
+ */
+#define RECV_POOL_OBJECTS	(32)
+#define RECV_POOL_SIZE		(2048)
+
 /*
  *	The maximum number of attributes which we allow in an incoming
  *	request.  If there are more attributes than this, the request
@@ -88,6 +98,15 @@ typedef struct radius_packet_t {
 
 static fr_randctx fr_rand_pool;	/* across multiple calls */
 static int fr_rand_initialized = 0;
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t fr_rand_mutex = PTHREAD_MUTEX_INITIALIZER;
+#  define RAND_LOCK pthread_mutex_lock(&fr_rand_mutex)
+#  define RAND_UNLOCK pthread_mutex_unlock(&fr_rand_mutex)
+#else
+#  define RAND_LOCK
+#  define RAND_UNLOCK
+#endif
+fr_thread_local_setup(fr_randctx *, fr_rand_thread)	/* macro */
 static unsigned int salt_offset = 0;
 static uint8_t nullvector[AUTH_VECTOR_LEN] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 }; /* for CoA decode */
 
@@ -381,10 +400,269 @@ ssize_t rad_recv_header(int sockfd, fr_ipaddr_t *src_ipaddr, uint16_t *src_port,
 }
 
 
+/** Peek at the RADIUS header of the next packet, without reading it
+ *
+ * Fills in the addresses, socket, code, ID, length and vector of a
+ * caller-supplied packet, which is enough to look it up in a list of
+ * packets.  packet->data is NULL.
+ *
+ * @param sockfd to peek at.
+ * @param packet to fill in.
+ * @return -1 on error, 0 if nothing was read, 1 if the packet was
+ *	discarded, otherwise the packet length from the header.
+ */
+ssize_t rad_recv_peek(int sockfd, RADIUS_PACKET *packet)
+{
+	ssize_t			data_len, packet_len;
+	uint8_t			header[RADIUS_HDR_LEN];
+	struct sockaddr_storage	src;
+	struct sockaddr_storage	dst;
+	socklen_t		sizeof_src = sizeof(src);
+	socklen_t		sizeof_dst = sizeof(dst);
+
+	memset(&src, 0, sizeof_src);
+	memset(&dst, 0, sizeof_dst);
+	memset(packet, 0, sizeof(*packet));
+
+#ifdef WITH_UDPFROMTO
+	data_len = recvfromto(sockfd, header, sizeof(header), MSG_PEEK,
+			      (struct sockaddr *)&src, &sizeof_src,
+			      (struct sockaddr *)&dst, &sizeof_dst);
+#else
+	data_len = recvfrom(sockfd, header, sizeof(header), MSG_PEEK,
+			    (struct sockaddr *)&src, &sizeof_src);
+	if ((data_len >= 0) &&
+	    (getsockname(sockfd, (struct sockaddr *)&dst, &sizeof_dst) < 0)) return -1;
+#endif
+	if (data_len < 0) {
+		if ((errno == EAGAIN) || (errno == EINTR)) return 0;
+		return -1;
+	}
+
+	/*
+	 *	Same checks as rad_recv_header(), but we need the
+	 *	whole header.
+	 */
+	if (data_len < RADIUS_HDR_LEN) {
+		rad_recv_discard(sockfd);
+		return 1;
+	}
+
+	packet_len = (header[2] * 256) + header[3];
+	if ((packet_len < RADIUS_HDR_LEN) || (packet_len > MAX_PACKET_LEN)) {
+		rad_recv_discard(sockfd);
+		return 1;
+	}
+
+	if (!fr_sockaddr2ipaddr(&src, sizeof_src, &packet->src_ipaddr, &packet->src_port) ||
+	    !fr_sockaddr2ipaddr(&dst, sizeof_dst, &packet->dst_ipaddr, &packet->dst_port) ||
+	    (src.ss_family != dst.ss_family)) {
+		rad_recv_discard(sockfd);
+		return 1;
+	}
+
+	packet->sockfd = sockfd;
+	packet->code = header[0];
+	packet->id = header[1];
+	packet->data_len = packet_len;
+	memcpy(packet->vector, header + 4, sizeof(packet->vector));
+
+	return packet_len;
+}
+
+
+/*
+ *	A receive buffer.  Packets read with rad_recv_ring() point
+ *	into one of these, instead of having their own copy of the
+ *	data.
+ */
+typedef struct rad_ring_buf {
+	rad_ring_t		*ring;		//!< Ring the buffer belongs to.
+	struct rad_ring_buf	*next;		//!< Next free buffer.
+	uint8_t			data[MAX_PACKET_LEN];
+} rad_ring_buf_t;
+
+/*
+ *	Buffers are released in whatever order the packets are
+ *	decoded, so the free ones are kept on a list.  The most
+ *	recently released buffer is re-used first, as it's the
+ *	one most likely to still be in the cache.
+ */
+struct rad_ring {
+	int			num;		//!< Number of buffers.
+	int			used;		//!< Buffers referenced by packets.
+	bool			freed;		//!< rad_ring_free() has been called.
+	rad_ring_buf_t		*free;		//!< Buffers which aren't in use.
+	rad_ring_buf_t		*bufs;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t		mutex;
+#endif
+};
+
+#ifdef HAVE_PTHREAD_H
+#  define RING_LOCK(_x) pthread_mutex_lock(&(_x)->mutex)
+#  define RING_UNLOCK(_x) pthread_mutex_unlock(&(_x)->mutex)
+#else
+#  define RING_LOCK(_x)
+#  define RING_UNLOCK(_x)
+#endif
+
+/** Allocate a ring of receive buffers for use with rad_recv_ring()
+ *
+ * The ring isn't parented by anything, as packets may still refer
+ * to it after its owner is gone.  Use rad_ring_free() to free it.
+ *
+ * @param num number of buffers.
+ * @return the new ring, or NULL on error.
+ */
+rad_ring_t *rad_ring_alloc(int num)
+{
+	int		i;
+	rad_ring_t	*ring;
+
+	if (num <= 0) {
+		fr_strerror_printf("Invalid number of receive buffers %d", num);
+		return NULL;
+	}
+
+	ring = talloc_zero(NULL, rad_ring_t);
+	if (!ring) {
+	oom:
+		fr_strerror_printf("out of memory");
+		talloc_free(ring);
+		return NULL;
+	}
+
+	ring->num = num;
+	ring->bufs = talloc_array(ring, rad_ring_buf_t, num);
+	if (!ring->bufs) goto oom;
+
+	for (i = num - 1; i >= 0; i--) {
+		ring->bufs[i].ring = ring;
+		ring->bufs[i].next = ring->free;
+		ring->free = &ring->bufs[i];
+	}
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_init(&ring->mutex, NULL);
+#endif
+
+	return ring;
+}
+
+/*
+ *	Called with the ring locked.  Unlocks it, and frees it if
+ *	nothing refers to it any more.
+ */
+static void rad_ring_unlock(rad_ring_t *ring)
+{
+	bool done;
+
+	done = ring->freed && (ring->used == 0);
+	RING_UNLOCK(ring);
+
+	if (!done) return;
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_destroy(&ring->mutex);
+#endif
+	talloc_free(ring);
+}
+
+/** Free a ring of receive buffers
+ *
+ * If packets still refer to buffers in the ring, it's freed when
+ * the last of them is released.
+ *
+ * @param ring to free.
+ */
+void rad_ring_free(rad_ring_t **ring)
+{
+	if (!ring || !*ring) return;
+
+	RING_LOCK(*ring);
+	(*ring)->freed = true;
+	rad_ring_unlock(*ring);
+
+	*ring = NULL;
+}
+
+static rad_ring_buf_t *rad_ring_get(rad_ring_t *ring)
+{
+	rad_ring_buf_t *buf;
+
+	RING_LOCK(ring);
+	buf = ring->free;
+	if (buf) {
+		ring->free = buf->next;
+		ring->used++;
+	}
+	RING_UNLOCK(ring);
+
+	return buf;
+}
+
+static void rad_ring_put(rad_ring_buf_t *buf)
+{
+	rad_ring_t *ring = buf->ring;
+
+	RING_LOCK(ring);
+	buf->next = ring->free;
+	ring->free = buf;
+	ring->used--;
+	rad_ring_unlock(ring);
+}
+
+static int _rad_packet_ring_free(RADIUS_PACKET *packet)
+{
+	rad_packet_release(packet);
+	return 0;
+}
+
+/*
+ *	Point the packet at a receive buffer.  If they're all in
+ *	use, give the packet its own buffer, the same as rad_recv().
+ */
+static uint8_t *rad_ring_data(rad_ring_t *ring, RADIUS_PACKET *packet, size_t len)
+{
+	rad_ring_buf_t *buf;
+
+	if (!ring || !(buf = rad_ring_get(ring))) {
+		return talloc_array(packet, uint8_t, len);
+	}
+
+	packet->ring_buf = buf;
+	talloc_set_destructor(packet, _rad_packet_ring_free);
+
+	return buf->data;
+}
+
+/** Release the receive buffer a packet refers to
+ *
+ * Called once the packet has been decoded, as nothing needs
+ * packet->data after that.  packet->data is then NULL, but
+ * packet->data_len is left alone.
+ *
+ * Packets which have their own copy of the data are left alone.
+ *
+ * @param packet to release the buffer of.
+ */
+void rad_packet_release(RADIUS_PACKET *packet)
+{
+	if (!packet || !packet->ring_buf) return;
+
+	talloc_set_destructor(packet, NULL);
+
+	rad_ring_put(packet->ring_buf);
+	packet->ring_buf = NULL;
+	packet->data = NULL;
+}
+
+
 /** Wrapper for recvfrom, which handles recvfromto, IPv6, and all possible combinations
  *
  */
-static ssize_t rad_recvfrom(int sockfd, RADIUS_PACKET *packet, int flags,
+static ssize_t rad_recvfrom(int sockfd, RADIUS_PACKET *packet, rad_ring_t *ring, int flags,
 			    fr_ipaddr_t *src_ipaddr, uint16_t *src_port,
 			    fr_ipaddr_t *dst_ipaddr, uint16_t *dst_port)
 {
@@ -446,7 +724,7 @@ static ssize_t rad_recvfrom(int sockfd, RADIUS_PACKET *packet, int flags,
 		}
 	}
 
-	packet->data = talloc_array(packet, uint8_t, len);
+	packet->data = rad_ring_data(ring, packet, len);
 	if (!packet->data) return -1;
 
 	/*
@@ -1314,6 +1592,7 @@ static ssize_t vp2attr_rfc(RADIUS_PACKET const *packet,
 	ptr[0] = attribute & 0xff;
 	ptr[1] = 2;
 
+	room -= ptr[1];
 	if (room > ((unsigned) 255 - ptr[1])) room = 255 - ptr[1];
 
 	len = vp2data_any(packet, original, secret, 0, pvp, ptr + ptr[1], room);
@@ -1358,6 +1637,11 @@ static ssize_t vp2attr_vsa(RADIUS_PACKET const *packet,
 				   attribute, ptr, room);
 	}
 
+	/*
+	 *	Not enough room for the header, and some data.
+	 */
+	if (room <= (size_t) (dv->type + dv->length)) return 0;
+
 	switch (dv->type) {
 	default:
 		fr_strerror_printf("vp2attr_vsa: Internal sanity check failed,"
@@ -1401,6 +1685,7 @@ static ssize_t vp2attr_vsa(RADIUS_PACKET const *packet,
 
 	}
 
+	room -= dv->type + dv->length;
 	if (room > ((unsigned) 255 - (dv->type + dv->length))) {
 		room = 255 - (dv->type + dv->length);
 	}
@@ -1501,12 +1786,13 @@ int rad_vp2vsa(RADIUS_PACKET const *packet, RADIUS_PACKET const *original,
 	lvalue = htonl(vp->da->vendor);
 	memcpy(ptr + 2, &lvalue, 4);
 
+	room -= ptr[1];
 	if (room > ((unsigned) 255 - ptr[1])) room = 255 - ptr[1];
 
 	len = vp2attr_vsa(packet, original, secret, pvp,
 			  vp->da->attr, vp->da->vendor,
 			  ptr + ptr[1], room);
-	if (len < 0) return len;
+	if (len <= 0) return len;
 
 #ifndef NDEBUG
 	if ((fr_debug_flag > 3) && fr_log_fp) {
@@ -1634,6 +1920,106 @@ static ssize_t rad_vp2rfctlv(RADIUS_PACKET const *packet,
 	return start[1];
 }
 
+/** Encode an attribute using the header the dictionary worked out for it
+ *
+ * @return the length of the attribute, or 0 if it has to go through
+ *	the full encoder instead.
+ */
+static ssize_t vp2attr_encode(VALUE_PAIR const *vp, uint8_t *start, size_t room)
+{
+	ATTR_ENCODE const *enc = &vp->da->encode;
+	uint8_t const	*data;
+	size_t		len;
+	uint8_t		array[8];
+	uint32_t	lvalue;
+	uint64_t	lvalue64;
+
+#ifndef NDEBUG
+	/*
+	 *	Let the full encoder print the hex dump.
+	 */
+	if ((fr_debug_flag > 3) && fr_log_fp) return 0;
+#endif
+
+	len = vp->length;
+
+	switch (vp->da->type) {
+	case PW_TYPE_STRING:
+	case PW_TYPE_OCTETS:
+		data = vp->data.ptr;
+		if (!data) return 0;
+		break;
+
+	case PW_TYPE_IFID:
+	case PW_TYPE_IPV4_ADDR:
+	case PW_TYPE_IPV6_ADDR:
+	case PW_TYPE_IPV6_PREFIX:
+	case PW_TYPE_IPV4_PREFIX:
+	case PW_TYPE_ABINARY:
+	case PW_TYPE_ETHERNET:
+		data = (uint8_t const *) &vp->data;
+		break;
+
+	case PW_TYPE_BYTE:
+		len = 1;
+		array[0] = vp->vp_byte;
+		data = array;
+		break;
+
+	case PW_TYPE_SHORT:
+		len = 2;
+		array[0] = (vp->vp_short >> 8) & 0xff;
+		array[1] = vp->vp_short & 0xff;
+		data = array;
+		break;
+
+	case PW_TYPE_INTEGER:
+		len = 4;
+		lvalue = htonl(vp->vp_integer);
+		memcpy(array, &lvalue, sizeof(lvalue));
+		data = array;
+		break;
+
+	case PW_TYPE_INTEGER64:
+		len = 8;
+		lvalue64 = htonll(vp->vp_integer64);
+		memcpy(array, &lvalue64, sizeof(lvalue64));
+		data = array;
+		break;
+
+	case PW_TYPE_DATE:
+		len = 4;
+		lvalue = htonl(vp->vp_date);
+		memcpy(array, &lvalue, sizeof(lvalue));
+		data = array;
+		break;
+
+	case PW_TYPE_SIGNED:
+		len = 4;
+		lvalue = htonl(vp->vp_signed);
+		memcpy(array, &lvalue, sizeof(lvalue));
+		data = array;
+		break;
+
+	default:
+		return 0;
+	}
+
+	/*
+	 *	Empty attributes, and ones which have to be
+	 *	truncated, are left to the full encoder.
+	 */
+	if ((len == 0) || ((enc->hdr_len + len) > 255) || ((enc->hdr_len + len) > room)) return 0;
+
+	memcpy(start, enc->hdr, enc->hdr_len);
+	memcpy(start + enc->hdr_len, data, len);
+
+	start[1] += len;
+	if (enc->vsa_len) start[enc->vsa_len] += len;
+
+	return enc->hdr_len + len;
+}
+
 /** Parse a data structure into a RADIUS attribute
  *
  */
@@ -1643,12 +2029,30 @@ int rad_vp2attr(RADIUS_PACKET const *packet, RADIUS_PACKET const *original,
 {
 	VALUE_PAIR const *vp;
 
-	if (!pvp || !*pvp || !start || (room <= 2)) return -1;
+	if (!pvp || !*pvp || !start) return -1;
+
+	/*
+	 *	The packet is full.
+	 */
+	if (room <= 2) return 0;
 
 	vp = *pvp;
 
 	VERIFY_VP(vp);
 
+	/*
+	 *	Most attributes don't need the full encoder.
+	 */
+	if (vp->da->encode.hdr_len) {
+		ssize_t len;
+
+		len = vp2attr_encode(vp, start, room);
+		if (len > 0) {
+			*pvp = vp->next;
+			return len;
+		}
+	}
+
 	/*
 	 *	RFC format attributes take the fast path.
 	 */
@@ -1840,6 +2244,7 @@ int rad_encode(RADIUS_PACKET *packet, RADIUS_PACKET const *original,
 	 */
 	packet->data_len = total_length;
 	packet->data = talloc_array(packet, uint8_t, packet->data_len);
+	packet->indexed = false;
 	if (!packet->data) {
 		fr_strerror_printf("Out of memory");
 		return -1;
@@ -1855,6 +2260,84 @@ int rad_encode(RADIUS_PACKET *packet, RADIUS_PACKET const *original,
 }
 
 
+/*
+ *	The HMAC-MD5 pads for the shared secrets this thread has
+ *	used recently.  There are usually only a few secrets in
+ *	use, so hashing the pads once per secret instead of once
+ *	per packet saves two MD5 blocks per Message-Authenticator.
+ */
+#define RAD_HMAC_CACHE_SIZE (8)
+
+typedef struct rad_hmac_cache_t {
+	int			next;		//!< Entry to replace next.
+	struct {
+		char		*secret;
+		size_t		secret_len;
+		FR_HMAC_MD5_CTX	ctx;
+	} entry[RAD_HMAC_CACHE_SIZE];
+} rad_hmac_cache_t;
+
+fr_thread_local_setup(rad_hmac_cache_t *, rad_hmac_cache)	/* macro */
+
+static void _rad_hmac_cache_free(void *arg)
+{
+	int i;
+	rad_hmac_cache_t *cache = arg;
+
+	for (i = 0; i < RAD_HMAC_CACHE_SIZE; i++) free(cache->entry[i].secret);
+	free(cache);
+}
+
+/*
+ *	HMAC-MD5 keyed with a shared secret.
+ */
+static void rad_hmac_md5(uint8_t digest[MD5_DIGEST_LENGTH], uint8_t const *text, size_t text_len,
+			 char const *secret)
+{
+	int			i;
+	size_t			secret_len = strlen(secret);
+	rad_hmac_cache_t	*cache;
+	char			*copy;
+
+	cache = fr_thread_local_init(rad_hmac_cache, _rad_hmac_cache_free);
+	if (!cache) {
+		cache = calloc(1, sizeof(*cache));
+		if (!cache) goto uncached;
+
+		if (fr_thread_local_set(rad_hmac_cache, cache) != 0) {
+			free(cache);
+			goto uncached;
+		}
+	}
+
+	for (i = 0; i < RAD_HMAC_CACHE_SIZE; i++) {
+		if (cache->entry[i].secret &&
+		    (cache->entry[i].secret_len == secret_len) &&
+		    (memcmp(cache->entry[i].secret, secret, secret_len) == 0)) {
+			fr_hmac_md5_ctx(digest, text, text_len, &cache->entry[i].ctx);
+			return;
+		}
+	}
+
+	copy = malloc(secret_len + 1);
+	if (!copy) {
+	uncached:
+		fr_hmac_md5(digest, text, text_len, (uint8_t const *) secret, secret_len);
+		return;
+	}
+	memcpy(copy, secret, secret_len + 1);
+
+	i = cache->next;
+	cache->next = (i + 1) % RAD_HMAC_CACHE_SIZE;
+
+	free(cache->entry[i].secret);
+	cache->entry[i].secret = copy;
+	cache->entry[i].secret_len = secret_len;
+	fr_hmac_md5_init(&cache->entry[i].ctx, (uint8_t const *) secret, secret_len);
+
+	fr_hmac_md5_ctx(digest, text, text_len, &cache->entry[i].ctx);
+}
+
 /** Sign a previously encoded packet
  *
  */
@@ -1922,8 +2405,7 @@ int rad_sign(RADIUS_PACKET *packet, RADIUS_PACKET const *original,
 		 *	into the Message-Authenticator
 		 *	attribute.
 		 */
-		fr_hmac_md5(calc_auth_vector, packet->data, packet->data_len,
-			    (uint8_t const *) secret, strlen(secret));
+		rad_hmac_md5(calc_auth_vector, packet->data, packet->data_len, secret);
 		memcpy(packet->data + packet->offset + 2,
 		       calc_auth_vector, AUTH_VECTOR_LEN);
 
@@ -2246,9 +2728,13 @@ bool rad_packet_ok(RADIUS_PACKET *packet, int flags, decode_fail_t *reason)
 	char			host_ipaddr[128];
 	bool			require_ma = false;
 	bool			seen_ma = false;
+	bool			dup_ma = false;
 	uint32_t		num_attributes;
+	uint16_t		ma_offset = 0;
 	decode_fail_t		failure = DECODE_FAIL_NONE;
 
+	packet->indexed = false;
+
 	/*
 	 *	Check for packets smaller than the packet header.
 	 *
@@ -2465,6 +2951,8 @@ bool rad_packet_ok(RADIUS_PACKET *packet, int flags, decode_fail_t *reason)
 				failure = DECODE_FAIL_MA_INVALID_LENGTH;
 				goto finish;
 			}
+			if (seen_ma) dup_ma = true;
+			ma_offset = attr - packet->data;
 			seen_ma = true;
 			break;
 		}
@@ -2537,6 +3025,14 @@ bool rad_packet_ok(RADIUS_PACKET *packet, int flags, decode_fail_t *reason)
 	packet->id = hdr->id;
 	memcpy(packet->vector, hdr->vector, AUTH_VECTOR_LEN);
 
+	/*
+	 *	Remember where the Message-Authenticator is, so that
+	 *	rad_verify() doesn't have to walk the packet again.
+	 *	With more than one, rad_verify() checks them all, as
+	 *	before.
+	 */
+	packet->ma_offset = ma_offset;
+	packet->indexed = !dup_ma;
 
 	finish:
 
@@ -2547,19 +3043,88 @@ bool rad_packet_ok(RADIUS_PACKET *packet, int flags, decode_fail_t *reason)
 }
 
 
-/** Receive UDP client requests, and fill in the basics of a RADIUS_PACKET structure
- *
+/*
+ *	Set the default fields of a new packet.
  */
-RADIUS_PACKET *rad_recv(int fd, int flags)
+static RADIUS_PACKET *rad_packet_init(RADIUS_PACKET *rp, bool new_vector)
 {
-	int sock_flags = 0;
-	ssize_t data_len;
-	RADIUS_PACKET		*packet;
+	rp->id = -1;
+	rp->offset = -1;
+
+	if (new_vector) {
+		int i;
+		uint32_t hash, base;
+
+		/*
+		 *	Don't expose the actual contents of the random
+		 *	pool.
+		 */
+		base = fr_rand();
+		fr_rand_fill(rp->vector, AUTH_VECTOR_LEN);
+		for (i = 0; i < AUTH_VECTOR_LEN; i += sizeof(uint32_t)) {
+			memcpy(&hash, rp->vector + i, sizeof(hash));
+			hash ^= base;
+			memcpy(rp->vector + i, &hash, sizeof(hash));
+		}
+	}
+	fr_rand();		/* stir the pool again */
+
+	return rp;
+}
+
+/*
+ *	Allocate a packet which is about to be read from the network.
+ */
+static RADIUS_PACKET *rad_alloc_recv(void)
+{
+#ifdef talloc_pooled_object
+	RADIUS_PACKET	*rp;
+
+	rp = talloc_pooled_object(NULL, RADIUS_PACKET, RECV_POOL_OBJECTS, RECV_POOL_SIZE);
+	if (!rp) {
+		fr_strerror_printf("out of memory");
+		return NULL;
+	}
+	memset(rp, 0, sizeof(*rp));
+	talloc_set_type(rp, RADIUS_PACKET);
+
+	return rad_packet_init(rp, false);
+#else
+	return rad_alloc(NULL, false);
+#endif
+}
+
+
+/** Receive UDP client requests, and fill in the basics of a RADIUS_PACKET structure
+ *
+ */
+RADIUS_PACKET *rad_recv(int fd, int flags)
+{
+	return rad_recv_ring(NULL, fd, flags);
+}
+
+/** Receive a UDP client request into a buffer from a ring
+ *
+ * The same as rad_recv(), but packet->data points into a buffer
+ * from the ring, which saves allocating and copying it.  Call
+ * rad_packet_release() once the packet has been decoded, so that
+ * the buffer can be re-used.  Freeing the packet releases it, too.
+ *
+ * @param ring to use, or NULL to allocate the data as rad_recv() does.
+ * @param fd to read from.
+ * @param flags as for rad_recv().
+ * @return the new packet, or NULL on error.
+ */
+RADIUS_PACKET *rad_recv_ring(rad_ring_t *ring, int fd, int flags)
+{
+	int sock_flags = 0;
+	ssize_t data_len;
+	RADIUS_PACKET		*packet;
 
 	/*
 	 *	Allocate the new request data structure
 	 */
-	packet = rad_alloc(NULL, false);
+	packet = rad_alloc_recv();
 	if (!packet) {
 		fr_strerror_printf("out of memory");
 		return NULL;
@@ -2570,7 +3135,7 @@ RADIUS_PACKET *rad_recv(int fd, int flags)
 		flags &= ~0x02;
 	}
 
-	data_len = rad_recvfrom(fd, packet, sock_flags,
+	data_len = rad_recvfrom(fd, packet, ring, sock_flags,
 				&packet->src_ipaddr, &packet->src_port,
 				&packet->dst_ipaddr, &packet->dst_port);
 
@@ -2640,6 +3205,581 @@ RADIUS_PACKET *rad_recv(int fd, int flags)
 	return packet;
 }
 
+#ifdef WITH_RADIUS_BATCH
+/*
+ *	One datagram in a batch.
+ */
+typedef struct rad_batch_slot_t {
+	uint8_t			data[MAX_PACKET_LEN];
+	uint8_t			*buf;		//!< Received data, either "data" or ring_buf.
+	rad_ring_buf_t		*ring_buf;	//!< Receive buffer, if reading into a ring.
+	struct sockaddr_storage	addr;		//!< Source on receive, destination on send.
+	char			cbuf[256];	//!< Control data for udpfromto.
+	struct iovec		iov;
+} rad_batch_slot_t;
+
+struct rad_batch {
+	int			num;		//!< Number of slots.
+	int			count;		//!< Slots received or queued.
+	int			sockfd;		//!< Socket the slots belong to.
+
+	struct sockaddr_storage	bound;		//!< Address the socket is bound to.
+	socklen_t		sizeof_bound;
+
+	rad_batch_slot_t	*slots;
+	struct mmsghdr		*msgs;
+};
+
+/*
+ *	Give back any receive buffers from "start" onwards which
+ *	weren't turned into packets.
+ */
+static void rad_batch_release(rad_batch_t *batch, int start)
+{
+	int i;
+
+	for (i = start; i < batch->num; i++) {
+		if (!batch->slots[i].ring_buf) continue;
+
+		rad_ring_put(batch->slots[i].ring_buf);
+		batch->slots[i].ring_buf = NULL;
+	}
+}
+
+static int _rad_batch_free(rad_batch_t *batch)
+{
+	if (batch->slots) rad_batch_release(batch, 0);
+	return 0;
+}
+
+/** Allocate a batch for use with rad_batch_recv() or rad_batch_send()
+ *
+ * A batch is used either for receiving, or for sending, not both.
+ *
+ * @param ctx to allocate the batch in.
+ * @param num maximum number of datagrams to receive or send with one
+ *	system call.
+ * @return the new batch, or NULL on error.
+ */
+rad_batch_t *rad_batch_alloc(TALLOC_CTX *ctx, int num)
+{
+	rad_batch_t *batch;
+
+	if (num <= 0) {
+		fr_strerror_printf("Invalid batch size %d", num);
+		return NULL;
+	}
+
+	batch = talloc_zero(ctx, rad_batch_t);
+	if (!batch) {
+	oom:
+		fr_strerror_printf("out of memory");
+		talloc_free(batch);
+		return NULL;
+	}
+
+	batch->num = num;
+	batch->sockfd = -1;
+	batch->slots = talloc_zero_array(batch, rad_batch_slot_t, num);
+	if (!batch->slots) goto oom;
+	batch->msgs = talloc_zero_array(batch, struct mmsghdr, num);
+	if (!batch->msgs) goto oom;
+
+	talloc_set_destructor(batch, _rad_batch_free);
+
+	return batch;
+}
+
+/** Return the number of datagrams a batch can hold
+ *
+ */
+int rad_batch_size(rad_batch_t const *batch)
+{
+	return batch->num;
+}
+
+/** Read as many pending datagrams as will fit in the batch
+ *
+ * Blocks until the first datagram arrives, the same as rad_recv()
+ * does on a blocking socket, but doesn't wait for more after that.
+ * The datagrams are turned into packets with rad_batch_packet().
+ *
+ * @param batch to read into.  Any previously received datagrams are
+ *	discarded.
+ * @param sockfd to read from.
+ * @param ring to read the datagrams into, or NULL to read them into
+ *	the batch.  Packets from the ring are released as for
+ *	rad_recv_ring().
+ * @return the number of datagrams read, or -1 on error.
+ */
+int rad_batch_recv(rad_batch_t *batch, int sockfd, rad_ring_t *ring)
+{
+	int i, rcode;
+
+	rad_batch_release(batch, 0);
+
+	batch->count = 0;
+	batch->sockfd = sockfd;
+
+	batch->sizeof_bound = sizeof(batch->bound);
+	if (getsockname(sockfd, (struct sockaddr *) &batch->bound, &batch->sizeof_bound) < 0) {
+		fr_strerror_printf("Failed getting socket name: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	for (i = 0; i < batch->num; i++) {
+		rad_batch_slot_t	*slot = &batch->slots[i];
+		struct msghdr		*msgh = &batch->msgs[i].msg_hdr;
+
+		slot->buf = slot->data;
+		if (ring) {
+			slot->ring_buf = rad_ring_get(ring);
+			if (slot->ring_buf) slot->buf = slot->ring_buf->data;
+		}
+
+		slot->iov.iov_base = slot->buf;
+		slot->iov.iov_len = sizeof(slot->data);
+
+		memset(msgh, 0, sizeof(*msgh));
+		msgh->msg_iov = &slot->iov;
+		msgh->msg_iovlen = 1;
+		msgh->msg_name = &slot->addr;
+		msgh->msg_namelen = sizeof(slot->addr);
+#ifdef WITH_UDPFROMTO
+		msgh->msg_control = slot->cbuf;
+		msgh->msg_controllen = sizeof(slot->cbuf);
+#endif
+	}
+
+#ifdef MSG_WAITFORONE
+	rcode = recvmmsg(sockfd, batch->msgs, batch->num, MSG_WAITFORONE, NULL);
+#else
+	/*
+	 *	Wait for the first one, then pick up whatever else
+	 *	is already queued.
+	 */
+	rcode = recvmmsg(sockfd, batch->msgs, 1, 0, NULL);
+	if ((rcode == 1) && (batch->num > 1)) {
+		int more;
+
+		more = recvmmsg(sockfd, batch->msgs + 1, batch->num - 1, MSG_DONTWAIT, NULL);
+		if (more > 0) rcode += more;
+	}
+#endif
+	if (rcode < 0) {
+		rad_batch_release(batch, 0);
+
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) return 0;
+
+		fr_strerror_printf("Error receiving packets: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	rad_batch_release(batch, rcode);
+	batch->count = rcode;
+
+	return rcode;
+}
+
+/*
+ *	Fill in the addresses of a received datagram.  Returns the
+ *	number of bytes of data it has.
+ */
+static ssize_t rad_batch_addr(rad_batch_t *batch, int i, RADIUS_PACKET *packet)
+{
+	rad_batch_slot_t	*slot;
+	struct msghdr		*msgh;
+	struct sockaddr_storage	dst;
+	socklen_t		sizeof_dst;
+
+	if ((i < 0) || (i >= batch->count)) {
+		fr_strerror_printf("Invalid batch index %d", i);
+		return -1;
+	}
+
+	slot = &batch->slots[i];
+	msgh = &batch->msgs[i].msg_hdr;
+
+	if (!fr_sockaddr2ipaddr(&slot->addr, msgh->msg_namelen,
+				&packet->src_ipaddr, &packet->src_port)) {
+		fr_strerror_printf("Discarding packet: Unknown address family");
+		return -1;
+	}
+
+	memcpy(&dst, &batch->bound, sizeof(dst));
+	sizeof_dst = batch->sizeof_bound;
+#ifdef WITH_UDPFROMTO
+	udpfromto_cmsg_dst(msgh, (struct sockaddr *) &dst, &sizeof_dst);
+#endif
+	fr_sockaddr2ipaddr(&dst, sizeof_dst, &packet->dst_ipaddr, &packet->dst_port);
+
+	if (slot->addr.ss_family != dst.ss_family) {
+		fr_strerror_printf("Discarding packet: Source and destination address families differ");
+		return -1;
+	}
+
+	packet->sockfd = batch->sockfd;
+
+	return batch->msgs[i].msg_len;
+}
+
+/*
+ *	Check the header of a received packet, and fill in its
+ *	addresses.  Returns the number of bytes of data to use.
+ */
+static ssize_t rad_batch_header(rad_batch_t *batch, int i, RADIUS_PACKET *packet)
+{
+	uint8_t const	*data;
+	ssize_t		data_len;
+	size_t		packet_len;
+
+	data_len = rad_batch_addr(batch, i, packet);
+	if (data_len < 0) return -1;
+
+	data = batch->slots[i].buf;
+
+	if (data_len < 4) {
+		fr_strerror_printf("Discarding packet: Too short");
+		return -1;
+	}
+
+	/*
+	 *	Enforce the same limits as rad_recv_header().
+	 */
+	packet_len = (data[2] * 256) + data[3];
+	if (packet_len < RADIUS_HDR_LEN) {
+		fr_strerror_printf("Discarding packet: Smaller than RFC minimum of %d bytes", RADIUS_HDR_LEN);
+		return -1;
+	}
+	if (packet_len > MAX_PACKET_LEN) {
+		fr_strerror_printf("Discarding packet: Larger than RFC limitation of 4096 bytes");
+		return -1;
+	}
+
+	/*
+	 *	rad_recvfrom() only reads "packet_len" bytes, and the
+	 *	OS discards the rest.  Do the same here.
+	 */
+	if ((size_t) data_len > packet_len) data_len = packet_len;
+
+	return data_len;
+}
+
+/** Get a datagram read by rad_batch_recv(), for protocols other than RADIUS
+ *
+ * Fills in the addresses and socket of a caller-supplied packet, but
+ * doesn't look at the data.
+ *
+ * @param batch the datagram was read into.
+ * @param i index of the datagram.
+ * @param packet to fill in.
+ * @param data where to write a pointer to the data.  It belongs to the
+ *	batch, and is only valid until the next rad_batch_recv().
+ * @return the length of the data, or -1 on error.
+ */
+ssize_t rad_batch_data(rad_batch_t *batch, int i, RADIUS_PACKET *packet, uint8_t **data)
+{
+	ssize_t data_len;
+
+	data_len = rad_batch_addr(batch, i, packet);
+	if (data_len < 0) return -1;
+
+	*data = batch->slots[i].buf;
+
+	return data_len;
+}
+
+/** Look at the header of a received packet, without allocating anything
+ *
+ * Fills in a caller-supplied packet, in the same way as rad_recv_peek().
+ *
+ * @param batch the packet was received into.
+ * @param i index of the packet.
+ * @param packet to fill in.
+ * @return 0 on success, -1 if the packet is invalid.
+ */
+int rad_batch_peek(rad_batch_t *batch, int i, RADIUS_PACKET *packet)
+{
+	uint8_t const *data;
+
+	memset(packet, 0, sizeof(*packet));
+
+	if (rad_batch_header(batch, i, packet) < RADIUS_HDR_LEN) return -1;
+
+	data = batch->slots[i].buf;
+	packet->code = data[0];
+	packet->id = data[1];
+	packet->data_len = (data[2] * 256) + data[3];
+	memcpy(packet->vector, data + 4, sizeof(packet->vector));
+
+	return 0;
+}
+
+/** Turn a datagram read by rad_batch_recv() into a RADIUS_PACKET
+ *
+ * Unlike rad_recv(), the packet is NOT checked with rad_packet_ok().
+ * The caller has to do that, once it knows which client sent the packet.
+ *
+ * @param batch the datagram was read into.
+ * @param i index of the datagram.
+ * @return a new packet, or NULL if the datagram was malformed.
+ */
+RADIUS_PACKET *rad_batch_packet(rad_batch_t *batch, int i)
+{
+	ssize_t			data_len;
+	RADIUS_PACKET		*packet;
+	rad_batch_slot_t	*slot;
+
+	packet = rad_alloc_recv();
+	if (!packet) return NULL;
+
+	data_len = rad_batch_header(batch, i, packet);
+	if (data_len < 0) {
+	error:
+		rad_free(&packet);
+		return NULL;
+	}
+
+	slot = &batch->slots[i];
+	if (slot->ring_buf) {
+		packet->data = slot->buf;
+		packet->ring_buf = slot->ring_buf;
+		talloc_set_destructor(packet, _rad_packet_ring_free);
+		slot->ring_buf = NULL;
+	} else {
+		packet->data = talloc_memdup(packet, slot->buf, data_len);
+		if (!packet->data) {
+			fr_strerror_printf("out of memory");
+			goto error;
+		}
+	}
+	packet->data_len = data_len;
+	packet->vps = NULL;
+
+	return packet;
+}
+
+/** Queue a packet for sending with rad_batch_flush()
+ *
+ * Encodes and signs the packet exactly as rad_send() does.  The batch
+ * is flushed first if the packet is for a different socket, and
+ * afterwards if the batch is full.
+ *
+ * @param batch to add the packet to.
+ * @param packet to send.
+ * @param original the packet is a reply to, may be NULL.
+ * @param secret the shared secret.
+ * @return 0 on success, -1 on error.
+ */
+int rad_batch_send(rad_batch_t *batch, RADIUS_PACKET *packet, RADIUS_PACKET const *original,
+		   char const *secret)
+{
+	/*
+	 *	Maybe it's a fake packet.  Don't send it.
+	 */
+	if (!packet || (packet->sockfd < 0)) return 0;
+
+	if (!packet->data) {
+		if (rad_encode(packet, original, secret) < 0) return -1;
+		if (rad_sign(packet, original, secret) < 0) return -1;
+	}
+
+#ifndef NDEBUG
+	if ((fr_debug_flag > 3) && fr_log_fp) rad_print_hex(packet);
+#endif
+
+	return rad_batch_queue(batch, packet);
+}
+
+/** Queue an encoded packet for sending with rad_batch_flush()
+ *
+ * For protocols other than RADIUS, which encode their own packets.
+ * The data is copied, so the packet can be freed afterwards.
+ *
+ * @param batch to add the packet to.
+ * @param packet to send.
+ * @return 0 on success, -1 on error.
+ */
+int rad_batch_queue(rad_batch_t *batch, RADIUS_PACKET *packet)
+{
+	rad_batch_slot_t	*slot;
+	struct msghdr		*msgh;
+	socklen_t		sizeof_dst;
+
+	if (!packet || (packet->sockfd < 0)) return 0;
+
+	if (!packet->data || (packet->data_len > MAX_PACKET_LEN)) {
+		fr_strerror_printf("Packet is too large to send");
+		return -1;
+	}
+
+	if (batch->count && (batch->sockfd != packet->sockfd)) rad_batch_flush(batch);
+
+	if (!batch->count) {
+		batch->sockfd = packet->sockfd;
+
+		/*
+		 *	Setting the source address is pointless, and on
+		 *	some platforms an error, if the socket is bound
+		 *	to a specific address.
+		 */
+		batch->sizeof_bound = sizeof(batch->bound);
+		if (getsockname(batch->sockfd, (struct sockaddr *) &batch->bound, &batch->sizeof_bound) < 0) {
+			fr_strerror_printf("Failed getting socket name: %s", fr_syserror(errno));
+			return -1;
+		}
+	}
+
+	slot = &batch->slots[batch->count];
+	msgh = &batch->msgs[batch->count].msg_hdr;
+	memset(msgh, 0, sizeof(*msgh));
+
+	if (!fr_ipaddr2sockaddr(&packet->dst_ipaddr, packet->dst_port, &slot->addr, &sizeof_dst)) {
+		return -1;
+	}
+
+	memcpy(slot->data, packet->data, packet->data_len);
+	slot->iov.iov_base = slot->data;
+	slot->iov.iov_len = packet->data_len;
+
+	msgh->msg_iov = &slot->iov;
+	msgh->msg_iovlen = 1;
+	msgh->msg_name = &slot->addr;
+	msgh->msg_namelen = sizeof_dst;
+
+#ifdef WITH_UDPFROMTO
+	if (((packet->dst_ipaddr.af == AF_INET) || (packet->dst_ipaddr.af == AF_INET6)) &&
+	    (packet->src_ipaddr.af != AF_UNSPEC) &&
+	    !fr_inaddr_any(&packet->src_ipaddr)) {
+		fr_ipaddr_t		bound;
+		uint16_t		port;
+
+		if (fr_sockaddr2ipaddr(&batch->bound, batch->sizeof_bound, &bound, &port) &&
+		    (fr_inaddr_any(&bound) == 1)) {
+			struct sockaddr_storage	src;
+			socklen_t		sizeof_src;
+
+			fr_ipaddr2sockaddr(&packet->src_ipaddr, packet->src_port, &src, &sizeof_src);
+			if (udpfromto_cmsg_src(msgh, slot->cbuf, sizeof(slot->cbuf),
+					       (struct sockaddr *) &src) < 0) {
+				fr_strerror_printf("Failed setting source address: %s", fr_syserror(errno));
+				return -1;
+			}
+		}
+	}
+#endif
+
+	batch->count++;
+	if (batch->count == batch->num) return (rad_batch_flush(batch) < 0) ? -1 : 0;
+
+	return 0;
+}
+
+/** Send all packets queued with rad_batch_send()
+ *
+ * A packet which can't be sent is skipped, so that one bad destination
+ * doesn't block the rest of the batch.
+ *
+ * @param batch to flush.
+ * @return the number of packets sent, or -1 if any packet failed.
+ */
+int rad_batch_flush(rad_batch_t *batch)
+{
+	int i = 0, sent = 0, failed = 0;
+
+	while (i < batch->count) {
+		int rcode;
+
+		rcode = sendmmsg(batch->sockfd, batch->msgs + i, batch->count - i, 0);
+		if (rcode < 0) {
+			if (errno == EINTR) continue;
+
+			/*
+			 *	sendmmsg() only returns an error if the
+			 *	first message couldn't be sent.
+			 */
+			fr_strerror_printf("sendto failed: %s", fr_syserror(errno));
+			failed++;
+			i++;
+			continue;
+		}
+
+		i += rcode;
+		sent += rcode;
+	}
+
+	batch->count = 0;
+
+	return failed ? -1 : sent;
+}
+#endif	/* WITH_RADIUS_BATCH */
+
+
+/*
+ *	Verify the Message-Authenticator at "ptr".
+ */
+static int rad_verify_ma(RADIUS_PACKET *packet, RADIUS_PACKET *original,
+			 char const *secret, uint8_t *ptr)
+{
+	uint8_t	msg_auth_vector[AUTH_VECTOR_LEN];
+	uint8_t calc_auth_vector[AUTH_VECTOR_LEN];
+
+	memcpy(msg_auth_vector, &ptr[2], sizeof(msg_auth_vector));
+	memset(&ptr[2], 0, AUTH_VECTOR_LEN);
+
+	switch (packet->code) {
+	default:
+		break;
+
+	case PW_CODE_ACCOUNTING_RESPONSE:
+		if (original &&
+		    (original->code == PW_CODE_STATUS_SERVER)) {
+			goto do_ack;
+		}
+
+	case PW_CODE_ACCOUNTING_REQUEST:
+	case PW_CODE_DISCONNECT_REQUEST:
+	case PW_CODE_COA_REQUEST:
+		memset(packet->data + 4, 0, AUTH_VECTOR_LEN);
+		break;
+
+	do_ack:
+	case PW_CODE_ACCESS_ACCEPT:
+	case PW_CODE_ACCESS_REJECT:
+	case PW_CODE_ACCESS_CHALLENGE:
+	case PW_CODE_DISCONNECT_ACK:
+	case PW_CODE_DISCONNECT_NAK:
+	case PW_CODE_COA_ACK:
+	case PW_CODE_COA_NAK:
+		if (!original) {
+			memcpy(&ptr[2], msg_auth_vector, AUTH_VECTOR_LEN);
+			fr_strerror_printf("ERROR: Cannot validate Message-Authenticator in response packet without a request packet");
+			return -1;
+		}
+		memcpy(packet->data + 4, original->vector, AUTH_VECTOR_LEN);
+		break;
+	}
+
+	rad_hmac_md5(calc_auth_vector, packet->data, packet->data_len, secret);
+	if (rad_digest_cmp(calc_auth_vector, msg_auth_vector,
+			   sizeof(calc_auth_vector)) != 0) {
+		char buffer[32];
+		fr_strerror_printf("Received packet from %s with invalid Message-Authenticator!  (Shared secret is incorrect.)",
+				   inet_ntop(packet->src_ipaddr.af,
+					     &packet->src_ipaddr.ipaddr,
+					     buffer, sizeof(buffer)));
+		/* Silently drop packet, according to RFC 3579 */
+		return -1;
+	} /* else the message authenticator was good */
+
+	/*
+	 *	Reinitialize Authenticators.
+	 */
+	memcpy(&ptr[2], msg_auth_vector, AUTH_VECTOR_LEN);
+	memcpy(packet->data + 4, packet->vector, AUTH_VECTOR_LEN);
+
+	return 0;
+}
 
 /** Verify the Request/Response Authenticator (and Message-Authenticator if present) of a packet
  *
@@ -2653,6 +3793,18 @@ int rad_verify(RADIUS_PACKET *packet, RADIUS_PACKET *original,
 
 	if (!packet || !packet->data) return -1;
 
+	/*
+	 *	rad_packet_ok() has already found the
+	 *	Message-Authenticator, so we don't need to look for it.
+	 */
+	if (packet->indexed) {
+		if (packet->ma_offset &&
+		    (rad_verify_ma(packet, original, secret, packet->data + packet->ma_offset) < 0)) {
+			return -1;
+		}
+		goto check_code;
+	}
+
 	/*
 	 *	Before we allocate memory for the attributes, do more
 	 *	sanity checking.
@@ -2660,80 +3812,23 @@ int rad_verify(RADIUS_PACKET *packet, RADIUS_PACKET *original,
 	ptr = packet->data + RADIUS_HDR_LEN;
 	length = packet->data_len - RADIUS_HDR_LEN;
 	while (length > 0) {
-		uint8_t	msg_auth_vector[AUTH_VECTOR_LEN];
-		uint8_t calc_auth_vector[AUTH_VECTOR_LEN];
-
 		attrlen = ptr[1];
 
-		switch (ptr[0]) {
-		default:	/* don't do anything. */
-			break;
-
-			/*
-			 *	Note that more than one Message-Authenticator
-			 *	attribute is invalid.
-			 */
-		case PW_MESSAGE_AUTHENTICATOR:
-			memcpy(msg_auth_vector, &ptr[2], sizeof(msg_auth_vector));
-			memset(&ptr[2], 0, AUTH_VECTOR_LEN);
-
-			switch (packet->code) {
-			default:
-				break;
-
-			case PW_CODE_ACCOUNTING_RESPONSE:
-				if (original &&
-				    (original->code == PW_CODE_STATUS_SERVER)) {
-					goto do_ack;
-				}
-
-			case PW_CODE_ACCOUNTING_REQUEST:
-			case PW_CODE_DISCONNECT_REQUEST:
-			case PW_CODE_COA_REQUEST:
-				memset(packet->data + 4, 0, AUTH_VECTOR_LEN);
-				break;
-
-			do_ack:
-			case PW_CODE_ACCESS_ACCEPT:
-			case PW_CODE_ACCESS_REJECT:
-			case PW_CODE_ACCESS_CHALLENGE:
-			case PW_CODE_DISCONNECT_ACK:
-			case PW_CODE_DISCONNECT_NAK:
-			case PW_CODE_COA_ACK:
-			case PW_CODE_COA_NAK:
-				if (!original) {
-					fr_strerror_printf("ERROR: Cannot validate Message-Authenticator in response packet without a request packet");
-					return -1;
-				}
-				memcpy(packet->data + 4, original->vector, AUTH_VECTOR_LEN);
-				break;
-			}
-
-			fr_hmac_md5(calc_auth_vector, packet->data, packet->data_len,
-				    (uint8_t const *) secret, strlen(secret));
-			if (rad_digest_cmp(calc_auth_vector, msg_auth_vector,
-				   sizeof(calc_auth_vector)) != 0) {
-				char buffer[32];
-				fr_strerror_printf("Received packet from %s with invalid Message-Authenticator!  (Shared secret is incorrect.)",
-					   inet_ntop(packet->src_ipaddr.af,
-						     &packet->src_ipaddr.ipaddr,
-						     buffer, sizeof(buffer)));
-				/* Silently drop packet, according to RFC 3579 */
-				return -1;
-			} /* else the message authenticator was good */
-
-			/*
-			 *	Reinitialize Authenticators.
-			 */
-			memcpy(&ptr[2], msg_auth_vector, AUTH_VECTOR_LEN);
-			memcpy(packet->data + 4, packet->vector, AUTH_VECTOR_LEN);
-			break;
-		} /* switch over the attributes */
+		/*
+		 *	Note that more than one Message-Authenticator
+		 *	attribute is invalid.
+		 */
+		if ((ptr[0] == PW_MESSAGE_AUTHENTICATOR) &&
+		    (rad_verify_ma(packet, original, secret, ptr) < 0)) {
+			return -1;
+		}
 
 		ptr += attrlen;
 		length -= attrlen;
 	} /* loop over the packet, sanity checking the attributes */
 
+check_code:
+
 	/*
 	 *	It looks like a RADIUS packet, but we don't know what it is
 	 *	so can't validate the authenticators.
@@ -3681,6 +4776,15 @@ ssize_t data2vp(TALLOC_CTX *ctx,
 
 	switch (da->type) {
 	case PW_TYPE_STRING:
+		/*
+		 *	Share the buffer with other VPs which have
+		 *	the same value.
+		 */
+		if (da->intern) {
+			vp->vp_strvalue = fr_intern_value(da->intern, data, vp->length);
+			if (vp->vp_strvalue) break;
+		}
+
 		p = talloc_array(vp, char, vp->length + 1);
 		memcpy(p, data, vp->length);
 		p[vp->length] = '\0';
@@ -3688,6 +4792,11 @@ ssize_t data2vp(TALLOC_CTX *ctx,
 		break;
 
 	case PW_TYPE_OCTETS:
+		if (da->intern) {
+			vp->vp_octets = fr_intern_value(da->intern, data, vp->length);
+			if (vp->vp_octets) break;
+		}
+
 		pairmemcpy(vp, data, vp->length);
 		break;
 
@@ -4433,56 +5542,117 @@ int rad_chap_encode(RADIUS_PACKET *packet, uint8_t *output, int id,
 }
 
 
-/** Seed the random number generator
+/** Initialize the global pool, if it isn't already
  *
- * May be called any number of times.
+ * Must be called with fr_rand_mutex held.
  */
-void fr_rand_seed(void const *data, size_t size)
+static void fr_rand_init(void)
 {
-	uint32_t hash;
+	int fd;
 
-	/*
-	 *	Ensure that the pool is initialized.
-	 */
-	if (!fr_rand_initialized) {
-		int fd;
+	if (fr_rand_initialized) return;
 
-		memset(&fr_rand_pool, 0, sizeof(fr_rand_pool));
+	memset(&fr_rand_pool, 0, sizeof(fr_rand_pool));
 
-		fd = open("/dev/urandom", O_RDONLY);
-		if (fd >= 0) {
-			size_t total;
-			ssize_t this;
+	fd = open("/dev/urandom", O_RDONLY);
+	if (fd >= 0) {
+		size_t total;
+		ssize_t this;
 
-			total = 0;
-			while (total < sizeof(fr_rand_pool.randrsl)) {
-				this = read(fd, fr_rand_pool.randrsl,
-					    sizeof(fr_rand_pool.randrsl) - total);
-				if ((this < 0) && (errno != EINTR)) break;
-				if (this > 0) total += this;
-			}
-			close(fd);
-		} else {
-			fr_rand_pool.randrsl[0] = fd;
-			fr_rand_pool.randrsl[1] = time(NULL);
-			fr_rand_pool.randrsl[2] = errno;
+		total = 0;
+		while (total < sizeof(fr_rand_pool.randrsl)) {
+			this = read(fd, fr_rand_pool.randrsl,
+				    sizeof(fr_rand_pool.randrsl) - total);
+			if ((this < 0) && (errno != EINTR)) break;
+			if (this > 0) total += this;
+		}
+		close(fd);
+	} else {
+		fr_rand_pool.randrsl[0] = fd;
+		fr_rand_pool.randrsl[1] = time(NULL);
+		fr_rand_pool.randrsl[2] = errno;
+	}
+
+	fr_randinit(&fr_rand_pool, 1);
+	fr_rand_pool.randcnt = 0;
+	fr_rand_initialized = 1;
+}
+
+static void _fr_rand_thread_free(void *arg)
+{
+	free(arg);
+}
+
+/** Get the calling thread's pool, creating it if necessary
+ *
+ * Each thread has its own ISAAC context, seeded from the global pool,
+ * so that threads don't contend for, or race on, a shared one.
+ *
+ * @return the thread's pool, or NULL if it couldn't be allocated.
+ */
+static fr_randctx *fr_rand_thread_pool(void)
+{
+	fr_randctx	*ctx;
+	int		i;
+
+	ctx = fr_thread_local_init(fr_rand_thread, _fr_rand_thread_free);
+	if (ctx) return ctx;
+
+	ctx = malloc(sizeof(*ctx));
+	if (!ctx) return NULL;
+
+	RAND_LOCK;
+	fr_rand_init();
+	for (i = 0; i < 256; i++) {
+		ctx->randrsl[i] = fr_rand_pool.randrsl[fr_rand_pool.randcnt++];
+		if (fr_rand_pool.randcnt >= 256) {
+			fr_rand_pool.randcnt = 0;
+			fr_isaac(&fr_rand_pool);
 		}
+	}
+	RAND_UNLOCK;
+
+	fr_randinit(ctx, 1);
+	ctx->randcnt = 0;
 
-		fr_randinit(&fr_rand_pool, 1);
-		fr_rand_pool.randcnt = 0;
-		fr_rand_initialized = 1;
+	if (fr_thread_local_set(fr_rand_thread, ctx) != 0) {
+		free(ctx);
+		return NULL;
 	}
 
-	if (!data) return;
+	return ctx;
+}
+
+/** Seed the random number generator
+ *
+ * May be called any number of times.  The data is mixed into the
+ * global pool, from which new threads are seeded, and into the pool
+ * of the calling thread.
+ */
+void fr_rand_seed(void const *data, size_t size)
+{
+	uint32_t	hash;
+	fr_randctx	*ctx;
+
+	RAND_LOCK;
+	fr_rand_init();
+	if (!data) {
+		RAND_UNLOCK;
+		return;
+	}
 
 	/*
 	 *	Hash the user data
 	 */
-	hash = fr_rand();
-	if (!hash) hash = fr_rand();
+	hash = fr_rand_pool.randrsl[fr_rand_pool.randcnt];
+	if (!hash) hash = fr_rand_pool.randrsl[fr_rand_pool.randcnt ^ 0x80];
 	hash = fr_hash_update(data, size, hash);
 
 	fr_rand_pool.randmem[fr_rand_pool.randcnt] ^= hash;
+	RAND_UNLOCK;
+
+	ctx = fr_rand_thread_pool();
+	if (ctx) ctx->randmem[ctx->randcnt] ^= hash;
 }
 
 
@@ -4491,25 +5661,82 @@ void fr_rand_seed(void const *data, size_t size)
  */
 uint32_t fr_rand(void)
 {
-	uint32_t num;
+	uint32_t	num;
+	fr_randctx	*ctx;
+
+	ctx = fr_rand_thread_pool();
+	if (!ctx) {
+		RAND_LOCK;
+		fr_rand_init();
+		ctx = &fr_rand_pool;
+		num = ctx->randrsl[ctx->randcnt++];
+		if (ctx->randcnt >= 256) {
+			ctx->randcnt = 0;
+			fr_isaac(ctx);
+		}
+		RAND_UNLOCK;
 
-	/*
-	 *	Ensure that the pool is initialized.
-	 */
-	if (!fr_rand_initialized) {
-		fr_rand_seed(NULL, 0);
+		return num;
 	}
 
-	num = fr_rand_pool.randrsl[fr_rand_pool.randcnt++];
-	if (fr_rand_pool.randcnt >= 256) {
-		fr_rand_pool.randcnt = 0;
-		fr_isaac(&fr_rand_pool);
+	num = ctx->randrsl[ctx->randcnt++];
+	if (ctx->randcnt >= 256) {
+		ctx->randcnt = 0;
+		fr_isaac(ctx);
 	}
 
 	return num;
 }
 
 
+/** Fill a buffer with random data
+ *
+ * Cheaper than calling fr_rand() for every four bytes, as the data is
+ * copied from the thread's pool in blocks.
+ *
+ * @param[out] out where to write the data.
+ * @param[in] len of the data to write.
+ */
+void fr_rand_fill(void *out, size_t len)
+{
+	uint8_t		*p = out;
+	fr_randctx	*ctx;
+	size_t		avail;
+	uint32_t	num;
+
+	ctx = fr_rand_thread_pool();
+	if (!ctx) {
+		while (len > 0) {
+			num = fr_rand();
+			avail = (len < sizeof(num)) ? len : sizeof(num);
+			memcpy(p, &num, avail);
+			p += avail;
+			len -= avail;
+		}
+		return;
+	}
+
+	while (len > 0) {
+		avail = (256 - ctx->randcnt) * sizeof(uint32_t);
+		if (avail > len) avail = len;
+
+		memcpy(p, &ctx->randrsl[ctx->randcnt], avail);
+		p += avail;
+		len -= avail;
+
+		/*
+		 *	Partial words are discarded, so the same
+		 *	bytes are never handed out twice.
+		 */
+		ctx->randcnt += (avail + sizeof(uint32_t) - 1) / sizeof(uint32_t);
+		if (ctx->randcnt >= 256) {
+			ctx->randcnt = 0;
+			fr_isaac(ctx);
+		}
+	}
+}
+
+
 /** Allocate a new RADIUS_PACKET
  *
  * @param ctx the context in which the packet is allocated. May be NULL if
@@ -4526,26 +5753,8 @@ RADIUS_PACKET *rad_alloc(TALLOC_CTX *ctx, bool new_vector)
 		fr_strerror_printf("out of memory");
 		return NULL;
 	}
-	rp->id = -1;
-	rp->offset = -1;
 
-	if (new_vector) {
-		int i;
-		uint32_t hash, base;
-
-		/*
-		 *	Don't expose the actual contents of the random
-		 *	pool.
-		 */
-		base = fr_rand();
-		for (i = 0; i < AUTH_VECTOR_LEN; i += sizeof(uint32_t)) {
-			hash = fr_rand() ^ base;
-			memcpy(rp->vector + i, &hash, sizeof(hash));
-		}
-	}
-	fr_rand();		/* stir the pool again */
-
-	return rp;
+	return rad_packet_init(rp, new_vector);
 }
 
 /** Allocate a new RADIUS_PACKET response
@@ -4631,6 +5840,7 @@ RADIUS_PACKET *rad_copy_packet(TALLOC_CTX *ctx, RADIUS_PACKET const *in)
 
 	out->data = NULL;
 	out->data_len = 0;
+	out->ring_buf = NULL;
 
 	out->vps = paircopy(out, in->vps);
 	out->offset = 0;
@@ -27,11 +27,18 @@ RCSID("$Id$")
 #ifdef HAVE_PTHREAD_H
 #include <pthread.h>
 
-#define PTHREAD_MUTEX_LOCK(_x) if (_x->lock) pthread_mutex_lock(&((_x)->mutex))
-#define PTHREAD_MUTEX_UNLOCK(_x) if (_x->lock) pthread_mutex_unlock(&((_x)->mutex))
+/*
+ *	Locked trees use a read/write lock.  Lookups and walks which
+ *	don't modify the tree only take the read lock, so readers
+ *	never block each other, and only wait for inserts and deletes.
+ */
+#define RBTREE_RDLOCK(_x) if (_x->lock) pthread_rwlock_rdlock(&((_x)->rwlock))
+#define RBTREE_WRLOCK(_x) if (_x->lock) pthread_rwlock_wrlock(&((_x)->rwlock))
+#define RBTREE_UNLOCK(_x) if (_x->lock) pthread_rwlock_unlock(&((_x)->rwlock))
 #else
-#define PTHREAD_MUTEX_LOCK(_x)
-#define PTHREAD_MUTEX_UNLOCK(_x)
+#define RBTREE_RDLOCK(_x)
+#define RBTREE_WRLOCK(_x)
+#define RBTREE_UNLOCK(_x)
 #endif
 
 /* Red-Black tree description */
@@ -62,7 +69,7 @@ struct rbtree_t {
 	bool			replace;
 #ifdef HAVE_PTHREAD_H
 	bool			lock;
-	pthread_mutex_t		mutex;
+	pthread_rwlock_t	rwlock;
 #endif
 };
 #define RBTREE_MAGIC (0x5ad09c42)
@@ -85,7 +92,7 @@ void rbtree_free(rbtree_t *tree)
 {
 	if (!tree) return;
 
-	PTHREAD_MUTEX_LOCK(tree);
+	RBTREE_WRLOCK(tree);
 
 	/*
 	 *	walk the tree, deleting the nodes...
@@ -98,7 +105,10 @@ void rbtree_free(rbtree_t *tree)
 	tree->root = NULL;
 
 #ifdef HAVE_PTHREAD_H
-	if (tree->lock) pthread_mutex_destroy(&tree->mutex);
+	if (tree->lock) {
+		pthread_rwlock_unlock(&tree->rwlock);
+		pthread_rwlock_destroy(&tree->rwlock);
+	}
 #endif
 
 	talloc_free(tree);
@@ -125,7 +135,20 @@ rbtree_t *rbtree_create(TALLOC_CTX *ctx, rb_comparator_t compare, rb_free_t node
 #ifdef HAVE_PTHREAD_H
 	tree->lock = (flags & RBTREE_FLAG_LOCK) != 0 ? true : false;
 	if (tree->lock) {
-		pthread_mutex_init(&tree->mutex, NULL);
+#ifdef PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP
+		pthread_rwlockattr_t attr;
+
+		/*
+		 *	glibc prefers readers by default, which lets a
+		 *	steady stream of lookups starve the writers.
+		 */
+		pthread_rwlockattr_init(&attr);
+		pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+		pthread_rwlock_init(&tree->rwlock, &attr);
+		pthread_rwlockattr_destroy(&attr);
+#else
+		pthread_rwlock_init(&tree->rwlock, NULL);
+#endif
 	}
 #endif
 	tree->free = node_free;
@@ -257,7 +280,7 @@ rbnode_t *rbtree_insert_node(rbtree_t *tree, void *data)
 {
 	rbnode_t *current, *parent, *x;
 
-	PTHREAD_MUTEX_LOCK(tree);
+	RBTREE_WRLOCK(tree);
 
 	/* find where node belongs */
 	current = tree->root;
@@ -274,7 +297,7 @@ rbnode_t *rbtree_insert_node(rbtree_t *tree, void *data)
 			 *	Don't replace the entry.
 			 */
 			if (!tree->replace) {
-				PTHREAD_MUTEX_UNLOCK(tree);
+				RBTREE_UNLOCK(tree);
 				return NULL;
 			}
 
@@ -283,7 +306,7 @@ rbnode_t *rbtree_insert_node(rbtree_t *tree, void *data)
 			 */
 			if (tree->free) tree->free(current->data);
 			current->data = data;
-			PTHREAD_MUTEX_UNLOCK(tree);
+			RBTREE_UNLOCK(tree);
 			return current;
 		}
 
@@ -295,7 +318,7 @@ rbnode_t *rbtree_insert_node(rbtree_t *tree, void *data)
 	x = talloc_zero(tree, rbnode_t);
 	if (!x) {
 		fr_strerror_printf("No memory for new rbtree node");
-		PTHREAD_MUTEX_UNLOCK(tree);
+		RBTREE_UNLOCK(tree);
 		return NULL;
 	}
 
@@ -320,7 +343,7 @@ rbnode_t *rbtree_insert_node(rbtree_t *tree, void *data)
 
 	tree->num_elements++;
 
-	PTHREAD_MUTEX_UNLOCK(tree);
+	RBTREE_UNLOCK(tree);
 	return x;
 }
 
@@ -407,7 +430,7 @@ static void rbtree_delete_internal(rbtree_t *tree, rbnode_t *z, bool skiplock)
 	if (!z || z == NIL) return;
 
 	if (!skiplock) {
-		PTHREAD_MUTEX_LOCK(tree);
+		RBTREE_WRLOCK(tree);
 	}
 
 	if (z->left == NIL || z->right == NIL) {
@@ -480,7 +503,7 @@ static void rbtree_delete_internal(rbtree_t *tree, rbnode_t *z, bool skiplock)
 
 	tree->num_elements--;
 	if (!skiplock) {
-		PTHREAD_MUTEX_UNLOCK(tree);
+		RBTREE_UNLOCK(tree);
 	}
 }
 void rbtree_delete(rbtree_t *tree, rbnode_t *z) {
@@ -510,14 +533,14 @@ rbnode_t *rbtree_find(rbtree_t *tree, void const *data)
 {
 	rbnode_t *current;
 
-	PTHREAD_MUTEX_LOCK(tree);
+	RBTREE_RDLOCK(tree);
 	current = tree->root;
 
 	while (current != NIL) {
 		int result = tree->compare(data, current->data);
 
 		if (result == 0) {
-			PTHREAD_MUTEX_UNLOCK(tree);
+			RBTREE_UNLOCK(tree);
 			return current;
 		} else {
 			current = (result < 0) ?
@@ -525,7 +548,7 @@ rbnode_t *rbtree_find(rbtree_t *tree, void const *data)
 		}
 	}
 
-	PTHREAD_MUTEX_UNLOCK(tree);
+	RBTREE_UNLOCK(tree);
 	return NULL;
 }
 
@@ -683,7 +706,9 @@ static int walk_delete_order(rbtree_t *tree, rb_walker_t compare, void *context)
 
 /*
  *	walk the entire tree.  The compare function CANNOT modify
- *	the tree.
+ *	the tree.  For locked trees, walks other than
+ *	RBTREE_DELETE_ORDER hold only the read lock, so the compare
+ *	function may run at the same time as other readers.
  *
  *	The compare function should return 0 to continue walking.
  *	Any other value stops the walk, and is returned.
@@ -694,7 +719,11 @@ int rbtree_walk(rbtree_t *tree, rb_order_t order, rb_walker_t compare, void *con
 
 	if (tree->root == NIL) return 0;
 
-	PTHREAD_MUTEX_LOCK(tree);
+	if (order == RBTREE_DELETE_ORDER) {
+		RBTREE_WRLOCK(tree);
+	} else {
+		RBTREE_RDLOCK(tree);
+	}
 
 	switch (order) {
 	case RBTREE_PRE_ORDER:
@@ -718,7 +747,7 @@ int rbtree_walk(rbtree_t *tree, rb_order_t order, rb_walker_t compare, void *con
 		break;
 	}
 
-	PTHREAD_MUTEX_UNLOCK(tree);
+	RBTREE_UNLOCK(tree);
 	return rcode;
 }
 
@@ -82,6 +82,52 @@ int fr_tcp_client_socket(fr_ipaddr_t *src_ipaddr,
 }
 
 
+/*
+ *	Check a packet which has been completely read, and print it
+ *	out if we're debugging.
+ */
+static int fr_tcp_packet_done(RADIUS_PACKET *packet, int flags)
+{
+	/*
+	 *	See if it's a well-formed RADIUS packet.
+	 */
+	if (!rad_packet_ok(packet, flags, NULL)) {
+		return -1;
+	}
+
+	/*
+	 *	Explicitly set the VP list to empty.
+	 */
+	packet->vps = NULL;
+
+	if (fr_debug_flag) {
+		char ip_buf[128], buffer[256];
+
+		if (packet->src_ipaddr.af != AF_UNSPEC) {
+			inet_ntop(packet->src_ipaddr.af,
+				  &packet->src_ipaddr.ipaddr,
+				  ip_buf, sizeof(ip_buf));
+			snprintf(buffer, sizeof(buffer), "host %s port %d",
+				 ip_buf, packet->src_port);
+		} else {
+			snprintf(buffer, sizeof(buffer), "socket %d",
+				 packet->sockfd);
+		}
+
+
+		if (is_radius_code(packet->code)) {
+			DEBUG("Received %s packet from %s",
+			      fr_packet_codes[packet->code], buffer);
+		} else {
+			DEBUG("Received packet from %s code %d",
+			      buffer, packet->code);
+		}
+		DEBUG(", id=%d, length=%zu\n", packet->id, packet->data_len);
+	}
+
+	return 1;		/* done reading the packet */
+}
+
 RADIUS_PACKET *fr_tcp_recv(int sockfd, int flags)
 {
 	RADIUS_PACKET *packet = rad_alloc(NULL, false);
@@ -193,44 +239,90 @@ int fr_tcp_read_packet(RADIUS_PACKET *packet, int flags)
 		return 0;
 	}
 
-	/*
-	 *	See if it's a well-formed RADIUS packet.
-	 */
-	if (!rad_packet_ok(packet, flags, NULL)) {
+	return fr_tcp_packet_done(packet, flags);
+}
+
+/** Read as much data as is available from a TCP socket
+ *
+ * This lets the caller take more than one packet from the socket
+ * with a single system call.  See fr_tcp_packet_from_buffer().
+ *
+ * @param sockfd to read from.  Should be non-blocking.
+ * @param buffer to read into.
+ * @param size of the free space in the buffer.
+ * @return the number of bytes read, 0 if no data was available, -1
+ *	on error, or -2 if the connection was closed.
+ */
+ssize_t fr_tcp_read_buffer(int sockfd, uint8_t *buffer, size_t size)
+{
+	ssize_t len;
+
+	len = recv(sockfd, buffer, size, 0);
+	if (len == 0) return -2; /* clean close */
+
+	if (len < 0) {
+#ifdef ECONNRESET
+		if (errno == ECONNRESET) return -2; /* forced */
+#endif
+		if ((errno == EINTR) || (errno == EAGAIN)
+#ifdef EWOULDBLOCK
+		    || (errno == EWOULDBLOCK)
+#endif
+			) return 0;
+
+		fr_strerror_printf("Error receiving packet: %s", fr_syserror(errno));
 		return -1;
 	}
 
-	/*
-	 *	Explicitly set the VP list to empty.
-	 */
-	packet->vps = NULL;
+	return len;
+}
 
-	if (fr_debug_flag) {
-		char ip_buf[128], buffer[256];
+/** Take one packet from data read by fr_tcp_read_buffer()
+ *
+ * The packet is copied out of the buffer, so the buffer can be
+ * re-used for the next read.
+ *
+ * @param packet to fill in.  Must have the socket and address
+ *	fields initialized, and no data.
+ * @param buffer holding data from the socket.
+ * @param len of the data in the buffer.
+ * @param flags as for rad_packet_ok().
+ * @return the number of bytes used from the buffer, 0 if the buffer
+ *	doesn't yet hold a complete packet, or -1 on error.
+ */
+ssize_t fr_tcp_packet_from_buffer(RADIUS_PACKET *packet, uint8_t const *buffer, size_t len, int flags)
+{
+	size_t packet_len;
 
-		if (packet->src_ipaddr.af != AF_UNSPEC) {
-			inet_ntop(packet->src_ipaddr.af,
-				  &packet->src_ipaddr.ipaddr,
-				  ip_buf, sizeof(ip_buf));
-			snprintf(buffer, sizeof(buffer), "host %s port %d",
-				 ip_buf, packet->src_port);
-		} else {
-			snprintf(buffer, sizeof(buffer), "socket %d",
-				 packet->sockfd);
-		}
+	if (len < 4) return 0;
 
+	packet_len = (buffer[2] << 8) | buffer[3];
 
-		if (is_radius_code(packet->code)) {
-			DEBUG("Received %s packet from %s",
-			      fr_packet_codes[packet->code], buffer);
-		} else {
-			DEBUG("Received packet from %s code %d",
-			      buffer, packet->code);
-		}
-		DEBUG(", id=%d, length=%zu\n", packet->id, packet->data_len);
+	if (packet_len < RADIUS_HDR_LEN) {
+		fr_strerror_printf("Discarding packet: Smaller than RFC minimum of 20 bytes");
+		return -1;
 	}
 
-	return 1;		/* done reading the packet */
+	/*
+	 *	If the packet is too big, then the socket is bad.
+	 */
+	if (packet_len > MAX_PACKET_LEN) {
+		fr_strerror_printf("Discarding packet: Larger than RFC limitation of 4096 bytes");
+		return -1;
+	}
+
+	if (len < packet_len) return 0;
+
+	packet->data = talloc_memdup(packet, buffer, packet_len);
+	if (!packet->data) {
+		fr_strerror_printf("Out of memory");
+		return -1;
+	}
+	packet->data_len = packet->partial = packet_len;
+
+	if (fr_tcp_packet_done(packet, flags) < 0) return -1;
+
+	return packet_len;
 }
 
 #endif /* WITH_TCP */
@@ -165,7 +165,6 @@ int recvfromto(int s, void *buf, size_t len, int flags,
 	       struct sockaddr *to, socklen_t *tolen)
 {
 	struct msghdr msgh;
-	struct cmsghdr *cmsg;
 	struct iovec iov;
 	char cbuf[256];
 	int err;
@@ -266,10 +265,27 @@ int recvfromto(int s, void *buf, size_t len, int flags,
 
 	if (fromlen) *fromlen = msgh.msg_namelen;
 
+	udpfromto_cmsg_dst(&msgh, to, tolen);
+
+	return err;
+}
+
+/** Get the destination address of a packet from the auxiliary data returned by recvmsg()
+ *
+ * @param msgh as filled in by recvmsg() or recvmmsg().
+ * @param to already initialised with the address the socket is bound to.
+ *	The address is overwritten if the kernel told us which one the
+ *	packet was sent to.
+ * @param tolen length of to.
+ */
+void udpfromto_cmsg_dst(struct msghdr *msgh, struct sockaddr *to, socklen_t *tolen)
+{
+	struct cmsghdr *cmsg;
+
 	/* Process auxiliary received data in msgh */
-	for (cmsg = CMSG_FIRSTHDR(&msgh);
+	for (cmsg = CMSG_FIRSTHDR(msgh);
 	     cmsg != NULL;
-	     cmsg = CMSG_NXTHDR(&msgh,cmsg)) {
+	     cmsg = CMSG_NXTHDR(msgh,cmsg)) {
 
 #ifdef IP_PKTINFO
 		if ((cmsg->cmsg_level == SOL_IP) &&
@@ -303,87 +319,38 @@ int recvfromto(int s, void *buf, size_t len, int flags,
 		}
 #endif
 	}
-
-	return err;
 }
 
-int sendfromto(int s, void *buf, size_t len, int flags,
-	       struct sockaddr *from, socklen_t fromlen,
-	       struct sockaddr *to, socklen_t tolen)
+/** Add auxiliary data to a msghdr, telling sendmsg() which source address to use
+ *
+ * @param msgh to add the control data to.
+ * @param cbuf buffer for the control data.  Must remain valid until the
+ *	packet has been sent.
+ * @param cbuf_len length of cbuf.
+ * @param from the source address.
+ * @return 1 if the control data was added, 0 if the OS doesn't support
+ *	setting the source address for this address family (the caller
+ *	should use sendto()), or -1 on error.
+ */
+int udpfromto_cmsg_src(struct msghdr *msgh, void *cbuf, size_t cbuf_len, struct sockaddr *from)
 {
-	struct msghdr msgh;
 	struct cmsghdr *cmsg;
-	struct iovec iov;
-	char cbuf[256];
-
-#ifdef __FreeBSD__
-	/*
-	 *	FreeBSD is extra pedantic about the use of IP_SENDSRCADDR,
-	 *	and sendmsg will fail with EINVAL if IP_SENDSRCADDR is used
-	 *	with a socket which is bound to something other than
-	 *	INADDR_ANY
-	 */
-	struct sockaddr bound;
-	socklen_t bound_len = sizeof(bound);
-
-	if (getsockname(s, &bound, &bound_len) < 0) {
-		return -1;
-	}
-
-	switch (bound.sa_family) {
-	case AF_INET:
-		if (((struct sockaddr_in *) &bound)->sin_addr.s_addr != INADDR_ANY) {
-			from = NULL;
-		}
-		break;
-
-	case AF_INET6:
-		if (!IN6_IS_ADDR_UNSPECIFIED(&((struct sockaddr_in6 *) &bound)->sin6_addr)) {
-			from = NULL;
-		}
-		break;
-	}
-#else
-#  if !defined(IP_PKTINFO) && !defined(IP_SENDSRCADDR) && !defined(IPV6_PKTINFO)
-	/*
-	 *	If the sendmsg() flags aren't defined, fall back to
-	 *	using sendto().
-	 */
-	from = NULL;
-#  endif
-#endif
 
-	/*
-	 *	Catch the case where the caller passes invalid arguments.
-	 */
-	if (!from || (fromlen == 0) || (from->sa_family == AF_UNSPEC)) {
-		return sendto(s, buf, len, flags, to, tolen);
-	}
-
-	/* Set up control buffer iov and msgh structures. */
-	memset(&cbuf, 0, sizeof(cbuf));
-	memset(&msgh, 0, sizeof(msgh));
-	memset(&iov, 0, sizeof(iov));
-	iov.iov_base = buf;
-	iov.iov_len = len;
-	msgh.msg_iov = &iov;
-	msgh.msg_iovlen = 1;
-	msgh.msg_name = to;
-	msgh.msg_namelen = tolen;
+	memset(cbuf, 0, cbuf_len);
 
 	if (from->sa_family == AF_INET) {
 #if !defined(IP_PKTINFO) && !defined(IP_SENDSRCADDR)
-		return sendto(s, buf, len, flags, to, tolen);
+		return 0;
 #else
 		struct sockaddr_in *s4 = (struct sockaddr_in *) from;
 
 #  ifdef IP_PKTINFO
 		struct in_pktinfo *pkt;
 
-		msgh.msg_control = cbuf;
-		msgh.msg_controllen = CMSG_SPACE(sizeof(*pkt));
+		msgh->msg_control = cbuf;
+		msgh->msg_controllen = CMSG_SPACE(sizeof(*pkt));
 
-		cmsg = CMSG_FIRSTHDR(&msgh);
+		cmsg = CMSG_FIRSTHDR(msgh);
 		cmsg->cmsg_level = SOL_IP;
 		cmsg->cmsg_type = IP_PKTINFO;
 		cmsg->cmsg_len = CMSG_LEN(sizeof(*pkt));
@@ -396,10 +363,10 @@ int sendfromto(int s, void *buf, size_t len, int flags,
 #  ifdef IP_SENDSRCADDR
 		struct in_addr *in;
 
-		msgh.msg_control = cbuf;
-		msgh.msg_controllen = CMSG_SPACE(sizeof(*in));
+		msgh->msg_control = cbuf;
+		msgh->msg_controllen = CMSG_SPACE(sizeof(*in));
 
-		cmsg = CMSG_FIRSTHDR(&msgh);
+		cmsg = CMSG_FIRSTHDR(msgh);
 		cmsg->cmsg_level = IPPROTO_IP;
 		cmsg->cmsg_type = IP_SENDSRCADDR;
 		cmsg->cmsg_len = CMSG_LEN(sizeof(*in));
@@ -413,16 +380,16 @@ int sendfromto(int s, void *buf, size_t len, int flags,
 #ifdef AF_INET6
 	else if (from->sa_family == AF_INET6) {
 #  if !defined(IPV6_PKTINFO)
-		return sendto(s, buf, len, flags, to, tolen);
+		return 0;
 #  else
 		struct sockaddr_in6 *s6 = (struct sockaddr_in6 *) from;
 
 		struct in6_pktinfo *pkt;
 
-		msgh.msg_control = cbuf;
-		msgh.msg_controllen = CMSG_SPACE(sizeof(*pkt));
+		msgh->msg_control = cbuf;
+		msgh->msg_controllen = CMSG_SPACE(sizeof(*pkt));
 
-		cmsg = CMSG_FIRSTHDR(&msgh);
+		cmsg = CMSG_FIRSTHDR(msgh);
 		cmsg->cmsg_level = IPPROTO_IPV6;
 		cmsg->cmsg_type = IPV6_PKTINFO;
 		cmsg->cmsg_len = CMSG_LEN(sizeof(*pkt));
@@ -442,6 +409,76 @@ int sendfromto(int s, void *buf, size_t len, int flags,
 		return -1;
 	}
 
+	return 1;
+}
+
+int sendfromto(int s, void *buf, size_t len, int flags,
+	       struct sockaddr *from, socklen_t fromlen,
+	       struct sockaddr *to, socklen_t tolen)
+{
+	int rcode;
+	struct msghdr msgh;
+	struct iovec iov;
+	char cbuf[256];
+
+#ifdef __FreeBSD__
+	/*
+	 *	FreeBSD is extra pedantic about the use of IP_SENDSRCADDR,
+	 *	and sendmsg will fail with EINVAL if IP_SENDSRCADDR is used
+	 *	with a socket which is bound to something other than
+	 *	INADDR_ANY
+	 */
+	struct sockaddr bound;
+	socklen_t bound_len = sizeof(bound);
+
+	if (getsockname(s, &bound, &bound_len) < 0) {
+		return -1;
+	}
+
+	switch (bound.sa_family) {
+	case AF_INET:
+		if (((struct sockaddr_in *) &bound)->sin_addr.s_addr != INADDR_ANY) {
+			from = NULL;
+		}
+		break;
+
+	case AF_INET6:
+		if (!IN6_IS_ADDR_UNSPECIFIED(&((struct sockaddr_in6 *) &bound)->sin6_addr)) {
+			from = NULL;
+		}
+		break;
+	}
+#else
+#  if !defined(IP_PKTINFO) && !defined(IP_SENDSRCADDR) && !defined(IPV6_PKTINFO)
+	/*
+	 *	If the sendmsg() flags aren't defined, fall back to
+	 *	using sendto().
+	 */
+	from = NULL;
+#  endif
+#endif
+
+	/*
+	 *	Catch the case where the caller passes invalid arguments.
+	 */
+	if (!from || (fromlen == 0) || (from->sa_family == AF_UNSPEC)) {
+		return sendto(s, buf, len, flags, to, tolen);
+	}
+
+	/* Set up control buffer iov and msgh structures. */
+	memset(&msgh, 0, sizeof(msgh));
+	memset(&iov, 0, sizeof(iov));
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	msgh.msg_iov = &iov;
+	msgh.msg_iovlen = 1;
+	msgh.msg_name = to;
+	msgh.msg_namelen = tolen;
+
+	rcode = udpfromto_cmsg_src(&msgh, cbuf, sizeof(cbuf), from);
+	if (rcode < 0) return -1;
+	if (rcode == 0) return sendto(s, buf, len, flags, to, tolen);
+
 	return sendmsg(s, &msgh, flags);
 }
 
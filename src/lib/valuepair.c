@@ -57,6 +57,14 @@ RCSID("$Id$")
  * @return 0
  */
 static int _pairfree(VALUE_PAIR *vp) {
+	/*
+	 *	Interned values aren't parented by the VP, so they
+	 *	have to be released explicitly.
+	 */
+	if (vp->da->flags.is_pointer && fr_intern_is(vp->data.ptr)) {
+		fr_intern_release(vp->data.ptr);
+	}
+
 #ifndef NDEBUG
 	vp->vp_integer = FREE_MAGIC;
 #endif
@@ -188,33 +196,121 @@ int pair2unknown(VALUE_PAIR *vp)
  */
 VALUE_PAIR *pairfind_da(VALUE_PAIR *vp, DICT_ATTR const *da, int8_t tag)
 {
-	vp_cursor_t 	cursor;
 	VALUE_PAIR	*i;
 
 	if(!fr_assert(da)) {
 		 return NULL;
 	}
 
-	for (i = fr_cursor_init(&cursor, &vp);
-	     i;
-	     i = fr_cursor_next(&cursor)) {
+	/*
+	 *	This is called for nearly every attribute reference,
+	 *	so walk the list directly instead of with a cursor.
+	 */
+	for (i = vp; i; i = i->next) {
 		VERIFY_VP(i);
-		if ((i->da == da) && (!i->da->flags.has_tag || TAG_EQ(tag, i->tag))) {
-			return i;
-		}
+		if (i->da != da) continue;
+
+		if (!da->flags.has_tag || TAG_EQ(tag, i->tag)) return i;
 	}
 
 	return NULL;
 }
 
 
+struct vp_index {
+	VALUE_PAIR	**first;	//!< The list which was indexed.
+	VALUE_PAIR	*last;		//!< The last VP when the index was built.
+	uint32_t	mask;		//!< Number of slots - 1.
+	VALUE_PAIR	**slots;	//!< First VP for each DA, by hash of the DA pointer.
+};
+
+/** Index a list of VALUE_PAIRs by DA
+ *
+ * @param[in] ctx to allocate the index in.
+ * @param[in] first VP in the list.  The list head must stay at this address.
+ * @return the index, or NULL on error.
+ */
+vp_index_t *pairindex_alloc(TALLOC_CTX *ctx, VALUE_PAIR **first)
+{
+	uint32_t num, size, hash;
+	vp_index_t *index;
+	VALUE_PAIR *vp;
+
+	num = 0;
+	for (vp = *first; vp; vp = vp->next) num++;
+
+	/*
+	 *	Keep the table at most half full.
+	 */
+	size = 16;
+	while (size < (num * 2)) size <<= 1;
+
+	index = talloc_zero(ctx, vp_index_t);
+	if (!index) return NULL;
+
+	index->slots = talloc_zero_array(index, VALUE_PAIR *, size);
+	if (!index->slots) {
+		talloc_free(index);
+		return NULL;
+	}
+	index->first = first;
+	index->mask = size - 1;
+
+	for (vp = *first; vp; vp = vp->next) {
+		VERIFY_VP(vp);
+
+		hash = fr_hash(&vp->da, sizeof(vp->da)) & index->mask;
+		while (index->slots[hash] && (index->slots[hash]->da != vp->da)) {
+			hash = (hash + 1) & index->mask;
+		}
+
+		if (!index->slots[hash]) index->slots[hash] = vp;
+		index->last = vp;
+	}
+
+	return index;
+}
+
+/** Find the first pair with the matching DA, using an index
+ *
+ * Returns the same VP as pairfind_da() on the indexed list.
+ *
+ * @param[in] index built by pairindex_alloc().
+ * @param[in] da to match.
+ * @param[in] tag to match. TAG_ANY matches any tag, TAG_NONE matches tagless VPs.
+ * @return the VP, or NULL if none match.
+ */
+VALUE_PAIR *pairindex_find(vp_index_t const *index, DICT_ATTR const *da, int8_t tag)
+{
+	uint32_t hash;
+	VALUE_PAIR *vp;
+
+	hash = fr_hash(&da, sizeof(da)) & index->mask;
+	while ((vp = index->slots[hash]) != NULL) {
+		if (vp->da == da) {
+			VERIFY_VP(vp);
+			if (!da->flags.has_tag || TAG_EQ(tag, vp->tag)) return vp;
+
+			return pairfind_da(vp->next, da, tag);
+		}
+		hash = (hash + 1) & index->mask;
+	}
+
+	/*
+	 *	Not in the index, but it may have been added to the
+	 *	list since.
+	 */
+	if (!index->last) return pairfind_da(*index->first, da, tag);
+
+	return pairfind_da(index->last->next, da, tag);
+}
+
 /** Find the pair with the matching attribute
  *
  * @todo should take DAs and do a pointer comparison.
  */
 VALUE_PAIR *pairfind(VALUE_PAIR *vp, unsigned int attr, unsigned int vendor, int8_t tag)
 {
-	vp_cursor_t 	cursor;
 	VALUE_PAIR	*i;
 
 	/* List head may be NULL if it contains no VPs */
@@ -222,9 +318,7 @@ VALUE_PAIR *pairfind(VALUE_PAIR *vp, unsigned int attr, unsigned int vendor, int
 
 	VERIFY_LIST(vp);
 
-	for (i = fr_cursor_init(&cursor, &vp);
-	     i;
-	     i = fr_cursor_next(&cursor)) {
+	for (i = vp; i; i = i->next) {
 		if ((i->da->attr == attr) && (i->da->vendor == vendor) && \
 		    (!i->da->flags.has_tag || TAG_EQ(tag, i->tag))) {
 			return i;
@@ -650,15 +744,27 @@ mismatch:
 	return false;
 }
 
-/** Copy a single valuepair
- *
- * Allocate a new valuepair and copy the da from the old vp.
- *
- * @param[in] ctx for talloc
- * @param[in] vp to copy.
- * @return a copy of the input VP or NULL on error.
+/*
+ *	Values shorter than this are as cheap to copy as they are to
+ *	share, so paircopy_shared() copies them.
  */
-VALUE_PAIR *paircopyvp(TALLOC_CTX *ctx, VALUE_PAIR const *vp)
+#define VP_SHARE_MIN_LENGTH	(32)
+
+/*
+ *	Make the copy point to the value of the original, instead of
+ *	copying it.  The value is only freed once neither VP uses it.
+ */
+static bool pairshare(VALUE_PAIR *n, VALUE_PAIR const *vp)
+{
+	if (vp->length < VP_SHARE_MIN_LENGTH) return false;
+
+	if (!talloc_reference(n, vp->data.ptr)) return false;
+
+	n->data.ptr = vp->data.ptr;
+	return true;
+}
+
+static VALUE_PAIR *paircopyvp_internal(TALLOC_CTX *ctx, VALUE_PAIR const *vp, bool share)
 {
 	VALUE_PAIR *n;
 
@@ -693,12 +799,22 @@ VALUE_PAIR *paircopyvp(TALLOC_CTX *ctx, VALUE_PAIR const *vp)
 	switch (vp->da->type) {
 	case PW_TYPE_TLV:
 	case PW_TYPE_OCTETS:
+		if (fr_intern_is(vp->vp_octets)) {
+			fr_intern_ref(vp->vp_octets);
+			break;
+		}
 		n->vp_octets = NULL;	/* else pairmemcpy will free vp's value */
+		if (share && pairshare(n, vp)) break;
 		pairmemcpy(n, vp->vp_octets, n->length);
 		break;
 
 	case PW_TYPE_STRING:
+		if (fr_intern_is(vp->vp_strvalue)) {
+			fr_intern_ref(vp->vp_strvalue);
+			break;
+		}
 		n->vp_strvalue = NULL;	/* else pairstrnpy will free vp's value */
+		if (share && pairshare(n, vp)) break;
 		pairstrncpy(n, vp->vp_strvalue, n->length);
 		break;
 
@@ -709,15 +825,20 @@ VALUE_PAIR *paircopyvp(TALLOC_CTX *ctx, VALUE_PAIR const *vp)
 	return n;
 }
 
-/** Copy a pairlist.
+/** Copy a single valuepair
  *
- * Copy all pairs from 'from' regardless of tag, attribute or vendor.
+ * Allocate a new valuepair and copy the da from the old vp.
  *
- * @param[in] ctx for new VALUE_PAIRs to be allocated in.
- * @param[in] from whence to copy VALUE_PAIRs.
- * @return the head of the new VALUE_PAIR list or NULL on error.
+ * @param[in] ctx for talloc
+ * @param[in] vp to copy.
+ * @return a copy of the input VP or NULL on error.
  */
-VALUE_PAIR *paircopy(TALLOC_CTX *ctx, VALUE_PAIR *from)
+VALUE_PAIR *paircopyvp(TALLOC_CTX *ctx, VALUE_PAIR const *vp)
+{
+	return paircopyvp_internal(ctx, vp, false);
+}
+
+static VALUE_PAIR *paircopy_internal(TALLOC_CTX *ctx, VALUE_PAIR *from, bool share)
 {
 	vp_cursor_t src, dst;
 
@@ -728,7 +849,7 @@ VALUE_PAIR *paircopy(TALLOC_CTX *ctx, VALUE_PAIR *from)
 	     vp;
 	     vp = fr_cursor_next(&src)) {
 		VERIFY_VP(vp);
-		vp = paircopyvp(ctx, vp);
+		vp = paircopyvp_internal(ctx, vp, share);
 		if (!vp) {
 			pairfree(&out);
 			return NULL;
@@ -739,6 +860,39 @@ VALUE_PAIR *paircopy(TALLOC_CTX *ctx, VALUE_PAIR *from)
 	return out;
 }
 
+/** Copy a pairlist.
+ *
+ * Copy all pairs from 'from' regardless of tag, attribute or vendor.
+ *
+ * @param[in] ctx for new VALUE_PAIRs to be allocated in.
+ * @param[in] from whence to copy VALUE_PAIRs.
+ * @return the head of the new VALUE_PAIR list or NULL on error.
+ */
+VALUE_PAIR *paircopy(TALLOC_CTX *ctx, VALUE_PAIR *from)
+{
+	return paircopy_internal(ctx, from, false);
+}
+
+/** Copy a pairlist, sharing the values with the original
+ *
+ * As paircopy(), but long string and octets values are shared between
+ * the original and the copy, instead of being duplicated.  Changing
+ * the value of either VP with one of the pair* functions gives it a
+ * new buffer, and leaves the other one alone.
+ *
+ * talloc references are not thread safe, so both lists must only
+ * ever be used by one thread at a time, e.g. when they are in the
+ * same REQUEST.
+ *
+ * @param[in] ctx for new VALUE_PAIRs to be allocated in.
+ * @param[in] from whence to copy VALUE_PAIRs.
+ * @return the head of the new VALUE_PAIR list or NULL on error.
+ */
+VALUE_PAIR *paircopy_shared(TALLOC_CTX *ctx, VALUE_PAIR *from)
+{
+	return paircopy_internal(ctx, from, true);
+}
+
 /** Copy matching pairs
  *
  * Copy pairs of a matching attribute number, vendor number and tag from the
@@ -1095,6 +1249,59 @@ void pairfilter(TALLOC_CTX *ctx, VALUE_PAIR **to, VALUE_PAIR **from, unsigned in
 
 static char const hextab[] = "0123456789abcdef";
 
+/*
+ *	Parse 1 to 19 decimal digits, which can't overflow.  Anything
+ *	else is left to the slower, more general, parsers.
+ */
+static bool parse_decimal(char const *value, uint64_t *out)
+{
+	char const	*p = value;
+	uint64_t	num = 0;
+
+	while ((*p >= '0') && (*p <= '9')) num = (num * 10) + (*p++ - '0');
+
+	if (*p || (p == value) || ((p - value) > 19)) return false;
+
+	*out = num;
+	return true;
+}
+
+/*
+ *	Parse a dotted quad, with no leading zeros, which is what
+ *	inet_pton() accepts.
+ */
+static bool parse_ipv4(char const *value, size_t len, uint32_t *out)
+{
+	char const	*p = value, *end = value + len;
+	uint8_t		addr[4];
+	int		i;
+
+	for (i = 0; i < 4; i++) {
+		unsigned int octet;
+
+		if ((p >= end) || (*p < '0') || (*p > '9')) return false;
+
+		octet = *p++ - '0';
+		if (octet > 0) {
+			while ((p < end) && (*p >= '0') && (*p <= '9')) {
+				octet = (octet * 10) + (*p++ - '0');
+				if (octet > 255) return false;
+			}
+		}
+		addr[i] = octet;
+
+		if (i < 3) {
+			if ((p >= end) || (*p != '.')) return false;
+			p++;
+		}
+	}
+
+	if (p != end) return false;
+
+	memcpy(out, addr, sizeof(addr));
+	return true;
+}
+
 /** Convert string value to native attribute value
  *
  * @param vp to assign value to.
@@ -1295,6 +1502,11 @@ int pairparsevalue(VALUE_PAIR *vp, char const *value, size_t inlen)
 	{
 		fr_ipaddr_t addr;
 
+		if (parse_ipv4(value, len, &vp->vp_ipaddr)) {
+			vp->length = sizeof(vp->vp_ipaddr);
+			goto finish;
+		}
+
 		if (fr_pton4(&addr, value, inlen, fr_hostname_lookups, false) < 0) return -1;
 
 		/*
@@ -1379,19 +1591,24 @@ int pairparsevalue(VALUE_PAIR *vp, char const *value, size_t inlen)
 	switch(vp->da->type) {
 	case PW_TYPE_BYTE:
 	{
-		char *p;
+		char *p = NULL;
 		unsigned int i;
+		uint64_t num;
 
 		/*
 		 *	Note that ALL integers are unsigned!
 		 */
-		i = fr_strtoul(value, &p);
+		if (parse_decimal(value, &num)) {
+			i = num;
+		} else {
+			i = fr_strtoul(value, &p);
+		}
 
 		/*
 		 *	Look for the named value for the given
 		 *	attribute.
 		 */
-		if (*p && !is_whitespace(p)) {
+		if (p && *p && !is_whitespace(p)) {
 			if ((dval = dict_valbyname(vp->da->attr, vp->da->vendor, value)) == NULL) {
 				fr_strerror_printf("Unknown value '%s' for attribute '%s'", value, vp->da->name);
 				return -1;
@@ -1413,19 +1630,24 @@ int pairparsevalue(VALUE_PAIR *vp, char const *value, size_t inlen)
 
 	case PW_TYPE_SHORT:
 	{
-		char *p;
+		char *p = NULL;
 		unsigned int i;
+		uint64_t num;
 
 		/*
 		 *	Note that ALL integers are unsigned!
 		 */
-		i = fr_strtoul(value, &p);
+		if (parse_decimal(value, &num)) {
+			i = num;
+		} else {
+			i = fr_strtoul(value, &p);
+		}
 
 		/*
 		 *	Look for the named value for the given
 		 *	attribute.
 		 */
-		if (*p && !is_whitespace(p)) {
+		if (p && *p && !is_whitespace(p)) {
 			if ((dval = dict_valbyname(vp->da->attr, vp->da->vendor, value)) == NULL) {
 				fr_strerror_printf("Unknown value '%s' for attribute '%s'", value, vp->da->name);
 				return -1;
@@ -1447,19 +1669,24 @@ int pairparsevalue(VALUE_PAIR *vp, char const *value, size_t inlen)
 
 	case PW_TYPE_INTEGER:
 	{
-		char *p;
+		char *p = NULL;
 		unsigned int i;
+		uint64_t num;
 
 		/*
 		 *	Note that ALL integers are unsigned!
 		 */
-		i = fr_strtoul(value, &p);
+		if (parse_decimal(value, &num)) {
+			i = num;
+		} else {
+			i = fr_strtoul(value, &p);
+		}
 
 		/*
 		 *	Look for the named value for the given
 		 *	attribute.
 		 */
-		if (*p && !is_whitespace(p)) {
+		if (p && *p && !is_whitespace(p)) {
 			if ((dval = dict_valbyname(vp->da->attr, vp->da->vendor, value)) == NULL) {
 				fr_strerror_printf("Unknown value '%s' for attribute '%s'", value, vp->da->name);
 				return -1;
@@ -1484,7 +1711,8 @@ int pairparsevalue(VALUE_PAIR *vp, char const *value, size_t inlen)
 		/*
 		 *	Note that ALL integers are unsigned!
 		 */
-		if (sscanf(value, "%" PRIu64, &y) != 1) {
+		if (!parse_decimal(value, &y) &&
+		    (sscanf(value, "%" PRIu64, &y) != 1)) {
 			fr_strerror_printf("Invalid value '%s' for attribute '%s'",
 					   value, vp->da->name);
 			return -1;
@@ -1542,6 +1770,22 @@ int pairparsevalue(VALUE_PAIR *vp, char const *value, size_t inlen)
 			break;
 		}
 
+		/*
+		 *	The usual xx:xx:xx:xx:xx:xx form.
+		 */
+		if ((strlen(value) == 17) &&
+		    (value[2] == ':') && (value[5] == ':') && (value[8] == ':') &&
+		    (value[11] == ':') && (value[14] == ':') &&
+		    (fr_hex2bin(&vp->vp_ether[0], 1, value, 2) == 1) &&
+		    (fr_hex2bin(&vp->vp_ether[1], 1, value + 3, 2) == 1) &&
+		    (fr_hex2bin(&vp->vp_ether[2], 1, value + 6, 2) == 1) &&
+		    (fr_hex2bin(&vp->vp_ether[3], 1, value + 9, 2) == 1) &&
+		    (fr_hex2bin(&vp->vp_ether[4], 1, value + 12, 2) == 1) &&
+		    (fr_hex2bin(&vp->vp_ether[5], 1, value + 15, 2) == 1)) {
+			vp->length = 6;
+			break;
+		}
+
 		cp = value;
 		while (*cp) {
 			if (cp[1] == ':') {
@@ -2831,6 +3075,26 @@ int pairlistcmp(VALUE_PAIR *a, VALUE_PAIR *b)
 	return 1;
 }
 
+/** Release the old value of a VALUE_PAIR
+ *
+ * The value may be shared with other VPs, either by paircopy_shared()
+ * or by interning, so it's only freed once no VP is using it.
+ *
+ * @param vp the value belonged to.
+ * @param value to release.
+ */
+static void pairvaluefree(VALUE_PAIR *vp, void *value)
+{
+	if (!value) return;
+
+	if (fr_intern_is(value)) {
+		fr_intern_release(value);
+		return;
+	}
+
+	talloc_unlink(vp, value);
+}
+
 /** Set the type of the VALUE_PAIR value buffer to match it's DICT_ATTR
  *
  * @param vp to fixup.
@@ -2873,7 +3137,7 @@ void pairmemcpy(VALUE_PAIR *vp, uint8_t const *src, size_t size)
 	}
 
 	memcpy(&q, &vp->vp_octets, sizeof(q));
-	TALLOC_FREE(q);
+	pairvaluefree(vp, q);
 
 	vp->vp_octets = p;
 	vp->length = size;
@@ -2893,7 +3157,7 @@ void pairmemsteal(VALUE_PAIR *vp, uint8_t const *src)
 	VERIFY_VP(vp);
 
 	memcpy(&q, &vp->vp_octets, sizeof(q));
-	talloc_free(q);
+	pairvaluefree(vp, q);
 
 	vp->vp_octets = talloc_steal(vp, src);
 	vp->type = VT_DATA;
@@ -2913,7 +3177,7 @@ void pairstrsteal(VALUE_PAIR *vp, char const *src)
 	VERIFY_VP(vp);
 
 	memcpy(&q, &vp->vp_octets, sizeof(q));
-	talloc_free(q);
+	pairvaluefree(vp, q);
 
 	vp->vp_strvalue = talloc_steal(vp, src);
 	vp->type = VT_DATA;
@@ -2937,7 +3201,7 @@ void pairstrcpy(VALUE_PAIR *vp, char const *src)
 	if (!p) return;
 
 	memcpy(&q, &vp->vp_strvalue, sizeof(q));
-	talloc_free(q);
+	pairvaluefree(vp, q);
 
 	vp->vp_strvalue = p;
 	vp->type = VT_DATA;
@@ -2964,7 +3228,7 @@ void pairstrncpy(VALUE_PAIR *vp, char const *src, size_t len)
 	p[len] = '\0';
 
 	memcpy(&q, &vp->vp_strvalue, sizeof(q));
-	talloc_free(q);
+	pairvaluefree(vp, q);
 
 	vp->vp_strvalue = p;
 	vp->type = VT_DATA;
@@ -3032,8 +3296,11 @@ int pairdatacpy(VALUE_PAIR *vp, PW_TYPE type, value_data_t const *data, size_t l
 	/*
 	 *	Clear existing value if there is one
 	 */
-	memcpy(&old, &vp->data.ptr, sizeof(old));
-	talloc_free(old);
+	if (vp->da->flags.is_pointer) {
+		memcpy(&old, &vp->data.ptr, sizeof(old));
+		pairvaluefree(vp, old);
+		vp->data.ptr = NULL;
+	}
 
 	switch (vp->da->type) {
 	case PW_TYPE_TLV:
@@ -3073,7 +3340,7 @@ void pairsprintf(VALUE_PAIR *vp, char const *fmt, ...)
 	if (!p) return;
 
 	memcpy(&q, &vp->vp_strvalue, sizeof(q));
-	talloc_free(q);
+	pairvaluefree(vp, q);
 
 	vp->vp_strvalue = p;
 	vp->type = VT_DATA;
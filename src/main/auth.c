@@ -335,166 +335,17 @@ int rad_postauth(REQUEST *request)
 }
 
 /*
- *	Process and reply to an authentication request
- *
- *	The return value of this function isn't actually used right now, so
- *	it's not entirely clear if it is returning the right things. --Pac.
+ *	Run Auth-Type for a request which has been authorized, check
+ *	Simultaneous-Use, and set the reply code.
  */
-int rad_authenticate(REQUEST *request)
+static int rad_authenticate_user(REQUEST *request)
 {
 #ifdef WITH_SESSION_MGMT
 	VALUE_PAIR	*check_item;
+	VALUE_PAIR	*tmp;
 #endif
 	VALUE_PAIR	*module_msg;
-	VALUE_PAIR	*tmp = NULL;
 	int		result;
-	char		autz_retry = 0;
-	int		autz_type = 0;
-
-#ifdef WITH_PROXY
-	/*
-	 *	If this request got proxied to another server, we need
-	 *	to check whether it authenticated the request or not.
-	 *
-	 *	request->proxy gets set only AFTER authorization, so
-	 *	it's safe to check it here.  If it exists, it means
-	 *	we're doing a second pass through rad_authenticate().
-	 */
-	if (request->proxy) {
-		int code = 0;
-
-		if (request->proxy_reply) code = request->proxy_reply->code;
-
-		switch (code) {
-		/*
-		 *	Reply of ACCEPT means accept, thus set Auth-Type
-		 *	accordingly.
-		 */
-		case PW_CODE_ACCESS_ACCEPT:
-			tmp = radius_paircreate(request,
-						&request->config_items,
-						PW_AUTH_TYPE, 0);
-			if (tmp) tmp->vp_integer = PW_AUTHTYPE_ACCEPT;
-			goto authenticate;
-
-		/*
-		 *	Challenges are punted back to the NAS without any
-		 *	further processing.
-		 */
-		case PW_CODE_ACCESS_CHALLENGE:
-			request->reply->code = PW_CODE_ACCESS_CHALLENGE;
-			return RLM_MODULE_OK;
-
-		/*
-		 *	ALL other replies mean reject. (this is fail-safe)
-		 *
-		 *	Do NOT do any authorization or authentication. They
-		 *	are being rejected, so we minimize the amount of work
-		 *	done by the server, by rejecting them here.
-		 */
-		case PW_CODE_ACCESS_REJECT:
-			rad_authlog("Login incorrect (Home Server says so)",
-				    request, 0);
-			request->reply->code = PW_CODE_ACCESS_REJECT;
-			return RLM_MODULE_REJECT;
-
-		default:
-			rad_authlog("Login incorrect (Home Server failed to respond)",
-				    request, 0);
-			return RLM_MODULE_REJECT;
-		}
-	}
-#endif
-	/*
-	 *	Look for, and cache, passwords.
-	 */
-	if (!request->password) {
-		request->password = pairfind(request->packet->vps, PW_USER_PASSWORD, 0, TAG_ANY);
-	}
-	if (!request->password) {
-		request->password = pairfind(request->packet->vps, PW_CHAP_PASSWORD, 0, TAG_ANY);
-	}
-
-	/*
-	 *	Get the user's authorization information from the database
-	 */
-autz_redo:
-	result = process_authorize(autz_type, request);
-switch (result) {
-	case RLM_MODULE_NOOP:
-	case RLM_MODULE_NOTFOUND:
-	case RLM_MODULE_OK:
-	case RLM_MODULE_UPDATED:
-		break;
-	case RLM_MODULE_HANDLED:
-		return result;
-	case RLM_MODULE_FAIL:
-	case RLM_MODULE_INVALID:
-	case RLM_MODULE_REJECT:
-	case RLM_MODULE_USERLOCK:
-	default:
-		if ((module_msg = pairfind(request->packet->vps, PW_MODULE_FAILURE_MESSAGE, 0, TAG_ANY)) != NULL) {
-			char msg[MAX_STRING_LEN + 16];
-			snprintf(msg, sizeof(msg), "Invalid user (%s)",
-				 module_msg->vp_strvalue);
-			rad_authlog(msg,request,0);
-		} else {
-			rad_authlog("Invalid user", request, 0);
-		}
-		request->reply->code = PW_CODE_ACCESS_REJECT;
-		return result;
-	}
-	if (!autz_retry) {
-		tmp = pairfind(request->config_items, PW_AUTZ_TYPE, 0, TAG_ANY);
-		if (tmp) {
-			autz_type = tmp->vp_integer;
-			RDEBUG2("Using Autz-Type %s",
-				dict_valnamebyattr(PW_AUTZ_TYPE, 0, autz_type));
-			autz_retry = 1;
-			goto autz_redo;
-		}
-	}
-
-	/*
-	 *	If we haven't already proxied the packet, then check
-	 *	to see if we should.  Maybe one of the authorize
-	 *	modules has decided that a proxy should be used. If
-	 *	so, get out of here and send the packet.
-	 */
-	if (
-#ifdef WITH_PROXY
-	    (request->proxy == NULL) &&
-#endif
-	    ((tmp = pairfind(request->config_items, PW_PROXY_TO_REALM, 0, TAG_ANY)) != NULL)) {
-		REALM *realm;
-
-		realm = realm_find2(tmp->vp_strvalue);
-
-		/*
-		 *	Don't authenticate, as the request is going to
-		 *	be proxied.
-		 */
-		if (realm && realm->auth_pool) {
-			return RLM_MODULE_OK;
-		}
-
-		/*
-		 *	Catch users who set Proxy-To-Realm to a LOCAL
-		 *	realm (sigh).  But don't complain if it is
-		 *	*the* LOCAL realm.
-		 */
-		if (realm &&(strcmp(realm->name, "LOCAL") != 0)) {
-			RWDEBUG2("You set Proxy-To-Realm = %s, but it is a LOCAL realm!  Cancelling proxy request.", realm->name);
-		}
-
-		if (!realm) {
-			RWDEBUG2("You set Proxy-To-Realm = %s, but the realm does not exist!  Cancelling invalid proxy request.", tmp->vp_strvalue);
-		}
-	}
-
-#ifdef WITH_PROXY
- authenticate:
-#endif
 
 	/*
 	 *	Validate the user
@@ -643,11 +494,169 @@ switch (result) {
 	return result;
 }
 
+/*
+ *	Process and reply to an authentication request
+ *
+ *	The return value of this function isn't actually used right now, so
+ *	it's not entirely clear if it is returning the right things. --Pac.
+ */
+int rad_authenticate(REQUEST *request)
+{
+	VALUE_PAIR	*module_msg;
+	VALUE_PAIR	*tmp = NULL;
+	int		result;
+	char		autz_retry = 0;
+	int		autz_type = 0;
+
+#ifdef WITH_PROXY
+	/*
+	 *	If this request got proxied to another server, we need
+	 *	to check whether it authenticated the request or not.
+	 *
+	 *	request->proxy gets set only AFTER authorization, so
+	 *	it's safe to check it here.  If it exists, it means
+	 *	we're doing a second pass through rad_authenticate().
+	 */
+	if (request->proxy) {
+		int code = 0;
+
+		if (request->proxy_reply) code = request->proxy_reply->code;
+
+		switch (code) {
+		/*
+		 *	Reply of ACCEPT means accept, thus set Auth-Type
+		 *	accordingly.
+		 */
+		case PW_CODE_ACCESS_ACCEPT:
+			tmp = radius_paircreate(request,
+						&request->config_items,
+						PW_AUTH_TYPE, 0);
+			if (tmp) tmp->vp_integer = PW_AUTHTYPE_ACCEPT;
+			return rad_authenticate_user(request);
+
+		/*
+		 *	Challenges are punted back to the NAS without any
+		 *	further processing.
+		 */
+		case PW_CODE_ACCESS_CHALLENGE:
+			request->reply->code = PW_CODE_ACCESS_CHALLENGE;
+			return RLM_MODULE_OK;
+
+		/*
+		 *	ALL other replies mean reject. (this is fail-safe)
+		 *
+		 *	Do NOT do any authorization or authentication. They
+		 *	are being rejected, so we minimize the amount of work
+		 *	done by the server, by rejecting them here.
+		 */
+		case PW_CODE_ACCESS_REJECT:
+			rad_authlog("Login incorrect (Home Server says so)",
+				    request, 0);
+			request->reply->code = PW_CODE_ACCESS_REJECT;
+			return RLM_MODULE_REJECT;
+
+		default:
+			rad_authlog("Login incorrect (Home Server failed to respond)",
+				    request, 0);
+			return RLM_MODULE_REJECT;
+		}
+	}
+#endif
+	/*
+	 *	Look for, and cache, passwords.
+	 */
+	if (!request->password) {
+		request->password = pairfind(request->packet->vps, PW_USER_PASSWORD, 0, TAG_ANY);
+	}
+	if (!request->password) {
+		request->password = pairfind(request->packet->vps, PW_CHAP_PASSWORD, 0, TAG_ANY);
+	}
+
+	/*
+	 *	Get the user's authorization information from the database
+	 */
+autz_redo:
+	result = process_authorize(autz_type, request);
+switch (result) {
+	case RLM_MODULE_NOOP:
+	case RLM_MODULE_NOTFOUND:
+	case RLM_MODULE_OK:
+	case RLM_MODULE_UPDATED:
+		break;
+	case RLM_MODULE_HANDLED:
+		return result;
+	case RLM_MODULE_FAIL:
+	case RLM_MODULE_INVALID:
+	case RLM_MODULE_REJECT:
+	case RLM_MODULE_USERLOCK:
+	default:
+		if ((module_msg = pairfind(request->packet->vps, PW_MODULE_FAILURE_MESSAGE, 0, TAG_ANY)) != NULL) {
+			char msg[MAX_STRING_LEN + 16];
+			snprintf(msg, sizeof(msg), "Invalid user (%s)",
+				 module_msg->vp_strvalue);
+			rad_authlog(msg,request,0);
+		} else {
+			rad_authlog("Invalid user", request, 0);
+		}
+		request->reply->code = PW_CODE_ACCESS_REJECT;
+		return result;
+	}
+	if (!autz_retry) {
+		tmp = pairfind(request->config_items, PW_AUTZ_TYPE, 0, TAG_ANY);
+		if (tmp) {
+			autz_type = tmp->vp_integer;
+			RDEBUG2("Using Autz-Type %s",
+				dict_valnamebyattr(PW_AUTZ_TYPE, 0, autz_type));
+			autz_retry = 1;
+			goto autz_redo;
+		}
+	}
+
+	/*
+	 *	If we haven't already proxied the packet, then check
+	 *	to see if we should.  Maybe one of the authorize
+	 *	modules has decided that a proxy should be used. If
+	 *	so, get out of here and send the packet.
+	 */
+	if (
+#ifdef WITH_PROXY
+	    (request->proxy == NULL) &&
+#endif
+	    ((tmp = pairfind(request->config_items, PW_PROXY_TO_REALM, 0, TAG_ANY)) != NULL)) {
+		REALM *realm;
+
+		realm = realm_find2(tmp->vp_strvalue);
+
+		/*
+		 *	Don't authenticate, as the request is going to
+		 *	be proxied.
+		 */
+		if (realm && realm->auth_pool) {
+			return RLM_MODULE_OK;
+		}
+
+		/*
+		 *	Catch users who set Proxy-To-Realm to a LOCAL
+		 *	realm (sigh).  But don't complain if it is
+		 *	*the* LOCAL realm.
+		 */
+		if (realm &&(strcmp(realm->name, "LOCAL") != 0)) {
+			RWDEBUG2("You set Proxy-To-Realm = %s, but it is a LOCAL realm!  Cancelling proxy request.", realm->name);
+		}
+
+		if (!realm) {
+			RWDEBUG2("You set Proxy-To-Realm = %s, but the realm does not exist!  Cancelling invalid proxy request.", tmp->vp_strvalue);
+		}
+	}
+
+	return rad_authenticate_user(request);
+}
+
 /*
  *	Run a virtual server auth and postauth
  *
  */
-int rad_virtual_server(REQUEST *request)
+static int virtual_server_run(REQUEST *request, bool authorize)
 {
 	VALUE_PAIR *vp;
 	int result;
@@ -665,7 +674,12 @@ int rad_virtual_server(REQUEST *request)
 	 */
 	rad_assert(request->packet->code == PW_CODE_ACCESS_REQUEST);
 
-	result = rad_authenticate(request);
+	if (authorize) {
+		result = rad_authenticate(request);
+	} else {
+		RDEBUG2("Re-using control items from the previous round, skipping authorize");
+		result = rad_authenticate_user(request);
+	}
 
 	if (request->reply->code == PW_CODE_ACCESS_REJECT) {
 		pairdelete(&request->config_items, PW_POST_AUTH_TYPE, 0, TAG_ANY);
@@ -685,3 +699,18 @@ int rad_virtual_server(REQUEST *request)
 
 	return result;
 }
+
+int rad_virtual_server(REQUEST *request)
+{
+	return virtual_server_run(request, true);
+}
+
+/*
+ *	Run a virtual server auth and postauth, for a request whose
+ *	control items were found by an earlier pass through the same
+ *	virtual server.  The authorize section is not run.
+ */
+int rad_virtual_server_authenticate(REQUEST *request)
+{
+	return virtual_server_run(request, false);
+}
@@ -38,20 +38,57 @@ RCSID("$Id$")
 #endif
 #endif
 
+#undef USEC
+#define USEC (1000000)
+
+/*
+ *	Clients are kept in a path-compressed binary trie (one for
+ *	IPv4, one for IPv6), keyed by network address and prefix
+ *	length.  Finding the client for a packet is then a single
+ *	walk down the trie, remembering the longest matching prefix,
+ *	instead of one lookup per configured prefix length.
+ */
+#ifdef WITH_TCP
+#define CLIENT_NUM_PROTO (3)	/* any, UDP, TCP */
+#else
+#define CLIENT_NUM_PROTO (1)
+#endif
+
+typedef struct client_node_t {
+	struct client_node_t	*child[2];
+	uint8_t			key[16];	//!< Network address, masked to prefix.
+	uint8_t			prefix;		//!< Length of key, in bits.
+	RADCLIENT		*client[CLIENT_NUM_PROTO];	//!< Indexed by client_proto().
+} client_node_t;
+
+/*
+ *	The roots are kept apart from the list, so that a HUP can
+ *	replace both of them with one pointer store.
+ */
+typedef struct client_trie_t {
+	client_node_t	*root[2];	//!< IPv4, IPv6.
+} client_trie_t;
+
 struct radclient_list {
-	/*
-	 *	FIXME: One set of trees for IPv4, and another for IPv6?
-	 */
-	rbtree_t	*trees[129]; /* for 0..128, inclusive. */
-	uint32_t       	min_prefix;
+	client_trie_t	*trie;
+	CONF_SECTION	*cs;		//!< The clients were read from.
 };
 
+#ifdef __ATOMIC_ACQUIRE
+#  define TRIE_LOAD(_x)		__atomic_load_n(&(_x), __ATOMIC_ACQUIRE)
+#  define TRIE_STORE(_x, _v)	__atomic_store_n(&(_x), _v, __ATOMIC_RELEASE)
+#else
+#  define TRIE_LOAD(_x)		(_x)
+#  define TRIE_STORE(_x, _v)	((_x) = (_v))
+#endif
+
 
 #ifdef WITH_STATS
 static rbtree_t		*tree_num = NULL;     /* client numbers 0..N */
 static int		tree_num_max = 0;
 #endif
 static RADCLIENT_LIST	*root_clients = NULL;
+static bool		clients_reloading = false;	//!< Don't replace root_clients while parsing.
 
 #ifdef WITH_DYNAMIC_CLIENTS
 static fr_fifo_t	*deleted_clients = NULL;
@@ -98,31 +135,211 @@ void client_free(RADCLIENT *client)
 	talloc_free(client);
 }
 
+static int client_proto(int proto)
+{
+#ifdef WITH_TCP
+	switch (proto) {
+	case IPPROTO_UDP:
+		return 1;
+
+	case IPPROTO_TCP:
+		return 2;
+
+	default:
+		break;
+	}
+#endif
+	return 0;
+}
+
+static uint8_t const *client_key(fr_ipaddr_t const *ipaddr, int *af, int *max_prefix)
+{
+	switch (ipaddr->af) {
+	case AF_INET:
+		*af = 0;
+		*max_prefix = 32;
+		return (uint8_t const *) &ipaddr->ipaddr.ip4addr;
+
+	case AF_INET6:
+		*af = 1;
+		*max_prefix = 128;
+		return (uint8_t const *) &ipaddr->ipaddr.ip6addr;
+
+	default:
+		return NULL;
+	}
+}
+
+#define KEY_BIT(_key, _bit) (((_key)[(_bit) >> 3] >> (7 - ((_bit) & 0x07))) & 0x01)
+
 /*
- *	Callback for comparing two clients.
+ *	Number of leading bits which are the same in both keys,
+ *	up to "max".
  */
-static int client_ipaddr_cmp(void const *one, void const *two)
+static int key_common(uint8_t const *a, uint8_t const *b, int max)
 {
-	RADCLIENT const *a = one;
-	RADCLIENT const *b = two;
-#ifndef WITH_TCP
+	int bits = 0;
+	uint8_t diff;
+
+	while (bits < max) {
+		diff = a[bits >> 3] ^ b[bits >> 3];
+		if (diff) {
+			while (!(diff & 0x80)) {
+				diff <<= 1;
+				bits++;
+			}
+			break;
+		}
+		bits += 8;
+	}
+
+	return (bits < max) ? bits : max;
+}
+
+static client_node_t *client_node_alloc(RADCLIENT_LIST *clients, uint8_t const *key, int prefix)
+{
+	client_node_t *node;
+
+	node = talloc_zero(clients, client_node_t);
+	if (!node) return NULL;
+
+	memcpy(node->key, key, (prefix + 7) >> 3);
+	if (prefix & 0x07) node->key[prefix >> 3] &= (0xff << (8 - (prefix & 0x07)));
+	node->prefix = prefix;
+
+	return node;
+}
+
+/*
+ *	Return the client in a node which matches the protocol.  An
+ *	"any" client matches all protocols, and looking up "any"
+ *	matches all clients.
+ */
+static RADCLIENT *client_node_match(client_node_t const *node, int proto)
+{
+#ifdef WITH_TCP
+	int i = client_proto(proto);
+
+	if (i != 0) return node->client[i] ? node->client[i] : node->client[0];
+
+	for (i = 0; i < CLIENT_NUM_PROTO; i++) {
+		if (node->client[i]) return node->client[i];
+	}
 
-	return fr_ipaddr_cmp(&a->ipaddr, &b->ipaddr);
+	return NULL;
 #else
-	int rcode;
+	return node->client[0];
+#endif
+}
 
-	rcode = fr_ipaddr_cmp(&a->ipaddr, &b->ipaddr);
-	if (rcode != 0) return rcode;
+/*
+ *	Find the node for an exact address and prefix, creating it
+ *	if necessary.
+ */
+static client_node_t *client_node_find(RADCLIENT_LIST *clients, fr_ipaddr_t const *ipaddr, bool create)
+{
+	int af, max_prefix, common;
+	int prefix = ipaddr->prefix;
+	uint8_t const *key;
+	client_node_t **p, *node, *split;
+
+	key = client_key(ipaddr, &af, &max_prefix);
+	if (!key || (prefix > max_prefix)) return NULL;
+
+	for (p = &clients->trie->root[af]; *p != NULL; p = &node->child[KEY_BIT(key, node->prefix)]) {
+		node = *p;
+
+		common = key_common(key, node->key, (prefix < node->prefix) ? prefix : node->prefix);
+		if (common == node->prefix) {
+			if (node->prefix == prefix) return node;
+			continue;
+		}
+
+		/*
+		 *	The new prefix diverges from, or is shorter
+		 *	than, this node.  Put a new node above it.
+		 */
+		if (!create) return NULL;
+
+		split = client_node_alloc(clients, key, common);
+		if (!split) return NULL;
+		split->child[KEY_BIT(node->key, common)] = node;
+
+		if (common < prefix) {
+			client_node_t *leaf;
+
+			leaf = client_node_alloc(clients, key, prefix);
+			if (!leaf) {
+				talloc_free(split);
+				return NULL;
+			}
+			split->child[KEY_BIT(key, common)] = leaf;
+			*p = split;
+
+			return leaf;
+		}
+
+		*p = split;
+		return split;
+	}
+
+	if (!create) return NULL;
+
+	*p = client_node_alloc(clients, key, prefix);
+	return *p;
+}
+
+#ifdef WITH_DYNAMIC_CLIENTS
+/*
+ *	Remove a client from the trie, and prune any nodes which are
+ *	no longer needed.
+ */
+static void client_node_delete(RADCLIENT_LIST *clients, RADCLIENT *client)
+{
+	int i, af, max_prefix;
+	int prefix = client->ipaddr.prefix;
+	uint8_t const *key;
+	client_node_t **p, **parent = NULL, *node;
+
+	key = client_key(&client->ipaddr, &af, &max_prefix);
+	if (!key) return;
+
+	for (p = &clients->trie->root[af]; *p != NULL; p = &node->child[KEY_BIT(key, node->prefix)]) {
+		node = *p;
+
+		if ((node->prefix > prefix) ||
+		    (key_common(key, node->key, node->prefix) != node->prefix)) return;
+
+		if (node->prefix == prefix) break;
+
+		parent = p;
+	}
+	if (!*p) return;
+
+	node = *p;
+	i = client_proto(client->proto);
+	if (node->client[i] != client) return;
+	node->client[i] = NULL;
+
+	if (client_node_match(node, IPPROTO_IP)) return;
+
+	if (node->child[0] && node->child[1]) return;
+
+	*p = node->child[0] ? node->child[0] : node->child[1];
+	talloc_free(node);
 
 	/*
-	 *	Wildcard match
+	 *	The parent may now be an empty node with only one child.
 	 */
-	if ((a->proto == IPPROTO_IP) ||
-	    (b->proto == IPPROTO_IP)) return 0;
+	if (!parent) return;
 
-	return (a->proto - b->proto);
-#endif
+	node = *parent;
+	if (client_node_match(node, IPPROTO_IP) || (node->child[0] && node->child[1])) return;
+
+	*parent = node->child[0] ? node->child[0] : node->child[1];
+	talloc_free(node);
 }
+#endif
 
 #ifdef WITH_STATS
 static int client_num_cmp(void const *one, void const *two)
@@ -139,15 +356,12 @@ static int client_num_cmp(void const *one, void const *two)
  */
 void clients_free(RADCLIENT_LIST *clients)
 {
-	int i;
-
 	if (!clients) clients = root_clients;
 	if (!clients) return;	/* Clients may not have been initialised yet */
 
-	for (i = 0; i <= 128; i++) {
-		if (clients->trees[i]) rbtree_free(clients->trees[i]);
-		clients->trees[i] = NULL;
-	}
+	/*
+	 *	The trie nodes are parented by the list.
+	 */
 
 	if (clients == root_clients) {
 #ifdef WITH_STATS
@@ -175,30 +389,27 @@ RADCLIENT_LIST *clients_init(CONF_SECTION *cs)
 	RADCLIENT_LIST *clients = talloc_zero(cs, RADCLIENT_LIST);
 
 	if (!clients) return NULL;
+	clients->cs = cs;
 
-	clients->min_prefix = 128;
+	clients->trie = talloc_zero(clients, client_trie_t);
+	if (!clients->trie) {
+		talloc_free(clients);
+		return NULL;
+	}
 
 	return clients;
 }
 
 /*
- *	Add a client to the tree.
+ *	Hack to fixup wildcard clients
+ *
+ *	If the IP is all zeros, with a 32 or 128 bit netmask
+ *	assume the user meant to configure 0.0.0.0/0 instead
+ *	of 0.0.0.0/32 - which would require the src IP of
+ *	the client to be all zeros.
  */
-int client_add(RADCLIENT_LIST *clients, RADCLIENT *client)
+static void client_fixup_wildcard(RADCLIENT *client)
 {
-	RADCLIENT *old;
-	char buffer[INET6_ADDRSTRLEN + 3];
-
-	if (!client) return 0;
-
-	/*
-	 *	Hack to fixup wildcard clients
-	 *
-	 *	If the IP is all zeros, with a 32 or 128 bit netmask
-	 *	assume the user meant to configure 0.0.0.0/0 instead
-	 *	of 0.0.0.0/32 - which would require the src IP of
-	 *	the client to be all zeros.
-	 */
 	if (fr_inaddr_any(&client->ipaddr) == 1) switch (client->ipaddr.af) {
 	case AF_INET:
 		if (client->ipaddr.prefix == 32) client->ipaddr.prefix = 0;
@@ -211,111 +422,68 @@ int client_add(RADCLIENT_LIST *clients, RADCLIENT *client)
 	default:
 		rad_assert(0);
 	}
+}
 
-	fr_ntop(buffer, sizeof(buffer), &client->ipaddr);
-	DEBUG3("Adding client %s (%s) to prefix tree %i", buffer, client->longname, client->ipaddr.prefix);
+/*
+ *	Find the list a client should be added to.  That's the list
+ *	for its virtual server if it has one, otherwise the global
+ *	list.  Either is created if it doesn't exist.
+ */
+static RADCLIENT_LIST *client_list_for(RADCLIENT const *client)
+{
+	RADCLIENT_LIST *clients;
 
-	/*
-	 *	If "clients" is NULL, it means add to the global list,
-	 *	unless we're trying to add it to a virtual server...
-	 */
-	if (!clients) {
-		if (client->server != NULL) {
-			CONF_SECTION *cs;
+	if (client->server != NULL) {
+		CONF_SECTION *cs;
 
-			cs = cf_section_sub_find_name2(main_config.config,
-						   "server", client->server);
-			if (!cs) {
-				radlog(L_ERR, "Failed to find virtual server %s",
-				       client->server);
-				return 0;
-			}
+		cs = cf_section_sub_find_name2(main_config.config,
+					   "server", client->server);
+		if (!cs) {
+			radlog(L_ERR, "Failed to find virtual server %s",
+			       client->server);
+			return NULL;
+		}
 
-			/*
-			 *	If the client list already exists, use that.
-			 *	Otherwise, create a new client list.
-			 */
-			clients = cf_data_find(cs, "clients");
+		/*
+		 *	If the client list already exists, use that.
+		 *	Otherwise, create a new client list.
+		 */
+		clients = cf_data_find(cs, "clients");
+		if (!clients) {
+			clients = clients_init(cs);
 			if (!clients) {
-				clients = clients_init(cs);
-				if (!clients) {
-					radlog(L_ERR, "Out of memory");
-					return 0;
-				}
-
-				if (cf_data_add(cs, "clients", clients, (void *) clients_free) < 0) {
-					radlog(L_ERR, "Failed to associate clients with virtual server %s",
-					       client->server);
-					clients_free(clients);
-					return 0;
-				}
+				radlog(L_ERR, "Out of memory");
+				return NULL;
 			}
 
-		} else {
-			/*
-			 *	Initialize the global list, if not done already.
-			 */
-			if (!root_clients) {
-				root_clients = clients_init(NULL);
-				if (!root_clients) return 0;
+			if (cf_data_add(cs, "clients", clients, (void *) clients_free) < 0) {
+				radlog(L_ERR, "Failed to associate clients with virtual server %s",
+				       client->server);
+				clients_free(clients);
+				return NULL;
 			}
-			clients = root_clients;
 		}
-	}
 
-	/*
-	 *	Create a tree for it.
-	 */
-	if (!clients->trees[client->ipaddr.prefix]) {
-		clients->trees[client->ipaddr.prefix] = rbtree_create(clients, client_ipaddr_cmp, NULL, 0);
-		if (!clients->trees[client->ipaddr.prefix]) {
-			return 0;
-		}
+		return clients;
 	}
 
-#define namecmp(a) ((!old->a && !client->a) || (old->a && client->a && (strcmp(old->a, client->a) == 0)))
-
 	/*
-	 *	Cannot insert the same client twice.
+	 *	Initialize the global list, if not done already.
 	 */
-	old = rbtree_finddata(clients->trees[client->ipaddr.prefix], client);
-	if (old) {
-		/*
-		 *	If it's a complete duplicate, then free the new
-		 *	one, and return "OK".
-		 */
-		if ((fr_ipaddr_cmp(&old->ipaddr, &client->ipaddr) == 0) &&
-		    (old->ipaddr.prefix == client->ipaddr.prefix) &&
-		    namecmp(longname) && namecmp(secret) &&
-		    namecmp(shortname) && namecmp(nas_type) &&
-		    namecmp(login) && namecmp(password) && namecmp(server) &&
-#ifdef WITH_DYNAMIC_CLIENTS
-		    (old->lifetime == client->lifetime) &&
-		    namecmp(client_server) &&
-#endif
-#ifdef WITH_COA
-		    namecmp(coa_name) &&
-		    (old->coa_server == client->coa_server) &&
-		    (old->coa_pool == client->coa_pool) &&
-#endif
-		    (old->message_authenticator == client->message_authenticator)) {
-			WARN("Ignoring duplicate client %s", client->longname);
-			client_free(client);
-			return 1;
-		}
-
-		ERROR("Failed to add duplicate client %s",
-		       client->shortname);
-		return 0;
+	if (!root_clients) {
+		root_clients = clients_init(NULL);
+		if (!root_clients) return NULL;
 	}
-#undef namecmp
 
-	/*
-	 *	Other error adding client: likely is fatal.
-	 */
-	if (!rbtree_insert(clients->trees[client->ipaddr.prefix], client)) {
-		return 0;
-	}
+	return root_clients;
+}
+
+/*
+ *	Put a client into the (free) slot of its trie node.
+ */
+static void client_insert(RADCLIENT_LIST *clients, client_node_t *node, RADCLIENT *client)
+{
+	node->client[client_proto(client->proto)] = client;
 
 #ifdef WITH_STATS
 	if (!tree_num) {
@@ -349,15 +517,274 @@ int client_add(RADCLIENT_LIST *clients, RADCLIENT *client)
 	if (tree_num) rbtree_insert(tree_num, client);
 #endif
 
-	if (client->ipaddr.prefix < clients->min_prefix) {
-		clients->min_prefix = client->ipaddr.prefix;
+	(void) talloc_steal(clients, client); /* reparent it */
+}
+
+/*
+ *	Whether a new client is a complete duplicate of an old one.
+ */
+static bool client_same(RADCLIENT const *old, RADCLIENT const *client)
+{
+#define namecmp(a) ((!old->a && !client->a) || (old->a && client->a && (strcmp(old->a, client->a) == 0)))
+
+	return ((fr_ipaddr_cmp(&old->ipaddr, &client->ipaddr) == 0) &&
+		(old->ipaddr.prefix == client->ipaddr.prefix) &&
+		namecmp(longname) && namecmp(secret) &&
+		namecmp(shortname) && namecmp(nas_type) &&
+		namecmp(login) && namecmp(password) && namecmp(server) &&
+#ifdef WITH_DYNAMIC_CLIENTS
+		(old->lifetime == client->lifetime) &&
+		namecmp(client_server) &&
+#endif
+#ifdef WITH_COA
+		namecmp(coa_name) &&
+		(old->coa_server == client->coa_server) &&
+		(old->coa_pool == client->coa_pool) &&
+#endif
+		(old->message_authenticator == client->message_authenticator));
+#undef namecmp
+}
+
+/*
+ *	Add a client to the tree.
+ */
+int client_add(RADCLIENT_LIST *clients, RADCLIENT *client)
+{
+	RADCLIENT *old;
+	client_node_t *node;
+	char buffer[INET6_ADDRSTRLEN + 3];
+
+	if (!client) return 0;
+
+	client_fixup_wildcard(client);
+
+	fr_ntop(buffer, sizeof(buffer), &client->ipaddr);
+	DEBUG3("Adding client %s (%s) to prefix tree %i", buffer, client->longname, client->ipaddr.prefix);
+
+	/*
+	 *	If "clients" is NULL, it means add to the global list,
+	 *	unless we're trying to add it to a virtual server...
+	 */
+	if (!clients) {
+		clients = client_list_for(client);
+		if (!clients) return 0;
 	}
 
-	(void) talloc_steal(clients, client); /* reparent it */
+	/*
+	 *	Find (or create) the trie node for it.
+	 */
+	node = client_node_find(clients, &client->ipaddr, true);
+	if (!node) {
+		ERROR("Failed adding client %s", client->shortname);
+		return 0;
+	}
+
+	/*
+	 *	Cannot insert the same client twice.
+	 */
+	old = client_node_match(node, client->proto);
+	if (old) {
+		/*
+		 *	If it's a complete duplicate, then free the new
+		 *	one, and return "OK".
+		 */
+		if (client_same(old, client)) {
+			WARN("Ignoring duplicate client %s", client->longname);
+			client_free(client);
+			return 1;
+		}
+
+		ERROR("Failed to add duplicate client %s",
+		       client->shortname);
+		return 0;
+	}
+
+	client_insert(clients, node, client);
 
 	return 1;
 }
 
+typedef struct client_bulk_t {
+	RADCLIENT_LIST	*clients;
+	RADCLIENT	*client;
+	int		index;		//!< In the caller's array, so the first duplicate wins.
+	bool		ok;
+} client_bulk_t;
+
+static int client_bulk_cmp(void const *one, void const *two)
+{
+	client_bulk_t const *a = one;
+	client_bulk_t const *b = two;
+	int rcode;
+
+	if (a->clients < b->clients) return -1;
+	if (a->clients > b->clients) return +1;
+
+	rcode = fr_ipaddr_cmp(&a->client->ipaddr, &b->client->ipaddr);
+	if (rcode != 0) return rcode;
+
+	rcode = client_proto(a->client->proto) - client_proto(b->client->proto);
+	if (rcode != 0) return rcode;
+
+	return a->index - b->index;
+}
+
+/** Add many clients at once
+ *
+ * All of the clients are checked before any of them are added.
+ * They're then sorted, which finds duplicates within the batch,
+ * and makes the trie inserts walk the same paths one after another.
+ *
+ * @param clients list to add to, or NULL to use the list each
+ *	client's virtual server selects (see client_add()).
+ * @param array of clients.  We take ownership of all of them.
+ * @param num number of clients in the array.
+ * @param strict if true, add none of the clients if any of them
+ *	is a duplicate, or can't be added.  Otherwise, those are
+ *	skipped, with a warning.  As with client_add(), a complete
+ *	duplicate of another client is ignored either way.
+ * @return the number of clients added, or -1 if strict and one
+ *	was invalid.
+ */
+int client_add_bulk(RADCLIENT_LIST *clients, RADCLIENT **array, int num, bool strict)
+{
+	int i, added = 0;
+	char const *server = NULL;
+	RADCLIENT_LIST *last = NULL;
+	client_bulk_t *bulk;
+	uint32_t protos = 0;
+	bool have_last = false, failed = false;
+
+	if (num <= 0) return 0;
+
+	bulk = talloc_array(NULL, client_bulk_t, num);
+	if (!bulk) {
+		ERROR("Out of memory");
+		for (i = 0; i < num; i++) client_free(array[i]);
+		return -1;
+	}
+
+	/*
+	 *	Find the list for each client.  The batch is usually
+	 *	for one virtual server, so remember the last lookup.
+	 */
+	for (i = 0; i < num; i++) {
+		RADCLIENT *c = array[i];
+
+		client_fixup_wildcard(c);
+		bulk[i].client = c;
+		bulk[i].index = i;
+		bulk[i].ok = true;
+
+		if (clients) {
+			bulk[i].clients = clients;
+			continue;
+		}
+
+		if (!have_last || (server != c->server) ||
+		    (server && c->server && (strcmp(server, c->server) != 0))) {
+			last = client_list_for(c);
+			server = c->server;
+			have_last = true;
+		}
+		bulk[i].clients = last;
+		if (!last) bulk[i].ok = false;
+	}
+
+	qsort(bulk, num, sizeof(*bulk), client_bulk_cmp);
+
+	/*
+	 *	Check for duplicates within the batch, and against
+	 *	the clients we already have.  Entries with the same
+	 *	address are now adjacent, so track which protocols
+	 *	we've seen for the current address.
+	 */
+	for (i = 0; i < num; i++) {
+		int proto;
+		client_node_t *node;
+		RADCLIENT *c = bulk[i].client;
+
+		if (!bulk[i].clients) {
+			failed = true;
+			continue;
+		}
+
+		if ((i == 0) || (bulk[i - 1].clients != bulk[i].clients) ||
+		    (fr_ipaddr_cmp(&bulk[i - 1].client->ipaddr, &c->ipaddr) != 0)) protos = 0;
+
+		/*
+		 *	A complete duplicate of the previous entry is
+		 *	ignored.
+		 */
+		if ((i > 0) && (bulk[i - 1].clients == bulk[i].clients) &&
+		    client_same(bulk[i - 1].client, c)) {
+			WARN("Ignoring duplicate client %s", c->longname);
+			bulk[i].ok = false;
+			continue;
+		}
+
+		proto = client_proto(c->proto);
+		if ((protos & (1 << proto)) || (protos & 0x01) || (protos && (proto == 0))) {
+			WARN("Duplicate client %s (%s)", c->longname, c->shortname);
+			goto bad;
+		}
+		protos |= (1 << proto);
+
+		node = client_node_find(bulk[i].clients, &c->ipaddr, false);
+		if (node) {
+			RADCLIENT *old;
+
+			old = client_node_match(node, c->proto);
+			if (old && client_same(old, c)) {
+				WARN("Ignoring duplicate client %s", c->longname);
+				bulk[i].ok = false;
+				continue;
+			}
+
+			if (old) {
+				WARN("Client %s (%s) already exists", c->longname, c->shortname);
+				goto bad;
+			}
+		}
+		continue;
+
+	bad:
+		bulk[i].ok = false;
+		failed = true;
+	}
+
+	if (failed && strict) {
+		ERROR("Not adding any of the %d clients", num);
+		for (i = 0; i < num; i++) client_free(bulk[i].client);
+		talloc_free(bulk);
+		return -1;
+	}
+
+	for (i = 0; i < num; i++) {
+		client_node_t *node;
+		RADCLIENT *c = bulk[i].client;
+
+		if (!bulk[i].ok) {
+			client_free(c);
+			continue;
+		}
+
+		node = client_node_find(bulk[i].clients, &c->ipaddr, true);
+		if (!node) {
+			ERROR("Failed adding client %s", c->shortname);
+			client_free(c);
+			continue;
+		}
+
+		client_insert(bulk[i].clients, node, c);
+		added++;
+	}
+
+	talloc_free(bulk);
+
+	return added;
+}
+
 
 #ifdef WITH_DYNAMIC_CLIENTS
 void client_delete(RADCLIENT_LIST *clients, RADCLIENT *client)
@@ -375,7 +802,7 @@ void client_delete(RADCLIENT_LIST *clients, RADCLIENT *client)
 #ifdef WITH_STATS
 	rbtree_deletebydata(tree_num, client);
 #endif
-	rbtree_deletebydata(clients->trees[client->ipaddr.prefix], client);
+	client_node_delete(clients, client);
 }
 #endif
 
@@ -415,40 +842,35 @@ RADCLIENT *client_findbynumber(UNUSED const RADCLIENT_LIST *clients, UNUSED int
  */
 RADCLIENT *client_find(RADCLIENT_LIST const *clients, fr_ipaddr_t const *ipaddr, int proto)
 {
-  int32_t i, max_prefix;
-	RADCLIENT myclient;
+	int af, max_prefix;
+	uint8_t const *key;
+	client_trie_t const *trie;
+	client_node_t const *node;
+	RADCLIENT *client, *found = NULL;
 
 	if (!clients) clients = root_clients;
 
 	if (!clients || !ipaddr) return NULL;
 
-	switch (ipaddr->af) {
-	case AF_INET:
-		max_prefix = 32;
-		break;
+	key = client_key(ipaddr, &af, &max_prefix);
+	if (!key) return NULL;
 
-	case AF_INET6:
-		max_prefix = 128;
-		break;
+	trie = TRIE_LOAD(clients->trie);
 
-	default :
-		return NULL;
-	}
-
-	for (i = max_prefix; i >= (int32_t) clients->min_prefix; i--) {
-		void *data;
-
-		myclient.ipaddr = *ipaddr;
-		myclient.proto = proto;
-		fr_ipaddr_mask(&myclient.ipaddr, i);
+	/*
+	 *	Walk down the trie, remembering the longest prefix
+	 *	which has a client for this protocol.
+	 */
+	for (node = trie->root[af]; node != NULL; node = node->child[KEY_BIT(key, node->prefix)]) {
+		if (key_common(key, node->key, node->prefix) != node->prefix) break;
 
-		if (!clients->trees[i]) continue;
+		client = client_node_match(node, proto);
+		if (client) found = client;
 
-		data = rbtree_finddata(clients->trees[i], &myclient);
-		if (data) return data;
+		if (node->prefix >= max_prefix) break;
 	}
 
-	return NULL;
+	return found;
 }
 
 /*
@@ -496,6 +918,10 @@ static const CONF_PARSER client_config[] = {
 	{ "password", FR_CONF_OFFSET(PW_TYPE_STRING, RADCLIENT, password), NULL },
 	{ "virtual_server", FR_CONF_OFFSET(PW_TYPE_STRING, RADCLIENT, server), NULL },
 	{ "response_window", FR_CONF_OFFSET(PW_TYPE_TIMEVAL, RADCLIENT, response_window), NULL },
+	{ "deadline", FR_CONF_OFFSET(PW_TYPE_TIMEVAL, RADCLIENT, deadline), NULL },
+
+	{ "max_pps", FR_CONF_OFFSET(PW_TYPE_INTEGER, RADCLIENT, max_pps), NULL },
+	{ "max_burst", FR_CONF_OFFSET(PW_TYPE_INTEGER, RADCLIENT, max_burst), NULL },
 
 #ifdef WITH_TCP
 	{ "proto", FR_CONF_POINTER(PW_TYPE_STRING, &hs_proto), NULL },
@@ -505,6 +931,7 @@ static const CONF_PARSER client_config[] = {
 #ifdef WITH_DYNAMIC_CLIENTS
 	{ "dynamic_clients", FR_CONF_OFFSET(PW_TYPE_STRING, RADCLIENT, client_server), NULL },
 	{ "lifetime", FR_CONF_OFFSET(PW_TYPE_INTEGER, RADCLIENT, lifetime), NULL },
+	{ "negative_lifetime", FR_CONF_OFFSET(PW_TYPE_INTEGER, RADCLIENT, negative_lifetime), NULL },
 	{ "rate_limit", FR_CONF_OFFSET(PW_TYPE_BOOLEAN, RADCLIENT, rate_limit), NULL },
 #endif
 
@@ -515,6 +942,129 @@ static const CONF_PARSER client_config[] = {
 	{ NULL, -1, 0, NULL, NULL }
 };
 
+/** Add the clients which use a client_profile
+ *
+ * The profile section is parsed once, as a client without an
+ * address.  Each line of its "clients" file is
+ * "<ipaddr>[/<prefix>] [<shortname>]", and makes a client which
+ * points to the profile's strings and section, instead of having
+ * its own copies.  Only the address and names belong to the client.
+ *
+ * @param clients list to add the clients to.
+ * @param cs the client_profile section.
+ * @param in_server Whether the clients belong to a specific virtual server.
+ * @param tls_required Whether the listener is TLS.
+ * @return 0 on success, -1 on error.
+ */
+static int client_profile_parse(RADCLIENT_LIST *clients, CONF_SECTION *cs, bool in_server, bool tls_required)
+{
+	RADCLIENT	*profile, **array = NULL;
+	CONF_PAIR	*cp;
+	char const	*filename;
+	FILE		*fp;
+	int		num = 0, size = 0, lineno = 0;
+	char		buffer[1024];
+
+	profile = client_afrom_cs(cs, cs, in_server);
+	if (!profile) return -1;
+
+#ifdef WITH_TLS
+	if (tls_required != profile->tls_required) {
+		cf_log_err_cs(cs, "Client profile does not have the same TLS configuration as the listener");
+		return -1;
+	}
+#else
+	(void) tls_required;	/* -Wunused */
+#endif
+
+	cp = cf_pair_find(cs, "clients");
+	if (!cp || !(filename = cf_pair_value(cp))) {
+		cf_log_err_cs(cs, "A client_profile must have a \"clients\" file");
+		return -1;
+	}
+
+	fp = fopen(filename, "r");
+	if (!fp) {
+		cf_log_err_cp(cp, "Failed opening %s: %s", filename, fr_syserror(errno));
+		return -1;
+	}
+
+	while (fgets(buffer, sizeof(buffer), fp) != NULL) {
+		char		*p, *addr, *name;
+		RADCLIENT	*c;
+		char		ipbuf[128];
+
+		lineno++;
+
+		for (p = buffer; isspace((int) *p); p++) {
+			/* nothing */
+		}
+		if (!*p || (*p == '#')) continue;
+
+		addr = p;
+		while (*p && !isspace((int) *p)) p++;
+		if (*p) *(p++) = '\0';
+
+		while (isspace((int) *p)) p++;
+		name = p;
+		while (*p && !isspace((int) *p)) p++;
+		*p = '\0';
+
+		c = talloc(NULL, RADCLIENT);
+		if (!c) {
+			ERROR("Out of memory");
+			goto error;
+		}
+		*c = *profile;
+
+		if (fr_pton(&c->ipaddr, addr, 0, false) < 0) {
+			ERROR("%s[%d]: Invalid client address \"%s\": %s", filename, lineno, addr, fr_strerror());
+			talloc_free(c);
+			goto error;
+		}
+
+		if ((c->src_ipaddr.af != AF_UNSPEC) && (c->src_ipaddr.af != c->ipaddr.af)) {
+			ERROR("%s[%d]: Client address \"%s\" and the profile's src_ipaddr are different "
+			      "address families", filename, lineno, addr);
+			talloc_free(c);
+			goto error;
+		}
+
+		ip_ntoh(&c->ipaddr, ipbuf, sizeof(ipbuf));
+		c->longname = talloc_typed_strdup(c, ipbuf);
+		c->shortname = *name ? talloc_typed_strdup(c, name) : c->longname;
+
+		if (num == size) {
+			size = size ? (size * 2) : 256;
+			array = talloc_realloc(NULL, array, RADCLIENT *, size);
+			if (!array) {
+				ERROR("Out of memory");
+				talloc_free(c);
+				goto error;
+			}
+		}
+		array[num++] = c;
+	}
+	fclose(fp);
+
+	if (client_add_bulk(clients, array, num, true) < 0) {
+		cf_log_err_cs(cs, "Failed adding clients from %s", filename);
+		talloc_free(array);
+		return -1;
+	}
+	talloc_free(array);
+
+	DEBUG("Added %d clients with profile %s", num, cf_section_name2(cs));
+
+	return 0;
+
+error:
+	fclose(fp);
+	while (num > 0) client_free(array[--num]);
+	talloc_free(array);
+	return -1;
+}
+
 /*
  *	Create the linked list of clients from the new configuration
  *	type.  This way we don't have to change too much in the other
@@ -678,18 +1228,114 @@ RADCLIENT_LIST *clients_parse_section(CONF_SECTION *section, UNUSED bool tls_req
 
 	}
 
+	for (cs = cf_subsection_find_next(section, NULL, "client_profile");
+	     cs != NULL;
+	     cs = cf_subsection_find_next(section, cs, "client_profile")) {
+		if (client_profile_parse(clients, cs, in_server, tls_required) < 0) return NULL;
+	}
+
 	/*
 	 *	Replace the global list of clients with the new one.
 	 *	The old one is still referenced from the original
 	 *	configuration, and will be freed when that is freed.
 	 */
-	if (global) {
+	if (global && !clients_reloading) {
 		root_clients = clients;
 	}
 
 	return clients;
 }
 
+#ifdef WITH_STATS
+/*
+ *	Clients which have been swapped out by a HUP no longer
+ *	show up in the statistics.
+ */
+static void client_node_unnumber(client_node_t *node)
+{
+	int i;
+
+	if (!node) return;
+
+	for (i = 0; i < CLIENT_NUM_PROTO; i++) {
+		if (node->client[i] && tree_num) rbtree_deletebydata(tree_num, node->client[i]);
+	}
+
+	client_node_unnumber(node->child[0]);
+	client_node_unnumber(node->child[1]);
+}
+#endif
+
+/** Re-read the global clients on HUP
+ *
+ * If the top-level "client" sections have changed, a new set of clients is
+ * built from them, and swapped into the global list with one pointer store.
+ * Lookups in progress see either the old clients, or the new ones.  The old clients
+ * aren't freed, as requests may still point to them.  They're freed along with
+ * the old configuration.
+ *
+ * Clients defined in "clients" sections, and in virtual servers, aren't
+ * reloaded.
+ *
+ * @param config the new configuration.
+ * @return 0 if the clients are unchanged, or were swapped, -1 on error (the
+ *	old clients are kept).
+ */
+int clients_hup(CONF_SECTION *config)
+{
+	RADCLIENT_LIST *live, *clients;
+	client_trie_t *trie;
+	CONF_SECTION *a, *b;
+
+	live = root_clients;
+	if (!live || !live->cs) return 0;
+
+	a = cf_subsection_find_next(live->cs, NULL, "client");
+	b = cf_subsection_find_next(config, NULL, "client");
+	while (a && b && cf_section_equal(a, b)) {
+		a = cf_subsection_find_next(live->cs, a, "client");
+		b = cf_subsection_find_next(config, b, "client");
+	}
+
+	/*
+	 *	We don't know if the files of the client profiles have
+	 *	changed, so they're always re-read.
+	 */
+	if (!a && !b &&
+	    !cf_subsection_find_next(live->cs, NULL, "client_profile") &&
+	    !cf_subsection_find_next(config, NULL, "client_profile")) return 0;
+
+	INFO("HUP - Reloading clients");
+
+	/*
+	 *	The listeners still point to the live list, so that
+	 *	stays the global one.
+	 */
+	clients_reloading = true;
+	clients = clients_parse_section(config, false);
+	clients_reloading = false;
+	if (!clients) {
+		ERROR("HUP - Failed reading clients.  Using old clients");
+		return -1;
+	}
+
+	/*
+	 *	Swap the tries.  The new list object keeps the old
+	 *	clients.
+	 */
+	trie = live->trie;
+	TRIE_STORE(live->trie, clients->trie);
+	clients->trie = trie;
+
+#ifdef WITH_STATS
+	client_node_unnumber(trie->root[0]);
+	client_node_unnumber(trie->root[1]);
+#endif
+	live->cs = config;
+
+	return 0;
+}
+
 #ifdef WITH_DYNAMIC_CLIENTS
 /*
  *	We overload this structure a lot.
@@ -776,6 +1422,7 @@ RADCLIENT *client_afrom_cs(TALLOC_CTX *ctx, CONF_SECTION *cs, bool in_server)
 {
 	RADCLIENT	*c;
 	char const	*name2;
+	bool		profile;
 
 	name2 = cf_section_name2(cs);
 	if (!name2) {
@@ -789,6 +1436,11 @@ RADCLIENT *client_afrom_cs(TALLOC_CTX *ctx, CONF_SECTION *cs, bool in_server)
 	c = talloc_zero(ctx, RADCLIENT);
 	c->cs = cs;
 
+	/*
+	 *	A client_profile has everything but the address.
+	 */
+	profile = (strcmp(cf_section_name1(cs), "client_profile") == 0);
+
 	memset(&cl_ipaddr, 0, sizeof(cl_ipaddr));
 	if (cf_section_parse(cs, c, client_config) < 0) {
 		cf_log_err_cs(cs, "Error parsing client section");
@@ -817,6 +1469,11 @@ RADCLIENT *client_afrom_cs(TALLOC_CTX *ctx, CONF_SECTION *cs, bool in_server)
 	if (cf_pair_find(cs, "ipaddr") || cf_pair_find(cs, "ipv4addr") || cf_pair_find(cs, "ipv6addr")) {
 		char buffer[128];
 
+		if (profile) {
+			cf_log_err_cs(cs, "A client_profile cannot have an address.  Put the addresses in its \"clients\" file");
+			goto error;
+		}
+
 		/*
 		 *	Sets ipv4/ipv6 address and prefix.
 		 */
@@ -832,6 +1489,9 @@ RADCLIENT *client_afrom_cs(TALLOC_CTX *ctx, CONF_SECTION *cs, bool in_server)
 		 *	Set the short name to the name2.
 		 */
 		if (!c->shortname) c->shortname = talloc_typed_strdup(c, name2);
+	} else if (profile) {
+		/* the addresses are in the "clients" file */
+
 	/*
 	 *	No "ipaddr" or "ipv6addr", use old-style "client <ipaddr> {" syntax.
 	 */
@@ -878,6 +1538,13 @@ RADCLIENT *client_afrom_cs(TALLOC_CTX *ctx, CONF_SECTION *cs, bool in_server)
 	if (cl_srcipaddr) {
 #ifdef WITH_UDPFROMTO
 		switch (c->ipaddr.af) {
+		case AF_UNSPEC:		/* client_profile, checked against each client's address */
+			if (fr_pton(&c->src_ipaddr, cl_srcipaddr, 0, true) < 0) {
+				cf_log_err_cs(cs, "Failed parsing src_ipaddr: %s", fr_strerror());
+				goto error;
+			}
+			break;
+
 		case AF_INET:
 			if (fr_pton4(&c->src_ipaddr, cl_srcipaddr, 0, true, false) < 0) {
 				cf_log_err_cs(cs, "Failed parsing src_ipaddr: %s", fr_strerror());
@@ -910,8 +1577,36 @@ RADCLIENT *client_afrom_cs(TALLOC_CTX *ctx, CONF_SECTION *cs, bool in_server)
 		FR_TIMEVAL_BOUND_CHECK("response_window", &c->response_window, <=, main_config.max_request_time, 0);
 	}
 
+	/*
+	 *	Likewise for the deadline.
+	 */
+	if (timerisset(&c->deadline)) {
+		FR_TIMEVAL_BOUND_CHECK("deadline", &c->deadline, >=, 0, 100000);
+		FR_TIMEVAL_BOUND_CHECK("deadline", &c->deadline, <=, main_config.max_request_time, 0);
+	}
+
+	/*
+	 *	The bucket starts full, so that a client can send a
+	 *	burst as soon as the server starts.
+	 */
+	if (c->max_pps) {
+		FR_INTEGER_BOUND_CHECK("max_pps", c->max_pps, >=, 1);
+		FR_INTEGER_BOUND_CHECK("max_pps", c->max_pps, <=, 1000000);
+
+		if (!c->max_burst) c->max_burst = c->max_pps;
+		FR_INTEGER_BOUND_CHECK("max_burst", c->max_burst, <=, 1000000);
+
+		c->tokens = (uint64_t) c->max_burst * USEC;
+		gettimeofday(&c->tokens_time, NULL);
+	}
+
 #ifdef WITH_DYNAMIC_CLIENTS
 	if (c->client_server) {
+		if (profile) {
+			cf_log_err_cs(cs, "A client_profile cannot have dynamic clients");
+			goto error;
+		}
+
 		c->secret = talloc_typed_strdup(c, "testing123");
 
 		if (((c->ipaddr.af == AF_INET) && (c->ipaddr.prefix == 32)) ||
@@ -1266,6 +1961,52 @@ RADCLIENT *client_afrom_request(RADCLIENT_LIST *clients, REQUEST *request)
 	return c;
 }
 
+/** Check whether a client is within its "max_pps" limit
+ *
+ * Each client has a token bucket which fills at "max_pps" packets per
+ * second, and holds at most "max_burst" packets.  Each packet takes
+ * one token, and packets which arrive when the bucket is empty should
+ * be dropped.  This stops one client from filling the queue, and
+ * starving all of the other clients.
+ *
+ * With "synchronous" listeners, more than one thread may update the
+ * same client, so the limit is approximate.
+ *
+ * @param client the packet came from.
+ * @return true if the packet should be processed, false to drop it.
+ */
+bool client_rate_ok(RADCLIENT *client)
+{
+	struct timeval now, elapsed;
+	uint64_t burst;
+
+	if (!client->max_pps) return true;
+
+	gettimeofday(&now, NULL);
+
+	burst = (uint64_t) client->max_burst * USEC;
+
+	if (timercmp(&now, &client->tokens_time, >)) {
+		timersub(&now, &client->tokens_time, &elapsed);
+		client->tokens_time = now;
+
+		/*
+		 *	More than a second refills any bucket.
+		 */
+		if (elapsed.tv_sec > 0) {
+			client->tokens = burst;
+		} else {
+			client->tokens += (uint64_t) elapsed.tv_usec * client->max_pps;
+			if (client->tokens > burst) client->tokens = burst;
+		}
+	}
+
+	if (client->tokens < USEC) return false;
+
+	client->tokens -= USEC;
+	return true;
+}
+
 /*
  *	Read a client definition from the given filename.
  */
@@ -0,0 +1,476 @@
+/*
+ * cluster.c	Share home server state with the other proxies in a cluster.
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2015  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/rad_assert.h>
+#include <freeradius-devel/md5.h>
+
+#ifdef WITH_PROXY
+/*
+ *	Each packet is a header, followed by one entry per home server.
+ *
+ *	header:	magic (4) node (4) time (4) sequence (4) HMAC-MD5 (16)
+ *	entry:	state (1) type (1) name length (1) latency (4) name (...)
+ *
+ *	The HMAC is calculated over the whole packet, with the HMAC
+ *	field set to zero.  All integers are in network byte order.
+ */
+#define CLUSTER_MAGIC		"FRc2"
+#define CLUSTER_HDR_LEN		(32)
+#define CLUSTER_HMAC_OFFSET	(16)
+#define CLUSTER_ENTRY_LEN	(7)
+#define CLUSTER_MAX_PACKET	(1400)
+
+/*
+ *	Packets claiming to be older (or newer) than this are replays,
+ *	or come from a node with a broken clock.
+ */
+#define CLUSTER_MAX_SKEW	(30)
+
+/*
+ *	Each node numbers its packets, starting from 1 when it starts.
+ *	We remember the highest sequence number seen from each node,
+ *	and which of the CLUSTER_WINDOW before it have been seen, so
+ *	that a packet which is sent again within CLUSTER_MAX_SKEW is
+ *	ignored.  Packets further behind than that are ignored, too.
+ *
+ *	A node gets a new ID when it restarts, so we remember a few
+ *	IDs for each peer.  If a peer has used them all recently, we
+ *	can't tell replays apart, and ignore packets from new IDs.
+ */
+#define CLUSTER_WINDOW		(64)
+#define CLUSTER_SEEN_MAX	(4)
+
+typedef struct cluster_seen_t {
+	uint32_t	node;
+	uint32_t	seq;		//!< Highest seen.
+	uint64_t	window;		//!< Bit N is set if seq - N has been seen.
+	time_t		when;		//!< Last packet, or 0 if unused.
+} cluster_seen_t;
+
+typedef struct cluster_t {
+	fr_ipaddr_t	ipaddr;		//!< To listen on.
+	uint16_t	port;		//!< To listen on, and to send to.
+	char const	*secret;	//!< Shared by all nodes.
+	uint32_t	interval;	//!< How often to send the latency of all home servers.
+
+	int		num_peers;
+	fr_ipaddr_t	*peers;		//!< The other nodes in the cluster.
+
+	cluster_seen_t	*seen;		//!< CLUSTER_SEEN_MAX for each peer.
+
+	int		fd;
+	uint32_t	node;		//!< Random ID, so we can ignore our own packets.
+	uint32_t	seq;		//!< Of the last packet we sent.
+	bool		receiving;	//!< Don't pass on changes caused by other nodes.
+} cluster_t;
+
+static cluster_t *cluster = NULL;
+
+static CONF_PARSER cluster_config[] = {
+	{ "ipaddr", FR_CONF_OFFSET(PW_TYPE_IP_ADDR, cluster_t, ipaddr), "*" },
+	{ "port", FR_CONF_OFFSET(PW_TYPE_SHORT, cluster_t, port), "1816" },
+	{ "secret", FR_CONF_OFFSET(PW_TYPE_STRING | PW_TYPE_SECRET | PW_TYPE_REQUIRED, cluster_t, secret), NULL },
+	{ "interval", FR_CONF_OFFSET(PW_TYPE_INTEGER, cluster_t, interval), "5" },
+
+	{ NULL, -1, 0, NULL, NULL }		/* end the list */
+};
+
+/** Parse the "cluster" subsection of the "proxy" section
+ *
+ * @param cs the "proxy" section.
+ * @return 0 on success (including when there is no cluster), -1 on error.
+ */
+int cluster_init(CONF_SECTION *cs)
+{
+	CONF_SECTION *subcs;
+	CONF_PAIR *cp;
+	int i;
+
+	if (!cs) return 0;
+
+	subcs = cf_section_sub_find(cs, "cluster");
+	if (!subcs) return 0;
+
+	cluster = talloc_zero(NULL, cluster_t);
+	cluster->fd = -1;
+
+	if (cf_section_parse(subcs, cluster, cluster_config) < 0) goto error;
+
+	FR_INTEGER_BOUND_CHECK("interval", cluster->interval, >=, 1);
+	FR_INTEGER_BOUND_CHECK("interval", cluster->interval, <=, 3600);
+
+	for (cp = cf_pair_find(subcs, "peer"); cp; cp = cf_pair_find_next(subcs, cp, "peer")) {
+		cluster->num_peers++;
+	}
+
+	if (!cluster->num_peers) {
+		cf_log_err_cs(subcs, "No \"peer\" entries found");
+		goto error;
+	}
+
+	cluster->peers = talloc_array(cluster, fr_ipaddr_t, cluster->num_peers);
+	cluster->seen = talloc_zero_array(cluster, cluster_seen_t, cluster->num_peers * CLUSTER_SEEN_MAX);
+
+	for (cp = cf_pair_find(subcs, "peer"), i = 0; cp; cp = cf_pair_find_next(subcs, cp, "peer"), i++) {
+		char const *value = cf_pair_value(cp);
+
+		if (!value || (fr_pton(&cluster->peers[i], value, 0, true) < 0)) {
+			cf_log_err_cp(cp, "Invalid peer address: %s", fr_strerror());
+			goto error;
+		}
+
+		if (cluster->peers[i].af != cluster->ipaddr.af) {
+			cf_log_err_cp(cp, "Peer address must be of the same address family as \"ipaddr\"");
+			goto error;
+		}
+	}
+
+	cluster->node = fr_rand();
+
+	return 0;
+
+error:
+	TALLOC_FREE(cluster);
+	return -1;
+}
+
+/** Open the cluster socket
+ *
+ * @return the socket, or -1 if there isn't a cluster, or the socket couldn't be opened.
+ */
+int cluster_start(void)
+{
+	char buffer[128];
+
+	if (!cluster) return -1;
+	if (cluster->fd >= 0) return cluster->fd;
+
+	cluster->fd = fr_socket(&cluster->ipaddr, cluster->port);
+	if (cluster->fd < 0) {
+		ERROR("Failed opening cluster socket %s port %u: %s",
+		      ip_ntoh(&cluster->ipaddr, buffer, sizeof(buffer)), cluster->port, fr_strerror());
+		return -1;
+	}
+
+	fr_nonblock(cluster->fd);
+
+	DEBUG("Sharing home server state with %d peer(s) via %s port %u",
+	      cluster->num_peers, ip_ntoh(&cluster->ipaddr, buffer, sizeof(buffer)), cluster->port);
+
+	return cluster->fd;
+}
+
+void cluster_free(void)
+{
+	if (!cluster) return;
+
+	if (cluster->fd >= 0) close(cluster->fd);
+	TALLOC_FREE(cluster);
+}
+
+/** How often to call cluster_send_all()
+ *
+ */
+uint32_t cluster_interval(void)
+{
+	if (!cluster) return 0;
+
+	return cluster->interval;
+}
+
+static size_t cluster_header(uint8_t *packet)
+{
+	uint32_t now, seq;
+
+	memcpy(packet, CLUSTER_MAGIC, 4);
+	memcpy(packet + 4, &cluster->node, 4);
+	now = htonl((uint32_t) time(NULL));
+	memcpy(packet + 8, &now, 4);
+	seq = htonl(++cluster->seq);
+	memcpy(packet + 12, &seq, 4);
+	memset(packet + CLUSTER_HMAC_OFFSET, 0, MD5_DIGEST_LENGTH);
+
+	return CLUSTER_HDR_LEN;
+}
+
+static size_t cluster_entry(uint8_t *p, size_t room, home_server_t const *home, uint8_t state)
+{
+	size_t len = strlen(home->name);
+	uint32_t latency;
+
+	if ((len > 255) || (room < (CLUSTER_ENTRY_LEN + len))) return 0;
+
+	p[0] = state;
+	p[1] = home->type;
+	p[2] = len;
+	latency = htonl(home->latency);
+	memcpy(p + 3, &latency, 4);
+	memcpy(p + CLUSTER_ENTRY_LEN, home->name, len);
+
+	return CLUSTER_ENTRY_LEN + len;
+}
+
+static void cluster_write(uint8_t *packet, size_t len)
+{
+	int i;
+	uint8_t digest[MD5_DIGEST_LENGTH];
+
+	fr_hmac_md5(digest, packet, len, (uint8_t const *) cluster->secret, strlen(cluster->secret));
+	memcpy(packet + CLUSTER_HMAC_OFFSET, digest, sizeof(digest));
+
+	for (i = 0; i < cluster->num_peers; i++) {
+		struct sockaddr_storage dst;
+		socklen_t sizeof_dst;
+
+		if (!fr_ipaddr2sockaddr(&cluster->peers[i], cluster->port, &dst, &sizeof_dst)) continue;
+
+		if (sendto(cluster->fd, packet, len, 0, (struct sockaddr *) &dst, sizeof_dst) < 0) {
+			char buffer[128];
+
+			DEBUG("Failed sending to cluster peer %s: %s",
+			      ip_ntoh(&cluster->peers[i], buffer, sizeof(buffer)), fr_syserror(errno));
+		}
+	}
+}
+
+/** Tell the other nodes that a home server has changed state
+ *
+ * Changes which were caused by another node aren't passed on.
+ */
+void cluster_send(home_server_t const *home)
+{
+	uint8_t packet[CLUSTER_MAX_PACKET];
+	uint8_t state;
+	size_t len, entry;
+
+	if (!cluster || (cluster->fd < 0) || cluster->receiving) return;
+
+	switch (home->state) {
+	case HOME_STATE_ALIVE:
+		state = CLUSTER_STATE_ALIVE;
+		break;
+
+	case HOME_STATE_ZOMBIE:
+		state = CLUSTER_STATE_ZOMBIE;
+		break;
+
+	case HOME_STATE_IS_DEAD:
+		state = CLUSTER_STATE_DEAD;
+		break;
+
+	default:
+		return;
+	}
+
+	len = cluster_header(packet);
+	entry = cluster_entry(packet + len, sizeof(packet) - len, home, state);
+	if (!entry) return;
+
+	cluster_write(packet, len + entry);
+}
+
+typedef struct cluster_walk_t {
+	uint8_t		packet[CLUSTER_MAX_PACKET];
+	size_t		len;
+} cluster_walk_t;
+
+static int cluster_send_latency(void *ctx, void *data)
+{
+	cluster_walk_t *walk = ctx;
+	home_server_t *home = data;
+	size_t entry;
+
+	if (!home->latency || home->server) return 0;
+
+	entry = cluster_entry(walk->packet + walk->len, sizeof(walk->packet) - walk->len, home, CLUSTER_STATE_NONE);
+	if (!entry) {
+		if (walk->len == CLUSTER_HDR_LEN) return 0;	/* name is too long */
+
+		cluster_write(walk->packet, walk->len);
+		walk->len = cluster_header(walk->packet);
+
+		entry = cluster_entry(walk->packet + walk->len, sizeof(walk->packet) - walk->len,
+				      home, CLUSTER_STATE_NONE);
+		if (!entry) return 0;
+	}
+	walk->len += entry;
+
+	return 0;
+}
+
+/** Send the latency of every home server to the other nodes
+ *
+ * Only the latency is sent.  Periodically sending the state would let
+ * a node which hasn't noticed a failure yet revive the home server
+ * everywhere else.
+ */
+void cluster_send_all(void)
+{
+	cluster_walk_t walk;
+
+	if (!cluster || (cluster->fd < 0)) return;
+
+	walk.len = cluster_header(walk.packet);
+	home_server_walk(cluster_send_latency, &walk);
+
+	if (walk.len > CLUSTER_HDR_LEN) cluster_write(walk.packet, walk.len);
+}
+
+/** Check a packet's sequence number, and remember it
+ *
+ * @param seen the entries for the peer which sent the packet.
+ * @param node which sent the packet.
+ * @param seq of the packet.
+ * @param now the current time.
+ * @return true if the packet has been seen before, or may have been.
+ */
+static bool cluster_replayed(cluster_seen_t *seen, uint32_t node, uint32_t seq, time_t now)
+{
+	int i;
+	uint32_t diff;
+	cluster_seen_t *entry = NULL, *oldest = &seen[0];
+
+	for (i = 0; i < CLUSTER_SEEN_MAX; i++) {
+		if (seen[i].when && (seen[i].node == node)) {
+			entry = &seen[i];
+			break;
+		}
+
+		if (seen[i].when < oldest->when) oldest = &seen[i];
+	}
+
+	if (!entry) {
+		/*
+		 *	Packets from the ID we'd forget could still
+		 *	be replayed.
+		 */
+		if (oldest->when && ((now - oldest->when) <= (2 * CLUSTER_MAX_SKEW))) return true;
+
+		oldest->node = node;
+		oldest->seq = seq;
+		oldest->window = 1;
+		oldest->when = now;
+		return false;
+	}
+
+	if (seq > entry->seq) {
+		diff = seq - entry->seq;
+		entry->window = (diff < CLUSTER_WINDOW) ? ((entry->window << diff) | 1) : 1;
+		entry->seq = seq;
+	} else {
+		diff = entry->seq - seq;
+		if (diff >= CLUSTER_WINDOW) return true;
+		if (entry->window & ((uint64_t) 1 << diff)) return true;
+
+		entry->window |= ((uint64_t) 1 << diff);
+	}
+
+	entry->when = now;
+	return false;
+}
+
+/** Read a packet from another node, and pass the changes it contains to "update"
+ *
+ */
+void cluster_recv(cluster_update_t update)
+{
+	uint8_t packet[CLUSTER_MAX_PACKET];
+	uint8_t digest[MD5_DIGEST_LENGTH];
+	uint8_t *p, *end;
+	ssize_t len;
+	struct sockaddr_storage src;
+	socklen_t sizeof_src = sizeof(src);
+	fr_ipaddr_t ipaddr;
+	uint16_t port;
+	uint32_t when, node, seq;
+	time_t now;
+	int i;
+	char buffer[128];
+
+	if (!cluster || (cluster->fd < 0)) return;
+
+	len = recvfrom(cluster->fd, packet, sizeof(packet), 0, (struct sockaddr *) &src, &sizeof_src);
+	if (len < CLUSTER_HDR_LEN) return;
+
+	if (!fr_sockaddr2ipaddr(&src, sizeof_src, &ipaddr, &port)) return;
+
+	for (i = 0; i < cluster->num_peers; i++) {
+		if (fr_ipaddr_cmp(&ipaddr, &cluster->peers[i]) == 0) break;
+	}
+	if (i == cluster->num_peers) {
+		DEBUG("Ignoring cluster packet from unknown peer %s", ip_ntoh(&ipaddr, buffer, sizeof(buffer)));
+		return;
+	}
+
+	if (memcmp(packet, CLUSTER_MAGIC, 4) != 0) return;
+	if (memcmp(packet + 4, &cluster->node, 4) == 0) return;
+
+	memcpy(digest, packet + CLUSTER_HMAC_OFFSET, sizeof(digest));
+	memset(packet + CLUSTER_HMAC_OFFSET, 0, sizeof(digest));
+	fr_hmac_md5(packet + CLUSTER_HMAC_OFFSET, packet, len, (uint8_t const *) cluster->secret, strlen(cluster->secret));
+	if (rad_digest_cmp(digest, packet + CLUSTER_HMAC_OFFSET, sizeof(digest)) != 0) {
+		DEBUG("Ignoring cluster packet from %s: Invalid signature", ip_ntoh(&ipaddr, buffer, sizeof(buffer)));
+		return;
+	}
+
+	now = time(NULL);
+	memcpy(&when, packet + 8, 4);
+	when = ntohl(when);
+	if ((when + CLUSTER_MAX_SKEW < (uint32_t) now) || (when > (uint32_t) now + CLUSTER_MAX_SKEW)) {
+		DEBUG("Ignoring cluster packet from %s: Too old, or the clocks differ",
+		      ip_ntoh(&ipaddr, buffer, sizeof(buffer)));
+		return;
+	}
+
+	memcpy(&node, packet + 4, 4);
+	memcpy(&seq, packet + 12, 4);
+	if (cluster_replayed(&cluster->seen[i * CLUSTER_SEEN_MAX], node, ntohl(seq), now)) {
+		DEBUG("Ignoring cluster packet from %s: Replayed", ip_ntoh(&ipaddr, buffer, sizeof(buffer)));
+		return;
+	}
+
+	cluster->receiving = true;
+
+	end = packet + len;
+	for (p = packet + CLUSTER_HDR_LEN; (p + CLUSTER_ENTRY_LEN) <= end; p += CLUSTER_ENTRY_LEN + p[2]) {
+		home_server_t *home;
+		uint32_t latency;
+		char name[256];
+
+		if ((p + CLUSTER_ENTRY_LEN + p[2]) > end) break;
+
+		memcpy(name, p + CLUSTER_ENTRY_LEN, p[2]);
+		name[p[2]] = '\0';
+
+		home = home_server_byname(name, p[1]);
+		if (!home || home->server) continue;
+
+		memcpy(&latency, p + 3, 4);
+		update(home, p[0], ntohl(latency));
+	}
+
+	cluster->receiving = false;
+}
+#endif
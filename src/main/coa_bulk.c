@@ -0,0 +1,608 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License, version 2 if the
+ *   License as published by the Free Software Foundation.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @file coa_bulk.c
+ * @brief Send large numbers of CoA and Disconnect packets.
+ *
+ * @copyright 2015 The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/rad_assert.h>
+
+#if defined(WITH_COA) && defined(HAVE_PTHREAD_H)
+
+/*
+ *	Bulk CoA.
+ *
+ *	Originating a CoA packet from a request ties up the request,
+ *	and a proxy ID, until the NAS answers.  That's fine for a few
+ *	packets, but not for pushing tens of thousands of them out at
+ *	once.  Instead, "coa bulk <file>" reads a file of packets, and
+ *	sends them from a thread of its own.
+ *
+ *	The file has the same format as radclient input: one packet per
+ *	block of "Attribute = value" lines, with blank lines between the
+ *	blocks.  Packet-Type sets the code (Disconnect-Request if it's
+ *	missing).  Packet-Dst-IP-Address (or Packet-Dst-IPv6-Address)
+ *	and Packet-Dst-Port select the home server of type "coa" which
+ *	it's sent to, and whose secret and coa { irt, mrt, mrc, mrd }
+ *	retransmission settings are used.
+ *
+ *	Each NAS gets its own ID space and a window of outstanding
+ *	packets, so a slow NAS doesn't hold up the others, and no NAS is
+ *	sent more than "window" packets at once.  Only the totals of
+ *	ACKs, NAKs and timeouts are kept.
+ */
+#define COA_BULK_MAX_JOBS	(16)
+
+typedef struct coa_bulk_packet {
+	RADIUS_PACKET		*packet;
+	struct timeval		first;		//!< When the packet was first sent.
+	struct timeval		next;		//!< When it's due to be retransmitted.
+	uint32_t		rt;		//!< Current retransmission timeout, in usec.
+	uint32_t		tries;		//!< Number of times it's been sent.
+	struct coa_bulk_packet	*queue;		//!< Next packet waiting for the same NAS.
+} coa_bulk_packet_t;
+
+typedef struct coa_bulk_nas {
+	home_server_t		*home;
+	int			sockfd;		//!< Socket for the address family of the NAS.
+	coa_bulk_packet_t	*head;		//!< Packets waiting to be sent.
+	coa_bulk_packet_t	*tail;
+	coa_bulk_packet_t	*outstanding[256];	//!< Packets sent, by ID.
+	uint32_t		num_outstanding;
+	uint8_t			next_id;
+} coa_bulk_nas_t;
+
+typedef struct coa_bulk {
+	char const		*filename;
+	FILE			*fp;
+	uint32_t		window;		//!< Most packets outstanding to one NAS.
+
+	int			sockfd4;	//!< Socket used for IPv4 NASes.
+	int			sockfd6;	//!< Socket used for IPv6 NASes.
+	fr_hash_table_t		*nas;		//!< NASes, by home server.
+	uint32_t		active;		//!< NASes with packets queued or outstanding.
+
+	time_t			started;
+	time_t			finished;	//!< 0 while the job is running.
+
+	uint32_t		total;		//!< Packets read from the file.
+	uint32_t		sent;
+	uint32_t		acks;
+	uint32_t		naks;
+	uint32_t		timeouts;
+	uint32_t		errors;		//!< Packets which couldn't be sent at all.
+} coa_bulk_t;
+
+static pthread_mutex_t	coa_bulk_mutex = PTHREAD_MUTEX_INITIALIZER;
+static coa_bulk_t	*coa_bulk_jobs[COA_BULK_MAX_JOBS];
+static int		coa_bulk_num_jobs = 0;
+
+#define COA_BULK_INC(_x) __atomic_fetch_add(&(_x), 1, __ATOMIC_RELAXED)
+
+#undef USEC
+#define USEC (1000000)
+
+static void tv_add(struct timeval *tv, int usec_delay)
+{
+	if (usec_delay >= USEC) {
+		tv->tv_sec += usec_delay / USEC;
+		usec_delay %= USEC;
+	}
+	tv->tv_usec += usec_delay;
+
+	if (tv->tv_usec >= USEC) {
+		tv->tv_sec += tv->tv_usec / USEC;
+		tv->tv_usec %= USEC;
+	}
+}
+
+static uint32_t coa_bulk_nas_hash(void const *data)
+{
+	coa_bulk_nas_t const *nas = data;
+
+	return fr_hash(&nas->home, sizeof(nas->home));
+}
+
+static int coa_bulk_nas_cmp(void const *one, void const *two)
+{
+	coa_bulk_nas_t const *a = one;
+	coa_bulk_nas_t const *b = two;
+
+	if (a->home < b->home) return -1;
+	if (a->home > b->home) return +1;
+	return 0;
+}
+
+/** Find the socket to send to a NAS from, opening it if necessary
+ *
+ */
+static int coa_bulk_socket(coa_bulk_t *job, int af)
+{
+	int		*sockfd;
+	fr_ipaddr_t	ipaddr;
+
+	sockfd = (af == AF_INET6) ? &job->sockfd6 : &job->sockfd4;
+	if (*sockfd >= 0) return *sockfd;
+
+	memset(&ipaddr, 0, sizeof(ipaddr));
+	ipaddr.af = af;
+	ipaddr.prefix = (af == AF_INET6) ? 128 : 32;
+
+	*sockfd = fr_socket(&ipaddr, 0);
+	if (*sockfd < 0) ERROR("coa bulk %s: Failed opening socket: %s", job->filename, fr_strerror());
+
+	return *sockfd;
+}
+
+/** Turn one block of the file into a packet, and queue it for its NAS
+ *
+ */
+static void coa_bulk_queue(coa_bulk_t *job, VALUE_PAIR *vps)
+{
+	VALUE_PAIR		*vp;
+	fr_ipaddr_t		ipaddr;
+	uint16_t		port = PW_COA_UDP_PORT;
+	home_server_t		*home;
+	coa_bulk_nas_t		my_nas, *nas;
+	coa_bulk_packet_t	*entry;
+	int			code = PW_CODE_DISCONNECT_REQUEST;
+	char			buffer[INET6_ADDRSTRLEN];
+
+	COA_BULK_INC(job->total);
+
+	memset(&ipaddr, 0, sizeof(ipaddr));
+	if ((vp = pairfind(vps, PW_PACKET_DST_IP_ADDRESS, 0, TAG_ANY)) != NULL) {
+		ipaddr.af = AF_INET;
+		ipaddr.ipaddr.ip4addr.s_addr = vp->vp_ipaddr;
+		ipaddr.prefix = 32;
+	} else if ((vp = pairfind(vps, PW_PACKET_DST_IPV6_ADDRESS, 0, TAG_ANY)) != NULL) {
+		ipaddr.af = AF_INET6;
+		ipaddr.ipaddr.ip6addr = vp->vp_ipv6addr;
+		ipaddr.prefix = 128;
+	} else {
+		ERROR("coa bulk %s: Packet %u has no Packet-Dst-IP-Address", job->filename, job->total);
+		goto error;
+	}
+
+	if ((vp = pairfind(vps, PW_PACKET_DST_PORT, 0, TAG_ANY)) != NULL) port = vp->vp_integer;
+
+	if ((vp = pairfind(vps, PW_PACKET_TYPE, 0, TAG_ANY)) != NULL) {
+		code = vp->vp_integer;
+		if ((code != PW_CODE_COA_REQUEST) && (code != PW_CODE_DISCONNECT_REQUEST)) {
+			ERROR("coa bulk %s: Packet %u has Packet-Type %d, which isn't CoA-Request or "
+			      "Disconnect-Request", job->filename, job->total, code);
+			goto error;
+		}
+	}
+
+	home = home_server_find(&ipaddr, port, IPPROTO_UDP);
+	if (!home || (home->type != HOME_TYPE_COA)) {
+		ERROR("coa bulk %s: Packet %u is for %s port %u, which isn't a home_server of type coa",
+		      job->filename, job->total, inet_ntop(ipaddr.af, &ipaddr.ipaddr, buffer, sizeof(buffer)), port);
+		goto error;
+	}
+
+	my_nas.home = home;
+	nas = fr_hash_table_finddata(job->nas, &my_nas);
+	if (!nas) {
+		nas = talloc_zero(job, coa_bulk_nas_t);
+		if (!nas) goto error;
+
+		nas->home = home;
+		nas->next_id = fr_rand() & 0xff;
+		nas->sockfd = coa_bulk_socket(job, ipaddr.af);
+		if ((nas->sockfd < 0) || !fr_hash_table_insert(job->nas, nas)) {
+			talloc_free(nas);
+			goto error;
+		}
+	}
+
+	entry = talloc_zero(nas, coa_bulk_packet_t);
+	if (!entry) goto error;
+
+	entry->packet = rad_alloc(entry, true);
+	if (!entry->packet) {
+		talloc_free(entry);
+		goto error;
+	}
+	entry->packet->code = code;
+	entry->packet->sockfd = nas->sockfd;
+	entry->packet->dst_ipaddr = ipaddr;
+	entry->packet->dst_port = port;
+	entry->packet->src_ipaddr.af = ipaddr.af;
+	entry->packet->vps = talloc_steal(entry->packet, vps);	/* Internal attributes aren't encoded */
+
+	if (!nas->head) {
+		if (nas->num_outstanding == 0) job->active++;
+		nas->head = entry;
+	} else {
+		nas->tail->queue = entry;
+	}
+	nas->tail = entry;
+
+	return;
+
+error:
+	pairfree(&vps);
+	COA_BULK_INC(job->errors);
+}
+
+/** Send, or re-send, a packet to a NAS
+ *
+ */
+static void coa_bulk_send(coa_bulk_t *job, coa_bulk_nas_t *nas, coa_bulk_packet_t *entry, struct timeval *now)
+{
+	home_server_t	*home = nas->home;
+	uint32_t	rt;
+
+	if (entry->tries == 0) {
+		entry->first = *now;
+		entry->rt = home->coa_irt * USEC;
+		COA_BULK_INC(job->sent);
+	} else {
+		/*
+		 *	RFC 5080 style back-off, without the jitter.
+		 */
+		rt = entry->rt * 2;
+		if (home->coa_mrt && (rt > (home->coa_mrt * USEC))) rt = home->coa_mrt * USEC;
+		entry->rt = rt;
+	}
+	entry->tries++;
+
+	entry->next = *now;
+	tv_add(&entry->next, entry->rt);
+
+	if (rad_send(entry->packet, NULL, home->secret) < 0) {
+		DEBUG("coa bulk %s: Failed sending packet: %s", job->filename, fr_strerror());
+	}
+}
+
+/** Send packets to a NAS until its window is full
+ *
+ */
+static void coa_bulk_fill(coa_bulk_t *job, coa_bulk_nas_t *nas, struct timeval *now)
+{
+	while (nas->head && (nas->num_outstanding < job->window) && (nas->num_outstanding < 256)) {
+		coa_bulk_packet_t *entry = nas->head;
+
+		while (nas->outstanding[nas->next_id]) nas->next_id++;
+
+		nas->head = entry->queue;
+		if (!nas->head) nas->tail = NULL;
+		entry->queue = NULL;
+
+		entry->packet->id = nas->next_id++;
+		nas->outstanding[entry->packet->id] = entry;
+		nas->num_outstanding++;
+
+		coa_bulk_send(job, nas, entry, now);
+	}
+}
+
+/** Forget about a packet which has been answered, or has timed out
+ *
+ */
+static void coa_bulk_done(coa_bulk_t *job, coa_bulk_nas_t *nas, coa_bulk_packet_t *entry, struct timeval *now)
+{
+	nas->outstanding[entry->packet->id] = NULL;
+	nas->num_outstanding--;
+	talloc_free(entry);
+
+	coa_bulk_fill(job, nas, now);
+
+	if (!nas->head && (nas->num_outstanding == 0)) job->active--;
+}
+
+typedef struct coa_bulk_timer_ctx {
+	coa_bulk_t	*job;
+	struct timeval	*now;
+	struct timeval	*when;		//!< Earliest retransmission, for the select() timeout.
+} coa_bulk_timer_ctx_t;
+
+/** Retransmit, or give up on, packets to a NAS which haven't been answered
+ *
+ */
+static int coa_bulk_timers(void *ctx, void *data)
+{
+	coa_bulk_timer_ctx_t	*timer = ctx;
+	coa_bulk_nas_t		*nas = data;
+	home_server_t		*home = nas->home;
+	int			i;
+
+	for (i = 0; (i < 256) && (nas->num_outstanding > 0); i++) {
+		coa_bulk_packet_t	*entry = nas->outstanding[i];
+		struct timeval		elapsed;
+
+		if (!entry) continue;
+
+		if (timercmp(&entry->next, timer->now, >)) {
+			if (timercmp(&entry->next, timer->when, <)) *timer->when = entry->next;
+			continue;
+		}
+
+		timersub(timer->now, &entry->first, &elapsed);
+		if ((home->coa_mrc && (entry->tries >= home->coa_mrc)) ||
+		    (home->coa_mrd && (elapsed.tv_sec >= (time_t) home->coa_mrd))) {
+			COA_BULK_INC(timer->job->timeouts);
+			coa_bulk_done(timer->job, nas, entry, timer->now);
+			continue;
+		}
+
+		coa_bulk_send(timer->job, nas, entry, timer->now);
+		if (timercmp(&entry->next, timer->when, <)) *timer->when = entry->next;
+	}
+
+	return 0;
+}
+
+static int coa_bulk_start_nas(void *ctx, void *data)
+{
+	coa_bulk_timer_ctx_t *timer = ctx;
+
+	coa_bulk_fill(timer->job, data, timer->now);
+
+	return 0;
+}
+
+/** Read a reply, and match it to the packet it's for
+ *
+ */
+static void coa_bulk_recv(coa_bulk_t *job, int sockfd, struct timeval *now)
+{
+	RADIUS_PACKET		*reply;
+	home_server_t		*home;
+	coa_bulk_nas_t		my_nas, *nas;
+	coa_bulk_packet_t	*entry;
+
+	reply = rad_recv(sockfd, 0);
+	if (!reply) return;
+
+	home = home_server_find(&reply->src_ipaddr, reply->src_port, IPPROTO_UDP);
+	if (!home) goto done;
+
+	my_nas.home = home;
+	nas = fr_hash_table_finddata(job->nas, &my_nas);
+	if (!nas) goto done;
+
+	entry = nas->outstanding[reply->id];
+	if (!entry) goto done;
+
+	if (rad_verify(reply, entry->packet, home->secret) < 0) {
+		DEBUG("coa bulk %s: Ignoring invalid reply: %s", job->filename, fr_strerror());
+		goto done;
+	}
+
+	switch (reply->code) {
+	case PW_CODE_COA_ACK:
+	case PW_CODE_DISCONNECT_ACK:
+		COA_BULK_INC(job->acks);
+		break;
+
+	case PW_CODE_COA_NAK:
+	case PW_CODE_DISCONNECT_NAK:
+		COA_BULK_INC(job->naks);
+		break;
+
+	default:
+		goto done;
+	}
+
+	coa_bulk_done(job, nas, entry, now);
+
+done:
+	rad_free(&reply);
+}
+
+static void *coa_bulk_thread(void *arg)
+{
+	coa_bulk_t		*job = arg;
+	VALUE_PAIR		*vps;
+	bool			filedone = false;
+	struct timeval		now, when, wake;
+	coa_bulk_timer_ctx_t	timer;
+
+	/*
+	 *	Read and queue everything first.
+	 */
+	while (!filedone) {
+		vps = NULL;
+		if (readvp2(job, &vps, job->fp, &filedone) < 0) {
+			ERROR("coa bulk %s: Failed reading file: %s", job->filename, fr_strerror());
+			break;
+		}
+		if (!vps) continue;
+
+		coa_bulk_queue(job, vps);
+	}
+	fclose(job->fp);
+	job->fp = NULL;
+
+	INFO("coa bulk %s: Sending %u packets to %u NASes", job->filename,
+	     job->total - job->errors, fr_hash_table_num_elements(job->nas));
+
+	gettimeofday(&now, NULL);
+	timer.job = job;
+	timer.now = &now;
+	timer.when = &when;
+	fr_hash_table_walk(job->nas, coa_bulk_start_nas, &timer);
+
+	while (job->active > 0) {
+		fd_set	fds;
+		int	maxfd = -1;
+
+		FD_ZERO(&fds);
+		if (job->sockfd4 >= 0) {
+			FD_SET(job->sockfd4, &fds);
+			maxfd = job->sockfd4;
+		}
+		if (job->sockfd6 >= 0) {
+			FD_SET(job->sockfd6, &fds);
+			if (job->sockfd6 > maxfd) maxfd = job->sockfd6;
+		}
+
+		/*
+		 *	Wake up for the earliest retransmission, or at
+		 *	least once a second.
+		 */
+		gettimeofday(&now, NULL);
+		when = now;
+		when.tv_sec++;
+		fr_hash_table_walk(job->nas, coa_bulk_timers, &timer);
+		if (job->active == 0) break;
+
+		if (timercmp(&when, &now, >)) {
+			timersub(&when, &now, &wake);
+		} else {
+			timerclear(&wake);
+		}
+
+		if (select(maxfd + 1, &fds, NULL, NULL, &wake) <= 0) continue;
+
+		gettimeofday(&now, NULL);
+		if ((job->sockfd4 >= 0) && FD_ISSET(job->sockfd4, &fds)) coa_bulk_recv(job, job->sockfd4, &now);
+		if ((job->sockfd6 >= 0) && FD_ISSET(job->sockfd6, &fds)) coa_bulk_recv(job, job->sockfd6, &now);
+	}
+
+	if (job->sockfd4 >= 0) close(job->sockfd4);
+	if (job->sockfd6 >= 0) close(job->sockfd6);
+	job->sockfd4 = job->sockfd6 = -1;
+	fr_hash_table_free(job->nas);
+	job->nas = NULL;
+
+	INFO("coa bulk %s: Finished.  %u sent, %u ACK, %u NAK, %u timed out, %u not sent",
+	     job->filename, job->sent, job->acks, job->naks, job->timeouts, job->errors);
+
+	__atomic_store_n(&job->finished, time(NULL), __ATOMIC_RELEASE);
+
+	return NULL;
+}
+
+/** Start sending the packets in a file
+ *
+ * @param filename of the packets, in radclient format.
+ * @param window most packets to have outstanding to any one NAS.
+ * @return 0 on success, -1 on error.  fr_strerror() has the reason.
+ */
+int coa_bulk_start(char const *filename, uint32_t window)
+{
+	coa_bulk_t	*job;
+	pthread_t	thread;
+	pthread_attr_t	attr;
+	int		rcode;
+
+	if ((window == 0) || (window > 256)) {
+		fr_strerror_printf("Window must be between 1 and 256");
+		return -1;
+	}
+
+	pthread_mutex_lock(&coa_bulk_mutex);
+	if ((coa_bulk_num_jobs == COA_BULK_MAX_JOBS) &&
+	    (__atomic_load_n(&coa_bulk_jobs[COA_BULK_MAX_JOBS - 1]->finished, __ATOMIC_ACQUIRE) == 0)) {
+		pthread_mutex_unlock(&coa_bulk_mutex);
+		fr_strerror_printf("Too many jobs are running");
+		return -1;
+	}
+	pthread_mutex_unlock(&coa_bulk_mutex);
+
+	job = talloc_zero(NULL, coa_bulk_t);
+	if (!job) {
+		fr_strerror_printf("Out of memory");
+		return -1;
+	}
+	job->filename = talloc_strdup(job, filename);
+	job->window = window;
+	job->sockfd4 = job->sockfd6 = -1;
+	job->started = time(NULL);
+
+	job->fp = fopen(filename, "r");
+	if (!job->fp) {
+		fr_strerror_printf("Failed opening %s: %s", filename, fr_syserror(errno));
+		talloc_free(job);
+		return -1;
+	}
+
+	job->nas = fr_hash_table_create(coa_bulk_nas_hash, coa_bulk_nas_cmp, NULL);
+	if (!job->nas) {
+		fr_strerror_printf("Out of memory");
+		fclose(job->fp);
+		talloc_free(job);
+		return -1;
+	}
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	rcode = pthread_create(&thread, &attr, coa_bulk_thread, job);
+	pthread_attr_destroy(&attr);
+	if (rcode != 0) {
+		fr_strerror_printf("Failed creating thread: %s", fr_syserror(rcode));
+		fr_hash_table_free(job->nas);
+		fclose(job->fp);
+		talloc_free(job);
+		return -1;
+	}
+
+	/*
+	 *	Newest first.  The oldest job is forgotten once it's
+	 *	finished, to make room.
+	 */
+	pthread_mutex_lock(&coa_bulk_mutex);
+	if (coa_bulk_num_jobs == COA_BULK_MAX_JOBS) {
+		talloc_free(coa_bulk_jobs[COA_BULK_MAX_JOBS - 1]);
+		coa_bulk_num_jobs--;
+	}
+	memmove(&coa_bulk_jobs[1], &coa_bulk_jobs[0], coa_bulk_num_jobs * sizeof(coa_bulk_jobs[0]));
+	coa_bulk_jobs[0] = job;
+	coa_bulk_num_jobs++;
+	pthread_mutex_unlock(&coa_bulk_mutex);
+
+	return 0;
+}
+
+/** Get the progress of the most recent jobs
+ *
+ * @param[out] stats one per job, newest first.
+ * @param[in] max number of stats to fill in.
+ * @return the number of stats filled in.
+ */
+int coa_bulk_stats(coa_bulk_stats_t *stats, int max)
+{
+	int i;
+
+	pthread_mutex_lock(&coa_bulk_mutex);
+	for (i = 0; (i < coa_bulk_num_jobs) && (i < max); i++) {
+		coa_bulk_t *job = coa_bulk_jobs[i];
+
+		stats[i].filename = job->filename;
+		stats[i].started = job->started;
+		stats[i].finished = __atomic_load_n(&job->finished, __ATOMIC_ACQUIRE);
+		stats[i].total = __atomic_load_n(&job->total, __ATOMIC_RELAXED);
+		stats[i].sent = __atomic_load_n(&job->sent, __ATOMIC_RELAXED);
+		stats[i].acks = __atomic_load_n(&job->acks, __ATOMIC_RELAXED);
+		stats[i].naks = __atomic_load_n(&job->naks, __ATOMIC_RELAXED);
+		stats[i].timeouts = __atomic_load_n(&job->timeouts, __ATOMIC_RELAXED);
+		stats[i].errors = __atomic_load_n(&job->errors, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&coa_bulk_mutex);
+
+	return i;
+}
+#endif
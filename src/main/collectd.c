@@ -293,6 +293,38 @@ rs_stats_tmpl_t *rs_stats_collectd_init_latency(TALLOC_CTX *ctx, rs_stats_tmpl_t
 
 	INIT_STATS("radius_rtx", rtx);
 
+	/*
+	 *	The latency histogram buckets are sent as individual
+	 *	gauges, so no custom types are needed in types.db.
+	 */
+	for (i = 0; i < RS_LATENCY_BUCKETS; i++) {
+		rs_stats_value_tmpl_t hist[2];
+		size_t len;
+
+		hist[0].src = &stats->interval.latency_hist[i];
+		hist[0].type = LCC_TYPE_GAUGE;
+		hist[0].cb = _copy_double_to_double;
+		hist[0].dst = NULL;
+		memset(&hist[1], 0, sizeof(rs_stats_value_tmpl_t));
+
+		strlcpy(buffer, fr_packet_codes[code], sizeof(buffer));
+		for (p = buffer; *p; ++p) *p = tolower(*p);
+		len = p - buffer;
+
+		if (i < (RS_LATENCY_BUCKETS - 1)) {
+			snprintf(buffer + len, sizeof(buffer) - len, "_latency_le_%ums", rs_latency_bounds[i]);
+		} else {
+			snprintf(buffer + len, sizeof(buffer) - len, "_latency_gt_%ums", rs_latency_bounds[i - 1]);
+		}
+
+		last = *tmpl = rs_stats_collectd_init(ctx, conf, type, "gauge", buffer, stats, hist);
+		if (!*tmpl) {
+			TALLOC_FREE(*out);
+			return NULL;
+		}
+		tmpl = &(*tmpl)->next;
+	}
+
 	return last;
 }
 
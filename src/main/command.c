@@ -23,8 +23,10 @@
 
 #ifdef WITH_COMMAND_SOCKET
 
+#include <freeradius-devel/modcall.h>
 #include <freeradius-devel/parser.h>
 #include <freeradius-devel/md5.h>
+#include <freeradius-devel/memstats.h>
 
 #ifdef HAVE_INTTYPES_H
 #include <inttypes.h>
@@ -275,6 +277,7 @@ static ssize_t CC_HINT(format (printf, 2, 3)) cprintf(rad_listen_t *listener, ch
 	va_start(ap, fmt);
 	len = vsnprintf(buffer, sizeof(buffer), fmt, ap);
 	va_end(ap);
+	if (len >= (ssize_t) sizeof(buffer)) len = sizeof(buffer) - 1;
 
 	if (listener->status == RAD_LISTEN_STATUS_EOL) return 0;
 
@@ -333,6 +336,42 @@ static int command_hup(rad_listen_t *listener, int argc, char *argv[])
 	return 1;		/* success */
 }
 
+static int command_flush_module(rad_listen_t *listener, int argc, char *argv[])
+{
+	int rcode;
+	CONF_SECTION *cs;
+	module_instance_t *mi;
+
+	if (argc == 0) {
+		cprintf(listener, "ERROR: Must specify <module>\n");
+		return 0;
+	}
+
+	cs = cf_section_find("modules");
+	if (!cs) return 0;
+
+	mi = find_module_instance(cs, argv[0], false);
+	if (!mi) {
+		cprintf(listener, "ERROR: No such module \"%s\"\n", argv[0]);
+		return 0;
+	}
+
+	if (!mi->entry->module->cache_flush) {
+		cprintf(listener, "ERROR: Module %s does not have a cache\n", argv[0]);
+		return 0;
+	}
+
+	rcode = mi->entry->module->cache_flush(mi->insthandle, (argc > 1) ? argv[1] : NULL);
+	if (rcode < 0) {
+		cprintf(listener, "ERROR: Failed to flush module cache\n");
+		return 0;
+	}
+
+	cprintf(listener, "Flushed %d entries\n", rcode);
+
+	return 1;		/* success */
+}
+
 static int command_terminate(UNUSED rad_listen_t *listener,
 			     UNUSED int argc, UNUSED char *argv[])
 {
@@ -610,6 +649,60 @@ static int command_show_module_status(rad_listen_t *listener, int argc, char *ar
 	return 1;		/* success */
 }
 
+#ifdef WITH_STATS
+static int command_show_module_stats(rad_listen_t *listener, int argc, char *argv[])
+{
+	int i;
+	CONF_SECTION *cs;
+	module_instance_t const *mi;
+	module_stats_t const *stats;
+
+	if (argc != 1) {
+		cprintf(listener, "ERROR: No module name was given\n");
+		return 0;
+	}
+
+	cs = cf_section_find("modules");
+	if (!cs) return 0;
+
+	mi = find_module_instance(cs, argv[0], false);
+	if (!mi) {
+		cprintf(listener, "ERROR: No such module \"%s\"\n", argv[0]);
+		return 0;
+	}
+
+	stats = mi->stats;
+	if (!stats) {
+		cprintf(listener, "ERROR: Module statistics are disabled.  Set \"profile_modules = yes\"\n");
+		return 0;
+	}
+
+	for (i = 0; i < RLM_COMPONENT_COUNT; i++) {
+		if (!stats->calls[i]) continue;
+
+		cprintf(listener, "\t%s.calls\t%" PRIu64 "\n", section_type_value[i].section, stats->calls[i]);
+		if (!stats->timed[i]) continue;
+
+		cprintf(listener, "\t%s.avg_usec\t%" PRIu64 "\n", section_type_value[i].section,
+			stats->usec[i] / stats->timed[i]);
+	}
+
+	for (i = 0; i < RLM_MODULE_NUMCODES; i++) {
+		if (!stats->rcode[i]) continue;
+
+		cprintf(listener, "\trcode.%s\t%" PRIu64 "\n",
+			fr_int2str(mod_rcode_table, i, "<invalid>"), stats->rcode[i]);
+	}
+
+	cprintf(listener, "\tlatency.p50\t%u\n", radius_stats_hist_percentile(stats->hist, 500));
+	cprintf(listener, "\tlatency.p90\t%u\n", radius_stats_hist_percentile(stats->hist, 900));
+	cprintf(listener, "\tlatency.p99\t%u\n", radius_stats_hist_percentile(stats->hist, 990));
+	cprintf(listener, "\tlatency.p99.9\t%u\n", radius_stats_hist_percentile(stats->hist, 999));
+
+	return 1;		/* success */
+}
+#endif
+
 
 /*
  *	Show all loaded modules
@@ -644,6 +737,52 @@ static int command_show_modules(rad_listen_t *listener, UNUSED int argc, UNUSED
 	return 1;		/* success */
 }
 
+static void command_print_unlang(void *ctx, int depth, char const *line)
+{
+	cprintf(ctx, "%.*s%s\n", depth, "\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t", line);
+}
+
+/*
+ *	Show the compiled version of a section of a virtual server.
+ */
+static int command_show_unlang(rad_listen_t *listener, int argc, char *argv[])
+{
+	int i;
+	modcallable *mc;
+	char const *server = NULL;
+
+	if ((argc < 1) || (argc > 2)) {
+		cprintf(listener, "ERROR: Must specify <section> [<server>]\n");
+		return 0;
+	}
+
+	for (i = 0; i < RLM_COMPONENT_COUNT; i++) {
+		if (strcmp(argv[0], section_type_value[i].section) == 0) break;
+	}
+	if (i == RLM_COMPONENT_COUNT) {
+		cprintf(listener, "ERROR: No such section \"%s\"\n", argv[0]);
+		return 0;
+	}
+
+	if (argc == 2) server = argv[1];
+
+	if (virtual_server_section(&mc, server, i) < 0) {
+		cprintf(listener, "ERROR: No such virtual server \"%s\"\n", server);
+		return 0;
+	}
+
+	if (!mc) {
+		cprintf(listener, "%s { } # empty\n", argv[0]);
+		return 1;
+	}
+
+	cprintf(listener, "%s {\n", argv[0]);
+	modcall_print(mc, 1, command_print_unlang, listener);
+	cprintf(listener, "}\n");
+
+	return 1;		/* success */
+}
+
 #ifdef WITH_PROXY
 static int command_show_home_servers(rad_listen_t *listener, UNUSED int argc, UNUSED char *argv[])
 {
@@ -758,6 +897,188 @@ static int command_show_version(rad_listen_t *listener, UNUSED int argc, UNUSED
 	return 1;
 }
 
+static int command_show_pools(rad_listen_t *listener, UNUSED int argc, UNUSED char *argv[])
+{
+	int i, num;
+	fr_connection_pool_stats_t *stats;
+
+	num = fr_connection_pool_stats_all(NULL, NULL, &stats);
+	for (i = 0; i < num; i++) {
+		cprintf(listener, "%s\n", stats[i].name ? stats[i].name : stats[i].log_prefix);
+		cprintf(listener, "\tconnections\t%u\n", stats[i].num);
+		cprintf(listener, "\tactive\t\t%u\n", stats[i].active);
+		cprintf(listener, "\tmax\t\t%u\n", stats[i].max);
+		cprintf(listener, "\twaiting\t\t%u\n", stats[i].waiting);
+		cprintf(listener, "\twaits\t\t%" PRIu64 "\n", stats[i].waits);
+		cprintf(listener, "\twait_timeouts\t%" PRIu64 "\n", stats[i].wait_timeouts);
+		cprintf(listener, "\tavg_wait_time\t%" PRIu64 "us\n",
+			stats[i].waits ? stats[i].wait_time / stats[i].waits : 0);
+		cprintf(listener, "\tmax_wait_time\t%uus\n", stats[i].max_wait_time);
+	}
+	talloc_free(stats);
+
+	return 1;
+}
+
+static int command_show_memory(rad_listen_t *listener, UNUSED int argc, UNUSED char *argv[])
+{
+	int i;
+	uint32_t num;
+	size_t size;
+	memstats_t stats;
+
+	/*
+	 *	These don't change between HUPs, so they're only
+	 *	measured when they're asked for.
+	 */
+	size = dict_memory(&num);
+	memstats_set(MEMSTATS_DICTIONARY, num, size);
+
+	if (main_config.config) {
+		memstats_set(MEMSTATS_CONFIG, talloc_total_blocks(main_config.config),
+			     talloc_total_size(main_config.config));
+	}
+
+	for (i = 0; i < MEMSTATS_NUM_TYPES; i++) {
+		memstats_get(i, &stats);
+
+		cprintf(listener, "%s\n", stats.name);
+		cprintf(listener, "\tnum\t\t%" PRIu64 "\n", stats.num);
+		cprintf(listener, "\tmax_num\t\t%" PRIu64 "\n", stats.max_num);
+		if (stats.total) cprintf(listener, "\ttotal\t\t%" PRIu64 "\n", stats.total);
+		cprintf(listener, "\tbytes\t\t%" PRIu64 "\n", stats.bytes);
+		cprintf(listener, "\tmax_bytes\t%" PRIu64 "\n", stats.max_bytes);
+		cprintf(listener, "\tavg_size\t%" PRIu64 "\n", stats.avg_size);
+	}
+
+	return 1;
+}
+
+static char const *pool_hist_names[FR_CONNECTION_POOL_HIST_BUCKETS] = {
+	"<10us", "<100us", "<1ms", "<10ms", "<100ms", "<1s", ">=1s"
+};
+
+static int command_show_pool(rad_listen_t *listener, int argc, char *argv[])
+{
+	int i;
+	fr_connection_pool_stats_t *found, stats;
+
+	if (argc != 1) {
+		cprintf(listener, "ERROR: No module name was given\n");
+		return 0;
+	}
+
+	if (fr_connection_pool_stats_all(NULL, argv[0], &found) <= 0) {
+		cprintf(listener, "ERROR: Module \"%s\" has no connection pool\n", argv[0]);
+		return 0;
+	}
+	stats = *found;
+	talloc_free(found);
+
+	cprintf(listener, "connections\t\t%u\n", stats.num);
+	cprintf(listener, "active\t\t\t%u\n", stats.active);
+	cprintf(listener, "max\t\t\t%u\n", stats.max);
+	cprintf(listener, "waiting\t\t\t%u\n", stats.waiting);
+	cprintf(listener, "waits\t\t\t%" PRIu64 "\n", stats.waits);
+	cprintf(listener, "wait_timeouts\t\t%" PRIu64 "\n", stats.wait_timeouts);
+	cprintf(listener, "spawn_failures\t\t%" PRIu64 "\n", stats.spawn_failures);
+	cprintf(listener, "reconnects\t\t%" PRIu64 "\n", stats.reconnects);
+
+	cprintf(listener, "acquire_time\n");
+	for (i = 0; i < FR_CONNECTION_POOL_HIST_BUCKETS; i++) {
+		cprintf(listener, "\t%s\t\t%" PRIu64 "\n", pool_hist_names[i], stats.wait_hist[i]);
+	}
+
+	cprintf(listener, "hold_time\n");
+	for (i = 0; i < FR_CONNECTION_POOL_HIST_BUCKETS; i++) {
+		cprintf(listener, "\t%s\t\t%" PRIu64 "\n", pool_hist_names[i], stats.hold_hist[i]);
+	}
+
+	return 1;
+}
+
+#ifdef HAVE_PTHREAD_H
+static int command_show_thread_pool(rad_listen_t *listener, UNUSED int argc, UNUSED char *argv[])
+{
+	thread_pool_stats_t stats;
+
+	if (!thread_pool_stats(&stats)) {
+		cprintf(listener, "ERROR: The server is not using a thread pool\n");
+		return 0;
+	}
+
+	cprintf(listener, "threads\t\t\t%u\n", stats.total_threads);
+	cprintf(listener, "active\t\t\t%u\n", stats.active_threads);
+	cprintf(listener, "max_servers\t\t%u\n", stats.max_threads);
+	cprintf(listener, "queued\t\t\t%u\n", stats.num_queued);
+
+	if (!stats.target_queue_time) {
+		cprintf(listener, "controller\t\tspare_servers\n");
+		return 1;
+	}
+
+	cprintf(listener, "controller\t\tqueue_time\n");
+	cprintf(listener, "target_queue_time\t%ums\n", stats.target_queue_time);
+	cprintf(listener, "queue_time\t\t%uus\n", stats.interval_queue_time);
+	cprintf(listener, "avg_queue_time\t\t%uus\n", stats.avg_queue_time);
+	cprintf(listener, "spawned\t\t\t%u\n", stats.controller_spawned);
+	cprintf(listener, "deleted\t\t\t%u\n", stats.controller_deleted);
+
+	return 1;
+}
+#endif
+
+#if defined(WITH_COA) && defined(HAVE_PTHREAD_H)
+static int command_coa_bulk(rad_listen_t *listener, int argc, char *argv[])
+{
+	uint32_t window = 32;
+
+	if (argc < 1) {
+		cprintf(listener, "ERROR: Must specify <filename>\n");
+		return 0;
+	}
+
+	if (argc > 1) {
+		char *end;
+		unsigned long num;
+
+		num = strtoul(argv[1], &end, 10);
+		if (*end || (num == 0) || (num > 256)) {
+			cprintf(listener, "ERROR: <window> must be between 1 and 256\n");
+			return 0;
+		}
+		window = num;
+	}
+
+	if (coa_bulk_start(argv[0], window) < 0) {
+		cprintf(listener, "ERROR: %s\n", fr_strerror());
+		return 0;
+	}
+
+	return 1;
+}
+
+static int command_show_coa(rad_listen_t *listener, UNUSED int argc, UNUSED char *argv[])
+{
+	coa_bulk_stats_t	stats[16];
+	int			i, num;
+	char			buffer[64];
+
+	num = coa_bulk_stats(stats, 16);
+	for (i = 0; i < num; i++) {
+		CTIME_R(&stats[i].started, buffer, sizeof(buffer));
+		buffer[strlen(buffer) - 1] = '\0';
+
+		cprintf(listener, "%s\t%s\t%s\ttotal=%u sent=%u ack=%u nak=%u timeout=%u error=%u\n",
+			stats[i].filename, buffer, stats[i].finished ? "done" : "running",
+			stats[i].total, stats[i].sent, stats[i].acks, stats[i].naks,
+			stats[i].timeouts, stats[i].errors);
+	}
+
+	return 1;
+}
+#endif
+
 static int command_debug_level(rad_listen_t *listener, int argc, char *argv[])
 {
 	int number;
@@ -896,6 +1217,30 @@ static int command_debug_condition(UNUSED rad_listen_t *listener, int argc, char
 	return 0;
 }
 
+extern size_t debug_capture_size;
+static int command_debug_capture(rad_listen_t *listener, int argc, char *argv[])
+{
+	int number;
+
+	/*
+	 *	Disable it.
+	 */
+	if (argc == 0) {
+		debug_capture_size = 0;
+		return 0;
+	}
+
+	number = atoi(argv[0]);
+	if ((number != 0) && ((number < 16) || (number > 1024))) {
+		cprintf(listener, "ERROR: <kilobytes> must be 0, or between 16 and 1024\n");
+		return -1;
+	}
+
+	debug_capture_size = ((size_t) number) * 1024;
+
+	return 0;
+}
+
 static int command_show_debug_condition(rad_listen_t *listener,
 					UNUSED int argc, UNUSED char *argv[])
 {
@@ -920,6 +1265,13 @@ static int command_show_debug_file(rad_listen_t *listener,
 }
 
 
+static int command_show_debug_capture(rad_listen_t *listener,
+				      UNUSED int argc, UNUSED char *argv[])
+{
+	cprintf(listener, "%u\n", (unsigned int) (debug_capture_size / 1024));
+	return 0;
+}
+
 static int command_show_debug_level(rad_listen_t *listener,
 					UNUSED int argc, UNUSED char *argv[])
 {
@@ -1080,6 +1432,28 @@ static int command_show_home_server_state(rad_listen_t *listener, int argc, char
 
 	return 1;
 }
+
+static int command_show_home_server_rtt(rad_listen_t *listener, int argc, char *argv[])
+{
+	home_server_t *home;
+	struct timeval const *response_window;
+
+	home = get_home_server(listener, argc, argv, NULL);
+	if (!home) {
+		return 0;
+	}
+
+	response_window = &home->response_window;
+	if (home->adaptive_response_window && timerisset(&home->rto)) response_window = &home->rto;
+
+	cprintf(listener, "srtt_usec\t%u\n", home->latency);
+	cprintf(listener, "rttvar_usec\t%u\n", home->rttvar);
+	cprintf(listener, "adaptive\t%s\n", home->adaptive_response_window ? "yes" : "no");
+	cprintf(listener, "response_window\t%d.%06d\n",
+		(int) response_window->tv_sec, (int) response_window->tv_usec);
+
+	return 1;
+}
 #endif
 
 /*
@@ -1382,6 +1756,10 @@ static fr_command_table_t command_table_debug[] = {
 	  "debug condition [condition] - Enable debugging for requests matching [condition]",
 	  command_debug_condition, NULL },
 
+	{ "capture", FR_WRITE,
+	  "debug capture [kilobytes] - Hold debugging output for requests matching the debug condition in a buffer of [kilobytes] per request, and only log it if the request is rejected, times out, or fails.  With no argument, log it immediately",
+	  command_debug_capture, NULL },
+
 	{ "level", FR_WRITE,
 	  "debug level <number> - Set debug level to <number>.  Higher is more debugging.",
 	  command_debug_level, NULL },
@@ -1398,6 +1776,10 @@ static fr_command_table_t command_table_show_debug[] = {
 	  "show debug condition - Shows current debugging condition.",
 	  command_show_debug_condition, NULL },
 
+	{ "capture", FR_READ,
+	  "show debug capture - Shows the per-request debug capture buffer size in kilobytes, or 0 if it's off.",
+	  command_show_debug_capture, NULL },
+
 	{ "level", FR_READ,
 	  "show debug level - Shows current debugging level.",
 	  command_show_debug_level, NULL },
@@ -1425,6 +1807,11 @@ static fr_command_table_t command_table_show_module[] = {
 	{ "status", FR_READ,
 	  "show module status <module> - show the module status",
 	  command_show_module_status, NULL },
+#ifdef WITH_STATS
+	{ "stats", FR_READ,
+	  "show module stats <module> - show call counts, results, and times for the module",
+	  command_show_module_stats, NULL },
+#endif
 
 	{ NULL, 0, NULL, NULL, NULL }
 };
@@ -1445,6 +1832,19 @@ static fr_command_table_t command_table_show_home[] = {
 	{ "state", FR_READ,
 	  "show home_server state <ipaddr> <port> [proto] - shows state of given home server",
 	  command_show_home_server_state, NULL },
+	{ "rtt", FR_READ,
+	  "show home_server rtt <ipaddr> <port> [proto] - shows response time estimates and response window of given home server",
+	  command_show_home_server_rtt, NULL },
+
+	{ NULL, 0, NULL, NULL, NULL }
+};
+#endif
+
+#ifdef HAVE_PTHREAD_H
+static fr_command_table_t command_table_show_thread[] = {
+	{ "pool", FR_READ,
+	  "show thread pool - shows the state of the thread pool",
+	  command_show_thread_pool, NULL },
 
 	{ NULL, 0, NULL, NULL, NULL }
 };
@@ -1455,6 +1855,11 @@ static fr_command_table_t command_table_show[] = {
 	{ "client", FR_READ,
 	  "show client <command> - do sub-command of client",
 	  NULL, command_table_show_client },
+#if defined(WITH_COA) && defined(HAVE_PTHREAD_H)
+	{ "coa", FR_READ,
+	  "show coa - shows the progress of \"coa bulk\" jobs",
+	  command_show_coa, NULL },
+#endif
 	{ "config", FR_READ,
 	  "show config <path> - shows the value of configuration option <path>",
 	  command_show_config, NULL },
@@ -1466,9 +1871,26 @@ static fr_command_table_t command_table_show[] = {
 	  "show home_server <command> - do sub-command of home_server",
 	  NULL, command_table_show_home },
 #endif
+	{ "memory", FR_READ,
+	  "show memory - shows the number of objects and bytes used by each subsystem, and their high-water marks",
+	  command_show_memory, NULL },
 	{ "module", FR_READ,
 	  "show module <command> - do sub-command of module",
 	  NULL, command_table_show_module },
+	{ "pool", FR_READ,
+	  "show pool <module> - shows the state and latency histograms of a module's connection pool",
+	  command_show_pool, NULL },
+	{ "pools", FR_READ,
+	  "show pools - shows the state of the connection pools",
+	  command_show_pools, NULL },
+#ifdef HAVE_PTHREAD_H
+	{ "thread", FR_READ,
+	  "show thread <command> - do sub-command of thread",
+	  NULL, command_table_show_thread },
+#endif
+	{ "unlang", FR_READ,
+	  "show unlang <section> [<server>] - shows the compiled version of a section of a virtual server",
+	  command_show_unlang, NULL },
 	{ "uptime", FR_READ,
 	  "show uptime - shows time at which server started",
 	  command_uptime, NULL },
@@ -1629,10 +2051,13 @@ static char const *elapsed_names[8] = {
 #endif
 #endif
 
-static int command_print_stats(rad_listen_t *listener, fr_stats_t *stats,
+static int command_print_stats(rad_listen_t *listener, fr_stats_t const *stats,
 			       int auth, int server)
 {
 	int i;
+	fr_stats_t total;
+
+	stats = radius_stats_total(&total, stats);
 
 	cprintf(listener, "\trequests\t" PU "\n", stats->total_requests);
 	cprintf(listener, "\tresponses\t" PU "\n", stats->total_responses);
@@ -1663,6 +2088,11 @@ static int command_print_stats(rad_listen_t *listener, fr_stats_t *stats,
 			elapsed_names[i], stats->elapsed[i]);
 	}
 
+	cprintf(listener, "\tlatency.p50\t%u\n", radius_stats_percentile(stats, 500));
+	cprintf(listener, "\tlatency.p90\t%u\n", radius_stats_percentile(stats, 900));
+	cprintf(listener, "\tlatency.p99\t%u\n", radius_stats_percentile(stats, 990));
+	cprintf(listener, "\tlatency.p99.9\t%u\n", radius_stats_percentile(stats, 999));
+
 	return 1;
 }
 
@@ -1729,6 +2159,7 @@ static int command_stats_detail(rad_listen_t *listener, int argc, char *argv[])
 	cprintf(listener, "tries\t%d\n", data->tries);
 	cprintf(listener, "offset\t%u\n", (unsigned int) data->offset);
 	cprintf(listener, "size\t%u\n", (unsigned int) buf.st_size);
+	cprintf(listener, "outstanding\t%u\n", data->outstanding);
 
 	return 1;
 }
@@ -1768,6 +2199,7 @@ static int command_stats_home_server(rad_listen_t *listener, int argc, char *arg
 	command_print_stats(listener, &home->stats,
 			    (home->type == HOME_TYPE_AUTH), 1);
 	cprintf(listener, "\toutstanding\t%d\n", home->currently_outstanding);
+	cprintf(listener, "\tlatency_usec\t%u\n", home->latency);
 	return 1;
 }
 #endif
@@ -1991,6 +2423,15 @@ static fr_command_table_t command_table_set_module[] = {
 };
 
 
+static fr_command_table_t command_table_flush[] = {
+	{ "module", FR_WRITE,
+	  "flush module <module> [<key>] - discard cached lookups for the module, or only those for <key>",
+	  command_flush_module, NULL },
+
+	{ NULL, 0, NULL, NULL, NULL }
+};
+
+
 static fr_command_table_t command_table_set[] = {
 	{ "module", FR_WRITE,
 	  "set module <command> - set module commands",
@@ -2005,6 +2446,16 @@ static fr_command_table_t command_table_set[] = {
 };
 
 
+#if defined(WITH_COA) && defined(HAVE_PTHREAD_H)
+static fr_command_table_t command_table_coa[] = {
+	{ "bulk", FR_WRITE,
+	  "coa bulk <filename> [<window>] - send the CoA and Disconnect packets in <filename>, with at most <window> outstanding to each NAS",
+	  command_coa_bulk, NULL },
+
+	{ NULL, 0, NULL, NULL, NULL }
+};
+#endif
+
 #ifdef WITH_STATS
 static fr_command_table_t command_table_stats[] = {
 	{ "client", FR_READ,
@@ -2042,6 +2493,11 @@ static fr_command_table_t command_table_stats[] = {
 static fr_command_table_t command_table[] = {
 #ifdef WITH_DYNAMIC_CLIENTS
 	{ "add", FR_WRITE, NULL, NULL, command_table_add },
+#endif
+#if defined(WITH_COA) && defined(HAVE_PTHREAD_H)
+	{ "coa", FR_WRITE,
+	  "coa <command> - commands to originate CoA and Disconnect packets",
+	  NULL, command_table_coa },
 #endif
 	{ "debug", FR_WRITE,
 	  "debug <command> - debugging commands",
@@ -2049,6 +2505,7 @@ static fr_command_table_t command_table[] = {
 #ifdef WITH_DYNAMIC_CLIENTS
 	{ "del", FR_WRITE, NULL, NULL, command_table_del },
 #endif
+	{ "flush", FR_WRITE, NULL, NULL, command_table_flush },
 	{ "hup", FR_WRITE,
 	  "hup [module] - sends a HUP signal to the server, or optionally to one module",
 	  command_hup, NULL },
@@ -40,7 +40,12 @@ RCSID("$Id$")
 #include <sys/stat.h>
 #endif
 
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
 #include <ctype.h>
+#include <fcntl.h>
 
 typedef enum conf_property {
 	CONF_PROPERTY_INVALID = 0,
@@ -105,6 +110,7 @@ struct conf_part {
 	rbtree_t	*pair_tree;	//!< and a partridge..
 	rbtree_t	*section_tree;	//!< no jokes here.
 	rbtree_t	*name2_tree;	//!< for sections of the same name2
+	rbtree_t	*name_tree;	//!< Subsections by name2, or name1 if there's no name2.
 	rbtree_t	*data_tree;
 
 	void		*base;
@@ -129,6 +135,147 @@ static char const 	*cf_expand_variables(char const *cf, int *lineno,
 
 static CONF_SECTION	*cf_template_copy(CONF_SECTION *parent, CONF_SECTION const *template);
 
+/*
+ *	Configuration snapshots.  While the text files are parsed,
+ *	everything the result depends on is recorded: the stat
+ *	information of each file and $INCLUDE directory, optional
+ *	files which were missing, and the $ENV{...} variables which
+ *	were expanded.  Once the parse succeeds, the tree is appended
+ *	to those records, and written to the snapshot.
+ *
+ *	On the next start, if none of the dependencies have changed,
+ *	the tree is rebuilt from the snapshot, skipping the reading,
+ *	tokenizing and variable expansion of the text.
+ *
+ *	The format is native-endian and specific to the build which
+ *	wrote it.  Anything unexpected means we parse the text.
+ */
+#define CF_SNAPSHOT_MAGIC	(0xfdc0f5a9)
+#define CF_SNAPSHOT_VERSION	(1)
+
+typedef enum cf_snapshot_op_t {
+	CF_SNAPSHOT_FILE = 1,			//!< File which was read.
+	CF_SNAPSHOT_DIR,			//!< Directory which was read by $INCLUDE foo/
+	CF_SNAPSHOT_ABSENT,			//!< File which $-INCLUDE didn't find.
+	CF_SNAPSHOT_ENV,			//!< Environment variable which was expanded.
+	CF_SNAPSHOT_FILENAME,			//!< Filename of the items which follow.
+	CF_SNAPSHOT_SECTION,
+	CF_SNAPSHOT_SECTION_END,
+	CF_SNAPSHOT_PAIR,
+	CF_SNAPSHOT_INCLUDE,			//!< CONF_DATA recording an included file.
+	CF_SNAPSHOT_CONDITION			//!< Parsed condition of an if / elsif.
+} cf_snapshot_op_t;
+
+typedef struct cf_snapshot_hdr_t {
+	uint32_t	magic;
+	uint32_t	version;
+	uint32_t	new_escape;		//!< Value of cf_new_escape after the parse.
+	uint32_t	deps;			//!< Length of the dependency records.
+	uint32_t	length;			//!< Of all records following the header.
+	uint32_t	hash;			//!< fr_hash() of the records.
+} cf_snapshot_hdr_t;
+
+static uint8_t *cf_snapshot_buf = NULL;		//!< Records for the files being parsed.
+static size_t cf_snapshot_len = 0;
+static size_t cf_snapshot_size = 0;
+
+/*
+ *	Append data to the snapshot records.  If we run out of
+ *	memory, we just stop recording, and no snapshot is written.
+ */
+static void cf_snapshot_put(void const *data, size_t len)
+{
+	if (!cf_snapshot_buf) return;
+
+	if ((cf_snapshot_len + len) > cf_snapshot_size) {
+		uint8_t *buf;
+		size_t size = cf_snapshot_size * 2;
+
+		while (size < (cf_snapshot_len + len)) size *= 2;
+
+		buf = realloc(cf_snapshot_buf, size);
+		if (!buf) {
+			free(cf_snapshot_buf);
+			cf_snapshot_buf = NULL;
+			return;
+		}
+		cf_snapshot_buf = buf;
+		cf_snapshot_size = size;
+	}
+
+	memcpy(cf_snapshot_buf + cf_snapshot_len, data, len);
+	cf_snapshot_len += len;
+}
+
+static void cf_snapshot_put_op(cf_snapshot_op_t op)
+{
+	uint8_t byte = op;
+
+	cf_snapshot_put(&byte, sizeof(byte));
+}
+
+static void cf_snapshot_put_num(int64_t num)
+{
+	cf_snapshot_put(&num, sizeof(num));
+}
+
+/*
+ *	Strings are written with their trailing NUL, so that they can
+ *	be used straight from the mapped snapshot.  A missing string
+ *	is written as a length of 0xffff.
+ */
+static void cf_snapshot_put_string(char const *str)
+{
+	size_t	len;
+	uint16_t len16;
+
+	if (!str) {
+		len16 = UINT16_MAX;
+		cf_snapshot_put(&len16, sizeof(len16));
+		return;
+	}
+
+	len = strlen(str);
+	if (len >= UINT16_MAX) {
+		free(cf_snapshot_buf);
+		cf_snapshot_buf = NULL;
+		return;
+	}
+
+	len16 = len;
+	cf_snapshot_put(&len16, sizeof(len16));
+	cf_snapshot_put(str, len + 1);
+}
+
+static void cf_snapshot_put_stat(cf_snapshot_op_t op, char const *name, struct stat const *stat_buf)
+{
+	if (!cf_snapshot_buf) return;
+
+	cf_snapshot_put_op(op);
+	cf_snapshot_put_string(name);
+	cf_snapshot_put_num(stat_buf->st_dev);
+	cf_snapshot_put_num(stat_buf->st_ino);
+	cf_snapshot_put_num(stat_buf->st_mtime);
+	cf_snapshot_put_num(op == CF_SNAPSHOT_FILE ? stat_buf->st_size : 0);
+}
+
+static void cf_snapshot_put_absent(char const *name)
+{
+	if (!cf_snapshot_buf) return;
+
+	cf_snapshot_put_op(CF_SNAPSHOT_ABSENT);
+	cf_snapshot_put_string(name);
+}
+
+static void cf_snapshot_put_env(char const *name, char const *value)
+{
+	if (!cf_snapshot_buf) return;
+
+	cf_snapshot_put_op(CF_SNAPSHOT_ENV);
+	cf_snapshot_put_string(name);
+	cf_snapshot_put_string(value);
+}
+
 /*
  *	Isolate the scary casts in these tiny provably-safe functions
  */
@@ -235,6 +382,19 @@ static int section_cmp(void const *a, void const *b)
 }
 
 
+/*
+ *	rbtree callback function
+ */
+static int name_cmp(void const *a, void const *b)
+{
+	CONF_SECTION const *one = a;
+	CONF_SECTION const *two = b;
+
+	return strcmp(one->name2 ? one->name2 : one->name1,
+		      two->name2 ? two->name2 : two->name1);
+}
+
+
 /*
  *	rbtree callback function
  */
@@ -287,6 +447,10 @@ static int _cf_section_free(CONF_SECTION *cs)
 		rbtree_free(cs->name2_tree);
 		cs->name2_tree = NULL;
 	}
+	if (cs->name_tree) {
+		rbtree_free(cs->name_tree);
+		cs->name_tree = NULL;
+	}
 	if (cs->data_tree) {
 		rbtree_free(cs->data_tree);
 		cs->data_tree = NULL;
@@ -477,6 +641,20 @@ void cf_item_add(CONF_SECTION *cs, CONF_ITEM *ci)
 				}
 			}
 
+			/*
+			 *	Index by name for cf_section_sub_find_name2()
+			 *	with no name1.  As with the other trees,
+			 *	the first section of a given name wins.
+			 */
+			if (!cs->name_tree) {
+				cs->name_tree = rbtree_create(cs, name_cmp, NULL, 0);
+				if (!cs->name_tree) {
+					ERROR("Out of memory");
+					fr_exit_now(1);
+				}
+			}
+			rbtree_insert(cs->name_tree, cs_new);
+
 			name1_cs = rbtree_finddata(cs->section_tree, cs_new);
 			if (!name1_cs) {
 				if (!rbtree_insert(cs->section_tree, cs_new)) {
@@ -850,7 +1028,7 @@ static char const *cf_expand_variables(char const *cf, int *lineno,
 				ERROR("%s[%d]: Reference \"%s\" type is invalid", cf, *lineno, input);
 				return NULL;
 			}
-		} else if (memcmp(ptr, "$ENV{", 5) == 0) {
+		} else if (strncmp(ptr, "$ENV{", 5) == 0) {
 			char *env;
 
 			ptr += 5;
@@ -886,6 +1064,7 @@ static char const *cf_expand_variables(char const *cf, int *lineno,
 			 *	If none exists, then make it an empty string.
 			 */
 			env = getenv(name);
+			cf_snapshot_put_env(name, env);
 			if (env == NULL) {
 				*name = '\0';
 				env = name;
@@ -1407,7 +1586,8 @@ int cf_section_parse(CONF_SECTION *cs, void *base,
 
 
 /*
- *	Check XLAT things in pass 2.  But don't cache the xlat stuff anywhere.
+ *	Check XLAT things in pass 2, and cache the tokenized form so
+ *	that it isn't re-parsed for every request.
  */
 int cf_section_parse_pass2(CONF_SECTION *cs, UNUSED void *base,
 			   CONF_PARSER const *variables)
@@ -1415,8 +1595,6 @@ int cf_section_parse_pass2(CONF_SECTION *cs, UNUSED void *base,
 	int i;
 	ssize_t slen;
 	char const *error;
-	char *value = NULL;
-	xlat_exp_t *xlat;
 
 	/*
 	 *	Handle the known configuration parameters.
@@ -1451,10 +1629,7 @@ int cf_section_parse_pass2(CONF_SECTION *cs, UNUSED void *base,
 		if ((cp->value_type != T_DOUBLE_QUOTED_STRING) &&
 		    (cp->value_type != T_BARE_WORD)) continue;
 
-		value = talloc_strdup(cs, cp->value); /* modified by xlat_tokenize */
-		xlat = NULL;
-
-		slen = xlat_tokenize(cs, value, &xlat, &error);
+		slen = xlat_precompile(cp->value, &error);
 		if (slen < 0) {
 			char *spaces, *text;
 
@@ -1466,14 +1641,9 @@ int cf_section_parse_pass2(CONF_SECTION *cs, UNUSED void *base,
 
 			talloc_free(spaces);
 			talloc_free(text);
-			talloc_free(value);
-			talloc_free(xlat);
 			return -1;
 		}
 
-		talloc_free(value);
-		talloc_free(xlat);
-
 		/*
 		 *	If the "multi" flag is set, check all of them.
 		 */
@@ -1877,6 +2047,19 @@ static int cf_section_read(char const *filename, int *lineno, FILE *fp,
 					return -1;
 				}
 
+				/*
+				 *	Adding or removing a file changes
+				 *	the mtime of the directory.
+				 */
+				if (cf_snapshot_buf) {
+					if (stat(value, &stat_buf) < 0) {
+						free(cf_snapshot_buf);
+						cf_snapshot_buf = NULL;
+					} else {
+						cf_snapshot_put_stat(CF_SNAPSHOT_DIR, value, &stat_buf);
+					}
+				}
+
 				/*
 				 *	Read the directory, ignoring "." files.
 				 */
@@ -1920,6 +2103,7 @@ static int cf_section_read(char const *filename, int *lineno, FILE *fp,
 
 					if (stat(value, &statbuf) < 0) {
 						WARN("Not including file %s: %s", value, fr_syserror(errno));
+						cf_snapshot_put_absent(value);
 						continue;
 					}
 				}
@@ -2386,6 +2570,8 @@ int cf_file_include(CONF_SECTION *cs, char const *filename)
 		return -1;
 	}
 
+	cf_snapshot_put_stat(CF_SNAPSHOT_FILE, filename, &statbuf);
+
 	if (!cs->item.filename) cs->item.filename = talloc_strdup(cs, filename);
 
 	/*
@@ -2437,6 +2623,515 @@ void cf_file_free(CONF_SECTION *cs)
 	talloc_free(cs);
 }
 
+/*
+ *	Append the tree to the snapshot records.  Returns false if it
+ *	contains anything which we don't know how to rebuild.
+ */
+static bool cf_snapshot_put_section(CONF_SECTION const *cs, char const **filename)
+{
+	CONF_ITEM const *ci;
+
+	for (ci = cs->children; ci != NULL; ci = ci->next) {
+		if ((ci->type != CONF_ITEM_DATA) && (ci->filename != *filename) &&
+		    (!ci->filename || !*filename || (strcmp(ci->filename, *filename) != 0))) {
+			cf_snapshot_put_op(CF_SNAPSHOT_FILENAME);
+			cf_snapshot_put_string(ci->filename);
+			*filename = ci->filename;
+		}
+
+		switch (ci->type) {
+		case CONF_ITEM_PAIR:
+		{
+			CONF_PAIR const *cp = cf_itemtopair(ci);
+
+			cf_snapshot_put_op(CF_SNAPSHOT_PAIR);
+			cf_snapshot_put_string(cp->attr);
+			cf_snapshot_put_string(cp->value);
+			cf_snapshot_put_num(cp->op);
+			cf_snapshot_put_num(cp->value_type);
+			cf_snapshot_put_num(ci->lineno);
+		}
+			break;
+
+		case CONF_ITEM_SECTION:
+		{
+			CONF_SECTION const *subcs = cf_itemtosection(ci);
+
+			/*
+			 *	Templates are merged when their section
+			 *	is closed, so this shouldn't happen.
+			 */
+			if (subcs->template) return false;
+
+			cf_snapshot_put_op(CF_SNAPSHOT_SECTION);
+			cf_snapshot_put_string(subcs->name1);
+			cf_snapshot_put_string(subcs->name2);
+			cf_snapshot_put_num(subcs->name2_type);
+			cf_snapshot_put_num(ci->lineno);
+
+			if (!cf_snapshot_put_section(subcs, filename)) return false;
+
+			cf_snapshot_put_op(CF_SNAPSHOT_SECTION_END);
+		}
+			break;
+
+		case CONF_ITEM_DATA:
+		{
+			CONF_DATA const *cd = (CONF_DATA const *) ci;
+
+			if (cd->flag == PW_TYPE_FILE_INPUT) {
+				cf_snapshot_put_op(CF_SNAPSHOT_INCLUDE);
+				cf_snapshot_put_string(cd->name);
+				cf_snapshot_put_num(*(time_t *) cd->data);
+				break;
+			}
+
+			if ((cd->flag == 0) && (strcmp(cd->name, "if") == 0)) {
+				cf_snapshot_put_op(CF_SNAPSHOT_CONDITION);
+				break;
+			}
+		}
+			return false;
+
+		default:
+			return false;
+		}
+	}
+
+	return (cf_snapshot_buf != NULL);
+}
+
+/*
+ *	Write the records we gathered while parsing the files, along
+ *	with the tree.  Failures are ignored, the worst that happens
+ *	is that we parse the text again next time.
+ */
+static void cf_snapshot_save(CONF_SECTION const *cs, char const *snapshot)
+{
+	int fd;
+	cf_snapshot_hdr_t hdr;
+	char const *filename = NULL;
+	char tmp[1024];
+
+	if (!cf_snapshot_buf) return;
+
+	hdr.deps = cf_snapshot_len;
+
+	if (!cf_snapshot_put_section(cs, &filename) || (cf_snapshot_len > UINT32_MAX)) {
+		DEBUG2("Not writing configuration snapshot %s", snapshot);
+		return;
+	}
+
+	hdr.magic = CF_SNAPSHOT_MAGIC;
+	hdr.version = CF_SNAPSHOT_VERSION;
+	hdr.new_escape = cf_new_escape;
+	hdr.length = cf_snapshot_len;
+	hdr.hash = fr_hash(cf_snapshot_buf, cf_snapshot_len);
+
+	/*
+	 *	Write to a temporary file, and rename it into place, so
+	 *	that nothing ever sees a partial snapshot.  mkstemp()
+	 *	won't follow a link someone else put at the name, and
+	 *	creates the file readable only by us.
+	 */
+	if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", snapshot) >= (int) sizeof(tmp)) {
+		WARN("Failed writing configuration snapshot %s: Name is too long", snapshot);
+		return;
+	}
+
+	fd = mkstemp(tmp);
+	if (fd < 0) {
+		WARN("Failed writing configuration snapshot %s: %s", tmp, fr_syserror(errno));
+		return;
+	}
+
+	if ((write(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) ||
+	    (write(fd, cf_snapshot_buf, cf_snapshot_len) != (ssize_t) cf_snapshot_len) ||
+	    (fsync(fd) < 0)) {
+		WARN("Failed writing configuration snapshot %s: %s", tmp, fr_syserror(errno));
+		close(fd);
+		unlink(tmp);
+		return;
+	}
+
+	if (close(fd) < 0) {
+		WARN("Failed writing configuration snapshot %s: %s", tmp, fr_syserror(errno));
+		unlink(tmp);
+		return;
+	}
+
+	if (rename(tmp, snapshot) < 0) {
+		WARN("Failed writing configuration snapshot %s: %s", snapshot, fr_syserror(errno));
+		unlink(tmp);
+		return;
+	}
+
+	DEBUG2("Wrote configuration snapshot %s", snapshot);
+}
+
+static bool cf_snapshot_get(uint8_t const **p, uint8_t const *end, void *out, size_t len)
+{
+	if ((size_t) (end - *p) < len) return false;
+
+	memcpy(out, *p, len);
+	*p += len;
+
+	return true;
+}
+
+static bool cf_snapshot_get_num(uint8_t const **p, uint8_t const *end, int64_t *out)
+{
+	return cf_snapshot_get(p, end, out, sizeof(*out));
+}
+
+/*
+ *	Strings point into the snapshot itself.
+ */
+static bool cf_snapshot_get_string(uint8_t const **p, uint8_t const *end, char const **out)
+{
+	uint16_t len;
+
+	if (!cf_snapshot_get(p, end, &len, sizeof(len))) return false;
+	if (len == UINT16_MAX) {
+		*out = NULL;
+		return true;
+	}
+
+	if ((size_t) (end - *p) <= len) return false;
+	if ((*p)[len] != '\0') return false;
+
+	*out = (char const *) *p;
+	*p += len + 1;
+
+	return true;
+}
+
+/*
+ *	Check that nothing the snapshot depends on has changed.
+ */
+static bool cf_snapshot_check(uint8_t const *p, uint8_t const *end)
+{
+	while (p < end) {
+		uint8_t op;
+		char const *name, *value;
+		int64_t dev, ino, mtime, size;
+		struct stat stat_buf;
+
+		if (!cf_snapshot_get(&p, end, &op, sizeof(op))) return false;
+
+		switch (op) {
+		case CF_SNAPSHOT_FILE:
+		case CF_SNAPSHOT_DIR:
+			if (!cf_snapshot_get_string(&p, end, &name) || !name ||
+			    !cf_snapshot_get_num(&p, end, &dev) ||
+			    !cf_snapshot_get_num(&p, end, &ino) ||
+			    !cf_snapshot_get_num(&p, end, &mtime) ||
+			    !cf_snapshot_get_num(&p, end, &size)) return false;
+
+			if (stat(name, &stat_buf) < 0) return false;
+
+			/*
+			 *	Let the parser complain about these.
+			 */
+#ifdef S_IWOTH
+			if ((stat_buf.st_mode & S_IWOTH) != 0) return false;
+#endif
+			if (((int64_t) stat_buf.st_dev != dev) ||
+			    ((int64_t) stat_buf.st_ino != ino) ||
+			    ((int64_t) stat_buf.st_mtime != mtime)) return false;
+
+			if ((op == CF_SNAPSHOT_FILE) && ((int64_t) stat_buf.st_size != size)) return false;
+			break;
+
+		case CF_SNAPSHOT_ABSENT:
+			if (!cf_snapshot_get_string(&p, end, &name) || !name) return false;
+
+			if (stat(name, &stat_buf) == 0) return false;
+			break;
+
+		case CF_SNAPSHOT_ENV:
+		{
+			char const *env;
+
+			if (!cf_snapshot_get_string(&p, end, &name) || !name ||
+			    !cf_snapshot_get_string(&p, end, &value)) return false;
+
+			env = getenv(name);
+			if (!env != !value) return false;
+			if (env && (strcmp(env, value) != 0)) return false;
+		}
+			break;
+
+		default:
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ *	Rebuild the children of a section from the snapshot.
+ *
+ *	Returns 1 at the end of the section, 0 at the end of the
+ *	records, and -1 on error.
+ */
+static int cf_snapshot_build(CONF_SECTION *cs, uint8_t const **p, uint8_t const *end,
+			     char const **filename)
+{
+	while (*p < end) {
+		uint8_t op;
+		char const *name1, *name2;
+		int64_t op_token, type, lineno;
+
+		if (!cf_snapshot_get(p, end, &op, sizeof(op))) return -1;
+
+		switch (op) {
+		case CF_SNAPSHOT_FILENAME:
+			if (!cf_snapshot_get_string(p, end, &name1)) return -1;
+
+			*filename = NULL;
+			if (name1) {
+				*filename = talloc_typed_strdup(cf_top_section(cs), name1);
+				if (!*filename) return -1;
+			}
+			break;
+
+		case CF_SNAPSHOT_PAIR:
+		{
+			CONF_PAIR *cp;
+
+			if (!cf_snapshot_get_string(p, end, &name1) || !name1 ||
+			    !cf_snapshot_get_string(p, end, &name2) ||
+			    !cf_snapshot_get_num(p, end, &op_token) ||
+			    !cf_snapshot_get_num(p, end, &type) ||
+			    !cf_snapshot_get_num(p, end, &lineno)) return -1;
+
+			cp = cf_pair_alloc(cs, name1, name2, op_token, type);
+			if (!cp) return -1;
+
+			cp->item.filename = *filename;
+			cp->item.lineno = lineno;
+			cf_item_add(cs, &(cp->item));
+		}
+			break;
+
+		case CF_SNAPSHOT_SECTION:
+		{
+			CONF_SECTION *subcs;
+
+			if (!cf_snapshot_get_string(p, end, &name1) || !name1 ||
+			    !cf_snapshot_get_string(p, end, &name2) ||
+			    !cf_snapshot_get_num(p, end, &type) ||
+			    !cf_snapshot_get_num(p, end, &lineno)) return -1;
+
+			/*
+			 *	name2 has already been expanded, so we
+			 *	don't let cf_section_alloc() look at it.
+			 */
+			subcs = cf_section_alloc(cs, name1, NULL);
+			if (!subcs) return -1;
+
+			if (name2) {
+				subcs->name2 = talloc_typed_strdup(subcs, name2);
+				if (!subcs->name2) {
+				section_error:
+					talloc_free(subcs);
+					return -1;
+				}
+			}
+			subcs->name2_type = type;
+
+			if (*filename) {
+				subcs->item.filename = talloc_strdup(subcs, *filename);
+				if (!subcs->item.filename) goto section_error;
+			}
+			subcs->item.lineno = lineno;
+			cf_item_add(cs, &(subcs->item));
+
+			if (cf_snapshot_build(subcs, p, end, filename) != 1) return -1;
+		}
+			break;
+
+		case CF_SNAPSHOT_SECTION_END:
+			return 1;
+
+		case CF_SNAPSHOT_INCLUDE:
+		{
+			time_t *mtime;
+			int64_t num;
+
+			if (!cf_snapshot_get_string(p, end, &name1) || !name1 ||
+			    !cf_snapshot_get_num(p, end, &num)) return -1;
+
+			mtime = talloc(cs, time_t);
+			if (!mtime) return -1;
+			*mtime = num;
+
+			if (cf_data_add_internal(cs, name1, mtime, NULL, PW_TYPE_FILE_INPUT) < 0) return -1;
+		}
+			break;
+
+		/*
+		 *	The condition text was expanded before it was
+		 *	saved, so we just tokenize it again.
+		 */
+		case CF_SNAPSHOT_CONDITION:
+		{
+			ssize_t slen;
+			char const *error = NULL;
+			fr_cond_t *cond = NULL;
+
+			if (!cs->name2) return -1;
+
+			slen = fr_condition_tokenize(cs, cf_sectiontoitem(cs), cs->name2, &cond,
+						     &error, FR_COND_TWO_PASS);
+			if (slen <= 0) {
+				talloc_free(cond);
+				return -1;
+			}
+
+			if (cf_data_add_internal(cs, "if", cond, NULL, false) < 0) return -1;
+		}
+			break;
+
+		default:
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ *	Rebuild the configuration from the snapshot, if it's for the
+ *	same file, and nothing it depends on has changed.
+ */
+static CONF_SECTION *cf_snapshot_load(char const *filename, char const *snapshot)
+{
+	int fd;
+	struct stat stat_buf;
+	cf_snapshot_hdr_t hdr;
+	uint8_t *buf = NULL;
+	uint8_t const *p, *deps, *end;
+	char const *root, *tree_filename = NULL;
+	bool new_escape = cf_new_escape;
+	CONF_SECTION *cs = NULL;
+
+	fd = open(snapshot, O_RDONLY);
+	if (fd < 0) return NULL;
+
+	/*
+	 *	Apply the same rules as for the configuration files.
+	 */
+	if ((fstat(fd, &stat_buf) < 0) || !S_ISREG(stat_buf.st_mode) ||
+	    (stat_buf.st_size < (off_t) sizeof(hdr))) goto done;
+#ifdef S_IWOTH
+	if ((stat_buf.st_mode & S_IWOTH) != 0) goto done;
+#endif
+
+#ifdef HAVE_SYS_MMAN_H
+	buf = mmap(NULL, stat_buf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (buf == MAP_FAILED) {
+		buf = NULL;
+		goto done;
+	}
+#else
+	buf = talloc_array(NULL, uint8_t, stat_buf.st_size);
+	if (!buf) goto done;
+
+	if (read(fd, buf, stat_buf.st_size) != (ssize_t) stat_buf.st_size) goto done;
+#endif
+
+	memcpy(&hdr, buf, sizeof(hdr));
+	if ((hdr.magic != CF_SNAPSHOT_MAGIC) ||
+	    (hdr.version != CF_SNAPSHOT_VERSION) ||
+	    (hdr.deps > hdr.length) ||
+	    ((off_t) (hdr.length + sizeof(hdr)) != stat_buf.st_size)) goto done;
+
+	p = buf + sizeof(hdr);
+	if (fr_hash(p, hdr.length) != hdr.hash) goto done;
+
+	deps = p + hdr.deps;
+	end = p + hdr.length;
+
+	/*
+	 *	The snapshot must be for the same top-level file.
+	 */
+	if (!cf_snapshot_get_string(&p, deps, &root) || !root ||
+	    (strcmp(root, filename) != 0)) goto done;
+
+	if (!cf_snapshot_check(p, deps)) {
+		DEBUG2("Configuration snapshot %s is out of date", snapshot);
+		goto done;
+	}
+
+	cs = cf_section_alloc(NULL, "main", NULL);
+	if (!cs) goto done;
+
+	cs->item.filename = talloc_strdup(cs, filename);
+	if (!cs->item.filename) goto error;
+
+	cf_new_escape = hdr.new_escape;
+
+	p = deps;
+	if (cf_snapshot_build(cs, &p, end, &tree_filename) != 0) {
+	error:
+		WARN("Ignoring invalid configuration snapshot %s", snapshot);
+		cf_new_escape = new_escape;
+		TALLOC_FREE(cs);
+		goto done;
+	}
+
+	DEBUG2("Loaded configuration snapshot %s", snapshot);
+
+done:
+#ifdef HAVE_SYS_MMAN_H
+	if (buf) munmap(buf, stat_buf.st_size);
+#else
+	talloc_free(buf);
+#endif
+	close(fd);
+
+	return cs;
+}
+
+/** Read a configuration file, using a snapshot of the parsed tree if possible
+ *
+ * If nothing the snapshot depends on has changed, the tree is rebuilt
+ * from it.  Otherwise, the file is parsed as with cf_file_read(), and
+ * the snapshot is re-written.
+ *
+ * @param filename of the top-level configuration file.
+ * @param snapshot file to load the tree from, and save it to.  May be NULL.
+ * @return the configuration tree, or NULL on error.
+ */
+CONF_SECTION *cf_file_read_snapshot(char const *filename, char const *snapshot)
+{
+	CONF_SECTION *cs;
+
+	if (!snapshot) return cf_file_read(filename);
+
+	cs = cf_snapshot_load(filename, snapshot);
+	if (cs) return cs;
+
+	rad_assert(cf_snapshot_buf == NULL);
+
+	cf_snapshot_size = 65536;
+	cf_snapshot_len = 0;
+	cf_snapshot_buf = malloc(cf_snapshot_size);
+	cf_snapshot_put_string(filename);
+
+	cs = cf_file_read(filename);
+	if (cs) cf_snapshot_save(cs, snapshot);
+
+	free(cf_snapshot_buf);
+	cf_snapshot_buf = NULL;
+	cf_snapshot_len = cf_snapshot_size = 0;
+
+	return cs;
+}
+
 
 /*
  * Return a CONF_PAIR within a CONF_SECTION.
@@ -2673,13 +3368,13 @@ CONF_SECTION *cf_section_sub_find(CONF_SECTION const *cs, char const *name)
 CONF_SECTION *cf_section_sub_find_name2(CONF_SECTION const *cs,
 					char const *name1, char const *name2)
 {
-	CONF_ITEM    *ci;
+	CONF_SECTION mycs;
 
 	if (!cs) cs = root_config;
 	if (!cs) return NULL;
 
 	if (name1) {
-		CONF_SECTION mycs, *master_cs;
+		CONF_SECTION *master_cs;
 
 		if (!cs->section_tree) return NULL;
 
@@ -2690,50 +3385,32 @@ CONF_SECTION *cf_section_sub_find_name2(CONF_SECTION const *cs,
 		if (!master_cs) return NULL;
 
 		/*
-		 *	Look it up in the name2 tree.  If it's there,
-		 *	return it.
+		 *	We don't insert ourselves into the name2 tree,
+		 *	and we come before everything in it.  So
+		 *	check if *we* are the answer first.
 		 */
-		if (master_cs->name2_tree) {
-			CONF_SECTION *subcs;
-
-			subcs = rbtree_finddata(master_cs->name2_tree, &mycs);
-			if (subcs) return subcs;
-		}
+		if (!master_cs->name2 && !name2) return master_cs;
+		if (master_cs->name2 && name2 &&
+		    (strcmp(master_cs->name2, name2) == 0)) return master_cs;
 
 		/*
-		 *	We don't insert ourselves into the name2 tree.
-		 *	So if there's nothing in the name2 tree, maybe
-		 *	*we* are the answer.
+		 *	Look it up in the name2 tree.
 		 */
-		if (!master_cs->name2 && name2) return NULL;
-		if (master_cs->name2 && !name2) return NULL;
-		if (!master_cs->name2 && !name2) return master_cs;
+		if (!master_cs->name2_tree) return NULL;
 
-		if (strcmp(master_cs->name2, name2) == 0) {
-			return master_cs;
-		}
-
-		return NULL;
+		return rbtree_finddata(master_cs->name2_tree, &mycs);
 	}
 
 	/*
-	 *	Else do it the old-fashioned way.
+	 *	Else look for the first section with the right
+	 *	name2, or name1 if there's no name2.
 	 */
-	for (ci = cs->children; ci; ci = ci->next) {
-		CONF_SECTION *subcs;
+	if (!name2 || !cs->name_tree) return NULL;
 
-		if (ci->type != CONF_ITEM_SECTION)
-			continue;
-
-		subcs = cf_itemtosection(ci);
-		if (!subcs->name2) {
-			if (strcmp(subcs->name1, name2) == 0) break;
-		} else {
-			if (strcmp(subcs->name2, name2) == 0) break;
-		}
-	}
+	mycs.name1 = name2;
+	mycs.name2 = NULL;
 
-	return cf_itemtosection(ci);
+	return rbtree_finddata(cs->name_tree, &mycs);
 }
 
 /*
@@ -2840,6 +3517,95 @@ int cf_pair_count(CONF_SECTION const *cs)
 	return count;
 }
 
+static bool cf_str_equal(char const *a, char const *b)
+{
+	if (!a || !b) return (a == b);
+
+	return (strcmp(a, b) == 0);
+}
+
+/*
+ *	Items which weren't read from a file.  cf_item_parse() adds
+ *	pairs for default values, and cf_section_parse() adds empty
+ *	subsections.
+ */
+static bool cf_item_is_default(CONF_ITEM const *ci)
+{
+	CONF_SECTION const *cs;
+
+	switch (ci->type) {
+	case CONF_ITEM_DATA:
+		return true;
+
+	case CONF_ITEM_PAIR:
+		return ((ci->lineno == 0) && ci->filename && (strcmp(ci->filename, "<internal>") == 0));
+
+	case CONF_ITEM_SECTION:
+		cs = cf_itemtosection(ci);
+		if (!ci->parent ||
+		    (ci->filename != ci->parent->item.filename) ||
+		    (ci->lineno != ci->parent->item.lineno)) return false;
+
+		for (ci = cs->children; ci != NULL; ci = ci->next) {
+			if (!cf_item_is_default(ci)) return false;
+		}
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+/** Check whether two sections have the same contents
+ *
+ * Names, pairs and subsections are compared, in order.  File names, line
+ * numbers and CONF_DATA are ignored, so a section which has only moved to
+ * another file is still equal.  So are the defaults which parsing the
+ * section filled in.
+ *
+ * @param[in] a first section, may be NULL.
+ * @param[in] b second section, may be NULL.
+ * @return true if both are NULL, or have the same contents, else false.
+ */
+bool cf_section_equal(CONF_SECTION const *a, CONF_SECTION const *b)
+{
+	CONF_ITEM const *ia, *ib;
+
+	if (a == b) return true;
+	if (!a || !b) return false;
+
+	if (!cf_str_equal(a->name1, b->name1) ||
+	    !cf_str_equal(a->name2, b->name2) ||
+	    !cf_section_equal(a->template, b->template)) return false;
+
+	ia = a->children;
+	ib = b->children;
+	while (true) {
+		while (ia && cf_item_is_default(ia)) ia = ia->next;
+		while (ib && cf_item_is_default(ib)) ib = ib->next;
+
+		if (!ia || !ib) return (ia == ib);
+
+		if (ia->type != ib->type) return false;
+
+		if (ia->type == CONF_ITEM_PAIR) {
+			CONF_PAIR const *pa = cf_itemtopair(ia);
+			CONF_PAIR const *pb = cf_itemtopair(ib);
+
+			if ((pa->op != pb->op) ||
+			    (pa->value_type != pb->value_type) ||
+			    !cf_str_equal(pa->attr, pb->attr) ||
+			    !cf_str_equal(pa->value, pb->value)) return false;
+
+		} else if (!cf_section_equal(cf_itemtosection(ia), cf_itemtosection(ib))) {
+			return false;
+		}
+
+		ia = ia->next;
+		ib = ib->next;
+	}
+}
+
 CONF_SECTION *cf_item_parent(CONF_ITEM const *ci)
 {
 	if (!ci) return NULL;
@@ -27,6 +27,8 @@ RCSID("$Id$")
 
 #include <freeradius-devel/radiusd.h>
 #include <freeradius-devel/modpriv.h>
+#include <freeradius-devel/memstats.h>
+#include <freeradius-devel/trace.h>
 #include <freeradius-devel/rad_assert.h>
 
 typedef struct fr_connection fr_connection_t;
@@ -55,6 +57,8 @@ struct fr_connection {
 	time_t		created;	//!< Time connection was created.
 	time_t		last_used;	//!< Last time the connection was
 					//!< reserved.
+	struct timeval	requested;	//!< When the connection was asked for.
+	struct timeval	acquired;	//!< When the connection was reserved.
 
 	uint32_t	num_uses;	//!< Number of times the connection
 					//!< has been reserved.
@@ -66,11 +70,25 @@ struct fr_connection {
 					//!< uses for a connection handle.
 	bool		in_use;		//!< Whether the connection is currently
 					//!< reserved.
+	uint32_t	slot;		//!< Index in the pool's slot array.
 #ifdef PTHREAD_DEBUG
 	pthread_t	pthread_id;	//!< When 'in_use == true'
 #endif
 };
 
+/** A request waiting for a connection
+ *
+ * Lives on the stack of the waiting thread.
+ */
+typedef struct fr_connection_waiter_t fr_connection_waiter_t;
+struct fr_connection_waiter_t {
+	fr_connection_waiter_t	*next;		//!< Next waiter in the queue.
+	fr_connection_t		*this;		//!< Connection handed to the waiter.
+#ifdef HAVE_PTHREAD_H
+	pthread_cond_t		cond;		//!< Signalled when 'this' is set.
+#endif
+};
+
 /** A connection pool
  *
  * Defines the configuration of the connection pool, all the counters and
@@ -115,6 +133,12 @@ struct fr_connection_pool_t {
 					//!< re-using the most recently used
 					//!< connections first.
 
+	struct timeval	wait_timeout;	//!< How long to wait for a connection
+					//!< when all of them are in use, and
+					//!< there are already 'max'.
+	uint32_t	max_waiting;	//!< Maximum number of requests which
+					//!< can wait.  0 is unlimited.
+
 	time_t		last_checked;	//!< Last time we pruned the connection
 					//!< pool.
 	time_t		last_spawned;	//!< Last time we spawned a connection.
@@ -135,6 +159,14 @@ struct fr_connection_pool_t {
 	fr_connection_t	*head;		//!< Start of the connection list.
 	fr_connection_t *tail;		//!< End of the connection list.
 
+	fr_connection_t	**slots;	//!< Every connection, indexed by its slot.
+	void		**handles;	//!< The handle of every connection, by slot.
+	uint32_t	*slot_next;	//!< Next slot in the idle stack.
+	uint64_t	idle_head;	//!< Top of the idle stack.  The low 32 bits
+					//!< are the slot + 1, the high 32 bits are
+					//!< a counter, to avoid ABA problems.
+	fr_atomic_queue_t *idle_queue;	//!< Idle connections, if 'spread' is set.
+
 	bool		spawning;	//!< Whether we are currently attempting
 					//!< to spawn a new connection.
 
@@ -142,6 +174,9 @@ struct fr_connection_pool_t {
 	pthread_mutex_t	mutex;		//!< Mutex used to keep consistent state
 					//!< when making modifications in
 					//!< threaded mode.
+#  ifndef __ATOMIC_ACQUIRE
+	pthread_mutex_t	idle_mutex;	//!< Protects the idle stack.
+#  endif
 #endif
 
 	CONF_SECTION	*cs;		//!< Configuration section holding
@@ -163,13 +198,108 @@ struct fr_connection_pool_t {
 					//!< connections.
 	fr_connection_alive_t	alive;	//!< Function used to check status
 					//!< of connections.
+
+	fr_connection_pool_t	*start_next;	//!< Next pool waiting for its
+						//!< 'start' connections.
+	bool		start_failed;	//!< Whether opening the 'start'
+					//!< connections failed.
+
+	fr_connection_waiter_t	*wait_head;	//!< Requests waiting for a connection,
+	fr_connection_waiter_t	**wait_tail;	//!< in the order they started waiting.
+	uint32_t	num_waiting;	//!< Length of the wait queue.
+	uint64_t	waits;		//!< Requests which have waited.
+	uint64_t	wait_timeouts;	//!< Requests which gave up waiting.
+	uint64_t	wait_time;	//!< Total time spent waiting (us).
+	uint32_t	max_wait_time;	//!< Longest wait (us).
+
+	uint64_t	spawn_failures;	//!< Connections which couldn't be opened.
+	uint64_t	reconnects;	//!< Connections which were re-opened.
+	uint64_t	wait_hist[FR_CONNECTION_POOL_HIST_BUCKETS];	//!< Time taken to get a
+									//!< connection.
+	uint64_t	hold_hist[FR_CONNECTION_POOL_HIST_BUCKETS];	//!< Time connections
+									//!< were held for.
+
+	char const	*name;		//!< Name of the module which owns the pool.
+	fr_connection_pool_t	*list_next;	//!< Next pool in the list of all pools.
+	bool			listed;		//!< Whether the pool is in the list of all pools.
 };
 
+/*
+ *	Opening the 'start' connections may take a long time, and
+ *	doesn't need to block the instantiation of other modules.
+ *	While starting, the pools are put on this list, and
+ *	fr_connection_pool_start_all() opens their connections in
+ *	parallel.
+ */
+static bool		pool_start_deferred = false;
+static fr_connection_pool_t *pool_start_head = NULL;
+
+/*
+ *	All of the pools, for fr_connection_pool_stats_all().  The
+ *	list is read by worker threads and the metrics thread, while
+ *	the main thread adds and frees pools on HUP, so it's only ever
+ *	used with the mutex held.
+ *
+ *	The mutex is taken before a pool's mutex, never after it.
+ */
+static fr_connection_pool_t *pool_list_head = NULL;
+static pthread_mutex_t	pool_list_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ *	Maximum number of threads used to open 'start' connections.
+ *	Connections for one pool are still opened one at a time.
+ */
+#define POOL_START_THREADS (16)
+
 #ifndef HAVE_PTHREAD_H
 #define pthread_mutex_lock(_x)
+#define pthread_mutex_trylock(_x) (0)
 #define pthread_mutex_unlock(_x)
 #endif
 
+/*
+ *	Idle connections are kept on a stack (or a queue if 'spread'
+ *	is set), which can be pushed and popped without holding the
+ *	pool mutex.  A connection which has been popped belongs to
+ *	whoever popped it, so nothing else can use or close it.
+ *
+ *	The stack is a list of slot numbers.  The counter in the top
+ *	of the stack is changed by every push and pop, so a pop can't
+ *	succeed using a 'next' value which has since been changed.
+ */
+#ifdef __ATOMIC_ACQUIRE
+#  define CP_LOAD(_x)		__atomic_load_n(&(_x), __ATOMIC_ACQUIRE)
+#  define CP_LOAD_RELAXED(_x)	__atomic_load_n(&(_x), __ATOMIC_RELAXED)
+#  define CP_STORE_RELAXED(_x, _v) __atomic_store_n(&(_x), _v, __ATOMIC_RELAXED)
+#  define CP_CAS(_x, _old, _new) __atomic_compare_exchange_n(&(_x), &(_old), _new, true, \
+							 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+#  define CP_INC(_pool, _x)	__atomic_add_fetch(&(_x), 1, __ATOMIC_RELAXED)
+#  define CP_DEC(_pool, _x)	__atomic_sub_fetch(&(_x), 1, __ATOMIC_RELAXED)
+#  define CP_LOCK(_pool)
+#  define CP_UNLOCK(_pool)
+#else
+#  define CP_LOAD(_x)		(_x)
+#  define CP_LOAD_RELAXED(_x)	(_x)
+#  define CP_STORE_RELAXED(_x, _v) ((_x) = (_v))
+#  define CP_CAS(_x, _old, _new) (((_x) == (_old)) ? ((_x) = (_new), true) : ((_old) = (_x), false))
+#  define CP_INC(_pool, _x)	do { CP_LOCK(_pool); (_x)++; CP_UNLOCK(_pool); } while (0)
+#  define CP_DEC(_pool, _x)	do { CP_LOCK(_pool); (_x)--; CP_UNLOCK(_pool); } while (0)
+#  define CP_LOCK(_pool)	pthread_mutex_lock(&(_pool)->idle_mutex)
+#  define CP_UNLOCK(_pool)	pthread_mutex_unlock(&(_pool)->idle_mutex)
+#endif
+
+/*
+ *	Orders a push onto the idle stack before a check for waiters,
+ *	and joining the wait queue before a pop from the idle stack.
+ *	Then at least one side sees the other, and a waiter can't miss
+ *	a connection which was released as it started to wait.
+ */
+#ifdef __ATOMIC_SEQ_CST
+#  define CP_FENCE()		__atomic_thread_fence(__ATOMIC_SEQ_CST)
+#else
+#  define CP_FENCE()
+#endif
+
 static const CONF_PARSER connection_config[] = {
 	{ "start", FR_CONF_OFFSET(PW_TYPE_INTEGER, fr_connection_pool_t, start), "5" },
 	{ "min", FR_CONF_OFFSET(PW_TYPE_INTEGER, fr_connection_pool_t, min), "5" },
@@ -182,9 +312,117 @@ static const CONF_PARSER connection_config[] = {
 	{ "idle_timeout", FR_CONF_OFFSET(PW_TYPE_INTEGER, fr_connection_pool_t, idle_timeout), "60" },
 	{ "retry_delay", FR_CONF_OFFSET(PW_TYPE_INTEGER, fr_connection_pool_t, retry_delay), "1" },
 	{ "spread", FR_CONF_OFFSET(PW_TYPE_BOOLEAN, fr_connection_pool_t, spread), "no" },
+	{ "wait_timeout", FR_CONF_OFFSET(PW_TYPE_TIMEVAL, fr_connection_pool_t, wait_timeout), "0" },
+	{ "max_waiting", FR_CONF_OFFSET(PW_TYPE_INTEGER, fr_connection_pool_t, max_waiting), "0" },
 	{ NULL, -1, 0, NULL, NULL }
 };
 
+/** Add an idle connection to the idle stack
+ *
+ * @note Must be called by the owner of the connection, which will no longer own it.
+ *
+ * @param[in,out] pool to modify.
+ * @param[in] this Connection to add.
+ */
+static void fr_connection_idle_push(fr_connection_pool_t *pool, fr_connection_t *this)
+{
+	uint64_t head, new;
+
+	rad_assert(!this->in_use);
+
+	if (pool->spread) {
+		(void) fr_atomic_queue_push(pool->idle_queue, this);
+		return;
+	}
+
+	CP_LOCK(pool);
+	head = CP_LOAD(pool->idle_head);
+	do {
+		CP_STORE_RELAXED(pool->slot_next[this->slot], (uint32_t) head);
+		new = (((head >> 32) + 1) << 32) | (this->slot + 1);
+	} while (!CP_CAS(pool->idle_head, head, new));
+	CP_UNLOCK(pool);
+}
+
+/** Take an idle connection from the idle stack
+ *
+ * @param[in,out] pool to take the connection from.
+ * @return the most recently used idle connection (or the least recently
+ *	used, if 'spread' is set), or NULL if there are none.
+ */
+static fr_connection_t *fr_connection_idle_pop(fr_connection_pool_t *pool)
+{
+	uint64_t head, new;
+	uint32_t slot;
+
+	if (pool->spread) return fr_atomic_queue_pop(pool->idle_queue);
+
+	CP_LOCK(pool);
+	head = CP_LOAD(pool->idle_head);
+	do {
+		slot = (uint32_t) head;
+		if (!slot) {
+			CP_UNLOCK(pool);
+			return NULL;
+		}
+
+		new = (((head >> 32) + 1) << 32) | CP_LOAD_RELAXED(pool->slot_next[slot - 1]);
+	} while (!CP_CAS(pool->idle_head, head, new));
+	CP_UNLOCK(pool);
+
+	return pool->slots[slot - 1];
+}
+
+/** Count a time in one of the pool's histograms
+ *
+ * @param[in] pool the histogram belongs to.
+ * @param[in,out] hist to update.
+ * @param[in] start of the interval.
+ * @param[in] end of the interval.
+ */
+static void fr_connection_hist_add(UNUSED fr_connection_pool_t *pool, uint64_t *hist,
+				   struct timeval const *start, struct timeval const *end)
+{
+	struct timeval elapsed;
+	uint64_t usec;
+	int i;
+
+	timersub(end, start, &elapsed);
+	if (elapsed.tv_sec < 0) return;	/* clock went backwards */
+
+	usec = (elapsed.tv_sec * (uint64_t) 1000000) + elapsed.tv_usec;
+	for (i = 0; (i < (FR_CONNECTION_POOL_HIST_BUCKETS - 1)) && (usec >= 10); i++) usec /= 10;
+
+	CP_INC(pool, hist[i]);
+}
+
+/** Hand idle connections to any requests which are waiting for one
+ *
+ * @note Must be called with the mutex held.
+ *
+ * @param[in,out] pool to modify.
+ */
+static void fr_connection_wake(fr_connection_pool_t *pool)
+{
+	fr_connection_waiter_t *waiter;
+	fr_connection_t *this;
+
+	while (pool->wait_head) {
+		this = fr_connection_idle_pop(pool);
+		if (!this) break;
+
+		waiter = pool->wait_head;
+		pool->wait_head = waiter->next;
+		if (!pool->wait_head) pool->wait_tail = &pool->wait_head;
+		CP_DEC(pool, pool->num_waiting);
+
+		waiter->this = this;
+#ifdef HAVE_PTHREAD_H
+		pthread_cond_signal(&waiter->cond);
+#endif
+	}
+}
+
 /** Removes a connection from the connection list
  *
  * @note Must be called with the mutex held.
@@ -243,35 +481,6 @@ static void fr_connection_link_head(fr_connection_pool_t *pool,
 	}
 }
 
-/** Adds a connection to the tail of the connection list
- *
- * @note Must be called with the mutex held.
- *
- * @param[in,out] pool to modify.
- * @param[in] this Connection to add.
- */
-static void fr_connection_link_tail(fr_connection_pool_t *pool,
-				    fr_connection_t *this)
-{
-	rad_assert(pool != NULL);
-	rad_assert(this != NULL);
-	rad_assert(pool->head != this);
-	rad_assert(pool->tail != this);
-
-	if (pool->tail) {
-		pool->tail->next = this;
-	}
-	this->prev = pool->tail;
-	this->next = NULL;
-	pool->tail = this;
-	if (!pool->head) {
-		rad_assert(this->prev == NULL);
-		pool->head = this;
-	} else {
-		rad_assert(this->prev != NULL);
-	}
-}
-
 /** Send a connection pool trigger.
  *
  * @param[in] pool to send trigger for.
@@ -384,6 +593,8 @@ static fr_connection_t *fr_connection_spawn(fr_connection_pool_t *pool,
 	if (!conn) {
 		ERROR("%s: Opening connection failed (%" PRIu64 ")", pool->log_prefix, pool->count);
 
+		CP_INC(pool, pool->spawn_failures);
+		talloc_free(ctx);
 		pool->last_failed = now;
 		pool->spawning = false;
 		return NULL;
@@ -397,9 +608,27 @@ static fr_connection_t *fr_connection_spawn(fr_connection_pool_t *pool,
 
 	this = talloc_zero(pool, fr_connection_t);
 	if (!this) {
+	fail:
+		talloc_free(ctx);
+		pool->spawning = false;
 		pthread_mutex_unlock(&pool->mutex);
 		return NULL;
 	}
+
+	/*
+	 *	Spawning is serialised, and the pool isn't full, so
+	 *	there's always a free slot.
+	 */
+	for (this->slot = 0; this->slot < pool->max; this->slot++) {
+		if (!pool->slots[this->slot]) break;
+	}
+	if (this->slot == pool->max) {
+		talloc_free(this);
+		goto fail;
+	}
+	pool->slots[this->slot] = this;
+	CP_STORE_RELAXED(pool->handles[this->slot], conn);
+
 	fr_link_talloc_ctx_free(this, ctx);
 
 	this->created = now;
@@ -416,6 +645,13 @@ static fr_connection_t *fr_connection_spawn(fr_connection_pool_t *pool,
 	pool->next_delay = pool->cleanup_interval;
 	pool->last_failed = 0;
 
+	if (!in_use) {
+		fr_connection_idle_push(pool, this);
+		fr_connection_wake(pool);
+	}
+
+	memstats_alloc(MEMSTATS_CONNECTION, ctx);
+
 	pthread_mutex_unlock(&pool->mutex);
 
 	fr_connection_exec_trigger(pool, "open");
@@ -429,7 +665,8 @@ static fr_connection_t *fr_connection_spawn(fr_connection_pool_t *pool,
  * the connection, then frees memory allocated to the connection.
  *
  * @note Will call the 'close' trigger.
- * @note Must be called with the mutex held.
+ * @note Must be called with the mutex held, by the owner of the connection
+ *	 (i.e. it must not be on the idle stack).
  *
  * @param[in,out] pool to modify.
  * @param[in,out] this Connection to delete.
@@ -448,25 +685,36 @@ static void fr_connection_close(fr_connection_pool_t *pool,
 		this->in_use = false;
 
 		rad_assert(pool->active != 0);
-		pool->active--;
+		CP_DEC(pool, pool->active);
 	}
 
 	fr_connection_exec_trigger(pool, "close");
 
+	pool->slots[this->slot] = NULL;
+	CP_STORE_RELAXED(pool->handles[this->slot], NULL);
 	fr_connection_unlink(pool, this);
 	rad_assert(pool->num > 0);
 	pool->num--;
 	talloc_free(this);
+	memstats_free(MEMSTATS_CONNECTION, NULL);
+
+	/*
+	 *	There's now room for another connection, so the first
+	 *	waiter can stop waiting, and open one.
+	 */
+#ifdef HAVE_PTHREAD_H
+	if (pool->wait_head) pthread_cond_signal(&pool->wait_head->cond);
+#endif
 }
 
-/** Find a connection handle in the connection list
+/** Find the connection for a reserved connection handle
  *
- * Walks over the list of connections searching for a specified connection
- * handle and returns the first connection that contains that pointer.
+ * Searches the handles of all of the connections.  Only the pointers are
+ * compared, so this doesn't need the mutex.  The entry for a reserved
+ * handle can't change while we're looking at it, as only its owner can
+ * close or reconnect it.
  *
- * @note Will lock mutex and only release mutex if connection handle
- * is not found, so will usually return will mutex held.
- * @note Must be called with the mutex free.
+ * @note Returns with the mutex free.
  *
  * @param[in] pool to search in.
  * @param[in] conn handle to search for.
@@ -475,33 +723,29 @@ static void fr_connection_close(fr_connection_pool_t *pool,
  */
 static fr_connection_t *fr_connection_find(fr_connection_pool_t *pool, void *conn)
 {
+	uint32_t i;
 	fr_connection_t *this;
 
 	if (!pool || !conn) return NULL;
 
-	pthread_mutex_lock(&pool->mutex);
+	for (i = 0; i < pool->max; i++) {
+		if (CP_LOAD_RELAXED(pool->handles[i]) == conn) break;
+	}
+	if (i == pool->max) return NULL;
 
-	/*
-	 *	FIXME: This loop could be avoided if we passed a 'void
-	 *	**connection' instead.  We could use "offsetof" in
-	 *	order to find top of the parent structure.
-	 */
-	for (this = pool->head; this != NULL; this = this->next) {
-		if (this->connection == conn) {
-#ifdef PTHREAD_DEBUG
-			pthread_t pthread_id;
+	this = pool->slots[i];
 
-			pthread_id = pthread_self();
-			rad_assert(pthread_equal(this->pthread_id, pthread_id) != 0);
-#endif
+#ifdef PTHREAD_DEBUG
+	{
+		pthread_t pthread_id;
 
-			rad_assert(this->in_use == true);
-			return this;
-		}
+		pthread_id = pthread_self();
+		rad_assert(pthread_equal(this->pthread_id, pthread_id) != 0);
 	}
+#endif
 
-	pthread_mutex_unlock(&pool->mutex);
-	return NULL;
+	rad_assert(this->in_use == true);
+	return this;
 }
 
 /** Delete a connection from the connection pool.
@@ -524,11 +768,33 @@ int fr_connection_del(fr_connection_pool_t *pool, void *conn)
 
 	INFO("%s: Deleting connection (%" PRIu64 ")", pool->log_prefix, this->number);
 
+	pthread_mutex_lock(&pool->mutex);
 	fr_connection_close(pool, this);
 	fr_connection_pool_check(pool);
 	return 1;
 }
 
+/*
+ *	Remove a pool from the list of all pools, so that no other
+ *	thread can find it.
+ */
+static void fr_connection_pool_unlist(fr_connection_pool_t *pool)
+{
+	fr_connection_pool_t **last;
+
+	if (!pool->listed) return;
+
+	pthread_mutex_lock(&pool_list_mutex);
+	for (last = &pool_list_head; *last != NULL; last = &(*last)->list_next) {
+		if (*last != pool) continue;
+
+		*last = pool->list_next;
+		break;
+	}
+	pool->listed = false;
+	pthread_mutex_unlock(&pool_list_mutex);
+}
+
 /** Delete a connection pool
  *
  * Closes, unlinks and frees all connections in the connection pool, then frees
@@ -547,6 +813,12 @@ void fr_connection_pool_delete(fr_connection_pool_t *pool)
 
 	DEBUG("%s: Removing connection pool", pool->log_prefix);
 
+	/*
+	 *	Before taking the pool's mutex, as the list's mutex
+	 *	has to be taken first.
+	 */
+	fr_connection_pool_unlist(pool);
+
 	pthread_mutex_lock(&pool->mutex);
 
 	for (this = pool->head; this != NULL; this = next) {
@@ -679,13 +951,185 @@ fr_connection_pool_t *fr_connection_pool_module_init(CONF_SECTION *module,
 	return pool;
 }
 
+/*
+ *	Remove a pool from the list of all pools, and the list of
+ *	pools waiting for their 'start' connections.
+ */
+static int _fr_connection_pool_free(fr_connection_pool_t *pool)
+{
+	fr_connection_pool_t **last;
+
+	for (last = &pool_start_head; *last != NULL; last = &(*last)->start_next) {
+		if (*last != pool) continue;
+
+		*last = pool->start_next;
+		break;
+	}
+
+	fr_connection_pool_unlist(pool);
+
+	return 0;
+}
+
+/** Open the 'start' connections for a pool
+ *
+ * @param[in] pool to open connections for.
+ * @return 0 on success, -1 if any of the connections failed.
+ */
+static int fr_connection_pool_start(fr_connection_pool_t *pool)
+{
+	uint32_t i;
+	time_t now;
+
+	now = time(NULL);
+
+	/*
+	 *	The module may already have used (and so opened)
+	 *	connections while it was being instantiated.
+	 */
+	for (i = pool->num; i < pool->start; i++) {
+		if (!fr_connection_spawn(pool, now, false)) return -1;
+	}
+
+	fr_connection_exec_trigger(pool, "start");
+
+	return 0;
+}
+
+/** Defer opening 'start' connections until fr_connection_pool_start_all() is called
+ *
+ * Used by the server when it starts, so that the connections for all of
+ * the modules can be opened in parallel.
+ */
+void fr_connection_pool_defer_start(void)
+{
+	pool_start_deferred = true;
+}
+
+#ifdef HAVE_PTHREAD_H
+typedef struct pool_start_ctx_t {
+	pthread_mutex_t		mutex;
+	fr_connection_pool_t	**pools;	//!< Pools still to be started.
+	int			num;		//!< Number of pools.
+	int			next;		//!< The next pool to start.
+} pool_start_ctx_t;
+
+static void *pool_start_thread(void *arg)
+{
+	pool_start_ctx_t *ctx = arg;
+	fr_connection_pool_t *pool;
+
+	for (;;) {
+		pthread_mutex_lock(&ctx->mutex);
+		if (ctx->next == ctx->num) {
+			pthread_mutex_unlock(&ctx->mutex);
+			break;
+		}
+		pool = ctx->pools[ctx->next++];
+		pthread_mutex_unlock(&ctx->mutex);
+
+		if (fr_connection_pool_start(pool) < 0) pool->start_failed = true;
+	}
+
+	return NULL;
+}
+#endif
+
+/** Open the 'start' connections for all of the deferred pools
+ *
+ * Pools are started in parallel, using up to POOL_START_THREADS threads.
+ * Connections are opened in the same way as fr_connection_pool_init()
+ * would have opened them.
+ *
+ * @return 0 on success, -1 if any pool failed to open its connections.
+ */
+int fr_connection_pool_start_all(void)
+{
+	int i, num, rcode = 0;
+	fr_connection_pool_t *pool, **pools;
+
+	pool_start_deferred = false;
+
+	for (pool = pool_start_head, num = 0; pool != NULL; pool = pool->start_next) num++;
+	if (!num) return 0;
+
+	pools = talloc_array(NULL, fr_connection_pool_t *, num);
+	if (!pools) return -1;
+
+	for (pool = pool_start_head, i = 0; pool != NULL; pool = pool->start_next, i++) {
+		pools[i] = pool;
+		pool->start_failed = false;
+	}
+
+	DEBUG("Opening connections for %d connection pool(s)", num);
+
+#ifdef HAVE_PTHREAD_H
+	{
+		int num_threads;
+		pthread_t threads[POOL_START_THREADS];
+		pool_start_ctx_t ctx;
+
+		pthread_mutex_init(&ctx.mutex, NULL);
+		ctx.pools = pools;
+		ctx.num = num;
+		ctx.next = 0;
+
+		num_threads = (num < POOL_START_THREADS) ? num : POOL_START_THREADS;
+		for (i = 0; i < num_threads; i++) {
+			if (pthread_create(&threads[i], NULL, pool_start_thread, &ctx) != 0) {
+				ERROR("Failed creating thread to open connections: %s", fr_syserror(errno));
+				break;
+			}
+		}
+		num_threads = i;
+
+		/*
+		 *	Do our share, too.  Or all of it, if we
+		 *	couldn't create any threads.
+		 */
+		(void) pool_start_thread(&ctx);
+
+		for (i = 0; i < num_threads; i++) {
+			pthread_join(threads[i], NULL);
+		}
+
+		pthread_mutex_destroy(&ctx.mutex);
+	}
+#else
+	for (i = 0; i < num; i++) {
+		if (fr_connection_pool_start(pools[i]) < 0) pools[i]->start_failed = true;
+	}
+#endif
+
+	for (i = 0; i < num; i++) {
+		if (!pools[i]->start_failed) continue;
+
+		cf_log_err_cs(pools[i]->cs, "%s: Failed opening initial connections", pools[i]->log_prefix);
+		rcode = -1;
+	}
+
+	/*
+	 *	The pools are no longer waiting.
+	 */
+	for (i = 0; i < num; i++) {
+		pools[i]->start_next = NULL;
+	}
+	pool_start_head = NULL;
+
+	talloc_free(pools);
+
+	return rcode;
+}
+
 /** Create a new connection pool
  *
  * Allocates structures used by the connection pool, initialises the various
  * configuration options and counters, and sets the callback functions.
  *
  * Will also spawn the number of connections specified by the 'start'
- * configuration options.
+ * configuration options.  If fr_connection_pool_defer_start() has been
+ * called, the connections are instead opened by
+ * fr_connection_pool_start_all().
  *
  * @note Will call the 'start' trigger.
  *
@@ -739,13 +1183,26 @@ fr_connection_pool_t *fr_connection_pool_init(CONF_SECTION *parent,
 	pool->alive = a;
 
 	pool->head = pool->tail = NULL;
+	pool->wait_tail = &pool->wait_head;
+
+	pthread_mutex_lock(&pool_list_mutex);
+	pool->list_next = pool_list_head;
+	pool_list_head = pool;
+	pool->listed = true;
+	pthread_mutex_unlock(&pool_list_mutex);
+	talloc_set_destructor(pool, _fr_connection_pool_free);
 
 	pool->log_prefix = log_prefix ? talloc_typed_strdup(pool, log_prefix) : "core";
+	pool->name = cf_section_name2(parent);
+	if (!pool->name) pool->name = cf_section_name1(parent);
 	pool->trigger_prefix = trigger_prefix ?
 					talloc_typed_strdup(pool, trigger_prefix) : "";
 
 #ifdef HAVE_PTHREAD_H
 	pthread_mutex_init(&pool->mutex, NULL);
+#  ifndef __ATOMIC_ACQUIRE
+	pthread_mutex_init(&pool->idle_mutex, NULL);
+#  endif
 #endif
 
 	DEBUG("%s: Initialising connection pool", pool->log_prefix);
@@ -778,6 +1235,16 @@ fr_connection_pool_t *fr_connection_pool_init(CONF_SECTION *parent,
 		pool->cleanup_interval = pool->idle_timeout;
 	}
 
+	pool->slots = talloc_zero_array(pool, fr_connection_t *, pool->max);
+	pool->handles = talloc_zero_array(pool, void *, pool->max);
+	pool->slot_next = talloc_zero_array(pool, uint32_t, pool->max);
+	if (!pool->slots || !pool->handles || !pool->slot_next) goto error;
+
+	if (pool->spread) {
+		pool->idle_queue = fr_atomic_queue_create(pool, pool->max);
+		if (!pool->idle_queue) goto error;
+	}
+
 	/*
 	 *	Don't open any connections.  Instead, force the limits
 	 *	to only 1 connection.
@@ -788,6 +1255,16 @@ fr_connection_pool_t *fr_connection_pool_init(CONF_SECTION *parent,
 		return pool;
 	}
 
+	/*
+	 *	Open the connections later, in parallel with the
+	 *	other pools.
+	 */
+	if (pool_start_deferred) {
+		pool->start_next = pool_start_head;
+		pool_start_head = pool;
+		return pool;
+	}
+
 	/*
 	 *	Create all of the connections, unless the admin says
 	 *	not to.
@@ -810,27 +1287,24 @@ fr_connection_pool_t *fr_connection_pool_init(CONF_SECTION *parent,
 /** Check whether a connection needs to be removed from the pool
  *
  * Will verify that the connection is within idle_timeout, max_uses, and
- * lifetime values. If it is not, the connection will be closed.
+ * lifetime values.
  *
- * @note Will only close connections not in use.
- * @note Must be called with the mutex held.
+ * @note The caller must own the connection, i.e. it must have taken it
+ *	 off of the idle stack.  Doesn't need the mutex, as the connection
+ *	 is closed by the caller.
  *
- * @param[in,out] pool to modify.
- * @param[in,out] this Connection to manage.
+ * @param[in] pool the connection is in.
+ * @param[in] this Connection to check.
  * @param[in] now Current time.
- * @return 0 if the connection was closed, otherwise 1.
+ * @return true if the connection should be closed, otherwise false.
  */
-static int fr_connection_manage(fr_connection_pool_t *pool,
-				fr_connection_t *this,
-				time_t now)
+static bool fr_connection_expired(fr_connection_pool_t *pool,
+				  fr_connection_t *this,
+				  time_t now)
 {
 	rad_assert(pool != NULL);
 	rad_assert(this != NULL);
-
-	/*
-	 *	Don't terminated in-use connections
-	 */
-	if (this->in_use) return 1;
+	rad_assert(!this->in_use);
 
 	if ((pool->max_uses > 0) &&
 	    (this->num_uses >= pool->max_uses)) {
@@ -840,8 +1314,7 @@ static int fr_connection_manage(fr_connection_pool_t *pool,
 		if (pool->num <= pool->min) {
 			RATE_LIMIT(WARN("%s: You probably need to lower \"min\"", pool->log_prefix));
 		}
-		fr_connection_close(pool, this);
-		return 0;
+		return true;
 	}
 
 	if ((pool->lifetime > 0) &&
@@ -857,7 +1330,7 @@ static int fr_connection_manage(fr_connection_pool_t *pool,
 		goto do_delete;
 	}
 
-	return 1;
+	return false;
 }
 
 
@@ -877,21 +1350,37 @@ static int fr_connection_manage(fr_connection_pool_t *pool,
  */
 static int fr_connection_pool_check(fr_connection_pool_t *pool)
 {
-	uint32_t spawn, idle, extra;
+	uint32_t spawn, idle, extra, i;
 	time_t now = time(NULL);
-	fr_connection_t *this, *next;
+	fr_connection_t *this, **idle_list;
 
 	if (pool->last_checked == now) {
 		pthread_mutex_unlock(&pool->mutex);
 		return 1;
 	}
 
+	/*
+	 *	Take all of the idle connections off of the stack, so
+	 *	that we own them, and can close them.  Any thread which
+	 *	finds the stack empty takes the mutex, and so waits
+	 *	until they've been put back.
+	 */
+	idle_list = talloc_array(NULL, fr_connection_t *, pool->max);
+	if (!idle_list) {
+		pthread_mutex_unlock(&pool->mutex);
+		return 1;
+	}
+
+	idle = 0;
+	while ((idle < pool->max) && ((this = fr_connection_idle_pop(pool)) != NULL)) {
+		idle_list[idle++] = this;
+	}
+
 	/*
 	 *	Some idle connections are OK, if they're within the
 	 *	configured "spare" range.  Any extra connections
 	 *	outside of that range can be closed.
 	 */
-	idle = pool->num - pool->active;
 	if (idle <= pool->spare) {
 		extra = 0;
 	} else {
@@ -952,36 +1441,24 @@ static int fr_connection_pool_check(fr_connection_pool_t *pool)
 		/* leave extra alone from above */
 	}
 
-	if (spawn) {
-		INFO("%s: %i of %u connections in use.  Need more spares", pool->log_prefix, pool->active, pool->num);
-		pthread_mutex_unlock(&pool->mutex);
-		fr_connection_spawn(pool, now, false); /* ignore return code */
-		pthread_mutex_lock(&pool->mutex);
-	}
-
 	/*
 	 *	We haven't spawned connections in a while, and there
 	 *	are too many spare ones.  Close the one which has been
 	 *	unused for the longest.
 	 */
 	if (extra && (now >= (pool->last_spawned + pool->delay_interval))) {
-		fr_connection_t *found;
+		uint32_t found = 0;
 
-		found = NULL;
-		for (this = pool->tail; this != NULL; this = this->prev) {
-			if (this->in_use) continue;
+		rad_assert(idle > 0);
 
-			if (!found ||
-			   (this->last_used < found->last_used)) {
-				found = this;
-			}
+		for (i = 1; i < idle; i++) {
+			if (idle_list[i]->last_used < idle_list[found]->last_used) found = i;
 		}
 
-		rad_assert(found != NULL);
-
 		INFO("%s: Closing connection (%" PRIu64 "), from %d unused connections", pool->log_prefix,
-		     found->number, extra);
-		fr_connection_close(pool, found);
+		     idle_list[found]->number, extra);
+		fr_connection_close(pool, idle_list[found]);
+		idle_list[found] = NULL;
 
 		/*
 		 *	Decrease the delay for the next time we clean
@@ -993,20 +1470,136 @@ static int fr_connection_pool_check(fr_connection_pool_t *pool)
 	}
 
 	/*
-	 *	Pass over all of the connections in the pool, limiting
-	 *	lifetime, idle time, max requests, etc.
+	 *	Pass over all of the idle connections, limiting
+	 *	lifetime, idle time, max requests, etc.  The ones
+	 *	which are left go back on the stack in the same order,
+	 *	so the most recently used is still on top.
 	 */
-	for (this = pool->head; this != NULL; this = next) {
-		next = this->next;
-		fr_connection_manage(pool, this, now);
+	for (i = idle; i > 0; i--) {
+		this = idle_list[pool->spread ? (idle - i) : (i - 1)];
+		if (!this) continue;
+
+		if (fr_connection_expired(pool, this, now)) {
+			fr_connection_close(pool, this);
+			continue;
+		}
+
+		fr_connection_idle_push(pool, this);
 	}
+	talloc_free(idle_list);
+	fr_connection_wake(pool);
 
 	pool->last_checked = now;
+
+	/*
+	 *	Spawn after the idle connections have been put back,
+	 *	as other threads can't get one while we're spawning.
+	 */
+	if (spawn) {
+		INFO("%s: %i of %u connections in use.  Need more spares", pool->log_prefix, pool->active, pool->num);
+		pthread_mutex_unlock(&pool->mutex);
+		fr_connection_spawn(pool, now, false); /* ignore return code */
+		return 1;
+	}
+
 	pthread_mutex_unlock(&pool->mutex);
 
 	return 1;
 }
 
+#ifdef HAVE_PTHREAD_H
+/** Wait for another thread to release a connection
+ *
+ * Requests wait in a FIFO queue, and released connections are handed to
+ * the request at the head of the queue.  A request stops waiting when it
+ * has been given a connection, when there is room in the pool for a new
+ * connection, or when 'wait_timeout' has passed.
+ *
+ * @note Must be called with the mutex held.  Returns with the mutex free.
+ *
+ * @param[in,out] pool to wait on.
+ * @param[out] out the connection we were given.
+ * @return 1 if we were given a connection, 0 if there's room to spawn one,
+ *	-1 on timeout.
+ */
+static int fr_connection_wait(fr_connection_pool_t *pool, fr_connection_t **out)
+{
+	fr_connection_waiter_t waiter, **last;
+	struct timeval start, end;
+	struct timespec when;
+	uint32_t waited;
+	int rcode = 0;
+
+	memset(&waiter, 0, sizeof(waiter));
+	pthread_cond_init(&waiter.cond, NULL);
+
+	*pool->wait_tail = &waiter;
+	pool->wait_tail = &waiter.next;
+	CP_INC(pool, pool->num_waiting);
+	pool->waits++;
+
+	/*
+	 *	A connection may have been released after we last
+	 *	looked at the idle stack, but before we joined the
+	 *	queue.
+	 */
+	CP_FENCE();
+	fr_connection_wake(pool);
+
+	gettimeofday(&start, NULL);
+	timeradd(&start, &pool->wait_timeout, &end);
+	when.tv_sec = end.tv_sec;
+	when.tv_nsec = end.tv_usec * 1000;
+
+	while (!waiter.this && (pool->num == pool->max) && (rcode != ETIMEDOUT)) {
+		rcode = pthread_cond_timedwait(&waiter.cond, &pool->mutex, &when);
+	}
+
+	/*
+	 *	Connections are only handed to the waiter at the head of
+	 *	the wait queue, and fr_connection_wake() removes it.
+	 */
+	if (!waiter.this) {
+		for (last = &pool->wait_head; *last != NULL; last = &(*last)->next) {
+			if (*last != &waiter) continue;
+
+			*last = waiter.next;
+			if (!*last) pool->wait_tail = last;
+			break;
+		}
+		CP_DEC(pool, pool->num_waiting);
+
+		/*
+		 *	We may have been the next in line for a
+		 *	connection which was closed.
+		 */
+		if (pool->wait_head && (pool->num < pool->max)) pthread_cond_signal(&pool->wait_head->cond);
+	}
+
+	gettimeofday(&end, NULL);
+	timersub(&end, &start, &end);
+	waited = (end.tv_sec * 1000000) + end.tv_usec;
+
+	pool->wait_time += waited;
+	if (waited > pool->max_wait_time) pool->max_wait_time = waited;
+
+	if (waiter.this) {
+		rcode = 1;
+	} else if (pool->num < pool->max) {
+		rcode = 0;
+	} else {
+		pool->wait_timeouts++;
+		rcode = -1;
+	}
+
+	pthread_mutex_unlock(&pool->mutex);
+	pthread_cond_destroy(&waiter.cond);
+
+	*out = waiter.this;
+	return rcode;
+}
+#endif
+
 /** Get a connection from the connection pool
  *
  * @param[in,out] pool to reserve the connection from.
@@ -1016,20 +1609,61 @@ static int fr_connection_pool_check(fr_connection_pool_t *pool)
 static void *fr_connection_get_internal(fr_connection_pool_t *pool, int spawn)
 {
 	time_t now;
-	fr_connection_t *this, *next;
+	struct timeval start;
+	fr_connection_t *this;
 
 	if (!pool) return NULL;
 
+	gettimeofday(&start, NULL);
+	now = start.tv_sec;
+
+	/*
+	 *	Idle connections are taken without the mutex.  Once
+	 *	we've taken one, nothing else can close it, so we only
+	 *	need the mutex if it has expired.
+	 */
+	while ((this = fr_connection_idle_pop(pool)) != NULL) {
+		if (!fr_connection_expired(pool, this, now)) goto do_return;
+
+		pthread_mutex_lock(&pool->mutex);
+		fr_connection_close(pool, this);
+		pthread_mutex_unlock(&pool->mutex);
+	}
+
 	pthread_mutex_lock(&pool->mutex);
 
-	now = time(NULL);
-	for (this = pool->head; this != NULL; this = next) {
-		next = this->next;
-		if (!fr_connection_manage(pool, this, now)) continue;
+	/*
+	 *	The stack may have been empty because another thread was
+	 *	managing the pool.  It has finished now that we have the
+	 *	mutex.
+	 */
+	this = fr_connection_idle_pop(pool);
+	if (this) {
+		pthread_mutex_unlock(&pool->mutex);
+		goto do_return;
+	}
 
-		if (!this->in_use) goto do_return;
+#ifdef HAVE_PTHREAD_H
+	/*
+	 *	Wait our turn for a connection, instead of failing.
+	 */
+	if ((pool->num == pool->max) && spawn && timerisset(&pool->wait_timeout) &&
+	    (!pool->max_waiting || (pool->num_waiting < pool->max_waiting))) {
+		switch (fr_connection_wait(pool, &this)) {
+		case 1:
+			goto do_return;
+
+		case 0:
+			pthread_mutex_lock(&pool->mutex);
+			break;
+
+		default:
+			ERROR("%s: No connections available after waiting %d.%06ds", pool->log_prefix,
+			      (int) pool->wait_timeout.tv_sec, (int) pool->wait_timeout.tv_usec);
+			return NULL;
+		}
 	}
-	rad_assert(pool->active == pool->num);
+#endif
 
 	if (pool->num == pool->max) {
 		bool complain = false;
@@ -1059,18 +1693,20 @@ static void *fr_connection_get_internal(fr_connection_pool_t *pool, int spawn)
 	     pool->active, pool->num);
 	this = fr_connection_spawn(pool, now, true); /* MY connection! */
 	if (!this) return NULL;
-	pthread_mutex_lock(&pool->mutex);
 
 do_return:
-	pool->active++;
+	CP_INC(pool, pool->active);
 	this->num_uses++;
 	this->last_used = now;
 	this->in_use = true;
 
+	this->requested = start;
+	gettimeofday(&this->acquired, NULL);
+	fr_connection_hist_add(pool, pool->wait_hist, &start, &this->acquired);
+
 #ifdef PTHREAD_DEBUG
 	this->pthread_id = pthread_self();
 #endif
-	pthread_mutex_unlock(&pool->mutex);
 
 	DEBUG("%s: Reserved connection (%" PRIu64 ")", pool->log_prefix, this->number);
 
@@ -1097,7 +1733,25 @@ do_return:
  */
 void *fr_connection_get(fr_connection_pool_t *pool)
 {
-	return fr_connection_get_internal(pool, true);
+	void *conn;
+	REQUEST *request;
+	struct timeval start;
+
+	request = trace_request_get();
+	if (!request) return fr_connection_get_internal(pool, true);
+
+	/*
+	 *	Successful gets are traced when the connection is
+	 *	released.
+	 */
+	gettimeofday(&start, NULL);
+	conn = fr_connection_get_internal(pool, true);
+	if (!conn && pool) {
+		(void) trace_span_add(request, TRACE_SPAN_CONNECTION, pool->name ? pool->name : pool->log_prefix,
+				      &start, NULL, true);
+	}
+
+	return conn;
 }
 
 /** Get the number of connections currently in the pool
@@ -1110,6 +1764,91 @@ int fr_connection_get_num(fr_connection_pool_t *pool)
 	return pool->num;
 }
 
+
+/** Get the state of a connection pool
+ *
+ * @param[in] pool to get the state of.
+ * @param[out] stats where to write the state.
+ */
+void fr_connection_pool_stats(fr_connection_pool_t *pool, fr_connection_pool_stats_t *stats)
+{
+	int i;
+
+	pthread_mutex_lock(&pool->mutex);
+	stats->name = pool->name;
+	stats->log_prefix = pool->log_prefix;
+	stats->num = pool->num;
+	stats->active = CP_LOAD(pool->active);
+	stats->max = pool->max;
+	stats->waiting = CP_LOAD(pool->num_waiting);
+	stats->waits = pool->waits;
+	stats->wait_timeouts = pool->wait_timeouts;
+	stats->wait_time = pool->wait_time;
+	stats->max_wait_time = pool->max_wait_time;
+	stats->spawn_failures = CP_LOAD_RELAXED(pool->spawn_failures);
+	stats->reconnects = pool->reconnects;
+
+	for (i = 0; i < FR_CONNECTION_POOL_HIST_BUCKETS; i++) {
+		stats->wait_hist[i] = CP_LOAD_RELAXED(pool->wait_hist[i]);
+		stats->hold_hist[i] = CP_LOAD_RELAXED(pool->hold_hist[i]);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+/** Get the state of all of the connection pools, or of the pool owned by a module
+ *
+ * The pools may be freed by a HUP as soon as this function returns, so
+ * the state is copied, including the names.
+ *
+ * @param[in] ctx to allocate the array in.
+ * @param[in] name of the module instance, or NULL for all of the pools.
+ * @param[out] out where to write the array of states.  Set to NULL if there
+ *	are no pools.
+ * @return the number of pools, or -1 on error.
+ */
+int fr_connection_pool_stats_all(TALLOC_CTX *ctx, char const *name, fr_connection_pool_stats_t **out)
+{
+	fr_connection_pool_t *pool;
+	fr_connection_pool_stats_t *stats;
+	int num = 0;
+
+	*out = NULL;
+
+	pthread_mutex_lock(&pool_list_mutex);
+	for (pool = pool_list_head; pool != NULL; pool = pool->list_next) {
+		if (name && (!pool->name || (strcmp(pool->name, name) != 0))) continue;
+
+		num++;
+		if (name) break;
+	}
+
+	if (!num) {
+		pthread_mutex_unlock(&pool_list_mutex);
+		return 0;
+	}
+
+	stats = talloc_array(ctx, fr_connection_pool_stats_t, num);
+	if (!stats) {
+		pthread_mutex_unlock(&pool_list_mutex);
+		return -1;
+	}
+
+	num = 0;
+	for (pool = pool_list_head; pool != NULL; pool = pool->list_next) {
+		if (name && (!pool->name || (strcmp(pool->name, name) != 0))) continue;
+
+		fr_connection_pool_stats(pool, &stats[num]);
+		if (stats[num].name) stats[num].name = talloc_typed_strdup(stats, stats[num].name);
+		if (stats[num].log_prefix) stats[num].log_prefix = talloc_typed_strdup(stats, stats[num].log_prefix);
+		num++;
+		if (name) break;
+	}
+	pthread_mutex_unlock(&pool_list_mutex);
+
+	*out = stats;
+	return num;
+}
+
 /** Release a connection
  *
  * Will mark a connection as unused and decrement the number of active
@@ -1122,47 +1861,67 @@ int fr_connection_get_num(fr_connection_pool_t *pool)
 void fr_connection_release(fr_connection_pool_t *pool, void *conn)
 {
 	fr_connection_t *this;
+	struct timeval now;
+	REQUEST *request;
 
 	this = fr_connection_find(pool, conn);
 	if (!this) return;
 
-	this->in_use = false;
+	gettimeofday(&now, NULL);
+	fr_connection_hist_add(pool, pool->hold_hist, &this->acquired, &now);
 
 	/*
-	 *	Determines whether the last used connection gets
-	 *	re-used first.
+	 *	The span covers waiting for the connection, and the
+	 *	time the backend spent on the request.
 	 */
-	if (pool->spread) {
-		/*
-		 *	Put it at the tail of the list, so
-		 *	that it will get re-used last.
-		 */
-		if (this != pool->tail) {
-			fr_connection_unlink(pool, this);
-			fr_connection_link_tail(pool, this);
-		}
-	} else {
-		/*
-		 *	Put it at the head of the list, so
-		 *	that it will get re-used quickly.
-		 */
-		if (this != pool->head) {
-			fr_connection_unlink(pool, this);
-			fr_connection_link_head(pool, this);
-		}
+	request = trace_request_get();
+	if (request) {
+		int span;
+		struct timeval wait;
+
+		timersub(&this->acquired, &this->requested, &wait);
+		span = trace_span_add(request, TRACE_SPAN_CONNECTION, pool->name ? pool->name : pool->log_prefix,
+				      &this->requested, &now, false);
+		trace_span_attr(request, span, "freeradius.connection", "%" PRIu64, this->number);
+		trace_span_attr(request, span, "freeradius.connection.wait", "%d.%06ds",
+				(int) wait.tv_sec, (int) wait.tv_usec);
 	}
 
+	this->in_use = false;
+
 	rad_assert(pool->active != 0);
-	pool->active--;
+	CP_DEC(pool, pool->active);
 
 	DEBUG("%s: Released connection (%" PRIu64 ")", pool->log_prefix, this->number);
 
+	/*
+	 *	The idle stack determines whether the last used
+	 *	connection gets re-used first.  If 'spread' is set,
+	 *	it's a queue, and the connection will be re-used last.
+	 */
+	fr_connection_idle_push(pool, this);
+
+	/*
+	 *	Hand the connection to the next request which is waiting
+	 *	for one.  The fence pairs with the one in
+	 *	fr_connection_wait().
+	 */
+	CP_FENCE();
+	if (CP_LOAD(pool->num_waiting) > 0) {
+		pthread_mutex_lock(&pool->mutex);
+		fr_connection_wake(pool);
+		pthread_mutex_unlock(&pool->mutex);
+	}
+
 	/*
 	 *	We mirror the "spawn on get" functionality by having
-	 *	"delete on release".  If there are too many spare
-	 *	connections, go manage the pool && clean some up.
+	 *	"delete on release".  The pool is managed at most once
+	 *	a second, and if another thread is already doing it,
+	 *	we don't wait.
 	 */
-	fr_connection_pool_check(pool);
+	if ((pool->last_checked != now.tv_sec) && (pthread_mutex_trylock(&pool->mutex) == 0)) {
+		fr_connection_pool_check(pool);
+	}
 }
 
 /** Reconnect a suspected inviable connection
@@ -1200,12 +1959,10 @@ void *fr_connection_reconnect(fr_connection_pool_t *pool, void *conn)
 
 	if (!pool || !conn) return NULL;
 
-	/*
-	 *	If fr_connection_find is successful the pool is now locked
-	 */
 	this = fr_connection_find(pool, conn);
 	if (!this) return NULL;
 
+	pthread_mutex_lock(&pool->mutex);
 
 	conn_number = this->number;
 
@@ -1248,6 +2005,8 @@ void *fr_connection_reconnect(fr_connection_pool_t *pool, void *conn)
 
 	fr_connection_exec_trigger(pool, "close");
 	this->connection = new_conn;
+	CP_STORE_RELAXED(pool->handles[this->slot], new_conn);
+	pool->reconnects++;
 	pthread_mutex_unlock(&pool->mutex);
 
 	return new_conn;
@@ -26,7 +26,20 @@ RCSID("$Id$")
 #include <crypt.h>
 #endif
 
-#ifdef HAVE_PTHREAD_H
+#ifdef HAVE_CRYPT_R
+/*
+ *	Each thread has its own crypt_data, so checks by different
+ *	threads don't have to wait for each other.  Expensive schemes
+ *	(e.g. SHA-512 crypt) can then use every CPU.
+ */
+fr_thread_local_setup(struct crypt_data *, fr_crypt_data)	/* macro */
+
+static void _fr_crypt_data_free(void *arg)
+{
+	free(arg);
+}
+
+#elif defined(HAVE_PTHREAD_H)
 #include <pthread.h>
 
 /*
@@ -49,7 +62,29 @@ int fr_crypt_check(char const *key, char const *crypted)
 	char *passwd;
 	int cmp = 0;
 
-#ifdef HAVE_PTHREAD_H
+#ifdef HAVE_CRYPT_R
+	struct crypt_data *data;
+
+	data = fr_thread_local_init(fr_crypt_data, _fr_crypt_data_free);
+	if (!data) {
+		/*
+		 *	malloc is thread safe, talloc is not.  The
+		 *	structure must start out zeroed.
+		 */
+		data = calloc(1, sizeof(*data));
+		if (!data) return -1;
+
+		if (fr_thread_local_set(fr_crypt_data, data) != 0) {
+			free(data);
+			return -1;
+		}
+	}
+
+	passwd = crypt_r(key, crypted, data);
+	if (passwd) cmp = strcmp(crypted, passwd);
+
+#else
+#  ifdef HAVE_PTHREAD_H
 	/*
 	 *	Ensure we're thread-safe, as crypt() isn't.
 	 */
@@ -59,7 +94,7 @@ int fr_crypt_check(char const *key, char const *crypted)
 	}
 
 	pthread_mutex_lock(&fr_crypt_mutex);
-#endif
+#  endif
 
 	passwd = crypt(key, crypted);
 
@@ -72,8 +107,9 @@ int fr_crypt_check(char const *key, char const *crypted)
 		cmp = strcmp(crypted, passwd);
 	}
 
-#ifdef HAVE_PTHREAD_H
+#  ifdef HAVE_PTHREAD_H
 	pthread_mutex_unlock(&fr_crypt_mutex);
+#  endif
 #endif
 
 	/*
@@ -39,6 +39,14 @@ RCSID("$Id$")
 
 #include <fcntl.h>
 
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+#ifdef WITH_DETAIL_COMPRESSION
+#include <zlib.h>
+#endif
+
 #ifdef WITH_DETAIL
 
 extern bool check_config;
@@ -59,6 +67,98 @@ static FR_NAME_NUMBER state_names[] = {
 };
 
 
+#ifdef WITH_DETAIL_THREAD
+/*
+ *	Sent by detail_send() to the reader thread, when a request
+ *	for one of the entries in the window is done.
+ */
+typedef struct detail_ack_t {
+	uint32_t	counter;	//!< Of the packet, as set by detail_packet().
+	bool		replied;
+	int		rtt;		//!< If it was replied to.
+} detail_ack_t;
+
+/*
+ *	Recover the counter which detail_packet() encoded into the
+ *	packet ID, ports and destination address.
+ */
+static uint32_t detail_counter(RADIUS_PACKET const *packet)
+{
+	return ((uint32_t) packet->id & 0xff) |
+		((uint32_t) ((packet->src_port - 1024) & 0xff) << 8) |
+		((uint32_t) ((packet->dst_port - 1024) & 0xff) << 16) |
+		((uint32_t) (ntohl(packet->dst_ipaddr.ipaddr.ip4addr.s_addr) & 0xff) << 24);
+}
+#endif
+
+/*
+ *	Update the RTT estimates with the time it took to process an
+ *	entry, and calculate the delay before reading the next one.
+ */
+static void detail_rtt(listen_detail_t *data, int rtt)
+{
+	struct timeval now;
+
+	/*
+	 *	We call gettimeofday a lot.  But it should be OK,
+	 *	because there's nothing else to do.
+	 */
+	gettimeofday(&now, NULL);
+
+	/*
+	 *	If we haven't sent a packet in the last second, reset
+	 *	the RTT.
+	 */
+	now.tv_sec -= 1;
+	if (timercmp(&data->last_packet, &now, <)) {
+		data->has_rtt = false;
+	}
+	now.tv_sec += 1;
+
+	/*
+	 *	We keep smoothed round trip time (SRTT), but not round
+	 *	trip timeout (RTO).  We use SRTT to calculate a rough
+	 *	load factor.
+	 *
+	 *	If we're proxying, the RTT is our processing time,
+	 *	plus the network delay there and back, plus the time
+	 *	on the other end to process the packet.  Ideally, we
+	 *	should remove the network delays from the RTT, but we
+	 *	don't know what they are.
+	 *
+	 *	So, to be safe, we over-estimate the total cost of
+	 *	processing the packet.
+	 */
+	if (!data->has_rtt) {
+		data->has_rtt = true;
+		data->srtt = rtt;
+		data->rttvar = rtt / 2;
+
+	} else {
+		data->rttvar -= data->rttvar >> 2;
+		data->rttvar += (data->srtt - rtt);
+		data->srtt -= data->srtt >> 3;
+		data->srtt += rtt >> 3;
+	}
+
+	/*
+	 *	Calculate the time we wait before sending the next
+	 *	packet.
+	 *
+	 *	rtt / (rtt + delay) = load_factor / 100
+	 */
+	data->delay_time = (data->srtt * (100 - data->load_factor)) / (data->load_factor);
+
+	/*
+	 *	Cap delay at no less than 4 packets/s.  If the
+	 *	end system can't handle this, then it's very
+	 *	broken.
+	 */
+	if (data->delay_time > (USEC / 4)) data->delay_time= USEC / 4;
+
+	data->last_packet = now;
+}
+
 /*
  *	If we're limiting outstanding packets, then mark the response
  *	as being sent.
@@ -66,9 +166,10 @@ static FR_NAME_NUMBER state_names[] = {
 int detail_send(rad_listen_t *listener, REQUEST *request)
 {
 #ifdef WITH_DETAIL_THREAD
-	char c = 0;
+	detail_ack_t ack;
 #endif
 	listen_detail_t *data = listener->data;
+	int rtt = 0;
 
 	rad_assert(request->listener == listener);
 	rad_assert(listener->send == detail_send);
@@ -78,96 +179,50 @@ int detail_send(rad_listen_t *listener, REQUEST *request)
 	 *	caller it's OK to read more "detail" file stuff.
 	 */
 	if (request->reply->code == 0) {
-		data->delay_time = data->retry_interval * USEC;
-		data->signal = 1;
-		data->state = STATE_NO_REPLY;
-
 		RDEBUG("Detail - No response to request.  Will retry in %d seconds",
 		       data->retry_interval);
 	} else {
-		int rtt;
 		struct timeval now;
-		/*
-		 *	We call gettimeofday a lot.  But it should be OK,
-		 *	because there's nothing else to do.
-		 */
-		gettimeofday(&now, NULL);
-
-		/*
-		 *	If we haven't sent a packet in the last second, reset
-		 *	the RTT.
-		 */
-		now.tv_sec -= 1;
-		if (timercmp(&data->last_packet, &now, <)) {
-			data->has_rtt = false;
-		}
-		now.tv_sec += 1;
 
-		/*
-		 *	Only one detail packet may be outstanding at a time,
-		 *	so it's safe to update some entries in the detail
-		 *	structure.
-		 *
-		 *	We keep smoothed round trip time (SRTT), but not round
-		 *	trip timeout (RTO).  We use SRTT to calculate a rough
-		 *	load factor.
-		 */
+		gettimeofday(&now, NULL);
 		rtt = now.tv_sec - request->packet->timestamp.tv_sec;
 		rtt *= USEC;
 		rtt += now.tv_usec;
 		rtt -= request->packet->timestamp.tv_usec;
+	}
 
-		/*
-		 *	If we're proxying, the RTT is our processing time,
-		 *	plus the network delay there and back, plus the time
-		 *	on the other end to process the packet.  Ideally, we
-		 *	should remove the network delays from the RTT, but we
-		 *	don't know what they are.
-		 *
-		 *	So, to be safe, we over-estimate the total cost of
-		 *	processing the packet.
-		 */
-		if (!data->has_rtt) {
-			data->has_rtt = true;
-			data->srtt = rtt;
-			data->rttvar = rtt / 2;
-
-		} else {
-			data->rttvar -= data->rttvar >> 2;
-			data->rttvar += (data->srtt - rtt);
-			data->srtt -= data->srtt >> 3;
-			data->srtt += rtt >> 3;
-		}
-
-		/*
-		 *	Calculate the time we wait before sending the next
-		 *	packet.
-		 *
-		 *	rtt / (rtt + delay) = load_factor / 100
-		 */
-		data->delay_time = (data->srtt * (100 - data->load_factor)) / (data->load_factor);
+#ifdef WITH_DETAIL_THREAD
+	/*
+	 *	Many entries may be outstanding, so the reader thread
+	 *	does all of the bookkeeping.
+	 */
+	ack.counter = detail_counter(request->packet);
+	ack.replied = (request->reply->code != 0);
+	ack.rtt = rtt;
 
-		/*
-		 *	Cap delay at no less than 4 packets/s.  If the
-		 *	end system can't handle this, then it's very
-		 *	broken.
-		 */
-		if (data->delay_time > (USEC / 4)) data->delay_time= USEC / 4;
+	if (write(data->child_pipe[1], &ack, sizeof(ack)) < 0) {
+		ERROR("Failed writing ack to reader thread: %s", fr_syserror(errno));
+	}
+#else
+	/*
+	 *	Only one detail packet may be outstanding at a time,
+	 *	so it's safe to update some entries in the detail
+	 *	structure.
+	 */
+	if (request->reply->code == 0) {
+		data->delay_time = data->retry_interval * USEC;
+		data->state = STATE_NO_REPLY;
+	} else {
+		detail_rtt(data, rtt);
 
 		RDEBUG3("Received response for request %d.  Will read the next packet in %d seconds",
 			request->number, data->delay_time / USEC);
 
-		data->last_packet = now;
-		data->signal = 1;
 		data->state = STATE_REPLIED;
 		data->counter++;
 	}
+	data->signal = 1;
 
-#ifdef WITH_DETAIL_THREAD
-	if (write(data->child_pipe[1], &c, 1) < 0) {
-		ERROR("Failed writing ack to reader thread: %s", fr_syserror(errno));
-	}
-#else
 	radius_signal_self(RADIUS_SIGNAL_SELF_DETAIL);
 #endif
 
@@ -213,6 +268,7 @@ static int detail_open(rad_listen_t *this)
 		time_t		chtime;
 		char const	*filename;
 		glob_t		files;
+		bool		*tried;
 
 		DEBUG2("Polling for detail file %s", data->filename);
 
@@ -223,22 +279,40 @@ static int detail_open(rad_listen_t *this)
 			return 0;
 		}
 
+		tried = talloc_zero_array(data, bool, files.gl_pathc);
+		if (!tried) goto noop;
+
 		/*
 		 *	Loop over the glob'd files, looking for the
-		 *	oldest one.
+		 *	oldest one.  Other readers of the same glob may
+		 *	rename it before we do, in which case we try the
+		 *	next oldest.
 		 */
+	next:
 		chtime = 0;
 		found = -1;
 		for (i = 0; i < files.gl_pathc; i++) {
+			if (tried[i]) continue;
+
+			/*
+			 *	Don't steal files from the other readers.
+			 */
+			if (strncmp(files.gl_pathv[i], data->filename_work_base,
+				    strlen(data->filename_work_base)) == 0) continue;
+
 			if (stat(files.gl_pathv[i], &st) < 0) continue;
 
-			if ((i == 0) || (st.st_ctime < chtime)) {
+			if ((found < 0) || (st.st_ctime < chtime)) {
 				chtime = st.st_ctime;
 				found = i;
 			}
 		}
 
-		if (found < 0) goto noop;
+		if (found < 0) {
+			talloc_free(tried);
+			goto noop;
+		}
+		tried[found] = true;
 
 		/*
 		 *	Rename detail to detail.work
@@ -247,11 +321,16 @@ static int detail_open(rad_listen_t *this)
 
 		DEBUG("Detail - Renaming %s -> %s", filename, data->filename_work);
 		if (rename(filename, data->filename_work) < 0) {
+			if (errno == ENOENT) goto next;
+
 			ERROR("Detail - Failed renaming %s to %s: %s",
 			      filename, data->filename_work, fr_syserror(errno));
+			talloc_free(tried);
 			goto noop;
 		}
 
+		talloc_free(tried);
+
 		globfree(&files);	/* Shouldn't be using anything in files now */
 
 		/*
@@ -278,6 +357,327 @@ static int detail_open(rad_listen_t *this)
 }
 
 
+/*
+ *	Map the whole of the work file into memory.
+ */
+static int detail_map(listen_detail_t *data, uint8_t **map, size_t *map_len)
+{
+	struct stat st;
+
+	if (fstat(data->work_fd, &st) < 0) {
+		ERROR("Failed to stat detail file %s: %s", data->filename_work, fr_syserror(errno));
+		return -1;
+	}
+
+	*map_len = st.st_size;
+
+#ifdef HAVE_SYS_MMAN_H
+	*map = mmap(NULL, *map_len, PROT_READ, MAP_SHARED, data->work_fd, 0);
+	if (*map == MAP_FAILED) {
+		*map = NULL;
+		ERROR("Failed mapping detail file %s: %s", data->filename_work, fr_syserror(errno));
+		return -1;
+	}
+#else
+	*map = talloc_array(data, uint8_t, *map_len);
+	if (!*map || (pread(data->work_fd, *map, *map_len, 0) != (ssize_t) *map_len)) {
+		TALLOC_FREE(*map);
+		ERROR("Failed reading detail file %s: %s", data->filename_work, fr_syserror(errno));
+		return -1;
+	}
+#endif
+
+	return 0;
+}
+
+static void detail_unmap(uint8_t **map, size_t *map_len)
+{
+	if (!*map) return;
+
+#ifdef HAVE_SYS_MMAN_H
+	munmap(*map, *map_len);
+	*map = NULL;
+#else
+	TALLOC_FREE(*map);
+#endif
+	*map_len = 0;
+}
+
+/*
+ *	Binary detail files start with a record header, which can't be
+ *	mistaken for the date at the start of a text entry.  If we
+ *	have one, map the whole file into memory.  The file is locked,
+ *	so nothing else will be appending to it.
+ *
+ *	Compressed files start with a block header instead.  The file
+ *	is mapped, and each block is decompressed into data->map as
+ *	the previous one is finished.
+ */
+static int detail_binary_open(listen_detail_t *data)
+{
+	uint32_t magic;
+
+	data->binary = false;
+	data->compressed = false;
+
+	if (pread(data->work_fd, &magic, sizeof(magic), 0) != sizeof(magic)) return 0;
+
+#ifdef WITH_DETAIL_COMPRESSION
+	if (magic == htonl(DETAIL_BLOCK_MAGIC)) {
+		if (detail_map(data, &data->zmap, &data->zmap_len) < 0) return -1;
+
+		if (data->track) {
+			WARN("Detail - Entries in compressed file %s can't be marked as done, "
+			     "and will be re-read if the server is restarted", data->filename_work);
+		}
+
+		data->zoffset = 0;
+		data->map = NULL;
+		data->map_len = 0;
+		data->binary = true;
+		data->compressed = true;
+		return 0;
+	}
+#endif
+
+	if (magic != htonl(DETAIL_BINARY_MAGIC)) return 0;
+
+	if (detail_map(data, &data->map, &data->map_len) < 0) return -1;
+
+	data->binary = true;
+	return 0;
+}
+
+static void detail_binary_close(listen_detail_t *data)
+{
+	if (data->compressed) {
+		detail_unmap(&data->zmap, &data->zmap_len);
+		TALLOC_FREE(data->map);
+		data->map_len = 0;
+	} else {
+		detail_unmap(&data->map, &data->map_len);
+	}
+
+	data->binary = false;
+	data->compressed = false;
+}
+
+#ifdef WITH_DETAIL_COMPRESSION
+/*
+ *	Decompress the next block of a compressed detail file into
+ *	data->map.  Corrupt blocks are skipped in the same way as
+ *	corrupt records, and a partial block at the end of the file is
+ *	treated as EOF.
+ *
+ *	Returns 1 if a block was read, 0 at EOF.
+ */
+static int detail_block_read(listen_detail_t *data)
+{
+	size_t		offset = data->zoffset;
+	uint32_t	length, raw_length;
+	uLongf		zlen;
+	uint8_t const	*zdata;
+	detail_block_t	hdr;
+	bool		corrupt = false;
+
+	TALLOC_FREE(data->map);
+	data->map_len = 0;
+	data->offset = 0;
+
+	while ((offset + sizeof(hdr)) <= data->zmap_len) {
+		memcpy(&hdr, data->zmap + offset, sizeof(hdr));
+		length = ntohl(hdr.length);
+		raw_length = ntohl(hdr.raw_length);
+		zdata = data->zmap + offset + sizeof(hdr);
+
+		if ((hdr.magic != htonl(DETAIL_BLOCK_MAGIC)) ||
+		    (length > (data->zmap_len - offset - sizeof(hdr))) ||
+		    (raw_length == 0) || (raw_length > DETAIL_BLOCK_MAX) ||
+		    (ntohl(hdr.checksum) != detail_block_checksum(&hdr, zdata, length))) {
+			if (!corrupt) {
+				WARN("Detail - Skipping corrupt block at offset %zu in %s",
+				     offset, data->filename_work);
+				corrupt = true;
+			}
+			offset++;
+			continue;
+		}
+		corrupt = false;
+
+		data->zoffset = offset + sizeof(hdr) + length;
+
+		data->map = talloc_array(data, uint8_t, raw_length);
+		zlen = raw_length;
+		if (!data->map ||
+		    (uncompress(data->map, &zlen, zdata, length) != Z_OK) ||
+		    (zlen != raw_length)) {
+			WARN("Detail - Skipping block at offset %zu in %s which failed to decompress",
+			     offset, data->filename_work);
+			TALLOC_FREE(data->map);
+			offset = data->zoffset;
+			continue;
+		}
+
+		data->map_len = raw_length;
+		return 1;
+	}
+
+	if (offset < data->zmap_len) {
+		ERROR("Truncated block: treating it as EOF for detail file %s", data->filename_work);
+	}
+
+	data->zoffset = data->zmap_len;
+	return 0;
+}
+#endif
+
+/*
+ *	Read the next entry from a binary detail file into data->vps.
+ *
+ *	Records which fail their checksum are skipped, by searching for
+ *	the next header which is valid.  If there isn't one, the rest of
+ *	the file was truncated by the writer, and we treat it as EOF.
+ *
+ *	Returns 1 if an entry was read, 0 at EOF.
+ */
+static int detail_binary_read(listen_detail_t *data)
+{
+	size_t		offset = data->offset;
+	uint32_t	length;
+	ssize_t		len;
+	uint8_t const	*attrs, *p, *end;
+	detail_binary_t	hdr;
+	RADIUS_PACKET	decoder;
+	vp_cursor_t	cursor;
+	VALUE_PAIR	*vp;
+	bool		corrupt = false;
+
+	/*
+	 *	The passwords were "encrypted" with an empty secret,
+	 *	and a zero vector.
+	 */
+	memset(&decoder, 0, sizeof(decoder));
+
+#ifdef WITH_DETAIL_COMPRESSION
+next_block:
+#endif
+	while ((offset + sizeof(hdr)) <= data->map_len) {
+		memcpy(&hdr, data->map + offset, sizeof(hdr));
+		length = ntohl(hdr.length);
+		attrs = data->map + offset + sizeof(hdr);
+
+		if ((hdr.magic != htonl(DETAIL_BINARY_MAGIC)) ||
+		    (length > (data->map_len - offset - sizeof(hdr))) ||
+		    (ntohl(hdr.checksum) != detail_binary_checksum(&hdr, attrs, length))) {
+			if (!corrupt) {
+				WARN("Detail - Skipping corrupt record at offset %zu in %s",
+				     offset, data->filename_work);
+				corrupt = true;
+			}
+			offset++;
+			continue;
+		}
+		corrupt = false;
+
+		data->last_offset = offset;
+		data->offset = offset + sizeof(hdr) + length;
+		data->timestamp = ntohl(hdr.timestamp);
+		data->timestamp_offset = offset + offsetof(detail_binary_t, done);
+
+		if (hdr.done) {
+			DEBUG2("Skipping record for timestamp %lu", data->timestamp);
+			offset = data->offset;
+			continue;
+		}
+
+		data->client_ip.af = AF_UNSPEC;
+		switch (hdr.af) {
+		case 4:
+			data->client_ip.af = AF_INET;
+			data->client_ip.prefix = 32;
+			memcpy(&data->client_ip.ipaddr.ip4addr, hdr.ipaddr, 4);
+			break;
+
+		case 6:
+			data->client_ip.af = AF_INET6;
+			data->client_ip.prefix = 128;
+			memcpy(&data->client_ip.ipaddr.ip6addr, hdr.ipaddr, 16);
+			break;
+
+		default:
+			break;
+		}
+
+		fr_cursor_init(&cursor, &data->vps);
+
+		vp = paircreate(data, PW_PACKET_TYPE, 0);
+		if (vp) {
+			vp->vp_integer = hdr.code;
+			fr_cursor_insert(&cursor, vp);
+		}
+
+		for (p = attrs, end = attrs + length; p < end; p += len) {
+			vp = NULL;
+			len = rad_attr2vp(data, &decoder, &decoder, "", p, end - p, &vp);
+			if (len <= 0) {
+				WARN("Detail - Skipping bad attribute in record at offset %zu in %s: %s",
+				     offset, data->filename_work, fr_strerror());
+				break;
+			}
+			if (vp) fr_cursor_merge(&cursor, vp);
+		}
+
+		vp = paircreate(data, PW_PACKET_ORIGINAL_TIMESTAMP, 0);
+		if (vp) {
+			vp->vp_date = (uint32_t) data->timestamp;
+			vp->type = VT_DATA;
+			fr_cursor_insert(&cursor, vp);
+		}
+
+		data->state = STATE_QUEUED;
+		return 1;
+	}
+
+	if (offset < data->map_len) {
+		ERROR("Truncated record: treating it as EOF for detail file %s", data->filename_work);
+	}
+
+	data->offset = data->map_len;
+
+#ifdef WITH_DETAIL_COMPRESSION
+	if (data->compressed && detail_block_read(data)) {
+		offset = 0;
+		goto next_block;
+	}
+#endif
+
+	return 0;
+}
+
+/*
+ *	Mark an entry as having been processed, so that it's skipped if
+ *	we're restarted before the file is finished.
+ */
+static void detail_done(listen_detail_t *data, off_t offset)
+{
+	if (data->compressed) return;
+
+	if (data->binary) {
+		uint8_t done = 1;
+
+		if (pwrite(data->work_fd, &done, sizeof(done), offset) < 0) {
+			ERROR("Failed marking entry done in detail file %s: %s",
+			      data->filename_work, fr_syserror(errno));
+		}
+		return;
+	}
+
+	fseek(data->fp, offset, SEEK_SET);
+	fwrite("\tDone", 1, 5, data->fp);
+	fflush(data->fp);
+	fseek(data->fp, data->offset, SEEK_SET);
+}
+
 /*
  *	FIXME: add a configuration "exit when done" so that the detail
  *	file reader can be used as a one-off tool to update stuff.
@@ -293,8 +693,11 @@ static int detail_open(rad_listen_t *this)
  *	t_rtt + t_delay wait for signal that the server is idle.
  *
  */
-#ifndef WITH_DETAIL_THREAD
 static RADIUS_PACKET *detail_poll(rad_listen_t *listener);
+static RADIUS_PACKET *detail_packet(listen_detail_t *data, VALUE_PAIR *vps,
+				    fr_ipaddr_t const *client_ip, time_t *timestamp, int tries);
+
+#ifndef WITH_DETAIL_THREAD
 
 int detail_recv(rad_listen_t *listener)
 {
@@ -356,10 +759,14 @@ int detail_recv(rad_listen_t *listener)
 
 	if (!request_receive(listener, packet, &data->detail_client,
 				     rad_accounting)) {
-		char c = 0;
+		detail_ack_t ack;
+
+		ack.counter = detail_counter(packet);
+		ack.replied = false;	/* try again later */
+		ack.rtt = 0;
 		rad_free(&packet);
-		data->state = STATE_NO_REPLY;	/* try again later */
-		if (write(data->child_pipe[1], &c, 1) < 0) {
+
+		if (write(data->child_pipe[1], &ack, sizeof(ack)) < 0) {
 			ERROR("Failed writing ack to reader thread: %s", fr_syserror(errno));
 		}
 	}
@@ -422,13 +829,21 @@ open_file:
 			return NULL;
 		}
 
-		data->fp = fdopen(data->work_fd, "r");
+		data->fp = fdopen(data->work_fd, "r+");
 		if (!data->fp) {
 			ERROR("FATAL: Failed to re-open detail file %s: %s",
 			       data->filename, fr_syserror(errno));
 			fr_exit(1);
 		}
 
+		if (detail_binary_open(data) < 0) {
+			fclose(data->fp);
+			data->fp = NULL;
+			data->work_fd = -1;
+			data->state = STATE_UNOPENED;
+			return NULL;
+		}
+
 		/*
 		 *	Look for the header
 		 */
@@ -449,6 +864,11 @@ open_file:
 			goto open_file;
 		}
 
+		if (data->binary) {
+			if (!detail_binary_read(data)) goto eof;
+			goto queue;
+		}
+
 		{
 			struct stat buf;
 
@@ -461,7 +881,7 @@ open_file:
 				goto cleanup;
 			}
 			if (((off_t) ftell(data->fp)) == buf.st_size) {
-				goto cleanup;
+				goto eof;
 			}
 		}
 
@@ -470,10 +890,18 @@ open_file:
 		 *	everything.
 		 */
 		if (feof(data->fp)) {
+		eof:
+			/*
+			 *	Unless there are entries which haven't
+			 *	been acknowledged yet.
+			 */
+			if (data->outstanding > 0) return NULL;
+
 		cleanup:
 			DEBUG("Detail - unlinking %s",
 			      data->filename_work);
 			unlink(data->filename_work);
+			detail_binary_close(data);
 			if (data->fp) fclose(data->fp);
 			data->fp = NULL;
 			data->work_fd = -1;
@@ -536,10 +964,7 @@ open_file:
 	case STATE_REPLIED:
 		if (data->track) {
 			rad_assert(data->fp != NULL);
-			fseek(data->fp, data->timestamp_offset, SEEK_SET);
-			fwrite("\tDone", 1, 5, data->fp);
-			fflush(data->fp);
-			fseek(data->fp, data->offset, SEEK_SET);
+			detail_done(data, data->timestamp_offset);
 		}
 
 		pairfree(&data->vps);
@@ -675,6 +1100,7 @@ open_file:
 	 */
 	if (ferror(data->fp)) goto cleanup;
 
+queue:
 	data->tries = 0;
 	data->packets++;
 
@@ -712,6 +1138,24 @@ open_file:
 		return NULL;
 	}
 
+	packet = detail_packet(data, data->vps, &data->client_ip, &data->timestamp, data->tries);
+
+	data->state = STATE_RUNNING;
+	data->running = packet->timestamp.tv_sec;
+
+	return packet;
+}
+
+/*
+ *	Create a packet from an entry in the detail file.
+ */
+static RADIUS_PACKET *detail_packet(listen_detail_t *data, VALUE_PAIR *vps,
+				    fr_ipaddr_t const *client_ip, time_t *timestamp, int tries)
+{
+	vp_cursor_t	cursor;
+	VALUE_PAIR	*vp;
+	RADIUS_PACKET	*packet;
+
 	/*
 	 *	Allocate the packet.  If we fail, it's a serious
 	 *	problem.
@@ -737,8 +1181,8 @@ open_file:
 	 *	Remember where it came from, so that we don't
 	 *	proxy it to the place it came from...
 	 */
-	if (data->client_ip.af != AF_UNSPEC) {
-		packet->src_ipaddr = data->client_ip;
+	if (client_ip->af != AF_UNSPEC) {
+		packet->src_ipaddr = *client_ip;
 	}
 
 	vp = pairfind(packet->vps, PW_PACKET_SRC_IP_ADDRESS, 0, TAG_ANY);
@@ -782,7 +1226,7 @@ open_file:
 	 *	Otherwise, it lets us re-send the original packet
 	 *	contents, unmolested.
 	 */
-	packet->vps = paircopy(packet, data->vps);
+	packet->vps = paircopy(packet, vps);
 
 	/*
 	 *	Prefer the Event-Timestamp in the packet, if it
@@ -792,7 +1236,7 @@ open_file:
 	 */
 	vp = pairfind(packet->vps, PW_EVENT_TIMESTAMP, 0, TAG_ANY);
 	if (vp) {
-		data->timestamp = vp->vp_integer;
+		*timestamp = vp->vp_integer;
 	}
 
 	/*
@@ -805,8 +1249,8 @@ open_file:
 		rad_assert(vp != NULL);
 		pairadd(&packet->vps, vp);
 	}
-	if (data->timestamp != 0) {
-		vp->vp_integer += time(NULL) - data->timestamp;
+	if (*timestamp != 0) {
+		vp->vp_integer += time(NULL) - *timestamp;
 	}
 
 	/*
@@ -818,7 +1262,7 @@ open_file:
 		rad_assert(vp != NULL);
 		pairadd(&packet->vps, vp);
 	}
-	vp->vp_integer = data->tries;
+	vp->vp_integer = tries;
 
 	if (debug_flag) {
 		fr_printf_log("detail_recv: Read packet from %s\n", data->filename_work);
@@ -829,9 +1273,6 @@ open_file:
 		}
 	}
 
-	data->state = STATE_RUNNING;
-	data->running = packet->timestamp.tv_sec;
-
 	return packet;
 }
 
@@ -877,6 +1318,7 @@ void detail_free(rad_listen_t *this)
 	}
 #endif
 
+	detail_binary_close(data);
 	if (data->fp != NULL) {
 		fclose(data->fp);
 		data->fp = NULL;
@@ -886,14 +1328,19 @@ void detail_free(rad_listen_t *this)
 
 int detail_print(rad_listen_t const *this, char *buffer, size_t bufsize)
 {
+	listen_detail_t *data = this->data;
+
 	if (!this->server) {
-		return snprintf(buffer, bufsize, "%s",
-				((listen_detail_t *)(this->data))->filename);
+		return snprintf(buffer, bufsize, "%s", data->filename);
+	}
+
+	if (data->readers > 1) {
+		return snprintf(buffer, bufsize, "detail file %s reader %u as server %s",
+				data->filename, data->id, this->server);
 	}
 
 	return snprintf(buffer, bufsize, "detail file %s as server %s",
-			((listen_detail_t *)(this->data))->filename,
-			this->server);
+			data->filename, this->server);
 }
 
 
@@ -961,51 +1408,227 @@ int detail_decode(UNUSED rad_listen_t *this, UNUSED REQUEST *request)
 
 
 #ifdef WITH_DETAIL_THREAD
+#define ACKED(_data, _i)	((_data)->acked[(_i) / 32] & (1U << ((_i) % 32)))
+
+/*
+ *	Pass a packet for an entry in the window to the master.
+ */
+static void detail_window_send(listen_detail_t *data, detail_entry_t *entry, RADIUS_PACKET *packet)
+{
+	entry->counter = data->counter++;
+	entry->retry_at = time(NULL) + data->retry_interval;
+
+	if (write(data->master_pipe[1], &packet, sizeof(packet)) < 0) {
+		ERROR("Failed passing detail packet pointer to master: %s", fr_syserror(errno));
+		rad_free(&packet);
+	}
+}
+
+/*
+ *	Move the entry which detail_poll() just read into the window.
+ */
+static detail_entry_t *detail_window_add(listen_detail_t *data)
+{
+	uint32_t i;
+	detail_entry_t *entry;
+
+	rad_assert(data->outstanding < data->max_outstanding);
+
+	i = (data->head + data->outstanding) % data->max_outstanding;
+	data->acked[i / 32] &= ~(1U << (i % 32));
+	data->outstanding++;
+
+	entry = &data->window[i];
+	entry->vps = data->vps;
+	entry->client_ip = data->client_ip;
+	entry->timestamp = data->timestamp;
+	entry->timestamp_offset = data->timestamp_offset;
+	entry->tries = data->tries;
+
+	/*
+	 *	The entry is the window's problem now.  Go read
+	 *	another one.
+	 */
+	data->vps = NULL;
+	data->state = STATE_HEADER;
+
+	return entry;
+}
+
+/*
+ *	A request for an entry in the window is done.
+ */
+static void detail_window_ack(listen_detail_t *data, detail_ack_t const *ack)
+{
+	uint32_t i, n;
+	detail_entry_t *entry;
+
+	for (n = 0; n < data->outstanding; n++) {
+		i = (data->head + n) % data->max_outstanding;
+		if (ACKED(data, i)) continue;
+
+		if (data->window[i].counter == ack->counter) break;
+	}
+
+	/*
+	 *	For a packet we've since re-sent.  Wait for the
+	 *	response to the new one.
+	 */
+	if (n == data->outstanding) return;
+
+	entry = &data->window[i];
+
+	/*
+	 *	If there's no reply, keep retransmitting the entry
+	 *	forever.
+	 */
+	if (!ack->replied) {
+		entry->retry_at = time(NULL) + data->retry_interval;
+		return;
+	}
+
+	detail_rtt(data, ack->rtt);
+
+	gettimeofday(&data->next_read, NULL);
+	data->next_read.tv_sec += data->delay_time / USEC;
+	data->next_read.tv_usec += data->delay_time % USEC;
+	if (data->next_read.tv_usec >= USEC) {
+		data->next_read.tv_sec++;
+		data->next_read.tv_usec -= USEC;
+	}
+
+	DEBUG3("Detail - Received response for entry at offset %" PRIu64 ".  Will read the next packet in %d seconds",
+	       (uint64_t) entry->timestamp_offset, data->delay_time / USEC);
+
+	data->acked[i / 32] |= (1U << (i % 32));
+
+	/*
+	 *	Entries leave the window in the order they were read,
+	 *	so we only ever mark a prefix of the file as done.
+	 */
+	while ((data->outstanding > 0) && ACKED(data, data->head)) {
+		entry = &data->window[data->head];
+
+		if (data->track && data->fp) detail_done(data, entry->timestamp_offset);
+
+		pairfree(&entry->vps);
+		data->acked[data->head / 32] &= ~(1U << (data->head % 32));
+		data->head = (data->head + 1) % data->max_outstanding;
+		data->outstanding--;
+	}
+}
+
+/*
+ *	Read entries from the detail file, and keep up to
+ *	max_outstanding of them in progress.
+ */
 static void *detail_handler_thread(void *arg)
 {
-	char c;
 	rad_listen_t *this = arg;
 	listen_detail_t *data = this->data;
 
 	while (true) {
+		uint32_t i, n;
+		int fd, delay;
+		bool idle = false;
+		time_t now;
+		struct timeval when, tv;
+		fd_set fds;
 		RADIUS_PACKET *packet;
+		detail_entry_t *entry;
+		detail_ack_t ack;
 
-		while ((packet = detail_poll(this)) == NULL) {
-			usleep(detail_delay(data));
+		/*
+		 *	If we're supposed to exit then tell
+		 *	the master thread we've exited.
+		 */
+		fd = data->child_pipe[0];
+		if (fd < 0) {
+			packet = NULL;
+			if (write(data->master_pipe[1], &packet, sizeof(packet)) < 0) {
+				ERROR("Failed writing exit status to master: %s", fr_syserror(errno));
+			}
+			return NULL;
+		}
 
-			/*
-			 *	If we're supposed to exit then tell
-			 *	the master thread we've exited.
-			 */
-			if (data->child_pipe[0] < 0) {
-				packet = NULL;
-				if (write(data->master_pipe[1], &packet, sizeof(packet)) < 0) {
-					ERROR("Failed writing exit status to master: %s", fr_syserror(errno));
-				}
-				return NULL;
+		/*
+		 *	Read new entries while there's room in the
+		 *	window, and the load factor allows it.
+		 */
+		gettimeofday(&when, NULL);
+		while ((data->outstanding < data->max_outstanding) &&
+		       !timercmp(&when, &data->next_read, <)) {
+			packet = detail_poll(this);
+			if (!packet) {
+				idle = true;
+				break;
 			}
+
+			entry = detail_window_add(data);
+			detail_window_send(data, entry, packet);
 		}
 
 		/*
-		 *	Keep retrying forever.
-		 *
-		 *	FIXME: cap the retries.
+		 *	Re-send the entries which haven't been
+		 *	acknowledged in time, and work out how long we
+		 *	can wait for the rest.
 		 */
-		do {
-			if (write(data->master_pipe[1], &packet, sizeof(packet)) < 0) {
-				ERROR("Failed passing detail packet pointer to master: %s", fr_syserror(errno));
+		delay = -1;
+		now = time(NULL);
+		for (n = 0; n < data->outstanding; n++) {
+			int remaining;
+
+			i = (data->head + n) % data->max_outstanding;
+			if (ACKED(data, i)) continue;
+
+			entry = &data->window[i];
+			if (entry->retry_at <= now) {
+				DEBUG("No response to detail request.  Retrying");
+
+				entry->tries++;
+				packet = detail_packet(data, entry->vps, &entry->client_ip,
+						       &entry->timestamp, entry->tries);
+				detail_window_send(data, entry, packet);
 			}
 
-			if (read(data->child_pipe[0], &c, 1) < 0) {
-				ERROR("Failed getting detail packet ack from master: %s", fr_syserror(errno));
-				break;
+			remaining = (entry->retry_at - now) * USEC;
+			if ((delay < 0) || (remaining < delay)) delay = remaining;
+		}
+
+		if (data->outstanding < data->max_outstanding) {
+			int remaining;
+
+			if (idle) {
+				remaining = detail_delay(data);
+			} else {
+				remaining = (data->next_read.tv_sec - when.tv_sec) * USEC;
+				remaining += data->next_read.tv_usec - when.tv_usec;
 			}
 
-			if (data->delay_time > 0) usleep(data->delay_time);
+			if ((delay < 0) || (remaining < delay)) delay = remaining;
+		}
 
-			packet = detail_poll(this);
-			if (!packet) break;
-		} while (data->state != STATE_REPLIED);
+		if (delay < 0) delay = detail_delay(data);
+
+		/*
+		 *	Wait for an ack, or until it's time to do
+		 *	something else.
+		 */
+		tv.tv_sec = delay / USEC;
+		tv.tv_usec = delay % USEC;
+
+		FD_ZERO(&fds);
+		FD_SET(fd, &fds);
+		if (select(fd + 1, &fds, NULL, NULL, &tv) <= 0) continue;
+
+		if (read(fd, &ack, sizeof(ack)) != sizeof(ack)) {
+			if (data->child_pipe[0] >= 0) {
+				ERROR("Failed getting detail packet ack from master: %s", fr_syserror(errno));
+			}
+			continue;
+		}
+
+		detail_window_ack(data, &ack);
 	}
 
 	return NULL;
@@ -1021,7 +1644,8 @@ static const CONF_PARSER detail_config[] = {
 	{ "retry_interval", FR_CONF_OFFSET(PW_TYPE_INTEGER, listen_detail_t, retry_interval), STRINGIFY(30) },
 	{ "one_shot", FR_CONF_OFFSET(PW_TYPE_BOOLEAN, listen_detail_t, one_shot), NULL },
 	{ "track", FR_CONF_OFFSET(PW_TYPE_BOOLEAN, listen_detail_t, track), NULL },
-	{ "max_outstanding", FR_CONF_OFFSET(PW_TYPE_INTEGER, listen_detail_t, load_factor), NULL },
+	{ "max_outstanding", FR_CONF_OFFSET(PW_TYPE_INTEGER, listen_detail_t, max_outstanding), STRINGIFY(1) },
+	{ "readers", FR_CONF_OFFSET(PW_TYPE_INTEGER, listen_detail_t, readers), STRINGIFY(1) },
 
 	{ NULL, -1, 0, NULL, NULL }		/* end the list */
 };
@@ -1067,11 +1691,29 @@ int detail_parse(CONF_SECTION *cs, rad_listen_t *this)
 
 	if (check_config) return 0;
 
-	if (data->max_outstanding == 0) data->max_outstanding = 1;
+	FR_INTEGER_BOUND_CHECK("max_outstanding", data->max_outstanding, >=, 1);
+	FR_INTEGER_BOUND_CHECK("max_outstanding", data->max_outstanding, <=, 1024);
+#ifndef WITH_DETAIL_THREAD
+	if (data->max_outstanding > 1) {
+		WARN("Detail file \"%s\" can only have one outstanding packet without threads.",
+		     data->filename);
+		data->max_outstanding = 1;
+	}
+#endif
 
 	FR_INTEGER_BOUND_CHECK("retry_interval", data->retry_interval, >=, 4);
 	FR_INTEGER_BOUND_CHECK("retry_interval", data->retry_interval, <=, 3600);
 
+	FR_INTEGER_BOUND_CHECK("readers", data->readers, >=, 1);
+	FR_INTEGER_BOUND_CHECK("readers", data->readers, <=, 64);
+	if ((data->readers > 1) && (data->one_shot ||
+				    ((strchr(data->filename, '*') == NULL) &&
+				     (strchr(data->filename, '[') == NULL)))) {
+		WARN("Detail file \"%s\" can only have multiple readers when it is a glob, and one_shot is not set.",
+		     data->filename);
+		data->readers = 1;
+	}
+
 	/*
 	 *	If the filename is a glob, use "detail.work" as the
 	 *	work file name.
@@ -1098,11 +1740,22 @@ int detail_parse(CONF_SECTION *cs, rad_listen_t *this)
 		snprintf(buffer, sizeof(buffer), "%s.work", data->filename);
 	}
 
-	data->filename_work = talloc_strdup(data, buffer);
+	/*
+	 *	Each reader has its own work file: detail.work,
+	 *	detail.work.1, ...
+	 */
+	data->filename_work_base = talloc_strdup(data, buffer);
+	if (data->id > 0) {
+		data->filename_work = talloc_asprintf(data, "%s.%u", buffer, data->id);
+	} else {
+		data->filename_work = data->filename_work_base;
+	}
 
 	data->work_fd = -1;
 	data->vps = NULL;
 	data->fp = NULL;
+	data->binary = false;
+	data->map = NULL;
 	data->state = STATE_UNOPENED;
 	data->delay_time = data->poll_interval * USEC;
 	data->signal = 1;
@@ -1120,6 +1773,15 @@ int detail_parse(CONF_SECTION *cs, rad_listen_t *this)
 	client->nas_type = talloc_strdup(data, "none");	/* Part of 'data' not dynamically allocated */
 
 #ifdef WITH_DETAIL_THREAD
+	data->window = talloc_zero_array(data, detail_entry_t, data->max_outstanding);
+	data->acked = talloc_zero_array(data, uint32_t, (data->max_outstanding + 31) / 32);
+	if (!data->window || !data->acked) {
+		ERROR("Out of memory");
+		fr_exit(1);
+	}
+	data->head = 0;
+	data->outstanding = 0;
+
 	/*
 	 *	Create the communication pipes.
 	 */
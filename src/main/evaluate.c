@@ -240,12 +240,13 @@ int radius_evaluate_tmpl(REQUEST *request, int modreturn, UNUSED int depth,
 static int do_regex(REQUEST *request, value_pair_map_t const *map)
 {
 	int compare, rcode, ret;
-	regex_t reg, *preg = NULL;
+	regex_t *preg = NULL;
 	char *lhs = NULL, *rhs = NULL;
 	regmatch_t rxmatch[REQUEST_MAX_REGEX + 1];
 
 	/*
-	 *  Expand and then compile it.
+	 *  Expand it.  It's compiled below, once we know
+	 *  the LHS expansion worked.
 	 */
 	switch (map->rhs->type) {
 	case TMPL_TYPE_XLAT_STRUCT: /* pre-compiled to an xlat thing */
@@ -255,20 +256,6 @@ static int do_regex(REQUEST *request, value_pair_map_t const *map)
 			return -1;
 		}
 		rad_assert(rhs != NULL);
-
-		compare = regcomp(&reg, rhs, REG_EXTENDED | (map->rhs->tmpl_iflag ? REG_ICASE : 0));
-		if (compare != 0) {
-			if (debug_flag) {
-				char errbuf[128];
-
-				regerror(compare, &reg, errbuf, sizeof(errbuf));
-				ERROR("Failed compiling regular expression: %s", errbuf);
-			}
-			EVAL_DEBUG("FAIL %d", __LINE__);
-			ret = -1;
-			goto finish;
-		}
-		preg = &reg;
 		break;
 
 	case TMPL_TYPE_REGEX_STRUCT: /* pre-compiled to a regex */
@@ -289,6 +276,20 @@ static int do_regex(REQUEST *request, value_pair_map_t const *map)
 	}
 	rad_assert(lhs != NULL);
 
+	/*
+	 *  The compiled regex belongs to the per-thread cache,
+	 *  so nothing else may be called before regexec().
+	 */
+	if (!preg) {
+		preg = rad_regcomp(rhs, REG_EXTENDED | (map->rhs->tmpl_iflag ? REG_ICASE : 0));
+		if (!preg) {
+			if (debug_flag) ERROR("Failed compiling regular expression: %s", fr_strerror());
+			EVAL_DEBUG("FAIL %d", __LINE__);
+			ret = -1;
+			goto finish;
+		}
+	}
+
 	/*
 	 *  regexec doesn't initialise unused elements
 	 */
@@ -301,12 +302,6 @@ finish:
 	talloc_free(rhs);
 	talloc_free(lhs);
 
-	/*
-	 *  regcomp allocs extra memory for the expression, so if the
-	 *  result wasn't cached we need to free it here.
-	 */
-	if (preg && (preg == &reg)) regfree(&reg);
-
 	return ret;
 }
 #endif
@@ -902,10 +897,21 @@ int radius_evaluate_cond(REQUEST *request, int modreturn, int depth,
 			return -1;
 		}
 
-		if (rcode < 0) return rcode;
+		if (rcode < 0) {
+			if (c->stats) FR_COND_STATS_INC(c->stats, error_count);
+			return rcode;
+		}
 
 		if (c->negate) rcode = !rcode;
 
+		if (c->stats) {
+			if (rcode) {
+				FR_COND_STATS_INC(c->stats, true_count);
+			} else {
+				FR_COND_STATS_INC(c->stats, false_count);
+			}
+		}
+
 		if (!c->next) break;
 
 		/*
@@ -26,6 +26,7 @@
 RCSID("$Id$")
 
 #include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/modules.h>
 #include <freeradius-devel/rad_assert.h>
 
 #include <sys/file.h>
@@ -356,8 +357,22 @@ pid_t radius_start_program(char const *cmd, REQUEST *request, bool exec_wait,
 #endif
 }
 
+#ifndef __MINGW32__
+/*
+ *	Wait for the child's output.  A module running a request can
+ *	give up the thread while it waits.  Anything else blocks.
+ */
+static int exec_wait_fd(REQUEST *request, int fd, struct timeval const *timeout)
+{
+	if (request) return module_yield(request, fd, timeout);
+
+	return thread_pool_wait_fd(fd, timeout);
+}
+#endif
+
 /** Read from the child process.
  *
+ * @param request the program is being run for, or NULL.
  * @param fd file descriptor to read from.
  * @param pid pid of child, will be reaped if it dies.
  * @param timeout amount of time to wait, in seconds.
@@ -365,8 +380,8 @@ pid_t radius_start_program(char const *cmd, REQUEST *request, bool exec_wait,
  * @param left length of buffer.
  * @return -1 on error, or length of output.
  */
-int radius_readfrom_program(int fd, pid_t pid, int timeout,
-			    char *answer, int left)
+static int exec_readfrom(REQUEST *request, int fd, pid_t pid, int timeout,
+			 char *answer, int left)
 {
 	int done = 0;
 #ifndef __MINGW32__
@@ -404,12 +419,8 @@ int radius_readfrom_program(int fd, pid_t pid, int timeout,
 	gettimeofday(&start, NULL);
 	while (1) {
 		int rcode;
-		fd_set fds;
 		struct timeval when, elapsed, wake;
 
-		FD_ZERO(&fds);
-		FD_SET(fd, &fds);
-
 		gettimeofday(&when, NULL);
 		tv_sub(&when, &start, &elapsed);
 		if (elapsed.tv_sec >= timeout) goto too_long;
@@ -418,7 +429,11 @@ int radius_readfrom_program(int fd, pid_t pid, int timeout,
 		when.tv_usec = 0;
 		tv_sub(&when, &elapsed, &wake);
 
-		rcode = select(fd + 1, &fds, NULL, NULL, &wake);
+		/*
+		 *	This lets the thread do other work while we
+		 *	wait, if the request is allowed to yield.
+		 */
+		rcode = exec_wait_fd(request, fd, &wake);
 		if (rcode == 0) {
 		too_long:
 			DEBUG("Child PID %u is taking too much time: forcing failure and killing child.", pid);
@@ -431,10 +446,7 @@ int radius_readfrom_program(int fd, pid_t pid, int timeout,
 			rad_waitpid(pid, &status);
 			return -1;
 		}
-		if (rcode < 0) {
-			if (errno == EINTR) continue;
-			break;
-		}
+		if (rcode < 0) break;
 
 #ifdef O_NONBLOCK
 		/*
@@ -490,6 +502,88 @@ int radius_readfrom_program(int fd, pid_t pid, int timeout,
 	return done;
 }
 
+/** Read from the child process.
+ *
+ * @param fd file descriptor to read from.
+ * @param pid pid of child, will be reaped if it dies.
+ * @param timeout amount of time to wait, in seconds.
+ * @param answer buffer to write into.
+ * @param left length of buffer.
+ * @return -1 on error, or length of output.
+ */
+int radius_readfrom_program(int fd, pid_t pid, int timeout,
+			    char *answer, int left)
+{
+	return exec_readfrom(NULL, fd, pid, timeout, answer, left);
+}
+
+#ifndef __MINGW32__
+/** Parse the output of a program into value pairs, or copy it to out
+ *
+ * @param[in] request Current request (may be NULL).
+ * @param[in] cmd which produced the output, for error messages.
+ * @param[in] answer program output, modified in place.
+ * @param[in] len length of the output.
+ * @param[out] out buffer to copy plaintext output to.
+ * @param[in] outlen length of out buffer.
+ * @param[out] output_pairs if not NULL, the output is parsed into this list.
+ * @return 0 on success, -1 if the output could not be parsed.
+ */
+static int exec_parse_output(REQUEST *request, char const *cmd, char *answer, ssize_t len,
+			     char *out, size_t outlen, VALUE_PAIR **output_pairs)
+{
+	char *p;
+	int comma = 0;
+
+	if (len == 0) return 0;
+
+	/*
+	 *	Parse the output, if any.
+	 */
+	if (output_pairs) {
+		/*
+		 *	HACK: Replace '\n' with ',' so that
+		 *	userparse() can parse the buffer in
+		 *	one go (the proper way would be to
+		 *	fix userparse(), but oh well).
+		 */
+		for (p = answer; *p; p++) {
+			if (*p == '\n') {
+				*p = comma ? ' ' : ',';
+				p++;
+				comma = 0;
+			}
+			if (*p == ',') {
+				comma++;
+			}
+		}
+
+		/*
+		 *	Replace any trailing comma by a NUL.
+		 */
+		if (answer[len - 1] == ',') {
+			answer[--len] = '\0';
+		}
+
+		if (userparse(request, answer, output_pairs) == T_INVALID) {
+			RERROR("Failed parsing output from: %s: %s", cmd, fr_strerror());
+			if (out) strlcpy(out, answer, outlen);
+			return -1;
+		}
+	/*
+	 *	We've not been told to extract output pairs,
+	 *	just copy the programs output to the out
+	 *	buffer.
+	 */
+
+	} else if (out) {
+		strlcpy(out, answer, outlen);
+	}
+
+	return 0;
+}
+#endif
+
 /** Execute a program.
  *
  * @param[out] out buffer to append plaintext (non valuepair) output.
@@ -514,9 +608,7 @@ int radius_exec_program(char *out, size_t outlen, VALUE_PAIR **output_pairs,
 	pid_t pid;
 	int from_child;
 #ifndef __MINGW32__
-	char *p;
 	pid_t child_pid;
-	int comma = 0;
 	int status, ret = 0;
 	ssize_t len;
 	char answer[4096];
@@ -536,10 +628,10 @@ int radius_exec_program(char *out, size_t outlen, VALUE_PAIR **output_pairs,
 	}
 
 #ifndef __MINGW32__
-	len = radius_readfrom_program(from_child, pid, timeout, answer, sizeof(answer));
+	len = exec_readfrom(request, from_child, pid, timeout, answer, sizeof(answer));
 	if (len < 0) {
 		/*
-		 *	Failure - radius_readfrom_program will
+		 *	Failure - exec_readfrom will
 		 *	have called close(from_child) for us
 		 */
 		RERROR("Failed to read from child output");
@@ -554,58 +646,12 @@ int radius_exec_program(char *out, size_t outlen, VALUE_PAIR **output_pairs,
 	 */
 	close(from_child);
 
-	if (len == 0) {
-		goto wait;
-	}
-
-	/*
-	 *	Parse the output, if any.
-	 */
-	if (output_pairs) {
-		/*
-		 *	HACK: Replace '\n' with ',' so that
-		 *	userparse() can parse the buffer in
-		 *	one go (the proper way would be to
-		 *	fix userparse(), but oh well).
-		 */
-		for (p = answer; *p; p++) {
-			if (*p == '\n') {
-				*p = comma ? ' ' : ',';
-				p++;
-				comma = 0;
-			}
-			if (*p == ',') {
-				comma++;
-			}
-		}
-
-		/*
-		 *	Replace any trailing comma by a NUL.
-		 */
-		if (answer[len - 1] == ',') {
-			answer[--len] = '\0';
-		}
-
-		if (userparse(request, answer, output_pairs) == T_INVALID) {
-			RERROR("Failed parsing output from: %s: %s", cmd, fr_strerror());
-			strlcpy(out, answer, len);
-			ret = -1;
-		}
-	/*
-	 *	We've not been told to extract output pairs,
-	 *	just copy the programs output to the out
-	 *	buffer.
-	 */
-
-	} else if (out) {
-		strlcpy(out, answer, outlen);
-	}
+	ret = exec_parse_output(request, cmd, answer, len, out, outlen, output_pairs);
 
 	/*
 	 *	Call rad_waitpid (should map to waitpid on non-threaded
 	 *	or single-server systems).
 	 */
-wait:
 	child_pid = rad_waitpid(pid, &status);
 	if (child_pid == 0) {
 		RERROR("Timeout waiting for child");
@@ -631,3 +677,327 @@ wait:
 
 	return -1;
 }
+
+/*
+ *	Persistent helper processes.
+ *
+ *	Instead of forking a new program for every request, the
+ *	program is started once and then fed one request at a time
+ *	over its stdin.  The framing is line based, so helpers are
+ *	easy to write in any scripting language:
+ *
+ *	server -> helper	One "Attribute = value" line per input
+ *				attribute, then an empty line.
+ *
+ *	helper -> server	Any number of output lines, exactly as an
+ *				exec'd program would print them, then a
+ *				line consisting of a '.' followed by the
+ *				exit code, e.g. ".0".
+ *
+ *	The exit code has the same meaning as the exit status of an
+ *	exec'd program.  A helper which closes its stdout, sends a
+ *	malformed reply, or takes longer than the timeout is killed,
+ *	and must be replaced by the caller.
+ */
+#define EXEC_HELPER_BUFSIZE	(8192)
+
+struct fr_exec_helper {
+	char const	*cmd;		//!< Command line the helper was started with.
+	pid_t		pid;		//!< PID of the helper.
+	int		to_child;	//!< Helper's stdin.
+	int		from_child;	//!< Helper's stdout.
+	bool		dead;		//!< Helper failed and must be replaced.
+};
+
+/** Kill a helper, it won't be sent any more requests
+ *
+ */
+static void exec_helper_kill(fr_exec_helper_t *helper)
+{
+#ifndef __MINGW32__
+	int status;
+
+	if (helper->to_child >= 0) {
+		close(helper->to_child);
+		helper->to_child = -1;
+	}
+	if (helper->from_child >= 0) {
+		close(helper->from_child);
+		helper->from_child = -1;
+	}
+
+	if (helper->pid > 0) {
+		kill(helper->pid, SIGTERM);
+		rad_waitpid(helper->pid, &status);
+		helper->pid = -1;
+	}
+#endif
+	helper->dead = true;
+}
+
+static int _exec_helper_free(fr_exec_helper_t *helper)
+{
+	exec_helper_kill(helper);
+
+	return 0;
+}
+
+/** Start a persistent helper process
+ *
+ * The command line is split into arguments as for radius_start_program(),
+ * but is not expanded, as there is no request it could be expanded for.
+ *
+ * @param ctx to allocate the helper in.  Freeing the helper kills the process.
+ * @param cmd Command to execute.
+ * @return a new helper, or NULL on error.
+ */
+fr_exec_helper_t *radius_exec_helper_start(TALLOC_CTX *ctx, char const *cmd)
+{
+	fr_exec_helper_t *helper;
+	int to_child = -1, from_child = -1;
+	pid_t pid;
+
+	pid = radius_start_program(cmd, NULL, true, &to_child, &from_child, NULL, false);
+	if (pid < 0) {
+		ERROR("Failed starting helper \"%s\"", cmd);
+		return NULL;
+	}
+
+	helper = talloc_zero(ctx, fr_exec_helper_t);
+	if (!helper) {
+		close(to_child);
+		close(from_child);
+		kill(pid, SIGTERM);
+		return NULL;
+	}
+	helper->cmd = talloc_strdup(helper, cmd);
+	helper->pid = pid;
+	helper->to_child = to_child;
+	helper->from_child = from_child;
+	talloc_set_destructor(helper, _exec_helper_free);
+
+	DEBUG2("Started helper PID %u: %s", (unsigned int) pid, cmd);
+
+	return helper;
+}
+
+/** Check whether a helper can still be used
+ *
+ * A helper which has exited shows up as EOF on its stdout, and a helper
+ * which wrote anything outside of a request has lost sync with us.
+ * Either way it's no longer usable.
+ *
+ * @param helper to check.
+ * @return true if the helper can be sent a request.
+ */
+bool radius_exec_helper_alive(fr_exec_helper_t *helper)
+{
+#ifndef __MINGW32__
+	fd_set fds;
+	struct timeval when;
+
+	if (helper->dead || (helper->from_child < 0)) return false;
+	if (helper->from_child >= FD_SETSIZE) return true;
+
+	FD_ZERO(&fds);
+	FD_SET(helper->from_child, &fds);
+	when.tv_sec = 0;
+	when.tv_usec = 0;
+
+	if (select(helper->from_child + 1, &fds, NULL, NULL, &when) != 0) {
+		DEBUG("Helper PID %u has exited, or is out of sync", (unsigned int) helper->pid);
+		exec_helper_kill(helper);
+		return false;
+	}
+
+	return true;
+#else
+	return false;
+#endif
+}
+
+#ifndef __MINGW32__
+/** Write the whole of a buffer to a helper
+ *
+ */
+static int exec_helper_write(fr_exec_helper_t *helper, char const *buffer, size_t len)
+{
+	ssize_t slen;
+
+	while (len > 0) {
+		slen = write(helper->to_child, buffer, len);
+		if (slen < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		buffer += slen;
+		len -= slen;
+	}
+
+	return 0;
+}
+
+/** Read a reply from a helper, up to and including the ".<code>" line
+ *
+ * @return length of the output before the terminating line, or -1 on error.
+ */
+static ssize_t exec_helper_read(fr_exec_helper_t *helper, REQUEST *request, int timeout,
+				char *answer, size_t size, int *status)
+{
+	size_t done = 0;
+	struct timeval start;
+
+	gettimeofday(&start, NULL);
+	while (1) {
+		int rcode;
+		ssize_t slen;
+		char *p, *line, *end;
+		struct timeval when, elapsed, wake;
+
+		gettimeofday(&when, NULL);
+		tv_sub(&when, &start, &elapsed);
+		if (elapsed.tv_sec >= timeout) {
+			DEBUG("Helper PID %u is taking too much time", (unsigned int) helper->pid);
+			return -1;
+		}
+
+		when.tv_sec = timeout;
+		when.tv_usec = 0;
+		tv_sub(&when, &elapsed, &wake);
+
+		rcode = exec_wait_fd(request, helper->from_child, &wake);
+		if (rcode == 0) {
+			DEBUG("Helper PID %u is taking too much time", (unsigned int) helper->pid);
+			return -1;
+		}
+		if (rcode < 0) return -1;
+
+		slen = read(helper->from_child, answer + done, size - done - 1);
+		if (slen < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		if (slen == 0) {
+			DEBUG("Helper PID %u closed its output", (unsigned int) helper->pid);
+			return -1;
+		}
+		done += slen;
+		answer[done] = '\0';
+
+		/*
+		 *	Look for the terminating line.  It must be the
+		 *	last thing the helper sends.
+		 */
+		line = answer;
+		while ((end = strchr(line, '\n')) != NULL) {
+			if (*line != '.') {
+				line = end + 1;
+				continue;
+			}
+
+			if (end + 1 != answer + done) {
+				DEBUG("Helper PID %u sent data after the end of its reply",
+				      (unsigned int) helper->pid);
+				return -1;
+			}
+
+			*status = (int) strtol(line + 1, &p, 10);
+			if ((p == line + 1) || ((*p != '\n') && (*p != '\r'))) {
+				DEBUG("Helper PID %u sent an invalid exit code", (unsigned int) helper->pid);
+				return -1;
+			}
+
+			*line = '\0';
+			done = line - answer;
+
+			/* Strip trailing new lines */
+			while ((done > 0) && ((answer[done - 1] == '\n') || (answer[done - 1] == '\r'))) {
+				answer[--done] = '\0';
+			}
+
+			return done;
+		}
+
+		if (done >= (size - 1)) {
+			DEBUG("Helper PID %u sent too much output", (unsigned int) helper->pid);
+			return -1;
+		}
+	}
+}
+#endif
+
+/** Send a request to a persistent helper, and wait for its reply
+ *
+ * If the helper fails it is killed, and radius_exec_helper_alive() will
+ * return false.  The caller should then replace it.
+ *
+ * @param[in] helper to send the request to.
+ * @param[in] request Current request.
+ * @param[in] input_pairs list of value pairs to send to the helper.
+ * @param[out] out buffer to copy plaintext (non valuepair) output to.
+ * @param[in] outlen length of out buffer.
+ * @param[out] output_pairs if not NULL, the helper's output is parsed into this list.
+ * @param[in] timeout amount of time to wait for the reply, in seconds.
+ * @return exit code sent by the helper, or -1 on error.
+ */
+int radius_exec_helper_call(fr_exec_helper_t *helper, REQUEST *request, VALUE_PAIR *input_pairs,
+			    char *out, size_t outlen, VALUE_PAIR **output_pairs, int timeout)
+{
+#ifndef __MINGW32__
+	vp_cursor_t	cursor;
+	VALUE_PAIR	*vp;
+	char		buffer[EXEC_HELPER_BUFSIZE];
+	char		answer[4096];
+	size_t		len = 0;
+	ssize_t		slen;
+	int		status, ret;
+
+	if (out) *out = '\0';
+
+	if (helper->dead) return -1;
+
+	/*
+	 *	Build the whole request first, so it goes to the
+	 *	helper in one write. Keeping it smaller than the pipe
+	 *	buffer means the write can't block.
+	 */
+	for (vp = fr_cursor_init(&cursor, &input_pairs); vp; vp = fr_cursor_next(&cursor)) {
+		size_t vlen;
+
+		vlen = vp_prints(buffer + len, sizeof(buffer) - len - 1, vp);
+		if ((len + vlen + 2) >= sizeof(buffer)) {
+			RWDEBUG("Too many input attributes for helper, sending only the first ones");
+			break;
+		}
+		len += vlen;
+		buffer[len++] = '\n';
+	}
+	buffer[len++] = '\n';
+
+	RDEBUG2("Sending request to helper PID %u: %s", (unsigned int) helper->pid, helper->cmd);
+
+	if (exec_helper_write(helper, buffer, len) < 0) {
+		RERROR("Failed writing to helper PID %u: %s", (unsigned int) helper->pid, fr_syserror(errno));
+		exec_helper_kill(helper);
+		return -1;
+	}
+
+	slen = exec_helper_read(helper, request, timeout, answer, sizeof(answer), &status);
+	if (slen < 0) {
+		RERROR("Failed reading reply from helper PID %u, killing it", (unsigned int) helper->pid);
+		exec_helper_kill(helper);
+		return -1;
+	}
+
+	ret = exec_parse_output(request, helper->cmd, answer, slen, out, outlen, output_pairs);
+	if ((status != 0) || (ret < 0)) {
+		RERROR("Helper returned code (%d) and output '%s'", status, answer);
+	} else {
+		RDEBUG2("Helper returned code (%d) and output '%s'", status, answer);
+	}
+
+	return ret < 0 ? ret : status;
+#else
+	return -1;
+#endif
+}
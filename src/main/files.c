@@ -252,6 +252,361 @@ parse_again:
 }
 
 
+/*
+ *	The PAIR_LIST "next" pointers belong to the caller, who may
+ *	have re-linked the list by name, so the index has its own.
+ */
+typedef struct pairlist_index_entry {
+	PAIR_LIST			*pl;
+	int				seq;	//!< Position in the indexed list.
+	struct pairlist_index_entry	*next;
+} pairlist_index_entry_t;
+
+typedef struct pairlist_index_bucket {
+	VALUE_PAIR const		*key;	//!< Check item every entry here requires.
+	pairlist_index_entry_t		*head;
+	pairlist_index_entry_t		*tail;
+} pairlist_index_bucket_t;
+
+typedef struct pairlist_index_attr {
+	DICT_ATTR const			*da;
+	int				values;	//!< Number of distinct values.
+	bool				used;	//!< Whether any entry is keyed on it.
+} pairlist_index_attr_t;
+
+struct pairlist_index {
+	fr_hash_table_t			*buckets;
+	pairlist_index_entry_t		*unindexed;	//!< Entries with no usable key.
+	pairlist_index_attr_t		*attrs;
+	int				num_attrs;
+};
+
+struct pairlist_cursor {
+	pairlist_index_t const		*index;
+	int				last;	//!< seq of the last entry returned.
+	int				num;
+	pairlist_index_entry_t		**chains;
+};
+
+static void const *pairlist_key_data(VALUE_PAIR const *vp)
+{
+	switch (vp->da->type) {
+	case PW_TYPE_STRING:
+	case PW_TYPE_OCTETS:
+		return vp->vp_octets;
+
+	default:
+		return &vp->data;
+	}
+}
+
+static uint32_t pairlist_bucket_hash(void const *data)
+{
+	VALUE_PAIR const *vp = ((pairlist_index_bucket_t const *)data)->key;
+	uint32_t hash;
+
+	hash = fr_hash_keyed(&vp->da, sizeof(vp->da));
+	return fr_hash_keyed_update(pairlist_key_data(vp), vp->length, hash);
+}
+
+static int pairlist_bucket_cmp(void const *one, void const *two)
+{
+	VALUE_PAIR const *a = ((pairlist_index_bucket_t const *)one)->key;
+	VALUE_PAIR const *b = ((pairlist_index_bucket_t const *)two)->key;
+
+	if (a->da < b->da) return -1;
+	if (a->da > b->da) return +1;
+
+	if (a->length < b->length) return -1;
+	if (a->length > b->length) return +1;
+
+	return memcmp(pairlist_key_data(a), pairlist_key_data(b), a->length);
+}
+
+/*
+ *	Whether a check item can only match a request which contains
+ *	the same attribute with exactly the same value.
+ *
+ *	Only on-the-wire attributes are used.  Server attributes are
+ *	set by other modules, and may have comparison functions which
+ *	are registered after this file has been read.
+ */
+static bool pairlist_key_ok(VALUE_PAIR const *vp)
+{
+	if ((vp->op != T_OP_CMP_EQ) && (vp->op != T_OP_EQ)) return false;
+	if (vp->type != VT_DATA) return false;
+	if (vp->da->flags.has_tag) return false;
+
+	if (!vp->da->vendor && ((vp->da->attr >= 0x100) || (vp->da->attr == PW_USER_PASSWORD))) return false;
+
+	switch (vp->da->type) {
+	case PW_TYPE_STRING:
+	case PW_TYPE_OCTETS:
+	case PW_TYPE_BYTE:
+	case PW_TYPE_SHORT:
+	case PW_TYPE_INTEGER:
+	case PW_TYPE_INTEGER64:
+	case PW_TYPE_DATE:
+	case PW_TYPE_IPV4_ADDR:
+	case PW_TYPE_IPV6_ADDR:
+	case PW_TYPE_IFID:
+		break;
+
+	default:
+		return false;
+	}
+
+	return !radius_find_compare(vp->da);
+}
+
+static pairlist_index_attr_t *pairlist_index_attr(pairlist_index_t const *index, DICT_ATTR const *da)
+{
+	int i;
+
+	for (i = 0; i < index->num_attrs; i++) {
+		if (index->attrs[i].da == da) return &index->attrs[i];
+	}
+
+	return NULL;
+}
+
+static int _pairlist_index_free(pairlist_index_t *index)
+{
+	fr_hash_table_free(index->buckets);
+
+	return 0;
+}
+
+/** Index a list of users file entries by their check items
+ *
+ * Each entry is keyed on the equality check item whose attribute has
+ * the most distinct values across the whole list.  pairlist_index_match()
+ * then only has to return the entries whose key is in the request,
+ * along with those which have no usable key.
+ *
+ * @param ctx to allocate the index in.
+ * @param list to index, linked by "next".  The entries must not be
+ *	freed or modified while the index is in use.
+ * @return the index, or NULL on error.
+ */
+pairlist_index_t *pairlist_index_alloc(TALLOC_CTX *ctx, PAIR_LIST *list)
+{
+	pairlist_index_t	*index;
+	pairlist_index_entry_t	*entry, **unindexed_tail;
+	pairlist_index_bucket_t	*bucket, my_bucket;
+	pairlist_index_attr_t	*attr, *best;
+	PAIR_LIST		*pl;
+	VALUE_PAIR		*vp, *key;
+	int			seq;
+
+	index = talloc_zero(ctx, pairlist_index_t);
+	if (!index) return NULL;
+
+	index->buckets = fr_hash_table_create(pairlist_bucket_hash, pairlist_bucket_cmp, NULL);
+	if (!index->buckets) {
+		talloc_free(index);
+		return NULL;
+	}
+	talloc_set_destructor(index, _pairlist_index_free);
+
+	/*
+	 *	Find every distinct key, and count the values
+	 *	seen for each attribute.
+	 */
+	for (pl = list; pl; pl = pl->next) {
+		for (vp = pl->check; vp; vp = vp->next) {
+			if (!pairlist_key_ok(vp)) continue;
+
+			my_bucket.key = vp;
+			if (fr_hash_table_finddata(index->buckets, &my_bucket)) continue;
+
+			bucket = talloc_zero(index, pairlist_index_bucket_t);
+			if (!bucket) goto error;
+			bucket->key = vp;
+			if (!fr_hash_table_insert(index->buckets, bucket)) goto error;
+
+			attr = pairlist_index_attr(index, vp->da);
+			if (!attr) {
+				index->attrs = talloc_realloc(index, index->attrs, pairlist_index_attr_t,
+							      index->num_attrs + 1);
+				if (!index->attrs) goto error;
+
+				attr = &index->attrs[index->num_attrs++];
+				attr->da = vp->da;
+				attr->values = 0;
+				attr->used = false;
+			}
+			attr->values++;
+		}
+	}
+
+	/*
+	 *	Add each entry to the bucket of its most selective key,
+	 *	keeping file order within each bucket.
+	 */
+	unindexed_tail = &index->unindexed;
+	seq = 0;
+	for (pl = list; pl; pl = pl->next) {
+		entry = talloc_zero(index, pairlist_index_entry_t);
+		if (!entry) goto error;
+		entry->pl = pl;
+		entry->seq = seq++;
+
+		key = NULL;
+		best = NULL;
+		for (vp = pl->check; vp; vp = vp->next) {
+			if (!pairlist_key_ok(vp)) continue;
+
+			attr = pairlist_index_attr(index, vp->da);
+			if (!best || (attr->values > best->values)) {
+				best = attr;
+				key = vp;
+			}
+		}
+
+		if (!key) {
+			*unindexed_tail = entry;
+			unindexed_tail = &entry->next;
+			continue;
+		}
+
+		best->used = true;
+		my_bucket.key = key;
+		bucket = fr_hash_table_finddata(index->buckets, &my_bucket);
+		rad_assert(bucket != NULL);
+
+		if (!bucket->head) {
+			bucket->head = entry;
+		} else {
+			bucket->tail->next = entry;
+		}
+		bucket->tail = entry;
+	}
+
+	return index;
+
+error:
+	talloc_free(index);
+	return NULL;
+}
+
+/*
+ *	(Re-)build the chains of a cursor, skipping the entries which
+ *	it has already returned.
+ */
+static int pairlist_cursor_fill(pairlist_cursor_t *cursor, VALUE_PAIR *vps)
+{
+	pairlist_index_t const	*index = cursor->index;
+	pairlist_index_bucket_t	*bucket, my_bucket;
+	pairlist_index_attr_t	*attr;
+	pairlist_index_entry_t	*entry;
+	VALUE_PAIR		*vp;
+	int			i, num;
+
+	num = 1;
+	for (vp = vps; vp; vp = vp->next) num++;
+
+	talloc_free(cursor->chains);
+	cursor->num = 0;
+	cursor->chains = talloc_array(cursor, pairlist_index_entry_t *, num);
+	if (!cursor->chains) return -1;
+
+	if (index->unindexed) cursor->chains[cursor->num++] = index->unindexed;
+
+	for (vp = vps; vp; vp = vp->next) {
+		attr = pairlist_index_attr(index, vp->da);
+		if (!attr || !attr->used) continue;
+
+		my_bucket.key = vp;
+		bucket = fr_hash_table_finddata(index->buckets, &my_bucket);
+		if (!bucket || !bucket->head) continue;
+
+		/*
+		 *	The request may contain the same attribute
+		 *	and value more than once.
+		 */
+		for (i = 0; i < cursor->num; i++) {
+			if (cursor->chains[i] == bucket->head) break;
+		}
+		if (i < cursor->num) continue;
+
+		cursor->chains[cursor->num++] = bucket->head;
+	}
+
+	for (i = 0; i < cursor->num; i++) {
+		for (entry = cursor->chains[i];
+		     entry && (entry->seq <= cursor->last);
+		     entry = entry->next);
+		cursor->chains[i] = entry;
+	}
+
+	return 0;
+}
+
+/** Find the entries in an index which may match a list of attributes
+ *
+ * @param ctx to allocate the cursor in.
+ * @param index built by pairlist_index_alloc().
+ * @param vps the request attributes the entries will be compared with.
+ * @return a cursor for pairlist_cursor_next(), or NULL on error.
+ */
+pairlist_cursor_t *pairlist_index_match(TALLOC_CTX *ctx, pairlist_index_t const *index, VALUE_PAIR *vps)
+{
+	pairlist_cursor_t	*cursor;
+
+	cursor = talloc_zero(ctx, pairlist_cursor_t);
+	if (!cursor) return NULL;
+
+	cursor->index = index;
+	cursor->last = -1;
+
+	if (pairlist_cursor_fill(cursor, vps) < 0) {
+		talloc_free(cursor);
+		return NULL;
+	}
+
+	return cursor;
+}
+
+/** Re-match a cursor after the attributes it was built from have changed
+ *
+ * Entries which have already been returned are not returned again.
+ *
+ * @param cursor from pairlist_index_match().
+ * @param vps the updated attributes.
+ * @return 0 on success, -1 on error.
+ */
+int pairlist_cursor_rematch(pairlist_cursor_t *cursor, VALUE_PAIR *vps)
+{
+	return pairlist_cursor_fill(cursor, vps);
+}
+
+/** Return the next possibly matching entry, in the order of the indexed list
+ *
+ * @param cursor from pairlist_index_match().
+ * @return the next entry, or NULL when there are no more.  The entry's
+ *	check items must still be compared with the request.
+ */
+PAIR_LIST *pairlist_cursor_next(pairlist_cursor_t *cursor)
+{
+	int		i, best = -1;
+	PAIR_LIST	*pl;
+
+	for (i = 0; i < cursor->num; i++) {
+		if (!cursor->chains[i]) continue;
+
+		if ((best < 0) || (cursor->chains[i]->seq < cursor->chains[best]->seq)) best = i;
+	}
+	if (best < 0) return NULL;
+
+	pl = cursor->chains[best]->pl;
+	cursor->last = cursor->chains[best]->seq;
+	cursor->chains[best] = cursor->chains[best]->next;
+
+	return pl;
+}
+
+
 /*
  *	Debug code.
  */
@@ -7,6 +7,8 @@ SOURCES	:=	conffile.c \
 		parser.c \
 		map.c \
 		tmpl.c \
+		memstats.c \
+		trace.c \
 		util.c \
 		valuepair.c \
 		xlat.c
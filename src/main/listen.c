@@ -31,6 +31,7 @@ RCSID("$Id$")
 #include <freeradius-devel/modpriv.h>
 
 #include <freeradius-devel/detail.h>
+#include <freeradius-devel/metrics.h>
 
 #ifdef WITH_UDPFROMTO
 #include <freeradius-devel/udpfromto.h>
@@ -76,6 +77,35 @@ static int last_listener = RAD_LISTEN_MAX;
 #define MAX_LISTENER (256)
 static fr_protocol_t master_listen[MAX_LISTENER];
 
+/*
+ *	Largest number of SO_REUSEPORT sockets for one listen section.
+ */
+#define MAX_LISTEN_SOCKETS (64)
+
+#ifdef WITH_RADIUS_BATCH
+/*
+ *	Largest number of packets read by one call to recvmmsg().
+ */
+#define MAX_RECV_BATCH (64)
+
+/*
+ *	Number of replies read from a UDP proxy socket at a time.
+ */
+#define PROXY_RECV_BATCH (32)
+
+/*
+ *	Per-thread state for batched reads.  A thread only reads
+ *	from one listener at a time, so one set of buffers is enough.
+ */
+typedef struct listen_batch_t {
+	rad_listen_t	*listener;	//!< Listener being read from, or NULL.
+	rad_batch_t	*recv;		//!< Packets read by recvmmsg().
+	rad_batch_t	*send;		//!< Replies queued for sendmmsg().
+} listen_batch_t;
+
+fr_thread_local_setup(listen_batch_t *, listen_batch)	/* macro */
+#endif
+
 #ifdef WITH_TCP
 /*
  *	We want to avoid opening a UDP proxy listener
@@ -114,6 +144,324 @@ static ssize_t xlat_listen(UNUSED void *instance, REQUEST *request,
 	return strlen(out);
 }
 
+#ifdef WITH_DYNAMIC_CLIENTS
+/*
+ *	Lookups of dynamic clients, keyed by source IP and protocol.
+ *
+ *	A lookup is queued by the thread which read the packet, and
+ *	run through the "dynamic_clients" virtual server by one of
+ *	a small number of lookup threads.  Packets from the source
+ *	are discarded until the lookup has finished.  The next
+ *	packet (usually a retransmission) then picks up the result,
+ *	and adds the client, in the same thread as when the lookup
+ *	was done inline.
+ *
+ *	Sources which were rejected are remembered for the
+ *	network's "negative_lifetime", so that scans from unknown
+ *	addresses don't cause a lookup for every packet.
+ */
+typedef enum dynamic_client_state_t {
+	DYNAMIC_CLIENT_QUEUED = 0,	//!< Waiting for a lookup thread.
+	DYNAMIC_CLIENT_RUNNING,		//!< Being looked up.
+	DYNAMIC_CLIENT_DONE,		//!< Waiting for the next packet to add it.
+	DYNAMIC_CLIENT_REJECTED		//!< Not a client.  Ignore packets until it expires.
+} dynamic_client_state_t;
+
+typedef struct dynamic_client_t dynamic_client_t;
+struct dynamic_client_t {
+	fr_ipaddr_t		ipaddr;		//!< Source of the packet.
+	int			proto;		//!< IPPROTO_UDP or IPPROTO_TCP.
+
+	RADCLIENT		*network;	//!< Enclosing network.
+	REQUEST			*request;	//!< Fake request run through the virtual server.
+	rlm_rcode_t		rcode;		//!< Result of running the virtual server.
+	dynamic_client_state_t	state;
+
+	time_t			expires;	//!< When a finished lookup is forgotten.
+	dynamic_client_t	*next;		//!< In the run queue, or the expiry list.
+	dynamic_client_t	*prev;		//!< In the expiry list.
+};
+
+/*
+ *	Queued lookups beyond this are discarded, and will be
+ *	retried when the client retransmits.
+ */
+#define DYNAMIC_CLIENT_MAX_QUEUED	(256)
+
+/*
+ *	Remembered sources, including negative entries.
+ */
+#define DYNAMIC_CLIENT_MAX_ENTRIES	(65536)
+
+/*
+ *	How long a finished lookup waits for the client to
+ *	retransmit.
+ */
+#define DYNAMIC_CLIENT_DONE_LIFETIME	(30)
+
+static fr_hash_table_t	*dynamic_clients = NULL;
+static dynamic_client_t	*dynamic_expire_head = NULL;	//!< Oldest first.
+static dynamic_client_t	*dynamic_expire_tail = NULL;
+
+#ifdef HAVE_PTHREAD_H
+static dynamic_client_t	*dynamic_queue_head = NULL;
+static dynamic_client_t	*dynamic_queue_tail = NULL;
+static uint32_t		dynamic_num_queued = 0;
+static pthread_mutex_t	dynamic_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	dynamic_cond = PTHREAD_COND_INITIALIZER;
+static pid_t		dynamic_pid = 0;	//!< Which process started the threads.
+static uint32_t		dynamic_num_threads = 0;
+
+#define DYNAMIC_LOCK	pthread_mutex_lock(&dynamic_mutex)
+#define DYNAMIC_UNLOCK	pthread_mutex_unlock(&dynamic_mutex)
+#else
+#define DYNAMIC_LOCK
+#define DYNAMIC_UNLOCK
+#endif
+
+static uint32_t dynamic_client_hash(void const *data)
+{
+	dynamic_client_t const *dc = data;
+	uint32_t hash;
+
+	if (dc->ipaddr.af == AF_INET) {
+		hash = fr_hash_keyed(&dc->ipaddr.ipaddr.ip4addr, sizeof(dc->ipaddr.ipaddr.ip4addr));
+	} else {
+		hash = fr_hash_keyed(&dc->ipaddr.ipaddr.ip6addr, sizeof(dc->ipaddr.ipaddr.ip6addr));
+	}
+
+	return fr_hash_keyed_update(&dc->proto, sizeof(dc->proto), hash);
+}
+
+static int dynamic_client_cmp(void const *one, void const *two)
+{
+	dynamic_client_t const *a = one;
+	dynamic_client_t const *b = two;
+	int rcode;
+
+	rcode = fr_ipaddr_cmp(&a->ipaddr, &b->ipaddr);
+	if (rcode != 0) return rcode;
+
+	return a->proto - b->proto;
+}
+
+static void dynamic_client_expire_remove(dynamic_client_t *dc)
+{
+	if (dc->prev) {
+		dc->prev->next = dc->next;
+	} else if (dynamic_expire_head == dc) {
+		dynamic_expire_head = dc->next;
+	}
+
+	if (dc->next) {
+		dc->next->prev = dc->prev;
+	} else if (dynamic_expire_tail == dc) {
+		dynamic_expire_tail = dc->prev;
+	}
+
+	dc->next = dc->prev = NULL;
+}
+
+/*
+ *	Finished lookups are put on the expiry list.  Must be called
+ *	with the mutex held.
+ */
+static void dynamic_client_expire_add(dynamic_client_t *dc, time_t expires)
+{
+	dc->expires = expires;
+	dc->next = NULL;
+	dc->prev = dynamic_expire_tail;
+
+	if (dynamic_expire_tail) {
+		dynamic_expire_tail->next = dc;
+	} else {
+		dynamic_expire_head = dc;
+	}
+	dynamic_expire_tail = dc;
+}
+
+/*
+ *	Forget a lookup.  It must not be queued or running.  Must be
+ *	called with the mutex held.
+ */
+static void dynamic_client_free(dynamic_client_t *dc)
+{
+	dynamic_client_expire_remove(dc);
+	fr_hash_table_delete(dynamic_clients, dc);
+
+	talloc_free(dc->request);
+	talloc_free(dc);
+}
+
+/*
+ *	Forget the entries which have expired.  The list is only
+ *	roughly in order, as networks may have different lifetimes,
+ *	so this stops at the first one which hasn't expired.
+ */
+static void dynamic_client_expire(time_t now)
+{
+	while (dynamic_expire_head && (dynamic_expire_head->expires <= now)) {
+		dynamic_client_free(dynamic_expire_head);
+	}
+}
+
+/*
+ *	Remember that a source isn't a client.
+ */
+static void dynamic_client_reject(dynamic_client_t *dc, time_t now)
+{
+	talloc_free(dc->request);
+	dc->request = NULL;
+
+	if (!dc->network->negative_lifetime) {
+		dynamic_client_free(dc);
+		return;
+	}
+
+	dc->state = DYNAMIC_CLIENT_REJECTED;
+	dynamic_client_expire_remove(dc);
+	dynamic_client_expire_add(dc, now + dc->network->negative_lifetime);
+}
+
+static dynamic_client_t *dynamic_client_alloc(RADCLIENT *network, fr_ipaddr_t const *ipaddr, int proto)
+{
+	dynamic_client_t *dc;
+
+	if (!dynamic_clients) {
+		dynamic_clients = fr_hash_table_create(dynamic_client_hash, dynamic_client_cmp, NULL);
+		if (!dynamic_clients) return NULL;
+	}
+
+	if (fr_hash_table_num_elements(dynamic_clients) >= DYNAMIC_CLIENT_MAX_ENTRIES) return NULL;
+
+	dc = talloc_zero(NULL, dynamic_client_t);
+	if (!dc) return NULL;
+
+	dc->ipaddr = *ipaddr;
+	dc->proto = proto;
+	dc->network = network;
+
+	if (!fr_hash_table_insert(dynamic_clients, dc)) {
+		talloc_free(dc);
+		return NULL;
+	}
+
+	return dc;
+}
+
+#ifdef HAVE_PTHREAD_H
+static void *dynamic_client_thread(UNUSED void *arg)
+{
+	dynamic_client_t *dc;
+	REQUEST *request;
+	rlm_rcode_t rcode;
+
+	DYNAMIC_LOCK;
+	while (true) {
+		while (!dynamic_queue_head) pthread_cond_wait(&dynamic_cond, &dynamic_mutex);
+
+		dc = dynamic_queue_head;
+		dynamic_queue_head = dc->next;
+		if (!dynamic_queue_head) dynamic_queue_tail = NULL;
+		dc->next = NULL;
+		dynamic_num_queued--;
+
+		dc->state = DYNAMIC_CLIENT_RUNNING;
+		request = dc->request;
+		DYNAMIC_UNLOCK;
+
+		RDEBUG("server %s {", request->server);
+		rcode = process_authorize(0, request);
+		RDEBUG("} # server %s", request->server);
+
+		DYNAMIC_LOCK;
+		dc->rcode = rcode;
+		if (rcode != RLM_MODULE_OK) {
+			dynamic_client_reject(dc, time(NULL));
+			continue;
+		}
+
+		dc->state = DYNAMIC_CLIENT_DONE;
+		dynamic_client_expire_add(dc, time(NULL) + DYNAMIC_CLIENT_DONE_LIFETIME);
+	}
+
+	return NULL;
+}
+
+/*
+ *	The threads are started here instead of at startup, as the
+ *	server may fork after reading the configuration.  Must be
+ *	called with the mutex held.
+ */
+static bool dynamic_client_threads_start(void)
+{
+	pthread_attr_t attr;
+	pthread_t id;
+
+	if (dynamic_pid != getpid()) {
+		dynamic_pid = getpid();
+		dynamic_num_threads = 0;
+	}
+
+	if (dynamic_num_threads) return true;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	while (dynamic_num_threads < main_config.dynamic_client_threads) {
+		if (pthread_create(&id, &attr, dynamic_client_thread, NULL) != 0) {
+			ERROR("Failed creating dynamic client thread: %s", fr_syserror(errno));
+			break;
+		}
+		dynamic_num_threads++;
+	}
+
+	pthread_attr_destroy(&attr);
+
+	return (dynamic_num_threads > 0);
+}
+#endif
+
+/*
+ *	Turn the result of running the virtual server into a client.
+ *	Frees the request.
+ */
+static RADCLIENT *dynamic_client_create(RADCLIENT_LIST *clients, RADCLIENT *network,
+					REQUEST *request, rlm_rcode_t rcode)
+{
+	RADCLIENT *created;
+
+	if (rcode != RLM_MODULE_OK) {
+		talloc_free(request);
+		return NULL;
+	}
+
+	/*
+	 *	If the client was updated by rlm_dynamic_clients,
+	 *	don't create the client from attribute-value pairs.
+	 */
+	if (request->client == network) {
+		created = client_afrom_request(clients, request);
+	} else {
+		created = request->client;
+
+		/*
+		 *	This frees the client if it isn't valid.
+		 */
+		if (!client_add_dynamic(clients, network, created)) created = NULL;
+	}
+
+	if (created) {
+		request->server = network->server;
+		exec_trigger(request, NULL, "server.client.add", false);
+	}
+
+	talloc_free(request);
+
+	return created;
+}
+#endif
+
 /*
  *	Find a per-socket client.
  */
@@ -245,6 +593,48 @@ RADCLIENT *client_listener_find(rad_listen_t *listener,
 		if (now == client->last_new_client) goto unknown;
 	}
 
+	/*
+	 *	See if this source has already been looked up.
+	 */
+	DYNAMIC_LOCK;
+	if (dynamic_clients) {
+		dynamic_client_t my_dc, *dc;
+
+		dynamic_client_expire(now);
+
+		my_dc.ipaddr = *ipaddr;
+		my_dc.proto = sock->proto;
+		dc = fr_hash_table_finddata(dynamic_clients, &my_dc);
+		if (dc) switch (dc->state) {
+		case DYNAMIC_CLIENT_DONE:
+			/*
+			 *	The network may have been replaced
+			 *	by a HUP, in which case look it up
+			 *	again.
+			 */
+			if (dc->network != client) {
+				dynamic_client_free(dc);
+				break;
+			}
+
+			request = dc->request;
+			rcode = dc->rcode;
+			dc->request = NULL;
+			dynamic_client_free(dc);
+			DYNAMIC_UNLOCK;
+			goto create;
+
+		case DYNAMIC_CLIENT_REJECTED:
+			DYNAMIC_UNLOCK;
+			goto unknown;
+
+		default:
+			DYNAMIC_UNLOCK;
+			return NULL;
+		}
+	}
+	DYNAMIC_UNLOCK;
+
 	client->last_new_client = now;
 
 	request = request_alloc(NULL);
@@ -269,6 +659,43 @@ RADCLIENT *client_listener_find(rad_listen_t *listener,
 	request->server = client->client_server;
 	request->root = &main_config;
 
+#ifdef HAVE_PTHREAD_H
+	/*
+	 *	Hand the request to a lookup thread, and discard the
+	 *	packet.  The result is used when the client
+	 *	retransmits.
+	 */
+	if (main_config.dynamic_client_threads > 0) {
+		dynamic_client_t *dc = NULL;
+
+		DYNAMIC_LOCK;
+		if ((dynamic_num_queued < DYNAMIC_CLIENT_MAX_QUEUED) && dynamic_client_threads_start()) {
+			dc = dynamic_client_alloc(client, ipaddr, sock->proto);
+		}
+		if (!dc) {
+			DYNAMIC_UNLOCK;
+			talloc_free(request);
+			goto unknown;
+		}
+
+		dc->request = request;
+		dc->state = DYNAMIC_CLIENT_QUEUED;
+		if (dynamic_queue_tail) {
+			dynamic_queue_tail->next = dc;
+		} else {
+			dynamic_queue_head = dc;
+		}
+		dynamic_queue_tail = dc;
+		dynamic_num_queued++;
+
+		pthread_cond_signal(&dynamic_cond);
+		DYNAMIC_UNLOCK;
+
+		DEBUG2("Queued lookup of dynamic client in server %s", client->client_server);
+		return NULL;
+	}
+#endif
+
 	/*
 	 *	Run a fake request through the given virtual server.
 	 *	Look for FreeRADIUS-Client-IP-Address
@@ -283,32 +710,22 @@ RADCLIENT *client_listener_find(rad_listen_t *listener,
 
 	RDEBUG("} # server %s", request->server);
 
-	if (rcode != RLM_MODULE_OK) {
-		talloc_free(request);
-		goto unknown;
-	}
-
-	/*
-	 *	If the client was updated by rlm_dynamic_clients,
-	 *	don't create the client from attribute-value pairs.
-	 */
-	if (request->client == client) {
-		created = client_afrom_request(clients, request);
-	} else {
-		created = request->client;
-
+create:
+	created = dynamic_client_create(clients, client, request, rcode);
+	if (!created) {
 		/*
-		 *	This frees the client if it isn't valid.
+		 *	Ignore this source for a while.
 		 */
-		if (!client_add_dynamic(clients, client, created)) goto unknown;
-	}
-
-	request->server = client->server;
-	exec_trigger(request, NULL, "server.client.add", false);
-
-	talloc_free(request);
+		if (client->negative_lifetime) {
+			dynamic_client_t *dc;
 
-	if (!created) goto unknown;
+			DYNAMIC_LOCK;
+			dc = dynamic_client_alloc(client, ipaddr, sock->proto);
+			if (dc) dynamic_client_reject(dc, now);
+			DYNAMIC_UNLOCK;
+		}
+		goto unknown;
+	}
 
 	return created;
 #endif
@@ -424,57 +841,107 @@ int rad_status_server(REQUEST *request)
 }
 
 #ifdef WITH_TCP
-static int dual_tcp_recv(rad_listen_t *listener)
+/*
+ *	How much data we read from a TCP connection at once.  Anything
+ *	left over after taking out the complete packets is kept for
+ *	the next read.
+ */
+#define TCP_BUFFER_SIZE (16384)
+
+/*
+ *	Process one complete packet from a TCP connection.
+ */
+static int dual_tcp_packet(rad_listen_t *listener, RADIUS_PACKET *packet)
 {
-	int rcode;
-	RADIUS_PACKET	*packet;
 	RAD_REQUEST_FUNP fun = NULL;
 	listen_socket_t *sock = listener->data;
 	RADCLIENT	*client = sock->client;
 
-	rad_assert(client != NULL);
-
-	if (listener->status != RAD_LISTEN_STATUS_KNOWN) return 0;
-
 	/*
-	 *	Allocate a packet for partial reads.
+	 *	Some sanity checks, based on the packet code.
 	 */
-	if (!sock->packet) {
-		sock->packet = rad_alloc(sock, false);
-		if (!sock->packet) return 0;
+	switch(packet->code) {
+	case PW_CODE_ACCESS_REQUEST:
+		if (listener->type != RAD_LISTEN_AUTH) goto bad_packet;
+		FR_STATS_INC(auth, total_requests);
+		fun = rad_authenticate;
+		break;
+
+#ifdef WITH_ACCOUNTING
+	case PW_CODE_ACCOUNTING_REQUEST:
+		if (listener->type != RAD_LISTEN_ACCT) goto bad_packet;
+		FR_STATS_INC(acct, total_requests);
+		fun = rad_accounting;
+		break;
+#endif
+
+	case PW_CODE_STATUS_SERVER:
+		if (!main_config.status_server) {
+			FR_STATS_INC(auth, total_unknown_types);
+			WARN("Ignoring Status-Server request due to security configuration");
+			rad_free(&sock->packet);
+			return 0;
+		}
+		fun = rad_status_server;
+		break;
 
-		sock->packet->sockfd = listener->fd;
-		sock->packet->src_ipaddr = sock->other_ipaddr;
-		sock->packet->src_port = sock->other_port;
-		sock->packet->dst_ipaddr = sock->my_ipaddr;
-		sock->packet->dst_port = sock->my_port;
-		sock->packet->proto = sock->proto;
+	default:
+	bad_packet:
+		FR_STATS_INC(auth, total_unknown_types);
+
+		DEBUG("Invalid packet code %d sent from client %s port %d : IGNORED",
+		      packet->code, client->shortname, packet->src_port);
+		rad_free(&sock->packet);
+		return 0;
+	} /* switch over packet types */
+
+	if (!request_receive(listener, packet, client, fun)) {
+		FR_STATS_INC(auth, total_packets_dropped);
+		rad_free(&sock->packet);
+		return 0;
 	}
 
-	/*
-	 *	Grab the packet currently being processed.
-	 */
-	packet = sock->packet;
+	sock->packet = NULL;	/* the request owns it now */
+	return 1;
+}
+
+/*
+ *	Read everything the client has sent, and process all of the
+ *	complete packets in it.  This means one system call for many
+ *	packets when a busy client pipelines requests.
+ */
+static int dual_tcp_recv(rad_listen_t *listener)
+{
+	int		num = 0;
+	ssize_t		rcode;
+	size_t		used;
+	RADIUS_PACKET	*packet;
+	listen_socket_t *sock = listener->data;
+
+	rad_assert(sock->client != NULL);
 
-	rcode = fr_tcp_read_packet(packet, 0);
+	if (listener->status != RAD_LISTEN_STATUS_KNOWN) return 0;
 
-	/*
-	 *	Still only a partial packet.  Put it back, and return,
-	 *	so that we'll read more data when it's ready.
-	 */
-	if (rcode == 0) {
-		return 0;
+	if (!sock->buffer) {
+		sock->buffer = talloc_array(sock, uint8_t, TCP_BUFFER_SIZE);
+		if (!sock->buffer) return 0;
+		sock->buffer_len = 0;
 	}
 
+	rcode = fr_tcp_read_buffer(listener->fd, sock->buffer + sock->buffer_len,
+				   TCP_BUFFER_SIZE - sock->buffer_len);
+	if (rcode == 0) return 0;
+
 	if (rcode == -1) {	/* error reading packet */
 		char buffer[256];
 
 		ERROR("Invalid packet from %s port %d, closing socket: %s",
-		       ip_ntoh(&packet->src_ipaddr, buffer, sizeof(buffer)),
-		       packet->src_port, fr_strerror());
+		       ip_ntoh(&sock->other_ipaddr, buffer, sizeof(buffer)),
+		       sock->other_port, fr_strerror());
 	}
 
 	if (rcode < 0) {	/* error or connection reset */
+	close_socket:
 		listener->status = RAD_LISTEN_STATUS_EOL;
 
 		/*
@@ -490,55 +957,65 @@ static int dual_tcp_recv(rad_listen_t *listener)
 		 *
 		 *	It is instead free'd in remove_from_request_hash()
 		 */
-		return 0;
+		return num;
 	}
 
+	sock->buffer_len += rcode;
+
 	/*
-	 *	Some sanity checks, based on the packet code.
+	 *	Take out every complete packet.
 	 */
-	switch(packet->code) {
-	case PW_CODE_ACCESS_REQUEST:
-		if (listener->type != RAD_LISTEN_AUTH) goto bad_packet;
-		FR_STATS_INC(auth, total_requests);
-		fun = rad_authenticate;
-		break;
+	used = 0;
+	while (used < sock->buffer_len) {
+		/*
+		 *	Allocate a packet for the next request.
+		 */
+		if (!sock->packet) {
+			sock->packet = rad_alloc(sock, false);
+			if (!sock->packet) break;	/* keep the rest for next time */
+
+			sock->packet->sockfd = listener->fd;
+			sock->packet->src_ipaddr = sock->other_ipaddr;
+			sock->packet->src_port = sock->other_port;
+			sock->packet->dst_ipaddr = sock->my_ipaddr;
+			sock->packet->dst_port = sock->my_port;
+			sock->packet->proto = sock->proto;
+		}
+		packet = sock->packet;
 
-#ifdef WITH_ACCOUNTING
-	case PW_CODE_ACCOUNTING_REQUEST:
-		if (listener->type != RAD_LISTEN_ACCT) goto bad_packet;
-		FR_STATS_INC(acct, total_requests);
-		fun = rad_accounting;
-		break;
-#endif
+		rcode = fr_tcp_packet_from_buffer(packet, sock->buffer + used,
+						  sock->buffer_len - used, 0);
 
-	case PW_CODE_STATUS_SERVER:
-		if (!main_config.status_server) {
-			FR_STATS_INC(auth, total_unknown_types);
-			WARN("Ignoring Status-Server request due to security configuration");
+		/*
+		 *	Only a partial packet is left.  Wait for the
+		 *	rest of it.
+		 */
+		if (rcode == 0) break;
+
+		if (rcode < 0) {
+			char buffer[256];
+
+			ERROR("Invalid packet from %s port %d, closing socket: %s",
+			       ip_ntoh(&packet->src_ipaddr, buffer, sizeof(buffer)),
+			       packet->src_port, fr_strerror());
 			rad_free(&sock->packet);
-			return 0;
+			sock->buffer_len = 0;
+			goto close_socket;
 		}
-		fun = rad_status_server;
-		break;
-
-	default:
-	bad_packet:
-		FR_STATS_INC(auth, total_unknown_types);
 
-		DEBUG("Invalid packet code %d sent from client %s port %d : IGNORED",
-		      packet->code, client->shortname, packet->src_port);
-		rad_free(&sock->packet);
-		return 0;
-	} /* switch over packet types */
+		used += rcode;
+		num += dual_tcp_packet(listener, packet);
+	}
 
-	if (!request_receive(listener, packet, client, fun)) {
-		FR_STATS_INC(auth, total_packets_dropped);
-		rad_free(&sock->packet);
-		return 0;
+	/*
+	 *	Keep the partial packet for next time.
+	 */
+	if (used > 0) {
+		sock->buffer_len -= used;
+		if (sock->buffer_len) memmove(sock->buffer, sock->buffer + used, sock->buffer_len);
 	}
 
-	sock->packet = NULL;	/* we have no need for more partial reads */
-	return 1;
+	return num;
 }
 
 static int dual_tcp_accept(rad_listen_t *listener)
@@ -646,6 +1123,7 @@ static int dual_tcp_accept(rad_listen_t *listener)
 	memcpy(this, listener, sizeof(*this));
 	this->next = NULL;
 	this->data = sock;	/* fix it back */
+	this->ring = NULL;
 
 	sock->parent = listener->data;
 	sock->other_ipaddr = src_ipaddr;
@@ -691,6 +1169,14 @@ static int dual_tcp_accept(rad_listen_t *listener)
 		if (this->tls) {
 			this->recv = dual_tls_recv;
 			this->send = dual_tls_send;
+
+			/*
+			 *	The connection has its own TLS session,
+			 *	so it needs its own mutex, too.
+			 */
+#ifdef HAVE_PTHREAD_H
+			pthread_mutex_init(&sock->mutex, NULL);
+#endif
 		}
 #endif
 	}
@@ -878,6 +1364,16 @@ static CONF_PARSER performance_config[] = {
 
 	{ "workers", FR_CONF_OFFSET(PW_TYPE_INTEGER, rad_listen_t, workers), NULL },
 
+	{ "recv_batch", FR_CONF_OFFSET(PW_TYPE_INTEGER, rad_listen_t, recv_batch), NULL },
+
+	{ "recv_buffers", FR_CONF_OFFSET(PW_TYPE_INTEGER, rad_listen_t, recv_buffers), NULL },
+
+	{ "cpu", FR_CONF_OFFSET(PW_TYPE_STRING, rad_listen_t, cpu_list), NULL },
+
+#ifdef WITH_TLS
+	{ "tls_io_threads", FR_CONF_OFFSET(PW_TYPE_INTEGER, rad_listen_t, tls_io_threads), NULL },
+#endif
+
 	{ NULL, -1, 0, NULL, NULL }		/* end the list */
 };
 
@@ -993,7 +1489,7 @@ int common_socket_parse(CONF_SECTION *cs, rad_listen_t *this)
 				return -1;
 			}
 
-#ifdef HAVE_PTRHEAD_H
+#ifdef HAVE_PTHREAD_H
 			if (pthread_mutex_init(&sock->mutex, NULL) < 0) {
 				rad_assert(0 == 1);
 				listen_free(&this);
@@ -1024,6 +1520,35 @@ int common_socket_parse(CONF_SECTION *cs, rad_listen_t *this)
 		return -1;
 	}
 
+	sock->num_sockets = 1;
+	rcode = cf_item_parse(cs, "num_sockets", FR_ITEM_POINTER(PW_TYPE_INTEGER, &sock->num_sockets), NULL);
+	if (rcode < 0) return -1;
+
+	if ((sock->num_sockets == 0) || (sock->num_sockets > MAX_LISTEN_SOCKETS)) {
+		cf_log_err_cs(cs,
+			      "Invalid value for \"num_sockets\"");
+		return -1;
+	}
+
+	if (sock->num_sockets > 1) {
+#ifndef SO_REUSEPORT
+		cf_log_err_cs(cs,
+			      "System does not support SO_REUSEPORT.  Delete \"num_sockets\" from the configuration file");
+		return -1;
+#else
+		if ((sock->proto != IPPROTO_UDP) ||
+		    ((this->type != RAD_LISTEN_AUTH)
+#ifdef WITH_ACCOUNTING
+		     && (this->type != RAD_LISTEN_ACCT)
+#endif
+			    )) {
+			cf_log_err_cs(cs,
+				      "\"num_sockets\" can only be used with \"udp\" sockets of type \"auth\" or \"acct\"");
+			return -1;
+		}
+#endif
+	}
+
 	/*
 	 *	Magical tuning methods!
 	 */
@@ -1033,6 +1558,22 @@ int common_socket_parse(CONF_SECTION *cs, rad_listen_t *this)
 					 performance_config);
 		if (rcode < 0) return -1;
 
+		/*
+		 *	Synchronous requests are freed as soon as the
+		 *	reply has been sent, so there is never anything
+		 *	for a retransmission to be matched against.
+		 *	Keeping them out of the request list also means
+		 *	that the receive threads don't touch it.
+		 */
+		if (this->synchronous) this->nodup = true;
+
+		/*
+		 *	One receive thread per socket.
+		 */
+		if (this->synchronous && !this->workers && (sock->num_sockets > 1)) {
+			this->workers = 1;
+		}
+
 		if (this->synchronous && sock->max_rate) {
 			WARN("Setting 'max_pps' is incompatible with 'synchronous'.  Disabling 'max_pps'");
 			sock->max_rate = 0;
@@ -1042,6 +1583,61 @@ int common_socket_parse(CONF_SECTION *cs, rad_listen_t *this)
 			WARN("Setting 'workers' requires 'synchronous'.  Disabling 'workers'");
 			this->workers = 0;
 		}
+
+		if (this->recv_batch > 1) {
+#ifndef WITH_RADIUS_BATCH
+			WARN("Setting 'recv_batch' requires recvmmsg() and sendmmsg().  Disabling 'recv_batch'");
+			this->recv_batch = 0;
+#else
+			if (this->recv_batch > MAX_RECV_BATCH) {
+				cf_log_err_cs(cs,
+					      "Invalid value for \"recv_batch\"");
+				return -1;
+			}
+
+			if (sock->proto != IPPROTO_UDP) {
+				WARN("Setting 'recv_batch' is only supported for UDP sockets.  Disabling 'recv_batch'");
+				this->recv_batch = 0;
+			}
+#endif
+		}
+
+		if (this->recv_buffers) {
+			FR_INTEGER_BOUND_CHECK("recv_buffers", this->recv_buffers, <=, 65536);
+
+			if ((sock->proto != IPPROTO_UDP) ||
+			    ((this->type != RAD_LISTEN_AUTH)
+#ifdef WITH_ACCOUNTING
+			     && (this->type != RAD_LISTEN_ACCT)
+#endif
+				    )) {
+				WARN("Setting 'recv_buffers' is only supported for UDP auth and acct sockets.  "
+				     "Disabling 'recv_buffers'");
+				this->recv_buffers = 0;
+			} else {
+				this->ring = rad_ring_alloc(this->recv_buffers);
+				if (!this->ring) {
+					cf_log_err_cs(cs, "Failed allocating receive buffers: %s", fr_strerror());
+					return -1;
+				}
+			}
+		}
+
+#ifdef WITH_TLS
+		if (this->tls_io_threads) {
+			FR_INTEGER_BOUND_CHECK("tls_io_threads", this->tls_io_threads, <=, MAX_TLS_IO_THREADS);
+
+			if (!this->tls) {
+				WARN("Setting 'tls_io_threads' is only supported for TLS sockets.  Disabling 'tls_io_threads'");
+				this->tls_io_threads = 0;
+			}
+
+#ifndef HAVE_PTHREAD_H
+			WARN("Setting 'tls_io_threads' requires threads.  Disabling 'tls_io_threads'");
+			this->tls_io_threads = 0;
+#endif
+		}
+#endif
 	}
 
 	subcs = cf_section_sub_find(cs, "limit");
@@ -1245,6 +1841,91 @@ int common_socket_parse(CONF_SECTION *cs, rad_listen_t *this)
 	return 0;
 }
 
+#ifdef WITH_RADIUS_BATCH
+static void _listen_batch_free(void *arg)
+{
+	talloc_free(arg);
+}
+
+/*
+ *	Get this thread's batch buffers, making sure they're large
+ *	enough for the listener.
+ */
+static listen_batch_t *listen_batch_get(rad_listen_t *listener)
+{
+	int ret;
+	listen_batch_t *batch;
+
+	batch = fr_thread_local_init(listen_batch, _listen_batch_free);
+	if (!batch) {
+		batch = talloc_zero(NULL, listen_batch_t);
+		if (!batch) {
+			fr_strerror_printf("out of memory");
+			return NULL;
+		}
+
+		ret = fr_thread_local_set(listen_batch, batch);
+		if (ret != 0) {
+			fr_strerror_printf("Failed setting up batch buffers: %s", fr_syserror(ret));
+			talloc_free(batch);
+			return NULL;
+		}
+	}
+
+	if (!batch->recv || (rad_batch_size(batch->recv) < (int) listener->recv_batch)) {
+		TALLOC_FREE(batch->recv);
+		TALLOC_FREE(batch->send);
+
+		batch->recv = rad_batch_alloc(batch, listener->recv_batch);
+		batch->send = rad_batch_alloc(batch, listener->recv_batch);
+		if (!batch->recv || !batch->send) {
+			TALLOC_FREE(batch->recv);
+			TALLOC_FREE(batch->send);
+			return NULL;
+		}
+	}
+
+	return batch;
+}
+
+/*
+ *	Replies which are generated while this thread is reading a
+ *	batch from the listener are queued, and sent together once
+ *	the whole batch has been processed.
+ *
+ *	Returns 1 if the reply was queued, 0 if the caller should
+ *	send it, and -1 on error.
+ */
+static int listen_batch_send(rad_listen_t *listener, REQUEST *request)
+{
+	listen_batch_t *batch;
+
+	if (listener->recv_batch <= 1) return 0;
+
+	batch = fr_thread_local_init(listen_batch, _listen_batch_free);
+	if (!batch || (batch->listener != listener)) return 0;
+
+	if (rad_batch_send(batch->send, request->reply, request->packet,
+			   request->client->secret) < 0) {
+		return -1;
+	}
+
+	return 1;
+}
+
+/*
+ *	Send any replies queued while processing the batch.
+ */
+static void listen_batch_flush(listen_batch_t *batch)
+{
+	batch->listener = NULL;
+
+	if (rad_batch_flush(batch->send) < 0) {
+		ERROR("Failed sending reply: %s", fr_strerror());
+	}
+}
+#endif
+
 /*
  *	Send an authentication response packet
  */
@@ -1267,6 +1948,21 @@ static int auth_socket_send(rad_listen_t *listener, REQUEST *request)
 	}
 #endif
 
+#ifdef WITH_RADIUS_BATCH
+	switch (listen_batch_send(listener, request)) {
+	case 1:
+		return 0;
+
+	case 0:
+		break;
+
+	default:
+		RERROR("Failed sending reply: %s",
+			       fr_strerror());
+		return -1;
+	}
+#endif
+
 	if (rad_send(request->reply, request->packet,
 		     request->client->secret) < 0) {
 		RERROR("Failed sending reply: %s",
@@ -1307,6 +2003,21 @@ static int acct_socket_send(rad_listen_t *listener, REQUEST *request)
 	}
 #endif
 
+#ifdef WITH_RADIUS_BATCH
+	switch (listen_batch_send(listener, request)) {
+	case 1:
+		return 0;
+
+	case 0:
+		break;
+
+	default:
+		RERROR("Failed sending reply: %s",
+			       fr_strerror());
+		return -1;
+	}
+#endif
+
 	if (rad_send(request->reply, request->packet,
 		     request->client->secret) < 0) {
 		RERROR("Failed sending reply: %s",
@@ -1366,48 +2077,162 @@ static int stats_socket_recv(rad_listen_t *listener)
 		return 0;
 	}
 
-	if ((client = client_listener_find(listener,
-					   &src_ipaddr, src_port)) == NULL) {
-		rad_recv_discard(listener->fd);
-		FR_STATS_INC(auth, total_invalid_requests);
-		return 0;
-	}
+	if ((client = client_listener_find(listener,
+					   &src_ipaddr, src_port)) == NULL) {
+		rad_recv_discard(listener->fd);
+		FR_STATS_INC(auth, total_invalid_requests);
+		return 0;
+	}
+
+	FR_STATS_TYPE_INC(client->auth.total_requests);
+
+	/*
+	 *	We only understand Status-Server on this socket.
+	 */
+	if (code != PW_CODE_STATUS_SERVER) {
+		DEBUG("Ignoring packet code %d sent to Status-Server port",
+		      code);
+		rad_recv_discard(listener->fd);
+		FR_STATS_INC(auth, total_unknown_types);
+		return 0;
+	}
+
+	/*
+	 *	Now that we've sanity checked everything, receive the
+	 *	packet.
+	 */
+	packet = rad_recv(listener->fd, 1); /* require message authenticator */
+	if (!packet) {
+		FR_STATS_INC(auth, total_malformed_requests);
+		DEBUG("%s", fr_strerror());
+		return 0;
+	}
+
+	if (!request_receive(listener, packet, client, rad_status_server)) {
+		FR_STATS_INC(auth, total_packets_dropped);
+		rad_free(&packet);
+		return 0;
+	}
+
+	return 1;
+}
+#endif
+
+
+#ifdef WITH_RADIUS_BATCH
+/*
+ *	Read a batch of packets with one system call, and process
+ *	each of them.  The checks are the same as in
+ *	auth_socket_recv(), but are done after the packet has
+ *	been read.
+ */
+static int auth_socket_recv_batch(rad_listen_t *listener)
+{
+	int		i, num, received = 0;
+	RADIUS_PACKET	*packet;
+	RADIUS_PACKET	header;
+	RAD_REQUEST_FUNP fun;
+	RADCLIENT	*client;
+	listen_batch_t	*batch;
+
+	batch = listen_batch_get(listener);
+	if (!batch) {
+		ERROR("%s", fr_strerror());
+		return 0;
+	}
+
+	num = rad_batch_recv(batch->recv, listener->fd, listener->ring);
+	if (num <= 0) {
+		if (num < 0) ERROR("%s", fr_strerror());
+		return 0;
+	}
+
+	batch->listener = listener;
+
+	for (i = 0; i < num; i++) {
+		client = NULL;
+
+		FR_STATS_INC(auth, total_requests);
+
+		/*
+		 *	Retransmits don't need a RADIUS_PACKET.  The
+		 *	client was looked up when the original came in.
+		 */
+		if ((rad_batch_peek(batch->recv, i, &header) == 0) &&
+		    client_listener_find(listener, &header.src_ipaddr, header.src_port) &&
+		    request_receive_dup(listener, &header)) {
+			continue;
+		}
+
+		packet = rad_batch_packet(batch->recv, i);
+		if (!packet) {
+			FR_STATS_INC(auth, total_malformed_requests);
+			DEBUG("%s", fr_strerror());
+			continue;
+		}
+
+		if ((client = client_listener_find(listener,
+						   &packet->src_ipaddr, packet->src_port)) == NULL) {
+			rad_free(&packet);
+			FR_STATS_INC(auth, total_invalid_requests);
+			continue;
+		}
+
+		FR_STATS_TYPE_INC(client->auth.total_requests);
+
+		if (!client_rate_ok(client)) {
+			rad_free(&packet);
+			FR_STATS_INC(auth, total_packets_dropped);
+			DEBUG("Dropping packet from client %s due to max_pps", client->shortname);
+			continue;
+		}
+
+		switch (packet->data[0]) {
+		case PW_CODE_ACCESS_REQUEST:
+			fun = rad_authenticate;
+			break;
+
+		case PW_CODE_STATUS_SERVER:
+			if (!main_config.status_server) {
+				rad_free(&packet);
+				FR_STATS_INC(auth, total_unknown_types);
+				WARN("Ignoring Status-Server request due to security configuration");
+				continue;
+			}
+			fun = rad_status_server;
+			break;
+
+		default:
+			FR_STATS_INC(auth, total_unknown_types);
 
-	FR_STATS_TYPE_INC(client->auth.total_requests);
+			DEBUG("Invalid packet code %d sent to authentication port from client %s port %d : IGNORED",
+			      packet->data[0], client->shortname, packet->src_port);
+			rad_free(&packet);
+			continue;
+		}
 
-	/*
-	 *	We only understand Status-Server on this socket.
-	 */
-	if (code != PW_CODE_STATUS_SERVER) {
-		DEBUG("Ignoring packet code %d sent to Status-Server port",
-		      code);
-		rad_recv_discard(listener->fd);
-		FR_STATS_INC(auth, total_unknown_types);
-		return 0;
-	}
+		if (!rad_packet_ok(packet, client->message_authenticator, NULL)) {
+			FR_STATS_INC(auth, total_malformed_requests);
+			DEBUG("%s", fr_strerror());
+			rad_free(&packet);
+			continue;
+		}
 
-	/*
-	 *	Now that we've sanity checked everything, receive the
-	 *	packet.
-	 */
-	packet = rad_recv(listener->fd, 1); /* require message authenticator */
-	if (!packet) {
-		FR_STATS_INC(auth, total_malformed_requests);
-		DEBUG("%s", fr_strerror());
-		return 0;
-	}
+		if (!request_receive(listener, packet, client, fun)) {
+			FR_STATS_INC(auth, total_packets_dropped);
+			rad_free(&packet);
+			continue;
+		}
 
-	if (!request_receive(listener, packet, client, rad_status_server)) {
-		FR_STATS_INC(auth, total_packets_dropped);
-		rad_free(&packet);
-		return 0;
+		received++;
 	}
 
-	return 1;
+	listen_batch_flush(batch);
+
+	return (received > 0);
 }
 #endif
 
-
 /*
  *	Check if an incoming request is "ok"
  *
@@ -1418,13 +2243,16 @@ static int auth_socket_recv(rad_listen_t *listener)
 {
 	ssize_t		rcode;
 	int		code;
-	uint16_t	src_port;
 	RADIUS_PACKET	*packet;
+	RADIUS_PACKET	header;
 	RAD_REQUEST_FUNP fun = NULL;
 	RADCLIENT	*client = NULL;
-	fr_ipaddr_t	src_ipaddr;
 
-	rcode = rad_recv_header(listener->fd, &src_ipaddr, &src_port, &code);
+#ifdef WITH_RADIUS_BATCH
+	if (listener->recv_batch > 1) return auth_socket_recv_batch(listener);
+#endif
+
+	rcode = rad_recv_peek(listener->fd, &header);
 	if (rcode < 0) return 0;
 
 	FR_STATS_INC(auth, total_requests);
@@ -1435,7 +2263,7 @@ static int auth_socket_recv(rad_listen_t *listener)
 	}
 
 	if ((client = client_listener_find(listener,
-					   &src_ipaddr, src_port)) == NULL) {
+					   &header.src_ipaddr, header.src_port)) == NULL) {
 		rad_recv_discard(listener->fd);
 		FR_STATS_INC(auth, total_invalid_requests);
 		return 0;
@@ -1443,9 +2271,26 @@ static int auth_socket_recv(rad_listen_t *listener)
 
 	FR_STATS_TYPE_INC(client->auth.total_requests);
 
+	/*
+	 *	Retransmits of requests we're still working on, or
+	 *	have a cached reply for, don't need to be read.
+	 */
+	if (request_receive_dup(listener, &header)) {
+		rad_recv_discard(listener->fd);
+		return 0;
+	}
+
+	if (!client_rate_ok(client)) {
+		rad_recv_discard(listener->fd);
+		FR_STATS_INC(auth, total_packets_dropped);
+		DEBUG("Dropping packet from client %s due to max_pps", client->shortname);
+		return 0;
+	}
+
 	/*
 	 *	Some sanity checks, based on the packet code.
 	 */
+	code = header.code;
 	switch(code) {
 	case PW_CODE_ACCESS_REQUEST:
 		fun = rad_authenticate;
@@ -1466,7 +2311,7 @@ static int auth_socket_recv(rad_listen_t *listener)
 		FR_STATS_INC(auth,total_unknown_types);
 
 		DEBUG("Invalid packet code %d sent to authentication port from client %s port %d : IGNORED",
-		      code, client->shortname, src_port);
+		      code, client->shortname, header.src_port);
 		return 0;
 		break;
 	} /* switch over packet types */
@@ -1475,7 +2320,7 @@ static int auth_socket_recv(rad_listen_t *listener)
 	 *	Now that we've sanity checked everything, receive the
 	 *	packet.
 	 */
-	packet = rad_recv(listener->fd, client->message_authenticator);
+	packet = rad_recv_ring(listener->ring, listener->fd, client->message_authenticator);
 	if (!packet) {
 		FR_STATS_INC(auth, total_malformed_requests);
 		DEBUG("%s", fr_strerror());
@@ -1518,6 +2363,120 @@ static int auth_socket_recv(rad_listen_t *listener)
 
 
 #ifdef WITH_ACCOUNTING
+#ifdef WITH_RADIUS_BATCH
+/*
+ *	Read a batch of packets with one system call, and process
+ *	each of them.  The checks are the same as in
+ *	acct_socket_recv(), but are done after the packet has
+ *	been read.
+ */
+static int acct_socket_recv_batch(rad_listen_t *listener)
+{
+	int		i, num, received = 0;
+	RADIUS_PACKET	*packet;
+	RADIUS_PACKET	header;
+	RAD_REQUEST_FUNP fun;
+	RADCLIENT	*client;
+	listen_batch_t	*batch;
+
+	batch = listen_batch_get(listener);
+	if (!batch) {
+		ERROR("%s", fr_strerror());
+		return 0;
+	}
+
+	num = rad_batch_recv(batch->recv, listener->fd, listener->ring);
+	if (num <= 0) {
+		if (num < 0) ERROR("%s", fr_strerror());
+		return 0;
+	}
+
+	batch->listener = listener;
+
+	for (i = 0; i < num; i++) {
+		client = NULL;
+
+		FR_STATS_INC(acct, total_requests);
+
+		/*
+		 *	Retransmits don't need a RADIUS_PACKET.  The
+		 *	client was looked up when the original came in.
+		 */
+		if ((rad_batch_peek(batch->recv, i, &header) == 0) &&
+		    client_listener_find(listener, &header.src_ipaddr, header.src_port) &&
+		    request_receive_dup(listener, &header)) {
+			continue;
+		}
+
+		packet = rad_batch_packet(batch->recv, i);
+		if (!packet) {
+			FR_STATS_INC(acct, total_malformed_requests);
+			ERROR("%s", fr_strerror());
+			continue;
+		}
+
+		if ((client = client_listener_find(listener,
+						   &packet->src_ipaddr, packet->src_port)) == NULL) {
+			rad_free(&packet);
+			FR_STATS_INC(acct, total_invalid_requests);
+			continue;
+		}
+
+		FR_STATS_TYPE_INC(client->acct.total_requests);
+
+		if (!client_rate_ok(client)) {
+			rad_free(&packet);
+			FR_STATS_INC(acct, total_packets_dropped);
+			DEBUG("Dropping packet from client %s due to max_pps", client->shortname);
+			continue;
+		}
+
+		switch (packet->data[0]) {
+		case PW_CODE_ACCOUNTING_REQUEST:
+			fun = rad_accounting;
+			break;
+
+		case PW_CODE_STATUS_SERVER:
+			if (!main_config.status_server) {
+				rad_free(&packet);
+				FR_STATS_INC(acct, total_unknown_types);
+				WARN("Ignoring Status-Server request due to security configuration");
+				continue;
+			}
+			fun = rad_status_server;
+			break;
+
+		default:
+			FR_STATS_INC(acct, total_unknown_types);
+
+			DEBUG("Invalid packet code %d sent to a accounting port from client %s port %d : IGNORED",
+			      packet->data[0], client->shortname, packet->src_port);
+			rad_free(&packet);
+			continue;
+		}
+
+		if (!rad_packet_ok(packet, 0, NULL)) {
+			FR_STATS_INC(acct, total_malformed_requests);
+			ERROR("%s", fr_strerror());
+			rad_free(&packet);
+			continue;
+		}
+
+		if (!request_receive(listener, packet, client, fun)) {
+			FR_STATS_INC(acct, total_packets_dropped);
+			rad_free(&packet);
+			continue;
+		}
+
+		received++;
+	}
+
+	listen_batch_flush(batch);
+
+	return (received > 0);
+}
+#endif
+
 /*
  *	Receive packets from an accounting socket
  */
@@ -1525,13 +2484,16 @@ static int acct_socket_recv(rad_listen_t *listener)
 {
 	ssize_t		rcode;
 	int		code;
-	uint16_t	src_port;
 	RADIUS_PACKET	*packet;
+	RADIUS_PACKET	header;
 	RAD_REQUEST_FUNP fun = NULL;
 	RADCLIENT	*client = NULL;
-	fr_ipaddr_t	src_ipaddr;
 
-	rcode = rad_recv_header(listener->fd, &src_ipaddr, &src_port, &code);
+#ifdef WITH_RADIUS_BATCH
+	if (listener->recv_batch > 1) return acct_socket_recv_batch(listener);
+#endif
+
+	rcode = rad_recv_peek(listener->fd, &header);
 	if (rcode < 0) return 0;
 
 	FR_STATS_INC(acct, total_requests);
@@ -1542,7 +2504,7 @@ static int acct_socket_recv(rad_listen_t *listener)
 	}
 
 	if ((client = client_listener_find(listener,
-					   &src_ipaddr, src_port)) == NULL) {
+					   &header.src_ipaddr, header.src_port)) == NULL) {
 		rad_recv_discard(listener->fd);
 		FR_STATS_INC(acct, total_invalid_requests);
 		return 0;
@@ -1550,9 +2512,26 @@ static int acct_socket_recv(rad_listen_t *listener)
 
 	FR_STATS_TYPE_INC(client->acct.total_requests);
 
+	/*
+	 *	Retransmits of requests we're still working on, or
+	 *	have a cached reply for, don't need to be read.
+	 */
+	if (request_receive_dup(listener, &header)) {
+		rad_recv_discard(listener->fd);
+		return 0;
+	}
+
+	if (!client_rate_ok(client)) {
+		rad_recv_discard(listener->fd);
+		FR_STATS_INC(acct, total_packets_dropped);
+		DEBUG("Dropping packet from client %s due to max_pps", client->shortname);
+		return 0;
+	}
+
 	/*
 	 *	Some sanity checks, based on the packet code.
 	 */
+	code = header.code;
 	switch(code) {
 	case PW_CODE_ACCOUNTING_REQUEST:
 		fun = rad_accounting;
@@ -1574,7 +2553,7 @@ static int acct_socket_recv(rad_listen_t *listener)
 		FR_STATS_INC(acct, total_unknown_types);
 
 		DEBUG("Invalid packet code %d sent to a accounting port from client %s port %d : IGNORED",
-		      code, client->shortname, src_port);
+		      code, client->shortname, header.src_port);
 		return 0;
 	} /* switch over packet types */
 
@@ -1582,7 +2561,7 @@ static int acct_socket_recv(rad_listen_t *listener)
 	 *	Now that we've sanity checked everything, receive the
 	 *	packet.
 	 */
-	packet = rad_recv(listener->fd, 0);
+	packet = rad_recv_ring(listener->ring, listener->fd, 0);
 	if (!packet) {
 		FR_STATS_INC(acct, total_malformed_requests);
 		ERROR("%s", fr_strerror());
@@ -1843,19 +2822,13 @@ static int coa_socket_recv(rad_listen_t *listener)
 
 #ifdef WITH_PROXY
 /*
- *	Recieve packets from a proxy socket.
+ *	Check the code of a reply from a home server, and pass it to
+ *	the request which is waiting for it.
  */
-static int proxy_socket_recv(rad_listen_t *listener)
+static int proxy_socket_reply(RADIUS_PACKET *packet)
 {
-	RADIUS_PACKET	*packet;
 	char		buffer[128];
 
-	packet = rad_recv(listener->fd, 0);
-	if (!packet) {
-		ERROR("%s", fr_strerror());
-		return 0;
-	}
-
 	/*
 	 *	FIXME: Client MIB updates?
 	 */
@@ -1899,6 +2872,70 @@ static int proxy_socket_recv(rad_listen_t *listener)
 	return 1;
 }
 
+#ifdef WITH_RADIUS_BATCH
+/*
+ *	Drain up to "recv_batch" replies from a proxy socket with one
+ *	system call.  The event loop then goes back to the other
+ *	sockets, so that one busy home server can't starve them.
+ */
+static int proxy_socket_recv_batch(rad_listen_t *listener)
+{
+	int		i, num, received = 0;
+	RADIUS_PACKET	*packet;
+	listen_batch_t	*batch;
+
+	batch = listen_batch_get(listener);
+	if (!batch) {
+		ERROR("%s", fr_strerror());
+		return 0;
+	}
+
+	num = rad_batch_recv(batch->recv, listener->fd, NULL);
+	if (num <= 0) {
+		if (num < 0) ERROR("%s", fr_strerror());
+		return 0;
+	}
+
+	for (i = 0; i < num; i++) {
+		packet = rad_batch_packet(batch->recv, i);
+		if (!packet) {
+			ERROR("%s", fr_strerror());
+			continue;
+		}
+
+		if (!rad_packet_ok(packet, 0, NULL)) {
+			ERROR("%s", fr_strerror());
+			rad_free(&packet);
+			continue;
+		}
+
+		received += proxy_socket_reply(packet);
+	}
+
+	return (received > 0);
+}
+#endif
+
+/*
+ *	Recieve packets from a proxy socket.
+ */
+static int proxy_socket_recv(rad_listen_t *listener)
+{
+	RADIUS_PACKET	*packet;
+
+#ifdef WITH_RADIUS_BATCH
+	if (listener->recv_batch > 1) return proxy_socket_recv_batch(listener);
+#endif
+
+	packet = rad_recv(listener->fd, 0);
+	if (!packet) {
+		ERROR("%s", fr_strerror());
+		return 0;
+	}
+
+	return proxy_socket_reply(packet);
+}
+
 #ifdef WITH_TCP
 /*
  *	Recieve packets from a proxy socket.
@@ -2135,6 +3172,16 @@ static fr_protocol_t master_listen[MAX_LISTENER] = {
 	NO_LISTENER,
 #endif
 
+#ifdef WITH_METRICS
+	/* OpenMetrics exporter */
+	{ RLM_MODULE_INIT, "metrics", sizeof(listen_metrics_t), NULL,
+	  metrics_parse, metrics_free,
+	  NULL, NULL,
+	  metrics_print, NULL, NULL },
+#else
+	NO_LISTENER,
+#endif
+
 	NO_LISTENER		/* bfd */
 };
 
@@ -2351,6 +3398,23 @@ static int listen_bind(rad_listen_t *this)
 	}
 #endif
 
+#ifdef SO_REUSEPORT
+	/*
+	 *	Several sockets share the same address and port.  The
+	 *	kernel spreads the incoming packets across them.  With
+	 *	"num_workers", every worker process opens each socket.
+	 */
+	if ((sock->num_sockets > 1) || (main_config.num_workers > 1)) {
+		int on = 1;
+
+		if (setsockopt(this->fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+			close(this->fd);
+			ERROR("Failed to reuse port: %s", fr_syserror(errno));
+			return -1;
+		}
+	}
+#endif
+
 	/*
 	 *	Set up sockaddr stuff.
 	 */
@@ -2533,6 +3597,8 @@ static int _listener_free(rad_listen_t *this)
 	 */
 	if (this->fd >= 0) close(this->fd);
 
+	rad_ring_free(&this->ring);
+
 	if (master_listen[this->type].free) {
 		master_listen[this->type].free(this);
 	}
@@ -2586,6 +3652,8 @@ static rad_listen_t *listen_alloc(TALLOC_CTX *ctx, RAD_LISTEN_TYPE type)
 	this = talloc_zero(ctx, rad_listen_t);
 
 	this->type = type;
+	this->cpu = -1;
+	this->numa_node = -1;
 	this->recv = master_listen[this->type].recv;
 	this->send = master_listen[this->type].send;
 	this->print = master_listen[this->type].print;
@@ -2667,9 +3735,14 @@ rad_listen_t *proxy_new_listener(home_server_t *home, uint16_t src_port)
 						&home->ipaddr, home->port);
 	} else
 #endif
-
+	{
 		this->fd = fr_socket(&home->src_ipaddr, src_port);
 
+#ifdef WITH_RADIUS_BATCH
+		this->recv_batch = PROXY_RECV_BATCH;
+#endif
+	}
+
 	if (this->fd < 0) {
 		this->print(this, buffer,sizeof(buffer));
 		ERROR("Failed opening proxy socket '%s' : %s",
@@ -2735,6 +3808,29 @@ static int _free_proto_handle(lt_dlhandle *handle)
 	return 0;
 }
 
+/*
+ *	Only the first worker process reads detail files, and opens
+ *	control and metrics sockets.  The others would process the
+ *	same detail file entries again, or take over the sockets.
+ */
+static bool listen_worker_skip(CONF_SECTION *cs)
+{
+	CONF_PAIR	*cp;
+	char const	*value;
+
+	if (main_config.worker_id == 0) return false;
+
+	cp = cf_pair_find(cs, "type");
+	if (!cp) return false;
+
+	value = cf_pair_value(cp);
+	if (!value) return false;
+
+	return ((strcmp(value, "detail") == 0) ||
+		(strcmp(value, "control") == 0) ||
+		(strcmp(value, "metrics") == 0));
+}
+
 static rad_listen_t *listen_parse(CONF_SECTION *cs, char const *server)
 {
 	int		type, rcode;
@@ -2910,6 +4006,88 @@ static rad_listen_t *listen_parse(CONF_SECTION *cs, char const *server)
 		return NULL;
 	}
 
+	/*
+	 *	Open the rest of the SO_REUSEPORT sockets.  Each one
+	 *	is a separate listener with the same configuration,
+	 *	and they're returned as a list.
+	 */
+	if (((type == RAD_LISTEN_AUTH)
+#ifdef WITH_ACCOUNTING
+	     || (type == RAD_LISTEN_ACCT)
+#endif
+		    ) && (((listen_socket_t *) this->data)->num_sockets > 1)) {
+		uint32_t	i;
+		rad_listen_t	**tail = &this->next;
+
+		for (i = 1; i < ((listen_socket_t *) this->data)->num_sockets; i++) {
+			rad_listen_t *sibling;
+
+			sibling = listen_alloc(cs, type);
+			sibling->server = server;
+			sibling->fd = -1;
+
+			if (master_listen[type].parse(cs, sibling) < 0) {
+				talloc_free(sibling);
+				listen_free(&this);
+				return NULL;
+			}
+
+			*tail = sibling;
+			tail = &sibling->next;
+		}
+	}
+
+#ifdef WITH_DETAIL
+	/*
+	 *	Each detail file reader is a separate listener with
+	 *	the same configuration, and its own work file.
+	 */
+	if ((type == RAD_LISTEN_DETAIL) && (((listen_detail_t *) this->data)->readers > 1)) {
+		uint32_t	i;
+		rad_listen_t	**tail = &this->next;
+
+		for (i = 1; i < ((listen_detail_t *) this->data)->readers; i++) {
+			rad_listen_t *sibling;
+
+			sibling = listen_alloc(cs, type);
+			sibling->server = server;
+			sibling->fd = -1;
+			((listen_detail_t *) sibling->data)->id = i;
+
+			if (master_listen[type].parse(cs, sibling) < 0) {
+				talloc_free(sibling);
+				listen_free(&this);
+				return NULL;
+			}
+
+			*tail = sibling;
+			tail = &sibling->next;
+		}
+	}
+#endif
+
+	/*
+	 *	Give each socket the next CPU from the list.
+	 */
+	if (this->cpu_list) {
+		int		num, *cpus;
+		uint32_t	i;
+		rad_listen_t	*sibling;
+
+		num = rad_cpu_list(this, &cpus, this->cpu_list);
+		if (num < 0) {
+			cf_log_err_cs(cs, "Invalid value for \"cpu\": %s", fr_strerror());
+			listen_free(&this);
+			return NULL;
+		}
+
+		for (sibling = this, i = 0; sibling != NULL; sibling = sibling->next, i++) {
+			sibling->cpu = cpus[i % num];
+			sibling->numa_node = rad_cpu_node(sibling->cpu);
+		}
+		talloc_free(cpus);
+	}
+
 
 	server_cs = cf_section_sub_find_name2(main_config.config, "server",
 					      this->server);
@@ -3135,6 +4313,8 @@ int listen_init(CONF_SECTION *config, rad_listen_t **head,
 		for (subcs = cf_subsection_find_next(cs, NULL, "listen");
 		     subcs != NULL;
 		     subcs = cf_subsection_find_next(cs, subcs, "listen")) {
+			if (listen_worker_skip(subcs)) continue;
+
 			this = listen_parse(subcs, name2);
 			if (!this) {
 				listen_free(head);
@@ -3142,7 +4322,7 @@ int listen_init(CONF_SECTION *config, rad_listen_t **head,
 			}
 
 			*last = this;
-			last = &(this->next);
+			while (*last) last = &((*last)->next);
 		} /* loop over "listen" directives in server <foo> */
 
 		goto add_sockets;
@@ -3154,6 +4334,8 @@ int listen_init(CONF_SECTION *config, rad_listen_t **head,
 	for (cs = cf_subsection_find_next(config, NULL, "listen");
 	     cs != NULL;
 	     cs = cf_subsection_find_next(config, cs, "listen")) {
+		if (listen_worker_skip(cs)) continue;
+
 		this = listen_parse(cs, NULL);
 		if (!this) {
 			listen_free(head);
@@ -3161,7 +4343,7 @@ int listen_init(CONF_SECTION *config, rad_listen_t **head,
 		}
 
 		*last = this;
-		last = &(this->next);
+		while (*last) last = &((*last)->next);
 	}
 
 	/*
@@ -3178,6 +4360,8 @@ int listen_init(CONF_SECTION *config, rad_listen_t **head,
 		for (subcs = cf_subsection_find_next(cs, NULL, "listen");
 		     subcs != NULL;
 		     subcs = cf_subsection_find_next(cs, subcs, "listen")) {
+			if (listen_worker_skip(subcs)) continue;
+
 			this = listen_parse(subcs, name2);
 			if (!this) {
 				listen_free(head);
@@ -3185,7 +4369,7 @@ int listen_init(CONF_SECTION *config, rad_listen_t **head,
 			}
 
 			*last = this;
-			last = &(this->next);
+			while (*last) last = &((*last)->next);
 		} /* loop over "listen" directives in virtual servers */
 	} /* loop over virtual servers */
 
@@ -3218,6 +4402,13 @@ add_sockets:
 				      progname);
 			return -1;
 		}
+
+#ifdef HAVE_PTHREAD_H
+		if (!check_config && this->tls_io_threads &&
+		    (tls_io_start(this->tls_io_threads) < 0)) {
+			return -1;
+		}
+#endif
 #endif
 		if (!check_config) {
 			if (this->workers && !spawn_flag) {
@@ -3245,6 +4436,10 @@ add_sockets:
 						fr_exit(1);
 					}
 
+					if ((this->cpu >= 0) && (rad_thread_cpu(id, this->cpu) < 0)) {
+						WARN("Thread %d for %s: %s", i, buffer, fr_strerror());
+					}
+
 					DEBUG("Thread %d for %s\n", i, buffer);
 				}
 #else
@@ -3399,6 +4594,10 @@ rad_listen_t *listener_find_byipaddr(fr_ipaddr_t const *ipaddr, uint16_t port, i
 	for (this = main_config.listen; this != NULL; this = this->next) {
 		listen_socket_t *sock;
 
+#ifdef WITH_METRICS
+		if (this->type == RAD_LISTEN_METRICS) continue;
+#endif
+
 		sock = this->data;
 
 		if (sock->my_port != port) continue;
@@ -3414,6 +4613,10 @@ rad_listen_t *listener_find_byipaddr(fr_ipaddr_t const *ipaddr, uint16_t port, i
 	for (this = main_config.listen; this != NULL; this = this->next) {
 		listen_socket_t *sock;
 
+#ifdef WITH_METRICS
+		if (this->type == RAD_LISTEN_METRICS) continue;
+#endif
+
 		sock = this->data;
 
 		if (sock->my_port != port) continue;
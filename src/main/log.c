@@ -39,6 +39,7 @@ RCSID("$Id$")
 #endif
 
 #include <sys/file.h>
+#include <sys/uio.h>
 
 #ifdef HAVE_PTHREAD_H
 #include <pthread.h>
@@ -319,40 +320,23 @@ int radlog_init(fr_log_t *log, bool daemonize)
 }
 
 /*
- *	Log the message to the logfile. Include the severity and
- *	a time stamp.
+ *	Add the colours, timestamp and severity to a message, and
+ *	terminate it with a newline.
  */
-int vradlog(log_type_t type, char const *fmt, va_list ap)
+static size_t log_line(char *out, size_t outlen, log_type_t type, time_t when, char const *msg)
 {
-	unsigned char *p;
-	char buffer[10240];	/* The largest config item size, then extra for prefixes and suffixes */
-	char *unsan;
-	size_t len;
-	int colourise = default_log.colourise;
-
-	/*
-	 *	If we don't want any messages, then
-	 *	throw them away.
-	 */
-	if (default_log.dst == L_DST_NULL) {
-		return 0;
-	}
+	size_t len = 0;
+	bool colourise = default_log.colourise;
 
-	buffer[0] = '\0';
-	len = 0;
+	out[0] = '\0';
 
 	if (colourise) {
-		len += strlcpy(buffer + len, fr_int2str(colours, type, ""), sizeof(buffer) - len) ;
+		len += strlcpy(out + len, fr_int2str(colours, type, ""), outlen - len);
 		if (len == 0) {
 			colourise = false;
 		}
 	}
 
-	/*
-	 *	Mark the point where we treat the buffer as unsanitized.
-	 */
-	unsan = buffer + len;
-
 	/*
 	 *	Don't print timestamps to syslog, it does that for us.
 	 *	Don't print timestamps and error types for low levels
@@ -361,40 +345,570 @@ int vradlog(log_type_t type, char const *fmt, va_list ap)
 	 *	Print timestamps for non-debugging, and for high levels
 	 *	of debugging.
 	 */
-	if (default_log.dst != L_DST_SYSLOG) {
-		if ((debug_flag != 1) && (debug_flag != 2)) {
-			time_t timeval;
+	if ((default_log.dst != L_DST_SYSLOG) && (debug_flag != 1) && (debug_flag != 2)) {
+		char *p;
+
+		CTIME_R(&when, out + len, outlen - len - 1);
+		p = strchr(out + len, '\n');
+		if (p) *p = ' ';
+
+		len = strlen(out);
+		len += strlcpy(out + len, fr_int2str(levels, type, ": "), outlen - len);
 
-			timeval = time(NULL);
-			CTIME_R(&timeval, buffer + len, sizeof(buffer) - len - 1);
+	} else if (len < outlen) switch (type) {
+	case L_DBG_WARN:
+		len += strlcpy(out + len, "WARNING: ", outlen - len);
+		break;
 
-			len = strlen(buffer);
-			len += strlcpy(buffer + len, fr_int2str(levels, type, ": "), sizeof(buffer) - len);
-		} else goto add_prefix;
+	case L_DBG_ERR:
+		len += strlcpy(out + len, "ERROR: ", outlen - len);
+		break;
+
+	default:
+		break;
+	}
+
+	if (len < outlen) {
+		len += strlcpy(out + len, msg, outlen - len);
+	}
+
+	if (colourise && (len < outlen)) {
+		len += strlcpy(out + len, VTC_RESET, outlen - len);
+	}
+
+	if (len < (outlen - 2)) {
+		out[len++] = '\n';
+		out[len] = '\0';
 	} else {
-	add_prefix:
-		if (len < sizeof(buffer)) switch (type) {
-		case L_DBG_WARN:
-			len += strlcpy(buffer + len, "WARNING: ", sizeof(buffer) - len);
-			break;
+		out[outlen - 2] = '\n';
+		out[outlen - 1] = '\0';
+		len = outlen - 1;
+	}
 
-		case L_DBG_ERR:
-			len += strlcpy(buffer + len, "ERROR: ", sizeof(buffer) - len);
-			break;
+	return len;
+}
 
-		default:
+#ifdef HAVE_SYSLOG_H
+static void log_syslog(log_type_t type, char const *line)
+{
+	int priority = LOG_DEBUG;
+
+	switch (type) {
+	case L_DBG:
+	case L_WARN:
+	case L_DBG_WARN:
+	case L_DBG_ERR:
+	case L_DBG_ERR_REQ:
+	case L_DBG_WARN_REQ:
+		priority = LOG_DEBUG;
+		break;
+	case L_AUTH:
+	case L_PROXY:
+	case L_ACCT:
+		priority = LOG_NOTICE;
+		break;
+	case L_INFO:
+		priority = LOG_INFO;
+		break;
+	case L_ERR:
+		priority = LOG_ERR;
+		break;
+	}
+	syslog(priority, "%s", line);
+}
+#endif
+
+/*
+ *	Write one message to the log destination.
+ */
+static int log_write(log_type_t type, time_t when, char const *msg)
+{
+	char buffer[10240 + 256];
+	size_t len;
+
+	len = log_line(buffer, sizeof(buffer), type, when, msg);
+
+	switch (default_log.dst) {
+
+#ifdef HAVE_SYSLOG_H
+	case L_DST_SYSLOG:
+		log_syslog(type, buffer);
+		break;
+#endif
+
+	case L_DST_FILES:
+	case L_DST_STDOUT:
+	case L_DST_STDERR:
+		return write(default_log.fd, buffer, len);
+
+	default:
+	case L_DST_NULL:	/* should have been caught above */
+		break;
+	}
+
+	return 0;
+}
+
+#if defined(HAVE_PTHREAD_H) && defined(__ATOMIC_ACQUIRE)
+/*
+ *	Asynchronous logging.
+ *
+ *	Each thread formats its messages into its own ring buffer, and
+ *	a logger thread writes them out in batches.  The rings have one
+ *	writer and one reader, so they don't need locks.  If a ring is
+ *	full, the message is dropped and counted, instead of making
+ *	the thread wait for the log destination.
+ *
+ *	The mutex only protects the list of rings, and the logger
+ *	sleeping.
+ */
+typedef struct log_record_t {
+	uint32_t	len;		//!< Of the message, or LOG_RECORD_PAD.
+	uint32_t	type;
+	time_t		when;
+} log_record_t;
+
+#define LOG_RECORD_PAD		(UINT32_MAX)	//!< Skip to the start of the ring.
+#define LOG_RECORD_SIZE(_len)	((sizeof(log_record_t) + (_len) + 7) & ~((size_t) 7))
+#define LOG_BATCH_SIZE		(65536)
+#define LOG_LINE_MAX		(10240 + 256)
+
+typedef struct log_ring_t {
+	struct log_ring_t *next;
+	uint8_t		*data;
+	uint32_t	size;		//!< A power of 2.
+	uint32_t	head;		//!< Advanced by the logger thread.
+	uint32_t	tail;		//!< Advanced by the owning thread.
+	uint64_t	dropped;	//!< Messages which didn't fit.
+	bool		exited;		//!< The owning thread has gone, free the ring once it's empty.
+} log_ring_t;
+
+static struct {
+	bool		running;
+	bool		exiting;
+	int		sleeping;
+	uint32_t	size;		//!< Of each ring.
+	pthread_key_t	key;
+	pthread_t	thread;
+	pthread_mutex_t	mutex;
+	pthread_cond_t	cond;
+	log_ring_t	*rings;
+	uint64_t	dropped;	//!< By rings which have been freed.
+} log_async;
+
+static void _log_ring_exit(void *arg)
+{
+	log_ring_t *ring = arg;
+
+	__atomic_store_n(&ring->exited, true, __ATOMIC_RELEASE);
+}
+
+static log_ring_t *log_ring_alloc(void)
+{
+	log_ring_t *ring;
+
+	ring = calloc(1, sizeof(*ring) + log_async.size);
+	if (!ring) return NULL;
+
+	ring->data = (uint8_t *) (ring + 1);
+	ring->size = log_async.size;
+
+	if (pthread_setspecific(log_async.key, ring) != 0) {
+		free(ring);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&log_async.mutex);
+	ring->next = log_async.rings;
+	log_async.rings = ring;
+	pthread_mutex_unlock(&log_async.mutex);
+
+	return ring;
+}
+
+/*
+ *	Queue a message for the logger thread.
+ *
+ *	Returns 0 if the message was queued or dropped, and -1 if it
+ *	should be written directly.
+ */
+static int log_async_push(log_type_t type, time_t when, char const *msg)
+{
+	log_ring_t	*ring;
+	log_record_t	*rec;
+	size_t		len = strlen(msg);
+	uint32_t	need, pad = 0, head, tail, offset;
+
+	ring = pthread_getspecific(log_async.key);
+	if (!ring) {
+		ring = log_ring_alloc();
+		if (!ring) return -1;
+	}
+
+	need = LOG_RECORD_SIZE(len);
+	tail = ring->tail;
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+	/*
+	 *	Records don't wrap around the end of the ring.
+	 */
+	offset = tail & (ring->size - 1);
+	if ((ring->size - offset) < need) pad = ring->size - offset;
+
+	if ((ring->size - (tail - head)) < (pad + need)) {
+		__atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	if (pad) {
+		if (pad >= sizeof(log_record_t)) {
+			rec = (log_record_t *) (ring->data + offset);
+			rec->len = LOG_RECORD_PAD;
+		}
+		tail += pad;
+		offset = 0;
+	}
+
+	rec = (log_record_t *) (ring->data + offset);
+	rec->len = len;
+	rec->type = type;
+	rec->when = when;
+	memcpy(rec + 1, msg, len);
+
+	__atomic_store_n(&ring->tail, tail + need, __ATOMIC_RELEASE);
+
+	/*
+	 *	Pairs with the logger setting "sleeping" and then
+	 *	checking the rings.  One of us sees the other.
+	 */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&log_async.sleeping, __ATOMIC_RELAXED)) {
+		pthread_mutex_lock(&log_async.mutex);
+		pthread_cond_signal(&log_async.cond);
+		pthread_mutex_unlock(&log_async.mutex);
+	}
+
+	return 0;
+}
+
+static void log_batch_flush(char *batch, size_t *used)
+{
+	size_t done = 0;
+
+	while (done < *used) {
+		ssize_t rcode;
+
+		rcode = write(default_log.fd, batch + done, *used - done);
+		if (rcode < 0) {
+			if (errno == EINTR) continue;
 			break;
 		}
+		done += rcode;
+	}
+
+	*used = 0;
+}
+
+/*
+ *	Write one message from the logger thread.  Syslog has its
+ *	own buffering, so we only batch writes to file descriptors.
+ */
+static void log_batch_add(char *batch, size_t *used, log_type_t type, time_t when, char const *msg)
+{
+#ifdef HAVE_SYSLOG_H
+	if (default_log.dst == L_DST_SYSLOG) {
+		char buffer[LOG_LINE_MAX];
+
+		log_line(buffer, sizeof(buffer), type, when, msg);
+		log_syslog(type, buffer);
+		return;
+	}
+#endif
+
+	if ((LOG_BATCH_SIZE - *used) < LOG_LINE_MAX) log_batch_flush(batch, used);
+
+	*used += log_line(batch + *used, LOG_BATCH_SIZE - *used, type, when, msg);
+}
+
+/*
+ *	Write everything in a ring.  Returns true if there was
+ *	anything to write.
+ */
+static bool log_ring_drain(log_ring_t *ring, char *batch, size_t *used)
+{
+	uint32_t	head, tail;
+	char		msg[LOG_LINE_MAX];
+
+	head = ring->head;
+	tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	if (head == tail) return false;
+
+	while (head != tail) {
+		uint32_t	offset = head & (ring->size - 1);
+		log_record_t	*rec;
+		size_t		len;
+
+		if ((ring->size - offset) < sizeof(log_record_t)) {
+			head += ring->size - offset;
+			continue;
+		}
+
+		rec = (log_record_t *) (ring->data + offset);
+		if (rec->len == LOG_RECORD_PAD) {
+			head += ring->size - offset;
+			continue;
+		}
+
+		len = rec->len;
+		if (len >= sizeof(msg)) len = sizeof(msg) - 1;
+		memcpy(msg, rec + 1, len);
+		msg[len] = '\0';
+
+		log_batch_add(batch, used, rec->type, rec->when, msg);
+
+		head += LOG_RECORD_SIZE(rec->len);
+	}
+
+	__atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+
+	return true;
+}
+
+static uint64_t log_async_dropped(void)
+{
+	uint64_t	dropped = log_async.dropped;
+	log_ring_t	*ring;
+
+	for (ring = log_async.rings; ring != NULL; ring = ring->next) {
+		dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+	}
+
+	return dropped;
+}
+
+static void *log_async_thread(UNUSED void *arg)
+{
+	char		*batch;
+	size_t		used = 0;
+	uint64_t	reported = 0;
+	time_t		last_report = 0;
+
+	batch = malloc(LOG_BATCH_SIZE);
+	if (!batch) return NULL;
+
+	while (true) {
+		bool		busy = false, exiting;
+		log_ring_t	*ring, **last;
+		uint64_t	dropped;
+		time_t		now;
+
+		/*
+		 *	New rings are only ever added at the head, so
+		 *	we can walk the list without the mutex.
+		 */
+		pthread_mutex_lock(&log_async.mutex);
+		exiting = log_async.exiting;
+		ring = log_async.rings;
+		pthread_mutex_unlock(&log_async.mutex);
+
+		for (; ring != NULL; ring = ring->next) {
+			if (log_ring_drain(ring, batch, &used)) busy = true;
+		}
+
+		/*
+		 *	Free the rings of threads which have exited.
+		 */
+		pthread_mutex_lock(&log_async.mutex);
+		last = &log_async.rings;
+		while ((ring = *last) != NULL) {
+			if (__atomic_load_n(&ring->exited, __ATOMIC_ACQUIRE) &&
+			    (ring->head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE))) {
+				*last = ring->next;
+				log_async.dropped += ring->dropped;
+				free(ring);
+				continue;
+			}
+			last = &ring->next;
+		}
+		dropped = log_async_dropped();
+		pthread_mutex_unlock(&log_async.mutex);
+
+		/*
+		 *	Say what we've lost, but not too often.
+		 */
+		now = time(NULL);
+		if ((dropped > reported) && (exiting || (now != last_report))) {
+			char msg[128];
+
+			snprintf(msg, sizeof(msg), "Log buffer full, dropped %" PRIu64 " messages",
+				 dropped - reported);
+			log_batch_add(batch, &used, L_WARN, now, msg);
+			reported = dropped;
+			last_report = now;
+		}
+
+		if (used) log_batch_flush(batch, &used);
+
+		if (busy) continue;
+		if (exiting) break;
+
+		/*
+		 *	Nothing to do.  Check again after saying we're
+		 *	asleep, so that we don't miss any messages.
+		 */
+		pthread_mutex_lock(&log_async.mutex);
+		__atomic_store_n(&log_async.sleeping, 1, __ATOMIC_SEQ_CST);
+
+		for (ring = log_async.rings; ring != NULL; ring = ring->next) {
+			if (ring->head != __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) break;
+		}
+
+		if (!ring && !log_async.exiting) {
+			struct timespec when;
+
+			when.tv_sec = time(NULL) + 1;
+			when.tv_nsec = 0;
+			pthread_cond_timedwait(&log_async.cond, &log_async.mutex, &when);
+		}
+
+		__atomic_store_n(&log_async.sleeping, 0, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&log_async.mutex);
+	}
+
+	free(batch);
+
+	return NULL;
+}
+
+/** Write log messages from a dedicated thread
+ *
+ * Messages are queued in a per-thread ring buffer of the given size,
+ * and written in batches.  Messages which don't fit are dropped, and
+ * the logger thread says how many were lost.
+ *
+ * Must be called after the server has forked into the background.
+ *
+ * @param size of each thread's ring buffer, rounded up to a power of 2.
+ * @return 0 on success, or -1 on error.
+ */
+int radlog_async_start(uint32_t size)
+{
+	int rcode;
+
+	if (log_async.running || (default_log.dst == L_DST_NULL)) return 0;
+
+	log_async.size = 1;
+	while (log_async.size < size) log_async.size <<= 1;
+
+	rcode = pthread_key_create(&log_async.key, _log_ring_exit);
+	if (rcode != 0) {
+		fr_strerror_printf("Failed creating thread key: %s", fr_syserror(rcode));
+		return -1;
+	}
+
+	pthread_mutex_init(&log_async.mutex, NULL);
+	pthread_cond_init(&log_async.cond, NULL);
+
+	rcode = pthread_create(&log_async.thread, NULL, log_async_thread, NULL);
+	if (rcode != 0) {
+		fr_strerror_printf("Failed creating logger thread: %s", fr_syserror(rcode));
+		return -1;
+	}
+
+	__atomic_store_n(&log_async.running, true, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/** Write any queued messages, and stop the logger thread
+ *
+ * Messages logged afterwards are written directly.  The rings are
+ * not freed, as other threads may still be using them.
+ */
+void radlog_async_stop(void)
+{
+	if (!log_async.running) return;
+
+	__atomic_store_n(&log_async.running, false, __ATOMIC_RELEASE);
+
+	pthread_mutex_lock(&log_async.mutex);
+	log_async.exiting = true;
+	pthread_cond_signal(&log_async.cond);
+	pthread_mutex_unlock(&log_async.mutex);
+
+	pthread_join(log_async.thread, NULL);
+}
+
+/** Write messages directly in a process forked from the server
+ *
+ * The logger thread doesn't exist in the child, so nothing would
+ * write out its queued messages.
+ */
+void radlog_async_forked(void)
+{
+	__atomic_store_n(&log_async.running, false, __ATOMIC_RELEASE);
+}
+
+/** How many messages have been dropped because a log buffer was full
+ *
+ */
+uint64_t radlog_dropped(void)
+{
+	uint64_t dropped;
+
+	if (!log_async.size) return 0;
+
+	pthread_mutex_lock(&log_async.mutex);
+	dropped = log_async_dropped();
+	pthread_mutex_unlock(&log_async.mutex);
+
+	return dropped;
+}
+#else
+int radlog_async_start(UNUSED uint32_t size)
+{
+	fr_strerror_printf("Asynchronous logging requires threads and atomic operations");
+	return -1;
+}
+
+void radlog_async_stop(void)
+{
+}
+
+void radlog_async_forked(void)
+{
+}
+
+uint64_t radlog_dropped(void)
+{
+	return 0;
+}
+#endif
+
+/*
+ *	Log the message to the logfile. Include the severity and
+ *	a time stamp.
+ */
+int vradlog(log_type_t type, char const *fmt, va_list ap)
+{
+	unsigned char *p;
+	char buffer[10240];	/* The largest config item size */
+	time_t when;
+
+	/*
+	 *	If we don't want any messages, then
+	 *	throw them away.
+	 */
+	if (default_log.dst == L_DST_NULL) {
+		return 0;
 	}
 
-	if (len < sizeof(buffer)) {
-		len += vsnprintf(buffer + len, sizeof(buffer) - len - 1, fmt, ap);
-	}
+	vsnprintf(buffer, sizeof(buffer), fmt, ap);
 
 	/*
 	 *	Filter out control chars and non UTF8 chars
 	 */
-	for (p = (unsigned char *)unsan; *p != '\0'; p++) {
+	for (p = (unsigned char *)buffer; *p != '\0'; p++) {
 		int clen;
 
 		switch (*p) {
@@ -417,58 +931,16 @@ int vradlog(log_type_t type, char const *fmt, va_list ap)
 		}
 	}
 
-	if (colourise && (len < sizeof(buffer))) {
-		len += strlcpy(buffer + len, VTC_RESET, sizeof(buffer) - len);
-	}
+	when = time(NULL);
 
-	if (len < (sizeof(buffer) - 2)) {
-		buffer[len]	= '\n';
-		buffer[len + 1] = '\0';
-	} else {
-		buffer[sizeof(buffer) - 2] = '\n';
-		buffer[sizeof(buffer) - 1] = '\0';
+#if defined(HAVE_PTHREAD_H) && defined(__ATOMIC_ACQUIRE)
+	if (__atomic_load_n(&log_async.running, __ATOMIC_ACQUIRE) &&
+	    (log_async_push(type, when, buffer) == 0)) {
+		return 0;
 	}
-
-	switch (default_log.dst) {
-
-#ifdef HAVE_SYSLOG_H
-	case L_DST_SYSLOG:
-		switch(type) {
-		case L_DBG:
-		case L_WARN:
-		case L_DBG_WARN:
-		case L_DBG_ERR:
-		case L_DBG_ERR_REQ:
-		case L_DBG_WARN_REQ:
-			type = LOG_DEBUG;
-			break;
-		case L_AUTH:
-		case L_PROXY:
-		case L_ACCT:
-			type = LOG_NOTICE;
-			break;
-		case L_INFO:
-			type = LOG_INFO;
-			break;
-		case L_ERR:
-			type = LOG_ERR;
-			break;
-		}
-		syslog(type, "%s", buffer);
-		break;
 #endif
 
-	case L_DST_FILES:
-	case L_DST_STDOUT:
-	case L_DST_STDERR:
-		return write(default_log.fd, buffer, strlen(buffer));
-
-	default:
-	case L_DST_NULL:	/* should have been caught above */
-		break;
-	}
-
-	return 0;
+	return log_write(type, when, buffer);
 }
 
 int radlog(log_type_t type, char const *msg, ...)
@@ -714,6 +1186,219 @@ void radlog_request(log_type_t type, log_debug_t lvl, REQUEST *request, char con
 	va_end(ap);
 }
 
+/*
+ *	Debug output for requests matching "debug condition" can be
+ *	captured in memory, instead of being written as it's produced.
+ *	It's only written out if the request fails, otherwise it's
+ *	thrown away.
+ *
+ *	Each line is formatted once, straight into the request's
+ *	buffer.  The arguments can't be kept for later, as they point
+ *	to attributes and stack buffers which are long gone by the
+ *	time the request finishes.  Everything else which makes
+ *	vradlog_request() slow (expanding the log file name, opening
+ *	the file, timestamps, and serialising on the log) is done
+ *	only when the lines are written out.
+ *
+ *	The buffer holds the most recent lines.  When it fills up, the
+ *	oldest quarter is dropped.
+ */
+#define LOG_CAPTURE_MAX_LINE	(1024)
+
+typedef struct log_capture_entry_t {
+	struct timeval	when;
+	char const	*module;
+	log_type_t	type;
+	log_debug_t	lvl;
+	uint8_t		indent;
+	uint16_t	len;		//!< Of the text which follows, including the '\0'.
+} log_capture_entry_t;
+
+struct log_capture {
+	struct timeval	start;
+	uint8_t		*buffer;
+	size_t		size;
+	size_t		used;
+	uint32_t	dropped;	//!< Lines pushed out by newer ones.
+};
+
+#define LOG_CAPTURE_ENTRY_SIZE(_len) (sizeof(log_capture_entry_t) + (((_len) + 7) & ~((size_t) 7)))
+
+/** Start capturing debug output for a request
+ *
+ * @param request to capture debug output for.
+ * @param size of the buffer.  It holds the most recent lines.
+ * @return true if the output is being captured, else false.
+ */
+bool log_capture_start(REQUEST *request, size_t size)
+{
+	log_capture_t *cap;
+
+	if (request->log.capture) return true;
+
+	if (size < (4 * LOG_CAPTURE_ENTRY_SIZE(LOG_CAPTURE_MAX_LINE))) return false;
+
+	cap = talloc_zero(request, log_capture_t);
+	if (!cap) return false;
+
+	cap->buffer = talloc_array(cap, uint8_t, size);
+	if (!cap->buffer) {
+		talloc_free(cap);
+		return false;
+	}
+	cap->size = size;
+	gettimeofday(&cap->start, NULL);
+
+	request->log.capture = cap;
+	request->log.func = vradlog_request_capture;
+
+	return true;
+}
+
+/*
+ *	Drop the oldest lines, so that there's at least "need" bytes
+ *	free at the end of the buffer.
+ */
+static void log_capture_drop(log_capture_t *cap, size_t need)
+{
+	size_t drop = 0;
+
+	while ((drop < cap->used) &&
+	       (((cap->size - cap->used + drop) < need) || (drop < (cap->size / 4)))) {
+		log_capture_entry_t *entry = (log_capture_entry_t *) (cap->buffer + drop);
+
+		drop += LOG_CAPTURE_ENTRY_SIZE(entry->len);
+		cap->dropped++;
+	}
+
+	memmove(cap->buffer, cap->buffer + drop, cap->used - drop);
+	cap->used -= drop;
+}
+
+/** Capture a log message for a request
+ *
+ * Used as request->log.func by log_capture_start().  Anything which
+ * isn't debug output is logged immediately, as usual.
+ *
+ * @param type the log category.
+ * @param lvl of debugging this message should be displayed at.
+ * @param request The current request.
+ * @param msg format string.
+ * @param ap arguments for the format string.
+ */
+void vradlog_request_capture(log_type_t type, log_debug_t lvl, REQUEST *request, char const *msg, va_list ap)
+{
+	log_capture_t *cap = request->log.capture;
+	log_capture_entry_t *entry;
+	size_t room;
+	int len;
+	va_list aq;
+
+	if (!cap || ((type & L_DBG) == 0)) {
+		vradlog_request(type, lvl, request, msg, ap);
+		return;
+	}
+
+	if (!radlog_debug_enabled(type, lvl, request)) return;
+
+	if ((cap->size - cap->used) < LOG_CAPTURE_ENTRY_SIZE(1)) {
+		log_capture_drop(cap, LOG_CAPTURE_ENTRY_SIZE(1));
+	}
+
+	entry = (log_capture_entry_t *) (cap->buffer + cap->used);
+	room = cap->size - cap->used - sizeof(*entry);
+	if (room > LOG_CAPTURE_MAX_LINE) room = LOG_CAPTURE_MAX_LINE;
+
+	va_copy(aq, ap);
+	len = vsnprintf((char *) (entry + 1), room, msg, aq);
+	va_end(aq);
+	if (len < 0) return;
+
+	/*
+	 *	It didn't fit in what's left of the buffer.  Make some
+	 *	room, and format it again.  Long lines are truncated.
+	 */
+	if (((size_t) len >= room) && (room < LOG_CAPTURE_MAX_LINE)) {
+		room = (size_t) len + 1;
+		if (room > LOG_CAPTURE_MAX_LINE) room = LOG_CAPTURE_MAX_LINE;
+
+		log_capture_drop(cap, LOG_CAPTURE_ENTRY_SIZE(room));
+
+		entry = (log_capture_entry_t *) (cap->buffer + cap->used);
+		va_copy(aq, ap);
+		len = vsnprintf((char *) (entry + 1), room, msg, aq);
+		va_end(aq);
+		if (len < 0) return;
+	}
+
+	if ((size_t) len >= room) len = room - 1;
+
+	gettimeofday(&entry->when, NULL);
+	entry->module = request->module;
+	entry->type = type;
+	entry->lvl = lvl;
+	entry->indent = request->log.indent;
+	entry->len = len + 1;
+
+	cap->used += LOG_CAPTURE_ENTRY_SIZE(entry->len);
+}
+
+/** Stop capturing debug output for a request
+ *
+ * If the request failed, the captured output is written to the log,
+ * along with anything else logged for the request after this.
+ * Otherwise it's thrown away, and the request goes back to the
+ * server's debug level.
+ *
+ * @param request being processed.
+ * @param flush write out the captured output.
+ */
+void log_capture_done(REQUEST *request, bool flush)
+{
+	log_capture_t *cap = request->log.capture;
+	uint8_t *p, *end;
+
+	if (!cap) return;
+
+	request->log.capture = NULL;
+	request->log.func = vradlog_request;
+
+	if (!flush) {
+		request->log.lvl = debug_flag;
+		talloc_free(cap);
+		return;
+	}
+
+	if (cap->dropped) {
+		radlog_request(L_DBG, L_DBG_LVL_1, request, "Captured debug output (the first %u lines were dropped)",
+			       cap->dropped);
+	} else {
+		radlog_request(L_DBG, L_DBG_LVL_1, request, "Captured debug output");
+	}
+
+	p = cap->buffer;
+	end = cap->buffer + cap->used;
+	while (p < end) {
+		log_capture_entry_t *entry = (log_capture_entry_t *) p;
+		char const *module = request->module;
+		uint8_t indent = request->log.indent;
+		struct timeval elapsed;
+
+		timersub(&entry->when, &cap->start, &elapsed);
+
+		request->module = entry->module;
+		request->log.indent = entry->indent;
+		radlog_request(entry->type, entry->lvl, request, "(+%d.%06d) %s",
+			       (int) elapsed.tv_sec, (int) elapsed.tv_usec, (char const *) (entry + 1));
+		request->module = module;
+		request->log.indent = indent;
+
+		p += LOG_CAPTURE_ENTRY_SIZE(entry->len);
+	}
+
+	talloc_free(cap);
+}
+
 /** Martial variadic log arguments into a va_list and pass to error logging functions
  *
  * This could all be done in a macro, but it turns out some implementations of the
@@ -860,12 +1545,64 @@ typedef struct fr_logfile_entry_t {
 } fr_logfile_entry_t;
 
 
+/*
+ *	Waits for a record to be written by the writer thread.
+ */
+typedef struct fr_logfile_wait_t {
+	bool		done;
+	int		rcode;
+} fr_logfile_wait_t;
+
+typedef struct fr_logfile_record_t fr_logfile_record_t;
+
+struct fr_logfile_record_t {
+	fr_logfile_record_t	*next;
+	char const		*filename;
+	mode_t			permissions;
+	uint8_t const		*data;
+	size_t			len;
+	fr_logfile_record_t	*group;		//!< First record for the same file, once written.
+	fr_logfile_wait_t	*wait;		//!< Or NULL if nobody is waiting.
+};
+
+/*
+ *	Wake the writer thread early when this much data is queued.
+ */
+#define LOGFILE_BATCH_MAX	(1 << 20)
+
+/*
+ *	Writers wait when this much data is queued, so that a slow
+ *	disk can't make the queue use all of the memory.
+ */
+#define LOGFILE_QUEUE_MAX	(16 << 20)
+#define LOGFILE_IOV_MAX		(64)
+
 struct fr_logfile_t {
 	uint32_t max_entries;
 #ifdef HAVE_PTHREAD_H
 	pthread_mutex_t mutex;
 #endif
 	fr_logfile_entry_t *entries;
+
+	fr_logfile_encode_t	encode;			//!< Applied to each batch before it's written.
+	void			*encode_ctx;
+
+#ifdef HAVE_PTHREAD_H
+	bool			async;			//!< Records are written by the writer thread.
+	uint32_t		commit_interval;	//!< Milliseconds to wait for more records.
+	bool			fsync;			//!< Sync each batch, and wait for it.
+	gid_t			gid;			//!< To give the files, or -1.
+
+	bool			running;		//!< The writer thread has been started.
+	pthread_t		writer;
+	pthread_mutex_t		queue_mutex;
+	pthread_cond_t		queue_cond;		//!< Signalled when records are queued.
+	pthread_cond_t		done_cond;		//!< Broadcast when a batch is written.
+	fr_logfile_record_t	*head;
+	fr_logfile_record_t	**tail;
+	size_t			queued;			//!< Bytes.
+	bool			exiting;
+#endif
 };
 
 
@@ -885,6 +1622,27 @@ static int _logfile_free(fr_logfile_t *lf)
 {
 	uint32_t i;
 
+#ifdef HAVE_PTHREAD_H
+	/*
+	 *	Let the writer thread flush everything which has been
+	 *	queued.
+	 */
+	if (lf->async) {
+		if (lf->running) {
+			pthread_mutex_lock(&lf->queue_mutex);
+			lf->exiting = true;
+			pthread_cond_signal(&lf->queue_cond);
+			pthread_mutex_unlock(&lf->queue_mutex);
+
+			pthread_join(lf->writer, NULL);
+		}
+
+		pthread_cond_destroy(&lf->done_cond);
+		pthread_cond_destroy(&lf->queue_cond);
+		pthread_mutex_destroy(&lf->queue_mutex);
+	}
+#endif
+
 	PTHREAD_MUTEX_LOCK(&lf->mutex);
 
 	for (i = 0; i < lf->max_entries; i++) {
@@ -1186,3 +1944,361 @@ int fr_logfile_unlock(fr_logfile_t *lf, int fd)
 	fr_strerror_printf("Attempt to unlock file which does not exist");
 	return -1;
 }
+
+/*
+ *	Write all of the data, even if the kernel only takes some of it.
+ */
+static int logfile_writev(int fd, struct iovec *iov, int iovcnt)
+{
+	ssize_t len;
+
+	while (iovcnt > 0) {
+		len = writev(fd, iov, iovcnt);
+		if (len < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+
+		while ((iovcnt > 0) && ((size_t) len >= iov->iov_len)) {
+			len -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+
+		if (iovcnt > 0) {
+			iov->iov_base = ((uint8_t *) iov->iov_base) + len;
+			iov->iov_len -= len;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ *	Encode data, and write it as one chunk.
+ */
+static int logfile_encode_write(fr_logfile_t *lf, int fd, uint8_t const *data, size_t len)
+{
+	int		rcode;
+	ssize_t		slen;
+	uint8_t		*out;
+	struct iovec	iov;
+
+	slen = lf->encode(NULL, &out, data, len, lf->encode_ctx);
+	if (slen < 0) return -1;
+
+	iov.iov_base = out;
+	iov.iov_len = slen;
+
+	rcode = logfile_writev(fd, &iov, 1);
+	talloc_free(out);
+
+	return rcode;
+}
+
+#ifdef HAVE_PTHREAD_H
+/*
+ *	Write a batch of records.  All of the records for one file are
+ *	written while holding the lock for that file, in as few system
+ *	calls as possible.
+ */
+static void logfile_write_batch(fr_logfile_t *lf, fr_logfile_record_t *batch)
+{
+	int			fd, rcode, iovcnt;
+	struct iovec		iov[LOGFILE_IOV_MAX];
+	fr_logfile_record_t	*rec, *first;
+	uint8_t			*raw = NULL;
+	size_t			raw_len, raw_size = 0;
+
+	for (first = batch; first; first = first->next) {
+		if (first->group) continue;
+
+		rcode = 0;
+		fd = fr_logfile_open(lf, first->filename, first->permissions);
+		if (fd < 0) {
+			ERROR("Failed to open %s: %s", first->filename, fr_strerror());
+			rcode = -1;
+
+		} else if ((lf->gid != (gid_t) -1) && (fchown(fd, -1, lf->gid) < 0)) {
+			DEBUG2("Unable to change system group of \"%s\"", first->filename);
+		}
+
+		iovcnt = 0;
+		raw_len = 0;
+		for (rec = first; rec; rec = rec->next) {
+			if (rec->group || (strcmp(rec->filename, first->filename) != 0)) continue;
+
+			rec->group = first;
+			if (rcode < 0) continue;
+
+			/*
+			 *	Records are encoded in chunks of up to
+			 *	LOGFILE_BATCH_MAX, plus one record.
+			 */
+			if (lf->encode) {
+				if (raw_len >= LOGFILE_BATCH_MAX) {
+					if (logfile_encode_write(lf, fd, raw, raw_len) < 0) rcode = -1;
+					raw_len = 0;
+				}
+
+				if ((raw_len + rec->len) > raw_size) {
+					uint8_t *tmp;
+
+					/*
+					 *	On failure, keep the buffer we
+					 *	have, and drop this record.
+					 */
+					tmp = talloc_realloc(NULL, raw, uint8_t, raw_len + rec->len + LOGFILE_BATCH_MAX);
+					if (!tmp) {
+						rcode = -1;
+						continue;
+					}
+					raw = tmp;
+					raw_size = raw_len + rec->len + LOGFILE_BATCH_MAX;
+				}
+
+				memcpy(raw + raw_len, rec->data, rec->len);
+				raw_len += rec->len;
+				continue;
+			}
+
+			memcpy(&iov[iovcnt].iov_base, &rec->data, sizeof(iov[iovcnt].iov_base));
+			iov[iovcnt].iov_len = rec->len;
+			iovcnt++;
+
+			if (iovcnt < LOGFILE_IOV_MAX) continue;
+
+			if (logfile_writev(fd, iov, iovcnt) < 0) rcode = -1;
+			iovcnt = 0;
+		}
+
+		if ((rcode == 0) && (iovcnt > 0) && (logfile_writev(fd, iov, iovcnt) < 0)) rcode = -1;
+		if ((rcode == 0) && (raw_len > 0) && (logfile_encode_write(lf, fd, raw, raw_len) < 0)) rcode = -1;
+
+		if (rcode < 0) {
+			if (fd >= 0) ERROR("Failed writing to %s: %s", first->filename, fr_syserror(errno));
+
+		} else if (lf->fsync && (fsync(fd) < 0)) {
+			ERROR("Failed syncing %s: %s", first->filename, fr_syserror(errno));
+			rcode = -1;
+		}
+
+		if (fd >= 0) fr_logfile_close(lf, fd);
+
+		for (rec = first; rec; rec = rec->next) {
+			if ((rec->group == first) && rec->wait) rec->wait->rcode = rcode;
+		}
+	}
+
+	talloc_free(raw);
+}
+
+static void *logfile_writer(void *arg)
+{
+	fr_logfile_t		*lf = arg;
+	fr_logfile_record_t	*batch, *next;
+	struct timeval		now;
+	struct timespec		when;
+
+	pthread_mutex_lock(&lf->queue_mutex);
+	while (true) {
+		while (!lf->head && !lf->exiting) pthread_cond_wait(&lf->queue_cond, &lf->queue_mutex);
+		if (!lf->head) break;
+
+		/*
+		 *	Give the other threads a chance to add to this
+		 *	batch, so that we write and sync once for all of
+		 *	them.
+		 */
+		if (lf->commit_interval > 0) {
+			gettimeofday(&now, NULL);
+			now.tv_usec += (lf->commit_interval % 1000) * 1000;
+			when.tv_sec = now.tv_sec + (lf->commit_interval / 1000) + (now.tv_usec / 1000000);
+			when.tv_nsec = (now.tv_usec % 1000000) * 1000;
+
+			while (!lf->exiting && (lf->queued < LOGFILE_BATCH_MAX)) {
+				if (pthread_cond_timedwait(&lf->queue_cond, &lf->queue_mutex, &when) == ETIMEDOUT) break;
+			}
+		}
+
+		batch = lf->head;
+		lf->head = NULL;
+		lf->tail = &lf->head;
+		lf->queued = 0;
+		pthread_mutex_unlock(&lf->queue_mutex);
+
+		logfile_write_batch(lf, batch);
+
+		pthread_mutex_lock(&lf->queue_mutex);
+		for (; batch; batch = next) {
+			next = batch->next;
+			if (batch->wait) batch->wait->done = true;
+			talloc_free(batch);
+		}
+		pthread_cond_broadcast(&lf->done_cond);
+	}
+	pthread_mutex_unlock(&lf->queue_mutex);
+
+	return NULL;
+}
+#endif
+
+/** Write records to log files from a dedicated thread
+ *
+ * Records passed to fr_logfile_write() are queued, and written in
+ * batches by the writer thread, which holds each file lock once per
+ * batch instead of once per record.
+ *
+ * The thread is started by the first write, as modules are
+ * instantiated before the server forks into the background.
+ *
+ * @param lf The logfile context returned from fr_logfile_init().
+ * @param commit_interval how long (in milliseconds) to wait for more
+ *	records before writing a batch.
+ * @param fsync sync each batch to disk, and don't return from
+ *	fr_logfile_write() until the record has been synced.
+ * @param gid to change the group of the files to, or -1.
+ * @return 0 on success, or -1 on error.
+ */
+int fr_logfile_async(fr_logfile_t *lf, uint32_t commit_interval, bool fsync, gid_t gid)
+{
+#ifdef HAVE_PTHREAD_H
+	if (lf->async) return 0;
+
+	lf->commit_interval = commit_interval;
+	lf->fsync = fsync;
+	lf->gid = gid;
+	lf->head = NULL;
+	lf->tail = &lf->head;
+
+	if (pthread_mutex_init(&lf->queue_mutex, NULL) != 0) {
+		fr_strerror_printf("Failed initializing mutex: %s", fr_syserror(errno));
+		return -1;
+	}
+	pthread_cond_init(&lf->queue_cond, NULL);
+	pthread_cond_init(&lf->done_cond, NULL);
+
+	lf->async = true;
+	return 0;
+#else
+	fr_strerror_printf("Asynchronous writes require threads");
+	return -1;
+#endif
+}
+
+/** Append a record to a log file
+ *
+ * If the writer thread has been started with fr_logfile_async(), the
+ * record is queued.  Otherwise it's written immediately.  When more
+ * than LOGFILE_QUEUE_MAX bytes are queued, this waits until the writer
+ * thread has taken them.
+ *
+ * @param lf The logfile context returned from fr_logfile_init().
+ * @param filename the file to write to.
+ * @param permissions to use if the file is created.
+ * @param data to write.
+ * @param len of the data.
+ * @return 0 on success, or -1 on error.  Errors from queued records are
+ *	only returned if the writer was started with fsync.
+ */
+int fr_logfile_write(fr_logfile_t *lf, char const *filename, mode_t permissions, void const *data, size_t len)
+{
+	int fd, rcode;
+	struct iovec iov;
+
+#ifdef HAVE_PTHREAD_H
+	if (lf->async) {
+		fr_logfile_record_t	*rec;
+		fr_logfile_wait_t	wait;
+		size_t			namelen = strlen(filename) + 1;
+		bool			wake;
+
+		/*
+		 *	One allocation, which the writer thread frees.
+		 */
+		rec = talloc_size(NULL, sizeof(*rec) + namelen + len);
+		if (!rec) {
+			fr_strerror_printf("Out of memory");
+			return -1;
+		}
+		talloc_set_name_const(rec, "fr_logfile_record_t");
+
+		memset(rec, 0, sizeof(*rec));
+		rec->filename = memcpy((uint8_t *) (rec + 1), filename, namelen);
+		rec->data = memcpy((uint8_t *) (rec + 1) + namelen, data, len);
+		rec->len = len;
+		rec->permissions = permissions;
+		if (lf->fsync) {
+			wait.done = false;
+			wait.rcode = 0;
+			rec->wait = &wait;
+		}
+
+		pthread_mutex_lock(&lf->queue_mutex);
+		if (!lf->running) {
+			rcode = pthread_create(&lf->writer, NULL, logfile_writer, lf);
+			if (rcode != 0) {
+				pthread_mutex_unlock(&lf->queue_mutex);
+				talloc_free(rec);
+				fr_strerror_printf("Failed creating writer thread: %s", fr_syserror(rcode));
+				return -1;
+			}
+			lf->running = true;
+		}
+
+		while ((lf->queued >= LOGFILE_QUEUE_MAX) && !lf->exiting) {
+			pthread_cond_wait(&lf->done_cond, &lf->queue_mutex);
+		}
+
+		wake = !lf->head;
+		*lf->tail = rec;
+		lf->tail = &rec->next;
+		lf->queued += len;
+		if (wake || (lf->queued >= LOGFILE_BATCH_MAX)) pthread_cond_signal(&lf->queue_cond);
+
+		if (!lf->fsync) {
+			pthread_mutex_unlock(&lf->queue_mutex);
+			return 0;
+		}
+
+		while (!wait.done) pthread_cond_wait(&lf->done_cond, &lf->queue_mutex);
+		pthread_mutex_unlock(&lf->queue_mutex);
+
+		if (wait.rcode < 0) fr_strerror_printf("Failed writing to %s", filename);
+		return wait.rcode;
+	}
+#endif
+
+	fd = fr_logfile_open(lf, filename, permissions);
+	if (fd < 0) return -1;
+
+	if (lf->encode) {
+		rcode = logfile_encode_write(lf, fd, data, len);
+	} else {
+		memcpy(&iov.iov_base, &data, sizeof(iov.iov_base));
+		iov.iov_len = len;
+
+		rcode = logfile_writev(fd, &iov, 1);
+	}
+	if (rcode < 0) fr_strerror_printf("Failed writing to %s: %s", filename, fr_syserror(errno));
+
+	fr_logfile_close(lf, fd);
+
+	return rcode;
+}
+
+/** Set a function to transform data before it's written
+ *
+ * The function is called with all of the records for one file in a
+ * batch (or with one record, if there's no writer thread), and its
+ * output is written instead.  e.g. to compress the data.
+ *
+ * @param lf The logfile context returned from fr_logfile_init().
+ * @param encode function, or NULL to write records unchanged.
+ * @param uctx passed to the function.
+ */
+void fr_logfile_encoder(fr_logfile_t *lf, fr_logfile_encode_t encode, void *uctx)
+{
+	lf->encode = encode;
+	lf->encode_ctx = uctx;
+}
@@ -51,6 +51,7 @@ RCSID("$Id$")
 
 struct main_config_t main_config;
 fr_cond_t *debug_condition;
+size_t debug_capture_size;
 extern bool log_dates_utc;
 
 typedef struct cached_config_t {
@@ -99,6 +100,9 @@ static const CONF_PARSER security_config[] = {
 	{ "max_attributes",  FR_CONF_POINTER(PW_TYPE_INTEGER, &fr_max_attributes), STRINGIFY(0) },
 	{ "reject_delay",  FR_CONF_POINTER(PW_TYPE_INTEGER, &main_config.reject_delay), STRINGIFY(0) },
 	{ "status_server", FR_CONF_POINTER(PW_TYPE_BOOLEAN, &main_config.status_server), "no"},
+#ifdef WITH_DYNAMIC_CLIENTS
+	{ "dynamic_client_threads", FR_CONF_POINTER(PW_TYPE_INTEGER, &main_config.dynamic_client_threads), "0" },
+#endif
 #ifdef ENABLE_OPENSSL_VERSION_CHECK
 	{ "allow_vulnerable_openssl", FR_CONF_POINTER(PW_TYPE_STRING, &main_config.allow_vulnerable_openssl), "no"},
 #endif
@@ -106,6 +110,16 @@ static const CONF_PARSER security_config[] = {
 };
 
 
+static const CONF_PARSER dns_config[] = {
+	{ "cache_size", FR_CONF_POINTER(PW_TYPE_INTEGER, &main_config.dns_cache_size), "0" },
+	{ "ttl", FR_CONF_POINTER(PW_TYPE_INTEGER, &main_config.dns_ttl), "300" },
+	{ "negative_ttl", FR_CONF_POINTER(PW_TYPE_INTEGER, &main_config.dns_negative_ttl), "30" },
+	{ "prefetch", FR_CONF_POINTER(PW_TYPE_INTEGER, &main_config.dns_prefetch), "30" },
+	{ "threads", FR_CONF_POINTER(PW_TYPE_INTEGER, &main_config.dns_threads), "2" },
+	{ NULL, -1, 0, NULL, NULL }
+};
+
+
 /*
  *	Logging configuration for the server.
  */
@@ -137,6 +151,8 @@ static const CONF_PARSER log_config_nodest[] = {
 	{ "msg_goodpass", FR_CONF_POINTER(PW_TYPE_STRING, &main_config.auth_goodpass_msg), NULL},
 	{ "colourise",FR_CONF_POINTER(PW_TYPE_BOOLEAN, &do_colourise), NULL },
 	{ "use_utc", FR_CONF_POINTER(PW_TYPE_BOOLEAN, &log_dates_utc), NULL },
+	{ "async", FR_CONF_POINTER(PW_TYPE_BOOLEAN, &main_config.log_async), "no" },
+	{ "async_buffer", FR_CONF_POINTER(PW_TYPE_INTEGER, &main_config.log_async_buffer), "65536" },
 	{ "msg_denied", FR_CONF_POINTER(PW_TYPE_STRING, &main_config.denied_msg),
 	  "You are already logged in - access denied" },
 
@@ -168,6 +184,13 @@ static const CONF_PARSER server_config[] = {
 	{ "max_request_time", FR_CONF_POINTER(PW_TYPE_INTEGER, &main_config.max_request_time), STRINGIFY(MAX_REQUEST_TIME) },
 	{ "cleanup_delay", FR_CONF_POINTER(PW_TYPE_INTEGER, &main_config.cleanup_delay), STRINGIFY(CLEANUP_DELAY) },
 	{ "max_requests", FR_CONF_POINTER(PW_TYPE_INTEGER, &main_config.max_requests), STRINGIFY(MAX_REQUESTS) },
+	{ "num_workers", FR_CONF_POINTER(PW_TYPE_INTEGER, &main_config.num_workers), "1" },
+	{ "timer_wheel", FR_CONF_POINTER(PW_TYPE_BOOLEAN, &main_config.timer_wheel), "no" },
+	{ "coarse_clock", FR_CONF_POINTER(PW_TYPE_BOOLEAN, &main_config.coarse_clock), "no" },
+	{ "reorder_conditions", FR_CONF_POINTER(PW_TYPE_BOOLEAN, &main_config.reorder_conditions), "no" },
+	{ "profile_conditions", FR_CONF_POINTER(PW_TYPE_BOOLEAN, &main_config.profile_conditions), "no" },
+	{ "profile_modules", FR_CONF_POINTER(PW_TYPE_BOOLEAN, &main_config.profile_modules), "no" },
+	{ "profile_modules_sample", FR_CONF_POINTER(PW_TYPE_INTEGER, &main_config.profile_modules_sample), "16" },
 	{ "pidfile", FR_CONF_POINTER(PW_TYPE_STRING, &main_config.pid_file), "${run_dir}/radiusd.pid"},
 	{ "checkrad", FR_CONF_POINTER(PW_TYPE_STRING, &main_config.checkrad), "${sbindir}/checkrad" },
 
@@ -193,6 +216,8 @@ static const CONF_PARSER server_config[] = {
 
 	{  "security", FR_CONF_POINTER(PW_TYPE_SUBSECTION, NULL), (void const *) security_config },
 
+	{  "dns", FR_CONF_POINTER(PW_TYPE_SUBSECTION, NULL), (void const *) dns_config },
+
 	{ NULL, -1, 0, NULL, NULL }
 };
 
@@ -749,6 +774,7 @@ int main_config_init(void)
 	 *	the ones in raddb.
 	 */
 	DEBUG2("including dictionary file %s/%s", main_config.dictionary_dir, RADIUS_DICTIONARY);
+	dict_set_cache(main_config.dictionary_cache);
 	if (dict_init(main_config.dictionary_dir, RADIUS_DICTIONARY) != 0) {
 		ERROR("Errors reading dictionary: %s",
 		      fr_strerror());
@@ -789,7 +815,7 @@ do {\
 	/* Read the configuration file */
 	snprintf(buffer, sizeof(buffer), "%.200s/%.50s.conf",
 		 radius_dir, main_config.name);
-	if ((cs = cf_file_read(buffer)) == NULL) {
+	if ((cs = cf_file_read_snapshot(buffer, main_config.config_snapshot)) == NULL) {
 		ERROR("Errors reading or parsing %s", buffer);
 		return -1;
 	}
@@ -910,6 +936,29 @@ do {\
 	FR_INTEGER_COND_CHECK("max_request_time", main_config.max_request_time, (main_config.max_request_time != 0), 100);
 	FR_INTEGER_BOUND_CHECK("reject_delay", main_config.reject_delay, <=, 10);
 	FR_INTEGER_BOUND_CHECK("cleanup_delay", main_config.cleanup_delay, <=, 10);
+	FR_INTEGER_BOUND_CHECK("profile_modules_sample", main_config.profile_modules_sample, >=, 1);
+	FR_INTEGER_BOUND_CHECK("num_workers", main_config.num_workers, >=, 1);
+	FR_INTEGER_BOUND_CHECK("num_workers", main_config.num_workers, <=, 64);
+#ifndef SO_REUSEPORT
+	if (main_config.num_workers > 1) {
+		ERROR("System does not support SO_REUSEPORT.  Delete \"num_workers\" from the configuration file");
+		return -1;
+	}
+#endif
+	FR_INTEGER_BOUND_CHECK("log.async_buffer", main_config.log_async_buffer, >=, 16384);
+	FR_INTEGER_BOUND_CHECK("log.async_buffer", main_config.log_async_buffer, <=, 16 * 1024 * 1024);
+	FR_INTEGER_BOUND_CHECK("dns.ttl", main_config.dns_ttl, >=, 1);
+	FR_INTEGER_BOUND_CHECK("dns.threads", main_config.dns_threads, <=, 64);
+
+	/*
+	 *	Before the clients and home servers are loaded, so
+	 *	that their hostnames are cached, too.
+	 */
+	if (fr_dns_cache_init(main_config.dns_cache_size, main_config.dns_ttl, main_config.dns_negative_ttl,
+			      main_config.dns_prefetch, main_config.dns_threads) < 0) {
+		ERROR("%s", fr_strerror());
+		return -1;
+	}
 
 	/*
 	 * Set default initial request processing delay to 1/3 of a second.
@@ -1070,6 +1119,8 @@ void main_config_hup(void)
 	 */
 	hup_logfile();
 
+	clients_hup(cs);
+
 	INFO("HUP - loading modules");
 
 	/*
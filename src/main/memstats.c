@@ -0,0 +1,170 @@
+/*
+ * memstats.c	Memory accounting for the server subsystems.
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2015  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/memstats.h>
+
+/*
+ *	Each subsystem counts the objects it allocates and frees, with
+ *	atomic adds, so the counters can be left on all of the time.
+ *
+ *	Walking a talloc tree to find its size is too slow to do for
+ *	every object, so only one in MEMSTATS_SAMPLE objects is
+ *	measured, and the byte counts are the number of objects
+ *	times their average sampled size.  Objects are measured when
+ *	they're allocated if they're complete by then (cache entries),
+ *	or when they're freed if they grow while they're in use
+ *	(requests).
+ *
+ *	The dictionaries and configuration don't change between HUPs,
+ *	so their sizes are set directly.
+ */
+#define MEMSTATS_SAMPLE (64)
+
+#define MS_LOAD(_x)		__atomic_load_n(&(_x), __ATOMIC_RELAXED)
+#define MS_STORE(_x, _v)	__atomic_store_n(&(_x), _v, __ATOMIC_RELAXED)
+#define MS_ADD(_x, _v)		__atomic_add_fetch(&(_x), _v, __ATOMIC_RELAXED)
+#define MS_SUB(_x, _v)		__atomic_sub_fetch(&(_x), _v, __ATOMIC_RELAXED)
+
+typedef struct memstats_account_t {
+	char const	*name;
+	uint64_t	num;
+	uint64_t	max_num;
+	uint64_t	total;
+	uint64_t	avg_size;
+	uint64_t	max_bytes;
+	uint64_t	bytes;		//!< Only for types whose size is set.
+	uint32_t	samples;
+} memstats_account_t;
+
+static memstats_account_t memstats[MEMSTATS_NUM_TYPES] = {
+	[MEMSTATS_REQUEST]	= { .name = "requests" },
+	[MEMSTATS_EAP_SESSION]	= { .name = "eap_sessions" },
+	[MEMSTATS_TLS_SESSION]	= { .name = "tls_sessions" },
+	[MEMSTATS_CACHE]	= { .name = "cache_entries" },
+	[MEMSTATS_CONNECTION]	= { .name = "connections" },
+	[MEMSTATS_DICTIONARY]	= { .name = "dictionary" },
+	[MEMSTATS_CONFIG]	= { .name = "config" },
+};
+
+static void memstats_max(uint64_t *max, uint64_t value)
+{
+	uint64_t old = __atomic_load_n(max, __ATOMIC_RELAXED);
+
+	while (value > old) {
+		if (__atomic_compare_exchange_n(max, &old, value, true,
+						__ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+	}
+}
+
+/*
+ *	Measure one in MEMSTATS_SAMPLE objects, and keep a moving
+ *	average of their sizes.  Races between threads can lose a
+ *	sample, which doesn't matter.
+ */
+static void memstats_sample(memstats_account_t *ma, TALLOC_CTX const *ctx)
+{
+	uint64_t size, avg;
+
+	if (!ctx) return;
+
+	if ((MS_ADD(ma->samples, 1) % MEMSTATS_SAMPLE) != 1) return;
+
+	size = talloc_total_size(ctx);
+	avg = MS_LOAD(ma->avg_size);
+	if (avg) {
+		avg = avg - (avg / 8) + (size / 8);
+	} else {
+		avg = size;
+	}
+	MS_STORE(ma->avg_size, avg);
+}
+
+/** Count an object which has been allocated
+ *
+ * @param type of object.
+ * @param ctx the object, if it can be measured now, or NULL.
+ */
+void memstats_alloc(memstats_type_t type, TALLOC_CTX const *ctx)
+{
+	memstats_account_t *ma = &memstats[type];
+	uint64_t num;
+
+	num = MS_ADD(ma->num, 1);
+	MS_ADD(ma->total, 1);
+
+	memstats_sample(ma, ctx);
+
+	memstats_max(&ma->max_num, num);
+	memstats_max(&ma->max_bytes, num * MS_LOAD(ma->avg_size));
+}
+
+/** Count an object which is being freed
+ *
+ * @param type of object.
+ * @param ctx the object, if it can be measured now, or NULL.
+ */
+void memstats_free(memstats_type_t type, TALLOC_CTX const *ctx)
+{
+	memstats_account_t *ma = &memstats[type];
+
+	memstats_sample(ma, ctx);
+
+	MS_SUB(ma->num, 1);
+}
+
+/** Set the size of a subsystem which isn't counted object by object
+ *
+ * @param type of object.
+ * @param num of objects.
+ * @param bytes they use in total.
+ */
+void memstats_set(memstats_type_t type, uint64_t num, uint64_t bytes)
+{
+	memstats_account_t *ma = &memstats[type];
+
+	MS_STORE(ma->num, num);
+	MS_STORE(ma->bytes, bytes);
+	MS_STORE(ma->avg_size, num ? bytes / num : 0);
+
+	memstats_max(&ma->max_num, num);
+	memstats_max(&ma->max_bytes, bytes);
+}
+
+void memstats_get(memstats_type_t type, memstats_t *stats)
+{
+	memstats_account_t *ma = &memstats[type];
+
+	stats->name = ma->name;
+	stats->num = MS_LOAD(ma->num);
+	stats->max_num = MS_LOAD(ma->max_num);
+	stats->total = MS_LOAD(ma->total);
+	stats->avg_size = MS_LOAD(ma->avg_size);
+	stats->max_bytes = MS_LOAD(ma->max_bytes);
+
+	stats->bytes = MS_LOAD(ma->bytes);
+	if (!stats->bytes) stats->bytes = stats->num * stats->avg_size;
+
+	if (stats->bytes > stats->max_bytes) stats->max_bytes = stats->bytes;
+}
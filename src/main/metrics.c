@@ -0,0 +1,965 @@
+/*
+ * metrics.c	Serve the server statistics as OpenMetrics text.
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2015  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/modpriv.h>
+#include <freeradius-devel/metrics.h>
+#include <freeradius-devel/rad_assert.h>
+
+#ifdef WITH_METRICS
+#include <sys/select.h>
+
+extern bool check_config;
+extern const FR_NAME_NUMBER mod_rcode_table[];
+
+/*
+ *	A "listen { type = metrics }" section is a small HTTP server
+ *	with its own thread.  It isn't put into the event loop, and
+ *	it never creates requests.  Each GET of /metrics walks the
+ *	same counters as Status-Server, and copies them before
+ *	printing them.  The counters are updated without locks, so
+ *	a scrape may see one counter updated, and another one not.
+ *	Prometheus et al. don't care.
+ *
+ *	Scrapers from outside the "allow" networks get a 403.
+ */
+#define METRICS_CONTENT_TYPE	"application/openmetrics-text; version=1.0.0; charset=utf-8"
+#define METRICS_REQUEST_MAX	(4096)
+#define METRICS_TIMEOUT		(2)		//!< Seconds to wait for a scraper to read or write.
+
+static CONF_PARSER metrics_config[] = {
+	{ "ipaddr", FR_CONF_OFFSET(PW_TYPE_IP_ADDR, listen_metrics_t, my_ipaddr), "127.0.0.1" },
+	{ "port", FR_CONF_OFFSET(PW_TYPE_SHORT, listen_metrics_t, my_port), "9812" },
+
+	{ NULL, -1, 0, NULL, NULL }		/* end the list */
+};
+
+/*
+ *	Indexed by RAD_LISTEN_TYPE, for the queue lengths.
+ */
+static char const *metrics_listen_names[RAD_LISTEN_MAX] = {
+	"status",
+	"proxy",
+	"auth",
+	"acct",
+	"detail",
+	"vmps",
+	"dhcp",
+	"control",
+	"coa",
+	"metrics"
+};
+
+typedef struct metrics_buf_t {
+	char		*data;
+	size_t		len;
+	size_t		size;
+	bool		error;		//!< Ran out of memory.
+} metrics_buf_t;
+
+/*
+ *	A copy of one set of counters, with the labels which
+ *	identify it.
+ */
+typedef struct metrics_source_t {
+	char		labels[256];	//!< Already escaped.
+	fr_stats_t	stats;
+
+	int		state;		//!< Home servers only.
+	uint32_t	outstanding;
+	uint32_t	latency;
+} metrics_source_t;
+
+typedef struct metrics_list_t {
+	metrics_source_t *source;
+	int		num;
+	int		size;
+} metrics_list_t;
+
+typedef struct metrics_module_t {
+	char		labels[256];
+	module_stats_t	stats;
+} metrics_module_t;
+
+typedef struct metrics_module_list_t {
+	metrics_module_t *module;
+	int		num;
+	int		size;
+} metrics_module_list_t;
+
+static const struct {
+	char const	*name;
+	char const	*help;
+	size_t		offset;
+} metrics_counters[] = {
+	{ "requests", "Requests received", offsetof(fr_stats_t, total_requests) },
+	{ "invalid_requests", "Requests from unknown clients", offsetof(fr_stats_t, total_invalid_requests) },
+	{ "dup_requests", "Duplicate requests", offsetof(fr_stats_t, total_dup_requests) },
+	{ "responses", "Responses sent", offsetof(fr_stats_t, total_responses) },
+	{ "access_accepts", "Access-Accepts sent", offsetof(fr_stats_t, total_access_accepts) },
+	{ "access_rejects", "Access-Rejects sent", offsetof(fr_stats_t, total_access_rejects) },
+	{ "access_challenges", "Access-Challenges sent", offsetof(fr_stats_t, total_access_challenges) },
+	{ "malformed_requests", "Malformed requests", offsetof(fr_stats_t, total_malformed_requests) },
+	{ "bad_authenticators", "Requests with bad authenticators", offsetof(fr_stats_t, total_bad_authenticators) },
+	{ "packets_dropped", "Requests dropped", offsetof(fr_stats_t, total_packets_dropped) },
+	{ "unknown_types", "Packets of unknown type", offsetof(fr_stats_t, total_unknown_types) },
+	{ "timeouts", "Requests which timed out", offsetof(fr_stats_t, total_timeouts) },
+
+	{ NULL, NULL, 0 }
+};
+
+static const struct {
+	unsigned int	permille;
+	char const	*quantile;
+} metrics_quantiles[] = {
+	{ 500, "0.5" },
+	{ 900, "0.9" },
+	{ 990, "0.99" },
+	{ 999, "0.999" },
+
+	{ 0, NULL }
+};
+
+/*
+ *	Upper bounds of the connection pool histogram buckets.  The
+ *	last bucket has no upper bound.
+ */
+static char const *metrics_pool_buckets[FR_CONNECTION_POOL_HIST_BUCKETS - 1] = {
+	"1e-05", "0.0001", "0.001", "0.01", "0.1", "1"
+};
+
+/*
+ *	The thread can't use talloc, as it may be tracking NULL
+ *	contexts for the main thread.
+ */
+static void CC_HINT(format (printf, 2, 3)) metrics_printf(metrics_buf_t *buf, char const *fmt, ...)
+{
+	va_list	ap;
+	int	len;
+
+	if (buf->error) return;
+
+	while (true) {
+		char *data;
+		size_t size;
+
+		va_start(ap, fmt);
+		len = vsnprintf(buf->data + buf->len, buf->size - buf->len, fmt, ap);
+		va_end(ap);
+		if (len < 0) {
+			buf->error = true;
+			return;
+		}
+
+		if ((size_t) len < (buf->size - buf->len)) break;
+
+		size = (buf->size * 2) + len;
+		data = realloc(buf->data, size);
+		if (!data) {
+			buf->error = true;
+			return;
+		}
+		buf->data = data;
+		buf->size = size;
+	}
+
+	buf->len += len;
+}
+
+/*
+ *	Label values may contain backslashes, double quotes and
+ *	newlines, which have to be escaped.
+ */
+static char const *metrics_escape(char *out, size_t outlen, char const *in)
+{
+	char *p = out, *end = out + outlen - 1;
+
+	if (!in) in = "";
+
+	while (*in && (p < end)) {
+		if ((*in == '\\') || (*in == '"') || (*in == '\n')) {
+			if ((end - p) < 2) break;
+
+			*p++ = '\\';
+			*p++ = (*in == '\n') ? 'n' : *in;
+			in++;
+			continue;
+		}
+
+		*p++ = *in++;
+	}
+	*p = '\0';
+
+	return out;
+}
+
+static metrics_source_t *metrics_source_add(metrics_list_t *list, fr_stats_t const *stats, char const *fmt, ...)
+	CC_HINT(format (printf, 3, 4));
+
+static metrics_source_t *metrics_source_add(metrics_list_t *list, fr_stats_t const *stats, char const *fmt, ...)
+{
+	va_list ap;
+	metrics_source_t *source;
+
+	if (list->num == list->size) {
+		int size = list->size ? (list->size * 2) : 16;
+
+		source = realloc(list->source, size * sizeof(*source));
+		if (!source) return NULL;
+
+		list->source = source;
+		list->size = size;
+	}
+
+	source = &list->source[list->num++];
+	memset(source, 0, sizeof(*source));
+
+	va_start(ap, fmt);
+	vsnprintf(source->labels, sizeof(source->labels), fmt, ap);
+	va_end(ap);
+
+	memcpy(&source->stats, stats, sizeof(source->stats));
+
+	return source;
+}
+
+/*
+ *	One family per counter, and one for the latency, so that the
+ *	samples of each family are together, as OpenMetrics requires.
+ */
+static void metrics_render_stats(metrics_buf_t *buf, char const *prefix, metrics_list_t const *list)
+{
+	int i, j, k;
+
+	if (!list->num) return;
+
+	for (i = 0; metrics_counters[i].name != NULL; i++) {
+		metrics_printf(buf, "# TYPE %s%s counter\n", prefix, metrics_counters[i].name);
+		metrics_printf(buf, "# HELP %s%s %s.\n", prefix, metrics_counters[i].name, metrics_counters[i].help);
+
+		for (j = 0; j < list->num; j++) {
+			fr_uint_t value;
+
+			memcpy(&value, ((uint8_t const *) &list->source[j].stats) + metrics_counters[i].offset,
+			       sizeof(value));
+
+			metrics_printf(buf, "%s%s_total{%s} %" PRIu64 "\n", prefix, metrics_counters[i].name,
+				       list->source[j].labels, (uint64_t) value);
+		}
+	}
+
+	metrics_printf(buf, "# TYPE %slatency_seconds summary\n", prefix);
+	metrics_printf(buf, "# HELP %slatency_seconds Time taken to respond to requests.\n", prefix);
+
+	for (j = 0; j < list->num; j++) {
+		uint64_t count = 0;
+
+		for (k = 0; metrics_quantiles[k].quantile != NULL; k++) {
+			metrics_printf(buf, "%slatency_seconds{%s,quantile=\"%s\"} %.6f\n", prefix,
+				       list->source[j].labels, metrics_quantiles[k].quantile,
+				       radius_stats_percentile(&list->source[j].stats,
+							       metrics_quantiles[k].permille) / 1000000.0);
+		}
+
+		for (k = 0; k < FR_STATS_HIST_BUCKETS; k++) count += list->source[j].stats.hist[k];
+
+		metrics_printf(buf, "%slatency_seconds_count{%s} %" PRIu64 "\n", prefix,
+			       list->source[j].labels, count);
+	}
+}
+
+static void metrics_render_global(metrics_buf_t *buf)
+{
+	metrics_list_t list;
+	fr_stats_t total;
+
+	memset(&list, 0, sizeof(list));
+
+	metrics_source_add(&list, radius_stats_total(&total, &radius_auth_stats), "type=\"auth\"");
+#ifdef WITH_ACCOUNTING
+	metrics_source_add(&list, radius_stats_total(&total, &radius_acct_stats), "type=\"acct\"");
+#endif
+#ifdef WITH_COA
+	metrics_source_add(&list, radius_stats_total(&total, &radius_coa_stats), "type=\"coa\"");
+	metrics_source_add(&list, radius_stats_total(&total, &radius_dsc_stats), "type=\"disconnect\"");
+#endif
+	metrics_render_stats(buf, "freeradius_", &list);
+
+#ifdef WITH_PROXY
+	list.num = 0;
+	metrics_source_add(&list, radius_stats_total(&total, &proxy_auth_stats), "type=\"auth\"");
+#ifdef WITH_ACCOUNTING
+	metrics_source_add(&list, radius_stats_total(&total, &proxy_acct_stats), "type=\"acct\"");
+#endif
+#ifdef WITH_COA
+	metrics_source_add(&list, radius_stats_total(&total, &proxy_coa_stats), "type=\"coa\"");
+	metrics_source_add(&list, radius_stats_total(&total, &proxy_dsc_stats), "type=\"disconnect\"");
+#endif
+	metrics_render_stats(buf, "freeradius_proxy_", &list);
+#endif
+
+	free(list.source);
+}
+
+static void metrics_render_clients(metrics_buf_t *buf)
+{
+	int i;
+	RADCLIENT *client;
+	metrics_list_t list;
+
+	memset(&list, 0, sizeof(list));
+
+	for (i = 0; (client = client_findbynumber(NULL, i)) != NULL; i++) {
+		char name[128], address[128];
+
+		metrics_escape(name, sizeof(name), client->shortname ? client->shortname : client->longname);
+		ip_ntoh(&client->ipaddr, address, sizeof(address));
+
+#define CLIENT_LABELS "client=\"%s\",address=\"%s\",type=\"%s\""
+		metrics_source_add(&list, &client->auth, CLIENT_LABELS, name, address, "auth");
+#ifdef WITH_ACCOUNTING
+		metrics_source_add(&list, &client->acct, CLIENT_LABELS, name, address, "acct");
+#endif
+#ifdef WITH_COA
+		metrics_source_add(&list, &client->coa, CLIENT_LABELS, name, address, "coa");
+		metrics_source_add(&list, &client->dsc, CLIENT_LABELS, name, address, "disconnect");
+#endif
+	}
+
+	metrics_render_stats(buf, "freeradius_client_", &list);
+	free(list.source);
+}
+
+static void metrics_render_listeners(metrics_buf_t *buf)
+{
+	rad_listen_t *this;
+	metrics_list_t list;
+
+	memset(&list, 0, sizeof(list));
+
+	for (this = main_config.listen; this != NULL; this = this->next) {
+		listen_socket_t *sock;
+		char address[128];
+
+		switch (this->type) {
+		case RAD_LISTEN_NONE:
+		case RAD_LISTEN_AUTH:
+#ifdef WITH_ACCOUNTING
+		case RAD_LISTEN_ACCT:
+#endif
+#ifdef WITH_COA
+		case RAD_LISTEN_COA:
+#endif
+			break;
+
+		default:
+			continue;
+		}
+
+		sock = this->data;
+		ip_ntoh(&sock->my_ipaddr, address, sizeof(address));
+
+		metrics_source_add(&list, &this->stats, "listener=\"%s%s\",address=\"%s\",port=\"%u\"",
+				   metrics_listen_names[this->type], this->dual ? "+acct" : "",
+				   address, sock->my_port);
+	}
+
+	metrics_render_stats(buf, "freeradius_listener_", &list);
+	free(list.source);
+}
+
+#ifdef WITH_PROXY
+static int metrics_home_server_add(void *ctx, void *data)
+{
+	metrics_list_t *list = ctx;
+	home_server_t const *home = data;
+	metrics_source_t *source;
+	char const *type;
+	char name[128], address[128];
+
+	switch (home->type) {
+	case HOME_TYPE_AUTH:
+		type = "auth";
+		break;
+
+	case HOME_TYPE_ACCT:
+		type = "acct";
+		break;
+
+#ifdef WITH_COA
+	case HOME_TYPE_COA:
+		type = "coa";
+		break;
+#endif
+
+	default:
+		return 0;
+	}
+
+	metrics_escape(name, sizeof(name), home->name);
+	if (home->server) {
+		metrics_escape(address, sizeof(address), home->server);
+	} else {
+		ip_ntoh(&home->ipaddr, address, sizeof(address));
+	}
+
+	source = metrics_source_add(list, &home->stats, "home_server=\"%s\",address=\"%s\",port=\"%u\",type=\"%s\"",
+				    name, address, home->port, type);
+	if (!source) return 0;
+
+	source->state = home->state;
+	source->outstanding = home->currently_outstanding;
+	source->latency = home->latency;
+
+	return 0;
+}
+
+static void metrics_render_home_servers(metrics_buf_t *buf)
+{
+	int i, j;
+	metrics_list_t list;
+	static const FR_NAME_NUMBER states[] = {
+		{ "alive",	HOME_STATE_ALIVE },
+		{ "zombie",	HOME_STATE_ZOMBIE },
+		{ "dead",	HOME_STATE_IS_DEAD },
+		{ "unknown",	HOME_STATE_UNKNOWN },
+		{ NULL, 0 }
+	};
+
+	memset(&list, 0, sizeof(list));
+
+	home_server_walk(metrics_home_server_add, &list);
+	if (!list.num) return;
+
+	metrics_render_stats(buf, "freeradius_home_server_", &list);
+
+	metrics_printf(buf, "# TYPE freeradius_home_server_outstanding gauge\n");
+	metrics_printf(buf, "# HELP freeradius_home_server_outstanding Requests waiting for a response.\n");
+	for (i = 0; i < list.num; i++) {
+		metrics_printf(buf, "freeradius_home_server_outstanding{%s} %u\n",
+			       list.source[i].labels, list.source[i].outstanding);
+	}
+
+	metrics_printf(buf, "# TYPE freeradius_home_server_rtt_seconds gauge\n");
+	metrics_printf(buf, "# HELP freeradius_home_server_rtt_seconds Moving average of the response time.\n");
+	for (i = 0; i < list.num; i++) {
+		metrics_printf(buf, "freeradius_home_server_rtt_seconds{%s} %.6f\n",
+			       list.source[i].labels, list.source[i].latency / 1000000.0);
+	}
+
+	metrics_printf(buf, "# TYPE freeradius_home_server_state stateset\n");
+	metrics_printf(buf, "# HELP freeradius_home_server_state Whether the server thinks the home server is alive.\n");
+	for (i = 0; i < list.num; i++) {
+		for (j = 0; states[j].name != NULL; j++) {
+			metrics_printf(buf, "freeradius_home_server_state{%s,freeradius_home_server_state=\"%s\"} %d\n",
+				       list.source[i].labels, states[j].name,
+				       list.source[i].state == states[j].number);
+		}
+	}
+
+	free(list.source);
+}
+#endif
+
+static void metrics_render_queues(metrics_buf_t *buf)
+{
+	int i, array[RAD_LISTEN_MAX], pps[2];
+
+	thread_pool_queue_stats(array, pps);
+
+	metrics_printf(buf, "# TYPE freeradius_queue_length gauge\n");
+	metrics_printf(buf, "# HELP freeradius_queue_length Requests waiting for a thread, by listener type.\n");
+	for (i = 0; i < RAD_LISTEN_MAX; i++) {
+		metrics_printf(buf, "freeradius_queue_length{type=\"%s\"} %d\n", metrics_listen_names[i], array[i]);
+	}
+
+	metrics_printf(buf, "# TYPE freeradius_packets_per_second gauge\n");
+	metrics_printf(buf, "# HELP freeradius_packets_per_second Packets going through the thread pool.\n");
+	metrics_printf(buf, "freeradius_packets_per_second{direction=\"in\"} %d\n", pps[0]);
+	metrics_printf(buf, "freeradius_packets_per_second{direction=\"out\"} %d\n", pps[1]);
+}
+
+static void metrics_render_log(metrics_buf_t *buf)
+{
+	metrics_printf(buf, "# TYPE freeradius_log_dropped counter\n");
+	metrics_printf(buf, "# HELP freeradius_log_dropped Log messages lost because a thread's log buffer was full.\n");
+	metrics_printf(buf, "freeradius_log_dropped_total %" PRIu64 "\n", radlog_dropped());
+}
+
+static void metrics_render_pools(metrics_buf_t *buf)
+{
+	int i, j, num;
+	fr_connection_pool_stats_t *stats;
+	char (*labels)[128] = NULL;
+
+	num = fr_connection_pool_stats_all(NULL, NULL, &stats);
+	if (num <= 0) goto done;
+
+	labels = malloc(num * sizeof(*labels));
+	if (!labels) goto done;
+
+	for (i = 0; i < num; i++) {
+		metrics_escape(labels[i], sizeof(labels[i]), stats[i].name ? stats[i].name : stats[i].log_prefix);
+	}
+
+#define POOL_GAUGE(_name, _help, _field) \
+	metrics_printf(buf, "# TYPE freeradius_pool_" _name " gauge\n"); \
+	metrics_printf(buf, "# HELP freeradius_pool_" _name " " _help ".\n"); \
+	for (i = 0; i < num; i++) { \
+		metrics_printf(buf, "freeradius_pool_" _name "{pool=\"%s\"} %u\n", labels[i], stats[i]._field); \
+	}
+
+#define POOL_COUNTER(_name, _help, _field) \
+	metrics_printf(buf, "# TYPE freeradius_pool_" _name " counter\n"); \
+	metrics_printf(buf, "# HELP freeradius_pool_" _name " " _help ".\n"); \
+	for (i = 0; i < num; i++) { \
+		metrics_printf(buf, "freeradius_pool_" _name "_total{pool=\"%s\"} %" PRIu64 "\n", labels[i], stats[i]._field); \
+	}
+
+	POOL_GAUGE("connections", "Connections in the pool", num);
+	POOL_GAUGE("connections_active", "Connections in use", active);
+	POOL_GAUGE("connections_max", "Maximum number of connections", max);
+	POOL_GAUGE("waiting", "Requests waiting for a connection", waiting);
+	POOL_COUNTER("waits", "Requests which have had to wait for a connection", waits);
+	POOL_COUNTER("wait_timeouts", "Requests which gave up waiting for a connection", wait_timeouts);
+	POOL_COUNTER("spawn_failures", "Connections which couldn't be opened", spawn_failures);
+	POOL_COUNTER("reconnects", "Connections which were re-opened", reconnects);
+
+#define POOL_HIST(_name, _help, _field) \
+	metrics_printf(buf, "# TYPE freeradius_pool_" _name "_seconds histogram\n"); \
+	metrics_printf(buf, "# HELP freeradius_pool_" _name "_seconds " _help ".\n"); \
+	for (i = 0; i < num; i++) { \
+		uint64_t count = 0; \
+		for (j = 0; j < (FR_CONNECTION_POOL_HIST_BUCKETS - 1); j++) { \
+			count += stats[i]._field[j]; \
+			metrics_printf(buf, "freeradius_pool_" _name "_seconds_bucket{pool=\"%s\",le=\"%s\"} %" PRIu64 "\n", \
+				       labels[i], metrics_pool_buckets[j], count); \
+		} \
+		count += stats[i]._field[j]; \
+		metrics_printf(buf, "freeradius_pool_" _name "_seconds_bucket{pool=\"%s\",le=\"+Inf\"} %" PRIu64 "\n", \
+			       labels[i], count); \
+		metrics_printf(buf, "freeradius_pool_" _name "_seconds_count{pool=\"%s\"} %" PRIu64 "\n", \
+			       labels[i], count); \
+	}
+
+	POOL_HIST("wait", "Time taken to get a connection", wait_hist);
+	POOL_HIST("hold", "Time connections were held for", hold_hist);
+
+done:
+	talloc_free(stats);
+	free(labels);
+}
+
+static int metrics_module_add(void *ctx, void *data)
+{
+	metrics_module_list_t *list = ctx;
+	module_instance_t const *mi = data;
+	char name[128];
+
+	if (!mi->stats) return 0;
+
+	if (list->num == list->size) {
+		metrics_module_t *module;
+		int size = list->size ? (list->size * 2) : 16;
+
+		module = realloc(list->module, size * sizeof(*module));
+		if (!module) return 0;
+
+		list->module = module;
+		list->size = size;
+	}
+
+	snprintf(list->module[list->num].labels, sizeof(list->module[list->num].labels),
+		 "module=\"%s\"", metrics_escape(name, sizeof(name), mi->name));
+	memcpy(&list->module[list->num].stats, mi->stats, sizeof(list->module[list->num].stats));
+	list->num++;
+
+	return 0;
+}
+
+static void metrics_render_modules(metrics_buf_t *buf)
+{
+	int i, j;
+	metrics_module_list_t list;
+
+	memset(&list, 0, sizeof(list));
+
+	module_instance_walk(metrics_module_add, &list);
+	if (!list.num) return;
+
+	metrics_printf(buf, "# TYPE freeradius_module_calls counter\n");
+	metrics_printf(buf, "# HELP freeradius_module_calls Calls to the module, by section.\n");
+	for (i = 0; i < list.num; i++) {
+		for (j = 0; j < RLM_COMPONENT_COUNT; j++) {
+			if (!list.module[i].stats.calls[j]) continue;
+
+			metrics_printf(buf, "freeradius_module_calls_total{%s,section=\"%s\"} %" PRIu64 "\n",
+				       list.module[i].labels, section_type_value[j].section,
+				       list.module[i].stats.calls[j]);
+		}
+	}
+
+	metrics_printf(buf, "# TYPE freeradius_module_results counter\n");
+	metrics_printf(buf, "# HELP freeradius_module_results Return codes of the module.\n");
+	for (i = 0; i < list.num; i++) {
+		for (j = 0; j < RLM_MODULE_NUMCODES; j++) {
+			if (!list.module[i].stats.rcode[j]) continue;
+
+			metrics_printf(buf, "freeradius_module_results_total{%s,rcode=\"%s\"} %" PRIu64 "\n",
+				       list.module[i].labels, fr_int2str(mod_rcode_table, j, "<invalid>"),
+				       list.module[i].stats.rcode[j]);
+		}
+	}
+
+	metrics_printf(buf, "# TYPE freeradius_module_latency_seconds summary\n");
+	metrics_printf(buf, "# HELP freeradius_module_latency_seconds Time taken by the sampled calls.\n");
+	for (i = 0; i < list.num; i++) {
+		uint64_t count = 0;
+
+		for (j = 0; metrics_quantiles[j].quantile != NULL; j++) {
+			metrics_printf(buf, "freeradius_module_latency_seconds{%s,quantile=\"%s\"} %.6f\n",
+				       list.module[i].labels, metrics_quantiles[j].quantile,
+				       radius_stats_hist_percentile(list.module[i].stats.hist,
+								    metrics_quantiles[j].permille) / 1000000.0);
+		}
+
+		for (j = 0; j < FR_STATS_HIST_BUCKETS; j++) count += list.module[i].stats.hist[j];
+
+		metrics_printf(buf, "freeradius_module_latency_seconds_count{%s} %" PRIu64 "\n",
+			       list.module[i].labels, count);
+	}
+
+	free(list.module);
+}
+
+static void metrics_render(metrics_buf_t *buf)
+{
+	metrics_render_global(buf);
+	metrics_render_clients(buf);
+	metrics_render_listeners(buf);
+#ifdef WITH_PROXY
+	metrics_render_home_servers(buf);
+#endif
+	metrics_render_queues(buf);
+	metrics_render_log(buf);
+	metrics_render_pools(buf);
+	metrics_render_modules(buf);
+
+	metrics_printf(buf, "# EOF\n");
+}
+
+static int metrics_write(int fd, char const *data, size_t len)
+{
+	while (len > 0) {
+		ssize_t rcode;
+
+		rcode = write(fd, data, len);
+		if (rcode < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+
+		data += rcode;
+		len -= rcode;
+	}
+
+	return 0;
+}
+
+static void metrics_respond(int fd, char const *status, char const *content_type, char const *body, size_t len)
+{
+	char header[256];
+
+	snprintf(header, sizeof(header),
+		 "HTTP/1.1 %s\r\n"
+		 "Content-Type: %s\r\n"
+		 "Content-Length: %zu\r\n"
+		 "Connection: close\r\n"
+		 "\r\n", status, content_type, len);
+
+	if (metrics_write(fd, header, strlen(header)) < 0) return;
+
+	(void) metrics_write(fd, body, len);
+}
+
+/*
+ *	Read one request, and answer it.  Only "GET /metrics" is
+ *	supported.  There's no keep-alive, so the scraper connects
+ *	again next time.
+ */
+static void metrics_serve(int fd)
+{
+	char		buffer[METRICS_REQUEST_MAX];
+	char		*path, *p;
+	size_t		len = 0;
+	struct timeval	tv;
+	metrics_buf_t	buf;
+
+	tv.tv_sec = METRICS_TIMEOUT;
+	tv.tv_usec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	/*
+	 *	We only care about the request line, but wait for the
+	 *	end of the headers, so that closing the socket doesn't
+	 *	reset the connection before the scraper has read the
+	 *	response.
+	 */
+	while (len < (sizeof(buffer) - 1)) {
+		ssize_t rcode;
+
+		rcode = read(fd, buffer + len, sizeof(buffer) - 1 - len);
+		if (rcode < 0) {
+			if (errno == EINTR) continue;
+			return;
+		}
+		if (rcode == 0) break;
+
+		len += rcode;
+		buffer[len] = '\0';
+
+		if (strstr(buffer, "\r\n\r\n") || strstr(buffer, "\n\n")) break;
+	}
+	buffer[len] = '\0';
+
+	if (strncmp(buffer, "GET ", 4) != 0) {
+		metrics_respond(fd, "405 Method Not Allowed", "text/plain", "Method Not Allowed\n", 19);
+		return;
+	}
+
+	path = buffer + 4;
+	p = strpbrk(path, " ?\r\n");
+	if (p) *p = '\0';
+
+	if (strcmp(path, "/metrics") != 0) {
+		metrics_respond(fd, "404 Not Found", "text/plain", "Not Found\n", 10);
+		return;
+	}
+
+	memset(&buf, 0, sizeof(buf));
+	buf.size = 16384;
+	buf.data = malloc(buf.size);
+	if (!buf.data) return;
+
+	metrics_render(&buf);
+
+	if (buf.error) {
+		metrics_respond(fd, "500 Internal Server Error", "text/plain", "Out of memory\n", 14);
+	} else {
+		metrics_respond(fd, "200 OK", METRICS_CONTENT_TYPE, buf.data, buf.len);
+	}
+
+	free(buf.data);
+}
+
+/*
+ *	Check the scraper's address against the "allow" networks.
+ */
+static bool metrics_allowed(listen_metrics_t const *inst, struct sockaddr_storage const *src, socklen_t salen)
+{
+	fr_ipaddr_t	ipaddr, network;
+	uint16_t	port;
+	int		i;
+
+	if (!fr_sockaddr2ipaddr(src, salen, &ipaddr, &port)) return false;
+
+	for (i = 0; i < inst->num_allow; i++) {
+		if (inst->allow[i].af != ipaddr.af) continue;
+
+		network = ipaddr;
+		fr_ipaddr_mask(&network, inst->allow[i].prefix);
+		if (fr_ipaddr_cmp(&network, &inst->allow[i]) == 0) return true;
+	}
+
+	return false;
+}
+
+/*
+ *	Wake up once a second to see if we've been told to exit.
+ */
+static void *metrics_thread(void *arg)
+{
+	rad_listen_t *this = arg;
+	listen_metrics_t *inst = this->data;
+
+	while (!inst->exiting) {
+		int		rcode, fd;
+		fd_set		fds;
+		struct timeval	tv;
+		struct sockaddr_storage	src;
+		socklen_t	salen = sizeof(src);
+
+		FD_ZERO(&fds);
+		FD_SET(inst->fd, &fds);
+		tv.tv_sec = 1;
+		tv.tv_usec = 0;
+
+		rcode = select(inst->fd + 1, &fds, NULL, NULL, &tv);
+		if (rcode <= 0) continue;
+
+		fd = accept(inst->fd, (struct sockaddr *) &src, &salen);
+		if (fd < 0) continue;
+
+		if (metrics_allowed(inst, &src, salen)) {
+			metrics_serve(fd);
+		} else {
+			metrics_respond(fd, "403 Forbidden", "text/plain", "Forbidden\n", 10);
+		}
+		close(fd);
+	}
+
+	return NULL;
+}
+
+/*
+ *	Parse the "allow" entries.  Without any, only the loopback
+ *	addresses may scrape.
+ */
+static int metrics_parse_allow(CONF_SECTION *cs, listen_metrics_t *inst)
+{
+	CONF_PAIR	*cp;
+	int		i;
+
+	for (cp = cf_pair_find(cs, "allow"); cp; cp = cf_pair_find_next(cs, cp, "allow")) {
+		inst->num_allow++;
+	}
+
+	if (!inst->num_allow) {
+		inst->allow = talloc_zero_array(inst, fr_ipaddr_t, 2);
+		inst->num_allow = 2;
+
+		inst->allow[0].af = AF_INET;
+		inst->allow[0].ipaddr.ip4addr.s_addr = htonl(INADDR_LOOPBACK);
+		fr_ipaddr_mask(&inst->allow[0], 8);
+
+		inst->allow[1].af = AF_INET6;
+		inst->allow[1].ipaddr.ip6addr = in6addr_loopback;
+		inst->allow[1].prefix = 128;
+		return 0;
+	}
+
+	inst->allow = talloc_zero_array(inst, fr_ipaddr_t, inst->num_allow);
+
+	for (cp = cf_pair_find(cs, "allow"), i = 0; cp; cp = cf_pair_find_next(cs, cp, "allow"), i++) {
+		char const *value = cf_pair_value(cp);
+
+		if (!value || (fr_pton(&inst->allow[i], value, 0, false) < 0)) {
+			cf_log_err_cp(cp, "Invalid \"allow\" network: %s", fr_strerror());
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int metrics_parse(CONF_SECTION *cs, rad_listen_t *this)
+{
+	int			rcode, on = 1;
+	listen_metrics_t	*inst = this->data;
+	struct sockaddr_storage	salocal;
+	socklen_t		salen;
+	char			buffer[256];
+
+	inst->fd = -1;
+
+	rcode = cf_section_parse(cs, inst, metrics_config);
+	if (rcode < 0) {
+		cf_log_err_cs(cs, "Failed parsing listen section");
+		return -1;
+	}
+
+	if (!inst->my_port) {
+		cf_log_err_cs(cs, "No port specified in listen section");
+		return -1;
+	}
+
+	if (metrics_parse_allow(cs, inst) < 0) return -1;
+
+	this->nodup = true;
+	this->synchronous = false;
+
+	if (check_config) return 0;
+
+	if (!fr_ipaddr2sockaddr(&inst->my_ipaddr, inst->my_port, &salocal, &salen)) {
+		cf_log_err_cs(cs, "Invalid address: %s", fr_strerror());
+		return -1;
+	}
+
+	inst->fd = socket(inst->my_ipaddr.af, SOCK_STREAM, 0);
+	if (inst->fd < 0) {
+		cf_log_err_cs(cs, "Failed opening socket: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	if (setsockopt(inst->fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0) {
+		cf_log_err_cs(cs, "Failed to reuse address: %s", fr_syserror(errno));
+		goto error;
+	}
+
+	if ((bind(inst->fd, (struct sockaddr *) &salocal, salen) < 0) ||
+	    (listen(inst->fd, 8) < 0)) {
+		metrics_print(this, buffer, sizeof(buffer));
+		cf_log_err_cs(cs, "Failed binding to %s: %s", buffer, fr_syserror(errno));
+		goto error;
+	}
+
+	rcode = pthread_create(&inst->pthread_id, NULL, metrics_thread, this);
+	if (rcode != 0) {
+		cf_log_err_cs(cs, "Failed creating metrics thread: %s", fr_syserror(rcode));
+		goto error;
+	}
+
+	return 0;
+
+error:
+	close(inst->fd);
+	inst->fd = -1;
+	return -1;
+}
+
+void metrics_free(rad_listen_t *this)
+{
+	listen_metrics_t *inst = this->data;
+
+	if (inst->fd < 0) return;
+
+	inst->exiting = true;
+	pthread_join(inst->pthread_id, NULL);
+
+	close(inst->fd);
+	inst->fd = -1;
+}
+
+int metrics_print(rad_listen_t const *this, char *buffer, size_t bufsize)
+{
+	listen_metrics_t *inst = this->data;
+	char address[128];
+
+	snprintf(buffer, bufsize, "metrics address %s port %u",
+		 ip_ntoh(&inst->my_ipaddr, address, sizeof(address)), inst->my_port);
+
+	return 1;
+}
+#endif	/* WITH_METRICS */
@@ -26,6 +26,7 @@ RCSID("$Id$")
 #include <freeradius-devel/modpriv.h>
 #include <freeradius-devel/modcall.h>
 #include <freeradius-devel/parser.h>
+#include <freeradius-devel/trace.h>
 #include <freeradius-devel/rad_assert.h>
 
 
@@ -49,7 +50,7 @@ struct modcallable {
 	struct modcallable *next;
 	char const *name;
 	char const *debug_name;
-	enum { MOD_SINGLE = 1, MOD_GROUP, MOD_LOAD_BALANCE, MOD_REDUNDANT_LOAD_BALANCE,
+	enum { MOD_SINGLE = 1, MOD_GROUP, MOD_LOAD_BALANCE, MOD_REDUNDANT_LOAD_BALANCE, MOD_PARALLEL,
 #ifdef WITH_UNLANG
 	       MOD_IF, MOD_ELSE, MOD_ELSIF, MOD_UPDATE, MOD_SWITCH, MOD_CASE,
 	       MOD_FOREACH, MOD_BREAK, MOD_RETURN,
@@ -76,7 +77,10 @@ typedef struct {
 	CONF_SECTION		*cs;
 	value_pair_map_t	*map;		/* update */
 	value_pair_tmpl_t	*vpt;		/* switch */
+	fr_hash_table_t		*cases;		/* switch, if all the cases are constant */
 	fr_cond_t		*cond;		/* if/elsif */
+	fr_cond_stats_t		*stats;		/* if/elsif, when profiling */
+	bool			in_place;	/* foreach, the body can't change the list */
 	bool			done_pass2;
 } modgroup;
 
@@ -281,10 +285,48 @@ static void safe_unlock(module_instance_t *instance)
 #define safe_unlock(foo)
 #endif
 
+#ifdef WITH_STATS
+#define USEC (1000000)
+
+/*
+ *	Count the result of a module call, and if it was timed, add
+ *	its time to the module's histogram.
+ */
+void module_stats_record(module_stats_t *stats, rlm_components_t component,
+			 rlm_rcode_t rcode, struct timeval const *start)
+{
+	struct timeval now;
+	uint64_t usec;
+
+	if (rcode < RLM_MODULE_NUMCODES) MODULE_STATS_ADD(stats->rcode[rcode], 1);
+
+	if (!start) return;
+
+	gettimeofday(&now, NULL);
+	if (timercmp(&now, start, <)) return;	/* clock went backwards */
+
+	usec = (now.tv_sec - start->tv_sec) * USEC;
+	usec += now.tv_usec;
+	usec -= start->tv_usec;
+	if (usec > UINT32_MAX) usec = UINT32_MAX;
+
+	MODULE_STATS_ADD(stats->timed[component], 1);
+	MODULE_STATS_ADD(stats->usec[component], usec);
+	MODULE_STATS_ADD(stats->hist[radius_stats_hist_index(usec)], 1);
+}
+#endif
+
 static rlm_rcode_t CC_HINT(nonnull) call_modsingle(rlm_components_t component, modsingle *sp, REQUEST *request)
 {
 	int blocked;
+	bool yield;
 	int indent = request->log.indent;
+	int span;
+#ifdef WITH_STATS
+	module_stats_t *stats = sp->modinst->stats;
+	struct timeval start;
+	bool timed = false;
+#endif
 
 	/*
 	 *	If the request should stop, refuse to do anything.
@@ -307,10 +349,53 @@ static rlm_rcode_t CC_HINT(nonnull) call_modsingle(rlm_components_t component, m
 	 */
 	request->module = sp->modinst->name;
 
+	/*
+	 *	Only modules which say so may give up the thread
+	 *	while waiting for I/O.  And never while holding the
+	 *	module's mutex.
+	 */
+	yield = ((sp->modinst->entry->module->type & (RLM_TYPE_YIELD_SAFE | RLM_TYPE_THREAD_UNSAFE)) == RLM_TYPE_YIELD_SAFE);
+	if (yield) {
+		thread_pool_yield_allow(true);
+	} else {
+		thread_pool_yield_block(true);
+	}
+
+#ifdef WITH_STATS
+	/*
+	 *	Time one call in every profile_modules_sample, which
+	 *	includes any wait for the module's mutex.
+	 */
+	if (stats) {
+		timed = ((MODULE_STATS_ADD(stats->calls[component], 1) % main_config.profile_modules_sample) == 0);
+		if (timed) gettimeofday(&start, NULL);
+	}
+#endif
+
+	span = trace_span_start(request, TRACE_SPAN_MODULE, sp->modinst->name);
+
 	safe_lock(sp->modinst);
 	request->rcode = sp->modinst->entry->module->methods[component](sp->modinst->insthandle, request);
 	safe_unlock(sp->modinst);
 
+	if (span >= 0) {
+		trace_span_attr(request, span, "freeradius.module", "%s", sp->modinst->entry->name);
+		trace_span_attr(request, span, "freeradius.section", "%s", section_type_value[component].section);
+		trace_span_attr(request, span, "freeradius.rcode", "%s",
+				fr_int2str(mod_rcode_table, request->rcode, "<invalid>"));
+		trace_span_end(request, span, (request->rcode == RLM_MODULE_FAIL));
+	}
+
+#ifdef WITH_STATS
+	if (stats) module_stats_record(stats, component, request->rcode, timed ? &start : NULL);
+#endif
+
+	if (yield) {
+		thread_pool_yield_allow(false);
+	} else {
+		thread_pool_yield_block(false);
+	}
+
 	request->module = "";
 
 	/*
@@ -353,6 +438,7 @@ static char const *group_name[] = {
 	"group",
 	"load-balance group",
 	"redundant-load-balance group",
+	"parallel",
 #ifdef WITH_UNLANG
 	"if",
 	"else",
@@ -430,6 +516,343 @@ static void modcall_child(REQUEST *request, rlm_components_t component, int dept
 }
 
 
+/*
+ *	One child of a "parallel" section.
+ */
+typedef struct modcall_branch_t {
+	modcallable		*c;
+	rlm_components_t	component;
+	REQUEST			*request;	//!< Copy of the request which the child runs against.
+	rlm_rcode_t		result;		//!< Starts as the result of the enclosing section.
+#ifdef HAVE_PTHREAD_H
+	bool			queued;		//!< Waiting for a branch thread.
+	bool			done;		//!< Finished by a branch thread.
+	struct modcall_branch_t	*next;
+#endif
+} modcall_branch_t;
+
+static void modcall_branch(modcall_branch_t *branch)
+{
+	modcall_stack_entry_t stack[MODCALL_STACK_MAX];
+
+#ifdef HAVE_PTHREAD_H
+	branch->request->child_pid = pthread_self();
+#endif
+
+	stack[0].c = branch->c;
+	stack[0].result = branch->result;
+	stack[0].priority = 0;
+	stack[0].unwind = 0;
+
+	if (!modcall_recurse(branch->request, branch->component, 0, &stack[0])) {
+		branch->result = RLM_MODULE_FAIL;
+		return;
+	}
+
+	branch->result = stack[0].result;
+}
+
+#ifdef HAVE_PTHREAD_H
+/*
+ *	Branches are run by a fixed set of threads, which are
+ *	started the first time a "parallel" section is used.  When
+ *	they're all busy, branches wait in a queue, and the thread
+ *	running the "parallel" section takes back any of its own
+ *	which haven't been started, and runs them itself.  So a
+ *	request never waits for a branch which isn't running, and
+ *	nested "parallel" sections can't deadlock.
+ */
+#define MODCALL_BRANCH_THREADS (8)
+
+static pthread_once_t branch_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t branch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t branch_queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t branch_done = PTHREAD_COND_INITIALIZER;
+static modcall_branch_t *branch_head = NULL;
+static modcall_branch_t **branch_tail = &branch_head;
+static int branch_threads = 0;
+
+static void *modcall_branch_thread(UNUSED void *arg)
+{
+	modcall_branch_t *branch;
+
+	pthread_mutex_lock(&branch_mutex);
+	while (true) {
+		while (!branch_head) pthread_cond_wait(&branch_queued, &branch_mutex);
+
+		branch = branch_head;
+		branch_head = branch->next;
+		if (!branch_head) branch_tail = &branch_head;
+		branch->queued = false;
+		pthread_mutex_unlock(&branch_mutex);
+
+		modcall_branch(branch);
+
+		pthread_mutex_lock(&branch_mutex);
+		branch->done = true;
+		pthread_cond_broadcast(&branch_done);
+	}
+
+	return NULL;
+}
+
+static void modcall_branch_threads_init(void)
+{
+	int i;
+	pthread_t thread;
+	pthread_attr_t attr;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	for (i = 0; i < MODCALL_BRANCH_THREADS; i++) {
+		if (pthread_create(&thread, &attr, modcall_branch_thread, NULL) != 0) {
+			WARN("Failed creating thread for parallel sections: %s", fr_syserror(errno));
+			break;
+		}
+		branch_threads++;
+	}
+
+	pthread_attr_destroy(&attr);
+}
+
+/*
+ *	Hand the branches to the branch threads, run the first one,
+ *	then wait for the rest.
+ */
+static void modcall_branches_run(modcall_branch_t *branch, int num)
+{
+	int i;
+	modcall_branch_t **last;
+
+	pthread_once(&branch_once, modcall_branch_threads_init);
+
+	if (branch_threads > 0) {
+		pthread_mutex_lock(&branch_mutex);
+		for (i = 1; i < num; i++) {
+			branch[i].queued = true;
+			branch[i].next = NULL;
+			*branch_tail = &branch[i];
+			branch_tail = &branch[i].next;
+		}
+		pthread_cond_broadcast(&branch_queued);
+		pthread_mutex_unlock(&branch_mutex);
+	}
+
+	modcall_branch(&branch[0]);
+
+	for (i = 1; i < num; i++) {
+		if (branch_threads > 0) {
+			pthread_mutex_lock(&branch_mutex);
+			if (!branch[i].queued) {
+				while (!branch[i].done) pthread_cond_wait(&branch_done, &branch_mutex);
+				pthread_mutex_unlock(&branch_mutex);
+				continue;
+			}
+
+			/*
+			 *	Not started yet.  Take it back.
+			 */
+			for (last = &branch_head; *last != &branch[i]; last = &(*last)->next);
+			*last = branch[i].next;
+			if (!*last) branch_tail = last;
+			branch[i].queued = false;
+			pthread_mutex_unlock(&branch_mutex);
+		}
+
+		modcall_branch(&branch[i]);
+	}
+}
+#endif
+
+/*
+ *	Copy a request for a branch.  It's allocated outside of the
+ *	original request, as it's used by a different thread.
+ */
+static REQUEST *modcall_branch_alloc(REQUEST *request)
+{
+	REQUEST *fake;
+
+	fake = request_alloc_fake_ctx(NULL, request);
+	if (!fake) return NULL;
+
+	fake->packet->vps = paircopy(fake->packet, request->packet->vps);
+	fake->reply->vps = paircopy(fake->reply, request->reply->vps);
+	fake->reply->code = request->reply->code;
+	fake->config_items = paircopy(fake, request->config_items);
+
+	fake->username = pairfind(fake->packet->vps, PW_USER_NAME, 0, TAG_ANY);
+	if (request->password) {
+		fake->password = pairfind(fake->packet->vps, request->password->da->attr,
+					  request->password->da->vendor, TAG_ANY);
+	}
+
+	fake->module = request->module;
+	fake->component = request->component;
+
+	return fake;
+}
+
+/*
+ *	Whether the lists have the same instances of an attribute.
+ */
+static bool modcall_pairs_same(VALUE_PAIR *a, VALUE_PAIR *b, DICT_ATTR const *da)
+{
+	vp_cursor_t ca, cb;
+	VALUE_PAIR *vpa, *vpb;
+
+	fr_cursor_init(&ca, &a);
+	fr_cursor_init(&cb, &b);
+
+	while (true) {
+		vpa = fr_cursor_next_by_num(&ca, da->attr, da->vendor, TAG_ANY);
+		vpb = fr_cursor_next_by_num(&cb, da->attr, da->vendor, TAG_ANY);
+		if (!vpa || !vpb) break;
+
+		if (vpa->tag != vpb->tag) return false;
+		if (pairdata_cmp(vpa->da->type, vpa->length, &vpa->data,
+				 vpb->da->type, vpb->length, &vpb->data) != 0) return false;
+	}
+
+	return (!vpa && !vpb);
+}
+
+/*
+ *	Copy the changes a branch made to one of its lists back to
+ *	the request.  If a branch added, changed or deleted any
+ *	instance of an attribute, all of the request's instances are
+ *	replaced by the branch's.
+ */
+static void modcall_branch_merge(TALLOC_CTX *ctx, VALUE_PAIR **to, VALUE_PAIR *orig, VALUE_PAIR *from)
+{
+	vp_cursor_t cursor;
+	VALUE_PAIR *vp, *prev, *copy;
+
+	for (vp = fr_cursor_init(&cursor, &from);
+	     vp != NULL;
+	     vp = fr_cursor_next(&cursor)) {
+		/*
+		 *	Only look at the first instance.
+		 */
+		for (prev = from; prev != vp; prev = prev->next) {
+			if ((prev->da->attr == vp->da->attr) && (prev->da->vendor == vp->da->vendor)) break;
+		}
+		if (prev != vp) continue;
+
+		if (modcall_pairs_same(orig, from, vp->da)) continue;
+
+		pairdelete(to, vp->da->attr, vp->da->vendor, TAG_ANY);
+		copy = paircopy_by_num(ctx, from, vp->da->attr, vp->da->vendor, TAG_ANY);
+		if (copy) pairadd(to, copy);
+	}
+
+	for (vp = fr_cursor_init(&cursor, &orig);
+	     vp != NULL;
+	     vp = fr_cursor_next(&cursor)) {
+		if (pairfind(from, vp->da->attr, vp->da->vendor, TAG_ANY)) continue;
+
+		pairdelete(to, vp->da->attr, vp->da->vendor, TAG_ANY);
+	}
+}
+
+/*
+ *	Run the children of a "parallel" section at the same time,
+ *	each one against its own copy of the request.
+ *
+ *	The results are combined in the order the children are
+ *	listed, as if each child was a group: the highest priority
+ *	result wins, and "return" or "reject" stops the combining.
+ *	Then the changes each child made to the request, control and
+ *	reply lists are copied back, also in order, so that later
+ *	children win.
+ *
+ *	Request data isn't copied, so the children can't see
+ *	foreach variables, or state kept by modules such as EAP.
+ */
+static rlm_rcode_t modcall_parallel(REQUEST *request, rlm_components_t component,
+				    modgroup *g, rlm_rcode_t start)
+{
+	int i, num, priority;
+	rlm_rcode_t result;
+	modcallable *this;
+	modcall_branch_t *branch;
+	VALUE_PAIR *packet_vps, *reply_vps, *config_vps;
+	DICT_ATTR const *password;
+
+	num = 0;
+	for (this = g->children; this != NULL; this = this->next) num++;
+
+	branch = talloc_zero_array(request, modcall_branch_t, num);
+	if (!branch) return RLM_MODULE_FAIL;
+
+	for (this = g->children, i = 0; this != NULL; this = this->next, i++) {
+		branch[i].c = this;
+		branch[i].component = component;
+		branch[i].result = start;
+		branch[i].request = modcall_branch_alloc(request);
+		if (!branch[i].request) {
+			REDEBUG("Failed allocating request for parallel section");
+			while (--i >= 0) talloc_free(branch[i].request);
+			talloc_free(branch);
+			return RLM_MODULE_FAIL;
+		}
+	}
+
+#ifdef HAVE_PTHREAD_H
+	modcall_branches_run(branch, num);
+#else
+	for (i = 0; i < num; i++) modcall_branch(&branch[i]);
+#endif
+
+	result = start;
+	priority = 0;
+	for (i = 0; i < num; i++) {
+		int action = branch[i].c->actions[branch[i].result];
+
+		if (action == MOD_ACTION_RETURN) {
+			result = branch[i].result;
+			break;
+		}
+
+		if (action == MOD_ACTION_REJECT) {
+			result = RLM_MODULE_REJECT;
+			break;
+		}
+
+		if (action > priority) {
+			result = branch[i].result;
+			priority = action;
+		}
+	}
+
+	/*
+	 *	Merge against the lists as they were before any of
+	 *	the children ran.
+	 */
+	packet_vps = paircopy(branch, request->packet->vps);
+	reply_vps = paircopy(branch, request->reply->vps);
+	config_vps = paircopy(branch, request->config_items);
+	password = request->password ? request->password->da : NULL;
+
+	for (i = 0; i < num; i++) {
+		modcall_branch_merge(request->packet, &request->packet->vps, packet_vps,
+				     branch[i].request->packet->vps);
+		modcall_branch_merge(request->reply, &request->reply->vps, reply_vps,
+				     branch[i].request->reply->vps);
+		modcall_branch_merge(request, &request->config_items, config_vps,
+				     branch[i].request->config_items);
+		talloc_free(branch[i].request);
+	}
+
+	if (request->username) request->username = pairfind(request->packet->vps, PW_USER_NAME, 0, TAG_ANY);
+	if (password) request->password = pairfind(request->packet->vps, password->attr, password->vendor, TAG_ANY);
+
+	talloc_free(branch);	/* and the copied lists */
+
+	return result;
+}
+
+
 /*
  *	Interpret the various types of blocks.
  */
@@ -456,21 +879,21 @@ redo:
 	if (!c) goto finish;
 
 	/*
-	 *	We've been asked to stop.  Do so.
+	 *	We've been asked to stop, or no one is waiting for
+	 *	the answer any more.  Do so.
 	 */
-	if ((request->master_state == REQUEST_STOP_PROCESSING) ||
-	    (request->parent &&
-	     (request->parent->master_state == REQUEST_STOP_PROCESSING))) {
+	if (request_expired(request)) {
 		entry->result = RLM_MODULE_FAIL;
 		entry->priority = 9999;
 		goto finish;
 	}
 
 #ifdef WITH_UNLANG
+	switch (c->type) {
 	/*
 	 *	Handle "if" conditions.
 	 */
-	if (c->type == MOD_IF) {
+	case MOD_IF: {
 		int condition;
 		modgroup *g;
 
@@ -494,10 +917,18 @@ redo:
 				break;
 			}
 			condition = 0;
+			if (g->stats) FR_COND_STATS_INC(g->stats, error_count);
 		} else {
 			RDEBUG2("%s %s -> %s",
 				group_name[c->type],
 				c->name, condition ? "TRUE" : "FALSE");
+			if (g->stats) {
+				if (condition) {
+					FR_COND_STATS_INC(g->stats, true_count);
+				} else {
+					FR_COND_STATS_INC(g->stats, false_count);
+				}
+			}
 		}
 
 		/*
@@ -521,7 +952,7 @@ redo:
 	 *	"else" if the previous "if" was taken.
 	 *	"if" if the previous if wasn't taken.
 	 */
-	if (c->type == MOD_ELSIF) {
+	case MOD_ELSIF:
 		if (!was_if) goto elsif_error;
 
 		/*
@@ -539,12 +970,11 @@ redo:
 		 *	Check the "if" condition.
 		 */
 		goto mod_if;
-	} /* MOD_ELSIF */
 
 	/*
 	 *	"else" for a preceding "if".
 	 */
-	if (c->type == MOD_ELSE) {
+	case MOD_ELSE:
 		if (!was_if) { /* error */
 		elsif_error:
 			RDEBUG2("... skipping %s for request %d: No preceding \"if\"",
@@ -566,7 +996,10 @@ redo:
 		was_if = false;
 		if_taken = false;
 		goto do_children;
-	} /* MOD_ELSE */
+
+	default:
+		break;
+	}
 
 	/*
 	 *	We're no longer processing if/else/elsif.  Reset the
@@ -576,7 +1009,8 @@ redo:
 	if_taken = false;
 #endif	/* WITH_UNLANG */
 
-	if (c->type == MOD_SINGLE) {
+	switch (c->type) {
+	case MOD_SINGLE: {
 		modsingle *sp;
 
 		/*
@@ -595,7 +1029,7 @@ redo:
 	/*
 	 *	Update attribute(s)
 	 */
-	if (c->type == MOD_UPDATE) {
+	case MOD_UPDATE: {
 		int rcode;
 		modgroup *g = mod_callabletogroup(c);
 		value_pair_map_t *map;
@@ -615,16 +1049,16 @@ redo:
 		result = RLM_MODULE_NOOP;
 		MOD_LOG_CLOSE_BRACE;
 		goto calculate_result;
-	} /* MOD_IF */
+	} /* MOD_UPDATE */
 
 	/*
 	 *	Loop over a set of attributes.
 	 */
-	if (c->type == MOD_FOREACH) {
+	case MOD_FOREACH: {
 		int i, foreach_depth = -1;
-		VALUE_PAIR *vps, *vp;
+		VALUE_PAIR *vps = NULL, *vp;
 		modcall_stack_entry_t *next = NULL;
-		vp_cursor_t copy;
+		vp_cursor_t cursor;
 		modgroup *g = mod_callabletogroup(c);
 
 		if (depth >= MODCALL_STACK_MAX) {
@@ -651,28 +1085,37 @@ redo:
 		}
 
 		/*
-		 *	Copy the VPs from the original request, this ensures deterministic
-		 *	behaviour if someone decides to add or remove VPs in the set were
-		 *	iterating over.
+		 *	If nothing in the body can add or remove VPs in
+		 *	the list we're iterating over, walk the list
+		 *	itself.  Otherwise, copy the VPs from the original
+		 *	request, this ensures deterministic behaviour if
+		 *	someone decides to add or remove VPs in the set
+		 *	were iterating over.
 		 */
-		if (tmpl_copy_vps(request, &vps, request, g->vpt) < 0) {	/* nothing to loop over */
+		if (g->in_place) {
+			vp = tmpl_cursor_init(NULL, &cursor, request, g->vpt);
+		} else if (tmpl_copy_vps(request, &vps, request, g->vpt) < 0) {
+			vp = NULL;
+		} else {
+			rad_assert(vps != NULL);
+			vp = fr_cursor_init(&cursor, &vps);
+		}
+
+		if (!vp) {	/* nothing to loop over */
 			MOD_LOG_OPEN_BRACE;
 			result = RLM_MODULE_NOOP;
 			MOD_LOG_CLOSE_BRACE;
 			goto calculate_result;
 		}
 
-		rad_assert(vps != NULL);
-		fr_cursor_init(&copy, &vps);
-
 		RDEBUG2("foreach %s ", c->name);
 
 		/*
 		 *	This is the actual body of the foreach loop
 		 */
-		for (vp = fr_cursor_first(&copy);
+		for (;
 		     vp != NULL;
-		     vp = fr_cursor_next(&copy)) {
+		     vp = g->in_place ? tmpl_cursor_next(&cursor, g->vpt) : fr_cursor_next(&cursor)) {
 #ifndef NDEBUG
 			if (fr_debug_flag >= 2) {
 				char buffer[1024];
@@ -717,7 +1160,7 @@ redo:
 		} /* loop over VPs */
 
 		/*
-		 *	Free the copied vps and the request data
+		 *	Free the copied vps (if any) and the request data
 		 *	If we don't remove the request data, something could call
 		 *	the xlat outside of a foreach loop and trigger a segv.
 		 */
@@ -734,7 +1177,7 @@ redo:
 	/*
 	 *	Break out of a "foreach" loop.
 	 */
-	if (c->type == MOD_BREAK) {
+	case MOD_BREAK: {
 		int i;
 		VALUE_PAIR **copy_p;
 
@@ -757,23 +1200,23 @@ redo:
 	 *	Stop processing the current section, no matter how
 	 *	deeply the current processing is.
 	 */
-	if (c->type == MOD_RETURN) {
+	case MOD_RETURN:
 		/*
 		 *	Leave result / priority on the stack, and stop processing the section.
 		 */
 		entry->unwind = MOD_RETURN;
 		goto finish;
-	} /* MOD_BREAK */
 #endif	  /* WITH_UNLANG */
 
 	/*
 	 *	Child is a group that has children of it's own.
 	 */
-	if ((c->type == MOD_GROUP) || (c->type == MOD_POLICY)
+	case MOD_GROUP:
+	case MOD_POLICY:
 #ifdef WITH_UNLANG
-	    || (c->type == MOD_CASE)
+	case MOD_CASE:
 #endif
-		) {
+	{
 		modgroup *g;
 
 #ifdef WITH_UNLANG
@@ -802,12 +1245,13 @@ redo:
 	} /* MOD_GROUP */
 
 #ifdef WITH_UNLANG
-	if (c->type == MOD_SWITCH) {
+	case MOD_SWITCH: {
 		modcallable *this, *found, *null_case;
 		modgroup *g, *h;
 		fr_cond_t cond;
 		value_pair_map_t map;
 		value_pair_tmpl_t vpt;
+		VALUE_PAIR *vp = NULL;
 
 		MOD_LOG_OPEN_BRACE;
 
@@ -830,7 +1274,7 @@ redo:
 		 *	The attribute doesn't exist.  We can skip
 		 *	directly to the default 'case' statement.
 		 */
-		if ((g->vpt->type == TMPL_TYPE_ATTR) && (tmpl_find_vp(NULL, request, g->vpt) < 0)) {
+		if ((g->vpt->type == TMPL_TYPE_ATTR) && (tmpl_find_vp(&vp, request, g->vpt) < 0)) {
 		find_null_case:
 			for (this = g->children; this; this = this->next) {
 				rad_assert(this->type == MOD_CASE);
@@ -845,6 +1289,28 @@ redo:
 			goto do_null_case;
 		}
 
+		/*
+		 *	All of the cases are constants.  Look up the
+		 *	value of the attribute.
+		 */
+		if (g->cases) {
+			modgroup key;
+			value_pair_tmpl_t key_vpt;
+
+			memset(&key_vpt, 0, sizeof(key_vpt));
+			key_vpt.type = TMPL_TYPE_DATA;
+			key_vpt.tmpl_data_type = vp->da->type;
+			key_vpt.tmpl_data_length = vp->length;
+			key_vpt.tmpl_data_value = &vp->data;
+			key.vpt = &key_vpt;
+
+			h = fr_hash_table_finddata(g->cases, &key);
+			if (!h) goto find_null_case;
+
+			found = mod_grouptocallable(h);
+			goto do_null_case;
+		}
+
 		/*
 		 *	Expand the template if necessary, so that it
 		 *	is evaluated once instead of for each 'case'
@@ -937,8 +1403,19 @@ redo:
 	} /* MOD_SWITCH */
 #endif
 
-	if ((c->type == MOD_LOAD_BALANCE) ||
-	    (c->type == MOD_REDUNDANT_LOAD_BALANCE)) {
+	case MOD_PARALLEL: {
+		modgroup *g;
+
+		g = mod_callabletogroup(c);
+
+		MOD_LOG_OPEN_BRACE;
+		result = modcall_parallel(request, component, g, entry->result);
+		MOD_LOG_CLOSE_BRACE;
+		goto calculate_result;
+	} /* MOD_PARALLEL */
+
+	case MOD_LOAD_BALANCE:
+	case MOD_REDUNDANT_LOAD_BALANCE: {
 		uint32_t count = 0;
 		modcallable *this, *found;
 		modgroup *g;
@@ -993,7 +1470,7 @@ redo:
 	 *	This should really be deleted, and replaced with a
 	 *	more abstracted / functional version.
 	 */
-	if (c->type == MOD_REFERENCE) {
+	case MOD_REFERENCE: {
 		modref *mr = mod_callabletoref(c);
 		char const *server = request->server;
 
@@ -1016,7 +1493,7 @@ redo:
 	 *	This should really be deleted, and replaced with a
 	 *	more abstracted / functional version.
 	 */
-	if (c->type == MOD_XLAT) {
+	case MOD_XLAT: {
 		modxlat *mx = mod_callabletoxlat(c);
 		char buffer[128];
 
@@ -1034,6 +1511,9 @@ redo:
 	/*
 	 *	Add new module types here.
 	 */
+	default:
+		break;
+	}
 
 calculate_result:
 #if 0
@@ -1103,6 +1583,12 @@ calculate_result:
 	if (entry->unwind == MOD_RETURN) goto finish;
 
 next_sibling:
+	/*
+	 *	The children of a "parallel" section are run one at a
+	 *	time, each from its own stack.
+	 */
+	if (entry->c->parent && (entry->c->parent->type == MOD_PARALLEL)) goto finish;
+
 	entry->c = entry->c->next;
 
 	if (entry->c) goto redo;
@@ -2328,6 +2814,12 @@ static modcallable *do_compile_modsingle(modcallable *parent,
 						   GROUPTYPE_SIMPLE,
 						   grouptype, MOD_LOAD_BALANCE);
 
+		} else if (strcmp(modrefname, "parallel") == 0) {
+			*modname = name2;
+			return do_compile_modgroup(parent, component, cs,
+						   GROUPTYPE_SIMPLE,
+						   grouptype, MOD_PARALLEL);
+
 		} else if (strcmp(modrefname, "redundant-load-balance") == 0) {
 			*modname = name2;
 
@@ -2358,7 +2850,8 @@ static modcallable *do_compile_modsingle(modcallable *parent,
 		} else 	if (strcmp(modrefname, "elsif") == 0) {
 			if (parent &&
 			    ((parent->type == MOD_LOAD_BALANCE) ||
-			     (parent->type == MOD_REDUNDANT_LOAD_BALANCE))) {
+			     (parent->type == MOD_REDUNDANT_LOAD_BALANCE) ||
+			     (parent->type == MOD_PARALLEL))) {
 				cf_log_err(ci, "'elsif' cannot be used in this section");
 				return NULL;
 			}
@@ -2376,7 +2869,8 @@ static modcallable *do_compile_modsingle(modcallable *parent,
 		} else 	if (strcmp(modrefname, "else") == 0) {
 			if (parent &&
 			    ((parent->type == MOD_LOAD_BALANCE) ||
-			     (parent->type == MOD_REDUNDANT_LOAD_BALANCE))) {
+			     (parent->type == MOD_REDUNDANT_LOAD_BALANCE) ||
+			     (parent->type == MOD_PARALLEL))) {
 				cf_log_err(ci, "'else' cannot be used in this section section");
 				return NULL;
 			}
@@ -2939,6 +3433,7 @@ set_codes:
 
 	case MOD_LOAD_BALANCE:
 	case MOD_REDUNDANT_LOAD_BALANCE:
+	case MOD_PARALLEL:
 		if (!g->children) {
 			cf_log_err_cs(g->cs, "%s sections cannot be empty",
 				      cf_section_name1(g->cs));
@@ -3340,6 +3835,253 @@ check_paircmp:
 	return true;
 }
 
+/*
+ *	Rough relative costs of evaluating a condition.  These
+ *	are only used to order the operands of "&&" and "||"
+ *	chains, so the absolute values don't matter.
+ */
+#define COND_COST_CONST		(0)
+#define COND_COST_ATTR		(1)
+#define COND_COST_CMP		(1)
+#define COND_COST_CAST		(1)
+#define COND_COST_REGEX		(5)
+#define COND_COST_XLAT		(10)
+#define COND_COST_PAIRCOMPARE	(20)
+#define COND_COST_EXEC		(100)
+
+static int pass2_tmpl_cost(value_pair_tmpl_t const *vpt)
+{
+	switch (vpt->type) {
+	case TMPL_TYPE_LITERAL:
+	case TMPL_TYPE_DATA:
+	case TMPL_TYPE_REGEX_STRUCT:
+	case TMPL_TYPE_NULL:
+		return COND_COST_CONST;
+
+	case TMPL_TYPE_ATTR:
+	case TMPL_TYPE_LIST:
+		return COND_COST_ATTR;
+
+	case TMPL_TYPE_EXEC:
+		return COND_COST_EXEC;
+
+	default:
+		return COND_COST_XLAT;
+	}
+}
+
+/*
+ *	Whether or not evaluating the condition can change the
+ *	request.  xlats and programs may do anything, and regexes
+ *	set the capture groups.  Paircompare callbacks are lookups,
+ *	and are treated as pure.
+ */
+static bool pass2_cond_pure(fr_cond_t const *c)
+{
+	switch (c->type) {
+	case COND_TYPE_TRUE:
+	case COND_TYPE_FALSE:
+		return true;
+
+	case COND_TYPE_EXISTS:
+		return (pass2_tmpl_cost(c->data.vpt) < COND_COST_XLAT);
+
+	case COND_TYPE_MAP:
+		if ((c->data.map->op == T_OP_REG_EQ) ||
+		    (c->data.map->op == T_OP_REG_NE)) return false;
+
+		return ((pass2_tmpl_cost(c->data.map->lhs) < COND_COST_XLAT) &&
+			(pass2_tmpl_cost(c->data.map->rhs) < COND_COST_XLAT));
+
+	case COND_TYPE_CHILD:
+		for (c = c->data.child; c != NULL; c = c->next) {
+			if (!pass2_cond_pure(c)) return false;
+		}
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+/*
+ *	Whether or not the condition can return an error.
+ *	Existence checks never do.  Comparisons fail when the
+ *	attribute is missing.
+ */
+static bool pass2_cond_infallible(fr_cond_t const *c)
+{
+	switch (c->type) {
+	case COND_TYPE_TRUE:
+	case COND_TYPE_FALSE:
+	case COND_TYPE_EXISTS:
+		return true;
+
+	case COND_TYPE_CHILD:
+		for (c = c->data.child; c != NULL; c = c->next) {
+			if (!pass2_cond_infallible(c)) return false;
+		}
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+/*
+ *	Stable insertion sort of a run of operands by cost.
+ *	The caller fixes up next_op.
+ */
+static fr_cond_t *pass2_cond_sort(fr_cond_t *head)
+{
+	fr_cond_t *sorted = NULL;
+
+	while (head) {
+		fr_cond_t **last, *c;
+
+		c = head;
+		head = head->next;
+
+		for (last = &sorted; *last != NULL; last = &(*last)->next) {
+			if ((*last)->cost > c->cost) break;
+		}
+
+		c->next = *last;
+		*last = c;
+	}
+
+	return sorted;
+}
+
+/*
+ *	Re-order a chain of operands so that the cheapest ones are
+ *	evaluated first.
+ *
+ *	We only do this when the result can't change.  All of the
+ *	operators in the chain have to be the same, because mixed
+ *	chains are evaluated strictly left to right.  Impure
+ *	operands are barriers, because moving a cheaper operand in
+ *	front of them changes whether or not they're run.
+ *
+ *	Errors stop evaluation, so operands which can fail are
+ *	left alone, too.  The exception is an "&&" chain whose
+ *	error is treated as "false" by the caller.  There, an error
+ *	and a false operand both make the whole chain false, no
+ *	matter where they are.
+ */
+static void pass2_cond_reorder(fr_cond_t **head, bool error_is_false)
+{
+	cond_op_t op;
+	fr_cond_t *c, **run;
+
+	op = (*head)->next_op;
+	if (op == COND_NONE) return;
+
+	for (c = *head; c->next != NULL; c = c->next) {
+		if (c->next_op != op) return;
+	}
+
+	if (op != COND_AND) error_is_false = false;
+
+	run = head;
+	while (*run) {
+		fr_cond_t *start, *end, *rest;
+
+		/*
+		 *	Skip barriers.
+		 */
+		if (!pass2_cond_pure(*run) ||
+		    (!error_is_false && !pass2_cond_infallible(*run))) {
+			run = &(*run)->next;
+			continue;
+		}
+
+		/*
+		 *	Find the end of this run of movable operands.
+		 */
+		start = end = *run;
+		while (end->next && pass2_cond_pure(end->next) &&
+		       (error_is_false || pass2_cond_infallible(end->next))) {
+			end = end->next;
+		}
+		rest = end->next;
+		end->next = NULL;
+
+		*run = pass2_cond_sort(start);
+
+		for (c = *run; c->next != NULL; c = c->next) {
+			c->next_op = op;
+		}
+		c->next_op = rest ? op : COND_NONE;
+		c->next = rest;
+
+		run = &c->next;
+	}
+}
+
+/** Annotate a condition with cost estimates, and optionally re-order / profile it
+ *
+ * @param ctx to allocate profiling counters in.
+ * @param head of the chain.  May be changed if the chain is re-ordered.
+ * @param error_is_false whether an error from this chain is treated the same as "false".
+ * @return the total cost of the chain.
+ */
+static int pass2_cond_optimize(TALLOC_CTX *ctx, fr_cond_t **head, bool error_is_false)
+{
+	int total = 0;
+	bool and_chain = true;
+	fr_cond_t *c;
+
+	for (c = *head; c != NULL; c = c->next) {
+		if ((c->next_op != COND_NONE) && (c->next_op != COND_AND)) and_chain = false;
+	}
+
+	for (c = *head; c != NULL; c = c->next) {
+		switch (c->type) {
+		case COND_TYPE_TRUE:
+		case COND_TYPE_FALSE:
+			c->cost = COND_COST_CONST;
+			break;
+
+		case COND_TYPE_EXISTS:
+			c->cost = pass2_tmpl_cost(c->data.vpt);
+			if (c->cost == COND_COST_CONST) c->cost = COND_COST_ATTR;	/* rcode */
+			break;
+
+		case COND_TYPE_MAP:
+			c->cost = pass2_tmpl_cost(c->data.map->lhs) + pass2_tmpl_cost(c->data.map->rhs) +
+				COND_COST_CMP;
+			if (c->cast) c->cost += COND_COST_CAST;
+			if ((c->data.map->op == T_OP_REG_EQ) ||
+			    (c->data.map->op == T_OP_REG_NE)) c->cost += COND_COST_REGEX;
+			if (c->pass2_fixup == PASS2_PAIRCOMPARE) c->cost += COND_COST_PAIRCOMPARE;
+			break;
+
+		/*
+		 *	An error from a negated child isn't the same
+		 *	as "false".
+		 */
+		case COND_TYPE_CHILD:
+			c->cost = pass2_cond_optimize(ctx, &c->data.child,
+						      error_is_false && and_chain && !c->negate);
+			break;
+
+		default:
+			break;
+		}
+
+		if (main_config.profile_conditions && !c->stats) {
+			c->stats = talloc_zero(ctx, fr_cond_stats_t);
+		}
+
+		total += c->cost;
+	}
+
+	if (main_config.reorder_conditions) pass2_cond_reorder(head, error_is_false);
+
+	return total;
+}
+
 
 /*
  *	Compile the RHS of update sections to xlat_exp_t
@@ -3366,6 +4108,157 @@ static bool modcall_pass2_update(modgroup *g)
 
 	return true;
 }
+
+/*
+ *	Whether anything in a "foreach" body can add or remove
+ *	attributes in the list being iterated over.  Only "update"
+ *	sections which don't write to that list are known to be
+ *	safe.  Modules, and anything else which we can't see into,
+ *	might change it.
+ */
+static bool modcall_changes_list(modcallable *c, value_pair_tmpl_t const *vpt)
+{
+	modgroup *g;
+	value_pair_map_t *map;
+
+	for (; c != NULL; c = c->next) {
+		switch (c->type) {
+		case MOD_BREAK:
+		case MOD_RETURN:
+			break;
+
+		case MOD_UPDATE:
+			g = mod_callabletogroup(c);
+			for (map = g->map; map != NULL; map = map->next) {
+				if ((map->lhs->type != TMPL_TYPE_ATTR) && (map->lhs->type != TMPL_TYPE_LIST)) return true;
+				if (map->lhs->tmpl_list == vpt->tmpl_list) return true;
+			}
+			break;
+
+		case MOD_GROUP:
+		case MOD_LOAD_BALANCE:
+		case MOD_REDUNDANT_LOAD_BALANCE:
+		case MOD_IF:
+		case MOD_ELSE:
+		case MOD_ELSIF:
+		case MOD_SWITCH:
+		case MOD_CASE:
+		case MOD_FOREACH:
+		case MOD_POLICY:
+			g = mod_callabletogroup(c);
+			if (modcall_changes_list(g->children, vpt)) return true;
+			break;
+
+		default:
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ *	Hash and compare the values of "case" statements.
+ */
+static uint32_t switch_case_hash(void const *data)
+{
+	value_pair_tmpl_t const *vpt = ((modgroup const *) data)->vpt;
+
+	switch (vpt->tmpl_data_type) {
+	case PW_TYPE_STRING:
+	case PW_TYPE_OCTETS:
+		return fr_hash(vpt->tmpl_data_value->octets, vpt->tmpl_data_length);
+
+	default:
+		return fr_hash(vpt->tmpl_data_value, vpt->tmpl_data_length);
+	}
+}
+
+static int switch_case_cmp(void const *one, void const *two)
+{
+	value_pair_tmpl_t const *a = ((modgroup const *) one)->vpt;
+	value_pair_tmpl_t const *b = ((modgroup const *) two)->vpt;
+
+	return pairdata_cmp(a->tmpl_data_type, a->tmpl_data_length, a->tmpl_data_value,
+			    b->tmpl_data_type, b->tmpl_data_length, b->tmpl_data_value);
+}
+
+static int _free_switch_cases(modgroup *g)
+{
+	fr_hash_table_free(g->cases);
+	return 0;
+}
+
+/*
+ *	If we're switching over an attribute, and every "case" is a
+ *	constant of the same type, put the cases into a hash table.
+ *	The interpreter can then find the matching case with one
+ *	lookup, instead of comparing the attribute to each case in
+ *	turn.
+ *
+ *	Otherwise, the cases are checked in order, as before.
+ */
+static bool modcall_pass2_switch(modgroup *g)
+{
+	modcallable *this;
+	modgroup *h;
+
+	if (g->vpt->type != TMPL_TYPE_ATTR) return true;
+
+	/*
+	 *	Only for types where "==" means "the data is the
+	 *	same".
+	 */
+	switch (g->vpt->tmpl_da->type) {
+	case PW_TYPE_STRING:
+	case PW_TYPE_OCTETS:
+	case PW_TYPE_BYTE:
+	case PW_TYPE_SHORT:
+	case PW_TYPE_INTEGER:
+	case PW_TYPE_INTEGER64:
+	case PW_TYPE_SIGNED:
+	case PW_TYPE_DATE:
+	case PW_TYPE_IPV4_ADDR:
+	case PW_TYPE_IPV6_ADDR:
+	case PW_TYPE_ETHERNET:
+	case PW_TYPE_IFID:
+		break;
+
+	default:
+		return true;
+	}
+
+	for (this = g->children; this; this = this->next) {
+		h = mod_callabletogroup(this);
+		if (!h->vpt) continue;
+
+		if ((h->vpt->type != TMPL_TYPE_DATA) ||
+		    (h->vpt->tmpl_data_type != g->vpt->tmpl_da->type)) return true;
+	}
+
+	g->cases = fr_hash_table_create(switch_case_hash, switch_case_cmp, NULL);
+	if (!g->cases) {
+		cf_log_err_cs(g->cs, "Failed creating hash table for case statements");
+		return false;
+	}
+	talloc_set_destructor(g, _free_switch_cases);
+
+	/*
+	 *	If there are duplicate cases, the first one wins, as
+	 *	it would when they're checked in order.
+	 */
+	for (this = g->children; this; this = this->next) {
+		h = mod_callabletogroup(this);
+		if (!h->vpt) continue;
+
+		if (!fr_hash_table_insert(g->cases, h)) {
+			WARN("%s[%d]: Ignoring duplicate case statement",
+			     cf_section_filename(h->cs), cf_section_lineno(h->cs));
+		}
+	}
+
+	return true;
+}
 #endif
 
 /*
@@ -3438,6 +4331,12 @@ bool modcall_pass2(modcallable *mc)
 				return false;
 			}
 
+			/*
+			 *	The caller treats errors as "false".
+			 */
+			pass2_cond_optimize(g->cond, &g->cond, true);
+			if (main_config.profile_conditions) g->stats = talloc_zero(g, fr_cond_stats_t);
+
 			if (!modcall_pass2(g->children)) return false;
 			g->done_pass2 = true;
 			break;
@@ -3533,6 +4432,7 @@ bool modcall_pass2(modcallable *mc)
 
 		do_children:
 			if (!modcall_pass2(g->children)) return false;
+			if ((c->type == MOD_SWITCH) && !modcall_pass2_switch(g)) return false;
 			g->done_pass2 = true;
 			break;
 
@@ -3667,6 +4567,7 @@ bool modcall_pass2(modcallable *mc)
 				return false;
 			}
 			if (!modcall_pass2(g->children)) return false;
+			g->in_place = !modcall_changes_list(g->children, g->vpt);
 			g->done_pass2 = true;
 			break;
 
@@ -3683,6 +4584,7 @@ bool modcall_pass2(modcallable *mc)
 		case MOD_GROUP:
 		case MOD_LOAD_BALANCE:
 		case MOD_REDUNDANT_LOAD_BALANCE:
+		case MOD_PARALLEL:
 			c->debug_name = group_name[c->type];
 
 #ifdef WITH_UNLANG
@@ -3709,12 +4611,33 @@ bool modcall_pass2(modcallable *mc)
 	return true;
 }
 
+static void modcall_debug_line(UNUSED void *ctx, int depth, char const *line)
+{
+	DEBUG("%.*s%s", depth, modcall_spaces, line);
+}
+
 void modcall_debug(modcallable *mc, int depth)
+{
+	modcall_print(mc, depth, modcall_debug_line, NULL);
+}
+
+/** Print a compiled section, one line at a time
+ *
+ * @param mc the first node to print.  Its siblings are printed, too.
+ * @param depth of indentation.
+ * @param print function to call for each line.
+ * @param ctx to pass to print.
+ */
+void modcall_print(modcallable *mc, int depth, modcall_print_t print, void *ctx)
 {
 	modcallable *this;
 	modgroup *g;
+#ifdef WITH_UNLANG
 	value_pair_map_t *map;
+	fr_cond_t *cond;
+#endif
 	char buffer[1024];
+	char line[1024 + 128];
 
 	for (this = mc; this != NULL; this = this->next) {
 		switch (this->type) {
@@ -3724,83 +4647,117 @@ void modcall_debug(modcallable *mc, int depth)
 		case MOD_SINGLE: {
 			modsingle *single = mod_callabletosingle(this);
 
-			DEBUG("%.*s%s", depth, modcall_spaces,
-				single->modinst->name);
+			print(ctx, depth, single->modinst->name);
 			}
 			break;
 
 #ifdef WITH_UNLANG
 		case MOD_UPDATE:
 			g = mod_callabletogroup(this);
-			DEBUG("%.*s%s {", depth, modcall_spaces,
-				group_name[this->type]);
+			snprintf(line, sizeof(line), "%s {", group_name[this->type]);
+			print(ctx, depth, line);
 
 			for (map = g->map; map != NULL; map = map->next) {
 				map_prints(buffer, sizeof(buffer), map);
-				DEBUG("%.*s%s", depth + 1, modcall_spaces, buffer);
+				print(ctx, depth + 1, buffer);
 			}
 
-			DEBUG("%.*s}", depth, modcall_spaces);
+			print(ctx, depth, "}");
 			break;
 
 		case MOD_ELSE:
 			g = mod_callabletogroup(this);
-			DEBUG("%.*s%s {", depth, modcall_spaces,
-				group_name[this->type]);
-			modcall_debug(g->children, depth + 1);
-			DEBUG("%.*s}", depth, modcall_spaces);
-			break;
+			snprintf(line, sizeof(line), "%s {", group_name[this->type]);
+			goto print_children;
 
 		case MOD_IF:
 		case MOD_ELSIF:
 			g = mod_callabletogroup(this);
 			fr_cond_sprint(buffer, sizeof(buffer), g->cond);
-			DEBUG("%.*s%s (%s) {", depth, modcall_spaces,
-				group_name[this->type], buffer);
-			modcall_debug(g->children, depth + 1);
-			DEBUG("%.*s}", depth, modcall_spaces);
-			break;
+			if (!g->stats) {
+				snprintf(line, sizeof(line), "%s (%s) {", group_name[this->type], buffer);
+				goto print_children;
+			}
+
+			snprintf(line, sizeof(line), "%s (%s) { # true %" PRIu64 " false %" PRIu64 " error %" PRIu64,
+				 group_name[this->type], buffer,
+				 g->stats->true_count, g->stats->false_count, g->stats->error_count);
+			print(ctx, depth, line);
+
+			/*
+			 *	And one line for each operand, in the
+			 *	order they're evaluated.
+			 */
+			for (cond = g->cond; cond != NULL; cond = cond->next) {
+				fr_cond_t operand;
+
+				if (!cond->stats) continue;
+
+				operand = *cond;
+				operand.next = NULL;
+				operand.next_op = COND_NONE;
+				fr_cond_sprint(buffer, sizeof(buffer), &operand);
+				snprintf(line, sizeof(line), "# %s : cost %i true %" PRIu64 " false %" PRIu64
+					 " error %" PRIu64, buffer, cond->cost,
+					 cond->stats->true_count, cond->stats->false_count, cond->stats->error_count);
+				print(ctx, depth + 1, line);
+			}
+			goto print_only_children;
 
 		case MOD_SWITCH:
 		case MOD_CASE:
 			g = mod_callabletogroup(this);
-			tmpl_prints(buffer, sizeof(buffer), g->vpt, NULL);
-			DEBUG("%.*s%s %s {", depth, modcall_spaces,
-				group_name[this->type], buffer);
-			modcall_debug(g->children, depth + 1);
-			DEBUG("%.*s}", depth, modcall_spaces);
-			break;
+			if (g->vpt) {
+				tmpl_prints(buffer, sizeof(buffer), g->vpt, NULL);
+			} else {
+				buffer[0] = '\0';
+			}
+			snprintf(line, sizeof(line), "%s %s {%s", group_name[this->type], buffer,
+				 g->cases ? " # hashed" : "");
+			goto print_children;
 
 		case MOD_POLICY:
 		case MOD_FOREACH:
 			g = mod_callabletogroup(this);
-			DEBUG("%.*s%s %s {", depth, modcall_spaces,
-				group_name[this->type], this->name);
-			modcall_debug(g->children, depth + 1);
-			DEBUG("%.*s}", depth, modcall_spaces);
-			break;
+			snprintf(line, sizeof(line), "%s %s {", group_name[this->type], this->name);
+			goto print_children;
 
 		case MOD_BREAK:
-			DEBUG("%.*sbreak", depth, modcall_spaces);
+			print(ctx, depth, "break");
 			break;
 
+		case MOD_RETURN:
+			print(ctx, depth, "return");
+			break;
 #endif
-		case MOD_GROUP:
-			g = mod_callabletogroup(this);
-			DEBUG("%.*s%s {", depth, modcall_spaces,
-			      group_name[this->type]);
-			modcall_debug(g->children, depth + 1);
-			DEBUG("%.*s}", depth, modcall_spaces);
+
+		case MOD_REFERENCE:
+			snprintf(line, sizeof(line), "server %s", mod_callabletoref(this)->ref_name);
+			print(ctx, depth, line);
 			break;
 
+		case MOD_XLAT: {
+			modxlat *mx = mod_callabletoxlat(this);
 
+			snprintf(line, sizeof(line), mx->exec ? "`%s`" : "\"%s\"", mx->xlat_name);
+			print(ctx, depth, line);
+			}
+			break;
+
+		case MOD_GROUP:
 		case MOD_LOAD_BALANCE:
 		case MOD_REDUNDANT_LOAD_BALANCE:
+		case MOD_PARALLEL:
 			g = mod_callabletogroup(this);
-			DEBUG("%.*s%s {", depth, modcall_spaces,
-				group_name[this->type]);
-			modcall_debug(g->children, depth + 1);
-			DEBUG("%.*s}", depth, modcall_spaces);
+			snprintf(line, sizeof(line), "%s {", group_name[this->type]);
+
+		print_children:
+			print(ctx, depth, line);
+#ifdef WITH_UNLANG
+		print_only_children:
+#endif
+			modcall_print(g->children, depth + 1, print, ctx);
+			print(ctx, depth, "}");
 			break;
 		}
 	}
@@ -28,8 +28,11 @@ RCSID("$Id$")
 #include <freeradius-devel/modpriv.h>
 #include <freeradius-devel/modcall.h>
 #include <freeradius-devel/parser.h>
+#include <freeradius-devel/trace.h>
 #include <freeradius-devel/rad_assert.h>
 
+#include <sys/stat.h>
+
 extern bool check_config;
 
 typedef struct indexed_modcallable {
@@ -271,6 +274,27 @@ static virtual_server_t *virtual_server_find(char const *name)
 	return server;
 }
 
+/** Find the compiled version of a section of a virtual server
+ *
+ * @param[out] out where the compiled section is written.  NULL if the
+ *	section is empty.
+ * @param name of the virtual server, or NULL for the top-level one.
+ * @param comp section to find.
+ * @return 0 on success, -1 if there's no such virtual server.
+ */
+int virtual_server_section(modcallable **out, char const *name, rlm_components_t comp)
+{
+	virtual_server_t *server;
+
+	*out = NULL;
+
+	server = virtual_server_find(name);
+	if (!server) return -1;
+
+	*out = server->mc[comp];
+	return 0;
+}
+
 static int _virtual_server_free(virtual_server_t *server)
 {
 	server = talloc_get_type_abort(server, virtual_server_t);
@@ -363,6 +387,163 @@ static void module_instance_free_old(UNUSED CONF_SECTION *cs, module_instance_t
 	}
 }
 
+/*
+ *	Per-thread module instance data.
+ *
+ *	Each thread keeps a short list of the instances it has
+ *	used, which is searched by instance handle.  Only modules
+ *	with a thread_instantiate callback show up here, so the
+ *	list is rarely more than a few entries long.
+ */
+typedef struct module_thread_t {
+	module_instance_t	*node;		//!< Instance the data belongs to.
+	void			*insthandle;	//!< node->insthandle, for fast lookups.
+	void			*data;		//!< Per-thread data.
+	struct module_thread_t	*next;
+} module_thread_t;
+
+typedef struct module_thread_list_t {
+	module_thread_t		*head;
+} module_thread_list_t;
+
+fr_thread_local_setup(module_thread_list_t *, module_threads)	/* macro */
+
+/*
+ *	Instances with a thread_instantiate callback.  Threads
+ *	search this the first time they use an instance.
+ */
+typedef struct module_thread_node_t {
+	module_instance_t		*node;
+	struct module_thread_node_t	*next;
+} module_thread_node_t;
+
+static module_thread_node_t *thread_nodes = NULL;
+
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t thread_nodes_mutex = PTHREAD_MUTEX_INITIALIZER;
+#  define THREAD_NODES_LOCK	pthread_mutex_lock(&thread_nodes_mutex)
+#  define THREAD_NODES_UNLOCK	pthread_mutex_unlock(&thread_nodes_mutex)
+#else
+#  define THREAD_NODES_LOCK
+#  define THREAD_NODES_UNLOCK
+#endif
+
+static void _module_threads_free(void *arg)
+{
+	module_thread_list_t *list = arg;
+	module_thread_t *this, *next;
+
+	for (this = list->head; this != NULL; this = next) {
+		next = this->next;
+
+		if (this->node->entry->module->thread_detach) {
+			this->node->entry->module->thread_detach(this->insthandle, this->data);
+		}
+		talloc_free(this);
+	}
+
+	talloc_free(list);
+}
+
+/** Return the calling thread's data for a module instance
+ *
+ * The data is created (and thread_instantiate called) the first time
+ * a thread asks for it.  The pointer is only valid in the calling thread,
+ * so modules must not hold it across module_yield().
+ *
+ * @param instance the module instance data, as passed to the module's methods.
+ * @return the per-thread data, or NULL on error, or if the module has no
+ *	thread_instantiate callback.
+ */
+void *module_thread_instance(void *instance)
+{
+	module_thread_list_t *list;
+	module_thread_t *this;
+	module_thread_node_t *tn;
+	module_t const *module;
+
+	list = fr_thread_local_init(module_threads, _module_threads_free);
+	if (!list) {
+		list = talloc_zero(NULL, module_thread_list_t);
+		if (!list) return NULL;
+
+		if (fr_thread_local_set(module_threads, list) != 0) {
+			talloc_free(list);
+			return NULL;
+		}
+	}
+
+	for (this = list->head; this != NULL; this = this->next) {
+		if (this->insthandle == instance) return this->data;
+	}
+
+	THREAD_NODES_LOCK;
+	for (tn = thread_nodes; tn != NULL; tn = tn->next) {
+		if (tn->node->insthandle == instance) break;
+	}
+	THREAD_NODES_UNLOCK;
+
+	if (!tn) return NULL;
+
+	module = tn->node->entry->module;
+
+	this = talloc_zero(list, module_thread_t);
+	if (!this) return NULL;
+
+	this->node = tn->node;
+	this->insthandle = instance;
+	if (module->thread_inst_size) {
+		this->data = talloc_zero_array(this, uint8_t, module->thread_inst_size);
+		if (!this->data) {
+		error:
+			talloc_free(this);
+			return NULL;
+		}
+	}
+
+	if (module->thread_instantiate(instance, this->data) < 0) {
+		ERROR("Thread instantiation failed for module \"%s\"", tn->node->name);
+		goto error;
+	}
+
+	this->next = list->head;
+	list->head = this;
+
+	return this->data;
+}
+
+/** Detach and free the calling thread's module instance data
+ *
+ * Called by each thread just before it exits, and by the main thread
+ * before the modules are freed.
+ */
+void modules_thread_detach(void)
+{
+	module_thread_list_t *list;
+
+	list = fr_thread_local_init(module_threads, _module_threads_free);
+	if (!list) return;
+
+	(void) fr_thread_local_set(module_threads, NULL);
+	_module_threads_free(list);
+}
+
+static void module_thread_node_remove(module_instance_t *node)
+{
+	module_thread_node_t *tn, **last;
+
+	THREAD_NODES_LOCK;
+	for (last = &thread_nodes; *last != NULL; last = &(*last)->next) {
+		if ((*last)->node != node) continue;
+
+		tn = *last;
+		*last = tn->next;
+		talloc_free(tn);
+		break;
+	}
+	THREAD_NODES_UNLOCK;
+}
+
 
 /*
  *	Free a module instance.
@@ -385,6 +566,8 @@ static void module_instance_free(void *data)
 	}
 #endif
 
+	if (this->entry->module->thread_instantiate) module_thread_node_remove(this);
+
 	/*
 	 *	Remove any registered paircompares.
 	 */
@@ -435,6 +618,8 @@ static int _module_entry_free(module_entry_t *this)
  */
 int modules_free(void)
 {
+	modules_thread_detach();
+
 	rbtree_free(instance_tree);
 	rbtree_free(module_tree);
 
@@ -527,10 +712,66 @@ static module_entry_t *linkto_module(char const *module_name,
 	return node;
 }
 
+/*
+ *	Modules such as "files" or "perl" read data or code from
+ *	files and directories named in their configuration.  Those
+ *	files may in turn include others, which we can't see.  So
+ *	a HUP always reloads a module which names any.
+ */
+struct fr_module_file_t {
+	char const		*filename;
+	fr_module_file_t	*next;
+};
+
+static void module_files_add(module_instance_t *node, CONF_SECTION const *cs)
+{
+	CONF_ITEM *ci;
+
+	for (ci = cf_item_find_next(cs, NULL);
+	     ci != NULL;
+	     ci = cf_item_find_next(cs, ci)) {
+		char const *value;
+		struct stat buf;
+		fr_module_file_t *mf;
+
+		if (cf_item_is_section(ci)) {
+			module_files_add(node, cf_itemtosection(ci));
+			continue;
+		}
+
+		if (!cf_item_is_pair(ci)) continue;
+
+		value = cf_pair_value(cf_itemtopair(ci));
+		if (!value || (value[0] != FR_DIR_SEP)) continue;
+
+		if ((stat(value, &buf) < 0) || !(S_ISREG(buf.st_mode) || S_ISDIR(buf.st_mode))) continue;
+
+		mf = talloc_zero(node, fr_module_file_t);
+		if (!mf) return;
+
+		mf->filename = talloc_strdup(mf, value);
+		mf->next = node->files;
+		node->files = mf;
+	}
+}
+
+static void module_files_record(module_instance_t *node, CONF_SECTION const *cs)
+{
+	fr_module_file_t *mf, *next;
+
+	for (mf = node->files; mf != NULL; mf = next) {
+		next = mf->next;
+		talloc_free(mf);
+	}
+	node->files = NULL;
+
+	module_files_add(node, cs);
+}
+
 /** Parse module's configuration section and setup destructors
  *
  */
-static int module_conf_parse(module_instance_t *node, void **handle)
+static int module_conf_parse(module_instance_t *node, CONF_SECTION *cs, void **handle)
 {
 	*handle = NULL;
 
@@ -550,8 +791,8 @@ static int module_conf_parse(module_instance_t *node, void **handle)
 		talloc_set_name(*handle, "rlm_config_t");
 
 		if (node->entry->module->config &&
-		    (cf_section_parse(node->cs, *handle, node->entry->module->config) < 0)) {
-			cf_log_err_cs(node->cs,"Invalid configuration for module \"%s\"", node->name);
+		    (cf_section_parse(cs, *handle, node->entry->module->config) < 0)) {
+			cf_log_err_cs(cs,"Invalid configuration for module \"%s\"", node->name);
 			talloc_free(*handle);
 
 			return -1;
@@ -671,7 +912,7 @@ module_instance_t *find_module_instance(CONF_SECTION *modules,
 	 *	module's detach method is called when it's instance data is
 	 *	about to be freed.
 	 */
-	if (module_conf_parse(node, &node->insthandle) < 0) {
+	if (module_conf_parse(node, node->cs, &node->insthandle) < 0) {
 		talloc_free(node);
 
 		return NULL;
@@ -710,11 +951,43 @@ module_instance_t *find_module_instance(CONF_SECTION *modules,
 	}
 
 #endif
+#ifdef WITH_STATS
+	if (main_config.profile_modules) node->stats = talloc_zero(node, module_stats_t);
+#endif
+
+	module_files_record(node, cs);
+
+	if (node->entry->module->thread_instantiate) {
+		module_thread_node_t *tn;
+
+		tn = talloc_zero(NULL, module_thread_node_t);
+		tn->node = node;
+
+		THREAD_NODES_LOCK;
+		tn->next = thread_nodes;
+		thread_nodes = tn;
+		THREAD_NODES_UNLOCK;
+	}
+
 	rbtree_insert(instance_tree, node);
 
 	return node;
 }
 
+/** Call a function for every module instance, in name order
+ *
+ * @param callback called with ctx and the module_instance_t.  A non-zero
+ *	return stops the walk.
+ * @param ctx passed to the callback.
+ * @return 0 if every instance was visited, otherwise the callback's return.
+ */
+int module_instance_walk(rb_walker_t callback, void *ctx)
+{
+	if (!instance_tree) return 0;
+
+	return rbtree_walk(instance_tree, RBTREE_IN_ORDER, callback, ctx);
+}
+
 /** Resolve polymorphic item's from a module's CONF_SECTION to a subsection in another module
  *
  * This allows certain module sections to reference module sections in other instances
@@ -859,11 +1132,29 @@ static indexed_modcallable *new_sublist(CONF_SECTION *cs,
 	return c;
 }
 
+#ifdef WITH_STATS
+/*
+ *	Run-time counters for each section, over all virtual servers,
+ *	if profile_modules is set.  The time includes the unlang in the
+ *	section, as well as the modules it calls.
+ */
+static module_stats_t section_stats;
+
+module_stats_t const *module_section_stats(void)
+{
+	return &section_stats;
+}
+#endif
+
 rlm_rcode_t indexed_modcall(rlm_components_t comp, int idx, REQUEST *request)
 {
 	rlm_rcode_t rcode;
 	modcallable *list = NULL;
 	virtual_server_t *server;
+#ifdef WITH_STATS
+	struct timeval start;
+	bool timed = false;
+#endif
 
 	/*
 	 *	Hack to find the correct virtual server.
@@ -902,13 +1193,64 @@ rlm_rcode_t indexed_modcall(rlm_components_t comp, int idx, REQUEST *request)
 	}
 	request->component = section_type_value[comp].section;
 
+#ifdef WITH_STATS
+	if (main_config.profile_modules) {
+		timed = ((MODULE_STATS_ADD(section_stats.calls[comp], 1) % main_config.profile_modules_sample) == 0);
+		if (timed) gettimeofday(&start, NULL);
+	}
+#endif
+
 	rcode = modcall(comp, list, request);
 
+#ifdef WITH_STATS
+	if (main_config.profile_modules) module_stats_record(&section_stats, comp, rcode, timed ? &start : NULL);
+#endif
+
 	request->module = "";
 	request->component = "<core>";
 	return rcode;
 }
 
+/** Wait for I/O without holding up the thread
+ *
+ * Modules which wait for a socket or a pipe should call this
+ * instead of select() or poll().  If the thread pool has "yield"
+ * enabled, and the module is marked RLM_TYPE_YIELD_SAFE, the
+ * request is suspended and the thread goes on to process other
+ * requests.  The request is resumed, possibly by another thread,
+ * when the fd becomes readable or the timeout expires.  Otherwise,
+ * this just blocks.
+ *
+ * Callers must not hold any mutexes across this call, or rely on
+ * thread-local storage (including errno) being the same after it.
+ *
+ * @param[in] request being processed.
+ * @param[in] fd to wait for, or -1 to wait for the timeout only.
+ * @param[in] timeout how long to wait, or NULL to wait forever.
+ * @return 1 if fd is readable, 0 on timeout, -1 on error, or if
+ *	the request has been told to stop, or passed its deadline.
+ */
+int module_yield(REQUEST *request, int fd, struct timeval const *timeout)
+{
+	int rcode;
+
+	if (request_expired(request)) return -1;
+
+	/*
+	 *	Other requests may run on this thread while we wait,
+	 *	and we may be resumed on a different one.
+	 */
+	if (request->trace) trace_request_set(NULL);
+
+	rcode = thread_pool_yield_fd(fd, timeout);
+
+	if (request->trace) trace_request_set(request);
+
+	if (request_expired(request)) return -1;
+
+	return rcode;
+}
+
 /*
  *	Load a sub-module list, as found inside an Auth-Type foo {}
  *	block
@@ -1177,6 +1519,22 @@ static int load_byserver(CONF_SECTION *cs)
 	}
 	talloc_set_destructor(server, _virtual_server_free);
 
+	/*
+	 *	Requests for this server are run by a named thread
+	 *	pool, see threads.c.
+	 */
+	if (name) {
+		CONF_PAIR *cp;
+
+		cp = cf_pair_find(cs, "thread_pool");
+		if (cp && (!cf_pair_value(cp) ||
+			   !cf_section_sub_find_name2(cf_top_section(cs), "thread", cf_pair_value(cp)))) {
+			cf_log_err_cp(cp, "No such thread pool \"%s\"",
+				      cf_pair_value(cp) ? cf_pair_value(cp) : "");
+			goto error;
+		}
+	}
+
 	/*
 	 *	Define types first.
 	 */
@@ -1437,8 +1795,30 @@ static int pass2_instance_cb(UNUSED void *ctx, void *data)
 /*
  *	Load all of the virtual servers.
  */
+/*
+ *	On HUP, a virtual server which is already loaded can be
+ *	kept if neither it, nor the policies which were compiled
+ *	into it, have changed.  Module instances are looked up by
+ *	name, so reloaded modules are picked up anyway.
+ */
+static bool virtual_server_unchanged(virtual_server_t const *server, CONF_SECTION *cs)
+{
+	if (!server) return false;
+
+	if (!cf_section_equal(server->cs, cs) ||
+	    !cf_section_equal(cf_section_sub_find(cf_top_section(server->cs), "policy"),
+			      cf_section_sub_find(cf_top_section(cs), "policy"))) {
+		return false;
+	}
+
+	cf_log_info(cs, "Virtual server \"%s\" is unchanged", server->name ? server->name : "<default>");
+
+	return true;
+}
+
 int virtual_servers_load(CONF_SECTION *config)
 {
+	int rcode;
 	CONF_SECTION *cs;
 	virtual_server_t *server;
 	static bool first_time = true;
@@ -1456,14 +1836,11 @@ int virtual_servers_load(CONF_SECTION *config)
 	cs = cf_section_find_name2(cf_subsection_find_next(config, NULL,
 							   "server"),
 				   "server", NULL);
-	if (cs) {
-		if (load_byserver(cs) < 0) {
-			return -1;
-		}
-	} else {
-		if (load_byserver(config) < 0) {
-			return -1;
-		}
+	if (!cs) cs = config;
+
+	if (!virtual_server_unchanged(virtual_server_find(NULL), cs) &&
+	    (load_byserver(cs) < 0)) {
+		return -1;
 	}
 
 	/*
@@ -1489,6 +1866,8 @@ int virtual_servers_load(CONF_SECTION *config)
 			return -1;
 		}
 
+		if (virtual_server_unchanged(server, cs)) continue;
+
 		if (load_byserver(cs) < 0) {
 			/*
 			 *	Once we successfully started once,
@@ -1501,12 +1880,13 @@ int virtual_servers_load(CONF_SECTION *config)
 	}
 
 	/*
-	 *	Check all of the module config items which are xlat expanded.
+	 *	Check all of the module config items which are xlat
+	 *	expanded.  This also caches their tokenized form,
+	 *	which is then used instead of the previous one.
 	 */
-	if (rbtree_walk(instance_tree, RBTREE_IN_ORDER,
-			pass2_instance_cb, NULL) != 0) {
-		return -1;
-	}
+	rcode = rbtree_walk(instance_tree, RBTREE_IN_ORDER, pass2_instance_cb, NULL);
+	xlat_cache_publish(main_config.max_request_time * 4);
+	if (rcode != 0) return -1;
 
 	/*
 	 *	Now that we've loaded everything, run pass 2 over the
@@ -1554,6 +1934,15 @@ int module_hup_module(CONF_SECTION *cs, module_instance_t *node, time_t when)
 		return 1;
 	}
 
+	/*
+	 *	Other threads hold data for the current instance,
+	 *	which we can't safely detach from here.
+	 */
+	if (node->entry->module->thread_instantiate) {
+		cf_log_module(cs, "Not reloading module \"%s\", it has per-thread data", node->name);
+		return 1;
+	}
+
 	cf_log_module(cs, "Trying to reload module \"%s\"", node->name);
 
 	/*
@@ -1561,7 +1950,7 @@ int module_hup_module(CONF_SECTION *cs, module_instance_t *node, time_t when)
 	 *	module's detach method is called when it's instance data is
 	 *	about to be freed.
 	 */
-	if (module_conf_parse(node, &insthandle) < 0) {
+	if (module_conf_parse(node, cs, &insthandle) < 0) {
 		cf_log_err_cs(cs, "HUP failed for module \"%s\" (parsing config failed). "
 			      "Using old configuration", node->name);
 
@@ -1577,6 +1966,13 @@ int module_hup_module(CONF_SECTION *cs, module_instance_t *node, time_t when)
 
 	INFO(" Module: Reloaded module \"%s\"", node->name);
 
+	/*
+	 *	The new configuration becomes the current one, so
+	 *	that the next HUP compares against it.
+	 */
+	node->cs = cs;
+	module_files_record(node, cs);
+
 	module_instance_free_old(cs, node, when);
 
 	/*
@@ -1618,6 +2014,7 @@ int modules_hup(CONF_SECTION *modules)
 	     ci != NULL;
 	     ci=cf_item_find_next(modules, ci)) {
 		char const *instname;
+		bool equal;
 		module_instance_t myNode;
 
 		/*
@@ -1631,6 +2028,20 @@ int modules_hup(CONF_SECTION *modules)
 
 		strlcpy(myNode.name, instname, sizeof(myNode.name));
 		node = rbtree_finddata(instance_tree, &myNode);
+		if (!node) continue;
+
+		/*
+		 *	Don't rebuild modules whose configuration hasn't
+		 *	changed, unless it names files, which may have.
+		 */
+		equal = cf_section_equal(node->cs, cs);
+		if (equal && !node->files) continue;
+
+		if ((node->entry->module->type & RLM_TYPE_HUP_SAFE) == 0) {
+			if (!equal) WARN("Module \"%s\" has changed, but cannot be reloaded.  Restart the server "
+					 "to use the new configuration", node->name);
+			continue;
+		}
 
 		module_hup_module(cs, node, when);
 	}
@@ -1740,40 +2151,45 @@ int modules_init(CONF_SECTION *config)
 
 	DEBUG2("%s: #### Instantiating modules ####", main_config.name);
 
+	/*
+	 *	The modules are instantiated in order, as they
+	 *	register xlats, attributes, etc.  The connection pools
+	 *	don't need to wait for each other, so their
+	 *	connections are opened in parallel once all of the
+	 *	modules have been instantiated.
+	 */
+	fr_connection_pool_defer_start();
+
 	/*
 	 *	Loop over module definitions, looking for duplicates.
 	 *
-	 *	This is O(N^2) in the number of modules, but most
-	 *	systems should have less than 100 modules.
+	 *	The lookup returns the first section with the
+	 *	same names, so if that isn't this one, then an
+	 *	earlier one is a duplicate.
 	 */
 	for (ci=cf_item_find_next(modules, NULL);
 	     ci != NULL;
-	     ci=next) {
+	     ci=cf_item_find_next(modules, ci)) {
 		char const *name1, *name2;
 		CONF_SECTION *subcs, *duplicate;
 
-		next = cf_item_find_next(modules, ci);
-
 		if (!cf_item_is_section(ci)) continue;
 
-		if (!next || !cf_item_is_section(next)) continue;
-
 		subcs = cf_itemtosection(ci);
 		name1 = cf_section_name1(subcs);
 		name2 = cf_section_name2(subcs);
 
-		duplicate = cf_section_find_name2(cf_itemtosection(next),
-						  name1, name2);
-		if (!duplicate) continue;
+		duplicate = cf_section_sub_find_name2(modules, name1, name2);
+		if (!duplicate || (duplicate == subcs)) continue;
 
 		if (!name2) name2 = "";
 
 		ERROR("Duplicate module \"%s %s\", in file %s:%d and file %s:%d",
 		       name1, name2,
-		       cf_section_filename(subcs),
-		       cf_section_lineno(subcs),
 		       cf_section_filename(duplicate),
-		       cf_section_lineno(duplicate));
+		       cf_section_lineno(duplicate),
+		       cf_section_filename(subcs),
+		       cf_section_lineno(subcs));
 		return -1;
 	}
 
@@ -1847,6 +2263,8 @@ int modules_init(CONF_SECTION *config)
 
 	if (virtual_servers_load(config) < 0) return -1;
 
+	if (fr_connection_pool_start_all() < 0) return -1;
+
 	return 0;
 }
 
@@ -35,6 +35,9 @@ RCSID("$Id$")
 #ifdef WITH_DETAIL
 #include <freeradius-devel/detail.h>
 #endif
+#include <freeradius-devel/metrics.h>
+#include <freeradius-devel/trace.h>
+#include <freeradius-devel/heap.h>
 
 #include <signal.h>
 #include <fcntl.h>
@@ -46,11 +49,30 @@ RCSID("$Id$")
 extern pid_t radius_pid;
 extern bool check_config;
 extern fr_cond_t *debug_condition;
+extern size_t debug_capture_size;
 
 static bool spawn_flag = false;
 static bool just_started = true;
 time_t fr_start_time = (time_t)-1;
-static rbtree_t *pl = NULL;
+
+/*
+ *	The list of live requests, used to detect duplicates.  It's
+ *	split into shards by the high bits of the packet hash.  Each
+ *	shard is a hash table with its own lock, so lookups on
+ *	different shards don't contend.
+ */
+#define REQUEST_SHARD_BITS	(4)
+#define REQUEST_SHARDS		(1 << REQUEST_SHARD_BITS)
+
+typedef struct request_shard_t {
+	fr_hash_table_t	*ht;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t	mutex;
+#endif
+} request_shard_t;
+
+static request_shard_t *pl = NULL;
+
 static fr_event_list_t *el = NULL;
 
 fr_event_list_t *radius_event_list_corral(UNUSED event_corral_t hint) {
@@ -198,12 +220,52 @@ static char const *child_state_names[REQUEST_CHILD_NUM_STATES] = {
 
 
 #ifdef WITH_PROXY
-static fr_packet_list_t *proxy_list = NULL;
+/*
+ *	Proxied requests are spread over several packet lists, each
+ *	with its own mutex.  Every list uses every proxy socket, but
+ *	only allocates the IDs where (id % PROXY_SHARDS) is its index.
+ *	So the ID of a reply tells us which list to look in, and
+ *	looking up replies doesn't have to wait for threads which are
+ *	inserting new requests into other lists.
+ */
+#ifdef HAVE_PTHREAD_H
+#define PROXY_SHARDS (4)
+#else
+#define PROXY_SHARDS (1)
+#endif
+
+typedef struct proxy_shard_t {
+	fr_packet_list_t	*list;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t		mutex;
+#endif
+} proxy_shard_t;
+
+static proxy_shard_t proxy_shards[PROXY_SHARDS];
+
+/*
+ *	Identical requests to the same home server which are in
+ *	flight at the same time.  Only the leader sends a packet.
+ *	The others wait, and get a copy of its reply.
+ */
+typedef struct proxy_coalesce {
+	home_server_t		*home;		//!< Where the leader was proxied to.
+	unsigned int		code;		//!< Of the proxied packet.
+	char const		*key;		//!< Expansion of the home server's coalesce_key.
+	REQUEST			*leader;	//!< The request which sent the packet.
+	REQUEST			*followers;	//!< Requests waiting for the leader's reply.
+	REQUEST			**last;		//!< Where to add the next follower.
+} proxy_coalesce_t;
+
+static fr_hash_table_t *proxy_coalesce_table = NULL;
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t proxy_coalesce_mutex;
+#endif
 #endif
 
 #ifdef HAVE_PTHREAD_H
 #ifdef WITH_PROXY
-static pthread_mutex_t proxy_mutex;
+static pthread_mutex_t proxy_count_mutex;
 static bool proxy_no_new_sockets = false;
 #endif
 
@@ -295,6 +357,147 @@ void radius_update_listener(rad_listen_t *this)
 #define FD_MUTEX_UNLOCK(_x)
 #endif
 
+static uint32_t packet_entry_hash(void const *data)
+{
+	RADIUS_PACKET const * const *packet_p = data;
+
+	return fr_packet_hash(*packet_p);
+}
+
+static int packet_entry_cmp(void const *one, void const *two)
+{
+	RADIUS_PACKET const * const *a = one;
+	RADIUS_PACKET const * const *b = two;
+
+	return fr_packet_cmp(*a, *b);
+}
+
+static void request_list_free(void)
+{
+	int i;
+
+	if (!pl) return;
+
+	for (i = 0; i < REQUEST_SHARDS; i++) {
+		if (!pl[i].ht) continue;
+
+		fr_hash_table_free(pl[i].ht);
+#ifdef HAVE_PTHREAD_H
+		pthread_mutex_destroy(&pl[i].mutex);
+#endif
+	}
+
+	TALLOC_FREE(pl);
+}
+
+static int request_list_create(void)
+{
+	int i;
+
+	pl = talloc_zero_array(NULL, request_shard_t, REQUEST_SHARDS);
+	if (!pl) return -1;
+
+	for (i = 0; i < REQUEST_SHARDS; i++) {
+#ifdef HAVE_PTHREAD_H
+		if (pthread_mutex_init(&pl[i].mutex, NULL) != 0) {
+			ERROR("FATAL: Failed to initialize request list mutex: %s",
+			      fr_syserror(errno));
+			request_list_free();
+			return -1;
+		}
+#endif
+
+		pl[i].ht = fr_hash_table_create(packet_entry_hash, packet_entry_cmp, NULL);
+		if (!pl[i].ht) {
+#ifdef HAVE_PTHREAD_H
+			pthread_mutex_destroy(&pl[i].mutex);
+#endif
+			request_list_free();
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static request_shard_t *request_shard(RADIUS_PACKET const *packet)
+{
+	return &pl[fr_packet_hash(packet) >> (32 - REQUEST_SHARD_BITS)];
+}
+
+static RADIUS_PACKET **request_list_find(RADIUS_PACKET *packet)
+{
+	RADIUS_PACKET **packet_p;
+	request_shard_t *shard = request_shard(packet);
+
+	PTHREAD_MUTEX_LOCK(&shard->mutex);
+	packet_p = fr_hash_table_finddata(shard->ht, &packet);
+	PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+
+	return packet_p;
+}
+
+static bool request_list_insert(REQUEST *request)
+{
+	int rcode;
+	request_shard_t *shard = request_shard(request->packet);
+
+	PTHREAD_MUTEX_LOCK(&shard->mutex);
+	rcode = fr_hash_table_insert(shard->ht, &request->packet);
+	PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+
+	return (rcode != 0);
+}
+
+/*
+ *	Called with the shard mutex held, or from a
+ *	request_list_walk() callback.
+ */
+static void request_list_delete_nl(REQUEST *request)
+{
+	if (!fr_hash_table_yank(request_shard(request->packet)->ht, &request->packet)) {
+		rad_assert(0 == 1);
+	}
+}
+
+static void request_list_delete(REQUEST *request)
+{
+	request_shard_t *shard = request_shard(request->packet);
+
+	PTHREAD_MUTEX_LOCK(&shard->mutex);
+	request_list_delete_nl(request);
+	PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+}
+
+static uint32_t request_list_num_elements(void)
+{
+	int i;
+	uint32_t num = 0;
+
+	for (i = 0; i < REQUEST_SHARDS; i++) {
+		PTHREAD_MUTEX_LOCK(&pl[i].mutex);
+		num += fr_hash_table_num_elements(pl[i].ht);
+		PTHREAD_MUTEX_UNLOCK(&pl[i].mutex);
+	}
+
+	return num;
+}
+
+/*
+ *	The callback may remove the request it's given from the list,
+ *	with request_list_delete_nl().
+ */
+static void request_list_walk(fr_hash_table_walk_t callback, void *ctx)
+{
+	int i;
+
+	for (i = 0; i < REQUEST_SHARDS; i++) {
+		PTHREAD_MUTEX_LOCK(&pl[i].mutex);
+		fr_hash_table_walk(pl[i].ht, callback, ctx);
+		PTHREAD_MUTEX_UNLOCK(&pl[i].mutex);
+	}
+}
+
 static int request_num_counter = 1;
 #ifdef WITH_PROXY
 static int request_will_proxy(REQUEST *request);
@@ -302,10 +505,13 @@ static int request_proxy(REQUEST *request, int retransmit);
 STATE_MACHINE_DECL(proxy_wait_for_reply);
 STATE_MACHINE_DECL(proxy_no_reply);
 STATE_MACHINE_DECL(proxy_running);
+STATE_MACHINE_DECL(proxy_coalesced);
 static int process_proxy_reply(REQUEST *request, RADIUS_PACKET *reply);
+static int setup_post_proxy_fail(REQUEST *request);
 static void remove_from_proxy_hash(REQUEST *request);
 static void remove_from_proxy_hash_nl(REQUEST *request, bool yank);
 static int insert_into_proxy_hash(REQUEST *request);
+static void proxy_coalesce_leave(REQUEST *request);
 #endif
 
 static REQUEST *request_setup(rad_listen_t *listener, RADIUS_PACKET *packet,
@@ -413,25 +619,38 @@ static void debug_packet(REQUEST *request, RADIUS_PACKET *packet, bool received)
 
 static struct timeval *request_response_window(REQUEST *request)
 {
+	struct timeval *response_window;
+
 	VERIFY_REQUEST(request);
 
+	rad_assert(request->home_server != NULL);
+
+	/*
+	 *	Use the window derived from the response times, once
+	 *	we have some.
+	 */
+	response_window = &request->home_server->response_window;
+	if (request->home_server->adaptive_response_window &&
+	    timerisset(&request->home_server->rto)) {
+		response_window = &request->home_server->rto;
+	}
+
 	if (request->client) {
 		/*
 		 *	The client hasn't set the response window.  Return
 		 *	either the home server one, if set, or the global one.
 		 */
 		if (!timerisset(&request->client->response_window)) {
-			return &request->home_server->response_window;
+			return response_window;
 		}
 
 		if (timercmp(&request->client->response_window,
-			     &request->home_server->response_window, <)) {
+			     response_window, <)) {
 			return &request->client->response_window;
 		}
 	}
 
-	rad_assert(request->home_server != NULL);
-	return &request->home_server->response_window;
+	return response_window;
 }
 
 /*
@@ -476,6 +695,28 @@ static void request_timer(void *ctx)
 /*
  *	Only ever called from the master thread.
  */
+/*
+ *	Write out the debug output captured for the request if it was
+ *	rejected, timed out, or failed without a reply.  Otherwise,
+ *	throw it away.
+ */
+static void request_capture_done(REQUEST *request)
+{
+	bool failed;
+
+	if (!request->log.capture) return;
+
+	failed = (request->master_state == REQUEST_STOP_PROCESSING) ||
+		 !request->reply || (request->reply->code == 0) ||
+		 (request->reply->code == PW_CODE_ACCESS_REJECT);
+#ifdef WITH_COA
+	failed |= request->reply && ((request->reply->code == PW_CODE_COA_NAK) ||
+				     (request->reply->code == PW_CODE_DISCONNECT_NAK));
+#endif
+
+	log_capture_done(request, failed);
+}
+
 STATE_MACHINE_DECL(request_done)
 {
 	struct timeval now, when;
@@ -643,13 +884,13 @@ STATE_MACHINE_DECL(request_done)
 	 */
 	if (request->in_request_hash) {
 		ASSERT_MASTER;
-		if (!rbtree_deletebydata(pl, &request->packet)) {
-			rad_assert(0 == 1);
-		}
+		request_list_delete(request);
 		request->in_request_hash = false;
 	}
 
 #ifdef WITH_PROXY
+	if (request->proxy_info) proxy_coalesce_leave(request);
+
 	/*
 	 *	Wait for the proxy ID to expire.  This allows us to
 	 *	avoid re-use of proxy IDs for a while.
@@ -673,7 +914,7 @@ STATE_MACHINE_DECL(request_done)
 		 *	We haven't received all responses, AND there's still
 		 *	time to wait.  Do so.
 		 */
-		if ((request->num_proxied_requests > request->num_proxied_responses) &&
+		if ((request->proxy_info->num_proxied_requests > request->proxy_info->num_proxied_responses) &&
 #ifdef WITH_TCP
 		    (request->home_server->proto != IPPROTO_TCP) &&
 #endif
@@ -699,7 +940,7 @@ STATE_MACHINE_DECL(request_done)
 #endif
 
 	if (request->child_state != REQUEST_DONE) {
-		gettimeofday(&now, NULL);
+		fr_event_now(el, &now);
 #ifdef WITH_PROXY
 	wait_some_more:
 #endif
@@ -741,7 +982,9 @@ STATE_MACHINE_DECL(request_done)
 
 	if (request->ev) fr_event_delete(el, &request->ev);
 
-	talloc_free(request);
+	trace_request_done(request);
+	request_capture_done(request);
+	request_pool_free(request);
 }
 
 
@@ -834,7 +1077,7 @@ static void request_process_timer(REQUEST *request)
 		}
 	}
 
-	gettimeofday(&now, NULL);
+	fr_event_now(el, &now);
 
 	/*
 	 *	The request was forcibly stopped.
@@ -935,6 +1178,8 @@ static void request_process_timer(REQUEST *request)
 
 		if (request->proxy_reply) {
 			request->process = proxy_running;
+		} else if (request->proxy_info && request->proxy_info->coalesced) {
+			request->process = proxy_coalesced;
 		} else {
 			request->process = proxy_wait_for_reply;
 		}
@@ -1106,8 +1351,9 @@ STATE_MACHINE_DECL(request_common)
 		 *	We're still waiting for a proxy reply.
 		 */
 		if (request->child_state == REQUEST_PROXIED) {
-			request->process = proxy_wait_for_reply;
-			proxy_wait_for_reply(request, action);
+			request->process = (request->proxy_info && request->proxy_info->coalesced) ?
+					   proxy_coalesced : proxy_wait_for_reply;
+			request->process(request, action);
 			return;
 		}
 #endif
@@ -1246,6 +1492,11 @@ static int CC_HINT(nonnull) request_pre_handler(REQUEST *request, UNUSED int act
 	if (!request->packet->vps) { /* FIXME: check for correct state */
 		rcode = request->listener->decode(request->listener, request);
 
+		/*
+		 *	Let the listener re-use the receive buffer.
+		 */
+		rad_packet_release(request->packet);
+
 #ifdef WITH_UNLANG
 		if (debug_condition) {
 			/*
@@ -1253,7 +1504,9 @@ static int CC_HINT(nonnull) request_pre_handler(REQUEST *request, UNUSED int act
 			 */
 			if (radius_evaluate_cond(request, RLM_MODULE_OK, 0, debug_condition)) {
 				request->log.lvl = L_DBG_LVL_2;
-				request->log.func = vradlog_request;
+				if (!debug_capture_size || !log_capture_start(request, debug_capture_size)) {
+					request->log.func = vradlog_request;
+				}
 			}
 		}
 #endif
@@ -1412,6 +1665,14 @@ STATE_MACHINE_DECL(request_finish)
 	}
 #endif
 
+	/*
+	 *	The client has stopped waiting for the reply.
+	 */
+	if (request->reply->code && request_expired(request)) {
+		RDEBUG("Request passed its deadline.  Not sending reply to client.");
+		request->reply->code = 0;
+	}
+
 	/*
 	 *	Ignore all "do not respond" packets.
 	 *	Except for the detail ones, which need to ping
@@ -1512,6 +1773,13 @@ STATE_MACHINE_DECL(request_finish)
 		NO_CHILD_THREAD;
 		request->child_state = REQUEST_RESPONSE_DELAY;
 	}
+
+	/*
+	 *	Nothing more will be done for the request, so there's
+	 *	no need to wait for the cleanup delay.
+	 */
+	trace_request_done(request);
+	request_capture_done(request);
 }
 
 STATE_MACHINE_DECL(request_running)
@@ -1606,6 +1874,76 @@ STATE_MACHINE_DECL(request_running)
 	}
 }
 
+static void request_dup_stats(UNUSED rad_listen_t *listener, UNUSED RADCLIENT *client, UNUSED int code)
+{
+#ifdef WITH_STATS
+	switch (code) {
+	case PW_CODE_ACCESS_REQUEST:
+		FR_STATS_INC(auth, total_dup_requests);
+		break;
+
+#ifdef WITH_ACCOUNTING
+	case PW_CODE_ACCOUNTING_REQUEST:
+		FR_STATS_INC(acct, total_dup_requests);
+		break;
+#endif
+#ifdef WITH_COA
+	case PW_CODE_COA_REQUEST:
+		FR_STATS_INC(coa, total_dup_requests);
+		break;
+
+	case PW_CODE_DISCONNECT_REQUEST:
+		FR_STATS_INC(dsc, total_dup_requests);
+		break;
+#endif
+
+	default:
+		break;
+	}
+#endif	/* WITH_STATS */
+}
+
+/** Deal with a retransmit before the packet is read
+ *
+ * The caller fills in a packet from the RADIUS header with
+ * rad_recv_peek() or rad_batch_peek(), and calls this before
+ * allocating anything.  If the packet is a retransmit of a request
+ * which is still in progress, or whose reply is cached, the original
+ * request deals with it, in the same way as request_receive() does.
+ *
+ * Anything else (new packets, conflicting packets, and retransmits of
+ * requests which are done) goes through request_receive() as normal.
+ *
+ * @param listener the packet was received on.
+ * @param packet header, addresses, and length of the received packet.
+ * @return true if the packet was a duplicate, and has been dealt with.
+ */
+bool request_receive_dup(rad_listen_t *listener, RADIUS_PACKET *packet)
+{
+	RADIUS_PACKET **packet_p;
+	REQUEST *request;
+
+	if (listener->nodup) return false;
+
+	packet_p = request_list_find(packet);
+	if (!packet_p) return false;
+
+	request = fr_packet2myptr(REQUEST, packet, packet_p);
+	rad_assert(request->in_request_hash);
+
+	if ((request->packet->code != packet->code) ||
+	    (request->packet->data_len != packet->data_len) ||
+	    (memcmp(request->packet->vector, packet->vector, sizeof(packet->vector)) != 0) ||
+	    (request->child_state == REQUEST_DONE)) {
+		return false;
+	}
+
+	request->process(request, FR_ACTION_DUP);
+	request_dup_stats(listener, request->client, packet->code);
+
+	return true;
+}
+
 int request_receive(rad_listen_t *listener, RADIUS_PACKET *packet,
 		    RADCLIENT *client, RAD_REQUEST_FUNP fun)
 {
@@ -1618,9 +1956,11 @@ int request_receive(rad_listen_t *listener, RADIUS_PACKET *packet,
 	VERIFY_PACKET(packet);
 
 	/*
-	 *	Set the last packet received.
+	 *	Set the last packet received.  This is the one place
+	 *	where the request is stamped.  Everything else uses
+	 *	packet->timestamp, or request->timestamp.
 	 */
-	gettimeofday(&now, NULL);
+	fr_clock_gettime(&now);
 
 	packet->timestamp = now;
 
@@ -1637,7 +1977,7 @@ int request_receive(rad_listen_t *listener, RADIUS_PACKET *packet,
 	 */
 	if (listener->nodup) goto skip_dup;
 
-	packet_p = rbtree_finddata(pl, &packet);
+	packet_p = request_list_find(packet);
 	if (packet_p) {
 		request = fr_packet2myptr(REQUEST, packet, packet_p);
 		rad_assert(request->in_request_hash);
@@ -1655,32 +1995,7 @@ int request_receive(rad_listen_t *listener, RADIUS_PACKET *packet,
 			 */
 			if (request->child_state != REQUEST_DONE) {
 				request->process(request, FR_ACTION_DUP);
-
-#ifdef WITH_STATS
-				switch (packet->code) {
-				case PW_CODE_ACCESS_REQUEST:
-					FR_STATS_INC(auth, total_dup_requests);
-					break;
-
-#ifdef WITH_ACCOUNTING
-				case PW_CODE_ACCOUNTING_REQUEST:
-					FR_STATS_INC(acct, total_dup_requests);
-					break;
-#endif
-#ifdef WITH_COA
-				case PW_CODE_COA_REQUEST:
-					FR_STATS_INC(coa, total_dup_requests);
-					break;
-
-				case PW_CODE_DISCONNECT_REQUEST:
-					FR_STATS_INC(dsc, total_dup_requests);
-					break;
-#endif
-
-				default:
-					break;
-				}
-#endif	/* WITH_STATS */
+				request_dup_stats(listener, client, packet->code);
 				return 0; /* duplicate of live request */
 			}
 #ifdef HAVE_PTHREAD_H
@@ -1712,7 +2027,7 @@ int request_receive(rad_listen_t *listener, RADIUS_PACKET *packet,
 	 *	Quench maximum number of outstanding requests.
 	 */
 	if (main_config.max_requests &&
-	    ((count = rbtree_num_elements(pl)) > main_config.max_requests)) {
+	    ((count = request_list_num_elements()) > main_config.max_requests)) {
 		RATE_LIMIT(ERROR("Dropping request (%d is too many): from client %s port %d - ID: %d", count,
 				 client->shortname,
 				 packet->src_port, packet->id);
@@ -1745,7 +2060,7 @@ skip_dup:
 	 *	Remember the request in the list.
 	 */
 	if (!listener->nodup) {
-		if (!rbtree_insert(pl, &request->packet)) {
+		if (!request_list_insert(request)) {
 			RERROR("Failed to insert request in the list of live requests: discarding it");
 			request_done(request, FR_ACTION_DONE);
 			return 1;
@@ -1763,6 +2078,7 @@ skip_dup:
 #endif
 
 		request->listener->decode(request->listener, request);
+		rad_packet_release(request->packet);
 		request->username = pairfind(request->packet->vps, PW_USER_NAME, 0, TAG_ANY);
 		request->password = pairfind(request->packet->vps, PW_USER_PASSWORD, 0, TAG_ANY);
 
@@ -1773,7 +2089,9 @@ skip_dup:
 		} else {
 			RDEBUG("Not sending reply");
 		}
-		talloc_free(request);
+		trace_request_done(request);
+		request_capture_done(request);
+		request_pool_free(request);
 		return 1;
 	}
 
@@ -1795,11 +2113,16 @@ static REQUEST *request_setup(rad_listen_t *listener, RADIUS_PACKET *packet,
 	/*
 	 *	Create and initialize the new request.
 	 */
-	request = request_alloc(NULL);
+	request = request_pool_alloc();
+	if (!request) {
+		ERROR("No memory");
+		return NULL;
+	}
+
 	request->reply = rad_alloc(request, false);
 	if (!request->reply) {
 		ERROR("No memory");
-		talloc_free(request);
+		request_pool_free(request);
 		return NULL;
 	}
 
@@ -1807,6 +2130,7 @@ static REQUEST *request_setup(rad_listen_t *listener, RADIUS_PACKET *packet,
 	request->client = client;
 	request->packet = talloc_steal(request, packet);
 	request->number = request_num_counter++;
+	request->timestamp = packet->timestamp.tv_sec;
 	request->priority = listener->type;
 	if (request->priority >= RAD_LISTEN_MAX) {
 		request->priority = RAD_LISTEN_AUTH;
@@ -1857,6 +2181,16 @@ static REQUEST *request_setup(rad_listen_t *listener, RADIUS_PACKET *packet,
 	request->listener->count++;
 #endif
 
+	/*
+	 *	Stop working on the request when the client will
+	 *	have given up on it.
+	 */
+	if (timerisset(&client->deadline)) {
+		timeradd(&request->packet->timestamp, &client->deadline, &request->deadline);
+	}
+
+	trace_request_start(request);
+
 	/*
 	 *	The request passes many of our sanity checks.
 	 *	From here on in, if anything goes wrong, we
@@ -1891,6 +2225,10 @@ static REQUEST *request_setup(rad_listen_t *listener, RADIUS_PACKET *packet,
  *
  ***********************************************************************/
 
+#ifdef WITH_PROXY
+static void proxy_keepalive(rad_listen_t *listener);
+#endif
+
 /*
  *	Timer function for all TCP sockets.
  */
@@ -1901,6 +2239,7 @@ static void tcp_socket_timer(void *ctx)
 	struct timeval end, now;
 	char buffer[256];
 	fr_socket_limit_t *limit;
+	bool keep = false;
 
 	ASSERT_MASTER;
 
@@ -1912,6 +2251,12 @@ static void tcp_socket_timer(void *ctx)
 #ifdef WITH_PROXY
 	case RAD_LISTEN_PROXY:
 		limit = &sock->home->limit;
+
+		/*
+		 *	Keep "min_connections" open, however idle
+		 *	they are.
+		 */
+		keep = (limit->num_connections <= limit->min_connections);
 		break;
 #endif
 
@@ -1951,7 +2296,7 @@ static void tcp_socket_timer(void *ctx)
 	/*
 	 *	Enforce an idle timeout.
 	 */
-	if (limit->idle_timeout > 0) {
+	if ((limit->idle_timeout > 0) && !keep) {
 		struct timeval idle;
 
 		rad_assert(sock->last_packet != 0);
@@ -1972,6 +2317,32 @@ static void tcp_socket_timer(void *ctx)
 		}
 	}
 
+#ifdef WITH_PROXY
+	/*
+	 *	Check connections to home servers which haven't had a
+	 *	reply for a while, so that dead ones are found and
+	 *	replaced before requests are sent on them.
+	 */
+	if ((listener->type == RAD_LISTEN_PROXY) && (limit->keepalive > 0)) {
+		struct timeval keepalive;
+
+		keepalive.tv_sec = ((sock->last_keepalive > sock->last_packet) ?
+				    sock->last_keepalive : sock->last_packet) + limit->keepalive;
+		keepalive.tv_usec = 0;
+
+		if (timercmp(&keepalive, &now, <=)) {
+			sock->last_keepalive = now.tv_sec;
+			proxy_keepalive(listener);
+
+			keepalive.tv_sec = now.tv_sec + limit->keepalive;
+		}
+
+		if (timercmp(&keepalive, &end, <)) {
+			end = keepalive;
+		}
+	}
+#endif
+
 	/*
 	 *	Wake up at t + 0.5s.  The code above checks if the timers
 	 *	are <= t.  This addition gives us a bit of leeway.
@@ -1985,26 +2356,6 @@ static void tcp_socket_timer(void *ctx)
 
 
 #ifdef WITH_PROXY
-/*
- *	Add +/- 2s of jitter, as suggested in RFC 3539
- *	and in RFC 5080.
- */
-static void add_jitter(struct timeval *when)
-{
-	uint32_t jitter;
-
-	when->tv_sec -= 2;
-
-	jitter = fr_rand();
-	jitter ^= (jitter >> 10);
-	jitter &= ((1 << 22) - 1); /* 22 bits of 1 */
-
-	/*
-	 *	Add in ~ (4 * USEC) of jitter.
-	 */
-	tv_add(when, jitter);
-}
-
 /*
  *	Called by socket_del to remove requests with this socket
  */
@@ -2068,7 +2419,7 @@ static void remove_from_proxy_hash_nl(REQUEST *request, bool yank)
 
 	if (!request->in_proxy_hash) return;
 
-	fr_packet_list_id_free(proxy_list, request->proxy, yank);
+	fr_packet_list_id_free(proxy_shards[request->proxy_shard].list, request->proxy, yank);
 	request->in_proxy_hash = false;
 
 	/*
@@ -2077,6 +2428,7 @@ static void remove_from_proxy_hash_nl(REQUEST *request, bool yank)
 	 *	packets, but whether or not the home server has
 	 *	responded at all.
 	 */
+	PTHREAD_MUTEX_LOCK(&proxy_count_mutex);
 	if (request->home_server &&
 	    request->home_server->currently_outstanding) {
 		request->home_server->currently_outstanding--;
@@ -2097,6 +2449,7 @@ static void remove_from_proxy_hash_nl(REQUEST *request, bool yank)
 	rad_assert(request->proxy_listener != NULL);
 	request->proxy_listener->count--;
 #endif
+	PTHREAD_MUTEX_UNLOCK(&proxy_count_mutex);
 	request->proxy_listener = NULL;
 
 	/*
@@ -2109,6 +2462,8 @@ static void remove_from_proxy_hash_nl(REQUEST *request, bool yank)
 
 static void remove_from_proxy_hash(REQUEST *request)
 {
+	proxy_shard_t *shard;
+
 	VERIFY_REQUEST(request);
 
 	/*
@@ -2122,99 +2477,402 @@ static void remove_from_proxy_hash(REQUEST *request)
 	 *	flag says that it IS in the hash, there might still be
 	 *	a race condition where it isn't.
 	 */
-	PTHREAD_MUTEX_LOCK(&proxy_mutex);
+	shard = &proxy_shards[request->proxy_shard];
+	PTHREAD_MUTEX_LOCK(&shard->mutex);
 
 	if (!request->in_proxy_hash) {
-		PTHREAD_MUTEX_UNLOCK(&proxy_mutex);
+		PTHREAD_MUTEX_UNLOCK(&shard->mutex);
 		return;
 	}
 
 	remove_from_proxy_hash_nl(request, true);
 
-	PTHREAD_MUTEX_UNLOCK(&proxy_mutex);
+	PTHREAD_MUTEX_UNLOCK(&shard->mutex);
 }
 
-static int insert_into_proxy_hash(REQUEST *request)
+static uint32_t proxy_coalesce_hash(void const *data)
 {
-	char buf[128];
-	int rcode, tries;
-	void *proxy_listener;
+	proxy_coalesce_t const *group = data;
+	uint32_t hash;
 
-	VERIFY_REQUEST(request);
+	hash = fr_hash(&group->home, sizeof(group->home));
+	hash = fr_hash_update(&group->code, sizeof(group->code), hash);
 
-	rad_assert(request->proxy != NULL);
-	rad_assert(request->home_server != NULL);
-	rad_assert(proxy_list != NULL);
+	return fr_hash_update(group->key, strlen(group->key), hash);
+}
 
+static void proxy_coalesce_free(void *data)
+{
+	talloc_free(data);
+}
 
-	PTHREAD_MUTEX_LOCK(&proxy_mutex);
-	proxy_listener = NULL;
-	request->num_proxied_requests = 1;
-	request->num_proxied_responses = 0;
+static int proxy_coalesce_cmp(void const *one, void const *two)
+{
+	proxy_coalesce_t const *a = one;
+	proxy_coalesce_t const *b = two;
 
-	for (tries = 0; tries < 2; tries++) {
-		rad_listen_t *this;
-		listen_socket_t *sock;
+	if (a->home != b->home) return (a->home < b->home) ? -1 : +1;
+	if (a->code != b->code) return (a->code < b->code) ? -1 : +1;
 
-		RDEBUG3("proxy: Trying to allocate ID (%d/2)", tries);
-		rcode = fr_packet_list_id_alloc(proxy_list,
-						request->home_server->proto,
-						&request->proxy, &proxy_listener);
-		if ((debug_flag > 2) && (rcode == 0)) {
-			RDEBUG("proxy: Failed allocating ID: %s", fr_strerror());
-		}
-		if (rcode > 0) break;
-		if (tries > 0) continue; /* try opening new socket only once */
+	return strcmp(a->key, b->key);
+}
 
-#ifdef HAVE_PTHREAD_H
-		if (proxy_no_new_sockets) break;
-#endif
+/** See whether a request can share the proxied packet of an identical one
+ *
+ * If another request with the same home server, packet code, and
+ * expansion of the home server's "coalesce_key" is waiting for a reply,
+ * the request is added to its followers, and marked as proxied without
+ * sending anything.  Otherwise it becomes the leader of a new group.
+ *
+ * @param request to proxy.
+ * @return true if the request is now waiting for another request's reply,
+ *	false if it should be proxied as normal.
+ */
+static bool proxy_coalesce(REQUEST *request)
+{
+	char *key = NULL;
+	proxy_coalesce_t my_group, *group;
+	unsigned int leader;
 
-		RDEBUG3("proxy: Trying to open a new listener to the home server");
-		this = proxy_new_listener(request->home_server, 0);
-		if (!this) {
-			PTHREAD_MUTEX_UNLOCK(&proxy_mutex);
-			goto fail;
-		}
+	if (!proxy_coalesce_table) return false;
 
-		request->proxy->src_port = 0; /* Use any new socket */
-		proxy_listener = this;
+	if ((radius_axlat(&key, request, request->home_server->coalesce_key, NULL, NULL) < 0) || !*key) {
+		talloc_free(key);
+		return false;
+	}
 
-		sock = this->data;
-		if (!fr_packet_list_socket_add(proxy_list, this->fd,
+	my_group.home = request->home_server;
+	my_group.code = request->proxy->code;
+	my_group.key = key;
+
+	PTHREAD_MUTEX_LOCK(&proxy_coalesce_mutex);
+	group = fr_hash_table_finddata(proxy_coalesce_table, &my_group);
+	if (!group) {
+		group = talloc_zero(NULL, proxy_coalesce_t);
+		group->home = request->home_server;
+		group->code = request->proxy->code;
+		group->key = talloc_steal(group, key);
+		group->leader = request;
+		group->last = &group->followers;
+
+		if (!fr_hash_table_insert(proxy_coalesce_table, group)) {
+			PTHREAD_MUTEX_UNLOCK(&proxy_coalesce_mutex);
+			talloc_free(group);
+			return false;
+		}
+
+		request->proxy_info->coalesce = group;
+		PTHREAD_MUTEX_UNLOCK(&proxy_coalesce_mutex);
+		return false;
+	}
+
+	/*
+	 *	The reply may be fanned out as soon as we're in the
+	 *	list, so the request has to look proxied first.
+	 */
+	gettimeofday(&request->proxy_info->proxy_retransmit, NULL);
+	request->proxy->timestamp = request->proxy_info->proxy_retransmit;
+	request->proxy_info->coalesced = true;
+	request->proxy_info->coalesce = group;
+	NO_CHILD_THREAD;
+	request->child_state = REQUEST_PROXIED;
+
+	*group->last = request;
+	group->last = &request->proxy_info->coalesce_next;
+	leader = group->leader->number;
+	PTHREAD_MUTEX_UNLOCK(&proxy_coalesce_mutex);
+
+	RDEBUG2("Waiting for the reply to identical proxied request (%u)", leader);
+	talloc_free(key);
+
+	return true;
+}
+
+/** Remove a request from its coalescing group
+ *
+ * When the leader goes, the group goes with it.  Its followers stay
+ * proxied, and time out on their own if they don't get a reply.
+ */
+static void proxy_coalesce_leave(REQUEST *request)
+{
+	proxy_coalesce_t *group;
+	REQUEST **last, *follower;
+
+	if (!request->proxy_info->coalesce) return;
+
+	PTHREAD_MUTEX_LOCK(&proxy_coalesce_mutex);
+	group = request->proxy_info->coalesce;
+	request->proxy_info->coalesce = NULL;
+
+	if (group->leader != request) {
+		for (last = &group->followers; *last; last = &(*last)->proxy_info->coalesce_next) {
+			if (*last != request) continue;
+
+			*last = request->proxy_info->coalesce_next;
+			if (group->last == &request->proxy_info->coalesce_next) group->last = last;
+			break;
+		}
+		request->proxy_info->coalesce_next = NULL;
+		PTHREAD_MUTEX_UNLOCK(&proxy_coalesce_mutex);
+		return;
+	}
+
+	fr_hash_table_yank(proxy_coalesce_table, group);
+	for (follower = group->followers; follower; follower = follower->proxy_info->coalesce_next) {
+		follower->proxy_info->coalesce = NULL;
+	}
+	PTHREAD_MUTEX_UNLOCK(&proxy_coalesce_mutex);
+
+	while (group->followers) {
+		follower = group->followers;
+		group->followers = follower->proxy_info->coalesce_next;
+		follower->proxy_info->coalesce_next = NULL;
+	}
+
+	talloc_free(group);
+}
+
+/** Give a copy of the leader's reply to every request waiting for it
+ *
+ * The copies are decoded against the leader's proxied packet, as that's
+ * the one the home server answered.  Only ever called from the master
+ * thread.
+ */
+static void proxy_coalesce_reply(REQUEST *request)
+{
+	proxy_coalesce_t *group;
+	REQUEST *follower, *next;
+	RADIUS_PACKET *reply;
+
+	if (!request->proxy_info->coalesce) return;
+
+	PTHREAD_MUTEX_LOCK(&proxy_coalesce_mutex);
+	group = request->proxy_info->coalesce;
+	if (group->leader != request) {
+		PTHREAD_MUTEX_UNLOCK(&proxy_coalesce_mutex);
+		return;
+	}
+
+	fr_hash_table_yank(proxy_coalesce_table, group);
+	for (follower = group->followers; follower; follower = follower->proxy_info->coalesce_next) {
+		follower->proxy_info->coalesce = NULL;
+	}
+	request->proxy_info->coalesce = NULL;
+	PTHREAD_MUTEX_UNLOCK(&proxy_coalesce_mutex);
+
+	for (follower = group->followers; follower; follower = next) {
+		next = follower->proxy_info->coalesce_next;
+		follower->proxy_info->coalesce_next = NULL;
+
+		if (follower->proxy_reply || (follower->master_state == REQUEST_STOP_PROCESSING)) continue;
+
+		reply = rad_alloc(follower, false);
+		if (!reply) continue;
+
+		reply->code = request->proxy_reply->code;
+		reply->id = request->proxy_reply->id;
+		reply->src_ipaddr = request->proxy_reply->src_ipaddr;
+		reply->src_port = request->proxy_reply->src_port;
+		reply->dst_ipaddr = request->proxy_reply->dst_ipaddr;
+		reply->dst_port = request->proxy_reply->dst_port;
+		reply->timestamp = request->proxy_reply->timestamp;
+		memcpy(reply->vector, request->proxy_reply->vector, sizeof(reply->vector));
+		reply->data = talloc_memdup(reply, request->proxy_reply->data, request->proxy_reply->data_len);
+		reply->data_len = request->proxy_reply->data_len;
+
+		if (rad_decode(reply, request->proxy, request->home_server->secret) < 0) {
+			RERROR("Failed decoding the reply for coalesced request (%u): %s",
+			       follower->number, fr_strerror());
+			talloc_free(reply);
+			continue;
+		}
+
+		RDEBUG2("Sharing the reply with coalesced request (%u)", follower->number);
+
+		follower->proxy_reply = reply;
+		follower->priority = RAD_LISTEN_PROXY;
+		follower->process(follower, FR_ACTION_PROXY_REPLY);
+	}
+
+	talloc_free(group);
+}
+
+/*
+ *	Open a new socket to the home server, and add it to all of the
+ *	proxy lists.  Must be called without any proxy mutex held.
+ */
+static rad_listen_t *proxy_new_socket(home_server_t *home)
+{
+	int i, j;
+	rad_listen_t *this;
+	listen_socket_t *sock;
+
+#ifdef HAVE_PTHREAD_H
+	if (proxy_no_new_sockets) return NULL;
+#endif
+
+	this = proxy_new_listener(home, 0);
+	if (!this) return NULL;
+
+	sock = this->data;
+
+	/*
+	 *	Grab all of the mutexes, in order, so that the socket
+	 *	shows up in all of the lists at the same time.
+	 */
+	for (i = 0; i < PROXY_SHARDS; i++) {
+		PTHREAD_MUTEX_LOCK(&proxy_shards[i].mutex);
+	}
+
+	for (i = 0; i < PROXY_SHARDS; i++) {
+		if (!fr_packet_list_socket_add(proxy_shards[i].list, this->fd,
 					       sock->proto,
 					       &sock->other_ipaddr, sock->other_port,
-					       this)) {
+					       this)) break;
+	}
+
+	if (i < PROXY_SHARDS) {
+		for (j = 0; j < i; j++) {
+			(void) fr_packet_list_socket_del(proxy_shards[j].list, this->fd);
+		}
 
 #ifdef HAVE_PTHREAD_H
-			proxy_no_new_sockets = true;
+		proxy_no_new_sockets = true;
 #endif
-			PTHREAD_MUTEX_UNLOCK(&proxy_mutex);
+	}
 
-			/*
-			 *	This is bad.  However, the
-			 *	packet list now supports 256
-			 *	open sockets, which should
-			 *	minimize this problem.
-			 */
-			ERROR("Failed adding proxy socket: %s",
-			      fr_strerror());
-			goto fail;
-		}
+	for (j = PROXY_SHARDS - 1; j >= 0; j--) {
+		PTHREAD_MUTEX_UNLOCK(&proxy_shards[j].mutex);
+	}
+
+	if (i < PROXY_SHARDS) {
+		/*
+		 *	This is bad.  However, the
+		 *	packet list now supports 256
+		 *	open sockets, which should
+		 *	minimize this problem.
+		 */
+		ERROR("Failed adding proxy socket: %s",
+		      fr_strerror());
+		return NULL;
+	}
+
+	/*
+	 *	Add it to the event loop.
+	 */
+	radius_update_listener(this);
+
+	return this;
+}
+
+/*
+ *	Open sockets to a home server until it has "min_connections"
+ *	of them, so that the first requests don't wait for a socket.
+ */
+static int proxy_prewarm_cb(UNUSED void *ctx, void *data)
+{
+	home_server_t *home = data;
+
+	if (home->server) return 0;
+
+	while (home->limit.num_connections < home->limit.min_connections) {
+		if (!proxy_new_socket(home)) break;
+	}
+
+	return 0;
+}
+
+/*
+ *	Open another socket to each of the home servers which are
+ *	running low on IDs.  Called in the main thread, so that the
+ *	worker threads don't wait for socket() and bind().
+ */
+static int proxy_open_socket_cb(UNUSED void *ctx, void *data)
+{
+	bool open_socket;
+	home_server_t *home = data;
+
+	PTHREAD_MUTEX_LOCK(&proxy_count_mutex);
+	open_socket = home->open_socket;
+	home->open_socket = false;
+	PTHREAD_MUTEX_UNLOCK(&proxy_count_mutex);
+
+	if (!open_socket) return 0;
+
+	DEBUG3("proxy: Running low on IDs, opening a new socket to home server %s", home->name);
+	(void) proxy_new_socket(home);
+
+	return 0;
+}
+
+/*
+ *	Allocate the proxy state for a request, if it doesn't have it
+ *	already.  Requests which aren't proxied never have it.
+ */
+static request_proxy_t *request_proxy_info(REQUEST *request)
+{
+	if (!request->proxy_info) request->proxy_info = talloc_zero(request, request_proxy_t);
+
+	return request->proxy_info;
+}
+
+static int insert_into_proxy_hash(REQUEST *request)
+{
+	char buf[128];
+	int i, rcode, tries;
+	bool id_low;
+	void *proxy_listener;
+	proxy_shard_t *shard = NULL;
+
+	VERIFY_REQUEST(request);
+
+	rad_assert(request->proxy != NULL);
+	rad_assert(request->home_server != NULL);
+	rad_assert(proxy_shards[0].list != NULL);
+
+	if (!request_proxy_info(request)) {
+		REDEBUG("Failed allocating proxy state");
+		return 0;
+	}
+
+	proxy_listener = NULL;
+	request->proxy_info->num_proxied_requests = 1;
+	request->proxy_info->num_proxied_responses = 0;
+
+	rcode = 0;
+	for (tries = 0; tries < 2; tries++) {
+		RDEBUG3("proxy: Trying to allocate ID (%d/2)", tries);
 
 		/*
-		 *	Add it to the event loop.  Ensure that we have
-		 *	only one mutex locked at a time.
+		 *	Spread requests across the lists.  If the
+		 *	first one is full, try the others before
+		 *	opening a new socket.
 		 */
-		PTHREAD_MUTEX_UNLOCK(&proxy_mutex);
-		radius_update_listener(this);
-		PTHREAD_MUTEX_LOCK(&proxy_mutex);
+		for (i = 0; i < PROXY_SHARDS; i++) {
+			request->proxy_shard = (request->number + i) % PROXY_SHARDS;
+			shard = &proxy_shards[request->proxy_shard];
+
+			PTHREAD_MUTEX_LOCK(&shard->mutex);
+			rcode = fr_packet_list_id_alloc(shard->list,
+							request->home_server->proto,
+							&request->proxy, &proxy_listener);
+			if (rcode > 0) break; /* with the mutex held */
+			PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+		}
+		if ((debug_flag > 2) && (rcode == 0)) {
+			RDEBUG("proxy: Failed allocating ID: %s", fr_strerror());
+		}
+		if (rcode > 0) break;
+		if (tries > 0) continue; /* try opening new socket only once */
+
+		RDEBUG3("proxy: Trying to open a new listener to the home server");
+		if (!proxy_new_socket(request->home_server)) break;
+
+		request->proxy->src_port = 0; /* Use any new socket */
 	}
 
 	if (!proxy_listener || (rcode == 0)) {
-		PTHREAD_MUTEX_UNLOCK(&proxy_mutex);
 		REDEBUG2("proxy: Failed allocating Id for proxied request");
-	fail:
 		request->proxy_listener = NULL;
 		request->in_proxy_hash = false;
 		return 0;
@@ -2226,18 +2884,39 @@ static int insert_into_proxy_hash(REQUEST *request)
 	request->in_proxy_hash = true;
 	RDEBUG3("proxy: request is now in proxy hash");
 
+	id_low = fr_packet_list_id_low(shard->list);
+
 	/*
 	 *	Keep track of maximum outstanding requests to a
 	 *	particular home server.  'max_outstanding' is
 	 *	enforced in home_server_ldb(), in realms.c.
+	 *
+	 *	Home servers and sockets are shared by all of the
+	 *	lists, so the counters have their own mutex.
+	 *
+	 *	If the sockets to this home server are running low
+	 *	on IDs, ask the main thread to open a new one, rather
+	 *	than waiting until a request fails to get an ID.
 	 */
+	PTHREAD_MUTEX_LOCK(&proxy_count_mutex);
 	request->home_server->currently_outstanding++;
 
 #ifdef WITH_TCP
 	request->proxy_listener->count++;
 #endif
 
-	PTHREAD_MUTEX_UNLOCK(&proxy_mutex);
+	if (id_low) {
+		id_low = !request->home_server->open_socket;
+		request->home_server->open_socket = true;
+	}
+	PTHREAD_MUTEX_UNLOCK(&proxy_count_mutex);
+
+	PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+
+	if (id_low) {
+		RDEBUG3("proxy: Running low on IDs, asking for a new listener to the home server");
+		radius_signal_self(RADIUS_SIGNAL_SELF_PROXY);
+	}
 
 	RDEBUG3("proxy: allocating destination %s port %d - Id %d",
 	       inet_ntop(request->proxy->dst_ipaddr.af,
@@ -2259,7 +2938,8 @@ static int process_proxy_reply(REQUEST *request, RADIUS_PACKET *reply)
 	/*
 	 *	There may be a proxy reply, but it may be too late.
 	 */
-	if (!request->home_server->server && !request->proxy_listener) return 0;
+	if (!request->home_server->server && !request->proxy_listener &&
+	    !(request->proxy_info && request->proxy_info->coalesced)) return 0;
 
 	/*
 	 *	Delete any reply we had accumulated until now.
@@ -2312,11 +2992,17 @@ static int process_proxy_reply(REQUEST *request, RADIUS_PACKET *reply)
 			 *	removed from the hash.
 			 */
 			if ((rcode == 0) &&
-			    (request->num_proxied_requests <= request->num_proxied_responses)) {
+			    (request->proxy_info->num_proxied_requests <= request->proxy_info->num_proxied_responses)) {
 				remove_from_proxy_hash(request);
 			}
 		} else {
 			rad_assert(!request->in_proxy_hash);
+
+			/*
+			 *	Coalesced replies were decoded when
+			 *	they were copied from the leader.
+			 */
+			if (request->proxy_info && request->proxy_info->coalesced) debug_packet(request, reply, true);
 		}
 	} else if (request->in_proxy_hash) {
 		remove_from_proxy_hash(request);
@@ -2350,7 +3036,7 @@ static int process_proxy_reply(REQUEST *request, RADIUS_PACKET *reply)
 	 *	running Post-Proxy-Type = Fail.
 	 */
 	if (reply) {
-		pairadd(&request->reply->vps, paircopy(request->reply, reply->vps));
+		pairadd(&request->reply->vps, paircopy_shared(request->reply, reply->vps));
 
 		/*
 		 *	Delete the Proxy-State Attributes from
@@ -2373,8 +3059,36 @@ static int process_proxy_reply(REQUEST *request, RADIUS_PACKET *reply)
 	return 1;
 }
 
+/*
+ *	Add a span for a proxied packet, from when it was first sent
+ *	until the reply, or until we gave up waiting.
+ */
+static void trace_proxy(REQUEST *request, struct timeval const *now)
+{
+	int span;
+	char buffer[128];
+
+	span = trace_span_add(request, TRACE_SPAN_PROXY, "proxy", &request->proxy->timestamp, now, !now);
+	if (span < 0) return;
+
+	if (request->home_server->name) {
+		trace_span_attr(request, span, "freeradius.home_server", "%s", request->home_server->name);
+	}
+	trace_span_attr(request, span, "net.peer.ip", "%s",
+			inet_ntop(request->proxy->dst_ipaddr.af, &request->proxy->dst_ipaddr.ipaddr,
+				  buffer, sizeof(buffer)));
+	trace_span_attr(request, span, "net.peer.port", "%u", request->proxy->dst_port);
+	if (request->proxy_info) {
+		trace_span_attr(request, span, "freeradius.proxy.packets", "%u", request->proxy_info->num_proxied_requests);
+	}
+	if (request->proxy_reply && is_radius_code(request->proxy_reply->code)) {
+		trace_span_attr(request, span, "radius.reply.code", "%s", fr_packet_codes[request->proxy_reply->code]);
+	}
+}
+
 int request_proxy_reply(RADIUS_PACKET *packet)
 {
+	proxy_shard_t *shard;
 	RADIUS_PACKET **proxy_p;
 	REQUEST *request;
 	struct timeval now;
@@ -2382,11 +3096,12 @@ int request_proxy_reply(RADIUS_PACKET *packet)
 
 	VERIFY_PACKET(packet);
 
-	PTHREAD_MUTEX_LOCK(&proxy_mutex);
-	proxy_p = fr_packet_list_find_byreply(proxy_list, packet);
+	shard = &proxy_shards[packet->id % PROXY_SHARDS];
+	PTHREAD_MUTEX_LOCK(&shard->mutex);
+	proxy_p = fr_packet_list_find_byreply(shard->list, packet);
 
 	if (!proxy_p) {
-		PTHREAD_MUTEX_UNLOCK(&proxy_mutex);
+		PTHREAD_MUTEX_UNLOCK(&shard->mutex);
 		PROXY( "No outstanding request was found for reply from host %s port %d - ID %u",
 		       inet_ntop(packet->src_ipaddr.af,
 				 &packet->src_ipaddr.ipaddr,
@@ -2396,9 +3111,9 @@ int request_proxy_reply(RADIUS_PACKET *packet)
 	}
 
 	request = fr_packet2myptr(REQUEST, proxy, proxy_p);
-	request->num_proxied_responses++; /* needs to be protected by lock */
+	request->proxy_info->num_proxied_responses++; /* needs to be protected by lock */
 
-	PTHREAD_MUTEX_UNLOCK(&proxy_mutex);
+	PTHREAD_MUTEX_UNLOCK(&shard->mutex);
 
 	/*
 	 *	No reply, BUT the current packet fails verification:
@@ -2425,7 +3140,7 @@ int request_proxy_reply(RADIUS_PACKET *packet)
 		return 0;
 	}
 
-	gettimeofday(&now, NULL);
+	fr_clock_gettime(&now);
 
 	/*
 	 *	Status-Server packets don't count as real packets.
@@ -2435,6 +3150,19 @@ int request_proxy_reply(RADIUS_PACKET *packet)
 
 		request->home_server->last_packet_recv = now.tv_sec;
 		sock->last_packet = now.tv_sec;
+
+		/*
+		 *	Only the first reply is timed.  Duplicates are
+		 *	discarded below.  Replies to retransmitted
+		 *	requests aren't timed, as we don't know which
+		 *	copy they're a reply to.
+		 */
+		if (!request->proxy_reply && (request->proxy_info->num_proxied_requests <= 1)) {
+			home_server_latency(request->home_server, &request->proxy->timestamp, &now);
+#ifdef WITH_STATS
+			radius_stats_ema(&request->home_server->ema, &request->proxy->timestamp, &now);
+#endif
+		}
 	}
 
 	/*
@@ -2458,6 +3186,12 @@ int request_proxy_reply(RADIUS_PACKET *packet)
 	packet->timestamp = now;
 	request->priority = RAD_LISTEN_PROXY;
 
+	/*
+	 *	Unless it's a late reply, and the request is running
+	 *	again in another thread.
+	 */
+	if (request->trace && (request->child_state == REQUEST_PROXIED)) trace_proxy(request, &now);
+
 	/*
 	 *	We've received a reply.  If we hadn't been sending it
 	 *	packets for a while, just mark it alive.
@@ -2495,6 +3229,12 @@ int request_proxy_reply(RADIUS_PACKET *packet)
 	}
 #endif
 
+	/*
+	 *	Before the leader runs, as it may be freed by the
+	 *	time it's done.
+	 */
+	if (request->proxy_info) proxy_coalesce_reply(request);
+
 	request->process(request, FR_ACTION_PROXY_REPLY);
 
 	return 1;
@@ -2889,6 +3629,11 @@ static int request_proxy(REQUEST *request, int retransmit)
 
 	if (request->master_state == REQUEST_STOP_PROCESSING) return 0;
 
+	if (!request_proxy_info(request)) {
+		REDEBUG("Failed allocating proxy state");
+		return -1;
+	}
+
 #ifdef WITH_COA
 	if (request->coa) {
 		RWDEBUG("Cannot proxy and originate CoA packets at the same time.  Cancelling CoA request");
@@ -2973,6 +3718,17 @@ static int request_proxy(REQUEST *request, int retransmit)
 		return -1;	/* so we call request_finish */
 	}
 
+	/*
+	 *	An identical request may already be waiting for a
+	 *	reply from this home server.  If so, wait for that
+	 *	reply instead of sending another packet.
+	 */
+	if (!retransmit && request->home_server->coalesce_key &&
+	    (request->proxy->code == PW_CODE_ACCOUNTING_REQUEST) &&
+	    !request->proxy_info->coalesce && proxy_coalesce(request)) {
+		return 1;
+	}
+
 	/*
 	 *	We're actually sending a proxied packet.  Do that now.
 	 */
@@ -3008,10 +3764,10 @@ static int request_proxy(REQUEST *request, int retransmit)
 
 	}
 
-	gettimeofday(&request->proxy_retransmit, NULL);
+	gettimeofday(&request->proxy_info->proxy_retransmit, NULL);
 	if (!retransmit) {
-		request->proxy->timestamp = request->proxy_retransmit;
-		request->home_server->last_packet_sent = request->proxy_retransmit.tv_sec;
+		request->proxy->timestamp = request->proxy_info->proxy_retransmit;
+		request->home_server->last_packet_sent = request->proxy_info->proxy_retransmit.tv_sec;
 	}
 
 	FR_STATS_TYPE_INC(request->home_server->stats.total_requests);
@@ -3086,7 +3842,7 @@ static int request_proxy_anew(REQUEST *request)
 			struct timeval now;
 
 			gettimeofday(&now, NULL);
-			vp->vp_integer += now.tv_sec - request->proxy_retransmit.tv_sec;
+			vp->vp_integer += now.tv_sec - request->proxy_info->proxy_retransmit.tv_sec;
 		}
 	}
 #endif
@@ -3096,6 +3852,165 @@ static int request_proxy_anew(REQUEST *request)
 	return 1;
 }
 
+/*
+ *	Status checks for all of the home servers share one timer.
+ *	Each home server sends its checks at a fixed point in its
+ *	ping_interval, and the timer sends every check which is due
+ *	in one batch.
+ */
+#define PING_BATCH_USEC (USEC / 20)
+
+static fr_heap_t	*ping_heap = NULL;
+static fr_event_t	*ping_ev = NULL;
+static struct timeval	ping_ev_when;
+static uint32_t		ping_slots = 0;
+
+static void ping_home_server(void *ctx);
+
+static uint64_t ping_key(void const *data)
+{
+	home_server_t const *home = data;
+
+	return ((uint64_t) home->ping_when.tv_sec * USEC) + home->ping_when.tv_usec;
+}
+
+static void ping_batch(UNUSED void *ctx)
+{
+	home_server_t *home;
+	struct timeval now;
+	int sent = 0;
+
+	gettimeofday(&now, NULL);
+
+	while ((home = fr_heap_peek(ping_heap)) != NULL) {
+		if (timercmp(&home->ping_when, &now, >)) break;
+
+		fr_heap_extract(ping_heap, home);
+		home->ping_queued = false;
+
+		ping_home_server(home);
+		sent++;
+	}
+
+	DEBUG3("PING: Sent %d status checks in this batch", sent);
+
+	/*
+	 *	Wake up for the next batch.  The time is rounded up,
+	 *	so that checks which are due close together are sent
+	 *	together.
+	 */
+	home = fr_heap_peek(ping_heap);
+	if (!home) return;
+
+	ping_ev_when = home->ping_when;
+	ping_ev_when.tv_usec = ((ping_ev_when.tv_usec + PING_BATCH_USEC - 1) / PING_BATCH_USEC) * PING_BATCH_USEC;
+	if (ping_ev_when.tv_usec >= USEC) {
+		ping_ev_when.tv_sec++;
+		ping_ev_when.tv_usec -= USEC;
+	}
+
+	if (!fr_event_insert(el, ping_batch, NULL, &ping_ev_when, &ping_ev)) {
+		_rad_panic(__FILE__, __LINE__, "Failed to insert event");
+	}
+}
+
+/*
+ *	Schedule the next status check for a home server.
+ */
+static void ping_queue(home_server_t *home, struct timeval const *now)
+{
+	uint64_t interval, usec, due;
+
+	if (!ping_heap) {
+		ping_heap = fr_heap_create_keyed(ping_key, offsetof(home_server_t, ping_heap));
+		if (!ping_heap) _rad_panic(__FILE__, __LINE__, "Failed creating status check schedule");
+
+		/*
+		 *	So that other servers with the same home
+		 *	servers don't check them at the same times.
+		 */
+		ping_slots = fr_rand();
+	}
+
+	/*
+	 *	Home servers are placed a golden ratio of the interval
+	 *	apart, which spreads them evenly no matter how many
+	 *	there are.  That also does what the RFC 3539 jitter
+	 *	did, and stops the checks from lining up.
+	 */
+	if (!home->ping_slot) {
+		ping_slots += 2654435769U;
+		home->ping_slot = ping_slots ? ping_slots : 1;
+	}
+
+	interval = (uint64_t) home->ping_interval * USEC;
+	usec = ((uint64_t) now->tv_sec * USEC) + now->tv_usec;
+
+	due = usec - (usec % interval) + ((interval * home->ping_slot) >> 32);
+	while (due < (usec + (interval / 2))) due += interval;
+
+	home->ping_when.tv_sec = due / USEC;
+	home->ping_when.tv_usec = due % USEC;
+
+	if (!fr_heap_insert(ping_heap, home)) {
+		_rad_panic(__FILE__, __LINE__, "Failed inserting status check");
+	}
+	home->ping_queued = true;
+
+	DEBUG("PING: Next status packet in %u.%06u seconds",
+	      (unsigned int) ((due - usec) / USEC), (unsigned int) ((due - usec) % USEC));
+
+	/*
+	 *	Only wake up earlier than we already will.
+	 */
+	if (ping_ev && !timercmp(&home->ping_when, &ping_ev_when, <)) return;
+
+	ping_ev_when = home->ping_when;
+	if (!fr_event_insert(el, ping_batch, NULL, &ping_ev_when, &ping_ev)) {
+		_rad_panic(__FILE__, __LINE__, "Failed inserting event");
+	}
+}
+
+/*
+ *	Stop any status checks, or revive timer, for a home server.
+ */
+static void ping_cancel(home_server_t *home)
+{
+	fr_event_delete(el, &home->ev);
+
+	if (!home->ping_queued) return;
+
+	fr_heap_extract(ping_heap, home);
+	home->ping_queued = false;
+}
+
+/*
+ *	Fill in a Status-Server from the home server's template, with
+ *	a new Id, authentication vector and Message-Authenticator.
+ *	The first check encodes the template.
+ */
+static int ping_template(home_server_t *home, REQUEST *request)
+{
+	RADIUS_PACKET *packet = request->proxy;
+
+	if (!home->ping_data) {
+		if (rad_encode(packet, NULL, home->secret) < 0) return -1;
+
+		home->ping_data = talloc_memdup(home, packet->data, packet->data_len);
+		home->ping_data_len = packet->data_len;
+		home->ping_offset = packet->offset;
+	} else {
+		packet->data = talloc_memdup(packet, home->ping_data, home->ping_data_len);
+		packet->data_len = home->ping_data_len;
+		packet->offset = home->ping_offset;
+	}
+
+	packet->data[1] = packet->id;
+	memcpy(packet->data + 4, packet->vector, AUTH_VECTOR_LEN);
+
+	return rad_sign(packet, NULL, home->secret);
+}
+
 STATE_MACHINE_DECL(request_ping)
 {
 	home_server_t *home = request->home_server;
@@ -3148,6 +4063,11 @@ STATE_MACHINE_DECL(request_ping)
 			return;
 		}
 
+		/*
+		 *	BFD says it's down, which trumps Status-Server.
+		 */
+		if (home->bfd && !home->bfd_up) return;
+
 		/*
 		 *	Mark it alive and delete any outstanding
 		 *	pings.
@@ -3160,7 +4080,8 @@ STATE_MACHINE_DECL(request_ping)
 		home->num_received_pings = 0;
 		gettimeofday(&home->revive_time, NULL);
 
-		fr_event_delete(el, &home->ev);
+		ping_cancel(home);
+		cluster_send(home);
 
 		RPROXY("Marking home server %s port %d alive",
 		       inet_ntop(request->proxy->dst_ipaddr.af,
@@ -3194,7 +4115,7 @@ static void ping_home_server(void *ctx)
 #ifdef WITH_TCP
 	    (home->proto == IPPROTO_TCP) ||
 #endif
-	    (home->ev != NULL)) {
+	    (home->ev != NULL) || home->ping_queued) {
 		return;
 	}
 
@@ -3243,8 +4164,16 @@ static void ping_home_server(void *ctx)
 	if (home->ping_check == HOME_PING_CHECK_STATUS_SERVER) {
 		request->proxy->code = PW_CODE_STATUS_SERVER;
 
-		pairmake(request->proxy, &request->proxy->vps,
-			 "Message-Authenticator", "0x00", T_OP_SET);
+		/*
+		 *	Only the first check needs the attributes.
+		 *	Later ones are copied from the template.
+		 */
+		if (!home->ping_data) {
+			pairmake(request->proxy, &request->proxy->vps,
+				 "Message-Authenticator", "0x00", T_OP_SET);
+			pairmake(request->proxy, &request->proxy->vps,
+				 "NAS-Identifier", "Status Check.  Are you alive?", T_OP_SET);
+		}
 
 	} else if (home->type == HOME_TYPE_AUTH) {
 		request->proxy->code = PW_CODE_ACCESS_REQUEST;
@@ -3275,11 +4204,13 @@ static void ping_home_server(void *ctx)
 #endif
 	}
 
-	vp = pairmake(request->proxy, &request->proxy->vps,
-		      "NAS-Identifier", "", T_OP_SET);
-	if (vp) {
-		pairsprintf(vp, "Status Check %u. Are you alive?",
-			    home->num_sent_pings);
+	if (home->ping_check != HOME_PING_CHECK_STATUS_SERVER) {
+		vp = pairmake(request->proxy, &request->proxy->vps,
+			      "NAS-Identifier", "", T_OP_SET);
+		if (vp) {
+			pairsprintf(vp, "Status Check %u. Are you alive?",
+				    home->num_sent_pings);
+		}
 	}
 
 	request->proxy->src_ipaddr = home->src_ipaddr;
@@ -3298,47 +4229,155 @@ static void ping_home_server(void *ctx)
 	request->child_state = REQUEST_DONE;
 	request->process = request_ping;
 
-	rad_assert(request->proxy_listener == NULL);
+	rad_assert(request->proxy_listener == NULL);
+
+	if (!insert_into_proxy_hash(request)) {
+		RPROXY("Failed to insert status check %d into proxy list.  Discarding it.",
+		       request->number);
+
+		rad_assert(!request->in_request_hash);
+		rad_assert(!request->in_proxy_hash);
+		rad_assert(request->ev == NULL);
+		talloc_free(request);
+		return;
+	}
+
+	/*
+	 *	Set up the timer callback.
+	 */
+	when = now;
+	when.tv_sec += home->ping_timeout;
+
+	DEBUG("PING: Waiting %u seconds for response to ping",
+	      home->ping_timeout);
+
+	STATE_MACHINE_TIMER(FR_ACTION_TIMER);
+	home->num_sent_pings++;
+
+	rad_assert(request->proxy_listener != NULL);
+
+	if ((home->ping_check == HOME_PING_CHECK_STATUS_SERVER) &&
+	    (ping_template(home, request) < 0)) {
+		RPROXY("Failed encoding status check: %s", fr_strerror());
+	} else {
+		request->proxy_listener->send(request->proxy_listener,
+					      request);
+	}
+
+	ping_queue(home, &now);
+}
+
+#ifdef WITH_TCP
+/*
+ *	A keepalive was answered, or timed out.
+ */
+STATE_MACHINE_DECL(request_keepalive)
+{
+	rad_listen_t *listener;
+	char buffer[256];
+
+	VERIFY_REQUEST(request);
+
+	TRACE_STATE_MACHINE;
+	ASSERT_MASTER;
+
+	switch (action) {
+	case FR_ACTION_TIMER:
+		/*
+		 *	The connection, or the home server, is stuck.
+		 *	Stop using the connection.  If that takes us
+		 *	below "min_connections", a new one is opened.
+		 */
+		listener = request->proxy_listener;
+		request_done(request, FR_ACTION_DONE);
+
+		if (listener && (listener->status == RAD_LISTEN_STATUS_KNOWN)) {
+			listener->print(listener, buffer, sizeof(buffer));
+			ERROR("No response to keepalive on socket %s.  Closing it", buffer);
+			listener->status = RAD_LISTEN_STATUS_EOL;
+			event_new_fd(listener);
+		}
+		return;
+
+	case FR_ACTION_PROXY_REPLY:
+		rad_assert(request->in_proxy_hash);
+
+		RDEBUG3("Received response to keepalive %d", request->number);
+		fr_event_delete(el, &request->ev);
+		remove_from_proxy_hash(request);
+		break;
+
+	default:
+		RDEBUG3("%s: Ignoring action %s", __FUNCTION__, action_codes[action]);
+		break;
+	}
+
+	rad_assert(!request->in_request_hash);
+	rad_assert(request->ev == NULL);
+	request_done(request, FR_ACTION_DONE);
+}
+
+/*
+ *	Send Status-Server on one connection to a TCP home server.
+ *
+ *	Connections with requests outstanding are left alone, as
+ *	those requests have their own timers.
+ */
+static void proxy_keepalive(rad_listen_t *listener)
+{
+	listen_socket_t *sock = listener->data;
+	home_server_t *home = sock->home;
+	REQUEST *request;
+	struct timeval when;
+
+	if ((listener->status != RAD_LISTEN_STATUS_KNOWN) || (listener->count > 0)) return;
+
+	request = request_alloc(NULL);
+	request->number = request_num_counter++;
+	NO_CHILD_THREAD;
+
+	request->proxy = rad_alloc(request, true);
+	rad_assert(request->proxy != NULL);
+
+	request->proxy->code = PW_CODE_STATUS_SERVER;
+	pairmake(request->proxy, &request->proxy->vps,
+		 "Message-Authenticator", "0x00", T_OP_SET);
+
+	/*
+	 *	The source port picks the connection.
+	 */
+	request->proxy->src_ipaddr = sock->my_ipaddr;
+	request->proxy->src_port = sock->my_port;
+	request->proxy->dst_ipaddr = home->ipaddr;
+	request->proxy->dst_port = home->port;
+	request->home_server = home;
+	request->child_state = REQUEST_DONE;
+	request->process = request_keepalive;
 
 	if (!insert_into_proxy_hash(request)) {
-		RPROXY("Failed to insert status check %d into proxy list.  Discarding it.",
+		RPROXY("Failed to insert keepalive %d into proxy list.  Discarding it.",
 		       request->number);
-
-		rad_assert(!request->in_request_hash);
-		rad_assert(!request->in_proxy_hash);
-		rad_assert(request->ev == NULL);
 		talloc_free(request);
 		return;
 	}
 
 	/*
-	 *	Set up the timer callback.
+	 *	It went out on another connection.  That's no use.
 	 */
-	when = now;
-	when.tv_sec += home->ping_timeout;
-
-	DEBUG("PING: Waiting %u seconds for response to ping",
-	      home->ping_timeout);
+	if (request->proxy_listener != listener) {
+		remove_from_proxy_hash(request);
+		talloc_free(request);
+		return;
+	}
 
+	gettimeofday(&when, NULL);
+	when.tv_sec += home->ping_timeout;
 	STATE_MACHINE_TIMER(FR_ACTION_TIMER);
-	home->num_sent_pings++;
-
-	rad_assert(request->proxy_listener != NULL);
-	request->proxy_listener->send(request->proxy_listener,
-				      request);
 
-	/*
-	 *	Add +/- 2s of jitter, as suggested in RFC 3539
-	 *	and in the Issues and Fixes draft.
-	 */
-	home->when = now;
-	home->when.tv_sec += home->ping_interval;
-
-	add_jitter(&home->when);
-
-	DEBUG("PING: Next status packet in %u seconds", home->ping_interval);
-	INSERT_EVENT(ping_home_server, home);
+	RDEBUG3("Sending keepalive %d", request->number);
+	listener->send(listener, request);
 }
+#endif	/* WITH_TCP */
 
 static void home_trigger(home_server_t *home, char const *trigger)
 {
@@ -3398,7 +4437,7 @@ static void mark_home_server_zombie(home_server_t *home, struct timeval *now, st
 	home->zombie_period_start.tv_sec = start;
 	home->zombie_period_start.tv_usec = USEC / 2;
 
-	fr_event_delete(el, &home->ev);
+	ping_cancel(home);
 	home->num_sent_pings = 0;
 	home->num_received_pings = 0;
 
@@ -3407,6 +4446,7 @@ static void mark_home_server_zombie(home_server_t *home, struct timeval *now, st
 			 buffer, sizeof(buffer)),
 	       home->port, (int) response_window->tv_sec, (int) response_window->tv_usec);
 
+	cluster_send(home);
 	ping_home_server(home);
 }
 
@@ -3429,12 +4469,14 @@ void revive_home_server(void *ctx)
 	/*
 	 *	Delete any outstanding events.
 	 */
-	if (home->ev) fr_event_delete(el, &home->ev);
+	ping_cancel(home);
 
 	PROXY( "Marking home server %s port %d alive again... we have no idea if it really is alive or not.",
 	       inet_ntop(home->ipaddr.af, &home->ipaddr.ipaddr,
 			 buffer, sizeof(buffer)),
 	       home->port);
+
+	cluster_send(home);
 }
 
 void mark_home_server_dead(home_server_t *home, struct timeval *when)
@@ -3456,6 +4498,15 @@ void mark_home_server_dead(home_server_t *home, struct timeval *when)
 
 	home->state = HOME_STATE_IS_DEAD;
 	home_trigger(home, "home_server.dead");
+	cluster_send(home);
+
+	/*
+	 *	The BFD session will tell us when it's alive again.
+	 */
+	if (home->bfd) {
+		ping_cancel(home);
+		return;
+	}
 
 	if (home->ping_check != HOME_PING_CHECK_NONE) {
 		/*
@@ -3484,6 +4535,116 @@ void mark_home_server_dead(home_server_t *home, struct timeval *when)
 	}
 }
 
+/** Record a state change from the BFD session to a home server
+ *
+ * Called from the BFD thread.  The main thread applies the change
+ * in home_server_bfd_cb().
+ */
+void home_server_bfd_update(home_server_t *home, bool up)
+{
+	if (!home->bfd) return;
+
+	__atomic_store_n(&home->bfd_up, up, __ATOMIC_RELAXED);
+	__atomic_store_n(&home->bfd_changed, true, __ATOMIC_RELEASE);
+
+	radius_signal_self(RADIUS_SIGNAL_SELF_BFD);
+}
+
+static int home_server_bfd_cb(UNUSED void *ctx, void *data)
+{
+	home_server_t *home = data;
+	struct timeval now;
+
+	if (!__atomic_exchange_n(&home->bfd_changed, false, __ATOMIC_ACQUIRE)) return 0;
+
+#ifdef WITH_TCP
+	if (home->proto == IPPROTO_TCP) return 0;
+#endif
+
+	if (__atomic_load_n(&home->bfd_up, __ATOMIC_RELAXED)) {
+		if ((home->state != HOME_STATE_ZOMBIE) &&
+		    (home->state != HOME_STATE_IS_DEAD)) return 0;
+
+		PROXY("BFD reports home server %s as up", home->name);
+		revive_home_server(home);
+		return 0;
+	}
+
+	if (home->state == HOME_STATE_IS_DEAD) return 0;
+
+	PROXY("BFD reports home server %s as down", home->name);
+	gettimeofday(&now, NULL);
+	mark_home_server_dead(home, &now);
+
+	return 0;
+}
+
+/*
+ *	Another proxy in the cluster says that a home server has
+ *	changed state.  Our own recent replies from the home server
+ *	count for more than what the other proxy says.
+ */
+static void home_server_peer_update(home_server_t *home, int state, uint32_t latency)
+{
+	struct timeval now;
+
+	ASSERT_MASTER;
+
+	if (latency) {
+		if (!home->latency) {
+			home->latency = latency;
+		} else {
+			home->latency += ((int64_t) latency - (int64_t) home->latency) / 8;
+		}
+	}
+
+#ifdef WITH_TCP
+	if (home->proto == IPPROTO_TCP) return;
+#endif
+
+	gettimeofday(&now, NULL);
+
+	switch (state) {
+	case CLUSTER_STATE_ZOMBIE:
+		if ((home->state != HOME_STATE_ALIVE) &&
+		    (home->state != HOME_STATE_UNKNOWN)) return;
+
+		PROXY("Cluster peer reports home server %s as zombie", home->name);
+		mark_home_server_zombie(home, &now, &home->response_window);
+		break;
+
+	case CLUSTER_STATE_DEAD:
+		if (home->state == HOME_STATE_IS_DEAD) return;
+
+		if (home->last_packet_recv >= (now.tv_sec - ((home->zombie_period + 3) / 4))) {
+			DEBUG("Cluster peer reports home server %s as dead, but it replied to us %d seconds ago",
+			      home->name, (int) (now.tv_sec - home->last_packet_recv));
+			return;
+		}
+
+		PROXY("Cluster peer reports home server %s as dead", home->name);
+		mark_home_server_dead(home, &now);
+
+		/*
+		 *	mark_home_server_dead() only starts pinging
+		 *	servers which were alive.
+		 */
+		if ((home->ping_check != HOME_PING_CHECK_NONE) && !home->ev && !home->ping_queued) ping_home_server(home);
+		break;
+
+	case CLUSTER_STATE_ALIVE:
+		if ((home->state != HOME_STATE_ZOMBIE) &&
+		    (home->state != HOME_STATE_IS_DEAD)) return;
+
+		PROXY("Cluster peer reports home server %s as alive", home->name);
+		revive_home_server(home);
+		break;
+
+	default:
+		break;
+	}
+}
+
 STATE_MACHINE_DECL(proxy_wait_for_reply)
 {
 	struct timeval now, when;
@@ -3541,7 +4702,7 @@ STATE_MACHINE_DECL(proxy_wait_for_reply)
 		 *	More than one retransmit a second is stupid,
 		 *	and should be suppressed by the proxy.
 		 */
-		when = request->proxy_retransmit;
+		when = request->proxy_info->proxy_retransmit;
 		when.tv_sec++;
 
 		if (timercmp(&now, &when, <)) {
@@ -3572,12 +4733,12 @@ STATE_MACHINE_DECL(proxy_wait_for_reply)
 				  buffer, sizeof(buffer)),
 			request->proxy->dst_port,
 			request->proxy->id);
-		request->num_proxied_requests++;
+		request->proxy_info->num_proxied_requests++;
 
 		rad_assert(request->proxy_listener != NULL);;
 		FR_STATS_TYPE_INC(home->stats.total_requests);
 		home->last_packet_sent = now.tv_sec;
-		request->proxy_retransmit = now;
+		request->proxy_info->proxy_retransmit = now;
 		request->proxy_listener->send(request->proxy_listener, request);
 		debug_packet(request, request->proxy, false);
 		break;
@@ -3652,6 +4813,8 @@ STATE_MACHINE_DECL(proxy_wait_for_reply)
 				mark_home_server_zombie(home, &now, response_window);
 		}
 
+		home_server_backoff(home);
+
 		FR_STATS_TYPE_INC(home->stats.total_timeouts);
 		if (home->type == HOME_TYPE_AUTH) {
 			if (request->proxy_listener) FR_STATS_TYPE_INC(request->proxy_listener->stats.total_timeouts);
@@ -3691,6 +4854,8 @@ STATE_MACHINE_DECL(proxy_wait_for_reply)
 			       request->proxy->dst_port);
 		}
 
+		if (request->trace) trace_proxy(request, NULL);
+
 		if (!setup_post_proxy_fail(request)) {
 			gettimeofday(&request->reply->timestamp, NULL);
 			request_cleanup_delay_init(request, NULL);
@@ -3721,6 +4886,68 @@ STATE_MACHINE_DECL(proxy_wait_for_reply)
 		break;
 	}
 }
+
+/*
+ *	Waiting for the reply to another request's proxied packet.
+ *	We didn't send anything, so there's nothing to retransmit,
+ *	and a timeout says nothing about the home server.
+ */
+STATE_MACHINE_DECL(proxy_coalesced)
+{
+	struct timeval now, when;
+
+	VERIFY_REQUEST(request);
+
+	TRACE_STATE_MACHINE;
+
+	if (request->master_state == REQUEST_STOP_PROCESSING) {
+		request_done(request, FR_ACTION_DONE);
+		return;
+	}
+
+	switch (action) {
+	case FR_ACTION_DUP:
+		RDEBUG2("Ignoring duplicate, still waiting for the reply to an identical proxied request");
+		break;
+
+	case FR_ACTION_TIMER:
+		gettimeofday(&now, NULL);
+
+		when = request->proxy->timestamp;
+		timeradd(&when, request_response_window(request), &when);
+
+		if (timercmp(&when, &now, >)) {
+			STATE_MACHINE_TIMER(FR_ACTION_TIMER);
+			return;
+		}
+
+		RERROR("Failing coalesced proxied request, due to lack of any response from home server %s",
+		       request->home_server->name);
+
+		proxy_coalesce_leave(request);
+
+		if (!setup_post_proxy_fail(request)) {
+			gettimeofday(&request->reply->timestamp, NULL);
+			request_cleanup_delay_init(request, NULL);
+			return;
+		}
+
+		request_queue_or_run(request, proxy_no_reply);
+		break;
+
+	case FR_ACTION_PROXY_REPLY:
+		request_queue_or_run(request, proxy_running);
+		break;
+
+	case FR_ACTION_CONFLICTING:
+		request_done(request, action);
+		return;
+
+	default:
+		RDEBUG3("%s: Ignoring action %s", __FUNCTION__, action_codes[action]);
+		break;
+	}
+}
 #endif	/* WITH_PROXY */
 
 /***********************************************************************
@@ -3864,7 +5091,6 @@ static void request_coa_originate(REQUEST *request)
 	coa->reply = rad_copy_packet(coa, request->reply);
 
 	coa->config_items = paircopy(coa, request->config_items);
-	coa->num_coa_requests = 0;
 	coa->handle = null_handler;
 	coa->number = request->number; /* it's associated with the same request */
 
@@ -3997,7 +5223,7 @@ static void coa_timer(REQUEST *request)
 	 *	Cap count at MRC, if it is non-zero.
 	 */
 	if (request->home_server->coa_mrc &&
-	    (request->num_coa_requests >= request->home_server->coa_mrc)) {
+	    (request->proxy_info->num_coa_requests >= request->home_server->coa_mrc)) {
 		char buffer[128];
 
 		RERROR("Failing request - originate-coa ID %u, due to lack of any response from coa server %s port %d",
@@ -4062,7 +5288,7 @@ static void coa_timer(REQUEST *request)
 	}
 	STATE_MACHINE_TIMER(FR_ACTION_TIMER);
 
-	request->num_coa_requests++; /* is NOT reset by code 3 lines above! */
+	request->proxy_info->num_coa_requests++; /* is NOT reset by code 3 lines above! */
 
 	FR_STATS_TYPE_INC(request->home_server->stats.total_requests);
 
@@ -4231,6 +5457,33 @@ static void event_socket_handler(UNUSED fr_event_list_t *xel, UNUSED int fd, voi
 	listener->recv(listener);
 }
 
+#ifdef WITH_PROXY
+static fr_event_t *cluster_ev = NULL;
+
+static void cluster_socket_handler(UNUSED fr_event_list_t *xel, UNUSED int fd, UNUSED void *ctx)
+{
+	cluster_recv(home_server_peer_update);
+}
+
+/*
+ *	Periodically share the latency of the home servers with the
+ *	rest of the cluster.
+ */
+static void cluster_timer(UNUSED void *ctx)
+{
+	struct timeval when;
+
+	cluster_send_all();
+
+	gettimeofday(&when, NULL);
+	when.tv_sec += cluster_interval();
+
+	if (!fr_event_insert(el, cluster_timer, NULL, &when, &cluster_ev)) {
+		ERROR("Failed inserting cluster timer");
+	}
+}
+#endif
+
 #ifdef WITH_DETAIL
 #ifdef WITH_DETAIL_THREAD
 #else
@@ -4440,6 +5693,16 @@ static int event_new_fd(rad_listen_t *this)
 #endif
 #endif	/* WITH_DETAIL */
 
+#ifdef WITH_METRICS
+		/*
+		 *	The exporter has its own thread, and its
+		 *	socket isn't put into the event loop.
+		 */
+		case RAD_LISTEN_METRICS:
+			this->status = RAD_LISTEN_STATUS_KNOWN;
+			return 1;
+#endif
+
 #ifdef WITH_PROXY
 		/*
 		 *	Add it to the list of sockets we can use.
@@ -4454,7 +5717,8 @@ static int event_new_fd(rad_listen_t *this)
 			 *	Add timers to outgoing child sockets, if necessary.
 			 */
 			if (sock->proto == IPPROTO_TCP && sock->opened &&
-			    (sock->home->limit.lifetime || sock->home->limit.idle_timeout)) {
+			    (sock->home->limit.lifetime || sock->home->limit.idle_timeout ||
+			     sock->home->limit.keepalive)) {
 				struct timeval when;
 
 				when.tv_sec = sock->opened + 1;
@@ -4526,15 +5790,34 @@ static int event_new_fd(rad_listen_t *this)
 		 *	previously sent.
 		 */
 		if (this->type == RAD_LISTEN_PROXY) {
-			PTHREAD_MUTEX_LOCK(&proxy_mutex);
-			if (!fr_packet_list_socket_freeze(proxy_list,
-							  this->fd)) {
-				ERROR("Fatal error freezing socket: %s", fr_strerror());
-				fr_exit(1);
+			int i;
+			home_server_t *home = ((listen_socket_t *) this->data)->home;
+
+			for (i = 0; i < PROXY_SHARDS; i++) {
+				PTHREAD_MUTEX_LOCK(&proxy_shards[i].mutex);
+				if (!fr_packet_list_socket_freeze(proxy_shards[i].list,
+								  this->fd)) {
+					ERROR("Fatal error freezing socket: %s", fr_strerror());
+					fr_exit(1);
+				}
+
+				fr_packet_list_walk(proxy_shards[i].list, this, proxy_eol_cb);
+				PTHREAD_MUTEX_UNLOCK(&proxy_shards[i].mutex);
 			}
 
-			fr_packet_list_walk(proxy_list, this, proxy_eol_cb);
-			PTHREAD_MUTEX_UNLOCK(&proxy_mutex);
+			/*
+			 *	Replace connections which are needed
+			 *	for "min_connections".  This one is
+			 *	still counted until it's freed.
+			 */
+			if (home && home->limit.min_connections &&
+			    (home->limit.num_connections <= home->limit.min_connections)) {
+				PTHREAD_MUTEX_LOCK(&proxy_count_mutex);
+				home->open_socket = true;
+				PTHREAD_MUTEX_UNLOCK(&proxy_count_mutex);
+
+				radius_signal_self(RADIUS_SIGNAL_SELF_PROXY);
+			}
 		}
 #endif
 
@@ -4618,6 +5901,7 @@ static int event_new_fd(rad_listen_t *this)
 		 *	list of outgoing sockets.
 		 */
 		if (this->type == RAD_LISTEN_PROXY) {
+			int i;
 			home_server_t *home;
 
 			home = sock->home;
@@ -4628,15 +5912,17 @@ static int event_new_fd(rad_listen_t *this)
 				     home->limit.num_connections, home->limit.max_connections);
 			}
 
-			PTHREAD_MUTEX_LOCK(&proxy_mutex);
-			fr_packet_list_walk(proxy_list, this, eol_proxy_listener);
+			for (i = 0; i < PROXY_SHARDS; i++) {
+				PTHREAD_MUTEX_LOCK(&proxy_shards[i].mutex);
+				fr_packet_list_walk(proxy_shards[i].list, this, eol_proxy_listener);
 
-			if (!fr_packet_list_socket_del(proxy_list, this->fd)) {
-				ERROR("Fatal error removing socket %s: %s",
-				      buffer, fr_strerror());
-				fr_exit(1);
+				if (!fr_packet_list_socket_del(proxy_shards[i].list, this->fd)) {
+					ERROR("Fatal error removing socket %s: %s",
+					      buffer, fr_strerror());
+					fr_exit(1);
+				}
+				PTHREAD_MUTEX_UNLOCK(&proxy_shards[i].mutex);
 			}
-			PTHREAD_MUTEX_UNLOCK(&proxy_mutex);
 		} else
 #endif
 		{
@@ -4645,7 +5931,7 @@ static int event_new_fd(rad_listen_t *this)
 			/*
 			 *	EOL all requests using this socket.
 			 */
-			rbtree_walk(pl, RBTREE_DELETE_ORDER, eol_listener, this);
+			request_list_walk(eol_listener, this);
 		}
 
 		/*
@@ -4744,6 +6030,25 @@ static void handle_signal_self(int flag)
 #endif
 #endif
 
+#if defined(WITH_TLS) && defined(HAVE_PTHREAD_H)
+	/*
+	 *	The TLS I/O threads have decoded some packets.
+	 */
+	if ((flag & RADIUS_SIGNAL_SELF_TLS) != 0) tls_io_process_done();
+#endif
+
+#ifdef WITH_PROXY
+	/*
+	 *	Some home servers are running low on IDs.
+	 */
+	if ((flag & RADIUS_SIGNAL_SELF_PROXY) != 0) home_server_walk(proxy_open_socket_cb, NULL);
+
+	/*
+	 *	BFD sessions to some home servers have changed state.
+	 */
+	if ((flag & RADIUS_SIGNAL_SELF_BFD) != 0) home_server_walk(home_server_bfd_cb, NULL);
+#endif
+
 #ifdef WITH_TCP
 #ifdef WITH_PROXY
 #ifdef HAVE_PTHREAD_H
@@ -4848,14 +6153,6 @@ int radius_event_init(TALLOC_CTX *ctx) {
 	return 1;
 }
 
-static int packet_entry_cmp(void const *one, void const *two)
-{
-	RADIUS_PACKET const * const *a = one;
-	RADIUS_PACKET const * const *b = two;
-
-	return fr_packet_cmp(*a, *b);
-}
-
 
 int radius_event_start(CONF_SECTION *cs, bool have_children)
 {
@@ -4871,29 +6168,62 @@ int radius_event_start(CONF_SECTION *cs, bool have_children)
 		 */
 		rad_assert(el);
 
-		pl = rbtree_create(NULL, packet_entry_cmp, NULL, 0);
-		if (!pl) return 0;	/* leak el */
+		fr_clock_coarse(main_config.coarse_clock);
+
+		if (main_config.timer_wheel && (fr_event_list_wheel(el) < 0)) {
+			ERROR("Failed creating timer wheel: %s", fr_strerror());
+			return 0;
+		}
+
+		if (request_list_create() < 0) return 0;	/* leak el */
 	}
 
 	request_num_counter = 0;
 
 #ifdef WITH_PROXY
 	if (main_config.proxy_requests && !check_config) {
+		int i;
+
 		/*
-		 *	Create the tree for managing proxied requests and
+		 *	Create the trees for managing proxied requests and
 		 *	responses.
 		 */
-		proxy_list = fr_packet_list_create(1);
-		if (!proxy_list) return 0;
+		for (i = 0; i < PROXY_SHARDS; i++) {
+			proxy_shards[i].list = fr_packet_list_create(1);
+			if (!proxy_shards[i].list) return 0;
+
+			if (!fr_packet_list_id_range(proxy_shards[i].list, i, PROXY_SHARDS)) {
+				ERROR("FATAL: Failed to initialize proxy list: %s",
+				      fr_strerror());
+				fr_exit(1);
+			}
+
+#ifdef HAVE_PTHREAD_H
+			if (pthread_mutex_init(&proxy_shards[i].mutex, NULL) != 0) {
+				ERROR("FATAL: Failed to initialize proxy mutex: %s",
+				       fr_syserror(errno));
+				fr_exit(1);
+			}
+#endif
+		}
 
 #ifdef HAVE_PTHREAD_H
-		if (pthread_mutex_init(&proxy_mutex, NULL) != 0) {
+		if (pthread_mutex_init(&proxy_count_mutex, NULL) != 0) {
+			ERROR("FATAL: Failed to initialize proxy mutex: %s",
+			       fr_syserror(errno));
+			fr_exit(1);
+		}
+
+		if (pthread_mutex_init(&proxy_coalesce_mutex, NULL) != 0) {
 			ERROR("FATAL: Failed to initialize proxy mutex: %s",
 			       fr_syserror(errno));
 			fr_exit(1);
 		}
 #endif
 
+		proxy_coalesce_table = fr_hash_table_create(proxy_coalesce_hash, proxy_coalesce_cmp, proxy_coalesce_free);
+		if (!proxy_coalesce_table) return 0;
+
 		/*
 		 *	The "init_delay" is set to "response_window".
 		 *	Reset it to half of "response_window" in order
@@ -4904,6 +6234,23 @@ int radius_event_start(CONF_SECTION *cs, bool have_children)
 		main_config.init_delay.tv_usec >>= 1;
 		main_config.init_delay.tv_sec >>= 1;
 
+		/*
+		 *	Share home server state with the other
+		 *	proxies in the cluster.
+		 */
+		if (cluster_interval()) {
+			int fd;
+
+			fd = cluster_start();
+			if (fd < 0) fr_exit(1);
+
+			if (!fr_event_fd_insert(el, 0, fd, cluster_socket_handler, el)) {
+				ERROR("Failed adding cluster socket to event loop: %s", fr_strerror());
+				fr_exit(1);
+			}
+
+			cluster_timer(NULL);
+		}
 	}
 #endif
 
@@ -4991,6 +6338,15 @@ int radius_event_start(CONF_SECTION *cs, bool have_children)
 	 */
 	fr_suid_down_permanent();
 
+#ifdef WITH_PROXY
+	/*
+	 *	Open the minimum number of sockets to each home
+	 *	server now, rather than when the first request
+	 *	arrives.
+	 */
+	if (main_config.proxy_requests) home_server_walk(proxy_prewarm_cb, NULL);
+#endif
+
 	return 1;
 }
 
@@ -5051,6 +6407,7 @@ static int request_delete_cb(UNUSED void *ctx, void *data)
 	rad_assert(request->in_proxy_hash == false);
 #endif
 
+	request_list_delete_nl(request);
 	request->in_request_hash = false;
 	if (request->ev) fr_event_delete(el, &request->ev);
 
@@ -5066,17 +6423,20 @@ static int request_delete_cb(UNUSED void *ctx, void *data)
 	}
 #endif
 
-	talloc_free(request);
+	trace_request_done(request);
+	request_capture_done(request);
+	request_pool_free(request);
 
-	/*
-	 *	Delete it from the list, and continue;
-	 */
-	return 2;
+	return 0;
 }
 
 
 void radius_event_free(void)
 {
+#ifdef WITH_PROXY
+	int i;
+#endif
+
 	ASSERT_MASTER;
 
 #ifdef WITH_PROXY
@@ -5084,12 +6444,14 @@ void radius_event_free(void)
 	 *	There are requests in the proxy hash that aren't
 	 *	referenced from anywhere else.  Remove them first.
 	 */
-	if (proxy_list) {
-		fr_packet_list_walk(proxy_list, NULL, proxy_delete_cb);
+	for (i = 0; i < PROXY_SHARDS; i++) {
+		if (!proxy_shards[i].list) continue;
+
+		fr_packet_list_walk(proxy_shards[i].list, NULL, proxy_delete_cb);
 	}
 #endif
 
-	rbtree_walk(pl, RBTREE_DELETE_ORDER,  request_delete_cb, NULL);
+	request_list_walk(request_delete_cb, NULL);
 
 	if (spawn_flag) {
 		/*
@@ -5108,29 +6470,35 @@ void radius_event_free(void)
 			int num;
 
 #ifdef WITH_PROXY
-			if (proxy_list) {
-				fr_packet_list_walk(proxy_list, NULL, proxy_delete_cb);
-				num = fr_packet_list_num_elements(proxy_list);
+			for (i = 0; i < PROXY_SHARDS; i++) {
+				if (!proxy_shards[i].list) continue;
+
+				fr_packet_list_walk(proxy_shards[i].list, NULL, proxy_delete_cb);
+				num = fr_packet_list_num_elements(proxy_shards[i].list);
 				if (num > 0) {
 					ERROR("Proxy list has %d requests still in it.", num);
 				}
 			}
 #endif
 
-			rbtree_walk(pl, RBTREE_DELETE_ORDER, NULL, request_delete_cb);
-			num = rbtree_num_elements(pl);
+			request_list_walk(request_delete_cb, NULL);
+			num = request_list_num_elements();
 			if (num > 0) {
 				ERROR("Request list has %d requests still in it.", num);
 			}
 		}
 	}
 
-	rbtree_free(pl);
-	pl = NULL;
+	request_list_free();
 
 #ifdef WITH_PROXY
-	fr_packet_list_free(proxy_list);
-	proxy_list = NULL;
+	for (i = 0; i < PROXY_SHARDS; i++) {
+		fr_packet_list_free(proxy_shards[i].list);
+		proxy_shards[i].list = NULL;
+	}
+
+	fr_hash_table_free(proxy_coalesce_table);
+	proxy_coalesce_table = NULL;
 #endif
 
 	TALLOC_FREE(el);
@@ -50,6 +50,9 @@ int            xlat_register(char const *module, RAD_XLAT_FUNC func, RADIUS_ESCA
 #include <sys/wait.h>
 pid_t rad_fork(void);
 pid_t rad_waitpid(pid_t pid, int *status);
+int thread_pool_wait_fd(int fd, struct timeval const *timeout);
+void thread_pool_yield_block(bool block);
+int module_yield(REQUEST *request, int fd, struct timeval const *timeout);
 
 pid_t rad_fork(void)
 {
@@ -61,6 +64,27 @@ pid_t rad_waitpid(pid_t pid, int *status)
 	return waitpid(pid, status, 0);
 }
 
+int thread_pool_wait_fd(int fd, struct timeval const *timeout)
+{
+	fd_set fds;
+	struct timeval wake;
+
+	FD_ZERO(&fds);
+	FD_SET(fd, &fds);
+	if (timeout) wake = *timeout;
+
+	return select(fd + 1, &fds, NULL, NULL, timeout ? &wake : NULL);
+}
+
+void thread_pool_yield_block(UNUSED bool block)
+{
+}
+
+int module_yield(UNUSED REQUEST *request, int fd, struct timeval const *timeout)
+{
+	return thread_pool_wait_fd(fd, timeout);
+}
+
 static ssize_t xlat_test(UNUSED void *instance, UNUSED REQUEST *request,
 			 UNUSED char const *fmt, UNUSED char *out, UNUSED size_t outlen)
 {
@@ -556,6 +580,145 @@ static void parse_xlat(char const *input, char *output, size_t outlen)
 	talloc_free(fmt);
 }
 
+typedef struct json_print {
+	char		*start;
+	char		*p;
+	char		*end;
+	bool		capture;		//!< The last key was "raw".
+} json_print_t;
+
+static void json_printf(json_print_t *jc, char const *fmt, ...) CC_HINT(format (printf, 2, 3));
+static void json_printf(json_print_t *jc, char const *fmt, ...)
+{
+	va_list ap;
+	size_t len;
+
+	if ((jc->p != jc->start) && (jc->p < (jc->end - 1))) *jc->p++ = ' ';
+
+	va_start(ap, fmt);
+	len = vsnprintf(jc->p, jc->end - jc->p, fmt, ap);
+	va_end(ap);
+
+	jc->p += (len < (size_t) (jc->end - jc->p)) ? len : (size_t) (jc->end - jc->p - 1);
+}
+
+/*
+ *	Print each event.  The value of a key called "skip" is skipped,
+ *	and a container which is the value of a key called "raw" is
+ *	captured.
+ */
+static fr_json_action_t json_print(void *uctx, fr_json_event_t event, UNUSED int depth,
+				   char const *value, size_t len)
+{
+	json_print_t *jc = uctx;
+	char buffer[1024];
+	bool capture = jc->capture;
+
+	jc->capture = false;
+
+	switch (event) {
+	case FR_JSON_OBJECT_START:
+	case FR_JSON_ARRAY_START:
+		if (capture) return FR_JSON_CAPTURE;
+		/* FALL-THROUGH */
+
+	case FR_JSON_OBJECT_END:
+	case FR_JSON_ARRAY_END:
+		json_printf(jc, "%c", "{}[]"[event]);
+		break;
+
+	case FR_JSON_KEY:
+		fr_print_string(value, len, buffer, sizeof(buffer), '"');
+		json_printf(jc, "\"%s\":", buffer);
+
+		if (strcmp(value, "skip") == 0) return FR_JSON_SKIP;
+		jc->capture = (strcmp(value, "raw") == 0);
+		break;
+
+	case FR_JSON_STRING:
+		fr_print_string(value, len, buffer, sizeof(buffer), '"');
+		json_printf(jc, "\"%s\"", buffer);
+		break;
+
+	case FR_JSON_RAW:
+		json_printf(jc, "raw(%.*s)", (int) len, value);
+		break;
+
+	default:
+		json_printf(jc, "%.*s", (int) len, value);
+		break;
+	}
+
+	return FR_JSON_CONTINUE;
+}
+
+static int json_parse_chunked(fr_json_parser_t *jp, char const *input, size_t chunk)
+{
+	size_t i, len = strlen(input);
+
+	fr_json_parser_reset(jp);
+
+	for (i = 0; i < len; i += chunk) {
+		if (fr_json_parse(jp, input + i, ((len - i) < chunk) ? (len - i) : chunk) < 0) return -1;
+	}
+
+	return fr_json_parse_end(jp);
+}
+
+/*
+ *	Parse the document in one piece, and then a byte at a time,
+ *	which has to give the same result.
+ */
+static void parse_json(char const *input, char *output, size_t outlen)
+{
+	fr_json_parser_t *jp;
+	json_print_t jc;
+	char *whole;
+	size_t chunk;
+	int ret;
+
+	jc.start = jc.p = output;
+	jc.end = output + outlen;
+	jc.capture = false;
+	*output = '\0';
+
+	jp = fr_json_parser_alloc(NULL, json_print, &jc);
+	if (!jp) {
+		snprintf(output, outlen, "ERROR Out of memory");
+		return;
+	}
+
+	whole = NULL;
+	for (chunk = strlen(input); chunk > 0; chunk = (chunk > 1) ? 1 : 0) {
+		jc.p = output;
+		*output = '\0';
+		jc.capture = false;
+
+		ret = json_parse_chunked(jp, input, chunk);
+		if (ret < 0) {
+			snprintf(output, outlen, "ERROR %s", fr_strerror());
+		} else if (ret == 0) {
+			snprintf(output, outlen, "empty");
+		}
+
+		if (!whole) {
+			whole = talloc_typed_strdup(jp, output);
+			continue;
+		}
+
+		if (strcmp(whole, output) != 0) {
+			char *bytes = talloc_typed_strdup(jp, output);
+
+			snprintf(output, outlen, "ERROR parsed a byte at a time: %s", bytes);
+			break;
+		}
+	}
+
+	if (!whole) snprintf(output, outlen, "empty");
+
+	talloc_free(jp);
+}
+
 static void process_file(const char *root_dir, char const *filename)
 {
 	int lineno;
@@ -805,6 +968,12 @@ static void process_file(const char *root_dir, char const *filename)
 			continue;
 		}
 
+		if (strncmp(p, "json ", 5) == 0) {
+			p += 5;
+			parse_json(p, output, sizeof(output));
+			continue;
+		}
+
 		fprintf(stderr, "Unknown input at line %d of %s\n",
 			lineno, directory);
 		exit(1);
@@ -26,6 +26,7 @@ RCSID("$Id$")
 
 #include <freeradius-devel/radclient.h>
 #include <freeradius-devel/conf.h>
+#include <freeradius-devel/md5.h>
 #include <ctype.h>
 
 #ifdef HAVE_GETOPT_H
@@ -34,6 +35,10 @@ RCSID("$Id$")
 
 #include <assert.h>
 
+#ifdef HAVE_PTHREAD_H
+#  include <pthread.h>
+#endif
+
 typedef struct REQUEST REQUEST;	/* to shut up warnings about mschap.h */
 
 #include "smbdes.h"
@@ -99,6 +104,13 @@ static void NEVER_RETURNS usage(void)
 	fprintf(stderr, "  -p <num>               Send 'num' packets from a file in parallel.\n");
 	fprintf(stderr, "  -q                     Do not print anything out.\n");
 	fprintf(stderr, "  -r <retries>           If timeout, retry sending the packet 'retries' times.\n");
+	fprintf(stderr, "  -R <rate>              Send 'rate' packets/s on a fixed schedule, without waiting for replies,\n");
+	fprintf(stderr, "                         then print the throughput and latency.\n");
+	fprintf(stderr, "  -L <seconds>           With -R, send for 'seconds' (defaults to 10).\n");
+	fprintf(stderr, "  -N <num>               With -R, send from 'num' sockets per thread (defaults to 1).\n");
+#ifdef HAVE_PTHREAD_H
+	fprintf(stderr, "  -T <num>               With -R, send from 'num' threads (defaults to 1).\n");
+#endif
 	fprintf(stderr, "  -s                     Print out summary information of auth results.\n");
 	fprintf(stderr, "  -S <file>              read secret from file, not command line.\n");
 	fprintf(stderr, "  -t <timeout>           Wait 'timeout' seconds before retrying (may be a floating point number).\n");
@@ -1107,6 +1119,629 @@ packet_done:
 	return 0;
 }
 
+/*
+ *	Open-loop ("rate") mode.
+ *
+ *	The normal send / receive loop waits for replies before
+ *	sending more packets, so it measures how fast the server
+ *	answers, rather than how the server behaves under a given
+ *	load.  In rate mode, each thread sends its share of the
+ *	packets on a fixed schedule, whether or not the server has
+ *	answered.  Packets are never retried.
+ *
+ *	Each thread has its own sockets, and each socket has 256 Ids.
+ *	If every Id is in use, the send is skipped and counted.
+ */
+typedef struct rc_rate_slot {
+	bool		used;
+	uint64_t	sent;				//!< When the request was sent (usec).
+	uint8_t		vector[AUTH_VECTOR_LEN];	//!< Request authenticator.
+} rc_rate_slot_t;
+
+typedef struct rc_rate_dynamic {
+	VALUE_PAIR	*vp;			//!< Attribute to re-write on each send.
+	char const	*fmt;			//!< Its value in the input file.
+} rc_rate_dynamic_t;
+
+typedef struct rc_rate_tmpl {
+	RADIUS_PACKET		*packet;	//!< The thread's copy of the request.
+	VALUE_PAIR		*chap;		//!< CHAP-Password to re-calculate on each send.
+	VALUE_PAIR		*cleartext;	//!< The password it is calculated from.
+	int			num_dynamic;
+	rc_rate_dynamic_t	*dynamic;
+} rc_rate_tmpl_t;
+
+typedef struct rc_rate_thread {
+	int			index;
+#ifdef HAVE_PTHREAD_H
+	pthread_t		pthread_id;
+#endif
+	TALLOC_CTX		*ctx;		//!< Everything the thread uses is allocated here.
+
+	int			*sockets;
+	rc_rate_slot_t		*slots;		//!< 256 per socket.
+	uint32_t		next_slot;
+	uint64_t		outstanding;
+
+	int			num_tmpl;
+	rc_rate_tmpl_t		*tmpl;
+
+	fr_randctx		rand;		//!< fr_rand() isn't thread safe.
+	rc_rate_stats_t		stats;
+} rc_rate_thread_t;
+
+#define USEC (1000000)
+#define RATE_HDR_LEN (20)
+#define RATE_MAX_PACKET_LEN (4096)
+
+static uint32_t rate = 0;
+static int rate_threads = 1;
+static int rate_sockets = 1;
+static int rate_duration = 10;
+static uint64_t rate_start;
+
+static uint64_t rate_now(void)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+
+	return ((uint64_t) now.tv_sec * USEC) + now.tv_usec;
+}
+
+static uint32_t rate_rand(rc_rate_thread_t *t)
+{
+	uint32_t num;
+
+	num = t->rand.randrsl[t->rand.randcnt++];
+	if (t->rand.randcnt >= 256) {
+		t->rand.randcnt = 0;
+		fr_isaac(&t->rand);
+	}
+
+	return num;
+}
+
+/*
+ *	When the thread should send its k'th packet.  The threads
+ *	interleave, so that together they send evenly spaced packets.
+ */
+static uint64_t rate_due(rc_rate_thread_t *t, uint64_t k)
+{
+	return rate_start + (((k * rate_threads) + t->index) * USEC) / rate;
+}
+
+/*
+ *	Expand %{counter}, %{random} and %{mac} in an attribute
+ *	value.  Anything else is copied as-is.
+ */
+static void rate_expand(rc_rate_thread_t *t, char *out, size_t outlen, char const *fmt, uint64_t counter)
+{
+	char const *p = fmt;
+	char *q = out, *end = out + outlen - 1;
+	size_t len;
+
+	while (*p && (q < end)) {
+		if ((p[0] != '%') || (p[1] != '{')) {
+			*q++ = *p++;
+			continue;
+		}
+
+		if (strncmp(p, "%{counter}", 10) == 0) {
+			len = snprintf(q, end - q + 1, "%" PRIu64, counter);
+			p += 10;
+
+		} else if (strncmp(p, "%{random}", 9) == 0) {
+			len = snprintf(q, end - q + 1, "%u", rate_rand(t));
+			p += 9;
+
+		} else if (strncmp(p, "%{mac}", 6) == 0) {
+			uint32_t a = rate_rand(t), b = rate_rand(t);
+
+			/*
+			 *	Locally administered, unicast.
+			 */
+			len = snprintf(q, end - q + 1, "%02x-%02x-%02x-%02x-%02x-%02x",
+				       ((a >> 24) & 0xfc) | 0x02, (a >> 16) & 0xff, (a >> 8) & 0xff,
+				       a & 0xff, (b >> 8) & 0xff, b & 0xff);
+			p += 6;
+
+		} else {
+			*q++ = *p++;
+			continue;
+		}
+
+		if (len > (size_t) (end - q)) len = end - q;
+		q += len;
+	}
+	*q = '\0';
+}
+
+/*
+ *	Give a thread its own copy of each request, and its own sockets.
+ */
+static int rate_thread_init(rc_rate_thread_t *t, int index)
+{
+	int i;
+	rc_request_t *this;
+	vp_cursor_t cursor;
+	VALUE_PAIR *vp;
+
+	memset(t, 0, sizeof(*t));
+	t->index = index;
+	t->ctx = talloc_new(NULL);
+	if (!t->ctx) return -1;
+
+	for (this = request_head; this != NULL; this = this->next) t->num_tmpl++;
+	t->tmpl = talloc_zero_array(t->ctx, rc_rate_tmpl_t, t->num_tmpl);
+	if (!t->tmpl) return -1;
+
+	for (this = request_head, i = 0; this != NULL; this = this->next, i++) {
+		rc_rate_tmpl_t *tmpl = &t->tmpl[i];
+
+		tmpl->packet = rad_alloc(t->ctx, false);
+		if (!tmpl->packet) return -1;
+
+		tmpl->packet->code = this->packet->code;
+		tmpl->packet->dst_ipaddr = this->packet->dst_ipaddr;
+		tmpl->packet->dst_port = this->packet->dst_port;
+		tmpl->packet->vps = paircopy(tmpl->packet, this->packet->vps);
+
+		if (this->password[0] != '\0') {
+			if ((vp = pairfind(tmpl->packet->vps, PW_USER_PASSWORD, 0, TAG_ANY)) != NULL) {
+				pairstrcpy(vp, this->password);
+
+			} else if ((vp = pairfind(tmpl->packet->vps, PW_CHAP_PASSWORD, 0, TAG_ANY)) != NULL) {
+				tmpl->chap = vp;
+				tmpl->cleartext = paircreate(tmpl->packet, PW_USER_PASSWORD, 0);
+				if (!tmpl->cleartext) return -1;
+				pairstrcpy(tmpl->cleartext, this->password);
+
+			} else if (pairfind(tmpl->packet->vps, PW_MS_CHAP_PASSWORD, 0, TAG_ANY) != NULL) {
+				ERROR("MS-CHAP-Password is not supported with -R");
+				return -1;
+			}
+		}
+
+		/*
+		 *	Remember which string attributes have to be
+		 *	re-written for every packet.
+		 */
+		for (vp = fr_cursor_init(&cursor, &tmpl->packet->vps);
+		     vp;
+		     vp = fr_cursor_next(&cursor)) {
+			if ((vp->da->type != PW_TYPE_STRING) || !strstr(vp->vp_strvalue, "%{")) continue;
+
+			tmpl->dynamic = talloc_realloc(t->ctx, tmpl->dynamic, rc_rate_dynamic_t,
+						       tmpl->num_dynamic + 1);
+			if (!tmpl->dynamic) return -1;
+			tmpl->dynamic[tmpl->num_dynamic].vp = vp;
+			tmpl->dynamic[tmpl->num_dynamic].fmt = talloc_strdup(t->ctx, vp->vp_strvalue);
+			tmpl->num_dynamic++;
+		}
+	}
+
+	t->sockets = talloc_array(t->ctx, int, rate_sockets);
+	t->slots = talloc_zero_array(t->ctx, rc_rate_slot_t, rate_sockets * 256);
+	if (!t->sockets || !t->slots) return -1;
+
+	for (i = 0; i < rate_sockets; i++) {
+		t->sockets[i] = fr_socket(&client_ipaddr, 0);
+		if (t->sockets[i] < 0) {
+			ERROR("Error opening socket");
+			return -1;
+		}
+		fr_nonblock(t->sockets[i]);
+	}
+
+	/*
+	 *	Seed the thread's generator from the main one.
+	 */
+	for (i = 0; i < 256; i++) t->rand.randrsl[i] = fr_rand();
+	fr_randinit(&t->rand, 1);
+	t->rand.randcnt = 0;
+
+	t->stats.latency_min = UINT64_MAX;
+
+	return 0;
+}
+
+static void rate_send(rc_rate_thread_t *t, uint64_t k, uint64_t now)
+{
+	int i;
+	uint32_t slot_num;
+	rc_rate_slot_t *slot;
+	rc_rate_tmpl_t *tmpl;
+	RADIUS_PACKET *packet;
+	struct sockaddr_storage dst;
+	socklen_t sizeof_dst;
+	char buffer[256];
+
+	/*
+	 *	Find a free Id.  Ones which have waited too long for a
+	 *	reply are lost, and may be re-used.
+	 */
+	slot_num = t->next_slot;
+	for (;;) {
+		slot = &t->slots[slot_num];
+		if (!slot->used) break;
+
+		if ((now - slot->sent) >= (uint64_t) (timeout * USEC)) {
+			slot->used = false;
+			t->outstanding--;
+			t->stats.lost++;
+			break;
+		}
+
+		slot_num = (slot_num + 1) % (rate_sockets * 256);
+		if (slot_num == t->next_slot) {
+			t->stats.no_id++;
+			return;
+		}
+	}
+
+	t->next_slot = (slot_num + 1) % (rate_sockets * 256);
+
+	tmpl = &t->tmpl[k % t->num_tmpl];
+	packet = tmpl->packet;
+
+	for (i = 0; i < tmpl->num_dynamic; i++) {
+		rate_expand(t, buffer, sizeof(buffer), tmpl->dynamic[i].fmt, (k * rate_threads) + t->index);
+		pairstrcpy(tmpl->dynamic[i].vp, buffer);
+	}
+
+	/*
+	 *	Consecutive slots are on different sockets.
+	 */
+	packet->id = slot_num / rate_sockets;
+	for (i = 0; i < 4; i++) ((uint32_t *) packet->vector)[i] = rate_rand(t);
+
+	if (tmpl->chap) {
+		uint8_t chap[17];
+
+		rad_chap_encode(packet, chap, rate_rand(t) & 0xff, tmpl->cleartext);
+		pairmemcpy(tmpl->chap, chap, sizeof(chap));
+	}
+
+	TALLOC_FREE(packet->data);
+	if ((rad_encode(packet, NULL, secret) < 0) || (rad_sign(packet, NULL, secret) < 0)) {
+		ERROR("Failed encoding packet");
+		exit(1);
+	}
+
+	fr_ipaddr2sockaddr(&packet->dst_ipaddr, packet->dst_port, &dst, &sizeof_dst);
+	if (sendto(t->sockets[slot_num % rate_sockets], packet->data, packet->data_len, 0,
+		   (struct sockaddr *) &dst, sizeof_dst) < 0) {
+		/*
+		 *	The kernel queue is full.  Count it as lost,
+		 *	as the server never saw it.
+		 */
+		t->stats.sent++;
+		t->stats.lost++;
+		return;
+	}
+
+	/*
+	 *	Access-Request authenticators are random, the others
+	 *	are calculated by rad_sign().
+	 */
+	memcpy(slot->vector, packet->data + 4, AUTH_VECTOR_LEN);
+	slot->sent = now;
+	slot->used = true;
+	t->outstanding++;
+	t->stats.sent++;
+}
+
+/*
+ *	Map a time in usec to its histogram bucket.
+ */
+static int rate_hist_index(uint64_t usec)
+{
+	int msb;
+
+	if (usec < RC_HIST_SUB) return usec;
+
+	if (usec >= (1U << RC_HIST_MAX_BITS)) return RC_HIST_BUCKETS - 1;
+
+	for (msb = RC_HIST_SUB_BITS; (usec >> (msb + 1)) != 0; msb++) {
+		/* nothing */
+	}
+
+	return ((msb - RC_HIST_SUB_BITS + 1) * RC_HIST_SUB) +
+		(usec >> (msb - RC_HIST_SUB_BITS)) - RC_HIST_SUB;
+}
+
+/*
+ *	The largest time counted by a histogram bucket.
+ */
+static uint64_t rate_hist_value(int i)
+{
+	int group = i / RC_HIST_SUB;
+	uint64_t sub = i % RC_HIST_SUB;
+
+	if (group == 0) return sub;
+
+	return ((RC_HIST_SUB + sub + 1) << (group - 1)) - 1;
+}
+
+static void rate_reply(rc_rate_thread_t *t, int sock, uint8_t *data, size_t data_len)
+{
+	size_t len;
+	rc_rate_slot_t *slot;
+	FR_MD5_CTX ctx;
+	uint8_t digest[AUTH_VECTOR_LEN];
+	uint64_t delay;
+
+	if (data_len < RATE_HDR_LEN) goto invalid;
+
+	len = (data[2] << 8) | data[3];
+	if ((len < RATE_HDR_LEN) || (len > data_len)) goto invalid;
+
+	slot = &t->slots[(data[1] * rate_sockets) + sock];
+	if (!slot->used) goto invalid;
+
+	/*
+	 *	Response Authenticator = MD5(Code + Id + Length +
+	 *	Request Authenticator + Attributes + Secret)
+	 */
+	fr_md5_init(&ctx);
+	fr_md5_update(&ctx, data, 4);
+	fr_md5_update(&ctx, slot->vector, AUTH_VECTOR_LEN);
+	fr_md5_update(&ctx, data + RATE_HDR_LEN, len - RATE_HDR_LEN);
+	fr_md5_update(&ctx, (uint8_t const *) secret, strlen(secret));
+	fr_md5_final(digest, &ctx);
+
+	if (rad_digest_cmp(digest, data + 4, AUTH_VECTOR_LEN) != 0) goto invalid;
+
+	slot->used = false;
+	t->outstanding--;
+	t->stats.received++;
+
+	switch (data[0]) {
+	case PW_CODE_ACCESS_ACCEPT:
+	case PW_CODE_ACCOUNTING_RESPONSE:
+	case PW_CODE_COA_ACK:
+	case PW_CODE_DISCONNECT_ACK:
+		t->stats.accepted++;
+		break;
+
+	case PW_CODE_ACCESS_CHALLENGE:
+		break;
+
+	default:
+		t->stats.rejected++;
+	}
+
+	delay = rate_now() - slot->sent;
+	if (delay < t->stats.latency_min) t->stats.latency_min = delay;
+	if (delay > t->stats.latency_max) t->stats.latency_max = delay;
+	t->stats.latency_sum += delay;
+	t->stats.hist[rate_hist_index(delay)]++;
+	return;
+
+invalid:
+	t->stats.invalid++;
+}
+
+/*
+ *	Wait up to "wait" usec for replies, and read all of the ones
+ *	which are available.
+ */
+static void rate_recv(rc_rate_thread_t *t, uint64_t wait)
+{
+	int i, max_fd = -1;
+	fd_set set;
+	struct timeval tv;
+	uint8_t data[RATE_MAX_PACKET_LEN];
+	ssize_t data_len;
+
+	FD_ZERO(&set);
+	for (i = 0; i < rate_sockets; i++) {
+		FD_SET(t->sockets[i], &set);
+		if (t->sockets[i] > max_fd) max_fd = t->sockets[i];
+	}
+
+	tv.tv_sec = wait / USEC;
+	tv.tv_usec = wait % USEC;
+
+	if (select(max_fd + 1, &set, NULL, NULL, &tv) <= 0) return;
+
+	for (i = 0; i < rate_sockets; i++) {
+		if (!FD_ISSET(t->sockets[i], &set)) continue;
+
+		while ((data_len = recv(t->sockets[i], data, sizeof(data), 0)) >= 0) {
+			rate_reply(t, i, data, data_len);
+		}
+	}
+}
+
+static void *rate_thread(void *arg)
+{
+	rc_rate_thread_t *t = arg;
+	uint64_t k, due, now, end, linger;
+
+	end = rate_start + ((uint64_t) rate_duration * USEC);
+	linger = end + (uint64_t) (timeout * USEC);
+
+	k = 0;
+	due = rate_due(t, k);
+
+	for (;;) {
+		now = rate_now();
+
+		/*
+		 *	Send everything which is due.  If we've
+		 *	fallen behind, catch up, rather than slipping
+		 *	the schedule.
+		 */
+		while ((due <= now) && (due < end)) {
+			if ((now - due) > t->stats.lag_max) t->stats.lag_max = now - due;
+
+			rate_send(t, k, now);
+			due = rate_due(t, ++k);
+			now = rate_now();
+		}
+
+		if (due < end) {
+			rate_recv(t, due - now);
+			continue;
+		}
+
+		/*
+		 *	Done sending, wait for the last replies.
+		 */
+		if (!t->outstanding || (now >= linger)) break;
+		rate_recv(t, linger - now);
+	}
+
+	t->stats.lost += t->outstanding;
+	t->outstanding = 0;
+
+	return NULL;
+}
+
+/*
+ *	The time (in usec) under which a given fraction (in tenths of
+ *	a percent) of the replies were received.
+ */
+static uint64_t rate_percentile(rc_rate_stats_t const *s, unsigned int permille)
+{
+	int i;
+	uint64_t rank, count = 0;
+
+	rank = ((s->received * permille) + 999) / 1000;
+	if (!rank) rank = 1;
+
+	for (i = 0; i < RC_HIST_BUCKETS; i++) {
+		count += s->hist[i];
+		if (count >= rank) break;
+	}
+	if (i == RC_HIST_BUCKETS) i--;
+
+	/*
+	 *	The bucket bound may be larger than any time we saw.
+	 */
+	if (rate_hist_value(i) > s->latency_max) return s->latency_max;
+
+	return rate_hist_value(i);
+}
+
+static int rate_run(void)
+{
+	int i;
+	uint64_t elapsed;
+	rc_rate_thread_t *threads;
+	rc_rate_stats_t total;
+
+	threads = talloc_zero_array(NULL, rc_rate_thread_t, rate_threads);
+	if (!threads) {
+		ERROR("Out of memory");
+		return 1;
+	}
+
+	for (i = 0; i < rate_threads; i++) {
+		if (rate_thread_init(&threads[i], i) < 0) return 1;
+	}
+
+	/*
+	 *	Give the threads a moment to start, so they all
+	 *	begin on schedule.
+	 */
+	rate_start = rate_now() + (USEC / 10);
+
+#ifdef HAVE_PTHREAD_H
+	for (i = 0; i < rate_threads; i++) {
+		int rcode;
+
+		rcode = pthread_create(&threads[i].pthread_id, NULL, rate_thread, &threads[i]);
+		if (rcode != 0) {
+			ERROR("Failed creating thread: %s", fr_syserror(rcode));
+			exit(1);
+		}
+	}
+
+	for (i = 0; i < rate_threads; i++) pthread_join(threads[i].pthread_id, NULL);
+#else
+	rate_thread(&threads[0]);
+#endif
+
+	elapsed = rate_now() - rate_start;
+
+	memset(&total, 0, sizeof(total));
+	total.latency_min = UINT64_MAX;
+	for (i = 0; i < rate_threads; i++) {
+		rc_rate_stats_t *s = &threads[i].stats;
+		int j;
+
+		total.sent += s->sent;
+		total.received += s->received;
+		total.accepted += s->accepted;
+		total.rejected += s->rejected;
+		total.lost += s->lost;
+		total.no_id += s->no_id;
+		total.invalid += s->invalid;
+		if (s->lag_max > total.lag_max) total.lag_max = s->lag_max;
+		if (s->latency_min < total.latency_min) total.latency_min = s->latency_min;
+		if (s->latency_max > total.latency_max) total.latency_max = s->latency_max;
+		total.latency_sum += s->latency_sum;
+		for (j = 0; j < RC_HIST_BUCKETS; j++) total.hist[j] += s->hist[j];
+
+		for (j = 0; j < rate_sockets; j++) close(threads[i].sockets[j]);
+		talloc_free(threads[i].ctx);
+	}
+	talloc_free(threads);
+
+	/*
+	 *	Rates are over the sending period.  The elapsed time
+	 *	includes waiting for the replies to the last packets.
+	 */
+	if (do_output) {
+		double secs = (double) rate_duration;
+
+		printf("Rate summary:\n"
+		       "\tDuration      : %d s\n"
+		       "\tElapsed       : %.3f s\n"
+		       "\tRequested     : %u packets/s\n"
+		       "\tSent          : %" PRIu64 " (%.1f packets/s)\n"
+		       "\tReceived      : %" PRIu64 " (%.1f packets/s)\n"
+		       "\tAccepted      : %" PRIu64 "\n"
+		       "\tRejected      : %" PRIu64 "\n"
+		       "\tLost          : %" PRIu64 "\n"
+		       "\tInvalid       : %" PRIu64 "\n"
+		       "\tNo free Id    : %" PRIu64 "\n"
+		       "\tMax send lag  : %" PRIu64 " usec\n",
+		       rate_duration, (double) elapsed / USEC, rate,
+		       total.sent, total.sent / secs,
+		       total.received, total.received / secs,
+		       total.accepted, total.rejected, total.lost,
+		       total.invalid, total.no_id, total.lag_max);
+
+		if (total.received) {
+			uint64_t count = 0;
+
+			printf("Latency (usec):\n"
+			       "\tmin %" PRIu64 ", mean %" PRIu64 ", p50 %" PRIu64 ", p90 %" PRIu64
+			       ", p99 %" PRIu64 ", p99.9 %" PRIu64 ", max %" PRIu64 "\n",
+			       total.latency_min, total.latency_sum / total.received,
+			       rate_percentile(&total, 500), rate_percentile(&total, 900),
+			       rate_percentile(&total, 990), rate_percentile(&total, 999),
+			       total.latency_max);
+
+			printf("Latency histogram:\n");
+			for (i = 0; i < RC_HIST_BUCKETS; i++) {
+				if (!total.hist[i]) continue;
+
+				count += total.hist[i];
+				printf("\t<= %8" PRIu64 " usec : %10" PRIu64 " %6.2f%%\n",
+				       rate_hist_value(i), total.hist[i],
+				       (100.0 * count) / total.received);
+			}
+		}
+	}
+
+	return (total.lost > 0) ? 1 : 0;
+}
+
 int main(int argc, char **argv)
 {
 	int c;
@@ -1145,7 +1780,10 @@ int main(int argc, char **argv)
 		exit(1);
 	}
 
-	while ((c = getopt(argc, argv, "46c:d:D:f:Fhi:n:p:qr:sS:t:vx"
+	while ((c = getopt(argc, argv, "46c:d:D:f:Fhi:L:N:n:p:qr:R:sS:t:vx"
+#ifdef HAVE_PTHREAD_H
+		"T:"
+#endif
 #ifdef WITH_TCP
 		"P:"
 #endif
@@ -1206,11 +1844,21 @@ int main(int argc, char **argv)
 			}
 			break;
 
+		case 'L':
+			rate_duration = atoi(optarg);
+			if (rate_duration <= 0) usage();
+			break;
+
 		case 'n':
 			persec = atoi(optarg);
 			if (persec <= 0) usage();
 			break;
 
+		case 'N':
+			rate_sockets = atoi(optarg);
+			if ((rate_sockets <= 0) || (rate_sockets > 1024)) usage();
+			break;
+
 			/*
 			 *	Note that sending MANY requests in
 			 *	parallel can over-run the kernel
@@ -1250,6 +1898,12 @@ int main(int argc, char **argv)
 			if ((retries == 0) || (retries > 1000)) usage();
 			break;
 
+		case 'R':
+			if (!isdigit((int) *optarg)) usage();
+			rate = atoi(optarg);
+			if (rate == 0) usage();
+			break;
+
 		case 's':
 			do_summary = true;
 			break;
@@ -1290,6 +1944,13 @@ int main(int argc, char **argv)
 			timeout = atof(optarg);
 			break;
 
+#ifdef HAVE_PTHREAD_H
+		case 'T':
+			rate_threads = atoi(optarg);
+			if ((rate_threads <= 0) || (rate_threads > 256)) usage();
+			break;
+#endif
+
 		case 'v':
 			DEBUG("%s", radclient_version);
 			exit(0);
@@ -1440,6 +2101,34 @@ int main(int argc, char **argv)
 		client_ipaddr = request_head->packet->src_ipaddr;
 		client_port = request_head->packet->src_port;
 	}
+
+	/*
+	 *	Open-loop mode uses its own sockets.
+	 */
+	if (rate) {
+		int rcode;
+
+#ifdef WITH_TCP
+		if (proto) {
+			ERROR("-R can only be used with UDP");
+			exit(1);
+		}
+#endif
+		for (this = request_head; this != NULL; this = this->next) {
+			if (radclient_sane(this) != 0) {
+				exit(1);
+			}
+		}
+
+		rcode = rate_run();
+
+		rbtree_free(filename_tree);
+		while (request_head) TALLOC_FREE(request_head);
+		dict_free();
+
+		exit(rcode);
+	}
+
 #ifdef WITH_TCP
 	if (proto) {
 		sockfd = fr_tcp_client_socket(NULL, &server_ipaddr, server_port);
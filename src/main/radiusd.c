@@ -29,6 +29,7 @@ RCSID("$Id$")
 
 #include <freeradius-devel/radiusd.h>
 #include <freeradius-devel/modules.h>
+#include <freeradius-devel/trace.h>
 #include <freeradius-devel/rad_assert.h>
 
 #include <sys/file.h>
@@ -83,6 +84,9 @@ static void sig_fatal (int);
 #ifdef SIGHUP
 static void sig_hup (int);
 #endif
+#ifndef __MINGW32__
+static void workers_supervise(bool write_pid, int status_fd);
+#endif
 
 /*
  *	The main guy.
@@ -156,9 +160,13 @@ int main(int argc, char *argv[])
 	main_config.log_file = NULL;
 
 	/*  Process the options.  */
-	while ((argval = getopt(argc, argv, "Cd:D:fhi:l:mMn:p:PstvxX")) != EOF) {
+	while ((argval = getopt(argc, argv, "c:Cd:D:fhi:l:mMn:p:PsS:tvxX")) != EOF) {
 
 		switch(argval) {
+			case 'c':
+				main_config.dictionary_cache = talloc_typed_strdup(NULL, optarg);
+				break;
+
 			case 'C':
 				check_config = true;
 				spawn_flag = false;
@@ -242,6 +250,10 @@ int main(int argc, char *argv[])
 				main_config.daemonize = false;
 				break;
 
+			case 'S':
+				main_config.config_snapshot = talloc_typed_strdup(NULL, optarg);
+				break;
+
 			case 't':	/* no child threads */
 				spawn_flag = false;
 				break;
@@ -357,6 +369,10 @@ int main(int argc, char *argv[])
 		exit(EXIT_FAILURE);
 	}
 
+	if (trace_init(main_config.config) < 0) {
+		exit(EXIT_FAILURE);
+	}
+
 	/*  Check for vulnerabilities in the version of libssl were linked against */
 #ifdef HAVE_OPENSSL_CRYPTO_H
 #ifdef ENABLE_OPENSSL_VERSION_CHECK
@@ -367,9 +383,11 @@ int main(int argc, char *argv[])
 #endif
 
 	/*
-	 *  Load the modules
+	 *  Load the modules.  Worker processes load their own, after
+	 *  they've been forked, so that they don't share connections.
 	 */
-	if (modules_init(main_config.config) < 0) {
+	if (((main_config.num_workers == 1) || check_config) &&
+	    (modules_init(main_config.config) < 0)) {
 		exit(EXIT_FAILURE);
 	}
 
@@ -475,6 +493,40 @@ int main(int argc, char *argv[])
 		exit(EXIT_FAILURE);
 	}
 
+#ifndef __MINGW32__
+	/*
+	 *	Fork the worker processes.  This process only
+	 *	supervises them, and workers_supervise() returns only
+	 *	in the workers.  Each worker is a complete server, with
+	 *	its own modules, threads, event loop, and sockets.
+	 */
+	if ((main_config.num_workers > 1) && !check_config) {
+		workers_supervise(write_pid || main_config.daemonize, from_child[1]);
+
+		write_pid = false;
+		main_config.daemonize = false;
+
+		if (modules_init(main_config.config) < 0) {
+			exit(EXIT_FAILURE);
+		}
+	}
+#endif
+
+	/*
+	 *	Debug output should appear as it happens, so it's
+	 *	never written asynchronously.
+	 */
+	if (main_config.log_async && !debug_flag &&
+	    (radlog_async_start(main_config.log_async_buffer) < 0)) {
+		ERROR("%s", fr_strerror());
+		exit(EXIT_FAILURE);
+	}
+
+	if (!check_config && (trace_start() < 0)) {
+		ERROR("%s", fr_strerror());
+		exit(EXIT_FAILURE);
+	}
+
 	/*
 	 *	Start the event loop(s) and threads.
 	 */
@@ -630,6 +682,11 @@ int main(int argc, char *argv[])
 	radius_event_free();
 
 cleanup:
+	/*
+	 *	Write any traces of the last requests.
+	 */
+	trace_free();
+
 	/*
 	 *	Detach any modules.
 	 */
@@ -637,6 +694,11 @@ cleanup:
 
 	xlat_free();		/* modules may have xlat's */
 
+	/*
+	 *	Write any queued log messages.
+	 */
+	radlog_async_stop();
+
 	/*
 	 *	Free the configuration items.
 	 */
@@ -672,6 +734,7 @@ static void NEVER_RETURNS usage(int status)
 
 	fprintf(output, "Usage: %s [options]\n", progname);
 	fprintf(output, "Options:\n");
+	fprintf(output, "  -c <file>     Cache the compiled dictionaries in file.\n");
 	fprintf(output, "  -C            Check configuration and exit.\n");
 	fprintf(stderr, "  -d <raddb>    Set configuration directory (defaults to " RADDBDIR ").\n");
 	fprintf(stderr, "  -D <dictdir>  Set main dictionary directory (defaults to " DICTDIR ").\n");
@@ -684,6 +747,7 @@ static void NEVER_RETURNS usage(int status)
 	fprintf(output, "  -p <port>     Listen on port ONLY.\n");
 	fprintf(output, "  -P            Always write out PID, even with -f.\n");
 	fprintf(output, "  -s            Do not spawn child processes to handle requests.\n");
+	fprintf(output, "  -S <file>     Keep a pre-parsed snapshot of the configuration in file.\n");
 	fprintf(output, "  -t            Disable threads.\n");
 	fprintf(output, "  -v            Print server version information.\n");
 	fprintf(output, "  -X            Turn on full debugging.\n");
@@ -692,6 +756,197 @@ static void NEVER_RETURNS usage(int status)
 }
 
 
+#ifndef __MINGW32__
+static pid_t			*worker_pids = NULL;
+static time_t			*worker_started = NULL;
+static volatile sig_atomic_t	workers_exiting = 0;
+
+/*
+ *	The supervisor passes HUP on to the workers, and turns any
+ *	other signal into a TERM for them.
+ */
+static void sig_workers(int sig)
+{
+	uint32_t i;
+
+	if (sig != SIGHUP) workers_exiting = 1;
+
+	for (i = 0; i < main_config.num_workers; i++) {
+		if (worker_pids[i] > 0) kill(worker_pids[i], (sig == SIGHUP) ? SIGHUP : SIGTERM);
+	}
+}
+
+/*
+ *	Returns 0 in the new worker, 1 in the supervisor, and -1 on error.
+ */
+static int worker_fork(uint32_t id)
+{
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0) {
+		ERROR("Couldn't fork worker %u: %s", id, fr_syserror(errno));
+		return -1;
+	}
+
+	if (pid == 0) {
+		signal(SIGHUP, SIG_DFL);
+		signal(SIGTERM, SIG_DFL);
+		signal(SIGINT, SIG_DFL);
+#ifdef SIGQUIT
+		signal(SIGQUIT, SIG_DFL);
+#endif
+		main_config.worker_id = id;
+		radius_pid = getpid();
+		return 0;
+	}
+
+	worker_pids[id] = pid;
+	worker_started[id] = time(NULL);
+
+	return 1;
+}
+
+/** Fork the worker processes, and supervise them
+ *
+ * Only returns in the workers.  The supervisor restarts workers
+ * which exit, passes signals on to them, and exits once they've
+ * all stopped.
+ *
+ * @param[in] write_pid whether the supervisor should write the PID file.
+ * @param[in] status_fd where to tell the parent that we've started, or -1.
+ */
+static void workers_supervise(bool write_pid, int status_fd)
+{
+	int		rcode = EXIT_SUCCESS;
+	int		status;
+	uint32_t	i, running = 0;
+	pid_t		pid;
+
+	worker_pids = talloc_zero_array(NULL, pid_t, main_config.num_workers);
+	worker_started = talloc_zero_array(NULL, time_t, main_config.num_workers);
+	if (!worker_pids || !worker_started) {
+		ERROR("Out of memory");
+		exit(EXIT_FAILURE);
+	}
+
+#ifdef WITH_STATS
+	if (radius_stats_shared_init(main_config.num_workers) < 0) {
+		ERROR("%s", fr_strerror());
+		exit(EXIT_FAILURE);
+	}
+#endif
+
+	if ((fr_set_signal(SIGHUP, sig_workers) < 0) ||
+	    (fr_set_signal(SIGTERM, sig_workers) < 0) ||
+	    (fr_set_signal(SIGINT, sig_workers) < 0)
+#ifdef SIGQUIT
+	    || (fr_set_signal(SIGQUIT, sig_workers) < 0)
+#endif
+		) {
+		ERROR("%s", fr_strerror());
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < main_config.num_workers; i++) {
+		switch (worker_fork(i)) {
+		case 0:
+			if (status_fd >= 0) close(status_fd);
+			return;
+
+		case 1:
+			running++;
+			break;
+
+		default:
+			rcode = EXIT_FAILURE;
+			sig_workers(SIGTERM);
+			break;
+		}
+
+		if (workers_exiting) break;
+	}
+
+	INFO("Started %u worker processes", running);
+
+	if (write_pid && !workers_exiting) {
+		FILE *fp;
+
+		fp = fopen(main_config.pid_file, "w");
+		if (fp != NULL) {
+			fprintf(fp, "%d\n", (int) radius_pid);
+			fclose(fp);
+		} else {
+			ERROR("Failed creating PID file %s: %s\n",
+			       main_config.pid_file, fr_syserror(errno));
+			rcode = EXIT_FAILURE;
+			sig_workers(SIGTERM);
+		}
+	}
+
+	if (status_fd >= 0) {
+		if (!workers_exiting && (write(status_fd, "\001", 1) < 0)) {
+			WARN("Failed informing parent of successful start: %s",
+			     fr_syserror(errno));
+		}
+		close(status_fd);
+	}
+
+	while (running > 0) {
+		pid = waitpid(-1, &status, 0);
+		if (pid < 0) {
+			if (errno == EINTR) continue;
+
+			ERROR("Failed waiting for workers: %s", fr_syserror(errno));
+			break;
+		}
+
+		for (i = 0; i < main_config.num_workers; i++) {
+			if (worker_pids[i] == pid) break;
+		}
+		if (i == main_config.num_workers) continue;
+
+		worker_pids[i] = 0;
+		running--;
+
+		if (workers_exiting) continue;
+
+		/*
+		 *	It exited with an error soon after it started,
+		 *	so the replacement would probably do the same.
+		 */
+		if (WIFEXITED(status) && (WEXITSTATUS(status) != 0) &&
+		    ((time(NULL) - worker_started[i]) < 10)) {
+			ERROR("Worker %u failed to start.  Stopping the server", i);
+			rcode = EXIT_FAILURE;
+			sig_workers(SIGTERM);
+			continue;
+		}
+
+		ERROR("Worker %u (pid %d) exited unexpectedly.  Restarting it", i, (int) pid);
+
+		switch (worker_fork(i)) {
+		case 0:
+			return;
+
+		case 1:
+			running++;
+			break;
+
+		default:
+			rcode = EXIT_FAILURE;
+			sig_workers(SIGTERM);
+			break;
+		}
+	}
+
+	if (write_pid) unlink(main_config.pid_file);
+
+	INFO("All workers have stopped.  Exiting");
+	exit(rcode);
+}
+#endif
+
 /*
  *	We got a fatal signal.
  */
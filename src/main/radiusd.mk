@@ -3,14 +3,15 @@ SOURCES := acct.c auth.c client.c crypt.c files.c \
 		  listen.c  mainconfig.c modules.c modcall.c \
 		  radiusd.c stats.c soh.c connection.c \
 		  session.c threads.c version.c  \
-		  process.c realms.c detail.c
+		  process.c realms.c detail.c cluster.c \
+		  metrics.c coa_bulk.c
 ifneq ($(OPENSSL_LIBS),)
-SOURCES	+= cb.c tls.c tls_listen.c
+SOURCES	+= cb.c tls.c tls_cache.c tls_crl.c tls_ocsp.c tls_listen.c
 endif
 
 SRC_CFLAGS	:= -DHOSTINFO=\"${HOSTINFO}\"
 TGT_INSTALLDIR  := ${sbindir}
-TGT_LDLIBS	:= $(LIBS) $(LCRYPT)
+TGT_LDLIBS	:= $(LIBS) $(LCRYPT) $(LIBZ)
 TGT_PREREQS	:= libfreeradius-server.a libfreeradius-radius.a
 
 # Libraries can't depend on libraries (oops), so make the binary
@@ -41,14 +41,23 @@ RCSID("$Id$")
 #  include <collectd/client.h>
 #endif
 
+/*
+ *	Capture threads each need their own timestamp buffer for
+ *	the debug macros.
+ */
+#if defined(HAVE_PTHREAD_H) && defined(__THREAD)
+#  define RS_WITH_THREADS
+static __THREAD char timestr[50];
+#else
+static char timestr[50];
+#endif
+
 static rs_t *conf;
 struct timeval start_pcap = {0, 0};
-static char timestr[50];
 
-static rbtree_t *request_tree = NULL;
-static rbtree_t *link_tree = NULL;
 static fr_event_list_t *events;
 static bool cleanup;
+static uint64_t captured = 0;			//!< Packets processed, by all threads.
 
 static int self_pipe[2] = {-1, -1};		//!< Signals from sig handlers
 
@@ -87,7 +96,20 @@ const FR_NAME_NUMBER rs_events[] = {
 	{  NULL , -1 }
 };
 
+/*
+ *	Upper bounds (ms) of the latency histogram buckets.  The last
+ *	bucket holds everything above the last bound.
+ */
+unsigned int const rs_latency_bounds[RS_LATENCY_BUCKETS - 1] = {
+	1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000
+};
+
+#ifdef RS_WITH_THREADS
+static pthread_mutex_t anomaly_mutex = PTHREAD_MUTEX_INITIALIZER;	//!< Serialises anomaly captures.
+#endif
+
 static void NEVER_RETURNS usage(int status);
+static void rs_signal_self(int sig);
 
 /** Fork and kill the parent process, writing out our PID
  *
@@ -529,6 +551,16 @@ static void rs_stats_print(rs_latency_t *stats, PW_CODE code)
 		INFO("\tLow       : %.3lfms", stats->interval.latency_low);
 		INFO("\tAverage   : %.3lfms", stats->interval.latency_average);
 		INFO("\tMA        : %.3lfms", stats->latency_smoothed);
+
+		for (i = 0; i < RS_LATENCY_BUCKETS; i++) {
+			if (!stats->interval.latency_hist[i]) continue;
+
+			if (i < (RS_LATENCY_BUCKETS - 1)) {
+				INFO("\t<=%5ums : %.3lf/s", rs_latency_bounds[i], stats->interval.latency_hist[i]);
+			} else {
+				INFO("\t> %5ums : %.3lf/s", rs_latency_bounds[i - 1], stats->interval.latency_hist[i]);
+			}
+		}
 	}
 
 	if (have_rt || stats->interval.lost || stats->interval.reused) {
@@ -648,6 +680,59 @@ static void rs_stats_process_counters(rs_latency_t *stats)
 	for (i = 0; i < RS_RETRANSMIT_MAX; i++) {
 		stats->interval.rt[i] = ((long double) stats->interval.rt_total[i]) / conf->stats.interval;
 	}
+
+	for (i = 0; i < RS_LATENCY_BUCKETS; i++) {
+		stats->interval.latency_hist[i] = ((long double) stats->interval.latency_hist_total[i]) /
+						  conf->stats.interval;
+	}
+}
+
+/** Add the interval counters from one set of stats to another, and clear them
+ *
+ * Used by the capture threads to publish their stats, and by the main thread to
+ * merge the published stats.
+ */
+static void rs_stats_merge(rs_stats_t *out, rs_stats_t *in)
+{
+	size_t i;
+	int j;
+
+	for (i = 0; i < (sizeof(rs_useful_codes) / sizeof(*rs_useful_codes)); i++) {
+		rs_latency_t *a = &out->exchange[rs_useful_codes[i]];
+		rs_latency_t *b = &in->exchange[rs_useful_codes[i]];
+
+		a->interval.received_total += b->interval.received_total;
+		a->interval.linked_total += b->interval.linked_total;
+		a->interval.unlinked_total += b->interval.unlinked_total;
+		a->interval.reused_total += b->interval.reused_total;
+		a->interval.lost_total += b->interval.lost_total;
+
+		for (j = 0; j <= RS_RETRANSMIT_MAX; j++) {
+			a->interval.rt_total[j] += b->interval.rt_total[j];
+		}
+
+		for (j = 0; j < RS_LATENCY_BUCKETS; j++) {
+			a->interval.latency_hist_total[j] += b->interval.latency_hist_total[j];
+		}
+
+		a->interval.latency_total += b->interval.latency_total;
+		if (b->interval.latency_high > a->interval.latency_high) {
+			a->interval.latency_high = b->interval.latency_high;
+		}
+		if (b->interval.latency_low &&
+		    (!a->interval.latency_low || (b->interval.latency_low < a->interval.latency_low))) {
+			a->interval.latency_low = b->interval.latency_low;
+		}
+
+		memset(&b->interval, 0, sizeof(b->interval));
+	}
+
+	/*
+	 *	If any thread had to mute the stats, they're muted.
+	 */
+	if (timercmp(&in->quiet, &out->quiet, >)) {
+		out->quiet = in->quiet;
+	}
 }
 
 /** Process stats for a single interval
@@ -668,18 +753,40 @@ static void rs_stats_process(void *ctx)
 
 	INFO("######### Stats Iteration %i #########", stats->intervals);
 
+#ifdef RS_WITH_THREADS
+	/*
+	 *	Collect whatever the capture threads have published
+	 *	since the last interval.  The packet path never takes
+	 *	the mutex, the threads only lock it every
+	 *	RS_THREAD_PUBLISH ms, to hand over their counters.
+	 */
+	for (i = 0; i < (size_t) this->num_threads; i++) {
+		rs_thread_t *thread = this->threads[i];
+
+		pthread_mutex_lock(&thread->mutex);
+		rs_stats_merge(stats, thread->published);
+		pthread_mutex_unlock(&thread->mutex);
+	}
+#endif
+
 	/*
 	 *	Verify that none of the pcap handles have dropped packets.
+	 *
+	 *	pcap_stats() only reads the kernel's counters for the
+	 *	socket, so it's fine to call it while a capture thread
+	 *	is reading packets from the handle.
 	 */
 	INFO("Interface capture rate:");
-	for (in_p = this->in;
-	     in_p;
-	     in_p = in_p->next) {
-		if (rs_check_pcap_drop(in_p, conf->stats.interval) < 0) {
-			ERROR("Muting stats for the next %i milliseconds", conf->stats.timeout);
+	for (i = 0; i < (size_t) (this->num_threads ? this->num_threads : 1); i++) {
+		for (in_p = this->num_threads ? this->threads[i]->in : this->in;
+		     in_p;
+		     in_p = in_p->next) {
+			if (rs_check_pcap_drop(in_p, conf->stats.interval) < 0) {
+				ERROR("Muting stats for the next %i milliseconds", conf->stats.timeout);
 
-			rs_tv_add_ms(&now, conf->stats.timeout, &stats->quiet);
-			goto clear;
+				rs_tv_add_ms(&now, conf->stats.timeout, &stats->quiet);
+				goto clear;
+			}
 		}
 	}
 
@@ -740,6 +847,7 @@ static void rs_stats_process(void *ctx)
 static void rs_stats_update_latency(rs_latency_t *stats, struct timeval *latency)
 {
 	double lint;
+	int i;
 
 	stats->interval.linked_total++;
 	/* More useful is this in milliseconds */
@@ -752,6 +860,10 @@ static void rs_stats_update_latency(rs_latency_t *stats, struct timeval *latency
 	}
 	stats->interval.latency_total += lint;
 
+	for (i = 0; i < (RS_LATENCY_BUCKETS - 1); i++) {
+		if (lint <= rs_latency_bounds[i]) break;
+	}
+	stats->interval.latency_hist_total[i]++;
 }
 
 /** Copy a subset of attributes from one list into the other
@@ -799,15 +911,15 @@ static int _request_free(rs_request_t *request)
 	 *	something has gone very badly wrong.
 	 */
 	if (request->in_request_tree) {
-		assert(rbtree_deletebydata(request_tree, request));
+		assert(rbtree_deletebydata(request->thread->request_tree, request));
 	}
 
 	if (request->in_link_tree) {
-		assert(rbtree_deletebydata(link_tree, request));
+		assert(rbtree_deletebydata(request->thread->link_tree, request));
 	}
 
 	if (request->event) {
-		assert(fr_event_delete(events, &request->event));
+		assert(fr_event_delete(request->thread->list, &request->event));
 	}
 
 	rad_free(&request->packet);
@@ -984,6 +1096,159 @@ static inline int rs_request_to_pcap(rs_event_t *event, rs_request_t *request, s
 	return 0;
 }
 
+/** Allocate a ring for recently captured packets
+ *
+ * @param ctx to allocate the ring in.
+ * @param size number of packets to keep.
+ * @return new ring, or NULL on error.
+ */
+static rs_ring_t *rs_ring_alloc(TALLOC_CTX *ctx, uint32_t size)
+{
+	rs_ring_t *ring;
+
+	ring = talloc_zero(ctx, rs_ring_t);
+	if (!ring) return NULL;
+
+	ring->header = talloc_zero_array(ring, struct pcap_pkthdr, size);
+	ring->data = talloc_array(ring, uint8_t, size * SNAPLEN);
+	if (!ring->header || !ring->data) {
+		talloc_free(ring);
+		return NULL;
+	}
+	ring->size = size;
+
+	return ring;
+}
+
+/** Add a packet to the ring, overwriting the oldest one if it's full
+ *
+ */
+static inline void rs_ring_add(rs_ring_t *ring, struct pcap_pkthdr const *header, uint8_t const *data)
+{
+	struct pcap_pkthdr *slot = &ring->header[ring->head];
+
+	*slot = *header;
+	if (slot->caplen > SNAPLEN) slot->caplen = SNAPLEN;
+	memcpy(ring->data + ((size_t) ring->head * SNAPLEN), data, slot->caplen);
+
+	if (++ring->head == ring->size) ring->head = 0;
+	if (ring->used < ring->size) ring->used++;
+}
+
+/** Write out the packets leading up to an anomaly
+ *
+ * Packets are only ever written once, so if anomalies come thick and fast
+ * only the packets since the last one are written.
+ *
+ * @param thread which saw the anomaly.
+ * @param why description of the anomaly.
+ */
+static void rs_anomaly(rs_thread_t *thread, char const *why)
+{
+	rs_ring_t	*ring = thread->ring;
+	uint32_t	i, slot, written;
+
+	if (!ring || !ring->used) return;
+
+	written = ring->used;
+	slot = (ring->head + ring->size - ring->used) % ring->size;
+
+#ifdef RS_WITH_THREADS
+	pthread_mutex_lock(&anomaly_mutex);
+#endif
+	for (i = 0; i < ring->used; i++) {
+		pcap_dump((void *)conf->anomaly.out->dumper, &ring->header[slot],
+			  ring->data + ((size_t) slot * SNAPLEN));
+		if (++slot == ring->size) slot = 0;
+	}
+	pcap_dump_flush(conf->anomaly.out->dumper);
+#ifdef RS_WITH_THREADS
+	pthread_mutex_unlock(&anomaly_mutex);
+#endif
+	ring->used = 0;
+
+	INFO("Anomaly (%s), wrote %u packets to %s", why, written, conf->anomaly.out->name);
+}
+
+/** Check the RADIUS header of a packet, without looking at the attributes
+ *
+ * This is all that's needed to correlate requests and responses, and to
+ * produce rate and latency statistics.  rad_packet_ok() is only called for
+ * packets whose attributes we decode, as walking the attributes costs more
+ * than everything else we do with a packet.
+ *
+ * @param packet to check.  The code, id, and vector are filled in from the header.
+ * @param reason why the packet was rejected.
+ * @return true if the header is valid, else false.
+ */
+static bool rs_packet_header_ok(RADIUS_PACKET *packet, decode_fail_t *reason)
+{
+	size_t		totallen;
+	uint8_t const	*hdr = packet->data;
+
+	if (packet->data_len < RADIUS_HDR_LEN) {
+		fr_strerror_printf("Malformed RADIUS packet: too short (received %zu < minimum %d)",
+				   packet->data_len, RADIUS_HDR_LEN);
+		*reason = DECODE_FAIL_MIN_LENGTH_PACKET;
+		return false;
+	}
+
+	if (!is_radius_code(hdr[0])) {
+		fr_strerror_printf("Bad RADIUS packet: unknown packet code %d", hdr[0]);
+		*reason = DECODE_FAIL_UNKNOWN_PACKET_CODE;
+		return false;
+	}
+
+	totallen = (hdr[2] << 8) | hdr[3];
+	if (totallen < RADIUS_HDR_LEN) {
+		fr_strerror_printf("Malformed RADIUS packet: too short (length %zu < minimum %d)",
+				   totallen, RADIUS_HDR_LEN);
+		*reason = DECODE_FAIL_MIN_LENGTH_FIELD;
+		return false;
+	}
+
+	if ((totallen > MAX_RADIUS_LEN) || (packet->data_len < totallen)) {
+		fr_strerror_printf("Malformed RADIUS packet: received %zu octets, packet length says %zu",
+				   packet->data_len, totallen);
+		*reason = DECODE_FAIL_MIN_LENGTH_MISMATCH;
+		return false;
+	}
+
+	/*
+	 *	Ignore any trailing data.  Unlike rad_packet_ok() we
+	 *	don't zero it, as it's in the capture buffer.
+	 */
+	packet->data_len = totallen;
+
+	packet->code = hdr[0];
+	packet->id = hdr[1];
+	memcpy(packet->vector, hdr + 4, AUTH_VECTOR_LEN);
+
+	return true;
+}
+
+/** Decode the attributes in a packet, without libradius printing its own debug output
+ *
+ */
+static int rs_decode(RADIUS_PACKET *packet, RADIUS_PACKET *original)
+{
+	int ret;
+	FILE *log_fp;
+
+	/*
+	 *	fr_log_fp is shared by all the capture threads, so they
+	 *	can't swap it out.
+	 */
+	if (conf->threads) return rad_decode(packet, original, conf->radius_secret);
+
+	log_fp = fr_log_fp;
+	fr_log_fp = NULL;
+	ret = rad_decode(packet, original, conf->radius_secret);
+	fr_log_fp = log_fp;
+
+	return ret;
+}
+
 /* This is the same as immediately scheduling the cleanup event */
 #define RS_CLEANUP_NOW(_x, _s)\
 	{\
@@ -995,6 +1260,7 @@ static inline int rs_request_to_pcap(rs_event_t *event, rs_request_t *request, s
 
 static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkthdr const *header, uint8_t const *data)
 {
+	rs_thread_t		*thread = event->thread;
 	rs_stats_t		*stats = event->stats;
 	struct timeval		elapsed = {0, 0};
 	struct timeval		latency;
@@ -1012,7 +1278,7 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 	bool			response;		/* Was it a response code */
 
 	decode_fail_t		reason;			/* Why we failed decoding the packet */
-	static uint64_t		captured = 0;
+	bool			decode;			/* Whether we need the attributes */
 
 	rs_status_t		status = RS_NORMAL;	/* Any special conditions (RTX, Unlinked, ID-Reused) */
 	RADIUS_PACKET		*current;		/* Current packet were processing */
@@ -1030,6 +1296,8 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 		rs_time_print(timestr, sizeof(timestr), &header->ts);
 	}
 
+	if (thread->ring) rs_ring_add(thread->ring, header, data);
+
 	len = fr_link_layer_offset(data, header->caplen, event->in->link_type);
 	if (len < 0) {
 		REDEBUG("Failed determining link layer header offset");
@@ -1107,7 +1375,7 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 	 *	recover once some requests timeout, so make an effort to deal
 	 *	with allocation failures gracefully.
 	 */
-	current = rad_alloc(conf, false);
+	current = rad_alloc(thread, false);
 	if (!current) {
 		REDEBUG("Failed allocating memory to hold decoded packet");
 		rs_tv_add_ms(&header->ts, conf->stats.timeout, &stats->quiet);
@@ -1140,7 +1408,35 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 	current->src_port = ntohs(udp->src);
 	current->dst_port = ntohs(udp->dst);
 
-	if (!rad_packet_ok(current, 0, &reason)) {
+	/*
+	 *	Everything up to the attributes is checked for every
+	 *	packet.  The attributes are only checked if we're going
+	 *	to decode them.
+	 */
+	if (!rs_packet_header_ok(current, &reason)) {
+		goto malformed;
+	}
+
+	switch (current->code) {
+	case PW_CODE_ACCOUNTING_RESPONSE:
+	case PW_CODE_ACCESS_REJECT:
+	case PW_CODE_ACCESS_ACCEPT:
+	case PW_CODE_ACCESS_CHALLENGE:
+	case PW_CODE_COA_NAK:
+	case PW_CODE_COA_ACK:
+	case PW_CODE_DISCONNECT_NAK:
+	case PW_CODE_DISCONNECT_ACK:
+	case PW_CODE_STATUS_CLIENT:
+		decode = conf->decode_response;
+		break;
+
+	default:
+		decode = conf->decode_request;
+		break;
+	}
+
+	if (decode && !rad_packet_ok(current, 0, &reason)) {
+	malformed:
 		REDEBUG("%s", fr_strerror());
 		if (conf->event_flags & RS_ERROR) {
 			conf->logger(count, RS_ERROR, event->in, current, &elapsed, NULL, false, false);
@@ -1163,7 +1459,7 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 	{
 		/* look for a matching request and use it for decoding */
 		search.expect = current;
-		original = rbtree_finddata(request_tree, &search);
+		original = rbtree_finddata(thread->request_tree, &search);
 
 		/*
 		 *	Verify this code is allowed
@@ -1184,14 +1480,8 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 		 *	Only decode attributes if we want to print them or filter on them
 		 *	rad_packet_ok does checks to verify the packet is actually valid.
 		 */
-		if (conf->decode_attrs) {
-			int ret;
-			FILE *log_fp = fr_log_fp;
-
-			fr_log_fp = NULL;
-			ret = rad_decode(current, original ? original->expect : NULL, conf->radius_secret);
-			fr_log_fp = log_fp;
-			if (ret != 0) {
+		if (decode) {
+			if (rs_decode(current, original ? original->expect : NULL) != 0) {
 				rad_free(&current);
 				REDEBUG("Failed decoding");
 				return;
@@ -1262,6 +1552,21 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 
 			status = RS_UNLINKED;
 			stats->exchange[current->code].interval.unlinked_total++;
+			rs_anomaly(thread, "response without request");
+		}
+
+		/*
+		 *	A burst of rejects may mean a backend has failed.
+		 */
+		if (thread->ring && conf->anomaly.rejects && (current->code == PW_CODE_ACCESS_REJECT)) {
+			if (thread->ring->reject_second != header->ts.tv_sec) {
+				thread->ring->reject_second = header->ts.tv_sec;
+				thread->ring->rejects = 0;
+			}
+
+			if (++thread->ring->rejects == (uint32_t) conf->anomaly.rejects) {
+				rs_anomaly(thread, "reject burst");
+			}
 		}
 
 		rs_response_to_pcap(event, original, header, data);
@@ -1291,15 +1596,8 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 		 *	Only decode attributes if we want to print them or filter on them
 		 *	rad_packet_ok does checks to verify the packet is actually valid.
 		 */
-		if (conf->decode_attrs) {
-			int ret;
-			FILE *log_fp = fr_log_fp;
-
-			fr_log_fp = NULL;
-			ret = rad_decode(current, NULL, conf->radius_secret);
-			fr_log_fp = log_fp;
-
-			if (ret != 0) {
+		if (decode) {
+			if (rs_decode(current, NULL) != 0) {
 				rad_free(&current);
 				REDEBUG("Failed decoding");
 				return;
@@ -1337,8 +1635,8 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 		if (search.link_vps) {
 			rs_request_t *tuple;
 
-			original = rbtree_finddata(link_tree, &search);
-			tuple = rbtree_finddata(request_tree, &search);
+			original = rbtree_finddata(thread->link_tree, &search);
+			tuple = rbtree_finddata(thread->request_tree, &search);
 
 			/*
 			 *	If the packet we matched using attributes is not the same
@@ -1352,7 +1650,7 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 		 *	Detect duplicates using the normal 5-tuple of src/dst ips/ports id
 		 */
 		} else {
-			original = rbtree_finddata(request_tree, &search);
+			original = rbtree_finddata(thread->request_tree, &search);
 			if (original && (memcmp(original->expect->vector, current->vector,
 			    sizeof(original->expect->vector)) != 0)) {
 				/*
@@ -1398,7 +1696,7 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 
 			/* Request may need to be reinserted as the 5 tuple of the response may of changed */
 			if (rs_packet_cmp(original, &search) != 0) {
-				rbtree_deletebydata(request_tree, original);
+				rbtree_deletebydata(thread->request_tree, original);
 			}
 
 			rad_free(&original->expect);
@@ -1410,11 +1708,12 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 		 *	...nope it's a new request.
 		 */
 		} else {
-			original = talloc_zero(conf, rs_request_t);
+			original = talloc_zero(thread, rs_request_t);
 			talloc_set_destructor(original, _request_free);
 
 			original->id = count;
 			original->in = event->in;
+			original->thread = thread;
 			original->stats_req = &stats->exchange[current->code];
 
 			/* Set the packet pointer to the start of the buffer*/
@@ -1435,7 +1734,7 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 				original->link_vps = search.link_vps;
 
 				/* We should never have conflicts */
-				assert(rbtree_insert(link_tree, original));
+				assert(rbtree_insert(thread->link_tree, original));
 				original->in_link_tree = true;
 			}
 
@@ -1452,7 +1751,7 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 
 		if (!original->in_request_tree) {
 			/* We should never have conflicts */
-			assert(rbtree_insert(request_tree, original));
+			assert(rbtree_insert(thread->request_tree, original));
 			original->in_request_tree = true;
 		}
 
@@ -1505,6 +1804,11 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 		rs_stats_update_latency(&stats->exchange[current->code], &latency);
 		rs_stats_update_latency(&stats->exchange[original->expect->code], &latency);
 
+		if (conf->anomaly.latency &&
+		    (((latency.tv_sec * 1000) + (latency.tv_usec / 1000)) >= conf->anomaly.latency)) {
+			rs_anomaly(thread, "high latency");
+		}
+
 		/*
 		 *	Were filtering on response, now print out the full data from the request
 		 */
@@ -1539,20 +1843,24 @@ static void rs_packet_process(uint64_t count, rs_event_t *event, struct pcap_pkt
 		rad_free(&current);
 	}
 
-	captured++;
 	/*
 	 *	We've hit our capture limit, break out of the event loop
 	 */
-	if ((conf->limit > 0) && (captured >= conf->limit)) {
-		INFO("Captured %" PRIu64 " packets, exiting...", captured);
-		fr_event_loop_exit(events, 1);
+	if ((__atomic_add_fetch(&captured, 1, __ATOMIC_RELAXED) == conf->limit) && (conf->limit > 0)) {
+		INFO("Captured %" PRIu64 " packets, exiting...", conf->limit);
+		fr_event_loop_exit(event->list, 1);
+
+		/*
+		 *	Capture threads have to tell the main thread too.
+		 */
+		if (event->list != events) rs_signal_self(SIGTERM);
 	}
 }
 
-static void rs_got_packet(UNUSED fr_event_list_t *el, int fd, void *ctx)
+static void rs_got_packet(fr_event_list_t *el, int fd, void *ctx)
 {
-	static uint64_t	count = 0;	/* Packets seen */
 	rs_event_t	*event = ctx;
+	uint64_t	*count = &event->thread->count;	/* Packets seen */
 	pcap_t		*handle = event->in->handle;
 
 	int i;
@@ -1591,9 +1899,9 @@ static void rs_got_packet(UNUSED fr_event_list_t *el, int fd, void *ctx)
 			do {
 				now = header->ts;
 			} while (fr_event_run(el, &now) == 1);
-			count++;
+			(*count)++;
 
-			rs_packet_process(count, event, header, data);
+			rs_packet_process(*count, event, header, data);
 		}
 		return;
 	}
@@ -1613,8 +1921,8 @@ static void rs_got_packet(UNUSED fr_event_list_t *el, int fd, void *ctx)
 			return;
 		}
 
-		count++;
-		rs_packet_process(count, event, header, data);
+		(*count)++;
+		rs_packet_process(*count, event, header, data);
 	}
 }
 
@@ -1772,6 +2080,100 @@ static void _unmark_link(void *request)
 	this->in_link_tree = false;
 }
 
+/** Allocate the capture and correlation state for a thread
+ *
+ * @param ctx to allocate the state in.  All the requests the thread sees are allocated
+ *	in the state, so this must not be shared with any other thread.
+ * @param number of the thread.
+ * @return new state, or NULL on error.
+ */
+static rs_thread_t *rs_thread_alloc(TALLOC_CTX *ctx, int number)
+{
+	rs_thread_t *thread;
+
+	thread = talloc_zero(ctx, rs_thread_t);
+	if (!thread) {
+		ERROR("Failed allocating thread state");
+		return NULL;
+	}
+	thread->number = number;
+
+	thread->request_tree = rbtree_create(thread, (rbcmp) rs_packet_cmp, _unmark_request, 0);
+	if (!thread->request_tree) {
+		ERROR("Failed creating request tree");
+	error:
+		talloc_free(thread);
+		return NULL;
+	}
+
+	if (conf->link_da_num > 0) {
+		thread->link_tree = rbtree_create(thread, (rbcmp) rs_rtx_cmp, _unmark_link, 0);
+		if (!thread->link_tree) {
+			ERROR("Failed creating RTX tree");
+			goto error;
+		}
+	}
+
+	return thread;
+}
+
+#ifdef RS_WITH_THREADS
+/** Hand the stats counted since the last call over to the main thread
+ *
+ * This is the only time a capture thread takes a lock, and it's every
+ * RS_THREAD_PUBLISH ms, not every packet.  It's also where the thread
+ * notices that it's been asked to stop.
+ */
+static void rs_thread_publish(void *ctx)
+{
+	rs_thread_t	*thread = ctx;
+	struct timeval	now, when;
+
+	pthread_mutex_lock(&thread->mutex);
+	rs_stats_merge(thread->published, thread->stats);
+	pthread_mutex_unlock(&thread->mutex);
+
+	if (__atomic_load_n(&thread->exit, __ATOMIC_ACQUIRE)) {
+		fr_event_loop_exit(thread->list, 1);
+		return;
+	}
+
+	gettimeofday(&now, NULL);
+	rs_tv_add_ms(&now, RS_THREAD_PUBLISH, &when);
+	if (!fr_event_insert(thread->list, rs_thread_publish, thread, &when, &thread->publish)) {
+		ERROR("Failed inserting stats publishing event for thread %i", thread->number);
+	}
+}
+
+static void *rs_thread_main(void *arg)
+{
+	rs_thread_t	*thread = arg;
+	sigset_t	set;
+
+	/*
+	 *	Signals are handled by the main thread.
+	 */
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	DEBUG2("Capture thread %i started", thread->number);
+
+	rs_thread_publish(thread);
+	fr_event_loop(thread->list);
+
+	/*
+	 *	Publish anything counted since the last timer fired.
+	 */
+	pthread_mutex_lock(&thread->mutex);
+	rs_stats_merge(thread->published, thread->stats);
+	pthread_mutex_unlock(&thread->mutex);
+
+	DEBUG2("Capture thread %i exiting", thread->number);
+
+	return NULL;
+}
+#endif
+
 #ifdef HAVE_COLLECTDC_H
 /** Re-open the collectd socket
  *
@@ -1856,6 +2258,9 @@ static void NEVER_RETURNS usage(int status)
 	fprintf(output, "Usage: radsniff [options][stats options] -- [pcap files]\n");
 	fprintf(output, "options:\n");
 	fprintf(output, "  -a                    List all interfaces available for capture.\n");
+	fprintf(output, "  -A <file>             Keep recent packets in memory, and write them to file when there's\n");
+	fprintf(output, "                        an anomaly (a response without a request, or see -j and -M).\n");
+	fprintf(output, "  -B <packets>          Number of packets to keep for -A (defaults to %i).\n", RS_ANOMALY_RING);
 	fprintf(output, "  -c <count>            Number of packets to capture.\n");
 	fprintf(output, "  -C                    Enable UDP checksum validation.\n");
 	fprintf(output, "  -d <directory>        Set dictionary directory.\n");
@@ -1873,9 +2278,11 @@ static void NEVER_RETURNS usage(int status)
 	fprintf(output, "  -h                    This help message.\n");
 	fprintf(output, "  -i <interface>        Capture packets from interface (defaults to all if supported).\n");
 	fprintf(output, "  -I <file>             Read packets from file (overrides input of -F).\n");
+	fprintf(output, "  -j <rejects>          With -A, this many Access-Rejects in a second is an anomaly.\n");
 	fprintf(output, "  -l <attr>[,<attr>]    Output packet sig and a list of attributes.\n");
 	fprintf(output, "  -L <attr>[,<attr>]    Detect retransmissions using these attributes to link requests.\n");
 	fprintf(output, "  -m                    Don't put interface(s) into promiscuous mode.\n");
+	fprintf(output, "  -M <ms>               With -A, a response taking this long is an anomaly.\n");
 	fprintf(output, "  -p <port>             Filter packets by port (default is 1812).\n");
 	fprintf(output, "  -P <pidfile>          Daemonize and write out <pidfile>.\n");
 	fprintf(output, "  -q                    Print less debugging information.\n");
@@ -1883,6 +2290,7 @@ static void NEVER_RETURNS usage(int status)
 	fprintf(output, "  -R <filter>           RADIUS attribute response filter.\n");
 	fprintf(output, "  -s <secret>           RADIUS secret.\n");
 	fprintf(output, "  -S                    Write PCAP data to stdout.\n");
+	fprintf(output, "  -t <threads>          Capture from live interfaces with this many threads.\n");
 	fprintf(output, "  -v                    Show program version information.\n");
 	fprintf(output, "  -w <file>             Write output packets to file.\n");
 	fprintf(output, "  -x                    Print more debugging information.\n");
@@ -1916,6 +2324,9 @@ int main(int argc, char *argv[])
 
 	rs_stats_t stats;
 
+	rs_thread_t *threads[RS_THREADS_MAX];		/* Capture and correlation state, one per thread */
+	int t;
+
 	fr_debug_flag = 1;
 	fr_log_fp = stdout;
 
@@ -1965,7 +2376,7 @@ int main(int argc, char *argv[])
 	/*
 	 *  Get options
 	 */
-	while ((opt = getopt(argc, argv, "ab:c:Cd:D:e:Ff:hi:I:l:L:mp:P:qr:R:s:Svw:xXW:T:P:N:O:")) != EOF) {
+	while ((opt = getopt(argc, argv, "aA:b:B:c:Cd:D:e:Ff:hi:I:j:l:L:mM:p:P:qr:R:s:St:vw:xXW:T:P:N:O:")) != EOF) {
 		switch (opt) {
 		case 'a':
 		{
@@ -1987,6 +2398,18 @@ int main(int argc, char *argv[])
 			goto finish;
 		}
 
+		case 'A':
+			conf->anomaly.file = optarg;
+			break;
+
+		case 'B':
+			conf->anomaly.size = atoi(optarg);
+			if (conf->anomaly.size <= 0) {
+				ERROR("Invalid anomaly buffer length \"%s\"", optarg);
+				usage(64);
+			}
+			break;
+
 		/* super secret option */
 		case 'b':
 			conf->buffer_pkts = atoi(optarg);
@@ -2049,6 +2472,14 @@ int main(int argc, char *argv[])
 			conf->from_file = true;
 			break;
 
+		case 'j':
+			conf->anomaly.rejects = atoi(optarg);
+			if (conf->anomaly.rejects <= 0) {
+				ERROR("Invalid number of rejects \"%s\"", optarg);
+				usage(64);
+			}
+			break;
+
 		case 'l':
 			conf->list_attributes = optarg;
 			break;
@@ -2061,6 +2492,14 @@ int main(int argc, char *argv[])
 			conf->promiscuous = false;
 			break;
 
+		case 'M':
+			conf->anomaly.latency = atoi(optarg);
+			if (conf->anomaly.latency <= 0) {
+				ERROR("Invalid latency \"%s\"", optarg);
+				usage(64);
+			}
+			break;
+
 		case 'p':
 			port = atoi(optarg);
 			break;
@@ -2092,6 +2531,14 @@ int main(int argc, char *argv[])
 			conf->to_stdout = true;
 			break;
 
+		case 't':
+			conf->threads = atoi(optarg);
+			if ((conf->threads <= 0) || (conf->threads > RS_THREADS_MAX)) {
+				ERROR("Number of threads must be between 1 and %i", RS_THREADS_MAX);
+				usage(64);
+			}
+			break;
+
 		case 'v':
 #ifdef HAVE_COLLECTDC_H
 			INFO("%s, %s, collectdclient version %s", radsniff_version, pcap_lib_version(),
@@ -2192,6 +2639,41 @@ int main(int argc, char *argv[])
 		conf->to_stdout = false;
 	}
 
+	if ((conf->anomaly.size || conf->anomaly.latency || conf->anomaly.rejects) && !conf->anomaly.file) {
+		ERROR("-B, -j and -M need an anomaly capture file (-A)");
+		usage(64);
+	}
+
+	if (conf->anomaly.file) {
+		if (!conf->anomaly.size) conf->anomaly.size = RS_ANOMALY_RING;
+
+		conf->anomaly.out = fr_pcap_init(conf, conf->anomaly.file, PCAP_FILE_OUT);
+		if (!conf->anomaly.out) {
+			ERROR("Failed creating pcap file \"%s\"", conf->anomaly.file);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	/*
+	 *	Capture threads each read their share of the packets from
+	 *	live interfaces, and there's only one output file.
+	 */
+	if (conf->threads) {
+#ifndef RS_WITH_THREADS
+		ERROR("Capture threads (-t) are not supported on this platform");
+		usage(64);
+#endif
+		if (conf->from_file || conf->from_stdin) {
+			ERROR("Capture threads (-t) can only be used with live interfaces");
+			usage(64);
+		}
+
+		if (conf->to_file || conf->to_stdout) {
+			ERROR("Capture threads (-t) can't be used when writing PCAP data");
+			usage(64);
+		}
+	}
+
 	if (conf->to_stdout) {
 		out = fr_pcap_init(conf, "stdout", PCAP_STDIO_OUT);
 		if (!out) {
@@ -2271,12 +2753,6 @@ int main(int argc, char *argv[])
 		if (conf->link_da_num < 0) {
 			usage(64);
 		}
-
-		link_tree = rbtree_create(conf, (rbcmp) rs_rtx_cmp, _unmark_link, 0);
-		if (!link_tree) {
-			ERROR("Failed creating RTX tree");
-			goto finish;
-		}
 	}
 
 	if (conf->filter_request) {
@@ -2326,20 +2802,44 @@ int main(int argc, char *argv[])
 	 *	or print the packet contents, we need to decode the attributes.
 	 *
 	 *	But, if were just logging requests, or graphing packets, we don't need to decode
-	 *	attributes.
+	 *	attributes, and the packets are processed using only their headers.  Requests
+	 *	and responses are decided separately, so that e.g. a request filter doesn't
+	 *	mean every response is decoded too.
 	 */
-	if (conf->list_da_num || conf->link_da_num || conf->filter_response_vps || conf->filter_request_vps ||
-	    conf->print_packet) {
-		conf->decode_attrs = true;
+	if (conf->list_da_num || conf->print_packet) {
+		conf->decode_request = true;
+		conf->decode_response = true;
+	}
+	if (conf->link_da_num || conf->filter_request_vps) {
+		conf->decode_request = true;
+	}
+	if (conf->filter_response_vps) {
+		conf->decode_response = true;
+	}
+
+	if (!conf->decode_request || !conf->decode_response) {
+		DEBUG("Processing %s%s%s using only the RADIUS header",
+		      !conf->decode_request ? "requests" : "",
+		      (!conf->decode_request && !conf->decode_response) ? " and " : "",
+		      !conf->decode_response ? "responses" : "");
 	}
 
 	/*
-	 *	Setup the request tree
+	 *	Setup the request trees.  Without -t there's one set, used by the main thread.
 	 */
-	request_tree = rbtree_create(conf, (rbcmp) rs_packet_cmp, _unmark_request, 0);
-	if (!request_tree) {
-		ERROR("Failed creating request tree");
-		goto finish;
+	for (t = 0; t < (conf->threads ? conf->threads : 1); t++) {
+		threads[t] = rs_thread_alloc(conf, t);
+		if (!threads[t]) {
+			goto finish;
+		}
+
+		if (conf->anomaly.file) {
+			threads[t]->ring = rs_ring_alloc(threads[t], conf->anomaly.size);
+			if (!threads[t]->ring) {
+				ERROR("Failed allocating anomaly buffer");
+				goto finish;
+			}
+		}
 	}
 
 	/*
@@ -2480,33 +2980,101 @@ int main(int argc, char *argv[])
 		/* Clear any irrelevant errors */
 		fr_strerror();
 	}
+	threads[0]->in = in;
 
 	/*
-	 *	Open our output interface (if we have one);
+	 *	Each capture thread needs its own handle on every interface.
+	 *	The handles on an interface form a fanout group, so the kernel
+	 *	shares the packets out between the threads by flow.
 	 */
-	if (out) {
-		out->link_type = -1;	/* Infer output link type from input */
+	if (conf->threads) {
+		int j;
+		uint16_t group;
 
-		for (in_p = in;
+		for (in_p = in, j = 0;
 		     in_p;
-		     in_p = in_p->next) {
-			if (out->link_type < 0) {
-				out->link_type = in_p->link_type;
-				continue;
-			}
+		     in_p = in_p->next, j++) {
+			group = (getpid() + j) & 0xffff;
 
-			if (out->link_type != in_p->link_type) {
-				ERROR("Asked to write to output file, but inputs do not have the same link type");
-				ret = 64;
+			if (fr_pcap_fanout(in_p, group) < 0) {
+				ERROR("%s", fr_strerror());
 				goto finish;
 			}
 		}
 
-		assert(out->link_type >= 0);
+		for (t = 1; t < conf->threads; t++) {
+			fr_pcap_t **tail = &threads[t]->in;
 
-		if (fr_pcap_open(out) < 0) {
-			ERROR("Failed opening pcap output (%s): %s", out->name, fr_strerror());
-			goto finish;
+			for (in_p = in, j = 0;
+			     in_p;
+			     in_p = in_p->next, j++) {
+				group = (getpid() + j) & 0xffff;
+
+				*tail = fr_pcap_init(threads[t], in_p->name, PCAP_INTERFACE_IN);
+				if (!*tail) {
+					ERROR("Failed allocating pcap handle");
+					goto finish;
+				}
+				(*tail)->promiscuous = conf->promiscuous;
+				(*tail)->buffer_pkts = conf->buffer_pkts;
+
+				if (fr_pcap_open(*tail) < 0) {
+					ERROR("Failed opening pcap handle (%s): %s", in_p->name, fr_strerror());
+					goto finish;
+				}
+
+				if (conf->pcap_filter && (fr_pcap_apply_filter(*tail, conf->pcap_filter) < 0)) {
+					ERROR("Failed applying filter");
+					goto finish;
+				}
+
+				if (fr_pcap_fanout(*tail, group) < 0) {
+					ERROR("%s", fr_strerror());
+					goto finish;
+				}
+
+				tail = &(*tail)->next;
+			}
+		}
+
+		INFO("Capturing with %i threads", conf->threads);
+	}
+
+	/*
+	 *	Open our output interface (if we have one), and the anomaly capture file;
+	 */
+	{
+		fr_pcap_t *outputs[] = { out, conf->anomaly.out };
+		size_t j;
+
+		for (j = 0; j < (sizeof(outputs) / sizeof(*outputs)); j++) {
+			fr_pcap_t *out_p = outputs[j];
+
+			if (!out_p) continue;
+
+			out_p->link_type = -1;	/* Infer output link type from input */
+
+			for (in_p = in;
+			     in_p;
+			     in_p = in_p->next) {
+				if (out_p->link_type < 0) {
+					out_p->link_type = in_p->link_type;
+					continue;
+				}
+
+				if (out_p->link_type != in_p->link_type) {
+					ERROR("Asked to write to output file, but inputs do not have the same link type");
+					ret = 64;
+					goto finish;
+				}
+			}
+
+			assert(out_p->link_type >= 0);
+
+			if (fr_pcap_open(out_p) < 0) {
+				ERROR("Failed opening pcap output (%s): %s", out_p->name, fr_strerror());
+				goto finish;
+			}
 		}
 	}
 
@@ -2542,23 +3110,51 @@ int main(int argc, char *argv[])
 		}
 
 		/*
-		 *  Now add fd's for each of the pcap sessions we opened
+		 *  Without -t the main event loop reads the packets.
 		 */
-		for (in_p = in;
-		     in_p;
-		     in_p = in_p->next) {
-			rs_event_t *event;
-
-			event = talloc_zero(events, rs_event_t);
-			event->list = events;
-			event->in = in_p;
-			event->out = out;
-			event->stats = &stats;
+		if (!conf->threads) {
+			threads[0]->list = events;
+			threads[0]->stats = &stats;
+		}
 
-			if (!fr_event_fd_insert(events, 0, in_p->fd, rs_got_packet, event)) {
-				ERROR("Failed inserting file descriptor");
+#ifdef RS_WITH_THREADS
+		/*
+		 *  Otherwise each capture thread has its own event loop and
+		 *  counters, which are merged by rs_stats_process().
+		 */
+		for (t = 0; t < conf->threads; t++) {
+			threads[t]->list = fr_event_list_create(threads[t], NULL);
+			threads[t]->stats = talloc_zero(threads[t], rs_stats_t);
+			threads[t]->published = talloc_zero(threads[t], rs_stats_t);
+			if (!threads[t]->list || !threads[t]->stats || !threads[t]->published) {
+				ERROR("Failed allocating capture thread state");
 				goto finish;
 			}
+			pthread_mutex_init(&threads[t]->mutex, NULL);
+		}
+#endif
+
+		/*
+		 *  Now add fd's for each of the pcap sessions we opened
+		 */
+		for (t = 0; t < (conf->threads ? conf->threads : 1); t++) {
+			for (in_p = threads[t]->in;
+			     in_p;
+			     in_p = in_p->next) {
+				rs_event_t *event;
+
+				event = talloc_zero(threads[t], rs_event_t);
+				event->list = threads[t]->list;
+				event->in = in_p;
+				event->out = out;
+				event->stats = threads[t]->stats;
+				event->thread = threads[t];
+
+				if (!fr_event_fd_insert(threads[t]->list, 0, in_p->fd, rs_got_packet, event)) {
+					ERROR("Failed inserting file descriptor");
+					goto finish;
+				}
+			}
 		}
 
 		buff = fr_pcap_device_names(conf, in, ' ');
@@ -2576,6 +3172,8 @@ int main(int argc, char *argv[])
 			update.list = events;
 			update.stats = &stats;
 			update.in = in;
+			update.threads = threads;
+			update.num_threads = conf->threads;
 
 			now.tv_sec += conf->stats.interval;
 			now.tv_usec = 0;
@@ -2607,8 +3205,38 @@ int main(int argc, char *argv[])
 	fr_set_signal(SIGQUIT, rs_signal_self);
 #endif
 
+#ifdef RS_WITH_THREADS
+	/*
+	 *	Start the capture threads.  This has to be done after
+	 *	daemonizing, as threads don't survive a fork.
+	 */
+	if (conf->threads) {
+		gettimeofday(&start_pcap, NULL);
+
+		for (t = 0; t < conf->threads; t++) {
+			int rcode;
+
+			rcode = pthread_create(&threads[t]->pthread_id, NULL, rs_thread_main, threads[t]);
+			if (rcode != 0) {
+				ERROR("Failed creating capture thread: %s", fr_syserror(rcode));
+				conf->threads = t;
+				goto stop_threads;
+			}
+		}
+	}
+#endif
+
 	fr_event_loop(events);	/* Enter the main event loop */
 
+#ifdef RS_WITH_THREADS
+	stop_threads:
+	for (t = 0; t < conf->threads; t++) {
+		__atomic_store_n(&threads[t]->exit, true, __ATOMIC_RELEASE);
+		pthread_join(threads[t]->pthread_id, NULL);
+		pthread_mutex_destroy(&threads[t]->mutex);
+	}
+#endif
+
 	DEBUG("Done sniffing");
 
 	finish:
@@ -25,6 +25,7 @@
 RCSID("$Id$")
 
 #include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/modules.h>
 #include <freeradius-devel/sysutmp.h>
 #include <freeradius-devel/radutmp.h>
 
@@ -79,6 +80,27 @@ pid_t rad_waitpid(pid_t pid, int *status)
 }
 #endif
 
+int thread_pool_wait_fd(int fd, struct timeval const *timeout)
+{
+	fd_set fds;
+	struct timeval wake;
+
+	FD_ZERO(&fds);
+	FD_SET(fd, &fds);
+	if (timeout) wake = *timeout;
+
+	return select(fd + 1, &fds, NULL, NULL, timeout ? &wake : NULL);
+}
+
+void thread_pool_yield_block(UNUSED bool block)
+{
+}
+
+int module_yield(UNUSED REQUEST *request, int fd, struct timeval const *timeout)
+{
+	return thread_pool_wait_fd(fd, timeout);
+}
+
 struct radutmp_config_t {
   char const *radutmp_fn;
 } radutmpconfig;
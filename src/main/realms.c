@@ -45,9 +45,43 @@ typedef struct realm_regex realm_regex_t;
 struct realm_regex {
 	REALM		*realm;		//!< The realm this regex matches.
 	regex_t		reg;		//!< The pre-compiled regular expression.
+	uint32_t	number;		//!< Position in the configuration.  Earlier regexes win.
+	bool		suffix;		//!< Matched via the suffix trie, not regexec().
 	realm_regex_t	*next;		//!< The next realm in the list of regular expressions.
+	realm_regex_t	*next_regex;	//!< The next realm which has to be matched with regexec().
 };
 static realm_regex_t *realms_regex = NULL;
+static realm_regex_t **realms_regex_tail = &realms_regex;
+static realm_regex_t *realms_regex_slow = NULL;
+static realm_regex_t **realms_regex_slow_tail = &realms_regex_slow;
+static uint32_t realms_regex_count = 0;
+
+/** How a suffix-style regex realm matches a name
+ *
+ */
+typedef enum realm_suffix_type {
+	REALM_SUFFIX_ANY = 0,		//!< "foo\.com$", the name ends with the suffix.
+	REALM_SUFFIX_DOMAIN,		//!< "^(.*\.)?foo\.com$", the suffix is a whole label.
+	REALM_SUFFIX_EXACT,		//!< "^foo\.com$", the name is the suffix.
+	REALM_SUFFIX_MAX
+} realm_suffix_type_t;
+
+typedef struct realm_trie realm_trie_t;
+
+/** Node in a trie of the reversed suffixes of regex realms
+ *
+ * Most regex realms are of the form "~(.*\.)?example\.com$".  Instead of
+ * running regexec() against each of them in turn, their literal suffixes
+ * are inserted (reversed, and lower-cased) into a trie, which is then
+ * walked once from the end of the name.
+ */
+struct realm_trie {
+	char		c;		//!< Character this node matches.
+	realm_trie_t	*child;		//!< First node for the previous character in the name.
+	realm_trie_t	*next;		//!< Next sibling.
+	realm_regex_t	*match[REALM_SUFFIX_MAX]; //!< Realms whose suffix ends here.
+};
+static realm_trie_t *realms_trie = NULL;
 #endif /* HAVE_REGEX */
 
 struct realm_config {
@@ -250,11 +284,27 @@ void realms_free(void)
 
 	rbtree_free(home_pools_byname);
 	home_pools_byname = NULL;
+
+	cluster_free();
 #endif
 
 	rbtree_free(realms_byname);
 	realms_byname = NULL;
 
+#ifdef HAVE_REGEX
+	/*
+	 *	The regexes themselves are parented by their realms.
+	 */
+	realms_regex = NULL;
+	realms_regex_tail = &realms_regex;
+	realms_regex_slow = NULL;
+	realms_regex_slow_tail = &realms_regex_slow;
+	realms_regex_count = 0;
+
+	talloc_free(realms_trie);
+	realms_trie = NULL;
+#endif
+
 	realm_pool_free(NULL);
 
 	talloc_free(realm_config);
@@ -264,10 +314,12 @@ void realms_free(void)
 
 #ifdef WITH_PROXY
 static CONF_PARSER limit_config[] = {
+	{ "min_connections", FR_CONF_OFFSET(PW_TYPE_INTEGER, home_server_t, limit.min_connections), "0" },
 	{ "max_connections", FR_CONF_OFFSET(PW_TYPE_INTEGER, home_server_t, limit.max_connections), "16" },
 	{ "max_requests", FR_CONF_OFFSET(PW_TYPE_INTEGER, home_server_t, limit.max_requests), "0" },
 	{ "lifetime", FR_CONF_OFFSET(PW_TYPE_INTEGER, home_server_t, limit.lifetime), "0" },
 	{ "idle_timeout", FR_CONF_OFFSET(PW_TYPE_INTEGER, home_server_t, limit.idle_timeout), "0" },
+	{ "keepalive", FR_CONF_OFFSET(PW_TYPE_INTEGER, home_server_t, limit.keepalive), "0" },
 
 	{ NULL, -1, 0, NULL, NULL }		/* end the list */
 };
@@ -311,6 +363,8 @@ static CONF_PARSER home_server_config[] = {
 	{ "src_ipaddr", FR_CONF_POINTER(PW_TYPE_STRING, &hs_srcipaddr), NULL },
 
 	{ "response_window", FR_CONF_OFFSET(PW_TYPE_TIMEVAL, home_server_t, response_window), "30" },
+	{ "adaptive_response_window", FR_CONF_OFFSET(PW_TYPE_BOOLEAN, home_server_t, adaptive_response_window), "no" },
+	{ "min_response_window", FR_CONF_OFFSET(PW_TYPE_TIMEVAL, home_server_t, min_response_window), "1" },
 	{ "response_timeouts", FR_CONF_OFFSET(PW_TYPE_INTEGER, home_server_t, max_response_timeouts), "1" },
 	{ "max_outstanding", FR_CONF_OFFSET(PW_TYPE_INTEGER, home_server_t, max_outstanding), "65536" },
 
@@ -326,6 +380,9 @@ static CONF_PARSER home_server_config[] = {
 
 	{ "num_answers_to_alive", FR_CONF_OFFSET(PW_TYPE_INTEGER, home_server_t, num_pings_to_alive), "3" },
 	{ "revive_interval", FR_CONF_OFFSET(PW_TYPE_INTEGER, home_server_t, revive_interval), "300" },
+	{ "bfd", FR_CONF_OFFSET(PW_TYPE_BOOLEAN, home_server_t, bfd), "no" },
+
+	{ "coalesce_key", FR_CONF_OFFSET(PW_TYPE_STRING | PW_TYPE_XLAT, home_server_t, coalesce_key), NULL },
 
 	{ "username", FR_CONF_OFFSET(PW_TYPE_STRING, home_server_t, ping_user_name), NULL },
 	{ "password", FR_CONF_OFFSET(PW_TYPE_STRING, home_server_t, ping_user_password), NULL },
@@ -369,12 +426,20 @@ void realm_home_server_sanitize(home_server_t *home, CONF_SECTION *cs)
 	FR_INTEGER_BOUND_CHECK("response_timeouts", home->max_response_timeouts, >=, 1);
 	FR_INTEGER_BOUND_CHECK("response_timeouts", home->max_response_timeouts, <=, 1000);
 
+	if (home->adaptive_response_window) {
+		FR_TIMEVAL_BOUND_CHECK("min_response_window", &home->min_response_window, >=, 0, 10000);
+		FR_TIMEVAL_BOUND_CHECK("min_response_window", &home->min_response_window, <=,
+				       home->response_window.tv_sec, home->response_window.tv_usec);
+	} else {
+		home->min_response_window = home->response_window;
+	}
+
 	/*
 	 *	Track the minimum response window, so that we can
 	 *	correctly set the timers in process.c
 	 */
-	if (timercmp(&main_config.init_delay, &home->response_window, >)) {
-		main_config.init_delay = home->response_window;
+	if (timercmp(&main_config.init_delay, &home->min_response_window, >)) {
+		main_config.init_delay = home->min_response_window;
 	}
 
 	FR_INTEGER_BOUND_CHECK("zombie_period", home->zombie_period, >=, 1);
@@ -403,14 +468,32 @@ void realm_home_server_sanitize(home_server_t *home, CONF_SECTION *cs)
 #endif
 
 	FR_INTEGER_BOUND_CHECK("max_connections", home->limit.max_connections, <=, 1024);
+	FR_INTEGER_BOUND_CHECK("min_connections", home->limit.min_connections, <=, 32);
 
 #ifdef WITH_TCP
 	/*
-	 *	UDP sockets can't be connection limited.
+	 *	UDP sockets aren't limited unless the administrator
+	 *	asked for it.  The default is for TCP.
 	 */
-	if (home->proto != IPPROTO_TCP) home->limit.max_connections = 0;
+	if (home->proto != IPPROTO_TCP) {
+		CONF_SECTION *limit = cs ? cf_section_sub_find(cs, "limit") : NULL;
+
+		if (!limit || !cf_pair_find(limit, "max_connections")) home->limit.max_connections = 0;
+	}
 #endif
 
+	if (home->limit.max_connections &&
+	    (home->limit.min_connections > home->limit.max_connections)) {
+		WARN("Ignoring \"min_connections = %u\", forcing to \"min_connections = %u\"",
+		     home->limit.min_connections, home->limit.max_connections);
+		home->limit.min_connections = home->limit.max_connections;
+	}
+
+	/*
+	 *	Virtual servers don't have sockets.
+	 */
+	if (home->server) home->limit.min_connections = 0;
+
 	if ((home->limit.idle_timeout > 0) && (home->limit.idle_timeout < 5))
 		home->limit.idle_timeout = 5;
 	if ((home->limit.lifetime > 0) && (home->limit.lifetime < 5))
@@ -418,6 +501,23 @@ void realm_home_server_sanitize(home_server_t *home, CONF_SECTION *cs)
 	if ((home->limit.lifetime > 0) && (home->limit.idle_timeout > home->limit.lifetime))
 		home->limit.idle_timeout = 0;
 
+	/*
+	 *	Keepalives are sent on each connection, so they're
+	 *	only for TCP.  The previous one has to have timed out
+	 *	before the next is sent.
+	 */
+	if (home->limit.keepalive > 0) {
+#ifdef WITH_TCP
+		if (home->proto == IPPROTO_TCP) {
+			FR_INTEGER_BOUND_CHECK("keepalive", home->limit.keepalive, >=, home->ping_timeout + 1);
+		} else
+#endif
+		{
+			WARN("Ignoring \"keepalive\", it is only used with TCP");
+			home->limit.keepalive = 0;
+		}
+	}
+
 	/*
 	 *	Make sure that this is set.
 	 */
@@ -488,6 +588,7 @@ static int home_server_add(realm_config_t *rc, CONF_SECTION *cs)
 	home->name = name2;
 	home->cs = cs;
 	home->state = HOME_STATE_UNKNOWN;
+	home->bfd_up = true;	/* until BFD says otherwise */
 
 	/*
 	 *	Last packet sent / received are zero.
@@ -1045,6 +1146,10 @@ static int server_pool_add(realm_config_t *rc,
 			{ "client-balance", HOME_POOL_CLIENT_BALANCE },
 			{ "client-port-balance", HOME_POOL_CLIENT_PORT_BALANCE },
 			{ "keyed-balance", HOME_POOL_KEYED_BALANCE },
+			{ "least-latency", HOME_POOL_LEAST_LATENCY },
+			{ "least_latency", HOME_POOL_LEAST_LATENCY },
+			{ "consistent-hash", HOME_POOL_CONSISTENT_HASH },
+			{ "consistent_hash", HOME_POOL_CONSISTENT_HASH },
 			{ NULL, 0 }
 		};
 
@@ -1775,6 +1880,133 @@ static int _realm_regex_free(realm_regex_t *rr)
 	regfree(&(rr->reg));
 	return 0;
 }
+
+/** See if a regex is a literal suffix match
+ *
+ * Recognises an optional '^', an optional ".*", "(.*\\.)", "(.*\\.)?" or
+ * "(.*\\.)*" prefix, a literal made of alphanumerics, '-', '_', '@' and escaped
+ * punctuation, and a trailing '$'.
+ *
+ * @param[out] out Where to write the lower-cased literal suffix.
+ * @param[in] outlen Size of the output buffer.
+ * @param[out] type How the suffix matches.
+ * @param[in] p The regex, without the leading '~'.
+ * @return true if the regex can be matched with the suffix trie, else false.
+ */
+static bool realm_regex_suffix(char *out, size_t outlen, realm_suffix_type_t *type, char const *p)
+{
+	bool anchored = false, domain = false, any = false;
+	char *q = out, *end = out + outlen - 1;
+
+	if (*p == '^') {
+		anchored = true;
+		p++;
+	}
+
+	if ((strncmp(p, "(.*\\.)?", 7) == 0) || (strncmp(p, "(.*\\.)*", 7) == 0)) {
+		domain = true;
+		p += 7;
+	} else if (strncmp(p, "(.*\\.)", 6) == 0) {
+		any = true;
+		*q++ = '.';
+		p += 6;
+	} else if (strncmp(p, ".*", 2) == 0) {
+		any = true;
+		p += 2;
+	}
+
+	while (*p && (*p != '$')) {
+		if (q >= end) return false;
+
+		if (*p == '\\') {
+			p++;
+			if (!*p || isalnum((uint8_t) *p)) return false;	/* \w, \b, etc. */
+		} else if (!isalnum((uint8_t) *p) && (*p != '-') && (*p != '_') && (*p != '@')) {
+			return false;
+		}
+
+		*q++ = tolower((uint8_t) *p++);
+	}
+
+	if ((q == out) || (p[0] != '$') || (p[1] != '\0')) return false;
+	*q = '\0';
+
+	/*
+	 *	Without '^' the regex can start matching anywhere,
+	 *	so any prefix is as good as none.
+	 */
+	if (!anchored || any) {
+		*type = REALM_SUFFIX_ANY;
+	} else if (domain) {
+		*type = REALM_SUFFIX_DOMAIN;
+	} else {
+		*type = REALM_SUFFIX_EXACT;
+	}
+
+	return true;
+}
+
+/** Add a suffix-style regex realm to the trie
+ *
+ */
+static void realm_trie_add(realm_regex_t *rr, char const *suffix, realm_suffix_type_t type)
+{
+	char const *p;
+	realm_trie_t *node;
+
+	if (!realms_trie) realms_trie = talloc_zero(NULL, realm_trie_t);
+	node = realms_trie;
+
+	for (p = suffix + strlen(suffix); p > suffix; p--) {
+		realm_trie_t *child;
+
+		for (child = node->child; child && (child->c != p[-1]); child = child->next);
+		if (!child) {
+			child = talloc_zero(realms_trie, realm_trie_t);
+			child->c = p[-1];
+			child->next = node->child;
+			node->child = child;
+		}
+		node = child;
+	}
+
+	/*
+	 *	Duplicate patterns only ever match the first one.
+	 */
+	if (!node->match[type]) node->match[type] = rr;
+}
+
+#define REALM_TRIE_BEST(_x) if ((_x) && (!best || ((_x)->number < best->number))) best = (_x)
+
+/** Find the first (in configuration order) suffix-style regex realm matching a name
+ *
+ */
+static realm_regex_t *realm_trie_find(char const *name)
+{
+	size_t i;
+	realm_trie_t *node = realms_trie;
+	realm_regex_t *best = NULL;
+
+	if (!node) return NULL;
+
+	for (i = strlen(name); i > 0; i--) {
+		char c = tolower((uint8_t) name[i - 1]);
+
+		for (node = node->child; node && (node->c != c); node = node->next);
+		if (!node) break;
+
+		REALM_TRIE_BEST(node->match[REALM_SUFFIX_ANY]);
+
+		if (i == 1) {
+			REALM_TRIE_BEST(node->match[REALM_SUFFIX_DOMAIN]);
+			REALM_TRIE_BEST(node->match[REALM_SUFFIX_EXACT]);
+		} else if (name[i - 2] == '.') {
+			REALM_TRIE_BEST(node->match[REALM_SUFFIX_DOMAIN]);
+		}
+	}
+
+	return best;
+}
 int realm_realm_add(REALM *r, CONF_SECTION *cs)
 #else
 int realm_realm_add(REALM *r, UNUSED CONF_SECTION *cs)
@@ -1796,7 +2028,9 @@ int realm_realm_add(REALM *r, UNUSED CONF_SECTION *cs)
 	 */
 	if (r->name[0] == '~') {
 		int rcode;
-		realm_regex_t *rr, **last;
+		realm_regex_t *rr;
+		realm_suffix_type_t type;
+		char suffix[256];
 
 		rr = talloc(r, realm_regex_t);
 		talloc_set_destructor(rr, _realm_regex_free);
@@ -1814,13 +2048,22 @@ int realm_realm_add(REALM *r, UNUSED CONF_SECTION *cs)
 			return 0;
 		}
 
-		last = &realms_regex;
-		while (*last) last = &((*last)->next);  /* O(N^2)... sue me. */
-
 		rr->realm = r;
+		rr->number = realms_regex_count++;
 		rr->next = NULL;
+		rr->next_regex = NULL;
+
+		*realms_regex_tail = rr;
+		realms_regex_tail = &rr->next;
+
+		rr->suffix = realm_regex_suffix(suffix, sizeof(suffix), &type, r->name + 1);
+		if (rr->suffix) {
+			realm_trie_add(rr, suffix, type);
+			return 1;
+		}
 
-		*last = rr;
+		*realms_regex_slow_tail = rr;
+		realms_regex_slow_tail = &rr->next_regex;
 		return 1;
 	}
 #endif
@@ -1910,6 +2153,11 @@ int realms_init(CONF_SECTION *config)
 			ERROR("Failed parsing proxy section");
 			goto error;
 		}
+
+		if (cluster_init(cs) < 0) {
+			ERROR("Failed parsing cluster section");
+			goto error;
+		}
 	} else {
 		rc->dead_time = DEAD_TIME;
 		rc->retry_count = RETRY_COUNT;
@@ -2025,7 +2273,7 @@ REALM *realm_find2(char const *name)
 	if (realm) return realm;
 
 #ifdef HAVE_REGEX
-	if (realms_regex) {
+	if (realms_regex && (name[0] == '~')) {
 		realm_regex_t *this;
 
 		for (this = realms_regex; this != NULL; this = this->next) {
@@ -2060,16 +2308,27 @@ REALM *realm_find(char const *name)
 
 #ifdef HAVE_REGEX
 	if (realms_regex) {
-		realm_regex_t *this;
+		realm_regex_t *this, *found;
+
+		/*
+		 *	One pass over the name finds the first matching
+		 *	suffix realm.  Only the real regexes which come
+		 *	before it in the configuration need to be run.
+		 */
+		found = realm_trie_find(name);
 
-		for (this = realms_regex;
+		for (this = realms_regex_slow;
 		     this != NULL;
-		     this = this->next) {
+		     this = this->next_regex) {
 			int compare;
 
+			if (found && (this->number > found->number)) break;
+
 			compare = regexec(&(this->reg), name, 0, NULL, 0);
 			if (compare == 0) return this->realm;
 		}
+
+		if (found) return found->realm;
 	}
 #endif
 
@@ -2131,9 +2390,12 @@ void home_server_update_request(home_server_t *home, REQUEST *request)
 		 *	client.  The Stripped-User-Name
 		 *	attribute is the one hacked through
 		 *	the 'hints' file.
+		 *
+		 *	Both lists belong to this request, so the
+		 *	values can be shared.
 		 */
-		request->proxy->vps = paircopy(request->proxy,
-					       request->packet->vps);
+		request->proxy->vps = paircopy_shared(request->proxy,
+						      request->packet->vps);
 	}
 
 	/*
@@ -2160,13 +2422,145 @@ void home_server_update_request(home_server_t *home, REQUEST *request)
 	}
 }
 
+/** Update the moving average of a home server's response time
+ *
+ * Each new sample has a weight of 1/8, the same as TCP uses for its
+ * smoothed round trip time.
+ *
+ * @param home server which sent the reply.
+ * @param sent when the request was (last) sent.
+ * @param received when the reply was received.
+ */
+void home_server_latency(home_server_t *home, struct timeval const *sent, struct timeval const *received)
+{
+	int64_t usec, delta;
+
+	usec = received->tv_sec - sent->tv_sec;
+	usec *= 1000000;
+	usec += received->tv_usec - sent->tv_usec;
+
+	if (usec <= 0) usec = 1;
+	if (usec > UINT32_MAX / 2) usec = UINT32_MAX / 2;
+
+	if (!home->latency) {
+		home->latency = usec;
+		home->rttvar = usec / 2;
+	} else {
+		/*
+		 *	RTTVAR is updated first, as it uses the old
+		 *	value of SRTT.  See RFC 6298, Section 2.
+		 */
+		delta = usec - (int64_t) home->latency;
+		if (delta < 0) delta = -delta;
+		home->rttvar += (delta - (int64_t) home->rttvar) / 4;
+
+		home->latency += (usec - (int64_t) home->latency) / 8;
+		if (!home->latency) home->latency = 1;
+	}
+
+	if (home->adaptive_response_window) {
+		uint64_t rto;
+
+		/*
+		 *	RTO = SRTT + max(G, 4 * RTTVAR), with a clock
+		 *	granularity of 1ms.
+		 */
+		rto = home->latency;
+		rto += (home->rttvar > 250) ? (4 * (uint64_t) home->rttvar) : 1000;
+
+		home->rto.tv_sec = rto / 1000000;
+		home->rto.tv_usec = rto % 1000000;
+
+		if (timercmp(&home->rto, &home->min_response_window, <)) home->rto = home->min_response_window;
+		if (timercmp(&home->rto, &home->response_window, >)) home->rto = home->response_window;
+	}
+}
+
+/** Back off the adaptive response window after a request times out
+ *
+ * Doubles the window, as TCP does for its retransmission timer, up to
+ * the configured "response_window".  The next reply recalculates it.
+ *
+ * @param home server which didn't respond.
+ */
+void home_server_backoff(home_server_t *home)
+{
+	if (!home->adaptive_response_window || !timerisset(&home->rto)) return;
+
+	timeradd(&home->rto, &home->rto, &home->rto);
+	if (timercmp(&home->rto, &home->response_window, >)) home->rto = home->response_window;
+}
+
+/*
+ *	How long a new request to the home server is expected to
+ *	wait, in arbitrary units.  Servers we haven't heard from
+ *	yet are cheap, so that they get a chance to be measured.
+ */
+static uint64_t home_server_cost(home_server_t const *home)
+{
+	return ((uint64_t) (home->latency + 1)) * (home->currently_outstanding + 1);
+}
+
+/*
+ *	Consistent hash pools only send a request to a server with
+ *	more than this percentage of the average load if all of
+ *	the others are also over it.
+ */
+#define HOME_POOL_LOAD_BOUND	(125)
+
+/*
+ *	Hash the source address of the request.
+ */
+static uint32_t home_pool_client_hash(REQUEST *request)
+{
+	switch (request->packet->src_ipaddr.af) {
+	case AF_INET:
+		return fr_hash(&request->packet->src_ipaddr.ipaddr.ip4addr,
+			       sizeof(request->packet->src_ipaddr.ipaddr.ip4addr));
+
+	case AF_INET6:
+		return fr_hash(&request->packet->src_ipaddr.ipaddr.ip6addr,
+			       sizeof(request->packet->src_ipaddr.ipaddr.ip6addr));
+
+	default:
+		return 0;
+	}
+}
+
+/*
+ *	The weight of a home server for a particular key.  The name
+ *	is used rather than the position in the pool, so that adding
+ *	and removing servers doesn't change the weights of the
+ *	others.  The final mix is from MurmurHash3, as FNV of
+ *	similar names gives similar results.
+ */
+static uint32_t home_server_weight(home_server_t const *home, uint32_t key)
+{
+	uint32_t hash;
+
+	hash = fr_hash_update(home->name, strlen(home->name), key);
+
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6b;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35;
+	hash ^= hash >> 16;
+
+	return hash;
+}
+
 home_server_t *home_server_ldb(char const *realmname,
 			     home_pool_t *pool, REQUEST *request)
 {
 	int		start;
 	int		count;
+	int		eligible = 0;
+	uint32_t	key = 0, bound = 0;
+	uint32_t	weight, found_weight = 0, spill_weight = 0;
 	home_server_t	*found = NULL;
+	home_server_t	*spill = NULL;
 	home_server_t	*zombie = NULL;
+	home_server_t	*choice[2] = { NULL, NULL };
 	VALUE_PAIR	*vp;
 
 	/*
@@ -2184,40 +2578,12 @@ home_server_t *home_server_ldb(char const *realmname,
 		 *	than nothing.
 		 */
 	case HOME_POOL_CLIENT_BALANCE:
-		switch (request->packet->src_ipaddr.af) {
-		case AF_INET:
-			hash = fr_hash(&request->packet->src_ipaddr.ipaddr.ip4addr,
-					 sizeof(request->packet->src_ipaddr.ipaddr.ip4addr));
-			break;
-
-		case AF_INET6:
-			hash = fr_hash(&request->packet->src_ipaddr.ipaddr.ip6addr,
-					 sizeof(request->packet->src_ipaddr.ipaddr.ip6addr));
-			break;
-
-		default:
-			hash = 0;
-			break;
-		}
+		hash = home_pool_client_hash(request);
 		start = hash % pool->num_home_servers;
 		break;
 
 	case HOME_POOL_CLIENT_PORT_BALANCE:
-		switch (request->packet->src_ipaddr.af) {
-		case AF_INET:
-			hash = fr_hash(&request->packet->src_ipaddr.ipaddr.ip4addr,
-					 sizeof(request->packet->src_ipaddr.ipaddr.ip4addr));
-			break;
-
-		case AF_INET6:
-			hash = fr_hash(&request->packet->src_ipaddr.ipaddr.ip6addr,
-					 sizeof(request->packet->src_ipaddr.ipaddr.ip6addr));
-			break;
-
-		default:
-			hash = 0;
-			break;
-		}
+		hash = home_pool_client_hash(request);
 		fr_hash_update(&request->packet->src_port,
 				 sizeof(request->packet->src_port), hash);
 		start = hash % pool->num_home_servers;
@@ -2233,6 +2599,43 @@ home_server_t *home_server_ldb(char const *realmname,
 
 	case HOME_POOL_LOAD_BALANCE:
 	case HOME_POOL_FAIL_OVER:
+	case HOME_POOL_LEAST_LATENCY:
+		start = 0;
+		break;
+
+		/*
+		 *	Rendezvous hashing.  Every server gets a weight
+		 *	from hashing the key together with its name, and
+		 *	the key goes to the heaviest live server.  When
+		 *	a server dies or is added, only the keys which
+		 *	it wins or loses move.
+		 *
+		 *	To keep popular keys from overloading a server,
+		 *	servers with more than HOME_POOL_LOAD_BOUND
+		 *	percent of the average load are only used when
+		 *	all of the others are also over the bound.
+		 */
+	case HOME_POOL_CONSISTENT_HASH:
+		if ((vp = pairfind(request->config_items, PW_LOAD_BALANCE_KEY, 0, TAG_ANY)) != NULL) {
+			key = fr_hash(vp->vp_strvalue, vp->length);
+		} else {
+			key = home_pool_client_hash(request);
+		}
+
+		{
+			uint32_t live = 0, load = 1;
+
+			for (count = 0; count < pool->num_home_servers; count++) {
+				home_server_t *home = pool->servers[count];
+
+				if (!home || (home->state == HOME_STATE_IS_DEAD)) continue;
+
+				live++;
+				load += home->currently_outstanding;
+			}
+
+			if (live) bound = ((load * HOME_POOL_LOAD_BOUND) + (100 * live) - 1) / (100 * live);
+		}
 		start = 0;
 		break;
 
@@ -2318,6 +2721,47 @@ home_server_t *home_server_ldb(char const *realmname,
 			continue;
 		}
 
+		/*
+		 *	Pick two of the live servers at random, and use
+		 *	the cheaper of the two.  Comparing two random
+		 *	servers spreads the load almost as well as
+		 *	comparing all of them, but doesn't send every
+		 *	request to the one which was fastest a moment
+		 *	ago.
+		 *
+		 *	This keeps a uniformly random pair of the
+		 *	servers seen so far.
+		 */
+		if (pool->type == HOME_POOL_LEAST_LATENCY) {
+			eligible++;
+			if (eligible <= 2) {
+				choice[eligible - 1] = home;
+			} else {
+				uint32_t r = fr_rand() % eligible;
+
+				if (r < 2) choice[r] = home;
+			}
+			continue;
+		}
+
+		if (pool->type == HOME_POOL_CONSISTENT_HASH) {
+			weight = home_server_weight(home, key);
+
+			if (home->currently_outstanding >= bound) {
+				if (!spill || (weight > spill_weight)) {
+					spill = home;
+					spill_weight = weight;
+				}
+				continue;
+			}
+
+			if (!found || (weight > found_weight)) {
+				found = home;
+				found_weight = weight;
+			}
+			continue;
+		}
+
 		/*
 		 *	We've found the first "live" one.  Use that.
 		 */
@@ -2369,6 +2813,27 @@ home_server_t *home_server_ldb(char const *realmname,
 		}
 	} /* loop over the home servers */
 
+	if (choice[0]) {
+		found = choice[0];
+
+		if (choice[1]) {
+			RDEBUG3("PROXY %s %u usec %u outstanding\t%s %u usec %u outstanding",
+				choice[0]->name, choice[0]->latency, choice[0]->currently_outstanding,
+				choice[1]->name, choice[1]->latency, choice[1]->currently_outstanding);
+
+			if (home_server_cost(choice[1]) < home_server_cost(choice[0])) found = choice[1];
+		}
+	}
+
+	/*
+	 *	Every live server is over the load bound.  Use the
+	 *	one this key prefers.
+	 */
+	if (!found && spill) {
+		RDEBUG3("PROXY All servers are over %u outstanding, using %s", bound, spill->name);
+		found = spill;
+	}
+
 	/*
 	 *	We have no live servers, BUT we have a zombie.  Use
 	 *	the zombie as a last resort.
@@ -2485,7 +2950,6 @@ home_server_t *home_server_find(fr_ipaddr_t *ipaddr, uint16_t port, int proto)
 	return rbtree_finddata(home_servers_byaddr, &myhome);
 }
 
-#ifdef WITH_COA
 home_server_t *home_server_byname(char const *name, int type)
 {
 	home_server_t myhome;
@@ -2496,7 +2960,16 @@ home_server_t *home_server_byname(char const *name, int type)
 
 	return rbtree_finddata(home_servers_byname, &myhome);
 }
-#endif
+
+/*
+ *	Call "callback" for every home server.
+ */
+int home_server_walk(rb_walker_t callback, void *ctx)
+{
+	if (!home_servers_byname) return 0;
+
+	return rbtree_walk(home_servers_byname, RBTREE_IN_ORDER, callback, ctx);
+}
 
 #ifdef WITH_STATS
 home_server_t *home_server_bynumber(int number)
@@ -25,6 +25,15 @@ RCSID("$Id$")
 
 #include <freeradius-devel/radiusd.h>
 #include <freeradius-devel/rad_assert.h>
+#include <freeradius-devel/modpriv.h>
+
+#ifdef HAVE_SYS_MMAN_H
+#  include <sys/mman.h>
+#endif
+
+#if defined(MAP_ANON) && !defined(MAP_ANONYMOUS)
+#  define MAP_ANONYMOUS MAP_ANON
+#endif
 
 #ifdef WITH_STATS
 
@@ -38,7 +47,7 @@ static struct timeval	start_time;
 static struct timeval	hup_time;
 
 #define FR_STATS_INIT { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 	\
-				 { 0, 0, 0, 0, 0, 0, 0, 0 }}
+				 { 0, 0, 0, 0, 0, 0, 0, 0 }, { 0 }}
 
 fr_stats_t radius_auth_stats = FR_STATS_INIT;
 #ifdef WITH_ACCOUNTING
@@ -60,6 +69,41 @@ fr_stats_t proxy_dsc_stats = FR_STATS_INIT;
 #endif
 #endif
 
+/*
+ *	The global statistics which are totalled across the
+ *	"num_workers" processes.
+ */
+static fr_stats_t * const stats_global[] = {
+	&radius_auth_stats,
+#ifdef WITH_ACCOUNTING
+	&radius_acct_stats,
+#endif
+#ifdef WITH_COA
+	&radius_coa_stats,
+	&radius_dsc_stats,
+#endif
+#ifdef WITH_PROXY
+	&proxy_auth_stats,
+#ifdef WITH_ACCOUNTING
+	&proxy_acct_stats,
+#endif
+#ifdef WITH_COA
+	&proxy_coa_stats,
+	&proxy_dsc_stats,
+#endif
+#endif
+};
+
+#define STATS_GLOBAL_MAX (sizeof(stats_global) / sizeof(stats_global[0]))
+
+/*
+ *	Shared between the worker processes.  Each one copies its
+ *	global statistics into its own row, at most once a second.
+ */
+static fr_stats_t	*stats_shared = NULL;
+static uint32_t		stats_shared_workers = 0;
+static time_t		stats_published = 0;
+
 
 static void tv_sub(struct timeval *end, struct timeval *start,
 		   struct timeval *elapsed)
@@ -80,6 +124,40 @@ static void tv_sub(struct timeval *end, struct timeval *start,
 	}
 }
 
+/*
+ *	Map a time in usec to its histogram bucket.  The first
+ *	FR_STATS_HIST_SUB buckets are one usec wide.  After that, each
+ *	power of two is split into FR_STATS_HIST_SUB equal buckets.
+ */
+int radius_stats_hist_index(uint32_t usec)
+{
+	int msb;
+
+	if (usec < FR_STATS_HIST_SUB) return usec;
+
+	if (usec >= (1U << FR_STATS_HIST_MAX_BITS)) return FR_STATS_HIST_BUCKETS - 1;
+
+	for (msb = FR_STATS_HIST_SUB_BITS; (usec >> (msb + 1)) != 0; msb++) {
+		/* nothing */
+	}
+
+	return ((msb - FR_STATS_HIST_SUB_BITS + 1) * FR_STATS_HIST_SUB) +
+		(usec >> (msb - FR_STATS_HIST_SUB_BITS)) - FR_STATS_HIST_SUB;
+}
+
+/*
+ *	The largest time counted by a histogram bucket.
+ */
+static uint32_t stats_hist_value(int i)
+{
+	int group = i / FR_STATS_HIST_SUB;
+	uint32_t sub = i % FR_STATS_HIST_SUB;
+
+	if (group == 0) return sub;
+
+	return ((FR_STATS_HIST_SUB + sub + 1) << (group - 1)) - 1;
+}
+
 static void stats_time(fr_stats_t *stats, struct timeval *start,
 		       struct timeval *end)
 {
@@ -93,6 +171,7 @@ static void stats_time(fr_stats_t *stats, struct timeval *start,
 
 	if (diff.tv_sec >= 10) {
 		stats->elapsed[7]++;
+		delay = UINT32_MAX;
 	} else {
 		int i;
 		uint32_t cmp;
@@ -108,6 +187,159 @@ static void stats_time(fr_stats_t *stats, struct timeval *start,
 			cmp *= 10;
 		}
 	}
+
+	stats->hist[radius_stats_hist_index(delay)]++;
+}
+
+/** Return the time (in usec) under which a given fraction of a histogram's times fall
+ *
+ * The histogram may be being updated while we read it, so we take a
+ * copy before walking it, which keeps the total and the buckets
+ * consistent with each other.
+ *
+ * @param hist of FR_STATS_HIST_BUCKETS counters.
+ * @param permille the percentile, in tenths of a percent, e.g. 999 for p99.9.
+ * @return the upper bound of the bucket holding that percentile, or 0
+ *	if no times have been recorded.
+ */
+uint32_t radius_stats_hist_percentile(fr_uint_t const *hist, unsigned int permille)
+{
+	int i;
+	uint64_t total, rank, count;
+	fr_uint_t copy[FR_STATS_HIST_BUCKETS];
+
+	memcpy(copy, hist, sizeof(copy));
+
+	total = 0;
+	for (i = 0; i < FR_STATS_HIST_BUCKETS; i++) total += copy[i];
+	if (!total) return 0;
+
+	if (permille > 1000) permille = 1000;
+
+	/*
+	 *	The smallest count which covers the percentile, so
+	 *	that p100 is the slowest bucket with anything in it.
+	 */
+	rank = ((total * permille) + 999) / 1000;
+	if (!rank) rank = 1;
+
+	count = 0;
+	for (i = 0; i < FR_STATS_HIST_BUCKETS; i++) {
+		count += copy[i];
+		if (count >= rank) break;
+	}
+	if (i == FR_STATS_HIST_BUCKETS) i--;
+
+	return stats_hist_value(i);
+}
+
+/** Return the time (in usec) under which a given fraction of requests completed
+ *
+ * The counters are updated only by the main server thread (see
+ * request_stats_final()).
+ */
+uint32_t radius_stats_percentile(fr_stats_t const *stats, unsigned int permille)
+{
+	return radius_stats_hist_percentile(stats->hist, permille);
+}
+
+/** Create the statistics shared between worker processes
+ *
+ * Must be called before the workers are forked.
+ *
+ * @param[in] num_workers the number of worker processes.
+ * @return 0 on success, -1 on error.
+ */
+int radius_stats_shared_init(uint32_t num_workers)
+{
+#if defined(HAVE_SYS_MMAN_H) && defined(MAP_ANONYMOUS)
+	size_t	size;
+	void	*map;
+
+	size = sizeof(fr_stats_t) * STATS_GLOBAL_MAX * num_workers;
+
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED) {
+		fr_strerror_printf("Failed allocating shared statistics: %s", fr_syserror(errno));
+		return -1;
+	}
+	memset(map, 0, size);
+
+	stats_shared = map;
+	stats_shared_workers = num_workers;
+
+	return 0;
+#else
+	fr_strerror_printf("Shared statistics are not supported on this system");
+	return -1;
+#endif
+}
+
+/*
+ *	Copy this worker's global statistics to the shared segment.
+ */
+static void stats_publish(void)
+{
+	size_t		i;
+	fr_stats_t	*row;
+
+	row = stats_shared + (main_config.worker_id * STATS_GLOBAL_MAX);
+	for (i = 0; i < STATS_GLOBAL_MAX; i++) {
+		row[i] = *stats_global[i];
+	}
+}
+
+/** Get the statistics for all worker processes
+ *
+ * @param[out] total where the sum is written, if one is needed.
+ * @param[in] stats one of the global statistics, or any other.
+ * @return total, if "stats" is global and there are worker processes.
+ *	Otherwise "stats".
+ */
+fr_stats_t const *radius_stats_total(fr_stats_t *total, fr_stats_t const *stats)
+{
+	size_t		i, j;
+	uint32_t	worker;
+
+	if (!stats_shared) return stats;
+
+	for (i = 0; i < STATS_GLOBAL_MAX; i++) {
+		if (stats_global[i] == stats) break;
+	}
+	if (i == STATS_GLOBAL_MAX) return stats;
+
+	stats_publish();
+
+	memset(total, 0, sizeof(*total));
+
+	for (worker = 0; worker < stats_shared_workers; worker++) {
+		fr_stats_t const *row = stats_shared + (worker * STATS_GLOBAL_MAX) + i;
+
+		total->total_requests += row->total_requests;
+		total->total_invalid_requests += row->total_invalid_requests;
+		total->total_dup_requests += row->total_dup_requests;
+		total->total_responses += row->total_responses;
+		total->total_access_accepts += row->total_access_accepts;
+		total->total_access_rejects += row->total_access_rejects;
+		total->total_access_challenges += row->total_access_challenges;
+		total->total_malformed_requests += row->total_malformed_requests;
+		total->total_bad_authenticators += row->total_bad_authenticators;
+		total->total_packets_dropped += row->total_packets_dropped;
+		total->total_no_records += row->total_no_records;
+		total->total_unknown_types += row->total_unknown_types;
+		total->total_timeouts += row->total_timeouts;
+		if (row->last_packet > total->last_packet) total->last_packet = row->last_packet;
+
+		for (j = 0; j < sizeof(total->elapsed) / sizeof(total->elapsed[0]); j++) {
+			total->elapsed[j] += row->elapsed[j];
+		}
+
+		for (j = 0; j < FR_STATS_HIST_BUCKETS; j++) {
+			total->hist[j] += row->hist[j];
+		}
+	}
+
+	return total;
 }
 
 void request_stats_final(REQUEST *request)
@@ -257,20 +489,20 @@ void request_stats_final(REQUEST *request)
 	}
 
 #ifdef WITH_PROXY
-	if (!request->proxy || !request->proxy_listener) goto done;	/* simplifies formatting */
+	if (!request->proxy || !request->proxy_listener || !request->proxy_info) goto done;	/* simplifies formatting */
 
 	switch (request->proxy->code) {
 	case PW_CODE_ACCESS_REQUEST:
-		proxy_auth_stats.total_requests += request->num_proxied_requests;
-		request->proxy_listener->stats.total_requests += request->num_proxied_requests;
-		request->home_server->stats.total_requests += request->num_proxied_requests;
+		proxy_auth_stats.total_requests += request->proxy_info->num_proxied_requests;
+		request->proxy_listener->stats.total_requests += request->proxy_info->num_proxied_requests;
+		request->home_server->stats.total_requests += request->proxy_info->num_proxied_requests;
 		break;
 
 #ifdef WITH_ACCOUNTING
 	case PW_CODE_ACCOUNTING_REQUEST:
 		proxy_acct_stats.total_requests++;
-		request->proxy_listener->stats.total_requests += request->num_proxied_requests;
-		request->home_server->stats.total_requests += request->num_proxied_requests;
+		request->proxy_listener->stats.total_requests += request->proxy_info->num_proxied_requests;
+		request->home_server->stats.total_requests += request->proxy_info->num_proxied_requests;
 		break;
 #endif
 
@@ -281,7 +513,7 @@ void request_stats_final(REQUEST *request)
 	if (!request->proxy_reply) goto done;	/* simplifies formatting */
 
 #undef INC
-#define INC(_x) proxy_auth_stats._x += request->num_proxied_responses; request->proxy_listener->stats._x += request->num_proxied_responses; request->home_server->stats._x += request->num_proxied_responses;
+#define INC(_x) proxy_auth_stats._x += request->proxy_info->num_proxied_responses; request->proxy_listener->stats._x += request->proxy_info->num_proxied_responses; request->home_server->stats._x += request->proxy_info->num_proxied_responses;
 
 	switch (request->proxy_reply->code) {
 	case PW_CODE_ACCESS_ACCEPT:
@@ -329,6 +561,11 @@ void request_stats_final(REQUEST *request)
 #endif /* WITH_PROXY */
 
 	request->master_state = REQUEST_COUNTED;
+
+	if (stats_shared && (request->timestamp != stats_published)) {
+		stats_published = request->timestamp;
+		stats_publish();
+	}
 }
 
 typedef struct fr_stats2vp {
@@ -430,8 +667,33 @@ static fr_stats2vp client_acctvp[] = {
 };
 #endif
 
+/*
+ *	Percentiles of the latency histogram, in the same order as the
+ *	attributes in each latency block of the dictionary.
+ */
+static unsigned int const latency_permille[] = { 500, 900, 990, 999 };
+
+#define LATENCY_AUTH		(197)
+#define LATENCY_PROXY_AUTH	(201)
+#define LATENCY_ACCT		(205)
+#define LATENCY_PROXY_ACCT	(209)
+
+static void request_stats_latency(REQUEST *request, int attribute, fr_stats_t const *stats)
+{
+	size_t i;
+	VALUE_PAIR *vp;
+
+	for (i = 0; i < sizeof(latency_permille) / sizeof(latency_permille[0]); i++) {
+		vp = radius_paircreate(request->reply, &request->reply->vps,
+				       attribute + i, VENDORPEC_FREERADIUS);
+		if (!vp) continue;
+
+		vp->vp_integer = radius_stats_percentile(stats, latency_permille[i]);
+	}
+}
+
 static void request_stats_addvp(REQUEST *request,
-				fr_stats2vp *table, fr_stats_t *stats)
+				fr_stats2vp *table, fr_stats_t const *stats)
 {
 	int i;
 	fr_uint_t counter;
@@ -442,15 +704,107 @@ static void request_stats_addvp(REQUEST *request,
 				       table[i].attribute, VENDORPEC_FREERADIUS);
 		if (!vp) continue;
 
-		counter = *(fr_uint_t *) (((uint8_t *) stats) + table[i].offset);
+		counter = *(fr_uint_t const *) (((uint8_t const *) stats) + table[i].offset);
 		vp->vp_integer = counter;
 	}
 }
 
 
+/*
+ *	Add the state of a connection pool to the reply.
+ */
+static void request_stats_pool(REQUEST *request, fr_connection_pool_stats_t const *stats)
+{
+	int i;
+	VALUE_PAIR *vp;
+	uint64_t counters[8];
+
+	vp = radius_paircreate(request->reply, &request->reply->vps, 186, VENDORPEC_FREERADIUS);
+	if (vp) pairstrcpy(vp, stats->name ? stats->name : stats->log_prefix);
+
+	counters[0] = stats->num;
+	counters[1] = stats->active;
+	counters[2] = stats->max;
+	counters[3] = stats->waiting;
+	counters[4] = stats->waits;
+	counters[5] = stats->wait_timeouts;
+	counters[6] = stats->spawn_failures;
+	counters[7] = stats->reconnects;
+
+	for (i = 0; i < 8; i++) {
+		vp = radius_paircreate(request->reply, &request->reply->vps, 187 + i, VENDORPEC_FREERADIUS);
+		if (vp) vp->vp_integer = counters[i];
+	}
+
+	/*
+	 *	One attribute per bucket, in bucket order.
+	 */
+	for (i = 0; i < FR_CONNECTION_POOL_HIST_BUCKETS; i++) {
+		vp = radius_paircreate(request->reply, &request->reply->vps, 195, VENDORPEC_FREERADIUS);
+		if (vp) vp->vp_integer = stats->wait_hist[i];
+	}
+
+	for (i = 0; i < FR_CONNECTION_POOL_HIST_BUCKETS; i++) {
+		vp = radius_paircreate(request->reply, &request->reply->vps, 196, VENDORPEC_FREERADIUS);
+		if (vp) vp->vp_integer = stats->hold_hist[i];
+	}
+}
+
+/*
+ *	Add the counters of a module instance to the reply.
+ */
+static void request_stats_module(REQUEST *request, module_instance_t const *mi)
+{
+	size_t i;
+	uint64_t calls;
+	VALUE_PAIR *vp;
+	module_stats_t const *stats = mi->stats;
+
+	if (!stats) return;
+
+	vp = radius_paircreate(request->reply, &request->reply->vps, 213, VENDORPEC_FREERADIUS);
+	if (vp) pairstrcpy(vp, mi->name);
+
+	calls = 0;
+	for (i = 0; i < RLM_COMPONENT_COUNT; i++) calls += stats->calls[i];
+
+	vp = radius_paircreate(request->reply, &request->reply->vps, 214, VENDORPEC_FREERADIUS);
+	if (vp) vp->vp_integer = calls;
+
+	/*
+	 *	One attribute per return code, in rcode order.
+	 */
+	for (i = 0; i < RLM_MODULE_NUMCODES; i++) {
+		vp = radius_paircreate(request->reply, &request->reply->vps, 215, VENDORPEC_FREERADIUS);
+		if (vp) vp->vp_integer = stats->rcode[i];
+	}
+
+	for (i = 0; i < sizeof(latency_permille) / sizeof(latency_permille[0]); i++) {
+		vp = radius_paircreate(request->reply, &request->reply->vps, 216 + i, VENDORPEC_FREERADIUS);
+		if (vp) vp->vp_integer = radius_stats_hist_percentile(stats->hist, latency_permille[i]);
+	}
+
+	/*
+	 *	One attribute per section, in section order.
+	 */
+	for (i = 0; i < RLM_COMPONENT_COUNT; i++) {
+		vp = radius_paircreate(request->reply, &request->reply->vps, 220, VENDORPEC_FREERADIUS);
+		if (vp) vp->vp_integer = stats->calls[i];
+	}
+}
+
+static int request_stats_module_cb(void *ctx, void *data)
+{
+	request_stats_module(ctx, data);
+
+	return 0;
+}
+
 void request_stats_reply(REQUEST *request)
 {
 	VALUE_PAIR *flag, *vp;
+	fr_stats_t total;
+	fr_stats_t const *stats;
 
 	/*
 	 *	Statistics are available ONLY on a "status" port.
@@ -466,7 +820,9 @@ void request_stats_reply(REQUEST *request)
 	 */
 	if (((flag->vp_integer & 0x01) != 0) &&
 	    ((flag->vp_integer & 0xc0) == 0)) {
-		request_stats_addvp(request, authvp, &radius_auth_stats);
+		stats = radius_stats_total(&total, &radius_auth_stats);
+		request_stats_addvp(request, authvp, stats);
+		request_stats_latency(request, LATENCY_AUTH, stats);
 	}
 
 #ifdef WITH_ACCOUNTING
@@ -475,7 +831,9 @@ void request_stats_reply(REQUEST *request)
 	 */
 	if (((flag->vp_integer & 0x02) != 0) &&
 	    ((flag->vp_integer & 0xc0) == 0)) {
-		request_stats_addvp(request, acctvp, &radius_acct_stats);
+		stats = radius_stats_total(&total, &radius_acct_stats);
+		request_stats_addvp(request, acctvp, stats);
+		request_stats_latency(request, LATENCY_ACCT, stats);
 	}
 #endif
 
@@ -485,7 +843,9 @@ void request_stats_reply(REQUEST *request)
 	 */
 	if (((flag->vp_integer & 0x04) != 0) &&
 	    ((flag->vp_integer & 0x20) == 0)) {
-		request_stats_addvp(request, proxy_authvp, &proxy_auth_stats);
+		stats = radius_stats_total(&total, &proxy_auth_stats);
+		request_stats_addvp(request, proxy_authvp, stats);
+		request_stats_latency(request, LATENCY_PROXY_AUTH, stats);
 	}
 
 #ifdef WITH_ACCOUNTING
@@ -494,7 +854,9 @@ void request_stats_reply(REQUEST *request)
 	 */
 	if (((flag->vp_integer & 0x08) != 0) &&
 	    ((flag->vp_integer & 0x20) == 0)) {
-		request_stats_addvp(request, proxy_acctvp, &proxy_acct_stats);
+		stats = radius_stats_total(&total, &proxy_acct_stats);
+		request_stats_addvp(request, proxy_acctvp, stats);
+		request_stats_latency(request, LATENCY_PROXY_ACCT, stats);
 	}
 #endif
 #endif
@@ -533,6 +895,37 @@ void request_stats_reply(REQUEST *request)
 #endif
 	}
 
+	/*
+	 *	Connection pools, either all of them, or the pool of
+	 *	one module.
+	 */
+	if ((flag->vp_integer & 0x100) != 0) {
+		int i, num;
+		fr_connection_pool_stats_t *pools;
+
+		vp = pairfind(request->packet->vps, 186, VENDORPEC_FREERADIUS, TAG_ANY);
+		num = fr_connection_pool_stats_all(request, vp ? vp->vp_strvalue : NULL, &pools);
+		for (i = 0; i < num; i++) {
+			request_stats_pool(request, &pools[i]);
+		}
+		talloc_free(pools);
+	}
+
+	/*
+	 *	Modules, either all of them, or one.
+	 */
+	if ((flag->vp_integer & 0x200) != 0) {
+		vp = pairfind(request->packet->vps, 213, VENDORPEC_FREERADIUS, TAG_ANY);
+		if (vp) {
+			module_instance_t *mi;
+
+			mi = find_module_instance(cf_section_find("modules"), vp->vp_strvalue, false);
+			if (mi) request_stats_module(request, mi);
+		} else {
+			module_instance_walk(request_stats_module_cb, request);
+		}
+	}
+
 	/*
 	 *	For a particular client.
 	 */
@@ -624,11 +1017,15 @@ void request_stats_reply(REQUEST *request)
 			if ((flag->vp_integer & 0x01) != 0) {
 				request_stats_addvp(request, client_authvp,
 						    &client->auth);
+				request_stats_latency(request, LATENCY_AUTH,
+						      &client->auth);
 			}
 #ifdef WITH_ACCOUNTING
 			if ((flag->vp_integer & 0x01) != 0) {
 				request_stats_addvp(request, client_acctvp,
 						    &client->acct);
+				request_stats_latency(request, LATENCY_ACCT,
+						      &client->acct);
 			}
 #endif
 		} /* else client wasn't found, don't echo it back */
@@ -673,6 +1070,7 @@ void request_stats_reply(REQUEST *request)
 		    ((request->listener->type == RAD_LISTEN_AUTH) ||
 		     (request->listener->type == RAD_LISTEN_NONE))) {
 			request_stats_addvp(request, authvp, &this->stats);
+			request_stats_latency(request, LATENCY_AUTH, &this->stats);
 		}
 
 #ifdef WITH_ACCOUNTING
@@ -680,6 +1078,7 @@ void request_stats_reply(REQUEST *request)
 		    ((request->listener->type == RAD_LISTEN_ACCT) ||
 		     (request->listener->type == RAD_LISTEN_NONE))) {
 			request_stats_addvp(request, acctvp, &this->stats);
+			request_stats_latency(request, LATENCY_ACCT, &this->stats);
 		}
 #endif
 	}
@@ -777,6 +1176,8 @@ void request_stats_reply(REQUEST *request)
 		    (home->type == HOME_TYPE_AUTH)) {
 			request_stats_addvp(request, proxy_authvp,
 					    &home->stats);
+			request_stats_latency(request, LATENCY_PROXY_AUTH,
+					      &home->stats);
 		}
 
 #ifdef WITH_ACCOUNTING
@@ -784,6 +1185,8 @@ void request_stats_reply(REQUEST *request)
 		    (home->type == HOME_TYPE_ACCT)) {
 			request_stats_addvp(request, proxy_acctvp,
 					    &home->stats);
+			request_stats_latency(request, LATENCY_PROXY_ACCT,
+					      &home->stats);
 		}
 #endif
 	}
@@ -792,6 +1195,20 @@ void request_stats_reply(REQUEST *request)
 
 void radius_stats_init(int flag)
 {
+	/*
+	 *	A worker which was restarted carries on from where
+	 *	the previous one left off.
+	 */
+	if (!flag && stats_shared) {
+		size_t		i;
+		fr_stats_t	*row;
+
+		row = stats_shared + (main_config.worker_id * STATS_GLOBAL_MAX);
+		for (i = 0; i < STATS_GLOBAL_MAX; i++) {
+			*stats_global[i] = row[i];
+		}
+	}
+
 	if (!flag) {
 		gettimeofday(&start_time, NULL);
 		hup_time = start_time; /* it's just nicer this way */
@@ -803,15 +1220,12 @@ void radius_stats_init(int flag)
 void radius_stats_ema(fr_stats_ema_t *ema,
 		      struct timeval *start, struct timeval *end)
 {
-	int micro;
-	time_t tdiff;
+	int64_t micro;
 #ifdef WITH_STATS_DEBUG
 	static int n = 0;
 #endif
 	if (ema->window == 0) return;
 
-	rad_assert(start->tv_sec <= end->tv_sec);
-
 	/*
 	 *	Initialize it.
 	 */
@@ -823,14 +1237,15 @@ void radius_stats_ema(fr_stats_ema_t *ema,
 	}
 
 
-	tdiff = start->tv_sec;
-	tdiff -= end->tv_sec;
-
-	micro = (int) tdiff;
-	if (micro > 40) micro = 40; /* don't overflow 32-bit ints */
+	/*
+	 *	ema1 and ema10 are 32-bit, so clamp the sample to
+	 *	what fits once it's scaled.
+	 */
+	micro = end->tv_sec - start->tv_sec;
 	micro *= USEC;
-	micro += start->tv_usec;
-	micro -= end->tv_usec;
+	micro += end->tv_usec - start->tv_usec;
+	if (micro < 0) micro = 0;
+	if (micro > (UINT32_MAX / EMA_SCALE)) micro = UINT32_MAX / EMA_SCALE;
 
 	micro *= EMA_SCALE;
 
@@ -838,19 +1253,14 @@ void radius_stats_ema(fr_stats_ema_t *ema,
 		ema->ema1 = micro;
 		ema->ema10 = micro;
 	} else {
-		int diff;
-
-		diff = ema->f1 * (micro - ema->ema1);
-		ema->ema1 += (diff / 1000000);
-
-		diff = ema->f10 * (micro - ema->ema10);
-		ema->ema10 += (diff / 1000000);
+		ema->ema1 += (ema->f1 * (micro - (int64_t) ema->ema1)) / F_EMA_SCALE;
+		ema->ema10 += (ema->f10 * (micro - (int64_t) ema->ema10)) / F_EMA_SCALE;
 	}
 
 
 #ifdef WITH_STATS_DEBUG
 	DEBUG("time %d %d.%06d\t%d.%06d\t%d.%06d\n",
-	      n, micro / PREC, (micro / EMA_SCALE) % USEC,
+	      n, (int) (micro / PREC), (int) ((micro / EMA_SCALE) % USEC),
 	      ema->ema1 / PREC, (ema->ema1 / EMA_SCALE) % USEC,
 	      ema->ema10 / PREC, (ema->ema10 / EMA_SCALE) % USEC);
 	n++;
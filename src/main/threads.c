@@ -26,6 +26,7 @@ USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
 
 #include <freeradius-devel/radiusd.h>
 #include <freeradius-devel/process.h>
+#include <freeradius-devel/modules.h>
 #include <freeradius-devel/rad_assert.h>
 
 /*
@@ -57,6 +58,10 @@ USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
 #include <sys/wait.h>
 #endif
 
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+#include <sched.h>
+#endif
+
 #ifdef HAVE_PTHREAD_H
 
 #ifdef HAVE_OPENSSL_CRYPTO_H
@@ -69,6 +74,17 @@ USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
 #include <openssl/evp.h>
 #endif
 
+/*
+ *	Requests can only give up their thread (see module_yield())
+ *	if we can switch stacks.
+ */
+#if !defined(WITH_GCD) && defined(HAVE_UCONTEXT_H) && defined(HAVE_POLL_H)
+#define WITH_YIELD
+#include <fcntl.h>
+#include <ucontext.h>
+#include <poll.h>
+#endif
+
 #ifndef WITH_GCD
 #define SEMAPHORE_LOCKED	(0)
 #define SEMAPHORE_UNLOCKED	(1)
@@ -79,6 +95,35 @@ USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
 
 #define NUM_FIFOS	       RAD_LISTEN_MAX
 
+#ifdef WITH_YIELD
+/*
+ *	With "yield", each request runs on a stack of its own, so
+ *	that it can be put aside when a module waits for I/O, and
+ *	picked up again later by whichever thread is free.
+ */
+typedef struct request_coroutine_t {
+	struct request_coroutine_t *next;	//!< In the waiting or resumed list.
+	REQUEST			*request;
+	ucontext_t		context;	//!< Where the request is running, or suspended.
+	ucontext_t		*caller;	//!< The thread which last resumed it.
+	void			*stack;		//!< yield_stack_size bytes.
+	int			fd;		//!< Wait for this to become readable, or -1.
+	bool			has_when;	//!< Whether or not there's a timeout.
+	struct timeval		when;		//!< Stop waiting at this time.
+	int			ready;		//!< 1 if readable, 0 on timeout, -1 on error.
+	int			yield_ok;	//!< Yield-safe module calls in progress.
+	int			no_yield;	//!< Yielding is blocked while this is non-zero.
+	bool			done;		//!< The request has finished running.
+} request_coroutine_t;
+
+/*
+ *	The coroutine which is running on this thread, if any.
+ */
+fr_thread_local_setup(request_coroutine_t *, thread_coroutine)
+#endif
+
+typedef struct thread_workload_t thread_workload_t;
+
 /*
  *  A data structure which contains the information about
  *  the current thread.
@@ -92,8 +137,66 @@ typedef struct THREAD_HANDLE {
 	unsigned int		request_count;	//!< The number of requests that this thread has handled.
 	time_t			timestamp;	//!< When the thread started executing.
 	REQUEST			*request;
+	int			cpu;		//!< CPU the thread is pinned to, or -1.
+	int			numa_node;	//!< NUMA node of that CPU, or -1.
+	thread_workload_t	*workload;	//!< Named pool the thread belongs to, or NULL.
+
+	/*
+	 *	Only used when "per_thread_queue" is set.
+	 */
+	sem_t			semaphore;	//!< Posted when a request is added to this thread's queue.
+	fr_atomic_queue_t	*queue[NUM_FIFOS]; //!< Pushed by the main thread, popped by this and idle threads.
+
+	/*
+	 *	Only used when "target_queue_time" is set.  Written
+	 *	by the thread, and read by the main thread.
+	 */
+	uint64_t		queue_time;	//!< Total time (usec) requests waited before this thread ran them.
+	uint64_t		queue_count;	//!< Number of requests included in queue_time.
+
+#ifdef WITH_YIELD
+	void			*stack;		//!< Cached coroutine stack, for the next request.
+#endif
 } THREAD_HANDLE;
 
+
+/*
+ *	A named pool of threads, from a "thread <name> { ... }"
+ *	section.  Virtual servers with "thread_pool = <name>" queue
+ *	their requests here instead of in the main pool, and only
+ *	these threads run them.  A virtual server which is stuck
+ *	waiting on a slow database can then only tie up its own
+ *	threads, and can't fill the queue used by the others.
+ *
+ *	The threads don't use per-thread queues, or "yield", and
+ *	don't exit until the server does.
+ */
+struct thread_workload_t {
+	char const		*name;
+	uint32_t		start_threads;
+	uint32_t		max_threads;
+	uint32_t		max_queue_size;
+
+	THREAD_HANDLE		*head;		//!< Only walked by the main thread.
+	uint32_t		total_threads;	//!< Only changed by the main thread.
+
+	sem_t			semaphore;	//!< Posted for each request queued.
+	pthread_mutex_t		mutex;		//!< Protects the fifos, num_queued and active_threads.
+	uint32_t		active_threads;
+	uint32_t		num_queued;
+	fr_fifo_t		*fifo[NUM_FIFOS];
+
+	thread_workload_t	*next;
+};
+
+/*
+ *	Which named pool a virtual server uses.
+ */
+typedef struct thread_workload_server_t {
+	char const		*server;
+	thread_workload_t	*workload;
+	struct thread_workload_server_t *next;
+} thread_workload_server_t;
 #endif	/* WITH_GCD */
 
 typedef struct thread_fork_t {
@@ -137,6 +240,45 @@ typedef struct THREAD_POOL {
 	time_t		time_last_spawned;
 	uint32_t	cleanup_delay;
 	bool		stop_flag;
+	bool		per_thread_queue;
+	uint32_t	per_thread_queue_size;	//!< Size of each per-thread queue.
+	THREAD_HANDLE	*next_queue;	//!< Where to start looking for a thread to give the next request to.
+
+	char const	*cpu_affinity;	//!< CPUs to pin threads to, e.g. "0-3,8-11".
+	int		*cpus;		//!< Parsed cpu_affinity.
+	int		num_cpus;	//!< Number of entries in cpus.
+
+	/*
+	 *	Queue latency controller.  Only used when
+	 *	"target_queue_time" is set.
+	 */
+	uint32_t	target_queue_time;	//!< Wanted queue time, in milliseconds.
+	struct timeval	next_control;		//!< When the controller next runs.
+	uint64_t	exited_queue_time;	//!< queue_time of deleted threads.
+	uint64_t	exited_queue_count;	//!< queue_count of deleted threads.
+	uint64_t	last_queue_time;	//!< Total queue_time when the controller last ran.
+	uint64_t	last_queue_count;	//!< Total queue_count when the controller last ran.
+	uint32_t	interval_queue_time;	//!< Mean queue time (usec) over the last interval.
+	uint32_t	avg_queue_time;		//!< Smoothed queue time (usec).
+	uint32_t	controller_spawned;	//!< Threads spawned by the controller.
+	uint32_t	controller_deleted;	//!< Threads deleted by the controller.
+
+	bool		yield;		//!< Run requests as coroutines, see module_yield().
+	uint32_t	yield_stack_size;	//!< Size of each coroutine's stack.
+#ifdef WITH_YIELD
+	/*
+	 *	Suspended requests are watched by a separate thread,
+	 *	which puts them on the "resumed" list when their fd is
+	 *	readable, or they time out.  Both lists are protected
+	 *	by yield_mutex.
+	 */
+	pthread_t	poll_thread;
+	int		poll_pipe[2];		//!< Wakes up the poll thread.
+	pthread_mutex_t	yield_mutex;
+	request_coroutine_t *waiting;		//!< Not yet seen by the poll thread.
+	request_coroutine_t *resumed;		//!< Ready to run again.
+	request_coroutine_t *resumed_tail;
+#endif
 #endif	/* WITH_GCD */
 	bool		spawn_flag;
 
@@ -164,12 +306,18 @@ typedef struct THREAD_POOL {
 
 	/*
 	 *	To ensure only one thread at a time touches the queue.
+	 *
+	 *	With "per_thread_queue", it instead protects the
+	 *	list of threads when it's walked by a child thread.
 	 */
 	pthread_mutex_t	queue_mutex;
 
 	uint32_t	max_queue_size;
 	uint32_t	num_queued;
 	fr_fifo_t	*fifo[NUM_FIFOS];
+
+	thread_workload_t	*workloads;	//!< Named pools.
+	thread_workload_server_t *workload_servers; //!< Virtual servers which use them.
 #endif	/* WITH_GCD */
 } THREAD_POOL;
 
@@ -180,6 +328,15 @@ static bool pool_initialized = false;
 static time_t last_cleaned = 0;
 
 static void thread_pool_manage(time_t now);
+static void thread_pool_control(struct timeval const *now);
+
+/*
+ *	How often the queue latency controller runs.
+ */
+#define CONTROL_INTERVAL_USEC	(100000)
+
+#undef USEC
+#define USEC (1000000)
 #endif
 
 #ifndef WITH_GCD
@@ -194,6 +351,12 @@ static const CONF_PARSER thread_config[] = {
 	{ "max_requests_per_server", FR_CONF_POINTER(PW_TYPE_INTEGER, &thread_pool.max_requests_per_thread), "0" },
 	{ "cleanup_delay", FR_CONF_POINTER(PW_TYPE_INTEGER, &thread_pool.cleanup_delay), "5" },
 	{ "max_queue_size", FR_CONF_POINTER(PW_TYPE_INTEGER, &thread_pool.max_queue_size), "65536" },
+	{ "per_thread_queue", FR_CONF_POINTER(PW_TYPE_BOOLEAN, &thread_pool.per_thread_queue), "no" },
+	{ "per_thread_queue_size", FR_CONF_POINTER(PW_TYPE_INTEGER, &thread_pool.per_thread_queue_size), "256" },
+	{ "target_queue_time", FR_CONF_POINTER(PW_TYPE_INTEGER, &thread_pool.target_queue_time), "0" },
+	{ "cpu_affinity", FR_CONF_POINTER(PW_TYPE_STRING, &thread_pool.cpu_affinity), NULL },
+	{ "yield", FR_CONF_POINTER(PW_TYPE_BOOLEAN, &thread_pool.yield), "no" },
+	{ "yield_stack_size", FR_CONF_POINTER(PW_TYPE_INTEGER, &thread_pool.yield_stack_size), "65536" },
 #ifdef WITH_STATS
 #ifdef WITH_ACCOUNTING
 	{ "auto_limit_acct", FR_CONF_POINTER(PW_TYPE_BOOLEAN, &thread_pool.auto_limit_acct), NULL },
@@ -201,6 +364,13 @@ static const CONF_PARSER thread_config[] = {
 #endif
 	{ NULL, -1, 0, NULL, NULL }
 };
+
+static const CONF_PARSER workload_config[] = {
+	{ "start_servers", FR_CONF_OFFSET(PW_TYPE_INTEGER, thread_workload_t, start_threads), "1" },
+	{ "max_servers", FR_CONF_OFFSET(PW_TYPE_INTEGER, thread_workload_t, max_threads), "8" },
+	{ "max_queue_size", FR_CONF_OFFSET(PW_TYPE_INTEGER, thread_workload_t, max_queue_size), "0" },
+	{ NULL, -1, 0, NULL, NULL }
+};
 #endif
 
 #ifdef HAVE_OPENSSL_CRYPTO_H
@@ -300,262 +470,120 @@ static void reap_children(void)
 #endif /* WNOHANG */
 
 #ifndef WITH_GCD
+#ifdef WITH_STATS
+#ifdef WITH_ACCOUNTING
 /*
- *	Add a request to the list of waiting requests.
- *	This function gets called ONLY from the main handler thread...
- *
- *	This function should never fail.
+ *	Decide whether or not to throw away an accounting request
+ *	because we're too busy.  Returns true if the request should
+ *	be discarded.
  */
-int request_enqueue(REQUEST *request)
+static bool request_auto_limit(REQUEST *request, uint32_t num_queued)
 {
+	struct timeval now;
+
 	/*
-	 *	If we haven't checked the number of child threads
-	 *	in a while, OR if the thread pool appears to be full,
-	 *	go manage it.
+	 *	Throw away accounting requests if we're too
+	 *	busy.  The NAS should retransmit these, and no
+	 *	one should notice.
+	 *
+	 *	In contrast, we always try to process
+	 *	authentication requests.  Those are more time
+	 *	critical, and it's harder to determine which
+	 *	we can throw away, and which we can keep.
+	 *
+	 *	We allow the queue to get half full before we
+	 *	start worrying.  Even then, we still require
+	 *	that the rate of input packets is higher than
+	 *	the rate of outgoing packets.  i.e. the queue
+	 *	is growing.
+	 *
+	 *	Once that happens, we roll a dice to see where
+	 *	the barrier is for "keep" versus "toss".  If
+	 *	the queue is smaller than the barrier, we
+	 *	allow it.  If the queue is larger than the
+	 *	barrier, we throw the packet away.  Otherwise,
+	 *	we keep it.
+	 *
+	 *	i.e. the probability of throwing the packet
+	 *	away increases from 0 (queue is half full), to
+	 *	100 percent (queue is completely full).
+	 *
+	 *	A probabilistic approach allows us to process
+	 *	SOME of the new accounting packets.
 	 */
-	if ((last_cleaned < request->timestamp) ||
-	    (thread_pool.active_threads == thread_pool.total_threads) ||
-	    (thread_pool.exited_threads > 0)) {
-		thread_pool_manage(request->timestamp);
-	}
-
-
-	pthread_mutex_lock(&thread_pool.queue_mutex);
-
-#ifdef WITH_STATS
-#ifdef WITH_ACCOUNTING
-	if (thread_pool.auto_limit_acct) {
-		struct timeval now;
+	if ((request->packet->code == PW_CODE_ACCOUNTING_REQUEST) &&
+	    (num_queued > (thread_pool.max_queue_size / 2)) &&
+	    (thread_pool.pps_in.pps_now > thread_pool.pps_out.pps_now)) {
+		uint32_t prob;
+		uint32_t keep;
 
 		/*
-		 *	Throw away accounting requests if we're too
-		 *	busy.  The NAS should retransmit these, and no
-		 *	one should notice.
-		 *
-		 *	In contrast, we always try to process
-		 *	authentication requests.  Those are more time
-		 *	critical, and it's harder to determine which
-		 *	we can throw away, and which we can keep.
-		 *
-		 *	We allow the queue to get half full before we
-		 *	start worrying.  Even then, we still require
-		 *	that the rate of input packets is higher than
-		 *	the rate of outgoing packets.  i.e. the queue
-		 *	is growing.
-		 *
-		 *	Once that happens, we roll a dice to see where
-		 *	the barrier is for "keep" versus "toss".  If
-		 *	the queue is smaller than the barrier, we
-		 *	allow it.  If the queue is larger than the
-		 *	barrier, we throw the packet away.  Otherwise,
-		 *	we keep it.
-		 *
-		 *	i.e. the probability of throwing the packet
-		 *	away increases from 0 (queue is half full), to
-		 *	100 percent (queue is completely full).
-		 *
-		 *	A probabilistic approach allows us to process
-		 *	SOME of the new accounting packets.
+		 *	Take a random value of how full we
+		 *	want the queue to be.  It's OK to be
+		 *	half full, but we get excited over
+		 *	anything more than that.
 		 */
-		if ((request->packet->code == PW_CODE_ACCOUNTING_REQUEST) &&
-		    (thread_pool.num_queued > (thread_pool.max_queue_size / 2)) &&
-		    (thread_pool.pps_in.pps_now > thread_pool.pps_out.pps_now)) {
-			uint32_t prob;
-			uint32_t keep;
-
-			/*
-			 *	Take a random value of how full we
-			 *	want the queue to be.  It's OK to be
-			 *	half full, but we get excited over
-			 *	anything more than that.
-			 */
-			keep = (thread_pool.max_queue_size / 2);
-			prob = fr_rand() & ((1 << 10) - 1);
-			keep *= prob;
-			keep >>= 10;
-			keep += (thread_pool.max_queue_size / 2);
-
-			/*
-			 *	If the queue is larger than our dice
-			 *	roll, we throw the packet away.
-			 */
-			if (thread_pool.num_queued > keep) {
-				pthread_mutex_unlock(&thread_pool.queue_mutex);
-				return 0;
-			}
-		}
-
-		gettimeofday(&now, NULL);
+		keep = (thread_pool.max_queue_size / 2);
+		prob = fr_rand() & ((1 << 10) - 1);
+		keep *= prob;
+		keep >>= 10;
+		keep += (thread_pool.max_queue_size / 2);
 
 		/*
-		 *	Calculate the instantaneous arrival rate into
-		 *	the queue.
+		 *	If the queue is larger than our dice
+		 *	roll, we throw the packet away.
 		 */
-		thread_pool.pps_in.pps = rad_pps(&thread_pool.pps_in.pps_old,
-						 &thread_pool.pps_in.pps_now,
-						 &thread_pool.pps_in.time_old,
-						 &now);
-
-		thread_pool.pps_in.pps_now++;
+		if (num_queued > keep) return true;
 	}
-#endif	/* WITH_ACCOUNTING */
-#endif
-
-	thread_pool.request_count++;
-
-	if (thread_pool.num_queued >= thread_pool.max_queue_size) {
-		pthread_mutex_unlock(&thread_pool.queue_mutex);
 
-		/*
-		 *	Mark the request as done.
-		 */
-		RATE_LIMIT(ERROR("Something is blocking the server.  There are %d packets in the queue, "
-				 "waiting to be processed.  Ignoring the new request.", thread_pool.num_queued));
-		return 0;
-	}
-	request->component = "<core>";
-	request->module = "<queue>";
-	request->child_state = REQUEST_QUEUED;
+	gettimeofday(&now, NULL);
 
 	/*
-	 *	Push the request onto the appropriate fifo for that
+	 *	Calculate the instantaneous arrival rate into
+	 *	the queue.
 	 */
-	if (!fr_fifo_push(thread_pool.fifo[request->priority], request)) {
-		pthread_mutex_unlock(&thread_pool.queue_mutex);
-		ERROR("!!! ERROR !!! Failed inserting request %d into the queue", request->number);
-		return 0;
-	}
+	thread_pool.pps_in.pps = rad_pps(&thread_pool.pps_in.pps_old,
+					 &thread_pool.pps_in.pps_now,
+					 &thread_pool.pps_in.time_old,
+					 &now);
 
-	thread_pool.num_queued++;
+	thread_pool.pps_in.pps_now++;
 
-	pthread_mutex_unlock(&thread_pool.queue_mutex);
+	return false;
+}
 
-	/*
-	 *	There's one more request in the queue.
-	 *
-	 *	Note that we're not touching the queue any more, so
-	 *	the semaphore post is outside of the mutex.  This also
-	 *	means that when the thread wakes up and tries to lock
-	 *	the mutex, it will be unlocked, and there won't be
-	 *	contention.
-	 */
-	sem_post(&thread_pool.semaphore);
+/*
+ *	Calculate the instantaneous departure rate from the queue.
+ *
+ *	Must be called with queue_mutex held.
+ */
+static void request_pps_out(void)
+{
+	struct timeval now;
 
-	return 1;
+	gettimeofday(&now, NULL);
+
+	thread_pool.pps_out.pps  = rad_pps(&thread_pool.pps_out.pps_old,
+					   &thread_pool.pps_out.pps_now,
+					   &thread_pool.pps_out.time_old,
+					   &now);
+	thread_pool.pps_out.pps_now++;
 }
+#endif	/* WITH_ACCOUNTING */
+#endif
 
 /*
- *	Remove a request from the queue.
+ *	Complain if requests have been sitting in the queue for too
+ *	long.  Returns how long the request was blocked, if we should
+ *	complain about it.
+ *
+ *	Must be called with queue_mutex held.
  */
-static int request_dequeue(REQUEST **prequest)
+static time_t request_blocked(REQUEST *request, int *num_blocked)
 {
 	time_t blocked;
 	static time_t last_complained = 0;
 	static time_t total_blocked = 0;
-	int num_blocked;
-	RAD_LISTEN_TYPE i, start;
-	REQUEST *request;
-	reap_children();
-
-	pthread_mutex_lock(&thread_pool.queue_mutex);
-
-#ifdef WITH_STATS
-#ifdef WITH_ACCOUNTING
-	if (thread_pool.auto_limit_acct) {
-		struct timeval now;
-
-		gettimeofday(&now, NULL);
-
-		/*
-		 *	Calculate the instantaneous departure rate
-		 *	from the queue.
-		 */
-		thread_pool.pps_out.pps  = rad_pps(&thread_pool.pps_out.pps_old,
-						   &thread_pool.pps_out.pps_now,
-						   &thread_pool.pps_out.time_old,
-						   &now);
-		thread_pool.pps_out.pps_now++;
-	}
-#endif
-#endif
-
-	/*
-	 *	Clear old requests from all queues.
-	 *
-	 *	We only do one pass over the queue, in order to
-	 *	amortize the work across the child threads.  Since we
-	 *	do N checks for one request de-queued, the old
-	 *	requests will be quickly cleared.
-	 */
-	for (i = 0; i < RAD_LISTEN_MAX; i++) {
-		request = fr_fifo_peek(thread_pool.fifo[i]);
-		if (!request) continue;
-
-		VERIFY_REQUEST(request);
-
-		if (request->master_state != REQUEST_STOP_PROCESSING) {
-			continue;
-		}
-
-		/*
-		 *	This entry was marked to be stopped.  Acknowledge it.
-		 */
-		request = fr_fifo_pop(thread_pool.fifo[i]);
-		rad_assert(request != NULL);
-		VERIFY_REQUEST(request);
-		request->child_state = REQUEST_DONE;
-		thread_pool.num_queued--;
-	}
-
-	start = 0;
- retry:
-	/*
-	 *	Pop results from the top of the queue
-	 */
-	for (i = start; i < RAD_LISTEN_MAX; i++) {
-		request = fr_fifo_pop(thread_pool.fifo[i]);
-		if (request) {
-			VERIFY_REQUEST(request);
-			start = i;
-			break;
-		}
-	}
-
-	if (!request) {
-		pthread_mutex_unlock(&thread_pool.queue_mutex);
-		*prequest = NULL;
-		return 0;
-	}
-
-	rad_assert(thread_pool.num_queued > 0);
-	thread_pool.num_queued--;
-	*prequest = request;
-
-	rad_assert(*prequest != NULL);
-	rad_assert(request->magic == REQUEST_MAGIC);
-
-	request->component = "<core>";
-	request->module = "";
-	request->child_state = REQUEST_RUNNING;
-
-	/*
-	 *	If the request has sat in the queue for too long,
-	 *	kill it.
-	 *
-	 *	The main clean-up code can't delete the request from
-	 *	the queue, and therefore won't clean it up until we
-	 *	have acknowledged it as "done".
-	 */
-	if (request->master_state == REQUEST_STOP_PROCESSING) {
-		request->module = "<done>";
-		request->child_state = REQUEST_DONE;
-		goto retry;
-	}
-
-	/*
-	 *	The thread is currently processing a request.
-	 */
-	thread_pool.active_threads++;
 
 	blocked = time(NULL);
 	if (!request->proxy && (blocked - request->timestamp) > 5) {
@@ -563,7 +591,7 @@ static int request_dequeue(REQUEST **prequest)
 		if (last_complained < blocked) {
 			last_complained = blocked;
 			blocked -= request->timestamp;
-			num_blocked = total_blocked;
+			*num_blocked = total_blocked;
 		} else {
 			blocked = 0;
 		}
@@ -572,37 +600,968 @@ static int request_dequeue(REQUEST **prequest)
 		blocked = 0;
 	}
 
-	pthread_mutex_unlock(&thread_pool.queue_mutex);
+	return blocked;
+}
 
-	if (blocked) {
-		ERROR("%d requests have been waiting in the processing queue for %d seconds.  Check that all databases are running properly!",
-		      num_blocked, (int) blocked);
+/*
+ *	The number of requests in one thread's queue.  The queues
+ *	are lock-free, so this is only a snapshot.
+ */
+static uint32_t thread_num_queued(THREAD_HANDLE *handle)
+{
+	int i;
+	uint32_t num_queued = 0;
+
+	for (i = 0; i < NUM_FIFOS; i++) {
+		num_queued += fr_atomic_queue_num_elements(handle->queue[i]);
 	}
 
-	return 1;
+	return num_queued;
 }
 
-
 /*
- *	The main thread handler for requests.
+ *	Count the number of requests in all of the per-thread queues.
  *
- *	Wait on the semaphore until we have it, and process the request.
+ *	We don't lock the queues.  We want a close approximation of
+ *	the number of queued requests, and this is good enough.
+ *
+ *	Child threads must hold queue_mutex, as the main thread may
+ *	be changing the list of threads.
  */
-static void *request_handler_thread(void *arg)
+static uint32_t thread_queue_num_queued(void)
 {
-	THREAD_HANDLE *self = (THREAD_HANDLE *) arg;
+	uint32_t num_queued = 0;
+	THREAD_HANDLE *handle;
 
-	/*
-	 *	Loop forever, until told to exit.
-	 */
-	do {
+	for (handle = thread_pool.head; handle; handle = handle->next) {
+		num_queued += thread_num_queued(handle);
+	}
+
+	return num_queued;
+}
+
+/*
+ *	Count the number of threads which are currently processing a
+ *	request.  As above, this is an approximation.
+ */
+static uint32_t thread_pool_active(void)
+{
+	uint32_t active_threads = 0;
+	THREAD_HANDLE *handle;
+
+	if (!thread_pool.per_thread_queue) return thread_pool.active_threads;
+
+	for (handle = thread_pool.head; handle; handle = handle->next) {
+		if (handle->request) active_threads++;
+	}
+
+	return active_threads;
+}
+
+/*
+ *	The NUMA node a request was received on, or -1 if we don't know.
+ */
+static int request_numa_node(REQUEST *request)
+{
+	if (!request->listener) return -1;
+
+	return request->listener->numa_node;
+}
+
+/*
+ *	Pick a thread to give a new request to.
+ *
+ *	We prefer a thread which is idle, and has nothing queued.
+ *	Otherwise, we pick the thread with the shortest queue.  Idle
+ *	threads will steal requests from busy ones.
+ *
+ *	Threads on the same NUMA node as the request are preferred
+ *	over ones which are equally good.
+ *
+ *	This function gets called ONLY from the main handler thread.
+ */
+static THREAD_HANDLE *thread_queue_select(int node)
+{
+	uint32_t best_queued = 0;
+	THREAD_HANDLE *handle, *start, *best = NULL, *idle = NULL;
+
+	start = thread_pool.next_queue;
+	if (!start) start = thread_pool.head;
+	if (!start) return NULL;
+
+	handle = start;
+	do {
+		if (handle->status == THREAD_RUNNING) {
+			uint32_t num_queued = thread_num_queued(handle);
+
+			if (!handle->request && (num_queued == 0)) {
+				if ((node < 0) || (handle->numa_node == node)) {
+					best = handle;
+					break;
+				}
+				if (!idle) idle = handle;
+			}
+
+			if (!best || (num_queued < best_queued) ||
+			    ((num_queued == best_queued) &&
+			     (node >= 0) && (handle->numa_node == node) && (best->numa_node != node))) {
+				best = handle;
+				best_queued = num_queued;
+			}
+		}
+
+		handle = handle->next;
+		if (!handle) handle = thread_pool.head;
+	} while (handle != start);
+
+	/*
+	 *	An idle thread on another node is still better than
+	 *	waiting for a busy one on this node.
+	 */
+	if (idle && (!best || best->request || best_queued)) best = idle;
+
+	if (best) thread_pool.next_queue = best->next;
+
+	return best;
+}
+
+/*
+ *	Add a request to a particular thread's queue.
+ */
+static int thread_queue_push(THREAD_HANDLE *handle, REQUEST *request)
+{
+	if (!fr_atomic_queue_push(handle->queue[request->priority], request)) return 0;
+
+	sem_post(&handle->semaphore);
+
+	return 1;
+}
+
+/*
+ *	Remove the highest priority request from a thread's queue.
+ *
+ *	This can be called by any thread.
+ */
+static REQUEST *thread_queue_pop(THREAD_HANDLE *handle)
+{
+	RAD_LISTEN_TYPE i;
+	REQUEST *request;
+
+	for (i = 0; i < RAD_LISTEN_MAX; i++) {
+		request = fr_atomic_queue_pop(handle->queue[i]);
+		if (request) {
+			VERIFY_REQUEST(request);
+			return request;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ *	Add a request to the per-thread queues.
+ */
+static int request_enqueue_thread(REQUEST *request)
+{
+	uint32_t num_queued;
+	THREAD_HANDLE *handle;
+
+	num_queued = thread_queue_num_queued();
+
+#ifdef WITH_STATS
+#ifdef WITH_ACCOUNTING
+	if (thread_pool.auto_limit_acct && request_auto_limit(request, num_queued)) return 0;
+#endif
+#endif
+
+	thread_pool.request_count++;
+
+	if (num_queued >= thread_pool.max_queue_size) {
+		RATE_LIMIT(ERROR("Something is blocking the server.  There are %d packets in the queue, "
+				 "waiting to be processed.  Ignoring the new request.", num_queued));
+		return 0;
+	}
+	request->component = "<core>";
+	request->module = "<queue>";
+	request->child_state = REQUEST_QUEUED;
+
+	handle = thread_queue_select(request_numa_node(request));
+	if (!handle) {
+		ERROR("!!! ERROR !!! Failed inserting request %d into the queue", request->number);
+		return 0;
+	}
+
+	/*
+	 *	The least busy thread has a full queue.
+	 */
+	if (!thread_queue_push(handle, request)) {
+		RATE_LIMIT(ERROR("Something is blocking the server.  The per-thread queues are full.  "
+				 "Ignoring the new request."));
+		return 0;
+	}
+
+	return 1;
+}
+
+static THREAD_HANDLE *spawn_workload_thread(thread_workload_t *workload);
+
+/*
+ *	Find the named pool used by the request's virtual server.
+ */
+static thread_workload_t *request_workload(REQUEST *request)
+{
+	thread_workload_server_t *ws;
+
+	if (!request->server) return NULL;
+
+	for (ws = thread_pool.workload_servers; ws; ws = ws->next) {
+		if (strcmp(ws->server, request->server) == 0) return ws->workload;
+	}
+
+	return NULL;
+}
+
+/*
+ *	Add a request to the queue of a named pool.
+ */
+static int request_enqueue_workload(thread_workload_t *workload, REQUEST *request)
+{
+	bool spawn;
+
+	thread_pool.request_count++;
+
+	pthread_mutex_lock(&workload->mutex);
+
+	if (workload->num_queued >= workload->max_queue_size) {
+		pthread_mutex_unlock(&workload->mutex);
+
+		RATE_LIMIT(ERROR("Something is blocking thread pool %s.  There are %d packets in its queue, "
+				 "waiting to be processed.  Ignoring the new request.",
+				 workload->name, workload->max_queue_size));
+		return 0;
+	}
+	request->component = "<core>";
+	request->module = "<queue>";
+	request->child_state = REQUEST_QUEUED;
+
+	if (!fr_fifo_push(workload->fifo[request->priority], request)) {
+		pthread_mutex_unlock(&workload->mutex);
+		ERROR("!!! ERROR !!! Failed inserting request %d into the queue", request->number);
+		return 0;
+	}
+
+	workload->num_queued++;
+
+	/*
+	 *	Start another thread if all of them are busy.
+	 */
+	spawn = ((workload->active_threads + workload->num_queued) > workload->total_threads);
+
+	pthread_mutex_unlock(&workload->mutex);
+
+	if (spawn && (workload->total_threads < workload->max_threads)) {
+		(void) spawn_workload_thread(workload);
+	}
+
+	sem_post(&workload->semaphore);
+
+	return 1;
+}
+
+/*
+ *	Add a request to the list of waiting requests.
+ *	This function gets called ONLY from the main handler thread...
+ *
+ *	This function should never fail.
+ */
+int request_enqueue(REQUEST *request)
+{
+	/*
+	 *	If we haven't checked the number of child threads
+	 *	in a while, OR if the thread pool appears to be full,
+	 *	go manage it.
+	 */
+	if ((last_cleaned < request->timestamp) ||
+	    (thread_pool_active() == thread_pool.total_threads) ||
+	    (thread_pool.exited_threads > 0)) {
+		thread_pool_manage(request->timestamp);
+	}
+
+	if (thread_pool.workloads) {
+		thread_workload_t *workload;
+
+		workload = request_workload(request);
+		if (workload) return request_enqueue_workload(workload, request);
+	}
+
+	/*
+	 *	Remember when the request was queued, so that the
+	 *	thread which runs it can tell how long it waited.
+	 */
+	if (thread_pool.target_queue_time) {
+		gettimeofday(&request->queued, NULL);
+
+		if (!timercmp(&request->queued, &thread_pool.next_control, <)) {
+			thread_pool_control(&request->queued);
+		}
+	}
+
+	if (thread_pool.per_thread_queue) return request_enqueue_thread(request);
+
+	pthread_mutex_lock(&thread_pool.queue_mutex);
+
+#ifdef WITH_STATS
+#ifdef WITH_ACCOUNTING
+	if (thread_pool.auto_limit_acct && request_auto_limit(request, thread_pool.num_queued)) {
+		pthread_mutex_unlock(&thread_pool.queue_mutex);
+		return 0;
+	}
+#endif	/* WITH_ACCOUNTING */
+#endif
+
+	thread_pool.request_count++;
+
+	if (thread_pool.num_queued >= thread_pool.max_queue_size) {
+		pthread_mutex_unlock(&thread_pool.queue_mutex);
+
+		/*
+		 *	Mark the request as done.
+		 */
+		RATE_LIMIT(ERROR("Something is blocking the server.  There are %d packets in the queue, "
+				 "waiting to be processed.  Ignoring the new request.", thread_pool.num_queued));
+		return 0;
+	}
+	request->component = "<core>";
+	request->module = "<queue>";
+	request->child_state = REQUEST_QUEUED;
+
+	/*
+	 *	Push the request onto the appropriate fifo for that
+	 */
+	if (!fr_fifo_push(thread_pool.fifo[request->priority], request)) {
+		pthread_mutex_unlock(&thread_pool.queue_mutex);
+		ERROR("!!! ERROR !!! Failed inserting request %d into the queue", request->number);
+		return 0;
+	}
+
+	thread_pool.num_queued++;
+
+	pthread_mutex_unlock(&thread_pool.queue_mutex);
+
+	/*
+	 *	There's one more request in the queue.
+	 *
+	 *	Note that we're not touching the queue any more, so
+	 *	the semaphore post is outside of the mutex.  This also
+	 *	means that when the thread wakes up and tries to lock
+	 *	the mutex, it will be unlocked, and there won't be
+	 *	contention.
+	 */
+	sem_post(&thread_pool.semaphore);
+
+	return 1;
+}
+
+/*
+ *	Remove a request from this thread's queue, or steal one from
+ *	another thread's queue.
+ */
+static int request_dequeue_thread(THREAD_HANDLE *self, REQUEST **prequest)
+{
+	int num_blocked = 0;
+	time_t blocked = 0;
+	REQUEST *request;
+	THREAD_HANDLE *handle;
+
+	reap_children();
+
+	/*
+	 *	Old requests are cleared below, as they're popped.
+	 */
+ retry:
+	request = thread_queue_pop(self);
+
+	/*
+	 *	Our queue is empty.  Walk through the other threads,
+	 *	and take a request from the first one which has work
+	 *	to do.  The queues are lock-free, so we can pop from
+	 *	them at the same time as their owner.
+	 *
+	 *	If we know which NUMA node we're on, we look at the
+	 *	threads on the same node first.
+	 */
+	if (!request) {
+		int pass;
+
+		pthread_mutex_lock(&thread_pool.queue_mutex);
+		for (pass = (self->numa_node < 0); !request && (pass < 2); pass++) {
+			for (handle = self->next ? self->next : thread_pool.head;
+			     handle != self;
+			     handle = handle->next ? handle->next : thread_pool.head) {
+				if ((pass == 0) && (handle->numa_node != self->numa_node)) continue;
+
+				request = thread_queue_pop(handle);
+				if (request) break;
+			}
+		}
+		pthread_mutex_unlock(&thread_pool.queue_mutex);
+	}
+
+	if (!request) {
+		*prequest = NULL;
+		return 0;
+	}
+
+	rad_assert(request->magic == REQUEST_MAGIC);
+
+	request->component = "<core>";
+	request->module = "";
+	request->child_state = REQUEST_RUNNING;
+
+	/*
+	 *	If the request has sat in the queue for too long,
+	 *	kill it.
+	 */
+	if (request->master_state == REQUEST_STOP_PROCESSING) {
+		request->module = "<done>";
+		request->child_state = REQUEST_DONE;
+		goto retry;
+	}
+
+	*prequest = request;
+
+#ifdef WITH_STATS
+#ifdef WITH_ACCOUNTING
+	if (thread_pool.auto_limit_acct) {
+		pthread_mutex_lock(&thread_pool.queue_mutex);
+		request_pps_out();
+		pthread_mutex_unlock(&thread_pool.queue_mutex);
+	}
+#endif
+#endif
+
+	/*
+	 *	Only take the pool lock if we might have something to
+	 *	complain about.
+	 */
+	if (!request->proxy && ((time(NULL) - request->timestamp) > 5)) {
+		pthread_mutex_lock(&thread_pool.queue_mutex);
+		blocked = request_blocked(request, &num_blocked);
+		pthread_mutex_unlock(&thread_pool.queue_mutex);
+	}
+
+	if (blocked) {
+		ERROR("%d requests have been waiting in the processing queue for %d seconds.  Check that all databases are running properly!",
+		      num_blocked, (int) blocked);
+	}
+
+	return 1;
+}
+
+/*
+ *	Remove a request from the queue.
+ */
+static int request_dequeue(REQUEST **prequest)
+{
+	time_t blocked;
+	int num_blocked = 0;
+	RAD_LISTEN_TYPE i, start;
+	REQUEST *request;
+	reap_children();
+
+	pthread_mutex_lock(&thread_pool.queue_mutex);
+
+#ifdef WITH_STATS
+#ifdef WITH_ACCOUNTING
+	if (thread_pool.auto_limit_acct) request_pps_out();
+#endif
+#endif
+
+	/*
+	 *	Clear old requests from all queues.
+	 *
+	 *	We only do one pass over the queue, in order to
+	 *	amortize the work across the child threads.  Since we
+	 *	do N checks for one request de-queued, the old
+	 *	requests will be quickly cleared.
+	 */
+	for (i = 0; i < RAD_LISTEN_MAX; i++) {
+		request = fr_fifo_peek(thread_pool.fifo[i]);
+		if (!request) continue;
+
+		VERIFY_REQUEST(request);
+
+		if (request->master_state != REQUEST_STOP_PROCESSING) {
+			continue;
+		}
+
+		/*
+		 *	This entry was marked to be stopped.  Acknowledge it.
+		 */
+		request = fr_fifo_pop(thread_pool.fifo[i]);
+		rad_assert(request != NULL);
+		VERIFY_REQUEST(request);
+		request->child_state = REQUEST_DONE;
+		thread_pool.num_queued--;
+	}
+
+	start = 0;
+ retry:
+	/*
+	 *	Pop results from the top of the queue
+	 */
+	for (i = start; i < RAD_LISTEN_MAX; i++) {
+		request = fr_fifo_pop(thread_pool.fifo[i]);
+		if (request) {
+			VERIFY_REQUEST(request);
+			start = i;
+			break;
+		}
+	}
+
+	if (!request) {
+		pthread_mutex_unlock(&thread_pool.queue_mutex);
+		*prequest = NULL;
+		return 0;
+	}
+
+	rad_assert(thread_pool.num_queued > 0);
+	thread_pool.num_queued--;
+	*prequest = request;
+
+	rad_assert(*prequest != NULL);
+	rad_assert(request->magic == REQUEST_MAGIC);
+
+	request->component = "<core>";
+	request->module = "";
+	request->child_state = REQUEST_RUNNING;
+
+	/*
+	 *	If the request has sat in the queue for too long,
+	 *	kill it.
+	 *
+	 *	The main clean-up code can't delete the request from
+	 *	the queue, and therefore won't clean it up until we
+	 *	have acknowledged it as "done".
+	 */
+	if (request->master_state == REQUEST_STOP_PROCESSING) {
+		request->module = "<done>";
+		request->child_state = REQUEST_DONE;
+		goto retry;
+	}
+
+	/*
+	 *	The thread is currently processing a request.
+	 */
+	thread_pool.active_threads++;
+
+	blocked = request_blocked(request, &num_blocked);
+
+	pthread_mutex_unlock(&thread_pool.queue_mutex);
+
+	if (blocked) {
+		ERROR("%d requests have been waiting in the processing queue for %d seconds.  Check that all databases are running properly!",
+		      num_blocked, (int) blocked);
+	}
+
+	return 1;
+}
+
+
+/*
+ *	Remove a request from the queue of a named pool.
+ */
+static int request_dequeue_workload(thread_workload_t *workload, REQUEST **prequest)
+{
+	int i;
+	REQUEST *request;
+
+	reap_children();
+
+	pthread_mutex_lock(&workload->mutex);
+
+ retry:
+	request = NULL;
+	for (i = 0; i < NUM_FIFOS; i++) {
+		request = fr_fifo_pop(workload->fifo[i]);
+		if (request) break;
+	}
+
+	if (!request) {
+		pthread_mutex_unlock(&workload->mutex);
+		*prequest = NULL;
+		return 0;
+	}
+
+	rad_assert(workload->num_queued > 0);
+	workload->num_queued--;
+
+	VERIFY_REQUEST(request);
+
+	request->component = "<core>";
+	request->module = "";
+	request->child_state = REQUEST_RUNNING;
+
+	/*
+	 *	If the request has sat in the queue for too long,
+	 *	kill it.
+	 */
+	if (request->master_state == REQUEST_STOP_PROCESSING) {
+		request->module = "<done>";
+		request->child_state = REQUEST_DONE;
+		goto retry;
+	}
+
+	workload->active_threads++;
+
+	pthread_mutex_unlock(&workload->mutex);
+
+	*prequest = request;
+	return 1;
+}
+
+#ifdef WITH_YIELD
+/*
+ *	Where a coroutine starts.  makecontext() can't portably pass
+ *	a pointer, so we find the coroutine via the thread.
+ */
+static void coroutine_main(void)
+{
+	request_coroutine_t *co;
+
+	co = fr_thread_local_init(thread_coroutine, NULL);
+	rad_assert(co != NULL);
+
+	co->request->process(co->request, FR_ACTION_RUN);
+	co->done = true;
+
+	setcontext(co->caller);
+}
+
+/*
+ *	Run a coroutine until it finishes, or until it yields.
+ */
+static void coroutine_run(THREAD_HANDLE *self, request_coroutine_t *co)
+{
+	ucontext_t caller;
+
+	self->request = co->request;
+	co->request->child_pid = self->pthread_id;
+	co->caller = &caller;
+
+	(void) fr_thread_local_set(thread_coroutine, co);
+	swapcontext(&caller, &co->context);
+	(void) fr_thread_local_set(thread_coroutine, NULL);
+
+	self->request = NULL;
+
+	/*
+	 *	The request is finished, and may already have been
+	 *	freed by the main thread.  Don't touch it.
+	 */
+	if (co->done) {
+		if (!self->stack) {
+			self->stack = co->stack;
+		} else {
+			free(co->stack);
+		}
+		free(co);
+		return;
+	}
+
+	/*
+	 *	It's waiting for I/O.  Hand it to the poll thread.
+	 *	As soon as the mutex is unlocked, it may be resumed
+	 *	by another thread.
+	 */
+	pthread_mutex_lock(&thread_pool.yield_mutex);
+	co->next = thread_pool.waiting;
+	thread_pool.waiting = co;
+	pthread_mutex_unlock(&thread_pool.yield_mutex);
+
+	/*
+	 *	If the pipe is full, the poll thread will wake up
+	 *	anyway.
+	 */
+	if (write(thread_pool.poll_pipe[1], "", 1) < 0) {
+		if (errno != EAGAIN) ERROR("Failed waking up the poll thread: %s", fr_syserror(errno));
+	}
+}
+
+/*
+ *	Run a new request as a coroutine.  If we can't, just run
+ *	it normally.
+ */
+static void coroutine_start(THREAD_HANDLE *self, REQUEST *request)
+{
+	request_coroutine_t *co;
+
+	co = calloc(1, sizeof(*co));
+	if (!co) goto run;
+
+	if (self->stack) {
+		co->stack = self->stack;
+		self->stack = NULL;
+	} else {
+		co->stack = malloc(thread_pool.yield_stack_size);
+		if (!co->stack) {
+			free(co);
+			goto run;
+		}
+	}
+
+	if (getcontext(&co->context) < 0) {
+		free(co->stack);
+		free(co);
+		goto run;
+	}
+	co->context.uc_stack.ss_sp = co->stack;
+	co->context.uc_stack.ss_size = thread_pool.yield_stack_size;
+	co->context.uc_link = NULL;
+	makecontext(&co->context, coroutine_main, 0);
+
+	co->request = request;
+	co->fd = -1;
+
+	coroutine_run(self, co);
+	return;
+
+run:
+	request->process(request, FR_ACTION_RUN);
+}
+
+/*
+ *	Run the oldest coroutine which is ready to be resumed.
+ */
+static bool coroutine_next(THREAD_HANDLE *self)
+{
+	request_coroutine_t *co;
+
+	pthread_mutex_lock(&thread_pool.yield_mutex);
+	co = thread_pool.resumed;
+	if (co) {
+		thread_pool.resumed = co->next;
+		if (!thread_pool.resumed) thread_pool.resumed_tail = NULL;
+	}
+	pthread_mutex_unlock(&thread_pool.yield_mutex);
+
+	if (!co) return false;
+
+	if (!thread_pool.per_thread_queue) {
+		pthread_mutex_lock(&thread_pool.queue_mutex);
+		thread_pool.active_threads++;
+		pthread_mutex_unlock(&thread_pool.queue_mutex);
+	}
+
+	DEBUG2("Thread %d resuming request %d", self->thread_num, co->request->number);
+
+	coroutine_run(self, co);
+	return true;
+}
+
+/*
+ *	Put a coroutine on the resumed list, and wake up a thread
+ *	to run it.  Called only from the poll thread.
+ */
+static void coroutine_resume(request_coroutine_t *co)
+{
+	THREAD_HANDLE *handle;
+
+	co->next = NULL;
+
+	pthread_mutex_lock(&thread_pool.yield_mutex);
+	if (thread_pool.resumed_tail) {
+		thread_pool.resumed_tail->next = co;
+	} else {
+		thread_pool.resumed = co;
+	}
+	thread_pool.resumed_tail = co;
+	pthread_mutex_unlock(&thread_pool.yield_mutex);
+
+	if (!thread_pool.per_thread_queue) {
+		sem_post(&thread_pool.semaphore);
+		return;
+	}
+
+	/*
+	 *	Prefer an idle thread.  Busy threads check the resumed
+	 *	list when they finish their current request, so if
+	 *	there's no idle thread, waking any one is enough.
+	 */
+	pthread_mutex_lock(&thread_pool.queue_mutex);
+	for (handle = thread_pool.head; handle != NULL; handle = handle->next) {
+		if (!handle->request && (handle->status == THREAD_RUNNING)) break;
+	}
+	if (!handle) handle = thread_pool.head;
+	if (handle) sem_post(&handle->semaphore);
+	pthread_mutex_unlock(&thread_pool.queue_mutex);
+}
+
+/*
+ *	Watch the suspended coroutines, and resume them when their
+ *	fd becomes readable, or when they time out.
+ */
+static void *coroutine_poll_thread(UNUSED void *arg)
+{
+	int			i, rcode, timeout;
+	int			num = 0, size = 0;
+	request_coroutine_t	*co, *next, **array = NULL;
+	struct pollfd		*fds = NULL;
+	struct timeval		now, left;
+	char			buffer[64];
+
+	while (!thread_pool.stop_flag) {
+		/*
+		 *	Take the newly suspended coroutines.
+		 */
+		pthread_mutex_lock(&thread_pool.yield_mutex);
+		co = thread_pool.waiting;
+		thread_pool.waiting = NULL;
+		pthread_mutex_unlock(&thread_pool.yield_mutex);
+
+		for (; co != NULL; co = next) {
+			next = co->next;
+
+			if (num == size) {
+				request_coroutine_t **new_array;
+				struct pollfd *new_fds;
+
+				new_array = talloc_realloc(NULL, array, request_coroutine_t *, size ? size * 2 : 64);
+				if (new_array) array = new_array;
+
+				new_fds = talloc_realloc(NULL, fds, struct pollfd, (size ? size * 2 : 64) + 1);
+				if (new_fds) fds = new_fds;
+
+				if (!new_array || !new_fds) {
+					ERROR("Out of memory watching suspended requests");
+					co->ready = -1;
+					coroutine_resume(co);
+					continue;
+				}
+				size = size ? size * 2 : 64;
+			}
+
+			array[num++] = co;
+		}
+
+		if (!fds) {
+			fds = talloc_array(NULL, struct pollfd, 1);
+			if (!fds) break;
+		}
+
+		fds[0].fd = thread_pool.poll_pipe[0];
+		fds[0].events = POLLIN;
+		fds[0].revents = 0;
+
+		/*
+		 *	Sleep until the first timeout, or until something
+		 *	happens.
+		 */
+		gettimeofday(&now, NULL);
+		timeout = -1;
+		for (i = 0; i < num; i++) {
+			int ms;
+
+			co = array[i];
+
+			fds[i + 1].fd = co->fd;	/* poll() ignores negative fds */
+			fds[i + 1].events = POLLIN;
+			fds[i + 1].revents = 0;
+
+			if (!co->has_when) continue;
+
+			if (timercmp(&co->when, &now, <)) {
+				ms = 0;
+			} else {
+				timersub(&co->when, &now, &left);
+				ms = (left.tv_sec * 1000) + ((left.tv_usec + 999) / 1000);
+			}
+			if ((timeout < 0) || (ms < timeout)) timeout = ms;
+		}
+
+		rcode = poll(fds, num + 1, timeout);
+		if (rcode < 0) {
+			if (errno == EINTR) continue;
+
+			/*
+			 *	Don't spin.  Fail all of the waiting
+			 *	requests instead.
+			 */
+			ERROR("Failed waiting for suspended requests: %s", fr_syserror(errno));
+			for (i = 0; i < num; i++) {
+				array[i]->ready = -1;
+				coroutine_resume(array[i]);
+			}
+			num = 0;
+			continue;
+		}
+
+		/*
+		 *	Drain the wake-up pipe.  It's non-blocking.
+		 */
+		if (fds[0].revents) {
+			while (read(thread_pool.poll_pipe[0], buffer, sizeof(buffer)) > 0) {
+				/* nothing */
+			}
+		}
+
+		/*
+		 *	Walk backwards, so that we can fill a hole with
+		 *	the last entry, which we've already checked.
+		 */
+		gettimeofday(&now, NULL);
+		for (i = num - 1; i >= 0; i--) {
+			co = array[i];
+
+			if ((co->fd >= 0) && fds[i + 1].revents) {
+				co->ready = (fds[i + 1].revents & (POLLIN | POLLHUP)) ? 1 : -1;
+
+			} else if (co->has_when && !timercmp(&now, &co->when, <)) {
+				co->ready = 0;
+
+			} else {
+				continue;
+			}
+
+			array[i] = array[--num];
+			coroutine_resume(co);
+		}
+	}
+
+	talloc_free(array);
+	talloc_free(fds);
+
+	return NULL;
+}
+#endif	/* WITH_YIELD */
+
+/*
+ *	The main thread handler for requests.
+ *
+ *	Wait on the semaphore until we have it, and process the request.
+ */
+static void *request_handler_thread(void *arg)
+{
+	THREAD_HANDLE *self = (THREAD_HANDLE *) arg;
+	sem_t *semaphore;
+
+	if (self->workload) {
+		semaphore = &self->workload->semaphore;
+	} else {
+		semaphore = thread_pool.per_thread_queue ? &self->semaphore : &thread_pool.semaphore;
+	}
+
+	/*
+	 *	Loop forever, until told to exit.
+	 */
+	do {
 		/*
 		 *	Wait to be signalled.
 		 */
 		DEBUG2("Thread %d waiting to be assigned a request",
 		       self->thread_num);
 	re_wait:
-		if (sem_wait(&thread_pool.semaphore) != 0) {
+		if (sem_wait(semaphore) != 0) {
 			/*
 			 *	Interrupted system call.  Go back to
 			 *	waiting, but DON'T print out any more
@@ -619,6 +1578,7 @@ static void *request_handler_thread(void *arg)
 
 		DEBUG2("Thread %d got semaphore", self->thread_num);
 
+	re_dequeue:
 #ifdef HAVE_OPENSSL_ERR_H
 		/*
 		 *	Clear the error queue for the current thread.
@@ -632,24 +1592,54 @@ static void *request_handler_thread(void *arg)
 		 */
 		if (thread_pool.stop_flag) break;
 
+#ifdef WITH_YIELD
+		/*
+		 *	Requests which were waiting for I/O go first.
+		 */
+		if (thread_pool.yield && !self->workload && coroutine_next(self)) goto finished;
+#endif
+
 		/*
 		 *	Try to grab a request from the queue.
 		 *
 		 *	It may be empty, in which case we fail
 		 *	gracefully.
 		 */
-		if (!request_dequeue(&self->request)) continue;
+		if (self->workload) {
+			if (!request_dequeue_workload(self->workload, &self->request)) continue;
+		} else if (thread_pool.per_thread_queue) {
+			if (!request_dequeue_thread(self, &self->request)) continue;
+		} else {
+			if (!request_dequeue(&self->request)) continue;
+		}
 
 		self->request->child_pid = self->pthread_id;
 		self->request_count++;
 
+		/*
+		 *	Everything this thread does for the request
+		 *	reads the time from here.
+		 */
+		fr_clock_update();
+
+		if (thread_pool.target_queue_time) {
+			struct timeval now, wait;
+
+			fr_clock_gettime(&now);
+			if (timercmp(&now, &self->request->queued, >)) {
+				timersub(&now, &self->request->queued, &wait);
+				self->queue_time += ((uint64_t) wait.tv_sec * USEC) + wait.tv_usec;
+			}
+			self->queue_count++;
+		}
+
 		DEBUG2("Thread %d handling request %d, (%d handled so far)",
 		       self->thread_num, self->request->number,
 		       self->request_count);
 
 #ifdef WITH_ACCOUNTING
 		if ((self->request->packet->code == PW_CODE_ACCOUNTING_REQUEST) &&
-		    thread_pool.auto_limit_acct) {
+		    thread_pool.auto_limit_acct && !self->workload) {
 			VALUE_PAIR *vp;
 			REQUEST *request = self->request;
 
@@ -664,34 +1654,69 @@ static void *request_handler_thread(void *arg)
 			vp = radius_paircreate(request, &request->config_items,
 					       183, VENDORPEC_FREERADIUS);
 			if (vp) {
-				vp->vp_integer = thread_pool.max_queue_size - thread_pool.num_queued;
+				uint32_t num_queued;
+
+				if (thread_pool.per_thread_queue) {
+					pthread_mutex_lock(&thread_pool.queue_mutex);
+					num_queued = thread_queue_num_queued();
+					pthread_mutex_unlock(&thread_pool.queue_mutex);
+				} else {
+					num_queued = thread_pool.num_queued;
+				}
+
+				vp->vp_integer = thread_pool.max_queue_size - num_queued;
 				vp->vp_integer *= 100;
 				vp->vp_integer /= thread_pool.max_queue_size;
 			}
 		}
 #endif
 
+#ifdef WITH_YIELD
+		if (thread_pool.yield && !self->workload) {
+			coroutine_start(self, self->request);
+		} else
+#endif
 		self->request->process(self->request, FR_ACTION_RUN);
 		self->request = NULL;
 
+#ifdef WITH_YIELD
+	finished:
+#endif
 		/*
 		 *	Update the active threads.
 		 */
-		pthread_mutex_lock(&thread_pool.queue_mutex);
-		rad_assert(thread_pool.active_threads > 0);
-		thread_pool.active_threads--;
-		pthread_mutex_unlock(&thread_pool.queue_mutex);
+		if (self->workload) {
+			pthread_mutex_lock(&self->workload->mutex);
+			rad_assert(self->workload->active_threads > 0);
+			self->workload->active_threads--;
+			pthread_mutex_unlock(&self->workload->mutex);
+
+		} else if (!thread_pool.per_thread_queue) {
+			pthread_mutex_lock(&thread_pool.queue_mutex);
+			rad_assert(thread_pool.active_threads > 0);
+			thread_pool.active_threads--;
+			pthread_mutex_unlock(&thread_pool.queue_mutex);
+		}
 
 		/*
 		 *	If the thread has handled too many requests, then make it
 		 *	exit.
 		 */
-		if ((thread_pool.max_requests_per_thread > 0) &&
+		if (!self->workload && (thread_pool.max_requests_per_thread > 0) &&
 		    (self->request_count >= thread_pool.max_requests_per_thread)) {
 			DEBUG2("Thread %d handled too many requests",
 			       self->thread_num);
 			break;
 		}
+
+		/*
+		 *	Keep going until there's nothing left to do
+		 *	in our queue, or in anyone else's.  Semaphore
+		 *	posts for requests we've already handled just
+		 *	cause a spurious wake-up later.
+		 */
+		if (thread_pool.per_thread_queue && !self->workload &&
+		    (self->status != THREAD_CANCELLED)) goto re_dequeue;
 	} while (self->status != THREAD_CANCELLED);
 
 	DEBUG2("Thread %d exiting...", self->thread_num);
@@ -705,9 +1730,20 @@ static void *request_handler_thread(void *arg)
 	ERR_remove_state(0);
 #endif
 
-	pthread_mutex_lock(&thread_pool.queue_mutex);
-	thread_pool.exited_threads++;
-	pthread_mutex_unlock(&thread_pool.queue_mutex);
+	/*
+	 *	Let modules clean up their data for this thread.
+	 */
+	modules_thread_detach();
+
+	/*
+	 *	Threads in named pools are only joined when the
+	 *	server exits.
+	 */
+	if (!self->workload) {
+		pthread_mutex_lock(&thread_pool.queue_mutex);
+		thread_pool.exited_threads++;
+		pthread_mutex_unlock(&thread_pool.queue_mutex);
+	}
 
 	/*
 	 *  Do this as the LAST thing before exiting.
@@ -719,6 +1755,22 @@ static void *request_handler_thread(void *arg)
 	return NULL;
 }
 
+/*
+ *	Free the per-thread queue of a THREAD_HANDLE.
+ */
+static void thread_queue_free(THREAD_HANDLE *handle)
+{
+	int i;
+
+	for (i = 0; i < NUM_FIFOS; i++) {
+		talloc_free(handle->queue[i]);
+		handle->queue[i] = NULL;
+	}
+#ifndef __APPLE__
+	sem_destroy(&handle->semaphore);
+#endif
+}
+
 /*
  *	Take a THREAD_HANDLE, delete it from the thread pool and
  *	free its resources.
@@ -735,6 +1787,8 @@ static void delete_thread(THREAD_HANDLE *handle)
 
 	DEBUG2("Deleting thread %d", handle->thread_num);
 
+	if (thread_pool.per_thread_queue) pthread_mutex_lock(&thread_pool.queue_mutex);
+
 	prev = handle->prev;
 	next = handle->next;
 	rad_assert(thread_pool.total_threads > 0);
@@ -757,6 +1811,39 @@ static void delete_thread(THREAD_HANDLE *handle)
 		next->prev = prev;
 	}
 
+	if (thread_pool.next_queue == handle) thread_pool.next_queue = next;
+
+	thread_pool.exited_queue_time += handle->queue_time;
+	thread_pool.exited_queue_count += handle->queue_count;
+
+	if (thread_pool.per_thread_queue) {
+		REQUEST *request;
+
+		pthread_mutex_unlock(&thread_pool.queue_mutex);
+
+		/*
+		 *	The thread may have exited with requests still
+		 *	in its queue.  Give them to someone else.  If
+		 *	there's no one left, mark them done so that
+		 *	the main thread can clean them up.
+		 */
+		while ((request = thread_queue_pop(handle)) != NULL) {
+			THREAD_HANDLE *other;
+
+			other = thread_queue_select(request_numa_node(request));
+			if (other && thread_queue_push(other, request)) continue;
+
+			request->module = "<done>";
+			request->child_state = REQUEST_DONE;
+		}
+
+		thread_queue_free(handle);
+	}
+
+#ifdef WITH_YIELD
+	free(handle->stack);
+#endif
+
 	/*
 	 *	Free the handle, now that it's no longer referencable.
 	 */
@@ -764,6 +1851,31 @@ static void delete_thread(THREAD_HANDLE *handle)
 }
 
 
+/*
+ *	Pick the CPU from "cpu_affinity" which has the fewest threads
+ *	pinned to it, or -1 if threads aren't pinned.
+ */
+static int thread_pool_cpu(void)
+{
+	int i, cpu = -1;
+	uint32_t count, best = 0;
+	THREAD_HANDLE *handle;
+
+	for (i = 0; i < thread_pool.num_cpus; i++) {
+		count = 0;
+		for (handle = thread_pool.head; handle; handle = handle->next) {
+			if (handle->cpu == thread_pool.cpus[i]) count++;
+		}
+
+		if ((cpu < 0) || (count < best)) {
+			cpu = thread_pool.cpus[i];
+			best = count;
+		}
+	}
+
+	return cpu;
+}
+
 /*
  *	Spawn a new thread, and place it in the thread pool.
  *
@@ -794,6 +1906,36 @@ static THREAD_HANDLE *spawn_thread(time_t now, int do_trigger)
 	handle->request_count = 0;
 	handle->status = THREAD_RUNNING;
 	handle->timestamp = time(NULL);
+	handle->cpu = thread_pool_cpu();
+	handle->numa_node = (handle->cpu < 0) ? -1 : rad_cpu_node(handle->cpu);
+
+	if (thread_pool.per_thread_queue) {
+		int i;
+
+		memset(&handle->semaphore, 0, sizeof(handle->semaphore));
+		if (sem_init(&handle->semaphore, 0, SEMAPHORE_LOCKED) != 0) {
+			ERROR("Failed to initialize thread semaphore: %s", fr_syserror(errno));
+			free(handle);
+			return NULL;
+		}
+
+		for (i = 0; i < NUM_FIFOS; i++) {
+			handle->queue[i] = fr_atomic_queue_create(NULL, thread_pool.per_thread_queue_size);
+			if (!handle->queue[i]) {
+				ERROR("Failed to set up thread request queue: %s", fr_strerror());
+				thread_queue_free(handle);
+				free(handle);
+				return NULL;
+			}
+		}
+
+		/*
+		 *	The thread has to go into the list before it
+		 *	starts running, as it walks the list looking
+		 *	for requests to steal.
+		 */
+		pthread_mutex_lock(&thread_pool.queue_mutex);
+	}
 
 	/*
 	 *	Create the thread joinable, so that it can be cleaned up
@@ -804,47 +1946,216 @@ static THREAD_HANDLE *spawn_thread(time_t now, int do_trigger)
 	 */
 	rcode = pthread_create(&handle->pthread_id, 0, request_handler_thread, handle);
 	if (rcode != 0) {
-		free(handle);
 		ERROR("Thread create failed: %s",
 		       fr_syserror(rcode));
+		if (thread_pool.per_thread_queue) {
+			pthread_mutex_unlock(&thread_pool.queue_mutex);
+			thread_queue_free(handle);
+		}
+		free(handle);
+		return NULL;
+	}
+
+	if ((handle->cpu >= 0) && (rad_thread_cpu(handle->pthread_id, handle->cpu) < 0)) {
+		WARN("Thread %d: %s", handle->thread_num, fr_strerror());
+	}
+
+	/*
+	 *	One more thread to go into the list.
+	 */
+	thread_pool.total_threads++;
+
+	/*
+	 *	Add the thread handle to the tail of the thread pool list.
+	 */
+	if (thread_pool.tail) {
+		thread_pool.tail->next = handle;
+		handle->prev = thread_pool.tail;
+		thread_pool.tail = handle;
+	} else {
+		rad_assert(thread_pool.head == NULL);
+		thread_pool.head = thread_pool.tail = handle;
+	}
+
+	if (thread_pool.per_thread_queue) pthread_mutex_unlock(&thread_pool.queue_mutex);
+
+	DEBUG2("Thread spawned new child %d. Total threads in pool: %d",
+			handle->thread_num, thread_pool.total_threads);
+	if (do_trigger) exec_trigger(NULL, NULL, "server.thread.start", true);
+
+	/*
+	 *	Update the time we last spawned a thread.
+	 */
+	thread_pool.time_last_spawned = now;
+
+	/*
+	 * Fire trigger if maximum number of threads reached
+	 */
+	if (thread_pool.total_threads >= thread_pool.max_threads)
+		exec_trigger(NULL, NULL, "server.thread.max_threads", true);
+
+	/*
+	 *	And return the new handle to the caller.
+	 */
+	return handle;
+}
+
+/*
+ *	Spawn a new thread for a named pool.
+ *
+ *	This function is called ONLY from the main server thread.
+ */
+static THREAD_HANDLE *spawn_workload_thread(thread_workload_t *workload)
+{
+	int rcode;
+	THREAD_HANDLE *handle;
+
+	handle = (THREAD_HANDLE *) rad_malloc(sizeof(THREAD_HANDLE));
+	memset(handle, 0, sizeof(THREAD_HANDLE));
+	handle->thread_num = thread_pool.max_thread_num++;
+	handle->status = THREAD_RUNNING;
+	handle->timestamp = time(NULL);
+	handle->cpu = -1;
+	handle->numa_node = -1;
+	handle->workload = workload;
+
+	rcode = pthread_create(&handle->pthread_id, 0, request_handler_thread, handle);
+	if (rcode != 0) {
+		ERROR("Thread create failed: %s", fr_syserror(rcode));
+		free(handle);
 		return NULL;
 	}
 
-	/*
-	 *	One more thread to go into the list.
-	 */
-	thread_pool.total_threads++;
-	DEBUG2("Thread spawned new child %d. Total threads in pool: %d",
-			handle->thread_num, thread_pool.total_threads);
-	if (do_trigger) exec_trigger(NULL, NULL, "server.thread.start", true);
+	handle->next = workload->head;
+	workload->head = handle;
+	workload->total_threads++;
+
+	DEBUG2("Thread spawned new child %d. Total threads in pool %s: %d",
+	       handle->thread_num, workload->name, workload->total_threads);
+
+	if (workload->total_threads >= workload->max_threads) {
+		exec_trigger(NULL, NULL, "server.thread.max_threads", true);
+	}
+
+	return handle;
+}
+
+/*
+ *	Parse the named pools, and find the virtual servers which
+ *	use them.
+ */
+static int thread_workloads_init(CONF_SECTION *cs)
+{
+	int i;
+	char const *name;
+	CONF_SECTION *subcs;
+	CONF_PAIR *cp;
+	thread_workload_t *workload;
+	thread_workload_server_t *ws;
+
+	for (subcs = cf_subsection_find_next(cs, NULL, "thread");
+	     subcs != NULL;
+	     subcs = cf_subsection_find_next(cs, subcs, "thread")) {
+		name = cf_section_name2(subcs);
+		if (!name || (strcmp(name, "pool") == 0)) continue;
+
+		workload = talloc_zero(NULL, thread_workload_t);
+		workload->name = name;
+
+		if (cf_section_parse(subcs, workload, workload_config) < 0) {
+			talloc_free(workload);
+			return -1;
+		}
+
+		if (workload->max_threads == 0) {
+			cf_log_err_cs(subcs, "max_servers must be > 0");
+		error:
+			talloc_free(workload);
+			return -1;
+		}
+
+		if (workload->start_threads > workload->max_threads) {
+			cf_log_err_cs(subcs, "start_servers (%i) must be <= max_servers (%i)",
+				      workload->start_threads, workload->max_threads);
+			goto error;
+		}
+
+		/*
+		 *	The fifos are allocated up front, so by default
+		 *	they only hold a few requests for each thread.
+		 */
+		if (workload->max_queue_size == 0) {
+			workload->max_queue_size = workload->max_threads * thread_pool.per_thread_queue_size;
+			if (workload->max_queue_size > 1024*1024) workload->max_queue_size = 1024*1024;
+		}
+
+		if ((workload->max_queue_size < 2) || (workload->max_queue_size > 1024*1024)) {
+			cf_log_err_cs(subcs, "max_queue_size value must be in range 2-1048576");
+			goto error;
+		}
+
+		memset(&workload->semaphore, 0, sizeof(workload->semaphore));
+		if (sem_init(&workload->semaphore, 0, SEMAPHORE_LOCKED) != 0) {
+			ERROR("FATAL: Failed to initialize semaphore: %s", fr_syserror(errno));
+			goto error;
+		}
+
+		if (pthread_mutex_init(&workload->mutex, NULL) != 0) {
+			ERROR("FATAL: Failed to initialize queue mutex: %s", fr_syserror(errno));
+			goto error;
+		}
+
+		for (i = 0; i < NUM_FIFOS; i++) {
+			workload->fifo[i] = fr_fifo_create(workload->max_queue_size, NULL);
+			if (!workload->fifo[i]) {
+				ERROR("FATAL: Failed to set up request fifo");
+				goto error;
+			}
+		}
+
+		workload->next = thread_pool.workloads;
+		thread_pool.workloads = workload;
+	}
+
+	for (subcs = cf_subsection_find_next(cs, NULL, "server");
+	     subcs != NULL;
+	     subcs = cf_subsection_find_next(cs, subcs, "server")) {
+		name = cf_section_name2(subcs);
+		if (!name) continue;
 
-	/*
-	 *	Add the thread handle to the tail of the thread pool list.
-	 */
-	if (thread_pool.tail) {
-		thread_pool.tail->next = handle;
-		handle->prev = thread_pool.tail;
-		thread_pool.tail = handle;
-	} else {
-		rad_assert(thread_pool.head == NULL);
-		thread_pool.head = thread_pool.tail = handle;
+		cp = cf_pair_find(subcs, "thread_pool");
+		if (!cp || !cf_pair_value(cp)) continue;
+
+		for (workload = thread_pool.workloads; workload; workload = workload->next) {
+			if (strcmp(workload->name, cf_pair_value(cp)) == 0) break;
+		}
+
+		/*
+		 *	"thread_pool = pool" is the main pool.
+		 *	virtual_servers_load() complains about names
+		 *	which don't exist.
+		 */
+		if (!workload) continue;
+
+		ws = talloc_zero(workload, thread_workload_server_t);
+		ws->server = name;
+		ws->workload = workload;
+		ws->next = thread_pool.workload_servers;
+		thread_pool.workload_servers = ws;
 	}
 
 	/*
-	 *	Update the time we last spawned a thread.
+	 *	Start the threads.
 	 */
-	thread_pool.time_last_spawned = now;
+	for (workload = thread_pool.workloads; workload; workload = workload->next) {
+		uint32_t j;
 
-	/*
-	 * Fire trigger if maximum number of threads reached
-	 */
-	if (thread_pool.total_threads >= thread_pool.max_threads)
-		exec_trigger(NULL, NULL, "server.thread.max_threads", true);
+		for (j = 0; j < workload->start_threads; j++) {
+			if (!spawn_workload_thread(workload)) return -1;
+		}
+	}
 
-	/*
-	 *	And return the new handle to the caller.
-	 */
-	return handle;
+	return 0;
 }
 #endif	/* WITH_GCD */
 
@@ -888,7 +2199,12 @@ int thread_pool_init(UNUSED CONF_SECTION *cs, bool *spawn_flag)
 	rad_assert(pool_initialized == false); /* not called on HUP */
 
 #ifndef WITH_GCD
-	pool_cf = cf_subsection_find_next(cs, NULL, "thread");
+	/*
+	 *	Other "thread" sections are named pools, see
+	 *	thread_workloads_init().
+	 */
+	pool_cf = cf_section_sub_find_name2(cs, "thread", "pool");
+	if (!pool_cf) pool_cf = cf_subsection_find_next(cs, NULL, "thread");
 	if (!pool_cf) *spawn_flag = false;
 #endif
 
@@ -951,12 +2267,45 @@ int thread_pool_init(UNUSED CONF_SECTION *cs, bool *spawn_flag)
 		ERROR("FATAL: max_queue_size value must be in range 2-1048576");
 		return -1;
 	}
+	if ((thread_pool.per_thread_queue_size < 2) || (thread_pool.per_thread_queue_size > thread_pool.max_queue_size)) {
+		ERROR("FATAL: per_thread_queue_size value must be in range 2-max_queue_size");
+		return -1;
+	}
 
 	if (thread_pool.start_threads > thread_pool.max_threads) {
 		ERROR("FATAL: start_servers (%i) must be <= max_servers (%i)",
 		      thread_pool.start_threads, thread_pool.max_threads);
 		return -1;
 	}
+
+	if (thread_pool.target_queue_time > 10000) {
+		ERROR("FATAL: target_queue_time value must be in range 0-10000");
+		return -1;
+	}
+
+	if ((thread_pool.yield_stack_size < 16384) || (thread_pool.yield_stack_size > 16*1024*1024)) {
+		ERROR("FATAL: yield_stack_size value must be in range 16384-16777216");
+		return -1;
+	}
+
+	if (thread_pool.cpu_affinity) {
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+		thread_pool.num_cpus = rad_cpu_list(NULL, &thread_pool.cpus, thread_pool.cpu_affinity);
+		if (thread_pool.num_cpus < 0) {
+			ERROR("FATAL: Failed parsing cpu_affinity: %s", fr_strerror());
+			return -1;
+		}
+#else
+		WARN("Setting 'cpu_affinity' requires pthread_setaffinity_np().  Ignoring 'cpu_affinity'");
+#endif
+	}
+
+#ifndef WITH_YIELD
+	if (thread_pool.yield) {
+		WARN("Setting 'yield' requires <ucontext.h>.  Ignoring 'yield'");
+		thread_pool.yield = false;
+	}
+#endif
 #endif	/* WITH_GCD */
 
 	/*
@@ -987,15 +2336,52 @@ int thread_pool_init(UNUSED CONF_SECTION *cs, bool *spawn_flag)
 	}
 
 	/*
-	 *	Allocate multiple fifos.
+	 *	Allocate multiple fifos.  With "per_thread_queue",
+	 *	each thread allocates its own.
 	 */
-	for (i = 0; i < RAD_LISTEN_MAX; i++) {
+	for (i = 0; !thread_pool.per_thread_queue && (i < RAD_LISTEN_MAX); i++) {
 		thread_pool.fifo[i] = fr_fifo_create(thread_pool.max_queue_size, NULL);
 		if (!thread_pool.fifo[i]) {
 			ERROR("FATAL: Failed to set up request fifo");
 			return -1;
 		}
 	}
+
+#ifdef WITH_YIELD
+	/*
+	 *	Start the thread which watches suspended requests.
+	 */
+	if (thread_pool.yield) {
+		rcode = pthread_mutex_init(&thread_pool.yield_mutex, NULL);
+		if (rcode != 0) {
+			ERROR("FATAL: Failed to initialize yield mutex: %s",
+			       fr_syserror(errno));
+			return -1;
+		}
+
+		if (pipe(thread_pool.poll_pipe) < 0) {
+			ERROR("FATAL: Failed creating pipe: %s",
+			       fr_syserror(errno));
+			return -1;
+		}
+
+		for (i = 0; i < 2; i++) {
+			if ((fcntl(thread_pool.poll_pipe[i], F_SETFL, O_NONBLOCK) < 0) ||
+			    (fcntl(thread_pool.poll_pipe[i], F_SETFD, FD_CLOEXEC) < 0)) {
+				ERROR("FATAL: Failed setting pipe flags: %s",
+				       fr_syserror(errno));
+				return -1;
+			}
+		}
+
+		rcode = pthread_create(&thread_pool.poll_thread, 0, coroutine_poll_thread, NULL);
+		if (rcode != 0) {
+			ERROR("FATAL: Failed creating poll thread: %s",
+			       fr_syserror(rcode));
+			return -1;
+		}
+	}
+#endif
 #endif
 
 #ifdef HAVE_OPENSSL_CRYPTO_H
@@ -1021,6 +2407,8 @@ int thread_pool_init(UNUSED CONF_SECTION *cs, bool *spawn_flag)
 			return -1;
 		}
 	}
+
+	if (thread_workloads_init(cs) < 0) return -1;
 #else
 	thread_pool.queue = dispatch_queue_create("org.freeradius.threads", NULL);
 	if (!thread_pool.queue) {
@@ -1057,9 +2445,15 @@ void thread_pool_stop(void)
 	/*
 	 *	Wakeup all threads to make them see stop flag.
 	 */
-	total_threads = thread_pool.total_threads;
-	for (i = 0; i != total_threads; i++) {
-		sem_post(&thread_pool.semaphore);
+	if (thread_pool.per_thread_queue) {
+		for (handle = thread_pool.head; handle; handle = handle->next) {
+			sem_post(&handle->semaphore);
+		}
+	} else {
+		total_threads = thread_pool.total_threads;
+		for (i = 0; i != total_threads; i++) {
+			sem_post(&thread_pool.semaphore);
+		}
 	}
 
 	/*
@@ -1070,6 +2464,47 @@ void thread_pool_stop(void)
 		pthread_join(handle->pthread_id, NULL);
 		delete_thread(handle);
 	}
+
+	/*
+	 *	And the threads in the named pools.
+	 */
+	while (thread_pool.workloads) {
+		thread_workload_t *workload = thread_pool.workloads;
+
+		for (handle = workload->head; handle; handle = handle->next) {
+			sem_post(&workload->semaphore);
+		}
+
+		for (handle = workload->head; handle; handle = next) {
+			next = handle->next;
+			pthread_join(handle->pthread_id, NULL);
+			free(handle);
+		}
+
+		for (i = 0; i < NUM_FIFOS; i++) fr_fifo_free(workload->fifo[i]);
+		pthread_mutex_destroy(&workload->mutex);
+#ifndef __APPLE__
+		sem_destroy(&workload->semaphore);
+#endif
+
+		thread_pool.workloads = workload->next;
+		talloc_free(workload);
+	}
+	thread_pool.workload_servers = NULL;
+
+#ifdef WITH_YIELD
+	/*
+	 *	Requests which are still suspended are abandoned.
+	 */
+	if (thread_pool.yield) {
+		if (write(thread_pool.poll_pipe[1], "", 1) < 0) {
+			ERROR("Failed waking up the poll thread: %s", fr_syserror(errno));
+		}
+		pthread_join(thread_pool.poll_thread, NULL);
+		close(thread_pool.poll_pipe[0]);
+		close(thread_pool.poll_pipe[1]);
+	}
+#endif
 #endif
 }
 
@@ -1090,6 +2525,135 @@ int request_enqueue(REQUEST *request)
 #endif
 
 #ifndef WITH_GCD
+/*
+ *	Tell the first idle thread we come across to exit.
+ *
+ *	Note that we only delete ONE at a time, instead of wiping
+ *	out many.  This allows the excess servers to be slowly
+ *	reaped, just in case the load spike comes again.
+ */
+static bool thread_pool_delete_spare(void)
+{
+	THREAD_HANDLE *handle;
+
+	for (handle = thread_pool.head; handle != NULL; handle = handle->next) {
+		/*
+		 *	If the thread is not handling a
+		 *	request, but still live, then tell it
+		 *	to exit.
+		 *
+		 *	It will eventually wake up, and realize
+		 *	it's been told to commit suicide.
+		 */
+		if ((handle->request == NULL) &&
+		    (!thread_pool.per_thread_queue || (thread_num_queued(handle) == 0)) &&
+		    (handle->status == THREAD_RUNNING)) {
+			handle->status = THREAD_CANCELLED;
+			/*
+			 *	Post an extra semaphore, as a
+			 *	signal to wake up, and exit.
+			 */
+			sem_post(thread_pool.per_thread_queue ? &handle->semaphore : &thread_pool.semaphore);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ *	Size the pool from how long requests wait in the queue,
+ *	instead of from the number of spare threads.
+ *
+ *	If requests wait longer than "target_queue_time", both over
+ *	the last interval and on average, add threads in proportion
+ *	to how far over the target we are.  Growth is capped at a
+ *	quarter of the pool per interval, so that a stalled back-end
+ *	doesn't cause the pool to jump straight to max_servers.  If
+ *	the smoothed queue time is well under the target, delete
+ *	spare threads one at a time.
+ */
+static void thread_pool_control(struct timeval const *now)
+{
+	uint64_t total_time, total_count, target, want;
+	uint32_t interval, active_threads, spare, num_queued, limit;
+	THREAD_HANDLE *handle;
+	int i;
+
+	thread_pool.next_control = *now;
+	thread_pool.next_control.tv_usec += CONTROL_INTERVAL_USEC;
+	if (thread_pool.next_control.tv_usec >= USEC) {
+		thread_pool.next_control.tv_sec++;
+		thread_pool.next_control.tv_usec -= USEC;
+	}
+
+	total_time = thread_pool.exited_queue_time;
+	total_count = thread_pool.exited_queue_count;
+	num_queued = 0;
+
+	for (handle = thread_pool.head; handle; handle = handle->next) {
+		total_time += handle->queue_time;
+		total_count += handle->queue_count;
+		if (thread_pool.per_thread_queue) num_queued += thread_num_queued(handle);
+	}
+	if (!thread_pool.per_thread_queue) num_queued = thread_pool.num_queued;
+
+	/*
+	 *	Nothing was dequeued.  If requests are waiting, then
+	 *	they've waited at least the whole interval.
+	 */
+	if (total_count > thread_pool.last_queue_count) {
+		interval = (total_time - thread_pool.last_queue_time) / (total_count - thread_pool.last_queue_count);
+	} else {
+		interval = num_queued ? CONTROL_INTERVAL_USEC : 0;
+	}
+	thread_pool.last_queue_time = total_time;
+	thread_pool.last_queue_count = total_count;
+
+	thread_pool.interval_queue_time = interval;
+	thread_pool.avg_queue_time = ((thread_pool.avg_queue_time * 3) + interval) / 4;
+
+	target = thread_pool.target_queue_time * 1000;
+	if (!target) target = 1;
+
+	active_threads = thread_pool_active();
+	spare = thread_pool.total_threads - active_threads;
+
+	if ((interval > target) && (thread_pool.avg_queue_time > target) &&
+	    (thread_pool.total_threads < thread_pool.max_threads)) {
+		want = ((uint64_t) thread_pool.total_threads * (interval - target)) / target;
+		if (want < 1) want = 1;
+
+		limit = thread_pool.total_threads / 4;
+		if (limit < 1) limit = 1;
+		if (want > limit) want = limit;
+
+		if ((want + thread_pool.total_threads) > thread_pool.max_threads) {
+			want = thread_pool.max_threads - thread_pool.total_threads;
+		}
+
+		DEBUG2("Threads: Queue time %uus is over target %uus, spawning %d threads",
+		       interval, (uint32_t) target, (int) want);
+
+		for (i = 0; i < (int) want; i++) {
+			if (!spawn_thread(now->tv_sec, 1)) break;
+			thread_pool.controller_spawned++;
+		}
+		return;
+	}
+
+	if ((thread_pool.avg_queue_time > (target / 2)) ||
+	    (spare <= thread_pool.min_spare_threads) ||
+	    ((now->tv_sec - thread_pool.time_last_spawned) < (int)thread_pool.cleanup_delay)) {
+		return;
+	}
+
+	DEBUG2("Threads: Queue time %uus is under target %uus, deleting 1 spare out of %d spares",
+	       thread_pool.avg_queue_time, (uint32_t) target, spare);
+
+	if (thread_pool_delete_spare()) thread_pool.controller_deleted++;
+}
+
 /*
  *	Check the min_spare_threads and max_spare_threads.
  *
@@ -1128,7 +2692,7 @@ static void thread_pool_manage(time_t now)
 	 *	approximation of the number of active threads, and this
 	 *	is good enough.
 	 */
-	active_threads = thread_pool.active_threads;
+	active_threads = thread_pool_active();
 	spare = thread_pool.total_threads - active_threads;
 	if (debug_flag) {
 		static uint32_t old_total = 0;
@@ -1142,6 +2706,11 @@ static void thread_pool_manage(time_t now)
 		}
 	}
 
+	/*
+	 *	The queue latency controller sizes the pool.
+	 */
+	if (thread_pool.target_queue_time) return;
+
 	/*
 	 *	If there are too few spare threads.  Go create some more.
 	 */
@@ -1188,10 +2757,6 @@ static void thread_pool_manage(time_t now)
 
 	/*
 	 *	If there are too many spare threads, delete one.
-	 *
-	 *	Note that we only delete ONE at a time, instead of
-	 *	wiping out many.  This allows the excess servers to
-	 *	be slowly reaped, just in case the load spike comes again.
 	 */
 	if (spare > thread_pool.max_spare_threads) {
 
@@ -1199,33 +2764,7 @@ static void thread_pool_manage(time_t now)
 
 		DEBUG2("Threads: deleting 1 spare out of %d spares", spare);
 
-		/*
-		 *	Walk through the thread pool, deleting the
-		 *	first idle thread we come across.
-		 */
-		for (handle = thread_pool.head; (handle != NULL) && (spare > 0) ; handle = next) {
-			next = handle->next;
-
-			/*
-			 *	If the thread is not handling a
-			 *	request, but still live, then tell it
-			 *	to exit.
-			 *
-			 *	It will eventually wake up, and realize
-			 *	it's been told to commit suicide.
-			 */
-			if ((handle->request == NULL) &&
-			    (handle->status == THREAD_RUNNING)) {
-				handle->status = THREAD_CANCELLED;
-				/*
-				 *	Post an extra semaphore, as a
-				 *	signal to wake up, and exit.
-				 */
-				sem_post(&thread_pool.semaphore);
-				spare--;
-				break;
-			}
-		}
+		thread_pool_delete_spare();
 	}
 
 	/*
@@ -1290,6 +2829,7 @@ pid_t rad_waitpid(pid_t pid, int *status)
 {
 	int i;
 	thread_fork_t mytf, *tf;
+	struct timeval tv;
 
 	if (!pool_initialized) return waitpid(pid, status, 0);
 
@@ -1314,7 +2854,12 @@ pid_t rad_waitpid(pid_t pid, int *status)
 			pthread_mutex_unlock(&thread_pool.wait_mutex);
 			return pid;
 		}
-		usleep(100000);	/* sleep for 1/10 of a second */
+		/*
+		 *	Sleep for 1/10 of a second.
+		 */
+		tv.tv_sec = 0;
+		tv.tv_usec = 100000;
+		thread_pool_wait_fd(-1, &tv);
 	}
 
 	/*
@@ -1332,6 +2877,68 @@ pid_t rad_waitpid(pid_t pid, int *status)
  */
 #endif
 
+/** Pin a thread to a CPU
+ *
+ * @param thread to pin.
+ * @param cpu to pin it to.
+ * @return 0 on success, -1 on error.
+ */
+int rad_thread_cpu(pthread_t thread, int cpu)
+{
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+	int rcode;
+	cpu_set_t set;
+
+	if ((cpu < 0) || (cpu >= CPU_SETSIZE)) {
+		fr_strerror_printf("Invalid CPU %d", cpu);
+		return -1;
+	}
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+
+	rcode = pthread_setaffinity_np(thread, sizeof(set), &set);
+	if (rcode != 0) {
+		fr_strerror_printf("Failed pinning thread to CPU %d: %s", cpu, fr_syserror(rcode));
+		return -1;
+	}
+
+	return 0;
+#else
+	fr_strerror_printf("Pinning threads to CPUs is not supported on this system");
+	return -1;
+#endif
+}
+
+/*
+ *	Get the state of the thread pool, for radmin.
+ *
+ *	Like thread_pool_manage(), this doesn't lock anything, so the
+ *	numbers are approximate.
+ */
+bool thread_pool_stats(thread_pool_stats_t *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+
+#ifndef WITH_GCD
+	if (!pool_initialized) return false;
+
+	stats->total_threads = thread_pool.total_threads;
+	stats->active_threads = thread_pool_active();
+	stats->max_threads = thread_pool.max_threads;
+	stats->num_queued = thread_pool.per_thread_queue ? thread_queue_num_queued() : thread_pool.num_queued;
+	stats->target_queue_time = thread_pool.target_queue_time;
+	stats->interval_queue_time = thread_pool.interval_queue_time;
+	stats->avg_queue_time = thread_pool.avg_queue_time;
+	stats->controller_spawned = thread_pool.controller_spawned;
+	stats->controller_deleted = thread_pool.controller_deleted;
+
+	return true;
+#else
+	return false;
+#endif
+}
+
 void thread_pool_queue_stats(int array[RAD_LISTEN_MAX], int pps[2])
 {
 	int i;
@@ -1341,7 +2948,23 @@ void thread_pool_queue_stats(int array[RAD_LISTEN_MAX], int pps[2])
 		struct timeval now;
 
 		for (i = 0; i < RAD_LISTEN_MAX; i++) {
-			array[i] = fr_fifo_num_elements(thread_pool.fifo[i]);
+			THREAD_HANDLE *handle;
+
+			if (!thread_pool.per_thread_queue) {
+				array[i] = fr_fifo_num_elements(thread_pool.fifo[i]);
+				continue;
+			}
+
+			/*
+			 *	Approximate, as we don't lock the
+			 *	per-thread queues.
+			 */
+			array[i] = 0;
+			pthread_mutex_lock(&thread_pool.queue_mutex);
+			for (handle = thread_pool.head; handle; handle = handle->next) {
+				array[i] += fr_atomic_queue_num_elements(handle->queue[i]);
+			}
+			pthread_mutex_unlock(&thread_pool.queue_mutex);
 		}
 
 		gettimeofday(&now, NULL);
@@ -1367,6 +2990,144 @@ void thread_pool_queue_stats(int array[RAD_LISTEN_MAX], int pps[2])
 }
 #endif /* HAVE_PTHREAD_H */
 
+/** Wait for a file descriptor to become readable
+ *
+ * This blocks the thread.  Requests which are running a module
+ * can give up the thread instead, see module_yield().
+ *
+ * @param[in] fd to wait for, or -1 to wait for the timeout only.
+ * @param[in] timeout how long to wait, or NULL to wait forever.
+ * @return 1 if fd is readable, 0 on timeout, -1 on error.
+ *	Interrupted waits are retried.
+ */
+int thread_pool_wait_fd(int fd, struct timeval const *timeout)
+{
+	int		rcode;
+	fd_set		fds;
+	struct timeval	wake;
+
+	if (timeout) wake = *timeout;
+
+	if (fd < 0) {
+		if (!timeout) return -1;
+
+		do {
+			rcode = select(0, NULL, NULL, NULL, &wake);
+		} while ((rcode < 0) && (errno == EINTR));
+
+		return (rcode < 0) ? -1 : 0;
+	}
+
+	do {
+		FD_ZERO(&fds);
+		FD_SET(fd, &fds);
+
+		rcode = select(fd + 1, &fds, NULL, NULL, timeout ? &wake : NULL);
+	} while ((rcode < 0) && (errno == EINTR));
+	if (rcode > 0) return 1;
+
+	return rcode;
+}
+
+/** Wait for a file descriptor, giving up the thread if we can
+ *
+ * Only module_yield() calls this.  When requests are run as
+ * coroutines (the "yield" option of the thread pool), and a
+ * yield-safe module is running, the request is suspended, and the
+ * thread goes on to do other work while we wait.  Otherwise, this
+ * is the same as thread_pool_wait_fd().
+ *
+ * @note The caller may be running on a different thread when
+ *	this returns, so errno isn't set on error.
+ *
+ * @param[in] fd to wait for, or -1 to wait for the timeout only.
+ * @param[in] timeout how long to wait, or NULL to wait forever.
+ * @return 1 if fd is readable, 0 on timeout, -1 on error.
+ */
+int thread_pool_yield_fd(int fd, struct timeval const *timeout)
+{
+#ifdef WITH_YIELD
+	request_coroutine_t *co;
+
+	co = fr_thread_local_init(thread_coroutine, NULL);
+	if (co && co->yield_ok && !co->no_yield && ((fd >= 0) || timeout)) {
+		co->fd = fd;
+		co->has_when = (timeout != NULL);
+		if (timeout) {
+			gettimeofday(&co->when, NULL);
+			timeradd(&co->when, timeout, &co->when);
+		}
+		co->ready = -1;
+
+		swapcontext(&co->context, co->caller);
+
+		/*
+		 *	Don't look at thread-local storage here.  We
+		 *	may have been resumed by another thread.
+		 */
+		return co->ready;
+	}
+#endif
+
+	return thread_pool_wait_fd(fd, timeout);
+}
+
+/** Let the current request give up its thread in module_yield()
+ *
+ * Calls nest, and each call with allow == true must be matched by
+ * one with allow == false.  This is used around calls to modules
+ * which are marked RLM_TYPE_YIELD_SAFE.  Outside of them, the
+ * request never gives up its thread.
+ *
+ * @param[in] allow true to allow yields, false to stop allowing them.
+ */
+void thread_pool_yield_allow(bool allow)
+{
+#ifdef WITH_YIELD
+	request_coroutine_t *co;
+
+	co = fr_thread_local_init(thread_coroutine, NULL);
+	if (!co) return;
+
+	if (allow) {
+		co->yield_ok++;
+	} else {
+		rad_assert(co->yield_ok > 0);
+		co->yield_ok--;
+	}
+#else
+	(void) allow;
+#endif
+}
+
+/** Stop the current request from giving up its thread
+ *
+ * Calls nest, and each call with block == true must be matched
+ * by one with block == false.  While blocked, thread_pool_yield_fd()
+ * just blocks.  This is used around code which holds locks, or
+ * thread-local state.
+ *
+ * @param[in] block true to block yields, false to unblock them.
+ */
+void thread_pool_yield_block(bool block)
+{
+#ifdef WITH_YIELD
+	request_coroutine_t *co;
+
+	co = fr_thread_local_init(thread_coroutine, NULL);
+	if (!co) return;
+
+	if (block) {
+		co->no_yield++;
+	} else {
+		rad_assert(co->no_yield > 0);
+		co->no_yield--;
+	}
+#else
+	(void) block;
+#endif
+}
+
 static void time_free(void *data)
 {
 	free(data);
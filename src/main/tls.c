@@ -26,6 +26,7 @@ RCSID("$Id$")
 USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
 
 #include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/modules.h>
 #include <freeradius-devel/process.h>
 #include <freeradius-devel/rad_assert.h>
 
@@ -81,6 +82,9 @@ static unsigned int 	record_plus(record_t *buf, void const *ptr,
 				    unsigned int size);
 static unsigned int 	record_minus(record_t *buf, void *ptr,
 				     unsigned int size);
+static unsigned char	*record_reserve(record_t *buf, unsigned int size);
+static int		record_ssl_read(SSL *ssl, record_t *buf);
+static int		record_bio_read(BIO *bio, record_t *buf);
 
 #ifdef PSK_MAX_IDENTITY_LEN
 static bool identity_is_safe(const char *identity)
@@ -322,6 +326,7 @@ tls_session_t *tls_new_session(TALLOC_CTX *ctx, fr_tls_server_conf_t *conf, REQU
 	state->record_close = record_close;
 	state->record_plus = record_plus;
 	state->record_minus = record_minus;
+	state->record_reserve = record_reserve;
 
 	/*
 	 *	Create & hook the BIOs to handle the dirty side of the
@@ -469,27 +474,88 @@ static int int_ssl_check(REQUEST *request, SSL *s, int ret, char const *text)
  * Fill the Bio with the dirty data to clean it
  * Get the cleaned data from SSL, if it is not Handshake data
  */
+#ifdef SSL_MODE_ASYNC
+#define TLS_ASYNC_TIMEOUT (5)	/* seconds */
+
+/*
+ *	Wait for an engine to finish an operation which it paused.
+ *	If the thread pool has "yield" enabled, the thread processes
+ *	other requests in the mean time.
+ */
+static int tls_async_wait(REQUEST *request, SSL *ssl)
+{
+	OSSL_ASYNC_FD fds[4];
+	size_t numfds = 0;
+	struct timeval timeout;
+
+	if (!SSL_get_all_async_fds(ssl, NULL, &numfds) || (numfds > (sizeof(fds) / sizeof(*fds)))) return -1;
+
+	/*
+	 *	Engines without a wait fd have to be polled.
+	 */
+	if (!numfds) {
+		timeout.tv_sec = 0;
+		timeout.tv_usec = 1000;
+
+		return (module_yield(request, -1, &timeout) < 0) ? -1 : 0;
+	}
+
+	if (!SSL_get_all_async_fds(ssl, fds, &numfds)) return -1;
+
+	timeout.tv_sec = TLS_ASYNC_TIMEOUT;
+	timeout.tv_usec = 0;
+
+	switch (module_yield(request, fds[0], &timeout)) {
+	case 1:
+		return 0;
+
+	case 0:
+		REDEBUG("Timed out waiting for the OpenSSL engine");
+		return -1;
+
+	default:
+		return -1;
+	}
+}
+#endif
+
 int tls_handshake_recv(REQUEST *request, tls_session_t *ssn)
 {
 	int err;
 
 	if (ssn->invalid_hb_used) return 0;
 
-	err = BIO_write(ssn->into_ssl, ssn->dirty_in.data, ssn->dirty_in.used);
-	if (err != (int) ssn->dirty_in.used) {
-		RDEBUG("Failed writing %d to SSL BIO: %d", ssn->dirty_in.used,
-			err);
+	/*
+	 *	EAP writes straight to the BIO, so there may be
+	 *	nothing here.
+	 */
+	if (ssn->dirty_in.used) {
+		err = BIO_write(ssn->into_ssl, ssn->dirty_in.data, ssn->dirty_in.used);
+		if (err != (int) ssn->dirty_in.used) {
+			RDEBUG("Failed writing %d to SSL BIO: %d", ssn->dirty_in.used,
+				err);
+			record_init(&ssn->dirty_in);
+			return 0;
+		}
 		record_init(&ssn->dirty_in);
-		return 0;
 	}
-	record_init(&ssn->dirty_in);
 
-	err = SSL_read(ssn->ssl, ssn->clean_out.data + ssn->clean_out.used,
-		       sizeof(ssn->clean_out.data) - ssn->clean_out.used);
-	if (err > 0) {
-		ssn->clean_out.used += err;
-		return 1;
+	err = record_ssl_read(ssn->ssl, &ssn->clean_out);
+
+#ifdef SSL_MODE_ASYNC
+	/*
+	 *	The engine paused in the middle of a private key
+	 *	operation.  Calling SSL_read() again continues it.
+	 */
+	while ((err <= 0) && (SSL_get_error(ssn->ssl, err) == SSL_ERROR_WANT_ASYNC)) {
+		RDEBUG3("Waiting for the OpenSSL engine");
+		if (tls_async_wait(request, ssn->ssl) < 0) return 0;
+
+		err = record_ssl_read(ssn->ssl, &ssn->clean_out);
 	}
+#endif
+
+	if (err > 0) return 1;
 
 	if (!int_ssl_check(request, ssn->ssl, err, "SSL_read")) {
 		return 0;
@@ -514,10 +580,9 @@ int tls_handshake_recv(REQUEST *request, tls_session_t *ssn)
 
 	err = BIO_ctrl_pending(ssn->from_ssl);
 	if (err > 0) {
-		err = BIO_read(ssn->from_ssl, ssn->dirty_out.data,
-			       sizeof(ssn->dirty_out.data));
+		err = record_bio_read(ssn->from_ssl, &ssn->dirty_out);
 		if (err > 0) {
-			ssn->dirty_out.used = err;
+			/* nothing more to do */
 
 		} else if (BIO_should_retry(ssn->from_ssl)) {
 			record_init(&ssn->dirty_in);
@@ -564,11 +629,8 @@ int tls_handshake_send(REQUEST *request, tls_session_t *ssn)
 		record_minus(&ssn->clean_in, NULL, written);
 
 		/* Get the dirty data from Bio to send it */
-		err = BIO_read(ssn->from_ssl, ssn->dirty_out.data,
-			       sizeof(ssn->dirty_out.data));
-		if (err > 0) {
-			ssn->dirty_out.used = err;
-		} else {
+		err = record_bio_read(ssn->from_ssl, &ssn->dirty_out);
+		if (err <= 0) {
 			int_ssl_check(request, ssn->ssl, err, "handshake_send");
 		}
 	}
@@ -619,9 +681,46 @@ static void record_init(record_t *rec)
 
 static void record_close(record_t *rec)
 {
+	talloc_free(rec->data);
+	rec->data = NULL;
 	rec->used = 0;
+	rec->size = 0;
 }
 
+/*
+ *	Make sure there's room for size more bytes in the buffer,
+ *	and return where they should be written.  The caller must
+ *	update rec->used.
+ *
+ *	Returns NULL if the buffer would grow beyond MAX_RECORD_SIZE,
+ *	or on allocation failure.
+ */
+static unsigned char *record_reserve(record_t *rec, unsigned int size)
+{
+	unsigned int need = rec->used + size;
+	unsigned int alloc;
+	unsigned char *data;
+
+	if (need <= rec->size) return rec->data + rec->used;
+
+	if (need > MAX_RECORD_SIZE) return NULL;
+
+	/*
+	 *	Grow geometrically, so appending fragments is
+	 *	amortised O(1).
+	 */
+	alloc = rec->size ? rec->size : RECORD_MIN_SIZE;
+	while (alloc < need) alloc <<= 1;
+	if (alloc > MAX_RECORD_SIZE) alloc = MAX_RECORD_SIZE;
+
+	data = talloc_realloc(NULL, rec->data, unsigned char, alloc);
+	if (!data) return NULL;
+
+	rec->data = data;
+	rec->size = alloc;
+
+	return rec->data + rec->used;
+}
 
 /*
  *	Copy data to the intermediate buffer, before we send
@@ -636,6 +735,8 @@ static unsigned int record_plus(record_t *rec, void const *ptr,
 		added = size;
 	if(added == 0)
 		return 0;
+	if (!record_reserve(rec, added))
+		return 0;
 	memcpy(rec->data + rec->used, ptr, added);
 	rec->used += added;
 	return added;
@@ -662,9 +763,86 @@ static unsigned int record_minus(record_t *rec, void *ptr,
 	 */
 	if(rec->used > 0)
 		memmove(rec->data, rec->data + taken, rec->used);
+
+	/*
+	 *	Don't keep large buffers around once they're empty.
+	 */
+	else if (rec->size > RECORD_MIN_SIZE)
+		record_close(rec);
+
 	return taken;
 }
 
+/*
+ *	Read decrypted data from the SSL session, appending it to the
+ *	buffer.  The buffer is grown as long as OpenSSL has more of the
+ *	current record.
+ *
+ *	Returns the number of bytes read, or the result of SSL_read().
+ */
+static int record_ssl_read(SSL *ssl, record_t *rec)
+{
+	int total = 0;
+
+	for (;;) {
+		unsigned int room;
+		unsigned char *p;
+		int err;
+
+		/*
+		 *	Use whatever is already allocated, or grow
+		 *	the buffer by at least RECORD_MIN_SIZE.
+		 */
+		room = rec->size - rec->used;
+		if (room < RECORD_MIN_SIZE) room = RECORD_MIN_SIZE;
+		if (room > (MAX_RECORD_SIZE - rec->used)) room = MAX_RECORD_SIZE - rec->used;
+		if (room == 0) break;
+
+		p = record_reserve(rec, room);
+		if (!p) break;
+
+		err = SSL_read(ssl, p, room);
+		if (err <= 0) return total ? total : err;
+
+		rec->used += err;
+		total += err;
+
+		if (((unsigned int) err < room) || (SSL_pending(ssl) <= 0)) break;
+	}
+
+	return total;
+}
+
+/*
+ *	Read encrypted data from the BIO, replacing the contents of the
+ *	buffer.  Only as much memory as there's data pending is used.
+ *
+ *	Returns the number of bytes read, or the result of BIO_read().
+ */
+static int record_bio_read(BIO *bio, record_t *rec)
+{
+	size_t pending;
+	unsigned int used = rec->used;
+	unsigned char *p;
+	int err;
+
+	pending = BIO_ctrl_pending(bio);
+	if (pending == 0) pending = 1;	/* BIO_read() decides if it's an error */
+	if (pending > MAX_RECORD_SIZE) pending = MAX_RECORD_SIZE;
+
+	rec->used = 0;
+	p = record_reserve(rec, pending);
+	if (!p) {
+		rec->used = used;
+		return -1;
+	}
+
+	err = BIO_read(bio, p, pending);
+	rec->used = (err > 0) ? (unsigned int) err : used;
+
+	return err;
+}
+
 void tls_session_information(tls_session_t *tls_session)
 {
 	char const *str_write_p, *str_version, *str_content_type = "";
@@ -899,6 +1077,10 @@ static CONF_PARSER cache_config[] = {
 	{ "max_entries", FR_CONF_OFFSET(PW_TYPE_INTEGER, fr_tls_server_conf_t, session_cache_size), "255" },
 	{ "name", FR_CONF_OFFSET(PW_TYPE_STRING, fr_tls_server_conf_t, session_id_name), NULL },
 	{ "persist_dir", FR_CONF_OFFSET(PW_TYPE_STRING, fr_tls_server_conf_t, session_cache_path), NULL },
+	{ "driver", FR_CONF_OFFSET(PW_TYPE_STRING, fr_tls_server_conf_t, session_cache_driver), "openssl" },
+	{ "redis_module_instance", FR_CONF_OFFSET(PW_TYPE_STRING, fr_tls_server_conf_t, session_cache_redis), NULL },
+	{ "session_tickets", FR_CONF_OFFSET(PW_TYPE_BOOLEAN, fr_tls_server_conf_t, session_tickets), "no" },
+	{ "ticket_key_rotation", FR_CONF_OFFSET(PW_TYPE_INTEGER, fr_tls_server_conf_t, ticket_key_rotation), "3600" },
 	{ NULL, -1, 0, NULL, NULL }	   /* end the list */
 };
 
@@ -916,6 +1098,9 @@ static CONF_PARSER ocsp_config[] = {
 	{ "use_nonce", FR_CONF_OFFSET(PW_TYPE_BOOLEAN, fr_tls_server_conf_t, ocsp_use_nonce), "yes" },
 	{ "timeout", FR_CONF_OFFSET(PW_TYPE_INTEGER, fr_tls_server_conf_t, ocsp_timeout), "yes" },
 	{ "softfail", FR_CONF_OFFSET(PW_TYPE_BOOLEAN, fr_tls_server_conf_t, ocsp_softfail), "yes" },
+	{ "cache", FR_CONF_OFFSET(PW_TYPE_BOOLEAN, fr_tls_server_conf_t, ocsp_cache_enable), "no" },
+	{ "cache_max_entries", FR_CONF_OFFSET(PW_TYPE_INTEGER, fr_tls_server_conf_t, ocsp_cache_size), "4096" },
+	{ "prefetch", FR_CONF_OFFSET(PW_TYPE_INTEGER, fr_tls_server_conf_t, ocsp_prefetch), "0" },
 	{ NULL, -1, 0, NULL, NULL }	   /* end the list */
 };
 #endif
@@ -941,10 +1126,14 @@ static CONF_PARSER tls_server_config[] = {
 #endif
 	{ "dh_file", FR_CONF_OFFSET(PW_TYPE_STRING, fr_tls_server_conf_t, dh_file), NULL },
 	{ "random_file", FR_CONF_OFFSET(PW_TYPE_STRING, fr_tls_server_conf_t, random_file), NULL },
+	{ "engine", FR_CONF_OFFSET(PW_TYPE_STRING, fr_tls_server_conf_t, engine_id), NULL },
+	{ "async", FR_CONF_OFFSET(PW_TYPE_BOOLEAN, fr_tls_server_conf_t, async), "no" },
 	{ "fragment_size", FR_CONF_OFFSET(PW_TYPE_INTEGER, fr_tls_server_conf_t, fragment_size), "1024" },
 	{ "include_length", FR_CONF_OFFSET(PW_TYPE_BOOLEAN, fr_tls_server_conf_t, include_length), "yes" },
 	{ "check_crl", FR_CONF_OFFSET(PW_TYPE_BOOLEAN, fr_tls_server_conf_t, check_crl), "no" },
 	{ "allow_expired_crl", FR_CONF_OFFSET(PW_TYPE_BOOLEAN, fr_tls_server_conf_t, allow_expired_crl), NULL },
+	{ "crl_dir", FR_CONF_OFFSET(PW_TYPE_STRING, fr_tls_server_conf_t, crl_dir), NULL },
+	{ "crl_reload_interval", FR_CONF_OFFSET(PW_TYPE_INTEGER, fr_tls_server_conf_t, crl_reload_interval), "3600" },
 	{ "check_cert_cn", FR_CONF_OFFSET(PW_TYPE_STRING, fr_tls_server_conf_t, check_cert_cn), NULL },
 	{ "cipher_list", FR_CONF_OFFSET(PW_TYPE_STRING, fr_tls_server_conf_t, cipher_list), NULL },
 	{ "check_cert_issuer", FR_CONF_OFFSET(PW_TYPE_STRING, fr_tls_server_conf_t, check_cert_issuer), NULL },
@@ -982,6 +1171,8 @@ static CONF_PARSER tls_client_config[] = {
 	{ "private_key_password", FR_CONF_OFFSET(PW_TYPE_STRING | PW_TYPE_SECRET, fr_tls_server_conf_t, private_key_password), NULL },
 	{ "dh_file", FR_CONF_OFFSET(PW_TYPE_STRING, fr_tls_server_conf_t, dh_file), NULL },
 	{ "random_file", FR_CONF_OFFSET(PW_TYPE_STRING, fr_tls_server_conf_t, random_file), NULL },
+	{ "engine", FR_CONF_OFFSET(PW_TYPE_STRING, fr_tls_server_conf_t, engine_id), NULL },
+	{ "async", FR_CONF_OFFSET(PW_TYPE_BOOLEAN, fr_tls_server_conf_t, async), "no" },
 	{ "fragment_size", FR_CONF_OFFSET(PW_TYPE_INTEGER, fr_tls_server_conf_t, fragment_size), "1024" },
 	{ "include_length", FR_CONF_OFFSET(PW_TYPE_BOOLEAN, fr_tls_server_conf_t, include_length), "yes" },
 	{ "check_crl", FR_CONF_OFFSET(PW_TYPE_BOOLEAN, fr_tls_server_conf_t, check_crl), "no" },
@@ -1120,9 +1311,16 @@ static int cbtls_new_session(SSL *ssl, SSL_SESSION *sess)
 
 	fr_bin2hex(buffer, sess->session_id, size);
 
+	conf = (fr_tls_server_conf_t *)SSL_get_ex_data(ssl, FR_TLS_EX_INDEX_CONF);
+
+	/*
+	 *	The session cache driver is given the session by
+	 *	tls_success(), once we know which attributes go with it.
+	 */
+	if (conf && conf->session_cache) return 0;
+
 	DEBUG2("SSL: Adding session %s to cache", buffer);
 
-	conf = (fr_tls_server_conf_t *)SSL_get_ex_data(ssl, FR_TLS_EX_INDEX_CONF);
 	if (conf && conf->session_cache_path) {
 		int fd, todo, blob_len, rv;
 		size_t len;
@@ -1210,7 +1408,11 @@ static SSL_SESSION *cbtls_get_session(SSL *ssl,
 
 	conf = (fr_tls_server_conf_t *)SSL_get_ex_data(ssl, FR_TLS_EX_INDEX_CONF);
 	talloc_ctx = SSL_get_ex_data(ssl, FR_TLS_EX_INDEX_TALLOC);
-	if (conf && conf->session_cache_path) {
+	if (conf && conf->session_cache) {
+		sess = tls_cache_load(conf, SSL_get_ex_data(ssl, FR_TLS_EX_INDEX_REQUEST), data, inlen, talloc_ctx);
+		if (sess) DEBUG2("SSL: Successfully restored session %s", buffer);
+
+	} else if (conf && conf->session_cache_path) {
 		int rv, fd, todo;
 		size_t len;
 		char filename[256];
@@ -1332,8 +1534,36 @@ static int ocsp_parse_cert_url(X509 *cert, char **phost, char **pport,
 /* Maximum leeway in validity period: default 5 minutes */
 #define MAX_VALIDITY_PERIOD     (5 * 60)
 
-static int ocsp_check(X509_STORE *store, X509 *issuer_cert, X509 *client_cert,
-		      fr_tls_server_conf_t *conf)
+/*
+ *	Convert an ASN.1 time to a time_t.  Returns 0 if it can't.
+ */
+static time_t ocsp_asn1_time(ASN1_GENERALIZEDTIME *t)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+	int days, secs;
+
+	if (!ASN1_TIME_diff(&days, &secs, NULL, t)) return 0;
+
+	return time(NULL) + ((time_t) days * 86400) + secs;
+#else
+	return 0;
+#endif
+}
+
+/** Ask the OCSP responder for the status of a certificate
+ *
+ * @param[in] store of trusted certificates, to verify the response.
+ * @param[in] issuer_cert which issued client_cert.
+ * @param[in] client_cert to check.
+ * @param[in] conf of the TLS context.
+ * @param[out] next_update set to the "nextUpdate" time of the response, if
+ *	the responder said the certificate was good or revoked.  Otherwise
+ *	left alone.
+ * @return 1 if the certificate is good, 2 if the responder couldn't be
+ *	asked, or 0 if the certificate was revoked, or the response invalid.
+ */
+int tls_ocsp_query(X509_STORE *store, X509 *issuer_cert, X509 *client_cert,
+		   fr_tls_server_conf_t *conf, time_t *next_update)
 {
 	OCSP_CERTID *certid;
 	OCSP_REQUEST *req;
@@ -1502,6 +1732,10 @@ static int ocsp_check(X509_STORE *store, X509 *issuer_cert, X509 *client_cert,
 		}
 	}
 
+	if (nextupd && ((status == V_OCSP_CERTSTATUS_GOOD) || (status == V_OCSP_CERTSTATUS_REVOKED))) {
+		*next_update = ocsp_asn1_time(nextupd);
+	}
+
 	switch (status) {
 	case V_OCSP_CERTSTATUS_GOOD:
 		DEBUG2("[oscp] --> Cert status: good");
@@ -1534,6 +1768,31 @@ ocsp_end:
 	OCSP_BASICRESP_free(bresp);
 
  ocsp_skip:
+	return ocsp_ok;
+}
+
+/*
+ *	Check the certificate, using the cached response if there
+ *	is one.
+ */
+static int ocsp_check(X509_STORE *store, X509 *issuer_cert, X509 *client_cert,
+		      fr_tls_server_conf_t *conf)
+{
+	int ocsp_ok = -1;
+	time_t next_update = 0;
+
+	if (conf->ocsp_cache) ocsp_ok = tls_ocsp_cache_find(conf, issuer_cert, client_cert);
+
+	if (ocsp_ok >= 0) {
+		DEBUG2("[ocsp] --> Using cached response");
+
+	} else {
+		ocsp_ok = tls_ocsp_query(store, issuer_cert, client_cert, conf, &next_update);
+		if (conf->ocsp_cache && next_update) {
+			tls_ocsp_cache_add(conf, issuer_cert, client_cert, ocsp_ok, next_update);
+		}
+	}
+
 	switch (ocsp_ok) {
 	case 1:
 		DEBUG2("[ocsp] --> Certificate is valid!");
@@ -1907,6 +2166,8 @@ int cbtls_verify(int ok, X509_STORE_CTX *ctx)
 			}
 		} /* check_cert_cn */
 
+		if (my_ok && conf->crl_index) my_ok = tls_crl_check(conf, request, client_cert);
+
 #ifdef HAVE_OPENSSL_OCSP_H
 		if (my_ok && conf->ocsp_enable){
 			RDEBUG2("--> Starting OCSP Request");
@@ -2008,8 +2269,12 @@ static X509_STORE *init_revocation_store(fr_tls_server_conf_t *conf)
 			return NULL;
 		}
 
+	/*
+	 *	With "crl_dir", the CRLs are checked by tls_crl_check(),
+	 *	and this store has none.
+	 */
 #ifdef X509_V_FLAG_CRL_CHECK
-	if (conf->check_crl)
+	if (conf->check_crl && !conf->crl_dir)
 		X509_STORE_set_flags(store, X509_V_FLAG_CRL_CHECK);
 #endif
 	return store;
@@ -2187,6 +2452,55 @@ SSL_CTX *tls_init_ctx(fr_tls_server_conf_t *conf, int client)
 	 */
 	SSL_CTX_set_app_data(ctx, conf);
 
+#ifdef HAVE_OPENSSL_ENGINE_H
+	/*
+	 *	Use the engine for everything it supports, so that the
+	 *	private key operations are done by the accelerator.
+	 */
+	if (conf->engine_id && !conf->engine) {
+		ENGINE_load_builtin_engines();
+
+		conf->engine = ENGINE_by_id(conf->engine_id);
+		if (!conf->engine) {
+			ERROR("tls: Failed loading OpenSSL engine \"%s\": %s", conf->engine_id,
+			      ERR_error_string(ERR_get_error(), NULL));
+			return NULL;
+		}
+
+		if (!ENGINE_init(conf->engine)) {
+			ERROR("tls: Failed initialising OpenSSL engine \"%s\": %s", conf->engine_id,
+			      ERR_error_string(ERR_get_error(), NULL));
+			ENGINE_free(conf->engine);
+			conf->engine = NULL;
+			return NULL;
+		}
+
+		if (!ENGINE_set_default(conf->engine, ENGINE_METHOD_ALL)) {
+			ERROR("tls: Failed using OpenSSL engine \"%s\": %s", conf->engine_id,
+			      ERR_error_string(ERR_get_error(), NULL));
+			return NULL;
+		}
+	}
+#else
+	if (conf->engine_id) {
+		ERROR("tls: \"engine\" requires OpenSSL with engine support");
+		return NULL;
+	}
+#endif
+
+	/*
+	 *	Let the engine pause in the middle of a handshake,
+	 *	instead of blocking the thread until it's done.
+	 */
+	if (conf->async) {
+#ifdef SSL_MODE_ASYNC
+		SSL_CTX_set_mode(ctx, SSL_MODE_ASYNC);
+#else
+		ERROR("tls: \"async\" requires OpenSSL 1.1.0 or later");
+		return NULL;
+#endif
+	}
+
 	/*
 	 * Identify the type of certificates that needs to be loaded
 	 */
@@ -2389,7 +2703,7 @@ post_ca:
 	ctx_options |= SSL_OP_NO_SSLv2;
 	ctx_options |= SSL_OP_NO_SSLv3;
 #ifdef SSL_OP_NO_TICKET
-	ctx_options |= SSL_OP_NO_TICKET ;
+	if (!conf->session_tickets) ctx_options |= SSL_OP_NO_TICKET ;
 #endif
 
 	/*
@@ -2460,7 +2774,7 @@ post_ca:
 	 *	Check the certificates for revocation.
 	 */
 #ifdef X509_V_FLAG_CRL_CHECK
-	if (conf->check_crl) {
+	if (conf->check_crl && !conf->crl_dir) {
 		certstore = SSL_CTX_get_cert_store(ctx);
 		if (certstore == NULL) {
 			ERROR("tls: SSL error %s", ERR_error_string(ERR_get_error(), NULL));
@@ -2522,9 +2836,18 @@ post_ca:
 		}
 
 		/*
-		 *	Cache it, and DON'T auto-clear it.
+		 *	Cache it, and DON'T auto-clear it.  If there's a
+		 *	session cache driver, it keeps the sessions instead
+		 *	of OpenSSL.
 		 */
-		SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_AUTO_CLEAR);
+		if (conf->session_cache) {
+			SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_AUTO_CLEAR |
+						       SSL_SESS_CACHE_NO_INTERNAL);
+		} else {
+			SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_AUTO_CLEAR);
+		}
+
+		if (conf->session_tickets) SSL_CTX_set_tlsext_ticket_key_cb(ctx, tls_cache_ticket_key);
 
 		SSL_CTX_set_session_id_context(ctx,
 					       (unsigned char *) conf->session_context_id,
@@ -2557,8 +2880,24 @@ post_ca:
  */
 static int _tls_server_conf_free(fr_tls_server_conf_t *conf)
 {
+#ifdef HAVE_OPENSSL_OCSP_H
+	/*
+	 *	Stops the prefetch thread, which uses the store.
+	 */
+	TALLOC_FREE(conf->ocsp_cache);
+#endif
+	TALLOC_FREE(conf->crl_index);
+
 	if (conf->ctx) SSL_CTX_free(conf->ctx);
 
+#ifdef HAVE_OPENSSL_ENGINE_H
+	if (conf->engine) {
+		ENGINE_finish(conf->engine);
+		ENGINE_free(conf->engine);
+	}
+	conf->engine = NULL;
+#endif
+
 #ifdef HAVE_OPENSSL_OCSP_H
 	if (conf->ocsp_store) X509_STORE_free(conf->ocsp_store);
 	conf->ocsp_store = NULL;
@@ -2623,6 +2962,10 @@ fr_tls_server_conf_t *tls_server_conf_parse(CONF_SECTION *cs)
 		goto error;
 	}
 
+	if (conf->session_cache_enable && (tls_cache_init(conf) < 0)) goto error;
+
+	if (conf->crl_dir && (tls_crl_init(conf) < 0)) goto error;
+
 	/*
 	 *	Initialize TLS
 	 */
@@ -2638,6 +2981,8 @@ fr_tls_server_conf_t *tls_server_conf_parse(CONF_SECTION *cs)
 	if (conf->ocsp_enable) {
 		conf->ocsp_store = init_revocation_store(conf);
 		if (conf->ocsp_store == NULL) goto error;
+
+		if (conf->ocsp_cache_enable && (tls_ocsp_cache_init(conf) < 0)) goto error;
 	}
 #endif /*HAVE_OPENSSL_OCSP_H*/
 	{
@@ -2747,6 +3092,7 @@ int tls_success(tls_session_t *ssn, REQUEST *request)
 	     (vp->vp_integer == 0))) {
 		SSL_CTX_remove_session(ssn->ctx,
 				       ssn->ssl->session);
+		if (conf->session_cache) tls_cache_delete(conf, request, SSL_get_session(ssn->ssl));
 		ssn->allow_session_resumption = 0;
 
 		/*
@@ -2801,7 +3147,10 @@ int tls_success(tls_session_t *ssn, REQUEST *request)
 			RDEBUG2("Saving session %s vps %p in the cache", buffer, vps);
 			SSL_SESSION_set_ex_data(ssn->ssl->session,
 						fr_tls_ex_index_vps, vps);
-			if (conf->session_cache_path) {
+			if (conf->session_cache) {
+				tls_cache_save(conf, request, SSL_get_session(ssn->ssl), vps);
+
+			} else if (conf->session_cache_path) {
 				/* write the VPs to the cache file */
 				char filename[256], buf[1024];
 				FILE *vp_file;
@@ -2847,6 +3196,16 @@ int tls_success(tls_session_t *ssn, REQUEST *request)
 
 		vps = SSL_SESSION_get_ex_data(ssn->ssl->session,
 					     fr_tls_ex_index_vps);
+
+		/*
+		 *	Sessions resumed from a ticket don't carry their
+		 *	attributes, so they're kept by the cache driver.
+		 */
+		if (!vps && conf->session_tickets) {
+			vps = tls_cache_load_vps(conf, request, SSL_get_session(ssn->ssl), talloc_ctx);
+			if (vps) SSL_SESSION_set_ex_data(SSL_get_session(ssn->ssl), fr_tls_ex_index_vps, vps);
+		}
+
 		if (!vps) {
 			RWDEBUG("No information in cached session %s", buffer);
 			return -1;
@@ -2901,10 +3260,17 @@ int tls_success(tls_session_t *ssn, REQUEST *request)
 
 void tls_fail(tls_session_t *ssn)
 {
+	fr_tls_server_conf_t *conf;
+
 	/*
 	 *	Force the session to NOT be cached.
 	 */
 	SSL_CTX_remove_session(ssn->ctx, ssn->ssl->session);
+
+	conf = (fr_tls_server_conf_t *)SSL_get_ex_data(ssn->ssl, FR_TLS_EX_INDEX_CONF);
+	if (conf && conf->session_cache) {
+		tls_cache_delete(conf, SSL_get_ex_data(ssn->ssl, FR_TLS_EX_INDEX_REQUEST), SSL_get_session(ssn->ssl));
+	}
 }
 
 fr_tls_status_t tls_application_data(tls_session_t *ssn,
@@ -2916,13 +3282,15 @@ fr_tls_status_t tls_application_data(tls_session_t *ssn,
 	/*
 	 *	Decrypt the complete record.
 	 */
-	err = BIO_write(ssn->into_ssl, ssn->dirty_in.data,
-			ssn->dirty_in.used);
-	if (err != (int) ssn->dirty_in.used) {
-		record_init(&ssn->dirty_in);
-		RDEBUG("Failed writing %d to SSL BIO: %d",
-		       ssn->dirty_in.used, err);
-		return FR_TLS_FAIL;
+	if (ssn->dirty_in.used) {
+		err = BIO_write(ssn->into_ssl, ssn->dirty_in.data,
+				ssn->dirty_in.used);
+		if (err != (int) ssn->dirty_in.used) {
+			record_init(&ssn->dirty_in);
+			RDEBUG("Failed writing %d to SSL BIO: %d",
+			       ssn->dirty_in.used, err);
+			return FR_TLS_FAIL;
+		}
 	}
 
 	/*
@@ -2937,8 +3305,7 @@ fr_tls_status_t tls_application_data(tls_session_t *ssn,
 	 *      SSL session, and put it into the decrypted
 	 *      data buffer.
 	 */
-	err = SSL_read(ssn->ssl, ssn->clean_out.data,
-		       sizeof(ssn->clean_out.data));
+	err = record_ssl_read(ssn->ssl, &ssn->clean_out);
 
 	if (err < 0) {
 		int code;
@@ -2971,11 +3338,6 @@ fr_tls_status_t tls_application_data(tls_session_t *ssn,
 		RWDEBUG("No data inside of the tunnel");
 	}
 
-	/*
-	 *	Passed all checks, successfully decrypted data
-	 */
-	ssn->clean_out.used = err;
-
 	return FR_TLS_OK;
 }
 
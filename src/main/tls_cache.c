@@ -0,0 +1,953 @@
+/*
+ * tls_cache.c
+ *
+ * Version:     $Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2014  The FreeRADIUS server project
+ */
+
+/**
+ * $Id$
+ * @file tls_cache.c
+ * @brief Session cache drivers, and session ticket keys.
+ *
+ * When a driver other than "openssl" is configured, OpenSSL's own cache
+ * is disabled, and resumable sessions are kept by the driver instead.
+ * Each entry holds the DER encoded session, followed by the attributes
+ * which are added to the reply when the session is resumed.
+ *
+ * @verbatim
+   entry: version (1), session length (2), session, attributes (text)
+   @endverbatim
+ *
+ * Sessions resumed from a ticket carry no session ID, so their attributes
+ * are kept separately, keyed by a digest of the master key.
+ *
+ * Session ticket keys are random.  Drivers which are shared between
+ * servers also share the keys, so each period's key is made by the
+ * first server to need it, and every other server uses that one.
+ *
+ * @copyright 2014  The FreeRADIUS server project
+ */
+RCSID("$Id$")
+USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/rad_assert.h>
+#include <freeradius-devel/memstats.h>
+
+#ifdef WITH_TLS
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+
+#ifdef HAVE_PTHREAD_H
+#define PTHREAD_MUTEX_LOCK pthread_mutex_lock
+#define PTHREAD_MUTEX_UNLOCK pthread_mutex_unlock
+#else
+#define PTHREAD_MUTEX_LOCK(_x)
+#define PTHREAD_MUTEX_UNLOCK(_x)
+#endif
+
+#define TLS_CACHE_VERSION	1
+#define TLS_CACHE_HEADER_LEN	3
+#define TLS_CACHE_SHARDS	16
+#define TLS_CACHE_KEY_MAX	(1 + EVP_MAX_MD_SIZE)
+
+/*
+ *	rlm_redis expands each command into a 4k buffer, so larger
+ *	sessions (usually ones with big client certificates) aren't
+ *	cached by the redis driver.
+ */
+#define TLS_CACHE_REDIS_MAX	1900
+
+#define TLS_CACHE_KEY_SESSION	0	//!< Keyed by session ID.
+#define TLS_CACHE_KEY_TICKET	1	//!< Keyed by a digest of the master key.
+#define TLS_CACHE_KEY_TICKET_KEY 2	//!< Keyed by the period the ticket key is used for.
+
+#define TLS_TICKET_KEY_LEN	80	//!< name (16), aes key (32), hmac key (32).
+
+typedef struct tls_cache_driver_t {
+	char const	*name;
+	int		(*init)(fr_tls_cache_t *cache);
+	void		(*save)(fr_tls_cache_t *cache, REQUEST *request, uint8_t const *key, size_t keylen,
+				uint8_t const *data, size_t len);
+	ssize_t		(*load)(fr_tls_cache_t *cache, REQUEST *request, uint8_t const *key, size_t keylen,
+				uint8_t **out);
+	void		(*delete)(fr_tls_cache_t *cache, REQUEST *request, uint8_t const *key, size_t keylen);
+
+	/*
+	 *	Only for drivers shared between servers.  Save an
+	 *	entry, unless there's already one with that key.
+	 */
+	void		(*add)(fr_tls_cache_t *cache, REQUEST *request, uint8_t const *key, size_t keylen,
+			       uint8_t const *data, size_t len, uint32_t lifetime);
+} tls_cache_driver_t;
+
+typedef struct tls_cache_entry_t {
+	struct tls_cache_entry_t *prev, *next;
+	time_t		expires;
+	size_t		keylen;
+	uint8_t		key[TLS_CACHE_KEY_MAX];
+	size_t		len;
+	uint8_t		*data;
+} tls_cache_entry_t;
+
+/*
+ *	Entries are kept in the order they were added.  They all
+ *	have the same lifetime, so the oldest entries are also the
+ *	first to expire.
+ */
+typedef struct tls_cache_shard_t {
+	fr_hash_table_t	*entries;
+	tls_cache_entry_t *head, *tail;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t	mutex;
+#endif
+} tls_cache_shard_t;
+
+struct fr_tls_cache_t {
+	fr_tls_server_conf_t		*conf;
+	tls_cache_driver_t const	*driver;
+	uint32_t			lifetime;	//!< In seconds.
+
+	uint32_t			shard_max;	//!< Entries per shard, 0 for no limit.
+	tls_cache_shard_t		shards[TLS_CACHE_SHARDS];
+};
+
+typedef struct tls_ticket_key_t {
+	bool		valid;
+	uint8_t		name[16];
+	uint8_t		aes_key[32];
+	uint8_t		hmac_key[32];
+} tls_ticket_key_t;
+
+struct fr_tls_ticket_keys_t {
+	fr_tls_cache_t	*cache;			//!< Which the keys are shared through.
+	uint32_t	rotation;
+	time_t		period;			//!< Of keys[0], in units of rotation.
+	tls_ticket_key_t keys[2];		//!< Current, and previous.
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t	mutex;
+#endif
+};
+
+/*
+ *	Memory driver.
+ */
+static uint32_t tls_cache_entry_hash(void const *data)
+{
+	tls_cache_entry_t const *entry = data;
+
+	return fr_hash_keyed(entry->key, entry->keylen);
+}
+
+static int tls_cache_entry_cmp(void const *one, void const *two)
+{
+	tls_cache_entry_t const *a = one;
+	tls_cache_entry_t const *b = two;
+
+	if (a->keylen != b->keylen) return a->keylen - b->keylen;
+
+	return memcmp(a->key, b->key, a->keylen);
+}
+
+static void tls_cache_entry_free(void *data)
+{
+	memstats_free(MEMSTATS_TLS_SESSION, NULL);
+	talloc_free(data);
+}
+
+static tls_cache_shard_t *tls_cache_shard(fr_tls_cache_t *cache, uint8_t const *key, size_t keylen)
+{
+	return &cache->shards[(fr_hash_keyed(key, keylen) >> 24) % TLS_CACHE_SHARDS];
+}
+
+static void tls_cache_unlink(tls_cache_shard_t *shard, tls_cache_entry_t *entry)
+{
+	if (entry->prev) {
+		entry->prev->next = entry->next;
+	} else {
+		shard->head = entry->next;
+	}
+	if (entry->next) {
+		entry->next->prev = entry->prev;
+	} else {
+		shard->tail = entry->prev;
+	}
+
+	fr_hash_table_delete(shard->entries, entry);
+}
+
+static int _tls_cache_free(fr_tls_cache_t *cache)
+{
+	int i;
+
+	for (i = 0; i < TLS_CACHE_SHARDS; i++) {
+		if (!cache->shards[i].entries) continue;
+
+		fr_hash_table_free(cache->shards[i].entries);
+#ifdef HAVE_PTHREAD_H
+		pthread_mutex_destroy(&cache->shards[i].mutex);
+#endif
+	}
+
+	return 0;
+}
+
+static int tls_cache_memory_init(fr_tls_cache_t *cache)
+{
+	int i;
+
+	if (cache->conf->session_cache_size) {
+		cache->shard_max = (cache->conf->session_cache_size + TLS_CACHE_SHARDS - 1) / TLS_CACHE_SHARDS;
+	}
+
+	for (i = 0; i < TLS_CACHE_SHARDS; i++) {
+		cache->shards[i].entries = fr_hash_table_create(tls_cache_entry_hash, tls_cache_entry_cmp,
+								tls_cache_entry_free);
+		if (!cache->shards[i].entries) return -1;
+#ifdef HAVE_PTHREAD_H
+		pthread_mutex_init(&cache->shards[i].mutex, NULL);
+#endif
+	}
+	talloc_set_destructor(cache, _tls_cache_free);
+
+	return 0;
+}
+
+static void tls_cache_memory_save(fr_tls_cache_t *cache, UNUSED REQUEST *request, uint8_t const *key, size_t keylen,
+				  uint8_t const *data, size_t len)
+{
+	tls_cache_shard_t *shard = tls_cache_shard(cache, key, keylen);
+	tls_cache_entry_t *entry, *old;
+	time_t now = time(NULL);
+
+	/*
+	 *	Not parented, as the other shards are allocating at
+	 *	the same time.
+	 */
+	entry = talloc_zero(NULL, tls_cache_entry_t);
+	if (!entry) return;
+
+	entry->expires = now + cache->lifetime;
+	entry->keylen = keylen;
+	memcpy(entry->key, key, keylen);
+	entry->len = len;
+	entry->data = talloc_memdup(entry, data, len);
+	if (!entry->data) {
+		talloc_free(entry);
+		return;
+	}
+
+	PTHREAD_MUTEX_LOCK(&shard->mutex);
+
+	old = fr_hash_table_finddata(shard->entries, entry);
+	if (old) tls_cache_unlink(shard, old);
+
+	while (shard->head &&
+	       ((shard->head->expires <= now) ||
+		(cache->shard_max && ((uint32_t) fr_hash_table_num_elements(shard->entries) >= cache->shard_max)))) {
+		tls_cache_unlink(shard, shard->head);
+	}
+
+	if (!fr_hash_table_insert(shard->entries, entry)) {
+		PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+		talloc_free(entry);
+		return;
+	}
+
+	entry->prev = shard->tail;
+	if (shard->tail) {
+		shard->tail->next = entry;
+	} else {
+		shard->head = entry;
+	}
+	shard->tail = entry;
+	memstats_alloc(MEMSTATS_TLS_SESSION, entry);
+
+	PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+}
+
+static ssize_t tls_cache_memory_load(fr_tls_cache_t *cache, UNUSED REQUEST *request, uint8_t const *key, size_t keylen,
+				     uint8_t **out)
+{
+	tls_cache_shard_t *shard = tls_cache_shard(cache, key, keylen);
+	tls_cache_entry_t my_entry, *entry;
+	ssize_t len = 0;
+
+	my_entry.keylen = keylen;
+	memcpy(my_entry.key, key, keylen);
+
+	PTHREAD_MUTEX_LOCK(&shard->mutex);
+	entry = fr_hash_table_finddata(shard->entries, &my_entry);
+	if (entry && (entry->expires <= time(NULL))) {
+		tls_cache_unlink(shard, entry);
+		entry = NULL;
+	}
+	if (entry) {
+		*out = talloc_memdup(NULL, entry->data, entry->len);
+		len = *out ? (ssize_t) entry->len : -1;
+	}
+	PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+
+	return len;
+}
+
+static void tls_cache_memory_delete(fr_tls_cache_t *cache, UNUSED REQUEST *request, uint8_t const *key, size_t keylen)
+{
+	tls_cache_shard_t *shard = tls_cache_shard(cache, key, keylen);
+	tls_cache_entry_t my_entry, *entry;
+
+	my_entry.keylen = keylen;
+	memcpy(my_entry.key, key, keylen);
+
+	PTHREAD_MUTEX_LOCK(&shard->mutex);
+	entry = fr_hash_table_finddata(shard->entries, &my_entry);
+	if (entry) tls_cache_unlink(shard, entry);
+	PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+}
+
+/*
+ *	Redis driver.  Commands are run through the xlat of a "redis"
+ *	module instance, so the server core doesn't need hiredis.
+ *	Keys and entries are hex, so they never need escaping.
+ */
+static int tls_cache_redis_init(fr_tls_cache_t *cache)
+{
+	if (!cache->conf->session_cache_redis) {
+		ERROR("tls: Session cache driver \"redis\" requires \"redis_module_instance\"");
+		return -1;
+	}
+
+	return 0;
+}
+
+static void tls_cache_redis_save(fr_tls_cache_t *cache, REQUEST *request, uint8_t const *key, size_t keylen,
+				 uint8_t const *data, size_t len)
+{
+	char hex_key[(TLS_CACHE_KEY_MAX * 2) + 1];
+	char *query;
+	char out[32];
+
+	if (!request) return;
+
+	if (len > TLS_CACHE_REDIS_MAX) {
+		RWDEBUG("Session is too large for the redis session cache (%zu > %i bytes)", len,
+			TLS_CACHE_REDIS_MAX);
+		return;
+	}
+
+	fr_bin2hex(hex_key, key, keylen);
+
+	query = talloc_array(request, char, (len * 2) + 1);
+	if (!query) return;
+	fr_bin2hex(query, data, len);
+
+	query = talloc_asprintf(request, "%%{%s:SET tls:%s %s EX %u}", cache->conf->session_cache_redis, hex_key,
+				query, cache->lifetime);
+	if (!query) return;
+
+	if (radius_xlat(out, sizeof(out), request, query, NULL, NULL) < 0) {
+		RERROR("Failed saving session to the redis session cache");
+	}
+	talloc_free(query);
+}
+
+static ssize_t tls_cache_redis_load(fr_tls_cache_t *cache, REQUEST *request, uint8_t const *key, size_t keylen,
+				    uint8_t **out)
+{
+	char hex_key[(TLS_CACHE_KEY_MAX * 2) + 1];
+	char query[256];
+	char *hex;
+	ssize_t slen;
+	size_t len;
+
+	if (!request) return 0;
+
+	fr_bin2hex(hex_key, key, keylen);
+	snprintf(query, sizeof(query), "%%{%s:GET tls:%s}", cache->conf->session_cache_redis, hex_key);
+
+	hex = talloc_array(request, char, (TLS_CACHE_REDIS_MAX * 2) + 1);
+	if (!hex) return -1;
+
+	slen = radius_xlat(hex, (TLS_CACHE_REDIS_MAX * 2) + 1, request, query, NULL, NULL);
+	if (slen <= 0) {
+		talloc_free(hex);
+		return 0;
+	}
+
+	*out = talloc_array(NULL, uint8_t, slen / 2);
+	if (!*out) {
+		talloc_free(hex);
+		return -1;
+	}
+
+	len = fr_hex2bin(*out, slen / 2, hex, slen);
+	talloc_free(hex);
+	if (len != ((size_t) slen / 2)) {
+		RERROR("Invalid entry in the redis session cache");
+		TALLOC_FREE(*out);
+		return -1;
+	}
+
+	return len;
+}
+
+static void tls_cache_redis_delete(fr_tls_cache_t *cache, REQUEST *request, uint8_t const *key, size_t keylen)
+{
+	char hex_key[(TLS_CACHE_KEY_MAX * 2) + 1];
+	char query[256];
+	char out[32];
+
+	if (!request) return;
+
+	fr_bin2hex(hex_key, key, keylen);
+	snprintf(query, sizeof(query), "%%{%s:DEL tls:%s}", cache->conf->session_cache_redis, hex_key);
+
+	(void) radius_xlat(out, sizeof(out), request, query, NULL, NULL);
+}
+
+static void tls_cache_redis_add(fr_tls_cache_t *cache, REQUEST *request, uint8_t const *key, size_t keylen,
+				uint8_t const *data, size_t len, uint32_t lifetime)
+{
+	char hex_key[(TLS_CACHE_KEY_MAX * 2) + 1];
+	char hex[(TLS_TICKET_KEY_LEN * 2) + 1];
+	char query[512];
+	char out[32];
+
+	if (!request || (len > TLS_TICKET_KEY_LEN)) return;
+
+	fr_bin2hex(hex_key, key, keylen);
+	fr_bin2hex(hex, data, len);
+	snprintf(query, sizeof(query), "%%{%s:SET tls:%s %s NX EX %u}", cache->conf->session_cache_redis, hex_key,
+		 hex, lifetime);
+
+	(void) radius_xlat(out, sizeof(out), request, query, NULL, NULL);
+}
+
+static tls_cache_driver_t const tls_cache_drivers[] = {
+	{ "memory", tls_cache_memory_init, tls_cache_memory_save, tls_cache_memory_load, tls_cache_memory_delete,
+	  NULL },
+	{ "redis", tls_cache_redis_init, tls_cache_redis_save, tls_cache_redis_load, tls_cache_redis_delete,
+	  tls_cache_redis_add },
+
+	{ NULL, NULL, NULL, NULL, NULL, NULL }
+};
+
+/*
+ *	Build the key for a session.  Returns the length of the key,
+ *	or 0 if the session can't be cached.
+ */
+static size_t tls_cache_key(fr_tls_server_conf_t *conf, SSL_SESSION *sess, int type, uint8_t *key)
+{
+	if (type == TLS_CACHE_KEY_SESSION) {
+		unsigned int len;
+		uint8_t const *id;
+
+		id = SSL_SESSION_get_id(sess, &len);
+		if (!len || (len > (TLS_CACHE_KEY_MAX - 1))) return 0;
+
+		key[0] = TLS_CACHE_KEY_SESSION;
+		memcpy(key + 1, id, len);
+
+		return len + 1;
+	}
+
+	if (conf->session_tickets) {
+		uint8_t master_key[SSL_MAX_MASTER_KEY_LENGTH];
+		size_t len;
+		unsigned int digest_len;
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+		len = SSL_SESSION_get_master_key(sess, master_key, sizeof(master_key));
+#else
+		len = sess->master_key_length;
+		if (len > sizeof(master_key)) return 0;
+		memcpy(master_key, sess->master_key, len);
+#endif
+		if (!len) return 0;
+
+		key[0] = TLS_CACHE_KEY_TICKET;
+		if (!EVP_Digest(master_key, len, key + 1, &digest_len, EVP_sha256(), NULL)) return 0;
+
+		return digest_len + 1;
+	}
+
+	return 0;
+}
+
+/*
+ *	Encode a session and its attributes.  If sess is NULL, only
+ *	the attributes are encoded.
+ */
+static uint8_t *tls_cache_encode(SSL_SESSION *sess, VALUE_PAIR *vps, size_t *len)
+{
+	vp_cursor_t cursor;
+	VALUE_PAIR *vp;
+	char *text;
+	char buffer[1024];
+	int der_len = 0;
+	size_t text_len;
+	uint8_t *data, *p;
+
+	text = talloc_strdup(NULL, "");
+	for (vp = fr_cursor_init(&cursor, &vps);
+	     vp && text;
+	     vp = fr_cursor_next(&cursor)) {
+		vp_prints(buffer, sizeof(buffer), vp);
+		text = talloc_asprintf_append_buffer(text, "%s%s", *text ? ", " : "", buffer);
+	}
+	if (!text) return NULL;
+	text_len = talloc_array_length(text) - 1;
+
+	if (sess) {
+		der_len = i2d_SSL_SESSION(sess, NULL);
+		if ((der_len < 1) || (der_len > UINT16_MAX)) {
+			talloc_free(text);
+			return NULL;
+		}
+	}
+
+	*len = TLS_CACHE_HEADER_LEN + der_len + text_len;
+	data = talloc_array(NULL, uint8_t, *len);
+	if (!data) {
+		talloc_free(text);
+		return NULL;
+	}
+
+	data[0] = TLS_CACHE_VERSION;
+	data[1] = (der_len >> 8) & 0xff;
+	data[2] = der_len & 0xff;
+
+	/* openssl mutates &p */
+	p = data + TLS_CACHE_HEADER_LEN;
+	if (sess && (i2d_SSL_SESSION(sess, &p) != der_len)) {
+		talloc_free(text);
+		talloc_free(data);
+		return NULL;
+	}
+	memcpy(data + TLS_CACHE_HEADER_LEN + der_len, text, text_len);
+	talloc_free(text);
+
+	return data;
+}
+
+/*
+ *	Decode an entry.  If sess is NULL, only the attributes are
+ *	decoded.
+ */
+static int tls_cache_decode(REQUEST *request, TALLOC_CTX *ctx, uint8_t const *data, size_t len,
+			    SSL_SESSION **sess, VALUE_PAIR **vps)
+{
+	size_t der_len;
+	char *text;
+	uint8_t const *p;
+
+	if ((len < TLS_CACHE_HEADER_LEN) || (data[0] != TLS_CACHE_VERSION)) {
+	invalid:
+		if (request) {
+			RERROR("Invalid entry in the session cache");
+		} else {
+			ERROR("tls: Invalid entry in the session cache");
+		}
+		return -1;
+	}
+
+	der_len = (data[1] << 8) | data[2];
+	if ((TLS_CACHE_HEADER_LEN + der_len) > len) goto invalid;
+
+	text = talloc_strndup(ctx, (char const *) data + TLS_CACHE_HEADER_LEN + der_len,
+			      len - (TLS_CACHE_HEADER_LEN + der_len));
+	if (!text) return -1;
+
+	*vps = NULL;
+	if (*text && (userparse(ctx, text, vps) == T_INVALID)) {
+		talloc_free(text);
+		pairfree(vps);
+		goto invalid;
+	}
+	talloc_free(text);
+
+	if (!sess) return 0;
+
+	if (!der_len) {
+		pairfree(vps);
+		goto invalid;
+	}
+
+	/* openssl mutates &p */
+	p = data + TLS_CACHE_HEADER_LEN;
+	*sess = d2i_SSL_SESSION(NULL, &p, der_len);
+	if (!*sess) {
+		if (request) {
+			RERROR("OpenSSL failed to load cached session: %s", ERR_error_string(ERR_get_error(), NULL));
+		} else {
+			ERROR("tls: OpenSSL failed to load cached session: %s", ERR_error_string(ERR_get_error(), NULL));
+		}
+		pairfree(vps);
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Save a session, and the attributes to add when it's resumed
+ *
+ * Sessions with an ID are saved whole.  For sessions which will be resumed
+ * from a ticket, only the attributes are saved.
+ *
+ * @param[in] conf of the TLS context.
+ * @param[in] request which completed the session.
+ * @param[in] sess to save.
+ * @param[in] vps to add to the reply when the session is resumed.
+ */
+void tls_cache_save(fr_tls_server_conf_t *conf, REQUEST *request, SSL_SESSION *sess, VALUE_PAIR *vps)
+{
+	uint8_t key[TLS_CACHE_KEY_MAX];
+	size_t keylen, len;
+	uint8_t *data;
+
+	keylen = tls_cache_key(conf, sess, TLS_CACHE_KEY_SESSION, key);
+	if (keylen) {
+		data = tls_cache_encode(sess, vps, &len);
+	} else {
+		keylen = tls_cache_key(conf, sess, TLS_CACHE_KEY_TICKET, key);
+		if (!keylen) return;
+
+		data = tls_cache_encode(NULL, vps, &len);
+	}
+	if (!data) {
+		RERROR("Failed encoding session for the session cache");
+		return;
+	}
+
+	conf->session_cache->driver->save(conf->session_cache, request, key, keylen, data, len);
+	talloc_free(data);
+}
+
+/** Load a session by its ID
+ *
+ * The attributes saved with the session are attached to it, in the same
+ * way as for sessions kept by OpenSSL.
+ *
+ * @param[in] conf of the TLS context.
+ * @param[in] request the client is resuming the session in.  May be NULL.
+ * @param[in] id of the session.
+ * @param[in] len of the id.
+ * @param[in] ctx to allocate the attributes in.
+ * @return the session, or NULL if it wasn't found.
+ */
+SSL_SESSION *tls_cache_load(fr_tls_server_conf_t *conf, REQUEST *request, uint8_t const *id, size_t len,
+			    TALLOC_CTX *ctx)
+{
+	uint8_t key[TLS_CACHE_KEY_MAX];
+	uint8_t *data = NULL;
+	ssize_t slen;
+	SSL_SESSION *sess;
+	VALUE_PAIR *vps;
+
+	if (!len || (len > (TLS_CACHE_KEY_MAX - 1))) return NULL;
+
+	key[0] = TLS_CACHE_KEY_SESSION;
+	memcpy(key + 1, id, len);
+
+	slen = conf->session_cache->driver->load(conf->session_cache, request, key, len + 1, &data);
+	if (slen <= 0) return NULL;
+
+	if (tls_cache_decode(request, ctx, data, slen, &sess, &vps) < 0) {
+		talloc_free(data);
+		return NULL;
+	}
+	talloc_free(data);
+
+	SSL_SESSION_set_ex_data(sess, fr_tls_ex_index_vps, vps);
+
+	return sess;
+}
+
+/** Load the attributes for a session resumed from a ticket
+ *
+ * @param[in] conf of the TLS context.
+ * @param[in] request the session was resumed in.
+ * @param[in] sess which was resumed.
+ * @param[in] ctx to allocate the attributes in.
+ * @return the attributes, or NULL if there were none.
+ */
+VALUE_PAIR *tls_cache_load_vps(fr_tls_server_conf_t *conf, REQUEST *request, SSL_SESSION *sess, TALLOC_CTX *ctx)
+{
+	uint8_t key[TLS_CACHE_KEY_MAX];
+	size_t keylen;
+	uint8_t *data = NULL;
+	ssize_t slen;
+	VALUE_PAIR *vps = NULL;
+
+	keylen = tls_cache_key(conf, sess, TLS_CACHE_KEY_TICKET, key);
+	if (!keylen) return NULL;
+
+	slen = conf->session_cache->driver->load(conf->session_cache, request, key, keylen, &data);
+	if (slen <= 0) return NULL;
+
+	(void) tls_cache_decode(request, ctx, data, slen, NULL, &vps);
+	talloc_free(data);
+
+	return vps;
+}
+
+/** Remove a session from the cache
+ *
+ * @param[in] conf of the TLS context.
+ * @param[in] request the session was used in.  May be NULL.
+ * @param[in] sess to remove.
+ */
+void tls_cache_delete(fr_tls_server_conf_t *conf, REQUEST *request, SSL_SESSION *sess)
+{
+	uint8_t key[TLS_CACHE_KEY_MAX];
+	size_t keylen;
+
+	if (!sess) return;
+
+	keylen = tls_cache_key(conf, sess, TLS_CACHE_KEY_SESSION, key);
+	if (keylen) conf->session_cache->driver->delete(conf->session_cache, request, key, keylen);
+
+	keylen = tls_cache_key(conf, sess, TLS_CACHE_KEY_TICKET, key);
+	if (keylen) conf->session_cache->driver->delete(conf->session_cache, request, key, keylen);
+}
+
+/*
+ *	Fetch the key for a period from a shared driver.
+ */
+static bool tls_ticket_key_fetch(fr_tls_ticket_keys_t *keys, REQUEST *request, time_t period, tls_ticket_key_t *key)
+{
+	uint8_t		id[9];
+	uint8_t		*data = NULL;
+	ssize_t		len;
+	int		i;
+
+	id[0] = TLS_CACHE_KEY_TICKET_KEY;
+	for (i = 0; i < 8; i++) id[i + 1] = ((uint64_t) period >> (8 * (7 - i))) & 0xff;
+
+	len = keys->cache->driver->load(keys->cache, request, id, sizeof(id), &data);
+	if (len != TLS_TICKET_KEY_LEN) {
+		talloc_free(data);
+		return false;
+	}
+
+	memcpy(key->name, data, sizeof(key->name));
+	memcpy(key->aes_key, data + 16, sizeof(key->aes_key));
+	memcpy(key->hmac_key, data + 48, sizeof(key->hmac_key));
+	key->valid = true;
+
+	memset(data, 0, len);
+	talloc_free(data);
+
+	return true;
+}
+
+/*
+ *	Make a random key for a period.  With a shared driver, the
+ *	key is offered to the other servers, and whichever key was
+ *	offered first is used, so tickets issued by one server can
+ *	be used with any other.
+ */
+static int tls_ticket_key_make(fr_tls_ticket_keys_t *keys, REQUEST *request, time_t period, tls_ticket_key_t *key)
+{
+	uint8_t		id[9];
+	uint8_t		data[TLS_TICKET_KEY_LEN];
+	int		i;
+
+	if ((RAND_bytes(key->name, sizeof(key->name)) != 1) ||
+	    (RAND_bytes(key->aes_key, sizeof(key->aes_key)) != 1) ||
+	    (RAND_bytes(key->hmac_key, sizeof(key->hmac_key)) != 1)) return -1;
+	key->valid = true;
+
+	if (!keys->cache->driver->add) return 0;
+
+	id[0] = TLS_CACHE_KEY_TICKET_KEY;
+	for (i = 0; i < 8; i++) id[i + 1] = ((uint64_t) period >> (8 * (7 - i))) & 0xff;
+
+	memcpy(data, key->name, sizeof(key->name));
+	memcpy(data + 16, key->aes_key, sizeof(key->aes_key));
+	memcpy(data + 48, key->hmac_key, sizeof(key->hmac_key));
+
+	/*
+	 *	Keys are kept for as long as tickets issued with
+	 *	them are accepted.
+	 */
+	keys->cache->driver->add(keys->cache, request, id, sizeof(id), data, sizeof(data), keys->rotation * 2);
+	memset(data, 0, sizeof(data));
+
+	/*
+	 *	If the store can't be reached, our own key is used
+	 *	until the next rotation.
+	 */
+	if (!tls_ticket_key_fetch(keys, request, period, key)) {
+		WARN("tls: Failed sharing session ticket key, tickets can only be used with this server");
+	}
+
+	return 0;
+}
+
+/*
+ *	Called with the mutex held.  With a shared driver, this waits
+ *	for the store, but only once per rotation.
+ */
+static void tls_ticket_keys_rotate(fr_tls_ticket_keys_t *keys, REQUEST *request, time_t now)
+{
+	time_t period = now / keys->rotation;
+
+	if (keys->keys[0].valid && (period == keys->period)) return;
+
+	if (keys->keys[0].valid && (period == (keys->period + 1))) {
+		keys->keys[1] = keys->keys[0];
+	} else {
+		keys->keys[1].valid = false;
+		if (keys->cache->driver->add) (void) tls_ticket_key_fetch(keys, request, period - 1, &keys->keys[1]);
+	}
+
+	keys->keys[0].valid = false;
+	if (tls_ticket_key_make(keys, request, period, &keys->keys[0]) < 0) {
+		ERROR("tls: Failed creating session ticket key");
+	}
+	keys->period = period;
+}
+
+/** Choose the key to encrypt a session ticket with, or find the key to decrypt one
+ *
+ * Tickets are encrypted with the current key.  Tickets encrypted with the
+ * previous key are still accepted, and replaced with a new one.
+ *
+ * @return 1 if the key was found, 2 if the ticket should be replaced, 0 if
+ *	the key wasn't found (so a full handshake is done instead), or -1 on
+ *	error.
+ */
+int tls_cache_ticket_key(SSL *ssl, unsigned char *key_name, unsigned char *iv, EVP_CIPHER_CTX *ctx,
+			 HMAC_CTX *hctx, int enc)
+{
+	fr_tls_server_conf_t	*conf;
+	fr_tls_ticket_keys_t	*keys;
+	tls_ticket_key_t	key;
+	int			i, ret = 0;
+
+	conf = (fr_tls_server_conf_t *)SSL_get_ex_data(ssl, FR_TLS_EX_INDEX_CONF);
+	if (!conf || !conf->ticket_keys) return -1;
+	keys = conf->ticket_keys;
+
+	PTHREAD_MUTEX_LOCK(&keys->mutex);
+	tls_ticket_keys_rotate(keys, SSL_get_ex_data(ssl, FR_TLS_EX_INDEX_REQUEST), time(NULL));
+
+	if (enc) {
+		key = keys->keys[0];
+		ret = key.valid ? 1 : -1;
+	} else {
+		for (i = 0; i < 2; i++) {
+			if (keys->keys[i].valid &&
+			    (memcmp(keys->keys[i].name, key_name, sizeof(keys->keys[i].name)) == 0)) {
+				key = keys->keys[i];
+				ret = (i == 0) ? 1 : 2;
+				break;
+			}
+		}
+	}
+	PTHREAD_MUTEX_UNLOCK(&keys->mutex);
+
+	if (ret <= 0) return ret;
+
+	if (enc) {
+		if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1) return -1;
+		memcpy(key_name, key.name, sizeof(key.name));
+
+		if (!EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, key.aes_key, iv)) return -1;
+	} else {
+		if (!EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, key.aes_key, iv)) return -1;
+	}
+
+	if (!HMAC_Init_ex(hctx, key.hmac_key, sizeof(key.hmac_key), EVP_sha256(), NULL)) return -1;
+
+	return ret;
+}
+
+static int _tls_ticket_keys_free(fr_tls_ticket_keys_t *keys)
+{
+	memset(keys->keys, 0, sizeof(keys->keys));
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_destroy(&keys->mutex);
+#endif
+
+	return 0;
+}
+
+/** Set up the session cache driver and session ticket keys
+ *
+ * @param[in] conf of the TLS context.
+ * @return 0 on success, -1 on error.
+ */
+int tls_cache_init(fr_tls_server_conf_t *conf)
+{
+	tls_cache_driver_t const *driver;
+
+	if (!conf->session_cache_driver || (strcmp(conf->session_cache_driver, "openssl") == 0)) {
+		if (conf->session_tickets) {
+			ERROR("tls: \"session_tickets\" requires a session cache \"driver\" other than \"openssl\"");
+			return -1;
+		}
+		return 0;
+	}
+
+	for (driver = tls_cache_drivers; driver->name; driver++) {
+		if (strcmp(driver->name, conf->session_cache_driver) == 0) break;
+	}
+	if (!driver->name) {
+		ERROR("tls: Unknown session cache driver \"%s\"", conf->session_cache_driver);
+		return -1;
+	}
+
+	if (conf->session_cache_path) {
+		ERROR("tls: \"persist_dir\" can only be used with the \"openssl\" session cache driver");
+		return -1;
+	}
+
+	conf->session_cache = talloc_zero(conf, fr_tls_cache_t);
+	if (!conf->session_cache) return -1;
+
+	conf->session_cache->conf = conf;
+	conf->session_cache->driver = driver;
+	conf->session_cache->lifetime = conf->session_timeout * 3600;
+
+	if (driver->init(conf->session_cache) < 0) {
+		TALLOC_FREE(conf->session_cache);
+		return -1;
+	}
+
+	if (!conf->session_tickets) return 0;
+
+	FR_INTEGER_BOUND_CHECK("ticket_key_rotation", conf->ticket_key_rotation, >=, 60);
+	FR_INTEGER_BOUND_CHECK("ticket_key_rotation", conf->ticket_key_rotation, <=, 86400 * 7);
+
+	conf->ticket_keys = talloc_zero(conf, fr_tls_ticket_keys_t);
+	if (!conf->ticket_keys) return -1;
+
+	conf->ticket_keys->cache = conf->session_cache;
+	conf->ticket_keys->rotation = conf->ticket_key_rotation;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_init(&conf->ticket_keys->mutex, NULL);
+#endif
+	talloc_set_destructor(conf->ticket_keys, _tls_ticket_keys_free);
+
+	return 0;
+}
+#endif	/* WITH_TLS */
@@ -0,0 +1,516 @@
+/*
+ * tls_crl.c
+ *
+ * Version:     $Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2014  The FreeRADIUS server project
+ */
+
+/**
+ * $Id$
+ * @file tls_crl.c
+ * @brief Check client certificates against CRLs which are reloaded in the background.
+ *
+ * OpenSSL loads CRLs into the X509_STORE the first time they're needed, and
+ * keeps them until the server is restarted.  Instead, when "crl_dir" is set,
+ * every CRL in that directory is loaded into a set indexed by issuer, and the
+ * set is rebuilt every "crl_reload_interval" seconds.  Requests hold a
+ * reference to the set they're using, so a new set can be swapped in at
+ * any time.
+ *
+ * As with X509_V_FLAG_CRL_CHECK, only the client certificate is checked, and
+ * it fails if there's no CRL for its issuer.
+ *
+ * @copyright 2014  The FreeRADIUS server project
+ */
+RCSID("$Id$")
+USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/rad_assert.h>
+
+#ifdef WITH_TLS
+#include <dirent.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+
+#ifdef HAVE_PTHREAD_H
+#define PTHREAD_MUTEX_LOCK pthread_mutex_lock
+#define PTHREAD_MUTEX_UNLOCK pthread_mutex_unlock
+#else
+#define PTHREAD_MUTEX_LOCK(_x)
+#define PTHREAD_MUTEX_UNLOCK(_x)
+#endif
+
+typedef struct tls_crl_t {
+	struct tls_crl_t *next;			//!< With the same issuer hash.
+	unsigned long	issuer;			//!< X509_NAME_hash() of the issuer.
+	X509_CRL	*crl;
+} tls_crl_t;
+
+typedef struct tls_crl_set_t {
+	fr_hash_table_t	*crls;
+	int		refs;
+	uint32_t	count;
+} tls_crl_set_t;
+
+struct fr_tls_crl_index_t {
+	fr_tls_server_conf_t	*conf;
+	tls_crl_set_t		*set;
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t		mutex;
+	pthread_cond_t		cond;
+	pthread_t		thread;
+	bool			running;
+	bool			exiting;
+#endif
+};
+
+static uint32_t tls_crl_hash(void const *data)
+{
+	tls_crl_t const *crl = data;
+
+	return fr_hash(&crl->issuer, sizeof(crl->issuer));
+}
+
+static int tls_crl_cmp(void const *one, void const *two)
+{
+	tls_crl_t const *a = one;
+	tls_crl_t const *b = two;
+
+	if (a->issuer < b->issuer) return -1;
+	if (a->issuer > b->issuer) return +1;
+
+	return 0;
+}
+
+static int _tls_crl_free(tls_crl_t *crl)
+{
+	X509_CRL_free(crl->crl);
+	talloc_free(crl->next);
+
+	return 0;
+}
+
+static void tls_crl_free(void *data)
+{
+	talloc_free(data);
+}
+
+static int _tls_crl_set_free(tls_crl_set_t *set)
+{
+	if (set->crls) fr_hash_table_free(set->crls);
+
+	return 0;
+}
+
+/*
+ *	Find the certificate of the CA which issued a CRL.
+ */
+static X509 *tls_crl_issuer(X509_STORE *store, X509_NAME *name)
+{
+	X509_STORE_CTX	*ctx;
+	X509		*issuer = NULL;
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	X509_OBJECT	*obj;
+#else
+	X509_OBJECT	obj;
+#endif
+
+	ctx = X509_STORE_CTX_new();
+	if (!ctx) return NULL;
+
+	if (X509_STORE_CTX_init(ctx, store, NULL, NULL) == 1) {
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+		obj = X509_STORE_CTX_get_obj_by_subject(ctx, X509_LU_X509, name);
+		if (obj) {
+			issuer = X509_OBJECT_get0_X509(obj);
+			if (issuer) X509_up_ref(issuer);
+			X509_OBJECT_free(obj);
+		}
+#else
+		if (X509_STORE_get_by_subject(ctx, X509_LU_X509, name, &obj) > 0) issuer = obj.data.x509;
+#endif
+	}
+	X509_STORE_CTX_free(ctx);
+
+	return issuer;
+}
+
+/*
+ *	Add one CRL to the set, if it was signed by a CA we trust.
+ */
+static void tls_crl_add(tls_crl_set_t *set, X509_STORE *store, X509_CRL *x509_crl, char const *filename)
+{
+	X509		*issuer;
+	EVP_PKEY	*pkey;
+	X509_REVOKED	*revoked;
+	tls_crl_t	*crl, *old;
+	int		ret;
+
+	issuer = tls_crl_issuer(store, X509_CRL_get_issuer(x509_crl));
+	if (!issuer) {
+		WARN("tls: Ignoring CRL in %s, as its issuer isn't a trusted CA", filename);
+		X509_CRL_free(x509_crl);
+		return;
+	}
+
+	pkey = X509_get_pubkey(issuer);
+	ret = pkey ? X509_CRL_verify(x509_crl, pkey) : 0;
+	if (pkey) EVP_PKEY_free(pkey);
+	if (ret != 1) {
+		WARN("tls: Ignoring CRL in %s, as its signature is invalid", filename);
+		X509_free(issuer);
+		X509_CRL_free(x509_crl);
+		return;
+	}
+
+	/*
+	 *	Sorts the revoked certificates now, so that requests
+	 *	don't have to.
+	 */
+	(void) X509_CRL_get0_by_serial(x509_crl, &revoked, X509_get_serialNumber(issuer));
+	X509_free(issuer);
+
+	crl = talloc_zero(NULL, tls_crl_t);
+	if (!crl) {
+		X509_CRL_free(x509_crl);
+		return;
+	}
+	crl->issuer = X509_NAME_hash(X509_CRL_get_issuer(x509_crl));
+	crl->crl = x509_crl;
+	talloc_set_destructor(crl, _tls_crl_free);
+
+	old = fr_hash_table_finddata(set->crls, crl);
+	if (old) {
+		crl->next = old->next;
+		old->next = crl;
+	} else if (!fr_hash_table_insert(set->crls, crl)) {
+		talloc_free(crl);
+		return;
+	}
+	set->count++;
+}
+
+/*
+ *	Load every CRL in the directory.  Files may hold one or more
+ *	PEM CRLs, or a single DER CRL.
+ */
+static tls_crl_set_t *tls_crl_load(fr_tls_server_conf_t *conf)
+{
+	tls_crl_set_t	*set;
+	X509_STORE	*store;
+	X509_CRL	*x509_crl;
+	DIR		*dir;
+	struct dirent	*dp;
+	char		filename[PATH_MAX];
+	FILE		*fp;
+	int		found;
+
+	dir = opendir(conf->crl_dir);
+	if (!dir) {
+		ERROR("tls: Failed opening crl_dir %s: %s", conf->crl_dir, fr_syserror(errno));
+		return NULL;
+	}
+
+	store = X509_STORE_new();
+	if (!store) {
+		closedir(dir);
+		return NULL;
+	}
+	if ((conf->ca_file || conf->ca_path) && !X509_STORE_load_locations(store, conf->ca_file, conf->ca_path)) {
+		ERROR("tls: Error reading Trusted root CA list for CRL checks: %s",
+		      ERR_error_string(ERR_get_error(), NULL));
+		X509_STORE_free(store);
+		closedir(dir);
+		return NULL;
+	}
+
+	set = talloc_zero(NULL, tls_crl_set_t);
+	if (!set) goto done;
+	talloc_set_destructor(set, _tls_crl_set_free);
+
+	set->crls = fr_hash_table_create(tls_crl_hash, tls_crl_cmp, tls_crl_free);
+	if (!set->crls) {
+		TALLOC_FREE(set);
+		goto done;
+	}
+
+	while ((dp = readdir(dir)) != NULL) {
+		if (dp->d_name[0] == '.') continue;
+
+		snprintf(filename, sizeof(filename), "%s/%s", conf->crl_dir, dp->d_name);
+
+		fp = fopen(filename, "r");
+		if (!fp) {
+			WARN("tls: Failed opening %s: %s", filename, fr_syserror(errno));
+			continue;
+		}
+
+		found = 0;
+		while ((x509_crl = PEM_read_X509_CRL(fp, NULL, NULL, NULL)) != NULL) {
+			tls_crl_add(set, store, x509_crl, filename);
+			found++;
+		}
+		ERR_clear_error();
+
+		if (!found) {
+			rewind(fp);
+			x509_crl = d2i_X509_CRL_fp(fp, NULL);
+			ERR_clear_error();
+			if (x509_crl) {
+				tls_crl_add(set, store, x509_crl, filename);
+			} else {
+				DEBUG2("tls: Ignoring %s, as it contains no CRLs", filename);
+			}
+		}
+		fclose(fp);
+	}
+
+	DEBUG("tls: Loaded %u CRLs from %s", set->count, conf->crl_dir);
+
+done:
+	X509_STORE_free(store);
+	closedir(dir);
+
+	return set;
+}
+
+static tls_crl_set_t *tls_crl_set_acquire(fr_tls_crl_index_t *index)
+{
+	tls_crl_set_t *set;
+
+	PTHREAD_MUTEX_LOCK(&index->mutex);
+	set = index->set;
+	if (set) set->refs++;
+	PTHREAD_MUTEX_UNLOCK(&index->mutex);
+
+	return set;
+}
+
+static void tls_crl_set_release(fr_tls_crl_index_t *index, tls_crl_set_t *set)
+{
+	bool unused;
+
+	PTHREAD_MUTEX_LOCK(&index->mutex);
+	unused = (--set->refs == 0);
+	PTHREAD_MUTEX_UNLOCK(&index->mutex);
+
+	if (unused) talloc_free(set);
+}
+
+/*
+ *	Swap in a new set.  The old one is freed once the last
+ *	request using it is done.
+ */
+static void tls_crl_set_replace(fr_tls_crl_index_t *index, tls_crl_set_t *set)
+{
+	tls_crl_set_t *old;
+
+	set->refs = 1;
+
+	PTHREAD_MUTEX_LOCK(&index->mutex);
+	old = index->set;
+	index->set = set;
+	PTHREAD_MUTEX_UNLOCK(&index->mutex);
+
+	if (old) tls_crl_set_release(index, old);
+}
+
+#ifdef HAVE_PTHREAD_H
+static void *tls_crl_thread(void *arg)
+{
+	fr_tls_crl_index_t	*index = arg;
+	tls_crl_set_t		*set;
+	struct timeval		now;
+	struct timespec		when;
+
+	pthread_mutex_lock(&index->mutex);
+	while (!index->exiting) {
+		gettimeofday(&now, NULL);
+		when.tv_sec = now.tv_sec + index->conf->crl_reload_interval;
+		when.tv_nsec = now.tv_usec * 1000;
+		pthread_cond_timedwait(&index->cond, &index->mutex, &when);
+		if (index->exiting) break;
+		pthread_mutex_unlock(&index->mutex);
+
+		/*
+		 *	If the directory can't be read, keep using the
+		 *	CRLs we have.
+		 */
+		set = tls_crl_load(index->conf);
+		if (set) tls_crl_set_replace(index, set);
+
+		pthread_mutex_lock(&index->mutex);
+	}
+	pthread_mutex_unlock(&index->mutex);
+
+	return NULL;
+}
+#endif
+
+/*
+ *	This is done when the first certificate is checked, instead
+ *	of when the configuration is parsed, as the server may fork
+ *	after that.
+ */
+static void tls_crl_start(fr_tls_crl_index_t *index)
+{
+#ifdef HAVE_PTHREAD_H
+	int ret;
+
+	/*
+	 *	Checked again with the mutex held.
+	 */
+	if (index->running) return;
+
+	pthread_mutex_lock(&index->mutex);
+	if (!index->running) {
+		ret = pthread_create(&index->thread, NULL, tls_crl_thread, index);
+		if (ret != 0) {
+			ERROR("tls: Failed creating CRL reload thread: %s", fr_syserror(ret));
+		} else {
+			index->running = true;
+		}
+	}
+	pthread_mutex_unlock(&index->mutex);
+#endif
+}
+
+/** Check a client certificate against the CRL of its issuer
+ *
+ * @param[in] conf of the TLS context.
+ * @param[in] request being authenticated.
+ * @param[in] client_cert to check.
+ * @return 1 if the certificate hasn't been revoked, 0 if it has, or if its
+ *	status can't be checked.
+ */
+int tls_crl_check(fr_tls_server_conf_t *conf, REQUEST *request, X509 *client_cert)
+{
+	fr_tls_crl_index_t	*index = conf->crl_index;
+	tls_crl_set_t		*set;
+	tls_crl_t		my_crl, *crl;
+	X509_NAME		*issuer;
+	X509_REVOKED		*revoked;
+	ASN1_TIME const		*next_update;
+	int			ret = 0;
+
+	tls_crl_start(index);
+
+	set = tls_crl_set_acquire(index);
+	if (!set) {
+		RERROR("No CRLs have been loaded");
+		return 0;
+	}
+
+	issuer = X509_get_issuer_name(client_cert);
+	my_crl.issuer = X509_NAME_hash(issuer);
+
+	for (crl = fr_hash_table_finddata(set->crls, &my_crl); crl; crl = crl->next) {
+		if (X509_NAME_cmp(X509_CRL_get_issuer(crl->crl), issuer) == 0) break;
+	}
+	if (!crl) {
+		RERROR("No CRL for the issuer of the client certificate");
+		goto done;
+	}
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	next_update = X509_CRL_get0_nextUpdate(crl->crl);
+#else
+	next_update = X509_CRL_get_nextUpdate(crl->crl);
+#endif
+	if (next_update && (X509_cmp_current_time(next_update) < 0) && !conf->allow_expired_crl) {
+		RERROR("The CRL for the issuer of the client certificate has expired");
+		goto done;
+	}
+
+	if (X509_CRL_get0_by_serial(crl->crl, &revoked, X509_get_serialNumber(client_cert)) == 1) {
+		AUTH("tls: Certificate has been revoked");
+		goto done;
+	}
+
+	ret = 1;
+
+done:
+	tls_crl_set_release(index, set);
+
+	return ret;
+}
+
+static int _tls_crl_index_free(fr_tls_crl_index_t *index)
+{
+#ifdef HAVE_PTHREAD_H
+	if (index->running) {
+		pthread_mutex_lock(&index->mutex);
+		index->exiting = true;
+		pthread_cond_signal(&index->cond);
+		pthread_mutex_unlock(&index->mutex);
+
+		pthread_join(index->thread, NULL);
+	}
+#endif
+
+	if (index->set) tls_crl_set_release(index, index->set);
+
+#ifdef HAVE_PTHREAD_H
+	pthread_cond_destroy(&index->cond);
+	pthread_mutex_destroy(&index->mutex);
+#endif
+
+	return 0;
+}
+
+/** Load the CRLs in crl_dir
+ *
+ * @param[in] conf of the TLS context.
+ * @return 0 on success, -1 on error.
+ */
+int tls_crl_init(fr_tls_server_conf_t *conf)
+{
+	fr_tls_crl_index_t *index;
+	tls_crl_set_t *set;
+
+	if (!conf->check_crl) {
+		ERROR("tls: \"crl_dir\" requires \"check_crl = yes\"");
+		return -1;
+	}
+
+	FR_INTEGER_BOUND_CHECK("crl_reload_interval", conf->crl_reload_interval, >=, 10);
+
+	set = tls_crl_load(conf);
+	if (!set) return -1;
+
+	index = talloc_zero(conf, fr_tls_crl_index_t);
+	if (!index) {
+		talloc_free(set);
+		return -1;
+	}
+	index->conf = conf;
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_init(&index->mutex, NULL);
+	pthread_cond_init(&index->cond, NULL);
+#endif
+	talloc_set_destructor(index, _tls_crl_index_free);
+
+	tls_crl_set_replace(index, set);
+	conf->crl_index = index;
+
+	return 0;
+}
+#endif	/* WITH_TLS */
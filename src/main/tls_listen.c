@@ -92,7 +92,13 @@ static void tls_socket_close(rad_listen_t *listener)
 	 */
 }
 
-static int CC_HINT(nonnull) tls_socket_write(rad_listen_t *listener, REQUEST *request)
+/*
+ *	Write the encrypted data to the socket.  Returns -1 on error,
+ *	and leaves it to the caller to close the socket.
+ *
+ *	Called with the mutex held.
+ */
+static int tls_socket_flush(rad_listen_t *listener, REQUEST *request)
 {
 	uint8_t *p;
 	ssize_t rcode;
@@ -101,37 +107,44 @@ static int CC_HINT(nonnull) tls_socket_write(rad_listen_t *listener, REQUEST *re
 	p = sock->ssn->dirty_out.data;
 
 	while (p < (sock->ssn->dirty_out.data + sock->ssn->dirty_out.used)) {
-		RDEBUG3("Writing to socket %d", request->packet->sockfd);
-		rcode = write(request->packet->sockfd, p,
+		RDEBUG3("Writing to socket %d", listener->fd);
+		rcode = write(listener->fd, p,
 			      (sock->ssn->dirty_out.data + sock->ssn->dirty_out.used) - p);
 		if (rcode <= 0) {
 			RDEBUG("Error writing to TLS socket: %s", fr_syserror(errno));
-
-			tls_socket_close(listener);
-			return 0;
+			return -1;
 		}
 		p += rcode;
 	}
 
 	sock->ssn->dirty_out.used = 0;
 
-	return 1;
+	return 0;
 }
 
+static int CC_HINT(nonnull) tls_socket_write(rad_listen_t *listener, REQUEST *request)
+{
+	if (tls_socket_flush(listener, request) < 0) {
+		tls_socket_close(listener);
+		return 0;
+	}
 
-static int tls_socket_recv(rad_listen_t *listener)
+	return 1;
+}
+
+/*
+ *	Allocate the packet, the REQUEST used for debugging, and the
+ *	TLS session.  Returns -1 on error, 0 if they already exist,
+ *	and 1 if this is the first data on the connection.
+ */
+static int tls_socket_init(rad_listen_t *listener)
 {
-	bool doing_init = false;
-	ssize_t rcode;
-	RADIUS_PACKET *packet;
 	REQUEST *request;
 	listen_socket_t *sock = listener->data;
-	fr_tls_status_t status;
-	RADCLIENT *client = sock->client;
 
 	if (!sock->packet) {
 		sock->packet = rad_alloc(sock, false);
-		if (!sock->packet) return 0;
+		if (!sock->packet) return -1;
 
 		sock->packet->sockfd = listener->fd;
 		sock->packet->src_ipaddr = sock->other_ipaddr;
@@ -144,79 +157,65 @@ static int tls_socket_recv(rad_listen_t *listener)
 		}
 	}
 
+	if (sock->request) return 0;
+
 	/*
 	 *	Allocate a REQUEST for debugging.
 	 */
+	sock->request = request = request_alloc(NULL);
 	if (!sock->request) {
-		sock->request = request = request_alloc(NULL);
-		if (!sock->request) {
-			ERROR("Out of memory");
-			return 0;
-		}
-
-		rad_assert(request->packet == NULL);
-		rad_assert(sock->packet != NULL);
-		request->packet = talloc_steal(request, sock->packet);
-
-		request->component = "<core>";
-		request->component = "<tls-connect>";
-
-		/*
-		 *	Not sure if we should do this on every packet...
-		 */
-		request->reply = rad_alloc(request, false);
-		if (!request->reply) return 0;
-
-		rad_assert(sock->ssn == NULL);
-
-		sock->ssn = tls_new_session(listener->tls, listener->tls, sock->request,
-					    listener->tls->require_client_cert);
-		if (!sock->ssn) {
-			TALLOC_FREE(sock->request);
-			sock->packet = NULL;
-			return 0;
-		}
-
-		(void) talloc_steal(sock, sock->ssn);
-		SSL_set_ex_data(sock->ssn->ssl, FR_TLS_EX_INDEX_REQUEST, (void *)request);
-		SSL_set_ex_data(sock->ssn->ssl, fr_tls_ex_index_certs, (void *)&request->packet->vps);
-		SSL_set_ex_data(sock->ssn->ssl, FR_TLS_EX_INDEX_TALLOC, sock->parent);
-
-		doing_init = true;
+		ERROR("Out of memory");
+		return -1;
 	}
 
-	rad_assert(sock->request != NULL);
-	rad_assert(sock->request->packet != NULL);
+	rad_assert(request->packet == NULL);
 	rad_assert(sock->packet != NULL);
-	rad_assert(sock->ssn != NULL);
+	request->packet = talloc_steal(request, sock->packet);
 
-	request = sock->request;
+	request->component = "<core>";
+	request->component = "<tls-connect>";
 
-	RDEBUG3("Reading from socket %d", request->packet->sockfd);
-	PTHREAD_MUTEX_LOCK(&sock->mutex);
-	rcode = read(request->packet->sockfd,
-		     sock->ssn->dirty_in.data,
-		     sizeof(sock->ssn->dirty_in.data));
-	if ((rcode < 0) && (errno == ECONNRESET)) {
-	do_close:
-		PTHREAD_MUTEX_UNLOCK(&sock->mutex);
-		DEBUG("Closing TLS socket from client port %u", sock->other_port);
-		tls_socket_close(listener);
-		PTHREAD_MUTEX_UNLOCK(&sock->mutex);
-		return 0;
-	}
+	/*
+	 *	Not sure if we should do this on every packet...
+	 */
+	request->reply = rad_alloc(request, false);
+	if (!request->reply) return -1;
 
-	if (rcode < 0) {
-		RDEBUG("Error reading TLS socket: %s", fr_syserror(errno));
-		goto do_close;
+	rad_assert(sock->ssn == NULL);
+
+	sock->ssn = tls_new_session(listener->tls, listener->tls, sock->request,
+				    listener->tls->require_client_cert);
+	if (!sock->ssn) {
+		TALLOC_FREE(sock->request);
+		sock->packet = NULL;
+		return -1;
 	}
 
-	/*
-	 *	Normal socket close.
-	 */
-	if (rcode == 0) goto do_close;
+	(void) talloc_steal(sock, sock->ssn);
+	SSL_set_ex_data(sock->ssn->ssl, FR_TLS_EX_INDEX_REQUEST, (void *)request);
+	SSL_set_ex_data(sock->ssn->ssl, fr_tls_ex_index_certs, (void *)&request->packet->vps);
+	SSL_set_ex_data(sock->ssn->ssl, FR_TLS_EX_INDEX_TALLOC, sock->parent);
+
+	return 1;
+}
 
-	sock->ssn->dirty_in.used = rcode;
+/*
+ *	Run the data in dirty_in through the handshake or the
+ *	application data decoder.  If there's a complete RADIUS
+ *	packet, it's copied to *packet_p, allocating a new packet if
+ *	*packet_p is NULL.
+ *
+ *	Returns -1 if the socket should be closed, 0 if more data is
+ *	needed, and 1 when there's a packet.
+ *
+ *	Called with the mutex held.
+ */
+static int tls_socket_decode(rad_listen_t *listener, bool doing_init, RADIUS_PACKET **packet_p)
+{
+	RADIUS_PACKET *packet;
+	listen_socket_t *sock = listener->data;
+	REQUEST *request = sock->request;
+	fr_tls_status_t status;
 
 	dump_hex("READ FROM SSL", sock->ssn->dirty_in.data, sock->ssn->dirty_in.used);
 
@@ -225,7 +224,7 @@ static int tls_socket_recv(rad_listen_t *listener)
 	 */
 	if (doing_init && (sock->ssn->dirty_in.data[0] != handshake)) {
 		RDEBUG("Non-TLS data sent to TLS socket: closing");
-		goto do_close;
+		return -1;
 	}
 
 	/*
@@ -235,12 +234,11 @@ static int tls_socket_recv(rad_listen_t *listener)
 
 	if (!tls_handshake_recv(request, sock->ssn)) {
 		RDEBUG("FAILED in TLS handshake receive");
-		goto do_close;
+		return -1;
 	}
 
 	if (sock->ssn->dirty_out.used > 0) {
-		tls_socket_write(listener, request);
-		PTHREAD_MUTEX_UNLOCK(&sock->mutex);
+		if (tls_socket_flush(listener, request) < 0) return -1;
 		return 0;
 	}
 
@@ -254,15 +252,9 @@ app:
 	status = tls_application_data(sock->ssn, request);
 	RDEBUG("Application data status %d", status);
 
-	if (status == FR_TLS_MORE_FRAGMENTS) {
-		PTHREAD_MUTEX_UNLOCK(&sock->mutex);
-		return 0;
-	}
+	if (status == FR_TLS_MORE_FRAGMENTS) return 0;
 
-	if (sock->ssn->clean_out.used == 0) {
-		PTHREAD_MUTEX_UNLOCK(&sock->mutex);
-		return 0;
-	}
+	if (sock->ssn->clean_out.used == 0) return 0;
 
 	dump_hex("TUNNELED DATA > ", sock->ssn->clean_out.data, sock->ssn->clean_out.used);
 
@@ -275,23 +267,38 @@ app:
 		RDEBUG("Received bad packet: Length %d contents %d",
 		       sock->ssn->clean_out.used,
 		       (sock->ssn->clean_out.data[2] << 8) | sock->ssn->clean_out.data[3]);
-		goto do_close;
+		return -1;
+	}
+
+	packet = *packet_p;
+	if (!packet) {
+		packet = rad_alloc(NULL, false);
+		if (!packet) return -1;
+
+		packet->sockfd = listener->fd;
+		packet->src_ipaddr = sock->other_ipaddr;
+		packet->src_port = sock->other_port;
+		packet->dst_ipaddr = sock->my_ipaddr;
+		packet->dst_port = sock->my_port;
+		*packet_p = packet;
 	}
 
-	packet = sock->packet;
 	packet->data = talloc_array(packet, uint8_t, sock->ssn->clean_out.used);
 	packet->data_len = sock->ssn->clean_out.used;
 	sock->ssn->record_minus(&sock->ssn->clean_out, packet->data, packet->data_len);
 	packet->vps = NULL;
-	PTHREAD_MUTEX_UNLOCK(&sock->mutex);
 
+	return 1;
+}
+
+/*
+ *	Check the decoded packet.
+ */
+static bool tls_socket_packet_ok(REQUEST *request, RADIUS_PACKET *packet)
+{
 	if (!rad_packet_ok(packet, 0, NULL)) {
 		RDEBUG("Received bad packet: %s", fr_strerror());
-		DEBUG("Closing TLS socket from client");
-		PTHREAD_MUTEX_LOCK(&sock->mutex);
-		tls_socket_close(listener);
-		PTHREAD_MUTEX_UNLOCK(&sock->mutex);
-		return 0;	/* do_close unlocks the mutex */
+		return false;
 	}
 
 	/*
@@ -319,34 +326,87 @@ app:
 		}
 	}
 
-	FR_STATS_INC(auth, total_requests);
-
-	return 1;
+	return true;
 }
 
-
-int dual_tls_recv(rad_listen_t *listener)
+static int tls_socket_recv(rad_listen_t *listener)
 {
-	RADIUS_PACKET *packet;
+	int rcode;
+	bool doing_init;
+	ssize_t data_len;
+	uint8_t *p;
 	REQUEST *request;
-	RAD_REQUEST_FUNP fun = NULL;
 	listen_socket_t *sock = listener->data;
-	RADCLIENT	*client = sock->client;
+	RADCLIENT *client = sock->client;
 
-	if (listener->status != RAD_LISTEN_STATUS_KNOWN) return 0;
-
-	if (!tls_socket_recv(listener)) {
-		return 0;
-	}
+	rcode = tls_socket_init(listener);
+	if (rcode < 0) return 0;
+	doing_init = (rcode == 1);
 
 	rad_assert(sock->request != NULL);
 	rad_assert(sock->request->packet != NULL);
 	rad_assert(sock->packet != NULL);
 	rad_assert(sock->ssn != NULL);
-	rad_assert(client != NULL);
 
 	request = sock->request;
-	packet = sock->packet;
+
+	RDEBUG3("Reading from socket %d", request->packet->sockfd);
+	PTHREAD_MUTEX_LOCK(&sock->mutex);
+	sock->ssn->record_init(&sock->ssn->dirty_in);
+	p = sock->ssn->record_reserve(&sock->ssn->dirty_in, MAX_RECORD_SIZE);
+	if (!p) {
+		RDEBUG("Failed allocating TLS socket buffer");
+		goto do_close;
+	}
+	data_len = read(request->packet->sockfd, p, MAX_RECORD_SIZE);
+	if ((data_len < 0) && (errno != ECONNRESET)) {
+		RDEBUG("Error reading TLS socket: %s", fr_syserror(errno));
+	}
+
+	/*
+	 *	Normal socket close, or an error.
+	 */
+	if (data_len <= 0) goto do_close;
+
+	sock->ssn->dirty_in.used = data_len;
+
+	rcode = tls_socket_decode(listener, doing_init, &sock->packet);
+	if (rcode < 0) {
+	do_close:
+		DEBUG("Closing TLS socket from client port %u", sock->other_port);
+		tls_socket_close(listener);
+		PTHREAD_MUTEX_UNLOCK(&sock->mutex);
+		return 0;
+	}
+	PTHREAD_MUTEX_UNLOCK(&sock->mutex);
+
+	if (rcode == 0) return 0;
+
+	if (!tls_socket_packet_ok(request, sock->packet)) {
+		DEBUG("Closing TLS socket from client");
+		PTHREAD_MUTEX_LOCK(&sock->mutex);
+		tls_socket_close(listener);
+		PTHREAD_MUTEX_UNLOCK(&sock->mutex);
+		return 0;
+	}
+
+	FR_STATS_INC(auth, total_requests);
+
+	return 1;
+}
+
+/*
+ *	Check a decoded packet against the listener, and hand it to
+ *	request_receive().  Returns 0 if the packet wasn't used, in
+ *	which case the caller should free it.
+ */
+static int dual_tls_dispatch(rad_listen_t *listener, RADIUS_PACKET *packet)
+{
+	RAD_REQUEST_FUNP fun = NULL;
+	listen_socket_t *sock = listener->data;
+	RADCLIENT	*client = sock->client;
+
+	rad_assert(client != NULL);
 
 	/*
 	 *	Some sanity checks, based on the packet code.
@@ -382,8 +442,6 @@ int dual_tls_recv(rad_listen_t *listener)
 		if (!main_config.status_server) {
 			FR_STATS_INC(auth, total_unknown_types);
 			WARN("Ignoring Status-Server request due to security configuration");
-			rad_free(&sock->packet);
-			request->packet = NULL;
 			return 0;
 		}
 		fun = rad_status_server;
@@ -395,20 +453,297 @@ int dual_tls_recv(rad_listen_t *listener)
 
 		DEBUG("Invalid packet code %d sent from client %s port %d : IGNORED",
 		      packet->code, client->shortname, packet->src_port);
-		rad_free(&sock->packet);
-		request->packet = NULL;
 		return 0;
 	} /* switch over packet types */
 
 	if (!request_receive(listener, packet, client, fun)) {
 		FR_STATS_INC(auth, total_packets_dropped);
+		return 0;
+	}
+
+	return 1;
+}
+
+#ifdef HAVE_PTHREAD_H
+/*
+ *	Asynchronous TLS.  The main thread reads the encrypted data
+ *	from the socket.  The handshake and the decryption are done
+ *	by an I/O thread, so that a burst of new connections doesn't
+ *	hold up the packets on the established ones.  Each connection
+ *	always goes to the same I/O thread, which keeps its records in
+ *	order.  Complete RADIUS packets are passed back to the main
+ *	thread, which hands them to request_receive().
+ */
+typedef struct tls_io_work_t {
+	struct tls_io_work_t	*next;
+	rad_listen_t		*listener;
+	bool			init;		//!< First data on the connection.
+	bool			close;		//!< The I/O thread wants the socket closed.
+	RADIUS_PACKET		*packet;	//!< Decoded packet, on the way back.
+	size_t			data_len;
+	uint8_t			data[MAX_RECORD_SIZE];
+} tls_io_work_t;
+
+typedef struct tls_io_queue_t {
+	pthread_mutex_t		mutex;
+	pthread_cond_t		cond;
+	tls_io_work_t		*head;
+	tls_io_work_t		**tail;
+} tls_io_queue_t;
+
+static tls_io_queue_t tls_io_queues[MAX_TLS_IO_THREADS];
+static uint32_t tls_io_num = 0;		//!< Number of I/O threads started.
+static tls_io_queue_t tls_io_done;	//!< Work on the way back to the main thread.
+
+/*
+ *	Decrypt the data, with the connection mutex held.
+ */
+static void tls_io_process(tls_io_work_t *work)
+{
+	int rcode;
+	rad_listen_t *listener = work->listener;
+	listen_socket_t *sock = listener->data;
+
+	PTHREAD_MUTEX_LOCK(&sock->mutex);
+
+	/*
+	 *	The main thread closed the socket while this data
+	 *	was in the queue.
+	 */
+	if (listener->status != RAD_LISTEN_STATUS_KNOWN) {
+		PTHREAD_MUTEX_UNLOCK(&sock->mutex);
+		return;
+	}
+
+	sock->ssn->record_init(&sock->ssn->dirty_in);
+	if (sock->ssn->record_plus(&sock->ssn->dirty_in, work->data, work->data_len) != work->data_len) {
+		PTHREAD_MUTEX_UNLOCK(&sock->mutex);
+		work->close = true;
+		return;
+	}
+
+	rcode = tls_socket_decode(listener, work->init, &work->packet);
+	PTHREAD_MUTEX_UNLOCK(&sock->mutex);
+
+	if ((rcode < 0) ||
+	    ((rcode > 0) && !tls_socket_packet_ok(sock->request, work->packet))) {
+		work->close = true;
+		rad_free(&work->packet);
+	}
+}
+
+static void *tls_io_thread(void *arg)
+{
+	bool signal;
+	tls_io_queue_t *queue = arg;
+	tls_io_work_t *work;
+
+	for (;;) {
+		pthread_mutex_lock(&queue->mutex);
+		while (!queue->head) pthread_cond_wait(&queue->cond, &queue->mutex);
+
+		work = queue->head;
+		queue->head = work->next;
+		if (!queue->head) queue->tail = &queue->head;
+		pthread_mutex_unlock(&queue->mutex);
+
+		work->next = NULL;
+		tls_io_process(work);
+
+		/*
+		 *	Only wake up the main thread if it doesn't
+		 *	already have work waiting.
+		 */
+		pthread_mutex_lock(&tls_io_done.mutex);
+		signal = (tls_io_done.head == NULL);
+		*tls_io_done.tail = work;
+		tls_io_done.tail = &work->next;
+		pthread_mutex_unlock(&tls_io_done.mutex);
+
+		if (signal) radius_signal_self(RADIUS_SIGNAL_SELF_TLS);
+	}
+
+	return NULL;
+}
+
+/** Start the TLS I/O threads
+ *
+ * May be called once per listener.  Threads are only started if
+ * there are fewer than requested.
+ *
+ * @param num the number of threads the listener uses.
+ * @return 0 on success, -1 on error.
+ */
+int tls_io_start(uint32_t num)
+{
+	int rcode;
+	pthread_t id;
+	tls_io_queue_t *queue;
+
+	rad_assert(num <= MAX_TLS_IO_THREADS);
+
+	if (tls_io_num == 0) {
+		pthread_mutex_init(&tls_io_done.mutex, NULL);
+		tls_io_done.tail = &tls_io_done.head;
+	}
+
+	while (tls_io_num < num) {
+		queue = &tls_io_queues[tls_io_num];
+
+		pthread_mutex_init(&queue->mutex, NULL);
+		pthread_cond_init(&queue->cond, NULL);
+		queue->tail = &queue->head;
+
+		rcode = pthread_create(&id, NULL, tls_io_thread, queue);
+		if (rcode != 0) {
+			ERROR("Thread create failed: %s", fr_syserror(rcode));
+			return -1;
+		}
+		pthread_detach(id);
+
+		DEBUG("TLS I/O thread %u started", tls_io_num);
+		tls_io_num++;
+	}
+
+	return 0;
+}
+
+/*
+ *	Read the encrypted data, and give it to the I/O thread which
+ *	owns the connection.
+ */
+static int tls_io_queue_recv(rad_listen_t *listener)
+{
+	int rcode;
+	ssize_t data_len;
+	uint32_t num;
+	tls_io_work_t *work;
+	tls_io_queue_t *queue;
+	listen_socket_t *sock = listener->data;
+
+	rcode = tls_socket_init(listener);
+	if (rcode < 0) return 0;
+
+	work = talloc_zero(NULL, tls_io_work_t);
+	if (!work) {
+		ERROR("Out of memory");
+		return 0;
+	}
+	work->listener = listener;
+	work->init = (rcode == 1);
+
+	data_len = read(listener->fd, work->data, sizeof(work->data));
+	if (data_len <= 0) {
+		if ((data_len < 0) && (errno != ECONNRESET)) {
+			DEBUG("Error reading TLS socket: %s", fr_syserror(errno));
+		}
+		talloc_free(work);
+
+		/*
+		 *	Any data still queued for the I/O thread is
+		 *	discarded once the status changes.
+		 */
+		DEBUG("Closing TLS socket from client port %u", sock->other_port);
+		PTHREAD_MUTEX_LOCK(&sock->mutex);
+		tls_socket_close(listener);
+		PTHREAD_MUTEX_UNLOCK(&sock->mutex);
+		return 0;
+	}
+	work->data_len = data_len;
+
+	num = listener->tls_io_threads;
+	if (num > tls_io_num) num = tls_io_num;
+	rad_assert(num > 0);
+
+	queue = &tls_io_queues[listener->fd % num];
+
+	/*
+	 *	Don't free the listener while the I/O thread has
+	 *	a pointer to it.
+	 */
+	listener->count++;
+
+	pthread_mutex_lock(&queue->mutex);
+	*queue->tail = work;
+	queue->tail = &work->next;
+	pthread_cond_signal(&queue->cond);
+	pthread_mutex_unlock(&queue->mutex);
+
+	return 0;
+}
+
+/** Process the packets decoded by the TLS I/O threads
+ *
+ * Called from the main thread when an I/O thread signals it.
+ */
+void tls_io_process_done(void)
+{
+	tls_io_work_t *work, *next;
+
+	pthread_mutex_lock(&tls_io_done.mutex);
+	work = tls_io_done.head;
+	tls_io_done.head = NULL;
+	tls_io_done.tail = &tls_io_done.head;
+	pthread_mutex_unlock(&tls_io_done.mutex);
+
+	for (; work != NULL; work = next) {
+		rad_listen_t *listener = work->listener;
+		listen_socket_t *sock = listener->data;
+		RADCLIENT *client = sock->client;
+
+		next = work->next;
+		listener->count--;
+
+		if (listener->status != RAD_LISTEN_STATUS_KNOWN) goto done;
+
+		if (work->close) {
+			DEBUG("Closing TLS socket from client port %u", sock->other_port);
+			PTHREAD_MUTEX_LOCK(&sock->mutex);
+			tls_socket_close(listener);
+			PTHREAD_MUTEX_UNLOCK(&sock->mutex);
+			goto done;
+		}
+
+		if (!work->packet) goto done;
+
+		FR_STATS_INC(auth, total_requests);
+
+		if (dual_tls_dispatch(listener, work->packet)) work->packet = NULL;
+
+	done:
+		rad_free(&work->packet);
+		talloc_free(work);
+	}
+}
+#endif	/* HAVE_PTHREAD_H */
+
+int dual_tls_recv(rad_listen_t *listener)
+{
+	listen_socket_t *sock = listener->data;
+
+	if (listener->status != RAD_LISTEN_STATUS_KNOWN) return 0;
+
+#ifdef HAVE_PTHREAD_H
+	if (listener->tls_io_threads) return tls_io_queue_recv(listener);
+#endif
+
+	if (!tls_socket_recv(listener)) {
+		return 0;
+	}
+
+	rad_assert(sock->request != NULL);
+	rad_assert(sock->request->packet != NULL);
+	rad_assert(sock->packet != NULL);
+	rad_assert(sock->ssn != NULL);
+
+	if (!dual_tls_dispatch(listener, sock->packet)) {
 		rad_free(&sock->packet);
-		request->packet = NULL;
+		sock->request->packet = NULL;
 		return 0;
 	}
 
 	sock->packet = NULL;	/* we have no need for more partial reads */
-	request->packet = NULL;
+	sock->request->packet = NULL;
 
 	return 1;
 }
@@ -0,0 +1,417 @@
+/*
+ * tls_ocsp.c
+ *
+ * Version:     $Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2014  The FreeRADIUS server project
+ */
+
+/**
+ * $Id$
+ * @file tls_ocsp.c
+ * @brief Cache OCSP responses, and refresh them before they expire.
+ *
+ * Responses are keyed by the OCSP certificate ID (the issuer name and key
+ * hashes, and the serial number of the certificate), and are used until the
+ * responder's "nextUpdate" time.  Responses without a "nextUpdate" aren't
+ * cached, as the responder may have newer information at any time.
+ *
+ * If "prefetch" is set, a background thread queries the responder again for
+ * entries which have been used since they were fetched, and will expire
+ * within "prefetch" seconds.  Certificates which are in regular use
+ * therefore never wait for the responder.
+ *
+ * @copyright 2014  The FreeRADIUS server project
+ */
+RCSID("$Id$")
+USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/rad_assert.h>
+
+#if defined(WITH_TLS) && defined(HAVE_OPENSSL_OCSP_H)
+#include <openssl/ocsp.h>
+
+#ifdef HAVE_PTHREAD_H
+#define PTHREAD_MUTEX_LOCK pthread_mutex_lock
+#define PTHREAD_MUTEX_UNLOCK pthread_mutex_unlock
+#else
+#define PTHREAD_MUTEX_LOCK(_x)
+#define PTHREAD_MUTEX_UNLOCK(_x)
+#endif
+
+#define OCSP_CACHE_KEY_MAX	128
+#define OCSP_PREFETCH_INTERVAL	10	/* seconds */
+
+typedef struct tls_ocsp_entry_t {
+	struct tls_ocsp_entry_t *prev, *next;
+	size_t		keylen;
+	uint8_t		key[OCSP_CACHE_KEY_MAX];
+	int		status;			//!< As returned by tls_ocsp_query().
+	time_t		expires;
+	bool		used;			//!< Since the response was fetched.
+	X509		*issuer_cert;
+	X509		*client_cert;
+} tls_ocsp_entry_t;
+
+struct fr_tls_ocsp_cache_t {
+	fr_tls_server_conf_t	*conf;
+	fr_hash_table_t		*entries;
+	tls_ocsp_entry_t	*head, *tail;	//!< In the order they were added.
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t		mutex;
+	pthread_cond_t		cond;
+	pthread_t		thread;
+	bool			running;
+	bool			exiting;
+#endif
+};
+
+static uint32_t tls_ocsp_entry_hash(void const *data)
+{
+	tls_ocsp_entry_t const *entry = data;
+
+	return fr_hash(entry->key, entry->keylen);
+}
+
+static int tls_ocsp_entry_cmp(void const *one, void const *two)
+{
+	tls_ocsp_entry_t const *a = one;
+	tls_ocsp_entry_t const *b = two;
+
+	if (a->keylen != b->keylen) return a->keylen - b->keylen;
+
+	return memcmp(a->key, b->key, a->keylen);
+}
+
+static int _tls_ocsp_entry_free(tls_ocsp_entry_t *entry)
+{
+	if (entry->issuer_cert) X509_free(entry->issuer_cert);
+	if (entry->client_cert) X509_free(entry->client_cert);
+
+	return 0;
+}
+
+static void tls_ocsp_entry_free(void *data)
+{
+	talloc_free(data);
+}
+
+/*
+ *	The key is the DER encoded OCSP certificate ID.
+ */
+static size_t tls_ocsp_key(X509 *issuer_cert, X509 *client_cert, uint8_t *key)
+{
+	OCSP_CERTID *certid;
+	uint8_t *p;
+	int len;
+
+	certid = OCSP_cert_to_id(NULL, client_cert, issuer_cert);
+	if (!certid) return 0;
+
+	len = i2d_OCSP_CERTID(certid, NULL);
+	if ((len <= 0) || (len > OCSP_CACHE_KEY_MAX)) {
+		OCSP_CERTID_free(certid);
+		return 0;
+	}
+
+	/* openssl mutates &p */
+	p = key;
+	len = i2d_OCSP_CERTID(certid, &p);
+	OCSP_CERTID_free(certid);
+
+	return (len > 0) ? len : 0;
+}
+
+/*
+ *	Called with the mutex held.
+ */
+static void tls_ocsp_unlink(fr_tls_ocsp_cache_t *cache, tls_ocsp_entry_t *entry)
+{
+	if (entry->prev) {
+		entry->prev->next = entry->next;
+	} else {
+		cache->head = entry->next;
+	}
+	if (entry->next) {
+		entry->next->prev = entry->prev;
+	} else {
+		cache->tail = entry->prev;
+	}
+
+	fr_hash_table_delete(cache->entries, entry);
+}
+
+/** Find a cached OCSP response
+ *
+ * @param[in] conf of the TLS context.
+ * @param[in] issuer_cert which issued client_cert.
+ * @param[in] client_cert to find the response for.
+ * @return the status as returned by tls_ocsp_query(), or -1 if there's no
+ *	usable response in the cache.
+ */
+int tls_ocsp_cache_find(fr_tls_server_conf_t *conf, X509 *issuer_cert, X509 *client_cert)
+{
+	fr_tls_ocsp_cache_t *cache = conf->ocsp_cache;
+	tls_ocsp_entry_t my_entry, *entry;
+	int status = -1;
+
+	my_entry.keylen = tls_ocsp_key(issuer_cert, client_cert, my_entry.key);
+	if (!my_entry.keylen) return -1;
+
+	if (conf->ocsp_prefetch) tls_ocsp_cache_start(conf);
+
+	PTHREAD_MUTEX_LOCK(&cache->mutex);
+	entry = fr_hash_table_finddata(cache->entries, &my_entry);
+	if (entry && (entry->expires <= time(NULL))) {
+		tls_ocsp_unlink(cache, entry);
+		entry = NULL;
+	}
+	if (entry) {
+		entry->used = true;
+		status = entry->status;
+	}
+	PTHREAD_MUTEX_UNLOCK(&cache->mutex);
+
+	return status;
+}
+
+/** Add an OCSP response to the cache
+ *
+ * @param[in] conf of the TLS context.
+ * @param[in] issuer_cert which issued client_cert.
+ * @param[in] client_cert the response is for.
+ * @param[in] status as returned by tls_ocsp_query().
+ * @param[in] expires the "nextUpdate" time of the response.
+ */
+void tls_ocsp_cache_add(fr_tls_server_conf_t *conf, X509 *issuer_cert, X509 *client_cert, int status, time_t expires)
+{
+	fr_tls_ocsp_cache_t *cache = conf->ocsp_cache;
+	tls_ocsp_entry_t *entry, *old;
+
+	if (expires <= time(NULL)) return;
+
+	/*
+	 *	Not parented, as other threads may be allocating
+	 *	at the same time.
+	 */
+	entry = talloc_zero(NULL, tls_ocsp_entry_t);
+	if (!entry) return;
+	talloc_set_destructor(entry, _tls_ocsp_entry_free);
+
+	entry->keylen = tls_ocsp_key(issuer_cert, client_cert, entry->key);
+	entry->status = status;
+	entry->expires = expires;
+	entry->issuer_cert = X509_dup(issuer_cert);
+	entry->client_cert = X509_dup(client_cert);
+	if (!entry->keylen || !entry->issuer_cert || !entry->client_cert) {
+		talloc_free(entry);
+		return;
+	}
+
+	PTHREAD_MUTEX_LOCK(&cache->mutex);
+
+	old = fr_hash_table_finddata(cache->entries, entry);
+	if (old) tls_ocsp_unlink(cache, old);
+
+	while (cache->head && conf->ocsp_cache_size &&
+	       ((uint32_t) fr_hash_table_num_elements(cache->entries) >= conf->ocsp_cache_size)) {
+		tls_ocsp_unlink(cache, cache->head);
+	}
+
+	if (!fr_hash_table_insert(cache->entries, entry)) {
+		PTHREAD_MUTEX_UNLOCK(&cache->mutex);
+		talloc_free(entry);
+		return;
+	}
+
+	entry->prev = cache->tail;
+	if (cache->tail) {
+		cache->tail->next = entry;
+	} else {
+		cache->head = entry;
+	}
+	cache->tail = entry;
+
+	PTHREAD_MUTEX_UNLOCK(&cache->mutex);
+}
+
+#ifdef HAVE_PTHREAD_H
+typedef struct tls_ocsp_fetch_t {
+	X509		*issuer_cert;
+	X509		*client_cert;
+} tls_ocsp_fetch_t;
+
+/*
+ *	Query the responder again for entries which are in use, and
+ *	will expire soon.
+ */
+static void tls_ocsp_prefetch(fr_tls_ocsp_cache_t *cache)
+{
+	fr_tls_server_conf_t *conf = cache->conf;
+	tls_ocsp_entry_t *entry;
+	tls_ocsp_fetch_t *fetch;
+	size_t i, count = 0;
+	time_t now = time(NULL);
+
+	fetch = talloc_array(NULL, tls_ocsp_fetch_t, fr_hash_table_num_elements(cache->entries) + 1);
+	if (!fetch) return;
+
+	for (entry = cache->head; entry; entry = entry->next) {
+		if (!entry->used || (entry->expires > (time_t) (now + conf->ocsp_prefetch))) continue;
+
+		fetch[count].issuer_cert = X509_dup(entry->issuer_cert);
+		fetch[count].client_cert = X509_dup(entry->client_cert);
+		if (!fetch[count].issuer_cert || !fetch[count].client_cert) {
+			if (fetch[count].issuer_cert) X509_free(fetch[count].issuer_cert);
+			if (fetch[count].client_cert) X509_free(fetch[count].client_cert);
+			continue;
+		}
+		entry->used = false;
+		count++;
+	}
+	pthread_mutex_unlock(&cache->mutex);
+
+	for (i = 0; i < count; i++) {
+		int status;
+		time_t next_update = 0;
+
+		if (!cache->exiting) {
+			status = tls_ocsp_query(conf->ocsp_store, fetch[i].issuer_cert, fetch[i].client_cert,
+						conf, &next_update);
+			if (next_update) {
+				tls_ocsp_cache_add(conf, fetch[i].issuer_cert, fetch[i].client_cert, status,
+						   next_update);
+			}
+		}
+
+		X509_free(fetch[i].issuer_cert);
+		X509_free(fetch[i].client_cert);
+	}
+	talloc_free(fetch);
+
+	if (count) DEBUG2("[ocsp] --> Refreshed %zu cached responses", count);
+
+	pthread_mutex_lock(&cache->mutex);
+}
+
+static void *tls_ocsp_thread(void *arg)
+{
+	fr_tls_ocsp_cache_t	*cache = arg;
+	struct timeval		now;
+	struct timespec		when;
+
+	pthread_mutex_lock(&cache->mutex);
+	while (!cache->exiting) {
+		gettimeofday(&now, NULL);
+		when.tv_sec = now.tv_sec + OCSP_PREFETCH_INTERVAL;
+		when.tv_nsec = now.tv_usec * 1000;
+		pthread_cond_timedwait(&cache->cond, &cache->mutex, &when);
+
+		if (!cache->exiting) tls_ocsp_prefetch(cache);
+	}
+	pthread_mutex_unlock(&cache->mutex);
+
+	return NULL;
+}
+#endif
+
+/** Start refreshing cached responses in the background
+ *
+ * This is done when the first certificate is checked, instead of when the
+ * configuration is parsed, as the server may fork after that.
+ *
+ * @param[in] conf of the TLS context.
+ */
+void tls_ocsp_cache_start(fr_tls_server_conf_t *conf)
+{
+#ifdef HAVE_PTHREAD_H
+	fr_tls_ocsp_cache_t *cache = conf->ocsp_cache;
+	int ret;
+
+	/*
+	 *	Checked again with the mutex held.
+	 */
+	if (cache->running) return;
+
+	pthread_mutex_lock(&cache->mutex);
+	if (!cache->running) {
+		ret = pthread_create(&cache->thread, NULL, tls_ocsp_thread, cache);
+		if (ret != 0) {
+			ERROR("tls: Failed creating OCSP prefetch thread: %s", fr_syserror(ret));
+		} else {
+			cache->running = true;
+		}
+	}
+	pthread_mutex_unlock(&cache->mutex);
+#endif
+}
+
+static int _tls_ocsp_cache_free(fr_tls_ocsp_cache_t *cache)
+{
+#ifdef HAVE_PTHREAD_H
+	if (cache->running) {
+		pthread_mutex_lock(&cache->mutex);
+		cache->exiting = true;
+		pthread_cond_signal(&cache->cond);
+		pthread_mutex_unlock(&cache->mutex);
+
+		pthread_join(cache->thread, NULL);
+	}
+#endif
+
+	fr_hash_table_free(cache->entries);
+
+#ifdef HAVE_PTHREAD_H
+	pthread_cond_destroy(&cache->cond);
+	pthread_mutex_destroy(&cache->mutex);
+#endif
+
+	return 0;
+}
+
+/** Create the OCSP response cache
+ *
+ * @param[in] conf of the TLS context.
+ * @return 0 on success, -1 on error.
+ */
+int tls_ocsp_cache_init(fr_tls_server_conf_t *conf)
+{
+	fr_tls_ocsp_cache_t *cache;
+
+	cache = talloc_zero(conf, fr_tls_ocsp_cache_t);
+	if (!cache) return -1;
+
+	cache->conf = conf;
+	cache->entries = fr_hash_table_create(tls_ocsp_entry_hash, tls_ocsp_entry_cmp, tls_ocsp_entry_free);
+	if (!cache->entries) {
+		talloc_free(cache);
+		return -1;
+	}
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_init(&cache->mutex, NULL);
+	pthread_cond_init(&cache->cond, NULL);
+#endif
+	talloc_set_destructor(cache, _tls_ocsp_cache_free);
+
+	conf->ocsp_cache = cache;
+
+	return 0;
+}
+#endif	/* WITH_TLS && HAVE_OPENSSL_OCSP_H */
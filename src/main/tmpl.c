@@ -1466,6 +1466,29 @@ int tmpl_find_vp(VALUE_PAIR **out, REQUEST *request, value_pair_tmpl_t const *vp
 
 	int err;
 
+	/*
+	 *	The common case is the first instance of an attribute.
+	 *	The DA was resolved when the template was compiled, so
+	 *	all that's left is a pointer comparison per VP.  Skip
+	 *	the cursor.
+	 */
+	if ((vpt->type == TMPL_TYPE_ATTR) && (vpt->tmpl_num == NUM_ANY)) {
+		VALUE_PAIR **vps;
+
+		if (out) *out = NULL;
+
+		if (radius_request(&request, vpt->tmpl_request) < 0) return -3;
+
+		vps = radius_list(request, vpt->tmpl_list);
+		if (!vps) return -2;
+
+		vp = pairfind_da(*vps, vpt->tmpl_da, vpt->tmpl_tag);
+		if (!vp) return -1;
+
+		if (out) *out = vp;
+		return 0;
+	}
+
 	vp = tmpl_cursor_init(&err, &cursor, request, vpt);
 	if (out) *out = vp;
 
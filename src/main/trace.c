@@ -0,0 +1,636 @@
+/*
+ * trace.c	Sampled request tracing.
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2015  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/trace.h>
+#include <freeradius-devel/rad_assert.h>
+
+/*
+ *	A traced request records a "span" for each module call, string
+ *	expansion, proxied packet and pool connection, with the time
+ *	it started and finished.  The spans are only ever touched by
+ *	the thread which is processing the request, or by the main
+ *	thread while the request is waiting for a proxy reply, so they
+ *	don't need locking.
+ *
+ *	When the request is done, its trace is queued for the exporter
+ *	thread, which writes it to a file as one line of OpenTelemetry
+ *	(OTLP) JSON.  The OpenTelemetry collector can read that file,
+ *	and send it on to whatever tracing system is in use.
+ */
+typedef struct trace_span_t {
+	uint64_t		id;
+	int			parent;		//!< Index of the parent span, or -1.
+	trace_span_type_t	type;
+	char const		*name;
+	struct timeval		start;
+	struct timeval		end;
+	bool			error;
+	char			*attrs;		//!< Already encoded as OTLP JSON.
+} trace_span_t;
+
+struct fr_trace_t {
+	fr_trace_t		*next;		//!< In the export queue.
+	uint8_t			trace_id[16];
+	bool			discard;	//!< Tracing was turned off by %{trace:0}.
+	int			current;	//!< The innermost span which is still open.
+	int			num;
+	int			size;
+	uint32_t		dropped;	//!< Spans past max_spans.
+	trace_span_t		*spans;		//!< The first one is the request.
+};
+
+static struct {
+	bool			enabled;	//!< There's a "trace" section.
+	uint32_t		sample;
+	uint32_t		max_spans;
+	uint32_t		max_queue;
+	char const		*file;
+
+	FILE			*fp;
+	bool			running;
+	uint64_t		dropped;	//!< Traces which didn't fit in the queue.
+#ifdef HAVE_PTHREAD_H
+	bool			exiting;
+	pthread_t		thread;
+	pthread_mutex_t		mutex;
+	pthread_cond_t		cond;
+	uint32_t		queued;
+	fr_trace_t		*head;
+	fr_trace_t		**tail;
+#endif
+} trace;
+
+static const CONF_PARSER trace_config[] = {
+	{ "sample", FR_CONF_POINTER(PW_TYPE_INTEGER, &trace.sample), "0" },
+	{ "max_spans", FR_CONF_POINTER(PW_TYPE_INTEGER, &trace.max_spans), "256" },
+	{ "max_queue", FR_CONF_POINTER(PW_TYPE_INTEGER, &trace.max_queue), "1024" },
+	{ "file", FR_CONF_POINTER(PW_TYPE_STRING, &trace.file), "${logdir}/trace.json" },
+
+	{ NULL, -1, 0, NULL, NULL }		/* end the list */
+};
+
+/*
+ *	OTLP span kinds.
+ */
+static int const trace_span_kind[] = {
+	[TRACE_SPAN_REQUEST]	= 2,	/* SERVER */
+	[TRACE_SPAN_MODULE]	= 1,	/* INTERNAL */
+	[TRACE_SPAN_XLAT]	= 1,	/* INTERNAL */
+	[TRACE_SPAN_PROXY]	= 3,	/* CLIENT */
+	[TRACE_SPAN_CONNECTION]	= 3	/* CLIENT */
+};
+
+/*
+ *	The traced request which this thread is running a module or
+ *	an expansion for.  This is so that connection pools, which
+ *	aren't passed the request, can add spans to it.
+ */
+fr_thread_local_setup(REQUEST *, trace_current)	/* macro */
+
+/** Set the request which this thread is working on
+ *
+ * @param[in] request being processed, or NULL.
+ */
+void trace_request_set(REQUEST *request)
+{
+	(void) fr_thread_local_init(trace_current, NULL);
+	(void) fr_thread_local_set(trace_current, request);
+}
+
+/** Get the traced request which this thread is working on
+ *
+ * @return the request, or NULL if there isn't one.
+ */
+REQUEST *trace_request_get(void)
+{
+	if (!trace.enabled) return NULL;
+
+	return fr_thread_local_init(trace_current, NULL);
+}
+
+/*
+ *	Escape a string for JSON.  Anything which isn't printable
+ *	ASCII is escaped, so that we don't have to check the UTF-8.
+ */
+static void trace_json_escape(char *out, size_t outlen, char const *in)
+{
+	char *p = out, *end = out + outlen - 1;
+
+	while (*in && (p < end)) {
+		uint8_t c = *in++;
+
+		if ((c == '"') || (c == '\\')) {
+			if ((end - p) < 2) break;
+			*p++ = '\\';
+			*p++ = c;
+			continue;
+		}
+
+		if ((c < 0x20) || (c >= 0x7f)) {
+			if ((end - p) < 6) break;
+			snprintf(p, 7, "\\u%04x", c);
+			p += 6;
+			continue;
+		}
+
+		*p++ = c;
+	}
+
+	*p = '\0';
+}
+
+static uint64_t trace_id_rand(void)
+{
+	return (((uint64_t) fr_rand()) << 32) | fr_rand();
+}
+
+static int trace_span_alloc(fr_trace_t *tr, trace_span_type_t type, char const *name)
+{
+	trace_span_t *span;
+
+	if ((uint32_t) tr->num >= trace.max_spans) {
+		tr->dropped++;
+		return -1;
+	}
+
+	if (tr->num == tr->size) {
+		trace_span_t *spans;
+		int size = tr->size ? tr->size * 2 : 16;
+
+		if ((uint32_t) size > trace.max_spans) size = trace.max_spans;
+
+		spans = talloc_realloc(tr, tr->spans, trace_span_t, size);
+		if (!spans) {
+			tr->dropped++;
+			return -1;
+		}
+		tr->spans = spans;
+		tr->size = size;
+	}
+
+	span = &tr->spans[tr->num];
+	memset(span, 0, sizeof(*span));
+	span->id = trace_id_rand();
+	span->parent = tr->current;
+	span->type = type;
+	span->name = talloc_strdup(tr->spans, name);
+
+	return tr->num++;
+}
+
+/** Start tracing a request
+ *
+ * @param[in] request to trace.
+ * @param[in] enable tracing, or stop it.
+ * @return whether or not the request is now being traced.
+ */
+bool trace_request_enable(REQUEST *request, bool enable)
+{
+	fr_trace_t *tr;
+	uint64_t id[2];
+
+	/*
+	 *	Fake requests are traced as part of the real one.
+	 */
+	if (!trace.enabled || request->parent) return false;
+
+	if (request->trace) {
+		request->trace->discard = !enable;
+		return enable;
+	}
+
+	if (!enable) return false;
+
+	/*
+	 *	The trace belongs to the request until it's done, so
+	 *	that it's freed along with the request if it's never
+	 *	exported.
+	 */
+	tr = talloc_zero(request, fr_trace_t);
+	if (!tr) return false;
+
+	id[0] = trace_id_rand();
+	id[1] = trace_id_rand();
+	memcpy(tr->trace_id, id, sizeof(tr->trace_id));
+	tr->current = -1;
+
+	if (trace_span_alloc(tr, TRACE_SPAN_REQUEST, "request") < 0) {
+		talloc_free(tr);
+		return false;
+	}
+	tr->current = 0;
+	tr->spans[0].start = request->packet->timestamp;
+
+	request->trace = tr;
+
+	return true;
+}
+
+/** Decide whether or not to trace a new request
+ *
+ * @param[in] request which has just been received.
+ */
+void trace_request_start(REQUEST *request)
+{
+	if (!trace.enabled || !trace.sample) return;
+
+	if ((request->number % trace.sample) != 0) return;
+
+	(void) trace_request_enable(request, true);
+}
+
+/** Start a span
+ *
+ * The span is a child of the innermost span which is still open.
+ *
+ * @param[in] request being traced.
+ * @param[in] type of span.
+ * @param[in] name of the span.
+ * @return an index to pass to trace_span_end(), or -1 if the
+ *	request isn't being traced.
+ */
+int trace_span_start(REQUEST *request, trace_span_type_t type, char const *name)
+{
+	fr_trace_t *tr = request->trace;
+	int i;
+
+	if (!tr) return -1;
+
+	i = trace_span_alloc(tr, type, name);
+	if (i < 0) return -1;
+
+	gettimeofday(&tr->spans[i].start, NULL);
+	tr->current = i;
+
+	trace_request_set(request);
+
+	return i;
+}
+
+/** Finish a span started by trace_span_start()
+ *
+ * @param[in] request being traced.
+ * @param[in] span returned by trace_span_start().
+ * @param[in] error whether or not the span failed.
+ */
+void trace_span_end(REQUEST *request, int span, bool error)
+{
+	fr_trace_t *tr = request->trace;
+
+	if (!tr || (span < 0) || (span >= tr->num)) return;
+
+	gettimeofday(&tr->spans[span].end, NULL);
+	tr->spans[span].error = error;
+	tr->current = tr->spans[span].parent;
+
+	/*
+	 *	Nothing is running for the request any more, so the
+	 *	thread may go on to other requests.
+	 */
+	if (tr->current <= 0) trace_request_set(NULL);
+}
+
+/** Add a span which has already finished
+ *
+ * @param[in] request being traced.
+ * @param[in] type of span.
+ * @param[in] name of the span.
+ * @param[in] start when the span started.
+ * @param[in] end when the span finished, or NULL for now.
+ * @param[in] error whether or not the span failed.
+ * @return an index to pass to trace_span_attr(), or -1 if the
+ *	request isn't being traced.
+ */
+int trace_span_add(REQUEST *request, trace_span_type_t type, char const *name,
+		   struct timeval const *start, struct timeval const *end, bool error)
+{
+	fr_trace_t *tr = request->trace;
+	int i;
+
+	if (!tr) return -1;
+
+	i = trace_span_alloc(tr, type, name);
+	if (i < 0) return -1;
+
+	tr->spans[i].start = *start;
+	if (end) {
+		tr->spans[i].end = *end;
+	} else {
+		gettimeofday(&tr->spans[i].end, NULL);
+	}
+	tr->spans[i].error = error;
+
+	return i;
+}
+
+/** Add a string attribute to a span
+ *
+ * @param[in] request being traced.
+ * @param[in] span to add the attribute to.
+ * @param[in] key name of the attribute.
+ * @param[in] fmt printf format string for the value.
+ */
+void trace_span_attr(REQUEST *request, int span, char const *key, char const *fmt, ...)
+{
+	fr_trace_t *tr = request->trace;
+	va_list ap;
+	char value[256], escaped[512];
+	char *attrs;
+
+	if (!tr || (span < 0) || (span >= tr->num)) return;
+
+	va_start(ap, fmt);
+	vsnprintf(value, sizeof(value), fmt, ap);
+	va_end(ap);
+
+	trace_json_escape(escaped, sizeof(escaped), value);
+
+	attrs = tr->spans[span].attrs;
+	if (!attrs) {
+		attrs = talloc_typed_strdup(tr->spans, "");
+		if (!attrs) return;
+	}
+
+	/*
+	 *	Keys are always literals, so they don't need escaping.
+	 */
+	attrs = talloc_asprintf_append_buffer(attrs, "%s{\"key\":\"%s\",\"value\":{\"stringValue\":\"%s\"}}",
+					      *attrs ? "," : "", key, escaped);
+	if (attrs) tr->spans[span].attrs = attrs;
+}
+
+#define USEC	(1000000)
+
+static void trace_write_time(FILE *fp, char const *name, struct timeval const *when)
+{
+	uint64_t usec = ((uint64_t) when->tv_sec) * USEC + when->tv_usec;
+
+	fprintf(fp, ",\"%s\":\"%" PRIu64 "000\"", name, usec);
+}
+
+/*
+ *	Write a trace as one OTLP ExportTraceServiceRequest.
+ */
+static void trace_write(FILE *fp, fr_trace_t *tr)
+{
+	int i;
+	char trace_id[sizeof(tr->trace_id) * 2 + 1];
+	char escaped[512];
+
+	fr_bin2hex(trace_id, tr->trace_id, sizeof(tr->trace_id));
+
+	fprintf(fp, "{\"resourceSpans\":[{\"resource\":{\"attributes\":["
+		"{\"key\":\"service.name\",\"value\":{\"stringValue\":\"freeradius\"}}]},"
+		"\"scopeSpans\":[{\"scope\":{\"name\":\"freeradius\"},\"spans\":[");
+
+	for (i = 0; i < tr->num; i++) {
+		trace_span_t *span = &tr->spans[i];
+
+		/*
+		 *	Spans which were never finished, e.g. a module
+		 *	which was still running when the request was
+		 *	told to stop.
+		 */
+		if (!span->end.tv_sec) span->end = tr->spans[0].end;
+
+		trace_json_escape(escaped, sizeof(escaped), span->name ? span->name : "");
+
+		fprintf(fp, "%s{\"traceId\":\"%s\",\"spanId\":\"%016" PRIx64 "\"", i ? "," : "", trace_id, span->id);
+		if (span->parent >= 0) {
+			fprintf(fp, ",\"parentSpanId\":\"%016" PRIx64 "\"", tr->spans[span->parent].id);
+		}
+		fprintf(fp, ",\"name\":\"%s\",\"kind\":%d", escaped, trace_span_kind[span->type]);
+		trace_write_time(fp, "startTimeUnixNano", &span->start);
+		trace_write_time(fp, "endTimeUnixNano", &span->end);
+
+		fputs(",\"attributes\":[", fp);
+		if (span->attrs) fputs(span->attrs, fp);
+		if ((i == 0) && tr->dropped) {
+			fprintf(fp, "%s{\"key\":\"freeradius.spans_dropped\",\"value\":{\"intValue\":\"%u\"}}",
+				span->attrs ? "," : "", tr->dropped);
+		}
+		fputc(']', fp);
+
+		if (span->error) fputs(",\"status\":{\"code\":2}", fp);
+
+		fputc('}', fp);
+	}
+
+	fputs("]}]}]}\n", fp);
+}
+
+/** Finish tracing a request, and queue the trace for export
+ *
+ * @param[in] request which is done.
+ */
+void trace_request_done(REQUEST *request)
+{
+	fr_trace_t *tr = request->trace;
+	trace_span_t *root;
+	char buffer[128];
+
+	if (!tr) return;
+
+	if (tr->discard || !trace.running) {
+		request->trace = NULL;
+		talloc_free(tr);
+		return;
+	}
+
+	root = &tr->spans[0];
+	if (request->packet && is_radius_code(request->packet->code)) {
+		root->name = fr_packet_codes[request->packet->code];
+	}
+	if (request->reply && request->reply->timestamp.tv_sec) {
+		root->end = request->reply->timestamp;
+	} else {
+		gettimeofday(&root->end, NULL);
+	}
+
+	/*
+	 *	The request's strings might not be around when the
+	 *	trace is written, so they're copied now.
+	 */
+	if (request->packet) {
+		if (is_radius_code(request->packet->code)) {
+			trace_span_attr(request, 0, "radius.request.code", "%s", fr_packet_codes[request->packet->code]);
+		}
+		trace_span_attr(request, 0, "net.peer.ip", "%s",
+				inet_ntop(request->packet->src_ipaddr.af, &request->packet->src_ipaddr.ipaddr,
+					  buffer, sizeof(buffer)));
+	}
+	if (request->reply && is_radius_code(request->reply->code) && request->reply->code) {
+		trace_span_attr(request, 0, "radius.reply.code", "%s", fr_packet_codes[request->reply->code]);
+	}
+	if (request->client && request->client->shortname) {
+		trace_span_attr(request, 0, "freeradius.client", "%s", request->client->shortname);
+	}
+	if (request->server) trace_span_attr(request, 0, "freeradius.virtual_server", "%s", request->server);
+	trace_span_attr(request, 0, "freeradius.request.number", "%u", request->number);
+
+	request->trace = NULL;
+	(void) talloc_steal(NULL, tr);
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&trace.mutex);
+	if (trace.queued >= trace.max_queue) {
+		trace.dropped++;
+		pthread_mutex_unlock(&trace.mutex);
+		talloc_free(tr);
+		return;
+	}
+
+	tr->next = NULL;
+	*trace.tail = tr;
+	trace.tail = &tr->next;
+	trace.queued++;
+	pthread_cond_signal(&trace.cond);
+	pthread_mutex_unlock(&trace.mutex);
+#else
+	trace_write(trace.fp, tr);
+	fflush(trace.fp);
+	talloc_free(tr);
+#endif
+}
+
+#ifdef HAVE_PTHREAD_H
+static void *trace_thread(UNUSED void *arg)
+{
+	while (true) {
+		fr_trace_t *tr, *next;
+
+		pthread_mutex_lock(&trace.mutex);
+		while (!trace.head && !trace.exiting) {
+			pthread_cond_wait(&trace.cond, &trace.mutex);
+		}
+
+		tr = trace.head;
+		trace.head = NULL;
+		trace.tail = &trace.head;
+		trace.queued = 0;
+		pthread_mutex_unlock(&trace.mutex);
+
+		if (!tr) break;		/* exiting, and nothing left to write */
+
+		for (; tr != NULL; tr = next) {
+			next = tr->next;
+			trace_write(trace.fp, tr);
+			talloc_free(tr);
+		}
+		fflush(trace.fp);
+	}
+
+	return NULL;
+}
+#endif
+
+/** Read the "trace" section
+ *
+ * Tracing is disabled if there isn't one.
+ *
+ * @param[in] config the main configuration.
+ * @return 0 on success, or -1 on error.
+ */
+int trace_init(CONF_SECTION *config)
+{
+	CONF_SECTION *cs;
+
+	cs = cf_section_sub_find(config, "trace");
+	if (!cs) return 0;
+
+	if (cf_section_parse(cs, NULL, trace_config) < 0) return -1;
+
+	if (trace.max_spans < 2) trace.max_spans = 2;
+	if (trace.max_queue < 1) trace.max_queue = 1;
+
+	trace.enabled = true;
+
+	return 0;
+}
+
+/** Open the trace file, and start the exporter thread
+ *
+ * Must be called after the server has forked into the background.
+ *
+ * @return 0 on success, or -1 on error.
+ */
+int trace_start(void)
+{
+	if (!trace.enabled || trace.running) return 0;
+
+	trace.fp = fopen(trace.file, "a");
+	if (!trace.fp) {
+		fr_strerror_printf("Failed opening trace file %s: %s", trace.file, fr_syserror(errno));
+		return -1;
+	}
+
+#ifdef HAVE_PTHREAD_H
+	{
+		int rcode;
+
+		trace.head = NULL;
+		trace.tail = &trace.head;
+		pthread_mutex_init(&trace.mutex, NULL);
+		pthread_cond_init(&trace.cond, NULL);
+
+		rcode = pthread_create(&trace.thread, NULL, trace_thread, NULL);
+		if (rcode != 0) {
+			fr_strerror_printf("Failed creating trace thread: %s", fr_syserror(rcode));
+			fclose(trace.fp);
+			trace.fp = NULL;
+			return -1;
+		}
+	}
+#endif
+
+	trace.running = true;
+
+	return 0;
+}
+
+/** Write any queued traces, and stop the exporter thread
+ *
+ */
+void trace_free(void)
+{
+	if (!trace.running) return;
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&trace.mutex);
+	trace.running = false;
+	trace.exiting = true;
+	pthread_cond_signal(&trace.cond);
+	pthread_mutex_unlock(&trace.mutex);
+
+	pthread_join(trace.thread, NULL);
+
+	if (trace.dropped) WARN("Dropped %" PRIu64 " traces, as the trace queue was full", trace.dropped);
+#else
+	trace.running = false;
+#endif
+
+	fclose(trace.fp);
+	trace.fp = NULL;
+}
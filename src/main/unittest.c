@@ -25,7 +25,10 @@ RCSID("$Id$")
 
 #include <freeradius-devel/radiusd.h>
 #include <freeradius-devel/modules.h>
+#include <freeradius-devel/modpriv.h>
 #include <freeradius-devel/rad_assert.h>
+#include <freeradius-devel/net.h>
+#include <freeradius-devel/pcap.h>
 
 #ifdef HAVE_GETOPT_H
 #	include <getopt.h>
@@ -57,11 +60,20 @@ char const *radiusd_version = "FreeRADIUS Version " RADIUSD_VERSION_STRING
  */
 static void usage(int);
 
+extern const FR_NAME_NUMBER mod_rcode_table[];
+
 void listen_free(UNUSED rad_listen_t **head)
 {
 	/* do nothing */
 }
 
+#ifdef WITH_STATS
+int radius_stats_hist_index(UNUSED uint32_t usec)
+{
+	return 0;
+}
+#endif
+
 
 static rad_listen_t *listen_alloc(void *ctx)
 {
@@ -100,15 +112,13 @@ static RADCLIENT *client_alloc(void *ctx)
 	return client;
 }
 
-static REQUEST *request_setup(FILE *fp)
+/*
+ *	Create and initialize a new request, with no packet data.
+ */
+static REQUEST *request_setup_empty(void)
 {
-	VALUE_PAIR *vp;
 	REQUEST *request;
-	vp_cursor_t cursor;
 
-	/*
-	 *	Create and initialize the new request.
-	 */
 	request = request_alloc(NULL);
 
 	request->packet = rad_alloc(request, false);
@@ -137,6 +147,18 @@ static REQUEST *request_setup(FILE *fp)
 
 	request->root = &main_config;
 
+	return request;
+}
+
+static REQUEST *request_setup(FILE *fp)
+{
+	VALUE_PAIR *vp;
+	REQUEST *request;
+	vp_cursor_t cursor;
+
+	request = request_setup_empty();
+	if (!request) return NULL;
+
 	/*
 	 *	Read packet from fp
 	 */
@@ -401,9 +423,443 @@ static void print_packet(FILE *fp, RADIUS_PACKET *packet)
 	fflush(fp);
 }
 
+/*
+ *	Create a request from a copy of a packet, sharing the
+ *	listener, client, and virtual server of another request.
+ */
+static REQUEST *request_from_packet(REQUEST *original, RADIUS_PACKET *packet, unsigned int number)
+{
+	REQUEST *request;
+
+	request = request_alloc(NULL);
+
+	request->packet = rad_copy_packet(request, packet);
+	request->reply = rad_alloc_reply(request, request->packet);
+	if (!request->packet || !request->reply) {
+		ERROR("No memory");
+		exit(EXIT_FAILURE);
+	}
+
+	request->listener = original->listener;
+	request->client = original->client;
+	request->number = number;
+	request->master_state = REQUEST_ACTIVE;
+	request->child_state = REQUEST_RUNNING;
+	request->server = original->server;
+	request->root = &main_config;
+	request->log.lvl = debug_flag;
+	request->log.func = vradlog_request;
+	request->username = pairfind(request->packet->vps, PW_USER_NAME, 0, TAG_ANY);
+	request->password = pairfind(request->packet->vps, PW_USER_PASSWORD, 0, TAG_ANY);
+
+	return request;
+}
+
 /*
  *	The main guy.
  */
+/*
+ *	Run copies of the input through the virtual server, and print
+ *	the average time as one line of JSON.  The first run (already
+ *	done) has loaded any caches, and checked that the policy works.
+ */
+static void bench(REQUEST *original, RADIUS_PACKET *packet, int count, char const *input_file)
+{
+	int i;
+	struct timeval start, end;
+	REQUEST *request;
+	char const *name, *p;
+	uint64_t usec;
+
+	gettimeofday(&start, NULL);
+
+	for (i = 0; i < count; i++) {
+		request = request_from_packet(original, packet, i + 1);
+
+		rad_virtual_server(request);
+
+		talloc_free(request);
+	}
+
+	gettimeofday(&end, NULL);
+
+	usec = ((uint64_t) (end.tv_sec - start.tv_sec) * 1000000) + end.tv_usec - start.tv_usec;
+
+	/*
+	 *	Name the result after the input file, without any
+	 *	directory or ".attrs".
+	 */
+	name = input_file ? input_file : "-";
+	p = strrchr(name, FR_DIR_SEP);
+	if (p) name = p + 1;
+	p = strstr(name, ".attrs");
+
+	printf("{\"benchmark\": \"%.*s\", \"iterations\": %d, \"ns_per_op\": %.1f}\n",
+	       p ? (int) (p - name) : (int) strlen(name), name, count, (usec * 1000.0) / count);
+}
+
+/*
+ *	Packets to replay through the server, and the threads which
+ *	are replaying them.
+ */
+typedef struct replay_t {
+	REQUEST		*original;	//!< Listener, client, and virtual server to use.
+	RADIUS_PACKET	**packets;
+	uint32_t	num;
+	uint64_t	total;		//!< Packets to process, over all of the passes.
+	uint64_t	next;		//!< Next packet to process.
+} replay_t;
+
+static bool replay_add(replay_t *replay, RADIUS_PACKET *packet)
+{
+	if ((packet->code != PW_CODE_ACCESS_REQUEST) && (packet->code != PW_CODE_ACCOUNTING_REQUEST)) {
+		talloc_free(packet);
+		return true;
+	}
+
+	if ((replay->num & (replay->num - 1)) == 0) {
+		RADIUS_PACKET **packets;
+
+		packets = talloc_realloc(replay, replay->packets, RADIUS_PACKET *, replay->num ? replay->num * 2 : 64);
+		if (!packets) return false;
+		replay->packets = packets;
+	}
+
+	replay->packets[replay->num++] = talloc_steal(replay, packet);
+	return true;
+}
+
+/*
+ *	Read packets from a detail file.  They're Accounting-Request
+ *	packets, unless there's a Packet-Type attribute.
+ */
+static int replay_read_detail(replay_t *replay, FILE *fp)
+{
+	char		buffer[8192];
+	bool		found;
+	RADIUS_PACKET	*packet;
+	VALUE_PAIR	*vp;
+	vp_cursor_t	cursor;
+
+	while (!feof(fp)) {
+		packet = rad_alloc(NULL, false);
+		if (!packet) return -1;
+
+		packet->code = PW_CODE_ACCOUNTING_REQUEST;
+		packet->src_ipaddr.af = AF_INET;
+		packet->src_ipaddr.ipaddr.ip4addr.s_addr = htonl(INADDR_LOOPBACK);
+		packet->src_port = 1024;
+		packet->dst_ipaddr = packet->src_ipaddr;
+		packet->dst_port = 1813;
+
+		fr_cursor_init(&cursor, &packet->vps);
+		found = false;
+
+		while (fgets(buffer, sizeof(buffer), fp)) {
+			if (buffer[0] == '\n') {
+				if (found) break;
+				continue;
+			}
+			found = true;
+
+			/*
+			 *	Skip the header, and the fields which
+			 *	the detail module adds.
+			 */
+			if (buffer[0] != '\t') continue;
+			if ((strncmp(buffer, "\tTimestamp = ", 13) == 0) ||
+			    (strncmp(buffer, "\tRequest-Authenticator = ", 26) == 0)) continue;
+
+			vp = NULL;
+			if ((userparse(packet, buffer, &vp) > 0) && vp) fr_cursor_merge(&cursor, vp);
+		}
+
+		if (!found) {
+			talloc_free(packet);
+			break;
+		}
+
+		vp = pairfind(packet->vps, PW_PACKET_TYPE, 0, TAG_ANY);
+		if (vp) packet->code = vp->vp_integer;
+
+		vp = pairfind(packet->vps, PW_PACKET_SRC_IP_ADDRESS, 0, TAG_ANY);
+		if (vp) packet->src_ipaddr.ipaddr.ip4addr.s_addr = vp->vp_ipaddr;
+
+		if (packet->code == PW_CODE_ACCESS_REQUEST) packet->dst_port = 1812;
+
+		if (!replay_add(replay, packet)) return -1;
+	}
+
+	return 0;
+}
+
+#ifdef HAVE_LIBPCAP
+/*
+ *	Read the request packets from a capture, such as one written
+ *	by radsniff.  The secret is needed to decode User-Password.
+ */
+static int replay_read_pcap(replay_t *replay, char const *file, char const *secret)
+{
+	fr_pcap_t		*in;
+	struct pcap_pkthdr	*header;
+	uint8_t const		*data, *p;
+	ip_header_t const	*ip;
+	ip_header6_t const	*ip6;
+	udp_header_t const	*udp;
+	RADIUS_PACKET		*packet;
+	ssize_t			len;
+	int			ret;
+
+	in = fr_pcap_init(replay, file, PCAP_FILE_IN);
+	if (!in || (fr_pcap_open(in) < 0)) {
+		ERROR("Failed opening %s: %s", file, in ? in->errbuf : "No memory");
+		return -1;
+	}
+
+	while ((ret = pcap_next_ex(in->handle, &header, &data)) == 1) {
+		len = fr_link_layer_offset(data, header->caplen, in->link_type);
+		if (len < 0) continue;
+		p = data + len;
+
+		ip = NULL;
+		ip6 = NULL;
+		switch ((p[0] & 0xf0) >> 4) {
+		case 4:
+			ip = (ip_header_t const *) p;
+			p += (0x0f & ip->ip_vhl) * 4;
+			break;
+
+		case 6:
+			ip6 = (ip_header6_t const *) p;
+			p += sizeof(ip_header6_t);
+			break;
+
+		default:
+			continue;
+		}
+
+		if ((size_t) ((p - data) + sizeof(udp_header_t) + RADIUS_HDR_LEN) > header->caplen) continue;
+		udp = (udp_header_t const *) p;
+		p += sizeof(udp_header_t);
+
+		packet = rad_alloc(NULL, false);
+		if (!packet) return -1;
+
+		packet->data_len = header->caplen - (p - data);
+		packet->data = talloc_memdup(packet, p, packet->data_len);
+
+		if (ip) {
+			packet->src_ipaddr.af = AF_INET;
+			packet->src_ipaddr.ipaddr.ip4addr = ip->ip_src;
+			packet->dst_ipaddr.af = AF_INET;
+			packet->dst_ipaddr.ipaddr.ip4addr = ip->ip_dst;
+		} else {
+			packet->src_ipaddr.af = AF_INET6;
+			packet->src_ipaddr.ipaddr.ip6addr = ip6->ip_src;
+			packet->dst_ipaddr.af = AF_INET6;
+			packet->dst_ipaddr.ipaddr.ip6addr = ip6->ip_dst;
+		}
+		packet->src_port = ntohs(udp->src);
+		packet->dst_port = ntohs(udp->dst);
+
+		if (!rad_packet_ok(packet, 0, NULL) ||
+		    ((packet->code != PW_CODE_ACCESS_REQUEST) && (packet->code != PW_CODE_ACCOUNTING_REQUEST)) ||
+		    (rad_decode(packet, NULL, secret) < 0)) {
+			talloc_free(packet);
+			continue;
+		}
+
+		if (!replay_add(replay, packet)) return -1;
+	}
+
+	if (ret == -1) {
+		ERROR("Failed reading %s: %s", file, pcap_geterr(in->handle));
+		return -1;
+	}
+
+	return 0;
+}
+#endif
+
+static void *replay_thread(void *arg)
+{
+	replay_t	*replay = arg;
+	REQUEST		*request;
+	uint64_t	i;
+
+	while ((i = __atomic_fetch_add(&replay->next, 1, __ATOMIC_RELAXED)) < replay->total) {
+		request = request_from_packet(replay->original, replay->packets[i % replay->num], i + 1);
+
+		if (request->packet->code == PW_CODE_ACCOUNTING_REQUEST) {
+			rad_accounting(request);
+		} else {
+			rad_virtual_server(request);
+		}
+
+		talloc_free(request);
+	}
+
+	return NULL;
+}
+
+static int _replay_module_stats(UNUSED void *ctx, void *data)
+{
+	module_instance_t const *mi = data;
+	int i;
+
+	if (!mi->stats) return 0;
+
+	for (i = 0; i < RLM_COMPONENT_COUNT; i++) {
+		if (!mi->stats->timed[i]) continue;
+
+		printf("{\"module\": \"%s\", \"section\": \"%s\", \"calls\": %" PRIu64 ", \"avg_usec\": %.1f}\n",
+		       mi->name, section_type_value[i].section, mi->stats->calls[i],
+		       (double) mi->stats->usec[i] / mi->stats->timed[i]);
+	}
+
+	return 0;
+}
+
+/*
+ *	Replay the packets from a detail file or a capture through the
+ *	server as fast as it can process them, and print the packets
+ *	per second, and the time spent in each section and module, as
+ *	lines of JSON.
+ */
+static int replay_run(REQUEST *original, char const *file, char const *secret, int passes, int threads)
+{
+	int		i, rcode = -1;
+	FILE		*fp;
+	uint8_t		magic[4];
+	bool		is_pcap;
+	replay_t	*replay;
+	struct timeval	start, end;
+	uint64_t	usec;
+	module_stats_t const *stats;
+#ifdef HAVE_PTHREAD_H
+	pthread_t	*tids;
+#endif
+
+	fp = fopen(file, "r");
+	if (!fp) {
+		ERROR("Failed reading %s: %s", file, fr_syserror(errno));
+		return -1;
+	}
+
+	/*
+	 *	Captures start with a magic number, which can't begin
+	 *	a detail file.
+	 */
+	is_pcap = ((fread(magic, 1, sizeof(magic), fp) == sizeof(magic)) &&
+		   ((memcmp(magic, "\xa1\xb2\xc3\xd4", 4) == 0) || (memcmp(magic, "\xd4\xc3\xb2\xa1", 4) == 0) ||
+		    (memcmp(magic, "\xa1\xb2\x3c\x4d", 4) == 0) || (memcmp(magic, "\x4d\x3c\xb2\xa1", 4) == 0)));
+	rewind(fp);
+
+	replay = talloc_zero(NULL, replay_t);
+	replay->original = original;
+
+	if (!is_pcap) {
+		if (replay_read_detail(replay, fp) < 0) {
+			ERROR("Failed reading %s", file);
+			fclose(fp);
+			goto finish;
+		}
+		fclose(fp);
+	} else {
+		fclose(fp);
+#ifdef HAVE_LIBPCAP
+		if (replay_read_pcap(replay, file, secret) < 0) goto finish;
+#else
+		(void) secret;	/* -Wunused */
+		ERROR("Can't read %s, the server was built without libpcap", file);
+		goto finish;
+#endif
+	}
+
+	if (!replay->num) {
+		ERROR("No Access-Request or Accounting-Request packets found in %s", file);
+		goto finish;
+	}
+
+	replay->total = (uint64_t) replay->num * passes;
+
+	gettimeofday(&start, NULL);
+
+#ifdef HAVE_PTHREAD_H
+	tids = talloc_array(replay, pthread_t, threads);
+	for (i = 0; i < threads; i++) {
+		if (pthread_create(&tids[i], NULL, replay_thread, replay) != 0) {
+			ERROR("Failed creating thread: %s", fr_syserror(errno));
+			fr_exit(EXIT_FAILURE);
+		}
+	}
+	for (i = 0; i < threads; i++) pthread_join(tids[i], NULL);
+#else
+	if (threads > 1) WARN("Built without threads, using one");
+	threads = 1;
+	replay_thread(replay);
+#endif
+
+	gettimeofday(&end, NULL);
+
+	usec = ((uint64_t) (end.tv_sec - start.tv_sec) * 1000000) + end.tv_usec - start.tv_usec;
+	if (!usec) usec = 1;
+
+	printf("{\"replay\": \"%s\", \"packets\": %" PRIu64 ", \"threads\": %d, \"seconds\": %.3f, "
+	       "\"packets_per_second\": %.1f}\n",
+	       file, replay->total, threads, usec / 1000000.0, (replay->total * 1000000.0) / usec);
+
+	stats = module_section_stats();
+	for (i = 0; i < RLM_COMPONENT_COUNT; i++) {
+		if (!stats->timed[i]) continue;
+
+		printf("{\"section\": \"%s\", \"calls\": %" PRIu64 ", \"avg_usec\": %.1f}\n",
+		       section_type_value[i].section, stats->calls[i], (double) stats->usec[i] / stats->timed[i]);
+	}
+
+	module_instance_walk(_replay_module_stats, NULL);
+	rcode = 0;
+
+finish:
+	talloc_free(replay);
+	return rcode;
+}
+
+/*
+ *	Make a module return a fixed code without doing anything,
+ *	as with "radmin set module status".
+ */
+static int stub_module(char const *arg)
+{
+	char const *p;
+	char name[MAX_STRING_LEN];
+	module_instance_t *mi;
+	int code = RLM_MODULE_OK;
+
+	p = strchr(arg, '=');
+	if (p) {
+		code = fr_str2int(mod_rcode_table, p + 1, -1);
+		if (code < 0) {
+			ERROR("Unknown return code \"%s\"", p + 1);
+			return -1;
+		}
+	} else {
+		p = arg + strlen(arg);
+	}
+	strlcpy(name, arg, ((size_t) (p - arg) < sizeof(name)) ? (size_t) (p - arg) + 1 : sizeof(name));
+
+	mi = find_module_instance(cf_section_find("modules"), name, false);
+	if (!mi) {
+		ERROR("No such module \"%s\"", name);
+		return -1;
+	}
+
+	mi->code = code;
+	mi->force = true;
+
+	return 0;
+}
+
 int main(int argc, char *argv[])
 {
 	int rcode = EXIT_SUCCESS;
@@ -415,6 +871,13 @@ int main(int argc, char *argv[])
 	REQUEST *request = NULL;
 	VALUE_PAIR *vp;
 	VALUE_PAIR *filter_vps = NULL;
+	int bench_count = 0;
+	RADIUS_PACKET *bench_packet = NULL;
+	char const *replay_file = NULL;
+	char const *replay_secret = "testing123";
+	int replay_threads = 1;
+	char const *stubs[32];
+	int i, num_stubs = 0;
 
 	/*
 	 *	If the server was built with debugging enabled always install
@@ -456,9 +919,14 @@ int main(int argc, char *argv[])
 	default_log.fd = STDOUT_FILENO;
 
 	/*  Process the options.  */
-	while ((argval = getopt(argc, argv, "d:D:f:hi:mMn:o:xX")) != EOF) {
+	while ((argval = getopt(argc, argv, "b:d:D:f:hi:mMn:o:r:s:S:t:xX")) != EOF) {
 
 		switch(argval) {
+			case 'b':
+				bench_count = atoi(optarg);
+				if (bench_count <= 0) usage(1);
+				break;
+
 			case 'd':
 				set_radius_dir(NULL, optarg);
 				break;
@@ -496,6 +964,24 @@ int main(int argc, char *argv[])
 				output_file = optarg;
 				break;
 
+			case 'r':
+				replay_file = optarg;
+				break;
+
+			case 's':
+				if (num_stubs == (sizeof(stubs) / sizeof(stubs[0]))) usage(1);
+				stubs[num_stubs++] = optarg;
+				break;
+
+			case 'S':
+				replay_secret = optarg;
+				break;
+
+			case 't':
+				replay_threads = atoi(optarg);
+				if (replay_threads <= 0) usage(1);
+				break;
+
 			case 'X':
 				debug_flag += 2;
 				main_config.log_auth = true;
@@ -532,6 +1018,14 @@ int main(int argc, char *argv[])
 		goto finish;
 	}
 
+	/*
+	 *	Time every section and module call.
+	 */
+	if (replay_file) {
+		main_config.profile_modules = true;
+		main_config.profile_modules_sample = 1;
+	}
+
 	/*
 	 *  Load the modules
 	 */
@@ -540,6 +1034,13 @@ int main(int argc, char *argv[])
 		goto finish;
 	}
 
+	for (i = 0; i < num_stubs; i++) {
+		if (stub_module(stubs[i]) < 0) {
+			rcode = EXIT_FAILURE;
+			goto finish;
+		}
+	}
+
 	/* Set the panic action (if required) */
 	if (main_config.panic_action &&
 #ifndef NDEBUG
@@ -552,6 +1053,15 @@ int main(int argc, char *argv[])
 
 	setlinebuf(stdout); /* unbuffered output */
 
+	if (replay_file) {
+		request = request_setup_empty();
+		if (!request || (replay_run(request, replay_file, replay_secret, bench_count ? bench_count : 1,
+					    replay_threads) < 0)) {
+			rcode = EXIT_FAILURE;
+		}
+		goto finish;
+	}
+
 	if (!input_file || (strcmp(input_file, "-") == 0)) {
 		fp = stdin;
 	} else {
@@ -617,6 +1127,19 @@ int main(int argc, char *argv[])
 		fclose(fp);
 	}
 
+	/*
+	 *	Keep a copy of the input, as processing the request
+	 *	changes it.
+	 */
+	if (bench_count) {
+		bench_packet = rad_copy_packet(NULL, request->packet);
+		if (!bench_packet) {
+			ERROR("No memory");
+			rcode = EXIT_FAILURE;
+			goto finish;
+		}
+	}
+
 	rad_virtual_server(request);
 
 	if (!output_file || (strcmp(output_file, "-") == 0)) {
@@ -653,9 +1176,12 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if (bench_count) bench(request, bench_packet, bench_count, input_file);
+
 	INFO("Exiting normally");
 
 finish:
+	talloc_free(bench_packet);
 	talloc_free(request);
 
 	/*
@@ -688,12 +1214,20 @@ static void NEVER_RETURNS usage(int status)
 
 	fprintf(output, "Usage: %s [options]\n", progname);
 	fprintf(output, "Options:\n");
+	fprintf(output, "  -b count      After checking the reply, process the input 'count' more times,\n");
+	fprintf(output, "                and print how long each took.\n");
 	fprintf(output, "  -d raddb_dir  Configuration files are in \"raddb_dir/*\".\n");
 	fprintf(output, "  -D dict_dir   Dictionary files are in \"dict_dir/*\".\n");
 	fprintf(output, "  -f file       Filter reply against attributes in 'file'.\n");
 	fprintf(output, "  -h            Print this help message.\n");
 	fprintf(output, "  -m            On SIGINT or SIGQUIT exit cleanly instead of immediately.\n");
 	fprintf(output, "  -n name       Read raddb/name.conf instead of raddb/radiusd.conf.\n");
+	fprintf(output, "  -r file       Replay the packets in a detail file or pcap file through the server,\n");
+	fprintf(output, "                'count' times if -b is given, and print the packets per second,\n");
+	fprintf(output, "                and the time spent in each section and module.\n");
+	fprintf(output, "  -s mod[=code] Stub out a module, so that it returns 'code' (default ok).\n");
+	fprintf(output, "  -S secret     Secret for decoding packets from a pcap file (default testing123).\n");
+	fprintf(output, "  -t threads    Replay packets using this many threads (default 1).\n");
 	fprintf(output, "  -X            Turn on full debugging.\n");
 	fprintf(output, "  -x            Turn on additional debugging. (-xx gives more debugging).\n");
 	exit(status);
@@ -3,15 +3,15 @@ SOURCES := acct.c auth.c client.c crypt.c files.c \
 		  mainconfig.c modules.c modcall.c \
 		  unittest.c soh.c connection.c \
 		  session.c threads.c version.c  \
-		  realms.c
+		  realms.c cluster.c
 
 ifneq ($(OPENSSL_LIBS),)
-SOURCES	+= cb.c tls.c
+SOURCES	+= cb.c tls.c tls_cache.c tls_crl.c tls_ocsp.c
 endif
 
 SRC_CFLAGS	:= -DHOSTINFO=\"${HOSTINFO}\"
 TGT_INSTALLDIR  :=
-TGT_LDLIBS	:= $(LIBS) $(LCRYPT)
+TGT_LDLIBS	:= $(LIBS) $(LCRYPT) $(PCAP_LIBS)
 TGT_PREREQS	:= libfreeradius-server.a libfreeradius-radius.a
 
 # Libraries can't depend on libraries (oops), so make the binary
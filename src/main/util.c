@@ -24,12 +24,23 @@ RCSID("$Id$")
 
 #include <freeradius-devel/radiusd.h>
 #include <freeradius-devel/rad_assert.h>
+#include <freeradius-devel/detail.h>
+#include <freeradius-devel/memstats.h>
 
 #include <ctype.h>
 
 #include <sys/stat.h>
 #include <fcntl.h>
 
+#ifdef HAVE_DIRENT_H
+#include <dirent.h>
+#endif
+
+/*
+ *	Largest CPU number accepted in a CPU list.
+ */
+#define MAX_CPU_NUM (1023)
+
 /*
  *	The signal() function in Solaris 2.5.1 sets SA_NODEFER in
  *	sa_flags, which causes grief if signal() is called in the
@@ -304,6 +315,104 @@ char *rad_ajoin(TALLOC_CTX *ctx, char const **array, char c)
 	return buff;
 }
 
+/** Parse a list of CPUs, e.g. "0-3,8,10-11"
+ *
+ * @param ctx to allocate the array in.
+ * @param out where to write the array of CPU numbers.
+ * @param str to parse.
+ * @return the number of CPUs in the list, or -1 on error.
+ */
+int rad_cpu_list(TALLOC_CTX *ctx, int **out, char const *str)
+{
+	int num = 0;
+	int *cpus;
+	char const *p = str;
+
+	*out = NULL;
+
+	cpus = talloc_array(ctx, int, MAX_CPU_NUM + 1);
+	if (!cpus) {
+		fr_strerror_printf("out of memory");
+		return -1;
+	}
+
+	while (*p) {
+		long first, last;
+		char *q;
+
+		while (isspace((int) *p)) p++;
+
+		if (!isdigit((int) *p)) goto invalid;
+		first = last = strtol(p, &q, 10);
+		p = q;
+
+		if (*p == '-') {
+			p++;
+			if (!isdigit((int) *p)) goto invalid;
+			last = strtol(p, &q, 10);
+			p = q;
+		}
+
+		if ((first > last) || (last > MAX_CPU_NUM)) goto invalid;
+
+		while (first <= last) {
+			if (num > MAX_CPU_NUM) goto invalid;
+			cpus[num++] = first++;
+		}
+
+		while (isspace((int) *p)) p++;
+
+		if (!*p) break;
+		if (*p != ',') goto invalid;
+		p++;
+	}
+
+	if (num == 0) {
+	invalid:
+		fr_strerror_printf("Invalid CPU list \"%s\"", str);
+		talloc_free(cpus);
+		return -1;
+	}
+
+	*out = cpus;
+	return num;
+}
+
+/** Find which NUMA node a CPU is on
+ *
+ * Uses the Linux sysfs layout, where each CPU directory contains a
+ * "nodeN" link.
+ *
+ * @param cpu to look up.
+ * @return the node number, or -1 if it isn't known.
+ */
+int rad_cpu_node(int cpu)
+{
+#ifdef HAVE_DIRENT_H
+	int node = -1;
+	char buffer[64];
+	DIR *dir;
+	struct dirent *dp;
+
+	snprintf(buffer, sizeof(buffer), "/sys/devices/system/cpu/cpu%d", cpu);
+
+	dir = opendir(buffer);
+	if (!dir) return -1;
+
+	while ((dp = readdir(dir)) != NULL) {
+		if ((strncmp(dp->d_name, "node", 4) == 0) && isdigit((int) dp->d_name[4])) {
+			node = atoi(dp->d_name + 4);
+			break;
+		}
+	}
+	closedir(dir);
+
+	return node;
+#else
+	return -1;
+#endif
+}
+
 /*
  *	Logs an error message and aborts the program
  *
@@ -327,6 +436,8 @@ static int _request_free(REQUEST *request)
 #endif
 	rad_assert(!request->ev);
 
+	memstats_free(MEMSTATS_REQUEST, request);
+
 #ifdef WITH_COA
 	if (request->coa) {
 		request->coa->parent = NULL;
@@ -356,7 +467,9 @@ REQUEST *request_alloc(TALLOC_CTX *ctx)
 	REQUEST *request;
 
 	request = talloc_zero(ctx, REQUEST);
+	if (!request) return NULL;
 	talloc_set_destructor(request, _request_free);
+	memstats_alloc(MEMSTATS_REQUEST, NULL);
 #ifndef NDEBUG
 	request->magic = REQUEST_MAGIC;
 #endif
@@ -370,7 +483,7 @@ REQUEST *request_alloc(TALLOC_CTX *ctx)
 	request->config_items = NULL;
 	request->username = NULL;
 	request->password = NULL;
-	request->timestamp = time(NULL);
+	request->timestamp = fr_clock_time();
 	request->log.lvl = debug_flag; /* Default to global debug level */
 
 	request->module = "";
@@ -380,6 +493,113 @@ REQUEST *request_alloc(TALLOC_CTX *ctx)
 	return request;
 }
 
+/*
+ *	Requests read from the network are allocated inside a talloc
+ *	pool, so that the reply and the attributes hung off of the
+ *	request don't each need a separate malloc().  Once the request
+ *	is freed the pool is empty, and goes onto a per-thread list to
+ *	be re-used by the next request, instead of being freed.
+ */
+#define REQUEST_POOL_SIZE	(16 * 1024)
+#define REQUEST_POOL_CACHE	(32)
+
+static char const request_pool_name[] = "REQUEST pool";
+
+typedef struct request_pool_t {
+	int		num;				//!< Number of cached pools.
+	TALLOC_CTX	*pool[REQUEST_POOL_CACHE];	//!< Empty pools, ready to be re-used.
+} request_pool_t;
+
+fr_thread_local_setup(request_pool_t *, request_pool)	/* macro */
+
+static void _request_pool_free(void *arg)
+{
+	request_pool_t *cache = arg;
+
+	while (cache->num > 0) talloc_free(cache->pool[--cache->num]);
+	talloc_free(cache);
+}
+
+static request_pool_t *request_pool_get(void)
+{
+	request_pool_t *cache;
+
+	cache = fr_thread_local_init(request_pool, _request_pool_free);
+	if (!cache) {
+		cache = talloc_zero(NULL, request_pool_t);
+		if (!cache) return NULL;
+
+		if (fr_thread_local_set(request_pool, cache) != 0) {
+			talloc_free(cache);
+			return NULL;
+		}
+	}
+
+	return cache;
+}
+
+/*
+ *	Create a new REQUEST data structure in a pool.  Free it with
+ *	request_pool_free(), so that the pool is recycled.
+ */
+REQUEST *request_pool_alloc(void)
+{
+	TALLOC_CTX *pool;
+	REQUEST *request;
+	request_pool_t *cache;
+
+	cache = request_pool_get();
+	if (cache && (cache->num > 0)) {
+		pool = cache->pool[--cache->num];
+	} else {
+		pool = talloc_pool(NULL, REQUEST_POOL_SIZE);
+		if (!pool) return NULL;
+		talloc_set_name_const(pool, request_pool_name);
+	}
+
+	request = request_alloc(pool);
+	if (!request) {
+		talloc_free(pool);
+		return NULL;
+	}
+
+	return request;
+}
+
+/*
+ *	Free a REQUEST, putting its pool back on this thread's list.
+ *	Requests which weren't allocated by request_pool_alloc() are
+ *	just freed.
+ */
+void request_pool_free(REQUEST *request)
+{
+	TALLOC_CTX *pool;
+	request_pool_t *cache;
+
+	if (!request) return;
+
+	pool = talloc_parent(request);
+	if (!pool || (talloc_get_name(pool) != request_pool_name)) {
+		talloc_free(request);
+		return;
+	}
+
+	talloc_free(request);
+
+	/*
+	 *	Memory stolen out of the pool stays in use until it's
+	 *	freed, so the pool can still be re-used.  It just
+	 *	has less room for the next request.
+	 */
+	cache = request_pool_get();
+	if (!cache || (cache->num >= REQUEST_POOL_CACHE)) {
+		talloc_free(pool);
+		return;
+	}
+
+	cache->pool[cache->num++] = pool;
+}
+
 
 /*
  *	Create a new REQUEST, based on an old one.
@@ -388,10 +608,20 @@ REQUEST *request_alloc(TALLOC_CTX *ctx)
  *	into the server, for tunneled protocols like TTLS & PEAP.
  */
 REQUEST *request_alloc_fake(REQUEST *request)
+{
+	return request_alloc_fake_ctx(request, request);
+}
+
+/*
+ *	As above, but allocated in "ctx" instead of under the old
+ *	request.  A fake request which is processed by another thread
+ *	can't share the old request's talloc hierarchy.
+ */
+REQUEST *request_alloc_fake_ctx(TALLOC_CTX *ctx, REQUEST *request)
 {
 	REQUEST *fake;
 
-	fake = request_alloc(request);
+	fake = request_alloc(ctx);
 
 	fake->number = request->number;
 #ifdef HAVE_PTHREAD_H
@@ -400,6 +630,7 @@ REQUEST *request_alloc_fake(REQUEST *request)
 	fake->parent = request;
 	fake->root = request->root;
 	fake->client = request->client;
+	fake->deadline = request->deadline;
 
 	/*
 	 *	For new server support.
@@ -484,6 +715,7 @@ REQUEST *request_alloc_coa(REQUEST *request)
 
 	request->coa->packet->code = 0; /* unknown, as of yet */
 	request->coa->child_state = REQUEST_RUNNING;
+	timerclear(&request->coa->deadline);	/* no one is waiting for it */
 	request->coa->proxy = rad_alloc(request->coa, false);
 	if (!request->coa->proxy) {
 		TALLOC_FREE(request->coa);
@@ -494,6 +726,31 @@ REQUEST *request_alloc_coa(REQUEST *request)
 }
 #endif
 
+/** Check whether work on a request should stop
+ *
+ * Work should stop when the main thread has told the request to
+ * stop, or when it has passed its deadline, after which the client
+ * will have stopped waiting for a reply.
+ *
+ * modcall checks this between modules, and modules may check it
+ * before starting something expensive, such as a database query.
+ *
+ * @param[in] request to check.
+ * @return true if the request should stop, else false.
+ */
+bool request_expired(REQUEST *request)
+{
+	struct timeval now;
+
+	if (request->master_state == REQUEST_STOP_PROCESSING) return true;
+	if (request->parent && (request->parent->master_state == REQUEST_STOP_PROCESSING)) return true;
+
+	if (!timerisset(&request->deadline)) return false;
+
+	gettimeofday(&now, NULL);
+	return timercmp(&now, &request->deadline, >=);
+}
+
 /*
  *	Copy a quoted string.
  */
@@ -875,6 +1132,174 @@ void rad_regcapture(REQUEST *request, int compare, char const *value, regmatch_t
 		request_data_add(request, request, REQUEST_DATA_REGEX | i, p, true);
 	}
 }
+
+/*
+ *	Regexes which are only known at run time (xlat expansions,
+ *	the "users" file) are usually the same from one packet to the
+ *	next.  Each thread keeps the ones it used most recently, so
+ *	that they aren't re-compiled for every packet.
+ */
+#define REGEX_CACHE_SIZE	(64)
+
+typedef struct regex_cache_entry_t {
+	struct regex_cache_entry_t *prev;
+	struct regex_cache_entry_t *next;
+	char const		*pattern;
+	int			flags;		//!< Passed to regcomp().
+	regex_t			reg;
+} regex_cache_entry_t;
+
+typedef struct regex_cache_t {
+	fr_hash_table_t		*ht;
+	regex_cache_entry_t	*head;		//!< Most recently used.
+	regex_cache_entry_t	*tail;		//!< Least recently used, and evicted first.
+	int			num;
+} regex_cache_t;
+
+fr_thread_local_setup(regex_cache_t *, regex_cache)	/* macro */
+
+static uint32_t regex_cache_hash(void const *data)
+{
+	regex_cache_entry_t const *entry = data;
+
+	return fr_hash_update(&entry->flags, sizeof(entry->flags), fr_hash_string(entry->pattern));
+}
+
+static int regex_cache_cmp(void const *one, void const *two)
+{
+	regex_cache_entry_t const *a = one;
+	regex_cache_entry_t const *b = two;
+
+	if (a->flags != b->flags) return a->flags - b->flags;
+
+	return strcmp(a->pattern, b->pattern);
+}
+
+static int _regex_cache_entry_free(regex_cache_entry_t *entry)
+{
+	regfree(&entry->reg);
+	return 0;
+}
+
+static void _regex_cache_free(void *arg)
+{
+	regex_cache_t *cache = arg;
+
+	fr_hash_table_free(cache->ht);
+	talloc_free(cache);
+}
+
+static void regex_cache_unlink(regex_cache_t *cache, regex_cache_entry_t *entry)
+{
+	if (entry->prev) {
+		entry->prev->next = entry->next;
+	} else {
+		cache->head = entry->next;
+	}
+
+	if (entry->next) {
+		entry->next->prev = entry->prev;
+	} else {
+		cache->tail = entry->prev;
+	}
+
+	entry->prev = entry->next = NULL;
+}
+
+static void regex_cache_link(regex_cache_t *cache, regex_cache_entry_t *entry)
+{
+	entry->prev = NULL;
+	entry->next = cache->head;
+	if (cache->head) {
+		cache->head->prev = entry;
+	} else {
+		cache->tail = entry;
+	}
+	cache->head = entry;
+}
+
+/** Find or compile a regular expression
+ *
+ * The result is owned by a per-thread cache, and is valid until
+ * the next call to this function from the same thread.
+ *
+ * @param pattern to compile.
+ * @param flags to pass to regcomp().
+ * @return the compiled regex, or NULL on error (see fr_strerror()).
+ */
+regex_t *rad_regcomp(char const *pattern, int flags)
+{
+	int rcode;
+	regex_cache_t *cache;
+	regex_cache_entry_t my_entry, *entry;
+
+	cache = fr_thread_local_init(regex_cache, _regex_cache_free);
+	if (!cache) {
+		cache = talloc_zero(NULL, regex_cache_t);
+		if (!cache) goto oom;
+
+		cache->ht = fr_hash_table_create(regex_cache_hash, regex_cache_cmp, NULL);
+		if (!cache->ht) {
+			talloc_free(cache);
+			goto oom;
+		}
+
+		if (fr_thread_local_set(regex_cache, cache) != 0) {
+			_regex_cache_free(cache);
+			goto oom;
+		}
+	}
+
+	my_entry.pattern = pattern;
+	my_entry.flags = flags;
+
+	entry = fr_hash_table_finddata(cache->ht, &my_entry);
+	if (entry) {
+		if (cache->head != entry) {
+			regex_cache_unlink(cache, entry);
+			regex_cache_link(cache, entry);
+		}
+		return &entry->reg;
+	}
+
+	if (cache->num >= REGEX_CACHE_SIZE) {
+		entry = cache->tail;
+		regex_cache_unlink(cache, entry);
+		fr_hash_table_delete(cache->ht, entry);
+		talloc_free(entry);
+		cache->num--;
+	}
+
+	entry = talloc_zero(cache, regex_cache_entry_t);
+	if (!entry) goto oom;
+
+	rcode = regcomp(&entry->reg, pattern, flags);
+	if (rcode != 0) {
+		char buffer[256];
+
+		regerror(rcode, &entry->reg, buffer, sizeof(buffer));
+		fr_strerror_printf("Invalid regular expression %s: %s", pattern, buffer);
+		talloc_free(entry);
+		return NULL;
+	}
+	talloc_set_destructor(entry, _regex_cache_entry_free);
+
+	entry->pattern = talloc_strdup(entry, pattern);
+	entry->flags = flags;
+	if (!entry->pattern || !fr_hash_table_insert(cache->ht, entry)) {
+		talloc_free(entry);
+		goto oom;
+	}
+
+	regex_cache_link(cache, entry);
+	cache->num++;
+
+	return &entry->reg;
+
+oom:
+	fr_strerror_printf("Out of memory");
+	return NULL;
+}
 #endif
 
 /** Return the default log dir
@@ -937,6 +1362,44 @@ char const *rad_radacct_dir(void)
 	return RADIR;
 }
 
+/** Checksum a binary detail file record
+ *
+ * Shared by rlm_detail, which writes the records, and the detail
+ * listener, which reads them.
+ *
+ * @param hdr of the record.  The checksum and done fields are ignored.
+ * @param attrs following the header.
+ * @param len of the attributes.
+ * @return the checksum, in host byte order.
+ */
+uint32_t detail_binary_checksum(detail_binary_t const *hdr, uint8_t const *attrs, size_t len)
+{
+	detail_binary_t copy;
+
+	memcpy(&copy, hdr, sizeof(copy));
+	copy.checksum = 0;
+	copy.done = 0;
+
+	return fr_hash_update(attrs, len, fr_hash(&copy, sizeof(copy)));
+}
+
+/** Checksum a compressed detail file block
+ *
+ * @param hdr of the block.  The checksum field is ignored.
+ * @param data following the header.
+ * @param len of the data.
+ * @return the checksum, in host byte order.
+ */
+uint32_t detail_block_checksum(detail_block_t const *hdr, uint8_t const *data, size_t len)
+{
+	detail_block_t copy;
+
+	memcpy(&copy, hdr, sizeof(copy));
+	copy.checksum = 0;
+
+	return fr_hash_update(data, len, fr_hash(&copy, sizeof(copy)));
+}
+
 #ifndef NDEBUG
 /*
  *	Verify a packet.
@@ -1056,4 +1519,24 @@ bool fr_getgid(char const *name, gid_t *gid)
 	return true;
 }
 #endif	/* HAVE_GETGRNAM_R */
+
+/** Resolve a group given as a name, or as a number
+ *
+ * @param group name or number.
+ * @param gid where to write the group ID.
+ * @return true on success, false if there's no such group.
+ */
+bool fr_getgid_any(char const *group, gid_t *gid)
+{
+	char *endptr;
+	long num;
+
+	num = strtol(group, &endptr, 10);
+	if ((endptr != group) && (*endptr == '\0')) {
+		*gid = num;
+		return true;
+	}
+
+	return fr_getgid(group, gid);
+}
 #endif	/* HAVE_GRP_H */
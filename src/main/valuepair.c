@@ -82,7 +82,7 @@ int radius_compare_vps(UNUSED REQUEST *request, VALUE_PAIR *check, VALUE_PAIR *v
 #ifdef HAVE_REGEX
 	if (check->op == T_OP_REG_EQ) {
 		int compare;
-		regex_t reg;
+		regex_t *preg;
 		char value[1024];
 		regmatch_t rxmatch[REQUEST_MAX_REGEX + 1];
 
@@ -91,18 +91,14 @@ int radius_compare_vps(UNUSED REQUEST *request, VALUE_PAIR *check, VALUE_PAIR *v
 		/*
 		 *	Include substring matches.
 		 */
-		compare = regcomp(&reg, check->vp_strvalue, REG_EXTENDED);
-		if (compare != 0) {
-			char buffer[256];
-			regerror(compare, &reg, buffer, sizeof(buffer));
-
-			RDEBUG("Invalid regular expression %s: %s", check->vp_strvalue, buffer);
+		preg = rad_regcomp(check->vp_strvalue, REG_EXTENDED);
+		if (!preg) {
+			RDEBUG("%s", fr_strerror());
 			return -2;
 		}
 
 		memset(&rxmatch, 0, sizeof(rxmatch));	/* regexec does not seem to initialise unused elements */
-		compare = regexec(&reg, value, REQUEST_MAX_REGEX + 1, rxmatch, 0);
-		regfree(&reg);
+		compare = regexec(preg, value, REQUEST_MAX_REGEX + 1, rxmatch, 0);
 		rad_regcapture(request, compare, value, rxmatch);
 
 		ret = (compare == 0) ? 0 : -1;
@@ -111,7 +107,7 @@ int radius_compare_vps(UNUSED REQUEST *request, VALUE_PAIR *check, VALUE_PAIR *v
 
 	if (check->op == T_OP_REG_NE) {
 		int compare;
-		regex_t reg;
+		regex_t *preg;
 		char value[1024];
 		regmatch_t rxmatch[REQUEST_MAX_REGEX + 1];
 
@@ -120,16 +116,12 @@ int radius_compare_vps(UNUSED REQUEST *request, VALUE_PAIR *check, VALUE_PAIR *v
 		/*
 		 *	Include substring matches.
 		 */
-		compare = regcomp(&reg, check->vp_strvalue, REG_EXTENDED);
-		if (compare != 0) {
-			char buffer[256];
-			regerror(compare, &reg, buffer, sizeof(buffer));
-
-			RDEBUG("Invalid regular expression %s: %s", check->vp_strvalue, buffer);
+		preg = rad_regcomp(check->vp_strvalue, REG_EXTENDED);
+		if (!preg) {
+			RDEBUG("%s", fr_strerror());
 			return -2;
 		}
-		compare = regexec(&reg, value,  REQUEST_MAX_REGEX + 1, rxmatch, 0);
-		regfree(&reg);
+		compare = regexec(preg, value,  REQUEST_MAX_REGEX + 1, rxmatch, 0);
 
 		ret = (compare != 0) ? 0 : -1;
 	}
@@ -430,6 +422,26 @@ void paircompare_unregister_instance(void *instance)
  */
 int paircompare(REQUEST *request, VALUE_PAIR *req_list, VALUE_PAIR *check,
 		VALUE_PAIR **rep_list)
+{
+	return paircompare_index(request, req_list, NULL, check, rep_list);
+}
+
+/** Compare two pair lists, using an index of the request list
+ *
+ * As paircompare(), but the attributes are found with pairindex_find(),
+ * which is faster when the same request list is compared against many
+ * check lists.
+ *
+ * @param[in] request Current request.
+ * @param[in] req_list request valuepairs.
+ * @param[in] index of req_list, or NULL to search it.
+ * @param[in] check Check/control valuepairs.
+ * @param[in,out] rep_list Reply value pairs.
+ *
+ * @return 0 on match.
+ */
+int paircompare_index(REQUEST *request, VALUE_PAIR *req_list, vp_index_t const *index,
+		      VALUE_PAIR *check, VALUE_PAIR **rep_list)
 {
 	vp_cursor_t cursor;
 	VALUE_PAIR *check_item;
@@ -482,7 +494,9 @@ int paircompare(REQUEST *request, VALUE_PAIR *req_list, VALUE_PAIR *check,
 				WARN("Are you sure you don't mean Cleartext-Password?");
 				WARN("See \"man rlm_pap\" for more information");
 			}
-			if (pairfind(req_list, PW_USER_PASSWORD, 0, TAG_ANY) == NULL) {
+			if (index) {
+				if (!pairindex_find(index, check_item->da, TAG_ANY)) continue;
+			} else if (pairfind(req_list, PW_USER_PASSWORD, 0, TAG_ANY) == NULL) {
 				continue;
 			}
 			break;
@@ -494,6 +508,7 @@ int paircompare(REQUEST *request, VALUE_PAIR *req_list, VALUE_PAIR *check,
 		first_only = otherattr(check_item->da, &from);
 
 		auth_item = req_list;
+		if (index && from && !first_only) auth_item = pairindex_find(index, from, TAG_ANY);
 	try_again:
 		if (!first_only) {
 			while (auth_item != NULL) {
@@ -28,6 +28,7 @@ RCSID("$Id$")
 
 #include <freeradius-devel/radiusd.h>
 #include <freeradius-devel/parser.h>
+#include <freeradius-devel/trace.h>
 #include <freeradius-devel/rad_assert.h>
 #include <freeradius-devel/base64.h>
 
@@ -40,6 +41,7 @@ typedef struct xlat_t {
 	RAD_XLAT_FUNC		func;			//!< xlat function.
 	RADIUS_ESCAPE_STRING	escape;			//!< Escape function to apply to dynamic input to func.
 	bool			internal;		//!< If true, cannot be redefined.
+	bool			pure;			//!< Output depends only on the input string.
 } xlat_t;
 
 typedef enum {
@@ -51,7 +53,8 @@ typedef enum {
 #ifdef HAVE_REGEX
 	XLAT_REGEX,		//!< regex reference
 #endif
-	XLAT_ALTERNATE		//!< xlat conditional syntax :-
+	XLAT_ALTERNATE,		//!< xlat conditional syntax :-
+	XLAT_CONSTANT		//!< Folded expansion.  Escaped, unlike a literal.
 } xlat_state_t;
 
 struct xlat_exp {
@@ -73,8 +76,61 @@ typedef struct xlat_out {
 	size_t len;		//!< Length of the output string.
 } xlat_out_t;
 
+/*
+ *	Output of a streaming expansion.  The buffer starts out as
+ *	caller (usually stack) memory, and is moved to the heap if it
+ *	has to grow.
+ */
+typedef struct xlat_buff {
+	char		*buffer;	//!< Output so far, always '\0' terminated.
+	size_t		len;		//!< Length of the output, not including the '\0'.
+	size_t		size;		//!< Size of buffer.
+	bool		heap;		//!< buffer was talloced, and can be reallocated.
+	bool		busy;		//!< Per-thread buffer is in use by an outer expansion.
+} xlat_buff_t;
+
+#define XLAT_BUFF_SIZE	(4096)		//!< Initial size of the per-thread buffer.
+#define XLAT_BUFF_KEEP	(65536)		//!< Shrink the per-thread buffer if it grew past this.
+
+fr_thread_local_setup(xlat_buff_t *, xlat_thread_buff)	/* macro */
+
 static rbtree_t *xlat_root = NULL;
 
+/*
+ *	Format strings from the configuration, tokenized when the
+ *	configuration is parsed.
+ *
+ *	Each load of the configuration builds a new tree, which
+ *	replaces the one used by the worker threads in one pointer
+ *	store, so they can search it without locking.  A replaced
+ *	tree is freed once no request can still be expanding one
+ *	of its entries.
+ */
+typedef struct xlat_cache_t {
+	char const	*fmt;		//!< The format string.
+	xlat_exp_t	*head;		//!< Its tokenized and folded form.
+} xlat_cache_t;
+
+#define XLAT_CACHE_MAX	(65536)		//!< Strings past this are tokenized for every request.
+
+typedef struct xlat_cache_old_t {
+	rbtree_t		*tree;
+	time_t			when;		//!< When it was replaced.
+	struct xlat_cache_old_t	*next;
+} xlat_cache_old_t;
+
+static rbtree_t *xlat_cache = NULL;		//!< Searched by the worker threads.
+static rbtree_t *xlat_cache_next = NULL;	//!< Being filled by xlat_precompile().
+static xlat_cache_old_t *xlat_cache_old = NULL;
+
+#ifdef __ATOMIC_ACQUIRE
+#  define XLAT_CACHE_LOAD()	__atomic_load_n(&xlat_cache, __ATOMIC_ACQUIRE)
+#  define XLAT_CACHE_STORE(_x)	__atomic_store_n(&xlat_cache, _x, __ATOMIC_RELEASE)
+#else
+#  define XLAT_CACHE_LOAD()	(xlat_cache)
+#  define XLAT_CACHE_STORE(_x)	(xlat_cache = _x)
+#endif
+
 #ifdef WITH_UNLANG
 static char const * const xlat_foreach_names[] = {"Foreach-Variable-0",
 						  "Foreach-Variable-1",
@@ -586,6 +642,24 @@ static ssize_t xlat_debug(UNUSED void *instance, REQUEST *request,
 	return strlen(out);
 }
 
+/** Trace the current request, or stop tracing it
+ *
+ * Example %{trace:1}
+ *
+ * Expands to 1 if the request is being traced, and 0 if it isn't.
+ */
+static ssize_t xlat_trace(UNUSED void *instance, REQUEST *request,
+			  char const *fmt, char *out, size_t outlen)
+{
+	bool traced = (request->trace != NULL);
+
+	if (*fmt) traced = trace_request_enable(request, atoi(fmt) != 0);
+
+	snprintf(out, outlen, "%d", traced);
+
+	return strlen(out);
+}
+
 /*
  *	Compare two xlat_t structs, based ONLY on the module name.
  */
@@ -676,6 +750,7 @@ int xlat_register(char const *name, RAD_XLAT_FUNC func, RADIUS_ESCAPE_STRING esc
 		XLAT_REGISTER(xlat);
 		XLAT_REGISTER(module);
 		XLAT_REGISTER(debug_attr);
+		XLAT_REGISTER(trace);
 
 		xlat_register("debug", xlat_debug, NULL, &xlat_inst[0]);
 		c = xlat_find("debug");
@@ -698,6 +773,7 @@ int xlat_register(char const *name, RAD_XLAT_FUNC func, RADIUS_ESCAPE_STRING esc
 		c->func = func;
 		c->escape = escape;
 		c->instance = instance;
+		c->pure = false;
 		return 0;
 	}
 
@@ -757,6 +833,24 @@ void xlat_unregister(char const *name, UNUSED RAD_XLAT_FUNC func, void *instance
 	rbtree_deletebydata(xlat_root, c);
 }
 
+/** Mark an xlat function as pure
+ *
+ * A pure function doesn't look at the request, and gives the same
+ * output for the same input.  When its argument is a constant, the
+ * call is done once, when the configuration is loaded.
+ *
+ * Registering the function again clears the flag.
+ *
+ * @param[in] name of the xlat function.
+ */
+void xlat_pure(char const *name)
+{
+	xlat_t	*c;
+
+	c = xlat_find(name);
+	if (c) c->pure = true;
+}
+
 
 /** Crappy temporary function to add attribute ref support to xlats
  *
@@ -798,6 +892,20 @@ ssize_t xlat_fmt_to_ref(uint8_t const **out, REQUEST *request, char const *fmt)
  */
 void xlat_free(void)
 {
+	xlat_cache_old_t *old;
+
+	rbtree_free(xlat_cache);
+	xlat_cache = NULL;
+	rbtree_free(xlat_cache_next);
+	xlat_cache_next = NULL;
+
+	while (xlat_cache_old) {
+		old = xlat_cache_old;
+		xlat_cache_old = old->next;
+		rbtree_free(old->tree);
+		talloc_free(old);
+	}
+
 	rbtree_free(xlat_root);
 }
 
@@ -1344,6 +1452,10 @@ static void xlat_tokenize_debug(xlat_exp_t const *node, int lvl)
 			DEBUG("%.*sliteral --> %s", lvl, xlat_tabs, node->fmt);
 			break;
 
+		case XLAT_CONSTANT:
+			DEBUG("%.*sconstant --> %s", lvl, xlat_tabs, node->fmt);
+			break;
+
 		case XLAT_PERCENT:
 			DEBUG("%.*spercent --> %c", lvl, xlat_tabs, node->fmt[0]);
 			break;
@@ -1425,6 +1537,7 @@ size_t xlat_sprint(char *buffer, size_t bufsize, xlat_exp_t const *node)
 	while (node) {
 		switch (node->type) {
 		case XLAT_LITERAL:
+		case XLAT_CONSTANT:
 			strlcpy(p, node->fmt, end - p);
 			p += strlen(p);
 			break;
@@ -1534,12 +1647,263 @@ size_t xlat_sprint(char *buffer, size_t bufsize, xlat_exp_t const *node)
 	return p - buffer;
 }
 
+/*
+ *	Smash \n --> CR.
+ *
+ *	The OUTPUT of xlat is a printable string.  The INPUT might not be...
+ *
+ *	This is really the reverse of fr_print_string().
+ */
+static void xlat_unescape(char *str)
+{
+	char const *p;
+	char *q;
+
+	p = q = str;
+	while (*p) {
+		if (*p == '\\') switch (p[1]) {
+			default:
+				*(q++) = p[1];
+				p += 2;
+				continue;
+
+			case 'n':
+				*(q++) = '\n';
+				p += 2;
+				continue;
+
+			case 't':
+				*(q++) = '\t';
+				p += 2;
+				continue;
+		}
+
+		*(q++) = *(p++);
+	}
+	*q = '\0';
+}
+
+/*
+ *	Fold the parts of a tokenized expansion which don't depend
+ *	on the request.
+ *
+ *	- A pure xlat function with a literal argument is called
+ *	  now, and the node is replaced by its output.
+ *	- "%{foo:-bar}" where "foo" is a literal becomes "foo".
+ *	- Adjacent literals are joined.
+ *
+ *	Folded nodes become XLAT_CONSTANT, not XLAT_LITERAL, because
+ *	they're the output of an expansion, and still have to go
+ *	through the caller's escape function.
+ *
+ *	Nodes which are unlinked are left in place, as the following
+ *	nodes are parented by them.  They're freed with the head.
+ */
+static void xlat_fold(xlat_exp_t *head)
+{
+	xlat_exp_t *node, *next;
+
+	for (node = head; node != NULL; node = node->next) {
+		if (node->child) xlat_fold(node->child);
+		if (node->alternate) xlat_fold(node->alternate);
+
+		switch (node->type) {
+		case XLAT_MODULE:
+		{
+			char *arg, *out;
+			ssize_t rcode;
+
+			if (!node->xlat->pure || !node->child || node->child->next ||
+			    (node->child->type != XLAT_LITERAL)) break;
+
+			arg = talloc_typed_strdup(node, node->child->fmt);
+			xlat_unescape(arg);
+
+			out = talloc_zero_array(node, char, 2048);
+			rcode = node->xlat->func(node->xlat->instance, NULL, arg, out, 2048);
+			talloc_free(arg);
+			if (rcode < 0) {
+				talloc_free(out);
+				break;
+			}
+
+			node->type = XLAT_CONSTANT;
+			node->fmt = out;
+			node->len = strlen(out);
+			node->child = NULL;
+		}
+			break;
+
+			/*
+			 *	Only the first node of the child is
+			 *	expanded, and a literal is never empty.
+			 */
+		case XLAT_ALTERNATE:
+			if (!node->child || (node->child->type != XLAT_LITERAL)) break;
+
+			node->type = XLAT_CONSTANT;
+			node->fmt = node->child->fmt;
+			node->len = strlen(node->fmt);
+			node->child = NULL;
+			node->alternate = NULL;
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	node = head;
+	while (node && node->next) {
+		next = node->next;
+
+		if ((node->type != XLAT_LITERAL) || (next->type != XLAT_LITERAL)) {
+			node = next;
+			continue;
+		}
+
+		node->fmt = talloc_typed_asprintf(node, "%s%s", node->fmt, next->fmt);
+		node->len = strlen(node->fmt);
+		node->next = next->next;
+	}
+}
+
 ssize_t xlat_tokenize(TALLOC_CTX *ctx, char *fmt, xlat_exp_t **head,
 		      char const **error)
 {
 	return xlat_tokenize_literal(ctx, fmt, head, false, error);
 }
 
+static int xlat_cache_cmp(void const *one, void const *two)
+{
+	xlat_cache_t const *a = one;
+	xlat_cache_t const *b = two;
+
+	return strcmp(a->fmt, b->fmt);
+}
+
+/** Tokenize a format string from the configuration, and cache it
+ *
+ * Once xlat_cache_publish() has been called, radius_xlat() and
+ * radius_axlat() with the same format string use the cached version,
+ * instead of tokenizing the string again for every request.  Any part
+ * of the string which doesn't depend on the request is expanded now.
+ *
+ * Must only be called from the main thread.
+ *
+ * @param[in] fmt the format string.
+ * @param[out] error why the string couldn't be parsed.
+ * @return the length of fmt which was parsed, or <= 0 on error, as with xlat_tokenize().
+ */
+ssize_t xlat_precompile(char const *fmt, char const **error)
+{
+	ssize_t slen;
+	char *tokens;
+	xlat_exp_t *head = NULL;
+	xlat_cache_t *entry, my_entry;
+
+	if (!xlat_cache_next) {
+		xlat_cache_next = rbtree_create(NULL, xlat_cache_cmp, NULL, 0);
+		if (!xlat_cache_next) {
+			*error = "Out of memory";
+			return -1;
+		}
+	}
+
+	my_entry.fmt = fmt;
+	if (rbtree_finddata(xlat_cache_next, &my_entry)) return strlen(fmt);
+
+	entry = talloc_zero(xlat_cache_next, xlat_cache_t);
+	if (!entry) {
+		*error = "Out of memory";
+		return -1;
+	}
+
+	tokens = talloc_typed_strdup(entry, fmt);
+	slen = xlat_tokenize_literal(entry, tokens, &head, false, error);
+
+	/*
+	 *	Errors are returned, and zero length strings aren't
+	 *	worth caching.
+	 */
+	if (slen <= 0) {
+		talloc_free(entry);
+		return slen;
+	}
+
+	/*
+	 *	The string is valid, but there are too many to
+	 *	keep.
+	 */
+	if (rbtree_num_elements(xlat_cache_next) >= XLAT_CACHE_MAX) {
+		talloc_free(entry);
+		return slen;
+	}
+
+	xlat_fold(head);
+
+	entry->fmt = talloc_typed_strdup(entry, fmt);
+	entry->head = head;
+
+	if (!rbtree_insert(xlat_cache_next, entry)) talloc_free(entry);
+
+	return slen;
+}
+
+/** Use the format strings passed to xlat_precompile() since the last call
+ *
+ * Called from the main thread once the configuration has been loaded,
+ * or re-loaded on HUP.  The previous strings are freed once requests
+ * can no longer be using them.
+ *
+ * @param keep how long, in seconds, a request may still be using the
+ *	strings after they've been replaced.
+ */
+void xlat_cache_publish(time_t keep)
+{
+	time_t now = time(NULL);
+	rbtree_t *tree;
+	xlat_cache_old_t *old, **last;
+
+	tree = xlat_cache;
+	XLAT_CACHE_STORE(xlat_cache_next);
+	xlat_cache_next = NULL;
+
+	if (tree) {
+		old = talloc_zero(NULL, xlat_cache_old_t);
+		if (!old) {
+			/*
+			 *	Leak it, rather than freeing it from
+			 *	under a request.
+			 */
+			ERROR("Out of memory");
+		} else {
+			old->tree = tree;
+			old->when = now;
+			old->next = xlat_cache_old;
+			xlat_cache_old = old;
+		}
+	}
+
+	/*
+	 *	Free the trees which were replaced long enough ago
+	 *	that every request using them has finished.
+	 */
+	last = &xlat_cache_old;
+	while (*last) {
+		old = *last;
+
+		if ((now - old->when) <= keep) {
+			last = &(old->next);
+			continue;
+		}
+
+		*last = old->next;
+		rbtree_free(old->tree);
+		talloc_free(old);
+	}
+}
+
 
 /** Tokenize an xlat expansion
  *
@@ -1669,7 +2033,11 @@ static char *xlat_getvp(TALLOC_CTX *ctx, REQUEST *request, pair_lists_t list, DI
 	 *	This allows users to manipulate virtual attributes as if they
 	 *	were real ones.
 	 */
-	vp = pairfind(vps, da->attr, da->vendor, tag);
+	if (!da->flags.is_unknown) {
+		vp = pairfind_da(vps, da, tag);
+	} else {
+		vp = pairfind(vps, da->attr, da->vendor, tag);
+	}
 	if (vp) goto do_print;
 
 	/*
@@ -1917,7 +2285,6 @@ static char *xlat_aprint(TALLOC_CTX *ctx, REQUEST *request, xlat_exp_t const * c
 {
 	ssize_t rcode;
 	char *str = NULL, *child;
-	char *q;
 	char const *p;
 	REQUEST *ref;
 
@@ -1931,6 +2298,15 @@ static char *xlat_aprint(TALLOC_CTX *ctx, REQUEST *request, xlat_exp_t const * c
 		XLAT_DEBUG("xlat_aprint LITERAL");
 		return talloc_typed_strdup(ctx, node->fmt);
 
+		/*
+		 *	Escape this, as it's the output of an
+		 *	expansion.
+		 */
+	case XLAT_CONSTANT:
+		XLAT_DEBUG("xlat_aprint CONSTANT");
+		str = talloc_typed_strdup(ctx, node->fmt);
+		break;
+
 		/*
 		 *	Do a one-character expansion.
 		 */
@@ -2070,35 +2446,7 @@ static char *xlat_aprint(TALLOC_CTX *ctx, REQUEST *request, xlat_exp_t const * c
 		XLAT_DEBUG("%.*sEXPAND mod %s %s", lvl, xlat_spaces, node->fmt, node->child->fmt);
 		XLAT_DEBUG("%.*s      ---> %s", lvl, xlat_spaces, child);
 
-		/*
-		 *	Smash \n --> CR.
-		 *
-		 *	The OUTPUT of xlat is a printable string.  The INPUT might not be...
-		 *
-		 *	This is really the reverse of fr_print_string().
-		 */
-		p = q = child;
-		while (*p) {
-			if (*p == '\\') switch (p[1]) {
-				default:
-					*(q++) = p[1];
-					p += 2;
-					continue;
-
-				case 'n':
-					*(q++) = '\n';
-					p += 2;
-					continue;
-
-				case 't':
-					*(q++) = '\t';
-					p += 2;
-					continue;
-			}
-
-			*(q++) = *(p++);
-		}
-		*q = '\0';
+		xlat_unescape(child);
 
 		str = talloc_array(ctx, char, 2048); /* FIXME: have the module call talloc_typed_asprintf */
 		*str = '\0';	/* Be sure the string is NULL terminated, we now only free on error */
@@ -2156,7 +2504,8 @@ static size_t xlat_process(char **out, REQUEST *request, xlat_exp_t const * cons
 {
 	int i, list;
 	size_t total;
-	char **array, *answer;
+	char *answer;
+	xlat_out_t *array;
 	xlat_exp_t const *node;
 
 	*out = NULL;
@@ -2190,21 +2539,29 @@ static size_t xlat_process(char **out, REQUEST *request, xlat_exp_t const * cons
 		return strlen(answer);
 	}
 
-	list = 0;		/* FIXME: calculate this once */
+	list = 0;
 	for (node = head; node != NULL; node = node->next) {
 		list++;
 	}
 
-	array = talloc_array(request, char *, list);
+	array = talloc_array(request, xlat_out_t, list);
 	if (!array) return -1;
 
+	/*
+	 *	Literals are used in place, instead of being copied
+	 *	to a temporary buffer.  Everything else is expanded
+	 *	into a buffer parented by the array.
+	 */
+	total = 0;
 	for (node = head, i = 0; node != NULL; node = node->next, i++) {
-		array[i] = xlat_aprint(array, request, node, escape, escape_ctx, 0); /* may be NULL */
-	}
+		if (node->type == XLAT_LITERAL) {
+			array[i].out = node->fmt;
+		} else {
+			array[i].out = xlat_aprint(array, request, node, escape, escape_ctx, 0); /* may be NULL */
+		}
 
-	total = 0;
-	for (i = 0; i < list; i++) {
-		if (array[i]) total += strlen(array[i]); /* FIXME: calculate strlen once */
+		array[i].len = array[i].out ? strlen(array[i].out) : 0;
+		total += array[i].len;
 	}
 
 	if (!total) {
@@ -2217,13 +2574,8 @@ static size_t xlat_process(char **out, REQUEST *request, xlat_exp_t const * cons
 
 	total = 0;
 	for (i = 0; i < list; i++) {
-		size_t len;
-
-		if (array[i]) {
-			len = strlen(array[i]);
-			memcpy(answer + total, array[i], len);
-			total += len;
-		}
+		memcpy(answer + total, array[i].out, array[i].len);
+		total += array[i].len;
 	}
 	answer[total] = '\0';
 	talloc_free(array);	/* and child entries */
@@ -2233,6 +2585,370 @@ static size_t xlat_process(char **out, REQUEST *request, xlat_exp_t const * cons
 }
 
 
+static void xlat_buff_init(xlat_buff_t *b, char *buffer, size_t size)
+{
+	b->buffer = buffer;
+	b->buffer[0] = '\0';
+	b->len = 0;
+	b->size = size;
+	b->heap = false;
+	b->busy = false;
+}
+
+static void xlat_buff_free(xlat_buff_t *b)
+{
+	if (b->heap) talloc_free(b->buffer);
+}
+
+/*
+ *	Make sure there's room for "need" more bytes, plus the '\0'.
+ */
+static int xlat_buff_reserve(xlat_buff_t *b, size_t need)
+{
+	size_t size;
+	char *p;
+
+	if ((b->len + need) < b->size) return 0;
+
+	size = b->size * 2;
+	while (size <= (b->len + need)) size *= 2;
+
+	if (b->heap) {
+		p = talloc_realloc(NULL, b->buffer, char, size);
+		if (!p) return -1;
+	} else {
+		p = talloc_array(NULL, char, size);
+		if (!p) return -1;
+		memcpy(p, b->buffer, b->len + 1);
+		b->heap = true;
+	}
+
+	b->buffer = p;
+	b->size = size;
+	return 0;
+}
+
+static int xlat_buff_append(xlat_buff_t *b, char const *in, size_t inlen)
+{
+	if (xlat_buff_reserve(b, inlen) < 0) return -1;
+
+	memcpy(b->buffer + b->len, in, inlen);
+	b->len += inlen;
+	b->buffer[b->len] = '\0';
+
+	return 0;
+}
+
+/*
+ *	Append the output of an expansion, escaping it if necessary.
+ *	"in" must not point into the buffer.
+ */
+static int xlat_buff_escape(xlat_buff_t *b, REQUEST *request, char const *in,
+			    RADIUS_ESCAPE_STRING escape, void *escape_ctx)
+{
+	if (!escape) return xlat_buff_append(b, in, strlen(in));
+
+	if (xlat_buff_reserve(b, 2048) < 0) return -1;
+
+	escape(request, b->buffer + b->len, 2038, in, escape_ctx);
+	b->len += strlen(b->buffer + b->len);
+
+	return 0;
+}
+
+static void _xlat_thread_buff_free(void *arg)
+{
+	xlat_buff_t *b = arg;
+
+	xlat_buff_free(b);
+	talloc_free(b);
+}
+
+/*
+ *	Get this thread's output buffer.  Returns NULL if it's already
+ *	in use, i.e. an xlat function is expanding a string of its own.
+ */
+static xlat_buff_t *xlat_buff_acquire(void)
+{
+	xlat_buff_t *b;
+
+	b = fr_thread_local_init(xlat_thread_buff, _xlat_thread_buff_free);
+	if (!b) {
+		b = talloc_zero(NULL, xlat_buff_t);
+		if (!b) return NULL;
+
+		b->buffer = talloc_array(NULL, char, XLAT_BUFF_SIZE);
+		if (!b->buffer) {
+			talloc_free(b);
+			return NULL;
+		}
+		b->size = XLAT_BUFF_SIZE;
+		b->heap = true;
+
+		if (fr_thread_local_set(xlat_thread_buff, b) != 0) {
+			_xlat_thread_buff_free(b);
+			return NULL;
+		}
+	}
+
+	if (b->busy) return NULL;
+
+	b->busy = true;
+	b->len = 0;
+	b->buffer[0] = '\0';
+
+	return b;
+}
+
+static void xlat_buff_release(xlat_buff_t *b)
+{
+	char *p;
+
+	if (b->size > XLAT_BUFF_KEEP) {
+		p = talloc_realloc(NULL, b->buffer, char, XLAT_BUFF_SIZE);
+		if (p) {
+			b->buffer = p;
+			b->size = XLAT_BUFF_SIZE;
+		}
+	}
+
+	b->busy = false;
+}
+
+/*
+ *	Print the common attribute types directly, without going
+ *	through xlat_getvp().  The output is the same as
+ *	vp_aprint_value(ctx, vp, '"').
+ *
+ *	Returns 1 if printed, 0 if the attribute doesn't exist, and
+ *	-1 if xlat_getvp() has to do the work.
+ */
+static int xlat_stream_attr(char *out, size_t outlen, REQUEST *request, xlat_exp_t const *node)
+{
+	REQUEST *ref = request;
+	VALUE_PAIR *vp, *vps;
+	DICT_ATTR const *da = node->attr.tmpl_da;
+	DICT_VALUE const *dv;
+
+	if ((node->attr.tmpl_num != NUM_ANY) || da->flags.virtual) return -1;
+
+	if (radius_request(&ref, node->attr.tmpl_request) < 0) return 0;
+
+	switch (node->attr.tmpl_list) {
+	case PAIR_LIST_REQUEST:
+		vps = ref->packet ? ref->packet->vps : NULL;
+		break;
+
+	case PAIR_LIST_REPLY:
+		vps = ref->reply ? ref->reply->vps : NULL;
+		break;
+
+	case PAIR_LIST_CONTROL:
+		vps = ref->config_items;
+		break;
+
+	default:
+		return -1;
+	}
+
+	switch (da->type) {
+	case PW_TYPE_STRING:
+	case PW_TYPE_INTEGER:
+	case PW_TYPE_SHORT:
+	case PW_TYPE_BYTE:
+	case PW_TYPE_IPV4_ADDR:
+	case PW_TYPE_IPV6_ADDR:
+		break;
+
+	default:
+		return -1;
+	}
+
+	if (!da->flags.is_unknown) {
+		vp = pairfind_da(vps, da, node->attr.tmpl_tag);
+	} else {
+		vp = pairfind(vps, da->attr, da->vendor, node->attr.tmpl_tag);
+	}
+	if (!vp) return 0;
+
+	switch (da->type) {
+	case PW_TYPE_STRING:
+		if (fr_print_string_len(vp->vp_strvalue, vp->length, '"') >= outlen) return -1;
+		fr_print_string(vp->vp_strvalue, vp->length, out, outlen, '"');
+		break;
+
+	case PW_TYPE_INTEGER:
+	case PW_TYPE_SHORT:
+	case PW_TYPE_BYTE:
+	{
+		unsigned int i;
+
+		i = (da->type == PW_TYPE_INTEGER) ? vp->vp_integer :
+		    (da->type == PW_TYPE_SHORT) ? vp->vp_short : vp->vp_byte;
+
+		dv = dict_valbyattr(da->attr, da->vendor, i);
+		if (dv) {
+			strlcpy(out, dv->name, outlen);
+		} else {
+			snprintf(out, outlen, "%u", i);
+		}
+	}
+		break;
+
+	default:
+		vp_prints_value(out, outlen, vp, 0);
+		break;
+	}
+
+	return 1;
+}
+
+static int xlat_stream(xlat_buff_t *out, REQUEST *request, xlat_exp_t const *head,
+		       RADIUS_ESCAPE_STRING escape, void *escape_ctx, int lvl);
+
+/** Expand one node directly into the output buffer
+ *
+ * This is xlat_aprint() without the intermediate strings.  Node types
+ * which aren't common enough to be worth the effort are expanded
+ * with xlat_aprint(), and copied.
+ *
+ * @return 1 if the node produced output (which may be empty), 0 if it
+ *	produced nothing, i.e. xlat_aprint() would return NULL, or -1 on error.
+ */
+static int xlat_stream_node(xlat_buff_t *out, REQUEST *request, xlat_exp_t const *node,
+			    RADIUS_ESCAPE_STRING escape, void *escape_ctx, int lvl)
+{
+	int rcode;
+	char *str;
+	char value[2048];
+
+	switch (node->type) {
+	case XLAT_LITERAL:
+		if (xlat_buff_append(out, node->fmt, strlen(node->fmt)) < 0) return -1;
+		return 1;
+
+	case XLAT_CONSTANT:
+		if (xlat_buff_escape(out, request, node->fmt, escape, escape_ctx) < 0) return -1;
+		return 1;
+
+	case XLAT_ATTRIBUTE:
+		rcode = xlat_stream_attr(value, sizeof(value), request, node);
+		if (rcode < 0) goto aprint;
+		if (rcode == 0) return 0;
+
+		if (xlat_buff_escape(out, request, value, escape, escape_ctx) < 0) return -1;
+		return 1;
+
+	case XLAT_MODULE:
+	{
+		xlat_buff_t child;
+		char child_buffer[2048];
+		ssize_t slen;
+
+		/*
+		 *	The input is escaped with the module's
+		 *	function, not ours.
+		 */
+		xlat_buff_init(&child, child_buffer, sizeof(child_buffer));
+		if (xlat_stream(&child, request, node->child, node->xlat->escape, node->xlat->instance, lvl + 1) < 0) {
+			xlat_buff_free(&child);
+			return -1;
+		}
+
+		if (child.len == 0) {
+			xlat_buff_free(&child);
+			return 0;
+		}
+
+		xlat_unescape(child.buffer);
+
+		/*
+		 *	Unescaped output can go straight into the
+		 *	buffer.
+		 */
+		if (!escape) {
+			if (xlat_buff_reserve(out, 2048) < 0) {
+				xlat_buff_free(&child);
+				return -1;
+			}
+
+			slen = node->xlat->func(node->xlat->instance, request, child.buffer,
+						out->buffer + out->len, 2048);
+			xlat_buff_free(&child);
+			if (slen < 0) {
+				out->buffer[out->len] = '\0';
+				return 0;
+			}
+
+			out->len += strlen(out->buffer + out->len);
+			return 1;
+		}
+
+		value[0] = '\0';
+		slen = node->xlat->func(node->xlat->instance, request, child.buffer, value, sizeof(value));
+		xlat_buff_free(&child);
+		if (slen < 0) return 0;
+
+		if (xlat_buff_escape(out, request, value, escape, escape_ctx) < 0) return -1;
+		return 1;
+	}
+
+	/*
+	 *	The chosen expansion is escaped twice, as with
+	 *	xlat_aprint().
+	 */
+	case XLAT_ALTERNATE:
+	{
+		xlat_buff_t tmp;
+
+		if (!escape) {
+			rcode = xlat_stream_node(out, request, node->child, escape, escape_ctx, lvl);
+			if (rcode != 0) return rcode;
+
+			return xlat_stream_node(out, request, node->alternate, escape, escape_ctx, lvl);
+		}
+
+		xlat_buff_init(&tmp, value, sizeof(value));
+		rcode = xlat_stream_node(&tmp, request, node->child, escape, escape_ctx, lvl);
+		if (rcode == 0) rcode = xlat_stream_node(&tmp, request, node->alternate, escape, escape_ctx, lvl);
+
+		if ((rcode > 0) && (xlat_buff_escape(out, request, tmp.buffer, escape, escape_ctx) < 0)) rcode = -1;
+		xlat_buff_free(&tmp);
+
+		return rcode;
+	}
+
+	default:
+		break;
+	}
+
+aprint:
+	str = xlat_aprint(request, request, node, escape, escape_ctx, lvl);
+	if (!str) return 0;
+
+	rcode = xlat_buff_append(out, str, strlen(str));
+	talloc_free(str);
+	if (rcode < 0) return -1;
+
+	return 1;
+}
+
+/** Expand a list of nodes into the output buffer
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int xlat_stream(xlat_buff_t *out, REQUEST *request, xlat_exp_t const *head,
+		       RADIUS_ESCAPE_STRING escape, void *escape_ctx, int lvl)
+{
+	xlat_exp_t const *node;
+
+	for (node = head; node != NULL; node = node->next) {
+		if (xlat_stream_node(out, request, node, escape, escape_ctx, lvl) < 0) return -1;
+	}
+
+	return 0;
+}
+
 /** Replace %whatever in a string.
  *
  * See 'doc/variables.txt' for more information.
@@ -2243,30 +2959,62 @@ static size_t xlat_process(char **out, REQUEST *request, xlat_exp_t const * cons
  * @param[in] node the xlat structure to expand
  * @param[in] escape function to escape final value e.g. SQL quoting.
  * @param[in] escape_ctx pointer to pass to escape function.
+ * @param[in] fmt the string which node was parsed from, or NULL, for tracing.
  * @return length of string written @bug should really have -1 for failure
  */
 static ssize_t xlat_expand_struct(char **out, size_t outlen, REQUEST *request, xlat_exp_t const *node,
-				  RADIUS_ESCAPE_STRING escape, void *escape_ctx)
+				  RADIUS_ESCAPE_STRING escape, void *escape_ctx, char const *fmt)
 {
-	char *buff;
-	ssize_t len;
+	xlat_buff_t *b, local;
+	char local_buffer[2048];
+	int rcode;
+	int span;
 
 	rad_assert(node != NULL);
 
-	len = xlat_process(&buff, request, node, escape, escape_ctx);
-	if ((len < 0) || !buff) {
-		rad_assert(buff == NULL);
-		if (*out) *out[0] = '\0';
-		return len;
+	span = trace_span_start(request, TRACE_SPAN_XLAT, "xlat");
+	if (span >= 0) trace_span_attr(request, span, "freeradius.xlat", "%s", fmt ? fmt : (node->fmt ? node->fmt : ""));
+
+	/*
+	 *	Expand into this thread's buffer, and copy the result
+	 *	out once.  If an xlat function is expanding its own
+	 *	string, use a local buffer instead.  The per-thread
+	 *	buffer belongs to this thread, so the request can't
+	 *	give up the thread while using it.
+	 */
+	b = xlat_buff_acquire();
+	if (!b) {
+		xlat_buff_init(&local, local_buffer, sizeof(local_buffer));
+		b = &local;
+	} else {
+		thread_pool_yield_block(true);
 	}
 
-	if (!*out) {
-		*out = buff;
+	rcode = xlat_stream(b, request, node, escape, escape_ctx, 0);
+	if (rcode == 0) {
+		if (!*out) {
+			*out = talloc_memdup(request, b->buffer, b->len + 1);
+			if (*out) talloc_set_type(*out, char);
+		} else {
+			strlcpy(*out, b->buffer, outlen);
+		}
+	}
+
+	if (b == &local) {
+		xlat_buff_free(&local);
 	} else {
-		strlcpy(*out, buff, outlen);
-		talloc_free(buff);
+		xlat_buff_release(b);
+		thread_pool_yield_block(false);
 	}
 
+	if ((rcode < 0) || !*out) {
+		if (*out) *out[0] = '\0';
+		trace_span_end(request, span, true);
+		return -1;
+	}
+
+	trace_span_end(request, span, false);
+
 	return strlen(*out);
 }
 
@@ -2290,6 +3038,27 @@ static ssize_t xlat_expand(char **out, size_t outlen, REQUEST *request, char con
 {
 	ssize_t len;
 	xlat_exp_t *node;
+	rbtree_t *cache;
+
+	/*
+	 *	Strings from the configuration have already been
+	 *	tokenized.
+	 */
+	cache = XLAT_CACHE_LOAD();
+	if (cache) {
+		xlat_cache_t *entry, my_entry;
+
+		my_entry.fmt = fmt;
+		entry = rbtree_finddata(cache, &my_entry);
+		if (entry) {
+			len = xlat_expand_struct(out, outlen, request, entry->head, escape, escape_ctx, fmt);
+
+			RDEBUG2("EXPAND %s", fmt);
+			RDEBUG2("   --> %s", *out);
+
+			return len;
+		}
+	}
 
 	/*
 	 *	Give better errors than the old code.
@@ -2309,7 +3078,7 @@ static ssize_t xlat_expand(char **out, size_t outlen, REQUEST *request, char con
 		return -1;
 	}
 
-	len = xlat_expand_struct(out, outlen, request, node, escape, escape_ctx);
+	len = xlat_expand_struct(out, outlen, request, node, escape, escape_ctx, fmt);
 	talloc_free(node);
 
 	RDEBUG2("EXPAND %s", fmt);
@@ -2358,5 +3127,5 @@ ssize_t radius_axlat(char **out, REQUEST *request, char const *fmt, RADIUS_ESCAP
 
 ssize_t radius_axlat_struct(char **out, REQUEST *request, xlat_exp_t const *xlat, RADIUS_ESCAPE_STRING escape, void *ctx)
 {
-	return xlat_expand_struct(out, 0, request, xlat, escape, ctx);
+	return xlat_expand_struct(out, 0, request, xlat, escape, ctx, NULL);
 }
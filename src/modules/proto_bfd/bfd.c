@@ -63,19 +63,36 @@ typedef enum bfd_auth_type_t {
 
 #define BFD_AUTH_INVALID (BFD_AUTH_MET_KEYED_SHA1 + 1)
 
+/*
+ *	All of the sessions on a socket share one timer wheel.  The
+ *	wheel covers ~5s, longer timers just stay in their slot until
+ *	their tick comes around.
+ */
+#define BFD_WHEEL_SLOTS (1024)
+#define BFD_WHEEL_TICK (5000)	/* usec */
+
+/*
+ *	Packets sent in one tick are sent together.
+ */
+#define BFD_SEND_BATCH (64)
+
+typedef struct bfd_timer_t {
+	struct bfd_timer_t	*next;
+	struct bfd_timer_t	**prev_next;	//!< Where we're linked from, NULL if not armed.
+	uint64_t		tick;		//!< When the timer fires.
+	fr_event_callback_t	callback;
+	void			*ctx;
+} bfd_timer_t;
+
+typedef struct bfd_engine_t bfd_engine_t;
+
 typedef struct bfd_state_t {
 	int		number;
 	int		sockfd;
 
-	fr_event_list_t *el;
+	bfd_engine_t	*engine;
 	const char	*server;
 
-#ifdef HAVE_PTHREAD_H
-	bool		blocked;
-	int		pipefd[2];
-	pthread_t	pthread_id;
-#endif
-
 	bfd_auth_type_t auth_type;
 	uint8_t		secret[BFD_MAX_SECRET_LENGTH];
 	size_t		secret_len;
@@ -91,8 +108,8 @@ typedef struct bfd_state_t {
 	struct sockaddr_storage remote_sockaddr;
 	socklen_t	salen;
 
-	fr_event_t	*ev_timeout;
-	fr_event_t	*ev_packet;
+	bfd_timer_t	ev_timeout;
+	bfd_timer_t	ev_packet;
 	struct timeval	last_recv;
 	struct timeval	next_recv;
 	struct timeval	last_sent;
@@ -129,6 +146,12 @@ typedef struct bfd_state_t {
 	int		detection_timeouts;
 
 	int		passive;
+
+#ifdef WITH_PROXY
+	home_server_t	**home_servers;		//!< Whose liveness follows this session.
+	int		num_home_servers;
+	bool		home_up;		//!< Last state given to the home servers.
+#endif
 } bfd_state_t;
 
 typedef struct bfd_auth_basic_t {
@@ -227,8 +250,31 @@ typedef struct bfd_socket_t {
 	size_t		secret_len;
 
 	rbtree_t	*session_tree;
+	bfd_engine_t	*engine;
 } bfd_socket_t;
 
+/*
+ *	Runs all of the sessions for one socket.
+ */
+struct bfd_engine_t {
+	int		sockfd;
+
+	uint64_t	tick;				//!< Next tick to process.
+	bfd_timer_t	*wheel[BFD_WHEEL_SLOTS];
+
+	int		num_queued;			//!< Packets waiting to be sent.
+	bfd_packet_t	queued[BFD_SEND_BATCH];
+	bfd_state_t	*queued_session[BFD_SEND_BATCH];
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t	mutex;
+	pthread_t	pthread_id;
+	bool		running;
+#else
+	fr_event_t	*ev_tick;
+#endif
+};
+
 static int bfd_start_packets(bfd_state_t *session);
 static int bfd_start_control(bfd_state_t *session);
 static int bfd_stop_control(bfd_state_t *session);
@@ -245,126 +291,282 @@ void bfd_init(fr_event_list_t *xel)
 }
 
 
-#ifdef HAVE_PTHREAD_H
-static void bfd_pthread_free(bfd_state_t *session)
+#ifndef HAVE_PTHREAD_H
+#  define pthread_mutex_lock(_x)
+#  define pthread_mutex_unlock(_x)
+#endif
+
+static uint64_t bfd_timeval_to_tick(struct timeval const *when)
+{
+	return ((((uint64_t) when->tv_sec) * USEC) + when->tv_usec) / BFD_WHEEL_TICK;
+}
+
+/*
+ *	Insert a timer into the wheel, replacing any previous
+ *	setting.  Timers in the past fire on the next tick.
+ */
+static void bfd_timer_insert(bfd_engine_t *engine, bfd_timer_t *timer,
+			     fr_event_callback_t callback, void *ctx,
+			     struct timeval const *when)
 {
-	session->blocked = true;
+	bfd_timer_t **slot;
 
-	close(session->pipefd[0]);
-	close(session->pipefd[1]);
+	if (timer->prev_next) {
+		*timer->prev_next = timer->next;
+		if (timer->next) timer->next->prev_next = timer->prev_next;
+	}
+
+	timer->callback = callback;
+	timer->ctx = ctx;
+	timer->tick = bfd_timeval_to_tick(when);
+	if (timer->tick < engine->tick) timer->tick = engine->tick;
 
-	talloc_free(session->el);
+	slot = &engine->wheel[timer->tick % BFD_WHEEL_SLOTS];
+	timer->next = *slot;
+	if (timer->next) timer->next->prev_next = &timer->next;
+	timer->prev_next = slot;
+	*slot = timer;
+}
 
-	session->el = NULL;
-	session->pipefd[0] = session->pipefd[1] = -1;
+static void bfd_timer_delete(bfd_timer_t *timer)
+{
+	if (!timer->prev_next) return;
 
-	session->blocked = false;
+	*timer->prev_next = timer->next;
+	if (timer->next) timer->next->prev_next = timer->prev_next;
+
+	timer->next = NULL;
+	timer->prev_next = NULL;
 }
 
 /*
- *	A child thread reads the packet from a pipe, and processes it.
+ *	Send all of the queued packets.
  */
-static void bfd_pipe_recv(UNUSED fr_event_list_t *xel, int fd, void *ctx)
+static void bfd_engine_flush(bfd_engine_t *engine)
 {
-	ssize_t num;
-	bfd_state_t *session = ctx;
-	bfd_packet_t bfd;
+	int i;
+#ifdef HAVE_SENDMMSG
+	struct mmsghdr	msgs[BFD_SEND_BATCH];
+	struct iovec	iov[BFD_SEND_BATCH];
+	int		sent = 0;
+#endif
+
+	if (!engine->num_queued) return;
+
+#ifdef HAVE_SENDMMSG
+	memset(msgs, 0, sizeof(msgs[0]) * engine->num_queued);
+
+	for (i = 0; i < engine->num_queued; i++) {
+		bfd_state_t *session = engine->queued_session[i];
+
+		iov[i].iov_base = &engine->queued[i];
+		iov[i].iov_len = engine->queued[i].length;
+		msgs[i].msg_hdr.msg_name = &session->remote_sockaddr;
+		msgs[i].msg_hdr.msg_namelen = session->salen;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	while (sent < engine->num_queued) {
+		int rcode;
 
-	if (session->blocked) return;
+		rcode = sendmmsg(engine->sockfd, msgs + sent, engine->num_queued - sent, 0);
+		if (rcode < 0) {
+			if (errno == EINTR) continue;
+
+			ERROR("Failed sending packet: %s", fr_syserror(errno));
+
+			/*
+			 *	Skip the packet which failed, and
+			 *	send the rest.
+			 */
+			rcode = 1;
+		}
+		sent += rcode;
+	}
+#else
+	for (i = 0; i < engine->num_queued; i++) {
+		bfd_state_t *session = engine->queued_session[i];
+
+		if (sendto(engine->sockfd, &engine->queued[i], engine->queued[i].length, 0,
+			   (struct sockaddr *) &session->remote_sockaddr,
+			   session->salen) < 0) {
+			ERROR("Failed sending packet: %s", fr_syserror(errno));
+		}
+	}
+#endif
+
+	engine->num_queued = 0;
+}
+
+/*
+ *	Queue a packet to be sent at the end of this tick.
+ */
+static void bfd_engine_queue(bfd_state_t *session, bfd_packet_t const *bfd)
+{
+	bfd_engine_t *engine = session->engine;
+
+	if (engine->num_queued == BFD_SEND_BATCH) bfd_engine_flush(engine);
+
+	memcpy(&engine->queued[engine->num_queued], bfd, bfd->length);
+	engine->queued_session[engine->num_queued] = session;
+	engine->num_queued++;
+}
+
+/*
+ *	Fire all of the timers up to and including "now", and send
+ *	any packets they queued.
+ */
+static void bfd_engine_run(bfd_engine_t *engine, struct timeval const *now)
+{
+	int		slots;
+	uint64_t	now_tick;
+	bfd_timer_t	*expired = NULL, *timer, *next;
+
+	now_tick = bfd_timeval_to_tick(now);
+	if (now_tick < engine->tick) return;
 
 	/*
-	 *	Read the header
+	 *	If we've fallen more than a full turn behind, every
+	 *	slot only needs to be looked at once.
 	 */
-	num = read(fd, &bfd, 4);
-	if ((num < 4) || (bfd.length < 4)) {
-	fail:
-		ERROR("BFD Failed reading from pipe!");
-		session->blocked = true;
-		return;
-	}
+	slots = BFD_WHEEL_SLOTS;
+	if ((now_tick - engine->tick) < BFD_WHEEL_SLOTS) slots = (now_tick - engine->tick) + 1;
 
 	/*
-	 *	Read the rest of the packet.
+	 *	Move the expired timers to a separate list, so that
+	 *	callbacks can add and delete timers.
 	 */
-	num = read(fd, ((uint8_t *) &bfd) + 4, bfd.length - 4);
-	if ((num < 0) || ((num + 4) != bfd.length)) goto fail;
+	while (slots--) {
+		for (timer = engine->wheel[engine->tick % BFD_WHEEL_SLOTS];
+		     timer != NULL;
+		     timer = next) {
+			next = timer->next;
 
-	bfd_process(session, &bfd);
+			if (timer->tick > now_tick) continue;
+
+			*timer->prev_next = timer->next;
+			if (timer->next) timer->next->prev_next = timer->prev_next;
+
+			timer->next = expired;
+			if (expired) expired->prev_next = &timer->next;
+			timer->prev_next = &expired;
+			expired = timer;
+		}
+		engine->tick++;
+	}
+	engine->tick = now_tick + 1;
+
+	while ((timer = expired) != NULL) {
+		bfd_timer_delete(timer);
+		timer->callback(timer->ctx);
+	}
+
+	bfd_engine_flush(engine);
 }
 
+#ifdef HAVE_PTHREAD_H
 /*
- *	Do nothing more than read from the sockets and process the
- *	timers.
+ *	Do nothing more than process the timers.  Packets are
+ *	received by the main thread.
  */
-static void *bfd_child_thread(void *ctx)
+static void *bfd_engine_thread(void *ctx)
 {
-	bfd_state_t *session = ctx;
+	bfd_engine_t *engine = ctx;
+	struct timeval now;
 
-	DEBUG("BFD %d starting child thread", session->number);
-	bfd_start_control(session);
+	while (engine->running) {
+		gettimeofday(&now, NULL);
 
-	fr_event_loop(session->el);
+		pthread_mutex_lock(&engine->mutex);
+		bfd_engine_run(engine, &now);
+		pthread_mutex_unlock(&engine->mutex);
 
-	bfd_pthread_free(session);
+		/*
+		 *	Wake up at the start of the next tick.
+		 */
+		usleep(BFD_WHEEL_TICK - (now.tv_usec % BFD_WHEEL_TICK));
+	}
 
 	return NULL;
 }
-
-
-static int bfd_pthread_create(bfd_state_t *session)
+#else
+static void bfd_engine_tick(void *ctx)
 {
-	int rcode;
-	pthread_attr_t attr;
+	bfd_engine_t *engine = ctx;
+	struct timeval now;
 
-	if (pipe(session->pipefd) < 0) {
-		ERROR("Failed opening pipe: %s", fr_syserror(errno));
-		return 0;
-	}
+	gettimeofday(&now, NULL);
+	bfd_engine_run(engine, &now);
 
-	session->el = fr_event_list_create(session, NULL);
-	if (!session->el) {
-		ERROR("Failed creating event list");
-	close_pipes:
-		close(session->pipefd[0]);
-		close(session->pipefd[1]);
-		session->pipefd[0] = session->pipefd[1] = -1;
-		return 0;
+	now.tv_usec += BFD_WHEEL_TICK - (now.tv_usec % BFD_WHEEL_TICK);
+	if (now.tv_usec >= USEC) {
+		now.tv_sec++;
+		now.tv_usec -= USEC;
 	}
 
-#ifdef O_NONBLOCK
-	fcntl(session->pipefd[0], F_SETFL, O_NONBLOCK | FD_CLOEXEC);
-	fcntl(session->pipefd[1], F_SETFL, O_NONBLOCK | FD_CLOEXEC);
+	if (!fr_event_insert(el, bfd_engine_tick, engine, &now, &engine->ev_tick)) {
+		rad_assert("Failed to insert event" == NULL);
+	}
+}
 #endif
 
-	if (!fr_event_fd_insert(session->el, 0, session->pipefd[0],
-				bfd_pipe_recv, session)) {
-		ERROR("Failed inserting file descriptor into event list: %s", fr_strerror());
-		goto close_pipes;
-	}
+static int bfd_engine_start(bfd_engine_t *engine)
+{
+#ifdef HAVE_PTHREAD_H
+	int rcode;
 
-	pthread_attr_init(&attr);
-	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	engine->running = true;
 
-	/*
-	 *	Create the thread detached, so that it cleans up it's
-	 *	own memory when it exits.
-	 *
-	 *	Note that the function returns non-zero on error, NOT
-	 *	-1.  The return code is the error, and errno isn't set.
-	 */
-	rcode = pthread_create(&session->pthread_id, &attr,
-			       bfd_child_thread, session);
+	rcode = pthread_create(&engine->pthread_id, NULL, bfd_engine_thread, engine);
 	if (rcode != 0) {
-		talloc_free(session->el);
-		session->el = NULL;
+		engine->running = false;
 		ERROR("Thread create failed: %s", fr_syserror(rcode));
-		goto close_pipes;
+		return -1;
+	}
+#else
+	if (!el) {
+		ERROR("BFD needs threads, or an event list");
+		return -1;
 	}
-	pthread_attr_destroy(&attr);
 
-	return 1;
+	bfd_engine_tick(engine);
+#endif
+
+	return 0;
+}
+
+static void bfd_engine_stop(bfd_engine_t *engine)
+{
+#ifdef HAVE_PTHREAD_H
+	if (!engine->running) return;
+
+	engine->running = false;
+	pthread_join(engine->pthread_id, NULL);
+#else
+	fr_event_delete(el, &engine->ev_tick);
+#endif
+}
+
+static bfd_engine_t *bfd_engine_create(TALLOC_CTX *ctx, int sockfd)
+{
+	bfd_engine_t *engine;
+	struct timeval now;
+
+	engine = talloc_zero(ctx, bfd_engine_t);
+	if (!engine) return NULL;
+
+	engine->sockfd = sockfd;
+
+	gettimeofday(&now, NULL);
+	engine->tick = bfd_timeval_to_tick(&now);
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_init(&engine->mutex, NULL);
+#endif
+
+	return engine;
 }
-#endif	/* HAVE_PTHREAD_H */
 
 
 static const char *bfd_state[] = {
@@ -391,12 +593,57 @@ static void bfd_request(bfd_state_t *session, REQUEST *request,
 }
 
 
+#ifdef WITH_PROXY
+/*
+ *	Tell the home servers when the session goes up, or comes
+ *	down from up.  Until it's been up, we don't know anything
+ *	the proxy doesn't.
+ */
+static void bfd_home_update(bfd_state_t *session)
+{
+	int i;
+	bool up = (session->session_state == BFD_STATE_UP);
+
+	if (up == session->home_up) return;
+
+	session->home_up = up;
+
+	for (i = 0; i < session->num_home_servers; i++) {
+		home_server_bfd_update(session->home_servers[i], up);
+	}
+}
+
+static int bfd_home_server_cb(void *ctx, void *data)
+{
+	bfd_state_t *session = ctx;
+	home_server_t *home = data;
+	home_server_t **home_servers;
+
+	if (!home->bfd || (fr_ipaddr_cmp(&home->ipaddr, &session->remote_ipaddr) != 0)) return 0;
+
+	home_servers = talloc_realloc(session, session->home_servers, home_server_t *,
+				      session->num_home_servers + 1);
+	if (!home_servers) return 1;
+
+	home_servers[session->num_home_servers++] = home;
+	session->home_servers = home_servers;
+
+	DEBUG("BFD %d controls liveness of home server %s", session->number, home->name);
+
+	return 0;
+}
+#endif
+
 static void bfd_trigger(bfd_state_t *session)
 {
 	RADIUS_PACKET packet;
 	REQUEST request;
 	char buffer[256];
 
+#ifdef WITH_PROXY
+	bfd_home_update(session);
+#endif
+
 	snprintf(buffer, sizeof(buffer), "server.bfd.%s",
 		 bfd_state[session->session_state]);
 
@@ -410,14 +657,8 @@ static void bfd_session_free(void *ctx)
 {
 	bfd_state_t *session = ctx;
 
-#ifdef WITH_PTHREAD_H
-	if (el != session->el) {
-		/*
-		 *	FIXME: this isn't particularly safe.
-		 */
-		bfd_pthread_free(session);
-	}
-#endif
+	bfd_timer_delete(&session->ev_timeout);
+	bfd_timer_delete(&session->ev_packet);
 
 	talloc_free(session);
 }
@@ -571,27 +812,27 @@ static bfd_state_t *bfd_new_session(bfd_socket_t *sock, int sockfd,
 		return NULL;
 	}
 
-	bfd_trigger(session);
-
+#ifdef WITH_PROXY
 	/*
-	 *	Check for threaded / non-threaded operation.
+	 *	Home servers with "bfd = yes" and the same address
+	 *	are marked dead / alive along with the session.
 	 */
-	if (el) {
-		session->el = el;
+	session->home_up = true;
+	if (home_server_walk(bfd_home_server_cb, session) != 0) {
+		ERROR("Failed linking home servers to BFD session");
+		rbtree_deletebydata(sock->session_tree, session);
+		return NULL;
+	}
+#endif
 
-		bfd_start_control(session);
+	bfd_trigger(session);
 
-#ifdef HAVE_PTHREAD_H
-		session->pipefd[0] = session->pipefd[1] = -1;
-		session->pthread_id = pthread_self();
-	} else {
-		if (!bfd_pthread_create(session)) {
-			rbtree_deletebydata(sock->session_tree, session);
-			talloc_free(session);
-			return NULL;
-		}
-#endif
-	}
+	/*
+	 *	The engine isn't running yet, so we don't need to lock
+	 *	it.
+	 */
+	session->engine = sock->engine;
+	bfd_start_control(session);
 
 	return session;
 }
@@ -878,11 +1119,7 @@ static void bfd_send_packet(void *ctx)
 
 	DEBUG("BFD %d sending packet state %s",
 	      session->number, bfd_state[session->session_state]);
-	if (sendto(session->sockfd, &bfd, bfd.length, 0,
-		   (struct sockaddr *) &session->remote_sockaddr,
-		   session->salen) < 0) {
-		ERROR("Failed sending packet: %s", fr_syserror(errno));
-	}
+	bfd_engine_queue(session, &bfd);
 }
 
 static int bfd_start_packets(bfd_state_t *session)
@@ -894,7 +1131,7 @@ static int bfd_start_packets(bfd_state_t *session)
 	/*
 	 *	Reset the timers.
 	 */
-	fr_event_delete(session->el, &session->ev_packet);
+	bfd_timer_delete(&session->ev_packet);
 
 	gettimeofday(&session->last_sent, NULL);
 	now = session->last_sent;
@@ -929,10 +1166,7 @@ static int bfd_start_packets(bfd_state_t *session)
 		now.tv_usec -= USEC;
 	}
 
-	if (!fr_event_insert(session->el, bfd_send_packet, session, &now,
-			     &session->ev_packet)) {
-		rad_assert("Failed to insert event" == NULL);
-	}
+	bfd_timer_insert(session->engine, &session->ev_packet, bfd_send_packet, session, &now);
 
 	return 0;
 }
@@ -942,7 +1176,7 @@ static void bfd_set_timeout(bfd_state_t *session, struct timeval *when)
 {
 	struct timeval now = *when;
 
-	fr_event_delete(session->el, &session->ev_timeout);
+	bfd_timer_delete(&session->ev_timeout);
 
 	if (session->detection_time >= USEC) {
 		now.tv_sec += session->detection_time / USEC;
@@ -970,10 +1204,7 @@ static void bfd_set_timeout(bfd_state_t *session, struct timeval *when)
 		}
 	}
 
-	if (!fr_event_insert(session->el, bfd_detection_timeout, session, &now,
-			     &session->ev_timeout)) {
-		rad_assert("Failed to insert event" == NULL);
-	}
+	bfd_timer_insert(session->engine, &session->ev_timeout, bfd_detection_timeout, session, &now);
 }
 
 
@@ -996,15 +1227,15 @@ static int bfd_start_control(bfd_state_t *session)
 
 	bfd_set_timeout(session, &session->last_recv);
 
-	if (session->ev_packet) return 0;
+	if (session->ev_packet.prev_next) return 0;
 
 	return bfd_start_packets(session);
 }
 
 static int bfd_stop_control(bfd_state_t *session)
 {
-	fr_event_delete(session->el, &session->ev_timeout);
-	fr_event_delete(session->el, &session->ev_packet);
+	bfd_timer_delete(&session->ev_timeout);
+	bfd_timer_delete(&session->ev_packet);
 	return 1;
 }
 
@@ -1049,8 +1280,8 @@ static int bfd_stop_poll(bfd_state_t *session)
 	 *	re-set the timers.
 	 */
 	if (!session->remote_demand_mode) {
-		rad_assert(session->ev_timeout != NULL);
-		rad_assert(session->ev_packet != NULL);
+		rad_assert(session->ev_timeout.prev_next != NULL);
+		rad_assert(session->ev_packet.prev_next != NULL);
 		session->doing_poll = 0;
 
 		bfd_stop_control(session);
@@ -1151,11 +1382,7 @@ static void bfd_poll_response(bfd_state_t *session)
 
 	bfd_sign(session, &bfd);
 
-	if (sendto(session->sockfd, &bfd, bfd.length, 0,
-		   (struct sockaddr *) &session->remote_sockaddr,
-		   session->salen) < 0) {
-		ERROR("Failed sending poll response: %s", fr_syserror(errno));
-	}
+	bfd_engine_queue(session, &bfd);
 }
 
 
@@ -1504,42 +1731,17 @@ static int bfd_socket_recv(rad_listen_t *listener)
 		return 0;
 	}
 
-#ifdef HAVE_PTHREAD_H
-	if (!el) {
-		uint8_t *p = (uint8_t *) &bfd;
-		size_t total = bfd.length;
 
-		/*
-		 *	A child has had a problem.  Do some cleanups.
-		 */
-		if (session->blocked) bfd_pthread_free(session);
-
-		/*
-		 *	No event list, try to create a new one.
-		 */
-		if (!session->el && !bfd_pthread_create(session)) {
-			DEBUG("BFD %d - error trying to create child thread",
-			      session->number);
-			return 0;
-		}
-
-		do {
-			rcode = write(session->pipefd[1], p, total);
-			if ((rcode < 0) && (errno == EINTR)) continue;
-
-			if (rcode < 0) {
-				session->blocked = true;
-				return 0;
-			}
+	pthread_mutex_lock(&sock->engine->mutex);
+	bfd_process(session, &bfd);
 
-			total -= rcode;
-			p += rcode;
-		} while (total > 0);
-		return 0;
-	}
-#endif
+	/*
+	 *	Poll responses are sent now, not on the next tick.
+	 */
+	bfd_engine_flush(sock->engine);
+	pthread_mutex_unlock(&sock->engine->mutex);
 
-	return bfd_process(session, &bfd);
+	return 0;
 }
 
 static int bfd_parse_ip_port(CONF_SECTION *cs, fr_ipaddr_t *ipaddr, uint16_t *port)
@@ -1645,6 +1847,8 @@ static void bfd_socket_free(rad_listen_t *this)
 {
 	bfd_socket_t *sock = this->data;
 
+	if (sock->engine) bfd_engine_stop(sock->engine);
+
 	rbtree_free(sock->session_tree);
 	talloc_free(sock);
 	this->data = NULL;
@@ -1867,6 +2071,12 @@ static int bfd_socket_parse(CONF_SECTION *cs, rad_listen_t *this)
 		exit(1);
 	}
 
+	sock->engine = bfd_engine_create(sock, this->fd);
+	if (!sock->engine) {
+		ERROR("Failed creating BFD engine!");
+		exit(1);
+	}
+
 	/*
 	 *	Bootstrap the initial set of connections.
 	 */
@@ -1874,6 +2084,10 @@ static int bfd_socket_parse(CONF_SECTION *cs, rad_listen_t *this)
 		exit(1);
 	}
 
+	if (bfd_engine_start(sock->engine) < 0) {
+		exit(1);
+	}
+
 	return 0;
 }
 
@@ -1 +1 @@
-SUBMAKEFILES := proto_dhcp.mk rlm_dhcp.mk dhcpclient.mk
+SUBMAKEFILES := proto_dhcp.mk rlm_dhcp.mk rlm_dhcp_lease.mk dhcpclient.mk
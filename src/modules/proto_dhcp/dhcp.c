@@ -42,6 +42,13 @@ RCSID("$Id$")
 #include <net/if_arp.h>
 #endif
 
+#ifdef WITH_DHCP_RAW
+#include <net/if.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#include <linux/filter.h>
+#endif
+
 #define DHCP_CHADDR_LEN	(16)
 #define DHCP_SNAME_LEN	(64)
 #define DHCP_FILE_LEN	(128)
@@ -210,87 +217,43 @@ static uint8_t *dhcp_get_option(dhcp_packet_t *packet, size_t packet_size,
 }
 
 /*
- *	DHCPv4 is only for IPv4.  Broadcast only works if udpfromto is
- *	defined.
+ *	Check a received packet, and fill in the fields the rest of
+ *	the server uses to identify it.
  */
-RADIUS_PACKET *fr_dhcp_recv(int sockfd)
+static int dhcp_packet_check(RADIUS_PACKET *packet)
 {
-	uint32_t		magic;
-	struct sockaddr_storage	src;
-	struct sockaddr_storage	dst;
-	socklen_t		sizeof_src;
-	socklen_t		sizeof_dst;
-	RADIUS_PACKET		*packet;
-	uint16_t		port;
-	uint8_t			*code;
-	ssize_t			data_len;
+	uint32_t	magic;
+	uint8_t		*code;
 
-	packet = rad_alloc(NULL, false);
-	if (!packet) {
-		fr_strerror_printf("Failed allocating packet");
-		return NULL;
-	}
-
-	packet->data = talloc_zero_array(packet, uint8_t, MAX_PACKET_SIZE);
-	if (!packet->data) {
-		fr_strerror_printf("Out of memory");
-		rad_free(&packet);
-		return NULL;
-	}
-
-	packet->sockfd = sockfd;
-	sizeof_src = sizeof(src);
-#ifdef WITH_UDPFROMTO
-	sizeof_dst = sizeof(dst);
-	data_len = recvfromto(sockfd, packet->data, MAX_PACKET_SIZE, 0,
-			      (struct sockaddr *)&src, &sizeof_src,
-			      (struct sockaddr *)&dst, &sizeof_dst);
-#else
-	data_len = recvfrom(sockfd, packet->data, MAX_PACKET_SIZE, 0,
-			    (struct sockaddr *)&src, &sizeof_src);
-#endif
-
-	if (data_len <= 0) {
-		fr_strerror_printf("Failed reading DHCP socket: %s", fr_syserror(errno));
-		rad_free(&packet);
-		return NULL;
-	}
-
-	packet->data_len = data_len;
 	if (packet->data_len < MIN_PACKET_SIZE) {
 		fr_strerror_printf("DHCP packet is too small (%zu < %d)",
 				   packet->data_len, MIN_PACKET_SIZE);
-		rad_free(&packet);
-		return NULL;
+		return -1;
 	}
 
 	if (packet->data_len > MAX_PACKET_SIZE) {
 		fr_strerror_printf("DHCP packet is too large (%zx > %d)",
 				   packet->data_len, MAX_PACKET_SIZE);
-		rad_free(&packet);
-		return NULL;
+		return -1;
 	}
 
 	if (packet->data[1] != 1) {
 		fr_strerror_printf("DHCP can only receive ethernet requests, not type %02x",
 		      packet->data[1]);
-		rad_free(&packet);
-		return NULL;
+		return -1;
 	}
 
 	if (packet->data[2] != 6) {
 		fr_strerror_printf("Ethernet HW length is wrong length %d",
 			packet->data[2]);
-		rad_free(&packet);
-		return NULL;
+		return -1;
 	}
 
 	memcpy(&magic, packet->data + 236, 4);
 	magic = ntohl(magic);
 	if (magic != DHCP_OPTION_MAGIC_NUMBER) {
 		fr_strerror_printf("Cannot do BOOTP");
-		rad_free(&packet);
-		return NULL;
+		return -1;
 	}
 
 	/*
@@ -303,14 +266,12 @@ RADIUS_PACKET *fr_dhcp_recv(int sockfd)
 			       packet->data_len, 53);
 	if (!code) {
 		fr_strerror_printf("No message-type option was found in the packet");
-		rad_free(&packet);
-		return NULL;
+		return -1;
 	}
 
 	if ((code[1] < 1) || (code[2] == 0) || (code[2] > 8)) {
 		fr_strerror_printf("Unknown value for message-type option");
-		rad_free(&packet);
-		return NULL;
+		return -1;
 	}
 
 	packet->code = code[2] | PW_DHCP_OFFSET;
@@ -343,6 +304,88 @@ RADIUS_PACKET *fr_dhcp_recv(int sockfd)
 	 *	FIXME: More checks, like DHCP packet type?
 	 */
 
+	return 0;
+}
+
+static void dhcp_packet_debug(RADIUS_PACKET *packet)
+{
+	char type_buf[64];
+	char const *name = type_buf;
+	char src_ip_buf[256], dst_ip_buf[256];
+
+	if (fr_debug_flag <= 1) return;
+
+	if ((packet->code >= PW_DHCP_DISCOVER) &&
+	    (packet->code <= PW_DHCP_INFORM)) {
+		name = dhcp_message_types[packet->code - PW_DHCP_OFFSET];
+	} else {
+		snprintf(type_buf, sizeof(type_buf), "%d",
+			 packet->code - PW_DHCP_OFFSET);
+	}
+
+	DEBUG("Received %s of Id %08x from %s:%d to %s:%d\n",
+	       name, (unsigned int) packet->id,
+	       inet_ntop(packet->src_ipaddr.af,
+			 &packet->src_ipaddr.ipaddr,
+			 src_ip_buf, sizeof(src_ip_buf)),
+	       packet->src_port,
+	       inet_ntop(packet->dst_ipaddr.af,
+			 &packet->dst_ipaddr.ipaddr,
+			 dst_ip_buf, sizeof(dst_ip_buf)),
+	       packet->dst_port);
+}
+
+/*
+ *	DHCPv4 is only for IPv4.  Broadcast only works if udpfromto is
+ *	defined.
+ */
+RADIUS_PACKET *fr_dhcp_recv(int sockfd)
+{
+	struct sockaddr_storage	src;
+	struct sockaddr_storage	dst;
+	socklen_t		sizeof_src;
+	socklen_t		sizeof_dst;
+	RADIUS_PACKET		*packet;
+	uint16_t		port;
+	ssize_t			data_len;
+
+	packet = rad_alloc(NULL, false);
+	if (!packet) {
+		fr_strerror_printf("Failed allocating packet");
+		return NULL;
+	}
+
+	packet->data = talloc_zero_array(packet, uint8_t, MAX_PACKET_SIZE);
+	if (!packet->data) {
+		fr_strerror_printf("Out of memory");
+		rad_free(&packet);
+		return NULL;
+	}
+
+	packet->sockfd = sockfd;
+	sizeof_src = sizeof(src);
+#ifdef WITH_UDPFROMTO
+	sizeof_dst = sizeof(dst);
+	data_len = recvfromto(sockfd, packet->data, MAX_PACKET_SIZE, 0,
+			      (struct sockaddr *)&src, &sizeof_src,
+			      (struct sockaddr *)&dst, &sizeof_dst);
+#else
+	data_len = recvfrom(sockfd, packet->data, MAX_PACKET_SIZE, 0,
+			    (struct sockaddr *)&src, &sizeof_src);
+#endif
+
+	if (data_len <= 0) {
+		fr_strerror_printf("Failed reading DHCP socket: %s", fr_syserror(errno));
+		rad_free(&packet);
+		return NULL;
+	}
+
+	packet->data_len = data_len;
+	if (dhcp_packet_check(packet) < 0) {
+		rad_free(&packet);
+		return NULL;
+	}
+
 	sizeof_dst = sizeof(dst);
 
 #ifndef WITH_UDPFROMTO
@@ -362,34 +405,89 @@ RADIUS_PACKET *fr_dhcp_recv(int sockfd)
 	fr_sockaddr2ipaddr(&src, sizeof_src, &packet->src_ipaddr, &port);
 	packet->src_port = port;
 
-	if (fr_debug_flag > 1) {
-		char type_buf[64];
-		char const *name = type_buf;
-		char src_ip_buf[256], dst_ip_buf[256];
+	dhcp_packet_debug(packet);
 
-		if ((packet->code >= PW_DHCP_DISCOVER) &&
-		    (packet->code <= PW_DHCP_INFORM)) {
-			name = dhcp_message_types[packet->code - PW_DHCP_OFFSET];
-		} else {
-			snprintf(type_buf, sizeof(type_buf), "%d",
-				 packet->code - PW_DHCP_OFFSET);
-		}
+	return packet;
+}
+
+#ifdef WITH_RADIUS_BATCH
+/** Turn a datagram read by rad_batch_recv() into a DHCP packet
+ *
+ * The same as fr_dhcp_recv(), but the datagram has already been read.
+ */
+RADIUS_PACKET *fr_dhcp_batch_packet(rad_batch_t *batch, int i)
+{
+	RADIUS_PACKET	*packet;
+	uint8_t		*data;
+	ssize_t		data_len;
+
+	packet = rad_alloc(NULL, false);
+	if (!packet) {
+		fr_strerror_printf("Failed allocating packet");
+		return NULL;
+	}
+
+	data_len = rad_batch_data(batch, i, packet, &data);
+	if (data_len < 0) {
+	error:
+		rad_free(&packet);
+		return NULL;
+	}
 
-		DEBUG("Received %s of Id %08x from %s:%d to %s:%d\n",
-		       name, (unsigned int) packet->id,
-		       inet_ntop(packet->src_ipaddr.af,
-				 &packet->src_ipaddr.ipaddr,
-				 src_ip_buf, sizeof(src_ip_buf)),
-		       packet->src_port,
-		       inet_ntop(packet->dst_ipaddr.af,
-				 &packet->dst_ipaddr.ipaddr,
-				 dst_ip_buf, sizeof(dst_ip_buf)),
-		       packet->dst_port);
+	if (data_len > MAX_PACKET_SIZE) {
+		fr_strerror_printf("DHCP packet is too large (%zx > %d)",
+				   (size_t) data_len, MAX_PACKET_SIZE);
+		goto error;
 	}
 
+	packet->data = talloc_memdup(packet, data, data_len);
+	if (!packet->data) {
+		fr_strerror_printf("Out of memory");
+		goto error;
+	}
+	packet->data_len = data_len;
+
+	if (dhcp_packet_check(packet) < 0) goto error;
+
+	dhcp_packet_debug(packet);
+
 	return packet;
 }
+#endif
+
+static void dhcp_send_debug(RADIUS_PACKET *packet)
+{
+	char type_buf[64];
+	char const *name = type_buf;
+#ifdef WITH_UDPFROMTO
+	char src_ip_buf[INET6_ADDRSTRLEN];
+#endif
+	char dst_ip_buf[INET6_ADDRSTRLEN];
+
+	if (fr_debug_flag <= 1) return;
 
+	if ((packet->code >= PW_DHCP_DISCOVER) &&
+	    (packet->code <= PW_DHCP_INFORM)) {
+		name = dhcp_message_types[packet->code - PW_DHCP_OFFSET];
+	} else {
+		snprintf(type_buf, sizeof(type_buf), "%d",
+		    packet->code - PW_DHCP_OFFSET);
+	}
+
+	DEBUG(
+#ifdef WITH_UDPFROMTO
+	"Sending %s Id %08x from %s:%d to %s:%d\n",
+#else
+	"Sending %s Id %08x to %s:%d\n",
+#endif
+	   name, (unsigned int) packet->id,
+#ifdef WITH_UDPFROMTO
+	   inet_ntop(packet->src_ipaddr.af, &packet->src_ipaddr.ipaddr, src_ip_buf, sizeof(src_ip_buf)),
+	   packet->src_port,
+#endif
+	   inet_ntop(packet->dst_ipaddr.af, &packet->dst_ipaddr.ipaddr, dst_ip_buf, sizeof(dst_ip_buf)),
+	   packet->dst_port);
+}
 
 /*
  *	Send a DHCP packet.
@@ -414,36 +512,7 @@ int fr_dhcp_send(RADIUS_PACKET *packet)
 		return -1;
 	}
 
-	if (fr_debug_flag > 1) {
-		char type_buf[64];
-		char const *name = type_buf;
-#ifdef WITH_UDPFROMTO
-		char src_ip_buf[INET6_ADDRSTRLEN];
-#endif
-		char dst_ip_buf[INET6_ADDRSTRLEN];
-
-		if ((packet->code >= PW_DHCP_DISCOVER) &&
-		    (packet->code <= PW_DHCP_INFORM)) {
-			name = dhcp_message_types[packet->code - PW_DHCP_OFFSET];
-		} else {
-			snprintf(type_buf, sizeof(type_buf), "%d",
-			    packet->code - PW_DHCP_OFFSET);
-		}
-
-		DEBUG(
-#ifdef WITH_UDPFROMTO
-		"Sending %s Id %08x from %s:%d to %s:%d\n",
-#else
-		"Sending %s Id %08x to %s:%d\n",
-#endif
-		   name, (unsigned int) packet->id,
-#ifdef WITH_UDPFROMTO
-		   inet_ntop(packet->src_ipaddr.af, &packet->src_ipaddr.ipaddr, src_ip_buf, sizeof(src_ip_buf)),
-		   packet->src_port,
-#endif
-		   inet_ntop(packet->dst_ipaddr.af, &packet->dst_ipaddr.ipaddr, dst_ip_buf, sizeof(dst_ip_buf)),
-		   packet->dst_port);
-	}
+	dhcp_send_debug(packet);
 
 #ifndef WITH_UDPFROMTO
 	/*
@@ -459,48 +528,355 @@ int fr_dhcp_send(RADIUS_PACKET *packet)
 #endif
 }
 
-static int fr_dhcp_attr2vp(TALLOC_CTX *ctx, VALUE_PAIR **vp_p, uint8_t const *p, size_t alen);
+#ifdef WITH_RADIUS_BATCH
+/** Queue an encoded DHCP packet, to be sent by rad_batch_flush()
+ *
+ */
+int fr_dhcp_queue(rad_batch_t *batch, RADIUS_PACKET *packet)
+{
+	if (packet->data_len == 0) {
+		fr_strerror_printf("No data to send");
+		return -1;
+	}
 
-/** Returns the number of array members for arrays with fixed element sizes
+	dhcp_send_debug(packet);
+
+	return rad_batch_queue(batch, packet);
+}
+#endif
+
+#ifdef WITH_DHCP_RAW
+/** Open an AF_PACKET socket for sending replies on an interface
+ *
+ * @param[in] interface to send on.
+ * @param[out] ifindex of the interface.
+ * @param[out] mac address of the interface, DHCP_HW_ADDR_LEN bytes.
+ * @return the socket, or -1 on error.
+ */
+int fr_dhcp_raw_open(char const *interface, int *ifindex, uint8_t *mac)
+{
+	int		fd;
+	struct ifreq	ifr;
+
+	if (!interface) {
+		fr_strerror_printf("No interface specified.  Cannot send raw packets");
+		return -1;
+	}
+
+	fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_IP));
+	if (fd < 0) {
+		fr_strerror_printf("Failed opening packet socket: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	memset(&ifr, 0, sizeof(ifr));
+	strlcpy(ifr.ifr_name, interface, sizeof(ifr.ifr_name));
+
+	if (ioctl(fd, SIOCGIFINDEX, &ifr) < 0) {
+		fr_strerror_printf("Failed getting index of interface %s: %s", interface, fr_syserror(errno));
+	error:
+		close(fd);
+		return -1;
+	}
+	*ifindex = ifr.ifr_ifindex;
+
+	if (ioctl(fd, SIOCGIFHWADDR, &ifr) < 0) {
+		fr_strerror_printf("Failed getting hardware address of interface %s: %s",
+				   interface, fr_syserror(errno));
+		goto error;
+	}
+
+	if (ifr.ifr_hwaddr.sa_family != ARPHRD_ETHER) {
+		fr_strerror_printf("Interface %s is not an ethernet interface", interface);
+		goto error;
+	}
+	memcpy(mac, ifr.ifr_hwaddr.sa_data, DHCP_HW_ADDR_LEN);
+
+	/*
+	 *	We only send on it.
+	 */
+	{
+		struct sock_filter	drop = { 0x06, 0, 0, 0 };	/* ret #0 */
+		struct sock_fprog	prog = { 1, &drop };
+
+		(void) setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog));
+	}
+
+	return fd;
+}
+
+static uint32_t ip_checksum_add(uint32_t sum, uint8_t const *data, size_t len)
+{
+	while (len > 1) {
+		sum += (data[0] << 8) | data[1];
+		data += 2;
+		len -= 2;
+	}
+	if (len) sum += data[0] << 8;
+
+	return sum;
+}
+
+static uint16_t ip_checksum_fold(uint32_t sum)
+{
+	while (sum >> 16) sum = (sum & 0xffff) + (sum >> 16);
+
+	return htons(~sum & 0xffff);
+}
+
+/** Send a DHCP reply to a client as an ethernet frame
  *
+ * The frame goes to the client's hardware address (or to the ethernet
+ * broadcast address, if the IP destination is broadcast), so the
+ * kernel doesn't need an ARP entry for an address the client doesn't
+ * have yet.
+ *
+ * @param fd from fr_dhcp_raw_open().
+ * @param ifindex from fr_dhcp_raw_open().
+ * @param mac of the interface, from fr_dhcp_raw_open().
+ * @param packet to send, already encoded.
+ * @return the number of bytes of DHCP data sent, or -1 on error.
  */
-static int fr_dhcp_array_members(size_t *len, DICT_ATTR const *da)
+int fr_dhcp_send_raw(int fd, int ifindex, uint8_t const *mac, RADIUS_PACKET *packet)
 {
-	int num_entries = 1;
+	uint8_t			frame[14 + 20 + 8 + MAX_PACKET_SIZE];
+	uint8_t			*ip, *udp;
+	uint8_t			dst_mac[DHCP_HW_ADDR_LEN];
+	uint16_t		ip_len, udp_len, csum;
+	uint32_t		sum;
+	struct sockaddr_ll	sll;
+	ssize_t			rcode;
+
+	if ((packet->data_len == 0) || (packet->data_len > MAX_PACKET_SIZE)) {
+		fr_strerror_printf("Invalid packet length %zu", packet->data_len);
+		return -1;
+	}
+
+	if ((packet->src_ipaddr.af != AF_INET) || (packet->dst_ipaddr.af != AF_INET)) {
+		fr_strerror_printf("Raw packets can only be sent for IPv4");
+		return -1;
+	}
+
+	if (packet->dst_ipaddr.ipaddr.ip4addr.s_addr == htonl(INADDR_BROADCAST)) {
+		memset(dst_mac, 0xff, sizeof(dst_mac));
+	} else {
+		memcpy(dst_mac, packet->data + 28, sizeof(dst_mac));	/* chaddr */
+	}
+
+	dhcp_send_debug(packet);
+
+	udp_len = 8 + packet->data_len;
+	ip_len = 20 + udp_len;
+
+	/*
+	 *	Ethernet header.
+	 */
+	memcpy(frame, dst_mac, DHCP_HW_ADDR_LEN);
+	memcpy(frame + 6, mac, DHCP_HW_ADDR_LEN);
+	frame[12] = 0x08;
+	frame[13] = 0x00;
+
+	/*
+	 *	IPv4 header, no options, don't fragment.
+	 */
+	ip = frame + 14;
+	memset(ip, 0, 20);
+	ip[0] = 0x45;
+	ip[2] = ip_len >> 8;
+	ip[3] = ip_len & 0xff;
+	ip[6] = 0x40;
+	ip[8] = 64;			/* TTL */
+	ip[9] = IPPROTO_UDP;
+	memcpy(ip + 12, &packet->src_ipaddr.ipaddr.ip4addr.s_addr, 4);
+	memcpy(ip + 16, &packet->dst_ipaddr.ipaddr.ip4addr.s_addr, 4);
+	csum = ip_checksum_fold(ip_checksum_add(0, ip, 20));
+	memcpy(ip + 10, &csum, 2);
 
 	/*
-	 *	Could be an array of bytes, integers, etc.
+	 *	UDP header, checksummed over the pseudo header.
 	 */
-	if (da->flags.array) switch (da->type) {
+	udp = ip + 20;
+	udp[0] = packet->src_port >> 8;
+	udp[1] = packet->src_port & 0xff;
+	udp[2] = packet->dst_port >> 8;
+	udp[3] = packet->dst_port & 0xff;
+	udp[4] = udp_len >> 8;
+	udp[5] = udp_len & 0xff;
+	udp[6] = udp[7] = 0;
+	memcpy(udp + 8, packet->data, packet->data_len);
+
+	sum = ip_checksum_add(0, ip + 12, 8);
+	sum += IPPROTO_UDP + udp_len;
+	sum = ip_checksum_add(sum, udp, udp_len);
+	csum = ip_checksum_fold(sum);
+	if (csum == 0) csum = 0xffff;
+	memcpy(udp + 6, &csum, 2);
+
+	memset(&sll, 0, sizeof(sll));
+	sll.sll_family = AF_PACKET;
+	sll.sll_protocol = htons(ETH_P_IP);
+	sll.sll_ifindex = ifindex;
+	sll.sll_halen = DHCP_HW_ADDR_LEN;
+	memcpy(sll.sll_addr, dst_mac, DHCP_HW_ADDR_LEN);
+
+	rcode = sendto(fd, frame, 14 + ip_len, 0, (struct sockaddr *) &sll, sizeof(sll));
+	if (rcode < 0) {
+		fr_strerror_printf("Failed sending raw packet: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	return packet->data_len;
+}
+#endif	/* WITH_DHCP_RAW */
+
+static int fr_dhcp_attr2vp(TALLOC_CTX *ctx, VALUE_PAIR **vp_p, uint8_t const *p, size_t alen);
+
+/** Returns the size of array members for arrays with fixed element sizes
+ *
+ * @return the member size, or 0 if the attribute isn't a fixed size array.
+ */
+static uint8_t fr_dhcp_array_stride(DICT_ATTR const *da)
+{
+	if (!da->flags.array) return 0;
+
+	switch (da->type) {
 	case PW_TYPE_BYTE:
-		num_entries = *len;
-		*len = 1;
-		break;
+		return 1;
 
-	case PW_TYPE_SHORT: /* ignore any trailing data */
-		num_entries = *len >> 1;
-		*len = 2;
-		break;
+	case PW_TYPE_SHORT:
+		return 2;
 
 	case PW_TYPE_IPV4_ADDR:
 	case PW_TYPE_INTEGER:
-	case PW_TYPE_DATE: /* ignore any trailing data */
-		num_entries = *len >> 2;
-		*len = 4;
-		break;
+	case PW_TYPE_DATE:
+		return 4;
 
 	case PW_TYPE_IPV6_ADDR:
-		num_entries = *len >> 4;
-		*len = 16;
-		break;
+		return 16;
 
 	default:
-		break;
+		return 0;
 	}
+}
+
+/** Returns the number of array members for arrays with fixed element sizes
+ *
+ * Any trailing data which doesn't make up a whole member is ignored.
+ */
+static int fr_dhcp_array_members(size_t *len, uint8_t stride)
+{
+	int num_entries;
+
+	if (!stride) return 1;
+
+	num_entries = *len / stride;
+	*len = stride;
 
 	return num_entries;
 }
 
+/*
+ *	Decode / encode information for one option, built from the
+ *	dictionary by fr_dhcp_init(), so that processing an option
+ *	is an index into a table instead of a dictionary lookup.
+ */
+typedef struct dhcp_option_info {
+	DICT_ATTR const		*da;		//!< Of the option, NULL if it's not in the dictionary.
+	uint8_t			stride;		//!< Size of array members, 0 if not a fixed size array.
+	struct dhcp_option_info	*sub;		//!< Suboptions, indexed by suboption number, for TLVs.
+} dhcp_option_info_t;
+
+static dhcp_option_info_t	dhcp_options[256];
+static DICT_ATTR const		*dhcp_header_attrs[14];
+static bool			dhcp_options_built = false;
+
+/** Build the option tables from the dictionary
+ *
+ * Must be called after dictionary.dhcp has been loaded, and before
+ * any threads start decoding packets.  If it isn't called, options
+ * are looked up in the dictionary as they're decoded.
+ *
+ * @return 0 on success, -1 if dictionary.dhcp hasn't been loaded.
+ */
+int fr_dhcp_init(void)
+{
+	int i, j;
+
+	if (dhcp_options_built) return 0;
+
+	for (i = 0; i < 14; i++) {
+		dhcp_header_attrs[i] = dict_attrbyname(dhcp_header_names[i]);
+		if (!dhcp_header_attrs[i]) {
+			fr_strerror_printf("Missing attribute %s, is dictionary.dhcp loaded?",
+					   dhcp_header_names[i]);
+			return -1;
+		}
+	}
+
+	for (i = 1; i < 255; i++) {
+		dhcp_option_info_t *opt = &dhcp_options[i];
+
+		opt->da = dict_attrbyvalue(i, DHCP_MAGIC_VENDOR);
+		if (!opt->da) continue;
+
+		opt->stride = fr_dhcp_array_stride(opt->da);
+		if (opt->da->type != PW_TYPE_TLV) continue;
+
+		opt->sub = talloc_zero_array(NULL, dhcp_option_info_t, 256);
+		if (!opt->sub) {
+			fr_strerror_printf("Out of memory");
+			return -1;
+		}
+
+		for (j = 1; j < 256; j++) {
+			DICT_ATTR const *da;
+
+			da = dict_attrbyvalue(DHCP_PACK_OPTION1(i, j), DHCP_MAGIC_VENDOR);
+			if (!da) continue;
+
+			opt->sub[j].da = da;
+			opt->sub[j].stride = fr_dhcp_array_stride(da);
+		}
+	}
+
+	dhcp_options_built = true;
+	return 0;
+}
+
+/** Find the attribute for an option or suboption
+ *
+ * @param[out] stride of array members, see fr_dhcp_array_stride().
+ * @param[in] parent TLV, or NULL for a top level option.
+ * @param[in] attr number, including the parent attribute number for suboptions.
+ * @param[in] vendor of the option.
+ * @return the attribute, or NULL if the option isn't in the dictionary.
+ */
+static DICT_ATTR const *dhcp_option_find(uint8_t *stride, DICT_ATTR const *parent, unsigned int attr, unsigned int vendor)
+{
+	DICT_ATTR const *da;
+
+	if (dhcp_options_built && (vendor == DHCP_MAGIC_VENDOR)) {
+		dhcp_option_info_t const *opt = NULL;
+
+		if (!parent) {
+			if (attr < 256) opt = &dhcp_options[attr];
+
+		} else if ((parent->attr < 256) && dhcp_options[parent->attr].sub) {
+			opt = &dhcp_options[parent->attr].sub[DHCP_UNPACK_OPTION1(attr)];
+		}
+
+		if (opt) {
+			*stride = opt->stride;
+			return opt->da;
+		}
+	}
+
+	da = dict_attrbyvalue(attr, vendor);
+	*stride = da ? fr_dhcp_array_stride(da) : 0;
+
+	return da;
+}
+
 /** RFC 4243 Vendor Specific Suboptions
  *
  * Vendor specific suboptions are in the format.
@@ -703,6 +1079,7 @@ static int fr_dhcp_decode_suboption(TALLOC_CTX *ctx, VALUE_PAIR **tlv, uint8_t c
 		uint8_t const	*a_p;
 		size_t		a_len;
 		int		num_entries, i;
+		uint8_t		stride;
 
 		DICT_ATTR const	*da;
 		uint32_t	attr;
@@ -729,7 +1106,7 @@ static int fr_dhcp_decode_suboption(TALLOC_CTX *ctx, VALUE_PAIR **tlv, uint8_t c
 		 *	attributes then it's time to break out %{hex:} and regular
 		 *	expressions.
 		 */
-		da = dict_attrbyvalue(attr, (*tlv)->da->vendor);
+		da = dhcp_option_find(&stride, (*tlv)->da->attr ? (*tlv)->da : NULL, attr, (*tlv)->da->vendor);
 		if (!da) {
 			da = dict_unknown_afrom_fields(ctx, attr, (*tlv)->da->vendor);
 			if (!da) {
@@ -740,7 +1117,7 @@ static int fr_dhcp_decode_suboption(TALLOC_CTX *ctx, VALUE_PAIR **tlv, uint8_t c
 
 		a_len = p[1];
 		a_p = p + 2;
-		num_entries = fr_dhcp_array_members(&a_len, da);
+		num_entries = fr_dhcp_array_members(&a_len, stride);
 		for (i = 0; i < num_entries; i++) {
 			vp = pairalloc(ctx, da);
 			if (!vp) {
@@ -945,6 +1322,7 @@ ssize_t fr_dhcp_decode_options(TALLOC_CTX *ctx, VALUE_PAIR **out, uint8_t const
 		uint8_t const	*a_p;
 		size_t		a_len;
 		int		num_entries, i;
+		uint8_t		stride;
 
 		DICT_ATTR const	*da;
 
@@ -966,7 +1344,7 @@ ssize_t fr_dhcp_decode_options(TALLOC_CTX *ctx, VALUE_PAIR **out, uint8_t const
 		 *	Unknown attribute, create an octets type
 		 *	attribute with the contents of the sub-option.
 		 */
-		da = dict_attrbyvalue(p[0], DHCP_MAGIC_VENDOR);
+		da = dhcp_option_find(&stride, NULL, p[0], DHCP_MAGIC_VENDOR);
 		if (!da) {
 			da = dict_unknown_afrom_fields(ctx, p[0], DHCP_MAGIC_VENDOR);
 			if (!da) {
@@ -988,7 +1366,7 @@ ssize_t fr_dhcp_decode_options(TALLOC_CTX *ctx, VALUE_PAIR **out, uint8_t const
 		 *	Array type sub-option create a new VALUE_PAIR
 		 *	for each array element.
 		 */
-		num_entries = fr_dhcp_array_members(&a_len, da);
+		num_entries = fr_dhcp_array_members(&a_len, stride);
 		for (i = 0; i < num_entries; i++) {
 			vp = pairalloc(ctx, da);
 			if (!vp) {
@@ -1051,7 +1429,12 @@ int fr_dhcp_decode(RADIUS_PACKET *packet)
 	for (i = 0; i < 14; i++) {
 		char *q;
 
-		vp = pairmake(packet, NULL, dhcp_header_names[i], NULL, T_OP_EQ);
+		if (dhcp_options_built) {
+			vp = pairalloc(packet, dhcp_header_attrs[i]);
+			if (vp) vp->op = T_OP_EQ;
+		} else {
+			vp = pairmake(packet, NULL, dhcp_header_names[i], NULL, T_OP_EQ);
+		}
 		if (!vp) {
 			char buffer[256];
 			strlcpy(buffer, fr_strerror(), sizeof(buffer));
@@ -1295,102 +1678,88 @@ static ssize_t fr_dhcp_vp2attr(uint8_t *out, size_t outlen, VALUE_PAIR *vp)
 	return vp->length;
 }
 
-/** Create a new TLV attribute from multiple sub options
+/** Write multiple sub options into a buffer
+ *
+ * The sub options are written directly into the option being encoded,
+ * so no intermediary TLV attribute has to be allocated.
  *
- * @param[in,out] ctx to allocate new attribute in.
+ * @param[out] out where to write the sub options.
+ * @param[in] outlen length of output buffer.
  * @param[in,out] cursor should be set to the start of the list of TLV attributes.
  *   Will be advanced to the first non-TLV attribute.
- * @return attribute holding the concatenation of the values of the sub options.
+ * @return the length of data written, or -1 on error.
  */
-static VALUE_PAIR *fr_dhcp_vp2suboption(TALLOC_CTX *ctx, vp_cursor_t *cursor)
+static ssize_t fr_dhcp_vp2suboption(uint8_t *out, size_t outlen, vp_cursor_t *cursor)
 {
 	ssize_t length;
 	unsigned int parent; 	/* Parent attribute of suboption */
 	uint8_t attr = 0;
-	uint8_t *p, *opt_len = NULL;
-	vp_cursor_t to_pack;
-	VALUE_PAIR *vp, *tlv;
+	uint8_t *p = out, *end = out + outlen, *opt_len = NULL;
+	bool failed = false;
+	VALUE_PAIR *vp;
 
 #define SUBOPTION_PARENT(_x) (_x & 0xffff00ff)
 #define SUBOPTION_ATTR(_x) ((_x & 0xff00) >> 8)
 
 	vp = fr_cursor_current(cursor);
-	if (!vp) return NULL;
+	if (!vp) return -1;
 
 	parent = SUBOPTION_PARENT(vp->da->attr);
-	tlv = paircreate(ctx, parent, DHCP_MAGIC_VENDOR);
-	if (!tlv) return NULL;
-
-	fr_cursor_copy(&to_pack, cursor);
 
 	/*
-	 *  Loop over TLVs to determine how much memory we need to allocate
-	 *
-	 *  We advanced the cursor we were passed, so if we fail encoding,
-	 *  the cursor is at the right position for the next potentially
-	 *  encodable attr.
+	 *  We always advance the cursor past all of the sub options,
+	 *  so if we fail encoding, the cursor is at the right position
+	 *  for the next potentially encodable attr.
 	 */
-	for (vp = fr_cursor_current(cursor);
+	for (;
 	     vp && vp->da->flags.is_tlv && !vp->da->flags.extended && (SUBOPTION_PARENT(vp->da->attr) == parent);
 	     vp = fr_cursor_next(cursor)) {
-		/*
-		 *  If it's not an array type or is an array type, but is not the same
-		 *  as the previous attribute, we add 2 for the additional sub-option
-		 *  header bytes.
-		 */
-		if (!vp->da->flags.array || (SUBOPTION_ATTR(vp->da->attr) != attr)) {
-			attr = SUBOPTION_ATTR(vp->da->attr);
-			tlv->length += 2;
-		}
-		tlv->length += vp->length;
-	}
+		if (failed) continue;
 
-	tlv->vp_tlv = talloc_zero_array(tlv, uint8_t, tlv->length);
-	if (!tlv->vp_tlv) {
-		talloc_free(tlv);
-		return NULL;
-	}
-	p = tlv->vp_tlv;
-
-	attr = 0;
-	for (vp = fr_cursor_current(&to_pack);
-	     vp && vp->da->flags.is_tlv && !vp->da->flags.extended && (SUBOPTION_PARENT(vp->da->attr) == parent);
-	     vp = fr_cursor_next(&to_pack)) {
 		if (SUBOPTION_ATTR(vp->da->attr) == 0) {
 			fr_strerror_printf("Invalid attribute number 0");
-			return NULL;
+			failed = true;
+			continue;
 		}
 
 		/* Don't write out the header, were packing array options */
 		if (!vp->da->flags.array || (attr != SUBOPTION_ATTR(vp->da->attr))) {
+			if ((end - p) < 2) {
+				failed = true;
+				continue;
+			}
+
 			attr = SUBOPTION_ATTR(vp->da->attr);
 			*p++ = attr;
 			opt_len = p++;
+			*opt_len = 0;
 		}
 
-		length = fr_dhcp_vp2attr(p, (tlv->vp_tlv + tlv->length) - p, vp);
-		if ((length < 0) || (length > 255)) {
-			talloc_free(tlv);
-			return NULL;
+		length = fr_dhcp_vp2attr(p, end - p, vp);
+		if ((length < 0) || ((*opt_len + length) > 255)) {
+			failed = true;
+			continue;
 		}
 
 		fr_assert(opt_len);
 		*opt_len += length;
 		p += length;
-	};
+	}
+
+	if (failed) return -1;
 
-	return tlv;
+	return p - out;
 }
 
 /** Encode a DHCP option and any sub-options.
  *
  * @param out Where to write encoded DHCP attributes.
  * @param outlen Length of out buffer.
- * @param ctx to use for any allocated memory.
+ * @param ctx unused, sub-options are written directly into out.
  * @param cursor with current VP set to the option to be encoded. Will be advanced to the next option to encode.
  * @return > 0 length of data written, < 0 error, 0 not valid option (skipping).
  */
-ssize_t fr_dhcp_encode_option(TALLOC_CTX *ctx, uint8_t *out, size_t outlen, vp_cursor_t *cursor)
+ssize_t fr_dhcp_encode_option(UNUSED TALLOC_CTX *ctx, uint8_t *out, size_t outlen, vp_cursor_t *cursor)
 {
 	VALUE_PAIR *vp;
 	DICT_ATTR const *previous;
@@ -1424,40 +1793,36 @@ ssize_t fr_dhcp_encode_option(TALLOC_CTX *ctx, uint8_t *out, size_t outlen, vp_c
 	/* We just consumed two bytes for the header */
 	freespace -= 2;
 
-	/* DHCP options with the same number get coalesced into a single option */
-	do {
-		VALUE_PAIR *tlv = NULL;
-
-		/* Sub option */
-		if (vp->da->flags.is_tlv) {
-			/*
-			 *  Coalesce TLVs into one sub-option.
-			 *  Cursor will be advanced to next non-TLV attribute.
-			 */
-			tlv = vp = fr_dhcp_vp2suboption(ctx, cursor);
+	/*
+	 *  Coalesce TLVs into one option, writing the sub-options
+	 *  directly into the output buffer.  Cursor will be advanced
+	 *  to next non-TLV attribute.
+	 */
+	if (vp->da->flags.is_tlv) {
+		len = fr_dhcp_vp2suboption(p, (freespace < 255) ? freespace : 255, cursor);
 
-			/*
-			 *  Skip if there's an issue coalescing the sub-options.
-			 *  Cursor will still have been advanced to next non-TLV attribute.
-			 */
-			if (!tlv) return 0;
 		/*
-		 *  If not calling fr_dhcp_vp2suboption() advance the cursor, so fr_cursor_current()
-		 *  returns the next attribute.
+		 *  Skip if there's an issue coalescing the sub-options.
 		 */
-		} else {
-			fr_cursor_next(cursor);
-		}
+		if (len < 0) return 0;
+
+		*opt_len = len;
+		p += len;
+
+		return p - out;
+	}
+
+	/* DHCP options with the same number get coalesced into a single option */
+	do {
+		fr_cursor_next(cursor);
 
 		if ((*opt_len + vp->length) > 255) {
 			fr_strerror_printf("Skipping \"%s\": Option splitting not supported "
 					   "(option > 255 bytes)", vp->da->name);
-			talloc_free(tlv);
 			return 0;
 		}
 
 		len = fr_dhcp_vp2attr(p, freespace, vp);
-		talloc_free(tlv);
 		if (len < 0) {
 			/* Failed encoding option */
 			return len;
@@ -71,8 +71,32 @@ typedef struct dhcp_socket_t {
 	RADCLIENT	dhcp_client;
 	char const	*src_interface;
 	fr_ipaddr_t     src_ipaddr;
+
+	bool		raw_send;		//!< Send replies to clients as ethernet frames.
+	int		raw_fd;
+	int		raw_ifindex;
+	uint8_t		raw_mac[DHCP_HW_ADDR_LEN];
 } dhcp_socket_t;
 
+#ifdef WITH_RADIUS_BATCH
+/*
+ *	Largest number of packets read by one call to recvmmsg().
+ */
+#define MAX_RECV_BATCH (64)
+
+/*
+ *	Per-thread state for batched reads, the same as for RADIUS
+ *	listeners.  A thread only reads from one listener at a time.
+ */
+typedef struct dhcp_batch_t {
+	rad_listen_t	*listener;	//!< Listener being read from, or NULL.
+	rad_batch_t	*recv;		//!< Packets read by recvmmsg().
+	rad_batch_t	*send;		//!< Replies queued for sendmmsg().
+} dhcp_batch_t;
+
+fr_thread_local_setup(dhcp_batch_t *, dhcp_batch)	/* macro */
+#endif
+
 #ifdef WITH_UDPFROMTO
 static int dhcprelay_process_client_request(REQUEST *request)
 {
@@ -531,6 +555,18 @@ static int dhcp_process(REQUEST *request)
 		return -1;
 	}
 
+#ifdef WITH_DHCP_RAW
+	/*
+	 *	Replies sent as ethernet frames go to the client's
+	 *	hardware address, so there's no need for an ARP entry.
+	 */
+	if (sock->raw_fd >= 0) {
+		RDEBUG("DHCP: Reply will be unicast to your-ip-address");
+		request->reply->dst_ipaddr.ipaddr.ip4addr.s_addr = vp->vp_ipaddr;
+		return 1;
+	}
+#endif
+
 #ifdef SIOCSARP
 	/*
 	 *	The system is configured to listen for broadcast
@@ -595,6 +631,15 @@ static int dhcp_socket_parse(CONF_SECTION *cs, rad_listen_t *this)
 	rcode = common_socket_parse(cs, this);
 	if (rcode != 0) return rcode;
 
+	/*
+	 *	Build the option tables before any threads start
+	 *	decoding packets.
+	 */
+	if (fr_dhcp_init() < 0) {
+		cf_log_err_cs(cs, "%s", fr_strerror());
+		return -1;
+	}
+
 	if (check_config) return 0;
 
 	sock = this->data;
@@ -651,6 +696,35 @@ static int dhcp_socket_parse(CONF_SECTION *cs, rad_listen_t *this)
 		sock->src_interface = talloc_typed_strdup(sock, sock->lsock.interface);
 	}
 
+	sock->raw_fd = -1;
+	rcode = cf_item_parse(cs, "raw_send", FR_ITEM_POINTER(PW_TYPE_BOOLEAN, &sock->raw_send), "no");
+	if (rcode < 0) return -1;
+
+	if (sock->raw_send) {
+#ifdef WITH_DHCP_RAW
+		/*
+		 *	Packet sockets need CAP_NET_RAW.
+		 */
+		fr_suid_up();
+		sock->raw_fd = fr_dhcp_raw_open(sock->src_interface, &sock->raw_ifindex, sock->raw_mac);
+		fr_suid_down();
+		if (sock->raw_fd < 0) {
+			cf_log_err_cs(cs, "Failed setting up \"raw_send\": %s", fr_strerror());
+			return -1;
+		}
+#else
+		cf_log_err_cs(cs, "\"raw_send\" is not supported on this system");
+		return -1;
+#endif
+	}
+
+#ifdef WITH_RADIUS_BATCH
+	if (this->recv_batch > MAX_RECV_BATCH) {
+		cf_log_err_cs(cs, "Invalid value for \"recv_batch\"");
+		return -1;
+	}
+#endif
+
 	cp = cf_pair_find(cs, "src_ipaddr");
 	if (cp) {
 		memset(&sock->src_ipaddr, 0, sizeof(sock->src_ipaddr));
@@ -679,6 +753,103 @@ static int dhcp_socket_parse(CONF_SECTION *cs, rad_listen_t *this)
 }
 
 
+#ifdef WITH_RADIUS_BATCH
+static void _dhcp_batch_free(void *arg)
+{
+	talloc_free(arg);
+}
+
+/*
+ *	Get this thread's batch buffers, making sure they're large
+ *	enough for the listener.
+ */
+static dhcp_batch_t *dhcp_batch_get(rad_listen_t *listener)
+{
+	int ret;
+	dhcp_batch_t *batch;
+
+	batch = fr_thread_local_init(dhcp_batch, _dhcp_batch_free);
+	if (!batch) {
+		batch = talloc_zero(NULL, dhcp_batch_t);
+		if (!batch) {
+			fr_strerror_printf("out of memory");
+			return NULL;
+		}
+
+		ret = fr_thread_local_set(dhcp_batch, batch);
+		if (ret != 0) {
+			fr_strerror_printf("Failed setting up batch buffers: %s", fr_syserror(ret));
+			talloc_free(batch);
+			return NULL;
+		}
+	}
+
+	if (!batch->recv || (rad_batch_size(batch->recv) < (int) listener->recv_batch)) {
+		TALLOC_FREE(batch->recv);
+		TALLOC_FREE(batch->send);
+
+		batch->recv = rad_batch_alloc(batch, listener->recv_batch);
+		batch->send = rad_batch_alloc(batch, listener->recv_batch);
+		if (!batch->recv || !batch->send) {
+			TALLOC_FREE(batch->recv);
+			TALLOC_FREE(batch->send);
+			return NULL;
+		}
+	}
+
+	return batch;
+}
+
+/*
+ *	Read a batch of packets with one system call.  Replies which
+ *	are generated by this thread while it processes the batch
+ *	are sent together at the end.
+ */
+static int dhcp_socket_recv_batch(rad_listen_t *listener)
+{
+	int		i, num, received = 0;
+	RADIUS_PACKET	*packet;
+	dhcp_socket_t	*sock = listener->data;
+	dhcp_batch_t	*batch;
+
+	batch = dhcp_batch_get(listener);
+	if (!batch) {
+		ERROR("%s", fr_strerror());
+		return 0;
+	}
+
+	num = rad_batch_recv(batch->recv, listener->fd, NULL);
+	if (num <= 0) {
+		if (num < 0) ERROR("%s", fr_strerror());
+		return 0;
+	}
+
+	batch->listener = listener;
+
+	for (i = 0; i < num; i++) {
+		packet = fr_dhcp_batch_packet(batch->recv, i);
+		if (!packet) {
+			ERROR("%s", fr_strerror());
+			continue;
+		}
+
+		if (!request_receive(listener, packet, &sock->dhcp_client, dhcp_process)) {
+			rad_free(&packet);
+			continue;
+		}
+
+		received++;
+	}
+
+	batch->listener = NULL;
+	if (rad_batch_flush(batch->send) < 0) {
+		ERROR("Failed sending reply: %s", fr_strerror());
+	}
+
+	return (received > 0);
+}
+#endif
+
 /*
  *	Check if an incoming request is "ok"
  *
@@ -690,6 +861,10 @@ static int dhcp_socket_recv(rad_listen_t *listener)
 	RADIUS_PACKET	*packet;
 	dhcp_socket_t	*sock;
 
+#ifdef WITH_RADIUS_BATCH
+	if (listener->recv_batch > 1) return dhcp_socket_recv_batch(listener);
+#endif
+
 	packet = fr_dhcp_recv(listener->fd);
 	if (!packet) {
 		ERROR("%s", fr_strerror());
@@ -726,6 +901,25 @@ static int dhcp_socket_send(rad_listen_t *listener, REQUEST *request)
 	sock = listener->data;
 	if (sock->suppress_responses) return 0;
 
+#ifdef WITH_DHCP_RAW
+	/*
+	 *	Replies to relays go through the UDP socket, as the
+	 *	relay has an address, and may not be on this link.
+	 */
+	if ((sock->raw_fd >= 0) && (request->reply->dst_port != sock->lsock.my_port)) {
+		return fr_dhcp_send_raw(sock->raw_fd, sock->raw_ifindex, sock->raw_mac, request->reply);
+	}
+#endif
+
+#ifdef WITH_RADIUS_BATCH
+	if (listener->recv_batch > 1) {
+		dhcp_batch_t *batch;
+
+		batch = fr_thread_local_init(dhcp_batch, _dhcp_batch_free);
+		if (batch && (batch->listener == listener)) return fr_dhcp_queue(batch->send, request->reply);
+	}
+#endif
+
 	return fr_dhcp_send(request->reply);
 }
 
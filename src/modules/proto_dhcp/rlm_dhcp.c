@@ -164,6 +164,11 @@ static int mod_instantiate(UNUSED CONF_SECTION *conf, void *instance)
 		}
 	}
 
+	if (fr_dhcp_init() < 0) {
+		ERROR("rlm_dhcp: %s", fr_strerror());
+		return -1;
+	}
+
 	return 0;
 }
 
@@ -195,4 +200,8 @@ module_t rlm_dhcp = {
 		NULL,		 	/* post-proxy */
 		NULL,			/* post-auth */
 	},
+	0,				/* thread_inst_size */
+	NULL,				/* thread_instantiate */
+	NULL,				/* thread_detach */
+	NULL				/* cache_flush */
 };
@@ -0,0 +1,1211 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License, version 2 if the
+ *   License as published by the Free Software Foundation.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file rlm_dhcp_lease.c
+ * @brief Allocates DHCP leases from memory, and journals them to a file.
+ *
+ * @copyright 2014  The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/modules.h>
+#include <freeradius-devel/dhcp.h>
+#include <freeradius-devel/rad_assert.h>
+
+#include <fcntl.h>
+
+#define LEASE_KEY_LEN		64		//!< Longest Client-Identifier we index.
+#define LEASE_WHEEL_SLOTS	256
+#define LEASE_FREE_BIT(_n)	((uint64_t) 1 << ((_n) & 63))
+#define LEASE_FREE_WORDS(_n)	(((_n) + 63) / 64)
+
+#define LEASE_MAGIC		0x46524c53	/* FRLS */
+#define LEASE_VERSION		1
+
+/*
+ *	Attributes we use which don't have a PW_DHCP_ define.
+ */
+#define DHCP_ROUTER_ADDRESS		3
+#define DHCP_REQUESTED_IP_ADDRESS	50
+#define DHCP_CLIENT_IDENTIFIER		61
+#define DHCP_CLIENT_IP_ADDRESS		263
+#define DHCP_GATEWAY_IP_ADDRESS		266
+#define DHCP_CLIENT_HARDWARE_ADDRESS	267
+
+typedef enum lease_state {
+	LEASE_FREE = 0,				//!< Free, but remembers who had it last.
+	LEASE_OFFERED,				//!< Held for a client we sent an offer to.
+	LEASE_ACTIVE,				//!< Acked.
+	LEASE_DECLINED				//!< In use by something we don't know about.
+} lease_state_t;
+
+/** One per address in a subnet's range
+ *
+ */
+typedef struct dhcp_lease {
+	uint32_t	ipaddr;			//!< In host byte order.
+	lease_state_t	state;
+	time_t		expires;
+
+	uint8_t		key_len;		//!< 0 if the lease has never been given out.
+	uint8_t		key[LEASE_KEY_LEN];	//!< Client-Identifier, or chaddr.
+	bool		indexed;		//!< Whether the key refers to this lease.
+
+	bool		queued;			//!< Whether it's on the timer wheel.
+	uint32_t	slot;
+	struct dhcp_lease *prev;
+	struct dhcp_lease *next;
+} dhcp_lease_t;
+
+/** A subnet, and the leases for its range
+ *
+ * Everything below the configuration is protected by the mutex.
+ */
+typedef struct lease_subnet {
+	char const	*name;
+	fr_ipaddr_t	network_addr;
+	fr_ipaddr_t	range_start_addr;
+	fr_ipaddr_t	range_stop_addr;
+	fr_ipaddr_t	router_addr;
+	uint32_t	lease_time;
+
+	uint32_t	network;		//!< These are all in host byte order.
+	uint32_t	netmask;
+	uint32_t	range_start;
+	uint32_t	range_stop;
+	uint32_t	router;
+
+	uint32_t	num_leases;
+	dhcp_lease_t	*leases;		//!< Indexed by address - range_start.
+	uint64_t	*free;			//!< Bitmap of free leases.
+	uint32_t	free_words;
+	uint32_t	free_hint;		//!< Word where the last free lease was found.
+	uint32_t	num_free;
+	fr_hash_table_t	*keys;			//!< Leases by client key.
+
+	dhcp_lease_t	*wheel[LEASE_WHEEL_SLOTS];	//!< Leases, by the slot they expire in.
+	time_t		wheel_next;		//!< Next slot to expire, in ticks.
+	uint32_t	wheel_tick;		//!< Seconds covered by each slot.
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t	mutex;
+#endif
+} lease_subnet_t;
+
+/** What the journal holds for a lease
+ *
+ * The journal is a header followed by these, appended each time a
+ * lease is acked, released or declined.  The last record for an
+ * address wins.
+ */
+typedef struct lease_record {
+	uint32_t	ipaddr;			//!< In host byte order.
+	uint8_t		state;
+	uint8_t		key_len;
+	uint16_t	pad;
+	int64_t		expires;
+	uint8_t		key[LEASE_KEY_LEN];
+} lease_record_t;
+
+typedef struct lease_header {
+	uint32_t	magic;
+	uint32_t	version;
+} lease_header_t;
+
+/*
+ *	Define a structure for our module configuration.
+ *
+ *	These variables do not need to be in a structure, but it's
+ *	a lot cleaner to do so, and a pointer to the structure can
+ *	be used as the instance handle.
+ */
+typedef struct rlm_dhcp_lease_t {
+	char const	*filename;
+	uint32_t	offer_time;
+	bool		journal_sync;
+
+	lease_subnet_t	**subnets;
+	uint32_t	num_subnets;
+
+	int		fd;			//!< The journal.
+	uint64_t	records;		//!< Records written since the journal was compacted.
+	uint64_t	max_records;		//!< When to compact it again.
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t	journal_mutex;
+	pthread_mutex_t	compact_mutex;
+#endif
+} rlm_dhcp_lease_t;
+
+#ifndef HAVE_PTHREAD_H
+/*
+ *	This is easier than ifdef's throughout the code.
+ */
+#define pthread_mutex_init(_x, _y)
+#define pthread_mutex_destroy(_x)
+#define pthread_mutex_lock(_x)
+#define pthread_mutex_trylock(_x) (0)
+#define pthread_mutex_unlock(_x)
+#endif
+
+static const CONF_PARSER module_config[] = {
+	{ "filename", FR_CONF_OFFSET(PW_TYPE_FILE_OUTPUT | PW_TYPE_REQUIRED, rlm_dhcp_lease_t, filename), NULL },
+	{ "offer_time", FR_CONF_OFFSET(PW_TYPE_INTEGER, rlm_dhcp_lease_t, offer_time), "10" },
+	{ "journal_sync", FR_CONF_OFFSET(PW_TYPE_BOOLEAN, rlm_dhcp_lease_t, journal_sync), "no" },
+
+	{ NULL, -1, 0, NULL, NULL }
+};
+
+static const CONF_PARSER subnet_config[] = {
+	{ "network", FR_CONF_OFFSET(PW_TYPE_IPV4_PREFIX | PW_TYPE_REQUIRED, lease_subnet_t, network_addr), NULL },
+	{ "range_start", FR_CONF_OFFSET(PW_TYPE_IPV4_ADDR, lease_subnet_t, range_start_addr), "0" },
+	{ "range_stop", FR_CONF_OFFSET(PW_TYPE_IPV4_ADDR, lease_subnet_t, range_stop_addr), "0" },
+	{ "router", FR_CONF_OFFSET(PW_TYPE_IPV4_ADDR, lease_subnet_t, router_addr), "0" },
+	{ "lease_time", FR_CONF_OFFSET(PW_TYPE_INTEGER, lease_subnet_t, lease_time), "7200" },
+
+	{ NULL, -1, 0, NULL, NULL }
+};
+
+static uint32_t lease_hash(void const *data)
+{
+	dhcp_lease_t const *lease = data;
+
+	return fr_hash(lease->key, lease->key_len);
+}
+
+static int lease_cmp(void const *one, void const *two)
+{
+	dhcp_lease_t const *a = one;
+	dhcp_lease_t const *b = two;
+
+	if (a->key_len != b->key_len) return a->key_len - b->key_len;
+
+	return memcmp(a->key, b->key, a->key_len);
+}
+
+static bool subnet_contains(lease_subnet_t const *subnet, uint32_t ip)
+{
+	return (ip & subnet->netmask) == subnet->network;
+}
+
+static dhcp_lease_t *subnet_lease(lease_subnet_t *subnet, uint32_t ip)
+{
+	if ((ip < subnet->range_start) || (ip > subnet->range_stop)) return NULL;
+
+	return &subnet->leases[ip - subnet->range_start];
+}
+
+/** Whether an address in the range can never be given out
+ *
+ */
+static bool subnet_excluded(lease_subnet_t const *subnet, uint32_t ip)
+{
+	if (subnet->router && (ip == subnet->router)) return true;
+
+	if (subnet->netmask == 0xffffffff) return false;
+
+	return (ip == subnet->network) || (ip == (subnet->network | ~subnet->netmask));
+}
+
+/*
+ *	The wheel only has to cover the longest a lease is held for
+ *	without being touched.  Leases which expire later than that
+ *	(e.g. from a journal written with a longer lease_time) are
+ *	just checked each time their slot comes round.
+ */
+static void wheel_remove(lease_subnet_t *subnet, dhcp_lease_t *lease)
+{
+	if (!lease->queued) return;
+
+	if (lease->prev) {
+		lease->prev->next = lease->next;
+	} else {
+		subnet->wheel[lease->slot] = lease->next;
+	}
+	if (lease->next) lease->next->prev = lease->prev;
+
+	lease->prev = lease->next = NULL;
+	lease->queued = false;
+}
+
+static void wheel_insert(lease_subnet_t *subnet, dhcp_lease_t *lease)
+{
+	wheel_remove(subnet, lease);
+
+	lease->slot = (lease->expires / subnet->wheel_tick) % LEASE_WHEEL_SLOTS;
+	lease->prev = NULL;
+	lease->next = subnet->wheel[lease->slot];
+	if (lease->next) lease->next->prev = lease;
+	subnet->wheel[lease->slot] = lease;
+	lease->queued = true;
+}
+
+static void key_unindex(lease_subnet_t *subnet, dhcp_lease_t *lease)
+{
+	if (!lease->indexed) return;
+
+	fr_hash_table_delete(subnet->keys, lease);
+	lease->indexed = false;
+}
+
+static void key_index(lease_subnet_t *subnet, dhcp_lease_t *lease, uint8_t const *key, size_t key_len)
+{
+	dhcp_lease_t *old;
+
+	key_unindex(subnet, lease);
+
+	memcpy(lease->key, key, key_len);
+	lease->key_len = key_len;
+
+	/*
+	 *	The key can only refer to one lease, so it loses
+	 *	whichever address it had before.
+	 */
+	old = fr_hash_table_finddata(subnet->keys, lease);
+	if (old) {
+		fr_hash_table_delete(subnet->keys, old);
+		old->indexed = false;
+		if (old->state != LEASE_FREE) {
+			wheel_remove(subnet, old);
+			old->state = LEASE_FREE;
+			subnet->free[(old - subnet->leases) / 64] |= LEASE_FREE_BIT(old - subnet->leases);
+			subnet->num_free++;
+		}
+	}
+
+	if (fr_hash_table_insert(subnet->keys, lease)) lease->indexed = true;
+}
+
+/** Mark a lease as free
+ *
+ * It stays in the index, so its last owner can have it back.
+ */
+static void lease_free(lease_subnet_t *subnet, dhcp_lease_t *lease)
+{
+	uint32_t n = lease - subnet->leases;
+
+	wheel_remove(subnet, lease);
+	if (lease->state == LEASE_FREE) return;
+
+	if (lease->state == LEASE_DECLINED) {
+		key_unindex(subnet, lease);
+		lease->key_len = 0;
+	}
+
+	lease->state = LEASE_FREE;
+	subnet->free[n / 64] |= LEASE_FREE_BIT(n);
+	subnet->num_free++;
+}
+
+static void lease_claim(lease_subnet_t *subnet, dhcp_lease_t *lease)
+{
+	uint32_t n = lease - subnet->leases;
+
+	rad_assert(subnet->free[n / 64] & LEASE_FREE_BIT(n));
+
+	subnet->free[n / 64] &= ~LEASE_FREE_BIT(n);
+	subnet->num_free--;
+}
+
+/** Take any free lease, starting at the word where the last one was found
+ *
+ * Prefers leases which nobody has had before, so returning clients
+ * are more likely to get their old address back.
+ */
+static dhcp_lease_t *lease_claim_any(lease_subnet_t *subnet)
+{
+	uint32_t	i;
+	dhcp_lease_t	*fallback = NULL;
+
+	for (i = 0; i < subnet->free_words; i++) {
+		uint32_t word = (subnet->free_hint + i) % subnet->free_words;
+		uint64_t v = subnet->free[word];
+
+		while (v) {
+			uint32_t n = (word * 64) + __builtin_ctzll(v);
+			dhcp_lease_t *lease = &subnet->leases[n];
+
+			v &= v - 1;
+
+			if (lease->key_len) {
+				if (!fallback) fallback = lease;
+				continue;
+			}
+
+			subnet->free_hint = word;
+			lease_claim(subnet, lease);
+			return lease;
+		}
+	}
+
+	if (fallback) lease_claim(subnet, fallback);
+
+	return fallback;
+}
+
+/** Free leases in the slots of the timer wheel which have passed
+ *
+ * Must be called with the subnet mutex held.
+ */
+static void subnet_expire(lease_subnet_t *subnet, time_t now)
+{
+	time_t		tick, end;
+	uint32_t	num = 0;
+
+	end = now / subnet->wheel_tick;
+	tick = subnet->wheel_next;
+	if ((end - tick) >= LEASE_WHEEL_SLOTS) tick = end - LEASE_WHEEL_SLOTS + 1;
+
+	for (; tick <= end; tick++) {
+		dhcp_lease_t *lease, *next;
+
+		for (lease = subnet->wheel[tick % LEASE_WHEEL_SLOTS]; lease != NULL; lease = next) {
+			next = lease->next;
+
+			if (lease->expires > now) continue;
+
+			lease_free(subnet, lease);
+			num++;
+		}
+	}
+	subnet->wheel_next = end;
+
+	if (num) DEBUG("rlm_dhcp_lease (%s): Expired %u leases", subnet->name, num);
+}
+
+static void lease_to_record(lease_record_t *record, dhcp_lease_t const *lease)
+{
+	memset(record, 0, sizeof(*record));
+	record->ipaddr = lease->ipaddr;
+	record->state = lease->state;
+	record->expires = lease->expires;
+	record->key_len = lease->key_len;
+	memcpy(record->key, lease->key, lease->key_len);
+}
+
+/** Open the journal, and lock it so that only one server uses it
+ *
+ */
+static int journal_open(char const *filename, int flags)
+{
+	int fd;
+
+	fd = open(filename, flags, 0600);
+	if (fd < 0) {
+		ERROR("rlm_dhcp_lease: Failed to open journal %s: %s", filename, fr_syserror(errno));
+		return -1;
+	}
+
+	if (rad_lockfd_nonblock(fd, 0) < 0) {
+		ERROR("rlm_dhcp_lease: Failed to lock journal %s, it may be in use by another process: %s",
+		      filename, fr_syserror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/** Append a lease to the journal
+ *
+ * Must be called with the subnet mutex held, so that the records for
+ * an address are written in the order they happened.
+ */
+static void journal_write(rlm_dhcp_lease_t *inst, dhcp_lease_t const *lease)
+{
+	lease_record_t record;
+
+	lease_to_record(&record, lease);
+
+	pthread_mutex_lock(&inst->journal_mutex);
+	if (inst->fd >= 0) {
+		if (write(inst->fd, &record, sizeof(record)) != sizeof(record)) {
+			ERROR("rlm_dhcp_lease: Failed writing to journal %s: %s", inst->filename, fr_syserror(errno));
+		} else {
+			if (inst->journal_sync) fsync(inst->fd);
+			inst->records++;
+		}
+	}
+	pthread_mutex_unlock(&inst->journal_mutex);
+}
+
+static int write_all(int fd, void const *data, size_t len)
+{
+	uint8_t const *p = data;
+
+	while (len > 0) {
+		ssize_t slen;
+
+		slen = write(fd, p, len);
+		if (slen < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		p += slen;
+		len -= slen;
+	}
+
+	return 0;
+}
+
+/** Replace the journal with one record per lease which matters
+ *
+ * The new journal is written next to the old one, and renamed over
+ * it.  All of the subnets are locked while it's written.
+ */
+static int journal_compact(rlm_dhcp_lease_t *inst)
+{
+	uint32_t	i, j, used = 0;
+	char		tmp[PATH_MAX];
+	int		fd, rcode = -1;
+	lease_header_t	header;
+	lease_record_t	buffer[256];
+	uint64_t	records = 0;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", inst->filename);
+
+	for (i = 0; i < inst->num_subnets; i++) pthread_mutex_lock(&inst->subnets[i]->mutex);
+
+	fd = journal_open(tmp, O_WRONLY | O_CREAT | O_TRUNC);
+	if (fd < 0) goto done;
+
+	header.magic = LEASE_MAGIC;
+	header.version = LEASE_VERSION;
+	if (write_all(fd, &header, sizeof(header)) < 0) goto error;
+
+	for (i = 0; i < inst->num_subnets; i++) {
+		lease_subnet_t *subnet = inst->subnets[i];
+
+		for (j = 0; j < subnet->num_leases; j++) {
+			dhcp_lease_t *lease = &subnet->leases[j];
+
+			/*
+			 *	Offers don't survive a restart, but the
+			 *	client may still get the address back.
+			 */
+			if (!lease->key_len) continue;
+
+			lease_to_record(&buffer[used], lease);
+			if (buffer[used].state == LEASE_OFFERED) buffer[used].state = LEASE_FREE;
+			records++;
+
+			if (++used < (sizeof(buffer) / sizeof(buffer[0]))) continue;
+
+			if (write_all(fd, buffer, used * sizeof(buffer[0])) < 0) goto error;
+			used = 0;
+		}
+	}
+
+	if ((write_all(fd, buffer, used * sizeof(buffer[0])) < 0) || (fsync(fd) < 0)) {
+	error:
+		ERROR("rlm_dhcp_lease: Failed writing journal %s: %s", tmp, fr_syserror(errno));
+		close(fd);
+		unlink(tmp);
+		goto done;
+	}
+
+	if (rename(tmp, inst->filename) < 0) {
+		ERROR("rlm_dhcp_lease: Failed renaming %s to %s: %s", tmp, inst->filename, fr_syserror(errno));
+		close(fd);
+		unlink(tmp);
+		goto done;
+	}
+
+	/*
+	 *	New records are appended to the file we just wrote.
+	 */
+	pthread_mutex_lock(&inst->journal_mutex);
+	if (inst->fd >= 0) close(inst->fd);
+	inst->fd = fd;
+	inst->records = 0;
+	pthread_mutex_unlock(&inst->journal_mutex);
+
+	DEBUG("rlm_dhcp_lease: Compacted journal %s to %" PRIu64 " leases", inst->filename, records);
+	rcode = 0;
+
+done:
+	for (i = inst->num_subnets; i > 0; i--) pthread_mutex_unlock(&inst->subnets[i - 1]->mutex);
+
+	return rcode;
+}
+
+/** Compact the journal if it's grown too large
+ *
+ * Called with no subnet mutexes held.
+ */
+static void journal_check(rlm_dhcp_lease_t *inst)
+{
+	uint64_t records;
+
+	pthread_mutex_lock(&inst->journal_mutex);
+	records = inst->records;
+	pthread_mutex_unlock(&inst->journal_mutex);
+
+	if (records < inst->max_records) return;
+
+	if (pthread_mutex_trylock(&inst->compact_mutex) != 0) return;
+	journal_compact(inst);
+	pthread_mutex_unlock(&inst->compact_mutex);
+}
+
+static lease_subnet_t *subnet_find_ip(rlm_dhcp_lease_t *inst, uint32_t ip)
+{
+	uint32_t i;
+
+	for (i = 0; i < inst->num_subnets; i++) {
+		if (subnet_contains(inst->subnets[i], ip)) return inst->subnets[i];
+	}
+
+	return NULL;
+}
+
+/** Read the journal, and set up the leases from it
+ *
+ */
+static int journal_load(rlm_dhcp_lease_t *inst, time_t now)
+{
+	int		fd;
+	ssize_t		len;
+	lease_header_t	header;
+	lease_record_t	record;
+	uint32_t	i, j;
+	uint64_t	num = 0;
+
+	fd = open(inst->filename, O_RDONLY);
+	if (fd < 0) {
+		if (errno == ENOENT) return 0;
+
+		ERROR("rlm_dhcp_lease: Failed to open journal %s: %s", inst->filename, fr_syserror(errno));
+		return -1;
+	}
+
+	len = read(fd, &header, sizeof(header));
+	if (len == 0) {
+		close(fd);
+		return 0;
+	}
+
+	if ((len != sizeof(header)) || (header.magic != LEASE_MAGIC) || (header.version != LEASE_VERSION)) {
+		ERROR("rlm_dhcp_lease: File %s is not a lease journal", inst->filename);
+		close(fd);
+		return -1;
+	}
+
+	/*
+	 *	A partial record at the end is from a crash part way
+	 *	through a write, and is ignored.
+	 */
+	while ((len = read(fd, &record, sizeof(record))) == sizeof(record)) {
+		lease_subnet_t	*subnet;
+		dhcp_lease_t	*lease;
+
+		subnet = subnet_find_ip(inst, record.ipaddr);
+		if (!subnet) continue;
+
+		lease = subnet_lease(subnet, record.ipaddr);
+		if (!lease || (record.key_len > LEASE_KEY_LEN)) continue;
+
+		lease->state = record.state;
+		lease->expires = record.expires;
+		lease->key_len = record.key_len;
+		memcpy(lease->key, record.key, record.key_len);
+		num++;
+	}
+	close(fd);
+
+	if (len < 0) {
+		ERROR("rlm_dhcp_lease: Failed reading journal %s: %s", inst->filename, fr_syserror(errno));
+		return -1;
+	}
+
+	for (i = 0; i < inst->num_subnets; i++) {
+		lease_subnet_t *subnet = inst->subnets[i];
+
+		for (j = 0; j < subnet->num_leases; j++) {
+			dhcp_lease_t *lease = &subnet->leases[j];
+
+			if (!lease->key_len) continue;
+
+			/*
+			 *	e.g. the router, or a range which has
+			 *	changed since the journal was written.
+			 */
+			if (subnet_excluded(subnet, lease->ipaddr) || (lease->state > LEASE_DECLINED)) {
+				lease->state = LEASE_FREE;
+				lease->key_len = 0;
+				continue;
+			}
+
+			if (lease->state == LEASE_DECLINED) {
+				if (lease->expires > now) continue;
+
+				lease->state = LEASE_FREE;
+				lease->key_len = 0;
+				continue;
+			}
+
+			if (fr_hash_table_insert(subnet->keys, lease)) lease->indexed = true;
+
+			if ((lease->state != LEASE_ACTIVE) || (lease->expires <= now)) lease->state = LEASE_FREE;
+		}
+	}
+
+	DEBUG("rlm_dhcp_lease: Read %" PRIu64 " records from journal %s", num, inst->filename);
+
+	return 0;
+}
+
+static int subnet_parse(rlm_dhcp_lease_t *inst, CONF_SECTION *cs, lease_subnet_t *subnet)
+{
+	uint32_t i, longest;
+
+	if (cf_section_parse(cs, subnet, subnet_config) < 0) return -1;
+
+	subnet->name = cf_section_name2(cs);
+	if (!subnet->name) {
+		cf_log_err_cs(cs, "Subnets must have a name");
+		return -1;
+	}
+
+	subnet->netmask = subnet->network_addr.prefix ? (0xffffffff << (32 - subnet->network_addr.prefix)) : 0;
+	subnet->network = ntohl(subnet->network_addr.ipaddr.ip4addr.s_addr) & subnet->netmask;
+	subnet->range_start = ntohl(subnet->range_start_addr.ipaddr.ip4addr.s_addr);
+	subnet->range_stop = ntohl(subnet->range_stop_addr.ipaddr.ip4addr.s_addr);
+	subnet->router = ntohl(subnet->router_addr.ipaddr.ip4addr.s_addr);
+
+	/*
+	 *	The range defaults to the whole subnet.
+	 */
+	if (!subnet->range_start) subnet->range_start = subnet->network;
+	if (!subnet->range_stop) subnet->range_stop = subnet->network | ~subnet->netmask;
+
+	if ((subnet->range_start > subnet->range_stop) ||
+	    !subnet_contains(subnet, subnet->range_start) || !subnet_contains(subnet, subnet->range_stop)) {
+		cf_log_err_cs(cs, "Invalid range for subnet");
+		return -1;
+	}
+
+	if (subnet->lease_time == 0) {
+		cf_log_err_cs(cs, "lease_time must be greater than 0");
+		return -1;
+	}
+
+	for (i = 0; i < inst->num_subnets; i++) {
+		lease_subnet_t *other = inst->subnets[i];
+
+		if (subnet_contains(other, subnet->network) || subnet_contains(subnet, other->network)) {
+			cf_log_err_cs(cs, "Subnet %s overlaps with subnet %s", subnet->name, other->name);
+			return -1;
+		}
+	}
+
+	subnet->num_leases = subnet->range_stop - subnet->range_start + 1;
+	subnet->leases = talloc_zero_array(subnet, dhcp_lease_t, subnet->num_leases);
+	subnet->free_words = LEASE_FREE_WORDS(subnet->num_leases);
+	subnet->free = talloc_zero_array(subnet, uint64_t, subnet->free_words);
+	subnet->keys = fr_hash_table_create(lease_hash, lease_cmp, NULL);
+	if (!subnet->leases || !subnet->free || !subnet->keys) {
+		cf_log_err_cs(cs, "Out of memory");
+		return -1;
+	}
+
+	for (i = 0; i < subnet->num_leases; i++) {
+		subnet->leases[i].ipaddr = subnet->range_start + i;
+	}
+
+	/*
+	 *	The wheel covers the longest time a lease is held.
+	 */
+	longest = subnet->lease_time > inst->offer_time ? subnet->lease_time : inst->offer_time;
+	subnet->wheel_tick = (longest / LEASE_WHEEL_SLOTS) + 1;
+
+	pthread_mutex_init(&subnet->mutex, NULL);
+
+	return 0;
+}
+
+/*
+ *	Do any per-module initialization that is separate to each
+ *	configured instance of the module.  e.g. set up connections
+ *	to external databases, read configuration files, set up
+ *	dictionary entries, etc.
+ *
+ *	If configuration information is given in the config section
+ *	that must be referenced in later calls, store a handle to it
+ *	in *instance otherwise put a null pointer there.
+ */
+static int mod_instantiate(CONF_SECTION *conf, void *instance)
+{
+	rlm_dhcp_lease_t	*inst = instance;
+	CONF_SECTION		*cs;
+	uint32_t		i, j;
+	uint64_t		total = 0;
+	time_t			now = time(NULL);
+
+	inst->fd = -1;
+
+	pthread_mutex_init(&inst->journal_mutex, NULL);
+	pthread_mutex_init(&inst->compact_mutex, NULL);
+
+	FR_INTEGER_BOUND_CHECK("offer_time", inst->offer_time, >=, 1);
+	FR_INTEGER_BOUND_CHECK("offer_time", inst->offer_time, <=, 3600);
+
+	for (cs = cf_subsection_find_next(conf, NULL, "subnet");
+	     cs != NULL;
+	     cs = cf_subsection_find_next(conf, cs, "subnet")) {
+		lease_subnet_t *subnet;
+
+		subnet = talloc_zero(inst, lease_subnet_t);
+		if (!subnet) return -1;
+
+		if (subnet_parse(inst, cs, subnet) < 0) {
+			if (subnet->keys) fr_hash_table_free(subnet->keys);
+			talloc_free(subnet);
+			return -1;
+		}
+
+		inst->subnets = talloc_realloc(inst, inst->subnets, lease_subnet_t *, inst->num_subnets + 1);
+		inst->subnets[inst->num_subnets++] = subnet;
+		total += subnet->num_leases;
+	}
+
+	if (!inst->num_subnets) {
+		cf_log_err_cs(conf, "At least one 'subnet' section is required");
+		return -1;
+	}
+
+	if (journal_load(inst, now) < 0) return -1;
+
+	/*
+	 *	Now that the leases are set up, build the free bitmaps
+	 *	and the timer wheels from them.
+	 */
+	for (i = 0; i < inst->num_subnets; i++) {
+		lease_subnet_t *subnet = inst->subnets[i];
+
+		subnet->wheel_next = now / subnet->wheel_tick;
+
+		for (j = 0; j < subnet->num_leases; j++) {
+			dhcp_lease_t *lease = &subnet->leases[j];
+
+			if (subnet_excluded(subnet, lease->ipaddr)) continue;
+
+			if (lease->state == LEASE_FREE) {
+				subnet->free[j / 64] |= LEASE_FREE_BIT(j);
+				subnet->num_free++;
+				continue;
+			}
+
+			wheel_insert(subnet, lease);
+		}
+
+		DEBUG("rlm_dhcp_lease (%s): %u of %u addresses are free", subnet->name,
+		      subnet->num_free, subnet->num_leases);
+	}
+
+	/*
+	 *	The journal holds at most one record per address after
+	 *	it's compacted.  Let it grow to a few times that.
+	 */
+	inst->max_records = (total * 4) + 4096;
+
+	return journal_compact(inst);
+}
+
+static int mod_detach(void *instance)
+{
+	rlm_dhcp_lease_t	*inst = instance;
+	uint32_t		i;
+
+	/*
+	 *	Write out the offers as free leases, so the next start
+	 *	has less to read.
+	 */
+	if (inst->fd >= 0) {
+		journal_compact(inst);
+		close(inst->fd);
+		inst->fd = -1;
+	}
+
+	for (i = 0; i < inst->num_subnets; i++) {
+		fr_hash_table_free(inst->subnets[i]->keys);
+		pthread_mutex_destroy(&inst->subnets[i]->mutex);
+	}
+
+	pthread_mutex_destroy(&inst->journal_mutex);
+	pthread_mutex_destroy(&inst->compact_mutex);
+
+	return 0;
+}
+
+static uint32_t request_ipaddr(VALUE_PAIR *vps, unsigned int attr)
+{
+	VALUE_PAIR *vp;
+
+	vp = pairfind(vps, attr, DHCP_MAGIC_VENDOR, TAG_ANY);
+	if (!vp) return 0;
+
+	return ntohl(vp->vp_ipaddr);
+}
+
+/** Get the key identifying the client
+ *
+ * The Client-Identifier if it has one (RFC 2131 Section 4.2), else the
+ * hardware address.
+ */
+static size_t request_key(REQUEST *request, uint8_t *key)
+{
+	VALUE_PAIR *vp;
+
+	vp = pairfind(request->packet->vps, DHCP_CLIENT_IDENTIFIER, DHCP_MAGIC_VENDOR, TAG_ANY);
+	if (vp && (vp->length > 0) && (vp->length <= LEASE_KEY_LEN)) {
+		memcpy(key, vp->vp_octets, vp->length);
+		return vp->length;
+	}
+
+	vp = pairfind(request->packet->vps, DHCP_CLIENT_HARDWARE_ADDRESS, DHCP_MAGIC_VENDOR, TAG_ANY);
+	if (!vp) return 0;
+
+	memcpy(key, vp->vp_ether, sizeof(vp->vp_ether));
+	return sizeof(vp->vp_ether);
+}
+
+/** Find the subnet a request is for
+ *
+ * Pool-Name if it's set, else the relay's address, the client's
+ * address, or the address of the socket the request came in on.
+ */
+static lease_subnet_t *request_subnet(rlm_dhcp_lease_t *inst, REQUEST *request)
+{
+	VALUE_PAIR	*vp;
+	uint32_t	i, ip;
+
+	vp = pairfind(request->config_items, PW_POOL_NAME, 0, TAG_ANY);
+	if (vp) {
+		for (i = 0; i < inst->num_subnets; i++) {
+			if (strcmp(inst->subnets[i]->name, vp->vp_strvalue) == 0) return inst->subnets[i];
+		}
+
+		RDEBUG2("No subnet matches Pool-Name %s", vp->vp_strvalue);
+		return NULL;
+	}
+
+	ip = request_ipaddr(request->packet->vps, DHCP_GATEWAY_IP_ADDRESS);
+	if (!ip) ip = request_ipaddr(request->packet->vps, DHCP_CLIENT_IP_ADDRESS);
+	if (!ip && request->listener) {
+		listen_socket_t *sock = request->listener->data;
+
+		if (sock->my_ipaddr.af == AF_INET) ip = ntohl(sock->my_ipaddr.ipaddr.ip4addr.s_addr);
+	}
+
+	if (ip) return subnet_find_ip(inst, ip);
+
+	if (inst->num_subnets == 1) return inst->subnets[0];
+
+	return NULL;
+}
+
+static void reply_lease(REQUEST *request, lease_subnet_t *subnet, dhcp_lease_t *lease, uint32_t lease_time)
+{
+	VALUE_PAIR *vp;
+
+	pairdelete(&request->reply->vps, PW_DHCP_YOUR_IP_ADDRESS, DHCP_MAGIC_VENDOR, TAG_ANY);
+	vp = radius_paircreate(request->reply, &request->reply->vps, PW_DHCP_YOUR_IP_ADDRESS, DHCP_MAGIC_VENDOR);
+	if (vp) vp->vp_ipaddr = htonl(lease->ipaddr);
+
+	pairdelete(&request->reply->vps, PW_DHCP_IP_ADDRESS_LEASE_TIME, DHCP_MAGIC_VENDOR, TAG_ANY);
+	vp = radius_paircreate(request->reply, &request->reply->vps, PW_DHCP_IP_ADDRESS_LEASE_TIME, DHCP_MAGIC_VENDOR);
+	if (vp) vp->vp_integer = lease_time;
+
+	if (!pairfind(request->reply->vps, PW_DHCP_SUBNET_MASK, DHCP_MAGIC_VENDOR, TAG_ANY)) {
+		vp = radius_paircreate(request->reply, &request->reply->vps, PW_DHCP_SUBNET_MASK, DHCP_MAGIC_VENDOR);
+		if (vp) vp->vp_ipaddr = htonl(subnet->netmask);
+	}
+
+	if (subnet->router && !pairfind(request->reply->vps, DHCP_ROUTER_ADDRESS, DHCP_MAGIC_VENDOR, TAG_ANY)) {
+		vp = radius_paircreate(request->reply, &request->reply->vps, DHCP_ROUTER_ADDRESS, DHCP_MAGIC_VENDOR);
+		if (vp) vp->vp_ipaddr = htonl(subnet->router);
+	}
+}
+
+/*
+ *	Find the client's lease, or pick a new one, and hold it for
+ *	offer_time.
+ */
+static rlm_rcode_t lease_discover(rlm_dhcp_lease_t *inst, REQUEST *request, lease_subnet_t *subnet,
+				  dhcp_lease_t *find)
+{
+	dhcp_lease_t	*lease;
+	uint32_t	requested;
+	char		str[32];
+
+	lease = fr_hash_table_finddata(subnet->keys, find);
+	if (lease && (lease->state == LEASE_DECLINED)) lease = NULL;
+
+	if (lease && (lease->state == LEASE_FREE)) {
+		uint32_t n = lease - subnet->leases;
+
+		if (subnet->free[n / 64] & LEASE_FREE_BIT(n)) {
+			lease_claim(subnet, lease);
+		} else {
+			lease = NULL;
+		}
+	}
+
+	/*
+	 *	Give the client the address it asked for, if it's free.
+	 */
+	if (!lease) {
+		requested = request_ipaddr(request->packet->vps, DHCP_REQUESTED_IP_ADDRESS);
+		if (requested) {
+			lease = subnet_lease(subnet, requested);
+			if (lease) {
+				uint32_t n = lease - subnet->leases;
+
+				if (subnet->free[n / 64] & LEASE_FREE_BIT(n)) {
+					lease_claim(subnet, lease);
+				} else {
+					lease = NULL;
+				}
+			}
+		}
+	}
+
+	if (!lease) lease = lease_claim_any(subnet);
+	if (!lease) {
+		RDEBUG("No free addresses in subnet %s", subnet->name);
+		return RLM_MODULE_NOTFOUND;
+	}
+
+	/*
+	 *	An active lease stays active, and keeps its expiry.
+	 */
+	if (lease->state != LEASE_ACTIVE) {
+		if (!lease->indexed || (lease->key_len != find->key_len) ||
+		    (memcmp(lease->key, find->key, find->key_len) != 0)) {
+			key_index(subnet, lease, find->key, find->key_len);
+		}
+		lease->state = LEASE_OFFERED;
+		lease->expires = request->timestamp + inst->offer_time;
+		wheel_insert(subnet, lease);
+	}
+
+	RDEBUG("Offering %s from subnet %s", ip_ntoa(str, htonl(lease->ipaddr)), subnet->name);
+	reply_lease(request, subnet, lease, subnet->lease_time);
+
+	return RLM_MODULE_UPDATED;
+}
+
+/*
+ *	Ack the address the client asked for, if it's the one it was
+ *	offered (or already has), or if it's free.
+ */
+static rlm_rcode_t lease_request(rlm_dhcp_lease_t *inst, REQUEST *request, lease_subnet_t *subnet,
+				 dhcp_lease_t *find)
+{
+	dhcp_lease_t	*lease;
+	uint32_t	ip, n;
+	char		str[32];
+
+	ip = request_ipaddr(request->packet->vps, DHCP_REQUESTED_IP_ADDRESS);
+	if (!ip) ip = request_ipaddr(request->packet->vps, DHCP_CLIENT_IP_ADDRESS);
+	if (!ip) {
+		REDEBUG("Request has no Requested-IP-Address or Client-IP-Address");
+		return RLM_MODULE_INVALID;
+	}
+
+	if (!subnet_contains(subnet, ip)) {
+		RDEBUG("%s is not in subnet %s", ip_ntoa(str, htonl(ip)), subnet->name);
+		return RLM_MODULE_REJECT;
+	}
+
+	lease = subnet_lease(subnet, ip);
+	if (!lease || subnet_excluded(subnet, ip)) {
+		RDEBUG("%s is not in the range of subnet %s", ip_ntoa(str, htonl(ip)), subnet->name);
+		return RLM_MODULE_REJECT;
+	}
+	n = lease - subnet->leases;
+
+	if ((lease->state == LEASE_OFFERED) || (lease->state == LEASE_ACTIVE)) {
+		if (!lease->indexed || (lease->key_len != find->key_len) ||
+		    (memcmp(lease->key, find->key, find->key_len) != 0)) {
+			RDEBUG("%s belongs to another client", ip_ntoa(str, htonl(ip)));
+			return RLM_MODULE_REJECT;
+		}
+
+	} else if ((lease->state == LEASE_FREE) && (subnet->free[n / 64] & LEASE_FREE_BIT(n))) {
+		/*
+		 *	e.g. INIT-REBOOT after we lost the lease.
+		 */
+		lease_claim(subnet, lease);
+		if (!lease->indexed || (lease->key_len != find->key_len) ||
+		    (memcmp(lease->key, find->key, find->key_len) != 0)) {
+			key_index(subnet, lease, find->key, find->key_len);
+		}
+
+	} else {
+		RDEBUG("%s is not available", ip_ntoa(str, htonl(ip)));
+		return RLM_MODULE_REJECT;
+	}
+
+	lease->state = LEASE_ACTIVE;
+	lease->expires = request->timestamp + subnet->lease_time;
+	wheel_insert(subnet, lease);
+	journal_write(inst, lease);
+
+	RDEBUG("Leased %s from subnet %s", ip_ntoa(str, htonl(lease->ipaddr)), subnet->name);
+	reply_lease(request, subnet, lease, subnet->lease_time);
+
+	return RLM_MODULE_UPDATED;
+}
+
+/*
+ *	Release and Decline both name the address, which must be the
+ *	client's.
+ */
+static rlm_rcode_t lease_give_back(rlm_dhcp_lease_t *inst, REQUEST *request, lease_subnet_t *subnet,
+				   dhcp_lease_t *find, bool decline)
+{
+	dhcp_lease_t	*lease;
+	uint32_t	ip;
+	char		str[32];
+
+	ip = request_ipaddr(request->packet->vps, decline ? DHCP_REQUESTED_IP_ADDRESS : DHCP_CLIENT_IP_ADDRESS);
+	lease = subnet_lease(subnet, ip);
+	if (!lease || (lease->state == LEASE_FREE) || (lease->state == LEASE_DECLINED) ||
+	    !lease->indexed || (lease->key_len != find->key_len) ||
+	    (memcmp(lease->key, find->key, find->key_len) != 0)) {
+		RDEBUG2("Client has no lease for %s", ip_ntoa(str, htonl(ip)));
+		return RLM_MODULE_NOTFOUND;
+	}
+
+	if (decline) {
+		/*
+		 *	Something else is using the address, so keep
+		 *	it out of the pool for a while.
+		 */
+		RDEBUG("%s was declined, holding it for %u seconds", ip_ntoa(str, htonl(ip)), subnet->lease_time);
+		key_unindex(subnet, lease);
+		lease->state = LEASE_DECLINED;
+		lease->expires = request->timestamp + subnet->lease_time;
+		wheel_insert(subnet, lease);
+	} else {
+		RDEBUG("Released %s", ip_ntoa(str, htonl(ip)));
+		lease_free(subnet, lease);
+		lease->expires = request->timestamp;
+	}
+	journal_write(inst, lease);
+
+	return RLM_MODULE_OK;
+}
+
+/*
+ *	DHCP packets are processed through the post-auth method.
+ */
+static rlm_rcode_t CC_HINT(nonnull) mod_post_auth(void *instance, REQUEST *request)
+{
+	rlm_dhcp_lease_t	*inst = instance;
+	lease_subnet_t		*subnet;
+	dhcp_lease_t		find;
+	rlm_rcode_t		rcode;
+
+	if (!request->listener || (request->listener->type != RAD_LISTEN_DHCP)) return RLM_MODULE_NOOP;
+
+	switch (request->packet->code) {
+	case PW_DHCP_DISCOVER:
+	case PW_DHCP_REQUEST:
+	case PW_DHCP_RELEASE:
+	case PW_DHCP_DECLINE:
+		break;
+
+	default:
+		return RLM_MODULE_NOOP;
+	}
+
+	memset(&find, 0, sizeof(find));
+	find.key_len = request_key(request, find.key);
+	if (!find.key_len) {
+		REDEBUG("Request has no Client-Identifier or Client-Hardware-Address");
+		return RLM_MODULE_INVALID;
+	}
+
+	subnet = request_subnet(inst, request);
+	if (!subnet) {
+		RDEBUG("No subnet found for request");
+		return RLM_MODULE_NOOP;
+	}
+
+	pthread_mutex_lock(&subnet->mutex);
+	subnet_expire(subnet, request->timestamp);
+
+	switch (request->packet->code) {
+	case PW_DHCP_DISCOVER:
+		rcode = lease_discover(inst, request, subnet, &find);
+		break;
+
+	case PW_DHCP_REQUEST:
+		rcode = lease_request(inst, request, subnet, &find);
+		break;
+
+	case PW_DHCP_RELEASE:
+		rcode = lease_give_back(inst, request, subnet, &find, false);
+		break;
+
+	default:
+		rcode = lease_give_back(inst, request, subnet, &find, true);
+		break;
+	}
+	pthread_mutex_unlock(&subnet->mutex);
+
+	journal_check(inst);
+
+	return rcode;
+}
+
+/*
+ *	The module name should be the only globally exported symbol.
+ *	That is, everything else should be 'static'.
+ *
+ *	If the module needs to temporarily modify it's instantiation
+ *	data, the type should be changed to RLM_TYPE_THREAD_UNSAFE.
+ *	The server will then take care of ensuring that the module
+ *	is single-threaded.
+ */
+module_t rlm_dhcp_lease = {
+	RLM_MODULE_INIT,
+	"dhcp_lease",
+	RLM_TYPE_THREAD_SAFE,		/* type */
+	sizeof(rlm_dhcp_lease_t),
+	module_config,
+	mod_instantiate,		/* instantiation */
+	mod_detach,			/* detach */
+	{
+		NULL,			/* authentication */
+		NULL,			/* authorization */
+		NULL,			/* preaccounting */
+		NULL,			/* accounting */
+		NULL,			/* checksimul */
+		NULL,			/* pre-proxy */
+		NULL,			/* post-proxy */
+		mod_post_auth		/* post-auth */
+	},
+	0,				/* thread_inst_size */
+	NULL,				/* thread_instantiate */
+	NULL,				/* thread_detach */
+	NULL				/* cache_flush */
+};
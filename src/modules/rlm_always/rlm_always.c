@@ -143,4 +143,8 @@ module_t rlm_always = {
 		mod_always_return		/* send-coa */
 #endif
 	},
+	0,				/* thread_inst_size */
+	NULL,				/* thread_instantiate */
+	NULL,				/* thread_detach */
+	NULL				/* cache_flush */
 };
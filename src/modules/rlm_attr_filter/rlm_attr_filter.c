@@ -36,13 +36,57 @@ RCSID("$Id$")
  *	Define a structure with the module configuration, so it can
  *	be used as the instance handle.
  */
+typedef struct attr_filter_rule attr_filter_rule_t;
+typedef struct attr_filter_entry attr_filter_entry_t;
+
 typedef struct rlm_attr_filter {
-	char const	*filename;
-	char const	*key;
-	bool		relaxed;
-	PAIR_LIST	*attrs;
+	char const		*filename;
+	char const		*key;
+	bool			relaxed;
+	PAIR_LIST		*attrs;
+
+	fr_hash_table_t		*entries;	//!< Named entries, chained in file order.
+	attr_filter_entry_t	*defaults;	//!< DEFAULT entries, in file order.
 } rlm_attr_filter_t;
 
+/*
+ *	A check item, ready to be compared against a pair.  Rules
+ *	for the same attribute are chained together.
+ */
+struct attr_filter_rule {
+	VALUE_PAIR		*check;
+#ifdef HAVE_REGEX
+	char const		*pattern;	//!< Of =~ or !~.
+	regex_t			*preg;		//!< Pre-compiled pattern, NULL if it has expansions.
+#endif
+	attr_filter_rule_t	*next;
+};
+
+typedef struct attr_filter_slot {
+	DICT_ATTR const		*da;
+	attr_filter_rule_t	*rules;
+} attr_filter_slot_t;
+
+/*
+ *	An entry from the filter file, with its check items indexed
+ *	by attribute, so that each input pair only has to be compared
+ *	against the rules which can apply to it.
+ */
+struct attr_filter_entry {
+	PAIR_LIST		*pl;
+	int			seq;		//!< Position in the file.
+	bool			fall_through;
+	int			relax_filter;	//!< -1 to use the module default.
+
+	bool			has_set;	//!< Entry has ":=" items to add.
+	int			vsa_any;	//!< Number of "Vendor-Specific =* ANY" rules.
+
+	uint32_t		mask;
+	attr_filter_slot_t	*slots;
+
+	attr_filter_entry_t	*next;		//!< Next entry with the same name.
+};
+
 static const CONF_PARSER module_config[] = {
 	{ "attrsfile", FR_CONF_OFFSET(PW_TYPE_FILE_INPUT | PW_TYPE_DEPRECATED, rlm_attr_filter_t, filename), NULL },
 	{ "filename", FR_CONF_OFFSET(PW_TYPE_FILE_INPUT | PW_TYPE_REQUIRED, rlm_attr_filter_t, filename), NULL },
@@ -51,13 +95,46 @@ static const CONF_PARSER module_config[] = {
 	{ NULL, -1, 0, NULL, NULL }
 };
 
-static void check_pair(REQUEST *request, VALUE_PAIR *check_item, VALUE_PAIR *reply_item, int *pass, int *fail)
+static void check_pair(REQUEST *request, attr_filter_rule_t const *rule, VALUE_PAIR *reply_item, int *pass, int *fail)
 {
 	int compare;
+	VALUE_PAIR *check_item = rule->check;
 
-	if (check_item->op == T_OP_SET) return;
+#ifdef HAVE_REGEX
+	if ((check_item->op == T_OP_REG_EQ) || (check_item->op == T_OP_REG_NE)) {
+		regex_t *preg = rule->preg;
+		char value[MAX_STRING_LEN * 4 + 1];
 
+		/*
+		 *	Patterns with expansions can't be compiled
+		 *	until we have a request.
+		 */
+		if (!preg) {
+			if (radius_xlat(value, sizeof(value), request, rule->pattern, NULL, NULL) < 0) {
+				compare = -1;
+				goto done;
+			}
+			preg = rad_regcomp(value, REG_EXTENDED);
+			if (!preg) {
+				compare = -1;
+				goto done;
+			}
+		}
+
+		vp_prints_value(value, sizeof(value), reply_item, 0);
+		compare = regexec(preg, value, 0, NULL, 0);
+		if (check_item->op == T_OP_REG_EQ) {
+			compare = (compare == 0);
+		} else {
+			compare = (compare != 0);
+		}
+	} else
+#endif
 	compare = paircmp(check_item, reply_item);
+
+#ifdef HAVE_REGEX
+done:
+#endif
 	if (compare < 0) {
 		REDEBUG("Comparison failed: %s", fr_strerror());
 	}
@@ -69,11 +146,17 @@ static void check_pair(REQUEST *request, VALUE_PAIR *check_item, VALUE_PAIR *rep
 	}
 
 	if (RDEBUG_ENABLED3) {
-		char rule[1024], pair[1024];
+		char text[1024], pair[1024];
 
-		vp_prints(rule, sizeof(rule), check_item);
+#ifdef HAVE_REGEX
+		if (rule->pattern) {
+			snprintf(text, sizeof(text), "%s %s \"%s\"", check_item->da->name,
+				 fr_int2str(fr_tokens, check_item->op, "<INVALID>"), rule->pattern);
+		} else
+#endif
+		vp_prints(text, sizeof(text), check_item);
 		vp_prints(pair, sizeof(pair), reply_item);
-		RDEBUG3("%s %s %s", pair, compare == 1 ? "allowed by" : "disallowed by", rule);
+		RDEBUG3("%s %s %s", pair, compare == 1 ? "allowed by" : "disallowed by", text);
 	}
 
 	return;
@@ -125,6 +208,161 @@ static int attr_filter_getfile(TALLOC_CTX *ctx, char const *filename, PAIR_LIST
 }
 
 
+static uint32_t entry_hash(void const *data)
+{
+	attr_filter_entry_t const *entry = data;
+
+	return fr_hash_string(entry->pl->name);
+}
+
+static int entry_cmp(void const *one, void const *two)
+{
+	attr_filter_entry_t const *a = one;
+	attr_filter_entry_t const *b = two;
+
+	return strcmp(a->pl->name, b->pl->name);
+}
+
+static attr_filter_slot_t *entry_slot(attr_filter_entry_t const *entry, DICT_ATTR const *da)
+{
+	uint32_t i;
+
+	for (i = fr_hash(&da, sizeof(da)) & entry->mask;
+	     entry->slots[i].da;
+	     i = (i + 1) & entry->mask) {
+		if (entry->slots[i].da == da) return &entry->slots[i];
+	}
+
+	return &entry->slots[i];
+}
+
+#ifdef HAVE_REGEX
+static int _free_compiled_regex(regex_t *preg)
+{
+	regfree(preg);
+	return 0;
+}
+#endif
+
+/*
+ *	Sort the check items of an entry into per-attribute rule
+ *	chains, compiling any regular expressions as we go.
+ */
+static attr_filter_entry_t *attr_filter_compile(rlm_attr_filter_t *inst, PAIR_LIST *pl, int seq)
+{
+	attr_filter_entry_t *entry;
+	attr_filter_rule_t *rule, **last;
+	attr_filter_slot_t *slot;
+	vp_cursor_t cursor;
+	VALUE_PAIR *check_item;
+	uint32_t size;
+
+	entry = talloc_zero(inst, attr_filter_entry_t);
+	if (!entry) return NULL;
+
+	entry->pl = pl;
+	entry->seq = seq;
+	entry->relax_filter = -1;
+
+	/*
+	 *	Leave at least half the slots empty.
+	 */
+	size = 2;
+	for (check_item = fr_cursor_init(&cursor, &pl->check);
+	     check_item;
+	     check_item = fr_cursor_next(&cursor)) size++;
+	while (size & (size - 1)) size++;
+	size <<= 1;
+
+	entry->mask = size - 1;
+	entry->slots = talloc_zero_array(entry, attr_filter_slot_t, size);
+	if (!entry->slots) {
+		talloc_free(entry);
+		return NULL;
+	}
+
+	for (check_item = fr_cursor_first(&cursor);
+	     check_item;
+	     check_item = fr_cursor_next(&cursor)) {
+		if (!check_item->da->vendor &&
+		    (check_item->da->attr == PW_FALL_THROUGH) &&
+			(check_item->vp_integer == 1)) {
+			entry->fall_through = true;
+			continue;
+		}
+		else if (!check_item->da->vendor && check_item->da->attr == PW_RELAX_FILTER) {
+			entry->relax_filter = check_item->vp_integer;
+			continue;
+		}
+
+		/*
+		 *	SET items are added to the output, and are
+		 *	never compared.
+		 */
+		if (check_item->op == T_OP_SET) {
+			entry->has_set = true;
+			continue;
+		}
+
+		if ((check_item->da->attr == PW_VENDOR_SPECIFIC) &&
+		    (check_item->op == T_OP_CMP_TRUE)) {
+			entry->vsa_any++;
+		}
+
+		rule = talloc_zero(entry, attr_filter_rule_t);
+		if (!rule) {
+			talloc_free(entry);
+			return NULL;
+		}
+		rule->check = check_item;
+
+#ifdef HAVE_REGEX
+		/*
+		 *	The parser leaves regular expressions as
+		 *	unexpanded strings.  Those without expansions
+		 *	can be compiled now.
+		 */
+		if ((check_item->op == T_OP_REG_EQ) || (check_item->op == T_OP_REG_NE)) {
+			rule->pattern = (check_item->type == VT_XLAT) ? check_item->value.xlat :
+									check_item->vp_strvalue;
+		}
+
+		if (rule->pattern && !strchr(rule->pattern, '%')) {
+			int rcode;
+
+			rule->preg = talloc_zero(rule, regex_t);
+			if (!rule->preg) {
+				talloc_free(entry);
+				return NULL;
+			}
+
+			rcode = regcomp(rule->preg, rule->pattern, REG_EXTENDED);
+			if (rcode != 0) {
+				char buffer[256];
+
+				regerror(rcode, rule->preg, buffer, sizeof(buffer));
+				ERROR("%s[%d] Invalid regular expression %s: %s",
+				      inst->filename, pl->lineno, rule->pattern, buffer);
+				talloc_free(entry);
+				return NULL;
+			}
+			talloc_set_destructor(rule->preg, _free_compiled_regex);
+		}
+#endif
+
+		/*
+		 *	Keep the rules in file order, so the debug
+		 *	output is the same as it always was.
+		 */
+		slot = entry_slot(entry, check_item->da);
+		slot->da = check_item->da;
+		for (last = &slot->rules; *last; last = &(*last)->next);
+		*last = rule;
+	}
+
+	return entry;
+}
+
 /*
  *	(Re-)read the "attrs" file into memory.
  */
@@ -132,6 +370,9 @@ static int mod_instantiate(UNUSED CONF_SECTION *conf, void *instance)
 {
 	rlm_attr_filter_t *inst = instance;
 	int rcode;
+	int seq = 0;
+	PAIR_LIST *pl;
+	attr_filter_entry_t *entry, *found, **last_default;
 
 	rcode = attr_filter_getfile(inst, inst->filename, &inst->attrs);
 	if (rcode != 0) {
@@ -140,6 +381,48 @@ static int mod_instantiate(UNUSED CONF_SECTION *conf, void *instance)
 		return -1;
 	}
 
+	inst->entries = fr_hash_table_create(entry_hash, entry_cmp, NULL);
+	if (!inst->entries) {
+		ERROR("Out of memory");
+		return -1;
+	}
+
+	last_default = &inst->defaults;
+	for (pl = inst->attrs; pl; pl = pl->next) {
+		entry = attr_filter_compile(inst, pl, seq++);
+		if (!entry) {
+			ERROR("Errors reading %s", inst->filename);
+			return -1;
+		}
+
+		if (strcmp(pl->name, "DEFAULT") == 0) {
+			*last_default = entry;
+			last_default = &entry->next;
+			continue;
+		}
+
+		found = fr_hash_table_finddata(inst->entries, entry);
+		if (!found) {
+			if (!fr_hash_table_insert(inst->entries, entry)) {
+				ERROR("Out of memory");
+				return -1;
+			}
+			continue;
+		}
+
+		while (found->next) found = found->next;
+		found->next = entry;
+	}
+
+	return 0;
+}
+
+static int mod_detach(void *instance)
+{
+	rlm_attr_filter_t *inst = instance;
+
+	fr_hash_table_free(inst->entries);
+
 	return 0;
 }
 
@@ -153,7 +436,10 @@ static rlm_rcode_t CC_HINT(nonnull(1,2)) attr_filter_common(void *instance, REQU
 	VALUE_PAIR	*vp;
 	vp_cursor_t	input, check, out;
 	VALUE_PAIR	*input_item, *check_item, *output;
-	PAIR_LIST	*pl;
+	attr_filter_entry_t *named, *defaults, *entry, my_entry;
+	attr_filter_slot_t *slot;
+	attr_filter_rule_t *rule;
+	PAIR_LIST	my_pl;
 	int		found = 0;
 	int		pass, fail = 0;
 	char const	*keyname = NULL;
@@ -190,43 +476,40 @@ static rlm_rcode_t CC_HINT(nonnull(1,2)) attr_filter_common(void *instance, REQU
 
 	/*
 	 *      Find the attr_filter profile entry for the entry.
+	 *	Named entries and DEFAULT entries are walked
+	 *	together, in the order they appear in the file.
 	 */
-	for (pl = inst->attrs; pl; pl = pl->next) {
-		int fall_through = 0;
+	my_pl.name = keyname;
+	my_entry.pl = &my_pl;
+	named = fr_hash_table_finddata(inst->entries, &my_entry);
+	defaults = inst->defaults;
+
+	while (named || defaults) {
 		int relax_filter = inst->relaxed;
 
-		/*
-		 *  If the current entry is NOT a default,
-		 *  AND the realm does NOT match the current entry,
-		 *  then skip to the next entry.
-		 */
-		if ((strcmp(pl->name, "DEFAULT") != 0) &&
-		    (strcmp(keyname, pl->name) != 0))  {
-		    continue;
+		if (!defaults || (named && (named->seq < defaults->seq))) {
+			entry = named;
+			named = named->next;
+		} else {
+			entry = defaults;
+			defaults = defaults->next;
 		}
 
-		RDEBUG2("Matched entry %s at line %d", pl->name, pl->lineno);
+		RDEBUG2("Matched entry %s at line %d", entry->pl->name, entry->pl->lineno);
 		found = 1;
 
-		for (check_item = fr_cursor_init(&check, &pl->check);
-		     check_item;
-		     check_item = fr_cursor_next(&check)) {
-			if (!check_item->da->vendor &&
-			    (check_item->da->attr == PW_FALL_THROUGH) &&
-				(check_item->vp_integer == 1)) {
-				fall_through = 1;
-				continue;
-			}
-			else if (!check_item->da->vendor && check_item->da->attr == PW_RELAX_FILTER) {
-				relax_filter = check_item->vp_integer;
-				continue;
-			}
+		if (entry->relax_filter >= 0) relax_filter = entry->relax_filter;
+
+		/*
+		 *    If it is a SET operator, add the attribute to
+		 *    the output list without checking it.
+		 */
+		if (entry->has_set) {
+			for (check_item = fr_cursor_init(&check, &entry->pl->check);
+			     check_item;
+			     check_item = fr_cursor_next(&check)) {
+				if (check_item->op != T_OP_SET) continue;
 
-			/*
-			 *    If it is a SET operator, add the attribute to
-			 *    the output list without checking it.
-			 */
-			if (check_item->op == T_OP_SET ) {
 				vp = paircopyvp(packet, check_item);
 				if (!vp) {
 					goto error;
@@ -250,24 +533,14 @@ static rlm_rcode_t CC_HINT(nonnull(1,2)) attr_filter_common(void *instance, REQU
 			pass = fail = 0; /* reset the pass,fail vars for each reply item */
 
 			/*
-			 *  Reset the check_item pointer to beginning of the list
+			 *  Vendor-Specific is special, and matches any VSA if the
+			 *  comparison is always true.
 			 */
-			for (check_item = fr_cursor_first(&check);
-			     check_item;
-			     check_item = fr_cursor_next(&check)) {
-				/*
-				 *  Vendor-Specific is special, and matches any VSA if the
-				 *  comparison is always true.
-				 */
-				if ((check_item->da->attr == PW_VENDOR_SPECIFIC) && (input_item->da->vendor != 0) &&
-				    (check_item->op == T_OP_CMP_TRUE)) {
-					pass++;
-					continue;
-				}
+			if (input_item->da->vendor != 0) pass += entry->vsa_any;
 
-				if (input_item->da == check_item->da) {
-					check_pair(request, check_item, input_item, &pass, &fail);
-				}
+			slot = entry_slot(entry, input_item->da);
+			for (rule = slot->rules; rule; rule = rule->next) {
+				check_pair(request, rule, input_item, &pass, &fail);
 			}
 
 			RDEBUG3("Attribute \"%s\" allowed by %i rules, disallowed by %i rules",
@@ -289,7 +562,7 @@ static rlm_rcode_t CC_HINT(nonnull(1,2)) attr_filter_common(void *instance, REQU
 		}
 
 		/* If we shouldn't fall through, break */
-		if (!fall_through) {
+		if (!entry->fall_through) {
 			break;
 		}
 	}
@@ -352,7 +625,7 @@ module_t rlm_attr_filter = {
 	sizeof(rlm_attr_filter_t),
 	module_config,
 	mod_instantiate,	/* instantiation */
-	NULL,			/* detach */
+	mod_detach,		/* detach */
 	{
 		NULL,		/* authentication */
 		mod_authorize,	/* authorization */
@@ -372,5 +645,9 @@ module_t rlm_attr_filter = {
 		mod_send_coa
 #endif
 	},
+	0,				/* thread_inst_size */
+	NULL,				/* thread_instantiate */
+	NULL,				/* thread_detach */
+	NULL				/* cache_flush */
 };
 
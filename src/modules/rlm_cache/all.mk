@@ -1,5 +0,0 @@
-TARGET		:= rlm_cache.a
-SOURCES		:= rlm_cache.c
-
-TGT_LDLIBS	:= $(LIBS)
-
@@ -0,0 +1,308 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License, version 2 if the
+ *   License as published by the Free Software Foundation.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file rlm_cache_memcached.c
+ * @brief memcached based cache.
+ *
+ * Entries are stored with an expiry time, so memcached expires them itself.
+ *
+ * @copyright 2014  The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/radiusd.h>
+
+#include <libmemcached/memcached.h>
+
+#include "rlm_cache.h"
+
+typedef struct rlm_cache_memcached_t {
+	char const		*options;	//!< libmemcached configuration string.
+
+	rlm_cache_t		*inst;
+	fr_connection_pool_t	*pool;
+} rlm_cache_memcached_t;
+
+typedef struct cache_memcached_conn_t {
+	memcached_st		*ctx;
+} cache_memcached_conn_t;
+
+/*
+ *	Entries stay valid until the handle is released.
+ */
+typedef struct cache_memcached_handle_t {
+	cache_memcached_conn_t	*conn;
+	TALLOC_CTX		*entries;
+} cache_memcached_handle_t;
+
+static const CONF_PARSER driver_config[] = {
+	{ "options", FR_CONF_OFFSET(PW_TYPE_STRING | PW_TYPE_REQUIRED, rlm_cache_memcached_t, options),
+	  "--SERVER=localhost --BINARY-PROTOCOL" },
+
+	{ NULL, -1, 0, NULL, NULL }		/* end the list */
+};
+
+static int _mod_conn_free(cache_memcached_conn_t *conn)
+{
+	memcached_free(conn->ctx);
+
+	return 0;
+}
+
+static void *mod_conn_create(TALLOC_CTX *ctx, void *instance)
+{
+	rlm_cache_memcached_t *driver = instance;
+	cache_memcached_conn_t *conn;
+	memcached_st *mc;
+	memcached_return_t rc;
+	memcached_stat_st *stats;
+
+	mc = memcached(driver->options, talloc_array_length(driver->options) - 1);
+	if (!mc) {
+		ERROR("rlm_cache (%s): Failed creating memcached connection", driver->inst->xlat_name);
+		return NULL;
+	}
+
+	/*
+	 *	libmemcached doesn't connect until it's used, so check
+	 *	the servers are there now.
+	 */
+	stats = memcached_stat(mc, NULL, &rc);
+	if (rc != MEMCACHED_SUCCESS) {
+		ERROR("rlm_cache (%s): Failed connecting to memcached: %s", driver->inst->xlat_name,
+		      memcached_strerror(mc, rc));
+		if (stats) memcached_stat_free(mc, stats);
+		memcached_free(mc);
+		return NULL;
+	}
+	memcached_stat_free(mc, stats);
+
+	conn = talloc_zero(ctx, cache_memcached_conn_t);
+	conn->ctx = mc;
+	talloc_set_destructor(conn, _mod_conn_free);
+
+	return conn;
+}
+
+static int _mod_destructor(rlm_cache_memcached_t *driver)
+{
+	fr_connection_pool_delete(driver->pool);
+
+	return 0;
+}
+
+static int mod_instantiate(CONF_SECTION *conf, rlm_cache_t *inst, void **driver_inst)
+{
+	rlm_cache_memcached_t *driver;
+	memcached_return_t rc;
+	char buffer[256];
+
+	MEM(driver = talloc_zero(inst, rlm_cache_memcached_t));
+	driver->inst = inst;
+
+	if (cf_section_parse(conf, driver, driver_config) < 0) {
+	error:
+		talloc_free(driver);
+		return -1;
+	}
+
+	rc = libmemcached_check_configuration(driver->options, talloc_array_length(driver->options) - 1,
+					      buffer, sizeof(buffer));
+	if (rc != MEMCACHED_SUCCESS) {
+		cf_log_err_cs(conf, "Invalid 'options': %s", buffer);
+		goto error;
+	}
+
+	snprintf(buffer, sizeof(buffer), "rlm_cache (%s)", inst->xlat_name);
+
+	driver->pool = fr_connection_pool_module_init(inst->cs, driver, mod_conn_create, NULL, buffer);
+	if (!driver->pool) goto error;
+
+	talloc_set_destructor(driver, _mod_destructor);
+	*driver_inst = driver;
+
+	return 0;
+}
+
+static int cache_acquire(rlm_cache_handle_t **out, void *driver_inst, REQUEST *request, UNUSED char const *key)
+{
+	rlm_cache_memcached_t *driver = driver_inst;
+	cache_memcached_handle_t *handle;
+
+	handle = talloc_zero(NULL, cache_memcached_handle_t);
+	if (!handle) return -1;
+
+	handle->conn = fr_connection_get(driver->pool);
+	if (!handle->conn) {
+		RERROR("No connections to memcached are available");
+		talloc_free(handle);
+		return -1;
+	}
+	handle->entries = talloc_new(handle);
+
+	*out = handle;
+
+	return 0;
+}
+
+static void cache_release(void *driver_inst, UNUSED REQUEST *request, rlm_cache_handle_t *handle)
+{
+	rlm_cache_memcached_t *driver = driver_inst;
+	cache_memcached_handle_t *h = handle;
+
+	if (!h) return;
+
+	if (h->conn) fr_connection_release(driver->pool, h->conn);
+	talloc_free(h);
+}
+
+static cache_status_t cache_find(rlm_cache_entry_t **out, void *driver_inst, REQUEST *request,
+				 rlm_cache_handle_t **handle, char const *key)
+{
+	rlm_cache_memcached_t *driver = driver_inst;
+	cache_memcached_handle_t *h = *handle;
+	rlm_cache_entry_t *c;
+	memcached_return_t rc;
+	uint32_t flags;
+	size_t len;
+	char *data;
+
+	data = memcached_get(h->conn->ctx, key, strlen(key), &len, &flags, &rc);
+	if (rc == MEMCACHED_NOTFOUND) return CACHE_MISS;
+	if (rc != MEMCACHED_SUCCESS) {
+		REDEBUG("Failed retrieving entry: %s", memcached_strerror(h->conn->ctx, rc));
+		return CACHE_ERROR;
+	}
+
+	c = driver->inst->deserialize(h->entries, key, (uint8_t const *) data, len);
+	free(data);
+	if (!c) {
+		REDEBUG("Failed decoding entry: %s", fr_strerror());
+		return CACHE_ERROR;
+	}
+
+	*out = c;
+
+	return CACHE_OK;
+}
+
+/*
+ *	Write an entry, with memcached expiring it at the same time we would.
+ */
+static cache_status_t cache_store(rlm_cache_memcached_t *driver, REQUEST *request, cache_memcached_handle_t *h,
+				  rlm_cache_entry_t *c)
+{
+	memcached_return_t rc;
+	uint8_t *data;
+	ssize_t len;
+	time_t ttl;
+
+	ttl = c->expires - request->timestamp;
+	if (ttl <= 0) ttl = 1;
+
+	len = driver->inst->serialize(&data, request, c);
+	if (len < 0) {
+		REDEBUG("Failed encoding entry: %s", fr_strerror());
+		return CACHE_ERROR;
+	}
+
+	rc = memcached_set(h->conn->ctx, c->key, strlen(c->key), (char const *) data, len, ttl, 0);
+	talloc_free(data);
+	if (rc != MEMCACHED_SUCCESS) {
+		REDEBUG("Failed storing entry: %s", memcached_strerror(h->conn->ctx, rc));
+		return CACHE_ERROR;
+	}
+
+	return CACHE_OK;
+}
+
+static cache_status_t cache_insert(void *driver_inst, REQUEST *request, rlm_cache_handle_t **handle,
+				   rlm_cache_entry_t *c)
+{
+	cache_memcached_handle_t *h = *handle;
+	cache_status_t ret;
+
+	ret = cache_store(driver_inst, request, h, c);
+	if (ret == CACHE_OK) talloc_steal(h->entries, c);
+
+	return ret;
+}
+
+static cache_status_t cache_set_ttl(void *driver_inst, REQUEST *request, rlm_cache_handle_t **handle,
+				    rlm_cache_entry_t *c)
+{
+	return cache_store(driver_inst, request, *handle, c);
+}
+
+static cache_status_t cache_expire(UNUSED void *driver_inst, REQUEST *request, rlm_cache_handle_t **handle,
+				   char const *key)
+{
+	cache_memcached_handle_t *h = *handle;
+	memcached_return_t rc;
+
+	rc = memcached_delete(h->conn->ctx, key, strlen(key), 0);
+	switch (rc) {
+	case MEMCACHED_SUCCESS:
+		return CACHE_OK;
+
+	case MEMCACHED_NOTFOUND:
+		return CACHE_MISS;
+
+	default:
+		REDEBUG("Failed deleting entry: %s", memcached_strerror(h->conn->ctx, rc));
+		return CACHE_ERROR;
+	}
+}
+
+/*
+ *	The number of items on all of the servers, which may include
+ *	ones which aren't ours.
+ */
+static int cache_count(UNUSED void *driver_inst, REQUEST *request, rlm_cache_handle_t **handle)
+{
+	cache_memcached_handle_t *h = *handle;
+	memcached_stat_st *stats;
+	memcached_return_t rc;
+	uint32_t i, num;
+	int count = 0;
+
+	stats = memcached_stat(h->conn->ctx, NULL, &rc);
+	if (rc != MEMCACHED_SUCCESS) {
+		REDEBUG("Failed getting stats: %s", memcached_strerror(h->conn->ctx, rc));
+		if (stats) memcached_stat_free(h->conn->ctx, stats);
+		return -1;
+	}
+
+	num = memcached_server_count(h->conn->ctx);
+	for (i = 0; i < num; i++) count += stats[i].curr_items;
+
+	memcached_stat_free(h->conn->ctx, stats);
+
+	return count;
+}
+
+cache_driver_t rlm_cache_memcached = {
+	"rlm_cache_memcached",
+	mod_instantiate,
+	cache_acquire,
+	cache_release,
+	cache_find,
+	cache_insert,
+	cache_expire,
+	cache_set_ttl,
+	cache_count
+};
@@ -0,0 +1,359 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License, version 2 if the
+ *   License as published by the Free Software Foundation.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file rlm_cache_redis.c
+ * @brief Redis based cache.
+ *
+ * Entries are stored with SET ... EX, so Redis expires them itself.
+ *
+ * @copyright 2014  The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/radiusd.h>
+
+#include <hiredis/hiredis.h>
+
+#include "rlm_cache.h"
+
+typedef struct rlm_cache_redis_t {
+	char const		*hostname;
+	uint16_t		port;
+	uint32_t		database;
+	char const		*password;
+
+	rlm_cache_t		*inst;
+	fr_connection_pool_t	*pool;
+} rlm_cache_redis_t;
+
+typedef struct cache_redis_conn_t {
+	redisContext		*ctx;
+} cache_redis_conn_t;
+
+/*
+ *	Entries stay valid until the handle is released, even if the
+ *	connection is replaced in the mean time.
+ */
+typedef struct cache_redis_handle_t {
+	cache_redis_conn_t	*conn;
+	TALLOC_CTX		*entries;
+} cache_redis_handle_t;
+
+static const CONF_PARSER driver_config[] = {
+	{ "server", FR_CONF_OFFSET(PW_TYPE_STRING | PW_TYPE_REQUIRED, rlm_cache_redis_t, hostname), NULL },
+	{ "port", FR_CONF_OFFSET(PW_TYPE_SHORT, rlm_cache_redis_t, port), "6379" },
+	{ "database", FR_CONF_OFFSET(PW_TYPE_INTEGER, rlm_cache_redis_t, database), "0" },
+	{ "password", FR_CONF_OFFSET(PW_TYPE_STRING | PW_TYPE_SECRET, rlm_cache_redis_t, password), NULL },
+
+	{ NULL, -1, 0, NULL, NULL }		/* end the list */
+};
+
+static int _mod_conn_free(cache_redis_conn_t *conn)
+{
+	redisFree(conn->ctx);
+
+	return 0;
+}
+
+/*
+ *	Run a command while connecting.  Only status replies of
+ *	"OK" are accepted.
+ */
+static int cache_redis_setup(rlm_cache_redis_t *driver, redisContext *ctx, char const *name, char const *fmt, ...)
+{
+	redisReply *reply;
+	va_list ap;
+	int ret = 0;
+
+	va_start(ap, fmt);
+	reply = redisvCommand(ctx, fmt, ap);
+	va_end(ap);
+
+	if (!reply) {
+		ERROR("rlm_cache (%s): Failed to run %s: %s", driver->inst->xlat_name, name, ctx->errstr);
+		return -1;
+	}
+
+	if ((reply->type != REDIS_REPLY_STATUS) || (strcmp(reply->str, "OK") != 0)) {
+		ERROR("rlm_cache (%s): Unexpected reply to %s: %s", driver->inst->xlat_name, name,
+		      (reply->type == REDIS_REPLY_ERROR) ? reply->str : "<not a status>");
+		ret = -1;
+	}
+	freeReplyObject(reply);
+
+	return ret;
+}
+
+static void *mod_conn_create(TALLOC_CTX *ctx, void *instance)
+{
+	rlm_cache_redis_t *driver = instance;
+	cache_redis_conn_t *conn;
+	redisContext *redis;
+
+	redis = redisConnect(driver->hostname, driver->port);
+	if (!redis) return NULL;
+
+	if (redis->err) {
+		ERROR("rlm_cache (%s): Failed connecting to %s:%u: %s", driver->inst->xlat_name,
+		      driver->hostname, driver->port, redis->errstr);
+	error:
+		redisFree(redis);
+		return NULL;
+	}
+
+	if (driver->password && (cache_redis_setup(driver, redis, "AUTH", "AUTH %s", driver->password) < 0)) {
+		goto error;
+	}
+
+	if (driver->database && (cache_redis_setup(driver, redis, "SELECT", "SELECT %u", driver->database) < 0)) {
+		goto error;
+	}
+
+	conn = talloc_zero(ctx, cache_redis_conn_t);
+	conn->ctx = redis;
+	talloc_set_destructor(conn, _mod_conn_free);
+
+	return conn;
+}
+
+static int _mod_destructor(rlm_cache_redis_t *driver)
+{
+	fr_connection_pool_delete(driver->pool);
+
+	return 0;
+}
+
+static int mod_instantiate(CONF_SECTION *conf, rlm_cache_t *inst, void **driver_inst)
+{
+	rlm_cache_redis_t *driver;
+	char buffer[256];
+
+	MEM(driver = talloc_zero(inst, rlm_cache_redis_t));
+	driver->inst = inst;
+
+	if (cf_section_parse(conf, driver, driver_config) < 0) {
+	error:
+		talloc_free(driver);
+		return -1;
+	}
+
+	snprintf(buffer, sizeof(buffer), "rlm_cache (%s)", inst->xlat_name);
+
+	driver->pool = fr_connection_pool_module_init(inst->cs, driver, mod_conn_create, NULL, buffer);
+	if (!driver->pool) goto error;
+
+	talloc_set_destructor(driver, _mod_destructor);
+	*driver_inst = driver;
+
+	return 0;
+}
+
+static int cache_acquire(rlm_cache_handle_t **out, void *driver_inst, REQUEST *request, UNUSED char const *key)
+{
+	rlm_cache_redis_t *driver = driver_inst;
+	cache_redis_handle_t *handle;
+
+	handle = talloc_zero(NULL, cache_redis_handle_t);
+	if (!handle) return -1;
+
+	handle->conn = fr_connection_get(driver->pool);
+	if (!handle->conn) {
+		RERROR("No connections to %s:%u are available", driver->hostname, driver->port);
+		talloc_free(handle);
+		return -1;
+	}
+	handle->entries = talloc_new(handle);
+
+	*out = handle;
+
+	return 0;
+}
+
+static void cache_release(void *driver_inst, UNUSED REQUEST *request, rlm_cache_handle_t *handle)
+{
+	rlm_cache_redis_t *driver = driver_inst;
+	cache_redis_handle_t *h = handle;
+
+	if (!h) return;
+
+	if (h->conn) fr_connection_release(driver->pool, h->conn);
+	talloc_free(h);
+}
+
+/*
+ *	Run a command, reconnecting once if the connection fails.
+ *	Error replies are logged, and turned into NULL.
+ */
+static redisReply *cache_redis_command(rlm_cache_redis_t *driver, REQUEST *request, cache_redis_handle_t *h,
+				       char const *fmt, ...)
+{
+	redisReply *reply = NULL;
+	va_list ap, aq;
+	int i;
+
+	va_start(ap, fmt);
+	for (i = 0; h->conn && (i < 2); i++) {
+		va_copy(aq, ap);
+		reply = redisvCommand(h->conn->ctx, fmt, aq);
+		va_end(aq);
+		if (reply) break;
+
+		RERROR("Failed talking to %s:%u: %s", driver->hostname, driver->port, h->conn->ctx->errstr);
+		h->conn = fr_connection_reconnect(driver->pool, h->conn);
+	}
+	va_end(ap);
+
+	if (reply && (reply->type == REDIS_REPLY_ERROR)) {
+		REDEBUG("Command failed: %s", reply->str);
+		freeReplyObject(reply);
+		return NULL;
+	}
+
+	return reply;
+}
+
+static cache_status_t cache_find(rlm_cache_entry_t **out, void *driver_inst, REQUEST *request,
+				 rlm_cache_handle_t **handle, char const *key)
+{
+	rlm_cache_redis_t *driver = driver_inst;
+	cache_redis_handle_t *h = *handle;
+	rlm_cache_entry_t *c;
+	redisReply *reply;
+
+	reply = cache_redis_command(driver, request, h, "GET %b", key, strlen(key));
+	if (!reply) return CACHE_ERROR;
+
+	switch (reply->type) {
+	case REDIS_REPLY_NIL:
+		freeReplyObject(reply);
+		return CACHE_MISS;
+
+	case REDIS_REPLY_STRING:
+		break;
+
+	default:
+		REDEBUG("Unexpected reply to GET");
+		freeReplyObject(reply);
+		return CACHE_ERROR;
+	}
+
+	c = driver->inst->deserialize(h->entries, key, (uint8_t const *) reply->str, reply->len);
+	freeReplyObject(reply);
+	if (!c) {
+		REDEBUG("Failed decoding entry: %s", fr_strerror());
+		return CACHE_ERROR;
+	}
+
+	*out = c;
+
+	return CACHE_OK;
+}
+
+/*
+ *	Write an entry, with Redis expiring it at the same time we would.
+ */
+static cache_status_t cache_store(rlm_cache_redis_t *driver, REQUEST *request, cache_redis_handle_t *h,
+				  rlm_cache_entry_t *c)
+{
+	redisReply *reply;
+	uint8_t *data;
+	ssize_t len;
+	time_t ttl;
+
+	ttl = c->expires - request->timestamp;
+	if (ttl <= 0) ttl = 1;
+
+	len = driver->inst->serialize(&data, request, c);
+	if (len < 0) {
+		REDEBUG("Failed encoding entry: %s", fr_strerror());
+		return CACHE_ERROR;
+	}
+
+	reply = cache_redis_command(driver, request, h, "SET %b %b EX %u", c->key, strlen(c->key),
+				    data, (size_t) len, (unsigned int) ttl);
+	talloc_free(data);
+	if (!reply) return CACHE_ERROR;
+
+	freeReplyObject(reply);
+
+	return CACHE_OK;
+}
+
+static cache_status_t cache_insert(void *driver_inst, REQUEST *request, rlm_cache_handle_t **handle,
+				   rlm_cache_entry_t *c)
+{
+	cache_redis_handle_t *h = *handle;
+	cache_status_t ret;
+
+	ret = cache_store(driver_inst, request, h, c);
+	if (ret == CACHE_OK) talloc_steal(h->entries, c);
+
+	return ret;
+}
+
+static cache_status_t cache_set_ttl(void *driver_inst, REQUEST *request, rlm_cache_handle_t **handle,
+				    rlm_cache_entry_t *c)
+{
+	return cache_store(driver_inst, request, *handle, c);
+}
+
+static cache_status_t cache_expire(void *driver_inst, REQUEST *request, rlm_cache_handle_t **handle,
+				   char const *key)
+{
+	rlm_cache_redis_t *driver = driver_inst;
+	redisReply *reply;
+	cache_status_t ret;
+
+	reply = cache_redis_command(driver, request, *handle, "DEL %b", key, strlen(key));
+	if (!reply) return CACHE_ERROR;
+
+	ret = ((reply->type == REDIS_REPLY_INTEGER) && (reply->integer > 0)) ? CACHE_OK : CACHE_MISS;
+	freeReplyObject(reply);
+
+	return ret;
+}
+
+/*
+ *	The number of keys in the database, which may include ones
+ *	which aren't ours.
+ */
+static int cache_count(void *driver_inst, REQUEST *request, rlm_cache_handle_t **handle)
+{
+	rlm_cache_redis_t *driver = driver_inst;
+	redisReply *reply;
+	int ret = -1;
+
+	reply = cache_redis_command(driver, request, *handle, "DBSIZE");
+	if (!reply) return -1;
+
+	if (reply->type == REDIS_REPLY_INTEGER) ret = reply->integer;
+	freeReplyObject(reply);
+
+	return ret;
+}
+
+cache_driver_t rlm_cache_redis = {
+	"rlm_cache_redis",
+	mod_instantiate,
+	cache_acquire,
+	cache_release,
+	cache_find,
+	cache_insert,
+	cache_expire,
+	cache_set_ttl,
+	cache_count
+};
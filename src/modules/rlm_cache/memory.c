@@ -0,0 +1,491 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License, version 2 if the
+ *   License as published by the Free Software Foundation.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file memory.c
+ * @brief In-memory cache driver, which is also used as the local tier.
+ *
+ * @copyright 2012-2013  The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include "rlm_cache.h"
+
+#include <freeradius-devel/heap.h>
+#include <freeradius-devel/hash.h>
+#include <freeradius-devel/memstats.h>
+#include <freeradius-devel/rad_assert.h>
+
+/*
+ *	Entries are spread over a number of shards by the hash of
+ *	their key.  Each shard has its own lock, so requests for
+ *	different keys don't usually wait for each other.
+ *
+ *	Each shard keeps its entries in a list, with the most
+ *	recently used entry at the head.  When the shard is full,
+ *	the entry at the tail is evicted, so frequently used entries
+ *	stay in the cache.
+ */
+typedef struct cache_shard_t {
+	fr_hash_table_t		*cache;
+	fr_heap_t		*heap;		//!< Of entries to expire.
+	rlm_cache_entry_t	*head;		//!< Most recently used.
+	rlm_cache_entry_t	*tail;		//!< Least recently used.
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t		mutex;
+#endif
+} cache_shard_t;
+
+typedef struct cache_memory_t {
+	cache_shard_t		*shards;
+	uint32_t		num_shards;
+	uint32_t		shard_max_entries;
+	int			shard_shift;
+} cache_memory_t;
+
+#ifdef HAVE_PTHREAD_H
+#define PTHREAD_MUTEX_LOCK pthread_mutex_lock
+#define PTHREAD_MUTEX_UNLOCK pthread_mutex_unlock
+#else
+#define PTHREAD_MUTEX_LOCK(_x)
+#define PTHREAD_MUTEX_UNLOCK(_x)
+#endif
+
+/*
+ *	Compare two entries by key.  There may only be one entry with
+ *	the same key.
+ */
+static int cache_entry_cmp(void const *one, void const *two)
+{
+	rlm_cache_entry_t const *a = one;
+	rlm_cache_entry_t const *b = two;
+
+	return strcmp(a->key, b->key);
+}
+
+static uint32_t cache_entry_hash(void const *data)
+{
+	rlm_cache_entry_t const *c = data;
+
+	return fr_hash_keyed_string(c->key);
+}
+
+static void cache_entry_free(void *data)
+{
+	rlm_cache_entry_t *c = data;
+
+	memstats_free(MEMSTATS_CACHE, NULL);
+
+	pairfree(&c->control);
+	pairfree(&c->packet);
+	pairfree(&c->reply);
+
+	talloc_free(c);
+}
+
+/*
+ *	Entries are ordered by expiry time.  The key is copied into the
+ *	heap, so cache_set_ttl() re-inserts the entry after changing it.
+ */
+static uint64_t cache_heap_key(void const *one)
+{
+	rlm_cache_entry_t const *c = one;
+
+	return (uint64_t) c->expires;
+}
+
+static void cache_lru_unlink(cache_shard_t *shard, rlm_cache_entry_t *c)
+{
+	if (c->prev) {
+		c->prev->next = c->next;
+	} else {
+		shard->head = c->next;
+	}
+
+	if (c->next) {
+		c->next->prev = c->prev;
+	} else {
+		shard->tail = c->prev;
+	}
+
+	c->prev = c->next = NULL;
+}
+
+static void cache_lru_push(cache_shard_t *shard, rlm_cache_entry_t *c)
+{
+	c->prev = NULL;
+	c->next = shard->head;
+
+	if (shard->head) {
+		shard->head->prev = c;
+	} else {
+		shard->tail = c;
+	}
+	shard->head = c;
+}
+
+/*
+ *	Remove an entry from all of the shard's indexes, and free it.
+ */
+static void cache_entry_delete(cache_shard_t *shard, rlm_cache_entry_t *c)
+{
+	fr_heap_extract(shard->heap, c);
+	cache_lru_unlink(shard, c);
+	fr_hash_table_delete(shard->cache, c);
+}
+
+/*
+ *	Expire old entries.  This keeps a full shard from evicting
+ *	entries which are still valid, while it holds expired ones.
+ */
+static void cache_expire(cache_shard_t *shard, time_t now)
+{
+	rlm_cache_entry_t *c;
+
+	while ((c = fr_heap_peek(shard->heap)) && (c->expires < now)) {
+		cache_entry_delete(shard, c);
+	}
+}
+
+static int _cache_memory_free(cache_memory_t *driver)
+{
+	uint32_t i;
+
+	if (!driver->shards) return 0;
+
+	for (i = 0; i < driver->num_shards; i++) {
+		cache_shard_t *shard = &driver->shards[i];
+
+		/*
+		 *	Only initialised shards have a heap.
+		 */
+		if (!shard->heap) break;
+
+		fr_heap_delete(shard->heap);
+		fr_hash_table_free(shard->cache);
+
+#ifdef HAVE_PTHREAD_H
+		pthread_mutex_destroy(&shard->mutex);
+#endif
+	}
+
+	return 0;
+}
+
+/** Allocate an in-memory cache
+ *
+ * @param[out] out Where to write the driver instance.
+ * @param[in] ctx to allocate it in.  The cache is freed with it.
+ * @param[in] max_entries in the cache.
+ * @param[in] num_shards to spread the entries over.  Rounded up to a power of 2.
+ * @return 0 on success, -1 on error.
+ */
+int cache_memory_init(void **out, TALLOC_CTX *ctx, uint32_t max_entries, uint32_t num_shards)
+{
+	cache_memory_t *driver;
+	uint32_t i;
+
+	/*
+	 *	Round up to a power of 2, and don't have more shards
+	 *	than entries.
+	 */
+	while (num_shards & (num_shards - 1)) num_shards++;
+	while ((num_shards > 1) && (num_shards > max_entries)) num_shards >>= 1;
+
+	driver = talloc_zero(ctx, cache_memory_t);
+	talloc_set_destructor(driver, _cache_memory_free);
+
+	driver->num_shards = num_shards;
+	driver->shard_max_entries = (max_entries + num_shards - 1) / num_shards;
+	for (driver->shard_shift = 32; (1U << (32 - driver->shard_shift)) < num_shards; driver->shard_shift--);
+
+	driver->shards = talloc_zero_array(driver, cache_shard_t, num_shards);
+	for (i = 0; i < num_shards; i++) {
+		cache_shard_t *shard = &driver->shards[i];
+
+		shard->cache = fr_hash_table_create(cache_entry_hash, cache_entry_cmp, cache_entry_free);
+		if (!shard->cache) {
+			ERROR("Failed to create cache");
+		error:
+			talloc_free(driver);
+			return -1;
+		}
+
+		/*
+		 *	The heap of entries to expire.
+		 */
+		shard->heap = fr_heap_create_keyed(cache_heap_key,
+						   offsetof(rlm_cache_entry_t, offset));
+		if (!shard->heap) {
+			ERROR("Failed to create heap for the cache");
+			fr_hash_table_free(shard->cache);
+			goto error;
+		}
+
+#ifdef HAVE_PTHREAD_H
+		if (pthread_mutex_init(&shard->mutex, NULL) < 0) {
+			ERROR("Failed initializing mutex: %s",
+			       fr_syserror(errno));
+			fr_heap_delete(shard->heap);
+			shard->heap = NULL;
+			fr_hash_table_free(shard->cache);
+			goto error;
+		}
+#endif
+	}
+
+	*out = driver;
+
+	return 0;
+}
+
+static int mod_instantiate(CONF_SECTION *conf, rlm_cache_t *inst, void **driver_inst)
+{
+	FR_INTEGER_BOUND_CHECK("shards", inst->num_shards, >=, 1);
+	FR_INTEGER_BOUND_CHECK("shards", inst->num_shards, <=, 1024);
+
+	if (cache_memory_init(driver_inst, inst, inst->max_entries, inst->num_shards) < 0) {
+		cf_log_err_cs(conf, "Failed creating cache");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ *	Lock the shard holding the key.  With no key, nothing is
+ *	locked, and each shard is locked as it's used.
+ *
+ *	The hash table uses the low bits of the hash, so we use the
+ *	high ones to pick the shard.
+ */
+static int cache_acquire(rlm_cache_handle_t **out, void *driver_inst, UNUSED REQUEST *request, char const *key)
+{
+	cache_memory_t *driver = driver_inst;
+	cache_shard_t *shard;
+
+	if (!key) {
+		*out = NULL;
+		return 0;
+	}
+
+	if (driver->num_shards == 1) {
+		shard = driver->shards;
+	} else {
+		shard = &driver->shards[fr_hash_keyed_string(key) >> driver->shard_shift];
+	}
+
+	PTHREAD_MUTEX_LOCK(&shard->mutex);
+	*out = shard;
+
+	return 0;
+}
+
+static void cache_release(UNUSED void *driver_inst, UNUSED REQUEST *request, rlm_cache_handle_t *handle)
+{
+	cache_shard_t *shard = handle;
+
+	if (!shard) return;
+
+	PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+}
+
+static cache_status_t cache_find(rlm_cache_entry_t **out, UNUSED void *driver_inst, REQUEST *request,
+				 rlm_cache_handle_t **handle, char const *key)
+{
+	cache_shard_t *shard = *handle;
+	rlm_cache_entry_t *c, my_c;
+
+	/*
+	 *	Look at the expiry heap.
+	 */
+	if (!fr_heap_peek(shard->heap)) {
+		rad_assert(fr_hash_table_num_elements(shard->cache) == 0);
+		return CACHE_MISS;
+	}
+
+	cache_expire(shard, request->timestamp);
+
+	/*
+	 *	Is there an entry for this key?
+	 */
+	my_c.key = key;
+	c = fr_hash_table_finddata(shard->cache, &my_c);
+	if (!c) return CACHE_MISS;
+
+	/*
+	 *	Move it to the head of the LRU list.
+	 */
+	if (c != shard->head) {
+		cache_lru_unlink(shard, c);
+		cache_lru_push(shard, c);
+	}
+
+	*out = c;
+
+	return CACHE_OK;
+}
+
+static cache_status_t cache_insert(void *driver_inst, REQUEST *request, rlm_cache_handle_t **handle,
+				   rlm_cache_entry_t *c)
+{
+	cache_memory_t *driver = driver_inst;
+	cache_shard_t *shard = *handle;
+	rlm_cache_entry_t *old;
+
+	if (!driver->shard_max_entries) {
+		RDEBUG("Cache is full: %d entries", driver->shard_max_entries);
+		return CACHE_ERROR;
+	}
+
+	old = fr_hash_table_finddata(shard->cache, c);
+	if (old) cache_entry_delete(shard, old);
+
+	/*
+	 *	Make room by evicting the least recently used entries.
+	 */
+	while ((uint32_t) fr_hash_table_num_elements(shard->cache) >= driver->shard_max_entries) {
+		rad_assert(shard->tail != NULL);
+
+		RDEBUG("Cache is full, evicting entry for \"%s\"", shard->tail->key);
+		cache_entry_delete(shard, shard->tail);
+	}
+
+	if (!fr_hash_table_insert(shard->cache, c)) {
+		REDEBUG("FAILED adding entry for key %s", c->key);
+		return CACHE_ERROR;
+	}
+
+	if (!fr_heap_insert(shard->heap, c)) {
+		REDEBUG("FAILED adding entry for key %s", c->key);
+		fr_hash_table_yank(shard->cache, c);
+		return CACHE_ERROR;
+	}
+	cache_lru_push(shard, c);
+	memstats_alloc(MEMSTATS_CACHE, c);
+
+	return CACHE_OK;
+}
+
+static cache_status_t cache_entry_expire(UNUSED void *driver_inst, UNUSED REQUEST *request,
+					 rlm_cache_handle_t **handle, char const *key)
+{
+	cache_shard_t *shard = *handle;
+	rlm_cache_entry_t *c, my_c;
+
+	my_c.key = key;
+	c = fr_hash_table_finddata(shard->cache, &my_c);
+	if (!c) return CACHE_MISS;
+
+	cache_entry_delete(shard, c);
+
+	return CACHE_OK;
+}
+
+static cache_status_t cache_set_ttl(UNUSED void *driver_inst, UNUSED REQUEST *request,
+				    rlm_cache_handle_t **handle, rlm_cache_entry_t *c)
+{
+	cache_shard_t *shard = *handle;
+
+	fr_heap_extract(shard->heap, c);
+	fr_heap_insert(shard->heap, c);
+
+	return CACHE_OK;
+}
+
+static int cache_count(void *driver_inst, UNUSED REQUEST *request, UNUSED rlm_cache_handle_t **handle)
+{
+	cache_memory_t *driver = driver_inst;
+	uint32_t i;
+	int count = 0;
+
+	for (i = 0; i < driver->num_shards; i++) {
+		cache_shard_t *shard = &driver->shards[i];
+
+		PTHREAD_MUTEX_LOCK(&shard->mutex);
+		count += fr_hash_table_num_elements(shard->cache);
+		PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+	}
+
+	return count;
+}
+
+/** Call a function for each entry in an in-memory cache
+ *
+ * The entries are visited starting with the least recently used, so
+ * inserting them in the same order recreates the LRU lists.
+ *
+ * The callback is given copies of the entries, which are made with
+ * the shard locked.  The callback itself is called with the shard
+ * unlocked, so requests aren't kept waiting while it writes to disk.
+ *
+ * @param[in] driver_inst from cache_memory_init().
+ * @param[in] callback to call.  Returning < 0 stops the walk.
+ * @param[in] uctx passed to the callback.
+ * @return 0 on success, or the value returned by the callback which stopped the walk.
+ */
+int cache_memory_walk(void *driver_inst, cache_memory_walk_t callback, void *uctx)
+{
+	cache_memory_t *driver = driver_inst;
+	rlm_cache_entry_t *c, *copy, *copies, **last;
+	TALLOC_CTX *ctx;
+	uint32_t i;
+	int ret = 0;
+
+	for (i = 0; (i < driver->num_shards) && (ret >= 0); i++) {
+		cache_shard_t *shard = &driver->shards[i];
+
+		ctx = talloc_new(NULL);
+		if (!ctx) return -1;
+
+		/*
+		 *	The copies are linked through their 'next'
+		 *	pointers, in the order they're visited.
+		 */
+		copies = NULL;
+		last = &copies;
+
+		PTHREAD_MUTEX_LOCK(&shard->mutex);
+		for (c = shard->tail; c; c = c->prev) {
+			copy = cache_entry_copy(ctx, c);
+			if (!copy) {
+				ret = -1;
+				break;
+			}
+			*last = copy;
+			last = &copy->next;
+		}
+		PTHREAD_MUTEX_UNLOCK(&shard->mutex);
+
+		for (c = copies; c && (ret >= 0); c = c->next) ret = callback(c, uctx);
+
+		talloc_free(ctx);
+	}
+
+	return ret < 0 ? ret : 0;
+}
+
+cache_driver_t rlm_cache_memory = {
+	"rlm_cache_memory",
+	mod_instantiate,
+	cache_acquire,
+	cache_release,
+	cache_find,
+	cache_insert,
+	cache_entry_expire,
+	cache_set_ttl,
+	cache_count
+};
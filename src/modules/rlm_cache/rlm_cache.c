@@ -25,44 +25,29 @@ RCSID("$Id$")
 #include <freeradius-devel/radiusd.h>
 #include <freeradius-devel/modules.h>
 #include <freeradius-devel/modcall.h>
-#include <freeradius-devel/heap.h>
 #include <freeradius-devel/rad_assert.h>
 
+#include "rlm_cache.h"
+
 /*
- *	Define a structure for our module configuration.
- *
- *	These variables do not need to be in a structure, but it's
- *	a lot cleaner to do so, and a pointer to the structure can
- *	be used as the instance handle.
+ *	The handles for one key.  Each tier is only acquired
+ *	when it's needed.
  */
-typedef struct rlm_cache_t {
-	char const		*xlat_name;
+typedef struct cache_handles_t {
 	char const		*key;
-	uint32_t		ttl;
-	uint32_t		max_entries;
-	int32_t			epoch;
-	bool			stats;
-	CONF_SECTION		*cs;
-	rbtree_t		*cache;
-	fr_heap_t		*heap;
-
-	value_pair_map_t	*maps;	//!< Attribute map applied to users
-					//!< and profiles.
-#ifdef HAVE_PTHREAD_H
-	pthread_mutex_t	cache_mutex;
-#endif
-} rlm_cache_t;
-
-typedef struct rlm_cache_entry_t {
-	char const	*key;
-	int		offset;
-	long long int	hits;
-	time_t		created;
-	time_t		expires;
-	VALUE_PAIR	*control;
-	VALUE_PAIR	*packet;
-	VALUE_PAIR	*reply;
-} rlm_cache_entry_t;
+	rlm_cache_handle_t	*l1;		//!< Of the local tier.
+	rlm_cache_handle_t	*handle;	//!< Of the driver.
+	bool			l1_acquired;
+	bool			acquired;
+} cache_handles_t;
+
+#define MAX_ATTRMAP	128
+
+/*
+ *	How long a request waits for another one to create an entry,
+ *	before giving up and creating it itself.
+ */
+#define CACHE_REFRESH_WAIT	5
 
 #ifdef HAVE_PTHREAD_H
 #define PTHREAD_MUTEX_LOCK pthread_mutex_lock
@@ -72,8 +57,6 @@ typedef struct rlm_cache_entry_t {
 #define PTHREAD_MUTEX_UNLOCK(_x)
 #endif
 
-#define MAX_ATTRMAP	128
-
 /*
  *	A mapping of configuration file names to internal variables.
  *
@@ -84,9 +67,16 @@ typedef struct rlm_cache_entry_t {
  *	buffer over-flows.
  */
 static const CONF_PARSER module_config[] = {
+	{ "driver", FR_CONF_OFFSET(PW_TYPE_STRING, rlm_cache_t, driver_name), "rlm_cache_memory" },
 	{ "key", FR_CONF_OFFSET(PW_TYPE_STRING | PW_TYPE_REQUIRED | PW_TYPE_XLAT, rlm_cache_t, key), NULL },
 	{ "ttl", FR_CONF_OFFSET(PW_TYPE_INTEGER, rlm_cache_t, ttl), "500" },
+	{ "stale_ttl", FR_CONF_OFFSET(PW_TYPE_INTEGER, rlm_cache_t, stale_ttl), "0" },
 	{ "max_entries", FR_CONF_OFFSET(PW_TYPE_INTEGER, rlm_cache_t, max_entries), "16384" },
+	{ "shards", FR_CONF_OFFSET(PW_TYPE_INTEGER, rlm_cache_t, num_shards), "16" },
+	{ "l1_max_entries", FR_CONF_OFFSET(PW_TYPE_INTEGER, rlm_cache_t, l1_max_entries), "0" },
+	{ "l1_ttl", FR_CONF_OFFSET(PW_TYPE_INTEGER, rlm_cache_t, l1_ttl), "5" },
+	{ "snapshot_file", FR_CONF_OFFSET(PW_TYPE_FILE_OUTPUT, rlm_cache_t, snapshot_file), NULL },
+	{ "snapshot_interval", FR_CONF_OFFSET(PW_TYPE_INTEGER, rlm_cache_t, snapshot_interval), "300" },
 
 	/* Should be a type which matches time_t, @fixme before 2038 */
 	{ "epoch", FR_CONF_OFFSET(PW_TYPE_SIGNED, rlm_cache_t, epoch), "0" },
@@ -95,124 +85,245 @@ static const CONF_PARSER module_config[] = {
 	{ NULL, -1, 0, NULL, NULL }		/* end the list */
 };
 
+/*
+ *	Entries are kept for stale_ttl seconds after they expire, so
+ *	they can be used while a new one is being created.
+ */
+static inline bool cache_entry_stale(rlm_cache_t const *inst, REQUEST *request, rlm_cache_entry_t const *c)
+{
+	return (c->expires - (time_t) inst->stale_ttl) < request->timestamp;
+}
+
+/** Claim the right to create the entry for a key
+ *
+ * Only one request at a time creates an entry for a key, so that the
+ * update section isn't expanded many times over when a popular entry
+ * expires.
+ *
+ * @return true if the caller should create the entry, and then call
+ *	cache_refresh_done().  false if another request is already creating it.
+ */
+static bool cache_refresh_claim(rlm_cache_t *inst, char const *key)
+{
+	char *copy;
+	bool claimed = false;
+
+	PTHREAD_MUTEX_LOCK(&inst->refresh_mutex);
+	if (!fr_hash_table_finddata(inst->refreshing, key)) {
+		copy = talloc_typed_strdup(NULL, key);
+		claimed = copy && fr_hash_table_insert(inst->refreshing, copy);
+		if (!claimed) talloc_free(copy);
+	}
+	PTHREAD_MUTEX_UNLOCK(&inst->refresh_mutex);
+
+	return claimed;
+}
 
 /*
- *	Compare two entries by key.  There may only be one entry with
- *	the same key.
+ *	Wait for the request which claimed a key to finish with it.
+ *	The caller must not hold any handles, as the other request
+ *	needs them to insert its entry.
+ *
+ *	Returns false if the other request took longer than
+ *	CACHE_REFRESH_WAIT seconds, e.g. because the update section
+ *	is waiting for a database which is down.
  */
-static int cache_entry_cmp(void const *one, void const *two)
+static bool cache_refresh_wait(rlm_cache_t *inst, REQUEST *request, char const *key)
 {
-	rlm_cache_entry_t const *a = one;
-	rlm_cache_entry_t const *b = two;
+	bool done = true;
+#ifdef HAVE_PTHREAD_H
+	struct timeval now;
+	struct timespec when;
+#endif
+
+	RDEBUG2("Waiting for another request to create entry for \"%s\"", key);
+
+	PTHREAD_MUTEX_LOCK(&inst->refresh_mutex);
+#ifdef HAVE_PTHREAD_H
+	gettimeofday(&now, NULL);
+	when.tv_sec = now.tv_sec + CACHE_REFRESH_WAIT;
+	when.tv_nsec = now.tv_usec * 1000;
+
+	while (fr_hash_table_finddata(inst->refreshing, key)) {
+		if (pthread_cond_timedwait(&inst->refresh_cond, &inst->refresh_mutex, &when) == ETIMEDOUT) {
+			done = !fr_hash_table_finddata(inst->refreshing, key);
+			break;
+		}
+	}
+#endif
+	PTHREAD_MUTEX_UNLOCK(&inst->refresh_mutex);
 
-	return strcmp(a->key, b->key);
+	return done;
 }
 
-static void cache_entry_free(void *data)
+static void cache_refresh_done(rlm_cache_t *inst, char const *key)
 {
-	rlm_cache_entry_t *c = data;
+	PTHREAD_MUTEX_LOCK(&inst->refresh_mutex);
+	fr_hash_table_delete(inst->refreshing, key);
+#ifdef HAVE_PTHREAD_H
+	pthread_cond_broadcast(&inst->refresh_cond);
+#endif
+	PTHREAD_MUTEX_UNLOCK(&inst->refresh_mutex);
+}
 
-	pairfree(&c->control);
-	pairfree(&c->packet);
-	pairfree(&c->reply);
+static uint32_t cache_refresh_hash(void const *data)
+{
+	return fr_hash_keyed_string(data);
+}
 
-	talloc_free(c);
+static int cache_refresh_cmp(void const *one, void const *two)
+{
+	return strcmp(one, two);
 }
 
-/*
- *	Compare two entries by expiry time.  There may be multiple
- *	entries with the same expiry time.
- */
-static int cache_heap_cmp(void const *one, void const *two)
+static void cache_refresh_free(void *data)
 {
-	rlm_cache_entry_t const *a = one;
-	rlm_cache_entry_t const *b = two;
+	talloc_free(data);
+}
 
-	if (a->expires < b->expires) return -1;
-	if (a->expires > b->expires) return +1;
+static int cache_acquire(rlm_cache_t *inst, REQUEST *request, cache_handles_t *h)
+{
+	if (h->acquired) return 0;
+
+	if (inst->driver->acquire(&h->handle, inst->driver_inst, request, h->key) < 0) {
+		REDEBUG("Failed to get a handle to the cache");
+		return -1;
+	}
+	h->acquired = true;
 
 	return 0;
 }
 
+static void cache_l1_release(rlm_cache_t *inst, REQUEST *request, cache_handles_t *h)
+{
+	if (!h->l1_acquired) return;
+
+	rlm_cache_memory.release(inst->l1_inst, request, h->l1);
+	h->l1_acquired = false;
+}
+
 /*
- *	Merge a cached entry into a REQUEST.
+ *	Release all of the handles.  The entries returned by the
+ *	lookup functions are no longer valid.
  */
-static void CC_HINT(nonnull) cache_merge(rlm_cache_t *inst, REQUEST *request, rlm_cache_entry_t *c)
+static void cache_release(rlm_cache_t *inst, REQUEST *request, cache_handles_t *h)
 {
-	VALUE_PAIR *vp;
+	cache_l1_release(inst, request, h);
 
-	vp = pairfind(request->config_items, PW_CACHE_MERGE, 0, TAG_ANY);
-	if (vp && (vp->vp_integer == 0)) {
-		RDEBUG2("Told not to merge entry into request");
-		return;
-	}
+	if (!h->acquired) return;
 
-	if (c->control) {
-		RDEBUG2("Merging cached control list");
-		rdebug_pair_list(L_DBG_LVL_2, request, c->control);
-		pairadd(&request->config_items, paircopy(request, c->control));
-	}
+	inst->driver->release(inst->driver_inst, request, h->handle);
+	h->acquired = false;
+}
 
-	if (c->packet && request->packet) {
-		RDEBUG2("Merging cached request list");
-		rdebug_pair_list(L_DBG_LVL_2, request, c->packet);
+/** Copy an entry
+ *
+ * e.g. so that it can be put into the local tier.
+ *
+ * @param[in] ctx to allocate the copy in.
+ * @param[in] c entry to copy.
+ * @return the copy, or NULL on error.
+ */
+rlm_cache_entry_t *cache_entry_copy(TALLOC_CTX *ctx, rlm_cache_entry_t const *c)
+{
+	rlm_cache_entry_t *copy;
 
-		pairadd(&request->packet->vps,
-			paircopy(request->packet, c->packet));
-	}
+	copy = talloc_zero(ctx, rlm_cache_entry_t);
+	if (!copy) return NULL;
 
-	if (c->reply && request->reply) {
-		RDEBUG2("Merging cached reply list");
-		rdebug_pair_list(L_DBG_LVL_2, request, c->reply);
+	copy->key = talloc_typed_strdup(copy, c->key);
+	copy->created = c->created;
+	copy->expires = c->expires;
+	copy->hits = c->hits;
+	copy->control = paircopy(copy, c->control);
+	copy->packet = paircopy(copy, c->packet);
+	copy->reply = paircopy(copy, c->reply);
 
-		pairadd(&request->reply->vps,
-			paircopy(request->reply, c->reply));
-	}
+	return copy;
+}
 
-	if (inst->stats) {
-		vp = paircreate(request->packet, PW_CACHE_ENTRY_HITS, 0);
-		rad_assert(vp != NULL);
+/*
+ *	Put a copy of an entry from the driver into the local tier.
+ *	It's kept there for at most l1_ttl seconds, so changes made
+ *	by other servers are seen soon enough.
+ */
+static void cache_l1_insert(rlm_cache_t *inst, REQUEST *request, cache_handles_t *h, rlm_cache_entry_t const *c)
+{
+	rlm_cache_entry_t *copy;
 
-		vp->vp_integer = c->hits;
+	if (!inst->l1_inst) return;
 
-		pairadd(&request->packet->vps, vp);
+	copy = cache_entry_copy(NULL, c);
+	if (!copy) return;
+
+	/*
+	 *	Stale entries aren't kept locally, so that the next
+	 *	request goes to the driver to see if there's a new one.
+	 */
+	copy->expires -= inst->stale_ttl;
+	if (copy->expires > (request->timestamp + (time_t) inst->l1_ttl)) {
+		copy->expires = request->timestamp + inst->l1_ttl;
 	}
-}
 
+	cache_l1_release(inst, request, h);
+	rlm_cache_memory.acquire(&h->l1, inst->l1_inst, request, h->key);
+	h->l1_acquired = true;
+
+	if (rlm_cache_memory.insert(inst->l1_inst, request, &h->l1, copy) != CACHE_OK) talloc_free(copy);
+
+	cache_l1_release(inst, request, h);
+}
 
 /*
- *	Find a cached entry.
+ *	Find an entry in the local tier.  Its lock is held if one
+ *	was found.
  */
-static rlm_cache_entry_t *cache_find(rlm_cache_t *inst, REQUEST *request,
-				     char const *key)
+static rlm_cache_entry_t *cache_l1_find(rlm_cache_t *inst, REQUEST *request, cache_handles_t *h)
 {
-	int ttl;
-	rlm_cache_entry_t *c, my_c;
-	VALUE_PAIR *vp;
+	rlm_cache_entry_t *c;
 
-	/*
-	 *	Look at the expiry heap.
-	 */
-	c = fr_heap_peek(inst->heap);
-	if (!c) {
-		rad_assert(rbtree_num_elements(inst->cache) == 0);
+	if (!inst->l1_inst) return NULL;
+
+	rlm_cache_memory.acquire(&h->l1, inst->l1_inst, request, h->key);
+	h->l1_acquired = true;
+
+	if (rlm_cache_memory.find(&c, inst->l1_inst, request, &h->l1, h->key) != CACHE_OK) {
+	miss:
+		cache_l1_release(inst, request, h);
 		return NULL;
 	}
 
 	/*
-	 *	If it's time to expire an old entry, do so now.
+	 *	Cache-TTL has to change the entry in the driver, so the
+	 *	local copy is discarded, and the driver is asked instead.
 	 */
-	if (c->expires < request->timestamp) {
-		fr_heap_extract(inst->heap, c);
-		rbtree_deletebydata(inst->cache, c);
+	if ((c->expires < request->timestamp) || (c->created < inst->epoch) ||
+	    pairfind(request->config_items, PW_CACHE_TTL, 0, TAG_ANY)) {
+		rlm_cache_memory.expire(inst->l1_inst, request, &h->l1, h->key);
+		goto miss;
 	}
 
-	/*
-	 *	Is there an entry for this key?
-	 */
-	my_c.key = key;
-	c = rbtree_finddata(inst->cache, &my_c);
-	if (!c) return NULL;
+	RDEBUG("Found entry for \"%s\" in the local tier", h->key);
+	c->hits++;
+
+	return c;
+}
+
+/*
+ *	Find a cached entry.
+ */
+static rlm_cache_entry_t *cache_find(rlm_cache_t *inst, REQUEST *request, cache_handles_t *h)
+{
+	int ttl;
+	rlm_cache_entry_t *c;
+	VALUE_PAIR *vp;
+
+	c = cache_l1_find(inst, request, h);
+	if (c) return c;
+
+	if (cache_acquire(inst, request, h) < 0) return NULL;
+
+	if (inst->driver->find(&c, inst->driver_inst, request, &h->handle, h->key) != CACHE_OK) return NULL;
 
 	/*
 	 *	Yes, but it expired, OR the "forget all" epoch has
@@ -223,13 +334,12 @@ static rlm_cache_entry_t *cache_find(rlm_cache_t *inst, REQUEST *request,
 	delete:
 		RDEBUG("Removing expired entry");
 
-		fr_heap_extract(inst->heap, c);
-		rbtree_deletebydata(inst->cache, c);
+		inst->driver->expire(inst->driver_inst, request, &h->handle, h->key);
 
 		return NULL;
 	}
 
-	RDEBUG("Found entry for \"%s\"", key);
+	RDEBUG("Found entry for \"%s\"", h->key);
 
 	/*
 	 *	Update the expiry time based on the TTL.
@@ -241,14 +351,62 @@ static rlm_cache_entry_t *cache_find(rlm_cache_t *inst, REQUEST *request,
 		if (vp->vp_signed <= 0) goto delete;
 
 		ttl = vp->vp_signed;
-		c->expires = request->timestamp + ttl;
+		c->expires = request->timestamp + ttl + inst->stale_ttl;
+		if (inst->driver->set_ttl(inst->driver_inst, request, &h->handle, c) != CACHE_OK) return NULL;
 		RDEBUG("Adding %d to the TTL", ttl);
 	}
 	c->hits++;
 
+	if (!cache_entry_stale(inst, request, c)) cache_l1_insert(inst, request, h, c);
+
 	return c;
 }
 
+/*
+ *	Merge a cached entry into a REQUEST.
+ */
+static void CC_HINT(nonnull) cache_merge(rlm_cache_t *inst, REQUEST *request, rlm_cache_entry_t *c)
+{
+	VALUE_PAIR *vp;
+
+	vp = pairfind(request->config_items, PW_CACHE_MERGE, 0, TAG_ANY);
+	if (vp && (vp->vp_integer == 0)) {
+		RDEBUG2("Told not to merge entry into request");
+		return;
+	}
+
+	if (c->control) {
+		RDEBUG2("Merging cached control list");
+		rdebug_pair_list(L_DBG_LVL_2, request, c->control);
+		pairadd(&request->config_items, paircopy(request, c->control));
+	}
+
+	if (c->packet && request->packet) {
+		RDEBUG2("Merging cached request list");
+		rdebug_pair_list(L_DBG_LVL_2, request, c->packet);
+
+		pairadd(&request->packet->vps,
+			paircopy(request->packet, c->packet));
+	}
+
+	if (c->reply && request->reply) {
+		RDEBUG2("Merging cached reply list");
+		rdebug_pair_list(L_DBG_LVL_2, request, c->reply);
+
+		pairadd(&request->reply->vps,
+			paircopy(request->reply, c->reply));
+	}
+
+	if (inst->stats) {
+		vp = paircreate(request->packet, PW_CACHE_ENTRY_HITS, 0);
+		rad_assert(vp != NULL);
+
+		vp->vp_integer = c->hits;
+
+		pairadd(&request->packet->vps, vp);
+	}
+}
+
 
 /** Callback for map_to_request
  *
@@ -269,7 +427,7 @@ static int _cache_add(VALUE_PAIR **out, REQUEST *request, UNUSED value_pair_map_
 /*
  *	Add an entry to the cache.
  */
-static rlm_cache_entry_t *cache_add(rlm_cache_t *inst, REQUEST *request, char const *key)
+static rlm_cache_entry_t *cache_add(rlm_cache_t *inst, REQUEST *request, cache_handles_t *h)
 {
 	int ttl;
 	VALUE_PAIR *vp, *to_cache;
@@ -281,11 +439,6 @@ static rlm_cache_entry_t *cache_add(rlm_cache_t *inst, REQUEST *request, char co
 
 	rlm_cache_entry_t *c;
 
-	if (rbtree_num_elements(inst->cache) >= inst->max_entries) {
-		RDEBUG("Cache is full: %d entries", inst->max_entries);
-		return NULL;
-	}
-
 	/*
 	 *	TTL of 0 means "don't cache this entry"
 	 */
@@ -293,16 +446,16 @@ static rlm_cache_entry_t *cache_add(rlm_cache_t *inst, REQUEST *request, char co
 	if (vp && (vp->vp_signed == 0)) return NULL;
 
 	c = talloc_zero(NULL, rlm_cache_entry_t);
-	c->key = talloc_typed_strdup(c, key);
+	c->key = talloc_typed_strdup(c, h->key);
 	c->created = c->expires = request->timestamp;
 
 	/*
 	 *	Use per-entry TTL if > 0, or globally defined one.
 	 */
 	ttl = vp && (vp->vp_signed > 0) ? vp->vp_integer : inst->ttl;
-	c->expires += ttl;
+	c->expires += ttl + inst->stale_ttl;
 
-	RDEBUG("Creating entry for \"%s\"", key);
+	RDEBUG("Creating entry for \"%s\"", h->key);
 
 	/*
 	 *	Check to see if we need to merge the entry into the request
@@ -385,6 +538,7 @@ static rlm_cache_entry_t *cache_add(rlm_cache_t *inst, REQUEST *request, char co
 			(void) talloc_steal(c, vp);
 
 			vp->op = map->op;
+			if (map->lhs->tmpl_tag != TAG_ANY) vp->tag = map->lhs->tmpl_tag;
 
 			switch (map->lhs->tmpl_list) {
 			case PAIR_LIST_REQUEST:
@@ -411,20 +565,20 @@ static rlm_cache_entry_t *cache_add(rlm_cache_t *inst, REQUEST *request, char co
 		}
 	}
 
-	if (!rbtree_insert(inst->cache, c)) {
-		REDEBUG("FAILED adding entry for key %s", key);
-		cache_entry_free(c);
-		return NULL;
-	}
-
-	if (!fr_heap_insert(inst->heap, c)) {
-		REDEBUG("FAILED adding entry for key %s", key);
-		rbtree_deletebydata(inst->cache, c);
+	/*
+	 *	The handle is only acquired now, so the update section
+	 *	isn't expanded with the entry's shard locked.
+	 */
+	if ((cache_acquire(inst, request, h) < 0) ||
+	    (inst->driver->insert(inst->driver_inst, request, &h->handle, c) != CACHE_OK)) {
+		talloc_free(c);
 		return NULL;
 	}
 
 	RDEBUG("Inserted entry, TTL %d seconds", ttl);
 
+	cache_l1_insert(inst, request, h, c);
+
 	return c;
 }
 
@@ -480,6 +634,7 @@ static ssize_t cache_xlat(void *instance, REQUEST *request,
 {
 	rlm_cache_entry_t 	*c;
 	rlm_cache_t		*inst = instance;
+	cache_handles_t		h;
 	VALUE_PAIR		*vp, *vps;
 	pair_lists_t		list;
 	DICT_ATTR const		*target;
@@ -495,8 +650,10 @@ static ssize_t cache_xlat(void *instance, REQUEST *request,
 		return -1;
 	}
 
-	PTHREAD_MUTEX_LOCK(&inst->cache_mutex);
-	c = cache_find(inst, request, fmt);
+	memset(&h, 0, sizeof(h));
+	h.key = fmt;
+
+	c = cache_find(inst, request, &h);
 
 	if (!c) {
 		RDEBUG("No cache entry for key \"%s\"", fmt);
@@ -518,12 +675,12 @@ static ssize_t cache_xlat(void *instance, REQUEST *request,
 		break;
 
 	case PAIR_LIST_UNKNOWN:
-		PTHREAD_MUTEX_UNLOCK(&inst->cache_mutex);
+		cache_release(inst, request, &h);
 		REDEBUG("Unknown list qualifier in \"%s\"", fmt);
 		return -1;
 
 	default:
-		PTHREAD_MUTEX_UNLOCK(&inst->cache_mutex);
+		cache_release(inst, request, &h);
 		REDEBUG("Unsupported list \"%s\"",
 			fr_int2str(pair_lists, list, "<UNKNOWN>"));
 		return -1;
@@ -538,12 +695,12 @@ static ssize_t cache_xlat(void *instance, REQUEST *request,
 
 	len = vp_prints_value(out, freespace, vp, 0);
 	if (is_truncated(len, freespace)) {
-		PTHREAD_MUTEX_UNLOCK(&inst->cache_mutex);
+		cache_release(inst, request, &h);
 		REDEBUG("Insufficient buffer space to write cached value");
 		return -1;
 	}
 done:
-	PTHREAD_MUTEX_UNLOCK(&inst->cache_mutex);
+	cache_release(inst, request, &h);
 
 	return ret;
 }
@@ -558,12 +715,29 @@ static int mod_detach(void *instance)
 
 	talloc_free(inst->maps);
 
-	fr_heap_delete(inst->heap);
-	rbtree_free(inst->cache);
+	if (inst->snapshot_file && inst->driver_inst) {
+		cache_snapshot_stop(inst);
+#ifdef HAVE_PTHREAD_H
+		pthread_cond_destroy(&inst->snapshot_cond);
+		pthread_mutex_destroy(&inst->snapshot_mutex);
+#endif
+	}
+
+	/*
+	 *	Free the driver instances while the driver is
+	 *	definitely still loaded.
+	 */
+	TALLOC_FREE(inst->driver_inst);
+	TALLOC_FREE(inst->l1_inst);
 
+	if (inst->refreshing) {
+		fr_hash_table_free(inst->refreshing);
 #ifdef HAVE_PTHREAD_H
-	pthread_mutex_destroy(&inst->cache_mutex);
+		pthread_cond_destroy(&inst->refresh_cond);
+		pthread_mutex_destroy(&inst->refresh_mutex);
 #endif
+	}
+
 	return 0;
 }
 
@@ -599,50 +773,129 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 		return -1;
 	}
 
-#ifdef HAVE_PTHREAD_H
-	if (pthread_mutex_init(&inst->cache_mutex, NULL) < 0) {
-		ERROR("Failed initializing mutex: %s",
-		       fr_syserror(errno));
+	inst->refreshing = fr_hash_table_create(cache_refresh_hash, cache_refresh_cmp, cache_refresh_free);
+	if (!inst->refreshing) {
+		cf_log_err_cs(conf, "Failed creating table of keys being refreshed");
 		return -1;
 	}
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_init(&inst->refresh_mutex, NULL);
+	pthread_cond_init(&inst->refresh_cond, NULL);
 #endif
 
+	inst->serialize = cache_serialize;
+	inst->deserialize = cache_deserialize;
+
 	/*
-	 *	The cache.
+	 *	The in-memory driver is built in, the others have to
+	 *	be loaded.
 	 */
+	if (strcmp(inst->driver_name, rlm_cache_memory.name) == 0) {
+		inst->driver = &rlm_cache_memory;
+	} else {
+		if (strncmp(inst->driver_name, "rlm_cache_", 10) != 0) {
+			cf_log_err_cs(conf, "\"%s\" is NOT a cache driver!", inst->driver_name);
+			return -1;
+		}
 
-	inst->cache = rbtree_create(NULL, cache_entry_cmp, cache_entry_free, 0);
-	if (!inst->cache) {
-		ERROR("Failed to create cache");
-		return -1;
+		inst->handle = lt_dlopenext(inst->driver_name);
+		if (!inst->handle) {
+			cf_log_err_cs(conf, "Could not link driver %s: %s", inst->driver_name, dlerror());
+			cf_log_err_cs(conf, "Make sure it (and all its dependent libraries!) are in the search path "
+				      "of your system's ld");
+			return -1;
+		}
+
+		inst->driver = (cache_driver_t *) dlsym(inst->handle, inst->driver_name);
+		if (!inst->driver) {
+			cf_log_err_cs(conf, "Could not link symbol %s: %s", inst->driver_name, dlerror());
+			return -1;
+		}
+	}
+
+	{
+		CONF_SECTION *cs;
+		char const *name;
+
+		name = strrchr(inst->driver_name, '_');
+		if (!name) {
+			name = inst->driver_name;
+		} else {
+			name++;
+		}
+
+		cs = cf_section_sub_find(conf, name);
+		if (!cs) {
+			cs = cf_section_alloc(conf, name, NULL);
+			if (!cs) return -1;
+		}
+
+		if (inst->driver->mod_instantiate(cs, inst, &inst->driver_inst) < 0) return -1;
 	}
-	fr_link_talloc_ctx_free(inst, inst->cache);
+
+	INFO("rlm_cache (%s): Driver %s loaded and linked", inst->xlat_name, inst->driver->name);
 
 	/*
-	 *	The heap of entries to expire.
+	 *	External drivers keep their entries over a restart
+	 *	anyway.
 	 */
-	inst->heap = fr_heap_create(cache_heap_cmp,
-				    offsetof(rlm_cache_entry_t, offset));
-	if (!inst->heap) {
-		ERROR("Failed to create heap for the cache");
-		return -1;
+	if (inst->snapshot_file) {
+		if (inst->driver != &rlm_cache_memory) {
+			cf_log_err_cs(conf, "'snapshot_file' can only be used with the %s driver",
+				      rlm_cache_memory.name);
+			return -1;
+		}
+
+		FR_INTEGER_BOUND_CHECK("snapshot_interval", inst->snapshot_interval, >=, 10);
+
+		if (cache_snapshot_load(inst) < 0) {
+			cf_log_err_cs(conf, "Failed loading 'snapshot_file'");
+
+			/*
+			 *	So that mod_detach() doesn't overwrite it.
+			 */
+			inst->snapshot_file = NULL;
+			return -1;
+		}
+
+#ifdef HAVE_PTHREAD_H
+		pthread_mutex_init(&inst->snapshot_mutex, NULL);
+		pthread_cond_init(&inst->snapshot_cond, NULL);
+#endif
+	}
+
+	/*
+	 *	The local tier.  It only makes sense in front of a
+	 *	driver which is shared with other servers.
+	 */
+	if (inst->l1_max_entries) {
+		if (inst->driver == &rlm_cache_memory) {
+			cf_log_err_cs(conf, "'l1_max_entries' can only be used with an external driver");
+			return -1;
+		}
+
+		FR_INTEGER_BOUND_CHECK("l1_ttl", inst->l1_ttl, >=, 1);
+		FR_INTEGER_BOUND_CHECK("shards", inst->num_shards, >=, 1);
+		FR_INTEGER_BOUND_CHECK("shards", inst->num_shards, <=, 1024);
+
+		if (cache_memory_init(&inst->l1_inst, inst, inst->l1_max_entries, inst->num_shards) < 0) {
+			cf_log_err_cs(conf, "Failed creating local tier");
+			return -1;
+		}
 	}
 
 	/*
 	 *	Make sure the users don't screw up too badly.
+	 *
+	 *	Without an update section, entries only record that
+	 *	the key has been seen.  e.g. to find duplicate
+	 *	accounting packets.
 	 */
 	if (map_afrom_cs(&inst->maps, cf_section_sub_find(inst->cs, "update"),
 			 PAIR_LIST_REQUEST, PAIR_LIST_REQUEST, cache_verify, NULL, MAX_ATTRMAP) < 0) {
 		return -1;
 	}
 
-	if (!inst->maps) {
-		cf_log_err_cs(inst->cs, "Cache config must contain an update section, and "
-			      "that section must not be empty");
-
-		return -1;
-	}
-
 	return 0;
 }
 
@@ -657,17 +910,24 @@ static rlm_rcode_t CC_HINT(nonnull) mod_cache_it(void *instance, REQUEST *reques
 {
 	rlm_cache_entry_t *c;
 	rlm_cache_t *inst = instance;
+	cache_handles_t h;
 	vp_cursor_t cursor;
 	VALUE_PAIR *vp;
 	char buffer[1024];
 	rlm_rcode_t rcode;
+	bool claimed;
 
 	if (radius_xlat(buffer, sizeof(buffer), request, inst->key, NULL, NULL) < 0) {
 		return RLM_MODULE_FAIL;
 	}
 
-	PTHREAD_MUTEX_LOCK(&inst->cache_mutex);
-	c = cache_find(inst, request, buffer);
+	if (inst->snapshot_file) cache_snapshot_start(inst);
+
+	memset(&h, 0, sizeof(h));
+	h.key = buffer;
+
+again:
+	c = cache_find(inst, request, &h);
 
 	/*
 	 *	If yes, only return whether we found a valid cache entry
@@ -679,7 +939,8 @@ static rlm_rcode_t CC_HINT(nonnull) mod_cache_it(void *instance, REQUEST *reques
 		goto done;
 	}
 
-	if (c) {
+	if (c && !cache_entry_stale(inst, request, c)) {
+	merge:
 		cache_merge(inst, request, c);
 
 		rcode = RLM_MODULE_OK;
@@ -688,20 +949,41 @@ static rlm_rcode_t CC_HINT(nonnull) mod_cache_it(void *instance, REQUEST *reques
 
 	vp = pairfind(request->config_items, PW_CACHE_READ_ONLY, 0, TAG_ANY);
 	if (vp && vp->vp_integer) {
+		if (c) goto merge;
+
 		rcode = RLM_MODULE_NOTFOUND;
 		goto done;
 	}
 
-	c = cache_add(inst, request, buffer);
-	if (!c) {
-		rcode = RLM_MODULE_NOOP;
-		goto done;
+	/*
+	 *	Only one request creates the entry.  The others use
+	 *	the stale one if there is one, or wait for the new one.
+	 *	If that takes too long, they create it themselves.
+	 */
+	claimed = cache_refresh_claim(inst, h.key);
+	if (!claimed) {
+		if (c) {
+			RDEBUG2("Entry is being refreshed by another request, using the stale one");
+			goto merge;
+		}
+
+		cache_release(inst, request, &h);
+		if (cache_refresh_wait(inst, request, h.key)) goto again;
+
+		RWDEBUG("Timed out waiting for another request to create entry for \"%s\", creating it here", h.key);
 	}
 
-	rcode = RLM_MODULE_UPDATED;
+	if (c) RDEBUG("Refreshing stale entry for \"%s\"", h.key);
+	cache_release(inst, request, &h);
+
+	c = cache_add(inst, request, &h);
+	cache_release(inst, request, &h);
+	if (claimed) cache_refresh_done(inst, h.key);
+
+	rcode = c ? RLM_MODULE_UPDATED : RLM_MODULE_NOOP;
 
 done:
-	PTHREAD_MUTEX_UNLOCK(&inst->cache_mutex);
+	cache_release(inst, request, &h);
 
 	/*
 	 *	Reset control attributes
@@ -723,6 +1005,68 @@ done:
 }
 
 
+/** Discard cached entries
+ *
+ * Called by "radmin flush module <module> [<key>]".  Without a key, the
+ * epoch is moved forward, so that every entry created before now is
+ * treated as expired.
+ *
+ * @param[in] instance rlm_cache configuration.
+ * @param[in] key of the entry to discard, or NULL to discard all entries.
+ * @return the number of entries discarded, or -1 on error.
+ */
+static int mod_cache_flush(void *instance, char const *key)
+{
+	rlm_cache_t *inst = instance;
+	REQUEST *request;
+	cache_handles_t h;
+	int count = 0;
+
+	request = request_alloc(NULL);
+	if (!request) return -1;
+	request->timestamp = time(NULL);
+
+	memset(&h, 0, sizeof(h));
+	h.key = key;
+
+	if (cache_acquire(inst, request, &h) < 0) {
+		talloc_free(request);
+		return -1;
+	}
+
+	if (key) {
+		if (inst->l1_inst) {
+			rlm_cache_memory.acquire(&h.l1, inst->l1_inst, request, key);
+			h.l1_acquired = true;
+			rlm_cache_memory.expire(inst->l1_inst, request, &h.l1, key);
+		}
+
+		switch (inst->driver->expire(inst->driver_inst, request, &h.handle, key)) {
+		case CACHE_OK:
+			count = 1;
+			break;
+
+		case CACHE_MISS:
+			break;
+
+		default:
+			count = -1;
+			break;
+		}
+	} else {
+		count = inst->driver->count(inst->driver_inst, request, &h.handle);
+		if (count >= 0) inst->epoch = request->timestamp;
+	}
+
+	cache_release(inst, request, &h);
+	talloc_free(request);
+
+	INFO("rlm_cache (%s): Flushed %i entries", inst->xlat_name, count);
+
+	return count;
+}
+
+
 /*
  *	The module name should be the only globally exported symbol.
  *	That is, everything else should be 'static'.
@@ -750,4 +1094,8 @@ module_t rlm_cache = {
 		mod_cache_it,	       	/* post-proxy */
 		mod_cache_it,		/* post-auth */
 	},
+	0,				/* thread_inst_size */
+	NULL,				/* thread_instantiate */
+	NULL,				/* thread_detach */
+	mod_cache_flush			/* cache_flush */
 };
@@ -0,0 +1,160 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License, version 2 if the
+ *   License as published by the Free Software Foundation.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+#ifndef _RLM_CACHE_H
+#define _RLM_CACHE_H
+/**
+ * $Id$
+ * @file rlm_cache.h
+ * @brief Cache values and merge them back into future requests.
+ *
+ * @copyright 2012-2013  The FreeRADIUS server project
+ */
+RCSIDH(rlm_cache_h, "$Id$")
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/connection.h>
+#include <freeradius-devel/modpriv.h>
+
+typedef struct rlm_cache_t rlm_cache_t;
+typedef struct rlm_cache_entry_t rlm_cache_entry_t;
+
+/*
+ *	Opaque per-operation handle.  e.g. a locked shard, or a
+ *	connection from the driver's pool.
+ */
+typedef void rlm_cache_handle_t;
+
+typedef enum {
+	CACHE_ERROR	= -1,				//!< Failed.
+	CACHE_OK	= 0,				//!< Success.
+	CACHE_MISS	= 1				//!< No entry for the key.
+} cache_status_t;
+
+/** A storage backend for the cache
+ *
+ * Drivers other than the in-memory one are loaded from rlm_cache_<name>,
+ * and configured from a subsection called <name>.
+ *
+ * A handle is acquired for each key, and released when the caller has
+ * finished with it.  Drivers may replace the handle, e.g. when they
+ * reconnect, or set it to NULL if it was lost, so they have to accept a
+ * NULL handle.  A NULL key acquires a handle for operations on the whole
+ * cache.
+ *
+ * Entries returned by find belong to the driver, as do entries which
+ * were inserted successfully.  They remain valid until the handle is
+ * released.  If the insert fails, the caller still owns the entry.
+ */
+typedef struct cache_driver_t {
+	char const	*name;
+
+	int		(*mod_instantiate)(CONF_SECTION *conf, rlm_cache_t *inst, void **driver_inst);
+
+	int		(*acquire)(rlm_cache_handle_t **out, void *driver_inst, REQUEST *request, char const *key);
+	void		(*release)(void *driver_inst, REQUEST *request, rlm_cache_handle_t *handle);
+
+	cache_status_t	(*find)(rlm_cache_entry_t **out, void *driver_inst, REQUEST *request,
+				rlm_cache_handle_t **handle, char const *key);
+	cache_status_t	(*insert)(void *driver_inst, REQUEST *request, rlm_cache_handle_t **handle,
+				  rlm_cache_entry_t *c);
+	cache_status_t	(*expire)(void *driver_inst, REQUEST *request, rlm_cache_handle_t **handle,
+				  char const *key);
+	cache_status_t	(*set_ttl)(void *driver_inst, REQUEST *request, rlm_cache_handle_t **handle,
+				   rlm_cache_entry_t *c);	//!< Store an entry's new expiry time.
+	int		(*count)(void *driver_inst, REQUEST *request, rlm_cache_handle_t **handle);
+} cache_driver_t;
+
+struct rlm_cache_t {
+	char const		*xlat_name;
+	char const		*driver_name;
+	char const		*key;
+	uint32_t		ttl;
+	uint32_t		stale_ttl;	//!< How long expired entries are served while
+						//!< they're being refreshed.
+	uint32_t		max_entries;
+	uint32_t		num_shards;
+	int32_t			epoch;
+	bool			stats;
+	CONF_SECTION		*cs;
+
+	uint32_t		l1_max_entries;	//!< Of the local tier in front of an external driver.
+	uint32_t		l1_ttl;		//!< Longest entries are kept in the local tier.
+
+	void			*handle;	//!< From lt_dlopenext() of the driver.
+	cache_driver_t const	*driver;
+	void			*driver_inst;
+
+	void			*l1_inst;	//!< In-memory driver instance, or NULL.
+
+	char const		*snapshot_file;	//!< Where the in-memory cache is saved.
+	uint32_t		snapshot_interval;
+#ifdef HAVE_PTHREAD_H
+	pthread_t		snapshot_thread;
+	pthread_mutex_t		snapshot_mutex;
+	pthread_cond_t		snapshot_cond;	//!< Signalled to stop the snapshot thread.
+	bool			snapshot_running;
+	bool			snapshot_exiting;
+#endif
+
+	fr_hash_table_t		*refreshing;	//!< Keys which a request is creating an entry for.
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t		refresh_mutex;
+	pthread_cond_t		refresh_cond;	//!< Broadcast when a key is removed from 'refreshing'.
+#endif
+
+	value_pair_map_t	*maps;	//!< Attribute map applied to users
+					//!< and profiles.
+
+	/*
+	 *	Exported to the drivers.  This avoids RTLD_GLOBAL.
+	 */
+	ssize_t			(*serialize)(uint8_t **out, TALLOC_CTX *ctx, rlm_cache_entry_t const *c);
+	rlm_cache_entry_t	*(*deserialize)(TALLOC_CTX *ctx, char const *key, uint8_t const *in, size_t inlen);
+};
+
+struct rlm_cache_entry_t {
+	char const		*key;
+	long long int		hits;
+	time_t			created;
+	time_t			expires;	//!< Including stale_ttl.
+	VALUE_PAIR		*control;
+	VALUE_PAIR		*packet;
+	VALUE_PAIR		*reply;
+
+	/*
+	 *	Only used by the in-memory driver.
+	 */
+	int			offset;		//!< In the expiry heap.
+	rlm_cache_entry_t	*prev;		//!< More recently used.
+	rlm_cache_entry_t	*next;		//!< Less recently used.
+};
+
+extern cache_driver_t rlm_cache_memory;
+
+typedef int (*cache_memory_walk_t)(rlm_cache_entry_t *c, void *uctx);
+
+int		cache_memory_init(void **out, TALLOC_CTX *ctx, uint32_t max_entries, uint32_t num_shards);
+int		cache_memory_walk(void *driver_inst, cache_memory_walk_t callback, void *uctx);
+
+rlm_cache_entry_t *cache_entry_copy(TALLOC_CTX *ctx, rlm_cache_entry_t const *c);
+
+int		cache_snapshot_load(rlm_cache_t *inst);
+int		cache_snapshot_write(rlm_cache_t *inst);
+int		cache_snapshot_start(rlm_cache_t *inst);
+void		cache_snapshot_stop(rlm_cache_t *inst);
+
+ssize_t		cache_serialize(uint8_t **out, TALLOC_CTX *ctx, rlm_cache_entry_t const *c);
+rlm_cache_entry_t *cache_deserialize(TALLOC_CTX *ctx, char const *key, uint8_t const *in, size_t inlen);
+#endif
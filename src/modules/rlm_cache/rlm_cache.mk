@@ -0,0 +1,4 @@
+TARGET		:= rlm_cache.a
+SOURCES		:= rlm_cache.c memory.c serialize.c snapshot.c
+
+TGT_LDLIBS	:= $(LIBS)
@@ -0,0 +1,350 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License, version 2 if the
+ *   License as published by the Free Software Foundation.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file serialize.c
+ * @brief Binary encoding of cache entries, for the external drivers.
+ *
+ * An entry is encoded as a header, followed by its attributes.  All
+ * integers are in network byte order.
+ *
+ * @verbatim
+   header:     version (1), created (4), expires (4), hits (4)
+   attribute:  list (1), op (1), tag (1), vendor (4), attr (4), length (2), value (length)
+   @endverbatim
+ *
+ * Values are stored as they would be in a RADIUS packet, without any
+ * tag, so the encoding doesn't depend on the architecture of the server.
+ * Attributes which are no longer in the dictionary are skipped when the
+ * entry is decoded.
+ *
+ * @copyright 2014  The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include "rlm_cache.h"
+
+#include <freeradius-devel/rad_assert.h>
+
+#define CACHE_SERIALIZE_VERSION	1
+#define CACHE_HEADER_LEN	13
+#define CACHE_ATTR_HEADER_LEN	13
+
+/*
+ *	Lists, in the order they're encoded.
+ */
+#define CACHE_LIST_CONTROL	0
+#define CACHE_LIST_REQUEST	1
+#define CACHE_LIST_REPLY	2
+
+static uint8_t *cache_put32(uint8_t *p, uint32_t value)
+{
+	p[0] = (value >> 24) & 0xff;
+	p[1] = (value >> 16) & 0xff;
+	p[2] = (value >> 8) & 0xff;
+	p[3] = value & 0xff;
+
+	return p + 4;
+}
+
+static uint32_t cache_get32(uint8_t const *p)
+{
+	return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+/*
+ *	Returns the length of the value, or -1 if the type can't be
+ *	encoded.  With a NULL out, only calculates the length.
+ */
+static ssize_t cache_value_encode(uint8_t *out, VALUE_PAIR const *vp)
+{
+	uint8_t const *value;
+	size_t len = vp->length;
+	uint64_t lvalue64;
+
+	switch (vp->da->type) {
+	case PW_TYPE_STRING:
+	case PW_TYPE_OCTETS:
+		value = vp->vp_octets;
+		break;
+
+	case PW_TYPE_BYTE:
+	case PW_TYPE_BOOLEAN:
+		len = 1;
+		if (out) out[0] = vp->vp_byte;
+		return len;
+
+	case PW_TYPE_SHORT:
+		len = 2;
+		if (out) {
+			out[0] = (vp->vp_short >> 8) & 0xff;
+			out[1] = vp->vp_short & 0xff;
+		}
+		return len;
+
+	case PW_TYPE_INTEGER:
+	case PW_TYPE_DATE:
+	case PW_TYPE_SIGNED:
+		len = 4;
+		if (out) cache_put32(out, vp->vp_integer);
+		return len;
+
+	case PW_TYPE_INTEGER64:
+		len = 8;
+		if (out) {
+			lvalue64 = htonll(vp->vp_integer64);
+			memcpy(out, &lvalue64, len);
+		}
+		return len;
+
+	/*
+	 *	Already in network byte order.
+	 */
+	case PW_TYPE_IPV4_ADDR:
+	case PW_TYPE_IFID:
+	case PW_TYPE_IPV6_ADDR:
+	case PW_TYPE_IPV6_PREFIX:
+	case PW_TYPE_IPV4_PREFIX:
+	case PW_TYPE_ETHERNET:
+	case PW_TYPE_ABINARY:
+		value = (uint8_t const *) &vp->data;
+		break;
+
+	default:
+		fr_strerror_printf("Can't cache %s, it's of type %s", vp->da->name,
+				   fr_int2str(dict_attr_types, vp->da->type, "<UNKNOWN>"));
+		return -1;
+	}
+
+	if (len > UINT16_MAX) {
+		fr_strerror_printf("Can't cache %s, it's too long", vp->da->name);
+		return -1;
+	}
+
+	if (out && len) memcpy(out, value, len);
+
+	return len;
+}
+
+static int cache_value_decode(VALUE_PAIR *vp, uint8_t const *in, size_t len)
+{
+	uint64_t lvalue64;
+
+	switch (vp->da->type) {
+	case PW_TYPE_STRING:
+		pairstrncpy(vp, (char const *) in, len);
+		break;
+
+	case PW_TYPE_OCTETS:
+		pairmemcpy(vp, in, len);
+		break;
+
+	case PW_TYPE_BYTE:
+	case PW_TYPE_BOOLEAN:
+		if (len != 1) goto bad_length;
+		vp->vp_byte = in[0];
+		break;
+
+	case PW_TYPE_SHORT:
+		if (len != 2) goto bad_length;
+		vp->vp_short = (in[0] << 8) | in[1];
+		break;
+
+	case PW_TYPE_INTEGER:
+	case PW_TYPE_DATE:
+	case PW_TYPE_SIGNED:
+		if (len != 4) goto bad_length;
+		vp->vp_integer = cache_get32(in);
+		break;
+
+	case PW_TYPE_INTEGER64:
+		if (len != 8) goto bad_length;
+		memcpy(&lvalue64, in, len);
+		vp->vp_integer64 = ntohll(lvalue64);
+		break;
+
+	case PW_TYPE_IPV4_ADDR:
+	case PW_TYPE_IFID:
+	case PW_TYPE_IPV6_ADDR:
+	case PW_TYPE_IPV6_PREFIX:
+	case PW_TYPE_IPV4_PREFIX:
+	case PW_TYPE_ETHERNET:
+	case PW_TYPE_ABINARY:
+		if ((len < dict_attr_sizes[vp->da->type][0]) || (len > dict_attr_sizes[vp->da->type][1]) ||
+		    (len > sizeof(vp->data))) {
+		bad_length:
+			fr_strerror_printf("Invalid length %zu for %s", len, vp->da->name);
+			return -1;
+		}
+		memcpy(&vp->data, in, len);
+		break;
+
+	default:
+		fr_strerror_printf("Can't decode %s, it's of type %s", vp->da->name,
+				   fr_int2str(dict_attr_types, vp->da->type, "<UNKNOWN>"));
+		return -1;
+	}
+
+	vp->length = len;
+	vp->type = VT_DATA;
+
+	return 0;
+}
+
+/** Encode a cache entry
+ *
+ * @param[out] out Where to write the encoded entry.
+ * @param[in] ctx to allocate the buffer in.
+ * @param[in] c entry to encode.  The key isn't included.
+ * @return the length of the encoded entry, or -1 on error (with fr_strerror() set).
+ */
+ssize_t cache_serialize(uint8_t **out, TALLOC_CTX *ctx, rlm_cache_entry_t const *c)
+{
+	VALUE_PAIR const *lists[3];
+	VALUE_PAIR const *vp;
+	uint8_t *buff, *p;
+	ssize_t len;
+	size_t total = CACHE_HEADER_LEN;
+	int i;
+
+	lists[CACHE_LIST_CONTROL] = c->control;
+	lists[CACHE_LIST_REQUEST] = c->packet;
+	lists[CACHE_LIST_REPLY] = c->reply;
+
+	/*
+	 *	Work out how long it's going to be, so we only
+	 *	allocate once.
+	 */
+	for (i = 0; i < 3; i++) {
+		for (vp = lists[i]; vp; vp = vp->next) {
+			len = cache_value_encode(NULL, vp);
+			if (len < 0) return -1;
+
+			total += CACHE_ATTR_HEADER_LEN + len;
+		}
+	}
+
+	buff = p = talloc_array(ctx, uint8_t, total);
+	if (!buff) {
+		fr_strerror_printf("Out of memory");
+		return -1;
+	}
+
+	*p++ = CACHE_SERIALIZE_VERSION;
+	p = cache_put32(p, c->created);
+	p = cache_put32(p, c->expires);
+	p = cache_put32(p, c->hits);
+
+	for (i = 0; i < 3; i++) {
+		for (vp = lists[i]; vp; vp = vp->next) {
+			len = cache_value_encode(p + CACHE_ATTR_HEADER_LEN, vp);
+
+			*p++ = i;
+			*p++ = vp->op;
+			*p++ = vp->tag;
+			p = cache_put32(p, vp->da->vendor);
+			p = cache_put32(p, vp->da->attr);
+			*p++ = (len >> 8) & 0xff;
+			*p++ = len & 0xff;
+			p += len;
+		}
+	}
+
+	rad_assert((size_t) (p - buff) == total);
+
+	*out = buff;
+
+	return total;
+}
+
+/** Decode a cache entry
+ *
+ * @param[in] ctx to allocate the entry in.
+ * @param[in] key of the entry.
+ * @param[in] in encoded entry.
+ * @param[in] inlen length of the encoded entry.
+ * @return the entry, or NULL on error (with fr_strerror() set).
+ */
+rlm_cache_entry_t *cache_deserialize(TALLOC_CTX *ctx, char const *key, uint8_t const *in, size_t inlen)
+{
+	rlm_cache_entry_t *c;
+	uint8_t const *p = in, *end = in + inlen;
+	vp_cursor_t cursors[3];
+
+	if ((inlen < CACHE_HEADER_LEN) || (in[0] != CACHE_SERIALIZE_VERSION)) {
+		fr_strerror_printf("Invalid cache entry header");
+		return NULL;
+	}
+
+	c = talloc_zero(ctx, rlm_cache_entry_t);
+	if (!c) {
+		fr_strerror_printf("Out of memory");
+		return NULL;
+	}
+
+	c->key = talloc_typed_strdup(c, key);
+	c->created = cache_get32(p + 1);
+	c->expires = cache_get32(p + 5);
+	c->hits = cache_get32(p + 9);
+	p += CACHE_HEADER_LEN;
+
+	fr_cursor_init(&cursors[CACHE_LIST_CONTROL], &c->control);
+	fr_cursor_init(&cursors[CACHE_LIST_REQUEST], &c->packet);
+	fr_cursor_init(&cursors[CACHE_LIST_REPLY], &c->reply);
+
+	while (p < end) {
+		DICT_ATTR const *da;
+		VALUE_PAIR *vp;
+		size_t len;
+
+		if ((end - p) < CACHE_ATTR_HEADER_LEN) {
+		truncated:
+			fr_strerror_printf("Cache entry is truncated");
+		error:
+			talloc_free(c);
+			return NULL;
+		}
+
+		len = (p[11] << 8) | p[12];
+		if ((size_t) (end - p) < (CACHE_ATTR_HEADER_LEN + len)) goto truncated;
+
+		if (p[0] > CACHE_LIST_REPLY) {
+			fr_strerror_printf("Invalid list %u in cache entry", p[0]);
+			goto error;
+		}
+
+		da = dict_attrbyvalue(cache_get32(p + 7), cache_get32(p + 3));
+		if (!da) goto next;
+
+		vp = pairalloc(c, da);
+		if (!vp) goto error;
+
+		vp->op = p[1];
+		vp->tag = p[2];
+
+		if (cache_value_decode(vp, p + CACHE_ATTR_HEADER_LEN, len) < 0) {
+			talloc_free(vp);
+			goto error;
+		}
+
+		fr_cursor_insert(&cursors[p[0]], vp);
+
+	next:
+		p += CACHE_ATTR_HEADER_LEN + len;
+	}
+
+	return c;
+}
@@ -0,0 +1,341 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License, version 2 if the
+ *   License as published by the Free Software Foundation.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file snapshot.c
+ * @brief Save the in-memory cache to a file, and load it again on start up.
+ *
+ * The file starts with a magic number, followed by one record for each
+ * entry.  All integers are in network byte order.
+ *
+ * @verbatim
+   record:  key length (2), entry length (4), key, entry (see serialize.c)
+   @endverbatim
+ *
+ * Entries keep their absolute expiry time, so the time the server was
+ * stopped for counts against their TTL.
+ *
+ * @copyright 2014  The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include "rlm_cache.h"
+
+#include <fcntl.h>
+
+#define CACHE_SNAPSHOT_MAGIC		"FRcache1"
+#define CACHE_SNAPSHOT_MAGIC_LEN	8
+#define CACHE_RECORD_HEADER_LEN		6
+
+typedef struct cache_snapshot_t {
+	rlm_cache_t const	*inst;
+	FILE			*fp;
+	time_t			now;
+	uint32_t		count;
+} cache_snapshot_t;
+
+static int _cache_snapshot_entry(rlm_cache_entry_t *c, void *uctx)
+{
+	cache_snapshot_t *snap = uctx;
+	uint8_t header[CACHE_RECORD_HEADER_LEN];
+	uint8_t *data;
+	ssize_t len;
+	size_t keylen;
+
+	if ((c->expires < snap->now) || (c->created < snap->inst->epoch)) return 0;
+
+	keylen = strlen(c->key);
+	if (keylen > UINT16_MAX) return 0;
+
+	/*
+	 *	Entries with attributes which can't be encoded
+	 *	are left out.
+	 */
+	len = cache_serialize(&data, NULL, c);
+	if (len < 0) return 0;
+
+	header[0] = (keylen >> 8) & 0xff;
+	header[1] = keylen & 0xff;
+	header[2] = (len >> 24) & 0xff;
+	header[3] = (len >> 16) & 0xff;
+	header[4] = (len >> 8) & 0xff;
+	header[5] = len & 0xff;
+
+	if ((fwrite(header, sizeof(header), 1, snap->fp) != 1) ||
+	    (keylen && (fwrite(c->key, keylen, 1, snap->fp) != 1)) ||
+	    (fwrite(data, len, 1, snap->fp) != 1)) {
+		talloc_free(data);
+		return -1;
+	}
+	talloc_free(data);
+
+	snap->count++;
+
+	return 0;
+}
+
+/** Write the in-memory cache to the snapshot file
+ *
+ * The snapshot is written to a temporary file, which is synced to
+ * disk and then replaces the old one, so a crash never leaves a
+ * partial snapshot.  The entries may contain passwords, so the file
+ * is only readable by the user the server runs as.
+ *
+ * @param[in] inst rlm_cache configuration.
+ * @return the number of entries written, or -1 on error.
+ */
+int cache_snapshot_write(rlm_cache_t *inst)
+{
+	cache_snapshot_t snap;
+	char tmp[PATH_MAX];
+	int fd;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", inst->snapshot_file);
+
+	memset(&snap, 0, sizeof(snap));
+	snap.inst = inst;
+	snap.now = time(NULL);
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		ERROR("rlm_cache (%s): Failed creating %s: %s", inst->xlat_name, tmp, fr_syserror(errno));
+		return -1;
+	}
+
+	snap.fp = fdopen(fd, "w");
+	if (!snap.fp) {
+		ERROR("rlm_cache (%s): Failed creating %s: %s", inst->xlat_name, tmp, fr_syserror(errno));
+		close(fd);
+		unlink(tmp);
+		return -1;
+	}
+
+	if ((fwrite(CACHE_SNAPSHOT_MAGIC, CACHE_SNAPSHOT_MAGIC_LEN, 1, snap.fp) != 1) ||
+	    (cache_memory_walk(inst->driver_inst, _cache_snapshot_entry, &snap) < 0)) {
+		ERROR("rlm_cache (%s): Failed writing %s: %s", inst->xlat_name, tmp, fr_syserror(errno));
+		fclose(snap.fp);
+	error:
+		unlink(tmp);
+		return -1;
+	}
+
+	if ((fflush(snap.fp) != 0) || (fsync(fd) < 0)) {
+		ERROR("rlm_cache (%s): Failed writing %s: %s", inst->xlat_name, tmp, fr_syserror(errno));
+		fclose(snap.fp);
+		goto error;
+	}
+
+	if (fclose(snap.fp) != 0) {
+		ERROR("rlm_cache (%s): Failed writing %s: %s", inst->xlat_name, tmp, fr_syserror(errno));
+		goto error;
+	}
+
+	if (rename(tmp, inst->snapshot_file) < 0) {
+		ERROR("rlm_cache (%s): Failed renaming %s to %s: %s", inst->xlat_name, tmp, inst->snapshot_file,
+		      fr_syserror(errno));
+		goto error;
+	}
+
+	DEBUG("rlm_cache (%s): Wrote %u entries to %s", inst->xlat_name, snap.count, inst->snapshot_file);
+
+	return snap.count;
+}
+
+/** Load the snapshot file into the in-memory cache
+ *
+ * A missing file isn't an error.  A damaged one is loaded up to the
+ * first bad record.
+ *
+ * @param[in] inst rlm_cache configuration.
+ * @return the number of entries loaded, or -1 on error.
+ */
+int cache_snapshot_load(rlm_cache_t *inst)
+{
+	FILE *fp;
+	REQUEST *request;
+	uint8_t magic[CACHE_SNAPSHOT_MAGIC_LEN];
+	uint8_t header[CACHE_RECORD_HEADER_LEN];
+	uint8_t *buff = NULL;
+	size_t keylen, len;
+	int count = 0, skipped = 0;
+
+	fp = fopen(inst->snapshot_file, "r");
+	if (!fp) {
+		if (errno == ENOENT) return 0;
+
+		ERROR("rlm_cache (%s): Failed opening %s: %s", inst->xlat_name, inst->snapshot_file,
+		      fr_syserror(errno));
+		return -1;
+	}
+
+	if ((fread(magic, sizeof(magic), 1, fp) != 1) ||
+	    (memcmp(magic, CACHE_SNAPSHOT_MAGIC, sizeof(magic)) != 0)) {
+		ERROR("rlm_cache (%s): %s is not a cache snapshot", inst->xlat_name, inst->snapshot_file);
+		fclose(fp);
+		return -1;
+	}
+
+	request = request_alloc(NULL);
+	if (!request) {
+		fclose(fp);
+		return -1;
+	}
+	request->timestamp = time(NULL);
+
+	while (fread(header, sizeof(header), 1, fp) == 1) {
+		rlm_cache_entry_t *c;
+		rlm_cache_handle_t *handle;
+		cache_status_t ret;
+		char *key;
+
+		keylen = (header[0] << 8) | header[1];
+		len = ((size_t) header[2] << 24) | (header[3] << 16) | (header[4] << 8) | header[5];
+
+		buff = talloc_realloc(request, buff, uint8_t, keylen + 1 + len);
+		if (!buff) break;
+
+		if ((keylen && (fread(buff, keylen, 1, fp) != 1)) ||
+		    (len && (fread(buff + keylen + 1, len, 1, fp) != 1))) {
+			WARN("rlm_cache (%s): %s is truncated", inst->xlat_name, inst->snapshot_file);
+			break;
+		}
+		buff[keylen] = '\0';
+		key = (char *) buff;
+
+		c = cache_deserialize(NULL, key, buff + keylen + 1, len);
+		if (!c) {
+			WARN("rlm_cache (%s): Failed loading entry for \"%s\": %s", inst->xlat_name, key,
+			     fr_strerror());
+			break;
+		}
+
+		if (c->expires < request->timestamp) {
+			talloc_free(c);
+			skipped++;
+			continue;
+		}
+
+		rlm_cache_memory.acquire(&handle, inst->driver_inst, request, c->key);
+		ret = rlm_cache_memory.insert(inst->driver_inst, request, &handle, c);
+		rlm_cache_memory.release(inst->driver_inst, request, handle);
+
+		if (ret != CACHE_OK) {
+			talloc_free(c);
+			continue;
+		}
+		count++;
+	}
+
+	fclose(fp);
+	talloc_free(request);
+
+	INFO("rlm_cache (%s): Loaded %i entries from %s, %i had expired", inst->xlat_name, count,
+	     inst->snapshot_file, skipped);
+
+	return count;
+}
+
+#ifdef HAVE_PTHREAD_H
+/*
+ *	Every snapshot_interval seconds, write a snapshot.  A final
+ *	one is written when the module is detached.
+ */
+static void *cache_snapshot_thread(void *arg)
+{
+	rlm_cache_t	*inst = arg;
+	struct timeval	now;
+	struct timespec	when;
+	bool		exiting;
+
+	pthread_mutex_lock(&inst->snapshot_mutex);
+	do {
+		if (!inst->snapshot_exiting) {
+			gettimeofday(&now, NULL);
+			when.tv_sec = now.tv_sec + inst->snapshot_interval;
+			when.tv_nsec = now.tv_usec * 1000;
+			pthread_cond_timedwait(&inst->snapshot_cond, &inst->snapshot_mutex, &when);
+		}
+		exiting = inst->snapshot_exiting;
+		pthread_mutex_unlock(&inst->snapshot_mutex);
+
+		cache_snapshot_write(inst);
+
+		pthread_mutex_lock(&inst->snapshot_mutex);
+	} while (!exiting);
+	pthread_mutex_unlock(&inst->snapshot_mutex);
+
+	return NULL;
+}
+#endif
+
+/** Start writing snapshots in the background
+ *
+ * This is done when the first request is processed instead of in
+ * mod_instantiate(), as the server may fork after the modules have been
+ * instantiated.
+ *
+ * @param[in] inst rlm_cache configuration.
+ * @return 0 on success (or if already started), -1 on error.
+ */
+int cache_snapshot_start(rlm_cache_t *inst)
+{
+#ifdef HAVE_PTHREAD_H
+	int ret = 0;
+
+	/*
+	 *	Checked again with the mutex held.
+	 */
+	if (inst->snapshot_running) return 0;
+
+	pthread_mutex_lock(&inst->snapshot_mutex);
+	if (!inst->snapshot_running) {
+		ret = pthread_create(&inst->snapshot_thread, NULL, cache_snapshot_thread, inst);
+		if (ret != 0) {
+			ERROR("rlm_cache (%s): Failed creating snapshot thread: %s", inst->xlat_name,
+			      fr_syserror(ret));
+		} else {
+			inst->snapshot_running = true;
+		}
+	}
+	pthread_mutex_unlock(&inst->snapshot_mutex);
+
+	return ret == 0 ? 0 : -1;
+#else
+	return 0;
+#endif
+}
+
+/** Stop the snapshot thread, and write a final snapshot
+ *
+ * @param[in] inst rlm_cache configuration.
+ */
+void cache_snapshot_stop(rlm_cache_t *inst)
+{
+#ifdef HAVE_PTHREAD_H
+	if (inst->snapshot_running) {
+		pthread_mutex_lock(&inst->snapshot_mutex);
+		inst->snapshot_exiting = true;
+		pthread_cond_signal(&inst->snapshot_cond);
+		pthread_mutex_unlock(&inst->snapshot_mutex);
+
+		pthread_join(inst->snapshot_thread, NULL);
+		inst->snapshot_running = false;
+		return;
+	}
+#endif
+
+	cache_snapshot_write(inst);
+}
@@ -203,4 +203,8 @@ module_t rlm_chap = {
 		NULL,			/* post-proxy */
 		NULL			/* post-auth */
 	},
+	0,				/* thread_inst_size */
+	NULL,				/* thread_instantiate */
+	NULL,				/* thread_detach */
+	NULL				/* cache_flush */
 };
@@ -31,6 +31,7 @@ RCSID("$Id$");
 #include <libcouchbase/couchbase.h>
 #include <json.h>
 
+#include "mod.h"
 #include "couchbase.h"
 #include "jsonc_missing.h"
 
@@ -63,16 +64,76 @@ void couchbase_stat_callback(lcb_t instance, const void *cookie, lcb_error_t err
 void couchbase_store_callback(lcb_t instance, const void *cookie, lcb_storage_t operation,
 			      lcb_error_t error, const lcb_store_resp_t *resp)
 {
-	if (error != LCB_SUCCESS) {
+	cookie_u cu;                            /* union of const and non const pointers */
+	cu.cdata = cookie;                      /* set const union member to cookie passed from couchbase */
+	cookie_t *c = (cookie_t *) cu.data;     /* set our cookie struct using non-const member */
+
+	/* record result if a cookie was passed */
+	if (c) c->error = error;
+
+	/* check error */
+	switch (error) {
+	case LCB_SUCCESS:
+		break;
+
+	case LCB_KEY_EEXISTS:
+		/* expected for add operations, the caller decides what to do */
+		if (operation == LCB_ADD) break;
+		/* FALL-THROUGH */
+
+	default:
 		/* log error */
 		ERROR("rlm_couchbase: (store_callback) %s (0x%x)", lcb_strerror(instance, error), error);
+		break;
 	}
 	/* silent compiler */
-	(void)cookie;
-	(void)operation;
 	(void)resp;
 }
 
+/** Add a document fetched by a multi-get to the cookie
+ *
+ * Parses the document and adds it to the cookie's document object, using
+ * the document key as the element name.
+ *
+ * @param c    Cookie of the multi-get.
+ * @param resp Couchbase get operation response object.
+ */
+static void couchbase_get_add_document(cookie_t *c, const lcb_get_resp_t *resp)
+{
+	char key[MAX_KEY_SIZE + 1];                     /* document key */
+	json_tokener *jtok;                             /* json tokener */
+	json_object *jobj;                              /* parsed document */
+	enum json_tokener_error jerr;                   /* json tokener error */
+
+	/* keys aren't nul terminated */
+	if (resp->v.v0.nkey >= sizeof(key)) {
+		ERROR("rlm_couchbase: (get_callback) document key longer than MAX_KEY_SIZE (%d)", MAX_KEY_SIZE);
+		return;
+	}
+	memcpy(key, resp->v.v0.key, resp->v.v0.nkey);
+	key[resp->v.v0.nkey] = '\0';
+
+	/* neither is the document */
+	jtok = json_tokener_new();
+	if (!jtok) {
+		ERROR("rlm_couchbase: (get_callback) failed allocating JSON tokener");
+		return;
+	}
+	jobj = json_tokener_parse_ex(jtok, resp->v.v0.bytes, resp->v.v0.nbytes);
+	jerr = json_tokener_get_error(jtok);
+	json_tokener_free(jtok);
+
+	if (!jobj || (jerr != json_tokener_success)) {
+		ERROR("rlm_couchbase: (get_callback) JSON Tokener error in document '%s': %s", key,
+		      json_tokener_error_desc(jerr));
+		if (jobj) json_object_put(jobj);
+		return;
+	}
+
+	/* document object takes ownership */
+	json_object_object_add(c->jdocs, key, jobj);
+}
+
 /** Couchbase callback for get (read) operations
  *
  * @param instance Couchbase connection instance.
@@ -88,6 +149,9 @@ void couchbase_get_callback(lcb_t instance, const void *cookie, lcb_error_t erro
 	const char *bytes = resp->v.v0.bytes;   /* the payload of this chunk */
 	lcb_size_t nbytes = resp->v.v0.nbytes;  /* length of this data chunk */
 
+	/* record result */
+	c->error = error;
+
 	/* check error */
 	switch (error) {
 	case LCB_SUCCESS:
@@ -95,6 +159,16 @@ void couchbase_get_callback(lcb_t instance, const void *cookie, lcb_error_t erro
 		if (bytes && nbytes > 1) {
 			/* debug */
 			DEBUG("rlm_couchbase: (get_callback) got %zu bytes", nbytes);
+			/* add to the documents of a multi-get */
+			if (c->jdocs) {
+				couchbase_get_add_document(c, resp);
+				break;
+			}
+			/* decode straight into value pairs */
+			if (c->decoder) {
+				c->decoded = mod_json_document_to_value_pairs(c->decoder, c->request, bytes, nbytes);
+				break;
+			}
 			/* build json object */
 			c->jobj = json_tokener_parse_verbose(bytes, &c->jerr);
 			/* switch on current error status */
@@ -301,6 +375,54 @@ lcb_error_t couchbase_set_key(lcb_t instance, const char *key, const char *docum
 	return error;
 }
 
+/** Add a document by key to Couchbase
+ *
+ * Setup and execute a Couchbase add operation and wait for the result.  Unlike
+ * @p couchbase_set_key this fails with LCB_KEY_EEXISTS if the key exists, which
+ * lets callers create documents without reading them first.
+ *
+ * @param  instance Couchbase connection instance.
+ * @param  cookie   Couchbase cookie for returning information from callbacks.
+ * @param  key      Document key to store in the database.
+ * @param  document Document body to store in the database.
+ * @param  expire   Expiration time for the document (0 = never)
+ * @return          Couchbase error object.
+ */
+lcb_error_t couchbase_add_key(lcb_t instance, const void *cookie, const char *key, const char *document, int expire)
+{
+	lcb_error_t error;                  /* couchbase command return */
+	lcb_store_cmd_t cmd;                /* store command stuct */
+	const lcb_store_cmd_t *commands[1]; /* store commands array */
+	cookie_u cu;                        /* union of const and non const pointers */
+
+	/* init commands */
+	commands[0] = &cmd;
+	memset(&cmd, 0, sizeof(cmd));
+
+	/* populate command struct */
+	cmd.v.v0.key = key;
+	cmd.v.v0.nkey = strlen(cmd.v.v0.key);
+	cmd.v.v0.bytes = document;
+	cmd.v.v0.nbytes = strlen(cmd.v.v0.bytes);
+	cmd.v.v0.exptime = expire;
+	cmd.v.v0.operation = LCB_ADD;
+
+	/* reset result */
+	cu.cdata = cookie;
+	((cookie_t *) cu.data)->error = LCB_SUCCESS;
+
+	/* add key/document in couchbase */
+	if ((error = lcb_store(instance, cookie, 1, commands)) == LCB_SUCCESS) {
+		/* enter event loop on success */
+		lcb_wait(instance);
+		/* return result of the operation */
+		error = ((cookie_t *) cu.data)->error;
+	}
+
+	/* return error */
+	return error;
+}
+
 /** Retrieve a document by key from Couchbase
  *
  * Setup and execute a Couchbase get request and wait for the result.
@@ -334,6 +456,54 @@ lcb_error_t couchbase_get_key(lcb_t instance, const void *cookie, const char *ke
 	return error;
 }
 
+/** Retrieve multiple documents by key from Couchbase
+ *
+ * Setup and execute a single Couchbase get request for all keys and wait for
+ * the results, which are added to the cookie's @p jdocs object by key.
+ * Documents which don't exist, or can't be parsed, are omitted.
+ *
+ * @param  instance Couchbase connection instance.
+ * @param  cookie   Couchbase cookie for returning information from callbacks.
+ * @param  keys     Document keys to fetch.
+ * @param  nkeys    Number of keys.
+ * @return          Couchbase error object.
+ */
+lcb_error_t couchbase_get_keys(lcb_t instance, const void *cookie, const char * const *keys, int nkeys)
+{
+	lcb_error_t error;                  /* couchbase command return */
+	lcb_get_cmd_t *cmds;                /* get command structs */
+	const lcb_get_cmd_t **commands;     /* get commands array */
+	int i;                              /* key index */
+
+	/* allocate commands */
+	cmds = talloc_zero_array(NULL, lcb_get_cmd_t, nkeys);
+	if (!cmds) return LCB_CLIENT_ENOMEM;
+
+	commands = talloc_array(cmds, const lcb_get_cmd_t *, nkeys);
+	if (!commands) {
+		talloc_free(cmds);
+		return LCB_CLIENT_ENOMEM;
+	}
+
+	/* populate command structs */
+	for (i = 0; i < nkeys; i++) {
+		commands[i] = &cmds[i];
+		cmds[i].v.v0.key = keys[i];
+		cmds[i].v.v0.nkey = strlen(keys[i]);
+	}
+
+	/* get documents, the callback is called once per key */
+	if ((error = lcb_get(instance, cookie, nkeys, commands)) == LCB_SUCCESS) {
+		/* enter event loop on success */
+		lcb_wait(instance);
+	}
+
+	talloc_free(cmds);
+
+	/* return error */
+	return error;
+}
+
 /** Query a Couchbase design document view
  *
  * Setup and execute a Couchbase view request and wait for the result.
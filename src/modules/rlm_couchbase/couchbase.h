@@ -41,6 +41,13 @@ typedef struct cookie_t {
 	json_object *jobj;              //!< JSON objects handled by the json-c library.
 	json_tokener *jtok;             //!< JSON tokener objects handled by the json-c library.
 	enum json_tokener_error jerr;   //!< Error values produced by the json-c library.
+	void *decoder;                  //!< If set, documents are decoded straight into value
+	                                //!< pairs for @p request, instead of into @p jobj.
+	REQUEST *request;               //!< Request to add decoded value pairs to.
+	int decoded;                    //!< 1 if a document was decoded, -1 if it was malformed.
+	json_object *jdocs;             //!< If set, documents fetched by @p couchbase_get_keys
+	                                //!< are added to this object, by key.
+	lcb_error_t error;              //!< Result of the last get or store operation.
 } cookie_t;
 
 /** Union of constant and non-constant pointers
@@ -78,9 +85,15 @@ lcb_error_t couchbase_server_stats(lcb_t instance, const void *cookie);
 /* store document/key in couchbase */
 lcb_error_t couchbase_set_key(lcb_t instance, const char *key, const char *document, int expire);
 
+/* store document/key in couchbase, failing if the key already exists */
+lcb_error_t couchbase_add_key(lcb_t instance, const void *cookie, const char *key, const char *document, int expire);
+
 /* pull document from couchbase by key */
 lcb_error_t couchbase_get_key(lcb_t instance, const void *cookie, const char *key);
 
+/* pull multiple documents from couchbase in one operation */
+lcb_error_t couchbase_get_keys(lcb_t instance, const void *cookie, const char * const *keys, int nkeys);
+
 /* query a couchbase view via http */
 lcb_error_t couchbase_query_view(lcb_t instance, const void *cookie, const char *path, const char *post);
 
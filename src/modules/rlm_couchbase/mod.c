@@ -97,6 +97,16 @@ void *mod_conn_create(TALLOC_CTX *ctx, void *instance)
 	chandle->cookie = cookie;
 	chandle->handle = cb_inst;
 
+	/* allocate user document decoder */
+	chandle->decoder = mod_json_decoder_alloc(chandle);
+	if (!chandle->decoder) {
+		ERROR("rlm_couchbase: failed to allocate user document decoder");
+		/* free handle, which destroys the couchbase instance */
+		talloc_free(chandle);
+		/* fail */
+		return NULL;
+	}
+
 	/* return handle struct */
 	return chandle;
 }
@@ -231,10 +241,252 @@ int mod_attribute_to_element(const char *name, json_object *map, void *buf)
 	return -1;
 }
 
-/** Build value pairs from the passed JSON object and add to the request
+/** State of the user document decoder
+ *
+ * The decoder is fed the user document by the get callback, and creates
+ * value pairs as the document is parsed, without building json-c objects.
+ * Anything other than the "config" and "reply" sections, and the "value"
+ * and "op" elements of attributes, is skipped by the parser.
+ */
+struct mod_json_decoder {
+	fr_json_parser_t *parser;   //!< Incremental JSON parser.
+	REQUEST *request;           //!< Request to add the value pairs to.
+	char const *section;        //!< Current section ("config" or "reply"), or NULL.
+	VALUE_PAIR *vps[2];         //!< Pairs for the config and reply sections.
+	bool failed;                //!< Skip the rest of the current section.
+	char attribute[256];        //!< Name of the current attribute.
+	char *value;                //!< Value of the current attribute.
+	size_t value_alloc;         //!< Space allocated for the value.
+	bool has_value;             //!< The current attribute has a value.
+	bool has_op;                //!< The current attribute has an operator.
+	FR_TOKEN op;                //!< Operator of the current attribute.
+	enum {
+		MOD_JSON_NONE = 0,      //!< Not in an attribute element.
+		MOD_JSON_VALUE,         //!< Expecting the 'value' element of an attribute.
+		MOD_JSON_OP             //!< Expecting the 'op' element of an attribute.
+	} element;
+};
+
+/** Create the value pair for the current attribute
+ *
+ * @param  dec The decoder.
+ * @return     Returns 0 on success, or -1 if the pair could not be created.
+ */
+static int mod_json_decoder_pairmake(mod_json_decoder_t *dec)
+{
+	REQUEST *request = dec->request;    /* request for debugging */
+	TALLOC_CTX *ctx;                    /* talloc context for pairmake */
+	VALUE_PAIR *vp, **ptr;              /* value pair and value pair pointer for pairmake */
+
+	/* check for value and op */
+	if (!dec->has_value || !dec->has_op) {
+		/* log error */
+		RERROR("failed to get 'value' or 'op' element for '%s' attribute", dec->attribute);
+		/* return */
+		return 0;
+	}
+
+	/* assign ctx and vps for pairmake based on section */
+	if (strcmp(dec->section, "config") == 0) {
+		ctx = request;
+		ptr = &dec->vps[0];
+	} else {
+		ctx = request->reply;
+		ptr = &dec->vps[1];
+	}
+
+	/* debugging */
+	RDEBUG("adding '%s' attribute to '%s' section", dec->attribute, dec->section);
+
+	/* add pair */
+	vp = pairmake(ctx, ptr, dec->attribute, dec->value, dec->op);
+	/* check pair */
+	if (!vp) {
+		RERROR("could not build value pair for '%s' attribute (%s)", dec->attribute, fr_strerror());
+		/* return */
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Handle events from the JSON parser
+ *
+ * Matches the fr_json_callback_t prototype.
+ */
+static fr_json_action_t mod_json_decoder_event(void *uctx, fr_json_event_t event, int depth,
+					       char const *value, size_t len)
+{
+	mod_json_decoder_t *dec = uctx;     /* our decoder */
+	REQUEST *request = dec->request;    /* request for debugging */
+
+	switch (depth) {
+	/* the document itself */
+	case 0:
+		if ((event == FR_JSON_OBJECT_START) || (event == FR_JSON_OBJECT_END)) return FR_JSON_CONTINUE;
+		/* log error */
+		RERROR("invalid json type for user document - documents must be json objects");
+		/* abort */
+		return FR_JSON_ABORT;
+
+	/* section names, and the sections themselves */
+	case 1:
+		if (event == FR_JSON_KEY) {
+			if (strcmp(value, "config") == 0) {
+				dec->section = "config";
+			} else if (strcmp(value, "reply") == 0) {
+				dec->section = "reply";
+			} else {
+				/* not a section we're interested in */
+				return FR_JSON_SKIP;
+			}
+			dec->failed = false;
+			return FR_JSON_CONTINUE;
+		}
+
+		/* end of the section */
+		if (event == FR_JSON_OBJECT_END) {
+			dec->section = NULL;
+			return FR_JSON_CONTINUE;
+		}
+
+		/* make sure we have the correct type */
+		if (event != FR_JSON_OBJECT_START) {
+			/* log error */
+			RERROR("invalid json type for '%s' section - sections must be json objects", dec->section);
+			/* skip it */
+			return (event == FR_JSON_ARRAY_START) ? FR_JSON_SKIP : FR_JSON_CONTINUE;
+		}
+		return FR_JSON_CONTINUE;
+
+	/* attribute names, and the attribute elements */
+	case 2:
+		if (event == FR_JSON_KEY) {
+			if (dec->failed) return FR_JSON_SKIP;
+
+			/* keep the attribute name */
+			if (len >= sizeof(dec->attribute)) {
+				RERROR("attribute name '%s' is too long", value);
+				return FR_JSON_SKIP;
+			}
+			strlcpy(dec->attribute, value, sizeof(dec->attribute));
+
+			/* debugging */
+			RDEBUG("parsing '%s' attribute: %s", dec->section, dec->attribute);
+			return FR_JSON_CONTINUE;
+		}
+
+		/* end of the attribute element */
+		if (event == FR_JSON_OBJECT_END) {
+			if (mod_json_decoder_pairmake(dec) < 0) dec->failed = true;
+			return FR_JSON_CONTINUE;
+		}
+
+		/* check for appropriate type */
+		if (event != FR_JSON_OBJECT_START) {
+			/* log error */
+			RERROR("invalid json type for '%s' attribute - attributes must be json objects",
+			       dec->attribute);
+			/* skip the rest of the section */
+			dec->failed = true;
+			return (event == FR_JSON_ARRAY_START) ? FR_JSON_SKIP : FR_JSON_CONTINUE;
+		}
+
+		/* start of the attribute element */
+		dec->has_value = false;
+		dec->has_op = false;
+		dec->element = MOD_JSON_NONE;
+		return FR_JSON_CONTINUE;
+
+	/* 'value' and 'op' elements */
+	case 3:
+		if (event == FR_JSON_KEY) {
+			if (strcmp(value, "value") == 0) {
+				dec->element = MOD_JSON_VALUE;
+			} else if (strcmp(value, "op") == 0) {
+				dec->element = MOD_JSON_OP;
+			} else {
+				/* ignore anything else */
+				return FR_JSON_SKIP;
+			}
+			return FR_JSON_CONTINUE;
+		}
+
+		if (dec->element == MOD_JSON_OP) {
+			if ((event == FR_JSON_OBJECT_START) || (event == FR_JSON_ARRAY_START)) {
+				dec->op = 0;
+				dec->has_op = true;
+				return FR_JSON_SKIP;
+			}
+			dec->op = fr_str2int(fr_tokens, value, 0);
+			dec->has_op = true;
+			return FR_JSON_CONTINUE;
+		}
+
+		/* make correct pairs based on json value type */
+		switch (event) {
+		case FR_JSON_NUMBER:
+		case FR_JSON_STRING:
+			if ((len + 1) > dec->value_alloc) {
+				char *p;
+
+				p = talloc_realloc(dec, dec->value, char, len + 1);
+				if (!p) return FR_JSON_ABORT;
+				dec->value = p;
+				dec->value_alloc = len + 1;
+			}
+			memcpy(dec->value, value, len + 1);
+			dec->has_value = true;
+			return FR_JSON_CONTINUE;
+
+		case FR_JSON_OBJECT_START:
+		case FR_JSON_ARRAY_START:
+			/* log error - we want to handle these eventually */
+			RERROR("skipping unhandled nested json object or array value pair object");
+			return FR_JSON_SKIP;
+
+		default:
+			/* log error */
+			RERROR("skipping unhandled json type in value pair object");
+			return FR_JSON_CONTINUE;
+		}
+
+	/* nothing deeper is ever given to us */
+	default:
+		return FR_JSON_SKIP;
+	}
+}
+
+/** Allocate a user document decoder
  *
- * Parse the passed JSON object and create value pairs that will be injected into
- * the given request for authorization.
+ * The decoder belongs to a connection handle, and is reused for every
+ * document fetched with it.
+ *
+ * @param  ctx The talloc context to allocate the decoder in.
+ * @return     Returns the new decoder, or NULL on error.
+ */
+mod_json_decoder_t *mod_json_decoder_alloc(TALLOC_CTX *ctx)
+{
+	mod_json_decoder_t *dec;    /* new decoder */
+
+	dec = talloc_zero(ctx, mod_json_decoder_t);
+	if (!dec) return NULL;
+
+	dec->parser = fr_json_parser_alloc(dec, mod_json_decoder_event, dec);
+	if (!dec->parser) {
+		talloc_free(dec);
+		return NULL;
+	}
+
+	return dec;
+}
+
+/** Build value pairs from a user document and add them to the request
+ *
+ * Parse the passed JSON document and create value pairs that will be injected
+ * into the given request for authorization.  The document is decoded as it's
+ * parsed, and the value pairs are only added to the request once the whole
+ * document has been parsed successfully.
  *
  * Example JSON document structure:
  * @code{.json}
@@ -256,96 +508,37 @@ int mod_attribute_to_element(const char *name, json_object *map, void *buf)
  * }
  * @endcode
  *
- * @param  json    The JSON object representation of the user documnent.
- * @param  section The pair section ("config" or "reply").
- * @param  request The request to which the generated pairs should be added.
+ * @param  dec      The decoder to use.
+ * @param  request  The request to which the generated pairs should be added.
+ * @param  document The user document.
+ * @param  len      Length of the user document.
+ * @return          Returns 1 if the document was decoded, or -1 if it was malformed.
  */
-void *mod_json_object_to_value_pairs(json_object *json, const char *section, REQUEST *request)
+int mod_json_document_to_value_pairs(mod_json_decoder_t *dec, REQUEST *request, char const *document, size_t len)
 {
-	json_object *jobj, *jval, *jop;     /* json object pointers */
-	TALLOC_CTX *ctx;                    /* talloc context for pairmake */
-	VALUE_PAIR *vp, **ptr;              /* value pair and value pair pointer for pairmake */
-
-	/* assign ctx and vps for pairmake based on section */
-	if (strcmp(section, "config") == 0) {
-		ctx = request;
-		ptr = &(request->config_items);
-	} else if (strcmp(section, "reply") == 0) {
-		ctx = request->reply;
-		ptr = &(request->reply->vps);
-	} else {
-		/* log error - this shouldn't happen */
-		RERROR("invalid section passed for pairmake");
+	/* reset decoder */
+	fr_json_parser_reset(dec->parser);
+	dec->request = request;
+	dec->section = NULL;
+	dec->vps[0] = dec->vps[1] = NULL;
+
+	/* parse document */
+	if ((fr_json_parse(dec->parser, document, len) < 0) || (fr_json_parse_end(dec->parser) <= 0)) {
+		/* log error */
+		RERROR("failed to parse user document: %s", fr_strerror());
+		/* free any pairs we made */
+		pairfree(&dec->vps[0]);
+		pairfree(&dec->vps[1]);
 		/* return */
-		return NULL;
-	}
-
-	/* get config payload */
-	if (json_object_object_get_ex(json, section, &jobj)) {
-		/* make sure we have the correct type */
-		if (!json_object_is_type(jobj, json_type_object)) {
-			/* log error */
-			RERROR("invalid json type for '%s' section - sections must be json objects", section);
-			/* reuturn */
-			return NULL;
-		}
-		/* loop through object */
-		json_object_object_foreach(jobj, attribute, json_vp) {
-			/* check for appropriate type in value and op */
-			if (!json_object_is_type(json_vp, json_type_object)) {
-				/* log error */
-				RERROR("invalid json type for '%s' attribute - attributes must be json objects", attribute);
-				/* return */
-				return NULL;
-			}
-			/* debugging */
-			RDEBUG("parsing '%s' attribute: %s => %s", section, attribute, json_object_to_json_string(json_vp));
-			/* create pair from json object */
-			if (json_object_object_get_ex(json_vp, "value", &jval) &&
-				json_object_object_get_ex(json_vp, "op", &jop)) {
-				/* make correct pairs based on json object type */
-				switch (json_object_get_type(jval)) {
-				case json_type_double:
-				case json_type_int:
-				case json_type_string:
-					/* debugging */
-					RDEBUG("adding '%s' attribute to '%s' section", attribute, section);
-					/* add pair */
-					vp = pairmake(ctx, ptr, attribute, json_object_get_string(jval),
-						fr_str2int(fr_tokens, json_object_get_string(jop), 0));
-					/* check pair */
-					if (!vp) {
-						RERROR("could not build value pair for '%s' attribute (%s)", attribute, fr_strerror());
-						/* return */
-						return NULL;
-					}
-					break;
-
-				case json_type_object:
-				case json_type_array:
-					/* log error - we want to handle these eventually */
-					RERROR("skipping unhandled nested json object or array value pair object");
-					break;
-
-				default:
-					/* log error - this shouldn't ever happen */
-					RERROR("skipping unhandled json type in value pair object");
-					break;
-				}
-			} else {
-				/* log error */
-				RERROR("failed to get 'value' or 'op' element for '%s' attribute", attribute);
-			}
-		}
-		/* return NULL */
-		return NULL;
+		return -1;
 	}
 
-	/* debugging */
-	RDEBUG("couldn't find '%s' section in json object - not adding value pairs for this section", section);
+	/* add pairs to the request */
+	pairadd(&request->config_items, dec->vps[0]);
+	pairadd(&request->reply->vps, dec->vps[1]);
 
-	/* return NULL */
-	return NULL;
+	/* return */
+	return 1;
 }
 
 /** Convert value pairs to json objects
@@ -588,6 +781,9 @@ int _mod_client_map_section(CONF_SECTION *client, CONF_SECTION const *map,
  * rebuild on this design document in Couchbase.  However, since this function is only
  * run once at sever startup this should not be a concern.
  *
+ * The client documents themselves are fetched MAX_BULK_KEYS at a time, using
+ * a single multi-get for each batch rather than one request per row.
+ *
  * @param  inst The module instance.
  * @param  cs   The client attribute configuration section.
  * @return      Returns 0 on success, -1 on error.
@@ -595,12 +791,14 @@ int _mod_client_map_section(CONF_SECTION *client, CONF_SECTION const *map,
 int mod_load_client_documents(rlm_couchbase_t *inst, CONF_SECTION *cs)
 {
 	void *handle = NULL;                   /* connection pool handle */
-	char vpath[256], docid[MAX_KEY_SIZE];  /* view path and document id */
+	char vpath[256];                       /* view path */
 	char error[512];                       /* view error return */
 	int idx = 0;                           /* row array index counter */
+	char const **docids = NULL;            /* document ids from view rows */
+	int ndocids = 0;                       /* number of document ids */
 	int retval = 0;                        /* return value */
 	lcb_error_t cb_error = LCB_SUCCESS;    /* couchbase error holder */
-	json_object *json, *jval;              /* json object holders */
+	json_object *json, *jval, *jdoc;       /* json object holders */
 	json_object *jrows = NULL;             /* json object to hold view rows */
 	CONF_SECTION *client;                  /* freeradius config section */
 	RADCLIENT *c;                          /* freeradius client */
@@ -705,6 +903,7 @@ int mod_load_client_documents(rlm_couchbase_t *inst, CONF_SECTION *cs)
 
 	/* free cookie object */
 	json_object_put(cookie->jobj);
+	cookie->jobj = NULL;
 
 	/* debugging */
 	DEBUG("rlm_couchbase: jrows == %s", json_object_to_json_string(jrows));
@@ -719,106 +918,147 @@ int mod_load_client_documents(rlm_couchbase_t *inst, CONF_SECTION *cs)
 		goto free_and_return;
 	}
 
-	/* loop across all row elements */
+	/* allocate document id array */
+	docids = talloc_array(NULL, char const *, json_object_array_length(jrows));
+	if (!docids) {
+		ERROR("rlm_couchbase: failed to allocate document id array");
+		/* set return */
+		retval = -1;
+		/* return */
+		goto free_and_return;
+	}
+
+	/* loop across all row elements, collecting document ids */
 	for (idx = 0; idx < json_object_array_length(jrows); idx++) {
 		/* fetch current index */
 		json = json_object_array_get_idx(jrows, idx);
 
 		/* get document id */
-		if (json_object_object_get_ex(json, "id", &jval)) {
-			/* clear docid */
-			memset(docid, 0, sizeof(docid));
-			/* copy and check length */
-			if (strlcpy(docid, json_object_get_string(jval), sizeof(docid)) >= sizeof(docid)) {
-				ERROR("rlm_couchbase: document id from row longer than MAX_KEY_SIZE (%d)", MAX_KEY_SIZE);
-				continue;
-			}
+		if (!json_object_object_get_ex(json, "id", &jval) || !json_object_get_string(jval) ||
+		    !*json_object_get_string(jval)) {
+			WARN("rlm_couchbase: failed to fetch document id from row - skipping");
+			continue;
 		}
 
-		/* check for valid doc id */
-		if (docid[0] == 0) {
-			WARN("rlm_couchbase: failed to fetch document id from row - skipping");
+		/* check length */
+		if (strlen(json_object_get_string(jval)) >= MAX_KEY_SIZE) {
+			ERROR("rlm_couchbase: document id from row longer than MAX_KEY_SIZE (%d)", MAX_KEY_SIZE);
 			continue;
 		}
 
+		/* rows are held until we're done, so the id can be referenced */
+		docids[ndocids++] = json_object_get_string(jval);
+	}
+
+	/* fetch documents MAX_BULK_KEYS at a time, with one round trip each */
+	for (idx = 0; idx < ndocids; idx += MAX_BULK_KEYS) {
+		int nkeys = ndocids - idx;      /* number of keys in this batch */
+		int i;                          /* batch index */
+
+		if (nkeys > MAX_BULK_KEYS) nkeys = MAX_BULK_KEYS;
+
 		/* debugging */
-		DEBUG("rlm_couchbase: preparing to fetch docid '%s'", docid);
+		DEBUG("rlm_couchbase: preparing to fetch %i client documents", nkeys);
 
-		/* reset  cookie error status */
-		cookie->jerr = json_tokener_success;
+		/* setup document holder */
+		cookie->jdocs = json_object_new_object();
 
-		/* fetch document */
-		cb_error = couchbase_get_key(cb_inst, cookie, docid);
+		/* fetch documents */
+		cb_error = couchbase_get_keys(cb_inst, cookie, docids + idx, nkeys);
 
 		/* check error */
-		if (cb_error != LCB_SUCCESS || cookie->jerr != json_tokener_success) {
+		if (cb_error != LCB_SUCCESS) {
 			/* log error */
-			ERROR("rlm_couchbase: failed to execute get request or parse return");
+			ERROR("rlm_couchbase: failed to execute get request: %s (0x%x)", lcb_strerror(NULL, cb_error), cb_error);
 			/* set return */
 			retval = -1;
 			/* return */
 			goto free_and_return;
 		}
 
-		/* debugging */
-		DEBUG("rlm_couchbase: cookie->jobj == %s", json_object_to_json_string(cookie->jobj));
+		for (i = idx; i < (idx + nkeys); i++) {
+			char const *docid = docids[i];
 
-		/* allocate conf section */
-		client = cf_section_alloc(NULL, "client", docid);
+			/* check for the document */
+			if (!json_object_object_get_ex(cookie->jdocs, docid, &jdoc)) {
+				/* log error */
+				ERROR("rlm_couchbase: failed to fetch or parse client document '%s'", docid);
+				/* set return */
+				retval = -1;
+				/* return */
+				goto free_and_return;
+			}
 
-		if (_mod_client_map_section(client, cs, cookie->jobj, docid) != 0) {
-			/* free config setion */
-			talloc_free(client);
-			/* set return */
-			retval = -1;
-			/* return */
-			goto free_and_return;
-		}
+			/* debugging */
+			DEBUG("rlm_couchbase: document '%s' == %s", docid, json_object_to_json_string(jdoc));
 
-		/*
-		 * @todo These should be parented from something.
-		 */
-		c = client_afrom_cs(NULL, client, false);
-		if (!c) {
-			ERROR("rlm_couchbase: failed to allocate client");
-			/* free config setion */
-			talloc_free(client);
-			/* set return */
-			retval = -1;
-			/* return */
-			goto free_and_return;
-		}
+			/* allocate conf section */
+			client = cf_section_alloc(NULL, "client", docid);
 
-		/*
-		 * Client parents the CONF_SECTION which defined it.
-		 */
-		talloc_steal(c, client);
+			if (_mod_client_map_section(client, cs, jdoc, docid) != 0) {
+				/* free config setion */
+				talloc_free(client);
+				/* set return */
+				retval = -1;
+				/* return */
+				goto free_and_return;
+			}
 
-		/* attempt to add client */
-		if (!client_add(NULL, c)) {
-			ERROR("rlm_couchbase: failed to add client from %s, possible duplicate?", docid);
-			/* free client */
-			client_free(c);
-			/* set return */
-			retval = -1;
-			/* return */
-			goto free_and_return;
-		}
+			/*
+			 * @todo These should be parented from something.
+			 */
+			c = client_afrom_cs(NULL, client, false);
+			if (!c) {
+				ERROR("rlm_couchbase: failed to allocate client");
+				/* free config setion */
+				talloc_free(client);
+				/* set return */
+				retval = -1;
+				/* return */
+				goto free_and_return;
+			}
 
-		/* debugging */
-		DEBUG("rlm_couchbase: client '%s' added", c->longname);
+			/*
+			 * Client parents the CONF_SECTION which defined it.
+			 */
+			talloc_steal(c, client);
+
+			/* attempt to add client */
+			if (!client_add(NULL, c)) {
+				ERROR("rlm_couchbase: failed to add client from %s, possible duplicate?", docid);
+				/* free client */
+				client_free(c);
+				/* set return */
+				retval = -1;
+				/* return */
+				goto free_and_return;
+			}
 
-		/* free json object */
-		json_object_put(cookie->jobj);
+			/* debugging */
+			DEBUG("rlm_couchbase: client '%s' added", c->longname);
+		}
+
+		/* free documents */
+		json_object_put(cookie->jdocs);
+		cookie->jdocs = NULL;
 	}
 
 	free_and_return:
 
 	/* free json object */
-	if (cookie->jobj) {
+	if (cookie && cookie->jobj) {
 		json_object_put(cookie->jobj);
 	}
 
+	/* free documents */
+	if (cookie && cookie->jdocs) {
+		json_object_put(cookie->jdocs);
+		cookie->jdocs = NULL;
+	}
+
+	/* free document ids */
+	talloc_free(docids);
+
 	/* free rows */
 	if (jrows) {
 		json_object_put(jrows);
@@ -42,6 +42,9 @@ RCSIDH(mod_h, "$Id$");
 /* maximum length of a document key */
 #define MAX_KEY_SIZE 250
 
+/* maximum number of documents fetched in one multi-get */
+#define MAX_BULK_KEYS 256
+
 /** The main module instance
  *
  * This struct contains the core module configuration.
@@ -69,8 +72,15 @@ typedef struct rlm_couchbase_t {
 typedef struct rlm_couchbase_handle_t {
 	void *handle;    //!< Real couchbase instance.
 	void *cookie;    //!< Couchbase cookie (@p cookie_u @p cookie_t).
+	void *decoder;   //!< User document decoder (@p mod_json_decoder_t).
 } rlm_couchbase_handle_t;
 
+/** Incremental decoder for user documents
+ *
+ * Converts user documents directly into value pairs, as they're parsed.
+ */
+typedef struct mod_json_decoder mod_json_decoder_t;
+
 /* define functions */
 void *mod_conn_create(TALLOC_CTX *ctx, void *instance);
 
@@ -80,7 +90,9 @@ int mod_build_attribute_element_map(CONF_SECTION *conf, void *instance);
 
 int mod_attribute_to_element(const char *name, json_object *map, void *buf);
 
-void *mod_json_object_to_value_pairs(json_object *json, const char *section, REQUEST *request);
+mod_json_decoder_t *mod_json_decoder_alloc(TALLOC_CTX *ctx);
+
+int mod_json_document_to_value_pairs(mod_json_decoder_t *dec, REQUEST *request, char const *document, size_t len);
 
 json_object *mod_value_pair_to_json_object(REQUEST *request, VALUE_PAIR *vp);
 
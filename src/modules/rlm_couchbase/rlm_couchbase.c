@@ -225,17 +225,17 @@ static rlm_rcode_t mod_authorize(void *instance, REQUEST *request)
 	/* reset  cookie error status */
 	cookie->jerr = json_tokener_success;
 
+	/* decode the document straight into the request */
+	cookie->decoder = handle_t->decoder;
+	cookie->request = request;
+
 	/* fetch document */
 	cb_error = couchbase_get_key(cb_inst, cookie, dockey);
 
 	/* check error */
-	if (cb_error != LCB_SUCCESS || cookie->jerr != json_tokener_success || cookie->jobj == NULL) {
+	if (cb_error != LCB_SUCCESS || cookie->decoded <= 0) {
 		/* log error */
 		RERROR("failed to fetch document or parse return");
-		/* free json object */
-		if (cookie->jobj) {
-			json_object_put(cookie->jobj);
-		}
 		/* release handle */
 		if (handle) {
 			fr_connection_release(inst->pool, handle);
@@ -244,20 +244,6 @@ static rlm_rcode_t mod_authorize(void *instance, REQUEST *request)
 		return RLM_MODULE_FAIL;
 	}
 
-	/* debugging */
-	RDEBUG("parsed user document == %s", json_object_to_json_string(cookie->jobj));
-
-	/* inject config value pairs defined in this json oblect */
-	mod_json_object_to_value_pairs(cookie->jobj, "config", request);
-
-	/* inject reply value pairs defined in this json oblect */
-	mod_json_object_to_value_pairs(cookie->jobj, "reply", request);
-
-	/* free json object */
-	if (cookie->jobj) {
-		json_object_put(cookie->jobj);
-	}
-
 	/* release handle */
 	if (handle) {
 		fr_connection_release(inst->pool, handle);
@@ -290,6 +276,7 @@ static rlm_rcode_t mod_accounting(void *instance, REQUEST *request)
 	char element[MAX_KEY_SIZE];         /* mapped radius attribute to element name */
 	int status = 0;                     /* account status type */
 	int docfound = 0;                   /* document found toggle */
+	bool add;                           /* create document without reading it first */
 	lcb_error_t cb_error = LCB_SUCCESS; /* couchbase error holder */
 
 	/* assert packet as not null */
@@ -356,27 +343,38 @@ static rlm_rcode_t mod_accounting(void *instance, REQUEST *request)
 		return RLM_MODULE_NOOP;
 	}
 
-	/* init cookie error status */
-	cookie->jerr = json_tokener_success;
-
-	/* attempt to fetch document */
-	cb_error = couchbase_get_key(cb_inst, cookie, dockey);
-
-	/* check error */
-	if (cb_error != LCB_SUCCESS || cookie->jerr != json_tokener_success) {
-		/* log error */
-		RERROR("failed to execute get request or parse returned json object");
-		/* free json object */
-		if (cookie->jobj) {
-			json_object_put(cookie->jobj);
-		}
-	} else {
-		/* check cookie json object */
-		if (cookie->jobj != NULL) {
-			/* set doc found */
-			docfound = 1;
-			/* debugging */
-			RDEBUG("parsed json body from couchbase: %s", json_object_to_json_string(cookie->jobj));
+	/*
+	 * Start records almost always create the document, so try adding it
+	 * without fetching it first.  That saves a round trip, and only if the
+	 * document already exists do we fall back to read-modify-write.
+	 */
+	add = (status == PW_STATUS_START);
+
+again:
+	if (!add) {
+		/* init cookie error status */
+		cookie->jerr = json_tokener_success;
+
+		/* attempt to fetch document */
+		cb_error = couchbase_get_key(cb_inst, cookie, dockey);
+
+		/* check error */
+		if (cb_error != LCB_SUCCESS || cookie->jerr != json_tokener_success) {
+			/* log error */
+			RERROR("failed to execute get request or parse returned json object");
+			/* free json object */
+			if (cookie->jobj) {
+				json_object_put(cookie->jobj);
+				cookie->jobj = NULL;
+			}
+		} else {
+			/* check cookie json object */
+			if (cookie->jobj != NULL) {
+				/* set doc found */
+				docfound = 1;
+				/* debugging */
+				RDEBUG("parsed json body from couchbase: %s", json_object_to_json_string(cookie->jobj));
+			}
 		}
 	}
 
@@ -463,13 +461,30 @@ static rlm_rcode_t mod_accounting(void *instance, REQUEST *request)
 	/* free json output */
 	if (cookie->jobj) {
 		json_object_put(cookie->jobj);
+		cookie->jobj = NULL;
 	}
 
-	/* debugging */
-	RDEBUG("setting '%s' => '%s'", dockey, document);
+	/* create new document */
+	if (add) {
+		/* debugging */
+		RDEBUG("adding '%s' => '%s'", dockey, document);
+
+		/* add document/key in couchbase */
+		cb_error = couchbase_add_key(cb_inst, cookie, dockey, document, inst->expire);
+
+		/* merge with the existing document instead */
+		if (cb_error == LCB_KEY_EEXISTS) {
+			RDEBUG("document exists - merging with existing document");
+			add = false;
+			goto again;
+		}
+	} else {
+		/* debugging */
+		RDEBUG("setting '%s' => '%s'", dockey, document);
 
-	/* store document/key in couchbase */
-	cb_error = couchbase_set_key(cb_inst, dockey, document, inst->expire);
+		/* store document/key in couchbase */
+		cb_error = couchbase_set_key(cb_inst, dockey, document, inst->expire);
+	}
 
 	/* check return */
 	if (cb_error != LCB_SUCCESS) {
@@ -531,4 +546,8 @@ module_t rlm_couchbase = {
 		NULL,                   /* post-proxy */
 		NULL                    /* post-auth */
 	},
+	0,				/* thread_inst_size */
+	NULL,				/* thread_instantiate */
+	NULL,				/* thread_detach */
+	NULL				/* cache_flush */
 };
@@ -52,6 +52,36 @@ RCSID("$Id$")
 
 #define UNIQUEID_MAX_LEN 32
 
+/*
+ *	Number of independently locked hash tables the counters are
+ *	spread over.
+ */
+#define COUNTER_STRIPE_BITS	6
+#define COUNTER_STRIPES		(1 << COUNTER_STRIPE_BITS)
+
+typedef struct rad_counter {
+	unsigned int user_counter;
+	char uniqueid[UNIQUEID_MAX_LEN];
+} rad_counter;
+
+/*
+ *	In-memory copy of one counter.  The GDBM file is only a
+ *	snapshot of these, written periodically.
+ */
+typedef struct counter_entry_t {
+	char		*key;		//!< Value of the key attribute.
+	size_t		key_len;	//!< Length of the key.
+	rad_counter	counter;	//!< As stored in the GDBM file.
+	bool		dirty;		//!< Changed since the last snapshot.
+} counter_entry_t;
+
+typedef struct counter_stripe_t {
+	fr_hash_table_t	*ht;		//!< Counters whose key hashes to this stripe.
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t	mutex;		//!< Protects ht, and the entries in it.
+#endif
+} counter_stripe_t;
+
 /*
  *	Define a structure for our module configuration.
  *
@@ -70,6 +100,7 @@ typedef struct rlm_counter_t {
 	char const *service_type;	/* Service-Type to search for */
 
 	uint32_t cache_size;
+	uint32_t sync_interval;		/* How often the counters are written to the database */
 	uint32_t service_val;
 
 	DICT_ATTR const *key_attr;
@@ -82,8 +113,20 @@ typedef struct rlm_counter_t {
 	time_t last_reset;	/* The time of the last reset. */
 
 	GDBM_FILE gdbm;		/* The gdbm file handle */
+	bool reset_pending;	/* The gdbm file has to be recreated at the next sync */
+	time_t next_sync;	/* When the counters are next written to the gdbm file */
+
+	counter_stripe_t stripe[COUNTER_STRIPES];	/* The counters */
+
 #ifdef HAVE_PTHREAD_H
 	pthread_mutex_t mutex;	/* A mutex to lock the gdbm file for only one reader/writer */
+	pthread_mutex_t reset_mutex;	/* Serialises resets of the counters */
+
+	pthread_mutex_t sync_mutex;	/* Protects the sync thread state */
+	pthread_cond_t sync_cond;	/* Signalled to stop the sync thread */
+	pthread_t sync_thread;		/* Writes the counters to the gdbm file */
+	bool sync_running;
+	bool sync_stop;
 #endif
 } rlm_counter_t;
 
@@ -98,11 +141,6 @@ typedef struct rlm_counter_t {
 #define pthread_mutex_destroy(a)
 #endif
 
-typedef struct rad_counter {
-	unsigned int user_counter;
-	char uniqueid[UNIQUEID_MAX_LEN];
-} rad_counter;
-
 /*
  *	A mapping of configuration file names to internal variables.
  *
@@ -134,6 +172,7 @@ static const CONF_PARSER module_config[] = {
 
 	{ "cache-size", FR_CONF_OFFSET(PW_TYPE_INTEGER | PW_TYPE_DEPRECATED, rlm_counter_t, cache_size), NULL },
 	{ "cache_size", FR_CONF_OFFSET(PW_TYPE_INTEGER, rlm_counter_t, cache_size), "1000" },
+	{ "sync_interval", FR_CONF_OFFSET(PW_TYPE_INTEGER, rlm_counter_t, sync_interval), "5" },
 
 	{ NULL, -1, 0, NULL, NULL }
 };
@@ -145,6 +184,69 @@ static const CONF_PARSER module_config[] = {
 #define ASSIGN(_x,_y) memcpy(&_x, &_y, sizeof(_x))
 
 
+static uint32_t counter_entry_hash(void const *data)
+{
+	counter_entry_t const *entry = data;
+
+	return fr_hash(entry->key, entry->key_len);
+}
+
+static int counter_entry_cmp(void const *one, void const *two)
+{
+	counter_entry_t const *a = one;
+	counter_entry_t const *b = two;
+
+	if (a->key_len < b->key_len) return -1;
+	if (a->key_len > b->key_len) return +1;
+
+	return memcmp(a->key, b->key, a->key_len);
+}
+
+static void counter_entry_free(void *data)
+{
+	talloc_free(data);
+}
+
+static fr_hash_table_t *counter_table_create(void)
+{
+	return fr_hash_table_create(counter_entry_hash, counter_entry_cmp, counter_entry_free);
+}
+
+/*
+ *	Select the stripe by the top bits of the hash, as the hash
+ *	table uses the bottom bits to select the bucket.
+ */
+static counter_stripe_t *counter_stripe(rlm_counter_t *inst, counter_entry_t const *entry)
+{
+	return &inst->stripe[counter_entry_hash(entry) >> (32 - COUNTER_STRIPE_BITS)];
+}
+
+static void counter_entry_key(counter_entry_t *entry, VALUE_PAIR const *key_vp)
+{
+	memset(entry, 0, sizeof(*entry));
+	ASSIGN(entry->key, key_vp->vp_strvalue);
+	entry->key_len = key_vp->length;
+}
+
+/*
+ *	Copy the counter for a key out of memory.
+ */
+static bool counter_lookup(rlm_counter_t *inst, VALUE_PAIR const *key_vp, rad_counter *out)
+{
+	counter_entry_t my_entry, *entry;
+	counter_stripe_t *stripe;
+
+	counter_entry_key(&my_entry, key_vp);
+	stripe = counter_stripe(inst, &my_entry);
+
+	pthread_mutex_lock(&stripe->mutex);
+	entry = fr_hash_table_finddata(stripe->ht, &my_entry);
+	if (entry) *out = entry->counter;
+	pthread_mutex_unlock(&stripe->mutex);
+
+	return (entry != NULL);
+}
+
 /*
  *	See if the counter matches.
  */
@@ -152,8 +254,6 @@ static int counter_cmp(void *instance, UNUSED REQUEST *req, VALUE_PAIR *request,
 		       UNUSED VALUE_PAIR *check_pairs, UNUSED VALUE_PAIR **reply_pairs)
 {
 	rlm_counter_t *inst = instance;
-	datum key_datum;
-	datum count_datum;
 	VALUE_PAIR *key_vp;
 	rad_counter counter;
 
@@ -165,16 +265,9 @@ static int counter_cmp(void *instance, UNUSED REQUEST *req, VALUE_PAIR *request,
 		return RLM_MODULE_NOOP;
 	}
 
-	ASSIGN(key_datum.dptr,key_vp->vp_strvalue);
-	key_datum.dsize = key_vp->length;
-
-	count_datum = gdbm_fetch(inst->gdbm, key_datum);
-
-	if (!count_datum.dptr) {
+	if (!counter_lookup(inst, key_vp, &counter)) {
 		return -1;
 	}
-	memcpy(&counter, count_datum.dptr, sizeof(rad_counter));
-	free(count_datum.dptr);
 
 	return counter.user_counter - check->vp_integer;
 }
@@ -323,6 +416,217 @@ static int find_next_reset(rlm_counter_t *inst, time_t timeval)
 }
 
 
+/*
+ *	Store one counter in the gdbm file.  Must be called with
+ *	inst->mutex held.
+ */
+static int counter_store(rlm_counter_t *inst, counter_entry_t const *entry)
+{
+	datum key_datum;
+	datum count_datum;
+	rad_counter const *counter = &entry->counter;
+
+	key_datum.dptr = entry->key;
+	key_datum.dsize = entry->key_len;
+	ASSIGN(count_datum.dptr, counter);
+	count_datum.dsize = sizeof(rad_counter);
+
+	if (gdbm_store(inst->gdbm, key_datum, count_datum, GDBM_REPLACE) < 0) {
+		ERROR("rlm_counter: Failed storing data to %s: %s", inst->filename, gdbm_strerror(gdbm_errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+typedef struct counter_dirty_t {
+	counter_entry_t	*entries;
+	int		num;
+} counter_dirty_t;
+
+/*
+ *	Copy the dirty entries of a stripe, so that they can be
+ *	written out without holding the stripe lock.
+ */
+static int counter_dirty_collect(void *ctx, void *data)
+{
+	counter_dirty_t *dirty = ctx;
+	counter_entry_t *entry = data;
+	counter_entry_t *copy;
+
+	if (!entry->dirty) return 0;
+	entry->dirty = false;
+
+	copy = &dirty->entries[dirty->num++];
+	*copy = *entry;
+	copy->key = talloc_memdup(dirty->entries, entry->key, entry->key_len);
+
+	return 0;
+}
+
+/*
+ *	Write the counters which changed since the last sync to the
+ *	gdbm file.  If the counters were reset, the file is recreated
+ *	first, so that it never contains counters from before the
+ *	reset.
+ */
+static int counter_sync(rlm_counter_t *inst)
+{
+	int i, j;
+	int rcode = 0;
+	bool reset;
+
+	pthread_mutex_lock(&inst->mutex);
+
+	pthread_mutex_lock(&inst->reset_mutex);
+	reset = inst->reset_pending;
+	inst->reset_pending = false;
+	pthread_mutex_unlock(&inst->reset_mutex);
+
+	if (reset && (reset_db(inst) != RLM_MODULE_OK)) {
+		pthread_mutex_unlock(&inst->mutex);
+		return -1;
+	}
+
+	for (i = 0; i < COUNTER_STRIPES; i++) {
+		counter_stripe_t *stripe = &inst->stripe[i];
+		counter_dirty_t dirty;
+		int num;
+
+		pthread_mutex_lock(&stripe->mutex);
+		num = fr_hash_table_num_elements(stripe->ht);
+		if (!num) {
+			pthread_mutex_unlock(&stripe->mutex);
+			continue;
+		}
+		dirty.entries = talloc_array(NULL, counter_entry_t, num);
+		dirty.num = 0;
+		fr_hash_table_walk(stripe->ht, counter_dirty_collect, &dirty);
+		pthread_mutex_unlock(&stripe->mutex);
+
+		for (j = 0; j < dirty.num; j++) {
+			if (counter_store(inst, &dirty.entries[j]) < 0) rcode = -1;
+		}
+		talloc_free(dirty.entries);
+	}
+
+	pthread_mutex_unlock(&inst->mutex);
+
+	return rcode;
+}
+
+#ifdef HAVE_PTHREAD_H
+static void *counter_sync_thread(void *arg)
+{
+	rlm_counter_t *inst = arg;
+	struct timespec when;
+
+	pthread_mutex_lock(&inst->sync_mutex);
+	while (!inst->sync_stop) {
+		when.tv_sec = time(NULL) + inst->sync_interval;
+		when.tv_nsec = 0;
+
+		pthread_cond_timedwait(&inst->sync_cond, &inst->sync_mutex, &when);
+		if (inst->sync_stop) break;
+
+		pthread_mutex_unlock(&inst->sync_mutex);
+		counter_sync(inst);
+		pthread_mutex_lock(&inst->sync_mutex);
+	}
+	pthread_mutex_unlock(&inst->sync_mutex);
+
+	return NULL;
+}
+
+/*
+ *	The thread is started here instead of in mod_instantiate(),
+ *	as the server may fork after the modules have been
+ *	instantiated.
+ */
+static void counter_sync_start(rlm_counter_t *inst)
+{
+	if (!inst->sync_interval || inst->sync_running) return;
+
+	pthread_mutex_lock(&inst->sync_mutex);
+	if (!inst->sync_running && !inst->sync_stop) {
+		if (pthread_create(&inst->sync_thread, NULL, counter_sync_thread, inst) != 0) {
+			ERROR("rlm_counter: Failed to start sync thread: %s", fr_syserror(errno));
+		} else {
+			inst->sync_running = true;
+		}
+	}
+	pthread_mutex_unlock(&inst->sync_mutex);
+}
+#else
+/*
+ *	Without threads, the request which notices the sync is due
+ *	writes the counters out.
+ */
+static void counter_sync_start(rlm_counter_t *inst)
+{
+	time_t now;
+
+	if (!inst->sync_interval) return;
+
+	now = fr_clock_time();
+	if (now < inst->next_sync) return;
+
+	inst->next_sync = now + inst->sync_interval;
+	counter_sync(inst);
+}
+#endif
+
+/*
+ *	Reset all of the counters if the reset time has passed.
+ *
+ *	Each stripe gets a new, empty, hash table, so the requests
+ *	only wait for a pointer swap.  Recreating the gdbm file is
+ *	left to the next sync.
+ */
+static void counter_reset_check(rlm_counter_t *inst, time_t now)
+{
+	int i;
+
+	if (!inst->reset_time || (inst->reset_time > now)) return;
+
+	pthread_mutex_lock(&inst->reset_mutex);
+	if (!inst->reset_time || (inst->reset_time > now)) {
+		pthread_mutex_unlock(&inst->reset_mutex);
+		return;
+	}
+
+	DEBUG("rlm_counter: Time to reset the database");
+	inst->last_reset = inst->reset_time;
+	find_next_reset(inst, now);
+
+	for (i = 0; i < COUNTER_STRIPES; i++) {
+		counter_stripe_t *stripe = &inst->stripe[i];
+		fr_hash_table_t *old, *ht;
+
+		ht = counter_table_create();
+		if (!ht) {
+			ERROR("rlm_counter: Failed to reset counters");
+			continue;
+		}
+
+		pthread_mutex_lock(&stripe->mutex);
+		old = stripe->ht;
+		stripe->ht = ht;
+		pthread_mutex_unlock(&stripe->mutex);
+
+		fr_hash_table_free(old);
+	}
+
+	inst->reset_pending = true;
+	pthread_mutex_unlock(&inst->reset_mutex);
+
+	/*
+	 *	Without a sync interval the file is always up to date.
+	 */
+	if (!inst->sync_interval) counter_sync(inst);
+}
+
+
 /*
  *	Do any per-module initialization that is separate to each
  *	configured instance of the module.  e.g. set up connections
@@ -341,7 +645,7 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 	ATTR_FLAGS flags;
 	time_t now;
 	int cache_size;
-	int ret;
+	int ret, i;
 	datum key_datum;
 	datum time_datum;
 	char const *default1 = "DEFAULT1";
@@ -508,10 +812,30 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 	 */
 	paircompare_register(inst->dict_attr, NULL, true, counter_cmp, inst);
 
+	/*
+	 *	The counters are kept in memory, spread over several
+	 *	hash tables so that lookups and updates for different
+	 *	keys rarely wait for each other.
+	 */
+	for (i = 0; i < COUNTER_STRIPES; i++) {
+		inst->stripe[i].ht = counter_table_create();
+		if (!inst->stripe[i].ht) {
+			ERROR("rlm_counter: Failed to create counter table");
+			return -1;
+		}
+		pthread_mutex_init(&inst->stripe[i].mutex, NULL);
+	}
+	inst->next_sync = now + inst->sync_interval;
+
 	/*
 	 * Init the mutex
 	 */
 	pthread_mutex_init(&inst->mutex, NULL);
+	pthread_mutex_init(&inst->reset_mutex, NULL);
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_init(&inst->sync_mutex, NULL);
+	pthread_cond_init(&inst->sync_cond, NULL);
+#endif
 
 	return 0;
 }
@@ -522,12 +846,10 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, REQUEST *request)
 {
 	rlm_counter_t *inst = instance;
-	datum key_datum;
-	datum count_datum;
 	VALUE_PAIR *key_vp, *count_vp, *proto_vp, *uniqueid_vp;
-	rad_counter counter;
-	rlm_rcode_t rcode;
-	int ret;
+	counter_entry_t my_entry, *entry;
+	counter_stripe_t *stripe;
+	rad_counter *counter;
 	int acctstatustype = 0;
 	time_t diff;
 
@@ -549,16 +871,9 @@ static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, REQUEST *requ
 	 *	Before doing anything else, see if we have to reset
 	 *	the counters.
 	 */
-	if (inst->reset_time && (inst->reset_time <= request->timestamp)) {
-		DEBUG("rlm_counter: Time to reset the database");
-		inst->last_reset = inst->reset_time;
-		find_next_reset(inst,request->timestamp);
-		pthread_mutex_lock(&inst->mutex);
-		rcode = reset_db(inst);
-		pthread_mutex_unlock(&inst->mutex);
-		if (rcode != RLM_MODULE_OK)
-			return rcode;
-	}
+	counter_reset_check(inst, request->timestamp);
+	counter_sync_start(inst);
+
 	/*
 	 * Check if we need to watch out for a specific service-type. If yes then check it
 	 */
@@ -606,33 +921,41 @@ static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, REQUEST *requ
 		return RLM_MODULE_NOOP;
 	}
 
-	ASSIGN(key_datum.dptr, key_vp->vp_strvalue);
-	key_datum.dsize = key_vp->length;
+	counter_entry_key(&my_entry, key_vp);
+	stripe = counter_stripe(inst, &my_entry);
 
 	DEBUG("rlm_counter: Searching the database for key '%s'",key_vp->vp_strvalue);
-	pthread_mutex_lock(&inst->mutex);
-	count_datum = gdbm_fetch(inst->gdbm, key_datum);
-	if (!count_datum.dptr) {
+	pthread_mutex_lock(&stripe->mutex);
+	entry = fr_hash_table_finddata(stripe->ht, &my_entry);
+	if (!entry) {
 		DEBUG("rlm_counter: Could not find the requested key in the database");
-		counter.user_counter = 0;
+		entry = talloc_zero(NULL, counter_entry_t);
+		if (entry) {
+			entry->key = talloc_memdup(entry, key_vp->vp_strvalue, key_vp->length);
+			entry->key_len = key_vp->length;
+		}
+		if (!entry || !entry->key || !fr_hash_table_insert(stripe->ht, entry)) {
+			pthread_mutex_unlock(&stripe->mutex);
+			talloc_free(entry);
+			ERROR("rlm_counter: Failed adding counter for '%s'", key_vp->vp_strvalue);
+			return RLM_MODULE_FAIL;
+		}
+		counter = &entry->counter;
 		if (uniqueid_vp != NULL)
-			strlcpy(counter.uniqueid,uniqueid_vp->vp_strvalue, sizeof(counter.uniqueid));
-		else
-			memset((char *)counter.uniqueid,0,UNIQUEID_MAX_LEN);
+			strlcpy(counter->uniqueid,uniqueid_vp->vp_strvalue, sizeof(counter->uniqueid));
 	} else {
 		DEBUG("rlm_counter: Key found");
-		memcpy(&counter, count_datum.dptr, sizeof(rad_counter));
-		free(count_datum.dptr);
-		DEBUG("rlm_counter: Counter Unique ID = '%s'",counter.uniqueid);
+		counter = &entry->counter;
+		DEBUG("rlm_counter: Counter Unique ID = '%s'",counter->uniqueid);
 		if (uniqueid_vp != NULL) {
-			if (strncmp(uniqueid_vp->vp_strvalue,counter.uniqueid, UNIQUEID_MAX_LEN - 1) == 0) {
+			if (strncmp(uniqueid_vp->vp_strvalue,counter->uniqueid, UNIQUEID_MAX_LEN - 1) == 0) {
 				DEBUG("rlm_counter: Unique IDs for user match. Droping the request");
-				pthread_mutex_unlock(&inst->mutex);
+				pthread_mutex_unlock(&stripe->mutex);
 				return RLM_MODULE_NOOP;
 			}
-			strlcpy(counter.uniqueid,uniqueid_vp->vp_strvalue, sizeof(counter.uniqueid));
+			strlcpy(counter->uniqueid,uniqueid_vp->vp_strvalue, sizeof(counter->uniqueid));
 		}
-		DEBUG("rlm_counter: User=%s, Counter=%d.",request->username->vp_strvalue,counter.user_counter);
+		DEBUG("rlm_counter: User=%s, Counter=%d.",request->username->vp_strvalue,counter->user_counter);
 	}
 
 	if (inst->count_attr->attr == PW_ACCT_SESSION_TIME) {
@@ -647,34 +970,44 @@ static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, REQUEST *requ
 		 *	day). That is the right thing
 		 */
 		diff = request->timestamp - inst->last_reset;
-		counter.user_counter += ((time_t) count_vp->vp_integer < diff) ? count_vp->vp_integer : diff;
+		counter->user_counter += ((time_t) count_vp->vp_integer < diff) ? count_vp->vp_integer : diff;
 
 	} else if (count_vp->da->type == PW_TYPE_INTEGER) {
 		/*
 		 *	Integers get counted, without worrying about
 		 *	reset dates.
 		 */
-		counter.user_counter += count_vp->vp_integer;
+		counter->user_counter += count_vp->vp_integer;
 
 	} else {
 		/*
 		 *	The attribute is NOT an integer, just count once
 		 *	more that we've seen it.
 		 */
-		counter.user_counter++;
+		counter->user_counter++;
 	}
 
-	DEBUG("rlm_counter: User=%s, New Counter=%d.",request->username->vp_strvalue,counter.user_counter);
-	count_datum.dptr = (char *) &counter;
-	count_datum.dsize = sizeof(rad_counter);
+	DEBUG("rlm_counter: User=%s, New Counter=%d.",request->username->vp_strvalue,counter->user_counter);
+
+	/*
+	 *	Written to the database by the next sync.
+	 */
+	if (inst->sync_interval) {
+		entry->dirty = true;
+		pthread_mutex_unlock(&stripe->mutex);
+		return RLM_MODULE_OK;
+	}
+
+	my_entry.counter = entry->counter;
+	pthread_mutex_unlock(&stripe->mutex);
 
 	DEBUG("rlm_counter: Storing new value in database");
-	ret = gdbm_store(inst->gdbm, key_datum, count_datum, GDBM_REPLACE);
-	pthread_mutex_unlock(&inst->mutex);
-	if (ret < 0) {
-		ERROR("rlm_counter: Failed storing data to %s: %s", inst->filename, gdbm_strerror(gdbm_errno));
+	pthread_mutex_lock(&inst->mutex);
+	if (counter_store(inst, &my_entry) < 0) {
+		pthread_mutex_unlock(&inst->mutex);
 		return RLM_MODULE_FAIL;
 	}
+	pthread_mutex_unlock(&inst->mutex);
 	DEBUG("rlm_counter: New value stored successfully");
 
 	return RLM_MODULE_OK;
@@ -690,8 +1023,6 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authorize(UNUSED void *instance, UNUSED
 {
 	rlm_counter_t *inst = instance;
 	rlm_rcode_t rcode = RLM_MODULE_NOOP;
-	datum key_datum;
-	datum count_datum;
 	rad_counter counter;
 	VALUE_PAIR *key_vp, *check_vp;
 	VALUE_PAIR *reply_item;
@@ -701,19 +1032,8 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authorize(UNUSED void *instance, UNUSED
 	 *	Before doing anything else, see if we have to reset
 	 *	the counters.
 	 */
-	if (inst->reset_time && (inst->reset_time <= request->timestamp)) {
-		rlm_rcode_t rcode2;
-
-		inst->last_reset = inst->reset_time;
-		find_next_reset(inst,request->timestamp);
-		pthread_mutex_lock(&inst->mutex);
-		rcode2 = reset_db(inst);
-		pthread_mutex_unlock(&inst->mutex);
-		if (rcode2 != RLM_MODULE_OK) {
-			return rcode2;
-		}
-	}
-
+	counter_reset_check(inst, request->timestamp);
+	counter_sync_start(inst);
 
 	/*
 	 *      Look for the key.  User-Name is special.  It means
@@ -735,10 +1055,6 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authorize(UNUSED void *instance, UNUSED
 		return rcode;
 	}
 
-	ASSIGN(key_datum.dptr, key_vp->vp_strvalue);
-	key_datum.dsize = key_vp->length;
-
-
 	/*
 	 * Init to be sure
 	 */
@@ -746,13 +1062,8 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authorize(UNUSED void *instance, UNUSED
 	counter.user_counter = 0;
 
 	DEBUG("rlm_counter: Searching the database for key '%s'",key_vp->vp_strvalue);
-	pthread_mutex_lock(&inst->mutex);
-	count_datum = gdbm_fetch(inst->gdbm, key_datum);
-	pthread_mutex_unlock(&inst->mutex);
-	if (count_datum.dptr != NULL) {
+	if (counter_lookup(inst, key_vp, &counter)) {
 		DEBUG("rlm_counter: Key Found");
-		memcpy(&counter, count_datum.dptr, sizeof(rad_counter));
-		free(count_datum.dptr);
 	}
 	else
 		DEBUG("rlm_counter: Could not find the requested key in the database");
@@ -845,12 +1156,41 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authorize(UNUSED void *instance, UNUSED
 static int mod_detach(void *instance)
 {
 	rlm_counter_t *inst = instance;
+	int i;
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&inst->sync_mutex);
+	inst->sync_stop = true;
+	pthread_cond_signal(&inst->sync_cond);
+	pthread_mutex_unlock(&inst->sync_mutex);
+
+	if (inst->sync_running) pthread_join(inst->sync_thread, NULL);
+#endif
+
+	/*
+	 *	Write out anything the sync thread hasn't.
+	 */
+	if (inst->gdbm && inst->stripe[COUNTER_STRIPES - 1].ht) {
+		counter_sync(inst);
+	}
 
 	if (inst->gdbm) {
 		gdbm_close(inst->gdbm);
 	}
 
+	for (i = 0; i < COUNTER_STRIPES; i++) {
+		if (!inst->stripe[i].ht) continue;
+
+		fr_hash_table_free(inst->stripe[i].ht);
+		pthread_mutex_destroy(&inst->stripe[i].mutex);
+	}
+
 	pthread_mutex_destroy(&inst->mutex);
+	pthread_mutex_destroy(&inst->reset_mutex);
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_destroy(&inst->sync_mutex);
+	pthread_cond_destroy(&inst->sync_cond);
+#endif
 
 	return 0;
 }
@@ -882,4 +1222,8 @@ module_t rlm_counter = {
 		NULL,			/* post-proxy */
 		NULL			/* post-auth */
 	},
+	0,				/* thread_inst_size */
+	NULL,				/* thread_instantiate */
+	NULL,				/* thread_detach */
+	NULL				/* cache_flush */
 };
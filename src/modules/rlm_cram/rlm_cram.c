@@ -204,4 +204,8 @@ module_t rlm_cram = {
 		NULL,			/* post-proxy */
 		NULL			/* post-auth */
 	},
+	0,				/* thread_inst_size */
+	NULL,				/* thread_instantiate */
+	NULL,				/* thread_detach */
+	NULL				/* cache_flush */
 };
@@ -128,5 +128,9 @@ module_t rlm_date = {
 		NULL,			/* pre-accounting */
 		NULL			/* accounting */
 	},
+	0,				/* thread_inst_size */
+	NULL,				/* thread_instantiate */
+	NULL,				/* thread_detach */
+	NULL				/* cache_flush */
 };
 
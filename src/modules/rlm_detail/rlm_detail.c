@@ -43,7 +43,12 @@ RCSID("$Id$")
 #  include <grp.h>
 #endif
 
+#ifdef WITH_DETAIL_COMPRESSION
+#  include <zlib.h>
+#endif
+
 #define DIRLEN	8192		//!< Maximum path length.
+#define BINLEN	65536		//!< Maximum size of a binary entry.
 
 /** Instance configuration for rlm_detail
  *
@@ -60,6 +65,13 @@ typedef struct detail_instance {
 
 	bool		log_srcdst;	//!< Add IP src/dst attributes to entries.
 
+	bool		binary;		//!< Write RADIUS attributes instead of text.
+	bool		compress;	//!< Write binary entries in compressed blocks.
+
+	bool		async;		//!< Queue entries for a writer thread.
+	uint32_t	commit_interval; //!< How long the writer waits for more entries.
+	bool		fsync;		//!< Sync entries before returning.
+
 	fr_logfile_t    *lf;		//!< Log file handler
 
 	fr_hash_table_t *ht;		//!< Holds suppressed attributes.
@@ -74,6 +86,11 @@ static const CONF_PARSER module_config[] = {
 	{ "group", FR_CONF_OFFSET(PW_TYPE_STRING, detail_instance_t, group), NULL },
 	{ "locking", FR_CONF_OFFSET(PW_TYPE_BOOLEAN, detail_instance_t, locking), "no" },
 	{ "log_packet_header", FR_CONF_OFFSET(PW_TYPE_BOOLEAN, detail_instance_t, log_srcdst), "no" },
+	{ "binary", FR_CONF_OFFSET(PW_TYPE_BOOLEAN, detail_instance_t, binary), "no" },
+	{ "compress", FR_CONF_OFFSET(PW_TYPE_BOOLEAN, detail_instance_t, compress), "no" },
+	{ "async", FR_CONF_OFFSET(PW_TYPE_BOOLEAN, detail_instance_t, async), "no" },
+	{ "commit_interval", FR_CONF_OFFSET(PW_TYPE_INTEGER, detail_instance_t, commit_interval), "10" },
+	{ "fsync", FR_CONF_OFFSET(PW_TYPE_BOOLEAN, detail_instance_t, fsync), "no" },
 	{ NULL, -1, 0, NULL, NULL }
 };
 
@@ -104,6 +121,47 @@ static int detail_cmp(void const *a, void const *b)
 }
 
 
+#ifdef WITH_DETAIL_COMPRESSION
+/** Compress binary entries into a detail_block_t
+ *
+ * Called by the log file code with all of the entries for one file.
+ */
+static ssize_t detail_compress(TALLOC_CTX *ctx, uint8_t **out, uint8_t const *data, size_t len, UNUSED void *uctx)
+{
+	uLongf		zlen;
+	uint8_t		*buffer;
+	detail_block_t	hdr;
+
+	if (len > DETAIL_BLOCK_MAX) {
+		fr_strerror_printf("Entries too large to compress");
+		return -1;
+	}
+
+	zlen = compressBound(len);
+	buffer = talloc_array(ctx, uint8_t, sizeof(hdr) + zlen);
+	if (!buffer) {
+		fr_strerror_printf("Out of memory");
+		return -1;
+	}
+
+	if (compress2(buffer + sizeof(hdr), &zlen, data, len, Z_BEST_SPEED) != Z_OK) {
+		fr_strerror_printf("Failed compressing entries");
+		talloc_free(buffer);
+		return -1;
+	}
+
+	hdr.magic = htonl(DETAIL_BLOCK_MAGIC);
+	hdr.length = htonl(zlen);
+	hdr.raw_length = htonl(len);
+	hdr.checksum = 0;
+	hdr.checksum = htonl(detail_block_checksum(&hdr, buffer + sizeof(hdr), zlen));
+	memcpy(buffer, &hdr, sizeof(hdr));
+
+	*out = buffer;
+	return sizeof(hdr) + zlen;
+}
+#endif
+
 /*
  *	(Re-)read radiusd.conf into memory.
  */
@@ -123,6 +181,48 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 		return -1;
 	}
 
+	if (inst->compress) {
+#ifdef WITH_DETAIL_COMPRESSION
+		if (!inst->binary) {
+			cf_log_err_cs(conf, "'compress = yes' requires 'binary = yes'");
+			return -1;
+		}
+
+		fr_logfile_encoder(inst->lf, detail_compress, inst);
+#else
+		cf_log_err_cs(conf, "'compress = yes' is not supported on this system (zlib is required)");
+		return -1;
+#endif
+	}
+
+	if (inst->async) {
+		gid_t gid = -1;
+
+#ifndef HAVE_OPEN_MEMSTREAM
+		if (!inst->binary) {
+			cf_log_err_cs(conf, "'async = yes' requires 'binary = yes' on this system");
+			return -1;
+		}
+#endif
+
+		FR_INTEGER_BOUND_CHECK("commit_interval", inst->commit_interval, <=, 1000);
+
+#ifdef HAVE_GRP_H
+		/*
+		 *	The writer thread sets the group of the files.
+		 */
+		if (inst->group && !fr_getgid_any(inst->group, &gid)) {
+			cf_log_err_cs(conf, "Unable to find system group '%s'", inst->group);
+			return -1;
+		}
+#endif
+
+		if (fr_logfile_async(inst->lf, inst->commit_interval, inst->fsync, gid) < 0) {
+			cf_log_err_cs(conf, "Failed starting writer: %s", fr_strerror());
+			return -1;
+		}
+	}
+
 	/*
 	 *	Suppress certain attributes.
 	 */
@@ -323,6 +423,151 @@ static int detail_write(FILE *out, detail_instance_t *inst, REQUEST *request, RA
 	return 0;
 }
 
+/** Encode a single binary detail entry
+ *
+ * The entry is written with one write(), so that a crash either leaves
+ * it complete, or truncated at the end of the file, where the reader's
+ * checksum will catch it.
+ *
+ * @param[out] out The entry, allocated in the context of the request.
+ * @param[in] inst Instance of rlm_detail.
+ * @param[in] request The current request.
+ * @param[in] packet associated with the request (request, reply, proxy-request, proxy-reply...).
+ * @param[in] compat Write out entry in compatibility mode.
+ * @return the length of the entry, or -1 on error.
+ */
+static ssize_t detail_encode_binary(uint8_t **out, detail_instance_t *inst, REQUEST *request, RADIUS_PACKET *packet, bool compat)
+{
+	VALUE_PAIR const	*vp;
+	RADIUS_PACKET		encoder;
+	detail_binary_t		hdr;
+	uint8_t			*buffer, *p, *end;
+	ssize_t			len;
+
+	buffer = talloc_array(request, uint8_t, BINLEN);
+	if (!buffer) return -1;
+
+	p = buffer + sizeof(hdr);
+	end = buffer + BINLEN;
+
+	/*
+	 *	The passwords are "encrypted" with an empty secret and
+	 *	a zero vector, which the reader reverses.
+	 */
+	memset(&encoder, 0, sizeof(encoder));
+
+	vp = packet->vps;
+	while (vp) {
+		/*
+		 *	Internal attributes can't be encoded.
+		 */
+		if ((!vp->da->vendor && ((vp->da->attr & 0xffff) >= 256) &&
+		     !vp->da->flags.extended && !vp->da->flags.long_extended) ||
+		    (inst->ht && fr_hash_table_finddata(inst->ht, vp->da)) ||
+		    (compat && !vp->da->vendor && (vp->da->attr == PW_USER_PASSWORD))) {
+			vp = vp->next;
+			continue;
+		}
+
+		if (vp->length == 0) {
+			vp = vp->next;
+			continue;
+		}
+
+		len = rad_vp2attr(&encoder, &encoder, "", &vp, p, end - p);
+		if (len <= 0) {
+			RERROR("Failed encoding detail entry: %s",
+			       len < 0 ? fr_strerror() : "Entry is too large");
+			talloc_free(buffer);
+			return -1;
+		}
+
+		p += len;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = htonl(DETAIL_BINARY_MAGIC);
+	hdr.length = htonl(p - (buffer + sizeof(hdr)));
+	hdr.timestamp = htonl(request->timestamp);
+	hdr.code = packet->code;
+
+	switch (packet->src_ipaddr.af) {
+	case AF_INET:
+		hdr.af = 4;
+		memcpy(hdr.ipaddr, &packet->src_ipaddr.ipaddr.ip4addr, 4);
+		break;
+
+	case AF_INET6:
+		hdr.af = 6;
+		memcpy(hdr.ipaddr, &packet->src_ipaddr.ipaddr.ip6addr, 16);
+		break;
+
+	default:
+		break;
+	}
+
+	hdr.checksum = htonl(detail_binary_checksum(&hdr, buffer + sizeof(hdr), p - (buffer + sizeof(hdr))));
+	memcpy(buffer, &hdr, sizeof(hdr));
+
+	*out = buffer;
+	return p - buffer;
+}
+
+/*
+ *	Queue an entry for the writer thread.
+ */
+static rlm_rcode_t detail_queue(detail_instance_t *inst, REQUEST *request, RADIUS_PACKET *packet, bool compat,
+				char const *filename)
+{
+	int	rcode;
+
+	if (inst->binary) {
+		uint8_t	*entry;
+		ssize_t	len;
+
+		len = detail_encode_binary(&entry, inst, request, packet, compat);
+		if (len < 0) return RLM_MODULE_FAIL;
+
+		rcode = fr_logfile_write(inst->lf, filename, inst->perm, entry, len);
+		talloc_free(entry);
+	}
+#ifdef HAVE_OPEN_MEMSTREAM
+	else {
+		FILE	*out;
+		char	*text = NULL;
+		size_t	len = 0;
+
+		out = open_memstream(&text, &len);
+		if (!out) {
+			RERROR("Failed formatting detail entry: %s", fr_syserror(errno));
+			return RLM_MODULE_FAIL;
+		}
+
+		if (detail_write(out, inst, request, packet, compat) < 0) {
+			fclose(out);
+			free(text);
+			return RLM_MODULE_FAIL;
+		}
+		fclose(out);
+
+		rcode = fr_logfile_write(inst->lf, filename, inst->perm, text, len);
+		free(text);
+	}
+#else
+	else {
+		rad_assert(0 == 1);	/* checked in mod_instantiate */
+		rcode = -1;
+	}
+#endif
+
+	if (rcode < 0) {
+		RERROR("Failed writing to detail file %s: %s", filename, fr_strerror());
+		return RLM_MODULE_FAIL;
+	}
+
+	return RLM_MODULE_OK;
+}
+
 /*
  *	Do detail, compatible with old accounting
  */
@@ -335,7 +580,6 @@ static rlm_rcode_t CC_HINT(nonnull) detail_do(void *instance, REQUEST *request,
 
 #ifdef HAVE_GRP_H
 	gid_t		gid;
-	char		*endptr;
 #endif
 
 	detail_instance_t *inst = instance;
@@ -367,6 +611,8 @@ static rlm_rcode_t CC_HINT(nonnull) detail_do(void *instance, REQUEST *request,
 #endif
 #endif
 
+	if (inst->async) return detail_queue(inst, request, packet, compat, buffer);
+
 	outfd = fr_logfile_open(inst->lf, buffer, inst->perm);
 	if (outfd < 0) {
 		RERROR("Couldn't open file %s: %s", buffer, fr_strerror());
@@ -375,12 +621,9 @@ static rlm_rcode_t CC_HINT(nonnull) detail_do(void *instance, REQUEST *request,
 
 #ifdef HAVE_GRP_H
 	if (inst->group != NULL) {
-		gid = strtol(inst->group, &endptr, 10);
-		if (*endptr != '\0') {
-			if (!fr_getgid(inst->group, &gid)) {
-				RDEBUG2("Unable to find system group '%s'", inst->group);
-				goto skip_group;
-			}
+		if (!fr_getgid_any(inst->group, &gid)) {
+			RDEBUG2("Unable to find system group '%s'", inst->group);
+			goto skip_group;
 		}
 
 		if (chown(buffer, -1, gid) == -1) {
@@ -391,6 +634,36 @@ static rlm_rcode_t CC_HINT(nonnull) detail_do(void *instance, REQUEST *request,
 skip_group:
 #endif
 
+	if (inst->binary) {
+		uint8_t	*entry;
+		ssize_t	len;
+
+		len = detail_encode_binary(&entry, inst, request, packet, compat);
+#ifdef WITH_DETAIL_COMPRESSION
+		if ((len >= 0) && inst->compress) {
+			uint8_t *block;
+
+			len = detail_compress(request, &block, entry, len, inst);
+			talloc_free(entry);
+			if (len < 0) {
+				RERROR("%s", fr_strerror());
+			} else {
+				entry = block;
+			}
+		}
+#endif
+		if (len >= 0) {
+			if (write(outfd, entry, len) < len) {
+				RERROR("Failed writing to detail file: %s", fr_syserror(errno));
+				len = -1;
+			}
+			talloc_free(entry);
+		}
+		fr_logfile_close(inst->lf, outfd);
+
+		return (len < 0) ? RLM_MODULE_FAIL : RLM_MODULE_OK;
+	}
+
 	/*
 	 *	Open the output fp for buffering.
 	 */
@@ -538,5 +811,9 @@ module_t rlm_detail = {
 		mod_send_coa
 #endif
 	},
+	0,				/* thread_inst_size */
+	NULL,				/* thread_instantiate */
+	NULL,				/* thread_detach */
+	NULL				/* cache_flush */
 };
 
@@ -611,4 +611,8 @@ module_t rlm_digest = {
 		NULL,			/* post-proxy */
 		NULL			/* post-auth */
 	},
+	0,				/* thread_inst_size */
+	NULL,				/* thread_instantiate */
+	NULL,				/* thread_detach */
+	NULL				/* cache_flush */
 };
@@ -125,4 +125,8 @@ module_t rlm_dynamic_clients = {
 		NULL,			/* post-proxy */
 		NULL			/* post-auth */
 	},
+	0,				/* thread_inst_size */
+	NULL,				/* thread_instantiate */
+	NULL,				/* thread_detach */
+	NULL				/* cache_flush */
 };
@@ -186,6 +186,13 @@ static int eap_module_call(eap_module_t *module, eap_handler_t *handler)
 
 	rad_assert(module != NULL);
 
+	/*
+	 *	rlm_eap itself can give up the thread, but most
+	 *	methods haven't been checked for locks or thread-local
+	 *	state which they hold across a yield.
+	 */
+	if (!module->type->yield_safe) thread_pool_yield_block(true);
+
 	switch (handler->stage) {
 	case INITIATE:
 		if (!module->type->initiate(module->instance, handler)) {
@@ -223,6 +230,8 @@ static int eap_module_call(eap_module_t *module, eap_handler_t *handler)
 		break;
 	}
 
+	if (!module->type->yield_safe) thread_pool_yield_block(false);
+
 	request->module = caller;
 	return rcode;
 }
@@ -122,6 +122,14 @@ typedef struct _eap_handler {
 	int		tls;
 	int		finished;
 	VALUE_PAIR	*certs;
+
+	VALUE_PAIR	*cred_cache;	//!< Inner tunnel credentials kept
+					//!< between rounds of this session.
+	char		*cred_identity;	//!< Inner User-Name cred_cache is for.
+
+	VALUE_PAIR	*inner_config;	//!< Inner control list, kept while the
+					//!< inner conversation continues.
+	char		*inner_identity;	//!< Inner User-Name inner_config is for.
 } eap_handler_t;
 
 /*
@@ -134,6 +142,23 @@ typedef struct rlm_eap_module {
 	int (*authorize)(void *instance, eap_handler_t *handler);
 	int (*authenticate)(void *instance, eap_handler_t *handler);
 	int (*detach)(void *instance);
+
+	/*
+	 *	Optional.  Save and load handler->opaque, so that
+	 *	sessions can be continued by other servers.  See
+	 *	"redis_module_instance" in the eap module.
+	 */
+	ssize_t (*opaque_save)(void *instance, eap_handler_t *handler, uint8_t *out, size_t outlen);
+	int (*opaque_load)(void *instance, eap_handler_t *handler, uint8_t const *data, size_t len);
+
+	/*
+	 *	Whether initiate() and authenticate() may give up the
+	 *	thread (see module_yield()).  Only set this for methods
+	 *	which hold no locks or thread-local state across any
+	 *	call which can yield.  The others run with yields
+	 *	blocked.
+	 */
+	bool yield_safe;
 } rlm_eap_module_t;
 
 #define REQUEST_DATA_EAP_HANDLER	 (1)
@@ -791,20 +791,27 @@ fr_tls_status_t eaptls_process(eap_handler_t *handler)
 	}
 
 	/*
-	 *	Get the session struct from the handler
+	 *	Write the fragment straight into the SSL session's
+	 *	memory BIO.  OpenSSL doesn't read from it until the
+	 *	last fragment has arrived, so it accumulates the
+	 *	fragments for us, and we don't need to copy them into
+	 *	an intermediate buffer first.
 	 *
-	 *	update the dirty_in buffer
-	 *
-	 *	NOTE: This buffer will contain partial data when M bit is set.
-	 *
-	 * 	CAUTION while reinitializing this buffer, it should be
-	 * 	reinitialized only when this M bit is NOT set.
+	 *	The amount of data which may be queued is still
+	 *	limited, as it was when it was buffered here.
 	 */
-	if (tlspacket->dlen !=
-	    (tls_session->record_plus)(&tls_session->dirty_in, tlspacket->data, tlspacket->dlen)) {
+	if ((BIO_ctrl_pending(tls_session->into_ssl) + tlspacket->dlen) > MAX_RECORD_SIZE) {
 		talloc_free(tlspacket);
 		RDEBUG("Exceeded maximum record size");
-		status =FR_TLS_FAIL;
+		status = FR_TLS_FAIL;
+		goto done;
+	}
+
+	if (tlspacket->dlen &&
+	    (BIO_write(tls_session->into_ssl, tlspacket->data, tlspacket->dlen) != (int) tlspacket->dlen)) {
+		talloc_free(tlspacket);
+		RDEBUG("Failed writing %u bytes to SSL BIO", (unsigned int) tlspacket->dlen);
+		status = FR_TLS_FAIL;
 		goto done;
 	}
 
@@ -999,3 +1006,147 @@ fr_tls_server_conf_t *eaptls_conf_parse(CONF_SECTION *cs, char const *attr)
 	return tls_conf;
 }
 
+
+/*
+ *	Control attributes which hold a user's credentials, rather than
+ *	anything derived from the current challenge.  These stay valid
+ *	for every round of one EAP session.
+ */
+static unsigned int const eaptls_cred_attrs[] = {
+	PW_CLEARTEXT_PASSWORD,
+	PW_NT_PASSWORD,
+	PW_LM_PASSWORD,
+	0
+};
+
+static void eaptls_creds_flush(eap_handler_t *handler)
+{
+	pairfree(&handler->cred_cache);
+	TALLOC_FREE(handler->cred_identity);
+}
+
+/** Add credentials found by earlier inner rounds to a tunnelled request
+ *
+ * Called before the tunnelled request is run through the inner virtual
+ * server.  If the inner User-Name is the one the cache was filled for,
+ * the cached credentials are added to the control list, so that
+ * rlm_mschap finds the NT-Password directly, and policies can skip
+ * the backend lookup with "if (!&control:NT-Password)".
+ *
+ * @param handler of the outer EAP session.
+ * @param fake the tunnelled request.
+ */
+static void eaptls_creds_restore(eap_handler_t *handler, REQUEST *fake)
+{
+	REQUEST		*request = handler->request;
+	VALUE_PAIR	*vp, *username;
+	vp_cursor_t	cursor;
+
+	if (!handler->cred_cache) return;
+
+	username = pairfind(fake->packet->vps, PW_USER_NAME, 0, TAG_ANY);
+	if (!username || !handler->cred_identity ||
+	    (strcmp(username->vp_strvalue, handler->cred_identity) != 0)) {
+		RDEBUG2("Inner User-Name has changed, discarding cached credentials");
+		eaptls_creds_flush(handler);
+		return;
+	}
+
+	for (vp = fr_cursor_init(&cursor, &handler->cred_cache);
+	     vp;
+	     vp = fr_cursor_next(&cursor)) {
+		if (pairfind(fake->config_items, vp->da->attr, vp->da->vendor, TAG_ANY)) continue;
+
+		RDEBUG2("Using cached &control:%s for \"%s\"", vp->da->name, handler->cred_identity);
+		pairadd(&fake->config_items, paircopyvp(fake, vp));
+	}
+}
+
+/** Remember the credentials an inner round looked up
+ *
+ * Called after the tunnelled request has been through the inner
+ * virtual server.  Password changes (MS-CHAP2-CPW) invalidate the
+ * cache, as the old hashes are no longer correct.
+ *
+ * @param handler of the outer EAP session.
+ * @param fake the tunnelled request.
+ */
+static void eaptls_creds_save(eap_handler_t *handler, REQUEST *fake)
+{
+	int		i;
+	VALUE_PAIR	*vp, *username, *creds = NULL;
+
+	if (pairfind(fake->packet->vps, PW_MSCHAP2_CPW, VENDORPEC_MICROSOFT, TAG_ANY)) {
+		eaptls_creds_flush(handler);
+		return;
+	}
+
+	username = pairfind(fake->packet->vps, PW_USER_NAME, 0, TAG_ANY);
+	if (!username) return;
+
+	for (i = 0; eaptls_cred_attrs[i] != 0; i++) {
+		vp = pairfind(fake->config_items, eaptls_cred_attrs[i], 0, TAG_ANY);
+		if (!vp) continue;
+
+		pairadd(&creds, paircopyvp(handler, vp));
+	}
+	if (!creds) return;
+
+	eaptls_creds_flush(handler);
+	handler->cred_cache = creds;
+	handler->cred_identity = talloc_strdup(handler, username->vp_strvalue);
+}
+
+/** Run a tunnelled request through the inner virtual server
+ *
+ * Credentials found by earlier rounds of this session are re-used, see
+ * eaptls_creds_restore().
+ *
+ * With authorize_once, the control list of a round which ended in an
+ * Access-Challenge is kept.  The next round, if it is for the same inner
+ * User-Name and carries an EAP-Message, starts with a copy of that list,
+ * and only runs the authenticate and post-auth sections.  The inner EAP
+ * conversation then looks the user up once, instead of once per round.
+ *
+ * @param handler of the outer EAP session.
+ * @param fake the tunnelled request.
+ * @param authorize_once skip authorize for continuing inner rounds.
+ * @return the result of rad_virtual_server().
+ */
+int eaptls_virtual_server(eap_handler_t *handler, REQUEST *fake, bool authorize_once)
+{
+	REQUEST		*request = handler->request;
+	VALUE_PAIR	*username;
+	int		rcode;
+
+	username = pairfind(fake->packet->vps, PW_USER_NAME, 0, TAG_ANY);
+	if (authorize_once && handler->inner_config && username &&
+	    (strcmp(username->vp_strvalue, handler->inner_identity) == 0) &&
+	    pairfind(fake->packet->vps, PW_EAP_MESSAGE, 0, TAG_ANY)) {
+		RDEBUG2("Continuing inner EAP conversation for \"%s\"", handler->inner_identity);
+		pairadd(&fake->config_items, paircopy(fake, handler->inner_config));
+		rcode = rad_virtual_server_authenticate(fake);
+	} else {
+		eaptls_creds_restore(handler, fake);
+		rcode = rad_virtual_server(fake);
+	}
+	eaptls_creds_save(handler, fake);
+
+	pairfree(&handler->inner_config);
+	TALLOC_FREE(handler->inner_identity);
+
+	/*
+	 *	Proxied inner requests have no reply code yet, and
+	 *	don't get here.
+	 */
+	if (!authorize_once || (fake->reply->code != PW_CODE_ACCESS_CHALLENGE) ||
+	    pairfind(fake->config_items, PW_PROXY_TO_REALM, 0, TAG_ANY)) return rcode;
+
+	username = pairfind(fake->packet->vps, PW_USER_NAME, 0, TAG_ANY);
+	if (!username) return rcode;
+
+	handler->inner_config = paircopy(handler, fake->config_items);
+	handler->inner_identity = talloc_strdup(handler, username->vp_strvalue);
+
+	return rcode;
+}
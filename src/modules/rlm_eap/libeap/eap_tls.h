@@ -104,4 +104,7 @@ int 		eaptls_compose(EAP_DS *eap_ds, EAPTLS_PACKET *reply);
 
 fr_tls_server_conf_t *eaptls_conf_parse(CONF_SECTION *cs, char const *key);
 
+/* Inner tunnel */
+int		eaptls_virtual_server(eap_handler_t *handler, REQUEST *fake, bool authorize_once) CC_HINT(nonnull);
+
 #endif /*_EAP_TLS_H*/
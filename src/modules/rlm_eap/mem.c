@@ -25,6 +25,7 @@ RCSID("$Id$")
 
 #include <stdio.h>
 #include "rlm_eap.h"
+#include <freeradius-devel/memstats.h>
 
 #ifdef HAVE_PTHREAD_H
 #define PTHREAD_MUTEX_LOCK pthread_mutex_lock
@@ -76,6 +77,8 @@ static int _eap_handler_free(eap_handler_t *handler)
 {
 	rlm_eap_t *inst = handler->inst_holder;
 
+	memstats_free(MEMSTATS_EAP_SESSION, handler);
+
 	if (handler->identity) {
 		talloc_free(handler->identity);
 		handler->identity = NULL;
@@ -94,10 +97,17 @@ static int _eap_handler_free(eap_handler_t *handler)
 
 	if (handler->certs) pairfree(&handler->certs);
 
-	PTHREAD_MUTEX_LOCK(&(inst->handler_mutex));
-	if (inst->handler_tree) {
-		rbtree_deletebydata(inst->handler_tree, handler);
+	/*
+	 *	The handler tree is only used when debugging, so
+	 *	that's the only time we need the lock.
+	 */
+	if (!inst->handler_tree) {
+		talloc_free(handler);
+		return 0;
 	}
+
+	PTHREAD_MUTEX_LOCK(&(inst->handler_mutex));
+	rbtree_deletebydata(inst->handler_tree, handler);
 	/*
 	 *	Free operations need to be synchronised too.
 	 */
@@ -114,20 +124,24 @@ eap_handler_t *eap_handler_alloc(rlm_eap_t *inst)
 {
 	eap_handler_t	*handler;
 
-	PTHREAD_MUTEX_LOCK(&(inst->handler_mutex));
 	handler = talloc_zero(NULL, eap_handler_t);
+	if (!handler) return NULL;
+
 	if (inst->handler_tree) {
+		PTHREAD_MUTEX_LOCK(&(inst->handler_mutex));
 		if (!rbtree_insert(inst->handler_tree, handler)) {
+			PTHREAD_MUTEX_UNLOCK(&(inst->handler_mutex));
 			ERROR("Failed inserting EAP handler into handler tree");
 			talloc_free(handler);
 			return NULL;
 		}
+		PTHREAD_MUTEX_UNLOCK(&(inst->handler_mutex));
 	}
 	handler->inst_holder = inst;
-	PTHREAD_MUTEX_UNLOCK(&(inst->handler_mutex));
 
 	/* Doesn't need to be inside the critical region */
 	talloc_set_destructor(handler, _eap_handler_free);
+	memstats_alloc(MEMSTATS_EAP_SESSION, NULL);
 
 	return handler;
 }
@@ -173,7 +187,7 @@ static int _check_opaque_free(check_handler_t *check)
 	 *	same RADIUS Id, which forces the current packet to be
 	 *	deleted.  In that case, ignore the error.
 	 */
-	if (time(NULL) < (check->handler->timestamp + 3)) goto done;
+	if (fr_clock_time() < (check->handler->timestamp + 3)) goto done;
 
 	if (!check->handler->finished) {
 		do_warning = true;
@@ -198,123 +212,189 @@ done:
 	return 0;
 }
 
-void eaplist_free(rlm_eap_t *inst)
+/*
+ *	Compare two handlers.
+ */
+static int eap_handler_cmp(void const *a, void const *b)
 {
-	eap_handler_t *node, *next;
+	int rcode;
+	eap_handler_t const *one = a;
+	eap_handler_t const *two = b;
+
+	if (one->eap_id < two->eap_id) return -1;
+	if (one->eap_id > two->eap_id) return +1;
 
-	for (node = inst->session_head; node != NULL; node = next) {
-		next = node->next;
-		talloc_free(node);
+	rcode = memcmp(one->state, two->state, sizeof(one->state));
+	if (rcode != 0) return rcode;
+
+	/*
+	 *	As of 2.1.8, we don't key off of source IP.  This
+	 *	a NAS to send packets load-balanced (or fail-over)
+	 *	across multiple intermediate proxies, and still have
+	 *	EAP work.
+	 */
+	if (fr_ipaddr_cmp(&one->src_ipaddr, &two->src_ipaddr) != 0) {
+		WARN("EAP packets are arriving from two different upstream "
+		       "servers.  Has there been a proxy fail-over?");
 	}
 
-	inst->session_head = inst->session_tail = NULL;
+	return 0;
 }
 
-/*
- *	Return a 32-bit random number.
- */
-static uint32_t eap_rand(fr_randctx *ctx)
+static uint32_t eap_handler_hash(void const *data)
 {
-	uint32_t num;
+	eap_handler_t const *handler = data;
 
-	num = ctx->randrsl[ctx->randcnt++];
-	if (ctx->randcnt >= 256) {
-		ctx->randcnt = 0;
-		fr_isaac(ctx);
-	}
-
-	return num;
+	return fr_hash_keyed(handler->state, sizeof(handler->state));
 }
 
-
-static eap_handler_t *eaplist_delete(rlm_eap_t *inst, REQUEST *request,
-				   eap_handler_t *handler)
+/*
+ *	The hash tables use the low bits of the hash, so we use the
+ *	high ones to pick the shard.
+ */
+static eap_session_shard_t *eaplist_shard(rlm_eap_t *inst, eap_handler_t const *handler)
 {
-	rbnode_t *node;
+	return &inst->shards[(eap_handler_hash(handler) >> 24) % EAP_SESSION_SHARDS];
+}
 
-	node = rbtree_find(inst->session_tree, handler);
-	if (!node) return NULL;
+/*
+ *	The time at which a session expires, and the slot of the
+ *	timer wheel it's in.
+ */
+static inline time_t eap_handler_expires(rlm_eap_t const *inst, eap_handler_t const *handler)
+{
+	return handler->timestamp + inst->timer_limit + 1;
+}
 
-	handler = rbtree_node2data(inst->session_tree, node);
+static inline int eap_handler_slot(rlm_eap_t const *inst, eap_handler_t const *handler)
+{
+	return (eap_handler_expires(inst, handler) / inst->wheel_tick) % EAP_WHEEL_SLOTS;
+}
 
-	RDEBUG("Finished EAP session with state "
-	       "0x%02x%02x%02x%02x%02x%02x%02x%02x",
-	       handler->state[0], handler->state[1],
-	       handler->state[2], handler->state[3],
-	       handler->state[4], handler->state[5],
-	       handler->state[6], handler->state[7]);
-	/*
-	 *	Delete old handler from the tree.
-	 */
-	rbtree_delete(inst->session_tree, node);
+/*
+ *	Remove a handler from its shard.
+ */
+static void eaplist_unlink(rlm_eap_t *inst, eap_session_shard_t *shard, eap_handler_t *handler)
+{
+	fr_hash_table_yank(shard->sessions, handler);
 
-	/*
-	 *	And unsplice it from the linked list.
-	 */
 	if (handler->prev) {
 		handler->prev->next = handler->next;
 	} else {
-		inst->session_head = handler->next;
+		shard->wheel[eap_handler_slot(inst, handler)] = handler->next;
 	}
-	if (handler->next) {
-		handler->next->prev = handler->prev;
-	} else {
-		inst->session_tail = handler->prev;
-	}
-	handler->prev = handler->next = NULL;
+	if (handler->next) handler->next->prev = handler->prev;
 
-	return handler;
+	handler->prev = handler->next = NULL;
 }
 
-
-static void eaplist_expire(rlm_eap_t *inst, REQUEST *request, time_t timestamp)
+/** Set up the session shards
+ *
+ * @param[in] inst of rlm_eap, with its configuration parsed.
+ * @return 0 on success, -1 on error.
+ */
+int eaplist_init(rlm_eap_t *inst)
 {
 	int i;
-	eap_handler_t *handler;
 
 	/*
-	 *	Check the first few handlers in the list, and delete
-	 *	them if they're too old.  We don't need to check them
-	 *	all, as incoming requests will quickly cause older
-	 *	handlers to be deleted.
-	 *
+	 *	Spread max_sessions over the shards, and make sure
+	 *	the wheel covers timer_expire.
 	 */
-	for (i = 0; i < 3; i++) {
-		handler = inst->session_head;
-		if (!handler) break;
+	inst->shard_max_sessions = (inst->max_sessions + EAP_SESSION_SHARDS - 1) / EAP_SESSION_SHARDS;
+	inst->wheel_tick = ((inst->timer_limit + 1) / EAP_WHEEL_SLOTS) + 1;
 
-		RDEBUG("Expiring EAP session with state "
-		       "0x%02x%02x%02x%02x%02x%02x%02x%02x",
-		       handler->state[0], handler->state[1],
-		       handler->state[2], handler->state[3],
-		       handler->state[4], handler->state[5],
-		       handler->state[6], handler->state[7]);
+	for (i = 0; i < EAP_SESSION_SHARDS; i++) {
+		eap_session_shard_t *shard = &inst->shards[i];
 
 		/*
-		 *	Expire entries from the start of the list.
-		 *	They should be the oldest ones.
+		 *	We don't free the sessions in the table, as
+		 *	that's taken care of elsewhere...
 		 */
-		if ((timestamp - handler->timestamp) > (int)inst->timer_limit) {
-			rbnode_t *node;
-			node = rbtree_find(inst->session_tree, handler);
-			rad_assert(node != NULL);
-			rbtree_delete(inst->session_tree, node);
-
-			/*
-			 *	handler == inst->session_head
-			 */
-			inst->session_head = handler->next;
-			if (handler->next) {
-				handler->next->prev = NULL;
-			} else {
-				inst->session_head = NULL;
-				inst->session_tail = NULL;
+		shard->sessions = fr_hash_table_create(eap_handler_hash, eap_handler_cmp, NULL);
+		if (!shard->sessions) {
+			ERROR("rlm_eap (%s): Cannot initialize session table", inst->xlat_name);
+			return -1;
+		}
+
+#ifdef HAVE_PTHREAD_H
+		if (pthread_mutex_init(&shard->mutex, NULL) < 0) {
+			ERROR("rlm_eap (%s): Failed initializing mutex: %s", inst->xlat_name, fr_syserror(errno));
+			fr_hash_table_free(shard->sessions);
+			shard->sessions = NULL;
+			return -1;
+		}
+#endif
+	}
+
+	return 0;
+}
+
+void eaplist_free(rlm_eap_t *inst)
+{
+	eap_handler_t *node, *next;
+	int i, j;
+
+	for (i = 0; i < EAP_SESSION_SHARDS; i++) {
+		eap_session_shard_t *shard = &inst->shards[i];
+
+		/*
+		 *	Only initialised shards have a table.
+		 */
+		if (!shard->sessions) break;
+
+		for (j = 0; j < EAP_WHEEL_SLOTS; j++) {
+			for (node = shard->wheel[j]; node != NULL; node = next) {
+				next = node->next;
+				talloc_free(node);
 			}
+			shard->wheel[j] = NULL;
+		}
+
+		fr_hash_table_free(shard->sessions);
+		shard->sessions = NULL;
+
+#ifdef HAVE_PTHREAD_H
+		pthread_mutex_destroy(&shard->mutex);
+#endif
+	}
+}
+
+
+/*
+ *	Expire the sessions in the slots of the timer wheel which
+ *	have passed since we last looked.  The current slot is
+ *	looked at again next time, as more of its sessions may
+ *	expire before then.
+ */
+static void eaplist_expire(rlm_eap_t *inst, REQUEST *request, eap_session_shard_t *shard, time_t timestamp)
+{
+	time_t tick, end;
+	eap_handler_t *handler, *next;
+
+	end = timestamp / inst->wheel_tick;
+	tick = shard->wheel_next;
+	if ((end - tick) >= EAP_WHEEL_SLOTS) tick = end - EAP_WHEEL_SLOTS + 1;
+
+	for (; tick <= end; tick++) {
+		for (handler = shard->wheel[tick % EAP_WHEEL_SLOTS]; handler != NULL; handler = next) {
+			next = handler->next;
+
+			if (eap_handler_expires(inst, handler) > timestamp) continue;
+
+			RDEBUG("Expiring EAP session with state "
+			       "0x%02x%02x%02x%02x%02x%02x%02x%02x",
+			       handler->state[0], handler->state[1],
+			       handler->state[2], handler->state[3],
+			       handler->state[4], handler->state[5],
+			       handler->state[6], handler->state[7]);
+
+			eaplist_unlink(inst, shard, handler);
 			talloc_free(handler);
-		} else {
-			break;
 		}
 	}
+
+	shard->wheel_next = end;
 }
 
 /*
@@ -328,6 +408,9 @@ int eaplist_add(rlm_eap_t *inst, eap_handler_t *handler)
 	int		status = 0;
 	VALUE_PAIR	*state;
 	REQUEST		*request = handler->request;
+	eap_session_shard_t *shard;
+	char		session[(EAP_STORE_MAX_SESSION * 2) + 1];
+	ssize_t		slen = 0;
 
 	/*
 	 *	Generate State, since we've been asked to add it to
@@ -346,38 +429,12 @@ int eaplist_add(rlm_eap_t *inst, eap_handler_t *handler)
 	handler->src_ipaddr = request->packet->src_ipaddr;
 	handler->eap_id = handler->eap_ds->request->id;
 
-	/*
-	 *	Playing with a data structure shared among threads
-	 *	means that we need a lock, to avoid conflict.
-	 */
-	PTHREAD_MUTEX_LOCK(&(inst->session_mutex));
-
-	/*
-	 *	If we have a DoS attack, discard new sessions.
-	 */
-	if (rbtree_num_elements(inst->session_tree) >= inst->max_sessions) {
-		status = -1;
-		eaplist_expire(inst, request, handler->timestamp);
-		goto done;
-	}
-
 	/*
 	 *	Create a unique content for the State variable.
 	 *	It will be modified slightly per round trip, but less so
 	 *	than in 1.x.
 	 */
-	if (handler->trips == 0) {
-		int i;
-
-		for (i = 0; i < 4; i++) {
-			uint32_t lvalue;
-
-			lvalue = eap_rand(&inst->rand_pool);
-
-			memcpy(handler->state + i * 4, &lvalue,
-			       sizeof(lvalue));
-		}
-	}
+	if (handler->trips == 0) fr_rand_fill(handler->state, sizeof(handler->state));
 
 	/*
 	 *	Add some more data to distinguish the sessions.
@@ -388,10 +445,34 @@ int eaplist_add(rlm_eap_t *inst, eap_handler_t *handler)
 
 	pairmemcpy(state, handler->state, sizeof(handler->state));
 
+	/*
+	 *	Encode the session for the session store while no
+	 *	other thread can see it.
+	 */
+	if (inst->redis_instance_name) slen = eap_store_encode(inst, handler, session, sizeof(session));
+
+	/*
+	 *	Playing with a data structure shared among threads
+	 *	means that we need a lock, to avoid conflict.  Only
+	 *	the shard holding this session is locked.
+	 */
+	shard = eaplist_shard(inst, handler);
+	PTHREAD_MUTEX_LOCK(&(shard->mutex));
+
+	eaplist_expire(inst, request, shard, handler->timestamp);
+
+	/*
+	 *	If we have a DoS attack, discard new sessions.
+	 */
+	if ((uint32_t) fr_hash_table_num_elements(shard->sessions) >= inst->shard_max_sessions) {
+		status = -1;
+		goto done;
+	}
+
 	/*
 	 *	Big-time failure.
 	 */
-	status = rbtree_insert(inst->session_tree, handler);
+	status = fr_hash_table_insert(shard->sessions, handler);
 
 	/*
 	 *	Catch Access-Challenge without response.
@@ -408,18 +489,13 @@ int eaplist_add(rlm_eap_t *inst, eap_handler_t *handler)
 	}
 
 	if (status) {
-		eap_handler_t *prev;
-
-		prev = inst->session_tail;
-		if (prev) {
-			prev->next = handler;
-			handler->prev = prev;
-			handler->next = NULL;
-			inst->session_tail = handler;
-		} else {
-			inst->session_head = inst->session_tail = handler;
-			handler->next = handler->prev = NULL;
-		}
+		eap_handler_t **slot;
+
+		slot = &shard->wheel[eap_handler_slot(inst, handler)];
+		handler->prev = NULL;
+		handler->next = *slot;
+		if (*slot) (*slot)->prev = handler;
+		*slot = handler;
 	}
 
 	/*
@@ -433,10 +509,13 @@ int eaplist_add(rlm_eap_t *inst, eap_handler_t *handler)
 	 */
 	if (status > 0) handler->request = NULL;
 
-	PTHREAD_MUTEX_UNLOCK(&(inst->session_mutex));
+	PTHREAD_MUTEX_UNLOCK(&(shard->mutex));
 
 	if (status <= 0) {
-		pairfree(&state);
+		/*
+		 *	The State is already in the reply list.
+		 */
+		pairdelete(&request->reply->vps, PW_STATE, 0, TAG_ANY);
 
 		if (status < 0) {
 			static time_t last_logged = 0;
@@ -452,6 +531,12 @@ int eaplist_add(rlm_eap_t *inst, eap_handler_t *handler)
 		return 0;
 	}
 
+	/*
+	 *	The handler may already have been taken by another
+	 *	thread, so use the copy of State in the reply.
+	 */
+	if (slen > 0) eap_store_save(inst, request, state->vp_octets, session);
+
 	RDEBUG("New EAP session, adding 'State' attribute to reply 0x%02x%02x%02x%02x%02x%02x%02x%02x",
 	       state->vp_octets[0], state->vp_octets[1], state->vp_octets[2], state->vp_octets[3],
 	       state->vp_octets[4], state->vp_octets[5], state->vp_octets[6], state->vp_octets[7]);
@@ -474,6 +559,7 @@ eap_handler_t *eaplist_find(rlm_eap_t *inst, REQUEST *request,
 {
 	VALUE_PAIR	*state;
 	eap_handler_t	*handler, myHandler;
+	eap_session_shard_t *shard;
 
 	/*
 	 *	We key the sessions off of the 'state' attribute, so it
@@ -493,12 +579,41 @@ eap_handler_t *eaplist_find(rlm_eap_t *inst, REQUEST *request,
 	 *	Playing with a data structure shared among threads
 	 *	means that we need a lock, to avoid conflict.
 	 */
-	PTHREAD_MUTEX_LOCK(&(inst->session_mutex));
+	shard = eaplist_shard(inst, &myHandler);
+	PTHREAD_MUTEX_LOCK(&(shard->mutex));
+
+	eaplist_expire(inst, request, shard, request->timestamp);
+
+	handler = fr_hash_table_finddata(shard->sessions, &myHandler);
+	if (handler) {
+		RDEBUG("Finished EAP session with state "
+		       "0x%02x%02x%02x%02x%02x%02x%02x%02x",
+		       handler->state[0], handler->state[1],
+		       handler->state[2], handler->state[3],
+		       handler->state[4], handler->state[5],
+		       handler->state[6], handler->state[7]);
 
-	eaplist_expire(inst, request, request->timestamp);
+		eaplist_unlink(inst, shard, handler);
+	}
+	PTHREAD_MUTEX_UNLOCK(&(shard->mutex));
 
-	handler = eaplist_delete(inst, request, &myHandler);
-	PTHREAD_MUTEX_UNLOCK(&(inst->session_mutex));
+	/*
+	 *	The session may have been started by another server.
+	 *	Either way, the copy in the store is removed, so that
+	 *	this round can't be continued twice.
+	 */
+	if (inst->redis_instance_name) {
+		if (!handler) {
+			handler = eap_store_load(inst, request, myHandler.state);
+			if (handler && (handler->eap_id != myHandler.eap_id)) {
+				RERROR("EAP session in the session store has the wrong EAP-Id");
+				talloc_free(handler);
+				handler = NULL;
+			}
+		} else if (!handler->tls) {
+			eap_store_forget(inst, request, myHandler.state);
+		}
+	}
 
 	/*
 	 *	Might not have been there.
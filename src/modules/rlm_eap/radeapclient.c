@@ -48,6 +48,10 @@ static int do_summary = 0;
 static bool filedone = false;
 static int totalapp = 0;
 static int totaldeny = 0;
+static bool load_mode = false;
+static int parallel = 1;
+static int count = 1;
+static uint32_t rate = 0;
 static char filesecret[256];
 char const *radius_dir = NULL;
 char const *dict_dir = NULL;
@@ -62,9 +66,58 @@ char const *radiusd_version = "";
 #endif
 
 log_debug_t debug_flag = 0;
-char password[256];
 
-struct eapsim_keys eapsim_mk;
+/*
+ *	The password and the EAP-SIM keys belong to the conversation,
+ *	so they have to be per-thread when several run at once.
+ */
+#if defined(HAVE_PTHREAD_H) && defined(__THREAD)
+#  define EAPCLIENT_THREADS
+#  define EAPCLIENT_LOCAL __THREAD
+#else
+#  define EAPCLIENT_LOCAL
+#endif
+
+static EAPCLIENT_LOCAL char password[256];
+static EAPCLIENT_LOCAL struct eapsim_keys eapsim_mk;
+
+#define USEC			(1000000)
+
+/*
+ *	Latency histograms use 8 linear sub-buckets per power of two,
+ *	from 1 usec up to about 2 minutes.
+ */
+#define EAP_HIST_SUB_BITS	(3)
+#define EAP_HIST_SUB		(1 << EAP_HIST_SUB_BITS)
+#define EAP_HIST_MAX_BITS	(27)
+#define EAP_HIST_BUCKETS	((EAP_HIST_MAX_BITS - EAP_HIST_SUB_BITS + 1) * EAP_HIST_SUB)
+
+typedef struct eap_latency {
+	uint64_t	count;			//!< Number of times recorded.
+	uint64_t	min;			//!< Shortest time, in usec.
+	uint64_t	max;			//!< Longest time, in usec.
+	uint64_t	sum;			//!< For the mean.
+	uint64_t	hist[EAP_HIST_BUCKETS];	//!< Times, by bucket.
+} eap_latency_t;
+
+typedef struct eap_stats {
+	eap_latency_t	round;			//!< From each Access-Request to its reply.
+	eap_latency_t	auth;			//!< From the first Access-Request to the last reply.
+	uint64_t	failed;			//!< Conversations which didn't finish.
+} eap_stats_t;
+
+typedef struct eap_thread {
+	RADIUS_PACKET	*packet;		//!< The conversation, with its own socket.
+	eap_stats_t	stats;
+#ifdef EAPCLIENT_THREADS
+	pthread_t	pthread_id;
+#endif
+} eap_thread_t;
+
+static VALUE_PAIR **entries = NULL;		//!< Conversations read from the input file.
+static uint64_t num_entries = 0;
+static uint64_t next_entry = 0;			//!< Shared by the threads.
+static uint64_t run_start = 0;
 
 static void map_eap_methods(RADIUS_PACKET *req);
 static void unmap_eap_methods(RADIUS_PACKET *rep);
@@ -76,12 +129,15 @@ static void NEVER_RETURNS usage(void)
 	fprintf(stdout, "Usage: radeapclient [options] server[:port] <command> [<secret>]");
 
 	fprintf(stdout, " <command>    One of auth, acct, status, or disconnect.");
+	fprintf(stdout, " -c count     Run each conversation from the file 'count' times.");
 	fprintf(stdout, " -d raddb     Set dictionary directory.");
 	fprintf(stdout, " -f file      Read packets from file, not stdin.");
 	fprintf(stdout, " -r retries   If timeout, retry sending the packet 'retries' times.");
 	fprintf(stdout, " -t timeout   Wait 'timeout' seconds before retrying (may be a floating point number).");
 	fprintf(stdout, " -h	       Print usage help information.");
 	fprintf(stdout, " -i id        Set request id to 'id'.  Values may be 0..255");
+	fprintf(stdout, " -n num       Start 'num' conversations per second.");
+	fprintf(stdout, " -p num       Run 'num' conversations in parallel.");
 	fprintf(stdout, " -S file      read secret from file, not command line.");
 	fprintf(stdout, " -q	       Do not print anything out.");
 	fprintf(stdout, " -s	       Print out summary information of auth results.");
@@ -98,6 +154,27 @@ int rad_virtual_server(REQUEST UNUSED *request)
   abort();
 }
 
+int rad_virtual_server_authenticate(REQUEST UNUSED *request)
+{
+  /*We're not the server so we cannot do this*/
+  abort();
+}
+
+/*
+ *	threads.c calls this, and we don't load any modules.
+ */
+void modules_thread_detach(void)
+{
+}
+
+/*
+ *	exec.c calls this.  We're not running modules, so just wait.
+ */
+int module_yield(UNUSED REQUEST *request, int fd, struct timeval const *wait)
+{
+	return thread_pool_wait_fd(fd, wait);
+}
+
 static uint16_t getport(char const *name)
 {
 	struct	servent		*svp;
@@ -110,6 +187,114 @@ static uint16_t getport(char const *name)
 	return ntohs(svp->s_port);
 }
 
+static uint64_t eap_now(void)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+
+	return ((uint64_t) now.tv_sec * USEC) + now.tv_usec;
+}
+
+/*
+ *	Map a time in usec to its histogram bucket.
+ */
+static int eap_hist_index(uint64_t usec)
+{
+	int msb;
+
+	if (usec < EAP_HIST_SUB) return usec;
+
+	if (usec >= (1U << EAP_HIST_MAX_BITS)) return EAP_HIST_BUCKETS - 1;
+
+	for (msb = EAP_HIST_SUB_BITS; (usec >> (msb + 1)) != 0; msb++) {
+		/* nothing */
+	}
+
+	return ((msb - EAP_HIST_SUB_BITS + 1) * EAP_HIST_SUB) +
+		(usec >> (msb - EAP_HIST_SUB_BITS)) - EAP_HIST_SUB;
+}
+
+/*
+ *	The largest time counted by a histogram bucket.
+ */
+static uint64_t eap_hist_value(int i)
+{
+	int group = i / EAP_HIST_SUB;
+	uint64_t sub = i % EAP_HIST_SUB;
+
+	if (group == 0) return sub;
+
+	return ((EAP_HIST_SUB + sub + 1) << (group - 1)) - 1;
+}
+
+static void eap_latency_add(eap_latency_t *l, uint64_t usec)
+{
+	if (!l->count || (usec < l->min)) l->min = usec;
+	if (usec > l->max) l->max = usec;
+	l->sum += usec;
+	l->count++;
+	l->hist[eap_hist_index(usec)]++;
+}
+
+static void eap_latency_merge(eap_latency_t *out, eap_latency_t const *in)
+{
+	int i;
+
+	if (!in->count) return;
+
+	if (!out->count || (in->min < out->min)) out->min = in->min;
+	if (in->max > out->max) out->max = in->max;
+	out->sum += in->sum;
+	out->count += in->count;
+	for (i = 0; i < EAP_HIST_BUCKETS; i++) out->hist[i] += in->hist[i];
+}
+
+static uint64_t eap_latency_percentile(eap_latency_t const *l, int permille)
+{
+	int i;
+	uint64_t rank, seen = 0;
+
+	rank = ((l->count * permille) + 999) / 1000;
+	if (!rank) rank = 1;
+
+	for (i = 0; i < EAP_HIST_BUCKETS; i++) {
+		seen += l->hist[i];
+		if (seen >= rank) break;
+	}
+	if (i == EAP_HIST_BUCKETS) i--;
+
+	/*
+	 *	The bucket bound may be larger than any time we saw.
+	 */
+	if (eap_hist_value(i) > l->max) return l->max;
+
+	return eap_hist_value(i);
+}
+
+static void eap_latency_print(char const *name, eap_latency_t const *l)
+{
+	int i;
+	uint64_t seen = 0;
+
+	if (!l->count) return;
+
+	INFO("\t%s latency (usec):", name);
+	INFO("\t\tmin %" PRIu64 ", mean %" PRIu64 ", p50 %" PRIu64 ", p90 %" PRIu64
+	     ", p99 %" PRIu64 ", max %" PRIu64,
+	     l->min, l->sum / l->count,
+	     eap_latency_percentile(l, 500), eap_latency_percentile(l, 900),
+	     eap_latency_percentile(l, 990), l->max);
+
+	for (i = 0; i < EAP_HIST_BUCKETS; i++) {
+		if (!l->hist[i]) continue;
+
+		seen += l->hist[i];
+		INFO("\t\t<= %8" PRIu64 " usec : %10" PRIu64 " %6.2f%%",
+		     eap_hist_value(i), l->hist[i], (100.0 * seen) / l->count);
+	}
+}
+
 #define R_RECV (0)
 #define R_SENT (1)
 static void debug_packet(RADIUS_PACKET *packet, int direction)
@@ -162,13 +347,19 @@ static void debug_packet(RADIUS_PACKET *packet, int direction)
 }
 
 
-static int send_packet(RADIUS_PACKET *req, RADIUS_PACKET **rep)
+/*
+ *	Errors on the wire stop a single conversation, but a load
+ *	test counts them and carries on.
+ */
+static int send_packet(RADIUS_PACKET *req, RADIUS_PACKET **rep, eap_stats_t *stats)
 {
 	int i;
 	struct timeval	tv;
+	uint64_t start;
 
 	if (!req || !rep) return -1;
 
+	start = eap_now();
 	for (i = 0; i < retries; i++) {
 		fd_set		rdfdesc;
 
@@ -212,19 +403,19 @@ static int send_packet(RADIUS_PACKET *req, RADIUS_PACKET **rep)
 				ERROR("ERROR: Sent request to host %s port %d, got response from host %s port %d!",
 					dst, req->dst_port,
 					src, (*rep)->src_port);
-				exit(1);
+				goto error;
 			}
 			break;
 		} else {	/* NULL: couldn't receive the packet */
 			ERROR("%s", fr_strerror());
-			exit(1);
+			goto error;
 		}
 	}
 
 	/* No response or no data read (?) */
 	if (i == retries) {
 		ERROR("rad_client: no response from server");
-		exit(1);
+		goto error;
 	}
 
 	/*
@@ -235,25 +426,33 @@ static int send_packet(RADIUS_PACKET *req, RADIUS_PACKET **rep)
 	 */
 	if (rad_verify(*rep, req, secret) != 0) {
 		ERROR("rad_verify: %s", fr_strerror());
-		exit(1);
+		goto error;
 	}
 
 	if (rad_decode(*rep, req, secret) != 0) {
 		ERROR("rad_decode: %s", fr_strerror());
-		exit(1);
+		goto error;
 	}
 
+	eap_latency_add(&stats->round, eap_now() - start);
+
 	/* libradius debug already prints out the value pairs for us */
 	if (!fr_debug_flag && do_output) {
 		debug_packet(*rep, R_RECV);
 	}
 	if((*rep)->code == PW_CODE_ACCESS_ACCEPT) {
-		totalapp++;
+		__atomic_fetch_add(&totalapp, 1, __ATOMIC_RELAXED);
 	} else if ((*rep)->code == PW_CODE_ACCESS_REJECT) {
-		totaldeny++;
+		__atomic_fetch_add(&totaldeny, 1, __ATOMIC_RELAXED);
 	}
 
 	return 0;
+
+error:
+	if (!load_mode) exit(1);
+
+	if (*rep) rad_free(rep);
+	return -1;
 }
 
 static void cleanresp(RADIUS_PACKET *resp)
@@ -822,7 +1021,7 @@ static int respond_eap_md5(RADIUS_PACKET *req,
 
 
 
-static int sendrecv_eap(RADIUS_PACKET *rep)
+static int sendrecv_eap(RADIUS_PACKET *rep, eap_stats_t *stats)
 {
 	RADIUS_PACKET *req = NULL;
 	VALUE_PAIR *vp, *vpnext;
@@ -940,7 +1139,7 @@ static int sendrecv_eap(RADIUS_PACKET *rep)
 	} /* there WAS a password */
 
 	/* send the response, wait for the next request */
-	send_packet(rep, &req);
+	send_packet(rep, &req, stats);
 	if (!req) {
 		ERROR("Failed getting response (EAP-Request from server)");
 		return -1;
@@ -962,21 +1161,131 @@ static int sendrecv_eap(RADIUS_PACKET *rep)
 		case PW_EAP_TYPE_BASE + PW_EAP_MD5:
 			if (respond_eap_md5(req, rep) && tried_eap_md5 < 3) {
 				tried_eap_md5++;
+				rad_free(&req);
 				goto again;
 			}
 			break;
 
 		case PW_EAP_TYPE_BASE + PW_EAP_SIM:
 			if (respond_eap_sim(req, rep)) {
+				rad_free(&req);
 				goto again;
 			}
 			break;
 		}
 	}
 
+	rad_free(&req);
+
 	return 1;
 }
 
+/*
+ *	Run conversations until every entry has been done 'count'
+ *	times.  Each thread has one conversation in flight, and with
+ *	'-n' they share a schedule, so that conversations start at
+ *	the requested rate no matter how many threads there are.
+ */
+static void *eap_thread(void *arg)
+{
+	eap_thread_t *t = arg;
+	uint64_t k, due, now, start;
+
+	while ((k = __atomic_fetch_add(&next_entry, 1, __ATOMIC_RELAXED)) < (num_entries * count)) {
+		if (rate) {
+			due = run_start + ((k * USEC) / rate);
+			now = eap_now();
+			if (due > now) usleep(due - now);
+		}
+
+		pairfree(&t->packet->vps);
+		t->packet->vps = paircopy(t->packet, entries[k % num_entries]);
+
+		start = eap_now();
+		if (sendrecv_eap(t->packet, &t->stats) < 0) {
+			t->stats.failed++;
+			continue;
+		}
+		eap_latency_add(&t->stats.auth, eap_now() - start);
+	}
+
+	return NULL;
+}
+
+static int eap_run(TALLOC_CTX *ctx, RADIUS_PACKET *tmpl, FILE *fp, eap_stats_t *total)
+{
+	int i;
+	eap_thread_t *threads;
+
+	while (!filedone) {
+		VALUE_PAIR *vps = NULL;
+
+		if (readvp2(ctx, &vps, fp, &filedone) < 0) {
+			ERROR("%s", fr_strerror());
+			return -1;
+		}
+		if (!vps) continue;
+
+		entries = talloc_realloc(ctx, entries, VALUE_PAIR *, num_entries + 1);
+		entries[num_entries++] = vps;
+	}
+
+	if (!num_entries) {
+		ERROR("No conversations to run");
+		return -1;
+	}
+
+	threads = talloc_zero_array(ctx, eap_thread_t, parallel);
+	for (i = 0; i < parallel; i++) {
+		RADIUS_PACKET *packet;
+
+		packet = rad_alloc(threads, true);
+		if (!packet) {
+			ERROR("%s", fr_strerror());
+			return -1;
+		}
+		packet->code = tmpl->code;
+		packet->id = fr_rand() & 0xff;
+		packet->dst_ipaddr = tmpl->dst_ipaddr;
+		packet->dst_port = tmpl->dst_port;
+
+		packet->sockfd = socket(tmpl->dst_ipaddr.af, SOCK_DGRAM, 0);
+		if (packet->sockfd < 0) {
+			ERROR("socket: %s", fr_syserror(errno));
+			return -1;
+		}
+		threads[i].packet = packet;
+	}
+
+	run_start = eap_now();
+
+#ifdef EAPCLIENT_THREADS
+	for (i = 0; i < parallel; i++) {
+		int rcode;
+
+		rcode = pthread_create(&threads[i].pthread_id, NULL, eap_thread, &threads[i]);
+		if (rcode != 0) {
+			ERROR("Failed creating thread: %s", fr_syserror(rcode));
+			exit(1);
+		}
+	}
+
+	for (i = 0; i < parallel; i++) pthread_join(threads[i].pthread_id, NULL);
+#else
+	eap_thread(&threads[0]);
+#endif
+
+	for (i = 0; i < parallel; i++) {
+		eap_latency_merge(&total->round, &threads[i].stats.round);
+		eap_latency_merge(&total->auth, &threads[i].stats.auth);
+		total->failed += threads[i].stats.failed;
+
+		close(threads[i].packet->sockfd);
+	}
+	talloc_free(threads);
+
+	return 0;
+}
 
 void set_radius_dir(TALLOC_CTX *ctx, char const *path)
 {
@@ -1001,6 +1310,8 @@ int main(int argc, char **argv)
 	FILE *fp;
 	int id;
 	int force_af = AF_UNSPEC;
+	int rcode;
+	eap_stats_t stats;
 
 	static fr_log_t radclient_log = {
 		.colourise = true,
@@ -1024,12 +1335,38 @@ int main(int argc, char **argv)
 
 	set_radius_dir(autofree, RADIUS_DIR);
 
-	while ((c = getopt(argc, argv, "46c:d:D:f:hi:qst:r:S:xXv")) != EOF)
+	while ((c = getopt(argc, argv, "46c:d:D:f:hi:n:p:qst:r:S:xXv")) != EOF)
 	{
 		switch(c) {
 		case '4':
 			force_af = AF_INET;
 			break;
+		case 'c':
+			if (!isdigit((int) *optarg))
+				usage();
+			count = atoi(optarg);
+			if (count <= 0) usage();
+			load_mode = true;
+			break;
+		case 'n':
+			if (!isdigit((int) *optarg))
+				usage();
+			rate = atoi(optarg);
+			load_mode = true;
+			break;
+		case 'p':
+			if (!isdigit((int) *optarg))
+				usage();
+			parallel = atoi(optarg);
+			if (parallel <= 0) usage();
+#ifndef EAPCLIENT_THREADS
+			if (parallel > 1) {
+				ERROR("Parallel conversations need thread support");
+				exit(1);
+			}
+#endif
+			load_mode = true;
+			break;
 		case '6':
 			force_af = AF_INET6;
 			break;
@@ -1143,7 +1480,7 @@ int main(int argc, char **argv)
 	/*
 	 *	It's OK if this one doesn't exist.
 	 */
-	int rcode = dict_read(radius_dir, RADIUS_DICTIONARY);
+	rcode = dict_read(radius_dir, RADIUS_DICTIONARY);
 	if (rcode == -1) {
 		ERROR("Errors reading %s/%s: %s", radius_dir, RADIUS_DICTIONARY, fr_strerror());
 		exit(1);
@@ -1267,19 +1604,41 @@ int main(int argc, char **argv)
 		exit(1);
 	}
 
-	while (!filedone) {
+	memset(&stats, 0, sizeof(stats));
+	if (load_mode) {
+		if (eap_run(autofree, req, fp, &stats) < 0) exit(1);
+
+	} else while (!filedone) {
+		uint64_t start;
+
 		if (req->vps) pairfree(&req->vps);
 		if (readvp2(NULL, &req->vps, fp, &filedone) < 0) {
 			ERROR("%s", fr_strerror());
 			break;
 		}
 
-		sendrecv_eap(req);
+		start = eap_now();
+		if (sendrecv_eap(req, &stats) < 0) {
+			stats.failed++;
+			continue;
+		}
+		eap_latency_add(&stats.auth, eap_now() - start);
 	}
 
-	if (do_summary) {
+	if (do_summary || load_mode) {
 		INFO("\n\t   Total approved auths:  %d", totalapp);
 		INFO("\t     Total denied auths:  %d", totaldeny);
+		INFO("\t     Total failed auths:  %" PRIu64, stats.failed);
+
+		if (load_mode) {
+			double secs = (double) (eap_now() - run_start) / USEC;
+
+			INFO("\t       Elapsed seconds:  %.3f", secs);
+			if (secs > 0) INFO("\t         Auths / second:  %.1f", stats.auth.count / secs);
+		}
+
+		eap_latency_print("EAP round", &stats.round);
+		eap_latency_print("Authentication", &stats.auth);
 	}
 
 	talloc_free(autofree);
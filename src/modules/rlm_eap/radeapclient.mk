@@ -15,7 +15,8 @@ ifneq "$(filter libfreeradius-eap%,${ALL_TGTS})" ""
 TGT_PREREQS += libfreeradius-eap.a
 
 ifneq ($(OPENSSL_LIBS),)
-SOURCES += ${top_srcdir}/src/main/cb.c ${top_srcdir}/src/main/tls.c
+SOURCES += ${top_srcdir}/src/main/cb.c ${top_srcdir}/src/main/tls.c ${top_srcdir}/src/main/tls_cache.c \
+	   ${top_srcdir}/src/main/tls_crl.c ${top_srcdir}/src/main/tls_ocsp.c
 TGT_LDLIBS  += $(OPENSSL_LIBS)
 endif
 
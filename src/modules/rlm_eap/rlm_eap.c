@@ -35,6 +35,7 @@ static const CONF_PARSER module_config[] = {
 	{ "ignore_unknown_eap_types", FR_CONF_OFFSET(PW_TYPE_BOOLEAN, rlm_eap_t, ignore_unknown_types), "no" },
 	{ "mod_accounting_username_bug", FR_CONF_OFFSET(PW_TYPE_BOOLEAN, rlm_eap_t, mod_accounting_username_bug), "no" },
 	{ "max_sessions", FR_CONF_OFFSET(PW_TYPE_INTEGER, rlm_eap_t, max_sessions), "2048" },
+	{ "redis_module_instance", FR_CONF_OFFSET(PW_TYPE_STRING, rlm_eap_t, redis_instance_name), NULL },
 
 	{ NULL, -1, 0, NULL, NULL }	   /* end the list */
 };
@@ -49,11 +50,9 @@ static int mod_detach(void *instance)
 	inst = (rlm_eap_t *)instance;
 
 #ifdef HAVE_PTHREAD_H
-	pthread_mutex_destroy(&(inst->session_mutex));
 	if (inst->handler_tree) pthread_mutex_destroy(&(inst->handler_mutex));
 #endif
 
-	rbtree_free(inst->session_tree);
 	if (inst->handler_tree) {
 		rbtree_free(inst->handler_tree);
 		/*
@@ -62,43 +61,12 @@ static int mod_detach(void *instance)
 		 */
 		inst->handler_tree = NULL;
 	}
-	inst->session_tree = NULL;
 	eaplist_free(inst);
 
 	return 0;
 }
 
 
-/*
- *	Compare two handlers.
- */
-static int eap_handler_cmp(void const *a, void const *b)
-{
-	int rcode;
-	eap_handler_t const *one = a;
-	eap_handler_t const *two = b;
-
-	if (one->eap_id < two->eap_id) return -1;
-	if (one->eap_id > two->eap_id) return +1;
-
-	rcode = memcmp(one->state, two->state, sizeof(one->state));
-	if (rcode != 0) return rcode;
-
-	/*
-	 *	As of 2.1.8, we don't key off of source IP.  This
-	 *	a NAS to send packets load-balanced (or fail-over)
-	 *	across multiple intermediate proxies, and still have
-	 *	EAP work.
-	 */
-	if (fr_ipaddr_cmp(&one->src_ipaddr, &two->src_ipaddr) != 0) {
-		WARN("EAP packets are arriving from two different upstream "
-		       "servers.  Has there been a proxy fail-over?");
-	}
-
-	return 0;
-}
-
-
 /*
  *	Compare two handler pointers
  */
@@ -115,21 +83,12 @@ static int eap_handler_ptr_cmp(void const *a, void const *b)
  */
 static int mod_instantiate(CONF_SECTION *cs, void *instance)
 {
-	int		i, ret;
+	int		ret;
 	eap_type_t	method;
 	int		num_methods;
 	CONF_SECTION 	*scs;
 	rlm_eap_t	*inst = instance;
 
-	/*
-	 *	Create our own random pool.
-	 */
-	for (i = 0; i < 256; i++) {
-		inst->rand_pool.randrsl[i] = fr_rand();
-	}
-	fr_randinit(&inst->rand_pool, 1);
-	inst->rand_pool.randcnt = 0;
-
 	inst->xlat_name = cf_section_name2(cs);
 	if (!inst->xlat_name) inst->xlat_name = "EAP";
 
@@ -222,16 +181,7 @@ static int mod_instantiate(CONF_SECTION *cs, void *instance)
 	 *	of 'inst', above.
 	 */
 
-	/*
-	 *	Lookup sessions in the tree.  We don't free them in
-	 *	the tree, as that's taken care of elsewhere...
-	 */
-	inst->session_tree = rbtree_create(NULL, eap_handler_cmp, NULL, 0);
-	if (!inst->session_tree) {
-		ERROR("rlm_eap (%s): Cannot initialize tree", inst->xlat_name);
-		return -1;
-	}
-	fr_link_talloc_ctx_free(inst, inst->session_tree);
+	if (eaplist_init(inst) < 0) return -1;
 
 	if (fr_debug_flag) {
 		inst->handler_tree = rbtree_create(NULL, eap_handler_ptr_cmp, NULL, 0);
@@ -249,13 +199,6 @@ static int mod_instantiate(CONF_SECTION *cs, void *instance)
 #endif
 	}
 
-#ifdef HAVE_PTHREAD_H
-	if (pthread_mutex_init(&(inst->session_mutex), NULL) < 0) {
-		ERROR("rlm_eap (%s): Failed initializing mutex: %s", inst->xlat_name, fr_syserror(errno));
-		return -1;
-	}
-#endif
-
 	return 0;
 }
 
@@ -454,14 +397,16 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(void *instance, REQUEST *re
 		 *	terminated string in Access-Accept.
 		 */
 		if (inst->mod_accounting_username_bug) {
-			char const *old = vp->vp_strvalue;
-			char *new = talloc_zero_array(vp, char, vp->length + 1);
+			size_t len = vp->length;
+			char *new = talloc_zero_array(vp, char, len + 1);
 
-			memcpy(new, old, vp->length);
-			vp->vp_strvalue = new;
-			vp->length++;
-
-			rad_const_free(old);
+			/*
+			 *	The old value may be shared, so let
+			 *	pairstrsteal() release it.
+			 */
+			memcpy(new, vp->vp_strvalue, len);
+			pairstrsteal(vp, new);
+			vp->length = len + 1;
 		}
 	}
 
@@ -768,7 +713,7 @@ static rlm_rcode_t CC_HINT(nonnull) mod_post_auth(void *instance, REQUEST *reque
 module_t rlm_eap = {
 	RLM_MODULE_INIT,
 	"eap",
-	0,   	/* type */
+	RLM_TYPE_YIELD_SAFE,	/* type, methods are checked in eap_module_call() */
 	sizeof(rlm_eap_t),
 	module_config,
 	mod_instantiate,		/* instantiation */
@@ -787,4 +732,8 @@ module_t rlm_eap = {
 #endif
 		mod_post_auth		/* post-auth */
 	},
+	0,				/* thread_inst_size */
+	NULL,				/* thread_instantiate */
+	NULL,				/* thread_detach */
+	NULL				/* cache_flush */
 };
@@ -41,15 +41,43 @@ typedef struct eap_module {
 	void			*instance;
 } eap_module_t;
 
+/*
+ *	Sessions are spread over the shards by the hash of their
+ *	State, so requests in different sessions rarely wait for
+ *	each other.
+ */
+#define EAP_SESSION_SHARDS	16
+
+/*
+ *	Each shard expires its sessions with a timer wheel.  The
+ *	slots are wide enough that the wheel covers timer_expire.
+ */
+#define EAP_WHEEL_SLOTS		64
+
+/*
+ *	Largest session we'll write to the session store, before
+ *	it's hex encoded.
+ */
+#define EAP_STORE_MAX_SESSION	1024
+
+typedef struct eap_session_shard_t {
+	fr_hash_table_t	*sessions;
+	eap_handler_t	*wheel[EAP_WHEEL_SLOTS];	//!< Sessions, by the slot they expire in.
+	time_t		wheel_next;			//!< Next slot to expire, in ticks.
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t	mutex;
+#endif
+} eap_session_shard_t;
+
 /*
  * This structure contains eap's persistent data.
- * sessions = remembered sessions, in a tree for speed.
+ * shards = remembered sessions, in hash tables for speed.
  * types = All supported EAP-Types
- * mutex = ensure only one thread is updating the sessions[] struct
  */
 typedef struct rlm_eap {
-	rbtree_t	*session_tree;
-	eap_handler_t	*session_head, *session_tail;
+	eap_session_shard_t shards[EAP_SESSION_SHARDS];
+	uint32_t	shard_max_sessions;
+	uint32_t	wheel_tick;	//!< Seconds covered by each slot of the timer wheels.
 	rbtree_t	*handler_tree; /* for debugging only */
 	eap_module_t 	*methods[PW_EAP_MAX_TYPES];
 
@@ -66,13 +94,13 @@ typedef struct rlm_eap {
 
 	uint32_t	max_sessions;
 
+	char const	*redis_instance_name;	//!< Share sessions through this redis module.
+
 #ifdef HAVE_PTHREAD_H
-	pthread_mutex_t	session_mutex;
 	pthread_mutex_t	handler_mutex;
 #endif
 
 	char const	*xlat_name; /* no xlat's yet */
-	fr_randctx	rand_pool;
 } rlm_eap_t;
 
 /*
@@ -104,10 +132,17 @@ eap_handler_t 	*eap_handler(rlm_eap_t *inst, eap_packet_raw_t **eap_msg, REQUEST
 EAP_DS      	*eap_ds_alloc(eap_handler_t *handler);
 eap_handler_t 	*eap_handler_alloc(rlm_eap_t *inst);
 void	    	eap_ds_free(EAP_DS **eap_ds);
+int		eaplist_init(rlm_eap_t *inst);
 int 	    	eaplist_add(rlm_eap_t *inst, eap_handler_t *handler) CC_HINT(nonnull);
 eap_handler_t 	*eaplist_find(rlm_eap_t *inst, REQUEST *request, eap_packet_raw_t *eap_packet);
 void		eaplist_free(rlm_eap_t *inst);
 
+/* Session store */
+ssize_t		eap_store_encode(rlm_eap_t *inst, eap_handler_t *handler, char *out, size_t outlen);
+void		eap_store_save(rlm_eap_t *inst, REQUEST *request, uint8_t const *state, char const *session);
+void		eap_store_forget(rlm_eap_t *inst, REQUEST *request, uint8_t const *state);
+eap_handler_t	*eap_store_load(rlm_eap_t *inst, REQUEST *request, uint8_t const *state);
+
 /* State */
 void	    	generate_key(void);
 VALUE_PAIR  	*generate_state(time_t timestamp);
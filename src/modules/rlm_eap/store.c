@@ -0,0 +1,270 @@
+/*
+ * store.c  Share EAP sessions with other servers, through Redis.
+ *
+ * Version:     $Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2014  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <stdio.h>
+#include "rlm_eap.h"
+
+/*
+ *	Sessions are kept in the local session list as usual, and a
+ *	copy is written to Redis, through the xlat of a "redis" module
+ *	instance:
+ *
+ *		%{redis:SET eap:<state> <session> EX <timer_expire>}
+ *
+ *	The key and the session are both hex, so they never need
+ *	escaping.  Whichever server gets the next packet of the
+ *	conversation fetches and deletes the copy with GETDEL, so
+ *	each round can only be continued once.
+ *
+ *	The session is encoded as:
+ *
+ *	  version (1), type (1), eap_id (1), stage (4), trips (4),
+ *	  timestamp (4), identity length (2), identity,
+ *	  opaque length (2), opaque (see rlm_eap_module_t.opaque_save)
+ */
+#define EAP_STORE_VERSION	1
+#define EAP_STORE_HEADER_LEN	15
+
+static void eap_store_put16(uint8_t *p, uint32_t value)
+{
+	p[0] = (value >> 8) & 0xff;
+	p[1] = value & 0xff;
+}
+
+static void eap_store_put32(uint8_t *p, uint32_t value)
+{
+	p[0] = (value >> 24) & 0xff;
+	p[1] = (value >> 16) & 0xff;
+	p[2] = (value >> 8) & 0xff;
+	p[3] = value & 0xff;
+}
+
+static uint32_t eap_store_get16(uint8_t const *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+static uint32_t eap_store_get32(uint8_t const *p)
+{
+	return ((uint32_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/*
+ *	Run one command against the store.  The output is the reply,
+ *	or an empty string if there was no reply.
+ */
+static ssize_t CC_HINT(format (printf, 5, 6)) eap_store_command(rlm_eap_t *inst, REQUEST *request,
+								  char *out, size_t outlen, char const *fmt, ...)
+{
+	va_list	ap;
+	char	query[EAP_STORE_MAX_SESSION * 2 + 128];
+	ssize_t	slen;
+
+	va_start(ap, fmt);
+	slen = vsnprintf(query, sizeof(query), fmt, ap);
+	va_end(ap);
+	if ((slen < 0) || ((size_t) slen >= sizeof(query))) return -1;
+
+	slen = radius_xlat(out, outlen, request, query, NULL, NULL);
+	if (slen < 0) {
+		RERROR("Failed running EAP session store command via %s", inst->redis_instance_name);
+		return -1;
+	}
+
+	return slen;
+}
+
+/** Encode an EAP session so that it can be saved to the store
+ *
+ * TLS based methods can't be shared, as OpenSSL can't export a handshake
+ * which is still in progress.  Other methods can be shared if they have
+ * no opaque data, or provide an opaque_save() callback.
+ *
+ * @param[in] inst rlm_eap configuration.
+ * @param[in] handler to encode.
+ * @param[out] out Where to write the hex encoded session.
+ * @param[in] outlen Length of out.
+ * @return the length of the encoded session, 0 if the session can't be
+ *	shared, or -1 on error.
+ */
+ssize_t eap_store_encode(rlm_eap_t *inst, eap_handler_t *handler, char *out, size_t outlen)
+{
+	uint8_t		buff[EAP_STORE_MAX_SESSION];
+	uint8_t		*p = buff;
+	size_t		len;
+	ssize_t		slen = 0;
+	eap_module_t	*method;
+
+	if (handler->tls) return 0;
+
+	method = inst->methods[handler->type];
+	if (!method) return 0;
+	if (handler->opaque && !method->type->opaque_save) return 0;
+
+	len = handler->identity ? strlen(handler->identity) : 0;
+	if ((EAP_STORE_HEADER_LEN + 2 + len + 2) > sizeof(buff)) return 0;
+
+	p[0] = EAP_STORE_VERSION;
+	p[1] = handler->type;
+	p[2] = handler->eap_id;
+	eap_store_put32(p + 3, handler->stage);
+	eap_store_put32(p + 7, handler->trips);
+	eap_store_put32(p + 11, handler->timestamp);
+	p += EAP_STORE_HEADER_LEN;
+
+	eap_store_put16(p, len);
+	memcpy(p + 2, handler->identity, len);
+	p += 2 + len;
+
+	if (handler->opaque) {
+		slen = method->type->opaque_save(method->instance, handler, p + 2, (buff + sizeof(buff)) - (p + 2));
+		if (slen <= 0) return slen;
+	}
+	eap_store_put16(p, slen);
+	p += 2 + slen;
+
+	len = p - buff;
+	if (((len * 2) + 1) > outlen) return 0;
+
+	return fr_bin2hex(out, buff, len);
+}
+
+/** Save an encoded session to the store
+ *
+ * @param[in] inst rlm_eap configuration.
+ * @param[in] request the session was last used for.
+ * @param[in] state of the session.
+ * @param[in] session as returned by eap_store_encode().
+ */
+void eap_store_save(rlm_eap_t *inst, REQUEST *request, uint8_t const *state, char const *session)
+{
+	char key[(EAP_STATE_LEN * 2) + 1];
+	char out[32];
+
+	fr_bin2hex(key, state, EAP_STATE_LEN);
+
+	if (eap_store_command(inst, request, out, sizeof(out), "%%{%s:SET eap:%s %s EX %u}",
+			      inst->redis_instance_name, key, session, inst->timer_limit) < 0) return;
+
+	RDEBUG2("Saved EAP session to the session store");
+}
+
+/** Remove a session from the store, so that it can't be continued elsewhere
+ *
+ * @param[in] inst rlm_eap configuration.
+ * @param[in] request continuing the session.
+ * @param[in] state of the session.
+ */
+void eap_store_forget(rlm_eap_t *inst, REQUEST *request, uint8_t const *state)
+{
+	char key[(EAP_STATE_LEN * 2) + 1];
+	char out[32];
+
+	fr_bin2hex(key, state, EAP_STATE_LEN);
+
+	(void) eap_store_command(inst, request, out, sizeof(out), "%%{%s:DEL eap:%s}",
+				 inst->redis_instance_name, key);
+}
+
+/** Load a session which was started by another server
+ *
+ * The session is removed from the store, whether or not it can be used.
+ *
+ * @param[in] inst rlm_eap configuration.
+ * @param[in] request continuing the session.
+ * @param[in] state of the session.
+ * @return the session, or NULL if it isn't in the store.
+ */
+eap_handler_t *eap_store_load(rlm_eap_t *inst, REQUEST *request, uint8_t const *state)
+{
+	char		key[(EAP_STATE_LEN * 2) + 1];
+	char		session[(EAP_STORE_MAX_SESSION * 2) + 1];
+	uint8_t		buff[EAP_STORE_MAX_SESSION];
+	uint8_t const	*p, *end;
+	ssize_t		slen;
+	size_t		len;
+	eap_handler_t	*handler;
+	eap_module_t	*method;
+
+	fr_bin2hex(key, state, EAP_STATE_LEN);
+
+	/*
+	 *	The session is fetched and removed in one command, so
+	 *	two servers can't both continue it.
+	 */
+	slen = eap_store_command(inst, request, session, sizeof(session), "%%{%s:GETDEL eap:%s}",
+				 inst->redis_instance_name, key);
+	if (slen <= 0) return NULL;
+
+	len = fr_hex2bin(buff, sizeof(buff), session, slen);
+	if ((len != ((size_t) slen / 2)) || (len < (EAP_STORE_HEADER_LEN + 4)) || (buff[0] != EAP_STORE_VERSION)) {
+	invalid:
+		RERROR("Invalid EAP session in the session store");
+		return NULL;
+	}
+	end = buff + len;
+
+	method = (buff[1] < PW_EAP_MAX_TYPES) ? inst->methods[buff[1]] : NULL;
+	if (!method) {
+		RERROR("EAP session in the session store uses method %s, which isn't enabled here",
+		       eap_type2name(buff[1]));
+		return NULL;
+	}
+
+	handler = eap_handler_alloc(inst);
+	if (!handler) return NULL;
+
+	handler->type = buff[1];
+	handler->eap_id = buff[2];
+	handler->stage = eap_store_get32(buff + 3);
+	handler->trips = eap_store_get32(buff + 7);
+	handler->timestamp = eap_store_get32(buff + 11);
+	handler->status = 1;
+	handler->src_ipaddr = request->packet->src_ipaddr;
+	memcpy(handler->state, state, sizeof(handler->state));
+	p = buff + EAP_STORE_HEADER_LEN;
+
+	len = eap_store_get16(p);
+	p += 2;
+	if ((p + len + 2) > end) {
+	error:
+		talloc_free(handler);
+		goto invalid;
+	}
+	handler->identity = talloc_strndup(handler, (char const *) p, len);
+	p += len;
+
+	len = eap_store_get16(p);
+	p += 2;
+	if ((p + len) != end) goto error;
+
+	if (len) {
+		if (!method->type->opaque_load ||
+		    (method->type->opaque_load(method->instance, handler, p, len) < 0)) goto error;
+	}
+
+	RDEBUG("Loaded EAP session with state 0x%s from the session store", key);
+
+	return handler;
+}
@@ -253,5 +253,8 @@ rlm_eap_module_t rlm_eap_gtc = {
 	gtc_initiate,			/* Start the initial request */
 	NULL,				/* authorization */
 	mod_authenticate,		/* authentication */
-	NULL     			/* detach */
+	NULL,				/* detach */
+	NULL,				/* opaque_save */
+	NULL,				/* opaque_load */
+	false				/* yield_safe */
 };
@@ -523,5 +523,8 @@ rlm_eap_module_t rlm_eap_ikev2 = {
 	ikev2_initiate,			/* Start the initial request */
 	NULL,				/* authorization */
 	ikev2_authenticate,		/* authentication */
-	ikev2_detach 			/* detach */
+	ikev2_detach,				/* detach */
+	NULL,					/* opaque_save */
+	NULL,					/* opaque_load */
+	false					/* yield_safe */
 };
@@ -192,6 +192,40 @@ static int CC_HINT(nonnull) mod_authenticate(UNUSED void *instance, eap_handler_
 	return 1;
 }
 
+/*
+ *	Save and load the stage and challenges, so that another
+ *	server can continue the session.
+ */
+static ssize_t leap_opaque_save(UNUSED void *instance, eap_handler_t *handler, uint8_t *out, size_t outlen)
+{
+	leap_session_t *session = talloc_get_type_abort(handler->opaque, leap_session_t);
+
+	if (outlen < (1 + sizeof(session->peer_challenge) + sizeof(session->peer_response))) return -1;
+
+	out[0] = session->stage;
+	memcpy(out + 1, session->peer_challenge, sizeof(session->peer_challenge));
+	memcpy(out + 1 + sizeof(session->peer_challenge), session->peer_response, sizeof(session->peer_response));
+
+	return 1 + sizeof(session->peer_challenge) + sizeof(session->peer_response);
+}
+
+static int leap_opaque_load(UNUSED void *instance, eap_handler_t *handler, uint8_t const *data, size_t len)
+{
+	leap_session_t *session;
+
+	if (len != (1 + sizeof(session->peer_challenge) + sizeof(session->peer_response))) return -1;
+
+	handler->opaque = session = talloc(handler, leap_session_t);
+	if (!session) return -1;
+	handler->free_opaque = NULL;
+
+	session->stage = data[0];
+	memcpy(session->peer_challenge, data + 1, sizeof(session->peer_challenge));
+	memcpy(session->peer_response, data + 1 + sizeof(session->peer_challenge), sizeof(session->peer_response));
+
+	return 0;
+}
+
 /*
  *	The module name should be the only globally exported symbol.
  *	That is, everything else should be 'static'.
@@ -203,4 +237,7 @@ rlm_eap_module_t rlm_eap_leap = {
 	NULL,			/* authorization */
 	mod_authenticate,	/* authentication */
 	NULL,			/* detach */
+	leap_opaque_save,	/* save the session */
+	leap_opaque_load,	/* load the session */
+	false			/* yield_safe */
 };
@@ -156,6 +156,30 @@ static int md5_authenticate(UNUSED void *arg, eap_handler_t *handler)
 	return 1;
 }
 
+/*
+ *	Save and load the challenge, so that another server can
+ *	check the response.
+ */
+static ssize_t md5_opaque_save(UNUSED void *instance, eap_handler_t *handler, uint8_t *out, size_t outlen)
+{
+	size_t len = talloc_array_length((uint8_t *) handler->opaque);
+
+	if (len > outlen) return -1;
+	memcpy(out, handler->opaque, len);
+
+	return len;
+}
+
+static int md5_opaque_load(UNUSED void *instance, eap_handler_t *handler, uint8_t const *data, size_t len)
+{
+	handler->opaque = talloc_memdup(handler, data, len);
+	if (!handler->opaque) return -1;
+	talloc_set_type(handler->opaque, uint8_t);
+	handler->free_opaque = NULL;
+
+	return 0;
+}
+
 /*
  *	The module name should be the only globally exported symbol.
  *	That is, everything else should be 'static'.
@@ -166,5 +190,8 @@ rlm_eap_module_t rlm_eap_md5 = {
 	md5_initiate,			/* Start the initial request */
 	NULL,				/* authorization */
 	md5_authenticate,		/* authentication */
-	NULL				/* detach */
+	NULL,				/* detach */
+	md5_opaque_save,		/* save the challenge */
+	md5_opaque_load,			/* load the challenge */
+	false				/* yield_safe */
 };
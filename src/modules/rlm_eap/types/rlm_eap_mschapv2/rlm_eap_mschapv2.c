@@ -734,5 +734,8 @@ rlm_eap_module_t rlm_eap_mschapv2 = {
 	mschapv2_initiate,		/* Start the initial request */
 	NULL,				/* authorization */
 	mschapv2_authenticate,		/* authentication */
-	NULL				/* detach */
+	NULL,					/* detach */
+	NULL,					/* opaque_save */
+	NULL,					/* opaque_load */
+	false					/* yield_safe */
 };
@@ -56,6 +56,7 @@ typedef struct peap_tunnel_t {
 	bool		use_tunneled_reply;
 	bool		proxy_tunneled_request_as_eap;
 	char const	*virtual_server;
+	bool		authorize_once;
 	bool		soh;
 	char const	*soh_virtual_server;
 	VALUE_PAIR	*soh_reply_vps;
@@ -1008,9 +1008,10 @@ rlm_rcode_t eappeap_process(eap_handler_t *handler, tls_session_t *tls_session)
 
 	/*
 	 *	Call authentication recursively, which will
-	 *	do PAP, CHAP, MS-CHAP, etc.
+	 *	do PAP, CHAP, MS-CHAP, etc.  Credentials found
+	 *	by earlier rounds of this session are re-used.
 	 */
-	rad_virtual_server(fake);
+	eaptls_virtual_server(handler, fake, t->authorize_once);
 
 	/*
 	 *	Note that we don't do *anything* with the reply
@@ -40,6 +40,8 @@ typedef struct rlm_eap_peap_t {
 						//!< protocol.
 #endif
 	char const *virtual_server;		//!< Virtual server for inner tunnel session.
+	bool authorize_once;			//!< Run the inner authorize section only once per
+						//!< tunneled EAP conversation.
 
 	bool soh;				//!< Do we do SoH request?
 	char const *soh_virtual_server;
@@ -62,6 +64,8 @@ static CONF_PARSER module_config[] = {
 
 	{ "virtual_server", FR_CONF_OFFSET(PW_TYPE_STRING, rlm_eap_peap_t, virtual_server), NULL },
 
+	{ "authorize_once", FR_CONF_OFFSET(PW_TYPE_BOOLEAN, rlm_eap_peap_t, authorize_once), "no" },
+
 	{ "soh", FR_CONF_OFFSET(PW_TYPE_BOOLEAN, rlm_eap_peap_t, soh), "no" },
 
 	{ "require_client_cert", FR_CONF_OFFSET(PW_TYPE_BOOLEAN, rlm_eap_peap_t, req_client_cert), "no" },
@@ -130,6 +134,7 @@ static peap_tunnel_t *peap_alloc(TALLOC_CTX *ctx, rlm_eap_peap_t *inst)
 	t->proxy_tunneled_request_as_eap = inst->proxy_tunneled_request_as_eap;
 #endif
 	t->virtual_server = inst->virtual_server;
+	t->authorize_once = inst->authorize_once;
 	t->soh = inst->soh;
 	t->soh_virtual_server = inst->soh_virtual_server;
 	t->session_resumption_state = PEAP_RESUMPTION_MAYBE;
@@ -369,5 +374,8 @@ rlm_eap_module_t rlm_eap_peap = {
 	eappeap_initiate,		/* Start the initial request */
 	NULL,				/* authorization */
 	mod_authenticate,		/* authentication */
-	NULL				/* detach */
+	NULL,					/* detach */
+	NULL,					/* opaque_save */
+	NULL,					/* opaque_load */
+	false					/* yield_safe */
 };
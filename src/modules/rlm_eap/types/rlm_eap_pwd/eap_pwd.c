@@ -100,16 +100,29 @@ static void eap_pwd_kdf(uint8_t *key, int keylen, char const *label, int labelle
 	}
 }
 
-int compute_password_element (pwd_session_t *sess, uint16_t grp_num,
-			      char const *password, int password_len,
-			      char const *id_server, int id_server_len,
-			      char const *id_peer, int id_peer_len,
-			      uint32_t *token)
+static int _pwd_group_free(pwd_group_t *grp)
 {
-	BIGNUM *x_candidate = NULL, *rnd = NULL, *cofactor = NULL;
-	HMAC_CTX ctx;
-	uint8_t pwe_digest[SHA256_DIGEST_LENGTH], *prfbuf = NULL, ctr;
-	int nid, is_odd, primebitlen, primebytelen, ret = 0;
+	EC_GROUP_free(grp->group);
+	BN_free(grp->prime);
+	BN_free(grp->order);
+	BN_free(grp->cofactor);
+	BN_free(grp->a);
+	BN_free(grp->b);
+	BN_free(grp->legendre_exp);
+	if (grp->mont) BN_MONT_CTX_free(grp->mont);
+
+	return 0;
+}
+
+/*
+ * Set up everything about a group which doesn't depend on the
+ * password, so that it's done once, instead of for every session.
+ */
+pwd_group_t *pwd_group_alloc(TALLOC_CTX *ctx, uint16_t grp_num)
+{
+	pwd_group_t *grp;
+	BN_CTX *bnctx = NULL;
+	int nid;
 
 	switch (grp_num) { /* from IANA registry for IKE D-H groups */
 	case 19:
@@ -134,56 +147,115 @@ int compute_password_element (pwd_session_t *sess, uint16_t grp_num,
 
 	default:
 		DEBUG("unknown group %d", grp_num);
-		goto fail;
+		return NULL;
 	}
 
-	sess->pwe = NULL;
-	sess->order = NULL;
-	sess->prime = NULL;
+	if ((grp = talloc_zero(ctx, pwd_group_t)) == NULL) return NULL;
+	talloc_set_destructor(grp, _pwd_group_free);
+	grp->group_num = grp_num;
 
-	if ((sess->group = EC_GROUP_new_by_curve_name(nid)) == NULL) {
+	if ((grp->group = EC_GROUP_new_by_curve_name(nid)) == NULL) {
 		DEBUG("unable to create EC_GROUP");
 		goto fail;
 	}
 
-	if (((rnd = BN_new()) == NULL) ||
-	    ((cofactor = BN_new()) == NULL) ||
-	    ((sess->pwe = EC_POINT_new(sess->group)) == NULL) ||
-	    ((sess->order = BN_new()) == NULL) ||
-	    ((sess->prime = BN_new()) == NULL) ||
-	    ((x_candidate = BN_new()) == NULL)) {
+	if (((bnctx = BN_CTX_new()) == NULL) ||
+	    ((grp->prime = BN_new()) == NULL) ||
+	    ((grp->order = BN_new()) == NULL) ||
+	    ((grp->cofactor = BN_new()) == NULL) ||
+	    ((grp->a = BN_new()) == NULL) ||
+	    ((grp->b = BN_new()) == NULL) ||
+	    ((grp->legendre_exp = BN_new()) == NULL) ||
+	    ((grp->mont = BN_MONT_CTX_new()) == NULL)) {
 		DEBUG("unable to create bignums");
 		goto fail;
 	}
 
-	if (!EC_GROUP_get_curve_GFp(sess->group, sess->prime, NULL, NULL, NULL)) {
+	if (!EC_GROUP_get_curve_GFp(grp->group, grp->prime, grp->a, grp->b, bnctx)) {
 		DEBUG("unable to get prime for GFp curve");
 		goto fail;
 	}
 
-	if (!EC_GROUP_get_order(sess->group, sess->order, NULL)) {
+	if (!EC_GROUP_get_order(grp->group, grp->order, bnctx)) {
 		DEBUG("unable to get order for curve");
 		goto fail;
 	}
 
-	if (!EC_GROUP_get_cofactor(sess->group, cofactor, NULL)) {
+	if (!EC_GROUP_get_cofactor(grp->group, grp->cofactor, bnctx)) {
 		DEBUG("unable to get cofactor for curve");
 		goto fail;
 	}
 
-	primebitlen = BN_num_bits(sess->prime);
-	primebytelen = BN_num_bytes(sess->prime);
-	if ((prfbuf = talloc_zero_array(sess, uint8_t, primebytelen)) == NULL) {
+	/*
+	 * x is a valid x-coordinate if x^3 + ax + b is a quadratic
+	 * residue mod p, i.e. if (x^3 + ax + b)^((p - 1)/2) == 1
+	 */
+	if (!BN_sub(grp->legendre_exp, grp->prime, BN_value_one()) ||
+	    !BN_rshift1(grp->legendre_exp, grp->legendre_exp)) {
+		DEBUG("unable to compute (p - 1)/2");
+		goto fail;
+	}
+
+	if (!BN_MONT_CTX_set(grp->mont, grp->prime, bnctx)) {
+		DEBUG("unable to set up Montgomery context");
+		goto fail;
+	}
+
+	grp->primebitlen = BN_num_bits(grp->prime);
+	grp->primebytelen = BN_num_bytes(grp->prime);
+
+	BN_CTX_free(bnctx);
+
+	return grp;
+
+fail:
+	if (bnctx) BN_CTX_free(bnctx);
+	talloc_free(grp);
+
+	return NULL;
+}
+
+/*
+ * Hunting and pecking, in constant time.  Every candidate is checked
+ * in the same way, and we always check EAP_PWD_HNP_ROUNDS of them,
+ * remembering the first good one with masks rather than branches.
+ * Otherwise the number of rounds (and so the time taken) depends on
+ * the password, and can be used to recover it.
+ *
+ * The result is the same point that the old "stop at the first good
+ * candidate" loop found.
+ */
+#define EAP_PWD_HNP_ROUNDS	40
+
+int compute_password_element (pwd_group_t const *grp, EC_POINT *pwe,
+			      char const *password, int password_len,
+			      char const *id_server, int id_server_len,
+			      char const *id_peer, int id_peer_len,
+			      uint32_t *token, BN_CTX *bnctx)
+{
+	BIGNUM *x_candidate = NULL, *y_sqr = NULL, *exp_result = NULL;
+	HMAC_CTX ctx;
+	uint8_t pwe_digest[SHA256_DIGEST_LENGTH], *prfbuf = NULL, *x_buf = NULL, ctr;
+	uint8_t found = 0, is_odd = 0;
+	int i, ret = -1;
+
+	BN_CTX_start(bnctx);
+	x_candidate = BN_CTX_get(bnctx);
+	y_sqr = BN_CTX_get(bnctx);
+	exp_result = BN_CTX_get(bnctx);
+	if (!exp_result) {
+		DEBUG("unable to create bignums");
+		goto fail;
+	}
+
+	if (((prfbuf = talloc_zero_array(NULL, uint8_t, grp->primebytelen)) == NULL) ||
+	    ((x_buf = talloc_zero_array(NULL, uint8_t, grp->primebytelen)) == NULL)) {
 		DEBUG("unable to alloc space for prf buffer");
 		goto fail;
 	}
-	ctr = 0;
-	while (1) {
-		if (ctr > 10) {
-			DEBUG("unable to find random point on curve for group %d, something's fishy", grp_num);
-			goto fail;
-		}
-		ctr++;
+
+	for (ctr = 1; ctr <= EAP_PWD_HNP_ROUNDS; ctr++) {
+		uint8_t valid, mask;
 
 		/*
 		 * compute counter-mode password value and stretch to prime
@@ -198,11 +270,10 @@ int compute_password_element (pwd_session_t *sess, uint16_t grp_num,
 		H_Update(&ctx, (uint8_t *)&ctr, sizeof(ctr));
 		H_Final(&ctx, pwe_digest);
 
-		BN_bin2bn(pwe_digest, SHA256_DIGEST_LENGTH, rnd);
 		eap_pwd_kdf(pwe_digest, SHA256_DIGEST_LENGTH, "EAP-pwd Hunting And Pecking",
-			    strlen("EAP-pwd Hunting And Pecking"), prfbuf, primebitlen);
+			    strlen("EAP-pwd Hunting And Pecking"), prfbuf, grp->primebitlen);
 
-		BN_bin2bn(prfbuf, primebytelen, x_candidate);
+		BN_bin2bn(prfbuf, grp->primebytelen, x_candidate);
 		/*
 		 * eap_pwd_kdf() returns a string of bits 0..primebitlen but
 		 * BN_bin2bn will treat that string of bits as a big endian
@@ -210,62 +281,90 @@ int compute_password_element (pwd_session_t *sess, uint16_t grp_num,
 		 * then excessive bits-- those _after_ primebitlen-- so now
 		 * we have to shift right the amount we masked off.
 		 */
-		if (primebitlen % 8) BN_rshift(x_candidate, x_candidate, (8 - (primebitlen % 8)));
-		if (BN_ucmp(x_candidate, sess->prime) >= 0) continue;
+		if (grp->primebitlen % 8) BN_rshift(x_candidate, x_candidate, (8 - (grp->primebitlen % 8)));
+		valid = (BN_ucmp(x_candidate, grp->prime) < 0);
 
 		/*
-		 * need to unambiguously identify the solution, if there is
-		 * one...
+		 * y^2 = x^3 + ax + b.  The exponentiation is the expensive
+		 * part, and is done in constant time.
 		 */
-		is_odd = BN_is_odd(rnd) ? 1 : 0;
+		if (!BN_mod_sqr(y_sqr, x_candidate, grp->prime, bnctx) ||
+		    !BN_mod_add(y_sqr, y_sqr, grp->a, grp->prime, bnctx) ||
+		    !BN_mod_mul(y_sqr, y_sqr, x_candidate, grp->prime, bnctx) ||
+		    !BN_mod_add(y_sqr, y_sqr, grp->b, grp->prime, bnctx) ||
+		    !BN_mod_exp_mont_consttime(exp_result, y_sqr, grp->legendre_exp, grp->prime,
+					       bnctx, grp->mont)) {
+			DEBUG("unable to check candidate");
+			goto fail;
+		}
+		valid &= BN_is_one(exp_result);
 
 		/*
-		 * solve the quadratic equation, if it's not solvable then we
-		 * don't have a point
+		 * Keep this candidate if it's good, and we don't already
+		 * have one.  The low bit of the seed unambiguously
+		 * identifies the solution.
 		 */
-		if (!EC_POINT_set_compressed_coordinates_GFp(sess->group, sess->pwe, x_candidate, is_odd, NULL)) {
-			continue;
+		mask = -(uint8_t)(valid & (found ^ 1));
+		for (i = 0; i < grp->primebytelen; i++) {
+			x_buf[i] = (x_buf[i] & ~mask) | (prfbuf[i] & mask);
 		}
+		is_odd = (is_odd & ~mask) | ((pwe_digest[SHA256_DIGEST_LENGTH - 1] & 0x01) & mask);
+		found |= valid;
+	}
 
-		/*
-		 * If there's a solution to the equation then the point must be
-		 * on the curve so why check again explicitly? OpenSSL code
-		 * says this is required by X9.62. We're not X9.62 but it can't
-		 * hurt just to be sure.
-		 */
-		if (!EC_POINT_is_on_curve(sess->group, sess->pwe, NULL)) {
-			DEBUG("EAP-pwd: point is not on curve");
-			continue;
+	if (!found) {
+		DEBUG("unable to find random point on curve for group %d, something's fishy", grp->group_num);
+		goto fail;
+	}
+
+	BN_bin2bn(x_buf, grp->primebytelen, x_candidate);
+	if (grp->primebitlen % 8) BN_rshift(x_candidate, x_candidate, (8 - (grp->primebitlen % 8)));
+
+	/*
+	 * solve the quadratic equation, we already know it's solvable
+	 */
+	if (!EC_POINT_set_compressed_coordinates_GFp(grp->group, pwe, x_candidate, is_odd, bnctx)) {
+		DEBUG("EAP-pwd: unable to set point coordinates");
+		goto fail;
+	}
+
+	/*
+	 * If there's a solution to the equation then the point must be
+	 * on the curve so why check again explicitly? OpenSSL code
+	 * says this is required by X9.62. We're not X9.62 but it can't
+	 * hurt just to be sure.
+	 */
+	if (!EC_POINT_is_on_curve(grp->group, pwe, bnctx)) {
+		DEBUG("EAP-pwd: point is not on curve");
+		goto fail;
+	}
+
+	if (BN_cmp(grp->cofactor, BN_value_one())) {
+		/* make sure the point is not in a small sub-group */
+		if (!EC_POINT_mul(grp->group, pwe, NULL, pwe, grp->cofactor, bnctx)) {
+			DEBUG("EAP-pwd: cannot multiply generator by order");
+			goto fail;
 		}
 
-		if (BN_cmp(cofactor, BN_value_one())) {
-			/* make sure the point is not in a small sub-group */
-			if (!EC_POINT_mul(sess->group, sess->pwe, NULL, sess->pwe,
-				cofactor, NULL)) {
-				DEBUG("EAP-pwd: cannot multiply generator by order");
-				continue;
-			}
-
-			if (EC_POINT_is_at_infinity(sess->group, sess->pwe)) {
-				DEBUG("EAP-pwd: point is at infinity");
-				continue;
-			}
+		if (EC_POINT_is_at_infinity(grp->group, pwe)) {
+			DEBUG("EAP-pwd: point is at infinity");
+			goto fail;
 		}
-		/* if we got here then we have a new generator. */
-		break;
 	}
 
-	sess->group_num = grp_num;
-	if (0) {
-		fail:		/* DON'T free sess, it's in handler->opaque */
-		ret = -1;
-	}
+	ret = 0;
 
+fail:
 	/* cleanliness and order.... */
-	BN_clear_free(cofactor);
-	BN_clear_free(x_candidate);
-	BN_clear_free(rnd);
+	if (x_candidate) BN_clear(x_candidate);
+	if (y_sqr) BN_clear(y_sqr);
+	if (exp_result) BN_clear(exp_result);
+	BN_CTX_end(bnctx);
+	if (prfbuf) memset(prfbuf, 0, grp->primebytelen);
+	if (x_buf) memset(x_buf, 0, grp->primebytelen);
 	talloc_free(prfbuf);
+	talloc_free(x_buf);
+	memset(pwe_digest, 0, sizeof(pwe_digest));
 
 	return ret;
 }
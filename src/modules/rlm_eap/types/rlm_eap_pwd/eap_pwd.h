@@ -73,6 +73,25 @@ typedef struct _pwd_id_packet {
     char identity[0];
 } CC_HINT(packed) pwd_id_packet;
 
+/*
+ * Everything about a group which doesn't depend on the session.
+ * Set up once per module instance, and shared (read only) by all
+ * sessions, in all threads.
+ */
+typedef struct _pwd_group_t {
+    uint16_t group_num;
+    EC_GROUP *group;
+    BIGNUM *prime;
+    BIGNUM *order;
+    BIGNUM *cofactor;
+    BIGNUM *a;			/* curve is y^2 = x^3 + ax + b */
+    BIGNUM *b;
+    BIGNUM *legendre_exp;	/* (p - 1) / 2 */
+    BN_MONT_CTX *mont;		/* for exponentiation mod p */
+    int primebitlen;
+    int primebytelen;
+} pwd_group_t;
+
 typedef struct _pwd_session_t {
     uint16_t state;
 #define PWD_STATE_ID_REQ		1
@@ -90,7 +109,7 @@ typedef struct _pwd_session_t {
     uint8_t *out_buf;     /* message to fragment */
     int out_buf_pos;
     int out_buf_len;
-    EC_GROUP *group;
+    EC_GROUP *group;		/* group, order and prime belong to the pwd_group_t */
     EC_POINT *pwe;
     BIGNUM *order;
     BIGNUM *prime;
@@ -103,11 +122,12 @@ typedef struct _pwd_session_t {
     uint8_t my_confirm[SHA256_DIGEST_LENGTH];
 } pwd_session_t;
 
-int compute_password_element(pwd_session_t *sess, uint16_t grp_num,
+pwd_group_t *pwd_group_alloc(TALLOC_CTX *ctx, uint16_t grp_num);
+int compute_password_element(pwd_group_t const *grp, EC_POINT *pwe,
 			     char const *password, int password_len,
 			     char const *id_server, int id_server_len,
 			     char const *id_peer, int id_peer_len,
-			     uint32_t *token);
+			     uint32_t *token, BN_CTX *bnctx);
 int compute_scalar_element(pwd_session_t *sess, BN_CTX *bnctx);
 int process_peer_commit (pwd_session_t *sess, uint8_t *commit, BN_CTX *bnctx);
 int compute_server_confirm(pwd_session_t *sess, uint8_t *buf, BN_CTX *bnctx);
@@ -46,15 +46,203 @@ static CONF_PARSER pwd_module_config[] = {
 	{ "fragment_size", FR_CONF_OFFSET(PW_TYPE_INTEGER, EAP_PWD_CONF, fragment_size), "1020" },
 	{ "server_id", FR_CONF_OFFSET(PW_TYPE_STRING, EAP_PWD_CONF, server_id), NULL },
 	{ "virtual_server", FR_CONF_OFFSET(PW_TYPE_STRING, EAP_PWD_CONF, virtual_server), NULL },
+	{ "crypto_threads", FR_CONF_OFFSET(PW_TYPE_INTEGER, EAP_PWD_CONF, crypto_threads), "0" },
 	{ NULL, -1, 0, NULL, NULL }
 };
 
+#ifdef HAVE_PTHREAD_H
+/*
+ * A password element being computed by a crypto thread.  The job has
+ * its own copy of everything, because the request may give up on it
+ * (and go away) while the thread is still working on it.
+ */
+struct _pwd_job_t {
+	pwd_job_t		*next;
+	int			refs;		/* the request, and the crypto thread */
+	int			fd[2];		/* thread writes to fd[1] when it's done */
+
+	pwd_group_t const	*grp;
+	EC_POINT		*pwe;
+	char			*password;
+	size_t			password_len;
+	char			*id_server;
+	char			*id_peer;
+	uint32_t		token;
+	int			rcode;
+};
+
+static int _pwd_job_free(pwd_job_t *job)
+{
+	if (job->fd[0] >= 0) close(job->fd[0]);
+	if (job->fd[1] >= 0) close(job->fd[1]);
+	if (job->pwe) EC_POINT_clear_free(job->pwe);
+	if (job->password) memset(job->password, 0, job->password_len);
+
+	return 0;
+}
+
+static void pwd_job_release(eap_pwd_t *inst, pwd_job_t *job)
+{
+	int refs;
+
+	pthread_mutex_lock(&inst->mutex);
+	refs = --job->refs;
+	pthread_mutex_unlock(&inst->mutex);
+
+	if (refs == 0) talloc_free(job);
+}
+
+static void *pwd_crypto_thread(void *arg)
+{
+	eap_pwd_t *inst = arg;
+	BN_CTX *bnctx;
+	pwd_job_t *job;
+	uint8_t done = 1;
+
+	bnctx = BN_CTX_new();
+
+	pthread_mutex_lock(&inst->mutex);
+	while (true) {
+		while (!inst->head && !inst->stop) pthread_cond_wait(&inst->cond, &inst->mutex);
+		if (inst->stop) break;
+
+		job = inst->head;
+		inst->head = job->next;
+		if (!inst->head) inst->tail = NULL;
+		pthread_mutex_unlock(&inst->mutex);
+
+		if (!bnctx) {
+			job->rcode = -1;
+		} else {
+			job->rcode = compute_password_element(job->grp, job->pwe,
+							      job->password, job->password_len,
+							      job->id_server, strlen(job->id_server),
+							      job->id_peer, strlen(job->id_peer),
+							      &job->token, bnctx);
+		}
+
+		/*
+		 * If the request has given up, nobody is listening, and
+		 * the write doesn't matter.
+		 */
+		if (write(job->fd[1], &done, sizeof(done)) < 0) {
+			DEBUG2("rlm_eap_pwd: Failed signalling request: %s", fr_syserror(errno));
+		}
+		pwd_job_release(inst, job);
+
+		pthread_mutex_lock(&inst->mutex);
+	}
+	pthread_mutex_unlock(&inst->mutex);
+
+	if (bnctx) BN_CTX_free(bnctx);
+
+	return NULL;
+}
+
+/*
+ * Hand the password element to a crypto thread, and let the
+ * request's thread get on with other requests while it's computed.
+ */
+static int pwd_job_run(eap_pwd_t *inst, REQUEST *request, pwd_session_t *sess, char const *password)
+{
+	pwd_job_t *job;
+	uint8_t done;
+	int ret;
+
+	job = talloc_zero(NULL, pwd_job_t);
+	if (!job) return -1;
+	job->fd[0] = job->fd[1] = -1;
+	talloc_set_destructor(job, _pwd_job_free);
+
+	if (pipe(job->fd) < 0) {
+		REDEBUG("Failed creating pipe: %s", fr_syserror(errno));
+		talloc_free(job);
+		return -1;
+	}
+
+	job->grp = inst->grp;
+	job->password_len = strlen(password);
+	job->token = sess->token;
+	if (((job->pwe = EC_POINT_new(inst->grp->group)) == NULL) ||
+	    ((job->password = talloc_strdup(job, password)) == NULL) ||
+	    ((job->id_server = talloc_strdup(job, inst->conf->server_id)) == NULL) ||
+	    ((job->id_peer = talloc_strdup(job, sess->peer_id)) == NULL)) {
+		talloc_free(job);
+		return -1;
+	}
+	job->refs = 2;
+
+	pthread_mutex_lock(&inst->mutex);
+	if (inst->tail) {
+		inst->tail->next = job;
+	} else {
+		inst->head = job;
+	}
+	inst->tail = job;
+	pthread_cond_signal(&inst->cond);
+	pthread_mutex_unlock(&inst->mutex);
+
+	if ((module_yield(request, job->fd[0], NULL) <= 0) ||
+	    (read(job->fd[0], &done, sizeof(done)) != sizeof(done))) {
+		REDEBUG("Gave up waiting for the password element");
+		pwd_job_release(inst, job);
+		return -1;
+	}
+
+	ret = job->rcode;
+	if ((ret == 0) && !EC_POINT_copy(sess->pwe, job->pwe)) ret = -1;
+	pwd_job_release(inst, job);
+
+	return ret;
+}
+#endif
+
+static int pwd_password_element(eap_pwd_t *inst, REQUEST *request, pwd_session_t *sess, char const *password)
+{
+#ifdef HAVE_PTHREAD_H
+	if (inst->crypto_thread) return pwd_job_run(inst, request, sess, password);
+#endif
+
+	return compute_password_element(inst->grp, sess->pwe,
+					password, strlen(password),
+					inst->conf->server_id, strlen(inst->conf->server_id),
+					sess->peer_id, strlen(sess->peer_id),
+					&sess->token, inst->bnctx);
+}
+
 static int mod_detach (void *arg)
 {
 	eap_pwd_t *inst;
 
 	inst = (eap_pwd_t *) arg;
 
+#ifdef HAVE_PTHREAD_H
+	if (inst->crypto_thread) {
+		pwd_job_t *job, *next;
+		uint32_t i;
+
+		pthread_mutex_lock(&inst->mutex);
+		inst->stop = true;
+		pthread_cond_broadcast(&inst->cond);
+		pthread_mutex_unlock(&inst->mutex);
+
+		for (i = 0; i < inst->num_crypto_threads; i++) {
+			pthread_join(inst->crypto_thread[i], NULL);
+		}
+
+		/*
+		 * Nothing is waiting for these any more.
+		 */
+		for (job = inst->head; job != NULL; job = next) {
+			next = job->next;
+			talloc_free(job);
+		}
+
+		pthread_cond_destroy(&inst->cond);
+		pthread_mutex_destroy(&inst->mutex);
+	}
+#endif
+
 	if (inst->bnctx) BN_CTX_free(inst->bnctx);
 
 	return 0;
@@ -79,6 +267,45 @@ static int eap_pwd_attach (CONF_SECTION *cs, void **instance)
 		return -1;
 	}
 
+	/*
+	 * Everything about the group which doesn't depend on the
+	 * password is done here, once.
+	 */
+	inst->grp = pwd_group_alloc(inst, inst->conf->group);
+	if (!inst->grp) {
+		cf_log_err_cs(cs, "Group %u is not supported", inst->conf->group);
+		return -1;
+	}
+
+	FR_INTEGER_BOUND_CHECK("crypto_threads", inst->conf->crypto_threads, <=, 64);
+
+#ifdef HAVE_PTHREAD_H
+	if (inst->conf->crypto_threads) {
+		uint32_t i;
+
+		inst->crypto_thread = talloc_zero_array(inst, pthread_t, inst->conf->crypto_threads);
+		if (!inst->crypto_thread) return -1;
+
+		pthread_mutex_init(&inst->mutex, NULL);
+		pthread_cond_init(&inst->cond, NULL);
+
+		for (i = 0; i < inst->conf->crypto_threads; i++) {
+			int rcode;
+
+			rcode = pthread_create(&inst->crypto_thread[i], NULL, pwd_crypto_thread, inst);
+			if (rcode != 0) {
+				ERROR("rlm_eap_pwd: Failed creating crypto thread: %s", fr_syserror(rcode));
+				return -1;
+			}
+			inst->num_crypto_threads++;
+		}
+	}
+#else
+	if (inst->conf->crypto_threads) {
+		WARN("rlm_eap_pwd: Ignoring \"crypto_threads\", as the server was built without threads");
+	}
+#endif
+
 	return 0;
 }
 
@@ -90,10 +317,7 @@ static int _free_pwd_session (pwd_session_t *session)
 	BN_clear_free(session->k);
 	EC_POINT_clear_free(session->my_element);
 	EC_POINT_clear_free(session->peer_element);
-	EC_GROUP_free(session->group);
 	EC_POINT_clear_free(session->pwe);
-	BN_clear_free(session->order);
-	BN_clear_free(session->prime);
 
 	return 0;
 }
@@ -185,18 +409,6 @@ static int eap_pwd_initiate (void *instance, eap_handler_t *handler)
 		ERROR("rlm_eap_pwd: Server ID is not configured");
 		return -1;
 	}
-	switch (inst->conf->group) {
-	case 19:
-	case 20:
-	case 21:
-	case 25:
-	case 26:
-		break;
-
-	default:
-		ERROR("rlm_eap_pwd: Group is not supported");
-		return -1;
-	}
 
 	if ((pwd_session = talloc_zero(handler, pwd_session_t)) == NULL) return -1;
 	talloc_set_destructor(pwd_session, _free_pwd_session);
@@ -210,10 +422,10 @@ static int eap_pwd_initiate (void *instance, eap_handler_t *handler)
 	pwd_session->k = NULL;
 	pwd_session->my_element = NULL;
 	pwd_session->peer_element = NULL;
-	pwd_session->group = NULL;
+	pwd_session->group = inst->grp->group;
 	pwd_session->pwe = NULL;
-	pwd_session->order = NULL;
-	pwd_session->prime = NULL;
+	pwd_session->order = inst->grp->order;
+	pwd_session->prime = inst->grp->prime;
 
 	/*
 	* figure out the MTU (basically do what eap-tls does)
@@ -458,11 +670,13 @@ static int mod_authenticate (void *arg, eap_handler_t *handler)
 			return 0;
 		}
 
-		if (compute_password_element(pwd_session, pwd_session->group_num,
-			     		     pw->data.strvalue, strlen(pw->data.strvalue),
-					     inst->conf->server_id, strlen(inst->conf->server_id),
-					     pwd_session->peer_id, strlen(pwd_session->peer_id),
-					     &pwd_session->token)) {
+		if ((pwd_session->pwe = EC_POINT_new(pwd_session->group)) == NULL) {
+			DEBUG2("failed to allocate password element");
+			talloc_free(fake);
+			return 0;
+		}
+
+		if (pwd_password_element(inst, request, pwd_session, pw->vp_strvalue) != 0) {
 			DEBUG2("failed to obtain password element");
 			talloc_free(fake);
 			return 0;
@@ -605,6 +819,9 @@ rlm_eap_module_t rlm_eap_pwd = {
 	eap_pwd_initiate,	/* initiate to a client */
 	NULL,			/* no authorization */
 	mod_authenticate,	/* pwd authentication */
-	mod_detach		/* detach */
+	mod_detach,			/* detach */
+	NULL,				/* opaque_save */
+	NULL,				/* opaque_load */
+	true				/* yield_safe */
 };
 
@@ -39,16 +39,37 @@
 #include <freeradius-devel/radiusd.h>
 #include <freeradius-devel/modules.h>
 
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
 typedef struct eap_pwd_conf {
     uint32_t	group;
     uint32_t	fragment_size;
     char const	*server_id;
     char const	*virtual_server;
+    uint32_t	crypto_threads;
 } EAP_PWD_CONF;
 
+typedef struct _pwd_job_t pwd_job_t;
+
 typedef struct _eap_pwd_t {
     EAP_PWD_CONF *conf;
     BN_CTX *bnctx;
+    pwd_group_t *grp;		/* precomputed for conf->group */
+#ifdef HAVE_PTHREAD_H
+    /*
+     * Threads which compute the password element, so that
+     * hunting and pecking doesn't hold up the main thread pool.
+     */
+    pthread_t *crypto_thread;
+    uint32_t num_crypto_threads;
+    pthread_mutex_t mutex;	/* protects everything below, and the jobs' refs */
+    pthread_cond_t cond;
+    pwd_job_t *head;		/* jobs waiting for a thread */
+    pwd_job_t *tail;
+    bool stop;
+#endif
 } eap_pwd_t;
 
 #endif  /* _RLM_EAP_PWD_H */
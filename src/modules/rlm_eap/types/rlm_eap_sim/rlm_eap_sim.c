@@ -43,6 +43,71 @@ typedef struct eap_sim_server_state {
 	int  sim_id;
 } eap_sim_state_t;
 
+#ifdef HAVE_PTHREAD_H
+#define PTHREAD_MUTEX_LOCK pthread_mutex_lock
+#define PTHREAD_MUTEX_UNLOCK pthread_mutex_unlock
+#else
+#define PTHREAD_MUTEX_LOCK(_x)
+#define PTHREAD_MUTEX_UNLOCK(_x)
+#endif
+
+/*
+ *	One triplet, fetched ahead of time.
+ */
+typedef struct eap_sim_vector {
+	uint8_t		rand[EAPSIM_RAND_SIZE];
+	uint8_t		sres[EAPSIM_SRES_SIZE];
+	uint8_t		kc[EAPSIM_KC_SIZE];
+	time_t		expires;
+} eap_sim_vector_t;
+
+/*
+ *	The unused triplets for one identity.
+ */
+typedef struct eap_sim_pool_entry {
+	char			*identity;
+	eap_sim_vector_t	*vectors;	//!< Oldest first.
+	uint32_t		num;
+	bool			refilling;	//!< Queued for, or being refilled by, the
+						//!< prefetch thread.
+} eap_sim_pool_entry_t;
+
+typedef struct eap_sim_refill eap_sim_refill_t;
+struct eap_sim_refill {
+	eap_sim_pool_entry_t	*entry;
+	REQUEST			*fake;		//!< Sent to the vector server.
+	eap_sim_refill_t	*next;
+};
+
+typedef struct rlm_eap_sim {
+	char const		*vector_server;	//!< Virtual server which fetches triplets.
+	uint32_t		pool_size;	//!< Triplets to keep for each identity.
+	uint32_t		low_water;	//!< Refill when there are fewer than this.
+	uint32_t		lifetime;	//!< How long a fetched triplet may be used for.
+	uint32_t		max_entries;	//!< Identities to keep triplets for.
+
+	fr_hash_table_t		*pool;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t		mutex;
+	pthread_cond_t		cond;
+	pthread_t		thread;
+	bool			running;
+	bool			exiting;
+	eap_sim_refill_t	*queue;
+	eap_sim_refill_t	**queue_tail;
+#endif
+} rlm_eap_sim_t;
+
+static CONF_PARSER module_config[] = {
+	{ "vector_server", FR_CONF_OFFSET(PW_TYPE_STRING, rlm_eap_sim_t, vector_server), NULL },
+	{ "vector_pool_size", FR_CONF_OFFSET(PW_TYPE_INTEGER, rlm_eap_sim_t, pool_size), "6" },
+	{ "vector_low_water", FR_CONF_OFFSET(PW_TYPE_INTEGER, rlm_eap_sim_t, low_water), "3" },
+	{ "vector_lifetime", FR_CONF_OFFSET(PW_TYPE_INTEGER, rlm_eap_sim_t, lifetime), "3600" },
+	{ "vector_max_users", FR_CONF_OFFSET(PW_TYPE_INTEGER, rlm_eap_sim_t, max_entries), "10000" },
+
+	{ NULL, -1, 0, NULL, NULL }	   /* end the list */
+};
+
 /*
  *	build a reply to be sent.
  */
@@ -114,9 +179,8 @@ static int eap_sim_sendstart(eap_handler_t *handler)
 	return 1;
 }
 
-static int eap_sim_get_challenge(eap_handler_t *handler, VALUE_PAIR *vps, int idx, eap_sim_state_t *ess)
+static int eap_sim_get_challenge(REQUEST *request, VALUE_PAIR *vps, int idx, eap_sim_state_t *ess)
 {
-	REQUEST *request = handler->request;
 	VALUE_PAIR *vp, *ki, *algo_version;
 
 	rad_assert(idx >= 0 && idx < 3);
@@ -247,6 +311,346 @@ static int eap_sim_get_challenge(eap_handler_t *handler, VALUE_PAIR *vps, int id
 	return 1;
 }
 
+static uint32_t pool_entry_hash(void const *data)
+{
+	eap_sim_pool_entry_t const *entry = data;
+
+	return fr_hash_string(entry->identity);
+}
+
+static int pool_entry_cmp(void const *one, void const *two)
+{
+	eap_sim_pool_entry_t const *a = one;
+	eap_sim_pool_entry_t const *b = two;
+
+	return strcmp(a->identity, b->identity);
+}
+
+static void pool_entry_free(void *data)
+{
+	talloc_free(data);
+}
+
+/*
+ *	Build the request which is sent to the vector server.  It may
+ *	outlive the request it's copied from.
+ */
+static REQUEST *eap_sim_vector_request(rlm_eap_sim_t *inst, REQUEST *request, char const *identity)
+{
+	REQUEST *fake;
+
+	fake = request_alloc_fake_ctx(NULL, request);
+	if (!fake) return NULL;
+
+	fake->parent = NULL;
+	fake->server = inst->vector_server;
+	fake->packet->code = PW_CODE_ACCESS_REQUEST;
+
+	fake->username = pairmake(fake->packet, &fake->packet->vps, "User-Name", identity, T_OP_SET);
+	if (!fake->username) {
+		talloc_free(fake);
+		return NULL;
+	}
+
+	return fake;
+}
+
+/*
+ *	Run the vector server, and get the three triplets it left in
+ *	the control list.
+ */
+static int eap_sim_vector_fetch(rlm_eap_sim_t *inst, REQUEST *fake, eap_sim_vector_t vectors[3])
+{
+	REQUEST *request = fake;
+	eap_sim_state_t ess;
+	time_t expires;
+	int i;
+
+	pairfree(&fake->config_items);
+	pairfree(&fake->reply->vps);
+	fake->reply->code = 0;
+
+	RDEBUG2("Fetching triplets for \"%s\" from %s", fake->username->vp_strvalue, fake->server);
+	rad_virtual_server(fake);
+
+	memset(&ess, 0, sizeof(ess));
+	for (i = 0; i < 3; i++) {
+		if (!eap_sim_get_challenge(fake, fake->config_items, i, &ess)) return -1;
+	}
+
+	expires = time(NULL) + inst->lifetime;
+	for (i = 0; i < 3; i++) {
+		memcpy(vectors[i].rand, ess.keys.rand[i], EAPSIM_RAND_SIZE);
+		memcpy(vectors[i].sres, ess.keys.sres[i], EAPSIM_SRES_SIZE);
+		memcpy(vectors[i].kc, ess.keys.Kc[i], EAPSIM_KC_SIZE);
+		vectors[i].expires = expires;
+	}
+
+	return 0;
+}
+
+/*
+ *	Delete the entries which have nothing left to give.  Called
+ *	with the mutex held, when the pool is full.
+ */
+static int pool_entry_unused(void *ctx, void *data)
+{
+	eap_sim_pool_entry_t ***next = ctx;
+	eap_sim_pool_entry_t *entry = data;
+
+	if (entry->refilling) return 0;
+	if (entry->num && (entry->vectors[entry->num - 1].expires > time(NULL))) return 0;
+
+	*((*next)++) = entry;
+
+	return 0;
+}
+
+static void eap_sim_pool_clean(rlm_eap_sim_t *inst)
+{
+	eap_sim_pool_entry_t **unused, **next, **p;
+
+	unused = talloc_array(NULL, eap_sim_pool_entry_t *, fr_hash_table_num_elements(inst->pool));
+	if (!unused) return;
+
+	next = unused;
+	fr_hash_table_walk(inst->pool, pool_entry_unused, &next);
+	for (p = unused; p < next; p++) fr_hash_table_delete(inst->pool, *p);
+
+	talloc_free(unused);
+}
+
+/*
+ *	Find the pool for an identity, creating it if there's room.
+ *	Called with the mutex held.
+ */
+static eap_sim_pool_entry_t *eap_sim_pool_find(rlm_eap_sim_t *inst, char const *identity)
+{
+	eap_sim_pool_entry_t *entry, my_entry;
+
+	memcpy(&my_entry.identity, &identity, sizeof(my_entry.identity));
+	entry = fr_hash_table_finddata(inst->pool, &my_entry);
+	if (entry) return entry;
+
+	if (fr_hash_table_num_elements(inst->pool) >= (int) inst->max_entries) {
+		eap_sim_pool_clean(inst);
+		if (fr_hash_table_num_elements(inst->pool) >= (int) inst->max_entries) return NULL;
+	}
+
+	entry = talloc_zero(NULL, eap_sim_pool_entry_t);
+	if (!entry) return NULL;
+
+	entry->identity = talloc_strdup(entry, identity);
+	entry->vectors = talloc_array(entry, eap_sim_vector_t, inst->pool_size + 2);
+	if (!entry->identity || !entry->vectors || !fr_hash_table_insert(inst->pool, entry)) {
+		talloc_free(entry);
+		return NULL;
+	}
+
+	return entry;
+}
+
+/*
+ *	Take three triplets from the pool.  Called with the mutex held.
+ */
+static bool eap_sim_pool_take(eap_sim_pool_entry_t *entry, eap_sim_state_t *ess)
+{
+	time_t now = time(NULL);
+	uint32_t i;
+
+	/*
+	 *	Triplets are added with increasing expiry times.
+	 */
+	for (i = 0; (i < entry->num) && (entry->vectors[i].expires <= now); i++);
+	if (i > 0) {
+		entry->num -= i;
+		memmove(entry->vectors, entry->vectors + i, entry->num * sizeof(entry->vectors[0]));
+	}
+
+	if (entry->num < 3) return false;
+
+	for (i = 0; i < 3; i++) {
+		memcpy(ess->keys.rand[i], entry->vectors[i].rand, EAPSIM_RAND_SIZE);
+		memcpy(ess->keys.sres[i], entry->vectors[i].sres, EAPSIM_SRES_SIZE);
+		memcpy(ess->keys.Kc[i], entry->vectors[i].kc, EAPSIM_KC_SIZE);
+	}
+
+	/*
+	 *	Each triplet is used only once.
+	 */
+	entry->num -= 3;
+	memmove(entry->vectors, entry->vectors + 3, entry->num * sizeof(entry->vectors[0]));
+	memset(entry->vectors + entry->num, 0, 3 * sizeof(entry->vectors[0]));
+
+	return true;
+}
+
+/*
+ *	Fill the pool for an identity, until it has "vector_pool_size"
+ *	triplets.
+ */
+static void eap_sim_pool_fill(rlm_eap_sim_t *inst, eap_sim_pool_entry_t *entry, REQUEST *fake)
+{
+	eap_sim_vector_t vectors[3];
+
+	PTHREAD_MUTEX_LOCK(&inst->mutex);
+	while (entry->num < inst->pool_size) {
+#ifdef HAVE_PTHREAD_H
+		if (inst->exiting) break;
+#endif
+		PTHREAD_MUTEX_UNLOCK(&inst->mutex);
+
+		if (eap_sim_vector_fetch(inst, fake, vectors) < 0) {
+			PTHREAD_MUTEX_LOCK(&inst->mutex);
+			break;
+		}
+
+		PTHREAD_MUTEX_LOCK(&inst->mutex);
+		memcpy(entry->vectors + entry->num, vectors, sizeof(vectors));
+		entry->num += 3;
+	}
+	entry->refilling = false;
+	PTHREAD_MUTEX_UNLOCK(&inst->mutex);
+}
+
+#ifdef HAVE_PTHREAD_H
+static void *eap_sim_vector_thread(void *arg)
+{
+	rlm_eap_sim_t		*inst = arg;
+	eap_sim_refill_t	*refill;
+
+	pthread_mutex_lock(&inst->mutex);
+	while (!inst->exiting) {
+		if (!inst->queue) {
+			pthread_cond_wait(&inst->cond, &inst->mutex);
+			continue;
+		}
+
+		refill = inst->queue;
+		inst->queue = refill->next;
+		if (!inst->queue) inst->queue_tail = &inst->queue;
+		pthread_mutex_unlock(&inst->mutex);
+
+		refill->fake->child_pid = pthread_self();
+		eap_sim_pool_fill(inst, refill->entry, refill->fake);
+		talloc_free(refill->fake);
+
+		pthread_mutex_lock(&inst->mutex);
+	}
+	pthread_mutex_unlock(&inst->mutex);
+
+	return NULL;
+}
+#endif
+
+/*
+ *	Top the pool up, if it's running low.  Called with the mutex
+ *	held.  Without threads, this is done before the request
+ *	continues, which is no better than not pooling.
+ */
+static void eap_sim_pool_refill(rlm_eap_sim_t *inst, REQUEST *request, eap_sim_pool_entry_t *entry)
+{
+	eap_sim_refill_t *refill;
+	REQUEST *fake;
+
+	if (entry->refilling || (entry->num >= inst->low_water)) return;
+
+	fake = eap_sim_vector_request(inst, request, entry->identity);
+	if (!fake) return;
+
+	refill = talloc_zero(fake, eap_sim_refill_t);
+	if (!refill) {
+		talloc_free(fake);
+		return;
+	}
+	refill->entry = entry;
+	refill->fake = fake;
+	entry->refilling = true;
+
+#ifdef HAVE_PTHREAD_H
+	/*
+	 *	Started here, instead of in attach, as the server
+	 *	may fork after that.
+	 */
+	if (!inst->running) {
+		int ret;
+
+		ret = pthread_create(&inst->thread, NULL, eap_sim_vector_thread, inst);
+		if (ret != 0) {
+			RERROR("Failed creating triplet prefetch thread: %s", fr_syserror(ret));
+			entry->refilling = false;
+			talloc_free(fake);
+			return;
+		}
+		inst->running = true;
+	}
+
+	RDEBUG2("Prefetching triplets for \"%s\"", entry->identity);
+	*inst->queue_tail = refill;
+	inst->queue_tail = &refill->next;
+	pthread_cond_signal(&inst->cond);
+#else
+	eap_sim_pool_fill(inst, entry, fake);
+	talloc_free(fake);
+#endif
+}
+
+/*
+ *	Get the triplets for a new session from the pool, or, if it's
+ *	empty, from the vector server.
+ */
+static int eap_sim_vector_get(rlm_eap_sim_t *inst, eap_handler_t *handler, eap_sim_state_t *ess)
+{
+	REQUEST *request = handler->request;
+	eap_sim_pool_entry_t *entry;
+	eap_sim_vector_t vectors[3];
+	REQUEST *fake;
+	int i;
+
+	if (!handler->identity) {
+		REDEBUG("No EAP-Identity, can't find triplets");
+		return 0;
+	}
+
+	PTHREAD_MUTEX_LOCK(&inst->mutex);
+	entry = eap_sim_pool_find(inst, handler->identity);
+	if (entry && eap_sim_pool_take(entry, ess)) {
+		RDEBUG2("Using prefetched triplets for \"%s\", %u left", handler->identity, entry->num);
+		eap_sim_pool_refill(inst, request, entry);
+		PTHREAD_MUTEX_UNLOCK(&inst->mutex);
+		return 1;
+	}
+	PTHREAD_MUTEX_UNLOCK(&inst->mutex);
+
+	/*
+	 *	Nothing prefetched yet.  We have to wait for these.
+	 */
+	fake = eap_sim_vector_request(inst, request, handler->identity);
+	if (!fake) return 0;
+
+	if (eap_sim_vector_fetch(inst, fake, vectors) < 0) {
+		REDEBUG("Vector server %s did not return triplets for \"%s\"",
+			inst->vector_server, handler->identity);
+		talloc_free(fake);
+		return 0;
+	}
+	talloc_free(fake);
+
+	for (i = 0; i < 3; i++) {
+		memcpy(ess->keys.rand[i], vectors[i].rand, EAPSIM_RAND_SIZE);
+		memcpy(ess->keys.sres[i], vectors[i].sres, EAPSIM_SRES_SIZE);
+		memcpy(ess->keys.Kc[i], vectors[i].kc, EAPSIM_KC_SIZE);
+	}
+
+	if (entry) {
+		PTHREAD_MUTEX_LOCK(&inst->mutex);
+		eap_sim_pool_refill(inst, request, entry);
+		PTHREAD_MUTEX_UNLOCK(&inst->mutex);
+	}
+
+	return 1;
+}
+
 /** Send the challenge itself
  *
  * Challenges will come from one of three places eventually:
@@ -450,8 +854,9 @@ static void eap_sim_stateenter(eap_handler_t *handler,
  *	Initiate the EAP-SIM session by starting the state machine
  *      and initiating the state.
  */
-static int eap_sim_initiate(UNUSED void *instance, eap_handler_t *handler)
+static int eap_sim_initiate(void *instance, eap_handler_t *handler)
 {
+	rlm_eap_sim_t *inst = instance;
 	REQUEST *request = handler->request;
 	eap_sim_state_t *ess;
 	time_t n;
@@ -468,9 +873,14 @@ static int eap_sim_initiate(UNUSED void *instance, eap_handler_t *handler)
 	/*
 	 *	Save the keying material, because it could change on a subsequent retrieval.
 	 */
-	if (!eap_sim_get_challenge(handler, request->config_items, 0, ess) ||
-	    !eap_sim_get_challenge(handler, request->config_items, 1, ess) ||
-	    !eap_sim_get_challenge(handler, request->config_items, 2, ess)) {
+	if (inst->vector_server &&
+	    !pairfind(request->config_items, PW_EAP_SIM_KI, 0, TAG_ANY) &&
+	    !pairfind(request->config_items, PW_EAP_SIM_RAND1, 0, TAG_ANY)) {
+		if (!eap_sim_vector_get(inst, handler, ess)) return 0;
+
+	} else if (!eap_sim_get_challenge(request, request->config_items, 0, ess) ||
+		   !eap_sim_get_challenge(request, request->config_items, 1, ess) ||
+		   !eap_sim_get_challenge(request, request->config_items, 2, ess)) {
 		return 0;
 	}
 
@@ -682,15 +1092,89 @@ static int mod_authenticate(UNUSED void *arg, eap_handler_t *handler)
 	return 0;
 }
 
+/*
+ *	Attach the module.
+ */
+static int eap_sim_attach(CONF_SECTION *cs, void **instance)
+{
+	rlm_eap_sim_t *inst;
+
+	*instance = inst = talloc_zero(cs, rlm_eap_sim_t);
+	if (!inst) return -1;
+
+	if (cf_section_parse(cs, inst, module_config) < 0) {
+		return -1;
+	}
+
+	if (!inst->vector_server) return 0;
+
+	if (inst->pool_size < 3) {
+		cf_log_err_cs(cs, "vector_pool_size must be at least 3");
+		return -1;
+	}
+
+	if (inst->low_water > inst->pool_size) {
+		cf_log_err_cs(cs, "vector_low_water must not be larger than vector_pool_size");
+		return -1;
+	}
+
+	inst->pool = fr_hash_table_create(pool_entry_hash, pool_entry_cmp, pool_entry_free);
+	if (!inst->pool) return -1;
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_init(&inst->mutex, NULL);
+	pthread_cond_init(&inst->cond, NULL);
+	inst->queue_tail = &inst->queue;
+#endif
+
+	return 0;
+}
+
+static int eap_sim_detach(void *instance)
+{
+	rlm_eap_sim_t *inst = instance;
+
+	if (!inst->pool) return 0;
+
+#ifdef HAVE_PTHREAD_H
+	if (inst->running) {
+		pthread_mutex_lock(&inst->mutex);
+		inst->exiting = true;
+		pthread_cond_signal(&inst->cond);
+		pthread_mutex_unlock(&inst->mutex);
+
+		pthread_join(inst->thread, NULL);
+	}
+
+	while (inst->queue) {
+		eap_sim_refill_t *refill = inst->queue;
+
+		inst->queue = refill->next;
+		talloc_free(refill->fake);
+	}
+
+	pthread_cond_destroy(&inst->cond);
+	pthread_mutex_destroy(&inst->mutex);
+#endif
+
+	fr_hash_table_free(inst->pool);
+	inst->pool = NULL;
+
+	return 0;
+}
+
 /*
  *	The module name should be the only globally exported symbol.
  *	That is, everything else should be 'static'.
  */
 rlm_eap_module_t rlm_eap_sim = {
 	"eap_sim",
-	NULL,				/* XXX attach */
+	eap_sim_attach,			/* attach */
 	eap_sim_initiate,		/* Start the initial request */
 	NULL,				/* XXX authorization */
 	mod_authenticate,		/* authentication */
-	NULL				/* XXX detach */
+	eap_sim_detach,				/* detach */
+	NULL,					/* opaque_save */
+	NULL,					/* opaque_load */
+	false					/* yield_safe */
 };
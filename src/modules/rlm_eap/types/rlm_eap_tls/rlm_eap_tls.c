@@ -203,13 +203,13 @@ static int CC_HINT(nonnull) mod_authenticate(void *type_arg, eap_handler_t *hand
 		RDEBUG2("Received unexpected tunneled data after successful handshake");
 #ifndef NDEBUG
 		if ((debug_flag > 2) && fr_log_fp) {
-			unsigned int i;
-			unsigned int data_len;
+			int i;
+			int data_len;
 			unsigned char buffer[1024];
 
-			data_len = (tls_session->record_minus)(&tls_session->dirty_in,
-						buffer, sizeof(buffer));
-			DEBUG("  Tunneled data (%u bytes)", data_len);
+			data_len = BIO_read(tls_session->into_ssl, buffer, sizeof(buffer));
+			if (data_len < 0) data_len = 0;
+			DEBUG("  Tunneled data (%i bytes)", data_len);
 			for (i = 0; i < data_len; i++) {
 				if ((i & 0x0f) == 0x00) fprintf(fr_log_fp, "  %x: ", i);
 				if ((i & 0x0f) == 0x0f) fprintf(fr_log_fp, "\n");
@@ -252,5 +252,8 @@ rlm_eap_module_t rlm_eap_tls = {
 	eaptls_initiate,		/* Start the initial request */
 	NULL,				/* authorization */
 	mod_authenticate,		/* authentication */
-	NULL				/* detach */
+	NULL,					/* detach */
+	NULL,					/* opaque_save */
+	NULL,					/* opaque_load */
+	true					/* yield_safe */
 };
@@ -36,6 +36,7 @@ typedef struct ttls_tunnel_t {
 	bool		copy_request_to_tunnel;
 	bool		use_tunneled_reply;
 	char const	*virtual_server;
+	bool		authorize_once;
 } ttls_tunnel_t;
 
 /*
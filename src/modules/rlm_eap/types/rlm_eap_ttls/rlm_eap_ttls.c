@@ -67,6 +67,12 @@ typedef struct rlm_eap_ttls_t {
 	 */
 	char const *virtual_server;
 
+	/*
+	 *	Run the inner authorize section only once per
+	 *	tunneled EAP conversation.
+	 */
+	bool authorize_once;
+
 	/*
 	 * 	Do we do require a client cert?
 	 */
@@ -80,6 +86,7 @@ static CONF_PARSER module_config[] = {
 	{ "copy_request_to_tunnel", FR_CONF_OFFSET(PW_TYPE_BOOLEAN, rlm_eap_ttls_t, copy_request_to_tunnel), "no" },
 	{ "use_tunneled_reply", FR_CONF_OFFSET(PW_TYPE_BOOLEAN, rlm_eap_ttls_t, use_tunneled_reply), "no" },
 	{ "virtual_server", FR_CONF_OFFSET(PW_TYPE_STRING, rlm_eap_ttls_t, virtual_server), NULL },
+	{ "authorize_once", FR_CONF_OFFSET(PW_TYPE_BOOLEAN, rlm_eap_ttls_t, authorize_once), "no" },
 	{ "include_length", FR_CONF_OFFSET(PW_TYPE_BOOLEAN, rlm_eap_ttls_t, include_length), "yes" },
 	{ "require_client_cert", FR_CONF_OFFSET(PW_TYPE_BOOLEAN, rlm_eap_ttls_t, req_client_cert), "no" },
 
@@ -142,6 +149,7 @@ static ttls_tunnel_t *ttls_alloc(TALLOC_CTX *ctx, rlm_eap_ttls_t *inst)
 	t->copy_request_to_tunnel = inst->copy_request_to_tunnel;
 	t->use_tunneled_reply = inst->use_tunneled_reply;
 	t->virtual_server = inst->virtual_server;
+	t->authorize_once = inst->authorize_once;
 	return t;
 }
 
@@ -357,5 +365,8 @@ rlm_eap_module_t rlm_eap_ttls = {
 	eapttls_initiate,		/* Start the initial request */
 	NULL,				/* authorization */
 	mod_authenticate,		/* authentication */
-	NULL				/* detach */
+	NULL,					/* detach */
+	NULL,					/* opaque_save */
+	NULL,					/* opaque_load */
+	false					/* yield_safe */
 };
@@ -1210,9 +1210,10 @@ PW_CODE eapttls_process(eap_handler_t *handler, tls_session_t *tls_session)
 
 	/*
 	 *	Call authentication recursively, which will
-	 *	do PAP, CHAP, MS-CHAP, etc.
+	 *	do PAP, CHAP, MS-CHAP, etc.  Credentials found
+	 *	by earlier rounds of this session are re-used.
 	 */
-	rad_virtual_server(fake);
+	eaptls_virtual_server(handler, fake, t->authorize_once);
 
 	/*
 	 *	Decide what to do with the reply.
@@ -26,6 +26,7 @@ RCSID("$Id$")
 #include <freeradius-devel/radiusd.h>
 #include <freeradius-devel/modules.h>
 #include <freeradius-devel/rad_assert.h>
+#include <freeradius-devel/connection.h>
 
 /*
  *	Define a structure for our module configuration.
@@ -43,6 +44,8 @@ typedef struct rlm_exec_t {
 	unsigned int	packet_code;
 	bool		shell_escape;
 	uint32_t	timeout;
+	bool		persistent;	//!< Send requests to a pool of helpers.
+	fr_connection_pool_t *pool;	//!< Pool of persistent helper processes.
 } rlm_exec_t;
 
 /*
@@ -62,6 +65,7 @@ static const CONF_PARSER module_config[] = {
 	{ "packet_type", FR_CONF_OFFSET(PW_TYPE_STRING, rlm_exec_t, packet_type), NULL },
 	{ "shell_escape", FR_CONF_OFFSET(PW_TYPE_BOOLEAN, rlm_exec_t, shell_escape), "yes" },
 	{ "timeout", FR_CONF_OFFSET(PW_TYPE_INTEGER, rlm_exec_t, timeout), NULL },
+	{ "persistent", FR_CONF_OFFSET(PW_TYPE_BOOLEAN, rlm_exec_t, persistent), "no" },
 
 	{ NULL, -1, 0, NULL, NULL }		/* end the list */
 };
@@ -195,6 +199,56 @@ static ssize_t exec_xlat(void *instance, REQUEST *request, char const *fmt, char
 	return strlen(out);
 }
 
+/*
+ *	Start a helper for the connection pool.
+ */
+static void *mod_conn_create(TALLOC_CTX *ctx, void *instance)
+{
+	rlm_exec_t	*inst = instance;
+
+	return radius_exec_helper_start(ctx, inst->program);
+}
+
+/** Run the configured program on one of the pooled helpers
+ *
+ * Helpers which exited while idle are replaced before use.  Helpers which
+ * fail during the request are thrown away, and the pool starts new ones
+ * as they're needed.
+ */
+static int exec_pool_call(rlm_exec_t *inst, REQUEST *request, VALUE_PAIR *input_pairs,
+			  char *out, size_t outlen, VALUE_PAIR **output_pairs)
+{
+	fr_exec_helper_t	*helper;
+	int			status;
+
+	*out = '\0';
+
+	helper = fr_connection_get(inst->pool);
+	if (!helper) {
+		REDEBUG("No helper processes available");
+		return -1;
+	}
+
+	if (!radius_exec_helper_alive(helper)) {
+		helper = fr_connection_reconnect(inst->pool, helper);
+		if (!helper) {
+			REDEBUG("Failed restarting helper process");
+			return -1;
+		}
+	}
+
+	status = radius_exec_helper_call(helper, request, input_pairs, out, outlen, output_pairs, inst->timeout);
+
+	if (!radius_exec_helper_alive(helper)) {
+		fr_connection_del(inst->pool, helper);
+		return status;
+	}
+
+	fr_connection_release(inst->pool, helper);
+
+	return status;
+}
+
 /*
  *	Do any per-module initialization that is separate to each
  *	configured instance of the module.  e.g. set up connections
@@ -281,6 +335,39 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 		return -1;
 	}
 
+	/*
+	 *	Start the helpers which requests will be sent to.
+	 */
+	if (inst->persistent) {
+		if (!inst->program) {
+			cf_log_err_cs(conf, "'persistent' requires a 'program' to execute");
+			return -1;
+		}
+
+		if (!inst->wait) {
+			cf_log_err_cs(conf, "'persistent' requires 'wait = yes'");
+			return -1;
+		}
+
+		if (strchr(inst->program, '%') != NULL) {
+			cf_log_err_cs(conf, "The 'program' of a persistent helper cannot be expanded per request. "
+				      "Use 'input_pairs' to pass attributes to it");
+			return -1;
+		}
+
+		inst->pool = fr_connection_pool_module_init(conf, inst, mod_conn_create, NULL, NULL);
+		if (!inst->pool) return -1;
+	}
+
+	return 0;
+}
+
+static int mod_detach(void *instance)
+{
+	rlm_exec_t	*inst = instance;
+
+	fr_connection_pool_delete(inst->pool);
+
 	return 0;
 }
 
@@ -338,13 +425,18 @@ static rlm_rcode_t CC_HINT(nonnull) mod_exec_dispatch(void *instance, REQUEST *r
 		}
 	}
 
-	/*
-	 *	This function does it's own xlat of the input program
-	 *	to execute.
-	 */
-	status = radius_exec_program(out, sizeof(out), inst->output ? &answer : NULL, request,
-				     inst->program, inst->input ? *input_pairs : NULL,
-				     inst->wait, inst->shell_escape, inst->timeout);
+	if (inst->pool) {
+		status = exec_pool_call(inst, request, inst->input ? *input_pairs : NULL,
+					out, sizeof(out), inst->output ? &answer : NULL);
+	} else {
+		/*
+		 *	This function does it's own xlat of the input program
+		 *	to execute.
+		 */
+		status = radius_exec_program(out, sizeof(out), inst->output ? &answer : NULL, request,
+					     inst->program, inst->input ? *input_pairs : NULL,
+					     inst->wait, inst->shell_escape, inst->timeout);
+	}
 	rcode = rlm_exec_status2rcode(request, out, strlen(out), status);
 
 	/*
@@ -353,7 +445,7 @@ static rlm_rcode_t CC_HINT(nonnull) mod_exec_dispatch(void *instance, REQUEST *r
 	 *	If we're not waiting, then there are no output pairs.
 	 */
 	if (inst->output) {
-		pairmove(request, output_pairs, &answer);
+		pairmove(radius_list_ctx(request, inst->output_list), output_pairs, &answer);
 	}
 	pairfree(&answer);
 
@@ -466,11 +558,11 @@ static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, REQUEST *requ
 module_t rlm_exec = {
 	RLM_MODULE_INIT,
 	"exec",				/* Name */
-	RLM_TYPE_THREAD_SAFE,   	/* type */
+	RLM_TYPE_THREAD_SAFE | RLM_TYPE_YIELD_SAFE,	/* type */
 	sizeof(rlm_exec_t),
 	module_config,
 	mod_instantiate,		/* instantiation */
-	NULL,				/* detach */
+	mod_detach,			/* detach */
 	{
 		mod_exec_dispatch,	/* authentication */
 		mod_exec_dispatch,	/* authorization */
@@ -485,4 +577,8 @@ module_t rlm_exec = {
 		mod_exec_dispatch
 #endif
 	},
+	0,				/* thread_inst_size */
+	NULL,				/* thread_instantiate */
+	NULL,				/* thread_detach */
+	NULL				/* cache_flush */
 };
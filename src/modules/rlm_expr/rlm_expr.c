@@ -44,8 +44,21 @@ USES_APPLE_DEPRECATED_API
 typedef struct rlm_expr_t {
 	char const *xlat_name;
 	char const *allowed_chars;
+
+	fr_hash_table_t *cache;		//!< Parsed expressions.
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t mutex;		//!< Protects the cache.
+#endif
 } rlm_expr_t;
 
+#ifdef HAVE_PTHREAD_H
+#define PTHREAD_MUTEX_LOCK pthread_mutex_lock
+#define PTHREAD_MUTEX_UNLOCK pthread_mutex_unlock
+#else
+#define PTHREAD_MUTEX_LOCK(_x)
+#define PTHREAD_MUTEX_UNLOCK(_x)
+#endif
+
 static const CONF_PARSER module_config[] = {
 	{ "safe_characters", FR_CONF_OFFSET(PW_TYPE_STRING, rlm_expr_t, allowed_chars), "@abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789.-_: /" },
 	{NULL, -1, 0, NULL, NULL}
@@ -177,14 +190,41 @@ static expr_map_t map[] =
 	{0,	TOKEN_LAST}
 };
 
-static bool get_expression(REQUEST *request, char const **string, int64_t *answer, expr_token_t prev);
+/*
+ *	A parsed expression.  Leaves are TOKEN_INTEGER, and hold
+ *	either a constant, or a reference to an attribute which is
+ *	looked up when the expression is evaluated.
+ */
+typedef struct expr_node_t expr_node_t;
+struct expr_node_t {
+	expr_token_t		op;		//!< Operator, or TOKEN_INTEGER for a leaf.
+	int64_t			value;		//!< Constant value of a leaf.
+	value_pair_tmpl_t	*vpt;		//!< Attribute to get the value of a leaf from.
+	expr_node_t		*lhs;
+	expr_node_t		*rhs;
+};
 
-static bool get_number(REQUEST *request, char const **string, int64_t *answer)
+/*
+ *	Parsed expressions which reference attributes, keyed by
+ *	the expanded format string.
+ */
+typedef struct expr_cache_entry_t {
+	char const		*fmt;
+	expr_node_t		*root;
+} expr_cache_entry_t;
+
+#define EXPR_CACHE_MAX	(1024)
+
+static expr_node_t *expr_parse(REQUEST *request, TALLOC_CTX *ctx, char const **string,
+			       expr_token_t prev, bool *dynamic);
+
+static expr_node_t *expr_parse_number(REQUEST *request, TALLOC_CTX *ctx, char const **string, bool *dynamic)
 {
 	int64_t x;
 	bool invert = false;
 	bool negative = false;
 	char const *p = *string;
+	expr_node_t *node;
 
 	/*
 	 *	Look for a number.
@@ -214,59 +254,29 @@ static bool get_number(REQUEST *request, char const **string, int64_t *answer)
 	}
 
 	/*
-	 *	Look for an attribute.
+	 *	Look for an attribute.  Its value is found when the
+	 *	expression is evaluated.
 	 */
 	if (*p == '&') {
 		ssize_t slen;
-		VALUE_PAIR *vp;
-		value_pair_tmpl_t vpt;
 
-		slen = tmpl_from_attr_substr(&vpt, p, REQUEST_CURRENT, PAIR_LIST_REQUEST);
+		node = talloc_zero(ctx, expr_node_t);
+		if (!node) return NULL;
+		node->op = TOKEN_INTEGER;
+
+		node->vpt = talloc_zero(node, value_pair_tmpl_t);
+		if (!node->vpt) return NULL;
+
+		slen = tmpl_from_attr_substr(node->vpt, p, REQUEST_CURRENT, PAIR_LIST_REQUEST);
 		if (slen < 0) {
 			RDEBUG("Failed parsing attribute name '%s': %s",
 			       p, fr_strerror());
-			return false;
+			return NULL;
 		}
 
-		p += slen;
-
-		if (tmpl_find_vp(&vp, request, &vpt) < 0) {
-			RDEBUG("Can't find &%s", vpt.tmpl_da->name);
-			x = 0;
-			goto done;
-		}
-
-		switch (vp->da->type) {
-		default:
-			RDEBUG("WARNING: Non-integer attribute %s", vp->da->name);
-			x = 0;
-			break;
-
-		case PW_TYPE_INTEGER64:
-			/*
-			 *	FIXME: error out if the number is too large.
-			 */
-			x = vp->vp_integer64;
-			break;
-
-		case PW_TYPE_INTEGER:
-			x = vp->vp_integer;
-			break;
-
-		case PW_TYPE_SIGNED:
-			x = vp->vp_signed;
-			break;
-
-		case PW_TYPE_SHORT:
-			x = vp->vp_short;
-			break;
-
-		case PW_TYPE_BYTE:
-			x = vp->vp_byte;
-			break;
-		}
-
-		goto done;
+		*dynamic = true;
+		*string = p + slen;
+		return node;
 	}
 
 	/*
@@ -274,14 +284,15 @@ static bool get_number(REQUEST *request, char const **string, int64_t *answer)
 	 */
 	if (*p == '(') {
 		p++;
-		if (!get_expression(request, &p, &x, TOKEN_NONE)) return false;
+		node = expr_parse(request, ctx, &p, TOKEN_NONE, dynamic);
+		if (!node) return NULL;
 
 		if (*p != ')') {
 			RDEBUG("No trailing ')'");
-			return false;
+			return NULL;
 		}
-		p++;
-		goto done;
+		*string = p + 1;
+		return node;
 	}
 
 	if (*p == '-') {
@@ -291,7 +302,7 @@ static bool get_number(REQUEST *request, char const **string, int64_t *answer)
 
 	if ((*p < '0') || (*p > '9')) {
 		RDEBUG2("Not a number at \"%s\"", p);
-		return false;
+		return NULL;
 	}
 
 	/*
@@ -310,9 +321,13 @@ static bool get_number(REQUEST *request, char const **string, int64_t *answer)
 	if (invert) x = ~x;
 
 done:
+	node = talloc_zero(ctx, expr_node_t);
+	if (!node) return NULL;
+	node->op = TOKEN_INTEGER;
+	node->value = x;
+
 	*string = p;
-	*answer = x;
-	return true;
+	return node;
 }
 
 static bool calc_result(REQUEST *request, int64_t lhs, expr_token_t op, int64_t rhs, int64_t *answer)
@@ -426,15 +441,22 @@ static bool get_operator(REQUEST *request, char const **string, expr_token_t *op
 }
 
 
-static bool get_expression(REQUEST *request, char const **string, int64_t *answer, expr_token_t prev)
+/*
+ *	Parse an expression into a tree, which can be evaluated
+ *	many times.  If the expression references attributes,
+ *	"dynamic" is set.
+ */
+static expr_node_t *expr_parse(REQUEST *request, TALLOC_CTX *ctx, char const **string,
+			       expr_token_t prev, bool *dynamic)
 {
-	int64_t		lhs, rhs;
+	expr_node_t	*lhs, *rhs, *node;
 	char const 	*p, *op_p;
 	expr_token_t	this;
 
 	p = *string;
 
-	if (!get_number(request, &p, &lhs)) return false;
+	lhs = expr_parse_number(request, ctx, &p, dynamic);
+	if (!lhs) return NULL;
 
 redo:
 	while (isspace((int) *p)) p++;
@@ -443,16 +465,15 @@ redo:
 	 *	A number by itself is OK.
 	 */
 	if (!*p || (*p == ')')) {
-		*answer = lhs;
 		*string = p;
-		return true;
+		return lhs;
 	}
 
 	/*
 	 *	Peek at the operator.
 	 */
 	op_p = p;
-	if (!get_operator(request, &p, &this)) return false;
+	if (!get_operator(request, &p, &this)) return NULL;
 
 	/*
 	 *	a + b + c ... = (a + b) + c ...
@@ -462,52 +483,193 @@ redo:
 	 *	care of continuing.
 	 */
 	if (precedence[this] <= precedence[prev]) {
-		*answer = lhs;
 		*string = op_p;
-		return true;
+		return lhs;
 	}
 
 	/*
 	 *	a + b * c ... = a + (b * c) ...
 	 */
-	if (!get_expression(request, &p, &rhs, this)) return false;
+	rhs = expr_parse(request, ctx, &p, this, dynamic);
+	if (!rhs) return NULL;
 
-	if (!calc_result(request, lhs, this, rhs, answer)) return false;
+	node = talloc_zero(ctx, expr_node_t);
+	if (!node) return NULL;
+	node->op = this;
+	node->lhs = lhs;
+	node->rhs = rhs;
 
 	/*
-	 *	There may be more to calculate.  The answer we
-	 *	calculated here is now the LHS of the lower priority
-	 *	operation which follows the current expression.  e.g.
+	 *	There may be more to parse.  The node we created
+	 *	here is now the LHS of the lower priority operation
+	 *	which follows the current expression.  e.g.
 	 *
 	 *	a * b + c ... = (a * b) + c ...
 	 *	              =       d + c ...
 	 */
-	lhs = *answer;
+	lhs = node;
 	goto redo;
 }
 
+static bool expr_eval(REQUEST *request, expr_node_t const *node, int64_t *answer)
+{
+	int64_t		lhs, rhs;
+	VALUE_PAIR	*vp;
+
+	if (node->op != TOKEN_INTEGER) {
+		if (!expr_eval(request, node->lhs, &lhs) ||
+		    !expr_eval(request, node->rhs, &rhs)) return false;
+
+		return calc_result(request, lhs, node->op, rhs, answer);
+	}
+
+	if (!node->vpt) {
+		*answer = node->value;
+		return true;
+	}
+
+	if (tmpl_find_vp(&vp, request, node->vpt) < 0) {
+		RDEBUG("Can't find &%s", node->vpt->tmpl_da->name);
+		*answer = 0;
+		return true;
+	}
+
+	switch (vp->da->type) {
+	default:
+		RDEBUG("WARNING: Non-integer attribute %s", vp->da->name);
+		*answer = 0;
+		break;
+
+	case PW_TYPE_INTEGER64:
+		/*
+		 *	FIXME: error out if the number is too large.
+		 */
+		*answer = vp->vp_integer64;
+		break;
+
+	case PW_TYPE_INTEGER:
+		*answer = vp->vp_integer;
+		break;
+
+	case PW_TYPE_SIGNED:
+		*answer = vp->vp_signed;
+		break;
+
+	case PW_TYPE_SHORT:
+		*answer = vp->vp_short;
+		break;
+
+	case PW_TYPE_BYTE:
+		*answer = vp->vp_byte;
+		break;
+	}
+
+	return true;
+}
+
+static uint32_t expr_cache_hash(void const *data)
+{
+	expr_cache_entry_t const *entry = data;
+
+	return fr_hash_string(entry->fmt);
+}
+
+static int expr_cache_cmp(void const *one, void const *two)
+{
+	expr_cache_entry_t const *a = one;
+	expr_cache_entry_t const *b = two;
+
+	return strcmp(a->fmt, b->fmt);
+}
+
+static void expr_cache_free(void *data)
+{
+	talloc_free(data);
+}
+
 /*
- *  Do xlat of strings!
+ *	Find the parsed form of an expression.
+ *
+ *	Expressions which reference attributes usually expand to
+ *	the same string for every request, so they are parsed once
+ *	and cached.  Expressions made only of numbers were built by
+ *	expanding other attributes, and are parsed every time.
  */
-static ssize_t expr_xlat(UNUSED void *instance, REQUEST *request, char const *fmt,
-			 char *out, size_t outlen)
+static expr_node_t const *expr_compile(rlm_expr_t *inst, REQUEST *request, TALLOC_CTX *ctx, char const *fmt)
 {
-	int64_t		result;
-	char const 	*p;
+	expr_cache_entry_t my_entry, *entry;
+	expr_node_t *root;
+	char const *p;
+	bool dynamic = false;
 
-	p = fmt;
+	my_entry.fmt = fmt;
 
-	if (!get_expression(request, &p, &result, TOKEN_NONE)) {
-		return -1;
-	}
+	PTHREAD_MUTEX_LOCK(&inst->mutex);
+	entry = fr_hash_table_finddata(inst->cache, &my_entry);
+	PTHREAD_MUTEX_UNLOCK(&inst->mutex);
+	if (entry) return entry->root;
+
+	entry = talloc_zero(ctx, expr_cache_entry_t);
+	if (!entry) return NULL;
+
+	/*
+	 *	The attribute templates point into the string they
+	 *	were parsed from, so parse our own copy.
+	 */
+	entry->fmt = talloc_strdup(entry, fmt);
+	if (!entry->fmt) return NULL;
+
+	p = entry->fmt;
+	root = expr_parse(request, entry, &p, TOKEN_NONE, &dynamic);
+	if (!root) return NULL;
 
 	if (*p) {
 		RDEBUG("Invalid text after expression: %s", p);
-		return -1;
+		return NULL;
 	}
 
-	snprintf(out, outlen, "%lld", (long long int) result);
-	return strlen(out);
+	if (!dynamic) return root;
+
+	entry->root = root;
+
+	/*
+	 *	Cache it for the next request.  If another thread
+	 *	got there first, or the cache is full, just use the
+	 *	one we parsed.
+	 */
+	PTHREAD_MUTEX_LOCK(&inst->mutex);
+	if ((fr_hash_table_num_elements(inst->cache) < EXPR_CACHE_MAX) &&
+	    fr_hash_table_insert(inst->cache, entry)) {
+		(void) talloc_steal(NULL, entry);
+	}
+	PTHREAD_MUTEX_UNLOCK(&inst->mutex);
+
+	return root;
+}
+
+/*
+ *  Do xlat of strings!
+ */
+static ssize_t expr_xlat(void *instance, REQUEST *request, char const *fmt,
+			 char *out, size_t outlen)
+{
+	rlm_expr_t		*inst = instance;
+	int64_t			result;
+	expr_node_t const	*root;
+	TALLOC_CTX		*ctx;
+	ssize_t			ret = -1;
+
+	ctx = talloc_new(request);
+	if (!ctx) return -1;
+
+	root = expr_compile(inst, request, ctx, fmt);
+	if (root && expr_eval(request, root, &result)) {
+		snprintf(out, outlen, "%lld", (long long int) result);
+		ret = strlen(out);
+	}
+
+	talloc_free(ctx);
+	return ret;
 }
 
 /** Generate a random integer value
@@ -1243,6 +1405,15 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 		inst->xlat_name = cf_section_name1(conf);
 	}
 
+	inst->cache = fr_hash_table_create(expr_cache_hash, expr_cache_cmp, expr_cache_free);
+	if (!inst->cache) {
+		cf_log_err_cs(conf, "Failed creating expression cache");
+		return -1;
+	}
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_init(&inst->mutex, NULL);
+#endif
+
 	xlat_register(inst->xlat_name, expr_xlat, NULL, inst);
 
 	/*
@@ -1269,6 +1440,17 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 	xlat_register("base64", base64_xlat, NULL, inst);
 	xlat_register("base64tohex", base64_to_hex_xlat, NULL, inst);
 
+	/*
+	 *	These don't look at the request, so they can be
+	 *	expanded when the configuration is loaded.
+	 */
+	xlat_pure("urlquote");
+	xlat_pure("urlunquote");
+	xlat_pure("escape");
+	xlat_pure("unescape");
+	xlat_pure("tolower");
+	xlat_pure("toupper");
+
 	/*
 	 *	Initialize various paircompare functions
 	 */
@@ -1276,6 +1458,20 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 	return 0;
 }
 
+static int mod_detach(void *instance)
+{
+	rlm_expr_t *inst = instance;
+
+	if (!inst->cache) return 0;
+
+	fr_hash_table_free(inst->cache);
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_destroy(&inst->mutex);
+#endif
+
+	return 0;
+}
+
 /*
  *	The module name should be the only globally exported symbol.
  *	That is, everything else should be 'static'.
@@ -1292,11 +1488,15 @@ module_t rlm_expr = {
 	sizeof(rlm_expr_t),
 	module_config,
 	mod_instantiate,		/* instantiation */
-	NULL,				/* detach */
+	mod_detach,			/* detach */
 	{
 		NULL,			/* authentication */
 		NULL,			/* authorization */
 		NULL,			/* pre-accounting */
 		NULL			/* accounting */
 	},
+	0,				/* thread_inst_size */
+	NULL,				/* thread_instantiate */
+	NULL,				/* thread_detach */
+	NULL				/* cache_flush */
 };
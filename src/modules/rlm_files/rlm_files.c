@@ -29,40 +29,48 @@ RCSID("$Id$")
 #include	<ctype.h>
 #include	<fcntl.h>
 
+/*
+ *	One users file, read into memory.
+ */
+typedef struct rlm_files_data {
+	fr_hash_table_t		*ht;		//!< Entries by name, chained in file order.
+	pairlist_index_t	*defaults;	//!< DEFAULT entries, by check item.
+} rlm_files_data_t;
+
 typedef struct rlm_files_t {
 	char const *compat_mode;
 
 	char const *key;
 
 	char const *filename;
-	fr_hash_table_t *common;
+	rlm_files_data_t common;
 
 	/* autz */
 	char const *usersfile;
-	fr_hash_table_t *users;
+	rlm_files_data_t users;
 
 
 	/* authenticate */
 	char const *auth_usersfile;
-	fr_hash_table_t *auth_users;
+	rlm_files_data_t auth_users;
 
 	/* preacct */
 	char const *acctusersfile;
-	fr_hash_table_t *acctusers;
+	rlm_files_data_t acctusers;
 
 #ifdef WITH_PROXY
 	/* pre-proxy */
 	char const *preproxy_usersfile;
-	fr_hash_table_t *preproxy_users;
+	rlm_files_data_t preproxy_users;
 
 	/* post-proxy */
 	char const *postproxy_usersfile;
-	fr_hash_table_t *postproxy_users;
+	rlm_files_data_t postproxy_users;
 #endif
 
 	/* post-authenticate */
 	char const *postauth_usersfile;
-	fr_hash_table_t *postauth_users;
+	rlm_files_data_t postauth_users;
 } rlm_files_t;
 
 
@@ -95,7 +103,7 @@ static const CONF_PARSER module_config[] = {
 
 static uint32_t pairlist_hash(void const *data)
 {
-	return fr_hash_string(((PAIR_LIST const *)data)->name);
+	return fr_hash_keyed_string(((PAIR_LIST const *)data)->name);
 }
 
 static int pairlist_cmp(void const *a, void const *b)
@@ -112,16 +120,18 @@ static void my_pairlist_free(void *data)
 }
 
 
-static int getusersfile(TALLOC_CTX *ctx, char const *filename, fr_hash_table_t **pht, char const *compat_mode_str)
+static int getusersfile(TALLOC_CTX *ctx, char const *filename, rlm_files_data_t *data, char const *compat_mode_str)
 {
 	int rcode;
 	PAIR_LIST *users = NULL;
 	PAIR_LIST *entry, *next;
+	PAIR_LIST my_pl;
 	fr_hash_table_t *ht, *tailht;
 	int order = 0;
 
 	if (!filename) {
-		*pht = NULL;
+		data->ht = NULL;
+		data->defaults = NULL;
 		return 0;
 	}
 
@@ -302,7 +312,22 @@ static int getusersfile(TALLOC_CTX *ctx, char const *filename, fr_hash_table_t *
 	}
 
 	fr_hash_table_free(tailht);
-	*pht = ht;
+
+	/*
+	 *	DEFAULT entries are all checked against every request,
+	 *	so also index them by the attributes they match on.
+	 */
+	my_pl.name = "DEFAULT";
+	entry = fr_hash_table_finddata(ht, &my_pl);
+	data->defaults = NULL;
+	if (entry) {
+		data->defaults = pairlist_index_alloc(ctx, entry);
+		if (!data->defaults) {
+			fr_hash_table_free(ht);
+			return -1;
+		}
+	}
+	data->ht = ht;
 
 	return 0;
 }
@@ -313,15 +338,22 @@ static int getusersfile(TALLOC_CTX *ctx, char const *filename, fr_hash_table_t *
 static int mod_detach(void *instance)
 {
 	rlm_files_t *inst = instance;
-	fr_hash_table_free(inst->common);
-	fr_hash_table_free(inst->users);
-	fr_hash_table_free(inst->acctusers);
+	TALLOC_FREE(inst->common.defaults);
+	fr_hash_table_free(inst->common.ht);
+	TALLOC_FREE(inst->users.defaults);
+	fr_hash_table_free(inst->users.ht);
+	TALLOC_FREE(inst->acctusers.defaults);
+	fr_hash_table_free(inst->acctusers.ht);
 #ifdef WITH_PROXY
-	fr_hash_table_free(inst->preproxy_users);
-	fr_hash_table_free(inst->postproxy_users);
+	TALLOC_FREE(inst->preproxy_users.defaults);
+	fr_hash_table_free(inst->preproxy_users.ht);
+	TALLOC_FREE(inst->postproxy_users.defaults);
+	fr_hash_table_free(inst->postproxy_users.ht);
 #endif
-	fr_hash_table_free(inst->auth_users);
-	fr_hash_table_free(inst->postauth_users);
+	TALLOC_FREE(inst->auth_users.defaults);
+	fr_hash_table_free(inst->auth_users.ht);
+	TALLOC_FREE(inst->postauth_users.defaults);
+	fr_hash_table_free(inst->postauth_users.ht);
 	return 0;
 }
 
@@ -355,7 +387,7 @@ static int mod_instantiate(UNUSED CONF_SECTION *conf, void *instance)
 /*
  *	Common code called by everything below.
  */
-static rlm_rcode_t file_common(rlm_files_t *inst, REQUEST *request, char const *filename, fr_hash_table_t *ht,
+static rlm_rcode_t file_common(rlm_files_t *inst, REQUEST *request, char const *filename, rlm_files_data_t *data,
 			       RADIUS_PACKET *request_packet, RADIUS_PACKET *reply_packet)
 {
 	char const	*name, *match;
@@ -365,6 +397,8 @@ static rlm_rcode_t file_common(rlm_files_t *inst, REQUEST *request, char const *
 	bool		found = false;
 	PAIR_LIST	my_pl;
 	char		buffer[256];
+	vp_index_t	*index = NULL;
+	pairlist_cursor_t *defaults = NULL;
 
 	if (!inst->key) {
 		VALUE_PAIR	*namepair;
@@ -382,12 +416,22 @@ static rlm_rcode_t file_common(rlm_files_t *inst, REQUEST *request, char const *
 		name = len ? buffer : "NONE";
 	}
 
-	if (!ht) return RLM_MODULE_NOOP;
+	if (!data->ht) return RLM_MODULE_NOOP;
 
 	my_pl.name = name;
-	user_pl = fr_hash_table_finddata(ht, &my_pl);
-	my_pl.name = "DEFAULT";
-	default_pl = fr_hash_table_finddata(ht, &my_pl);
+	user_pl = fr_hash_table_finddata(data->ht, &my_pl);
+
+	/*
+	 *	Only the DEFAULT entries which can match the request
+	 *	attributes are returned, still in file order.
+	 */
+	default_pl = NULL;
+	if (data->defaults) {
+		defaults = pairlist_index_match(request, data->defaults, request_packet->vps);
+		if (!defaults) return RLM_MODULE_FAIL;
+
+		default_pl = pairlist_cursor_next(defaults);
+	}
 
 	/*
 	 *	Find the entry for the user.
@@ -405,7 +449,7 @@ static rlm_rcode_t file_common(rlm_files_t *inst, REQUEST *request, char const *
 		} else if (!user_pl && default_pl) {
 			pl = default_pl;
 			match = "DEFAULT";
-			default_pl = default_pl->next;
+			default_pl = pairlist_cursor_next(defaults);
 
 		} else if (user_pl->order < default_pl->order) {
 			pl = user_pl;
@@ -415,7 +459,7 @@ static rlm_rcode_t file_common(rlm_files_t *inst, REQUEST *request, char const *
 		} else {
 			pl = default_pl;
 			match = "DEFAULT";
-			default_pl = default_pl->next;
+			default_pl = pairlist_cursor_next(defaults);
 		}
 
 		check_tmp = paircopy(request, pl->check);
@@ -429,10 +473,21 @@ static rlm_rcode_t file_common(rlm_files_t *inst, REQUEST *request, char const *
 			}
 		}
 
-		if (paircompare(request, request_packet->vps, pl->check, &reply_packet->vps) == 0) {
+		/*
+		 *	The same request attributes are looked up for
+		 *	every entry, so index them once.
+		 */
+		if (!index) index = pairindex_alloc(request, &request_packet->vps);
+
+		if (paircompare_index(request, request_packet->vps, index, pl->check, &reply_packet->vps) == 0) {
 			RDEBUG2("%s: Matched entry %s at line %d", filename, match, pl->lineno);
 			found = true;
 
+			/*
+			 *	The attributes may be edited below.
+			 */
+			TALLOC_FREE(index);
+
 			/* ctx may be reply or proxy */
 			reply_tmp = paircopy(reply_packet, pl->reply);
 			radius_pairmove(request, &reply_packet->vps, reply_tmp, true);
@@ -447,6 +502,9 @@ static rlm_rcode_t file_common(rlm_files_t *inst, REQUEST *request, char const *
 		}
 	}
 
+	talloc_free(index);
+	talloc_free(defaults);
+
 	/*
 	 *	Remove server internal parameters.
 	 */
@@ -474,7 +532,7 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authorize(void *instance, REQUEST *reque
 	rlm_files_t *inst = instance;
 
 	return file_common(inst, request, "users",
-			   inst->users ? inst->users : inst->common,
+			   inst->users.ht ? &inst->users : &inst->common,
 			   request->packet, request->reply);
 }
 
@@ -489,7 +547,7 @@ static rlm_rcode_t CC_HINT(nonnull) mod_preacct(void *instance, REQUEST *request
 	rlm_files_t *inst = instance;
 
 	return file_common(inst, request, "acct_users",
-			   inst->acctusers ? inst->acctusers : inst->common,
+			   inst->acctusers.ht ? &inst->acctusers : &inst->common,
 			   request->packet, request->reply);
 }
 
@@ -499,7 +557,7 @@ static rlm_rcode_t CC_HINT(nonnull) mod_pre_proxy(void *instance, REQUEST *reque
 	rlm_files_t *inst = instance;
 
 	return file_common(inst, request, "preproxy_users",
-			   inst->preproxy_users ? inst->preproxy_users : inst->common,
+			   inst->preproxy_users.ht ? &inst->preproxy_users : &inst->common,
 			   request->packet, request->proxy);
 }
 
@@ -508,7 +566,7 @@ static rlm_rcode_t CC_HINT(nonnull) mod_post_proxy(void *instance, REQUEST *requ
 	rlm_files_t *inst = instance;
 
 	return file_common(inst, request, "postproxy_users",
-			   inst->postproxy_users ? inst->postproxy_users : inst->common,
+			   inst->postproxy_users.ht ? &inst->postproxy_users : &inst->common,
 			   request->proxy_reply, request->reply);
 }
 #endif
@@ -518,7 +576,7 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(void *instance, REQUEST *re
 	rlm_files_t *inst = instance;
 
 	return file_common(inst, request, "auth_users",
-			   inst->auth_users ? inst->auth_users : inst->common,
+			   inst->auth_users.ht ? &inst->auth_users : &inst->common,
 			   request->packet, request->reply);
 }
 
@@ -527,7 +585,7 @@ static rlm_rcode_t CC_HINT(nonnull) mod_post_auth(void *instance, REQUEST *reque
 	rlm_files_t *inst = instance;
 
 	return file_common(inst, request, "postauth_users",
-			   inst->postauth_users ? inst->postauth_users : inst->common,
+			   inst->postauth_users.ht ? &inst->postauth_users : &inst->common,
 			   request->packet, request->reply);
 }
 
@@ -555,5 +613,9 @@ module_t rlm_files = {
 #endif
 		mod_post_auth		/* post-auth */
 	},
+	0,				/* thread_inst_size */
+	NULL,				/* thread_instantiate */
+	NULL,				/* thread_detach */
+	NULL				/* cache_flush */
 };
 
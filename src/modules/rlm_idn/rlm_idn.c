@@ -27,6 +27,25 @@ RCSID("$Id$")
 
 #include <idna.h>
 
+#ifdef HAVE_PTHREAD_H
+#  define IDN_LOCK(_inst) pthread_mutex_lock(&(_inst)->mutex)
+#  define IDN_UNLOCK(_inst) pthread_mutex_unlock(&(_inst)->mutex)
+#else
+#  define IDN_LOCK(_inst)
+#  define IDN_UNLOCK(_inst)
+#endif
+
+/*
+ *	A recent conversion.  Failures are remembered, too.
+ */
+typedef struct idn_cache_entry_t {
+	char const			*in;		//!< The UTF-8 name.
+	char const			*out;		//!< The ASCII name, or NULL on error.
+	int				res;		//!< Result from idna_to_ascii_8z().
+	struct idn_cache_entry_t	*prev;		//!< More recently used.
+	struct idn_cache_entry_t	*next;		//!< Less recently used.
+} idn_cache_entry_t;
+
 /*
  *      Structure for module configuration
  */
@@ -34,6 +53,14 @@ typedef struct rlm_idn_t {
 	char const	*xlat_name;
 	bool		use_std3_ascii_rules;
 	bool		allow_unassigned;
+	uint32_t	cache_size;
+
+	fr_hash_table_t	*cache;
+	idn_cache_entry_t *lru_head;
+	idn_cache_entry_t *lru_tail;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t	mutex;
+#endif
 } rlm_idn_t;
 
 /*
@@ -83,18 +110,129 @@ static const CONF_PARSER mod_config[] = {
 
 	{ "allow_unassigned", FR_CONF_OFFSET(PW_TYPE_BOOLEAN, rlm_idn_t, allow_unassigned), "no" },
 	{ "use_std3_ascii_rules", FR_CONF_OFFSET(PW_TYPE_BOOLEAN, rlm_idn_t, use_std3_ascii_rules), "yes" },
+	{ "cache_size", FR_CONF_OFFSET(PW_TYPE_INTEGER, rlm_idn_t, cache_size), "1024" },
 
 	{ NULL, -1, 0, NULL, NULL }
 };
 
+static uint32_t idn_cache_hash(void const *data)
+{
+	return fr_hash_string(((idn_cache_entry_t const *)data)->in);
+}
+
+static int idn_cache_cmp(void const *a, void const *b)
+{
+	return strcmp(((idn_cache_entry_t const *)a)->in,
+		      ((idn_cache_entry_t const *)b)->in);
+}
+
+static void idn_cache_free(void *data)
+{
+	talloc_free(data);
+}
+
+static void idn_lru_unlink(rlm_idn_t *inst, idn_cache_entry_t *entry)
+{
+	if (entry->prev) {
+		entry->prev->next = entry->next;
+	} else {
+		inst->lru_head = entry->next;
+	}
+
+	if (entry->next) {
+		entry->next->prev = entry->prev;
+	} else {
+		inst->lru_tail = entry->prev;
+	}
+
+	entry->prev = entry->next = NULL;
+}
+
+static void idn_lru_insert(rlm_idn_t *inst, idn_cache_entry_t *entry)
+{
+	entry->prev = NULL;
+	entry->next = inst->lru_head;
+	if (inst->lru_head) inst->lru_head->prev = entry;
+	inst->lru_head = entry;
+	if (!inst->lru_tail) inst->lru_tail = entry;
+}
+
+/*
+ *	Copy a cached conversion to the output buffer.  Must be
+ *	called with the mutex held.
+ */
+static ssize_t idn_cache_find(rlm_idn_t *inst, char const *fmt, int *res, char *out, size_t freespace)
+{
+	idn_cache_entry_t *entry, my_entry;
+
+	my_entry.in = fmt;
+	entry = fr_hash_table_finddata(inst->cache, &my_entry);
+	if (!entry) return -1;
+
+	if (entry != inst->lru_head) {
+		idn_lru_unlink(inst, entry);
+		idn_lru_insert(inst, entry);
+	}
+
+	*res = entry->res;
+	if (entry->res) return 0;
+
+	return strlcpy(out, entry->out, freespace);
+}
+
+/*
+ *	Remember a conversion, forgetting the least recently used
+ *	one if the cache is full.  Must be called with the mutex held.
+ */
+static void idn_cache_add(rlm_idn_t *inst, char const *fmt, int res, char const *idna)
+{
+	idn_cache_entry_t *entry;
+
+	if ((uint32_t) fr_hash_table_num_elements(inst->cache) >= inst->cache_size) {
+		entry = inst->lru_tail;
+		idn_lru_unlink(inst, entry);
+		fr_hash_table_delete(inst->cache, entry);
+	}
+
+	entry = talloc_zero(NULL, idn_cache_entry_t);
+	if (!entry) return;
+
+	entry->in = talloc_strdup(entry, fmt);
+	entry->res = res;
+	if (!res) entry->out = talloc_strdup(entry, idna);
+	if (!entry->in || (!res && !entry->out) || !fr_hash_table_insert(inst->cache, entry)) {
+		talloc_free(entry);
+		return;
+	}
+
+	idn_lru_insert(inst, entry);
+}
+
 static ssize_t xlat_idna(void *instance, UNUSED REQUEST *request, char const *fmt, char *out, size_t freespace)
 {
 	rlm_idn_t *inst = instance;
 	char *idna = NULL;
 	int res;
+	ssize_t cached;
 	size_t len;
 	int flags = 0;
 
+	if (inst->cache) {
+		IDN_LOCK(inst);
+		cached = idn_cache_find(inst, fmt, &res, out, freespace);
+		IDN_UNLOCK(inst);
+
+		if (cached >= 0) {
+			if (res) {
+				REDEBUG("%s", idna_strerror(res));
+				return -1;
+			}
+
+			len = cached;
+			goto check;
+		}
+	}
+
 	if (inst->use_std3_ascii_rules) {
 		flags |= IDNA_USE_STD3_ASCII_RULES;
 	}
@@ -108,25 +246,36 @@ static ssize_t xlat_idna(void *instance, UNUSED REQUEST *request, char const *fm
 			free (idna); /* Docs unclear, be safe. */
 		}
 
+		if (inst->cache) {
+			IDN_LOCK(inst);
+			idn_cache_add(inst, fmt, res, NULL);
+			IDN_UNLOCK(inst);
+		}
+
 		REDEBUG("%s", idna_strerror(res));
 		return -1;
 	}
 
-	len = strlen(idna);
+	if (inst->cache) {
+		IDN_LOCK(inst);
+		idn_cache_add(inst, fmt, res, idna);
+		IDN_UNLOCK(inst);
+	}
+
+	len = strlcpy(out, idna, freespace);
+	free(idna);
 
+check:
 	/* 253 is max DNS length */
 	if (!((len < (freespace - 1)) && (len <= 253))) {
 		/* Never provide a truncated result, as it may be queried. */
 		REDEBUG("Conversion was truncated");
 
-		free(idna);
+		*out = '\0';
 		return -1;
 
 	}
 
-	strlcpy(out, idna, freespace);
-	free(idna);
-
 	return len;
 }
 
@@ -142,11 +291,37 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 
 	inst->xlat_name = xlat_name;
 
+	if (inst->cache_size > 0) {
+		inst->cache = fr_hash_table_create(idn_cache_hash, idn_cache_cmp, idn_cache_free);
+		if (!inst->cache) {
+			cf_log_err_cs(conf, "Failed creating conversion cache");
+			return -1;
+		}
+
+#ifdef HAVE_PTHREAD_H
+		pthread_mutex_init(&inst->mutex, NULL);
+#endif
+	}
+
 	xlat_register(inst->xlat_name, xlat_idna, NULL, inst);
 
 	return 0;
 }
 
+static int mod_detach(void *instance)
+{
+	rlm_idn_t *inst = instance;
+
+	if (!inst->cache) return 0;
+
+	fr_hash_table_free(inst->cache);
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_destroy(&inst->mutex);
+#endif
+
+	return 0;
+}
+
 module_t rlm_idn = {
 	RLM_MODULE_INIT,
 	"idn",
@@ -154,7 +329,7 @@ module_t rlm_idn = {
 	sizeof(rlm_idn_t),
 	mod_config,			/* CONF_PARSER */
 	mod_instantiate,		/* instantiation */
-	NULL,				/* detach */
+	mod_detach,			/* detach */
 	{
 		NULL,		 	/* authentication */
 		NULL,			/* authorization */
@@ -169,4 +344,8 @@ module_t rlm_idn = {
 		NULL
 #endif
 	},
+	0,				/* thread_inst_size */
+	NULL,				/* thread_instantiate */
+	NULL,				/* thread_detach */
+	NULL				/* cache_flush */
 };
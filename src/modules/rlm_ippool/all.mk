@@ -0,0 +1 @@
+SUBMAKEFILES		:= rlm_ippool.mk rlm_ippool_tool.mk
@@ -16,7 +16,7 @@
 /**
  * $Id$
  * @file rlm_ippool.c
- * @brief Allocates an IPv4 address from a pool stored in a GDBM database.
+ * @brief Allocates an IPv4 address from a pool stored in a memory mapped file.
  *
  * @copyright 2000,2006  The FreeRADIUS server project
  * @copyright 2002  Kostas Kalevras <kkalev@noc.ntua.gr>
@@ -27,8 +27,10 @@ RCSID("$Id$")
 #include <freeradius-devel/modules.h>
 #include <freeradius-devel/rad_assert.h>
 
-#include "config.h"
 #include <ctype.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #ifdef WITH_DHCP
 #include <freeradius-devel/dhcp.h>
@@ -36,21 +38,7 @@ RCSID("$Id$")
 
 #include "../../include/md5.h"
 
-#include <gdbm.h>
-
-#ifdef NEEDS_GDBM_SYNC
-#	define GDBM_SYNCOPT GDBM_SYNC
-#else
-#	define GDBM_SYNCOPT 0
-#endif
-
-#ifdef GDBM_NOLOCK
-#define GDBM_IPPOOL_OPTS (GDBM_SYNCOPT | GDBM_NOLOCK)
-#else
-#define GDBM_IPPOOL_OPTS (GDBM_SYNCOPT)
-#endif
-
-#define MAX_NAS_NAME_SIZE 64
+#include "rlm_ippool.h"
 
 /*
  *	Define a structure for our module configuration.
@@ -73,12 +61,30 @@ typedef struct rlm_ippool_t {
 	uint32_t	netmask;
 
 	uint32_t	max_timeout;
-	uint32_t	cache_size;
 	bool		override;
-	GDBM_FILE	gdbm;
-	GDBM_FILE	ip;
+
+	int		fd;
+	size_t		size;
+	uint8_t		*map;			//!< The whole pool file.
+	ippool_header_t	*header;
+	ippool_entry_t	*entries;
+	uint64_t	*free;
+	ippool_slot_t	*slots;
+
+	uint32_t	num_entries;
+	uint32_t	free_words;
+	uint32_t	free_hint;		//!< Word where the last free entry was found.
+	uint32_t	stripe_size;		//!< Slots in each index table.
+	uint32_t	stripe_used[IPPOOL_STRIPES];	//!< Slots which aren't empty.
+	time_t		last_sweep;
+
 #ifdef HAVE_PTHREAD_H
-	pthread_mutex_t op_mutex;
+	pthread_mutex_t	key_mutex[IPPOOL_STRIPES];	//!< One per index table.
+	pthread_mutex_t	entry_mutex[IPPOOL_STRIPES];	//!< Entry n uses n % IPPOOL_STRIPES.
+	pthread_mutex_t	sweep_mutex;
+#  ifndef __ATOMIC_ACQUIRE
+	pthread_mutex_t	free_mutex;
+#  endif
 #endif
 } rlm_ippool_t;
 
@@ -89,28 +95,55 @@ typedef struct rlm_ippool_t {
 #define pthread_mutex_init(_x, _y)
 #define pthread_mutex_destroy(_x)
 #define pthread_mutex_lock(_x)
+#define pthread_mutex_trylock(_x) (0)
 #define pthread_mutex_unlock(_x)
 #endif
 
-typedef struct ippool_info {
-	uint32_t	ipaddr;
-	char		active;
-	char		cli[32];
-	char		extra;
-	time_t		timestamp;
-	time_t		timeout;
-} ippool_info;
+#define ENTRY_LOCK(_inst, _n)	pthread_mutex_lock(&(_inst)->entry_mutex[(_n) & (IPPOOL_STRIPES - 1)])
+#define ENTRY_UNLOCK(_inst, _n)	pthread_mutex_unlock(&(_inst)->entry_mutex[(_n) & (IPPOOL_STRIPES - 1)])
 
-typedef struct ippool_key {
-	char key[16];
-} ippool_key;
+/*
+ *	Entries are taken from the free bitmap with a CAS on the word
+ *	holding their bit, so allocations only need the mutexes of the
+ *	index table and the entry they change.
+ *
+ *	If the compiler doesn't have the __atomic builtins, we fall
+ *	back to a mutex around the same code.
+ */
+#ifdef __ATOMIC_ACQUIRE
+#  define FREE_LOAD(_x)		__atomic_load_n(&(_x), __ATOMIC_ACQUIRE)
+#  define FREE_STORE_RELAXED(_x, _v) __atomic_store_n(&(_x), _v, __ATOMIC_RELAXED)
+#  define FREE_CAS(_x, _old, _new) __atomic_compare_exchange_n(&(_x), &(_old), _new, true, \
+							   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+#  define FREE_SET(_x, _bit)	__atomic_fetch_or(&(_x), _bit, __ATOMIC_RELEASE)
+#  define FREE_FIRST(_v)	((uint32_t) __builtin_ctzll(_v))
+#  define FREE_LOCK(_inst)
+#  define FREE_UNLOCK(_inst)
+#else
+#  define FREE_LOAD(_x)		(_x)
+#  define FREE_STORE_RELAXED(_x, _v) ((_x) = (_v))
+#  define FREE_CAS(_x, _old, _new) (((_x) == (_old)) ? ((_x) = (_new), true) : ((_old) = (_x), false))
+#  define FREE_SET(_x, _bit)	((_x) |= (_bit))
+#  define FREE_FIRST(_v)	free_first(_v)
+#  define FREE_LOCK(_inst)	pthread_mutex_lock(&(_inst)->free_mutex)
+#  define FREE_UNLOCK(_inst)	pthread_mutex_unlock(&(_inst)->free_mutex)
+
+static uint32_t free_first(uint64_t v)
+{
+	uint32_t i;
+
+	for (i = 0; !(v & 1); i++) v >>= 1;
+
+	return i;
+}
+#endif
 
 static const CONF_PARSER module_config[] = {
 	{ "session-db", FR_CONF_OFFSET(PW_TYPE_FILE_OUTPUT | PW_TYPE_DEPRECATED, rlm_ippool_t, filename), NULL },
 	{ "filename", FR_CONF_OFFSET(PW_TYPE_FILE_OUTPUT | PW_TYPE_REQUIRED, rlm_ippool_t, filename), NULL },
 
 	{ "ip-index", FR_CONF_OFFSET(PW_TYPE_STRING | PW_TYPE_DEPRECATED, rlm_ippool_t, ip_index), NULL },
-	{ "ip_index", FR_CONF_OFFSET(PW_TYPE_STRING | PW_TYPE_REQUIRED, rlm_ippool_t, ip_index), NULL },
+	{ "ip_index", FR_CONF_OFFSET(PW_TYPE_STRING, rlm_ippool_t, ip_index), NULL },
 
 	{ "key", FR_CONF_OFFSET(PW_TYPE_STRING | PW_TYPE_REQUIRED | PW_TYPE_XLAT, rlm_ippool_t, key), "%{NAS-IP-Address} %{NAS-Port}" },
 
@@ -122,9 +155,6 @@ static const CONF_PARSER module_config[] = {
 
 	{ "netmask", FR_CONF_OFFSET(PW_TYPE_IPV4_ADDR, rlm_ippool_t, netmask_addr), "0" },
 
-	{ "cache-size", FR_CONF_OFFSET(PW_TYPE_INTEGER | PW_TYPE_DEPRECATED, rlm_ippool_t, cache_size), NULL },
-	{ "cache_size", FR_CONF_OFFSET(PW_TYPE_INTEGER, rlm_ippool_t, cache_size), "1000" },
-
 	{ "override", FR_CONF_OFFSET(PW_TYPE_BOOLEAN, rlm_ippool_t, override), "no" },
 
 	{ "maximum-timeout", FR_CONF_OFFSET(PW_TYPE_INTEGER | PW_TYPE_DEPRECATED, rlm_ippool_t, max_timeout), NULL },
@@ -133,187 +163,623 @@ static const CONF_PARSER module_config[] = {
 	{ NULL, -1, 0, NULL, NULL }
 };
 
+static uint8_t const zero_key[16];
+
+/** Hash a string to the 16 byte key used in the index
+ *
+ */
+static void ippool_md5(uint8_t *out, char const *in)
+{
+	FR_MD5_CTX md5_context;
+
+	fr_md5_init(&md5_context);
+	fr_md5_update(&md5_context, (uint8_t const *) in, strlen(in));
+	fr_md5_final(out, &md5_context);
+}
+
+/** Whether an address in the range is the network or broadcast address
+ *
+ */
+static bool ippool_excluded(rlm_ippool_t const *inst, uint32_t ip)
+{
+	uint32_t or_result = ip | inst->netmask;
+
+	return (~inst->netmask != 0) && ((or_result == inst->netmask) || (~or_result == 0));
+}
+
 /*
- *	Do any per-module initialization that is separate to each
- *	configured instance of the module.  e.g. set up connections
- *	to external databases, read configuration files, set up
- *	dictionary entries, etc.
+ *	The MD5 keys are already well distributed, so the first four
+ *	bytes pick the index table, and the slot to start probing at.
+ */
+static uint32_t key_stripe(uint8_t const *key)
+{
+	uint32_t hash;
+
+	memcpy(&hash, key, sizeof(hash));
+
+	return hash & (IPPOOL_STRIPES - 1);
+}
+
+static uint32_t key_start(rlm_ippool_t const *inst, uint8_t const *key)
+{
+	uint32_t hash;
+
+	memcpy(&hash, key, sizeof(hash));
+
+	return (hash / IPPOOL_STRIPES) & (inst->stripe_size - 1);
+}
+
+/** Lock the index tables for a key and a Calling-Station-Id
  *
- *	If configuration information is given in the config section
- *	that must be referenced in later calls, store a handle to it
- *	in *instance otherwise put a null pointer there.
+ * They're always locked in the same order, so two requests can't deadlock.
+ * Entry mutexes are only ever taken after these.
  */
-static int mod_instantiate(CONF_SECTION *conf, void *instance)
+static void keys_lock(rlm_ippool_t *inst, uint32_t a, uint32_t b)
 {
-	rlm_ippool_t	*inst = instance;
-	int		cache_size;
-	ippool_info	entry;
-	ippool_key	key;
-	datum		key_datum;
-	datum		data_datum;
+	if (a > b) {
+		uint32_t tmp = a;
+		a = b;
+		b = tmp;
+	}
 
-	char const	*cli = "0";
-	char const	*pool_name = NULL;
+	pthread_mutex_lock(&inst->key_mutex[a]);
+	if (a != b) pthread_mutex_lock(&inst->key_mutex[b]);
+}
 
-	int		rcode;
-	uint32_t	i, j;
-	uint32_t	or_result;
-	char		str[32];
-	char		init_str[17];
+static void keys_unlock(rlm_ippool_t *inst, uint32_t a, uint32_t b)
+{
+	pthread_mutex_unlock(&inst->key_mutex[a]);
+	if (a != b) pthread_mutex_unlock(&inst->key_mutex[b]);
+}
+
+/** Take any free entry from the bitmap
+ *
+ * The search starts at the word where the last free entry was found,
+ * so most allocations look at one or two words.
+ */
+static bool entry_claim(rlm_ippool_t *inst, uint32_t *out)
+{
+	uint32_t i, start;
+
+	start = FREE_LOAD(inst->free_hint);
+
+	FREE_LOCK(inst);
+	for (i = 0; i < inst->free_words; i++) {
+		uint32_t word = (start + i) % inst->free_words;
+		uint64_t v = FREE_LOAD(inst->free[word]);
+
+		while (v) {
+			uint32_t n = (word * 64) + FREE_FIRST(v);
+
+			if (FREE_CAS(inst->free[word], v, v & ~IPPOOL_FREE_BIT(n))) {
+				FREE_UNLOCK(inst);
+				FREE_STORE_RELAXED(inst->free_hint, word);
+				*out = n;
+				return true;
+			}
+		}
+	}
+	FREE_UNLOCK(inst);
+
+	return false;
+}
+
+/** Take a particular entry from the bitmap, if it's free
+ *
+ */
+static bool entry_claim_one(rlm_ippool_t *inst, uint32_t n)
+{
+	uint64_t v;
+
+	FREE_LOCK(inst);
+	v = FREE_LOAD(inst->free[n / 64]);
+	while (v & IPPOOL_FREE_BIT(n)) {
+		if (FREE_CAS(inst->free[n / 64], v, v & ~IPPOOL_FREE_BIT(n))) {
+			FREE_UNLOCK(inst);
+			return true;
+		}
+	}
+	FREE_UNLOCK(inst);
+
+	return false;
+}
+
+static void entry_free(rlm_ippool_t *inst, uint32_t n)
+{
+	FREE_LOCK(inst);
+	FREE_SET(inst->free[n / 64], IPPOOL_FREE_BIT(n));
+	FREE_UNLOCK(inst);
+}
+
+/** Whether a slot still refers to its entry
+ *
+ * Must be called with the mutex for the entry held.
+ */
+static bool slot_valid(rlm_ippool_t const *inst, ippool_slot_t const *slot)
+{
+	ippool_entry_t const *entry;
+
+	if ((slot->entry == IPPOOL_SLOT_EMPTY) || (slot->entry > inst->num_entries)) return false;
+
+	entry = &inst->entries[slot->entry - 1];
+	if (slot->generation != entry->generation) return false;
+
+	if (slot->type == IPPOOL_SLOT_CLI) return entry->active;
 
 	/*
-	 *  Add the ip pool name
+	 *	The key the entry was last given to always refers to
+	 *	it, so the key can be given the same address again.
+	 *	Multilink sessions only refer to it while active.
 	 */
-	inst->name = NULL;
-	pool_name = cf_section_name2(conf);
-	if (pool_name != NULL) {
-		inst->name = talloc_typed_strdup(inst, pool_name);
-	}
+	if (memcmp(slot->key, entry->key, sizeof(entry->key)) == 0) return true;
 
-	cache_size = inst->cache_size;
+	return slot->active && entry->active;
+}
 
-	rad_assert(inst->filename && *inst->filename);
-	rad_assert(inst->ip_index && *inst->ip_index);
+/** Find the slot for a key in its index table
+ *
+ * Must be called with the mutex for the table held.
+ */
+static ippool_slot_t *slot_find(rlm_ippool_t *inst, uint8_t const *key, uint8_t type)
+{
+	ippool_slot_t	*table;
+	uint32_t	i, start;
 
-	inst->range_start = htonl(*((uint32_t *)(&(inst->range_start_addr.ipaddr.ip4addr))));
-	inst->range_stop = htonl(*((uint32_t *)(&(inst->range_stop_addr.ipaddr.ip4addr))));
-	inst->netmask = htonl(*((uint32_t *)(&(inst->netmask_addr.ipaddr.ip4addr))));
-	if (inst->range_start == 0 || inst->range_stop == 0 || \
-	    inst->range_start >= inst->range_stop ) {
-		cf_log_err_cs(conf, "Invalid data range");
-		return -1;
-	}
+	table = inst->slots + (key_stripe(key) * inst->stripe_size);
+	start = key_start(inst, key);
 
-	{
-		char *file;
+	for (i = 0; i < inst->stripe_size; i++) {
+		ippool_slot_t *slot = &table[(start + i) & (inst->stripe_size - 1)];
 
-		memcpy(&file, &inst->filename, sizeof(file));
-		inst->gdbm = gdbm_open(file, sizeof(int),
-				       GDBM_WRCREAT | GDBM_IPPOOL_OPTS, 0600, NULL);
+		if (slot->entry == IPPOOL_SLOT_EMPTY) return NULL;
+		if (slot->entry == IPPOOL_SLOT_DELETED) continue;
+
+		if ((slot->type == type) && (memcmp(slot->key, key, sizeof(slot->key)) == 0)) return slot;
 	}
 
-	if (!inst->gdbm) {
-		ERROR("rlm_ippool: Failed to open file %s: %s", inst->filename, fr_syserror(errno));
+	return NULL;
+}
 
-		return -1;
+/** Remove deleted and stale slots from an index table
+ *
+ * Called when the table is getting full.  Must be called with the
+ * mutex for the table held.
+ */
+static void stripe_compact(rlm_ippool_t *inst, uint32_t stripe)
+{
+	ippool_slot_t	*table, *live;
+	uint32_t	i, num = 0;
+
+	table = inst->slots + (stripe * inst->stripe_size);
+
+	live = talloc_array(NULL, ippool_slot_t, inst->stripe_size);
+	if (!live) return;
+
+	for (i = 0; i < inst->stripe_size; i++) {
+		bool valid;
+		uint32_t n;
+
+		if ((table[i].entry == IPPOOL_SLOT_EMPTY) || (table[i].entry == IPPOOL_SLOT_DELETED)) continue;
+
+		n = table[i].entry - 1;
+		ENTRY_LOCK(inst, n);
+		valid = slot_valid(inst, &table[i]);
+		ENTRY_UNLOCK(inst, n);
+
+		if (valid) live[num++] = table[i];
 	}
 
-	{
-		char *file;
+	memset(table, 0, inst->stripe_size * sizeof(*table));
 
-		memcpy(&file, &inst->ip_index, sizeof(file));
-		inst->ip = gdbm_open(file, sizeof(int),
-				     GDBM_WRCREAT | GDBM_IPPOOL_OPTS, 0600, NULL);
+	for (i = 0; i < num; i++) {
+		uint32_t j = key_start(inst, live[i].key);
+
+		while (table[j].entry != IPPOOL_SLOT_EMPTY) j = (j + 1) & (inst->stripe_size - 1);
+		table[j] = live[i];
 	}
 
-	if (!inst->ip) {
-		ERROR("rlm_ippool: Failed to open file %s: %s", inst->ip_index, fr_syserror(errno));
+	DEBUG3("rlm_ippool: Index table %u now has %u of %u slots in use", stripe, num, inst->stripe_size);
+	inst->stripe_used[stripe] = num;
 
-		return -1;
+	talloc_free(live);
+}
+
+/** Find or add the slot for a key
+ *
+ * A new slot refers to no entry, and the caller has to fill it in.
+ * Must be called with the mutex for the table held.
+ */
+static ippool_slot_t *slot_insert(rlm_ippool_t *inst, uint8_t const *key, uint8_t type)
+{
+	ippool_slot_t	*table, *slot;
+	uint32_t	i, start, stripe;
+	bool		compacted = false;
+
+	stripe = key_stripe(key);
+	table = inst->slots + (stripe * inst->stripe_size);
+	start = key_start(inst, key);
+
+again:
+	slot = NULL;
+	for (i = 0; i < inst->stripe_size; i++) {
+		ippool_slot_t *this = &table[(start + i) & (inst->stripe_size - 1)];
+
+		if (this->entry == IPPOOL_SLOT_EMPTY) {
+			if (slot) break;
+
+			/*
+			 *	Keep a quarter of each table empty, so
+			 *	lookups for keys which aren't there stay
+			 *	short.
+			 */
+			if (!compacted && ((inst->stripe_used[stripe] + 1) * 4 > inst->stripe_size * 3)) {
+				stripe_compact(inst, stripe);
+				compacted = true;
+				goto again;
+			}
+
+			slot = this;
+			inst->stripe_used[stripe]++;
+			break;
+		}
+
+		if (this->entry == IPPOOL_SLOT_DELETED) {
+			if (!slot) slot = this;
+			continue;
+		}
+
+		if ((this->type == type) && (memcmp(this->key, key, sizeof(this->key)) == 0)) return this;
 	}
 
-	if (gdbm_setopt(inst->gdbm, GDBM_CACHESIZE, &cache_size, sizeof(int)) == -1) {
-		ERROR("rlm_ippool: Failed to set cache size");
+	if (!slot) return NULL;
+
+	memcpy(slot->key, key, sizeof(slot->key));
+	slot->type = type;
+	slot->entry = IPPOOL_SLOT_DELETED;
+	slot->generation = 0;
+	slot->active = 0;
+
+	return slot;
+}
+
+/** Release one session on the entry a key slot refers to
+ *
+ * Must be called with the mutex for the slot's table held.
+ *
+ * @return true if the key had an active session, else false.
+ */
+static bool entry_release(rlm_ippool_t *inst, ippool_slot_t *slot, uint32_t *ipaddr)
+{
+	ippool_entry_t	*entry;
+	uint32_t	n;
+	bool		released = false, owner;
+
+	if ((slot->entry == IPPOOL_SLOT_DELETED) || (slot->entry > inst->num_entries)) return false;
+
+	n = slot->entry - 1;
+	entry = &inst->entries[n];
+
+	ENTRY_LOCK(inst, n);
+	owner = (slot->generation == entry->generation) &&
+		(memcmp(slot->key, entry->key, sizeof(entry->key)) == 0);
+
+	if (slot->active && slot_valid(inst, slot) && entry->active) {
+		released = true;
+		*ipaddr = entry->ipaddr;
+
+		if (entry->sessions > 0) entry->sessions--;
+		if (entry->sessions == 0) {
+			entry->active = 0;
+			entry->timestamp = 0;
+			entry->timeout = 0;
+			entry_free(inst, n);
+		}
 	}
+	ENTRY_UNLOCK(inst, n);
+
+	slot->active = 0;
+	if (!owner) slot->entry = IPPOOL_SLOT_DELETED;
+
+	return released;
+}
 
-	if (gdbm_setopt(inst->ip, GDBM_CACHESIZE, &cache_size, sizeof(int)) == -1) {
-		ERROR("rlm_ippool: Failed to set cache size");
+/** Free entries whose sessions have timed out
+ *
+ * Only done when there are no free entries, and at most once a second.
+ */
+static void entry_sweep(rlm_ippool_t *inst, time_t now)
+{
+	uint32_t i, num = 0;
+
+	if (pthread_mutex_trylock(&inst->sweep_mutex) != 0) return;
+
+	if (inst->last_sweep == now) {
+		pthread_mutex_unlock(&inst->sweep_mutex);
+		return;
 	}
+	inst->last_sweep = now;
+
+	for (i = 0; i < inst->num_entries; i++) {
+		ippool_entry_t *entry = &inst->entries[i];
+
+		ENTRY_LOCK(inst, i);
+		if (entry->active && entry->timestamp &&
+		    ((entry->timeout && (now >= (entry->timestamp + entry->timeout))) ||
+		     (inst->max_timeout && (now >= (entry->timestamp + inst->max_timeout))))) {
+			entry->active = 0;
+			entry->sessions = 0;
+			entry->timestamp = 0;
+			entry->timeout = 0;
+			entry->generation++;	/* Every slot referring to it is now stale */
+			entry_free(inst, i);
+			num++;
+		}
+		ENTRY_UNLOCK(inst, i);
+	}
+	pthread_mutex_unlock(&inst->sweep_mutex);
+
+	if (num) DEBUG("rlm_ippool: Freed %u expired entries", num);
+}
+
+/** Recreate the free bitmap and the index from the entries
+ *
+ * Done when the file is created, or wasn't closed cleanly.  Multilink
+ * sessions are lost, and each active entry ends up with one session.
+ */
+static void ippool_rebuild(rlm_ippool_t *inst)
+{
+	uint32_t i;
+
+	memset(inst->free, 0, inst->free_words * sizeof(*inst->free));
+	memset(inst->slots, 0, inst->header->num_slots * sizeof(*inst->slots));
+	memset(inst->stripe_used, 0, sizeof(inst->stripe_used));
+
+	for (i = 0; i < inst->num_entries; i++) {
+		ippool_entry_t	*entry = &inst->entries[i];
+		ippool_slot_t	*slot;
+
+		if (!entry->active) {
+			entry->sessions = 0;
+			entry_free(inst, i);
+			if (memcmp(entry->key, zero_key, sizeof(zero_key)) == 0) continue;
+		} else {
+			entry->sessions = 1;
+		}
+
+		slot = slot_insert(inst, entry->key, IPPOOL_SLOT_KEY);
+		if (!slot) continue;
+
+		/*
+		 *	An address which was given to the key more recently
+		 *	may already be there.  Prefer the active one.
+		 */
+		if ((slot->entry != IPPOOL_SLOT_DELETED) && slot->active && !entry->active) continue;
 
-	pthread_mutex_init(&inst->op_mutex, NULL);
+		slot->entry = i + 1;
+		slot->generation = entry->generation;
+		slot->active = entry->active;
 
-	key_datum = gdbm_firstkey(inst->gdbm);
-	if (key_datum.dptr) {
-		free(key_datum.dptr);
-		return 0;
+		if (entry->active && entry->cli[0]) {
+			uint8_t cli_key[16];
+
+			entry->cli[sizeof(entry->cli) - 1] = '\0';
+			ippool_md5(cli_key, entry->cli);
+
+			slot = slot_insert(inst, cli_key, IPPOOL_SLOT_CLI);
+			if (!slot) continue;
+
+			slot->entry = i + 1;
+			slot->generation = entry->generation;
+		}
+	}
+}
+
+/** Work out where everything goes in the pool file
+ *
+ */
+static void ippool_layout(rlm_ippool_t const *inst, ippool_header_t *header)
+{
+	uint64_t	ip;
+	uint32_t	stripe_size = 16;
+
+	memset(header, 0, sizeof(*header));
+	header->magic = IPPOOL_MAGIC;
+	header->version = IPPOOL_VERSION;
+	header->range_start = inst->range_start;
+	header->range_stop = inst->range_stop;
+	header->netmask = inst->netmask;
+
+	for (ip = inst->range_start; ip <= inst->range_stop; ip++) {
+		if (!ippool_excluded(inst, ip)) header->num_entries++;
 	}
 
 	/*
-	 *  If the database does not exist initialize it.
-	 *  We set the nas/port pairs to not existent values and
-	 *  active = 0
+	 *	Each address can be referred to by its key, the
+	 *	Calling-Station-Id, and multilink keys, so start with
+	 *	room for four slots per address.
 	 */
-	DEBUG("rlm_ippool: Initializing database");
-	for (i = inst->range_start, j=~0; i <= inst->range_stop; i++, j--){
+	while ((uint64_t) stripe_size * IPPOOL_STRIPES < (uint64_t) header->num_entries * 4) stripe_size <<= 1;
+	header->num_slots = stripe_size * IPPOOL_STRIPES;
+
+	header->entries_offset = (sizeof(*header) + 63) & ~((uint64_t) 63);
+	header->free_offset = header->entries_offset + (((uint64_t) header->num_entries * sizeof(ippool_entry_t) + 63) & ~((uint64_t) 63));
+	header->slots_offset = header->free_offset + ((uint64_t) IPPOOL_FREE_WORDS(header->num_entries) * sizeof(uint64_t));
+	header->size = header->slots_offset + ((uint64_t) header->num_slots * sizeof(ippool_slot_t));
+}
+
+/** Open (or create) and map the pool file
+ *
+ */
+static int ippool_open(rlm_ippool_t *inst)
+{
+	ippool_header_t	header, expected;
+	struct stat	buf;
+	bool		create;
+	uint32_t	i;
+	uint64_t	ip;
+	void		*map;
+
+	ippool_layout(inst, &expected);
+
+	inst->fd = open(inst->filename, O_RDWR | O_CREAT, 0600);
+	if (inst->fd < 0) {
+		ERROR("rlm_ippool: Failed to open file %s: %s", inst->filename, fr_syserror(errno));
+		return -1;
+	}
+
+	if (rad_lockfd_nonblock(inst->fd, 0) < 0) {
+		ERROR("rlm_ippool: Failed to lock file %s, it may be in use by another process: %s",
+		      inst->filename, fr_syserror(errno));
+	error:
+		close(inst->fd);
+		inst->fd = -1;
+		return -1;
+	}
+
+	if (fstat(inst->fd, &buf) < 0) {
+		ERROR("rlm_ippool: Failed to stat file %s: %s", inst->filename, fr_syserror(errno));
+		goto error;
+	}
+
+	create = (buf.st_size == 0);
+	if (create) {
+		DEBUG("rlm_ippool: Initializing database");
+		if (ftruncate(inst->fd, expected.size) < 0) {
+			ERROR("rlm_ippool: Failed to extend file %s: %s", inst->filename, fr_syserror(errno));
+			goto error;
+		}
+	} else {
+		if ((read(inst->fd, &header, sizeof(header)) != sizeof(header)) ||
+		    (header.magic != IPPOOL_MAGIC)) {
+			ERROR("rlm_ippool: File %s is not an ippool file.  If it was created by an "
+			      "older version of the server, remove it and it will be re-created", inst->filename);
+			goto error;
+		}
+
+		if (header.version != IPPOOL_VERSION) {
+			ERROR("rlm_ippool: File %s has version %u, expected %u", inst->filename,
+			      header.version, IPPOOL_VERSION);
+			goto error;
+		}
+
 		/*
-		 *  Net and Broadcast addresses are excluded
+		 *	The layout depends only on the range, so a file
+		 *	for this range must match it exactly.
 		 */
-		or_result = i | inst->netmask;
-		if (~inst->netmask != 0 && (or_result == inst->netmask || (~or_result == 0))) {
-			DEBUG("rlm_ippool: IP %s excluded", ip_ntoa(str, ntohl(i)));
-			continue;
+		if ((header.range_start != expected.range_start) || (header.range_stop != expected.range_stop) ||
+		    (header.netmask != expected.netmask) || (header.num_entries != expected.num_entries) ||
+		    (header.num_slots != expected.num_slots) ||
+		    (header.entries_offset != expected.entries_offset) ||
+		    (header.free_offset != expected.free_offset) ||
+		    (header.slots_offset != expected.slots_offset) || (header.size != expected.size) ||
+		    ((uint64_t) buf.st_size != expected.size)) {
+			ERROR("rlm_ippool: File %s was created for a different range or netmask.  "
+			      "Remove it, and it will be re-created", inst->filename);
+			goto error;
 		}
+	}
 
-		sprintf(init_str,"%016d",j);
-		DEBUG("rlm_ippool: Initialized bucket: %s",init_str);
-		memcpy(key.key, init_str,16);
-		key_datum.dptr = (char *) &key;
-		key_datum.dsize = sizeof(ippool_key);
-
-		entry.ipaddr = ntohl(i);
-		entry.active = 0;
-		entry.extra = 0;
-		entry.timestamp = 0;
-		entry.timeout = 0;
-		strcpy(entry.cli,cli);
-
-		data_datum.dptr = (char *) &entry;
-		data_datum.dsize = sizeof(ippool_info);
-
-		rcode = gdbm_store(inst->gdbm, key_datum, data_datum, GDBM_REPLACE);
-		if (rcode < 0) {
-			ERROR("rlm_ippool: Failed storing data to %s: %s", inst->filename, gdbm_strerror(gdbm_errno));
-			gdbm_close(inst->gdbm);
-			gdbm_close(inst->ip);
-			return -1;
+	map = mmap(NULL, expected.size, PROT_READ | PROT_WRITE, MAP_SHARED, inst->fd, 0);
+	if (map == MAP_FAILED) {
+		ERROR("rlm_ippool: Failed to map file %s: %s", inst->filename, fr_syserror(errno));
+		goto error;
+	}
+
+	inst->map = map;
+	inst->size = expected.size;
+	inst->header = map;
+	inst->entries = (ippool_entry_t *) (inst->map + expected.entries_offset);
+	inst->free = (uint64_t *) (inst->map + expected.free_offset);
+	inst->slots = (ippool_slot_t *) (inst->map + expected.slots_offset);
+	inst->num_entries = expected.num_entries;
+	inst->free_words = IPPOOL_FREE_WORDS(expected.num_entries);
+	inst->stripe_size = expected.num_slots / IPPOOL_STRIPES;
+
+	if (create) {
+		*inst->header = expected;
+
+		for (ip = inst->range_start, i = 0; ip <= inst->range_stop; ip++) {
+			char str[32];
+
+			if (ippool_excluded(inst, ip)) {
+				DEBUG("rlm_ippool: IP %s excluded", ip_ntoa(str, ntohl(ip)));
+				continue;
+			}
+			inst->entries[i++].ipaddr = ntohl(ip);
 		}
 	}
 
+	if (!inst->header->clean) {
+		if (!create) WARN("rlm_ippool: File %s was not closed cleanly, rebuilding its index", inst->filename);
+		ippool_rebuild(inst);
+	} else {
+		for (i = 0; i < inst->header->num_slots; i++) {
+			if (inst->slots[i].entry != IPPOOL_SLOT_EMPTY) inst->stripe_used[i / inst->stripe_size]++;
+		}
+	}
+
+	/*
+	 *	Until it's closed, the file may not agree with itself.
+	 */
+	inst->header->clean = 0;
+	msync(inst->map, sizeof(*inst->header), MS_SYNC);
+
 	return 0;
 }
 
-/** Decrease allocated count from the ip index
+/*
+ *	Do any per-module initialization that is separate to each
+ *	configured instance of the module.  e.g. set up connections
+ *	to external databases, read configuration files, set up
+ *	dictionary entries, etc.
  *
+ *	If configuration information is given in the config section
+ *	that must be referenced in later calls, store a handle to it
+ *	in *instance otherwise put a null pointer there.
  */
-static int decrease_allocated_count(rlm_ippool_t *inst, REQUEST *request, ippool_info *entry, datum *save_datum)
+static int mod_instantiate(CONF_SECTION *conf, void *instance)
 {
-	datum		data_datum;
-	datum		key_datum;
-	int		num;
-
-
-	key_datum.dptr = (char *) &(entry->ipaddr);
-	key_datum.dsize = sizeof(uint32_t);
-	data_datum = gdbm_fetch(inst->ip, key_datum);
-	if (!data_datum.dptr) {
-		return 0;
-	}
-	memcpy(&num, data_datum.dptr, sizeof(int));
-	free(data_datum.dptr);
-	if (num > 0){
-		int	rcode;
-
-		num--;
-
-		RDEBUG("Allocated count now: %i", num);
-		data_datum.dptr = (char *) &num;
-		data_datum.dsize = sizeof(int);
-		rcode = gdbm_store(inst->ip, key_datum, data_datum, GDBM_REPLACE);
-		if (rcode < 0) {
-			RDEBUG("Failed storing data to %s: %s", inst->ip_index, gdbm_strerror(gdbm_errno));
-			return -1;
-		}
-		if ((num > 0) && entry->extra == 1){
-			/*
-			 * We are doing MPPP and we still have nas/port entries referencing
-			 * this ip. Delete this entry so that eventually we only keep one
-			 * reference to this ip.
-			 */
-			gdbm_delete(inst->gdbm, *save_datum);
-		}
+	rlm_ippool_t	*inst = instance;
+	char const	*pool_name = NULL;
+	int		i;
+
+	inst->fd = -1;
+
+	/*
+	 *  Add the ip pool name
+	 */
+	inst->name = NULL;
+	pool_name = cf_section_name2(conf);
+	if (pool_name != NULL) {
+		inst->name = talloc_typed_strdup(inst, pool_name);
 	}
 
-	return 0;
+	rad_assert(inst->filename && *inst->filename);
+
+	if (inst->ip_index) {
+		WARN("rlm_ippool (%s): 'ip_index' is no longer used, and can be removed",
+		     inst->name ? inst->name : cf_section_name1(conf));
+	}
+
+	inst->range_start = htonl(*((uint32_t *)(&(inst->range_start_addr.ipaddr.ip4addr))));
+	inst->range_stop = htonl(*((uint32_t *)(&(inst->range_stop_addr.ipaddr.ip4addr))));
+	inst->netmask = htonl(*((uint32_t *)(&(inst->netmask_addr.ipaddr.ip4addr))));
+	if (inst->range_start == 0 || inst->range_stop == 0 || \
+	    inst->range_start >= inst->range_stop ) {
+		cf_log_err_cs(conf, "Invalid data range");
+		return -1;
+	}
+
+	for (i = 0; i < IPPOOL_STRIPES; i++) {
+		pthread_mutex_init(&inst->key_mutex[i], NULL);
+		pthread_mutex_init(&inst->entry_mutex[i], NULL);
+	}
+	pthread_mutex_init(&inst->sweep_mutex, NULL);
+#if defined(HAVE_PTHREAD_H) && !defined(__ATOMIC_ACQUIRE)
+	pthread_mutex_init(&inst->free_mutex, NULL);
+#endif
+
+	return ippool_open(inst);
 }
 
 
@@ -324,21 +790,16 @@ static int decrease_allocated_count(rlm_ippool_t *inst, REQUEST *request, ippool
 static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, REQUEST *request)
 {
 	rlm_ippool_t	*inst = instance;
+	ippool_slot_t	*slot;
 
-	datum		key_datum;
-	ippool_key	key;
-	datum		data_datum;
-	ippool_info	entry;
-	datum		save_datum;
-
-	int		rcode;
 	VALUE_PAIR	*vp;
 
 	char		str[32];
-	uint8_t		key_str[17];
+	uint8_t		key[16];
 	char		hex_str[35];
 	char		xlat_str[MAX_STRING_LEN];
-	int		ret;
+	uint32_t	stripe, ipaddr;
+	bool		released = false;
 
 	vp = pairfind(request->packet->vps, PW_ACCT_STATUS_TYPE, 0, TAG_ANY);
 	if (!vp) {
@@ -348,24 +809,16 @@ static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, REQUEST *requ
 
 	switch (vp->vp_integer) {
 	case PW_STATUS_STOP:
-	{
-		FR_MD5_CTX md5_context;
 		if (radius_xlat(xlat_str, sizeof(xlat_str), request, inst->key, NULL, NULL) < 0){
 			return RLM_MODULE_FAIL;
 		}
 
-		fr_md5_init(&md5_context);
-		fr_md5_update(&md5_context, (uint8_t *)xlat_str, strlen(xlat_str));
-		fr_md5_final(key_str, &md5_context);
-
-		key_str[16] = '\0';
-		fr_bin2hex(hex_str, key_str, 16);
+		ippool_md5(key, xlat_str);
+		fr_bin2hex(hex_str, key, 16);
 		hex_str[32] = '\0';
 
 		RDEBUG2("MD5 on 'key' directive maps to: %s", hex_str);
-		memcpy(key.key, key_str, 16);
 		break;
-	}
 
 	default:
 		/* We don't care about any other accounting packet */
@@ -375,82 +828,43 @@ static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, REQUEST *requ
 	}
 
 	RDEBUG2("Searching for an entry for key: '%s'", xlat_str);
-	key_datum.dptr = (char *) &key;
-	key_datum.dsize = sizeof(ippool_key);
 
-	pthread_mutex_lock(&inst->op_mutex);
-	data_datum = gdbm_fetch(inst->gdbm, key_datum);
-	if (data_datum.dptr == NULL) {
-		pthread_mutex_unlock(&inst->op_mutex);
+	stripe = key_stripe(key);
+	keys_lock(inst, stripe, stripe);
+	slot = slot_find(inst, key, IPPOOL_SLOT_KEY);
+	if (slot) released = entry_release(inst, slot, &ipaddr);
+	keys_unlock(inst, stripe, stripe);
+
+	if (!released) {
 		RDEBUG2("Entry not found");
 
 		return RLM_MODULE_NOTFOUND;
 	}
 
-	/*
-	 *   If the entry was found set active to zero
-	 */
-	memcpy(&entry, data_datum.dptr, sizeof(ippool_info));
-	free(data_datum.dptr);
-
-	RDEBUG("Deallocated entry for ip: %s", ip_ntoa(str, entry.ipaddr));
-	entry.active = 0;
-	entry.timestamp = 0;
-	entry.timeout = 0;
-
-	/*
-	 *  Save the reference to the entry
-	 */
-	save_datum.dptr = key_datum.dptr;
-	save_datum.dsize = key_datum.dsize;
-
-	data_datum.dptr = (char *) &entry;
-	data_datum.dsize = sizeof(ippool_info);
-	rcode = gdbm_store(inst->gdbm, key_datum, data_datum, GDBM_REPLACE);
-	if (rcode < 0) {
-		pthread_mutex_unlock(&inst->op_mutex);
-		REDEBUG("Failed storing data to %s: %s", inst->filename, gdbm_strerror(gdbm_errno));
-
-		return RLM_MODULE_FAIL;
-	}
-
-	/*
-	 *  Decrease allocated count from the ip index
-	 */
-	ret = decrease_allocated_count(inst, request, &entry, &save_datum);
-	pthread_mutex_unlock(&inst->op_mutex);
-	if (ret < 0) {
-		return RLM_MODULE_FAIL;
-	}
+	RDEBUG("Deallocated entry for ip: %s", ip_ntoa(str, ipaddr));
 
 	return RLM_MODULE_OK;
 }
 
-static rlm_rcode_t CC_HINT(nonnull) mod_post_auth(UNUSED void *instance, UNUSED REQUEST *request)
+static rlm_rcode_t CC_HINT(nonnull) mod_post_auth(void *instance, REQUEST *request)
 {
-	rlm_ippool_t *inst = instance;
-
-	datum		key_datum;
-	ippool_key	key;
-	datum		nextkey;
-	datum		data_datum;
-	ippool_info	entry;
-	datum		save_datum;
-
-	int		delete = 0;
-	bool		found = false;
-	int		mppp = 0;
-	int		extra = 0;
-	int		rcode;
-	int		num = 0;
+	rlm_ippool_t	*inst = instance;
+	ippool_slot_t	*slot, *cli_slot = NULL;
+	ippool_entry_t	*entry;
+
+	bool		mppp = false;
+	bool		claimed = false;
+	uint32_t	n = 0, generation = 0, ipaddr = 0;
+	uint32_t	stripe, cli_stripe;
+	time_t		timeout = 0;
 
 	VALUE_PAIR	*vp;
 	char const	*cli = NULL;
 	char		str[32];
-	uint8_t		key_str[17];
+	uint8_t		key[16];
+	uint8_t		cli_key[16];
 	char		hex_str[35];
 	char		xlat_str[MAX_STRING_LEN];
-	FR_MD5_CTX	md5_context;
 
 #ifdef WITH_DHCP
 	bool dhcp = false;
@@ -493,67 +907,33 @@ static rlm_rcode_t CC_HINT(nonnull) mod_post_auth(UNUSED void *instance, UNUSED
 		return RLM_MODULE_FAIL;
 	}
 
-	fr_md5_init(&md5_context);
-	fr_md5_update(&md5_context, (uint8_t *)xlat_str, strlen(xlat_str));
-	fr_md5_final(key_str, &md5_context);
-	key_str[16] = '\0';
-	fr_bin2hex(hex_str, key_str, 16);
+	ippool_md5(key, xlat_str);
+	fr_bin2hex(hex_str, key, 16);
 	hex_str[32] = '\0';
 
 	RDEBUG("MD5 on 'key' directive maps to: %s", hex_str);
-	memcpy(key.key, key_str, 16);
-
-	RDEBUG("Searching for an entry for key: '%s'", hex_str);
-	key_datum.dptr = (char *) &key;
-	key_datum.dsize = sizeof(ippool_key);
-
-	pthread_mutex_lock(&inst->op_mutex);
-	data_datum = gdbm_fetch(inst->gdbm, key_datum);
-	if (data_datum.dptr != NULL){
-		/*
-		 *  If there is a corresponding entry in the database with active=1 it is stale.
-		 *  Set active to zero
-		 */
-		found = true;
-		memcpy(&entry, data_datum.dptr, sizeof(ippool_info));
-		free(data_datum.dptr);
-
-		if (entry.active){
-			int ret;
-			RDEBUG("Found a stale entry for ip: %s",ip_ntoa(str,entry.ipaddr));
-			entry.active = 0;
-			entry.timestamp = 0;
-			entry.timeout = 0;
 
-			/*
-			 *  Save the reference to the entry
-			 */
-			save_datum.dptr = key_datum.dptr;
-			save_datum.dsize = key_datum.dsize;
+	stripe = cli_stripe = key_stripe(key);
+	if (cli) {
+		ippool_md5(cli_key, cli);
+		cli_stripe = key_stripe(cli_key);
+	}
 
-			data_datum.dptr = (char *) &entry;
-			data_datum.dsize = sizeof(ippool_info);
+	if ((vp = pairfind(request->reply->vps, PW_SESSION_TIMEOUT, 0, TAG_ANY)) != NULL) {
+		timeout = (time_t) vp->vp_integer;
+	}
 
-			rcode = gdbm_store(inst->gdbm, key_datum, data_datum, GDBM_REPLACE);
-			if (rcode < 0) {
-				REDEBUG("Failed storing data to %s: %s", inst->filename, gdbm_strerror(gdbm_errno));
-				pthread_mutex_unlock(&inst->op_mutex);
-				return RLM_MODULE_FAIL;
-			}
+	RDEBUG("Searching for an entry for key: '%s'", hex_str);
+	keys_lock(inst, stripe, cli_stripe);
 
-			/*
-			 *  Decrease allocated count for the ip
-			 */
-			ret = decrease_allocated_count(inst, request, &entry, &save_datum);
-			pthread_mutex_unlock(&inst->op_mutex);
-			if (ret < 0) {
-				return RLM_MODULE_FAIL;
-			}
-		}
+	/*
+	 *  If there is an active session for this key it is stale.
+	 */
+	slot = slot_find(inst, key, IPPOOL_SLOT_KEY);
+	if (slot && entry_release(inst, slot, &ipaddr)) {
+		RDEBUG("Found a stale entry for ip: %s", ip_ntoa(str, ipaddr));
 	}
 
-	pthread_mutex_unlock(&inst->op_mutex);
-
 	/*
 	 *  If there is a Framed-IP-Address (or Dhcp-Your-IP-Address)
 	 *  attribute in the reply, check for override
@@ -561,6 +941,7 @@ static rlm_rcode_t CC_HINT(nonnull) mod_post_auth(UNUSED void *instance, UNUSED
 	if (pairfind(request->reply->vps, attr_ipaddr, vendor_ipaddr, TAG_ANY) != NULL) {
 		RDEBUG("Found IP address attribute in reply attribute list");
 		if (!inst->override) {
+			keys_unlock(inst, stripe, cli_stripe);
 			RDEBUG("override is set to no. Return NOOP");
 			return RLM_MODULE_NOOP;
 		}
@@ -570,229 +951,128 @@ static rlm_rcode_t CC_HINT(nonnull) mod_post_auth(UNUSED void *instance, UNUSED
 	}
 
 	/*
-	 *  Walk through the database searching for an active=0 entry.
-	 *  We search twice. Once to see if we have an active entry with the same caller_id
-	 *  so that MPPP can work ok and then once again to find a free entry.
+	 *  If there is an active session with the same caller id,
+	 *  use the same address, so that MPPP can work ok.
 	 */
-	pthread_mutex_lock(&inst->op_mutex);
-	key_datum.dptr = NULL;
-	if (cli != NULL){
-		key_datum = gdbm_firstkey(inst->gdbm);
-		while (key_datum.dptr) {
-			data_datum = gdbm_fetch(inst->gdbm, key_datum);
-			if (data_datum.dptr){
-				memcpy(&entry,data_datum.dptr, sizeof(ippool_info));
-				free(data_datum.dptr);
-				/*
-				* If we find an entry for the same caller-id with active=1
-				* then we use that for multilink (MPPP) to work properly.
-				*/
-				if (strcmp(entry.cli,cli) == 0 && entry.active){
-					mppp = 1;
-					break;
-				}
-			}
-
-			nextkey = gdbm_nextkey(inst->gdbm, key_datum);
-			free(key_datum.dptr);
-			key_datum = nextkey;
+	if (cli) cli_slot = slot_find(inst, cli_key, IPPOOL_SLOT_CLI);
+	if (cli_slot && (cli_slot->entry <= inst->num_entries)) {
+		n = cli_slot->entry - 1;
+		entry = &inst->entries[n];
+
+		ENTRY_LOCK(inst, n);
+		if (slot_valid(inst, cli_slot) && (strcmp(entry->cli, cli) == 0)) {
+			mppp = true;
+			entry->sessions++;
+			entry->timestamp = request->timestamp;
+			generation = entry->generation;
+			ipaddr = entry->ipaddr;
 		}
+		ENTRY_UNLOCK(inst, n);
 	}
 
-	if (!key_datum.dptr){
-		key_datum = gdbm_firstkey(inst->gdbm);
-		while(key_datum.dptr){
-			data_datum = gdbm_fetch(inst->gdbm, key_datum);
-			if (data_datum.dptr){
-				memcpy(&entry,data_datum.dptr, sizeof(ippool_info));
-				free(data_datum.dptr);
-
-				/*
-				 * Find an entry with active == 0
-				 * or an entry that has expired
-				 */
-				if (entry.active == 0 || (entry.timestamp && ((entry.timeout &&
-				request->timestamp >= (entry.timestamp + entry.timeout)) ||
-				(inst->max_timeout && request->timestamp >= (entry.timestamp + inst->max_timeout))))){
-					datum tmp;
-
-					tmp.dptr = (char *) &entry.ipaddr;
-					tmp.dsize = sizeof(uint32_t);
-					data_datum = gdbm_fetch(inst->ip, tmp);
-
-					/*
-					 * If we find an entry in the ip index and the number is zero (meaning
-					 * that we haven't allocated the same ip address to another nas/port pair)
-					 * or if we don't find an entry then delete the session entry so
-					 * that we can change the key
-					 * Else we don't delete the session entry since we haven't yet deallocated the
-					 * corresponding ip address and we continue our search.
-					 */
-
-					if (data_datum.dptr){
-						memcpy(&num,data_datum.dptr, sizeof(int));
-						free(data_datum.dptr);
-						if (num == 0){
-							delete = 1;
-							break;
-						}
-					}
-					else{
-						delete = 1;
-						break;
-					}
-				}
-			}
-			nextkey = gdbm_nextkey(inst->gdbm, key_datum);
-			free(key_datum.dptr);
-			key_datum = nextkey;
-		}
-	}
 	/*
-	 * If we have found a free entry set active to 1 then add a Framed-IP-Address attribute to
-	 * the reply
-	 * We keep the operation mutex locked until after we have set the corresponding entry active
+	 *  Otherwise give the key the address it had last time,
+	 *  if nobody else has it.  Failing that, any free address.
 	 */
-	if (key_datum.dptr){
-		if (found && !mppp){
-			/*
-			 * Found == 1 means we have the nas/port combination entry in our database
-			 * We exchange the ip address between the nas/port entry and the free entry
-			 * Afterwards we will save the free ip address to the nas/port entry.
-			 * That is:
-			 *  ---------------------------------------------
-			 *  - NAS/PORT Entry  |||| Free Entry  ||| Time
-			 *  -    IP1		 IP2(Free)    BEFORE
-			 *  -    IP2(Free)	   IP1	  AFTER
-			 *  ---------------------------------------------
-			 *
-			 * We only do this if we are NOT doing MPPP
-			 *
-			 */
-			datum key_datum_tmp;
-			datum data_datum_tmp;
-			ippool_key key_tmp;
-
-			memcpy(key_tmp.key,key_str,16);
-			key_datum_tmp.dptr = (char *) &key_tmp;
-			key_datum_tmp.dsize = sizeof(ippool_key);
-
-			data_datum_tmp = gdbm_fetch(inst->gdbm, key_datum_tmp);
-			if (data_datum_tmp.dptr != NULL){
-
-				rcode = gdbm_store(inst->gdbm, key_datum, data_datum_tmp, GDBM_REPLACE);
-				free(data_datum_tmp.dptr);
-				if (rcode < 0) {
-					REDEBUG("Failed storing data to %s: %s", inst->filename, gdbm_strerror(gdbm_errno));
-						pthread_mutex_unlock(&inst->op_mutex);
-					return RLM_MODULE_FAIL;
-				}
-			}
-		} else{
-			/*
-			 * We have not found the nas/port combination
-			 */
-			if (delete) {
-				/*
-				 *  Delete the entry so that we can change the key
-				 *  All is well. We delete one entry and we add one entry
-				 */
-				gdbm_delete(inst->gdbm, key_datum);
-			} else{
-				/*
-				 *  We are doing MPPP. (mppp should be 1)
-				 *  We don't do anything.
-				 *  We will create an extra not needed entry in the database in this case
-				 *  but we don't really care since we always also use the ip_index database
-				 *  when we search for a free entry.
-				 *  We will also delete that entry on the accounting section so that we only
-				 *  have one nas/port entry referencing each ip
-				 */
-				if (mppp) {
-					extra = 1;
-				}
-				if (!mppp) {
-					REDEBUG("mppp is not one. Please report this behaviour");
-				}
-			}
-		}
-		free(key_datum.dptr);
-		entry.active = 1;
-		entry.timestamp = request->timestamp;
-		if ((vp = pairfind(request->reply->vps, PW_SESSION_TIMEOUT, 0, TAG_ANY)) != NULL) {
-			entry.timeout = (time_t) vp->vp_integer;
-#ifdef WITH_DHCP
-			if (dhcp) {
-				vp = radius_paircreate(request->reply, &request->reply->vps,
-						       PW_DHCP_IP_ADDRESS_LEASE_TIME, DHCP_MAGIC_VENDOR);
-				vp->vp_integer = entry.timeout;
-				pairdelete(&request->reply->vps, PW_SESSION_TIMEOUT, 0, TAG_ANY);
-			}
-#endif
-		} else {
-			entry.timeout = 0;
-		}
-		if (extra) {
-			entry.extra = 1;
-		}
+	if (!mppp && slot && (slot->entry <= inst->num_entries)) {
+		bool owner;
 
-		data_datum.dptr = (char *) &entry;
-		data_datum.dsize = sizeof(ippool_info);
-		memcpy(key.key, key_str, 16);
-		key_datum.dptr = (char *) &key;
-		key_datum.dsize = sizeof(ippool_key);
-
-		RDEBUG2("Allocating ip to key: '%s'",hex_str);
-		rcode = gdbm_store(inst->gdbm, key_datum, data_datum, GDBM_REPLACE);
-		if (rcode < 0) {
-			REDEBUG("Failed storing data to %s: %s", inst->filename, gdbm_strerror(gdbm_errno));
-				pthread_mutex_unlock(&inst->op_mutex);
-			return RLM_MODULE_FAIL;
-		}
+		n = slot->entry - 1;
+		entry = &inst->entries[n];
 
-		/* Increase the ip index count */
-		key_datum.dptr = (char *) &entry.ipaddr;
-		key_datum.dsize = sizeof(uint32_t);
-		data_datum = gdbm_fetch(inst->ip, key_datum);
-		if (data_datum.dptr){
-			memcpy(&num,data_datum.dptr,sizeof(int));
-			free(data_datum.dptr);
-		} else {
-			num = 0;
+		ENTRY_LOCK(inst, n);
+		owner = slot_valid(inst, slot) && !entry->active;
+		ENTRY_UNLOCK(inst, n);
+
+		if (owner) claimed = entry_claim_one(inst, n);
+	}
+
+	if (!mppp && !claimed) {
+		claimed = entry_claim(inst, &n);
+		if (!claimed) {
+			entry_sweep(inst, request->timestamp);
+			claimed = entry_claim(inst, &n);
 		}
+	}
 
-		num++;
-		RDEBUG("num: %d",num);
-		data_datum.dptr = (char *) &num;
-		data_datum.dsize = sizeof(int);
-		rcode = gdbm_store(inst->ip, key_datum, data_datum, GDBM_REPLACE);
-		if (rcode < 0) {
-			REDEBUG("Failed storing data to %s: %s", inst->ip_index, gdbm_strerror(gdbm_errno));
-			pthread_mutex_unlock(&inst->op_mutex);
-			return RLM_MODULE_FAIL;
+	if (!mppp && !claimed) {
+		keys_unlock(inst, stripe, cli_stripe);
+		RDEBUG("No available ip addresses in pool");
+		return RLM_MODULE_NOTFOUND;
+	}
+
+	if (!mppp) {
+		entry = &inst->entries[n];
+
+		ENTRY_LOCK(inst, n);
+		entry->generation++;
+		entry->active = 1;
+		entry->sessions = 1;
+		memcpy(entry->key, key, sizeof(entry->key));
+		strlcpy(entry->cli, cli ? cli : "", sizeof(entry->cli));
+		entry->timestamp = request->timestamp;
+		entry->timeout = timeout;
+		generation = entry->generation;
+		ipaddr = entry->ipaddr;
+		ENTRY_UNLOCK(inst, n);
+	}
+
+	RDEBUG2("Allocating ip to key: '%s'", hex_str);
+	slot = slot_insert(inst, key, IPPOOL_SLOT_KEY);
+	if (!slot) {
+		entry = &inst->entries[n];
+
+		ENTRY_LOCK(inst, n);
+		if (entry->sessions > 0) entry->sessions--;
+		if (entry->sessions == 0) {
+			entry->active = 0;
+			entry_free(inst, n);
 		}
-		pthread_mutex_unlock(&inst->op_mutex);
+		ENTRY_UNLOCK(inst, n);
+		keys_unlock(inst, stripe, cli_stripe);
 
-		RDEBUG("Allocated ip %s to client key: %s",ip_ntoa(str,entry.ipaddr),hex_str);
-		vp = radius_paircreate(request->reply, &request->reply->vps,
-				       attr_ipaddr, vendor_ipaddr);
-		vp->vp_ipaddr = entry.ipaddr;
+		REDEBUG("Index of %s is full", inst->filename);
+		return RLM_MODULE_FAIL;
+	}
+	slot->entry = n + 1;
+	slot->generation = generation;
+	slot->active = 1;
 
-		/*
-		 *	If there is no Framed-Netmask attribute in the
-		 *	reply, add one
-		 */
-		if (pairfind(request->reply->vps, attr_ipmask, vendor_ipaddr, TAG_ANY) == NULL) {
-			vp = radius_paircreate(request->reply, &request->reply->vps,
-					       attr_ipmask, vendor_ipaddr);
-			vp->vp_ipaddr = ntohl(inst->netmask);
+	/*
+	 *  If there's no room for the caller id, the next session
+	 *  from it just gets a different address.
+	 */
+	if (cli && !mppp) {
+		cli_slot = slot_insert(inst, cli_key, IPPOOL_SLOT_CLI);
+		if (cli_slot) {
+			cli_slot->entry = n + 1;
+			cli_slot->generation = generation;
 		}
+	}
+	keys_unlock(inst, stripe, cli_stripe);
 
+#ifdef WITH_DHCP
+	if (dhcp && timeout) {
+		vp = radius_paircreate(request->reply, &request->reply->vps,
+				       PW_DHCP_IP_ADDRESS_LEASE_TIME, DHCP_MAGIC_VENDOR);
+		vp->vp_integer = timeout;
+		pairdelete(&request->reply->vps, PW_SESSION_TIMEOUT, 0, TAG_ANY);
 	}
-	else{
-		pthread_mutex_unlock(&inst->op_mutex);
-		RDEBUG("No available ip addresses in pool");
-		return RLM_MODULE_NOTFOUND;
+#endif
+
+	RDEBUG("Allocated ip %s to client key: %s", ip_ntoa(str, ipaddr), hex_str);
+	vp = radius_paircreate(request->reply, &request->reply->vps,
+			       attr_ipaddr, vendor_ipaddr);
+	vp->vp_ipaddr = ipaddr;
+
+	/*
+	 *	If there is no Framed-Netmask attribute in the
+	 *	reply, add one
+	 */
+	if (pairfind(request->reply->vps, attr_ipmask, vendor_ipaddr, TAG_ANY) == NULL) {
+		vp = radius_paircreate(request->reply, &request->reply->vps,
+				       attr_ipmask, vendor_ipaddr);
+		vp->vp_ipaddr = ntohl(inst->netmask);
 	}
 
 	return RLM_MODULE_OK;
@@ -800,11 +1080,25 @@ static rlm_rcode_t CC_HINT(nonnull) mod_post_auth(UNUSED void *instance, UNUSED
 
 static int mod_detach(void *instance)
 {
-	rlm_ippool_t *inst = instance;
+	rlm_ippool_t	*inst = instance;
+	int		i;
+
+	if (inst->map) {
+		msync(inst->map, inst->size, MS_SYNC);
+		inst->header->clean = 1;
+		msync(inst->map, sizeof(*inst->header), MS_SYNC);
+		munmap(inst->map, inst->size);
+		close(inst->fd);
+	}
 
-	gdbm_close(inst->gdbm);
-	gdbm_close(inst->ip);
-	pthread_mutex_destroy(&inst->op_mutex);
+	for (i = 0; i < IPPOOL_STRIPES; i++) {
+		pthread_mutex_destroy(&inst->key_mutex[i]);
+		pthread_mutex_destroy(&inst->entry_mutex[i]);
+	}
+	pthread_mutex_destroy(&inst->sweep_mutex);
+#if defined(HAVE_PTHREAD_H) && !defined(__ATOMIC_ACQUIRE)
+	pthread_mutex_destroy(&inst->free_mutex);
+#endif
 	return 0;
 }
 
@@ -835,4 +1129,8 @@ module_t rlm_ippool = {
 		NULL,			/* post-proxy */
 		mod_post_auth		/* post-auth */
 	},
+	0,				/* thread_inst_size */
+	NULL,				/* thread_instantiate */
+	NULL,				/* thread_detach */
+	NULL				/* cache_flush */
 };
@@ -0,0 +1,100 @@
+#ifndef _RLM_IPPOOL_H
+#define _RLM_IPPOOL_H
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file rlm_ippool.h
+ * @brief Layout of the pool file shared by rlm_ippool and rlm_ippool_tool.
+ *
+ * The pool file is memory mapped.  It holds a header, one fixed size
+ * entry per address in the range, a bitmap of the free entries, and an
+ * index of the keys (and Calling-Station-Ids) which were given
+ * addresses.
+ *
+ * The index is split into IPPOOL_STRIPES separate open addressing
+ * tables, each protected by its own mutex in the server.  A slot
+ * refers to an entry, and is only valid while its generation matches
+ * that of the entry.  Giving an entry to a new key increments the
+ * generation, which makes every other slot referring to it stale.
+ *
+ * The file is in host byte order, and can't be moved between
+ * machines of different architectures.
+ *
+ * @copyright 2014  The FreeRADIUS server project
+ */
+RCSIDH(rlm_ippool_h, "$Id$")
+
+#define IPPOOL_MAGIC		0x4950504c	/* "IPPL" */
+#define IPPOOL_VERSION		1
+
+#define IPPOOL_STRIPES		64		//!< Number of index tables, must be a power of 2.
+
+#define IPPOOL_SLOT_EMPTY	0
+#define IPPOOL_SLOT_DELETED	UINT32_MAX
+
+#define IPPOOL_SLOT_KEY		1		//!< Slot is for the MD5 of the expanded 'key'.
+#define IPPOOL_SLOT_CLI		2		//!< Slot is for the MD5 of the Calling-Station-Id.
+
+/** The free bitmap has one bit per entry, which is set if the entry is free
+ *
+ */
+#define IPPOOL_FREE_WORDS(_n)	(((_n) + 63) / 64)
+#define IPPOOL_FREE_BIT(_n)	(((uint64_t) 1) << ((_n) & 63))
+
+typedef struct ippool_header {
+	uint32_t	magic;
+	uint32_t	version;
+
+	uint32_t	range_start;		//!< In host byte order.
+	uint32_t	range_stop;		//!< In host byte order.
+	uint32_t	netmask;		//!< In host byte order.
+
+	uint32_t	num_entries;		//!< One per usable address in the range.
+	uint32_t	num_slots;		//!< Size of the index, a multiple of IPPOOL_STRIPES.
+
+	uint32_t	clean;			//!< The file was closed cleanly, and the free bitmap
+						//!< and index agree with the entries.
+
+	uint64_t	entries_offset;
+	uint64_t	free_offset;
+	uint64_t	slots_offset;
+	uint64_t	size;			//!< Of the whole file.
+} ippool_header_t;
+
+typedef struct ippool_entry {
+	uint32_t	ipaddr;			//!< In network byte order.
+	uint32_t	generation;		//!< Incremented when the address is given to a new key.
+	uint32_t	sessions;		//!< Number of keys using the address (multilink).
+	uint8_t		active;
+	uint8_t		pad[3];
+	uint8_t		key[16];		//!< MD5 of the key the address was last given to.
+	char		cli[32];		//!< Calling-Station-Id of that key.
+	int64_t		timestamp;
+	int64_t		timeout;
+} ippool_entry_t;
+
+typedef struct ippool_slot {
+	uint8_t		key[16];
+	uint32_t	entry;			//!< Entry number + 1, or IPPOOL_SLOT_EMPTY / _DELETED.
+	uint32_t	generation;		//!< Of the entry, when the slot was written.
+	uint8_t		type;			//!< IPPOOL_SLOT_KEY or IPPOOL_SLOT_CLI.
+	uint8_t		active;			//!< Key slot holds one of the entry's sessions.
+	uint8_t		pad[2];
+} ippool_slot_t;
+
+#endif /* _RLM_IPPOOL_H */
@@ -4,6 +4,3 @@
 
 SOURCES		:= rlm_ippool.c
 TARGET		:= rlm_ippool.a
-
-SRC_CFLAGS	:= $(rlm_ippool_CFLAGS) 
-TGT_LDLIBS	:= $(rlm_ippool_LDLIBS)
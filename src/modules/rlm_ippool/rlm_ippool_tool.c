@@ -57,9 +57,12 @@ RCSID("$Id$")
 
 #include <freeradius-devel/libradius.h>
 #include <fcntl.h>
-#include <gdbm.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "../../include/md5.h"
 
+#include "rlm_ippool.h"
+
 int active = 0;
 
 int aflag = 0;
@@ -67,427 +70,202 @@ int cflag = 0;
 int rflag = 0;
 int vflag = 0;
 int nflag = 0;
-int oflag = 0;
-int uflag = 0;
-
-typedef struct ippool_info {
-	uint32_t	ipaddr;
-	char		active;
-	char		cli[32];
-	char		extra;
-} ippool_info;
-
 
-#define MAX_NAS_NAME_SIZE 64
-
-typedef struct old_ippool_key {
-	char nas[MAX_NAS_NAME_SIZE];
-	uint16_t port;
-} old_ippool_key;
+#define MATCH_IP(ip1, ip2) ((ip1) == NULL || strcmp((ip1), (ip2)) == 0)
+#define MATCH_ACTIVE(entry) ((entry)->active == 1 || !aflag)
 
-typedef struct ippool_key {
-	char key[16];
-} ippool_key;
+typedef struct ippool_file {
+	int		fd;
+	size_t		size;
+	uint8_t		*map;
+	ippool_header_t	*header;
+	ippool_entry_t	*entries;
+	uint64_t	*free;
+} ippool_file;
 
-#define MATCH_IP(ip1, ip2) ((ip1) == NULL || strcmp((ip1), (ip2)) == 0)
-#define MATCH_ACTIVE(info) ((info).active == 1 || !aflag)
+int openpool(ippool_file *pool, char const *filename, bool writable);
 
-void addip(char *sessiondbname, char *indexdbname, char *ipaddress,
-	   char *NASname, char *NASport, int old);
+void closepool(ippool_file *pool);
 
-void viewdb(char *sessiondbname, char *indexdbname, char *ipaddress, int old);
+void addip(char const *filename, char const *ipaddress, char const *NASname, char const *NASport);
 
-void tonewformat(char *sessiondbname, char *newsessiondbname);
+void viewdb(char const *filename, char const *ipaddress);
 
 void usage(char *argv0);
 
-void addip(char *sessiondbname, char *indexdbname, char *ipaddress,
-	   char *NASname, char *NASport, int old)
+/*
+ *	The server holds a lock on the file while it's using it.  We
+ *	only change the file when nobody else has it open, and mark
+ *	it as needing its index rebuilt, so the server only has to
+ *	see the entries.
+ */
+int openpool(ippool_file *pool, char const *filename, bool writable)
 {
-	GDBM_FILE	sessiondb;
-	GDBM_FILE	indexdb;
-	datum		key_datum, data_datum, save_datum;
-	datum		nextkey;
-
-	ippool_key	key;
-	old_ippool_key	old_key;
-
-	ippool_info	entry;
-	struct in_addr	ipaddr;
-	uint8_t		key_str[17];
-	char		hex_str[35];
-	int		num = 0;
-	int		mppp = 0;
-	int		mode = GDBM_WRITER;
-	int		rcode;
-	int		delete = 0;
-	uint16_t	port;
-	bool		found = false;
+	ippool_header_t	header;
+	struct stat	buf;
+	void		*map;
 
-	sessiondb = gdbm_open(sessiondbname, 512, mode, 0,NULL);
-	indexdb = gdbm_open(indexdbname, 512, mode, 0,NULL);
+	memset(pool, 0, sizeof(*pool));
 
-	if (inet_aton(ipaddress, &ipaddr) == 0) {
-		printf("rlm_ippool_tool: Unable to convert IP address '%s'\n", ipaddress);
-		return;
+	pool->fd = open(filename, writable ? O_RDWR : O_RDONLY);
+	if (pool->fd < 0) {
+		printf("rlm_ippool_tool: Unable to open '%s': %s\n", filename, fr_syserror(errno));
+		return -1;
 	}
 
-	if (!sessiondb) {
-		printf("rlm_ippool_tool: Unable to open DB '%s'\n", sessiondbname);
-		return;
+	if (writable && (rad_lockfd_nonblock(pool->fd, 0) < 0)) {
+		printf("rlm_ippool_tool: '%s' is in use, stop the server first\n", filename);
+	error:
+		close(pool->fd);
+		return -1;
 	}
 
-	if (!indexdb) {
-		printf("rlm_ippool_tool: Unable to open DB '%s'\n", indexdbname);
-		return;
+	if ((fstat(pool->fd, &buf) < 0) ||
+	    (read(pool->fd, &header, sizeof(header)) != sizeof(header)) ||
+	    (header.magic != IPPOOL_MAGIC)) {
+		printf("rlm_ippool_tool: '%s' is not an ippool file\n", filename);
+		goto error;
 	}
 
-	port = strtoul(NASport, NULL, 0);
-
-	/* Basically from rlm_ippool.c */
-
-	if (old){
-		strlcpy(old_key.nas, NASname, sizeof(old_key.nas));
-		old_key.port = port;
-		key_datum.dptr = (char *) &old_key;
-		key_datum.dsize = sizeof(old_ippool_key);
-	} else {
-		char md5_input_str[MAX_STRING_LEN];
-		FR_MD5_CTX md5_context;
-
-		snprintf(md5_input_str, MAX_STRING_LEN, "%s %s", NASname, NASport);
-
-		fr_md5_init(&md5_context);
-		fr_md5_update(&md5_context, (uint8_t *) md5_input_str, strlen(md5_input_str));
-		fr_md5_final(key_str, &md5_context);
-
-		memcpy(key.key, key_str, 16);
-		fr_bin2hex(hex_str, key_str, 16);
-		hex_str[32] = '\0';
-		key_datum.dptr = (char *) &key;
-		key_datum.dsize = sizeof(ippool_key);
+	if (header.version != IPPOOL_VERSION) {
+		printf("rlm_ippool_tool: '%s' has version %u, expected %u\n", filename,
+		       header.version, IPPOOL_VERSION);
+		goto error;
 	}
 
-
-	data_datum = gdbm_fetch(sessiondb, key_datum);
-	if (data_datum.dptr != NULL){
-		found = true;
-		memcpy(&entry, data_datum.dptr, sizeof(ippool_info));
-
-		if (entry.active){
-			if (old) {
-				printf("rlm_ippool_tool: Deleting stale entry for ip/port %s/%u",
-					ipaddress, port);
-			} else {
-				printf("rlm_ippool_tool: Deleting stale entry for key: '%s'", hex_str);
-			}
-
-			entry.active = 0;
-			save_datum.dptr = key_datum.dptr;
-			save_datum.dsize = key_datum.dsize;
-
-			data_datum.dptr = (char*) &entry;
-			data_datum.dsize = sizeof(ippool_info);
-
-			rcode = gdbm_store(sessiondb, key_datum, data_datum, GDBM_REPLACE);
-			if (rcode < 0) {
-				printf("rlm_ippool_tool: Failed storing data to %s: %s\n",
-					sessiondbname, gdbm_strerror(gdbm_errno));
-				goto close;
-			}
-
-			key_datum.dptr = (char *) &entry.ipaddr;
-			key_datum.dsize = sizeof(uint32_t);
-			data_datum = gdbm_fetch(indexdb, key_datum);
-
-			if (data_datum.dptr != NULL) {
-				memcpy(&num, data_datum.dptr, sizeof(int));
-
-				if (num > 0) {
-					num--;
-					data_datum.dptr = (char *) &num;
-					data_datum.dsize = sizeof(int);
-					rcode = gdbm_store(indexdb, key_datum, data_datum, GDBM_REPLACE);
-
-					if (rcode < 0) {
-						printf("rlm_ippool_tool: Failed storing data to %s: %s\n",
-							indexdbname, gdbm_strerror(gdbm_errno));
-						goto close;
-					}
-
-					if (num > 0 && entry.extra == 1) {
-						gdbm_delete(sessiondb, save_datum);
-					}
-				}
-			}
-		}
+	if ((header.size != (uint64_t) buf.st_size) ||
+	    (header.entries_offset + ((uint64_t) header.num_entries * sizeof(ippool_entry_t)) > header.free_offset) ||
+	    (header.free_offset + ((uint64_t) IPPOOL_FREE_WORDS(header.num_entries) * sizeof(uint64_t)) > header.size)) {
+		printf("rlm_ippool_tool: '%s' is truncated or corrupt\n", filename);
+		goto error;
 	}
-	key_datum.dptr = NULL;
-
-	if (!key_datum.dptr) {
-		key_datum = gdbm_firstkey(sessiondb);
-
-		while (key_datum.dptr) {
-			data_datum = gdbm_fetch(sessiondb, key_datum);
-			if (data_datum.dptr != NULL) {
-				memcpy(&entry, data_datum.dptr, sizeof(ippool_info));
-				free(data_datum.dptr);
-
-				if (entry.active == 0 && entry.ipaddr == ipaddr.s_addr) {
-					datum tmp;
-					tmp.dptr = (char *) &entry.ipaddr;
-					tmp.dsize = sizeof(uint32_t);
-					data_datum = gdbm_fetch(indexdb, tmp);
-					if (data_datum.dptr){
-						memcpy(&num, data_datum.dptr, sizeof(int));
-						free(data_datum.dptr);
-						if (num == 0){
-							delete = 1;
-							break;
-						}
-					} else {
-						delete = 1;
-						break;
-					}
-				}
-			}
-			nextkey = gdbm_nextkey(sessiondb, key_datum);
-			free(key_datum.dptr);
-			key_datum = nextkey;
-		}
-	}
-
-	if (key_datum.dptr){
-		if (found && ! mppp){
-			datum key_datum_tmp, data_datum_tmp;
-			old_ippool_key old_key_tmp;
-			ippool_key key_tmp;
-
-			if (old){
-				strlcpy(old_key_tmp.nas, NASname,
-					sizeof(old_key_tmp.nas));
-				old_key_tmp.port = port;
-				key_datum_tmp.dptr = (char *) &old_key_tmp;
-				key_datum_tmp.dsize = sizeof(old_ippool_key);
-			} else {
-				memcpy(key_tmp.key, key_str, 16);
-				key_datum_tmp.dptr = (char *) &key_tmp;
-				key_datum_tmp.dsize = sizeof(ippool_key);
-			}
-
-			data_datum_tmp = gdbm_fetch(sessiondb, key_datum_tmp);
-			if (data_datum_tmp.dptr != NULL) {
-				rcode = gdbm_store(sessiondb, key_datum, data_datum_tmp, GDBM_REPLACE);
-				if (rcode < 0) {
-					printf("rlm_ippool_tool: Failed storing data to %s: %s\n",
-						sessiondbname, gdbm_strerror(gdbm_errno));
-					goto close;
-				}
-				free(data_datum_tmp.dptr);
-			}
-		} else {
-			if (delete) {
-				gdbm_delete(sessiondb, key_datum);
-			}
-		}
-
-		free(key_datum.dptr);
-		entry.active = 1;
-
-		data_datum.dptr = (char *) &entry;
-		data_datum.dsize = sizeof(ippool_info);
-
-		if (old){
-			strlcpy(old_key.nas, NASname, sizeof(old_key.nas));
-			old_key.port = port;
-			key_datum.dptr = (char *) &old_key;
-			key_datum.dsize = sizeof(old_ippool_key);
-			printf("rlm_ippool_tool: Allocating ip to nas/port: %s/%u\n", old_key.nas, old_key.port);
-		} else {
-			memcpy(key.key, key_str, 16);
-			key_datum.dptr = (char *) &key;
-			key_datum.dsize = sizeof(ippool_key);
-			printf("rlm_ippool_tool: Allocating ip to key: '%s'\n", hex_str);
-		}
 
-		rcode = gdbm_store(sessiondb, key_datum, data_datum, GDBM_REPLACE);
-		if (rcode < 0) {
-			printf("rlm_ippool_tool: Failed storing data to %s: %s\n",
-				sessiondbname, gdbm_strerror(gdbm_errno));
-			goto close;
-		}
-
-		/* Increase the ip index count */
-		key_datum.dptr = (char *) &entry.ipaddr;
-		key_datum.dsize = sizeof(uint32_t);
-		data_datum = gdbm_fetch(indexdb, key_datum);
-		if (data_datum.dptr) {
-			memcpy(&num, data_datum.dptr, sizeof(int));
-		} else {
-			num = 0;
-		}
-
-		num++;
-		printf("rlm_ippool_tool: num: %d\n", num);
-		data_datum.dptr = (char *) &num;
-		data_datum.dsize = sizeof(int);
-
-		rcode = gdbm_store(indexdb, key_datum, data_datum, GDBM_REPLACE);
-		if (rcode < 0) {
-			printf("rlm_ippool_tool: Failed storing data to %s: %s\n",
-				indexdbname, gdbm_strerror(gdbm_errno));
+	map = mmap(NULL, header.size, writable ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, pool->fd, 0);
+	if (map == MAP_FAILED) {
+		printf("rlm_ippool_tool: Unable to map '%s': %s\n", filename, fr_syserror(errno));
+		goto error;
+	}
 
-			goto close;
-		}
+	pool->map = map;
+	pool->size = header.size;
+	pool->header = map;
+	pool->entries = (ippool_entry_t *) (pool->map + header.entries_offset);
+	pool->free = (uint64_t *) (pool->map + header.free_offset);
 
-		if (old) {
-			printf("rlm_ippool_tool: Allocated ip %s to client on nas %s, port %u\n",
-				ipaddress, old_key.nas, port);
-		} else {
-			printf("rlm_ippool_tool: Allocated ip %s to key  '%s'\n", ipaddress, hex_str);
-		}
-	}
+	return 0;
+}
 
-	close:
-	gdbm_close(indexdb);
-	gdbm_close(sessiondb);
+void closepool(ippool_file *pool)
+{
+	munmap(pool->map, pool->size);
+	close(pool->fd);
 }
 
+/*
+ *	Mark the entry for an address as being used by a NAS/port.
+ */
+void addip(char const *filename, char const *ipaddress, char const *NASname, char const *NASport)
+{
+	ippool_file	pool;
+	ippool_entry_t	*entry = NULL;
+	struct in_addr	ipaddr;
+	uint8_t		key[16];
+	char		hex_str[35];
+	char		md5_input_str[MAX_STRING_LEN];
+	FR_MD5_CTX	md5_context;
+	uint32_t	i;
 
-void tonewformat(char *sessiondbname, char *newsessiondbname) {
-	GDBM_FILE sessiondb;
-	GDBM_FILE newsessiondb;
-	datum key_datum, keynext_datum, data_datum, newkey_datum;
-	old_ippool_key old_key;
-	ippool_key key;
-	uint8_t key_str[17];
-	char hex_str[35];
-	int rcode;
+	if (inet_aton(ipaddress, &ipaddr) == 0) {
+		printf("rlm_ippool_tool: Unable to convert IP address '%s'\n", ipaddress);
+		return;
+	}
 
-	sessiondb = gdbm_open(sessiondbname, 512, GDBM_READER, 0,NULL);
-	newsessiondb = gdbm_open(newsessiondbname, 512, GDBM_NEWDB, 0,NULL);
+	if (openpool(&pool, filename, true) < 0) return;
 
-	if (!sessiondb || !newsessiondb) return;
+	/* Basically from rlm_ippool.c */
+	snprintf(md5_input_str, MAX_STRING_LEN, "%s %s", NASname, NASport);
 
-	memset(key_str, 0, 17);
+	fr_md5_init(&md5_context);
+	fr_md5_update(&md5_context, (uint8_t *) md5_input_str, strlen(md5_input_str));
+	fr_md5_final(key, &md5_context);
 
-	key_datum = gdbm_firstkey(sessiondb);
-	while (key_datum.dptr) {
-		keynext_datum = gdbm_nextkey(sessiondb, key_datum);
+	fr_bin2hex(hex_str, key, 16);
+	hex_str[32] = '\0';
 
-		if (key_datum.dsize != sizeof(struct old_ippool_key)) {
-			goto next;
+	for (i = 0; i < pool.header->num_entries; i++) {
+		if (pool.entries[i].ipaddr == ipaddr.s_addr) {
+			entry = &pool.entries[i];
+			break;
 		}
+	}
 
-		char md5_input_str[MAX_STRING_LEN];
-		FR_MD5_CTX md5_context;
-
-		memcpy(&old_key, key_datum.dptr, sizeof(struct old_ippool_key));
-
-		snprintf(md5_input_str, MAX_STRING_LEN, "%s %d", old_key.nas, old_key.port);
-
-		fr_md5_init(&md5_context);
-		fr_md5_update(&md5_context, (uint8_t *) md5_input_str, strlen(md5_input_str));
-		fr_md5_final(key_str, &md5_context);
-
-		memcpy(key.key, key_str, 16);
-		fr_bin2hex(hex_str, key_str, 16);
-		hex_str[32] = '\0';
-
-		printf("rlm_ippool_tool: Transforming pair nas/port (%s/%d) to md5 '%s'\n",
-			old_key.nas, old_key.port, hex_str);
+	if (!entry) {
+		printf("rlm_ippool_tool: IP address %s is not in the pool\n", ipaddress);
+		goto close;
+	}
 
-		newkey_datum.dptr = (char *) &key;
-		newkey_datum.dsize = sizeof(ippool_key);
-		data_datum = gdbm_fetch(sessiondb, key_datum);
+	if (entry->active) {
+		printf("rlm_ippool_tool: IP address %s is already in use\n", ipaddress);
+		goto close;
+	}
 
-		if (!data_datum.dptr) {
-			goto next;
-		}
+	for (i = 0; i < pool.header->num_entries; i++) {
+		ippool_entry_t *this = &pool.entries[i];
 
-		rcode = gdbm_store(newsessiondb, newkey_datum, data_datum, GDBM_REPLACE);
-		if (rcode < 0) {
-			printf("Failed to update new file %s: %s\n", newsessiondbname, gdbm_strerror(gdbm_errno));
-			gdbm_close(newsessiondb);
-			gdbm_close(sessiondb);
-			return;
+		if (this->active && (memcmp(this->key, key, sizeof(key)) == 0)) {
+			printf("rlm_ippool_tool: Deleting stale entry for key: '%s'\n", hex_str);
+			this->active = 0;
+			this->sessions = 0;
+			this->timestamp = 0;
+			this->timeout = 0;
+			pool.free[i / 64] |= IPPOOL_FREE_BIT(i);
 		}
-
-		next:
-		key_datum = keynext_datum;
 	}
 
-	gdbm_close(newsessiondb);
-	gdbm_close(sessiondb);
-}
+	printf("rlm_ippool_tool: Allocating ip to key: '%s'\n", hex_str);
 
-void viewdb(char *sessiondbname, char *indexdbname, char *ipaddress, int old) {
-	GDBM_FILE sessiondb;
-	GDBM_FILE indexdb;
-	datum key_datum, keynext_datum, data_datum, save_datum;
-	old_ippool_key old_key;
-	ippool_key key;
-	ippool_info info;
-	struct in_addr ipaddr;
-	int num;
-	uint8_t key_str[17];
-	char hex_str[35];
-	char *ip;
-	int mode = GDBM_READER;
-	int rcode;
-
-	if (rflag) mode = GDBM_WRITER;
-	sessiondb = gdbm_open(sessiondbname, 512, mode, 0,NULL);
-	indexdb = gdbm_open(indexdbname, 512, mode, 0,NULL);
-
-	if ((!sessiondb) || (!indexdb)) {
-		return;
-	}
+	i = entry - pool.entries;
+	entry->generation++;
+	entry->active = 1;
+	entry->sessions = 1;
+	memcpy(entry->key, key, sizeof(entry->key));
+	entry->cli[0] = '\0';
+	entry->timestamp = time(NULL);
+	entry->timeout = 0;
+	pool.free[i / 64] &= ~IPPOOL_FREE_BIT(i);
+	pool.header->clean = 0;
 
-	memset(key_str, 0,17);
+	printf("rlm_ippool_tool: Allocated ip %s to key  '%s'\n", ipaddress, hex_str);
 
-	key_datum = gdbm_firstkey(sessiondb);
-	while (key_datum.dptr) {
-		keynext_datum = gdbm_nextkey(sessiondb, key_datum);
+close:
+	closepool(&pool);
+}
 
-		if ((key_datum.dsize != sizeof(struct ippool_key)) &&
-		    (key_datum.dsize != sizeof(struct old_ippool_key))) {
-			goto next;
-		}
+void viewdb(char const *filename, char const *ipaddress)
+{
+	ippool_file	pool;
+	struct in_addr	ipaddr;
+	char		hex_str[35];
+	char		*ip;
+	uint32_t	i;
 
-		if (old) {
-			 memcpy(&old_key, key_datum.dptr, sizeof(struct old_ippool_key));
-		} else {
-			 memcpy(&key, key_datum.dptr, sizeof(struct ippool_key));
-		}
+	if (openpool(&pool, filename, rflag) < 0) return;
 
-		data_datum = gdbm_fetch(sessiondb, key_datum);
-		if (!data_datum.dptr) {
-			goto next;
-		}
+	for (i = 0; i < pool.header->num_entries; i++) {
+		ippool_entry_t *entry = &pool.entries[i];
 
-		memcpy(&info, data_datum.dptr, sizeof(struct ippool_info));
-		memcpy(&ipaddr, &info.ipaddr, 4);
+		memcpy(&ipaddr, &entry->ipaddr, 4);
 		ip = inet_ntoa(ipaddr);
 
-		if (info.active) active++;
-
-		if (vflag && MATCH_IP(ipaddress, ip) && MATCH_ACTIVE(info)) {
-			if (old) {
-				printf("NAS:%s port:0x%x - ", old_key.nas, old_key.port);
-			} else {
-				memcpy(key_str, key.key, 16);
-				fr_bin2hex(hex_str, key_str, 16);
-				hex_str[32] = '\0';
-				printf("KEY: '%s' - ", hex_str);
-			}
-		}
+		if (entry->active) active++;
 
-		if (!vflag && aflag && info.active && MATCH_IP(ipaddress, ip)) {
+		if (!vflag && aflag && entry->active && MATCH_IP(ipaddress, ip)) {
 			printf("%s\n", ip);
-		} else if (vflag && MATCH_IP(ipaddress, ip) && MATCH_ACTIVE(info)) {
-			printf("ipaddr:%s active:%d cli:%s",
-			inet_ntoa(ipaddr), info.active, info.cli);
+		} else if (vflag && MATCH_IP(ipaddress, ip) && MATCH_ACTIVE(entry)) {
+			fr_bin2hex(hex_str, entry->key, 16);
+			hex_str[32] = '\0';
+			printf("KEY: '%s' - ipaddr:%s active:%d cli:%s num:%u\n",
+			       hex_str, ip, entry->active, entry->cli, entry->sessions);
 		}
 
 		/*
@@ -495,101 +273,39 @@ void viewdb(char *sessiondbname, char *indexdbname, char *ipaddress, int old) {
 		 * - set active to zero
 		 * - set number of sessions to zero
 		 */
-		if (rflag && MATCH_IP(ipaddress, ip)) {
-			info.active = 0;
-			save_datum.dptr = key_datum.dptr;
-			save_datum.dsize = key_datum.dsize;
-			data_datum.dptr = (char *) &info;
-			data_datum.dsize = sizeof(ippool_info);
-
-			rcode = gdbm_store(sessiondb, key_datum, data_datum, GDBM_REPLACE);
-			if (rcode < 0) {
-				printf("Failed to update %s: %s\n", ip, gdbm_strerror(gdbm_errno));
-				gdbm_close(indexdb);
-				gdbm_close(sessiondb);
-				return;
-			}
-
-			key_datum.dptr = (char *)&info.ipaddr;
-			key_datum.dsize = sizeof(uint32_t);
-			data_datum = gdbm_fetch(indexdb, key_datum);
-
-			if (data_datum.dptr != NULL) {
-				memcpy(&num, data_datum.dptr, sizeof(int));
-				if (num > 0) {
-					num--;
-					data_datum.dptr = (char *) &num;
-					data_datum.dsize = sizeof(int);
-					rcode = gdbm_store(indexdb, key_datum, data_datum, GDBM_REPLACE);
-
-					if (rcode < 0) {
-						printf("Failed to update %s: %s\n", ip, gdbm_strerror(gdbm_errno));
-						gdbm_close(indexdb);
-						gdbm_close(sessiondb);
-						return;
-					}
-
-					if (num > 0 && info.extra == 1) {
-						gdbm_delete(sessiondb, save_datum);
-					}
-				}
-			}
-		}
-
-		key_datum.dptr = (char *)&info.ipaddr;
-		key_datum.dsize = sizeof(uint32_t);
-		data_datum = gdbm_fetch(indexdb, key_datum);
-
-		if (data_datum.dptr!= NULL) {
-			memcpy(&num, data_datum.dptr, sizeof(int));
-
-			if (vflag && MATCH_IP(ipaddress, ip) && MATCH_ACTIVE(info)) {
-				printf(" num:%d", num);
-			}
+		if (rflag && entry->active && MATCH_IP(ipaddress, ip)) {
+			entry->active = 0;
+			entry->sessions = 0;
+			entry->timestamp = 0;
+			entry->timeout = 0;
+			pool.free[i / 64] |= IPPOOL_FREE_BIT(i);
+			pool.header->clean = 0;
 		}
-
-		if (vflag && MATCH_IP(ipaddress, ip) && MATCH_ACTIVE(info)) {
-			printf("\n");
-		} else if (vflag && !ipaddress){
-			if (old) {
-				printf("NAS:%s port:0x%x\n", old_key.nas, old_key.port);
-			} else	{
-				memcpy(key_str, key.key, 16);
-				fr_bin2hex(hex_str, key_str, 16);
-				hex_str[32] = '\0';
-				printf("KEY: '%s' - ", hex_str);
-			}
-		}
-
-		next:
-		key_datum = keynext_datum;
 	}
 
-	gdbm_close(indexdb);
-	gdbm_close(sessiondb);
+	closepool(&pool);
 }
 
 void NEVER_RETURNS usage(char *argv0) {
-	printf("Usage: %s [-a] [-c] [-o] [-v] <filename> <index-db> [ipaddress]\n", argv0);
+	printf("Usage: %s [-a] [-c] [-r] [-v] <filename> [ipaddress]\n", argv0);
 	printf("  -a: print all active entries\n");
 	printf("  -c: report number of active entries\n");
 	printf("  -r: remove active entries\n");
 	printf("  -v: verbose report of all entries\n");
-	printf("  -o: Assume old database format (nas/port pair, not md5 output)\n");
 	printf("  If an ipaddress is specified then that address is used to\n");
 	printf("  limit the actions or output.\n");
-	printf("  Usage: %s -n  <filename> <index-db> <ipaddress> <nasIP> <nasPort>\n", argv0);
+	printf("  Usage: %s -n  <filename> <ipaddress> <nasIP> <nasPort>\n", argv0);
 	printf("  -n: Mark the entry nasIP/nasPort as having ipaddress\n");
-	printf("  Usage: %s -u <filename> <new-filename>\n", argv0);
-	printf("  -u: Update old format database to new.\n");
+	printf("  The server must be stopped before using -r or -n.\n");
 	exit(0);
 }
 
 int main(int argc, char **argv) {
 	int ch;
 	char *argv0 = argv[0];
+	struct in_addr ipaddr;
 
-	while ((ch = getopt(argc, argv, "acrvnou"))!= -1)
+	while ((ch = getopt(argc, argv, "acrvn"))!= -1)
 	switch (ch) {
 	case 'a':
 		aflag++;
@@ -611,31 +327,30 @@ int main(int argc, char **argv) {
 		nflag = 1;
 		break;
 
-	case 'o':
-		oflag = 1;
-		break;
-
-	case 'u':
-		uflag = 1;
-		break;
-
 	default:
 		usage(argv0);
 	}
 	argc -= optind;
 	argv += optind;
 
-	if ((argc == 2 || argc == 3) && !nflag && !uflag) {
-		viewdb(argv[0], argv[1], argv[2], oflag);
+	/*
+	 *	Older versions also took the name of an index file, which
+	 *	is no longer used.  Skip it, so existing scripts still work.
+	 */
+	if ((argc == (nflag ? 5 : 3)) ||
+	    (!nflag && (argc == 2) && (inet_aton(argv[1], &ipaddr) == 0))) {
+		argv[1] = argv[0];
+		argc--;
+		argv++;
+	}
+
+	if ((argc == 1 || argc == 2) && !nflag) {
+		viewdb(argv[0], argv[1]);
 		if (cflag) printf("%d\n", active);
+	} else if (argc == 4 && nflag) {
+		addip(argv[0], argv[1], argv[2], argv[3]);
 	} else {
-		if (argc == 5 && nflag) {
-			addip(argv[0], argv[1], argv[2], argv[3], argv[4], oflag);
-		} else if (argc == 2 && uflag) {
-			tonewformat(argv[0], argv[1]);
-		} else {
-			usage(argv0);
-		}
+		usage(argv0);
 	}
 
 	return 0;
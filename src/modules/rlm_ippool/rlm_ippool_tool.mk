@@ -5,8 +5,6 @@
 SOURCES		:= rlm_ippool_tool.c
 TARGET		:= rlm_ippool_tool
 TGT_PREREQS	:= libfreeradius-radius.a
-
-SRC_CFLAGS	:= $(rlm_ippool_CFLAGS)
-TGT_LDLIBS	:= $(LIBS) $(rlm_ippool_LDLIBS)
+TGT_LDLIBS	:= $(LIBS)
 
 MAN		:= rlm_ippool_tool.8
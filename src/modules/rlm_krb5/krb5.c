@@ -97,8 +97,6 @@ char const *rlm_krb5_error(krb5_context context, krb5_error_code code)
  * @return 0 (always indicates success).
  */
 static int _mod_conn_free(rlm_krb5_handle_t *conn) {
-	krb5_free_context(conn->context);
-
 	if (conn->keytab) {
 		krb5_kt_close(conn->context, conn->keytab);
 	}
@@ -109,9 +107,54 @@ static int _mod_conn_free(rlm_krb5_handle_t *conn) {
 	}
 #endif
 
+	krb5_free_context(conn->context);
+
 	return 0;
 }
 
+/** Copy all entries in a keytab into a new memory keytab
+ *
+ * File keytabs are opened and scanned every time a key is needed from them,
+ * memory keytabs are just a list.
+ *
+ * @param[in] context Kerberos context.
+ * @param[in] in keytab to copy.
+ * @param[in] name of the memory keytab, must be unique.
+ * @param[out] out Where to write the new keytab.
+ * @return 0 on success, else a kerberos error code.
+ */
+static krb5_error_code krb5_keytab_copy(krb5_context context, krb5_keytab in, char const *name, krb5_keytab *out)
+{
+	krb5_error_code ret;
+	krb5_kt_cursor cursor;
+	krb5_keytab_entry entry;
+
+	ret = krb5_kt_resolve(context, name, out);
+	if (ret) return ret;
+
+	ret = krb5_kt_start_seq_get(context, in, &cursor);
+	if (ret) goto error;
+
+	while ((ret = krb5_kt_next_entry(context, in, &entry, &cursor)) == 0) {
+		ret = krb5_kt_add_entry(context, *out, &entry);
+#ifdef HEIMDAL_KRB5
+		krb5_kt_free_entry(context, &entry);
+#else
+		krb5_free_keytab_entry_contents(context, &entry);
+#endif
+		if (ret) break;
+	}
+	krb5_kt_end_seq_get(context, in, &cursor);
+
+	if (ret == KRB5_KT_END) return 0;
+
+error:
+	krb5_kt_close(context, *out);
+	*out = NULL;
+
+	return ret;
+}
+
 /** Create and return a new connection
  *
  * libkrb5(s) can talk to the KDC over TCP. Were assuming something sane is implemented
@@ -143,6 +186,27 @@ void *mod_conn_create(TALLOC_CTX *ctx, void *instance)
 		goto cleanup;
 	}
 
+	/*
+	 *	Replace the keytab with an in memory copy
+	 */
+	if (inst->cache_keytab) {
+		krb5_keytab copy;
+		char name[128];
+
+		snprintf(name, sizeof(name), "MEMORY:rlm_krb5_%s_%p", inst->xlat_name, conn);
+
+		ret = krb5_keytab_copy(conn->context, conn->keytab, name, &copy);
+		if (ret) {
+			ERROR("rlm_krb5 (%s): Copying keytab failed: %s", inst->xlat_name,
+			      rlm_krb5_error(conn->context, ret));
+
+			goto cleanup;
+		}
+
+		krb5_kt_close(conn->context, conn->keytab);
+		conn->keytab = copy;
+	}
+
 #ifdef HEIMDAL_KRB5
 	ret = krb5_cc_new_unique(conn->context, "MEMORY", NULL, &conn->ccache);
 	if (ret) {
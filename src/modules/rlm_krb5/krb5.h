@@ -62,6 +62,13 @@ typedef struct rlm_krb5_t {
 						//!< service_princ, or NULL.
 	char			*service;	//!< The service component of service_princ, or NULL.
 
+	bool			cache_keytab;	//!< Copy the keytab into a memory keytab for each
+						//!< context, so verification doesn't read the keytab
+						//!< file for every request.
+	bool			service_ticket;	//!< Request the initial credentials for the service
+						//!< principal, so they can be verified without a
+						//!< TGS exchange.
+
 	krb5_context context;			//!< The kerberos context (cloned once per request).
 
 #ifndef HEIMDAL_KRB5
@@ -72,6 +79,7 @@ typedef struct rlm_krb5_t {
 
 	krb5_principal server;			//!< A structure representing the parsed
 						//!< service_princ.
+	char		*server_name;		//!< server, as a string, for requesting credentials.
 #endif
 } rlm_krb5_t;
 
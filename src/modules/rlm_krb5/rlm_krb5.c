@@ -34,6 +34,8 @@ RCSID("$Id$")
 static const CONF_PARSER module_config[] = {
 	{ "keytab", FR_CONF_OFFSET(PW_TYPE_STRING, rlm_krb5_t, keytabname), NULL },
 	{ "service_principal", FR_CONF_OFFSET(PW_TYPE_STRING, rlm_krb5_t, service_princ), NULL },
+	{ "cache_keytab", FR_CONF_OFFSET(PW_TYPE_BOOLEAN, rlm_krb5_t, cache_keytab), "no" },
+	{ "service_ticket", FR_CONF_OFFSET(PW_TYPE_BOOLEAN, rlm_krb5_t, service_ticket), "no" },
 	{ NULL, -1, 0, NULL, NULL }
 };
 
@@ -51,6 +53,10 @@ static int mod_detach(void *instance)
 	if (inst->server) {
 		krb5_free_principal(inst->context, inst->server);
 	}
+
+	if (inst->server_name) {
+		krb5_free_unparsed_name(inst->context, inst->server_name);
+	}
 #endif
 
 	/* Don't free hostname, it's just a pointer into service_princ */
@@ -73,7 +79,6 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 #ifndef HEIMDAL_KRB5
 	krb5_keytab keytab;
 	char keytab_name[200];
-	char *princ_name;
 #endif
 
 #ifdef HEIMDAL_KRB5
@@ -149,6 +154,10 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 		DEBUG("rlm_krb5 (%s): Ignoring hostname component of service principal \"%s\", not "
 		      "needed/supported by Heimdal", inst->xlat_name, inst->hostname);
 	}
+
+	if (inst->service_ticket) {
+		WARN("rlm_krb5 (%s): Ignoring \"service_ticket\", not supported with Heimdal", inst->xlat_name);
+	}
 #else
 
 	/*
@@ -162,7 +171,7 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 		return -1;
 	}
 
-	ret = krb5_unparse_name(inst->context, inst->server, &princ_name);
+	ret = krb5_unparse_name(inst->context, inst->server, &inst->server_name);
 	if (ret) {
 		/* Uh? */
 		ERROR("rlm_krb5 (%s): Failed constructing service principal string: %s", inst->xlat_name,
@@ -174,8 +183,7 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 	/*
 	 *	Not necessarily the same as the config item
 	 */
-	DEBUG("rlm_krb5 (%s): Using service principal \"%s\"", inst->xlat_name, princ_name);
-	krb5_free_unparsed_name(inst->context, princ_name);
+	DEBUG("rlm_krb5 (%s): Using service principal \"%s\"", inst->xlat_name, inst->server_name);
 
 	/*
 	 *	Setup options for getting credentials and verifying them
@@ -437,11 +445,20 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(void *instance, REQUEST *re
 
 	/*
 	 * 	Retrieve the TGT from the TGS/KDC and check we can decrypt it.
+	 *
+	 *	Or retrieve a ticket for the service principal directly,
+	 *	which krb5_verify_init_creds can check against the keytab
+	 *	without asking the KDC for one.
 	 */
 	memcpy(&password, &request->password->vp_strvalue, sizeof(password));
-	RDEBUG("Retrieving and decrypting TGT");
+	if (inst->service_ticket) {
+		RDEBUG("Retrieving and decrypting ticket for \"%s\"", inst->server_name);
+	} else {
+		RDEBUG("Retrieving and decrypting TGT");
+	}
 	ret = krb5_get_init_creds_password(conn->context, &init_creds, client, password,
-					   NULL, NULL, 0, NULL, inst->gic_options);
+					   NULL, NULL, 0, inst->service_ticket ? inst->server_name : NULL,
+					   inst->gic_options);
 	if (ret) {
 		rcode = krb5_process_error(request, conn, ret);
 		goto cleanup;
@@ -489,4 +506,8 @@ module_t rlm_krb5 = {
 		NULL,			/* post-proxy */
 		NULL			/* post-auth */
 	},
+	0,				/* thread_inst_size */
+	NULL,				/* thread_instantiate */
+	NULL,				/* thread_detach */
+	NULL				/* cache_flush */
 };
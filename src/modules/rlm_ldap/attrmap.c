@@ -407,6 +407,57 @@ void rlm_ldap_map_do(UNUSED const ldap_instance_t *inst, REQUEST *request, LDAP
 	}
 }
 
+/** Convert attribute map into valuepairs, using a mirrored object
+ *
+ * The same as rlm_ldap_map_do, but the values come from the mirror, which must be read locked.
+ */
+void rlm_ldap_map_do_mirror(const ldap_instance_t *inst, REQUEST *request, rlm_ldap_map_xlat_t const *expanded,
+			    ldap_mirror_obj_t const *obj)
+{
+	value_pair_map_t const 	*map;
+	unsigned int		total = 0;
+
+	rlm_ldap_result_t	result;
+	char const		*name;
+
+	for (map = expanded->maps; map != NULL; map = map->next) {
+		name = expanded->attrs[total++];
+
+		result.values = rlm_ldap_mirror_values(obj, name);
+		if (!result.values) {
+			RDEBUG3("Attribute \"%s\" not found in LDAP object", name);
+			continue;
+		}
+
+		for (result.count = 0; result.values[result.count]; result.count++);
+
+		if (map_to_request(request, map, rlm_ldap_map_getvalue, &result) == -1) return;	/* Fail */
+	}
+
+	if (inst->valuepair_attr) {
+		struct berval	**values;
+		int		i;
+
+		values = rlm_ldap_mirror_values(obj, inst->valuepair_attr);
+		for (i = 0; values && values[i]; i++) {
+			value_pair_map_t *attr;
+
+			RDEBUG3("Parsing attribute string '%s'", values[i]->bv_val);
+			if (map_afrom_vp_str(&attr, request, values[i]->bv_val,
+					     REQUEST_CURRENT, PAIR_LIST_REPLY,
+					     REQUEST_CURRENT, PAIR_LIST_REQUEST) < 0) {
+				RWDEBUG("Failed parsing '%s' value \"%s\" as valuepair, skipping...",
+					inst->valuepair_attr, values[i]->bv_val);
+				continue;
+			}
+			if (map_to_request(request, attr, map_to_vp, NULL) < 0) {
+				RWDEBUG("Failed adding \"%s\" to request, skipping...", values[i]->bv_val);
+			}
+			talloc_free(attr);
+		}
+	}
+}
+
 /** Search for and apply an LDAP profile
  *
  * LDAP profiles are mapped using the same attribute map as user objects, they're used to add common sets of attributes
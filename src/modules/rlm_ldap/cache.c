@@ -0,0 +1,546 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License, version 2 if the
+ *   License as published by the Free Software Foundation.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file cache.c
+ * @brief LDAP module cache of user objects and group memberships.
+ *
+ * Entries are found by the expanded base DN and filter of the user search,
+ * and hold the DN of the user object, the result of the search, and any group
+ * memberships which were determined for the user.  Users who weren't found
+ * are remembered for a shorter time.
+ *
+ * @copyright 2014 The FreeRADIUS Server Project.
+ */
+#include	<freeradius-devel/rad_assert.h>
+
+#include	"ldap.h"
+
+#ifdef HAVE_PTHREAD_H
+#  define CACHE_LOCK(_inst)	pthread_mutex_lock(&(_inst)->cache_mutex)
+#  define CACHE_UNLOCK(_inst)	pthread_mutex_unlock(&(_inst)->cache_mutex)
+#else
+#  define CACHE_LOCK(_inst)
+#  define CACHE_UNLOCK(_inst)
+#endif
+
+#define LDAP_CACHE_REQUEST_DATA	0	//!< unique_int of the request data holding the entry.
+
+/** Whether a user is a member of a group
+ *
+ */
+typedef struct ldap_cache_check {
+	char const		*group;		//!< Name or DN, as given in the comparison.
+	bool			found;		//!< The user is a member.
+	struct ldap_cache_check	*next;
+} ldap_cache_check_t;
+
+/** A reference to an entry held by a request
+ *
+ */
+typedef struct ldap_cache_ref {
+	ldap_instance_t		*inst;
+	ldap_cache_entry_t	*entry;
+} ldap_cache_ref_t;
+
+static int ldap_cache_cmp(void const *one, void const *two)
+{
+	ldap_cache_entry_t const *a = one;
+	ldap_cache_entry_t const *b = two;
+
+	return strcmp(a->key, b->key);
+}
+
+static int ldap_cache_heap_cmp(void const *one, void const *two)
+{
+	ldap_cache_entry_t const *a = one;
+	ldap_cache_entry_t const *b = two;
+
+	if (a->expires < b->expires) return -1;
+	if (a->expires > b->expires) return +1;
+
+	return 0;
+}
+
+static int _ldap_cache_entry_free(ldap_cache_entry_t *entry)
+{
+	if (entry->result) ldap_msgfree(entry->result);
+
+	return 0;
+}
+
+/** Drop a reference to an entry, freeing it if it was the last
+ *
+ * Must be called with the cache mutex held.
+ */
+static void ldap_cache_unref(ldap_cache_entry_t *entry)
+{
+	rad_assert(entry->refs > 0);
+
+	if (--entry->refs == 0) talloc_free(entry);
+}
+
+/** Remove an entry from the cache
+ *
+ * Must be called with the cache mutex held.  The entry is freed once no
+ * request is using it.
+ */
+static void ldap_cache_remove(ldap_instance_t *inst, ldap_cache_entry_t *entry)
+{
+	fr_heap_extract(inst->cache_heap, entry);
+	rbtree_deletebydata(inst->cache, entry);
+	ldap_cache_unref(entry);
+}
+
+/** Remove expired entries from the cache
+ *
+ * Must be called with the cache mutex held.
+ */
+static void ldap_cache_expire(ldap_instance_t *inst, time_t now)
+{
+	ldap_cache_entry_t *entry;
+
+	while ((entry = fr_heap_peek(inst->cache_heap)) && (entry->expires <= now)) {
+		ldap_cache_remove(inst, entry);
+	}
+}
+
+static int _ldap_cache_ref_free(ldap_cache_ref_t *ref)
+{
+	CACHE_LOCK(ref->inst);
+	ldap_cache_unref(ref->entry);
+	CACHE_UNLOCK(ref->inst);
+
+	return 0;
+}
+
+/** Make the request hold a reference to an entry
+ *
+ * The caller must already have counted the reference.  It's dropped when the
+ * request is freed, or when another entry is attached to it.
+ */
+static ldap_cache_entry_t *ldap_cache_attach(ldap_instance_t *inst, REQUEST *request, ldap_cache_entry_t *entry)
+{
+	ldap_cache_ref_t *ref;
+
+	ref = talloc(request, ldap_cache_ref_t);
+	if (!ref) {
+	error:
+		CACHE_LOCK(inst);
+		ldap_cache_unref(entry);
+		CACHE_UNLOCK(inst);
+
+		return NULL;
+	}
+	ref->inst = inst;
+	ref->entry = entry;
+
+	if (request_data_add(request, inst, LDAP_CACHE_REQUEST_DATA, ref, true) < 0) {
+		talloc_free(ref);
+		goto error;
+	}
+	talloc_set_destructor(ref, _ldap_cache_ref_free);
+
+	return entry;
+}
+
+/** Check whether an entry holds the attributes a search wants
+ *
+ */
+static bool ldap_cache_attrs_match(char const * const *a, char const * const *b)
+{
+	if (!a || !b) return (a == b);
+
+	while (*a && *b) {
+		if (strcmp(*a++, *b++) != 0) return false;
+	}
+
+	return (!*a && !*b);
+}
+
+/** Create the cache
+ *
+ * @param[in] inst rlm_ldap configuration.
+ * @return 0 on success, -1 on error.
+ */
+int rlm_ldap_cache_init(ldap_instance_t *inst)
+{
+#ifdef HAVE_PTHREAD_H
+	if (pthread_mutex_init(&inst->cache_mutex, NULL) < 0) {
+		LDAP_ERR("Failed initializing cache mutex: %s", fr_syserror(errno));
+		return -1;
+	}
+#endif
+
+	inst->cache = rbtree_create(NULL, ldap_cache_cmp, NULL, 0);
+	if (!inst->cache) {
+		LDAP_ERR("Failed creating cache");
+		return -1;
+	}
+
+	inst->cache_heap = fr_heap_create(ldap_cache_heap_cmp, offsetof(ldap_cache_entry_t, heap_id));
+	if (!inst->cache_heap) {
+		LDAP_ERR("Failed creating heap for the cache");
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Free the cache, and all of the entries in it
+ *
+ * @param[in] inst rlm_ldap configuration.
+ */
+void rlm_ldap_cache_free(ldap_instance_t *inst)
+{
+	ldap_cache_entry_t *entry;
+
+	if (!inst->cache) return;
+
+	if (inst->cache_heap) {
+		while ((entry = fr_heap_peek(inst->cache_heap))) ldap_cache_remove(inst, entry);
+		fr_heap_delete(inst->cache_heap);
+		inst->cache_heap = NULL;
+	}
+
+	rbtree_free(inst->cache);
+	inst->cache = NULL;
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_destroy(&inst->cache_mutex);
+#endif
+}
+
+/** Find the cached result of a user search
+ *
+ * If an entry is found the request holds a reference to it, until the request
+ * is freed.
+ *
+ * @param[in] inst rlm_ldap configuration.
+ * @param[in] request Current request.
+ * @param[in] key Expanded base DN and filter of the search.
+ * @param[in] attrs the search retrieves.
+ * @param[in] want_result If true, only return entries holding the result of a search for attrs.
+ * @return the entry (which has a NULL DN if the user wasn't found), or NULL if there's no usable entry.
+ */
+ldap_cache_entry_t *rlm_ldap_cache_find(ldap_instance_t const *inst, REQUEST *request, char const *key,
+					char const * const *attrs, bool want_result)
+{
+	ldap_instance_t		*mutable;
+	ldap_cache_entry_t	*entry, my_entry;
+
+	memcpy(&mutable, &inst, sizeof(mutable));
+
+	my_entry.key = key;
+
+	CACHE_LOCK(mutable);
+	ldap_cache_expire(mutable, request->timestamp);
+
+	entry = rbtree_finddata(inst->cache, &my_entry);
+	if (!entry || (entry->dn && want_result && (!entry->result || !ldap_cache_attrs_match(entry->attrs, attrs)))) {
+		CACHE_UNLOCK(mutable);
+
+		return NULL;
+	}
+	entry->refs++;
+	CACHE_UNLOCK(mutable);
+
+	return ldap_cache_attach(mutable, request, entry);
+}
+
+/** Cache the result of a user search
+ *
+ * The entry takes ownership of the result, which is freed with the entry,
+ * even if the entry can't be created.  The request holds a reference to the
+ * new entry until it's freed.
+ *
+ * @param[in] inst rlm_ldap configuration.
+ * @param[in] request Current request.
+ * @param[in] key Expanded base DN and filter of the search.
+ * @param[in] dn of the user object, NULL if the user wasn't found.
+ * @param[in] attrs the search retrieved.
+ * @param[in] result of the search, may be NULL.
+ * @return the new entry, or NULL on error.
+ */
+ldap_cache_entry_t *rlm_ldap_cache_add(ldap_instance_t const *inst, REQUEST *request, char const *key,
+				       char const *dn, char const * const *attrs, LDAPMessage *result)
+{
+	ldap_instance_t		*mutable;
+	ldap_cache_entry_t	*entry, *old;
+	int			i;
+
+	memcpy(&mutable, &inst, sizeof(mutable));
+
+	entry = talloc_zero(NULL, ldap_cache_entry_t);
+	if (!entry) {
+		if (result) ldap_msgfree(result);
+		return NULL;
+	}
+	entry->result = result;
+	talloc_set_destructor(entry, _ldap_cache_entry_free);
+
+	entry->key = talloc_typed_strdup(entry, key);
+	entry->name = talloc_typed_strdup(entry, request->username ? request->username->vp_strvalue : "");
+	if (dn) entry->dn = talloc_typed_strdup(entry, dn);
+
+	if (result && attrs) {
+		char const **p;
+
+		i = 0;
+		while (attrs[i]) i++;
+
+		entry->attrs = p = talloc_array(entry, char const *, i + 1);
+		for (i = 0; attrs[i]; i++) p[i] = talloc_typed_strdup(entry, attrs[i]);
+		p[i] = NULL;
+	}
+
+	entry->expires = request->timestamp + (dn ? inst->cache_ttl : inst->cache_negative_ttl);
+	entry->refs = 1;	/* The request's */
+
+	CACHE_LOCK(mutable);
+	ldap_cache_expire(mutable, request->timestamp);
+
+	/*
+	 *	We searched because the entry for the key didn't
+	 *	hold what we wanted.  Replace it.
+	 */
+	old = rbtree_finddata(inst->cache, entry);
+	if (old) ldap_cache_remove(mutable, old);
+
+	/*
+	 *	Make room by removing the entry which would expire
+	 *	soonest.
+	 */
+	if (rbtree_num_elements(inst->cache) >= inst->cache_max_entries) {
+		old = fr_heap_peek(inst->cache_heap);
+		if (old) ldap_cache_remove(mutable, old);
+	}
+
+	if (!rbtree_insert(inst->cache, entry)) {
+		RWDEBUG("Failed adding user object to the cache");
+	} else if (!fr_heap_insert(inst->cache_heap, entry)) {
+		RWDEBUG("Failed adding user object to the cache");
+		rbtree_deletebydata(inst->cache, entry);
+	} else {
+		entry->refs++;	/* The cache's */
+	}
+	CACHE_UNLOCK(mutable);
+
+	return ldap_cache_attach(mutable, request, entry);
+}
+
+/** Return the entry the request found or added
+ *
+ * @param[in] inst rlm_ldap configuration.
+ * @param[in] request Current request.
+ * @return the entry, or NULL if the request doesn't hold one.
+ */
+ldap_cache_entry_t *rlm_ldap_cache_request(ldap_instance_t const *inst, REQUEST *request)
+{
+	ldap_instance_t		*mutable;
+	ldap_cache_ref_t	*ref;
+
+	if (!inst->cache) return NULL;
+
+	memcpy(&mutable, &inst, sizeof(mutable));
+
+	ref = request_data_reference(request, mutable, LDAP_CACHE_REQUEST_DATA);
+	if (!ref) return NULL;
+
+	return ref->entry;
+}
+
+/** Add the cached group memberships of a user to the control list
+ *
+ * @param[in] inst rlm_ldap configuration.
+ * @param[in] request Current request.
+ * @param[in] entry for the user.
+ * @return true if the memberships were cached, else false.
+ */
+bool rlm_ldap_cache_groups_get(ldap_instance_t const *inst, REQUEST *request, ldap_cache_entry_t *entry)
+{
+	ldap_instance_t	*mutable;
+	VALUE_PAIR	*vp;
+	vp_cursor_t	cursor;
+
+	memcpy(&mutable, &inst, sizeof(mutable));
+
+	CACHE_LOCK(mutable);
+	if (!entry->groups_done) {
+		CACHE_UNLOCK(mutable);
+		return false;
+	}
+
+	RDEBUG("Using cached group memberships");
+	for (vp = fr_cursor_init(&cursor, &entry->groups);
+	     vp;
+	     vp = fr_cursor_next(&cursor)) {
+		pairadd(&request->config_items, paircopyvp(request, vp));
+		RDEBUG("Added control:%s with value \"%s\"", vp->da->name, vp->vp_strvalue);
+	}
+	CACHE_UNLOCK(mutable);
+
+	return true;
+}
+
+/** Cache the group memberships of a user
+ *
+ * @param[in] inst rlm_ldap configuration.
+ * @param[in] request Current request.
+ * @param[in] entry for the user.
+ * @param[in] skip Number of cache_da pairs which were in the control list before the
+ *	memberships were determined.
+ */
+void rlm_ldap_cache_groups_set(ldap_instance_t const *inst, REQUEST *request, ldap_cache_entry_t *entry,
+			       int skip)
+{
+	ldap_instance_t	*mutable;
+	VALUE_PAIR	*vp;
+	vp_cursor_t	in, out;
+
+	memcpy(&mutable, &inst, sizeof(mutable));
+
+	CACHE_LOCK(mutable);
+	if (entry->groups_done) {
+		CACHE_UNLOCK(mutable);
+		return;
+	}
+
+	fr_cursor_init(&out, &entry->groups);
+	fr_cursor_init(&in, &request->config_items);
+	while ((vp = fr_cursor_next_by_num(&in, inst->cache_da->attr, inst->cache_da->vendor, TAG_ANY))) {
+		if (skip > 0) {
+			skip--;
+			continue;
+		}
+
+		fr_cursor_insert(&out, paircopyvp(entry, vp));
+	}
+	entry->groups_done = true;
+	CACHE_UNLOCK(mutable);
+}
+
+/** Find the cached result of a group comparison
+ *
+ * @param[in] inst rlm_ldap configuration.
+ * @param[in] entry for the user.
+ * @param[in] group name or DN.
+ * @return 1 if the user is a member, 0 if the user isn't, -1 if the result isn't cached.
+ */
+int rlm_ldap_cache_check_get(ldap_instance_t const *inst, ldap_cache_entry_t *entry, char const *group)
+{
+	ldap_instance_t		*mutable;
+	ldap_cache_check_t	*check;
+	int			rcode = -1;
+
+	memcpy(&mutable, &inst, sizeof(mutable));
+
+	CACHE_LOCK(mutable);
+	for (check = entry->checked; check; check = check->next) {
+		if (strcmp(check->group, group) == 0) {
+			rcode = check->found ? 1 : 0;
+			break;
+		}
+	}
+	CACHE_UNLOCK(mutable);
+
+	return rcode;
+}
+
+/** Cache the result of a group comparison
+ *
+ * @param[in] inst rlm_ldap configuration.
+ * @param[in] entry for the user.
+ * @param[in] group name or DN.
+ * @param[in] found Whether the user is a member.
+ */
+void rlm_ldap_cache_check_set(ldap_instance_t const *inst, ldap_cache_entry_t *entry, char const *group,
+			      bool found)
+{
+	ldap_instance_t		*mutable;
+	ldap_cache_check_t	*check;
+
+	memcpy(&mutable, &inst, sizeof(mutable));
+
+	CACHE_LOCK(mutable);
+	if (entry->num_checked >= LDAP_CACHE_MAX_CHECKED) goto finish;
+
+	for (check = entry->checked; check; check = check->next) {
+		if (strcmp(check->group, group) == 0) goto finish;
+	}
+
+	check = talloc(entry, ldap_cache_check_t);
+	if (!check) goto finish;
+
+	check->group = talloc_typed_strdup(check, group);
+	check->found = found;
+	check->next = entry->checked;
+	entry->checked = check;
+	entry->num_checked++;
+
+finish:
+	CACHE_UNLOCK(mutable);
+}
+
+typedef struct ldap_cache_flush {
+	fr_heap_t	*heap;
+	char const	*key;
+	int		count;
+} ldap_cache_flush_t;
+
+static int ldap_cache_flush_walk(void *ctx, void *data)
+{
+	ldap_cache_flush_t	*flush = ctx;
+	ldap_cache_entry_t	*entry = data;
+
+	if (flush->key &&
+	    (strcmp(entry->name, flush->key) != 0) &&
+	    (!entry->dn || (strcasecmp(entry->dn, flush->key) != 0))) return 0;
+
+	fr_heap_extract(flush->heap, entry);
+	ldap_cache_unref(entry);
+	flush->count++;
+
+	return 2;	/* Delete and continue */
+}
+
+/** Discard cached user objects
+ *
+ * Called by "radmin flush module <module> [<key>]".
+ *
+ * @param[in] instance rlm_ldap configuration.
+ * @param[in] key User-Name or DN of the users to discard, or NULL to discard all entries.
+ * @return the number of entries discarded.
+ */
+int rlm_ldap_cache_flush(void *instance, char const *key)
+{
+	ldap_instance_t		*inst = instance;
+	ldap_cache_flush_t	flush;
+
+	if (!inst->cache) return 0;
+
+	flush.heap = inst->cache_heap;
+	flush.key = key;
+	flush.count = 0;
+
+	CACHE_LOCK(inst);
+	rbtree_walk(inst->cache, RBTREE_DELETE_ORDER, ldap_cache_flush_walk, &flush);
+	CACHE_UNLOCK(inst);
+
+	LDAP_INFO("Flushed %i cached user objects", flush.count);
+
+	return flush.count;
+}
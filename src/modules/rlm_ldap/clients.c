@@ -142,7 +142,8 @@ int rlm_ldap_client_load(ldap_instance_t const *inst, CONF_SECTION *cs)
 	LDAPMessage	*entry;
 	char		*dn = NULL;
 
-	RADCLIENT	*c;
+	RADCLIENT	*c, **clients = NULL;
+	int		num = 0;
 
 	LDAP_DBG("Loading dynamic clients");
 
@@ -169,7 +170,7 @@ int rlm_ldap_client_load(ldap_instance_t const *inst, CONF_SECTION *cs)
 	/*
 	 *	Perform all searches as the admin user.
 	 */
-	if (conn->rebound) {
+	if (!inst->mux && conn->rebound) {
 		status = rlm_ldap_bind(inst, NULL, &conn, inst->admin_dn, inst->password, true);
 		if (status != LDAP_PROC_SUCCESS) {
 			ret = -1;
@@ -247,14 +248,25 @@ int rlm_ldap_client_load(ldap_instance_t const *inst, CONF_SECTION *cs)
 		 */
 		talloc_steal(c, cc);
 
-		if (!client_add(NULL, c)) {
-			LDAP_ERR("Failed to add client \"%s\", possible duplicate?", dn);
-			ret = -1;
-			client_free(c);
-			goto finish;
+		/*
+		 *	Collect the clients, and add them all at once
+		 *	when we're done with the connection.
+		 */
+		if ((num & 0xff) == 0) {
+			RADCLIENT **tmp;
+
+			tmp = talloc_realloc(NULL, clients, RADCLIENT *, num + 256);
+			if (!tmp) {
+				LDAP_ERR("Out of memory");
+				ret = -1;
+				client_free(c);
+				goto finish;
+			}
+			clients = tmp;
 		}
+		clients[num++] = c;
 
-		LDAP_DBG("Client \"%s\" added", dn);
+		LDAP_DBG("Client \"%s\" loaded", dn);
 
 		ldap_memfree(dn);
 		dn = NULL;
@@ -267,6 +279,14 @@ finish:
 
 	rlm_ldap_release_socket(inst, conn);
 
+	if (ret < 0) {
+		while (num > 0) client_free(clients[--num]);
+	} else if (client_add_bulk(NULL, clients, num, true) < 0) {
+		LDAP_ERR("Failed to add clients, possible duplicates?");
+		ret = -1;
+	}
+	talloc_free(clients);
+
 	return ret;
 }
 
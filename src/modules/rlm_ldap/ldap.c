@@ -28,6 +28,7 @@
 
 #include <stdarg.h>
 #include <ctype.h>
+#include <poll.h>
 
 #include <lber.h>
 #include <ldap.h>
@@ -233,6 +234,322 @@ char const *rlm_ldap_error_str(ldap_handle_t const *conn)
 	return ldap_err2string(lib_errno);
 }
 
+#ifdef HAVE_PTHREAD_H
+#  define MUX_LOCK(_mux)	pthread_mutex_lock(&(_mux)->mutex)
+#  define MUX_UNLOCK(_mux)	pthread_mutex_unlock(&(_mux)->mutex)
+#  define MUX_SIGNAL(_mux)	pthread_cond_broadcast(&(_mux)->cond)
+#else
+#  define MUX_LOCK(_mux)
+#  define MUX_UNLOCK(_mux)
+#  define MUX_SIGNAL(_mux)
+#endif
+
+#define LDAP_MUX_POLL_MAX	100		//!< Most milliseconds the reader waits on the connection's socket
+						//!< before asking libldap, which may be reading from other
+						//!< sockets to chase referrals.
+
+/** Pick the multiplexed connection with the fewest searches waiting
+ *
+ * The counts are read without locking, as this only has to be roughly right.
+ */
+static ldap_mux_t *rlm_ldap_mux_pick(ldap_instance_t const *inst)
+{
+	uint32_t i;
+	ldap_mux_t *mux = &inst->mux[0];
+
+	for (i = 1; i < inst->multiplex; i++) {
+		if (inst->mux[i].outstanding < mux->outstanding) mux = &inst->mux[i];
+	}
+
+	return mux;
+}
+
+/** Fail all of the searches waiting on a connection, and close it
+ *
+ * Must be called with the mux mutex held.  The connection is reopened by the
+ * next search sent on it.
+ */
+static void rlm_ldap_mux_fail(ldap_mux_t *mux, int lib_errno)
+{
+	ldap_mux_wait_t *wait;
+
+	for (wait = mux->waiting; wait; wait = wait->next) {
+		wait->done = true;
+		wait->rcode = -1;
+		wait->lib_errno = lib_errno;
+	}
+
+	mux->waiting = NULL;
+	mux->outstanding = 0;
+
+	talloc_free(mux->conn);
+	mux->conn = NULL;
+}
+
+/** Hand a result to the search waiting for it
+ *
+ * Must be called with the mux mutex held.  Results for searches which have
+ * given up waiting are freed.
+ *
+ * The result is parsed here, with the handle which received it.  libldap
+ * expects that, and the handle's error state is only valid while we hold
+ * the mutex.
+ */
+static void rlm_ldap_mux_dispatch(ldap_mux_t *mux, LDAPMessage *msg)
+{
+	ldap_mux_wait_t **last, *wait;
+	int msgid;
+
+	msgid = ldap_msgid(msg);
+
+	for (last = &mux->waiting; *last; last = &(*last)->next) {
+		wait = *last;
+		if (wait->msgid != msgid) continue;
+
+		*last = wait->next;
+		mux->outstanding--;
+
+		wait->done = true;
+		wait->rcode = ldap_msgtype(msg);
+		wait->result = msg;
+		wait->lib_errno = ldap_parse_result(mux->conn->handle, msg, &wait->srv_errno,
+						    &wait->part_dn, &wait->srv_err, NULL, NULL, 0);
+		return;
+	}
+
+	ldap_msgfree(msg);
+}
+
+/** Send a search on one of the multiplexed connections
+ *
+ * If the search can't be sent, wait is marked as done, with the error.
+ *
+ * @param[in] inst rlm_ldap configuration.
+ * @param[out] wait to initialise, and add to the connection's list of waiting searches.
+ * @param[in] dn to use as base for the search.
+ * @param[in] scope to use (LDAP_SCOPE_BASE, LDAP_SCOPE_ONE, LDAP_SCOPE_SUB).
+ * @param[in] filter to use, should be pre-escaped.
+ * @param[in] attrs to retrieve.
+ * @param[in] tv server side time limit.
+ */
+static void rlm_ldap_mux_search(ldap_instance_t const *inst, ldap_mux_wait_t *wait, char const *dn, int scope,
+				char const *filter, char **attrs, struct timeval *tv)
+{
+	ldap_mux_t *mux;
+	ldap_instance_t *mutable;
+	int ret = LDAP_SERVER_DOWN;
+
+	memcpy(&mutable, &inst, sizeof(mutable));
+
+	mux = rlm_ldap_mux_pick(inst);
+
+	memset(wait, 0, sizeof(*wait));
+	wait->mux = mux;
+
+	MUX_LOCK(mux);
+	if (!mux->conn) {
+		DEBUG("rlm_ldap (%s): Reopening multiplexed connection", inst->xlat_name);
+		mux->conn = rlm_ldap_conn_open(NULL, mutable, true);
+		if (!mux->conn) goto error;
+	}
+
+	ret = ldap_search_ext(mux->conn->handle, dn, scope, filter, attrs, 0, NULL, NULL, tv, 0, &wait->msgid);
+	if (ret != LDAP_SUCCESS) {
+		if ((ret == LDAP_SERVER_DOWN) || (ret == LDAP_CONNECT_ERROR)) rlm_ldap_mux_fail(mux, ret);
+
+	error:
+		MUX_UNLOCK(mux);
+
+		wait->done = true;
+		wait->rcode = -1;
+		wait->lib_errno = ret;
+		return;
+	}
+
+	wait->next = mux->waiting;
+	mux->waiting = wait;
+	mux->outstanding++;
+	MUX_UNLOCK(mux);
+}
+
+/** Wait for the result of a search sent on a multiplexed connection
+ *
+ * Has the same return values as ldap_result.
+ *
+ * @param[in] inst rlm_ldap configuration.
+ * @param[in] wait as initialised by rlm_ldap_mux_search.
+ * @param[in] timeout how long to wait.
+ * @param[out] result the search result.
+ * @param[out] lib_errno the error, if we return -1.
+ * @return -1 on error, 0 on timeout, else the type of the result message.
+ */
+static int rlm_ldap_mux_result(ldap_instance_t const *inst, ldap_mux_wait_t *wait, struct timeval const *timeout,
+			       LDAPMessage **result, int *lib_errno)
+{
+	ldap_mux_t *mux = wait->mux;
+	ldap_mux_wait_t **last;
+	struct timeval now, when, zero;
+	struct pollfd pfd;
+	LDAPMessage *msg;
+	int rcode, ms;
+
+	if (wait->done) goto done;
+
+	gettimeofday(&now, NULL);
+	timeradd(&now, timeout, &when);
+
+	MUX_LOCK(mux);
+	while (!wait->done) {
+		gettimeofday(&now, NULL);
+		if (!timercmp(&now, &when, <)) break;
+
+#ifdef HAVE_PTHREAD_H
+		if (mux->reading) {
+			struct timespec ts;
+
+			ts.tv_sec = when.tv_sec;
+			ts.tv_nsec = when.tv_usec * 1000;
+
+			pthread_cond_timedwait(&mux->cond, &mux->mutex, &ts);
+			continue;
+		}
+#endif
+
+		/*
+		 *	No one else is reading, so we do.  Wait for data
+		 *	without the mutex held, so that other threads can
+		 *	send their searches.
+		 */
+		mux->reading = true;
+		pfd.fd = -1;
+		if (mux->conn) ldap_get_option(mux->conn->handle, LDAP_OPT_DESC, &pfd.fd);
+		MUX_UNLOCK(mux);
+
+		ms = ((when.tv_sec - now.tv_sec) * 1000) + ((when.tv_usec - now.tv_usec) / 1000);
+		if (ms > LDAP_MUX_POLL_MAX) ms = LDAP_MUX_POLL_MAX;
+		if (ms < 1) ms = 1;
+
+		if (pfd.fd >= 0) {
+			pfd.events = POLLIN;
+			pfd.revents = 0;
+			(void) poll(&pfd, 1, ms);
+		}
+
+		MUX_LOCK(mux);
+		mux->reading = false;
+
+		/*
+		 *	Hand out every complete result libldap has.
+		 */
+		if (mux->conn) {
+			memset(&zero, 0, sizeof(zero));
+
+			while ((rcode = ldap_result(mux->conn->handle, LDAP_RES_ANY, LDAP_MSG_ALL, &zero, &msg)) > 0) {
+				rlm_ldap_mux_dispatch(mux, msg);
+			}
+
+			if (rcode < 0) {
+				int err = LDAP_SUCCESS;
+
+				ldap_get_option(mux->conn->handle, LDAP_OPT_ERROR_NUMBER, &err);
+				if (err == LDAP_SUCCESS) err = LDAP_SERVER_DOWN;
+
+				LDAP_ERR("Multiplexed connection failed: %s", ldap_err2string(err));
+				rlm_ldap_mux_fail(mux, err);
+			}
+		}
+
+		MUX_SIGNAL(mux);
+	}
+
+	/*
+	 *	Timed out.  The result will be freed if it arrives.
+	 */
+	if (!wait->done) {
+		for (last = &mux->waiting; *last; last = &(*last)->next) {
+			if (*last != wait) continue;
+
+			*last = wait->next;
+			mux->outstanding--;
+			break;
+		}
+
+		if (mux->conn) ldap_abandon_ext(mux->conn->handle, wait->msgid, NULL, NULL);
+		MUX_UNLOCK(mux);
+
+		return 0;
+	}
+	MUX_UNLOCK(mux);
+
+done:
+	*result = wait->result;
+	*lib_errno = wait->lib_errno;
+
+	return wait->rcode;
+}
+
+/** Open the multiplexed connections
+ *
+ * Connections which can't be opened now are opened by the first search sent on them.
+ *
+ * @param[in] inst rlm_ldap configuration.
+ * @return 0 on success, -1 on error.
+ */
+int rlm_ldap_mux_init(ldap_instance_t *inst)
+{
+	uint32_t i;
+
+#ifndef HAVE_PTHREAD_H
+	if (inst->multiplex > 1) {
+		WARN("rlm_ldap (%s): Server is not threaded, using one multiplexed connection", inst->xlat_name);
+		inst->multiplex = 1;
+	}
+#endif
+
+	inst->mux = talloc_zero_array(inst, ldap_mux_t, inst->multiplex);
+	if (!inst->mux) return -1;
+
+	for (i = 0; i < inst->multiplex; i++) {
+#ifdef HAVE_PTHREAD_H
+		pthread_mutex_init(&inst->mux[i].mutex, NULL);
+		pthread_cond_init(&inst->mux[i].cond, NULL);
+#endif
+
+		/*
+		 *	Allocated in the NULL ctx, as they're reopened
+		 *	by whichever thread finds them closed.
+		 */
+		inst->mux[i].conn = rlm_ldap_conn_open(NULL, inst, true);
+		if (!inst->mux[i].conn) {
+			WARN("rlm_ldap (%s): Failed opening multiplexed connection %u, will retry", inst->xlat_name, i);
+		}
+	}
+
+	return 0;
+}
+
+/** Close the multiplexed connections
+ *
+ * @param[in] inst rlm_ldap configuration.
+ */
+void rlm_ldap_mux_free(ldap_instance_t *inst)
+{
+	uint32_t i;
+
+	if (!inst->mux) return;
+
+	for (i = 0; i < inst->multiplex; i++) {
+		talloc_free(inst->mux[i].conn);
+		inst->mux[i].conn = NULL;
+#ifdef HAVE_PTHREAD_H
+		pthread_mutex_destroy(&inst->mux[i].mutex);
+		pthread_cond_destroy(&inst->mux[i].cond);
+#endif
+	}
+
+	TALLOC_FREE(inst->mux);
+}
+
 /** Parse response from LDAP server dealing with any errors
  *
  * Should be called after an LDAP operation. Will check result of operation and if it was successful, then attempt
@@ -244,6 +561,7 @@ char const *rlm_ldap_error_str(ldap_handle_t const *conn)
  * @param[in] inst of LDAP module.
  * @param[in] conn Current connection.
  * @param[in] msgid returned from last operation.
+ * @param[in] wait if the operation was a search sent with rlm_ldap_mux_search, else NULL.
  * @param[in] dn Last search or bind DN.
  * @param[out] result Where to write result, if NULL result will be freed.
  * @param[out] error Where to write the error string, may be NULL, must not be freed.
@@ -251,7 +569,8 @@ char const *rlm_ldap_error_str(ldap_handle_t const *conn)
  *	(with talloc_free).
  * @return One of the LDAP_PROC_* codes.
  */
-static ldap_rcode_t rlm_ldap_result(ldap_instance_t const *inst, ldap_handle_t const *conn, int msgid, char const *dn,
+static ldap_rcode_t rlm_ldap_result(ldap_instance_t const *inst, ldap_handle_t const *conn, int msgid,
+				    ldap_mux_wait_t *wait, char const *dn,
 				    LDAPMessage **result, char const **error, char **extra)
 {
 	ldap_rcode_t status = LDAP_PROC_SUCCESS;
@@ -293,12 +612,16 @@ static ldap_rcode_t rlm_ldap_result(ldap_instance_t const *inst, ldap_handle_t c
 	*result = NULL;
 
 	/*
-	 *	Check if there was an error sending the request
+	 *	Check if there was an error sending the request.  The
+	 *	error number of a multiplexed connection may belong to
+	 *	another search, so rlm_ldap_mux_result returns it instead.
 	 */
-	ldap_get_option(conn->handle, LDAP_OPT_ERROR_NUMBER,
-			&lib_errno);
-	if (lib_errno != LDAP_SUCCESS) {
-		goto process_error;
+	if (!wait) {
+		ldap_get_option(conn->handle, LDAP_OPT_ERROR_NUMBER,
+				&lib_errno);
+		if (lib_errno != LDAP_SUCCESS) {
+			goto process_error;
+		}
 	}
 
 	memset(&tv, 0, sizeof(tv));
@@ -308,7 +631,42 @@ static ldap_rcode_t rlm_ldap_result(ldap_instance_t const *inst, ldap_handle_t c
 	 *	Now retrieve the result and check for errors
 	 *	ldap_result returns -1 on error, and 0 on timeout
 	 */
-	lib_errno = ldap_result(conn->handle, msgid, 1, &tv, result);
+	if (wait) {
+		int mux_errno = LDAP_SUCCESS;
+
+		lib_errno = rlm_ldap_mux_result(inst, wait, &tv, result, &mux_errno);
+		if (lib_errno == -1) {
+			lib_errno = mux_errno;
+			goto process_error;
+		}
+		if (lib_errno == 0) {
+			lib_errno = LDAP_TIMEOUT;
+			goto process_error;
+		}
+
+		/*
+		 *	Already parsed by whichever thread received it.
+		 */
+		lib_errno = wait->lib_errno;
+		srv_errno = wait->srv_errno;
+		if (extra) {
+			part_dn = wait->part_dn;
+			srv_err = wait->srv_err;
+		} else {
+			if (wait->part_dn) ldap_memfree(wait->part_dn);
+			if (wait->srv_err) ldap_memfree(wait->srv_err);
+		}
+		wait->part_dn = wait->srv_err = NULL;
+
+		if (freeit) {
+			ldap_msgfree(*result);
+			*result = NULL;
+		}
+
+		goto process_error;
+	} else {
+		lib_errno = ldap_result(conn->handle, msgid, 1, &tv, result);
+	}
 	if (lib_errno == 0) {
 		lib_errno = LDAP_TIMEOUT;
 
@@ -322,7 +680,7 @@ static ldap_rcode_t rlm_ldap_result(ldap_instance_t const *inst, ldap_handle_t c
 	}
 
 	/*
-	 *	Parse the result and check for errors sent by the server
+	 *	Parse the result and check for errors sent by the server.
 	 */
 	lib_errno = ldap_parse_result(conn->handle, *result,
 				      &srv_errno,
@@ -539,7 +897,7 @@ ldap_rcode_t rlm_ldap_bind(ldap_instance_t const *inst, REQUEST *request, ldap_h
 			}
 		}
 
-		status = rlm_ldap_result(inst, *pconn, msgid, dn, NULL, &error, &extra);
+		status = rlm_ldap_result(inst, *pconn, msgid, NULL, dn, NULL, &error, &extra);
 		switch (status) {
 		case LDAP_PROC_SUCCESS:
 			LDAP_DBG_REQ("Bind successful");
@@ -636,11 +994,23 @@ ldap_rcode_t rlm_ldap_search(ldap_instance_t const *inst, REQUEST *request, ldap
 	char const 	*error = NULL;
 	char		*extra = NULL;
 
+	ldap_mux_wait_t	wait;		// If the search is sent on a
+					// multiplexed connection.
+
 	int 		i;
 
 
 	rad_assert(*pconn && (*pconn)->handle);
 
+	/*
+	 *	Don't bother the directory if no one is waiting for
+	 *	the answer.
+	 */
+	if (request && request_expired(request)) {
+		REDEBUG("Request has passed its deadline, not searching");
+		return LDAP_PROC_ERROR;
+	}
+
 	/*
 	 *	OpenLDAP library doesn't declare attrs array as const, but
 	 *	it really should be *sigh*.
@@ -649,9 +1019,10 @@ ldap_rcode_t rlm_ldap_search(ldap_instance_t const *inst, REQUEST *request, ldap
 	memcpy(&search_attrs, &attrs, sizeof(attrs));
 
 	/*
-	 *	Do all searches as the admin user.
+	 *	Do all searches as the admin user.  Multiplexed
+	 *	connections are always bound as the admin user.
 	 */
-	if ((*pconn)->rebound) {
+	if (!inst->mux && (*pconn)->rebound) {
 		status = rlm_ldap_bind(inst, request, pconn, inst->admin_dn, inst->password, true);
 		if (status != LDAP_PROC_SUCCESS) {
 			return LDAP_PROC_ERROR;
@@ -681,17 +1052,35 @@ ldap_rcode_t rlm_ldap_search(ldap_instance_t const *inst, REQUEST *request, ldap
 	 *	For sanity, for when no connections are viable,
 	 *	and we can't make a new one.
 	 */
-	for (i = fr_connection_get_num(inst->pool); i >= 0; i--) {
-		(void) ldap_search_ext((*pconn)->handle, dn, scope, filter, search_attrs,
-				       0, NULL, NULL, &tv, 0, &msgid);
+	for (i = inst->mux ? (int) inst->multiplex : fr_connection_get_num(inst->pool); i >= 0; i--) {
+		if (inst->mux) {
+			rlm_ldap_mux_search(inst, &wait, dn, scope, filter, search_attrs, &tv);
+			msgid = wait.msgid;
+		} else {
+			(void) ldap_search_ext((*pconn)->handle, dn, scope, filter, search_attrs,
+					       0, NULL, NULL, &tv, 0, &msgid);
+		}
 
 		LDAP_DBG_REQ("Waiting for search result...");
-		status = rlm_ldap_result(inst, *pconn, msgid, dn, &our_result, &error, &extra);
+		status = rlm_ldap_result(inst, *pconn, msgid, inst->mux ? &wait : NULL, dn,
+					 &our_result, &error, &extra);
 		switch (status) {
 		case LDAP_PROC_SUCCESS:
 			break;
 
 		case LDAP_PROC_RETRY:
+			/*
+			 *	A failed multiplexed connection is
+			 *	reopened by the next search sent on it.
+			 */
+			if (inst->mux) {
+				LDAP_DBGW_REQ("Search failed: %s. Retrying...", error);
+
+				talloc_free(extra); /* don't leak debug info */
+
+				continue;
+			}
+
 			*pconn = fr_connection_reconnect(inst->pool, *pconn);
 			if (*pconn) {
 				LDAP_DBGW_REQ("Search failed: %s. Got new socket, retrying...", error);
@@ -780,6 +1169,11 @@ ldap_rcode_t rlm_ldap_modify(ldap_instance_t const *inst, REQUEST *request, ldap
 
 	rad_assert(*pconn && (*pconn)->handle);
 
+	if (request_expired(request)) {
+		REDEBUG("Request has passed its deadline, not modifying");
+		return LDAP_PROC_ERROR;
+	}
+
 	/*
 	 *	Perform all modifications as the admin user.
 	 */
@@ -803,7 +1197,7 @@ ldap_rcode_t rlm_ldap_modify(ldap_instance_t const *inst, REQUEST *request, ldap
 		(void) ldap_modify_ext((*pconn)->handle, dn, mods, NULL, NULL, &msgid);
 
 		RDEBUG2("Waiting for modify result...");
-		status = rlm_ldap_result(inst, *pconn, msgid, dn, NULL, &error, &extra);
+		status = rlm_ldap_result(inst, *pconn, msgid, NULL, dn, NULL, &error, &extra);
 		switch (status) {
 		case LDAP_PROC_SUCCESS:
 			break;
@@ -856,6 +1250,7 @@ finish:
  * @param[in] attrs Additional attributes to retrieve, may be NULL.
  * @param[in] force Query even if the User-DN already exists.
  * @param[out] result Where to write the result, may be NULL in which case result is discarded.
+ *	If the cache is enabled, the result belongs to the cache, and must not be freed.
  * @param[out] rcode The status of the operation, one of the RLM_MODULE_* codes.
  * @return The user's DN or NULL on error.
  */
@@ -872,6 +1267,9 @@ char const *rlm_ldap_find_user(ldap_instance_t const *inst, REQUEST *request, ld
 	char	    	filter[LDAP_MAX_FILTER_STR_LEN];
 	char		*filter_p = NULL;
 	char	    	base_dn[LDAP_MAX_DN_STR_LEN];
+	char		key[LDAP_MAX_DN_STR_LEN + LDAP_MAX_FILTER_STR_LEN + 1];
+	ldap_cache_entry_t *cached;
+	char const	*mirror_dn;
 
 	bool freeit = false;					//!< Whether the message should
 								//!< be freed after being processed.
@@ -901,18 +1299,10 @@ char const *rlm_ldap_find_user(ldap_instance_t const *inst, REQUEST *request, ld
 	}
 
 	/*
-	 *	Perform all searches as the admin user.
+	 *	Only the DN is wanted, and the mirror knows it.
 	 */
-	if ((*pconn)->rebound) {
-		status = rlm_ldap_bind(inst, request, pconn, inst->admin_dn, inst->password, true);
-		if (status != LDAP_PROC_SUCCESS) {
-			*rcode = RLM_MODULE_FAIL;
-			return NULL;
-		}
-
-		rad_assert(*pconn);
-
-		(*pconn)->rebound = false;
+	if (inst->mirror_users && freeit && (rlm_ldap_mirror_find_user(inst, request, rcode, &mirror_dn) == 0)) {
+		return mirror_dn;
 	}
 
 	if (inst->userobj_filter) {
@@ -934,12 +1324,55 @@ char const *rlm_ldap_find_user(ldap_instance_t const *inst, REQUEST *request, ld
 		return NULL;
 	}
 
+	/*
+	 *	See if we already know where the user is, or that
+	 *	they don't exist.
+	 */
+	if (inst->cache) {
+		snprintf(key, sizeof(key), "%s\n%s", base_dn, filter_p ? filter_p : "");
+
+		cached = rlm_ldap_cache_find(inst, request, key, attrs, !freeit);
+		if (cached) {
+			if (!cached->dn) {
+				RDEBUG("User object not found (cached)");
+				*rcode = RLM_MODULE_NOTFOUND;
+				return NULL;
+			}
+
+			RDEBUG("User object found at DN \"%s\" (cached)", cached->dn);
+			vp = pairmake(request, &request->config_items, "LDAP-UserDN", cached->dn, T_OP_EQ);
+			if (!vp) return NULL;
+
+			if (!freeit) *result = cached->result;
+			*rcode = RLM_MODULE_OK;
+			return vp->vp_strvalue;
+		}
+	}
+
+	/*
+	 *	Perform all searches as the admin user.
+	 */
+	if (!inst->mux && (*pconn)->rebound) {
+		status = rlm_ldap_bind(inst, request, pconn, inst->admin_dn, inst->password, true);
+		if (status != LDAP_PROC_SUCCESS) {
+			*rcode = RLM_MODULE_FAIL;
+			return NULL;
+		}
+
+		rad_assert(*pconn);
+
+		(*pconn)->rebound = false;
+	}
+
 	status = rlm_ldap_search(inst, request, pconn, base_dn, inst->userobj_scope, filter_p, attrs, result);
 	switch (status) {
 	case LDAP_PROC_SUCCESS:
 		break;
 
 	case LDAP_PROC_NO_RESULT:
+		if (inst->cache && inst->cache_negative_ttl) {
+			rlm_ldap_cache_add(inst, request, key, NULL, NULL, NULL);
+		}
 		*rcode = RLM_MODULE_NOTFOUND;
 		return NULL;
 
@@ -975,6 +1408,23 @@ char const *rlm_ldap_find_user(ldap_instance_t const *inst, REQUEST *request, ld
 		*rcode = RLM_MODULE_OK;
 	}
 
+	/*
+	 *	The cache entry owns the result from now on.
+	 */
+	if (inst->cache && vp) {
+		if (freeit) {
+			ldap_msgfree(*result);
+			*result = NULL;
+		}
+
+		if (!rlm_ldap_cache_add(inst, request, key, dn, attrs, *result) && !freeit) {
+			REDEBUG("Failed caching user object");
+			*result = NULL;
+			vp = NULL;
+			*rcode = RLM_MODULE_FAIL;
+		}
+	}
+
 	finish:
 	ldap_memfree(dn);
 
@@ -1110,15 +1560,19 @@ static int _mod_conn_free(ldap_handle_t *conn)
 /** Create and return a new connection
  *
  * Create a new ldap connection and allocate memory for a new rlm_handle_t
+ *
+ * @param ctx to allocate the handle in.
+ * @param inst rlm_ldap configuration.
+ * @param bind as the admin user now.  If false, the connection is marked as rebound, so that
+ *	whoever first uses it for an admin operation binds it.
  */
-void *mod_conn_create(TALLOC_CTX *ctx, void *instance)
+ldap_handle_t *rlm_ldap_conn_open(TALLOC_CTX *ctx, ldap_instance_t *inst, bool bind)
 {
 	ldap_rcode_t status;
 
 	int ldap_errno, ldap_version;
 	struct timeval tv;
 
-	ldap_instance_t *inst = instance;
 	ldap_handle_t *conn;
 
 	/*
@@ -1285,6 +1739,12 @@ void *mod_conn_create(TALLOC_CTX *ctx, void *instance)
 	}
 #endif /* HAVE_LDAP_START_TLS */
 
+	if (!bind) {
+		conn->rebound = true;
+
+		return conn;
+	}
+
 	status = rlm_ldap_bind(inst, NULL, &conn, inst->admin_dn, inst->password, false);
 	if (status != LDAP_PROC_SUCCESS) {
 		goto error;
@@ -1298,6 +1758,19 @@ error:
 	return NULL;
 }
 
+/** Create and return a new connection for the connection pool
+ *
+ * When searches are multiplexed, the pool's connections are only used for binds and modifications.
+ * They aren't bound as the admin user until that's needed, and libldap doesn't connect to the
+ * server until they're first used.
+ */
+void *mod_conn_create(TALLOC_CTX *ctx, void *instance)
+{
+	ldap_instance_t *inst = instance;
+
+	return rlm_ldap_conn_open(ctx, inst, (inst->multiplex == 0));
+}
+
 /** Gets an LDAP socket from the connection pool
  *
  * Retrieve a socket from the connection pool, or NULL on error (of if no sockets are available).
@@ -12,6 +12,7 @@
 
 #include	<freeradius-devel/radiusd.h>
 #include	<freeradius-devel/modules.h>
+#include	<freeradius-devel/heap.h>
 #include	<ldap.h>
 
 /*
@@ -53,12 +54,18 @@
 #define LDAP_MAX_FILTER_STR_LEN		1024		//!< Maximum length of an xlat expanded filter.
 #define LDAP_MAX_DN_STR_LEN		2048		//!< Maximum length of an xlat expanded DN.
 
+#define LDAP_CACHE_MAX_CHECKED		64		//!< Maximum number of group comparison results cached
+							//!< for a given user.
+
 typedef struct ldap_acct_section {
 	CONF_SECTION	*cs;				//!< Section configuration.
 
 	char const *reference;				//!< Configuration reference string.
 } ldap_acct_section_t;
 
+typedef struct ldap_mirror ldap_mirror_t;
+typedef struct ldap_mirror_obj ldap_mirror_obj_t;
+
 typedef struct ldap_instance {
 	CONF_SECTION	*cs;				//!< Main configuration section for this instance.
 	fr_connection_pool_t *pool;			//!< Connection pool instance.
@@ -211,6 +218,37 @@ typedef struct ldap_instance {
 	uint32_t	srv_timelimit;			//!< How long the server should spent on a single request
 							//!< (also bounded by value on the server).
 
+	uint32_t	multiplex;			//!< Number of connections all searches are sent over.
+							//!< 0 means each search uses the connection from the pool.
+	struct ldap_mux	*mux;				//!< The multiplexed connections.
+
+	/*
+	 *	Cache of user objects
+	 */
+	uint32_t	cache_ttl;			//!< How long user objects, and their group memberships,
+							//!< are cached for.  0 disables the cache.
+	uint32_t	cache_negative_ttl;		//!< How long users who weren't found are remembered for.
+	uint32_t	cache_max_entries;		//!< Maximum number of users in the cache.
+
+	rbtree_t	*cache;				//!< Cached user objects, by expanded base DN and filter.
+	fr_heap_t	*cache_heap;			//!< The same entries, by expiry time.
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t	cache_mutex;			//!< Protects the cache and the entries in it.
+#endif
+
+	/*
+	 *	Mirror of user and group objects
+	 */
+	char const	*mirror_attr;			//!< User object attribute holding the mirror key.
+							//!< NULL disables the mirror.
+	char const	*mirror_key;			//!< Value of mirror_attr to look users up by.
+	char const	*mirror_filter;			//!< Filter for the user objects which are mirrored.
+	char const	*mirror_member_attr;		//!< Group object attribute listing its members.
+	uint32_t	mirror_retry_delay;		//!< How long to wait before reconnecting the sync.
+
+	ldap_mirror_t	*mirror_users;			//!< Mirrored user objects.
+	ldap_mirror_t	*mirror_groups;			//!< Mirrored group objects, NULL if groups aren't cacheable.
+
 #ifdef WITH_EDIR
 	/*
 	 *	eDir support
@@ -246,6 +284,66 @@ typedef struct ldap_handle {
 	ldap_instance_t	*inst;				//!< rlm_ldap configuration.
 } ldap_handle_t;
 
+typedef struct ldap_mux_wait ldap_mux_wait_t;
+
+/** A connection which many searches are outstanding on at once
+ *
+ * Threads send their searches, then wait for their own results.  Whichever
+ * thread finds no other thread reading from the connection becomes the reader,
+ * and hands the results it gets to the threads waiting for them.
+ */
+typedef struct ldap_mux {
+	ldap_handle_t	*conn;				//!< Bound as the admin user, NULL if it needs reconnecting.
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t	mutex;				//!< Protects the fields below, and all calls into libldap
+							//!< using conn->handle.
+	pthread_cond_t	cond;				//!< Signalled when results are handed out, or when the
+							//!< reader stops reading.
+#endif
+	bool		reading;			//!< A thread is reading from the connection.
+	ldap_mux_wait_t	*waiting;			//!< Searches waiting for their results.
+	uint32_t	outstanding;			//!< Number of searches waiting.
+} ldap_mux_t;
+
+/** A search waiting for its result on an ldap_mux_t
+ *
+ */
+struct ldap_mux_wait {
+	ldap_mux_t	*mux;				//!< The search was sent on.
+	int		msgid;				//!< Of the search.
+	bool		done;				//!< The result (or an error) has been received.
+	int		rcode;				//!< As returned by ldap_result.
+	int		lib_errno;			//!< If rcode is -1, else as returned by ldap_parse_result.
+	int		srv_errno;			//!< From the search result.
+	char		*part_dn;			//!< Partial DN match from the search result, freed with
+							//!< ldap_memfree.
+	char		*srv_err;			//!< Server's error message, freed with ldap_memfree.
+	LDAPMessage	*result;			//!< Chain of entries, and the search result.
+	ldap_mux_wait_t	*next;
+};
+
+/** A user object kept by the cache
+ *
+ * The DN and the result of the search never change once the entry is created,
+ * and may be used without holding the cache mutex.  Requests hold a reference
+ * to the entry they found, so it's only freed when the last of them is done.
+ */
+typedef struct ldap_cache_entry {
+	char const	*key;				//!< Expanded base DN and filter of the user search.
+	char const	*name;				//!< User-Name of the request which created the entry.
+	char const	*dn;				//!< Of the user object, NULL if the user wasn't found.
+	LDAPMessage	*result;			//!< Of the search, NULL if only the DN was wanted.
+	char const	**attrs;			//!< Attributes the search retrieved, NULL terminated.
+	time_t		expires;			//!< When the entry is removed from the cache.
+	int		heap_id;			//!< For the expiry heap.
+	int		refs;				//!< Requests using the entry, and one for the cache.
+
+	bool		groups_done;			//!< Group memberships have been cached.
+	VALUE_PAIR	*groups;			//!< Cached memberships, as cache_da pairs.
+	struct ldap_cache_check *checked;		//!< Results of group comparisons.
+	uint32_t	num_checked;			//!< Number of comparison results.
+} ldap_cache_entry_t;
+
 typedef struct rlm_ldap_map_xlat {
 	value_pair_map_t const *maps;
 	char const *attrs[LDAP_MAX_ATTRMAP + LDAP_MAP_RESERVED + 1]; //!< Reserve some space for access attributes
@@ -341,6 +439,12 @@ void rlm_ldap_check_reply(ldap_instance_t const *inst, REQUEST *request);
  */
 void *mod_conn_create(TALLOC_CTX *ctx, void *instance);
 
+ldap_handle_t *rlm_ldap_conn_open(TALLOC_CTX *ctx, ldap_instance_t *inst, bool bind);
+
+int rlm_ldap_mux_init(ldap_instance_t *inst);
+
+void rlm_ldap_mux_free(ldap_instance_t *inst);
+
 ldap_handle_t *rlm_ldap_get_socket(ldap_instance_t const *inst, REQUEST *request);
 
 void rlm_ldap_release_socket(ldap_instance_t const *inst, ldap_handle_t *conn);
@@ -362,6 +466,47 @@ rlm_rcode_t rlm_ldap_check_userobj_dynamic(ldap_instance_t const *inst, REQUEST
 
 rlm_rcode_t rlm_ldap_check_cached(ldap_instance_t const *inst, REQUEST *request, VALUE_PAIR *check);
 
+/*
+ *	cache.c - Cache of user objects and group memberships.
+ */
+int rlm_ldap_cache_init(ldap_instance_t *inst);
+
+void rlm_ldap_cache_free(ldap_instance_t *inst);
+
+ldap_cache_entry_t *rlm_ldap_cache_find(ldap_instance_t const *inst, REQUEST *request, char const *key,
+					char const * const *attrs, bool want_result);
+
+ldap_cache_entry_t *rlm_ldap_cache_add(ldap_instance_t const *inst, REQUEST *request, char const *key,
+				       char const *dn, char const * const *attrs, LDAPMessage *result);
+
+ldap_cache_entry_t *rlm_ldap_cache_request(ldap_instance_t const *inst, REQUEST *request);
+
+bool rlm_ldap_cache_groups_get(ldap_instance_t const *inst, REQUEST *request, ldap_cache_entry_t *entry);
+
+void rlm_ldap_cache_groups_set(ldap_instance_t const *inst, REQUEST *request, ldap_cache_entry_t *entry,
+			       int skip);
+
+int rlm_ldap_cache_check_get(ldap_instance_t const *inst, ldap_cache_entry_t *entry, char const *group);
+
+void rlm_ldap_cache_check_set(ldap_instance_t const *inst, ldap_cache_entry_t *entry, char const *group,
+			      bool found);
+
+int rlm_ldap_cache_flush(void *instance, char const *key);
+
+/*
+ *	mirror.c - Mirror of user and group objects.
+ */
+int rlm_ldap_mirror_init(ldap_instance_t *inst);
+
+void rlm_ldap_mirror_free(ldap_instance_t *inst);
+
+struct berval **rlm_ldap_mirror_values(ldap_mirror_obj_t const *obj, char const *name);
+
+int rlm_ldap_mirror_authorize(ldap_instance_t const *inst, REQUEST *request, rlm_ldap_map_xlat_t const *expanded,
+			      rlm_rcode_t *rcode);
+
+int rlm_ldap_mirror_find_user(ldap_instance_t const *inst, REQUEST *request, rlm_rcode_t *rcode, char const **dn);
+
 /*
  *	attrmap.c - Attribute mapping code.
  */
@@ -374,6 +519,9 @@ int rlm_ldap_map_xlat(REQUEST *request, value_pair_map_t const *maps, rlm_ldap_m
 void rlm_ldap_map_do(ldap_instance_t const *inst, REQUEST *request, LDAP *handle,
 		     rlm_ldap_map_xlat_t const *expanded, LDAPMessage *entry);
 
+void rlm_ldap_map_do_mirror(ldap_instance_t const *inst, REQUEST *request, rlm_ldap_map_xlat_t const *expanded,
+			    ldap_mirror_obj_t const *obj);
+
 rlm_rcode_t rlm_ldap_map_profile(ldap_instance_t const *inst, REQUEST *request, ldap_handle_t **pconn,
 				 char const *profile, rlm_ldap_map_xlat_t const *expanded);
 
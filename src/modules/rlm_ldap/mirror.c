@@ -0,0 +1,1075 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License, version 2 if the
+ *   License as published by the Free Software Foundation.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file mirror.c
+ * @brief LDAP module in-memory mirror of user and group objects.
+ *
+ * A thread per mirror loads the objects under a base DN with an RFC 4533
+ * (syncrepl) refreshAndPersist search, and then applies the changes the
+ * server sends.  Objects are indexed by entryUUID, by DN, and by the values
+ * of one or two attributes.  While the mirror is in sync, authorize finds
+ * users, and resolves their group memberships, without querying the directory.
+ *
+ * @copyright 2016 The FreeRADIUS Server Project.
+ */
+#include	<freeradius-devel/rad_assert.h>
+
+#include	"ldap.h"
+
+#if defined(HAVE_LDAP_SYNC) && defined(HAVE_PTHREAD_H)
+#include	<ldap_sync.h>
+#include	<sys/socket.h>
+
+typedef struct ldap_mirror_ref ldap_mirror_ref_t;
+
+/** Objects which have the same value for an indexed attribute
+ *
+ */
+typedef struct ldap_mirror_bucket {
+	char const		*key;				//!< The value.
+	ldap_mirror_ref_t	*head;				//!< The objects.
+} ldap_mirror_bucket_t;
+
+/** An index entry pointing to an object
+ *
+ */
+struct ldap_mirror_ref {
+	rbtree_t		*index;				//!< The bucket is in.
+	ldap_mirror_bucket_t	*bucket;
+	ldap_mirror_obj_t	*obj;
+	ldap_mirror_ref_t	*next;				//!< In the bucket.
+	ldap_mirror_ref_t	*next_obj;			//!< Of the object.
+};
+
+typedef struct ldap_mirror_attr {
+	char const		*name;
+	struct berval		**values;			//!< NULL terminated, and each value is
+								//!< \0 terminated, as with libldap.
+} ldap_mirror_attr_t;
+
+/** A copy of an LDAP object
+ *
+ * Objects are never changed once they're indexed.  A modified object
+ * replaces the old copy.
+ */
+struct ldap_mirror_obj {
+	char const		*uuid;				//!< entryUUID, as hex.
+	char const		*dn;
+	ldap_mirror_attr_t	*attrs;
+	int			num_attrs;
+	uint32_t		generation;			//!< Of the refresh which last saw the object.
+	ldap_mirror_ref_t	*refs;				//!< Index entries pointing to the object.
+};
+
+struct ldap_mirror {
+	ldap_instance_t		*inst;
+	char const		*name;				//!< "user" or "group", for log messages.
+
+	char const		*base_dn;
+	int			scope;
+	char const		*filter;
+	char			**attrs;			//!< To retrieve, NULL terminated.
+	char const		*key_attr;			//!< Attribute indexed by by_key.
+	bool			key_nocase;			//!< Whether by_key is case insensitive.
+	char const		*member_attr;			//!< Attribute indexed by by_member, may be NULL.
+
+	rbtree_t		*by_uuid;			//!< Objects, by entryUUID.
+	rbtree_t		*by_dn;				//!< Buckets, by DN.
+	rbtree_t		*by_key;			//!< Buckets, by key_attr value.
+	rbtree_t		*by_member;			//!< Buckets, by member_attr value.
+	uint32_t		num_objs;
+
+	uint32_t		generation;			//!< Of the current refresh.
+	bool			ready;				//!< The refresh finished, and we're still connected.
+
+	pthread_rwlock_t	lock;				//!< Protects the fields above, and the objects.
+
+	pthread_mutex_t		mutex;				//!< Protects the fields below.
+	pthread_cond_t		cond;				//!< Wakes the thread when we're exiting.
+	int			fd;				//!< Of the sync connection, or -1.
+	bool			exiting;
+	bool			running;
+	pthread_t		thread;
+};
+
+static int ldap_mirror_uuid_cmp(void const *one, void const *two)
+{
+	ldap_mirror_obj_t const *a = one;
+	ldap_mirror_obj_t const *b = two;
+
+	return strcmp(a->uuid, b->uuid);
+}
+
+static int ldap_mirror_bucket_cmp(void const *one, void const *two)
+{
+	ldap_mirror_bucket_t const *a = one;
+	ldap_mirror_bucket_t const *b = two;
+
+	return strcmp(a->key, b->key);
+}
+
+static int ldap_mirror_bucket_casecmp(void const *one, void const *two)
+{
+	ldap_mirror_bucket_t const *a = one;
+	ldap_mirror_bucket_t const *b = two;
+
+	return strcasecmp(a->key, b->key);
+}
+
+static ldap_mirror_bucket_t *ldap_mirror_bucket_find(rbtree_t *index, char const *key)
+{
+	ldap_mirror_bucket_t my_bucket;
+
+	my_bucket.key = key;
+
+	return rbtree_finddata(index, &my_bucket);
+}
+
+/** Add an object to an index
+ *
+ * Must be called with the write lock held.
+ */
+static int ldap_mirror_index(ldap_mirror_obj_t *obj, rbtree_t *index, char const *key)
+{
+	ldap_mirror_bucket_t	*bucket;
+	ldap_mirror_ref_t	*ref;
+
+	bucket = ldap_mirror_bucket_find(index, key);
+	if (!bucket) {
+		bucket = talloc_zero(NULL, ldap_mirror_bucket_t);
+		if (!bucket) return -1;
+
+		bucket->key = talloc_typed_strdup(bucket, key);
+		if (!rbtree_insert(index, bucket)) {
+			talloc_free(bucket);
+			return -1;
+		}
+	}
+
+	ref = talloc_zero(obj, ldap_mirror_ref_t);
+	if (!ref) return -1;
+
+	ref->index = index;
+	ref->bucket = bucket;
+	ref->obj = obj;
+	ref->next = bucket->head;
+	bucket->head = ref;
+	ref->next_obj = obj->refs;
+	obj->refs = ref;
+
+	return 0;
+}
+
+/** Remove an object from the indexes, and free it
+ *
+ * Must be called with the write lock held.
+ */
+static void ldap_mirror_remove(ldap_mirror_t *mirror, ldap_mirror_obj_t *obj)
+{
+	ldap_mirror_ref_t *ref, **last;
+
+	for (ref = obj->refs; ref; ref = ref->next_obj) {
+		for (last = &ref->bucket->head; *last; last = &(*last)->next) {
+			if (*last != ref) continue;
+
+			*last = ref->next;
+			break;
+		}
+
+		if (!ref->bucket->head) {
+			rbtree_deletebydata(ref->index, ref->bucket);
+			talloc_free(ref->bucket);
+		}
+	}
+
+	rbtree_deletebydata(mirror->by_uuid, obj);
+	mirror->num_objs--;
+	talloc_free(obj);
+}
+
+/** Find the values of an attribute of a mirrored object
+ *
+ * @param[in] obj to search.
+ * @param[in] name of the attribute.
+ * @return the values, NULL terminated, or NULL if the object doesn't have the attribute.
+ */
+struct berval **rlm_ldap_mirror_values(ldap_mirror_obj_t const *obj, char const *name)
+{
+	int i;
+
+	if (!name) return NULL;
+
+	for (i = 0; i < obj->num_attrs; i++) {
+		if (strcasecmp(obj->attrs[i].name, name) == 0) return obj->attrs[i].values;
+	}
+
+	return NULL;
+}
+
+/** Copy an entry from a sync message
+ *
+ * Called without the lock held, as the copy isn't visible to anyone else.
+ */
+static ldap_mirror_obj_t *ldap_mirror_obj_alloc(LDAP *ld, LDAPMessage *msg, struct berval *uuid)
+{
+	ldap_mirror_obj_t	*obj;
+	ldap_mirror_attr_t	*attr;
+	BerElement		*ber = NULL;
+	struct berval		**values, *bv;
+	char			*name, *dn;
+	int			i, count;
+
+	obj = talloc_zero(NULL, ldap_mirror_obj_t);
+	if (!obj) return NULL;
+
+	obj->uuid = fr_abin2hex(obj, (uint8_t const *) uuid->bv_val, uuid->bv_len);
+
+	dn = ldap_get_dn(ld, msg);
+	if (!dn) {
+	error:
+		talloc_free(obj);
+		return NULL;
+	}
+	obj->dn = talloc_typed_strdup(obj, dn);
+	ldap_memfree(dn);
+
+	for (name = ldap_first_attribute(ld, msg, &ber);
+	     name;
+	     name = ldap_next_attribute(ld, msg, ber)) {
+		values = ldap_get_values_len(ld, msg, name);
+		if (!values) {
+			ldap_memfree(name);
+			continue;
+		}
+
+		attr = talloc_realloc(obj, obj->attrs, ldap_mirror_attr_t, obj->num_attrs + 1);
+		if (!attr) {
+			ldap_value_free_len(values);
+			ldap_memfree(name);
+			if (ber) ber_free(ber, 0);
+			goto error;
+		}
+		obj->attrs = attr;
+		attr = &obj->attrs[obj->num_attrs++];
+
+		attr->name = talloc_typed_strdup(obj, name);
+		ldap_memfree(name);
+
+		count = ldap_count_values_len(values);
+		attr->values = talloc_array(obj, struct berval *, count + 1);
+		for (i = 0; i < count; i++) {
+			bv = talloc(attr->values, struct berval);
+			bv->bv_len = values[i]->bv_len;
+			bv->bv_val = talloc_array(bv, char, bv->bv_len + 1);
+			memcpy(bv->bv_val, values[i]->bv_val, bv->bv_len);
+			bv->bv_val[bv->bv_len] = '\0';
+
+			attr->values[i] = bv;
+		}
+		attr->values[count] = NULL;
+
+		ldap_value_free_len(values);
+	}
+	if (ber) ber_free(ber, 0);
+
+	return obj;
+}
+
+/** Add an object, replacing any older copy
+ *
+ */
+static void ldap_mirror_upsert(ldap_mirror_t *mirror, ldap_mirror_obj_t *obj)
+{
+	ldap_instance_t		*inst = mirror->inst;
+	ldap_mirror_obj_t	*old;
+	struct berval		**values;
+	int			i;
+
+	pthread_rwlock_wrlock(&mirror->lock);
+	obj->generation = mirror->generation;
+
+	old = rbtree_finddata(mirror->by_uuid, obj);
+	if (old) ldap_mirror_remove(mirror, old);
+
+	if (!rbtree_insert(mirror->by_uuid, obj)) {
+		pthread_rwlock_unlock(&mirror->lock);
+		talloc_free(obj);
+		return;
+	}
+	mirror->num_objs++;
+
+	if (ldap_mirror_index(obj, mirror->by_dn, obj->dn) < 0) goto error;
+
+	values = rlm_ldap_mirror_values(obj, mirror->key_attr);
+	for (i = 0; values && values[i]; i++) {
+		if (ldap_mirror_index(obj, mirror->by_key, values[i]->bv_val) < 0) goto error;
+	}
+
+	values = rlm_ldap_mirror_values(obj, mirror->member_attr);
+	for (i = 0; values && values[i]; i++) {
+		if (ldap_mirror_index(obj, mirror->by_member, values[i]->bv_val) < 0) goto error;
+	}
+	pthread_rwlock_unlock(&mirror->lock);
+
+	LDAP_DBG3("Mirrored %s object \"%s\"", mirror->name, obj->dn);
+
+	return;
+
+error:
+	LDAP_ERR("Failed indexing %s object \"%s\"", mirror->name, obj->dn);
+	ldap_mirror_remove(mirror, obj);
+	pthread_rwlock_unlock(&mirror->lock);
+}
+
+/** Remove, or mark as present, the object with a given entryUUID
+ *
+ */
+static void ldap_mirror_uuid(ldap_mirror_t *mirror, struct berval *uuid, bool present)
+{
+	ldap_mirror_obj_t	*obj, my_obj;
+	char			buffer[256];
+
+	if (uuid->bv_len > ((sizeof(buffer) - 1) / 2)) return;
+
+	fr_bin2hex(buffer, (uint8_t const *) uuid->bv_val, uuid->bv_len);
+	my_obj.uuid = buffer;
+
+	pthread_rwlock_wrlock(&mirror->lock);
+	obj = rbtree_finddata(mirror->by_uuid, &my_obj);
+	if (obj) {
+		if (present) {
+			obj->generation = mirror->generation;
+		} else {
+			ldap_mirror_remove(mirror, obj);
+		}
+	}
+	pthread_rwlock_unlock(&mirror->lock);
+}
+
+static int _ldap_mirror_collect(void *ctx, void *data)
+{
+	ldap_mirror_obj_t	***stale = ctx;
+	ldap_mirror_obj_t	*obj = data;
+
+	*(*stale)++ = obj;
+
+	return 0;
+}
+
+/** The refresh has finished
+ *
+ * Anything which the server didn't send or mention during the refresh has
+ * been deleted.
+ */
+static void ldap_mirror_refreshed(ldap_mirror_t *mirror)
+{
+	ldap_instance_t		*inst = mirror->inst;
+	ldap_mirror_obj_t	**objs, **p;
+	uint32_t		i, num, removed = 0;
+
+	pthread_rwlock_wrlock(&mirror->lock);
+	num = mirror->num_objs;
+	objs = p = talloc_array(NULL, ldap_mirror_obj_t *, num + 1);
+	if (objs) {
+		rbtree_walk(mirror->by_uuid, RBTREE_IN_ORDER, _ldap_mirror_collect, &p);
+
+		for (i = 0; i < num; i++) {
+			if (objs[i]->generation == mirror->generation) continue;
+
+			ldap_mirror_remove(mirror, objs[i]);
+			removed++;
+		}
+		talloc_free(objs);
+	}
+
+	mirror->ready = true;
+	num = mirror->num_objs;
+	pthread_rwlock_unlock(&mirror->lock);
+
+	LDAP_INFO("Mirror of %s objects is ready, with %u objects (%u removed)", mirror->name, num, removed);
+}
+
+/*
+ *	Callbacks for ldap_sync_poll().
+ */
+static int ldap_mirror_search_entry(ldap_sync_t *ls, LDAPMessage *msg, struct berval *uuid,
+				    ldap_sync_refresh_t phase)
+{
+	ldap_mirror_t		*mirror = ls->ls_private;
+	ldap_mirror_obj_t	*obj;
+
+	if (!uuid) return LDAP_SUCCESS;
+
+	switch (phase) {
+	case LDAP_SYNC_CAPI_PRESENT:
+		ldap_mirror_uuid(mirror, uuid, true);
+		break;
+
+	case LDAP_SYNC_CAPI_ADD:
+	case LDAP_SYNC_CAPI_MODIFY:
+		obj = ldap_mirror_obj_alloc(ls->ls_ld, msg, uuid);
+		if (obj) ldap_mirror_upsert(mirror, obj);
+		break;
+
+	case LDAP_SYNC_CAPI_DELETE:
+		ldap_mirror_uuid(mirror, uuid, false);
+		break;
+
+	default:
+		break;
+	}
+
+	return LDAP_SUCCESS;
+}
+
+static int ldap_mirror_search_reference(UNUSED ldap_sync_t *ls, UNUSED LDAPMessage *msg)
+{
+	return LDAP_SUCCESS;
+}
+
+static int ldap_mirror_intermediate(ldap_sync_t *ls, UNUSED LDAPMessage *msg, BerVarray uuids,
+				    ldap_sync_refresh_t phase)
+{
+	ldap_mirror_t	*mirror = ls->ls_private;
+	int		i;
+
+	for (i = 0; uuids && uuids[i].bv_val; i++) {
+		switch (phase) {
+		case LDAP_SYNC_CAPI_PRESENTS_IDSET:
+			ldap_mirror_uuid(mirror, &uuids[i], true);
+			break;
+
+		case LDAP_SYNC_CAPI_DELETES_IDSET:
+			ldap_mirror_uuid(mirror, &uuids[i], false);
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	if ((phase == LDAP_SYNC_CAPI_DONE) || (ls->ls_refreshPhase == LDAP_SYNC_CAPI_DONE)) {
+		bool ready;
+
+		pthread_rwlock_rdlock(&mirror->lock);
+		ready = mirror->ready;
+		pthread_rwlock_unlock(&mirror->lock);
+
+		if (!ready) ldap_mirror_refreshed(mirror);
+	}
+
+	return LDAP_SUCCESS;
+}
+
+static int ldap_mirror_search_result(UNUSED ldap_sync_t *ls, UNUSED LDAPMessage *msg, UNUSED int refresh_deletes)
+{
+	return LDAP_SUCCESS;
+}
+
+/** Wait before reconnecting, unless we're exiting
+ *
+ */
+static void ldap_mirror_wait(ldap_mirror_t *mirror)
+{
+	struct timespec ts;
+
+	pthread_mutex_lock(&mirror->mutex);
+	if (!mirror->exiting) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += mirror->inst->mirror_retry_delay;
+		pthread_cond_timedwait(&mirror->cond, &mirror->mutex, &ts);
+	}
+	pthread_mutex_unlock(&mirror->mutex);
+}
+
+/** Keep a mirror in sync with the directory
+ *
+ */
+static void *ldap_mirror_thread(void *arg)
+{
+	ldap_mirror_t	*mirror = arg;
+	ldap_instance_t	*inst = mirror->inst;
+	ldap_handle_t	*conn;
+	ldap_sync_t	*ls;
+	int		rcode, fd;
+	bool		exiting;
+
+	for (;;) {
+		pthread_mutex_lock(&mirror->mutex);
+		exiting = mirror->exiting;
+		pthread_mutex_unlock(&mirror->mutex);
+		if (exiting) break;
+
+		conn = rlm_ldap_conn_open(NULL, inst, true);
+		if (!conn) {
+			LDAP_ERR("Failed connecting to mirror %s objects, retrying in %u seconds",
+				 mirror->name, inst->mirror_retry_delay);
+			ldap_mirror_wait(mirror);
+			continue;
+		}
+
+		/*
+		 *	So that mod_detach can interrupt us.
+		 */
+		fd = -1;
+		ldap_get_option(conn->handle, LDAP_OPT_DESC, &fd);
+		pthread_mutex_lock(&mirror->mutex);
+		mirror->fd = fd;
+		exiting = mirror->exiting;
+		pthread_mutex_unlock(&mirror->mutex);
+		if (exiting) {
+			talloc_free(conn);
+			break;
+		}
+
+		ls = ldap_sync_initialize(NULL);
+		if (!ls) {
+			talloc_free(conn);
+			break;
+		}
+
+		/*
+		 *	libldap frees these in ldap_sync_destroy(),
+		 *	unless we take them back first.
+		 */
+		memcpy(&ls->ls_base, &mirror->base_dn, sizeof(ls->ls_base));
+		memcpy(&ls->ls_filter, &mirror->filter, sizeof(ls->ls_filter));
+		ls->ls_attrs = mirror->attrs;
+		ls->ls_scope = mirror->scope;
+		ls->ls_timelimit = 0;
+		ls->ls_sizelimit = 0;
+		ls->ls_timeout = -1;
+		ls->ls_search_entry = ldap_mirror_search_entry;
+		ls->ls_search_reference = ldap_mirror_search_reference;
+		ls->ls_intermediate = ldap_mirror_intermediate;
+		ls->ls_search_result = ldap_mirror_search_result;
+		ls->ls_private = mirror;
+		ls->ls_ld = conn->handle;
+
+		/*
+		 *	Everything the refresh doesn't mention is
+		 *	removed at the end of it.
+		 */
+		pthread_rwlock_wrlock(&mirror->lock);
+		mirror->generation++;
+		pthread_rwlock_unlock(&mirror->lock);
+
+		LDAP_DBG("Starting sync of %s objects under \"%s\"", mirror->name, mirror->base_dn);
+
+		rcode = ldap_sync_init(ls, LDAP_SYNC_REFRESH_AND_PERSIST);
+		if (rcode == LDAP_SUCCESS) {
+			/*
+			 *	Wake up every second to see if
+			 *	we're exiting.
+			 */
+			ls->ls_timeout = 1;
+
+			for (;;) {
+				pthread_mutex_lock(&mirror->mutex);
+				exiting = mirror->exiting;
+				pthread_mutex_unlock(&mirror->mutex);
+				if (exiting) break;
+
+				rcode = ldap_sync_poll(ls);
+				if (rcode != LDAP_SUCCESS) break;
+			}
+		}
+
+		pthread_rwlock_wrlock(&mirror->lock);
+		mirror->ready = false;
+		pthread_rwlock_unlock(&mirror->lock);
+
+		pthread_mutex_lock(&mirror->mutex);
+		mirror->fd = -1;
+		exiting = mirror->exiting;
+		pthread_mutex_unlock(&mirror->mutex);
+
+		ls->ls_base = NULL;
+		ls->ls_filter = NULL;
+		ls->ls_attrs = NULL;
+		ls->ls_ld = NULL;
+		ldap_sync_destroy(ls, 1);
+		talloc_free(conn);
+
+		if (exiting) break;
+
+		LDAP_ERR("Lost sync of %s objects: %s.  Using the directory until it is restored",
+			 mirror->name, ldap_err2string(rcode));
+		ldap_mirror_wait(mirror);
+	}
+
+	return NULL;
+}
+
+static int _ldap_mirror_free(ldap_mirror_t *mirror)
+{
+	if (mirror->running) {
+		pthread_mutex_lock(&mirror->mutex);
+		mirror->exiting = true;
+		if (mirror->fd >= 0) shutdown(mirror->fd, SHUT_RDWR);
+		pthread_cond_signal(&mirror->cond);
+		pthread_mutex_unlock(&mirror->mutex);
+
+		pthread_join(mirror->thread, NULL);
+	}
+
+	if (mirror->by_uuid) {
+		ldap_mirror_obj_t **objs, **p;
+		uint32_t i, num = mirror->num_objs;
+
+		objs = p = talloc_array(NULL, ldap_mirror_obj_t *, num + 1);
+		if (objs) {
+			rbtree_walk(mirror->by_uuid, RBTREE_IN_ORDER, _ldap_mirror_collect, &p);
+			for (i = 0; i < num; i++) ldap_mirror_remove(mirror, objs[i]);
+			talloc_free(objs);
+		}
+	}
+
+	if (mirror->by_member) rbtree_free(mirror->by_member);
+	if (mirror->by_key) rbtree_free(mirror->by_key);
+	if (mirror->by_dn) rbtree_free(mirror->by_dn);
+	if (mirror->by_uuid) rbtree_free(mirror->by_uuid);
+
+	pthread_rwlock_destroy(&mirror->lock);
+	pthread_mutex_destroy(&mirror->mutex);
+	pthread_cond_destroy(&mirror->cond);
+
+	return 0;
+}
+
+/** Create a mirror, and start the thread which keeps it in sync
+ *
+ */
+static ldap_mirror_t *ldap_mirror_alloc(ldap_instance_t *inst, char const *name, char const *base_dn, int scope,
+					char const *filter, char const * const *attrs, char const *key_attr,
+					bool key_nocase, char const *member_attr)
+{
+	ldap_mirror_t	*mirror;
+	int		i, num;
+
+	mirror = talloc_zero(inst, ldap_mirror_t);
+	if (!mirror) return NULL;
+
+	pthread_rwlock_init(&mirror->lock, NULL);
+	pthread_mutex_init(&mirror->mutex, NULL);
+	pthread_cond_init(&mirror->cond, NULL);
+	talloc_set_destructor(mirror, _ldap_mirror_free);
+
+	mirror->inst = inst;
+	mirror->name = name;
+	mirror->base_dn = base_dn;
+	mirror->scope = scope;
+	mirror->filter = filter ? filter : "(objectClass=*)";
+	mirror->key_attr = key_attr;
+	mirror->key_nocase = key_nocase;
+	mirror->member_attr = member_attr;
+	mirror->fd = -1;
+
+	for (num = 0; attrs[num]; num++);
+	mirror->attrs = talloc_array(mirror, char *, num + 1);
+	for (i = 0; i < num; i++) mirror->attrs[i] = talloc_typed_strdup(mirror->attrs, attrs[i]);
+	mirror->attrs[num] = NULL;
+
+	mirror->by_uuid = rbtree_create(NULL, ldap_mirror_uuid_cmp, NULL, 0);
+	mirror->by_dn = rbtree_create(NULL, ldap_mirror_bucket_casecmp, NULL, 0);
+	mirror->by_key = rbtree_create(NULL, key_nocase ? ldap_mirror_bucket_casecmp : ldap_mirror_bucket_cmp,
+				       NULL, 0);
+	mirror->by_member = rbtree_create(NULL, ldap_mirror_bucket_casecmp, NULL, 0);
+	if (!mirror->by_uuid || !mirror->by_dn || !mirror->by_key || !mirror->by_member) {
+		LDAP_ERR("Failed creating indexes for the mirror of %s objects", name);
+		talloc_free(mirror);
+		return NULL;
+	}
+
+	if (pthread_create(&mirror->thread, NULL, ldap_mirror_thread, mirror) != 0) {
+		LDAP_ERR("Failed starting thread to mirror %s objects: %s", name, fr_syserror(errno));
+		talloc_free(mirror);
+		return NULL;
+	}
+	mirror->running = true;
+
+	return mirror;
+}
+
+/** Find the one object in a bucket
+ *
+ * Must be called with the read lock held.
+ *
+ * @return the object, or NULL if there isn't exactly one.
+ */
+static ldap_mirror_obj_t *ldap_mirror_find(rbtree_t *index, char const *key, int *count)
+{
+	ldap_mirror_bucket_t	*bucket;
+	ldap_mirror_ref_t	*ref;
+
+	*count = 0;
+
+	bucket = ldap_mirror_bucket_find(index, key);
+	if (!bucket) return NULL;
+
+	for (ref = bucket->head; ref; ref = ref->next) (*count)++;
+
+	return (*count == 1) ? bucket->head->obj : NULL;
+}
+
+/** Expand the mirror key for the current request
+ *
+ */
+static int ldap_mirror_key(ldap_instance_t const *inst, REQUEST *request, char *key, size_t keylen)
+{
+	if (radius_xlat(key, keylen, request, inst->mirror_key, NULL, NULL) < 0) {
+		REDEBUG("Unable to create mirror key");
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Find the user object for the current request
+ *
+ * Must be called with the read lock held, and the mirror ready.
+ */
+static ldap_mirror_obj_t *ldap_mirror_user(ldap_instance_t const *inst, REQUEST *request, char const *key,
+					   rlm_rcode_t *rcode)
+{
+	ldap_mirror_obj_t	*obj;
+	int			count;
+
+	obj = ldap_mirror_find(inst->mirror_users->by_key, key, &count);
+	if (!obj) {
+		if (count > 1) {
+			REDEBUG("Ambiguous mirror lookup, %i objects have %s \"%s\" (should be 1 or 0)",
+				count, inst->mirror_attr, key);
+			*rcode = RLM_MODULE_INVALID;
+			return NULL;
+		}
+
+		RDEBUG("User object not found (mirror)");
+		*rcode = RLM_MODULE_NOTFOUND;
+		return NULL;
+	}
+
+	RDEBUG("User object found at DN \"%s\" (mirror)", obj->dn);
+	if (!pairmake(request, &request->config_items, "LDAP-UserDN", obj->dn, T_OP_EQ)) {
+		*rcode = RLM_MODULE_FAIL;
+		return NULL;
+	}
+
+	*rcode = RLM_MODULE_OK;
+	return obj;
+}
+
+/** Add a group membership to the control list
+ *
+ */
+static void ldap_mirror_group_add(ldap_instance_t const *inst, REQUEST *request, char const *value)
+{
+	pairmake(request, &request->config_items, inst->cache_da->name, value, T_OP_ADD);
+	RDEBUG("Added %s with value \"%s\" to control list", inst->cache_da->name, value);
+}
+
+/** Add the name and/or DN of a mirrored group to the control list
+ *
+ */
+static void ldap_mirror_group_add_obj(ldap_instance_t const *inst, REQUEST *request, ldap_mirror_obj_t const *group)
+{
+	struct berval **values;
+
+	if (inst->cacheable_group_dn) ldap_mirror_group_add(inst, request, group->dn);
+
+	if (inst->cacheable_group_name) {
+		values = rlm_ldap_mirror_values(group, inst->groupobj_name_attr);
+		if (!values || !values[0]) {
+			RWDEBUG("Group object \"%s\" has no %s", group->dn, inst->groupobj_name_attr);
+			return;
+		}
+
+		ldap_mirror_group_add(inst, request, values[0]->bv_val);
+	}
+}
+
+/** Resolve a user's group memberships, from the user and group mirrors
+ *
+ * The same as rlm_ldap_cacheable_userobj() and rlm_ldap_cacheable_groupobj().
+ * Must be called with the user mirror's read lock held.
+ */
+static void ldap_mirror_groups(ldap_instance_t const *inst, REQUEST *request, ldap_mirror_obj_t const *user,
+			       char const *key)
+{
+	ldap_mirror_t		*groups = inst->mirror_groups;
+	ldap_mirror_obj_t	*group;
+	ldap_mirror_bucket_t	*bucket;
+	ldap_mirror_ref_t	*ref;
+	struct berval		**values;
+	int			i, count;
+
+	values = rlm_ldap_mirror_values(user, inst->userobj_membership_attr);
+
+	pthread_rwlock_rdlock(&groups->lock);
+	for (i = 0; values && values[i] && (i < LDAP_MAX_CACHEABLE); i++) {
+		if (rlm_ldap_is_dn(values[i]->bv_val)) {
+			if (!inst->cacheable_group_name) {
+				ldap_mirror_group_add(inst, request, values[i]->bv_val);
+				continue;
+			}
+
+			group = ldap_mirror_find(groups->by_dn, values[i]->bv_val, &count);
+		} else {
+			if (!inst->cacheable_group_dn) {
+				ldap_mirror_group_add(inst, request, values[i]->bv_val);
+				continue;
+			}
+
+			group = ldap_mirror_find(groups->by_key, values[i]->bv_val, &count);
+		}
+
+		if (!group) {
+			RWDEBUG("Group \"%s\" not found in the mirror", values[i]->bv_val);
+			continue;
+		}
+
+		ldap_mirror_group_add_obj(inst, request, group);
+	}
+
+	/*
+	 *	Groups which list the user as a member, by DN or by
+	 *	the key the user was found with.
+	 */
+	if (groups->member_attr) {
+		bucket = ldap_mirror_bucket_find(groups->by_member, user->dn);
+		for (ref = bucket ? bucket->head : NULL; ref; ref = ref->next) {
+			ldap_mirror_group_add_obj(inst, request, ref->obj);
+		}
+
+		bucket = ldap_mirror_bucket_find(groups->by_member, key);
+		for (ref = bucket ? bucket->head : NULL; ref; ref = ref->next) {
+			ldap_mirror_group_add_obj(inst, request, ref->obj);
+		}
+	}
+	pthread_rwlock_unlock(&groups->lock);
+}
+
+/** Authorize a user from the mirror
+ *
+ * Does everything mod_authorize does with the user object, without
+ * querying the directory.
+ *
+ * @param[in] inst rlm_ldap configuration.
+ * @param[in] request Current request.
+ * @param[in] expanded attribute map.
+ * @param[out] rcode The result of authorization.
+ * @return 0 if the user was authorized from the mirror, -1 if the mirror isn't ready and the
+ *	directory should be used.
+ */
+int rlm_ldap_mirror_authorize(ldap_instance_t const *inst, REQUEST *request, rlm_ldap_map_xlat_t const *expanded,
+			      rlm_rcode_t *rcode)
+{
+	ldap_mirror_t		*mirror = inst->mirror_users;
+	ldap_mirror_obj_t	*obj;
+	struct berval		**values;
+	char			key[LDAP_MAX_FILTER_STR_LEN];
+
+	if (ldap_mirror_key(inst, request, key, sizeof(key)) < 0) {
+		*rcode = RLM_MODULE_INVALID;
+		return 0;
+	}
+
+	pthread_rwlock_rdlock(&mirror->lock);
+	if (!mirror->ready || (inst->mirror_groups && !inst->mirror_groups->ready)) {
+		pthread_rwlock_unlock(&mirror->lock);
+		RDEBUG2("Mirror is not in sync, searching the directory");
+		return -1;
+	}
+
+	obj = ldap_mirror_user(inst, request, key, rcode);
+	if (!obj) goto finish;
+
+	/*
+	 *	Check for access.
+	 */
+	if (inst->userobj_access_attr) {
+		values = rlm_ldap_mirror_values(obj, inst->userobj_access_attr);
+		if (values && values[0]) {
+			if (inst->access_positive) {
+				if (strncasecmp(values[0]->bv_val, "false", 5) == 0) {
+					RDEBUG("\"%s\" attribute exists but is set to 'false' - user locked out",
+					       inst->userobj_access_attr);
+					*rcode = RLM_MODULE_USERLOCK;
+					goto finish;
+				}
+			} else if (strncasecmp(values[0]->bv_val, "false", 5) != 0) {
+				RDEBUG("\"%s\" attribute exists - user locked out", inst->userobj_access_attr);
+				*rcode = RLM_MODULE_USERLOCK;
+				goto finish;
+			}
+		} else if (inst->access_positive) {
+			RDEBUG("No \"%s\" attribute - user locked out", inst->userobj_access_attr);
+			*rcode = RLM_MODULE_USERLOCK;
+			goto finish;
+		}
+	}
+
+	if (inst->mirror_groups) ldap_mirror_groups(inst, request, obj, key);
+
+	if (inst->user_map || inst->valuepair_attr) {
+		RDEBUG("Processing user attributes");
+		rlm_ldap_map_do_mirror(inst, request, expanded, obj);
+		rlm_ldap_check_reply(inst, request);
+	}
+
+finish:
+	pthread_rwlock_unlock(&mirror->lock);
+
+	return 0;
+}
+
+/** Find the DN of the user from the mirror
+ *
+ * @param[in] inst rlm_ldap configuration.
+ * @param[in] request Current request.
+ * @param[out] rcode The result of the lookup.
+ * @param[out] dn of the user, as added to the control list.
+ * @return 0 if the mirror was used, -1 if it isn't ready.
+ */
+int rlm_ldap_mirror_find_user(ldap_instance_t const *inst, REQUEST *request, rlm_rcode_t *rcode, char const **dn)
+{
+	ldap_mirror_t	*mirror = inst->mirror_users;
+	VALUE_PAIR	*vp;
+	char		key[LDAP_MAX_FILTER_STR_LEN];
+
+	*dn = NULL;
+
+	if (ldap_mirror_key(inst, request, key, sizeof(key)) < 0) {
+		*rcode = RLM_MODULE_INVALID;
+		return 0;
+	}
+
+	pthread_rwlock_rdlock(&mirror->lock);
+	if (!mirror->ready) {
+		pthread_rwlock_unlock(&mirror->lock);
+		return -1;
+	}
+
+	if (ldap_mirror_user(inst, request, key, rcode)) {
+		vp = pairfind(request->config_items, PW_LDAP_USERDN, 0, TAG_ANY);
+		if (vp) *dn = vp->vp_strvalue;
+	}
+	pthread_rwlock_unlock(&mirror->lock);
+
+	return 0;
+}
+
+/** Check the configuration, and start mirroring
+ *
+ * @param[in] inst rlm_ldap configuration.
+ * @return 0 on success, -1 on error.
+ */
+int rlm_ldap_mirror_init(ldap_instance_t *inst)
+{
+	char const	*user_attrs[] = { "*", NULL, NULL, NULL };
+	char const	*group_attrs[] = { NULL, NULL, NULL };
+	int		i;
+
+	if (strchr(inst->userobj_base_dn, '%') || (inst->groupobj_base_dn && strchr(inst->groupobj_base_dn, '%'))) {
+		cf_log_err_cs(inst->cs, "The mirror can't be used with dynamic base_dns");
+		return -1;
+	}
+
+	if (inst->default_profile || inst->profile_attr) {
+		cf_log_err_cs(inst->cs, "The mirror can't be used with profiles");
+		return -1;
+	}
+
+#ifdef WITH_EDIR
+	if (inst->edir) {
+		cf_log_err_cs(inst->cs, "The mirror can't be used with eDirectory universal passwords");
+		return -1;
+	}
+#endif
+
+	if ((inst->cacheable_group_name || inst->cacheable_group_dn) &&
+	    inst->groupobj_membership_filter && !inst->mirror_member_attr) {
+		cf_log_err_cs(inst->cs, "The mirror can't evaluate group.membership_filter.  "
+			      "Set mirror.group_member_attribute instead");
+		return -1;
+	}
+
+	/*
+	 *	All user attributes, and the operational ones we
+	 *	need, which "*" doesn't include.
+	 */
+	i = 1;
+	if (inst->userobj_membership_attr) user_attrs[i++] = inst->userobj_membership_attr;
+	if (inst->userobj_access_attr) user_attrs[i++] = inst->userobj_access_attr;
+
+	inst->mirror_users = ldap_mirror_alloc(inst, "user", inst->userobj_base_dn, inst->userobj_scope,
+					       inst->mirror_filter, user_attrs, inst->mirror_attr, true, NULL);
+	if (!inst->mirror_users) return -1;
+
+	if (!inst->cacheable_group_name && !inst->cacheable_group_dn) return 0;
+
+	i = 0;
+	group_attrs[i++] = inst->groupobj_name_attr;
+	if (inst->mirror_member_attr) group_attrs[i++] = inst->mirror_member_attr;
+
+	inst->mirror_groups = ldap_mirror_alloc(inst, "group", inst->groupobj_base_dn, inst->groupobj_scope,
+						inst->groupobj_filter, group_attrs, inst->groupobj_name_attr, false,
+						inst->mirror_member_attr);
+	if (!inst->mirror_groups) return -1;
+
+	return 0;
+}
+
+/** Stop mirroring, and free the mirrors
+ *
+ * @param[in] inst rlm_ldap configuration.
+ */
+void rlm_ldap_mirror_free(ldap_instance_t *inst)
+{
+	TALLOC_FREE(inst->mirror_groups);
+	TALLOC_FREE(inst->mirror_users);
+}
+#else
+int rlm_ldap_mirror_init(ldap_instance_t *inst)
+{
+	cf_log_err_cs(inst->cs, "The mirror requires libldap with syncrepl support (ldap_sync_init), "
+		      "and threads");
+	return -1;
+}
+
+void rlm_ldap_mirror_free(UNUSED ldap_instance_t *inst)
+{
+}
+
+int rlm_ldap_mirror_authorize(UNUSED ldap_instance_t const *inst, UNUSED REQUEST *request,
+			      UNUSED rlm_ldap_map_xlat_t const *expanded, UNUSED rlm_rcode_t *rcode)
+{
+	return -1;
+}
+
+int rlm_ldap_mirror_find_user(UNUSED ldap_instance_t const *inst, UNUSED REQUEST *request,
+			      UNUSED rlm_rcode_t *rcode, char const **dn)
+{
+	*dn = NULL;
+	return -1;
+}
+
+struct berval **rlm_ldap_mirror_values(UNUSED ldap_mirror_obj_t const *obj, UNUSED char const *name)
+{
+	return NULL;
+}
+#endif
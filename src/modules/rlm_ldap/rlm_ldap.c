@@ -151,6 +151,31 @@ static CONF_PARSER client_config[] = {
 	{ NULL, -1, 0, NULL, NULL }
 };
 
+/*
+ *	Cache of user objects
+ */
+static CONF_PARSER cache_config[] = {
+	{ "ttl", FR_CONF_OFFSET(PW_TYPE_INTEGER, ldap_instance_t, cache_ttl), "0" },
+	{ "negative_ttl", FR_CONF_OFFSET(PW_TYPE_INTEGER, ldap_instance_t, cache_negative_ttl), "0" },
+	{ "max_entries", FR_CONF_OFFSET(PW_TYPE_INTEGER, ldap_instance_t, cache_max_entries), "16384" },
+
+	{ NULL, -1, 0, NULL, NULL }
+};
+
+/*
+ *	Mirror of user and group objects
+ */
+static CONF_PARSER mirror_config[] = {
+	{ "attribute", FR_CONF_OFFSET(PW_TYPE_STRING, ldap_instance_t, mirror_attr), NULL },
+	{ "key", FR_CONF_OFFSET(PW_TYPE_STRING | PW_TYPE_XLAT, ldap_instance_t, mirror_key),
+	  "%{%{Stripped-User-Name}:-%{User-Name}}" },
+	{ "filter", FR_CONF_OFFSET(PW_TYPE_STRING, ldap_instance_t, mirror_filter), "(objectClass=*)" },
+	{ "group_member_attribute", FR_CONF_OFFSET(PW_TYPE_STRING, ldap_instance_t, mirror_member_attr), NULL },
+	{ "retry_delay", FR_CONF_OFFSET(PW_TYPE_INTEGER, ldap_instance_t, mirror_retry_delay), "10" },
+
+	{ NULL, -1, 0, NULL, NULL }
+};
+
 /*
  *	Reference for accounting updates
  */
@@ -188,6 +213,9 @@ static CONF_PARSER option_config[] = {
 	/* allow server unlimited time for search (server-side limit) */
 	{ "srv_timelimit", FR_CONF_OFFSET(PW_TYPE_INTEGER, ldap_instance_t, srv_timelimit), "20" },
 
+	/* connections all searches share, 0 to use the pool */
+	{ "multiplex", FR_CONF_OFFSET(PW_TYPE_INTEGER, ldap_instance_t, multiplex), "0" },
+
 #ifdef LDAP_OPT_X_KEEPALIVE_IDLE
 	{ "idle", FR_CONF_OFFSET(PW_TYPE_INTEGER, ldap_instance_t, keepalive_idle), "60" },
 #endif
@@ -236,6 +264,10 @@ static const CONF_PARSER module_config[] = {
 
 	{ "tls", FR_CONF_POINTER(PW_TYPE_SUBSECTION, NULL), (void const *) tls_config },
 
+	{ "cache", FR_CONF_POINTER(PW_TYPE_SUBSECTION, NULL), (void const *) cache_config },
+
+	{ "mirror", FR_CONF_POINTER(PW_TYPE_SUBSECTION, NULL), (void const *) mirror_config },
+
 	{NULL, -1, 0, NULL, NULL}
 };
 
@@ -365,6 +397,7 @@ static int rlm_ldap_groupcmp(void *instance, REQUEST *request, UNUSED VALUE_PAIR
 
 	ldap_handle_t	*conn = NULL;
 	char const	*user_dn;
+	ldap_cache_entry_t *cached;
 
 	rad_assert(inst->groupobj_base_dn);
 
@@ -412,6 +445,26 @@ static int rlm_ldap_groupcmp(void *instance, REQUEST *request, UNUSED VALUE_PAIR
 
 	rad_assert(conn);
 
+	/*
+	 *	Check if we've compared the user with this group before
+	 */
+	cached = rlm_ldap_cache_request(inst, request);
+	if (cached) {
+		switch (rlm_ldap_cache_check_get(inst, cached, check->vp_strvalue)) {
+		case 1:
+			RDEBUG2("User found. Matched cached comparison");
+			found = true;
+			goto finish;
+
+		case 0:
+			found = false;
+			goto finish;
+
+		default:
+			break;
+		}
+	}
+
 	/*
 	 *	Check groupobj user membership
 	 */
@@ -422,6 +475,7 @@ static int rlm_ldap_groupcmp(void *instance, REQUEST *request, UNUSED VALUE_PAIR
 
 		case RLM_MODULE_OK:
 			found = true;
+			goto done;
 
 		default:
 			goto finish;
@@ -440,6 +494,7 @@ static int rlm_ldap_groupcmp(void *instance, REQUEST *request, UNUSED VALUE_PAIR
 
 		case RLM_MODULE_OK:
 			found = true;
+			goto done;
 
 		default:
 			goto finish;
@@ -448,6 +503,9 @@ static int rlm_ldap_groupcmp(void *instance, REQUEST *request, UNUSED VALUE_PAIR
 
 	rad_assert(conn);
 
+done:
+	if (cached) rlm_ldap_cache_check_set(inst, cached, check->vp_strvalue, found);
+
 finish:
 	if (conn) rlm_ldap_release_socket(inst, conn);
 
@@ -467,8 +525,14 @@ static int mod_detach(void *instance)
 {
 	ldap_instance_t *inst = instance;
 
+	rlm_ldap_mirror_free(inst);
+
 	fr_connection_pool_delete(inst->pool);
 
+	rlm_ldap_mux_free(inst);
+
+	rlm_ldap_cache_free(inst);
+
 	if (inst->user_map) {
 		talloc_free(inst->user_map);
 	}
@@ -764,6 +828,31 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 	inst->pool = fr_connection_pool_module_init(inst->cs, inst, mod_conn_create, NULL, NULL);
 	if (!inst->pool) goto error;
 
+	/*
+	 *	Open the connections searches are multiplexed over.
+	 */
+	FR_INTEGER_BOUND_CHECK("multiplex", inst->multiplex, <=, 64);
+	if (inst->multiplex && (rlm_ldap_mux_init(inst) < 0)) goto error;
+
+	/*
+	 *	Cache user objects, so we don't search for the same
+	 *	users over and over.
+	 */
+	if (inst->cache_ttl) {
+		FR_INTEGER_BOUND_CHECK("cache.negative_ttl", inst->cache_negative_ttl, <=, inst->cache_ttl);
+		FR_INTEGER_BOUND_CHECK("cache.max_entries", inst->cache_max_entries, >=, 1);
+		if (rlm_ldap_cache_init(inst) < 0) goto error;
+	}
+
+	/*
+	 *	Keep a copy of the user objects, so authorize
+	 *	doesn't have to search for them.
+	 */
+	if (inst->mirror_attr) {
+		FR_INTEGER_BOUND_CHECK("mirror.retry_delay", inst->mirror_retry_delay, >=, 1);
+		if (rlm_ldap_mirror_init(inst) < 0) goto error;
+	}
+
 	/*
 	 *	Bulk load dynamic clients.
 	 */
@@ -918,6 +1007,15 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authorize(void *instance, REQUEST *reque
 		return RLM_MODULE_FAIL;
 	}
 
+	/*
+	 *	Everything we need is in the mirror, unless it's
+	 *	out of sync.
+	 */
+	if (inst->mirror_users && (rlm_ldap_mirror_authorize(inst, request, &expanded, &rcode) == 0)) {
+		rlm_ldap_map_xlat_free(&expanded);
+		return rcode;
+	}
+
 	conn = rlm_ldap_get_socket(inst, request);
 	if (!conn) return RLM_MODULE_FAIL;
 
@@ -969,16 +1067,35 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authorize(void *instance, REQUEST *reque
 	 *	Check if we need to cache group memberships
 	 */
 	if (inst->cacheable_group_dn || inst->cacheable_group_name) {
-		if (inst->userobj_membership_attr) {
-			rcode = rlm_ldap_cacheable_userobj(inst, request, &conn, entry, inst->userobj_membership_attr);
+		ldap_cache_entry_t *cached;
+
+		cached = rlm_ldap_cache_request(inst, request);
+		if (!cached || !rlm_ldap_cache_groups_get(inst, request, cached)) {
+			int skip = 0;
+			vp_cursor_t cursor;
+
+			/*
+			 *	Only the memberships we add go into the cache.
+			 */
+			fr_cursor_init(&cursor, &request->config_items);
+			while (fr_cursor_next_by_num(&cursor, inst->cache_da->attr, inst->cache_da->vendor, TAG_ANY)) {
+				skip++;
+			}
+
+			if (inst->userobj_membership_attr) {
+				rcode = rlm_ldap_cacheable_userobj(inst, request, &conn, entry,
+								   inst->userobj_membership_attr);
+				if (rcode != RLM_MODULE_OK) {
+					goto finish;
+				}
+			}
+
+			rcode = rlm_ldap_cacheable_groupobj(inst, request, &conn);
 			if (rcode != RLM_MODULE_OK) {
 				goto finish;
 			}
-		}
 
-		rcode = rlm_ldap_cacheable_groupobj(inst, request, &conn);
-		if (rcode != RLM_MODULE_OK) {
-			goto finish;
+			if (cached) rlm_ldap_cache_groups_set(inst, request, cached, skip);
 		}
 	}
 
@@ -1099,7 +1216,7 @@ skip_edir:
 
 finish:
 	rlm_ldap_map_xlat_free(&expanded);
-	if (result) {
+	if (result && !inst->cache) {
 		ldap_msgfree(result);
 	}
 	rlm_ldap_release_socket(inst, conn);
@@ -1380,4 +1497,8 @@ module_t rlm_ldap = {
 		NULL,			/* post-proxy 		 */
 		mod_post_auth		/* post-auth */
 	},
+	0,				/* thread_inst_size	 */
+	NULL,				/* thread_instantiate	 */
+	NULL,				/* thread_detach	 */
+	rlm_ldap_cache_flush		/* cache_flush		 */
 };
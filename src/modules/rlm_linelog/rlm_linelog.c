@@ -59,6 +59,9 @@ typedef struct rlm_linelog_t {
 	char const	*group;
 	char const	*line;
 	char const	*reference;
+	bool		async;
+	uint32_t	commit_interval;
+	bool		fsync;
 	fr_logfile_t	*lf;
 } rlm_linelog_t;
 
@@ -78,6 +81,9 @@ static const CONF_PARSER module_config[] = {
 	{ "group", FR_CONF_OFFSET(PW_TYPE_STRING, rlm_linelog_t, group), NULL },
 	{ "format", FR_CONF_OFFSET(PW_TYPE_STRING | PW_TYPE_XLAT, rlm_linelog_t, line), NULL },
 	{ "reference", FR_CONF_OFFSET(PW_TYPE_STRING | PW_TYPE_XLAT, rlm_linelog_t, reference), NULL },
+	{ "async", FR_CONF_OFFSET(PW_TYPE_BOOLEAN, rlm_linelog_t, async), "no" },
+	{ "commit_interval", FR_CONF_OFFSET(PW_TYPE_INTEGER, rlm_linelog_t, commit_interval), "10" },
+	{ "fsync", FR_CONF_OFFSET(PW_TYPE_BOOLEAN, rlm_linelog_t, fsync), "no" },
 	{ NULL, -1, 0, NULL, NULL }		/* end the list */
 };
 
@@ -125,6 +131,27 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 		return -1;
 	}
 
+	if (inst->async && (strcmp(inst->filename, "syslog") != 0)) {
+		gid_t gid = -1;
+
+		FR_INTEGER_BOUND_CHECK("commit_interval", inst->commit_interval, <=, 1000);
+
+#ifdef HAVE_GRP_H
+		/*
+		 *	The writer thread sets the group of the files.
+		 */
+		if (inst->group && !fr_getgid_any(inst->group, &gid)) {
+			cf_log_err_cs(conf, "Unable to find system group \"%s\"", inst->group);
+			return -1;
+		}
+#endif
+
+		if (fr_logfile_async(inst->lf, inst->commit_interval, inst->fsync, gid) < 0) {
+			cf_log_err_cs(conf, "Failed starting writer: %s", fr_strerror());
+			return -1;
+		}
+	}
+
 	inst->cs = conf;
 	return 0;
 }
@@ -198,12 +225,12 @@ static rlm_rcode_t CC_HINT(nonnull) mod_do_linelog(void *instance, REQUEST *requ
 	int fd = -1;
 	char *p;
 	char line[4096];
+	char path[2048];
 	rlm_linelog_t *inst = (rlm_linelog_t*) instance;
 	char const *value = inst->line;
 
 #ifdef HAVE_GRP_H
 	gid_t gid;
-	char *endptr;
 #endif
 
 	line[0] = '\0';
@@ -254,8 +281,6 @@ static rlm_rcode_t CC_HINT(nonnull) mod_do_linelog(void *instance, REQUEST *requ
 	 *	FIXME: Check length.
 	 */
 	if (strcmp(inst->filename, "syslog") != 0) {
-		char path[2048];
-
 		if (radius_xlat(path, sizeof(path), request, inst->filename, NULL, NULL) < 0) {
 			return RLM_MODULE_FAIL;
 		}
@@ -271,6 +296,11 @@ static rlm_rcode_t CC_HINT(nonnull) mod_do_linelog(void *instance, REQUEST *requ
 			*p = '/';
 		}
 
+		/*
+		 *	The writer thread opens the file.
+		 */
+		if (inst->async) goto skip_group;
+
 		fd = fr_logfile_open(inst->lf, path, inst->permissions);
 		if (fd == -1) {
 			ERROR("rlm_linelog: Failed to open %s: %s",
@@ -280,12 +310,9 @@ static rlm_rcode_t CC_HINT(nonnull) mod_do_linelog(void *instance, REQUEST *requ
 
 #ifdef HAVE_GRP_H
 		if (inst->group != NULL) {
-			gid = strtol(inst->group, &endptr, 10);
-			if (*endptr != '\0') {
-				if (!fr_getgid(inst->group, &gid)) {
-					RDEBUG2("Unable to find system group \"%s\"", inst->group);
-					goto skip_group;
-				}
+			if (!fr_getgid_any(inst->group, &gid)) {
+				RDEBUG2("Unable to find system group \"%s\"", inst->group);
+				goto skip_group;
 			}
 
 			if (chown(path, -1, gid) == -1) {
@@ -308,7 +335,15 @@ static rlm_rcode_t CC_HINT(nonnull) mod_do_linelog(void *instance, REQUEST *requ
 		return RLM_MODULE_FAIL;
 	}
 
-	if (fd >= 0) {
+	if (inst->async && (strcmp(inst->filename, "syslog") != 0)) {
+		strcat(line, "\n");
+
+		if (fr_logfile_write(inst->lf, path, inst->permissions, line, strlen(line)) < 0) {
+			ERROR("rlm_linelog: Failed writing: %s", fr_strerror());
+			return RLM_MODULE_FAIL;
+		}
+
+	} else if (fd >= 0) {
 		strcat(line, "\n");
 
 		if (write(fd, line, strlen(line)) < 0) {
@@ -354,4 +389,8 @@ module_t rlm_linelog = {
 		mod_do_linelog		/* send-coa */
 #endif
 	},
+	0,				/* thread_inst_size */
+	NULL,				/* thread_instantiate */
+	NULL,				/* thread_detach */
+	NULL				/* cache_flush */
 };
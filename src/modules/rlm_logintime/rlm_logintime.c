@@ -271,4 +271,8 @@ module_t rlm_logintime = {
 		NULL,			/* post-proxy */
 		mod_authorize  		/* post-auth */
 	},
+	0,				/* thread_inst_size */
+	NULL,				/* thread_instantiate */
+	NULL,				/* thread_detach */
+	NULL				/* cache_flush */
 };
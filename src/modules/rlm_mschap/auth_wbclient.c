@@ -0,0 +1,208 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License, version 2 if the
+ *   License as published by the Free Software Foundation.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file auth_wbclient.c
+ * @brief NTLM authentication against the wbclient library
+ *
+ * @copyright 2015  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include	<freeradius-devel/radiusd.h>
+
+#include	"rlm_mschap.h"
+#include	"mschap.h"
+#include	"auth_wbclient.h"
+
+#define NT_LENGTH 24
+
+/*
+ *	NTSTATUS codes winbind hands back in wbcAuthErrorInfo.
+ */
+#define NT_STATUS_PASSWORD_EXPIRED	0xC0000071
+#define NT_STATUS_PASSWORD_MUST_CHANGE	0xC0000224
+
+/** Free a winbind context when the pool closes the connection
+ *
+ */
+static int _mod_conn_free(struct wbcContext **wb_ctx)
+{
+	wbcCtxFree(*wb_ctx);
+
+	return 0;
+}
+
+/** Create a winbind context for the connection pool
+ *
+ * The context holds the winbindd socket open, so requests sharing a
+ * pooled context avoid the connect() cost that ntlm_auth pays on every
+ * invocation.
+ *
+ * @param ctx to allocate the handle in.
+ * @param instance of rlm_mschap (unused).
+ * @return a new wbcContext, or NULL on error.
+ */
+void *mod_conn_create(TALLOC_CTX *ctx, UNUSED void *instance)
+{
+	struct wbcContext **wb_ctx;
+
+	wb_ctx = talloc_zero(ctx, struct wbcContext *);
+	*wb_ctx = wbcCtxCreate();
+	if (!*wb_ctx) {
+		ERROR("rlm_mschap: Failed creating winbind context");
+		talloc_free(wb_ctx);
+		return NULL;
+	}
+
+	talloc_set_destructor(wb_ctx, _mod_conn_free);
+
+	return *wb_ctx;
+}
+
+/** Check an MS-CHAP response against winbindd
+ *
+ * @param inst rlm_mschap instance.
+ * @param request the current request.
+ * @param challenge the 8 byte MS-CHAP challenge.
+ * @param response the 24 byte NT-Response.
+ * @param nthashhash where the NT hash hash (the user session key) is written.
+ * @return 0 on success, -648 if the password has expired, -1 on any other error.
+ */
+int do_auth_wbclient(rlm_mschap_t *inst, REQUEST *request,
+		     uint8_t const *challenge, uint8_t const *response,
+		     uint8_t nthashhash[NT_DIGEST_LENGTH])
+{
+	int			rcode = -1;
+	struct wbcContext	*wb_ctx;
+	struct wbcAuthUserParams authparams;
+	wbcErr			err;
+	struct wbcAuthUserInfo	*info = NULL;
+	struct wbcAuthErrorInfo	*error = NULL;
+	char			user_name_buf[500];
+	char			domain_name_buf[500];
+	uint8_t			resp[NT_LENGTH];
+
+	memset(&authparams, 0, sizeof(authparams));
+
+	/*
+	 *	Expand the user and domain names winbind will
+	 *	authenticate against.
+	 */
+	if (radius_xlat(user_name_buf, sizeof(user_name_buf), request, inst->wb_username, NULL, NULL) < 0) {
+		REDEBUG2("Unable to expand winbind_username");
+		return -1;
+	}
+	authparams.account_name = user_name_buf;
+
+	if (inst->wb_domain) {
+		if (radius_xlat(domain_name_buf, sizeof(domain_name_buf), request, inst->wb_domain, NULL, NULL) < 0) {
+			REDEBUG2("Unable to expand winbind_domain");
+			return -1;
+		}
+		authparams.domain_name = domain_name_buf;
+	}
+
+	/*
+	 *	Build the challenge-response structure.  wbclient
+	 *	takes a non-const pointer to the response.
+	 */
+	authparams.level = WBC_AUTH_USER_LEVEL_RESPONSE;
+	authparams.parameter_control |= WBC_MSV1_0_ALLOW_MSVCHAPV2 |
+					WBC_MSV1_0_ALLOW_WORKSTATION_TRUST_ACCOUNT |
+					WBC_MSV1_0_ALLOW_SERVER_TRUST_ACCOUNT;
+
+	memcpy(resp, response, NT_LENGTH);
+	authparams.password.response.nt_length = NT_LENGTH;
+	authparams.password.response.nt_data = resp;
+	memcpy(authparams.password.response.challenge, challenge,
+	       sizeof(authparams.password.response.challenge));
+
+	wb_ctx = fr_connection_get(inst->wb_pool);
+	if (!wb_ctx) {
+		RERROR("Unable to get winbind connection from pool");
+		return -1;
+	}
+
+	RDEBUG2("Sending authentication request user='%s' domain='%s'",
+		authparams.account_name, authparams.domain_name ? authparams.domain_name : "");
+
+	err = wbcCtxAuthenticateUserEx(wb_ctx, &authparams, &info, &error);
+
+	fr_connection_release(inst->wb_pool, wb_ctx);
+
+	switch (err) {
+	case WBC_ERR_SUCCESS:
+		rcode = 0;
+		RDEBUG2("Authenticated successfully");
+
+		/*
+		 *	The user session key is the NT hash hash.
+		 */
+		memcpy(nthashhash, info->user_session_key, NT_DIGEST_LENGTH);
+		break;
+
+	case WBC_ERR_WINBIND_NOT_AVAILABLE:
+		RERROR("Unable to contact winbind!");
+		RDEBUG2("Check that winbind is running and that FreeRADIUS has");
+		RDEBUG2("permission to connect to the winbind privileged socket.");
+		break;
+
+	case WBC_ERR_DOMAIN_NOT_FOUND:
+		REDEBUG2("Domain not found");
+		break;
+
+	case WBC_ERR_AUTH_ERROR:
+		if (!error) {
+			REDEBUG2("Authentication failed");
+			break;
+		}
+
+		/*
+		 *	Same mapping as the "Password expired" and
+		 *	"Must change password" output of ntlm_auth.
+		 */
+		if ((error->nt_status == NT_STATUS_PASSWORD_EXPIRED) ||
+		    (error->nt_status == NT_STATUS_PASSWORD_MUST_CHANGE)) {
+			REDEBUG2("%s", error->display_string);
+			rcode = -648;
+			break;
+		}
+
+		REDEBUG2("%s [0x%X]", error->display_string, error->nt_status);
+		break;
+
+	default:
+		/*
+		 *	Only errors left are
+		 *	  WBC_ERR_INVALID_PARAM
+		 *	  WBC_ERR_NO_MEMORY
+		 *	neither of which are particularly likely.
+		 */
+		if (error && error->display_string) {
+			REDEBUG2("libwbclient error: wbcErr %d (%s)", err, error->display_string);
+		} else {
+			REDEBUG2("libwbclient error: wbcErr %d", err);
+		}
+		break;
+	}
+
+	if (info) wbcFreeMemory(info);
+	if (error) wbcFreeMemory(error);
+
+	return rcode;
+}
@@ -32,9 +32,14 @@ RCSID("$Id$")
 
 #include 	<ctype.h>
 
+#include	"rlm_mschap.h"
 #include	"mschap.h"
 #include	"smbdes.h"
 
+#ifdef WITH_AUTH_WINBIND
+#include	"auth_wbclient.h"
+#endif
+
 #ifdef HAVE_OPENSSL_CRYPTO_H
 USES_APPLE_DEPRECATED_API	/* OpenSSL API has been deprecated by Apple */
 #  include	<openssl/rc4.h>
@@ -137,26 +142,6 @@ static int pdb_decode_acct_ctrl(char const *p)
 }
 
 
-typedef struct rlm_mschap_t {
-	bool		use_mppe;
-	bool		require_encryption;
-	bool		require_strong;
-	bool		with_ntdomain_hack;	/* this should be in another module */
-	char const	*xlat_name;
-	char const	*ntlm_auth;
-	uint32_t	ntlm_auth_timeout;
-	char const	*ntlm_cpw;
-	char const	*ntlm_cpw_username;
-	char const	*ntlm_cpw_domain;
-	char const	*local_cpw;
-	char const	*auth_type;
-	bool		allow_retry;
-	char const	*retry_msg;
-#ifdef WITH_OPEN_DIRECTORY
-	bool		open_directory;
-#endif
-} rlm_mschap_t;
-
 
 /*
  *	Does dynamic translation of strings.
@@ -534,6 +519,8 @@ static const CONF_PARSER module_config[] = {
 	{ "with_ntdomain_hack", FR_CONF_OFFSET(PW_TYPE_BOOLEAN, rlm_mschap_t, with_ntdomain_hack), "yes" },
 	{ "ntlm_auth", FR_CONF_OFFSET(PW_TYPE_STRING, rlm_mschap_t, ntlm_auth), NULL },
 	{ "ntlm_auth_timeout", FR_CONF_OFFSET(PW_TYPE_INTEGER, rlm_mschap_t, ntlm_auth_timeout), NULL },
+	{ "winbind_username", FR_CONF_OFFSET(PW_TYPE_STRING | PW_TYPE_XLAT, rlm_mschap_t, wb_username), NULL },
+	{ "winbind_domain", FR_CONF_OFFSET(PW_TYPE_STRING | PW_TYPE_XLAT, rlm_mschap_t, wb_domain), NULL },
 	{ "passchange", FR_CONF_POINTER(PW_TYPE_SUBSECTION, NULL), (void const *) passchange_config },
 	{ "allow_retry", FR_CONF_OFFSET(PW_TYPE_BOOLEAN, rlm_mschap_t, allow_retry), "yes" },
 	{ "retry_msg", FR_CONF_OFFSET(PW_TYPE_STRING, rlm_mschap_t, retry_msg), NULL },
@@ -588,6 +575,49 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 		return -1;
 	}
 
+	/*
+	 *	Work out how we're checking the NT-Response.
+	 */
+	inst->method = AUTH_INTERNAL;
+
+	if (inst->wb_username) {
+#ifdef WITH_AUTH_WINBIND
+		inst->method = AUTH_WBCLIENT;
+
+		inst->wb_pool = fr_connection_pool_module_init(conf, inst, mod_conn_create, NULL, NULL);
+		if (!inst->wb_pool) {
+			cf_log_err_cs(conf, "Unable to initialise winbind connection pool");
+			return -1;
+		}
+#else
+		cf_log_err_cs(conf, "'winbind' auth not enabled at compile time");
+		return -1;
+#endif
+	}
+
+	if (inst->ntlm_auth) {
+		if (inst->method == AUTH_WBCLIENT) {
+			cf_log_err_cs(conf, "Only one of 'ntlm_auth' or 'winbind_username' may be set");
+			return -1;
+		}
+
+		inst->method = AUTH_NTLMAUTH_EXEC;
+	}
+
+	return 0;
+}
+
+/*
+ *	Tidy up instance
+ */
+static int mod_detach(UNUSED void *instance)
+{
+#ifdef WITH_AUTH_WINBIND
+	rlm_mschap_t *inst = instance;
+
+	fr_connection_pool_delete(inst->wb_pool);
+#endif
+
 	return 0;
 }
 
@@ -1016,8 +1046,9 @@ ntlm_auth_err:
  *	Do the MS-CHAP stuff.
  *
  *	This function is here so that all of the MS-CHAP related
- *	authentication is in one place, and we can perhaps later replace
- *	it with code to call winbindd, or something similar.
+ *	authentication is in one place.  When do_ntlm_auth is set the
+ *	response is checked by the configured external method, either
+ *	ntlm_auth or winbindd via libwbclient.
  */
 static int CC_HINT(nonnull (1, 2, 4, 5 ,6)) do_mschap(rlm_mschap_t *inst, REQUEST *request, VALUE_PAIR *password,
 						      uint8_t const *challenge, uint8_t const *response,
@@ -1052,6 +1083,10 @@ static int CC_HINT(nonnull (1, 2, 4, 5 ,6)) do_mschap(rlm_mschap_t *inst, REQUES
 		    (password->da->attr == PW_NT_PASSWORD)) {
 			fr_md4_calc(nthashhash, password->vp_octets, MD4_DIGEST_LENGTH);
 		}
+#ifdef WITH_AUTH_WINBIND
+	} else if (inst->method == AUTH_WBCLIENT) {
+		return do_auth_wbclient(inst, request, challenge, response, nthashhash);
+#endif
 	} else {		/* run ntlm_auth */
 		int	result;
 		char	buffer[256];
@@ -1310,13 +1345,13 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(void * instance, REQUEST *r
 	bool do_ntlm_auth;
 
 	/*
-	 *	If we have ntlm_auth configured, use it unless told
-	 *	otherwise
+	 *	If we have ntlm_auth or winbind configured, use it
+	 *	unless told otherwise
 	 */
-	do_ntlm_auth = (inst->ntlm_auth != NULL);
+	do_ntlm_auth = (inst->method != AUTH_INTERNAL);
 
 	/*
-	 *	If we have an ntlm_auth configuration, then we may
+	 *	If we have an external auth configuration, then we may
 	 *	want to suppress it.
 	 */
 	if (do_ntlm_auth) {
@@ -1885,7 +1920,7 @@ module_t rlm_mschap = {
 	sizeof(rlm_mschap_t),
 	module_config,
 	mod_instantiate,		/* instantiation */
-	NULL,				/* detach */
+	mod_detach,			/* detach */
 	{
 		mod_authenticate,	/* authenticate */
 		mod_authorize,		/* authorize */
@@ -1896,4 +1931,8 @@ module_t rlm_mschap = {
 		NULL,			/* post-proxy */
 		NULL			/* post-auth */
 	},
+	0,				/* thread_inst_size */
+	NULL,				/* thread_instantiate */
+	NULL,				/* thread_detach */
+	NULL				/* cache_flush */
 };
@@ -0,0 +1,47 @@
+/* Copyright 2006-2015 The FreeRADIUS server project */
+
+#ifndef _RLM_MSCHAP_H
+#define _RLM_MSCHAP_H
+
+RCSIDH(rlm_mschap_h, "$Id$")
+
+#ifdef WITH_AUTH_WINBIND
+#  include <freeradius-devel/connection.h>
+#endif
+
+/*
+ *	How the NT-Response is checked.
+ */
+typedef enum {
+	AUTH_INTERNAL = 0,		//!< Against a local NT/LM-Password.
+	AUTH_NTLMAUTH_EXEC,		//!< By forking the ntlm_auth helper.
+	AUTH_WBCLIENT			//!< By calling winbindd through libwbclient.
+} MSCHAP_AUTH_METHOD;
+
+typedef struct rlm_mschap_t {
+	bool			use_mppe;
+	bool			require_encryption;
+	bool			require_strong;
+	bool			with_ntdomain_hack;	/* this should be in another module */
+	char const		*xlat_name;
+	char const		*ntlm_auth;
+	uint32_t		ntlm_auth_timeout;
+	char const		*ntlm_cpw;
+	char const		*ntlm_cpw_username;
+	char const		*ntlm_cpw_domain;
+	char const		*local_cpw;
+	char const		*auth_type;
+	bool			allow_retry;
+	char const		*retry_msg;
+	MSCHAP_AUTH_METHOD	method;
+	char const		*wb_username;
+	char const		*wb_domain;
+#ifdef WITH_AUTH_WINBIND
+	fr_connection_pool_t	*wb_pool;
+#endif
+#ifdef WITH_OPEN_DIRECTORY
+	bool			open_directory;
+#endif
+} rlm_mschap_t;
+
+#endif /*_RLM_MSCHAP_H*/
@@ -0,0 +1,2 @@
+TARGET		:= rlm_nats.a
+SOURCES		:= rlm_nats.c
@@ -0,0 +1,882 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License, version 2 if the
+ *   License as published by the Free Software Foundation.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file rlm_nats.c
+ * @brief Publish accounting requests to a NATS server, as JSON.
+ *
+ * @copyright 2015  The FreeRADIUS server project
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/modules.h>
+#include <freeradius-devel/tcp.h>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+/*
+ *	The request threads only encode the packet as JSON, and put it
+ *	on a queue.  A publisher thread takes everything on the queue,
+ *	and sends it to the NATS server in as few writes as it can.
+ *
+ *	When the server can't be reached, the publisher appends the
+ *	messages to a spool file instead, and sends them from there
+ *	once it can.  Messages are only dropped if the queue is full,
+ *	or the spool file has reached "spool_max".  So a request
+ *	thread never waits for the network, or for the disk.
+ *
+ *	Delivery is "at least once".  If the connection fails in the
+ *	middle of a write, the whole write is spooled, and some of its
+ *	messages may be sent twice.
+ */
+#define NATS_MAX_MESSAGE	(8192)
+#define NATS_MAX_SUBJECT	(256)
+#define NATS_MAX_VALUES		(32)
+#define NATS_BUFFER_SIZE	(65536)
+
+typedef struct nats_map {
+	char const		*name;		//!< JSON key.
+	value_pair_tmpl_t	*vpt;		//!< Attribute to take the value from.
+} nats_map_t;
+
+typedef struct nats_msg {
+	struct nats_msg		*next;
+	size_t			len;
+	char			data[];
+} nats_msg_t;
+
+typedef struct rlm_nats_t {
+	char const		*name;
+
+	fr_ipaddr_t		ipaddr;
+	uint16_t		port;
+	char const		*username;
+	char const		*password;
+	char const		*subject;
+	char			*connect;	//!< CONNECT line sent to the server.
+
+	uint32_t		queue_size;	//!< Messages waiting for the publisher.
+	uint32_t		batch_size;	//!< Wake the publisher when this many are queued.
+	uint32_t		flush_interval;	//!< Milliseconds between publishes, when fewer are queued.
+	uint32_t		retry_delay;	//!< Seconds between connection attempts.
+
+	char const		*spool;
+	uint64_t		spool_max;
+
+	nats_map_t		*map;
+	int			num_map;
+
+	pthread_mutex_t		mutex;		//!< Protects the queue.
+	nats_msg_t		*head;
+	nats_msg_t		*tail;
+	uint32_t		num_queued;
+
+	bool			running;
+	bool			stop;
+	pthread_t		thread;
+	int			pipe[2];	//!< Woken when a batch is queued.
+
+	/*
+	 *	Only used by the publisher thread.
+	 */
+	int			sockfd;
+	time_t			next_connect;
+	char			rbuf[4096];	//!< Partial line from the server.
+	size_t			rbuf_len;
+	char			*wbuf;
+	size_t			wbuf_len;
+
+	int			spool_fd;
+	off_t			spool_offset;	//!< Start of the first message not yet sent.
+	off_t			spool_size;
+
+	uint64_t		published;
+	uint64_t		spooled;
+	uint64_t		dropped;
+	uint64_t		dropped_logged;
+} rlm_nats_t;
+
+static const CONF_PARSER module_config[] = {
+	{ "server", FR_CONF_OFFSET(PW_TYPE_IP_ADDR, rlm_nats_t, ipaddr), "127.0.0.1" },
+	{ "port", FR_CONF_OFFSET(PW_TYPE_SHORT, rlm_nats_t, port), "4222" },
+	{ "username", FR_CONF_OFFSET(PW_TYPE_STRING, rlm_nats_t, username), NULL },
+	{ "password", FR_CONF_OFFSET(PW_TYPE_STRING | PW_TYPE_SECRET, rlm_nats_t, password), NULL },
+	{ "subject", FR_CONF_OFFSET(PW_TYPE_STRING | PW_TYPE_REQUIRED, rlm_nats_t, subject), "radius.accounting" },
+	{ "queue_size", FR_CONF_OFFSET(PW_TYPE_INTEGER, rlm_nats_t, queue_size), "65536" },
+	{ "batch_size", FR_CONF_OFFSET(PW_TYPE_INTEGER, rlm_nats_t, batch_size), "256" },
+	{ "flush_interval", FR_CONF_OFFSET(PW_TYPE_INTEGER, rlm_nats_t, flush_interval), "100" },
+	{ "retry_delay", FR_CONF_OFFSET(PW_TYPE_INTEGER, rlm_nats_t, retry_delay), "5" },
+	{ "spool", FR_CONF_OFFSET(PW_TYPE_FILE_OUTPUT, rlm_nats_t, spool), NULL },
+	{ "spool_max", FR_CONF_OFFSET(PW_TYPE_INTEGER64, rlm_nats_t, spool_max), "1073741824" },
+	{ NULL, -1, 0, NULL, NULL }		/* end the list */
+};
+
+/*
+ *	Append the values of one attribute as a JSON member.  A single
+ *	value is written as is, and several as an array.
+ */
+static ssize_t nats_encode_member(char *out, size_t outlen, char const *name,
+				  VALUE_PAIR **vps, int num)
+{
+	char *p = out, *end = out + outlen;
+	size_t len;
+	int i;
+
+	len = snprintf(p, end - p, ",\"%s\":%s", name, (num > 1) ? "[" : "");
+	if (len >= (size_t) (end - p)) return -1;
+	p += len;
+
+	for (i = 0; i < num; i++) {
+		if (i > 0) {
+			if ((end - p) < 2) return -1;
+			*p++ = ',';
+		}
+
+		len = vp_prints_value_json(p, end - p, vps[i]);
+		if (len >= (size_t) (end - p)) return -1;
+		p += len;
+	}
+
+	if (num > 1) {
+		if ((end - p) < 2) return -1;
+		*p++ = ']';
+	}
+	*p = '\0';
+
+	return p - out;
+}
+
+/** Encode a request as one line of JSON
+ *
+ * With a "map", the members are the keys of the map.  Otherwise they're
+ * the names of the attributes in the request.
+ *
+ * @return the length of the JSON, or -1 if it doesn't fit.
+ */
+static ssize_t nats_encode(rlm_nats_t const *inst, REQUEST *request, char *out, size_t outlen)
+{
+	char		*p = out, *end = out + outlen;
+	VALUE_PAIR	*vps[NATS_MAX_VALUES];
+	VALUE_PAIR	*vp, *prev;
+	vp_cursor_t	cursor;
+	ssize_t		slen;
+	int		i, num, err;
+
+	slen = snprintf(p, end - p, "{\"timestamp\":%ld", (long) request->packet->timestamp.tv_sec);
+	if (slen >= (end - p)) return -1;
+	p += slen;
+
+	if (inst->map) {
+		for (i = 0; i < inst->num_map; i++) {
+			num = 0;
+			for (vp = tmpl_cursor_init(&err, &cursor, request, inst->map[i].vpt);
+			     vp && (num < NATS_MAX_VALUES);
+			     vp = tmpl_cursor_next(&cursor, inst->map[i].vpt)) {
+				vps[num++] = vp;
+			}
+			if (!num) continue;
+
+			slen = nats_encode_member(p, end - p, inst->map[i].name, vps, num);
+			if (slen < 0) return -1;
+			p += slen;
+		}
+		goto done;
+	}
+
+	for (vp = request->packet->vps; vp; vp = vp->next) {
+		/*
+		 *	Multiple instances are written together, when
+		 *	we see the first one.
+		 */
+		for (prev = request->packet->vps; prev != vp; prev = prev->next) {
+			if ((prev->da == vp->da) && (prev->tag == vp->tag)) break;
+		}
+		if (prev != vp) continue;
+
+		num = 0;
+		for (prev = vp; prev && (num < NATS_MAX_VALUES); prev = prev->next) {
+			if ((prev->da == vp->da) && (prev->tag == vp->tag)) vps[num++] = prev;
+		}
+
+		slen = nats_encode_member(p, end - p, vp->da->name, vps, num);
+		if (slen < 0) return -1;
+		p += slen;
+	}
+
+done:
+	if ((end - p) < 2) return -1;
+	*p++ = '}';
+	*p = '\0';
+
+	return p - out;
+}
+
+static void nats_wake(rlm_nats_t *inst)
+{
+	if (write(inst->pipe[1], "", 1) < 0) {
+		/* Full, so it's going to wake up anyway */
+	}
+}
+
+/*
+ *	Spool file.  One message per line.  Only used by the publisher
+ *	thread.
+ */
+static void nats_spool_write(rlm_nats_t *inst, nats_msg_t *msg)
+{
+	struct iovec	iov[2];
+	static char	newline[] = "\n";
+
+	for (; msg; msg = msg->next) {
+		if ((inst->spool_fd < 0) ||
+		    ((uint64_t) (inst->spool_size + msg->len + 1) > inst->spool_max)) {
+			__atomic_fetch_add(&inst->dropped, 1, __ATOMIC_RELAXED);
+			continue;
+		}
+
+		iov[0].iov_base = msg->data;
+		iov[0].iov_len = msg->len;
+		iov[1].iov_base = newline;
+		iov[1].iov_len = 1;
+
+		if (writev(inst->spool_fd, iov, 2) != (ssize_t) (msg->len + 1)) {
+			ERROR("rlm_nats (%s): Failed writing to %s: %s", inst->name, inst->spool,
+			      fr_syserror(errno));
+			__atomic_fetch_add(&inst->dropped, 1, __ATOMIC_RELAXED);
+			continue;
+		}
+
+		inst->spool_size += msg->len + 1;
+		inst->spooled++;
+	}
+}
+
+static void nats_disconnect(rlm_nats_t *inst)
+{
+	if (inst->sockfd < 0) return;
+
+	close(inst->sockfd);
+	inst->sockfd = -1;
+	inst->rbuf_len = 0;
+	inst->next_connect = time(NULL) + inst->retry_delay;
+}
+
+static int nats_write(rlm_nats_t *inst, char const *data, size_t len)
+{
+	ssize_t	slen;
+
+	while (len > 0) {
+		slen = write(inst->sockfd, data, len);
+		if (slen < 0) {
+			if (errno == EINTR) continue;
+
+			ERROR("rlm_nats (%s): Failed writing to NATS server: %s", inst->name, fr_syserror(errno));
+			nats_disconnect(inst);
+			return -1;
+		}
+		data += slen;
+		len -= slen;
+	}
+
+	return 0;
+}
+
+static int nats_connect(rlm_nats_t *inst)
+{
+	struct timeval	tv;
+
+	if (time(NULL) < inst->next_connect) return -1;
+
+	inst->sockfd = fr_tcp_client_socket(NULL, &inst->ipaddr, inst->port);
+	if (inst->sockfd < 0) {
+		char ipbuf[128];
+
+		ERROR("rlm_nats (%s): Failed connecting to NATS server %s port %u: %s", inst->name,
+		      inet_ntop(inst->ipaddr.af, &inst->ipaddr.ipaddr, ipbuf, sizeof(ipbuf)),
+		      inst->port, fr_strerror());
+		inst->sockfd = -1;
+		inst->next_connect = time(NULL) + inst->retry_delay;
+		return -1;
+	}
+
+	/*
+	 *	Don't hang forever on a server which has stopped
+	 *	reading.
+	 */
+	tv.tv_sec = 5;
+	tv.tv_usec = 0;
+	(void) setsockopt(inst->sockfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	if (nats_write(inst, inst->connect, strlen(inst->connect)) < 0) return -1;
+
+	INFO("rlm_nats (%s): Connected to NATS server", inst->name);
+	return 0;
+}
+
+/*
+ *	Read what the server sent us.  We answer PINGs, and drop the
+ *	connection on errors.  Everything else is ignored.
+ */
+static void nats_read(rlm_nats_t *inst)
+{
+	ssize_t	slen;
+	char	*p, *eol;
+
+	slen = read(inst->sockfd, inst->rbuf + inst->rbuf_len, sizeof(inst->rbuf) - inst->rbuf_len - 1);
+	if (slen <= 0) {
+		if ((slen < 0) && (errno == EINTR)) return;
+
+		ERROR("rlm_nats (%s): NATS server closed the connection", inst->name);
+		nats_disconnect(inst);
+		return;
+	}
+	inst->rbuf_len += slen;
+	inst->rbuf[inst->rbuf_len] = '\0';
+
+	p = inst->rbuf;
+	while ((eol = strstr(p, "\r\n")) != NULL) {
+		*eol = '\0';
+
+		if (strcmp(p, "PING") == 0) {
+			if (nats_write(inst, "PONG\r\n", 6) < 0) return;
+
+		} else if (strncmp(p, "-ERR", 4) == 0) {
+			ERROR("rlm_nats (%s): NATS server error: %s", inst->name, p + 4);
+			nats_disconnect(inst);
+			return;
+		}
+
+		p = eol + 2;
+	}
+
+	/*
+	 *	Keep the partial line.  If there's no room, it's a
+	 *	long INFO line, which we don't need.
+	 */
+	inst->rbuf_len -= p - inst->rbuf;
+	if (inst->rbuf_len >= (sizeof(inst->rbuf) - 1)) inst->rbuf_len = 0;
+	memmove(inst->rbuf, p, inst->rbuf_len);
+}
+
+/*
+ *	Add one message to the write buffer, writing it out if it's
+ *	full.  Messages are at most NATS_MAX_MESSAGE bytes, and the
+ *	subject at most NATS_MAX_SUBJECT, so one always fits in an
+ *	empty buffer.
+ */
+static int nats_publish(rlm_nats_t *inst, char const *data, size_t len)
+{
+	size_t	need;
+
+	need = strlen(inst->subject) + len + 32;
+	if ((inst->wbuf_len + need) > NATS_BUFFER_SIZE) {
+		if (nats_write(inst, inst->wbuf, inst->wbuf_len) < 0) return -1;
+		inst->wbuf_len = 0;
+	}
+
+	inst->wbuf_len += sprintf(inst->wbuf + inst->wbuf_len, "PUB %s %zu\r\n", inst->subject, len);
+	memcpy(inst->wbuf + inst->wbuf_len, data, len);
+	inst->wbuf_len += len;
+	inst->wbuf[inst->wbuf_len++] = '\r';
+	inst->wbuf[inst->wbuf_len++] = '\n';
+
+	return 0;
+}
+
+static int nats_flush(rlm_nats_t *inst)
+{
+	if (!inst->wbuf_len) return 0;
+
+	if (nats_write(inst, inst->wbuf, inst->wbuf_len) < 0) return -1;
+	inst->wbuf_len = 0;
+
+	return 0;
+}
+
+/*
+ *	Send what's in the spool file, a buffer at a time.  The file
+ *	is emptied once it has all been sent.
+ */
+static int nats_spool_send(rlm_nats_t *inst)
+{
+	char	*buffer, *p, *eol, *end;
+	ssize_t	slen;
+	int	num;
+	bool	skip = false;
+
+	buffer = talloc_array(NULL, char, NATS_BUFFER_SIZE);
+	if (!buffer) return -1;
+
+	while (inst->spool_offset < inst->spool_size) {
+		slen = pread(inst->spool_fd, buffer, NATS_BUFFER_SIZE, inst->spool_offset);
+		if (slen <= 0) {
+			ERROR("rlm_nats (%s): Failed reading %s: %s", inst->name, inst->spool,
+			      (slen < 0) ? fr_syserror(errno) : "unexpected end of file");
+			inst->spool_offset = inst->spool_size;
+			break;
+		}
+
+		p = buffer;
+		end = buffer + slen;
+		num = 0;
+		while ((eol = memchr(p, '\n', end - p)) != NULL) {
+			/*
+			 *	A line longer than any message can't have
+			 *	been written by us, and might not fit in
+			 *	the write buffer.  Skip it.
+			 */
+			if (skip || ((eol - p) > NATS_MAX_MESSAGE)) {
+				ERROR("rlm_nats (%s): Skipping line of more than %d bytes in %s", inst->name,
+				      NATS_MAX_MESSAGE, inst->spool);
+				skip = false;
+
+			} else if (eol > p) {
+				if (nats_publish(inst, p, eol - p) < 0) goto error;
+				num++;
+			}
+			p = eol + 1;
+		}
+
+		/*
+		 *	No end of line in the whole buffer.  Skip it,
+		 *	and the rest of the line in the next one.
+		 */
+		if (p == buffer) {
+			p = end;
+			skip = true;
+		}
+
+		if (nats_flush(inst) < 0) goto error;
+
+		inst->published += num;
+		inst->spool_offset += p - buffer;
+	}
+
+	talloc_free(buffer);
+
+	if (ftruncate(inst->spool_fd, 0) < 0) {
+		ERROR("rlm_nats (%s): Failed truncating %s: %s", inst->name, inst->spool, fr_syserror(errno));
+		return -1;
+	}
+	inst->spool_offset = inst->spool_size = 0;
+
+	return 0;
+
+error:
+	talloc_free(buffer);
+	inst->wbuf_len = 0;
+	return -1;
+}
+
+/*
+ *	Send a batch of messages, or spool them if we can't.
+ */
+static void nats_send(rlm_nats_t *inst, nats_msg_t *head)
+{
+	nats_msg_t	*msg;
+	uint32_t	num = 0;
+
+	if (inst->sockfd < 0) (void) nats_connect(inst);
+
+	/*
+	 *	Older messages go first.
+	 */
+	if ((inst->sockfd >= 0) && (inst->spool_offset < inst->spool_size)) (void) nats_spool_send(inst);
+
+	if (!head) return;
+
+	if ((inst->sockfd < 0) || (inst->spool_offset < inst->spool_size)) {
+		nats_spool_write(inst, head);
+		return;
+	}
+
+	for (msg = head; msg; msg = msg->next) {
+		if (nats_publish(inst, msg->data, msg->len) < 0) goto spool;
+		num++;
+	}
+	if (nats_flush(inst) < 0) goto spool;
+
+	inst->published += num;
+	return;
+
+spool:
+	inst->wbuf_len = 0;
+	nats_spool_write(inst, head);
+}
+
+static void nats_free_list(nats_msg_t *head)
+{
+	nats_msg_t *next;
+
+	for (; head; head = next) {
+		next = head->next;
+		talloc_free(head);
+	}
+}
+
+static void *nats_thread(void *arg)
+{
+	rlm_nats_t	*inst = arg;
+	nats_msg_t	*head;
+	struct pollfd	fds[2];
+	time_t		now, last_report = 0;
+	char		buffer[256];
+	bool		stop;
+
+	do {
+		stop = __atomic_load_n(&inst->stop, __ATOMIC_ACQUIRE);
+
+		pthread_mutex_lock(&inst->mutex);
+		head = inst->head;
+		inst->head = inst->tail = NULL;
+		inst->num_queued = 0;
+		pthread_mutex_unlock(&inst->mutex);
+
+		nats_send(inst, head);
+		nats_free_list(head);
+
+		/*
+		 *	Complain about drops, but not too often.
+		 */
+		now = time(NULL);
+		if ((now - last_report) >= 10) {
+			uint64_t dropped;
+
+			last_report = now;
+			dropped = __atomic_load_n(&inst->dropped, __ATOMIC_RELAXED);
+			if (dropped != inst->dropped_logged) {
+				WARN("rlm_nats (%s): Dropped %" PRIu64 " messages, as the queue or spool file "
+				     "is full", inst->name, dropped - inst->dropped_logged);
+				inst->dropped_logged = dropped;
+			}
+		}
+
+		if (stop) break;
+
+		fds[0].fd = inst->pipe[0];
+		fds[0].events = POLLIN;
+		fds[1].fd = inst->sockfd;
+		fds[1].events = POLLIN;
+
+		if (poll(fds, (inst->sockfd >= 0) ? 2 : 1, inst->flush_interval) <= 0) continue;
+
+		if (fds[0].revents) {
+			while (read(inst->pipe[0], buffer, sizeof(buffer)) > 0);
+		}
+
+		if ((inst->sockfd >= 0) && fds[1].revents) nats_read(inst);
+	} while (true);
+
+	nats_disconnect(inst);
+
+	return NULL;
+}
+
+/** Build the attribute map from the "map" section
+ *
+ */
+static int nats_map_parse(CONF_SECTION *conf, rlm_nats_t *inst)
+{
+	CONF_SECTION	*cs;
+	CONF_ITEM	*ci;
+	CONF_PAIR	*cp;
+	char const	*name, *value;
+	int		num = 0;
+
+	cs = cf_section_sub_find(conf, "map");
+	if (!cs) return 0;
+
+	for (ci = cf_item_find_next(cs, NULL); ci != NULL; ci = cf_item_find_next(cs, ci)) num++;
+	if (!num) return 0;
+
+	inst->map = talloc_zero_array(inst, nats_map_t, num);
+	if (!inst->map) return -1;
+
+	for (ci = cf_item_find_next(cs, NULL); ci != NULL; ci = cf_item_find_next(cs, ci)) {
+		if (!cf_item_is_pair(ci)) {
+			cf_log_err(ci, "Entry is not in \"key = attribute\" format");
+			return -1;
+		}
+
+		cp = cf_itemtopair(ci);
+		name = cf_pair_attr(cp);
+		value = cf_pair_value(cp);
+
+		if (strpbrk(name, "\"\\")) {
+			cf_log_err(ci, "Invalid character in key \"%s\"", name);
+			return -1;
+		}
+
+		if (!value) {
+			cf_log_err(ci, "No attribute given for key \"%s\"", name);
+			return -1;
+		}
+		if (*value == '&') value++;
+
+		if (tmpl_afrom_attr_str(inst->map, &inst->map[inst->num_map].vpt, value,
+					REQUEST_CURRENT, PAIR_LIST_REQUEST) <= 0) {
+			cf_log_err(ci, "Failed parsing attribute reference \"%s\": %s", value, fr_strerror());
+			return -1;
+		}
+		inst->map[inst->num_map].name = name;
+		inst->num_map++;
+	}
+
+	return 0;
+}
+
+/*
+ *	Quote a string for JSON.  Only the characters which JSON
+ *	doesn't allow in a string are escaped.
+ */
+static char *nats_json_string(TALLOC_CTX *ctx, char const *in)
+{
+	char	*out, *p;
+
+	out = p = talloc_array(ctx, char, (strlen(in) * 6) + 3);
+	if (!out) return NULL;
+
+	*p++ = '"';
+	for (; *in; in++) {
+		uint8_t c = *in;
+
+		if ((c == '"') || (c == '\\')) {
+			*p++ = '\\';
+			*p++ = c;
+
+		} else if (c < 0x20) {
+			p += sprintf(p, "\\u%04x", c);
+
+		} else {
+			*p++ = c;
+		}
+	}
+	*p++ = '"';
+	*p = '\0';
+
+	return out;
+}
+
+static int mod_instantiate(CONF_SECTION *conf, void *instance)
+{
+	rlm_nats_t *inst = instance;
+
+	inst->name = cf_section_name2(conf);
+	if (!inst->name) inst->name = cf_section_name1(conf);
+
+	inst->sockfd = -1;
+	inst->spool_fd = -1;
+	inst->pipe[0] = inst->pipe[1] = -1;
+
+	FR_INTEGER_BOUND_CHECK("queue_size", inst->queue_size, >=, 1);
+	FR_INTEGER_BOUND_CHECK("batch_size", inst->batch_size, >=, 1);
+	FR_INTEGER_BOUND_CHECK("batch_size", inst->batch_size, <=, inst->queue_size);
+	FR_INTEGER_BOUND_CHECK("flush_interval", inst->flush_interval, >=, 1);
+	FR_INTEGER_BOUND_CHECK("flush_interval", inst->flush_interval, <=, 10000);
+	FR_INTEGER_BOUND_CHECK("retry_delay", inst->retry_delay, >=, 1);
+
+	if (strpbrk(inst->subject, " \t\r\n")) {
+		cf_log_err_cs(conf, "'subject' must not contain white space");
+		return -1;
+	}
+
+	if (strlen(inst->subject) > NATS_MAX_SUBJECT) {
+		cf_log_err_cs(conf, "'subject' must be no more than %d characters", NATS_MAX_SUBJECT);
+		return -1;
+	}
+
+	if (inst->username) {
+		char *user, *pass;
+
+		user = nats_json_string(inst, inst->username);
+		pass = nats_json_string(inst, inst->password ? inst->password : "");
+		if (!user || !pass) return -1;
+
+		inst->connect = talloc_typed_asprintf(inst, "CONNECT {\"verbose\":false,\"pedantic\":false,"
+						      "\"name\":\"freeradius\",\"user\":%s,\"pass\":%s}\r\n",
+						      user, pass);
+		talloc_free(user);
+		talloc_free(pass);
+	} else {
+		inst->connect = talloc_typed_strdup(inst, "CONNECT {\"verbose\":false,\"pedantic\":false,"
+						    "\"name\":\"freeradius\"}\r\n");
+	}
+	if (!inst->connect) return -1;
+
+	if (nats_map_parse(conf, inst) < 0) return -1;
+
+	inst->wbuf = talloc_array(inst, char, NATS_BUFFER_SIZE);
+	if (!inst->wbuf) return -1;
+
+	/*
+	 *	Anything left from last time is sent first.
+	 */
+	if (inst->spool) {
+		struct stat buf;
+
+		inst->spool_fd = open(inst->spool, O_RDWR | O_CREAT | O_APPEND, 0600);
+		if (inst->spool_fd < 0) {
+			cf_log_err_cs(conf, "Failed opening %s: %s", inst->spool, fr_syserror(errno));
+			return -1;
+		}
+
+		if (fstat(inst->spool_fd, &buf) == 0) inst->spool_size = buf.st_size;
+	}
+
+	if (pipe(inst->pipe) < 0) {
+		cf_log_err_cs(conf, "Failed creating pipe: %s", fr_syserror(errno));
+		return -1;
+	}
+	fr_nonblock(inst->pipe[0]);
+	fr_nonblock(inst->pipe[1]);
+
+	pthread_mutex_init(&inst->mutex, NULL);
+
+	return 0;
+}
+
+static int mod_detach(void *instance)
+{
+	rlm_nats_t *inst = instance;
+
+	if (inst->running) {
+		__atomic_store_n(&inst->stop, true, __ATOMIC_RELEASE);
+		nats_wake(inst);
+		pthread_join(inst->thread, NULL);
+	}
+
+	nats_free_list(inst->head);
+	inst->head = NULL;
+
+	if (inst->pipe[0] >= 0) {
+		close(inst->pipe[0]);
+		close(inst->pipe[1]);
+		pthread_mutex_destroy(&inst->mutex);
+	}
+	if (inst->spool_fd >= 0) close(inst->spool_fd);
+
+	return 0;
+}
+
+static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, REQUEST *request)
+{
+	rlm_nats_t	*inst = instance;
+	nats_msg_t	*msg;
+	char		buffer[NATS_MAX_MESSAGE];
+	ssize_t		len;
+	bool		wake;
+
+	len = nats_encode(inst, request, buffer, sizeof(buffer));
+	if (len < 0) {
+		REDEBUG("Request is too large to publish (more than %d bytes of JSON)", NATS_MAX_MESSAGE);
+		return RLM_MODULE_FAIL;
+	}
+
+	/*
+	 *	Cheap check first, so that a full queue doesn't cost
+	 *	us a copy of every packet.
+	 */
+	if (__atomic_load_n(&inst->num_queued, __ATOMIC_RELAXED) >= inst->queue_size) goto drop;
+
+	msg = talloc_size(NULL, sizeof(*msg) + len);
+	if (!msg) return RLM_MODULE_FAIL;
+	talloc_set_name_const(msg, "nats_msg_t");
+
+	msg->next = NULL;
+	msg->len = len;
+	memcpy(msg->data, buffer, len);
+
+	pthread_mutex_lock(&inst->mutex);
+	if (inst->num_queued >= inst->queue_size) {
+		pthread_mutex_unlock(&inst->mutex);
+		talloc_free(msg);
+		goto drop;
+	}
+
+	/*
+	 *	The thread is started here instead of in
+	 *	mod_instantiate(), as the server may fork after the
+	 *	modules have been instantiated.
+	 */
+	if (!inst->running) {
+		int ret;
+
+		ret = pthread_create(&inst->thread, NULL, nats_thread, inst);
+		if (ret != 0) {
+			pthread_mutex_unlock(&inst->mutex);
+			talloc_free(msg);
+			REDEBUG("Failed creating publisher thread: %s", fr_syserror(ret));
+			return RLM_MODULE_FAIL;
+		}
+		inst->running = true;
+	}
+
+	if (inst->tail) {
+		inst->tail->next = msg;
+	} else {
+		inst->head = msg;
+	}
+	inst->tail = msg;
+	inst->num_queued++;
+	wake = (inst->num_queued == inst->batch_size);
+	pthread_mutex_unlock(&inst->mutex);
+
+	if (wake) nats_wake(inst);
+
+	return RLM_MODULE_OK;
+
+drop:
+	__atomic_fetch_add(&inst->dropped, 1, __ATOMIC_RELAXED);
+	RWDEBUG("Publish queue is full.  Dropping request");
+	return RLM_MODULE_FAIL;
+}
+
+/*
+ *	The module name should be the only globally exported symbol.
+ *	That is, everything else should be 'static'.
+ *
+ *	If the module needs to temporarily modify it's instantiation
+ *	data, the type should be changed to RLM_TYPE_THREAD_UNSAFE.
+ *	The server will then take care of ensuring that the module
+ *	is single-threaded.
+ */
+module_t rlm_nats = {
+	RLM_MODULE_INIT,
+	"nats",
+	RLM_TYPE_THREAD_SAFE,		/* type */
+	sizeof(rlm_nats_t),
+	module_config,
+	mod_instantiate,		/* instantiation */
+	mod_detach,			/* detach */
+	{
+		NULL,			/* authentication */
+		NULL,			/* authorization */
+		NULL,			/* preaccounting */
+		mod_accounting,		/* accounting */
+		NULL,			/* checksimul */
+		NULL,			/* pre-proxy */
+		NULL,			/* post-proxy */
+		NULL			/* post-auth */
+	},
+	0,				/* thread_inst_size */
+	NULL,				/* thread_instantiate */
+	NULL,				/* thread_detach */
+	NULL				/* cache_flush */
+};
@@ -28,7 +28,6 @@ RCSIDH(extern_h, "$Id$")
 #include <freeradius-devel/modules.h>
 
 #include <sys/types.h>
-#include <pthread.h>
 
 #include "otp.h"	/* OTP_MAX_CHALLENGE_LEN, otp_pwe_t */
 
@@ -58,6 +57,8 @@ typedef struct rlm_otp_t {
 	uint32_t mschap_mppe_policy;	//!< Whether or not do to mppe for
 					//!< mschap .
 	uint32_t mschap_mppe_types;	//!< key type/length for mschap/mppe.
+
+	fr_connection_pool_t *pool;	//!< Connections to otpd.
 } rlm_otp_t;
 
 /* otp_mppe.c */
@@ -65,6 +66,8 @@ void otp_mppe(REQUEST *, otp_pwe_t, rlm_otp_t const *, char const *);
 
 /* otp_pw_valid.c */
 int otp_pw_valid(REQUEST *, int, char const *, rlm_otp_t const *, char []);
+void *otp_conn_create(TALLOC_CTX *, void *);
+int otp_conn_alive(void *, void *);
 
 /* otp_radstate.c */
 #define OTP_MAX_RADSTATE_LEN 2 + (OTP_MAX_CHALLENGE_LEN * 2 + 8 + 8 + 32)*2 + 1
@@ -84,15 +87,4 @@ void	otp_get_random(uint8_t *, size_t);
 void	otp_async_challenge(char[OTP_MAX_CHALLENGE_LEN + 1], size_t);
 ssize_t	otp_a2x(uint8_t const *, size_t, uint8_t *);
 
-void	_otp_pthread_mutex_init(pthread_mutex_t *, pthread_mutexattr_t const *,
-				char const *);
-void	_otp_pthread_mutex_lock(pthread_mutex_t *, char const *);
-int	_otp_pthread_mutex_trylock(pthread_mutex_t *, char const *);
-void	_otp_pthread_mutex_unlock(pthread_mutex_t *, char const *);
-
-#define otp_pthread_mutex_init(a, b) _otp_pthread_mutex_init((a), (b), __func__)
-#define otp_pthread_mutex_lock(a) _otp_pthread_mutex_lock((a), __func__)
-#define otp_pthread_mutex_trylock(a) _otp_pthread_mutex_trylock((a), __func__)
-#define otp_pthread_mutex_unlock(a) _otp_pthread_mutex_unlock((a), __func__)
-
 #endif /* EXTERN_H */
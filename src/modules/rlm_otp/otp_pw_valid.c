@@ -30,9 +30,7 @@ RCSID("$Id$")
 #include "otp.h"
 #include "otp_pw_valid.h"
 
-#ifdef HAVE_PTHREAD_H
-#include <pthread.h>
-#endif
+#include <poll.h>
 #include <sys/un.h>
 
 
@@ -52,9 +50,6 @@ static int otprc2rlmrc(int rc)
 	}
 }
 
-static otp_fd_t *otp_fd_head;
-static pthread_mutex_t otp_fd_head_mutex = PTHREAD_MUTEX_INITIALIZER;
-
 /*
  * Test for passcode validity by asking otpd.
  *
@@ -237,34 +232,30 @@ static int otp_verify(rlm_otp_t const *opt,
 {
 	otp_fd_t *fdp;
 	int rc;
-	int tryagain = 2;
+	bool tryagain = true;
 
-	retry:
-	if (!tryagain--) {
+	fdp = fr_connection_get(opt->pool);
+	if (!fdp) {
 		return -1;
 	}
 
-	fdp = otp_getfd(opt);
-	if (!fdp || fdp->fd == -1) {
-		return -1;
+	/* don't send a request down a connection otpd has closed */
+	if (otp_conn_alive(NULL, fdp) < 0) {
+		fdp = fr_connection_reconnect(opt->pool, fdp);
+		if (!fdp) {
+			return -1;
+		}
 	}
 
+	retry:
 	rc = otp_write(fdp, (char const *) request, sizeof(*request));
 	if (rc != sizeof(*request)) {
-		if (rc == 0) {
-			goto retry;	/* otpd disconnect */	/*TODO: pause */
-		} else {
-			return -1;
-		}
+		goto reconnect;
 	}
 
 	rc = otp_read(fdp, (char *) reply, sizeof(*reply));
 	if (rc != sizeof(*reply)) {
-		if (rc == 0) {
-			goto retry;	/* otpd disconnect */	/*TODO: pause */
-		} else {
-			return -1;
-		}
+		goto reconnect;
 	}
 
 	/* validate the reply */
@@ -272,24 +263,50 @@ static int otp_verify(rlm_otp_t const *opt,
 		AUTH("rlm_otp: otpd reply for [%s] invalid "
 		       "(version %d != 1)", request->username, reply->version);
 
-		otp_putfd(fdp, 1);
-		return -1;
+		goto error;
 	}
 
 	if (reply->passcode[OTP_MAX_PASSCODE_LEN] != '\0') {
 		AUTH("rlm_otp: otpd reply for [%s] invalid "
 		       "(passcode)", request->username);
 
-		otp_putfd(fdp, 1);
-		return -1;
+		goto error;
 	}
 
-	otp_putfd(fdp, 0);
+	fr_connection_release(opt->pool, fdp);
 	return reply->rc;
+
+	/*
+	 *	otpd has gone away (e.g. it was restarted), so the
+	 *	request may never have been seen.  Try once more
+	 *	on a new connection.
+	 */
+	reconnect:
+	if (tryagain) {
+		tryagain = false;
+
+		fdp = fr_connection_reconnect(opt->pool, fdp);
+		if (!fdp) {
+			return -1;
+		}
+		goto retry;
+	}
+
+	/*
+	 *	We don't know where the next reply starts, so the
+	 *	connection can't be given to anyone else.
+	 */
+	error:
+	fdp = fr_connection_reconnect(opt->pool, fdp);
+	if (fdp) {
+		fr_connection_release(opt->pool, fdp);
+	}
+
+	return -1;
 }
 
 /*
- * Full read with logging, and close on failure.
+ * Full read with logging.
  * Returns nread on success, 0 on EOF, -1 on other failures.
  */
 static int
@@ -306,7 +323,6 @@ otp_read(otp_fd_t *fdp, char *buf, size_t len)
 			} else {
 				ERROR("rlm_otp: %s: read from otpd: %s",
 				       __func__, fr_syserror(errno));
-				otp_putfd(fdp, 1);
 
 				return -1;
 			}
@@ -314,7 +330,6 @@ otp_read(otp_fd_t *fdp, char *buf, size_t len)
 
 		if (!n) {
 			ERROR("rlm_otp: %s: otpd disconnect", __func__);
-			otp_putfd(fdp, 1);
 
 			return 0;
 		}
@@ -326,8 +341,8 @@ otp_read(otp_fd_t *fdp, char *buf, size_t len)
 }
 
 /*
- *	Full write with logging, and close on failure.
- *	Returns number of bytes written on success, errno on failure.
+ *	Full write with logging.
+ *	Returns number of bytes written on success, -1 on failure.
  */
 static int otp_write(otp_fd_t *fdp, char const *buf, size_t len)
 {
@@ -343,9 +358,7 @@ static int otp_write(otp_fd_t *fdp, char const *buf, size_t len)
 				ERROR("rlm_otp: %s: write to otpd: %s",
 				       __func__, fr_syserror(errno));
 
-				otp_putfd(fdp, 1);
-				return errno;
-
+				return -1;
 			}
 		}
 
@@ -395,62 +408,58 @@ static int otp_connect(char const *path)
 	return fd;
 }
 
+static int _otp_conn_free(otp_fd_t *fdp)
+{
+	if (fdp->fd >= 0) {
+		(void) close(fdp->fd);
+	}
+
+	return 0;
+}
+
 /*
- * Retrieve an fd (from pool) to use for otpd connection.
- * It'd be simpler to use TLS but FR can have lots of threads
- * and we don't want to waste fd's that way.
+ * Connection pool create callback.
  * We can't have a global fd because we'd then be pipelining
  * requests to otpd and we have no way to demultiplex
- * the responses.
+ * the responses, so each request takes a connection of its
+ * own from the pool.
  */
-static otp_fd_t * otp_getfd(rlm_otp_t const *opt)
+void *otp_conn_create(TALLOC_CTX *ctx, void *instance)
 {
-	int rc;
+	rlm_otp_t *inst = instance;
 	otp_fd_t *fdp;
+	int fd;
 
-	/* walk the connection pool looking for an available fd */
-	for (fdp = otp_fd_head; fdp; fdp = fdp->next) {
-		rc = otp_pthread_mutex_trylock(&fdp->mutex);
-		if (!rc) {
-			if (!strcmp(fdp->path, opt->otpd_rp)) {	/* could just use == */
-				break;
-			}
-		}
-	}
-
-	if (!fdp) {
-		/* no fd was available, add a new one */
-		fdp = rad_malloc(sizeof(*fdp));
-		otp_pthread_mutex_init(&fdp->mutex, NULL);
-		otp_pthread_mutex_lock(&fdp->mutex);
-
-		/* insert new fd at head */
-		otp_pthread_mutex_lock(&otp_fd_head_mutex);
-		fdp->next = otp_fd_head;
-		otp_fd_head = fdp;
-		otp_pthread_mutex_unlock(&otp_fd_head_mutex);
-
-		/* initialize */
-		fdp->path = opt->otpd_rp;
-		fdp->fd = -1;
+	fd = otp_connect(inst->otpd_rp);
+	if (fd < 0) {
+		return NULL;
 	}
 
-	/* establish connection */
-	if (fdp->fd == -1) {
-		fdp->fd = otp_connect(fdp->path);
-	}
+	fdp = talloc_zero(ctx, otp_fd_t);
+	fdp->fd = fd;
+	talloc_set_destructor(fdp, _otp_conn_free);
 
 	return fdp;
 }
 
-/* release fd, and optionally disconnect from otpd */
-static void otp_putfd(otp_fd_t *fdp, int disconnect)
+/*
+ * Connection pool health check.
+ * otpd only ever writes in reply to a request, so an idle
+ * connection which is readable has either been closed by otpd,
+ * or holds a stale reply.  Neither is any use to us.
+ */
+int otp_conn_alive(UNUSED void *instance, void *handle)
 {
-	if (disconnect) {
-		(void) close(fdp->fd);
-		fdp->fd = -1;
+	otp_fd_t *fdp = handle;
+	struct pollfd pfd;
+
+	pfd.fd = fdp->fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+
+	if (poll(&pfd, 1, 0) != 0) {
+		return -1;
 	}
 
-	/* make connection available to another thread */
-	otp_pthread_mutex_unlock(&fdp->mutex);
+	return 0;
 }
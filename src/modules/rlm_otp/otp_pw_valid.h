@@ -23,16 +23,13 @@
 
 RCSIDH(otp_pw_valid_h, "$Id$")
 
-#include <pthread.h>
 #include <sys/types.h>
 #include "extern.h"	/* rlm_otp_t */
 #include "otp.h"	/* otp_request_t, otp_reply_t */
 
+/* connection handle, owned by the instance's connection pool */
 typedef struct otp_fd_t {
-  pthread_mutex_t	mutex;
-  char const		*path;	/* allows diff instances to use diff otpds */
   int			fd;
-  struct otp_fd_t	*next;
 } otp_fd_t;
 
 static int otprc2rlmrc(int);
@@ -41,7 +38,5 @@ static int otp_verify(rlm_otp_t const *,
 static int otp_read(otp_fd_t *, char *, size_t);
 static int otp_write(otp_fd_t *, char const *, size_t);
 static int otp_connect(char const *);
-static otp_fd_t *otp_getfd(rlm_otp_t const *);
-static void otp_putfd(otp_fd_t *, int);
 
 #endif /* OTP_PW_VALID_H */
@@ -24,7 +24,6 @@ RCSID("$Id$")
 #include "extern.h"
 
 #include <inttypes.h>
-#include <pthread.h>
 #include <sys/types.h>
 #include <stdlib.h>
 #include <string.h>
@@ -75,69 +74,3 @@ void otp_async_challenge(char challenge[OTP_MAX_CHALLENGE_LEN + 1],
 
 	challenge[len] = '\0';
 }
-
-/** Guaranteed initialization
- *
- */
-void _otp_pthread_mutex_init(pthread_mutex_t *mutexp, pthread_mutexattr_t const *attr, char const *caller)
-{
-	int rc;
-
-	rc = pthread_mutex_init(mutexp, attr);
-	if (rc) {
-		ERROR("rlm_otp: %s: pthread_mutex_init: %s",
-		       caller, fr_syserror(rc));
-
-		fr_exit(1);
-	}
-}
-
-/** Guaranteed lock
- *
- */
-void _otp_pthread_mutex_lock(pthread_mutex_t *mutexp, char const *caller)
-{
-	int rc;
-
-	rc = pthread_mutex_lock(mutexp);
-	if (rc) {
-		ERROR("rlm_otp: %s: pthread_mutex_lock: %s",
-		       caller, fr_syserror(rc));
-
-		fr_exit(1);
-	}
-}
-
-/** Guaranteed trylock
- *
- */
-int _otp_pthread_mutex_trylock(pthread_mutex_t *mutexp, char const *caller)
-{
-	int rc;
-
-	rc = pthread_mutex_trylock(mutexp);
-	if (rc && rc != EBUSY) {
-		ERROR("rlm_otp: %s: pthread_mutex_trylock: %s",
-		       caller, fr_syserror(rc));
-
-		fr_exit(1);
-	}
-
-	return rc;
-}
-
-/** Guaranteed unlock
- *
- */
-void _otp_pthread_mutex_unlock(pthread_mutex_t *mutexp, char const *caller)
-{
-	int rc;
-
-	rc = pthread_mutex_unlock(mutexp);
-	if (rc) {
-		ERROR("rlm_otp: %s: pthread_mutex_unlock: %s",
-		       caller, fr_syserror(rc));
-
-		fr_exit(1);
-	}
-}
@@ -116,6 +116,20 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 	inst->name = cf_section_name2(conf);
 	if (!inst->name) inst->name = cf_section_name1(conf);
 
+	inst->pool = fr_connection_pool_module_init(conf, inst, otp_conn_create, otp_conn_alive, NULL);
+	if (!inst->pool) {
+		return -1;
+	}
+
+	return 0;
+}
+
+static int mod_detach(void *instance)
+{
+	rlm_otp_t *inst = instance;
+
+	fr_connection_pool_delete(inst->pool);
+
 	return 0;
 }
 
@@ -422,7 +436,7 @@ module_t rlm_otp = {
 	sizeof(rlm_otp_t),
 	module_config,
 	mod_instantiate,		/* instantiation */
-	NULL,				/* detach */
+	mod_detach,			/* detach */
 	{
 		mod_authenticate,	/* authentication */
 		mod_authorize,		/* authorization */
@@ -433,4 +447,8 @@ module_t rlm_otp = {
 		NULL,			/* post-proxy */
 		NULL			/* post-auth */
 	},
+	0,				/* thread_inst_size */
+	NULL,				/* thread_instantiate */
+	NULL,				/* thread_detach */
+	NULL				/* cache_flush */
 };
@@ -26,6 +26,13 @@ RCSID("$Id$")
 #include <freeradius-devel/modules.h>
 #include <freeradius-devel/rad_assert.h>
 
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
 struct mypasswd {
 	struct mypasswd *next;
 	char *listflag;
@@ -369,8 +376,38 @@ int main(void){
 }
 
 #else  /* TEST */
+
+#ifdef HAVE_PTHREAD_H
+#define PTHREAD_MUTEX_LOCK pthread_mutex_lock
+#define PTHREAD_MUTEX_UNLOCK pthread_mutex_unlock
+#else
+#define PTHREAD_MUTEX_LOCK(_x)
+#define PTHREAD_MUTEX_UNLOCK(_x)
+#endif
+
+/*
+ *	Limits for "mmap = yes", so that lines can be split into
+ *	fields on the stack.
+ */
+#define PASSWD_MAX_FIELDS	64
+#define PASSWD_MAX_LINE		1024
+
+/*
+ *	The passwd file, mapped into memory, with a hash table of the
+ *	offsets of its keys.
+ */
+typedef struct passwd_map {
+	char			*data;		//!< Contents of the file, read-only.
+	size_t			len;
+	struct stat		st;		//!< Of the file when it was read.
+	uint32_t		mask;		//!< Number of slots - 1.
+	uint32_t		*slots;		//!< Offset of each key + 1, or 0 if the slot is empty.
+	int			refs;
+} passwd_map_t;
+
 struct passwd_instance {
 	struct hashtable	*ht;
+	passwd_map_t		*map;
 	struct mypasswd		*pwdfmt;
 	char const		*filename;
 	char const		*format;
@@ -383,6 +420,16 @@ struct passwd_instance {
 	uint32_t		listable;
 	DICT_ATTR const		*keyattr;
 	bool			ignore_empty;
+	bool			use_mmap;
+	uint32_t		reload_interval;
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t		mutex;
+	pthread_cond_t		cond;
+	pthread_t		thread;
+	bool			running;
+	bool			exiting;
+#endif
 };
 
 static const CONF_PARSER module_config[] = {
@@ -402,9 +449,347 @@ static const CONF_PARSER module_config[] = {
 	{ "hashsize", FR_CONF_OFFSET(PW_TYPE_INTEGER | PW_TYPE_DEPRECATED, struct passwd_instance, hash_size), NULL },
 	{ "hash_size", FR_CONF_OFFSET(PW_TYPE_INTEGER, struct passwd_instance, hash_size), "100" },
 
+	{ "mmap", FR_CONF_OFFSET(PW_TYPE_BOOLEAN, struct passwd_instance, use_mmap), "no" },
+	{ "reload_interval", FR_CONF_OFFSET(PW_TYPE_INTEGER, struct passwd_instance, reload_interval), "0" },
+
 	{ NULL, -1, 0, NULL, NULL }
 };
 
+static int _passwd_map_free(passwd_map_t *map)
+{
+#ifdef HAVE_SYS_MMAN_H
+	if (map->data) munmap(map->data, map->len);
+#endif
+
+	return 0;
+}
+
+/*
+ *	Where a key which starts at "p" ends.  If the key is the last
+ *	field, it's the rest of the line, as with string_to_entry().
+ */
+static char const *passwd_key_end(struct passwd_instance const *inst, char const *p, char const *eol)
+{
+	bool last = (inst->keyfield == (inst->nfields - 1));
+
+	for (; p < eol; p++) {
+		if (!last && (*p == *inst->delimiter)) break;
+		if (inst->listable && (*p == ',')) break;
+	}
+
+	return p;
+}
+
+/*
+ *	Walk over the keys in the file, either counting them, or
+ *	adding them to the hash table.
+ */
+static uint32_t passwd_map_walk(struct passwd_instance const *inst, passwd_map_t *map, bool insert)
+{
+	char const	*p, *eol, *next, *key, *end;
+	char const	*data_end = map->data + map->len;
+	uint32_t	keys = 0, i, hash;
+	uint32_t	skipped = 0;
+
+	for (p = map->data; p < data_end; p = next) {
+		eol = memchr(p, '\n', data_end - p);
+		if (!eol) eol = data_end;
+		next = eol + 1;
+
+		if ((eol > p) && (eol[-1] == '\r')) eol--;
+		if (eol == p) continue;
+		if (inst->ignore_nislike && ((*p == '+') || (*p == '-'))) continue;
+
+		if ((eol - p) >= PASSWD_MAX_LINE) {
+			skipped++;
+			continue;
+		}
+
+		key = p;
+		for (i = 0; key && (i < inst->keyfield); i++) {
+			key = memchr(key, *inst->delimiter, eol - key);
+			if (key) key++;
+		}
+		if (!key) continue;
+
+		for (;;) {
+			end = passwd_key_end(inst, key, eol);
+			if (end > key) {
+				keys++;
+
+				if (insert) {
+					hash = fr_hash(key, end - key) & map->mask;
+					while (map->slots[hash]) hash = (hash + 1) & map->mask;
+					map->slots[hash] = (key - map->data) + 1;
+				}
+			}
+
+			if (!inst->listable || (end == eol) || (*end != ',')) break;
+			key = end + 1;
+		}
+	}
+
+	if (insert && skipped) {
+		WARN("rlm_passwd: Ignored %u lines in %s which are longer than %i characters",
+		     skipped, inst->filename, PASSWD_MAX_LINE - 1);
+	}
+
+	return keys;
+}
+
+/*
+ *	Read and index the passwd file.
+ */
+static passwd_map_t *passwd_map_load(struct passwd_instance const *inst)
+{
+	int		fd;
+	passwd_map_t	*map;
+	uint32_t	keys, size;
+
+	fd = open(inst->filename, O_RDONLY);
+	if (fd < 0) {
+		ERROR("rlm_passwd: Failed opening %s: %s", inst->filename, fr_syserror(errno));
+		return NULL;
+	}
+
+	map = talloc_zero(NULL, passwd_map_t);
+	if (!map) {
+		close(fd);
+		return NULL;
+	}
+	talloc_set_destructor(map, _passwd_map_free);
+
+	if (fstat(fd, &map->st) < 0) {
+		ERROR("rlm_passwd: Failed examining %s: %s", inst->filename, fr_syserror(errno));
+		goto error;
+	}
+
+	/*
+	 *	Keys are stored as 32bit offsets.
+	 */
+	if ((uint64_t) map->st.st_size >= UINT32_MAX) {
+		ERROR("rlm_passwd: %s is too large for \"mmap = yes\"", inst->filename);
+		goto error;
+	}
+	map->len = map->st.st_size;
+
+	if (map->len > 0) {
+#ifdef HAVE_SYS_MMAN_H
+		void *data;
+
+		data = mmap(NULL, map->len, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			ERROR("rlm_passwd: Failed mapping %s: %s", inst->filename, fr_syserror(errno));
+			goto error;
+		}
+		map->data = data;
+#else
+		char *data;
+
+		data = talloc_array(map, char, map->len);
+		if (!data) goto error;
+
+		if (read(fd, data, map->len) != (ssize_t) map->len) {
+			ERROR("rlm_passwd: Failed reading %s: %s", inst->filename, fr_syserror(errno));
+			goto error;
+		}
+		map->data = data;
+#endif
+	}
+	close(fd);
+	fd = -1;
+
+	/*
+	 *	Keep the table at most half full.
+	 */
+	keys = passwd_map_walk(inst, map, false);
+	size = 16;
+	while (size < (keys * 2)) size <<= 1;
+
+	map->slots = talloc_zero_array(map, uint32_t, size);
+	if (!map->slots) goto error;
+	map->mask = size - 1;
+
+	passwd_map_walk(inst, map, true);
+
+	DEBUG2("rlm_passwd: Indexed %u keys in %s", keys, inst->filename);
+
+	return map;
+
+error:
+	if (fd >= 0) close(fd);
+	talloc_free(map);
+	return NULL;
+}
+
+/*
+ *	Return the next entry in the map with the given key.
+ *	"pos" is the slot to search from, and is updated.
+ */
+static char const *passwd_map_next(struct passwd_instance const *inst, passwd_map_t const *map,
+				   char const *name, size_t len, uint32_t *pos)
+{
+	char const	*key, *eol;
+	uint32_t	off;
+
+	while ((off = map->slots[*pos]) != 0) {
+		*pos = (*pos + 1) & map->mask;
+
+		key = map->data + off - 1;
+		if ((size_t) ((map->data + map->len) - key) < len) continue;
+		if (memcmp(key, name, len) != 0) continue;
+
+		eol = memchr(key, '\n', (map->data + map->len) - key);
+		if (!eol) eol = map->data + map->len;
+		if ((eol > key) && (eol[-1] == '\r')) eol--;
+
+		if (passwd_key_end(inst, key, eol) == (key + len)) return key;
+	}
+
+	return NULL;
+}
+
+/*
+ *	Split the line containing "key" into fields, without
+ *	allocating any memory.
+ */
+static struct mypasswd *passwd_map_entry(struct passwd_instance const *inst, passwd_map_t const *map,
+					 char const *key, void *buffer, size_t bufferlen)
+{
+	char const	*start, *eol;
+	char		line[PASSWD_MAX_LINE];
+	size_t		len;
+
+	for (start = key; (start > map->data) && (start[-1] != '\n'); start--);
+
+	eol = memchr(key, '\n', (map->data + map->len) - key);
+	if (!eol) eol = map->data + map->len;
+
+	len = eol - start;
+	if (len >= sizeof(line)) return NULL;
+
+	memcpy(line, start, len);
+	line[len] = '\0';
+
+	if (!string_to_entry(line, inst->nfields, *inst->delimiter, buffer, bufferlen)) return NULL;
+
+	return buffer;
+}
+
+static passwd_map_t *passwd_map_acquire(struct passwd_instance *inst)
+{
+	passwd_map_t *map;
+
+	PTHREAD_MUTEX_LOCK(&inst->mutex);
+	map = inst->map;
+	if (map) map->refs++;
+	PTHREAD_MUTEX_UNLOCK(&inst->mutex);
+
+	return map;
+}
+
+static void passwd_map_release(struct passwd_instance *inst, passwd_map_t *map)
+{
+	bool unused;
+
+	PTHREAD_MUTEX_LOCK(&inst->mutex);
+	unused = (--map->refs == 0);
+	PTHREAD_MUTEX_UNLOCK(&inst->mutex);
+
+	if (unused) talloc_free(map);
+}
+
+/*
+ *	Swap in a new map.  The old one is unmapped once the last
+ *	request using it is done.
+ */
+static void passwd_map_replace(struct passwd_instance *inst, passwd_map_t *map)
+{
+	passwd_map_t *old;
+
+	map->refs = 1;
+
+	PTHREAD_MUTEX_LOCK(&inst->mutex);
+	old = inst->map;
+	inst->map = map;
+	PTHREAD_MUTEX_UNLOCK(&inst->mutex);
+
+	if (old) passwd_map_release(inst, old);
+}
+
+#ifdef HAVE_PTHREAD_H
+static void *passwd_map_thread(void *arg)
+{
+	struct passwd_instance	*inst = arg;
+	passwd_map_t		*map;
+	struct stat		st;
+	struct timeval		now;
+	struct timespec		when;
+	bool			changed;
+
+	pthread_mutex_lock(&inst->mutex);
+	while (!inst->exiting) {
+		gettimeofday(&now, NULL);
+		when.tv_sec = now.tv_sec + inst->reload_interval;
+		when.tv_nsec = now.tv_usec * 1000;
+		pthread_cond_timedwait(&inst->cond, &inst->mutex, &when);
+		if (inst->exiting) break;
+
+		/*
+		 *	Only this thread replaces the map, so it's
+		 *	safe to look at it without a reference.
+		 */
+		changed = (stat(inst->filename, &st) == 0) &&
+			  ((st.st_mtime != inst->map->st.st_mtime) ||
+			   (st.st_size != inst->map->st.st_size) ||
+			   (st.st_ino != inst->map->st.st_ino));
+		pthread_mutex_unlock(&inst->mutex);
+
+		/*
+		 *	If the file can't be read, keep using the
+		 *	entries we have.
+		 */
+		if (changed) {
+			INFO("rlm_passwd: Reloading %s", inst->filename);
+			map = passwd_map_load(inst);
+			if (map) passwd_map_replace(inst, map);
+		}
+
+		pthread_mutex_lock(&inst->mutex);
+	}
+	pthread_mutex_unlock(&inst->mutex);
+
+	return NULL;
+}
+#endif
+
+/*
+ *	This is done on the first lookup, instead of in
+ *	mod_instantiate(), as the server may fork after that.
+ */
+static void passwd_map_start(struct passwd_instance *inst)
+{
+#ifdef HAVE_PTHREAD_H
+	int ret;
+
+	/*
+	 *	Checked again with the mutex held.
+	 */
+	if (!inst->reload_interval || inst->running) return;
+
+	pthread_mutex_lock(&inst->mutex);
+	if (!inst->running) {
+		ret = pthread_create(&inst->thread, NULL, passwd_map_thread, inst);
+		if (ret != 0) {
+			ERROR("rlm_passwd: Failed creating reload thread: %s", fr_syserror(ret));
+		} else {
+			inst->running = true;
+		}
+	}
+	pthread_mutex_unlock(&inst->mutex);
+#endif
+}
+
 static int mod_instantiate(CONF_SECTION *conf, void *instance)
 {
 	int nfields=0, keyfield=-1, listable=0;
@@ -418,11 +803,16 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 	rad_assert(inst->filename && *inst->filename);
 	rad_assert(inst->format && *inst->format);
 
-	if (inst->hash_size == 0) {
+	if (!inst->use_mmap && (inst->hash_size == 0)) {
 		cf_log_err_cs(conf, "Invalid value '0' for hash_size");
 		return -1;
 	}
 
+	if (inst->reload_interval && !inst->use_mmap) {
+		cf_log_err_cs(conf, "'reload_interval' requires 'mmap = yes'");
+		return -1;
+	}
+
 	lf = talloc_typed_strdup(inst, inst->format);
 	if ( !lf) {
 		ERROR("rlm_passwd: memory allocation failed for lf");
@@ -457,7 +847,12 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 			      inst->format);
 		return -1;
 	}
-	if (! (inst->ht = build_hash_table (inst->filename, nfields, keyfield, listable, inst->hash_size, inst->ignore_nislike, *inst->delimiter)) ){
+	if (inst->use_mmap && (nfields > PASSWD_MAX_FIELDS)) {
+		cf_log_err_cs(conf, "'mmap = yes' supports at most %i fields in format", PASSWD_MAX_FIELDS);
+		return -1;
+	}
+	if (!inst->use_mmap &&
+	    !(inst->ht = build_hash_table (inst->filename, nfields, keyfield, listable, inst->hash_size, inst->ignore_nislike, *inst->delimiter)) ){
 		ERROR("rlm_passwd: can't build hashtable from passwd file");
 		return -1;
 	}
@@ -500,6 +895,20 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 	inst->keyfield = keyfield;
 	inst->listable = listable;
 	DEBUG2("rlm_passwd: nfields: %d keyfield %d(%s) listable: %s", nfields, keyfield, inst->pwdfmt->field[keyfield], listable?"yes":"no");
+
+	if (inst->use_mmap) {
+		passwd_map_t *map;
+
+		map = passwd_map_load(inst);
+		if (!map) return -1;
+
+#ifdef HAVE_PTHREAD_H
+		pthread_mutex_init(&inst->mutex, NULL);
+		pthread_cond_init(&inst->cond, NULL);
+#endif
+		passwd_map_replace(inst, map);
+	}
+
 	return 0;
 
 #undef inst
@@ -511,6 +920,27 @@ static int mod_detach (void *instance) {
 		release_ht(inst->ht);
 		inst->ht = NULL;
 	}
+
+	if (inst->map) {
+#ifdef HAVE_PTHREAD_H
+		if (inst->running) {
+			pthread_mutex_lock(&inst->mutex);
+			inst->exiting = true;
+			pthread_cond_signal(&inst->cond);
+			pthread_mutex_unlock(&inst->mutex);
+
+			pthread_join(inst->thread, NULL);
+		}
+#endif
+		passwd_map_release(inst, inst->map);
+		inst->map = NULL;
+
+#ifdef HAVE_PTHREAD_H
+		pthread_cond_destroy(&inst->cond);
+		pthread_mutex_destroy(&inst->mutex);
+#endif
+	}
+
 	free(inst->pwdfmt);
 	return 0;
 #undef inst
@@ -535,6 +965,57 @@ static void addresult (TALLOC_CTX *ctx, struct passwd_instance *inst, REQUEST *r
 	}
 }
 
+/*
+ *	As below, but using the mmap'd file.
+ */
+static rlm_rcode_t passwd_map_lookup(struct passwd_instance *inst, REQUEST *request, VALUE_PAIR *key)
+{
+	char		buffer[1024];
+	char const	*found;
+	size_t		len;
+	uint32_t	pos;
+	bool		matched;
+	passwd_map_t	*map;
+	VALUE_PAIR	*i;
+	vp_cursor_t	cursor;
+	struct mypasswd	*pw;
+	union {
+		struct mypasswd	pw;
+		char		data[sizeof(struct mypasswd) + (PASSWD_MAX_FIELDS * (sizeof(char *) + 1)) + PASSWD_MAX_LINE];
+	} entry;
+
+	passwd_map_start(inst);
+
+	map = passwd_map_acquire(inst);
+	if (!map) return RLM_MODULE_FAIL;
+
+	for (i = fr_cursor_init(&cursor, &key);
+	     i;
+	     i = fr_cursor_next_by_num(&cursor, inst->keyattr->attr, inst->keyattr->vendor, TAG_ANY)) {
+		vp_prints_value(buffer, sizeof(buffer), i, 0);
+		len = strlen(buffer);
+		if (!len) continue;
+
+		matched = false;
+		pos = fr_hash(buffer, len) & map->mask;
+		while ((found = passwd_map_next(inst, map, buffer, len, &pos)) != NULL) {
+			pw = passwd_map_entry(inst, map, found, &entry, sizeof(entry));
+			if (!pw) continue;
+
+			matched = true;
+			addresult(request, inst, request, &request->config_items, pw, 0, "config_items");
+			addresult(request->reply, inst, request, &request->reply->vps, pw, 1, "reply_items");
+			addresult(request->packet, inst, request, &request->packet->vps, pw, 2, "request_items");
+		}
+
+		if (matched && !inst->allow_multiple) break;
+	}
+
+	passwd_map_release(inst, map);
+
+	return RLM_MODULE_OK;
+}
+
 static rlm_rcode_t CC_HINT(nonnull) mod_passwd_map(void *instance, REQUEST *request)
 {
 #define inst ((struct passwd_instance *)instance)
@@ -548,6 +1029,8 @@ static rlm_rcode_t CC_HINT(nonnull) mod_passwd_map(void *instance, REQUEST *requ
 		return RLM_MODULE_NOTFOUND;
 	}
 
+	if (inst->use_mmap) return passwd_map_lookup(inst, request, key);
+
 	for (i = fr_cursor_init(&cursor, &key);
 	     i;
 	     i = fr_cursor_next_by_num(&cursor, inst->keyattr->attr, inst->keyattr->vendor, TAG_ANY)) {
@@ -596,5 +1079,9 @@ module_t rlm_passwd = {
 		mod_passwd_map
 #endif
 	},
+	0,				/* thread_inst_size */
+	NULL,				/* thread_instantiate */
+	NULL,				/* thread_detach */
+	NULL				/* cache_flush */
 };
 #endif /* TEST */
@@ -299,6 +299,14 @@ static XS(XS_radiusd_radlog)
 	XSRETURN_NO;
 }
 
+static XS(XS_radiusd_pairs_fetch);
+static XS(XS_radiusd_pairs_store);
+static XS(XS_radiusd_pairs_exists);
+static XS(XS_radiusd_pairs_delete);
+static XS(XS_radiusd_pairs_clear);
+static XS(XS_radiusd_pairs_firstkey);
+static XS(XS_radiusd_pairs_nextkey);
+
 static void xs_init(pTHX)
 {
 	char const *file = __FILE__;
@@ -307,6 +315,17 @@ static void xs_init(pTHX)
 	newXS("DynaLoader::boot_DynaLoader", boot_DynaLoader, file);
 
 	newXS("radiusd::radlog",XS_radiusd_radlog, "rlm_perl");
+
+	/*
+	 *	The class the %RAD_* hashes are tied to.
+	 */
+	newXS("radiusd::Pairs::FETCH", XS_radiusd_pairs_fetch, "rlm_perl");
+	newXS("radiusd::Pairs::STORE", XS_radiusd_pairs_store, "rlm_perl");
+	newXS("radiusd::Pairs::EXISTS", XS_radiusd_pairs_exists, "rlm_perl");
+	newXS("radiusd::Pairs::DELETE", XS_radiusd_pairs_delete, "rlm_perl");
+	newXS("radiusd::Pairs::CLEAR", XS_radiusd_pairs_clear, "rlm_perl");
+	newXS("radiusd::Pairs::FIRSTKEY", XS_radiusd_pairs_firstkey, "rlm_perl");
+	newXS("radiusd::Pairs::NEXTKEY", XS_radiusd_pairs_nextkey, "rlm_perl");
 }
 
 /*
@@ -571,18 +590,55 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 	return 0;
 }
 
-static void perl_vp_to_svpvn_element(REQUEST *request, AV *av, VALUE_PAIR const *vp,
-				     int *i, const char *hash_name, const char *list_name)
+/*
+ *	The %RAD_* hashes are tied to the VALUE_PAIR lists of the
+ *	request.  Attributes are only converted to Perl values when
+ *	the script reads them, and only attributes the script writes
+ *	(or may have written, for arrays) are converted back.
+ */
+typedef struct rlm_perl_vps_t {
+	REQUEST		*request;
+	TALLOC_CTX	*ctx;		//!< To allocate new pairs in.
+	VALUE_PAIR	**vps;		//!< The list the hash is tied to.
+	char const	*hash_name;
+	char const	*list_name;
+
+	SV		*obj;		//!< The object the hash is tied to.
+	HV		*cache;		//!< Attributes which have been read or written.
+	HV		*dirty;		//!< Attributes which have been written or deleted.
+	bool		cleared;	//!< The whole hash was emptied.
+} rlm_perl_vps_t;
+
+/*
+ *	Tagged attributes are in the hash with name <attribute>:<tag>,
+ *	others just use the normal attribute name as the key.
+ */
+static char const *perl_vp_key(VALUE_PAIR const *vp, char *buffer, size_t bufsize)
 {
-	size_t len;
+	if (vp->da->flags.has_tag && (vp->tag != TAG_ANY)) {
+		snprintf(buffer, bufsize, "%s:%d", vp->da->name, vp->tag);
+		return buffer;
+	}
 
+	return vp->da->name;
+}
+
+static SV *perl_vp_to_sv(rlm_perl_vps_t *t, VALUE_PAIR const *vp, int i)
+{
+	REQUEST *request = t->request;
+	SV *sv;
+	char index[16];
 	char buffer[1024];
+	size_t len;
+
+	index[0] = '\0';
+	if (i >= 0) snprintf(index, sizeof(index), "[%i]", i);
 
 	switch (vp->da->type) {
 	case PW_TYPE_STRING:
-		RDEBUG("$%s{'%s'}[%i] = &%s:%s -> '%s'", hash_name, vp->da->name, *i,
-		       list_name, vp->da->name, vp->vp_strvalue);
-		av_push(av, newSVpvn(vp->vp_strvalue, vp->length));
+		RDEBUG("$%s{'%s'}%s = &%s:%s -> '%s'", t->hash_name, vp->da->name, index,
+		       t->list_name, vp->da->name, vp->vp_strvalue);
+		sv = newSVpvn(vp->vp_strvalue, vp->length);
 		break;
 
 	case PW_TYPE_OCTETS:
@@ -590,115 +646,259 @@ static void perl_vp_to_svpvn_element(REQUEST *request, AV *av, VALUE_PAIR const
 			char *hex;
 
 			hex = fr_abin2hex(request, vp->vp_octets, vp->length);
-			RDEBUG("$%s{'%s'}[%i] = &%s:%s -> 0x%s", hash_name, vp->da->name, *i,
-			       list_name, vp->da->name, hex);
+			RDEBUG("$%s{'%s'}%s = &%s:%s -> 0x%s", t->hash_name, vp->da->name, index,
+			       t->list_name, vp->da->name, hex);
 			talloc_free(hex);
 		}
-		av_push(av, newSVpvn((char const *)vp->vp_octets, vp->length));
+		sv = newSVpvn((char const *)vp->vp_octets, vp->length);
 		break;
 
 	default:
 		len = vp_prints_value(buffer, sizeof(buffer), vp, 0);
-		RDEBUG("$%s{'%s'}[%i] = &%s:%s -> '%s'", hash_name, vp->da->name, *i,
-		       list_name, vp->da->name, buffer);
-		av_push(av, newSVpvn(buffer, truncate_len(len, sizeof(buffer))));
+		RDEBUG("$%s{'%s'}%s = &%s:%s -> '%s'", t->hash_name, vp->da->name, index,
+		       t->list_name, vp->da->name, buffer);
+		sv = newSVpvn(buffer, truncate_len(len, sizeof(buffer)));
 		break;
 	}
-	(*i)++;
+
+	return sv;
 }
 
 /*
- *  	get the vps and put them in perl hash
- *  	If one VP have multiple values it is added as array_ref
- *  	Example for this is Cisco-AVPair that holds multiple values.
- *  	Which will be available as array_ref in $RAD_REQUEST{'Cisco-AVPair'}
+ *	Convert all of the attributes matching a key to a Perl value.
+ *	If one key has multiple values it is returned as an array_ref.
+ *	Example for this is Cisco-AVPair that holds multiple values.
+ *	Which will be available as array_ref in $RAD_REQUEST{'Cisco-AVPair'}
  */
-static void perl_store_vps(UNUSED TALLOC_CTX *ctx, REQUEST *request, VALUE_PAIR *vps, HV *rad_hv,
-			   const char *hash_name, const char *list_name)
+static SV *perl_vps_build(rlm_perl_vps_t *t, char const *key)
 {
-	VALUE_PAIR *vp;
+	VALUE_PAIR *vp, *first = NULL;
+	AV *av = NULL;
+	int i = 0;
+	char buffer[256];
 
-	hv_undef(rad_hv);
+	for (vp = *t->vps; vp; vp = vp->next) {
+		if (strcmp(perl_vp_key(vp, buffer, sizeof(buffer)), key) != 0) continue;
 
-	vp_cursor_t cursor;
+		if (!first) {
+			first = vp;
+			continue;
+		}
+
+		if (!av) {
+			av = newAV();
+			av_push(av, perl_vp_to_sv(t, first, i++));
+		}
+		av_push(av, perl_vp_to_sv(t, vp, i++));
+	}
 
-	RINDENT();
-	pairsort(&vps, attrtagcmp);
-	for (vp = fr_cursor_init(&cursor, &vps);
-	     vp;
-	     vp = fr_cursor_next(&cursor)) {
-		VALUE_PAIR *next;
+	if (av) return newRV_noinc((SV *) av);
+	if (first) return perl_vp_to_sv(t, first, -1);
 
-		char const *name;
-		char namebuf[256];
-		char buffer[1024];
+	return NULL;
+}
 
-		size_t len;
+/*
+ *	Remove all of the attributes matching a key.
+ */
+static void perl_vps_remove(rlm_perl_vps_t *t, char const *key)
+{
+	VALUE_PAIR *vp, **last;
+	char buffer[256];
 
-		/*
-		 *	Tagged attributes are added to the hash with name
-		 *	<attribute>:<tag>, others just use the normal attribute
-		 *	name as the key.
-		 */
-		if (vp->da->flags.has_tag && (vp->tag != TAG_ANY)) {
-			snprintf(namebuf, sizeof(namebuf), "%s:%d", vp->da->name, vp->tag);
-			name = namebuf;
-		} else {
-			name = vp->da->name;
+	last = t->vps;
+	while ((vp = *last) != NULL) {
+		if (strcmp(perl_vp_key(vp, buffer, sizeof(buffer)), key) != 0) {
+			last = &vp->next;
+			continue;
 		}
 
-		/*
-		 *	We've sorted by type, then tag, so attributes of the
-		 *	same type/tag should follow on from each other.
-		 */
-		if ((next = fr_cursor_next_peek(&cursor)) && ATTRIBUTE_EQ(vp, next)) {
-			int i = 0;
-			AV *av;
+		*last = vp->next;
+		vp->next = NULL;
+		pairfree(&vp);
+	}
+}
 
-			av = newAV();
-			perl_vp_to_svpvn_element(request, av, vp, &i, hash_name, list_name);
-			do {
-				perl_vp_to_svpvn_element(request, av, next, &i, hash_name, list_name);
-				fr_cursor_next(&cursor);
-			} while ((next = fr_cursor_next_peek(&cursor)) && ATTRIBUTE_EQ(vp, next));
-			(void)hv_store(rad_hv, name, strlen(name), newRV_noinc((SV *)av), 0);
+static rlm_perl_vps_t *perl_vps_self(SV *self)
+{
+	rlm_perl_vps_t *t;
 
-			continue;
-		}
+	if (!SvROK(self)) croak("rlm_perl: Invalid tied hash");
 
-		/*
-		 *	It's a normal single valued attribute
-		 */
-		switch (vp->da->type) {
-		case PW_TYPE_STRING:
-			RDEBUG("$%s{'%s'} = &%s:%s -> '%s'", hash_name, vp->da->name, list_name,
-			       vp->da->name, vp->vp_strvalue);
-			(void)hv_store(rad_hv, name, strlen(name), newSVpvn(vp->vp_strvalue, vp->length), 0);
-			break;
+	t = INT2PTR(rlm_perl_vps_t *, SvIV(SvRV(self)));
+	if (!t) croak("rlm_perl: Tied hash used outside of the call it was created for");
 
-		case PW_TYPE_OCTETS:
-			if (RDEBUG_ENABLED) {
-				char *hex;
+	return t;
+}
 
-				hex = fr_abin2hex(request, vp->vp_octets, vp->length);
-				RDEBUG("$%s{'%s'} = &%s:%s -> 0x%s", hash_name, vp->da->name,
-				       list_name, vp->da->name, hex);
-				talloc_free(hex);
-			}
-			(void)hv_store(rad_hv, name, strlen(name),
-				       newSVpvn((char const *)vp->vp_octets, vp->length), 0);
-			break;
+static XS(XS_radiusd_pairs_fetch)
+{
+	dXSARGS;
+	rlm_perl_vps_t	*t;
+	SV		**svp, *sv;
+	char		*key;
+	STRLEN		len;
 
-		default:
-			len = vp_prints_value(buffer, sizeof(buffer), vp, 0);
-			RDEBUG("$%s{'%s'} = &%s:%s -> '%s'", hash_name, vp->da->name,
-			       list_name, vp->da->name, buffer);
-			(void)hv_store(rad_hv, name, strlen(name),
-				       newSVpvn(buffer, truncate_len(len, sizeof(buffer))), 0);
-			break;
-		}
+	if (items != 2) croak("Usage: FETCH(self, key)");
+
+	t = perl_vps_self(ST(0));
+	key = SvPV(ST(1), len);
+
+	svp = hv_fetch(t->cache, key, len, 0);
+	if (svp) {
+		ST(0) = sv_mortalcopy(*svp);
+		XSRETURN(1);
 	}
-	REXDENT();
+
+	if (t->cleared || hv_exists(t->dirty, key, len)) XSRETURN_UNDEF;
+
+	sv = perl_vps_build(t, key);
+	if (!sv) XSRETURN_UNDEF;
+
+	(void) hv_store(t->cache, key, len, sv, 0);
+
+	ST(0) = sv_mortalcopy(sv);
+	XSRETURN(1);
+}
+
+static XS(XS_radiusd_pairs_store)
+{
+	dXSARGS;
+	rlm_perl_vps_t	*t;
+	char		*key;
+	STRLEN		len;
+
+	if (items != 3) croak("Usage: STORE(self, key, value)");
+
+	t = perl_vps_self(ST(0));
+	key = SvPV(ST(1), len);
+
+	(void) hv_store(t->cache, key, len, newSVsv(ST(2)), 0);
+	(void) hv_store(t->dirty, key, len, newSViv(1), 0);
+
+	XSRETURN_EMPTY;
+}
+
+static XS(XS_radiusd_pairs_exists)
+{
+	dXSARGS;
+	rlm_perl_vps_t	*t;
+	VALUE_PAIR	*vp;
+	char		*key;
+	STRLEN		len;
+	char		buffer[256];
+
+	if (items != 2) croak("Usage: EXISTS(self, key)");
+
+	t = perl_vps_self(ST(0));
+	key = SvPV(ST(1), len);
+
+	if (hv_exists(t->cache, key, len)) XSRETURN_YES;
+	if (t->cleared || hv_exists(t->dirty, key, len)) XSRETURN_NO;
+
+	for (vp = *t->vps; vp; vp = vp->next) {
+		if (strcmp(perl_vp_key(vp, buffer, sizeof(buffer)), key) == 0) XSRETURN_YES;
+	}
+
+	XSRETURN_NO;
+}
+
+static XS(XS_radiusd_pairs_delete)
+{
+	dXSARGS;
+	rlm_perl_vps_t	*t;
+	SV		*sv = NULL;
+	char		*key;
+	STRLEN		len;
+
+	if (items != 2) croak("Usage: DELETE(self, key)");
+
+	t = perl_vps_self(ST(0));
+	key = SvPV(ST(1), len);
+
+	if (hv_exists(t->cache, key, len)) {
+		sv = hv_delete(t->cache, key, len, 0);	/* mortal */
+		if (sv) SvREFCNT_inc(sv);
+
+	} else if (!t->cleared && !hv_exists(t->dirty, key, len)) {
+		sv = perl_vps_build(t, key);
+	}
+
+	(void) hv_store(t->dirty, key, len, newSViv(1), 0);
+
+	if (!sv) XSRETURN_UNDEF;
+
+	ST(0) = sv_2mortal(sv);
+	XSRETURN(1);
+}
+
+static XS(XS_radiusd_pairs_clear)
+{
+	dXSARGS;
+	rlm_perl_vps_t	*t;
+
+	if (items != 1) croak("Usage: CLEAR(self)");
+
+	t = perl_vps_self(ST(0));
+
+	hv_clear(t->cache);
+	hv_clear(t->dirty);
+	t->cleared = true;
+
+	XSRETURN_EMPTY;
+}
+
+static XS(XS_radiusd_pairs_nextkey)
+{
+	dXSARGS;
+	rlm_perl_vps_t	*t;
+	HE		*he;
+
+	if ((items != 1) && (items != 2)) croak("Usage: NEXTKEY(self, lastkey)");
+
+	t = perl_vps_self(ST(0));
+
+	he = hv_iternext(t->cache);
+	if (!he) XSRETURN_UNDEF;
+
+	ST(0) = sv_mortalcopy(hv_iterkeysv(he));
+	XSRETURN(1);
+}
+
+/*
+ *	Walking the hash needs all of the keys, so everything is
+ *	converted.
+ */
+static XS(XS_radiusd_pairs_firstkey)
+{
+	dXSARGS;
+	rlm_perl_vps_t	*t;
+	VALUE_PAIR	*vp;
+	HE		*he;
+	char		buffer[256];
+
+	if (items != 1) croak("Usage: FIRSTKEY(self)");
+
+	t = perl_vps_self(ST(0));
+
+	if (!t->cleared) for (vp = *t->vps; vp; vp = vp->next) {
+		char const *key;
+		SV *sv;
+
+		key = perl_vp_key(vp, buffer, sizeof(buffer));
+		if (hv_exists(t->cache, key, strlen(key)) || hv_exists(t->dirty, key, strlen(key))) continue;
+
+		sv = perl_vps_build(t, key);
+		if (sv) (void) hv_store(t->cache, key, strlen(key), sv, 0);
+	}
+
+	hv_iterinit(t->cache);
+
+	he = hv_iternext(t->cache);
+	if (!he) XSRETURN_UNDEF;
+
+	ST(0) = sv_mortalcopy(hv_iterkeysv(he));
+	XSRETURN(1);
 }
 
 /*
@@ -745,31 +945,101 @@ static int pairadd_sv(TALLOC_CTX *ctx, REQUEST *request, VALUE_PAIR **vps, char
 }
 
 /*
- *     Gets the content from hashes
+ *	Tie a hash to a list of attributes.
  */
-static int get_hv_content(TALLOC_CTX *ctx, REQUEST *request, HV *my_hv, VALUE_PAIR **vps,
-			  const char *hash_name, const char *list_name)
+static rlm_perl_vps_t *perl_tie_vps(TALLOC_CTX *ctx, REQUEST *request, VALUE_PAIR **vps, HV *rad_hv,
+				    char const *hash_name, char const *list_name)
 {
-	SV		*res_sv, **av_sv;
-	AV		*av;
-	char		*key;
-	I32		key_len, len, i, j;
-	int		ret = 0;
-
-	*vps = NULL;
-	for (i = hv_iterinit(my_hv); i > 0; i--) {
-		res_sv = hv_iternextsv(my_hv,&key,&key_len);
-		if (SvROK(res_sv) && (SvTYPE(SvRV(res_sv)) == SVt_PVAV)) {
-			av = (AV*)SvRV(res_sv);
-			len = av_len(av);
-			for (j = 0; j <= len; j++) {
-				av_sv = av_fetch(av, j, 0);
-				ret = pairadd_sv(ctx, request, vps, key, *av_sv, T_OP_ADD, hash_name, list_name) + ret;
+	rlm_perl_vps_t *t;
+
+	sv_unmagic((SV *) rad_hv, PERL_MAGIC_tied);
+	hv_undef(rad_hv);
+
+	t = talloc_zero(request, rlm_perl_vps_t);
+	t->request = request;
+	t->ctx = ctx;
+	t->vps = vps;
+	t->hash_name = hash_name;
+	t->list_name = list_name;
+	t->cache = newHV();
+	t->dirty = newHV();
+
+	t->obj = newSV(0);
+	sv_setref_pv(t->obj, "radiusd::Pairs", t);
+	sv_magic((SV *) rad_hv, t->obj, PERL_MAGIC_tied, NULL, 0);
+
+	return t;
+}
+
+/*
+ *	Write back the attributes the script changed, and untie the
+ *	hash.
+ *
+ *	Array values are always written back, as the script can
+ *	change the array without going through the tied hash.
+ */
+static void perl_untie_vps(rlm_perl_vps_t *t, HV *rad_hv)
+{
+	REQUEST	*request = t->request;
+	HE	*he;
+	char	*key;
+	I32	key_len, len, j;
+
+	if (t->cleared) {
+		pairfree(t->vps);
+
+	} else {
+		hv_iterinit(t->dirty);
+		while ((he = hv_iternext(t->dirty)) != NULL) {
+			key = hv_iterkey(he, &key_len);
+			if (!hv_exists(t->cache, key, key_len)) {
+				RDEBUG("&%s:%s deleted by $%s{'%s'}", t->list_name, key, t->hash_name, key);
+				perl_vps_remove(t, key);
 			}
-		} else ret = pairadd_sv(ctx, request, vps, key, res_sv, T_OP_EQ, hash_name, list_name) + ret;
+		}
 	}
 
-	return ret;
+	hv_iterinit(t->cache);
+	while ((he = hv_iternext(t->cache)) != NULL) {
+		SV	*sv;
+		bool	is_array;
+
+		key = hv_iterkey(he, &key_len);
+		sv = hv_iterval(t->cache, he);
+		is_array = SvROK(sv) && (SvTYPE(SvRV(sv)) == SVt_PVAV);
+
+		if (!t->cleared) {
+			if (!is_array && !hv_exists(t->dirty, key, key_len)) continue;
+
+			perl_vps_remove(t, key);
+		}
+
+		if (!is_array) {
+			(void) pairadd_sv(t->ctx, request, t->vps, key, sv, T_OP_EQ, t->hash_name, t->list_name);
+			continue;
+		}
+
+		len = av_len((AV *) SvRV(sv));
+		for (j = 0; j <= len; j++) {
+			SV **av_sv;
+
+			av_sv = av_fetch((AV *) SvRV(sv), j, 0);
+			if (!av_sv) continue;
+
+			(void) pairadd_sv(t->ctx, request, t->vps, key, *av_sv, T_OP_ADD, t->hash_name, t->list_name);
+		}
+	}
+
+	/*
+	 *	The script may have kept a reference to the object.
+	 */
+	sv_setiv(SvRV(t->obj), 0);
+	sv_unmagic((SV *) rad_hv, PERL_MAGIC_tied);
+	SvREFCNT_dec(t->obj);
+
+	SvREFCNT_dec((SV *) t->cache);
+	SvREFCNT_dec((SV *) t->dirty);
+	talloc_free(t);
 }
 
 /*
@@ -781,16 +1051,17 @@ static int do_perl(void *instance, REQUEST *request, char const *function_name)
 {
 
 	rlm_perl_t	*inst = instance;
-	VALUE_PAIR	*vp;
 	int		exitstatus=0, count;
 	STRLEN		n_a;
 
 	HV		*rad_reply_hv;
 	HV		*rad_config_hv;
 	HV		*rad_request_hv;
+	rlm_perl_vps_t	*request_vps, *reply_vps, *config_vps;
 #ifdef WITH_PROXY
 	HV		*rad_request_proxy_hv;
 	HV		*rad_request_proxy_reply_hv;
+	rlm_perl_vps_t	*proxy_vps = NULL, *proxy_reply_vps = NULL;
 #endif
 
 	/*
@@ -825,25 +1096,30 @@ static int do_perl(void *instance, REQUEST *request, char const *function_name)
 		rad_config_hv = get_hv("RAD_CONFIG", 1);
 		rad_request_hv = get_hv("RAD_REQUEST", 1);
 
-		perl_store_vps(request->packet, request, request->packet->vps, rad_request_hv, "RAD_REQUEST", "request");
-		perl_store_vps(request->reply, request, request->reply->vps, rad_reply_hv, "RAD_REPLY", "reply");
-		perl_store_vps(request, request, request->config_items, rad_config_hv, "RAD_CONFIG", "control");
+		request_vps = perl_tie_vps(request->packet, request, &request->packet->vps, rad_request_hv,
+					   "RAD_REQUEST", "request");
+		reply_vps = perl_tie_vps(request->reply, request, &request->reply->vps, rad_reply_hv,
+					 "RAD_REPLY", "reply");
+		config_vps = perl_tie_vps(request, request, &request->config_items, rad_config_hv,
+					  "RAD_CONFIG", "control");
 
 #ifdef WITH_PROXY
 		rad_request_proxy_hv = get_hv("RAD_REQUEST_PROXY",1);
 		rad_request_proxy_reply_hv = get_hv("RAD_REQUEST_PROXY_REPLY",1);
 
 		if (request->proxy != NULL) {
-			perl_store_vps(request->proxy, request, request->proxy->vps, rad_request_proxy_hv,
-				       "RAD_REQUEST_PROXY", "proxy-request");
+			proxy_vps = perl_tie_vps(request->proxy, request, &request->proxy->vps, rad_request_proxy_hv,
+						 "RAD_REQUEST_PROXY", "proxy-request");
 		} else {
+			sv_unmagic((SV *) rad_request_proxy_hv, PERL_MAGIC_tied);
 			hv_undef(rad_request_proxy_hv);
 		}
 
 		if (request->proxy_reply != NULL) {
-			perl_store_vps(request->proxy_reply, request, request->proxy_reply->vps,
-				       rad_request_proxy_reply_hv, "RAD_REQUEST_PROXY_REPLY", "proxy-reply");
+			proxy_reply_vps = perl_tie_vps(request->proxy_reply, request, &request->proxy_reply->vps,
+						       rad_request_proxy_reply_hv, "RAD_REQUEST_PROXY_REPLY", "proxy-reply");
 		} else {
+			sv_unmagic((SV *) rad_request_proxy_reply_hv, PERL_MAGIC_tied);
 			hv_undef(rad_request_proxy_reply_hv);
 		}
 #endif
@@ -880,49 +1156,22 @@ static int do_perl(void *instance, REQUEST *request, char const *function_name)
 		FREETMPS;
 		LEAVE;
 
-		vp = NULL;
-		if ((get_hv_content(request->packet, request, rad_request_hv, &vp, "RAD_REQUEST", "request")) == 0) {
-			pairfree(&request->packet->vps);
-			request->packet->vps = vp;
-			vp = NULL;
+		perl_untie_vps(request_vps, rad_request_hv);
 
-			/*
-			 *	Update cached copies
-			 */
-			request->username = pairfind(request->packet->vps, PW_USER_NAME, 0, TAG_ANY);
-			request->password = pairfind(request->packet->vps, PW_USER_PASSWORD, 0, TAG_ANY);
-			if (!request->password)
-				request->password = pairfind(request->packet->vps, PW_CHAP_PASSWORD, 0, TAG_ANY);
-		}
-
-		if ((get_hv_content(request->reply, request, rad_reply_hv, &vp, "RAD_REPLY", "reply")) == 0) {
-			pairfree(&request->reply->vps);
-			request->reply->vps = vp;
-			vp = NULL;
-		}
+		/*
+		 *	Update cached copies
+		 */
+		request->username = pairfind(request->packet->vps, PW_USER_NAME, 0, TAG_ANY);
+		request->password = pairfind(request->packet->vps, PW_USER_PASSWORD, 0, TAG_ANY);
+		if (!request->password)
+			request->password = pairfind(request->packet->vps, PW_CHAP_PASSWORD, 0, TAG_ANY);
 
-		if ((get_hv_content(request, request, rad_config_hv, &vp, "RAD_CONFIG", "control")) == 0) {
-			pairfree(&request->config_items);
-			request->config_items = vp;
-			vp = NULL;
-		}
+		perl_untie_vps(reply_vps, rad_reply_hv);
+		perl_untie_vps(config_vps, rad_config_hv);
 
 #ifdef WITH_PROXY
-		if (request->proxy &&
-		    (get_hv_content(request->proxy, request, rad_request_proxy_hv, &vp,
-		    		    "RAD_REQUEST_PROXY", "proxy-request") == 0)) {
-			pairfree(&request->proxy->vps);
-			request->proxy->vps = vp;
-			vp = NULL;
-		}
-
-		if (request->proxy_reply &&
-		    (get_hv_content(request->proxy_reply, request, rad_request_proxy_reply_hv, &vp,
-		    		    "RAD_REQUEST_PROXY_REPLY", "proxy-reply") == 0)) {
-			pairfree(&request->proxy_reply->vps);
-			request->proxy_reply->vps = vp;
-			vp = NULL;
-		}
+		if (proxy_vps) perl_untie_vps(proxy_vps, rad_request_proxy_hv);
+		if (proxy_reply_vps) perl_untie_vps(proxy_reply_vps, rad_request_proxy_reply_hv);
 #endif
 
 	}
@@ -1114,4 +1363,8 @@ module_t rlm_perl = {
 		mod_send_coa
 #endif
 	},
+	0,				/* thread_inst_size */
+	NULL,				/* thread_instantiate */
+	NULL,				/* thread_detach */
+	NULL				/* cache_flush */
 };
@@ -34,6 +34,8 @@ typedef struct rlm_preprocess_t {
 	char const	*hints_file;
 	PAIR_LIST	*huntgroups;
 	PAIR_LIST	*hints;
+	pairlist_index_t *huntgroups_index;
+	pairlist_index_t *hints_index;
 	bool		with_ascend_hack;
 	uint32_t	ascend_channels_per_line;
 	bool		with_ntdomain_hack;
@@ -368,13 +370,14 @@ static int hunt_paircmp(REQUEST *req, VALUE_PAIR *request, VALUE_PAIR *check)
  *	Add hints to the info sent by the terminal server
  *	based on the pattern of the username, and other attributes.
  */
-static int hints_setup(PAIR_LIST *hints, REQUEST *request)
+static int hints_setup(pairlist_index_t *hints, REQUEST *request)
 {
 	char const     	*name;
 	VALUE_PAIR	*add;
 	VALUE_PAIR	*tmp;
 	PAIR_LIST	*i;
 	VALUE_PAIR	*request_pairs;
+	pairlist_cursor_t *cursor;
 	int		updated = 0, ft;
 
 	request_pairs = request->packet->vps;
@@ -394,7 +397,10 @@ static int hints_setup(PAIR_LIST *hints, REQUEST *request)
 		return RLM_MODULE_NOOP;
 	}
 
-	for (i = hints; i; i = i->next) {
+	cursor = pairlist_index_match(request, hints, request_pairs);
+	if (!cursor) return RLM_MODULE_FAIL;
+
+	while ((i = pairlist_cursor_next(cursor)) != NULL) {
 		/*
 		 *	Use "paircompare", which is a little more general...
 		 */
@@ -417,9 +423,18 @@ static int hints_setup(PAIR_LIST *hints, REQUEST *request)
 			if (!ft) {
 				break;
 			}
+
+			/*
+			 *	Later entries may match on the attributes
+			 *	we've just added.
+			 */
+			request_pairs = request->packet->vps;
+			if (pairlist_cursor_rematch(cursor, request_pairs) < 0) break;
 		}
 	}
 
+	talloc_free(cursor);
+
 	if (updated == 0) {
 		return RLM_MODULE_NOOP;
 	}
@@ -430,11 +445,12 @@ static int hints_setup(PAIR_LIST *hints, REQUEST *request)
 /*
  *	See if we have access to the huntgroup.
  */
-static int huntgroup_access(REQUEST *request, PAIR_LIST *huntgroups)
+static int huntgroup_access(REQUEST *request, pairlist_index_t *huntgroups)
 {
 	PAIR_LIST	*i;
 	int		r = RLM_MODULE_OK;
 	VALUE_PAIR	*request_pairs = request->packet->vps;
+	pairlist_cursor_t *cursor;
 
 	/*
 	 *	We're not controlling access by huntgroups:
@@ -444,7 +460,10 @@ static int huntgroup_access(REQUEST *request, PAIR_LIST *huntgroups)
 		return RLM_MODULE_OK;
 	}
 
-	for (i = huntgroups; i; i = i->next) {
+	cursor = pairlist_index_match(request, huntgroups, request_pairs);
+	if (!cursor) return RLM_MODULE_FAIL;
+
+	while ((i = pairlist_cursor_next(cursor)) != NULL) {
 		/*
 		 *	See if this entry matches.
 		 */
@@ -473,6 +492,8 @@ static int huntgroup_access(REQUEST *request, PAIR_LIST *huntgroups)
 		break;
 	}
 
+	talloc_free(cursor);
+
 	return r;
 }
 
@@ -529,6 +550,11 @@ static int mod_instantiate(UNUSED CONF_SECTION *conf, void *instance)
 
 			return -1;
 		}
+
+		if (inst->huntgroups) {
+			inst->huntgroups_index = pairlist_index_alloc(inst, inst->huntgroups);
+			if (!inst->huntgroups_index) return -1;
+		}
 	}
 
 	/*
@@ -541,6 +567,11 @@ static int mod_instantiate(UNUSED CONF_SECTION *conf, void *instance)
 
 			return -1;
 		}
+
+		if (inst->hints) {
+			inst->hints_index = pairlist_index_alloc(inst, inst->hints);
+			if (!inst->hints_index) return -1;
+		}
 	}
 
 	return 0;
@@ -616,7 +647,7 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authorize(void *instance, REQUEST *reque
 		return RLM_MODULE_FAIL;
 	}
 
-	hints_setup(inst->hints, request);
+	hints_setup(inst->hints_index, request);
 
 	/*
 	 *      If there is a PW_CHAP_PASSWORD attribute but there
@@ -629,7 +660,7 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authorize(void *instance, REQUEST *reque
 		pairmemcpy(vp, request->packet->vector, AUTH_VECTOR_LEN);
 	}
 
-	if ((r = huntgroup_access(request, inst->huntgroups)) != RLM_MODULE_OK) {
+	if ((r = huntgroup_access(request, inst->huntgroups_index)) != RLM_MODULE_OK) {
 		char buf[1024];
 		RIDEBUG("No huntgroup access: [%s] (%s)",
 			request->username ? request->username->vp_strvalue : "<NO User-Name>",
@@ -687,7 +718,7 @@ static rlm_rcode_t CC_HINT(nonnull) mod_preaccounting(void *instance, REQUEST *r
 		return RLM_MODULE_FAIL;
 	}
 
-	hints_setup(inst->hints, request);
+	hints_setup(inst->hints_index, request);
 
 	/*
 	 *	Add an event timestamp.  This means that the rest of
@@ -707,7 +738,7 @@ static rlm_rcode_t CC_HINT(nonnull) mod_preaccounting(void *instance, REQUEST *r
 		}
 	}
 
-	if ((r = huntgroup_access(request, inst->huntgroups)) != RLM_MODULE_OK) {
+	if ((r = huntgroup_access(request, inst->huntgroups_index)) != RLM_MODULE_OK) {
 		char buf[1024];
 		RIDEBUG("No huntgroup access: [%s] (%s)",
 			request->username ? request->username->vp_strvalue : "<NO User-Name>",
@@ -737,5 +768,9 @@ module_t rlm_preprocess = {
 		NULL,				/* post-proxy */
 		NULL				/* post-auth */
 	},
+	0,				/* thread_inst_size */
+	NULL,				/* thread_instantiate */
+	NULL,				/* thread_detach */
+	NULL				/* cache_flush */
 };
 
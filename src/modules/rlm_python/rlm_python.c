@@ -31,6 +31,10 @@ RCSID("$Id$")
 
 #include <Python.h>
 #include <dlfcn.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
 
 #ifdef HAVE_PTHREAD_H
 #define Pyx_BLOCK_THREADS    {PyGILState_STATE __gstate = PyGILState_Ensure();
@@ -53,11 +57,63 @@ struct py_function_def {
 	char const	*function_name;
 };
 
+/*
+ *	Helper processes.
+ *
+ *	Python 2 has a single GIL shared by every interpreter in the
+ *	process, so sub-interpreters don't let two threads run Python
+ *	code at the same time.  Instead, when "processes" is set, the
+ *	interpreter runs in a pool of forked helpers, each with its own
+ *	GIL.  A worker thread takes an idle helper, marshals the request
+ *	into a buffer shared with it, and wakes it with a single byte
+ *	on a socketpair.  The helper writes the result back into the
+ *	same buffer, and wakes the worker the same way.
+ *
+ *	The helpers are started as they're needed, rather than when the
+ *	module is instantiated.  That way they're children of the
+ *	server which is running, and not of the process which exits
+ *	when the server daemonizes.
+ *
+ *	request		uint32_t offset of the py_function_def in rlm_python_t
+ *			uint32_t 1 if there is a request, else 0
+ *			uint32_t number of attributes
+ *			"name\0value\0" for each attribute
+ *
+ *	reply		int32_t  rcode
+ *			uint32_t number of attributes
+ *			uint8_t list (0 reply, 1 control), uint8_t operator,
+ *			"name\0value\0" for each attribute
+ */
+#define PYTHON_SHM_SIZE		(65536)
+#define PYTHON_MAX_PROCESSES	(256)
+
+#ifndef MAP_ANONYMOUS
+#  define MAP_ANONYMOUS MAP_ANON
+#endif
+
+typedef struct python_helper {
+	pid_t			pid;		//!< PID of the helper.
+	int			fd;		//!< Our end of the socketpair used to wake the helper.
+	uint8_t			*shm;		//!< Buffer shared with the helper.
+	struct python_helper	*next;		//!< Next idle helper.
+} python_helper_t;
+
 typedef struct rlm_python_t {
 	void		*libpython;
 	PyThreadState	*main_thread_state;
 	char const	*python_path;
 
+	bool		pass_by_reference;	//!< Pass a radiusd.Pairs object instead of a tuple.
+
+	uint32_t	processes;		//!< Number of helper processes, 0 to run in the server.
+	python_helper_t	*helpers;		//!< Array of helpers.
+	uint32_t	started;		//!< Number of helpers which have been started.
+	python_helper_t	*idle;			//!< Helpers not currently handling a request.
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t	mutex;			//!< Protects the idle list.
+	pthread_cond_t	cond;			//!< Signalled when a helper becomes idle.
+#endif
+
 	struct py_function_def
 	instantiate,
 	authorize,
@@ -101,6 +157,8 @@ static CONF_PARSER module_config[] = {
 #undef A
 
 	{ "python_path", FR_CONF_OFFSET(PW_TYPE_STRING, rlm_python_t, python_path), NULL },
+	{ "pass_by_reference", FR_CONF_OFFSET(PW_TYPE_BOOLEAN, rlm_python_t, pass_by_reference), "no" },
+	{ "processes", FR_CONF_OFFSET(PW_TYPE_INTEGER, rlm_python_t, processes), "0" },
 
 	{ NULL, -1, 0, NULL, NULL }		/* end the list */
 };
@@ -146,6 +204,8 @@ fr_thread_local_setup(PyThreadState *, local_thread_state);	/* macro */
 
 static PyObject *radiusd_module = NULL;
 
+static PyTypeObject py_pairs_type;
+
 /*
  *	radiusd Python functions
  */
@@ -239,6 +299,10 @@ static int mod_init(rlm_python_t *inst)
 		}
 	}
 
+	if (PyType_Ready(&py_pairs_type) < 0) goto failed;
+	Py_INCREF(&py_pairs_type);
+	if (PyModule_AddObject(radiusd_module, "Pairs", (PyObject *) &py_pairs_type) < 0) goto failed;
+
 #ifdef HAVE_PTHREAD_H
 	PyThreadState_Swap(NULL);	/* We have to swap out the current thread else we get deadlocks */
 	PyEval_ReleaseLock();		/* Drop lock grabbed by InitThreads */
@@ -388,282 +452,941 @@ failed:
 	return -1;
 }
 
-#ifdef HAVE_PTHREAD_H
-/** Cleanup any thread local storage on pthread_exit()
+/*
+ *	radiusd.Pairs
+ *
+ *	Gives Python the request's attribute lists by reference,
+ *	instead of printing every attribute into a tuple on each call.
+ *	Attributes are only converted when they're looked at, and
+ *	writes go straight into the list, so nothing has to be parsed
+ *	back afterwards.
+ *
+ *	For compatibility with functions written for tuples, the object
+ *	is also a sequence of (name, value) tuples.  Indexing it with a
+ *	string returns the value of the first attribute of that name, as
+ *	an int or a str depending on its type.
  */
-static void do_python_cleanup(void *arg)
+typedef struct py_pairs {
+	PyObject_HEAD
+	REQUEST		*request;	//!< Request the list belongs to, NULL once the call has returned.
+	TALLOC_CTX	*ctx;		//!< Context to allocate new attributes in.
+	VALUE_PAIR	**vps;		//!< The list.
+	PyObject	*reply;		//!< Pairs object for the reply list.
+	PyObject	*config;	//!< Pairs object for the control list.
+
+	int		last_index;	//!< Index of last_vp, so iterating doesn't rescan the list.
+	VALUE_PAIR	*last_vp;	//!< Last attribute returned by index.
+} py_pairs_t;
+
+static PyObject *py_pairs_alloc(REQUEST *request, TALLOC_CTX *ctx, VALUE_PAIR **vps)
 {
-	PyThreadState	*my_thread_state = arg;
+	py_pairs_t *self;
 
-	PyEval_AcquireLock();
-	PyThreadState_Swap(NULL);	/* Not entirely sure this is needed */
-	PyThreadState_Clear(my_thread_state);
-	PyThreadState_Delete(my_thread_state);
-	PyEval_ReleaseLock();
+	self = PyObject_New(py_pairs_t, &py_pairs_type);
+	if (!self) return NULL;
+
+	self->request = request;
+	self->ctx = ctx;
+	self->vps = vps;
+	self->reply = NULL;
+	self->config = NULL;
+	self->last_index = -1;
+	self->last_vp = NULL;
+
+	return (PyObject *) self;
 }
-#endif
 
-static rlm_rcode_t do_python(rlm_python_t *inst, REQUEST *request, PyObject *pFunc, char const *funcname, bool worker)
+/** Create the object passed to a function, for the request list
+ *
+ */
+static PyObject *py_pairs_new(REQUEST *request)
 {
-	vp_cursor_t	cursor;
-	VALUE_PAIR      *vp;
-	PyObject	*pRet = NULL;
-	PyObject	*pArgs = NULL;
-	int		tuplelen;
-	int		ret;
+	py_pairs_t *self;
 
-	PyGILState_STATE gstate;
-	PyThreadState	*prev_thread_state = NULL;	/* -Wuninitialized */
-	memset(&gstate, 0, sizeof(gstate));		/* -Wuninitialized */
+	self = (py_pairs_t *) py_pairs_alloc(request, request->packet, &request->packet->vps);
+	if (!self) return NULL;
 
-	/* Return with "OK, continue" if the function is not defined. */
-	if (!pFunc)
-		return RLM_MODULE_NOOP;
+	self->reply = py_pairs_alloc(request, request->reply, &request->reply->vps);
+	self->config = py_pairs_alloc(request, request, &request->config_items);
+	if (!self->reply || !self->config) {
+		Py_DECREF(self);
+		return NULL;
+	}
 
-#ifdef HAVE_PTHREAD_H
-	gstate = PyGILState_Ensure();
-	if (worker) {
-		PyThreadState *my_thread_state;
-		my_thread_state = fr_thread_local_init(local_thread_state, do_python_cleanup);
-		if (!my_thread_state) {
-			my_thread_state = PyThreadState_New(inst->main_thread_state->interp);
-			RDEBUG3("Initialised new thread state %p", my_thread_state);
-			if (!my_thread_state) {
-				REDEBUG("Failed initialising local PyThreadState on first run");
-				PyGILState_Release(gstate);
-				return RLM_MODULE_FAIL;
-			}
+	return (PyObject *) self;
+}
 
-			ret = fr_thread_local_set(local_thread_state, my_thread_state);
-			if (ret != 0) {
-				REDEBUG("Failed storing PyThreadState in TLS: %s", fr_syserror(ret));
-				PyThreadState_Clear(my_thread_state);
-				PyThreadState_Delete(my_thread_state);
-				PyGILState_Release(gstate);
-				return RLM_MODULE_FAIL;
-			}
-		}
-		RDEBUG3("Using thread state %p", my_thread_state);
-		prev_thread_state = PyThreadState_Swap(my_thread_state);	/* Swap in our local thread state */
-	}
-#endif
+/** Stop a function from touching the request after it's returned
+ *
+ * The function may have kept a reference to the object.
+ */
+static void py_pairs_release(PyObject *obj)
+{
+	py_pairs_t *self = (py_pairs_t *) obj;
 
-	/* Default return value is "OK, continue" */
-	ret = RLM_MODULE_OK;
+	self->request = NULL;
+	self->vps = NULL;
+	self->last_vp = NULL;
+	if (self->reply) py_pairs_release(self->reply);
+	if (self->config) py_pairs_release(self->config);
+}
 
-	/*
-	 *	We will pass a tuple containing (name, value) tuples
-	 *	We can safely use the Python function to build up a
-	 *	tuple, since the tuple is not used elsewhere.
-	 *
-	 *	Determine the size of our tuple by walking through the packet.
-	 *	If request is NULL, pass None.
-	 */
-	tuplelen = 0;
-	if (request != NULL) {
-		for (vp = fr_cursor_init(&cursor, &request->packet->vps);
-		     vp;
-		     vp = fr_cursor_next(&cursor)) {
-			tuplelen++;
-		}
-	}
+static void py_pairs_dealloc(PyObject *obj)
+{
+	py_pairs_t *self = (py_pairs_t *) obj;
 
-	if (tuplelen == 0) {
-		Py_INCREF(Py_None);
-		pArgs = Py_None;
-	} else {
-		int i = 0;
-		if ((pArgs = PyTuple_New(tuplelen)) == NULL) {
-			ret = RLM_MODULE_FAIL;
-			goto finish;
-		}
+	Py_XDECREF(self->reply);
+	Py_XDECREF(self->config);
+	PyObject_Del(obj);
+}
 
-		for (vp = fr_cursor_init(&cursor, &request->packet->vps);
-		     vp;
-		     vp = fr_cursor_next(&cursor), i++) {
-			PyObject *pPair;
+static int py_pairs_valid(py_pairs_t *self)
+{
+	if (self->vps) return 1;
 
-			/* The inside tuple has two only: */
-			if ((pPair = PyTuple_New(2)) == NULL) {
-				ret = RLM_MODULE_FAIL;
-				goto finish;
-			}
+	PyErr_SetString(PyExc_RuntimeError, "radiusd.Pairs used after the function returned");
+	return 0;
+}
 
-			if (mod_populate_vptuple(pPair, vp) == 0) {
-				/* Put the tuple inside the container */
-				PyTuple_SET_ITEM(pArgs, i, pPair);
-			} else {
-				Py_INCREF(Py_None);
-				PyTuple_SET_ITEM(pArgs, i, Py_None);
-				Py_DECREF(pPair);
-			}
-		}
-	}
+/** Resolve "Attribute-Name" or "Attribute-Name:tag"
+ *
+ */
+static DICT_ATTR const *py_pairs_attr(char const *name, int8_t *tag)
+{
+	char const	*p;
+	char		buf[256];
+	DICT_ATTR const	*da;
 
-	/* Call Python function. */
-	pRet = PyObject_CallFunctionObjArgs(pFunc, pArgs, NULL);
+	*tag = TAG_ANY;
 
-	if (!pRet) {
-		ret = RLM_MODULE_FAIL;
-		goto finish;
+	p = strchr(name, ':');
+	if (!p) {
+		da = dict_attrbyname(name);
+	} else {
+		if ((size_t) (p - name) >= sizeof(buf)) goto unknown;
+
+		memcpy(buf, name, p - name);
+		buf[p - name] = '\0';
+		da = dict_attrbyname(buf);
+		if (da && da->flags.has_tag) *tag = atoi(p + 1);
 	}
+	if (da) return da;
 
-	if (!request)
-		goto finish;
+unknown:
+	PyErr_Format(PyExc_KeyError, "Unknown attribute '%s'", name);
+	return NULL;
+}
 
-	/*
-	 *	The function returns either:
-	 *  1. (returnvalue, replyTuple, configTuple), where
-	 *   - returnvalue is one of the constants RLM_*
-	 *   - replyTuple and configTuple are tuples of string
-	 *      tuples of size 2
-	 *
-	 *  2. the function return value alone
-	 *
-	 *  3. None - default return value is set
-	 *
-	 * xxx This code is messy!
-	 */
-	if (PyTuple_CheckExact(pRet)) {
-		PyObject *pTupleInt;
+/** Convert the value of an attribute to the closest Python type
+ *
+ */
+static PyObject *py_pairs_value(VALUE_PAIR const *vp)
+{
+	char buf[1024];
 
-		if (PyTuple_GET_SIZE(pRet) != 3) {
-			ERROR("rlm_python:%s: tuple must be (return, replyTuple, configTuple)", funcname);
-			ret = RLM_MODULE_FAIL;
-			goto finish;
-		}
+	switch (vp->da->type) {
+	case PW_TYPE_STRING:
+		return PyString_FromStringAndSize(vp->vp_strvalue, vp->length);
 
-		pTupleInt = PyTuple_GET_ITEM(pRet, 0);
-		if (!PyInt_CheckExact(pTupleInt)) {
-			ERROR("rlm_python:%s: first tuple element not an integer", funcname);
-			ret = RLM_MODULE_FAIL;
-			goto finish;
-		}
-		/* Now have the return value */
-		ret = PyInt_AsLong(pTupleInt);
-		/* Reply item tuple */
-		mod_vptuple(request->reply, &request->reply->vps,
-			    PyTuple_GET_ITEM(pRet, 1), funcname);
-		/* Config item tuple */
-		mod_vptuple(request, &request->config_items,
-			    PyTuple_GET_ITEM(pRet, 2), funcname);
+	case PW_TYPE_OCTETS:
+		return PyString_FromStringAndSize((char const *) vp->vp_octets, vp->length);
 
-	} else if (PyInt_CheckExact(pRet)) {
-		/* Just an integer */
-		ret = PyInt_AsLong(pRet);
+	case PW_TYPE_INTEGER:
+	case PW_TYPE_DATE:
+		return PyLong_FromUnsignedLong(vp->vp_integer);
 
-	} else if (pRet == Py_None) {
-		/* returned 'None', return value defaults to "OK, continue." */
-		ret = RLM_MODULE_OK;
-	} else {
-		/* Not tuple or None */
-		ERROR("rlm_python:%s: function did not return a tuple or None", funcname);
-		ret = RLM_MODULE_FAIL;
-		goto finish;
+	case PW_TYPE_SHORT:
+		return PyInt_FromLong(vp->vp_short);
+
+	case PW_TYPE_BYTE:
+		return PyInt_FromLong(vp->vp_byte);
+
+	case PW_TYPE_SIGNED:
+		return PyInt_FromLong(vp->vp_signed);
+
+	case PW_TYPE_INTEGER64:
+		return PyLong_FromUnsignedLongLong(vp->vp_integer64);
+
+	default:
+		vp_prints_value(buf, sizeof(buf), vp, '\0');
+		return PyString_FromString(buf);
 	}
+}
 
-finish:
-	Py_XDECREF(pArgs);
-	Py_XDECREF(pRet);
+static Py_ssize_t py_pairs_length(PyObject *obj)
+{
+	py_pairs_t	*self = (py_pairs_t *) obj;
+	vp_cursor_t	cursor;
+	VALUE_PAIR	*vp;
+	Py_ssize_t	len = 0;
 
-#ifdef HAVE_PTHREAD_H
-	if (worker) {
-		PyThreadState_Swap(prev_thread_state);
+	if (!py_pairs_valid(self)) return -1;
+
+	for (vp = fr_cursor_init(&cursor, self->vps);
+	     vp;
+	     vp = fr_cursor_next(&cursor)) {
+		len++;
 	}
-	PyGILState_Release(gstate);
-#endif
 
-	return ret;
+	return len;
 }
 
-/*
- *	Import a user module and load a function from it
+/** Return the (name, value) tuple at an index, as the tuple interface did
+ *
  */
-
-static int mod_load_function(struct py_function_def *def)
+static PyObject *py_pairs_item(PyObject *obj, Py_ssize_t i)
 {
-	char const *funcname = "mod_load_function";
-	PyGILState_STATE gstate;
+	py_pairs_t	*self = (py_pairs_t *) obj;
+	VALUE_PAIR	*vp;
+	Py_ssize_t	j;
+	PyObject	*pPair;
 
-	gstate = PyGILState_Ensure();
+	if (!py_pairs_valid(self)) return NULL;
 
-	if (def->module_name != NULL && def->function_name != NULL) {
-		if ((def->module = PyImport_ImportModule(def->module_name)) == NULL) {
-			ERROR("rlm_python:%s: module '%s' is not found", funcname, def->module_name);
-			goto failed;
-		}
+	if (self->last_vp && (i == (self->last_index + 1))) {
+		vp = self->last_vp->next;
+		j = i;
+	} else {
+		for (vp = *self->vps, j = 0; vp && (j < i); vp = vp->next, j++);
+	}
 
-		if ((def->function = PyObject_GetAttrString(def->module, def->function_name)) == NULL) {
-			ERROR("rlm_python:%s: function '%s.%s' is not found", funcname, def->module_name, def->function_name);
-			goto failed;
-		}
+	if (!vp || (i < 0)) {
+		PyErr_SetString(PyExc_IndexError, "radiusd.Pairs index out of range");
+		return NULL;
+	}
+	self->last_index = j;
+	self->last_vp = vp;
 
-		if (!PyCallable_Check(def->function)) {
-			ERROR("rlm_python:%s: function '%s.%s' is not callable", funcname, def->module_name, def->function_name);
-			goto failed;
-		}
+	if ((pPair = PyTuple_New(2)) == NULL) return NULL;
+	if (mod_populate_vptuple(pPair, vp) < 0) {
+		Py_DECREF(pPair);
+		return NULL;
 	}
-	PyGILState_Release(gstate);
-	return 0;
 
-failed:
-	mod_error();
-	ERROR("rlm_python:%s: failed to import python function '%s.%s'", funcname, def->module_name, def->function_name);
-	Py_XDECREF(def->function);
-	def->function = NULL;
-	Py_XDECREF(def->module);
-	def->module = NULL;
-	PyGILState_Release(gstate);
-	return -1;
+	return pPair;
 }
 
-
-static void mod_objclear(PyObject **ob)
+static int py_pairs_contains(PyObject *obj, PyObject *key)
 {
-	if (*ob != NULL) {
-		Pyx_BLOCK_THREADS
-		Py_DECREF(*ob);
-		Pyx_UNBLOCK_THREADS
-		*ob = NULL;
+	py_pairs_t	*self = (py_pairs_t *) obj;
+	DICT_ATTR const	*da;
+	int8_t		tag;
+	char const	*name;
+
+	if (!py_pairs_valid(self)) return -1;
+
+	if ((name = PyString_AsString(key)) == NULL) return -1;
+	if ((da = py_pairs_attr(name, &tag)) == NULL) {
+		PyErr_Clear();
+		return 0;
 	}
-}
 
-static void mod_funcdef_clear(struct py_function_def *def)
-{
-	mod_objclear(&def->function);
-	mod_objclear(&def->module);
+	return pairfind_da(*self->vps, da, tag) != NULL;
 }
 
-static void mod_instance_clear(rlm_python_t *inst)
+static PyObject *py_pairs_subscript(PyObject *obj, PyObject *key)
 {
-#define A(x) mod_funcdef_clear(&inst->x)
+	py_pairs_t	*self = (py_pairs_t *) obj;
+	DICT_ATTR const	*da;
+	VALUE_PAIR	*vp;
+	int8_t		tag;
+	char const	*name;
 
-	A(instantiate);
-	A(authorize);
-	A(authenticate);
-	A(preacct);
-	A(accounting);
-	A(checksimul);
-	A(detach);
+	if (PyIndex_Check(key)) {
+		Py_ssize_t i;
 
-#undef A
-}
+		i = PyNumber_AsSsize_t(key, PyExc_IndexError);
+		if ((i == -1) && PyErr_Occurred()) return NULL;
 
-/*
- *	Do any per-module initialization that is separate to each
- *	configured instance of the module.  e.g. set up connections
- *	to external databases, read configuration files, set up
- *	dictionary entries, etc.
+		return py_pairs_item(obj, i);
+	}
+
+	if (!py_pairs_valid(self)) return NULL;
+
+	if ((name = PyString_AsString(key)) == NULL) return NULL;
+	if ((da = py_pairs_attr(name, &tag)) == NULL) return NULL;
+
+	vp = pairfind_da(*self->vps, da, tag);
+	if (!vp) {
+		PyErr_SetObject(PyExc_KeyError, key);
+		return NULL;
+	}
+
+	return py_pairs_value(vp);
+}
+
+/** Replace every attribute of a name with one of the given value, or delete them
  *
- *	If configuration information is given in the config section
- *	that must be referenced in later calls, store a handle to it
- *	in *instance otherwise put a null pointer there.
+ */
+static int py_pairs_ass_subscript(PyObject *obj, PyObject *key, PyObject *value)
+{
+	py_pairs_t	*self = (py_pairs_t *) obj;
+	DICT_ATTR const	*da;
+	VALUE_PAIR	*vp;
+	int8_t		tag;
+	char const	*name;
+	PyObject	*pStr;
+	int		ret = 0;
+
+	if (!py_pairs_valid(self)) return -1;
+
+	if ((name = PyString_AsString(key)) == NULL) return -1;
+	if ((da = py_pairs_attr(name, &tag)) == NULL) return -1;
+
+	self->last_vp = NULL;
+
+	pairdelete(self->vps, da->attr, da->vendor, tag);
+	if (!value) return 0;
+
+	if ((pStr = PyObject_Str(value)) == NULL) return -1;
+
+	vp = pairmake(self->ctx, self->vps, name, PyString_AsString(pStr), T_OP_EQ);
+	if (!vp) {
+		PyErr_Format(PyExc_ValueError, "%s", fr_strerror());
+		ret = -1;
+	}
+	Py_DECREF(pStr);
+
+	return ret;
+}
+
+static PyObject *py_pairs_keys(PyObject *obj, UNUSED PyObject *args)
+{
+	py_pairs_t	*self = (py_pairs_t *) obj;
+	vp_cursor_t	cursor;
+	VALUE_PAIR	*vp;
+	PyObject	*pList, *pStr;
+
+	if (!py_pairs_valid(self)) return NULL;
+
+	if ((pList = PyList_New(0)) == NULL) return NULL;
+
+	for (vp = fr_cursor_init(&cursor, self->vps);
+	     vp;
+	     vp = fr_cursor_next(&cursor)) {
+		if (vp->da->flags.has_tag) {
+			pStr = PyString_FromFormat("%s:%d", vp->da->name, vp->tag);
+		} else {
+			pStr = PyString_FromString(vp->da->name);
+		}
+		if (!pStr || (PyList_Append(pList, pStr) < 0)) {
+			Py_XDECREF(pStr);
+			Py_DECREF(pList);
+			return NULL;
+		}
+		Py_DECREF(pStr);
+	}
+
+	return pList;
+}
+
+static PyObject *py_pairs_get(PyObject *obj, PyObject *args)
+{
+	PyObject	*key, *def = Py_None, *pValue;
+
+	if (!PyArg_ParseTuple(args, "O|O", &key, &def)) return NULL;
+
+	pValue = py_pairs_subscript(obj, key);
+	if (!pValue && PyErr_ExceptionMatches(PyExc_KeyError)) {
+		PyErr_Clear();
+		Py_INCREF(def);
+		return def;
+	}
+
+	return pValue;
+}
+
+static PyObject *py_pairs_getattr_list(PyObject *list)
+{
+	if (!list) {
+		PyErr_SetString(PyExc_AttributeError, "Only the request list has reply and config");
+		return NULL;
+	}
+
+	Py_INCREF(list);
+	return list;
+}
+
+static PyObject *py_pairs_get_reply(PyObject *obj, UNUSED void *closure)
+{
+	return py_pairs_getattr_list(((py_pairs_t *) obj)->reply);
+}
+
+static PyObject *py_pairs_get_config(PyObject *obj, UNUSED void *closure)
+{
+	return py_pairs_getattr_list(((py_pairs_t *) obj)->config);
+}
+
+static PySequenceMethods py_pairs_as_sequence = {
+	.sq_length	= py_pairs_length,
+	.sq_item	= py_pairs_item,
+	.sq_contains	= py_pairs_contains,
+};
+
+static PyMappingMethods py_pairs_as_mapping = {
+	.mp_length		= py_pairs_length,
+	.mp_subscript		= py_pairs_subscript,
+	.mp_ass_subscript	= py_pairs_ass_subscript,
+};
+
+static PyMethodDef py_pairs_methods[] = {
+	{ "keys", &py_pairs_keys, METH_NOARGS,
+	  "Names of the attributes in the list, in order\n"
+	},
+	{ "get", &py_pairs_get, METH_VARARGS,
+	  "get(name[, default])\n\n" \
+	  "Value of the first attribute of that name, or default\n"
+	},
+	{ NULL, NULL, 0, NULL },
+};
+
+static PyGetSetDef py_pairs_getset[] = {
+	{ "reply", py_pairs_get_reply, NULL, "The reply list", NULL },
+	{ "config", py_pairs_get_config, NULL, "The control list", NULL },
+	{ NULL, NULL, NULL, NULL, NULL },
+};
+
+static PyTypeObject py_pairs_type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name	= "radiusd.Pairs",
+	.tp_basicsize	= sizeof(py_pairs_t),
+	.tp_dealloc	= py_pairs_dealloc,
+	.tp_as_sequence	= &py_pairs_as_sequence,
+	.tp_as_mapping	= &py_pairs_as_mapping,
+	.tp_flags	= Py_TPFLAGS_DEFAULT,
+	.tp_doc		= "Attributes of the request being processed",
+	.tp_methods	= py_pairs_methods,
+	.tp_getset	= py_pairs_getset,
+};
+
+#ifdef HAVE_PTHREAD_H
+/** Cleanup any thread local storage on pthread_exit()
+ */
+static void do_python_cleanup(void *arg)
+{
+	PyThreadState	*my_thread_state = arg;
+
+	PyEval_AcquireLock();
+	PyThreadState_Swap(NULL);	/* Not entirely sure this is needed */
+	PyThreadState_Clear(my_thread_state);
+	PyThreadState_Delete(my_thread_state);
+	PyEval_ReleaseLock();
+}
+#endif
+
+/** Call a Python function, and decode what it returned
+ *
+ * Must be called with the GIL held.  If there's no request to add the
+ * results to, reply and config are NULL, and the return value of the
+ * function is ignored.
+ */
+static rlm_rcode_t mod_call(PyObject *pFunc, PyObject *pArgs, char const *funcname,
+			    TALLOC_CTX *reply_ctx, VALUE_PAIR **reply,
+			    TALLOC_CTX *config_ctx, VALUE_PAIR **config)
+{
+	PyObject	*pRet;
+	int		ret;
+
+	/* Call Python function. */
+	pRet = PyObject_CallFunctionObjArgs(pFunc, pArgs, NULL);
+	if (!pRet) return RLM_MODULE_FAIL;
+
+	/* Default return value is "OK, continue" */
+	ret = RLM_MODULE_OK;
+
+	if (!reply) goto finish;
+
+	/*
+	 *	The function returns either:
+	 *  1. (returnvalue, replyTuple, configTuple), where
+	 *   - returnvalue is one of the constants RLM_*
+	 *   - replyTuple and configTuple are tuples of string
+	 *      tuples of size 2
+	 *
+	 *  2. the function return value alone
+	 *
+	 *  3. None - default return value is set
+	 *
+	 * xxx This code is messy!
+	 */
+	if (PyTuple_CheckExact(pRet)) {
+		PyObject *pTupleInt;
+
+		if (PyTuple_GET_SIZE(pRet) != 3) {
+			ERROR("rlm_python:%s: tuple must be (return, replyTuple, configTuple)", funcname);
+			ret = RLM_MODULE_FAIL;
+			goto finish;
+		}
+
+		pTupleInt = PyTuple_GET_ITEM(pRet, 0);
+		if (!PyInt_CheckExact(pTupleInt)) {
+			ERROR("rlm_python:%s: first tuple element not an integer", funcname);
+			ret = RLM_MODULE_FAIL;
+			goto finish;
+		}
+		/* Now have the return value */
+		ret = PyInt_AsLong(pTupleInt);
+		/* Reply item tuple */
+		mod_vptuple(reply_ctx, reply, PyTuple_GET_ITEM(pRet, 1), funcname);
+		/* Config item tuple */
+		mod_vptuple(config_ctx, config, PyTuple_GET_ITEM(pRet, 2), funcname);
+
+	} else if (PyInt_CheckExact(pRet)) {
+		/* Just an integer */
+		ret = PyInt_AsLong(pRet);
+
+	} else if (pRet == Py_None) {
+		/* returned 'None', return value defaults to "OK, continue." */
+		ret = RLM_MODULE_OK;
+	} else {
+		/* Not tuple or None */
+		ERROR("rlm_python:%s: function did not return a tuple or None", funcname);
+		ret = RLM_MODULE_FAIL;
+	}
+
+finish:
+	Py_DECREF(pRet);
+
+	return ret;
+}
+
+/** Print the name of an attribute the way it's passed to Python
+ *
+ */
+static void mod_vp_name(char *out, size_t outlen, VALUE_PAIR const *vp)
+{
+	if (vp->da->flags.has_tag) {
+		snprintf(out, outlen, "%s:%d", vp->da->name, vp->tag);
+	} else {
+		snprintf(out, outlen, "%s", vp->da->name);
+	}
+}
+
+/** Copy a string, including its terminating NUL, into a helper's buffer
  *
  */
-static int mod_instantiate(UNUSED CONF_SECTION *conf, void *instance)
+static int mod_shm_put(uint8_t **p, uint8_t const *end, char const *str)
+{
+	size_t len = strlen(str) + 1;
+
+	if ((size_t) (end - *p) < len) return -1;
+
+	memcpy(*p, str, len);
+	*p += len;
+
+	return 0;
+}
+
+/** Get a NUL terminated string out of a helper's buffer
+ *
+ */
+static char const *mod_shm_get(uint8_t **p, uint8_t const *end)
+{
+	char const	*str = (char const *) *p;
+	uint8_t		*q;
+
+	if (*p >= end) return NULL;
+
+	q = memchr(*p, '\0', end - *p);
+	if (!q) return NULL;
+
+	*p = q + 1;
+
+	return str;
+}
+
+/** Tell the other end of a helper's socketpair that the buffer is ready
+ *
+ */
+static int mod_helper_signal(int fd)
+{
+	uint8_t c = 0;
+	ssize_t slen;
+
+	do {
+		slen = write(fd, &c, 1);
+	} while ((slen < 0) && (errno == EINTR));
+
+	return (slen == 1) ? 0 : -1;
+}
+
+/** Wait for the other end of a helper's socketpair to hand us the buffer
+ *
+ * @return 0 on success, -1 if the other end has gone away.
+ */
+static int mod_helper_wait(int fd)
+{
+	uint8_t c;
+	ssize_t slen;
+
+	do {
+		slen = read(fd, &c, 1);
+	} while ((slen < 0) && (errno == EINTR));
+
+	return (slen == 1) ? 0 : -1;
+}
+
+/** Run a function in a specific helper process
+ *
+ */
+static rlm_rcode_t mod_helper_run(rlm_python_t *inst, python_helper_t *helper, REQUEST *request,
+				  struct py_function_def *def, char const *funcname)
+{
+	uint8_t		*p, *end;
+	uint32_t	u32, count, i;
+	int32_t		rcode;
+	vp_cursor_t	cursor;
+	VALUE_PAIR	*vp;
+	char		name[256];
+	char		buf[1024];
+
+	p = helper->shm;
+	end = p + PYTHON_SHM_SIZE;
+
+	u32 = (uint8_t *) def - (uint8_t *) inst;
+	memcpy(p, &u32, sizeof(u32));
+	p += sizeof(u32);
+
+	u32 = (request != NULL);
+	memcpy(p, &u32, sizeof(u32));
+	p += sizeof(u32);
+
+	p += sizeof(count);	/* Filled in below */
+
+	count = 0;
+	if (request) {
+		for (vp = fr_cursor_init(&cursor, &request->packet->vps);
+		     vp;
+		     vp = fr_cursor_next(&cursor)) {
+			mod_vp_name(name, sizeof(name), vp);
+			vp_prints_value(buf, sizeof(buf), vp, '"');
+
+			if ((mod_shm_put(&p, end, name) < 0) || (mod_shm_put(&p, end, buf) < 0)) {
+				REDEBUG("Too many attributes to pass to %s", funcname);
+				return RLM_MODULE_FAIL;
+			}
+			count++;
+		}
+	}
+	memcpy(helper->shm + (2 * sizeof(uint32_t)), &count, sizeof(count));
+
+	if (mod_helper_signal(helper->fd) < 0) goto dead;
+
+	/*
+	 *	Let other requests use this thread while the helper
+	 *	runs.  We always read the reply, even if the request
+	 *	has been told to stop, as the helper will write it
+	 *	regardless.
+	 */
+	if (request) (void) module_yield(request, helper->fd, NULL);
+
+	if (mod_helper_wait(helper->fd) < 0) goto dead;
+
+	p = helper->shm;
+	memcpy(&rcode, p, sizeof(rcode));
+	p += sizeof(rcode);
+	memcpy(&count, p, sizeof(count));
+	p += sizeof(count);
+
+	for (i = 0; i < count; i++) {
+		uint8_t		list, op;
+		char const	*attr, *value;
+
+		if ((end - p) < 2) break;
+		list = *p++;
+		op = *p++;
+
+		attr = mod_shm_get(&p, end);
+		value = mod_shm_get(&p, end);
+		if (!attr || !value) break;
+
+		if (!request) continue;
+
+		if (list == 0) {
+			vp = pairmake(request->reply, &request->reply->vps, attr, value, op);
+		} else {
+			vp = pairmake(request, &request->config_items, attr, value, op);
+		}
+		if (vp != NULL) {
+			DEBUG("rlm_python:%s: '%s' = '%s'", funcname, attr, value);
+		} else {
+			DEBUG("rlm_python:%s: Failed: '%s' = '%s'", funcname, attr, value);
+		}
+	}
+
+	return rcode;
+
+dead:
+	ERROR("rlm_python:%s: helper PID %u has exited", funcname, (unsigned int) helper->pid);
+	return RLM_MODULE_FAIL;
+}
+
+static int mod_helper_start(rlm_python_t *inst, python_helper_t *helper);
+
+/** Run a function in the first idle helper process, starting another if they're all busy
+ *
+ */
+static rlm_rcode_t do_python_helper(rlm_python_t *inst, REQUEST *request,
+				    struct py_function_def *def, char const *funcname)
+{
+	python_helper_t	*helper;
+	rlm_rcode_t	rcode;
+
+	/* Return with "OK, continue" if the function is not defined. */
+	if (!def->module_name || !def->function_name) return RLM_MODULE_NOOP;
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&inst->mutex);
+#endif
+	while (!inst->idle) {
+		if (inst->started < inst->processes) {
+			helper = &inst->helpers[inst->started];
+			if (mod_helper_start(inst, helper) < 0) {
+#ifdef HAVE_PTHREAD_H
+				pthread_mutex_unlock(&inst->mutex);
+#endif
+				return RLM_MODULE_FAIL;
+			}
+			inst->started++;
+
+			helper->next = inst->idle;
+			inst->idle = helper;
+			break;
+		}
+#ifdef HAVE_PTHREAD_H
+		pthread_cond_wait(&inst->cond, &inst->mutex);
+#endif
+	}
+	helper = inst->idle;
+	inst->idle = helper->next;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_unlock(&inst->mutex);
+#endif
+
+	rcode = mod_helper_run(inst, helper, request, def, funcname);
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&inst->mutex);
+#endif
+	helper->next = inst->idle;
+	inst->idle = helper;
+#ifdef HAVE_PTHREAD_H
+	pthread_cond_signal(&inst->cond);
+	pthread_mutex_unlock(&inst->mutex);
+#endif
+
+	return rcode;
+}
+
+static rlm_rcode_t do_python(rlm_python_t *inst, REQUEST *request, struct py_function_def *def, char const *funcname, bool worker)
+{
+	vp_cursor_t	cursor;
+	VALUE_PAIR      *vp;
+	PyObject	*pArgs = NULL;
+	int		tuplelen;
+	int		ret;
+
+	PyGILState_STATE gstate;
+	PyThreadState	*prev_thread_state = NULL;	/* -Wuninitialized */
+	memset(&gstate, 0, sizeof(gstate));		/* -Wuninitialized */
+
+	if (inst->processes) return do_python_helper(inst, request, def, funcname);
+
+	/* Return with "OK, continue" if the function is not defined. */
+	if (!def->function)
+		return RLM_MODULE_NOOP;
+
+#ifdef HAVE_PTHREAD_H
+	gstate = PyGILState_Ensure();
+	if (worker) {
+		PyThreadState *my_thread_state;
+		my_thread_state = fr_thread_local_init(local_thread_state, do_python_cleanup);
+		if (!my_thread_state) {
+			my_thread_state = PyThreadState_New(inst->main_thread_state->interp);
+			RDEBUG3("Initialised new thread state %p", my_thread_state);
+			if (!my_thread_state) {
+				REDEBUG("Failed initialising local PyThreadState on first run");
+				PyGILState_Release(gstate);
+				return RLM_MODULE_FAIL;
+			}
+
+			ret = fr_thread_local_set(local_thread_state, my_thread_state);
+			if (ret != 0) {
+				REDEBUG("Failed storing PyThreadState in TLS: %s", fr_syserror(ret));
+				PyThreadState_Clear(my_thread_state);
+				PyThreadState_Delete(my_thread_state);
+				PyGILState_Release(gstate);
+				return RLM_MODULE_FAIL;
+			}
+		}
+		RDEBUG3("Using thread state %p", my_thread_state);
+		prev_thread_state = PyThreadState_Swap(my_thread_state);	/* Swap in our local thread state */
+	}
+#endif
+
+	/* Default return value is "OK, continue" */
+	ret = RLM_MODULE_OK;
+
+	/*
+	 *	We will pass a tuple containing (name, value) tuples
+	 *	We can safely use the Python function to build up a
+	 *	tuple, since the tuple is not used elsewhere.
+	 *
+	 *	Determine the size of our tuple by walking through the packet.
+	 *	If request is NULL, pass None.  With pass_by_reference,
+	 *	pass a radiusd.Pairs object wrapping the request instead.
+	 */
+	tuplelen = 0;
+	if (inst->pass_by_reference && request) {
+		tuplelen = -1;
+		if ((pArgs = py_pairs_new(request)) == NULL) {
+			ret = RLM_MODULE_FAIL;
+			goto finish;
+		}
+	}
+
+	if ((request != NULL) && (tuplelen == 0)) {
+		for (vp = fr_cursor_init(&cursor, &request->packet->vps);
+		     vp;
+		     vp = fr_cursor_next(&cursor)) {
+			tuplelen++;
+		}
+	}
+
+	if (tuplelen < 0) {
+		/* Already have a radiusd.Pairs object */
+	} else if (tuplelen == 0) {
+		Py_INCREF(Py_None);
+		pArgs = Py_None;
+	} else {
+		int i = 0;
+		if ((pArgs = PyTuple_New(tuplelen)) == NULL) {
+			ret = RLM_MODULE_FAIL;
+			goto finish;
+		}
+
+		for (vp = fr_cursor_init(&cursor, &request->packet->vps);
+		     vp;
+		     vp = fr_cursor_next(&cursor), i++) {
+			PyObject *pPair;
+
+			/* The inside tuple has two only: */
+			if ((pPair = PyTuple_New(2)) == NULL) {
+				ret = RLM_MODULE_FAIL;
+				goto finish;
+			}
+
+			if (mod_populate_vptuple(pPair, vp) == 0) {
+				/* Put the tuple inside the container */
+				PyTuple_SET_ITEM(pArgs, i, pPair);
+			} else {
+				Py_INCREF(Py_None);
+				PyTuple_SET_ITEM(pArgs, i, Py_None);
+				Py_DECREF(pPair);
+			}
+		}
+	}
+
+	if (request) {
+		ret = mod_call(def->function, pArgs, funcname,
+			       request->reply, &request->reply->vps,
+			       request, &request->config_items);
+	} else {
+		ret = mod_call(def->function, pArgs, funcname, NULL, NULL, NULL, NULL);
+	}
+
+finish:
+	if (pArgs && (tuplelen < 0)) py_pairs_release(pArgs);
+	Py_XDECREF(pArgs);
+
+#ifdef HAVE_PTHREAD_H
+	if (worker) {
+		PyThreadState_Swap(prev_thread_state);
+	}
+	PyGILState_Release(gstate);
+#endif
+
+	return ret;
+}
+
+/*
+ *	Import a user module and load a function from it
+ */
+
+static int mod_load_function(struct py_function_def *def)
 {
-	rlm_python_t *inst = instance;
+	char const *funcname = "mod_load_function";
+	PyGILState_STATE gstate;
+
+	gstate = PyGILState_Ensure();
+
+	if (def->module_name != NULL && def->function_name != NULL) {
+		if ((def->module = PyImport_ImportModule(def->module_name)) == NULL) {
+			ERROR("rlm_python:%s: module '%s' is not found", funcname, def->module_name);
+			goto failed;
+		}
+
+		if ((def->function = PyObject_GetAttrString(def->module, def->function_name)) == NULL) {
+			ERROR("rlm_python:%s: function '%s.%s' is not found", funcname, def->module_name, def->function_name);
+			goto failed;
+		}
+
+		if (!PyCallable_Check(def->function)) {
+			ERROR("rlm_python:%s: function '%s.%s' is not callable", funcname, def->module_name, def->function_name);
+			goto failed;
+		}
+	}
+	PyGILState_Release(gstate);
+	return 0;
+
+failed:
+	mod_error();
+	ERROR("rlm_python:%s: failed to import python function '%s.%s'", funcname, def->module_name, def->function_name);
+	Py_XDECREF(def->function);
+	def->function = NULL;
+	Py_XDECREF(def->module);
+	def->module = NULL;
+	PyGILState_Release(gstate);
+	return -1;
+}
+
+
+static void mod_objclear(PyObject **ob)
+{
+	if (*ob != NULL) {
+		Pyx_BLOCK_THREADS
+		Py_DECREF(*ob);
+		Pyx_UNBLOCK_THREADS
+		*ob = NULL;
+	}
+}
+
+static void mod_funcdef_clear(struct py_function_def *def)
+{
+	mod_objclear(&def->function);
+	mod_objclear(&def->module);
+}
+
+static void mod_instance_clear(rlm_python_t *inst)
+{
+#define A(x) mod_funcdef_clear(&inst->x)
+
+	A(instantiate);
+	A(authorize);
+	A(authenticate);
+	A(preacct);
+	A(accounting);
+	A(checksimul);
+	A(detach);
+
+#undef A
+}
 
+/** Load the Python functions, and call the instantiate function
+ *
+ */
+static int mod_instantiate_python(rlm_python_t *inst)
+{
 	if (mod_init(inst) != 0) {
 		return -1;
 	}
@@ -691,7 +1414,7 @@ static int mod_instantiate(UNUSED CONF_SECTION *conf, void *instance)
 	 *	Call the instantiate function.  No request.  Use the
 	 *	return value.
 	 */
-	return do_python(inst, NULL, inst->instantiate.function, "instantiate", false);
+	return do_python(inst, NULL, &inst->instantiate, "instantiate", false);
 failed:
 	Pyx_BLOCK_THREADS
 	mod_error();
@@ -700,15 +1423,311 @@ failed:
 	return -1;
 }
 
+/** Run one request marshaled by mod_helper_run(), in a helper process
+ *
+ */
+static void mod_helper_call(rlm_python_t *inst, uint8_t *shm)
+{
+	uint8_t			*p = shm, *end = shm + PYTHON_SHM_SIZE;
+	uint32_t		offset, has_request, count, i;
+	int32_t			rcode = RLM_MODULE_FAIL;
+	int			list;
+	struct py_function_def	*def;
+	char const		*funcname = "helper";
+	PyObject		*pArgs = NULL;
+	PyGILState_STATE	gstate;
+	TALLOC_CTX		*ctx;
+	VALUE_PAIR		*reply = NULL, *config = NULL, *vp;
+	vp_cursor_t		cursor;
+	char			name[256];
+	char			buf[1024];
+
+	memcpy(&offset, p, sizeof(offset));
+	p += sizeof(offset);
+	memcpy(&has_request, p, sizeof(has_request));
+	p += sizeof(has_request);
+	memcpy(&count, p, sizeof(count));
+	p += sizeof(count);
+
+	ctx = talloc_new(NULL);
+
+	if (offset > (sizeof(*inst) - sizeof(*def))) goto done;
+	def = (struct py_function_def *) (((uint8_t *) inst) + offset);
+	if (def->function_name) funcname = def->function_name;
+
+	if (!def->function) {
+		rcode = RLM_MODULE_NOOP;
+		goto done;
+	}
+
+	gstate = PyGILState_Ensure();
+
+	if (count == 0) {
+		Py_INCREF(Py_None);
+		pArgs = Py_None;
+	} else {
+		if ((pArgs = PyTuple_New(count)) == NULL) goto release;
+
+		for (i = 0; i < count; i++) {
+			char const	*attr, *value;
+			PyObject	*pPair;
+
+			attr = mod_shm_get(&p, end);
+			value = mod_shm_get(&p, end);
+			if (!attr || !value) goto release;
+
+			if ((pPair = Py_BuildValue("(ss)", attr, value)) == NULL) goto release;
+			PyTuple_SET_ITEM(pArgs, i, pPair);
+		}
+	}
+
+	if (has_request) {
+		rcode = mod_call(def->function, pArgs, funcname, ctx, &reply, ctx, &config);
+	} else {
+		rcode = mod_call(def->function, pArgs, funcname, NULL, NULL, NULL, NULL);
+	}
+
+release:
+	Py_XDECREF(pArgs);
+	PyGILState_Release(gstate);
+
+done:
+	p = shm + sizeof(rcode) + sizeof(count);
+	count = 0;
+
+	for (list = 0; list < 2; list++) {
+		for (vp = fr_cursor_init(&cursor, (list ? &config : &reply));
+		     vp;
+		     vp = fr_cursor_next(&cursor)) {
+			if ((end - p) < 2) goto overflow;
+			*p++ = list;
+			*p++ = vp->op;
+
+			mod_vp_name(name, sizeof(name), vp);
+			vp_prints_value(buf, sizeof(buf), vp, '\0');
+
+			if ((mod_shm_put(&p, end, name) < 0) || (mod_shm_put(&p, end, buf) < 0)) goto overflow;
+			count++;
+		}
+	}
+	goto finish;
+
+overflow:
+	ERROR("rlm_python:%s: too many attributes to return", funcname);
+	rcode = RLM_MODULE_FAIL;
+	count = 0;
+
+finish:
+	memcpy(shm, &rcode, sizeof(rcode));
+	memcpy(shm + sizeof(rcode), &count, sizeof(count));
+	talloc_free(ctx);
+}
+
+/** Main loop of a helper process
+ *
+ * Starts its own interpreter, reports the result of the instantiate
+ * function, then runs requests until the server closes its end of the
+ * socketpair.
+ */
+static void NEVER_RETURNS mod_helper_main(rlm_python_t *inst, python_helper_t *helper, int fd)
+{
+	uint32_t	i;
+	int32_t		rcode;
+
+	/*
+	 *	The server's other threads don't exist in this
+	 *	process, so its messages can't be left for the
+	 *	logger thread.
+	 */
+	radlog_async_forked();
+
+	signal(SIGHUP, SIG_IGN);
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+#ifdef SIGPIPE
+	signal(SIGPIPE, SIG_IGN);
+#endif
+
+	/*
+	 *	Don't hold the other helpers' sockets open, or they
+	 *	won't see EOF when the server exits.
+	 */
+	for (i = 0; i < inst->started; i++) {
+		if (inst->helpers[i].fd >= 0) close(inst->helpers[i].fd);
+	}
+
+	/*
+	 *	Everything from here on runs in this process.
+	 */
+	inst->processes = 0;
+	rcode = mod_instantiate_python(inst);
+
+	memcpy(helper->shm, &rcode, sizeof(rcode));
+	if ((mod_helper_signal(fd) < 0) || (rcode < 0)) _exit(1);
+
+	while (mod_helper_wait(fd) == 0) {
+		mod_helper_call(inst, helper->shm);
+		if (mod_helper_signal(fd) < 0) break;
+	}
+
+	_exit(0);
+}
+
+/** Stop the helper processes
+ *
+ * Closing the socketpair tells a helper to exit.
+ */
+static void mod_helper_stop(python_helper_t *helper)
+{
+	int status;
+
+	if (helper->fd >= 0) close(helper->fd);
+	helper->fd = -1;
+
+	if (helper->pid > 0) {
+		kill(helper->pid, SIGTERM);
+		waitpid(helper->pid, &status, 0);
+	}
+	helper->pid = 0;
+
+	if (helper->shm) munmap(helper->shm, PYTHON_SHM_SIZE);
+	helper->shm = NULL;
+}
+
+/** Fork a helper process, and wait for it to instantiate
+ *
+ * Called with the mutex held, by the first request which finds no
+ * idle helper.
+ */
+static int mod_helper_start(rlm_python_t *inst, python_helper_t *helper)
+{
+	int	fd[2];
+	int32_t	rcode;
+
+	helper->shm = mmap(NULL, PYTHON_SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (helper->shm == MAP_FAILED) {
+		helper->shm = NULL;
+		ERROR("rlm_python: Failed allocating shared memory: %s", fr_syserror(errno));
+		return -1;
+	}
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fd) < 0) {
+		ERROR("rlm_python: Failed creating socketpair: %s", fr_syserror(errno));
+		goto error;
+	}
+
+	helper->pid = fork();
+	if (helper->pid < 0) {
+		ERROR("rlm_python: Failed forking helper: %s", fr_syserror(errno));
+		close(fd[0]);
+		close(fd[1]);
+		goto error;
+	}
+
+	if (helper->pid == 0) {
+		close(fd[0]);
+		mod_helper_main(inst, helper, fd[1]);
+	}
+
+	close(fd[1]);
+	helper->fd = fd[0];
+
+	if (mod_helper_wait(helper->fd) < 0) {
+		ERROR("rlm_python: Helper PID %u exited during instantiation", (unsigned int) helper->pid);
+		goto error;
+	}
+
+	memcpy(&rcode, helper->shm, sizeof(rcode));
+	if (rcode < 0) goto error;
+
+	DEBUG2("rlm_python: Started helper PID %u", (unsigned int) helper->pid);
+
+	return 0;
+
+error:
+	mod_helper_stop(helper);
+	return -1;
+}
+
+/*
+ *	Do any per-module initialization that is separate to each
+ *	configured instance of the module.  e.g. set up connections
+ *	to external databases, read configuration files, set up
+ *	dictionary entries, etc.
+ *
+ *	If configuration information is given in the config section
+ *	that must be referenced in later calls, store a handle to it
+ *	in *instance otherwise put a null pointer there.
+ *
+ */
+static int mod_instantiate(UNUSED CONF_SECTION *conf, void *instance)
+{
+	rlm_python_t *inst = instance;
+
+	if (inst->processes) {
+		uint32_t i;
+
+		if (inst->processes > PYTHON_MAX_PROCESSES) {
+			ERROR("rlm_python: processes must be no more than %u", PYTHON_MAX_PROCESSES);
+			return -1;
+		}
+
+		if (inst->pass_by_reference) {
+			WARN("rlm_python: pass_by_reference can't be used with processes, ignoring it");
+			inst->pass_by_reference = false;
+		}
+
+		/*
+		 *	The helpers are started by do_python_helper().
+		 */
+		inst->helpers = talloc_zero_array(inst, python_helper_t, inst->processes);
+		if (!inst->helpers) return -1;
+		for (i = 0; i < inst->processes; i++) inst->helpers[i].fd = -1;
+
+#ifdef HAVE_PTHREAD_H
+		pthread_mutex_init(&inst->mutex, NULL);
+		pthread_cond_init(&inst->cond, NULL);
+#endif
+		return 0;
+	}
+
+	return mod_instantiate_python(inst);
+}
+
 static int mod_detach(void *instance)
 {
 	rlm_python_t *inst = instance;
 	int	     ret;
 
+	/*
+	 *	Every helper runs its own detach function.
+	 */
+	if (inst->helpers) {
+		uint32_t i;
+
+		ret = RLM_MODULE_NOOP;
+		for (i = 0; i < inst->started; i++) {
+			if (inst->detach.module_name && inst->detach.function_name) {
+				ret = mod_helper_run(inst, &inst->helpers[i], NULL, &inst->detach, "detach");
+			}
+			mod_helper_stop(&inst->helpers[i]);
+		}
+
+#ifdef HAVE_PTHREAD_H
+		pthread_mutex_destroy(&inst->mutex);
+		pthread_cond_destroy(&inst->cond);
+#endif
+		talloc_free(inst->helpers);
+		inst->helpers = NULL;
+		inst->idle = NULL;
+
+		return ret;
+	}
+
 	/*
 	 *	Master should still have no thread state
 	 */
-	ret = do_python(inst, NULL, inst->detach.function, "detach", false);
+	ret = do_python(inst, NULL, &inst->detach, "detach", false);
 
 	mod_instance_clear(inst);
 	dlclose(inst->libpython);
@@ -717,7 +1736,7 @@ static int mod_detach(void *instance)
 }
 
 #define A(x) static rlm_rcode_t CC_HINT(nonnull) mod_##x(void *instance, REQUEST *request) { \
-		return do_python((rlm_python_t *) instance, request, ((rlm_python_t *)instance)->x.function, #x, true);\
+		return do_python((rlm_python_t *) instance, request, &((rlm_python_t *)instance)->x, #x, true);\
 	}
 
 A(authenticate)
@@ -765,5 +1784,9 @@ module_t rlm_python = {
 		, mod_recv_coa,
 		mod_send_coa
 #endif
-	}
+	},
+	0,				/* thread_inst_size */
+	NULL,				/* thread_instantiate */
+	NULL,				/* thread_detach */
+	NULL				/* cache_flush */
 };
@@ -28,6 +28,9 @@ RCSID("$Id$")
 #include	<freeradius-devel/rad_assert.h>
 
 #include	<fcntl.h>
+#include	<ctype.h>
+#include	<sys/mman.h>
+#include	<sys/stat.h>
 
 #include "config.h"
 
@@ -46,6 +49,8 @@ typedef struct nas_port {
 	struct nas_port 	*next;
 } NAS_PORT;
 
+typedef struct session_index session_index_t;
+
 typedef struct rlm_radutmp_t {
 	NAS_PORT	*nas_port_list;
 	char const	*filename;
@@ -54,6 +59,13 @@ typedef struct rlm_radutmp_t {
 	bool		check_nas;
 	uint32_t	permission;
 	bool		caller_id_ok;
+
+	bool		use_index;		//!< Keep an index of the file in memory.
+	uint32_t	max_sessions;		//!< Most records the indexed file can hold.
+	session_index_t	*index;			//!< The index, if use_index is set.
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t	mutex;			//!< Serialises access to the file without the index.
+#endif
 } rlm_radutmp_t;
 
 static const CONF_PARSER module_config[] = {
@@ -65,9 +77,489 @@ static const CONF_PARSER module_config[] = {
 	{ "permissions", FR_CONF_OFFSET(PW_TYPE_INTEGER, rlm_radutmp_t, permission), "0644" },
 	{ "callerid", FR_CONF_OFFSET(PW_TYPE_BOOLEAN | PW_TYPE_DEPRECATED, rlm_radutmp_t, caller_id_ok), NULL },
 	{ "caller_id", FR_CONF_OFFSET(PW_TYPE_BOOLEAN, rlm_radutmp_t, caller_id_ok), "no" },
+	{ "index", FR_CONF_OFFSET(PW_TYPE_BOOLEAN, rlm_radutmp_t, use_index), "no" },
+	{ "max_sessions", FR_CONF_OFFSET(PW_TYPE_INTEGER, rlm_radutmp_t, max_sessions), "1048576" },
 	{ NULL, -1, 0, NULL, NULL }		/* end the list */
 };
 
+#ifdef HAVE_PTHREAD_H
+#define PTHREAD_MUTEX_LOCK pthread_mutex_lock
+#define PTHREAD_MUTEX_UNLOCK pthread_mutex_unlock
+#else
+#define PTHREAD_MUTEX_LOCK(_x)
+#define PTHREAD_MUTEX_UNLOCK(_x)
+#endif
+
+/*
+ *	The session index.
+ *
+ *	With "index = yes" the radutmp file is mapped into memory
+ *	once, and hash chains are kept over it, keyed by NAS+port and
+ *	by login.  Accounting packets find their record through the
+ *	NAS+port chains, and checksimul counts a user's sessions by
+ *	walking that user's login chain, so neither reads the file.
+ *	Records are still written into the mapped file, which keeps
+ *	the sessions across restarts, and keeps radwho working.
+ *
+ *	Every record which has been used is in exactly one NAS+port
+ *	chain, and records of type P_LOGIN are also in one login
+ *	chain.  Records which are all zeros are free.  The chains are
+ *	protected by striped mutexes.  Changing a record needs the
+ *	mutex for its NAS+port chain, and for the login chain of its
+ *	login, which are always taken in that order.
+ */
+#define SESSION_STRIPES		(64)
+#define SESSION_GROW		(1024)		//!< Records the file is extended by at a time.
+#define SESSION_NONE		UINT32_MAX
+
+typedef struct session_index {
+	int		fd;		//!< The radutmp file.
+	struct radutmp	*utmp;		//!< The file, mapped.
+	bool		case_sensitive;	//!< How logins are compared.
+
+	uint32_t	max;		//!< Records mapped, the most the file can grow to.
+	uint32_t	size;		//!< Records in the file.
+	uint32_t	used;		//!< Records either in a chain, or free.  The rest are unused.
+	uint32_t	free;		//!< First free record.
+
+	uint32_t	mask;		//!< Hash tables have mask + 1 buckets.
+	uint32_t	*port_head;	//!< First record in each NAS+port chain.
+	uint32_t	*port_next;	//!< Next record in the same NAS+port chain, or free list.
+	uint32_t	*user_head;	//!< First record in each login chain.
+	uint32_t	*user_next;	//!< Next record in the same login chain.
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t	alloc_mutex;	//!< Protects the free list, and growing the file.
+	pthread_mutex_t	port_mutex[SESSION_STRIPES];
+	pthread_mutex_t	user_mutex[SESSION_STRIPES];
+#endif
+} session_index_t;
+
+static uint32_t session_port_hash(uint32_t nasaddr, uint32_t port)
+{
+	return fr_hash_update(&port, sizeof(port), fr_hash(&nasaddr, sizeof(nasaddr)));
+}
+
+static uint32_t session_user_hash(session_index_t const *idx, char const *login)
+{
+	char	buf[RUT_NAMESIZE + 1];
+	size_t	i;
+
+	for (i = 0; (i < RUT_NAMESIZE) && login[i]; i++) {
+		buf[i] = idx->case_sensitive ? login[i] : tolower((uint8_t) login[i]);
+	}
+	buf[i] = '\0';
+
+	return fr_hash_string(buf);
+}
+
+static bool session_user_cmp(session_index_t const *idx, char const *a, char const *b)
+{
+	if (strncmp(a, b, RUT_NAMESIZE) == 0) return true;
+
+	return !idx->case_sensitive && (strncasecmp(a, b, RUT_NAMESIZE) == 0);
+}
+
+#define SESSION_STRIPE(_hash) ((_hash) & (SESSION_STRIPES - 1))
+
+/** Lock the login chains for two logins, in a consistent order
+ *
+ */
+static void session_user_lock(session_index_t *idx, uint32_t a, uint32_t b)
+{
+	a = SESSION_STRIPE(a);
+	b = SESSION_STRIPE(b);
+	if (a > b) {
+		uint32_t tmp = a;
+		a = b;
+		b = tmp;
+	}
+
+	PTHREAD_MUTEX_LOCK(&idx->user_mutex[a]);
+	if (b != a) PTHREAD_MUTEX_LOCK(&idx->user_mutex[b]);
+}
+
+static void session_user_unlock(session_index_t *idx, uint32_t a, uint32_t b)
+{
+	a = SESSION_STRIPE(a);
+	b = SESSION_STRIPE(b);
+
+	PTHREAD_MUTEX_UNLOCK(&idx->user_mutex[a]);
+	if (b != a) PTHREAD_MUTEX_UNLOCK(&idx->user_mutex[b]);
+}
+
+/** Add a record to the login chain for its login
+ *
+ * The caller must hold the mutex for that chain.
+ */
+static void session_user_link(session_index_t *idx, uint32_t i, uint32_t hash)
+{
+	uint32_t bucket = hash & idx->mask;
+
+	idx->user_next[i] = idx->user_head[bucket];
+	idx->user_head[bucket] = i;
+}
+
+static void session_user_unlink(session_index_t *idx, uint32_t i, uint32_t hash)
+{
+	uint32_t *p;
+
+	for (p = &idx->user_head[hash & idx->mask]; *p != SESSION_NONE; p = &idx->user_next[*p]) {
+		if (*p != i) continue;
+
+		*p = idx->user_next[i];
+		idx->user_next[i] = SESSION_NONE;
+		return;
+	}
+}
+
+/** Find the record for a NAS+port
+ *
+ * The caller must hold the mutex for the chain.
+ */
+static uint32_t session_port_find(session_index_t *idx, uint32_t hash, uint32_t nasaddr, uint32_t port)
+{
+	uint32_t i;
+
+	for (i = idx->port_head[hash & idx->mask]; i != SESSION_NONE; i = idx->port_next[i]) {
+		if ((idx->utmp[i].nas_address == nasaddr) && (idx->utmp[i].nas_port == port)) break;
+	}
+
+	return i;
+}
+
+/** Get a free record, extending the file if there isn't one
+ *
+ */
+static uint32_t session_alloc(session_index_t *idx)
+{
+	uint32_t i = SESSION_NONE;
+
+	PTHREAD_MUTEX_LOCK(&idx->alloc_mutex);
+	if (idx->free != SESSION_NONE) {
+		i = idx->free;
+		idx->free = idx->port_next[i];
+		goto done;
+	}
+
+	if (idx->used == idx->size) {
+		uint32_t size;
+
+		if (idx->size == idx->max) goto done;
+
+		size = idx->size + SESSION_GROW;
+		if (size > idx->max) size = idx->max;
+
+		if (ftruncate(idx->fd, (off_t) size * sizeof(struct radutmp)) < 0) {
+			ERROR("rlm_radutmp: Failed extending session file: %s", fr_syserror(errno));
+			goto done;
+		}
+		idx->size = size;
+	}
+	i = idx->used++;
+
+done:
+	PTHREAD_MUTEX_UNLOCK(&idx->alloc_mutex);
+
+	return i;
+}
+
+static int _session_index_free(session_index_t *idx)
+{
+#ifdef HAVE_PTHREAD_H
+	int i;
+
+	pthread_mutex_destroy(&idx->alloc_mutex);
+	for (i = 0; i < SESSION_STRIPES; i++) {
+		pthread_mutex_destroy(&idx->port_mutex[i]);
+		pthread_mutex_destroy(&idx->user_mutex[i]);
+	}
+#endif
+	if (idx->utmp) munmap(idx->utmp, (size_t) idx->max * sizeof(struct radutmp));
+	if (idx->fd >= 0) close(idx->fd);
+
+	return 0;
+}
+
+/** Map the radutmp file, and build the chains from what's in it
+ *
+ */
+static session_index_t *session_index_alloc(TALLOC_CTX *ctx, char const *filename, uint32_t permission,
+					    uint32_t max, bool case_sensitive)
+{
+	session_index_t		*idx;
+	struct stat		buf;
+	uint32_t		i, buckets;
+	static struct radutmp	zero;
+
+	idx = talloc_zero(ctx, session_index_t);
+	if (!idx) return NULL;
+	idx->fd = -1;
+	talloc_set_destructor(idx, _session_index_free);
+
+	idx->case_sensitive = case_sensitive;
+	idx->free = SESSION_NONE;
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_init(&idx->alloc_mutex, NULL);
+	for (i = 0; i < SESSION_STRIPES; i++) {
+		pthread_mutex_init(&idx->port_mutex[i], NULL);
+		pthread_mutex_init(&idx->user_mutex[i], NULL);
+	}
+#endif
+
+	idx->fd = open(filename, O_RDWR | O_CREAT, permission);
+	if (idx->fd < 0) {
+		ERROR("rlm_radutmp: Error accessing file %s: %s", filename, fr_syserror(errno));
+		goto error;
+	}
+
+	if (fstat(idx->fd, &buf) < 0) {
+		ERROR("rlm_radutmp: Failed to stat file %s: %s", filename, fr_syserror(errno));
+		goto error;
+	}
+
+	idx->size = buf.st_size / sizeof(struct radutmp);
+	if (idx->size > max) {
+		ERROR("rlm_radutmp: File %s has %u records, more than max_sessions", filename, idx->size);
+		goto error;
+	}
+	idx->used = idx->size;
+	idx->max = max;
+
+	/*
+	 *	Drop any partial record at the end.
+	 */
+	if ((off_t) (idx->size * sizeof(struct radutmp)) != buf.st_size) {
+		if (ftruncate(idx->fd, (off_t) idx->size * sizeof(struct radutmp)) < 0) {
+			ERROR("rlm_radutmp: Failed truncating file %s: %s", filename, fr_syserror(errno));
+			goto error;
+		}
+	}
+
+	/*
+	 *	Map all of it up front, so growing the file never
+	 *	moves records out from under other threads.  Pages
+	 *	beyond the end of the file aren't touched until it's
+	 *	been extended to cover them.
+	 */
+	idx->utmp = mmap(NULL, (size_t) max * sizeof(struct radutmp), PROT_READ | PROT_WRITE, MAP_SHARED, idx->fd, 0);
+	if (idx->utmp == MAP_FAILED) {
+		idx->utmp = NULL;
+		ERROR("rlm_radutmp: Failed to map file %s: %s", filename, fr_syserror(errno));
+		goto error;
+	}
+
+	for (buckets = SESSION_STRIPES; (buckets < (max / 4)) && (buckets < (1 << 24)); buckets <<= 1);
+	idx->mask = buckets - 1;
+
+	idx->port_head = talloc_array(idx, uint32_t, buckets);
+	idx->user_head = talloc_array(idx, uint32_t, buckets);
+	idx->port_next = talloc_array(idx, uint32_t, max);
+	idx->user_next = talloc_array(idx, uint32_t, max);
+	if (!idx->port_head || !idx->user_head || !idx->port_next || !idx->user_next) goto error;
+
+	memset(idx->port_head, 0xff, buckets * sizeof(uint32_t));
+	memset(idx->user_head, 0xff, buckets * sizeof(uint32_t));
+	memset(idx->user_next, 0xff, max * sizeof(uint32_t));
+
+	/*
+	 *	Walk backwards, so that if the file has more than one
+	 *	record for a NAS+port, the first one is found, as it
+	 *	would be by reading the file.
+	 */
+	for (i = idx->size; i > 0; i--) {
+		struct radutmp	*u = &idx->utmp[i - 1];
+		uint32_t	hash;
+
+		if (memcmp(u, &zero, sizeof(zero)) == 0) {
+			idx->port_next[i - 1] = idx->free;
+			idx->free = i - 1;
+			continue;
+		}
+
+		hash = session_port_hash(u->nas_address, u->nas_port) & idx->mask;
+		idx->port_next[i - 1] = idx->port_head[hash];
+		idx->port_head[hash] = i - 1;
+
+		if (u->type == P_LOGIN) session_user_link(idx, i - 1, session_user_hash(idx, u->login));
+	}
+
+	DEBUG("rlm_radutmp: Indexed %u records from %s", idx->size, filename);
+
+	return idx;
+
+error:
+	talloc_free(idx);
+	return NULL;
+}
+
+/** Apply an accounting packet to the index
+ *
+ * Follows the same rules as writing the file directly.
+ */
+static rlm_rcode_t session_update(session_index_t *idx, REQUEST *request, struct radutmp *ut,
+				  int status, char const *nas)
+{
+	uint32_t	port_hash, old_hash, new_hash;
+	uint32_t	i;
+	struct radutmp	*u;
+	int		r = 1;
+
+	port_hash = session_port_hash(ut->nas_address, ut->nas_port);
+
+	PTHREAD_MUTEX_LOCK(&idx->port_mutex[SESSION_STRIPE(port_hash)]);
+
+	i = session_port_find(idx, port_hash, ut->nas_address, ut->nas_port);
+	if (i == SESSION_NONE) {
+		if (status == PW_STATUS_STOP) {
+			r = 0;
+			goto done;
+		}
+
+		i = session_alloc(idx);
+		if (i == SESSION_NONE) {
+			PTHREAD_MUTEX_UNLOCK(&idx->port_mutex[SESSION_STRIPE(port_hash)]);
+			REDEBUG("Session file is full, increase max_sessions");
+			return RLM_MODULE_FAIL;
+		}
+
+		memset(&idx->utmp[i], 0, sizeof(idx->utmp[i]));
+		idx->utmp[i].nas_address = ut->nas_address;
+		idx->utmp[i].nas_port = ut->nas_port;
+		idx->user_next[i] = SESSION_NONE;
+		idx->port_next[i] = idx->port_head[port_hash & idx->mask];
+		idx->port_head[port_hash & idx->mask] = i;
+	}
+	u = &idx->utmp[i];
+
+	if (status == PW_STATUS_STOP) {
+		if (u->type == P_IDLE) {
+			r = 0;
+		} else if (strncmp(ut->session_id, u->session_id, sizeof(u->session_id)) != 0) {
+			RWDEBUG("Logout entry for NAS %s port %u has wrong ID", nas, u->nas_port);
+			r = -1;
+		}
+	} else if (strncmp(ut->session_id, u->session_id, sizeof(u->session_id)) == 0) {
+		if ((status == PW_STATUS_START) && (u->time >= ut->time)) {
+			if (u->type == P_LOGIN) {
+				INFO("rlm_radutmp: Login entry for NAS %s port %u duplicate", nas, u->nas_port);
+			} else {
+				RWDEBUG("Login entry for NAS %s port %u wrong order", nas, u->nas_port);
+			}
+			r = -1;
+		} else if ((status == PW_STATUS_ALIVE) && (u->type == P_LOGIN)) {
+			/*
+			 *	Keep the original login time.
+			 */
+			ut->time = u->time;
+		}
+	}
+
+	if (r <= 0) goto done;
+
+	old_hash = session_user_hash(idx, u->login);
+
+	if ((status == PW_STATUS_START) || (status == PW_STATUS_ALIVE)) {
+		new_hash = session_user_hash(idx, ut->login);
+
+		session_user_lock(idx, old_hash, new_hash);
+		if (u->type == P_LOGIN) session_user_unlink(idx, i, old_hash);
+
+		ut->type = P_LOGIN;
+		*u = *ut;
+		session_user_link(idx, i, new_hash);
+		session_user_unlock(idx, old_hash, new_hash);
+		goto done;
+	}
+
+	/*
+	 *	The user has logged off.
+	 */
+	session_user_lock(idx, old_hash, old_hash);
+	session_user_unlink(idx, i, old_hash);
+	u->type = P_IDLE;
+	u->time = ut->time;
+	u->delay = ut->delay;
+	session_user_unlock(idx, old_hash, old_hash);
+
+done:
+	PTHREAD_MUTEX_UNLOCK(&idx->port_mutex[SESSION_STRIPE(port_hash)]);
+
+	if ((r == 0) && (status == PW_STATUS_STOP)) {
+		RWDEBUG("Logout for NAS %s port %u, but no Login record", nas, ut->nas_port);
+	}
+
+	return RLM_MODULE_OK;
+}
+
+/** Log out every session on a NAS
+ *
+ */
+static rlm_rcode_t session_zap_nas(session_index_t *idx, uint32_t nasaddr, time_t t)
+{
+	uint32_t stripe, bucket, i;
+
+	if (t == 0) time(&t);
+
+	for (stripe = 0; stripe < SESSION_STRIPES; stripe++) {
+		PTHREAD_MUTEX_LOCK(&idx->port_mutex[stripe]);
+
+		for (bucket = stripe; bucket <= idx->mask; bucket += SESSION_STRIPES) {
+			for (i = idx->port_head[bucket]; i != SESSION_NONE; i = idx->port_next[i]) {
+				struct radutmp	*u = &idx->utmp[i];
+				uint32_t	hash;
+
+				if ((nasaddr != 0 && nasaddr != u->nas_address) || u->type != P_LOGIN) continue;
+
+				hash = session_user_hash(idx, u->login);
+				session_user_lock(idx, hash, hash);
+				session_user_unlink(idx, i, hash);
+				u->type = P_IDLE;
+				u->time = t;
+				session_user_unlock(idx, hash, hash);
+			}
+		}
+
+		PTHREAD_MUTEX_UNLOCK(&idx->port_mutex[stripe]);
+	}
+
+	return RLM_MODULE_OK;
+}
+
+/** Copy out the sessions for a login
+ *
+ * @return the number of sessions, or -1 on error.
+ */
+static int session_find_user(session_index_t *idx, TALLOC_CTX *ctx, char const *login, struct radutmp **out)
+{
+	uint32_t	hash, i;
+	int		count = 0;
+	struct radutmp	*sessions = NULL;
+
+	hash = session_user_hash(idx, login);
+
+	PTHREAD_MUTEX_LOCK(&idx->user_mutex[SESSION_STRIPE(hash)]);
+	for (i = idx->user_head[hash & idx->mask]; i != SESSION_NONE; i = idx->user_next[i]) {
+		if (!session_user_cmp(idx, login, idx->utmp[i].login)) continue;
+
+		if (out) {
+			sessions = talloc_realloc(ctx, sessions, struct radutmp, count + 1);
+			if (!sessions) {
+				count = -1;
+				break;
+			}
+			sessions[count] = idx->utmp[i];
+		}
+		count++;
+	}
+	PTHREAD_MUTEX_UNLOCK(&idx->user_mutex[SESSION_STRIPE(hash)]);
+
+	if (out) *out = sessions;
+
+	return count;
+}
+
 
 #ifdef WITH_ACCOUNTING
 /*
@@ -144,7 +636,7 @@ static NAS_PORT *nas_port_find(NAS_PORT *nas_port_list, uint32_t nasaddr, uint16
 /*
  *	Store logins in the RADIUS utmp file.
  */
-static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, REQUEST *request)
+static rlm_rcode_t radutmp_accounting(void *instance, REQUEST *request)
 {
 	rlm_rcode_t	rcode = RLM_MODULE_OK;
 	struct radutmp	ut, u;
@@ -326,14 +818,22 @@ static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, REQUEST *requ
 	 */
 	if (status == PW_STATUS_ACCOUNTING_ON && (ut.nas_address != htonl(INADDR_NONE))) {
 		RIDEBUG("NAS %s restarted (Accounting-On packet seen)", nas);
-		rcode = radutmp_zap(request, filename, ut.nas_address, ut.time);
+		if (inst->index) {
+			rcode = session_zap_nas(inst->index, ut.nas_address, ut.time);
+		} else {
+			rcode = radutmp_zap(request, filename, ut.nas_address, ut.time);
+		}
 
 		goto finish;
 	}
 
 	if (status == PW_STATUS_ACCOUNTING_OFF && (ut.nas_address != htonl(INADDR_NONE))) {
 		RIDEBUG("NAS %s rebooted (Accounting-Off packet seen)", nas);
-		rcode = radutmp_zap(request, filename, ut.nas_address, ut.time);
+		if (inst->index) {
+			rcode = session_zap_nas(inst->index, ut.nas_address, ut.time);
+		} else {
+			rcode = radutmp_zap(request, filename, ut.nas_address, ut.time);
+		}
 
 		goto finish;
 	}
@@ -380,6 +880,12 @@ static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, REQUEST *requ
 		goto finish;
 	}
 
+	if (inst->index) {
+		rcode = session_update(inst->index, request, &ut, status, nas);
+
+		goto finish;
+	}
+
 	/*
 	 *	Enter into the radutmp file.
 	 */
@@ -537,9 +1043,99 @@ static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, REQUEST *requ
 
 	return rcode;
 }
+
+static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, REQUEST *request)
+{
+	rlm_radutmp_t	*inst = instance;
+	rlm_rcode_t	rcode;
+
+	if (inst->index) return radutmp_accounting(instance, request);
+
+	PTHREAD_MUTEX_LOCK(&inst->mutex);
+	rcode = radutmp_accounting(instance, request);
+	PTHREAD_MUTEX_UNLOCK(&inst->mutex);
+
+	return rcode;
+}
 #endif
 
 #ifdef WITH_SESSION_MGMT
+/*
+ *	Ask the NAS whether a session is still there.  Counts it in
+ *	request->simul_count if it is, and zaps it if it isn't.
+ *
+ *	Returns 0 if the NAS was checked, -1 if it couldn't be.
+ */
+static int radutmp_check_session(REQUEST *request, struct radutmp *u, char const *login, int fd,
+				 uint32_t ipno, char const *call_num)
+{
+	int	rcode;
+	char	session_id[sizeof(u->session_id) + 1];
+	char	utmp_login[sizeof(u->login) + 1];
+
+	/* Guarantee string is NULL terminated */
+	u->session_id[sizeof(u->session_id) - 1] = '\0';
+	strlcpy(session_id, u->session_id, sizeof(session_id));
+
+	/*
+	 *	The login name MAY fill the whole field,
+	 *	and thus won't be zero-filled.
+	 *
+	 *	Note that we take the user name from
+	 *	the utmp file, as that's the canonical
+	 *	form.  The 'login' variable may contain
+	 *	a string which is an upper/lowercase
+	 *	version of u.login.  When we call the
+	 *	routine to check the terminal server,
+	 *	the NAS may be case sensitive.
+	 *
+	 *	e.g. We ask if "bob" is using a port,
+	 *	and the NAS says "no", because "BOB"
+	 *	is using the port.
+	 */
+	memset(utmp_login, 0, sizeof(utmp_login));
+	memcpy(utmp_login, u->login, sizeof(u->login));
+
+	/*
+	 *	rad_check_ts may take seconds
+	 *	to return, and we don't want
+	 *	to block everyone else while
+	 *	that's happening.  */
+	if (fd >= 0) rad_unlockfd(fd, LOCK_LEN);
+	rcode = rad_check_ts(u->nas_address, u->nas_port, utmp_login, session_id);
+	if (fd >= 0) rad_lockfd(fd, LOCK_LEN);
+
+	if (rcode == 0) {
+		/*
+		 *	Stale record - zap it.
+		 */
+		session_zap(request, u->nas_address, u->nas_port, login, session_id,
+			    u->framed_address, u->proto, 0);
+		return 0;
+	}
+
+	if (rcode != 1) {
+		RWDEBUG("Failed to check the terminal server for user '%s'.", utmp_login);
+		return -1;
+	}
+
+	/*
+	 *	User is still logged in.
+	 */
+	++request->simul_count;
+
+	/*
+	 *	Does it look like a MPP attempt?
+	 */
+	if (strchr("SCPA", u->proto) && ipno && u->framed_address == ipno) {
+		request->simul_mpp = 2;
+	} else if (strchr("SCPA", u->proto) && call_num && !strncmp(u->caller_id, call_num,16)) {
+		request->simul_mpp = 2;
+	}
+
+	return 0;
+}
+
 /*
  *	See if a user is already logged in. Sets request->simul_count to the
  *	current session count for this user and sets request->simul_mpp to 2
@@ -554,7 +1150,9 @@ static rlm_rcode_t CC_HINT(nonnull) mod_checksimul(void *instance, REQUEST *requ
 {
 	rlm_rcode_t	rcode = RLM_MODULE_OK;
 	struct radutmp	u;
+	struct radutmp	*sessions = NULL;
 	int		fd = -1;
+	int		i, count = 0;
 	VALUE_PAIR	*vp;
 	uint32_t	ipno = 0;
 	char const     	*call_num = NULL;
@@ -563,11 +1161,38 @@ static rlm_rcode_t CC_HINT(nonnull) mod_checksimul(void *instance, REQUEST *requ
 	char		*expanded = NULL;
 	ssize_t		len;
 
+	/*
+	 *	With the index, the sessions for the user are found
+	 *	without reading the file.
+	 */
+	if (inst->index) {
+		len = radius_axlat(&expanded, request, inst->username, NULL, NULL);
+		if (len < 0) return RLM_MODULE_FAIL;
+		if (!len) {
+			talloc_free(expanded);
+			return RLM_MODULE_NOOP;
+		}
+
+		request->simul_count = session_find_user(inst->index, request, expanded, NULL);
+		if ((request->simul_count < request->simul_max) || !inst->check_nas) goto finish;
+
+		count = session_find_user(inst->index, request, expanded, &sessions);
+		if (count < 0) {
+			rcode = RLM_MODULE_FAIL;
+			goto finish;
+		}
+		goto check;
+	}
+
+	PTHREAD_MUTEX_LOCK(&inst->mutex);
+
 	/*
 	 *	Get the filename, via xlat.
 	 */
 	if (radius_axlat(&expanded, request, inst->filename, NULL, NULL) < 0) {
-		return RLM_MODULE_FAIL;
+		rcode = RLM_MODULE_FAIL;
+
+		goto finish;
 	}
 
 	fd = open(expanded, O_RDWR);
@@ -578,7 +1203,8 @@ static rlm_rcode_t CC_HINT(nonnull) mod_checksimul(void *instance, REQUEST *requ
 		 */
 		if (errno == ENOENT) {
 			request->simul_count=0;
-			return RLM_MODULE_OK;
+
+			goto finish;
 		}
 
 		/*
@@ -635,6 +1261,7 @@ static rlm_rcode_t CC_HINT(nonnull) mod_checksimul(void *instance, REQUEST *requ
 	}
 	lseek(fd, (off_t)0, SEEK_SET);
 
+check:
 	/*
 	 *	Setup some stuff, like for MPP detection.
 	 */
@@ -646,6 +1273,24 @@ static rlm_rcode_t CC_HINT(nonnull) mod_checksimul(void *instance, REQUEST *requ
 		call_num = vp->vp_strvalue;
 	}
 
+	request->simul_count = 0;
+
+	/*
+	 *	The index gave us a copy of the sessions, so nothing
+	 *	is locked while we ask the NASes about them.
+	 */
+	if (inst->index) {
+		for (i = 0; i < count; i++) {
+			if (radutmp_check_session(request, &sessions[i], expanded, -1, ipno, call_num) < 0) {
+				rcode = RLM_MODULE_FAIL;
+
+				goto finish;
+			}
+		}
+
+		goto finish;
+	}
+
 	/*
 	 *	lock the file while reading/writing.
 	 */
@@ -657,68 +1302,10 @@ static rlm_rcode_t CC_HINT(nonnull) mod_checksimul(void *instance, REQUEST *requ
 	 *	it's not a duplicate session.  This happens with
 	 *	static IP's like DSL.
 	 */
-	request->simul_count = 0;
 	while (read(fd, &u, sizeof(u)) == sizeof(u)) {
 		if (((strncmp(expanded, u.login, RUT_NAMESIZE) == 0) || (!inst->case_sensitive &&
 		    (strncasecmp(expanded, u.login, RUT_NAMESIZE) == 0))) && (u.type == P_LOGIN)) {
-			char session_id[sizeof(u.session_id) + 1];
-			char utmp_login[sizeof(u.login) + 1];
-
-			/* Guarantee string is NULL terminated */
-			u.session_id[sizeof(u.session_id) - 1] = '\0';
-			strlcpy(session_id, u.session_id, sizeof(session_id));
-
-			/*
-			 *	The login name MAY fill the whole field,
-			 *	and thus won't be zero-filled.
-			 *
-			 *	Note that we take the user name from
-			 *	the utmp file, as that's the canonical
-			 *	form.  The 'login' variable may contain
-			 *	a string which is an upper/lowercase
-			 *	version of u.login.  When we call the
-			 *	routine to check the terminal server,
-			 *	the NAS may be case sensitive.
-			 *
-			 *	e.g. We ask if "bob" is using a port,
-			 *	and the NAS says "no", because "BOB"
-			 *	is using the port.
-			 */
-			memset(utmp_login, 0, sizeof(utmp_login));
-			memcpy(utmp_login, u.login, sizeof(u.login));
-
-			/*
-			 *	rad_check_ts may take seconds
-			 *	to return, and we don't want
-			 *	to block everyone else while
-			 *	that's happening.  */
-			rad_unlockfd(fd, LOCK_LEN);
-			rcode = rad_check_ts(u.nas_address, u.nas_port, utmp_login, session_id);
-			rad_lockfd(fd, LOCK_LEN);
-
-			if (rcode == 0) {
-				/*
-				 *	Stale record - zap it.
-				 */
-				session_zap(request, u.nas_address, u.nas_port, expanded, session_id,
-					    u.framed_address, u.proto, 0);
-			}
-			else if (rcode == 1) {
-				/*
-				 *	User is still logged in.
-				 */
-				++request->simul_count;
-
-				/*
-				 *	Does it look like a MPP attempt?
-				 */
-				if (strchr("SCPA", u.proto) && ipno && u.framed_address == ipno) {
-					request->simul_mpp = 2;
-				} else if (strchr("SCPA", u.proto) && call_num && !strncmp(u.caller_id, call_num,16)) {
-					request->simul_mpp = 2;
-				}
-			} else {
-				RWDEBUG("Failed to check the terminal server for user '%s'.", utmp_login);
+			if (radutmp_check_session(request, &u, expanded, fd, ipno, call_num) < 0) {
 				rcode = RLM_MODULE_FAIL;
 
 				goto finish;
@@ -728,24 +1315,72 @@ static rlm_rcode_t CC_HINT(nonnull) mod_checksimul(void *instance, REQUEST *requ
 	finish:
 
 	talloc_free(expanded);
+	talloc_free(sessions);
 
 	if (fd > -1) {
 		close(fd);		/* and implicitely release the locks */
 	}
 
+	if (!inst->index) PTHREAD_MUTEX_UNLOCK(&inst->mutex);
+
 	return rcode;
 }
 #endif
 
+static int mod_instantiate(CONF_SECTION *conf, void *instance)
+{
+	rlm_radutmp_t *inst = instance;
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutexattr_t attr;
+
+	/*
+	 *	Recursive, as checksimul may zap a session, which
+	 *	calls accounting.
+	 */
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&inst->mutex, &attr);
+	pthread_mutexattr_destroy(&attr);
+#endif
+
+	if (!inst->use_index) return 0;
+
+	if (strchr(inst->filename, '%') != NULL) {
+		cf_log_err_cs(conf, "'filename' cannot be expanded at run-time with 'index = yes'");
+		return -1;
+	}
+
+	if (inst->max_sessions < SESSION_GROW) inst->max_sessions = SESSION_GROW;
+
+	inst->index = session_index_alloc(inst, inst->filename, inst->permission, inst->max_sessions,
+					  inst->case_sensitive);
+	if (!inst->index) return -1;
+
+	return 0;
+}
+
+static int mod_detach(void *instance)
+{
+	rlm_radutmp_t *inst = instance;
+
+	TALLOC_FREE(inst->index);
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_destroy(&inst->mutex);
+#endif
+
+	return 0;
+}
+
 /* globally exported name */
 module_t rlm_radutmp = {
 	RLM_MODULE_INIT,
 	"radutmp",
-	RLM_TYPE_THREAD_UNSAFE | RLM_TYPE_HUP_SAFE,   	/* type */
+	RLM_TYPE_THREAD_SAFE | RLM_TYPE_HUP_SAFE,   	/* type */
 	sizeof(rlm_radutmp_t),
 	module_config,
-	NULL,			       /* instantiation */
-	NULL,			       /* detach */
+	mod_instantiate,	       /* instantiation */
+	mod_detach,		       /* detach */
 	{
 		NULL,		 /* authentication */
 		NULL,		 /* authorization */
@@ -764,5 +1399,9 @@ module_t rlm_radutmp = {
 		NULL,			/* post-proxy */
 		NULL			/* post-auth */
 	},
+	0,				/* thread_inst_size */
+	NULL,				/* thread_instantiate */
+	NULL,				/* thread_detach */
+	NULL				/* cache_flush */
 };
 
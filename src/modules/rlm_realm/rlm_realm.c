@@ -517,5 +517,9 @@ module_t rlm_realm = {
 		NULL			/* send-coa */
 #endif
 	},
+	0,				/* thread_inst_size */
+	NULL,				/* thread_instantiate */
+	NULL,				/* thread_detach */
+	NULL				/* cache_flush */
 };
 
@@ -35,32 +35,50 @@ static const CONF_PARSER module_config[] = {
 	{ "port", FR_CONF_OFFSET(PW_TYPE_SHORT, REDIS_INST, port), "6379" },
 	{ "database", FR_CONF_OFFSET(PW_TYPE_INTEGER, REDIS_INST, database), "0" },
 	{ "password", FR_CONF_OFFSET(PW_TYPE_STRING | PW_TYPE_SECRET, REDIS_INST, password), NULL },
+	{ "cluster", FR_CONF_OFFSET(PW_TYPE_BOOLEAN, REDIS_INST, cluster), "no" },
 
 	{ NULL, -1, 0, NULL, NULL} /* end the list */
 };
 
+#ifdef HAVE_PTHREAD_H
+#define PTHREAD_MUTEX_LOCK pthread_mutex_lock
+#define PTHREAD_MUTEX_UNLOCK pthread_mutex_unlock
+#else
+#define PTHREAD_MUTEX_LOCK(_x)
+#define PTHREAD_MUTEX_UNLOCK(_x)
+#endif
+
 static int _mod_conn_free(REDISSOCK *dissocket)
 {
-	redisFree(dissocket->conn);
+	int i;
 
-	if (dissocket->reply) {
-		freeReplyObject(dissocket->reply);
-		dissocket->reply = NULL;
+	rlm_redis_finish_query(dissocket);
+
+	for (i = 0; i < REDIS_MAX_NODES; i++) {
+		if (dissocket->nodes[i]) redisFree(dissocket->nodes[i]);
 	}
 
 	return 0;
 }
 
-static void *mod_conn_create(TALLOC_CTX *ctx, void *instance)
+/*
+ *	Open a connection to one server, and authenticate to it.
+ */
+static redisContext *redis_connect(REDIS_INST *inst, char const *host, uint16_t port)
 {
-	REDIS_INST *inst = instance;
-	REDISSOCK *dissocket = NULL;
 	redisContext *conn;
 	redisReply *reply = NULL;
 	char buffer[1024];
 
-	conn = redisConnect(inst->hostname, inst->port);
-	if (conn->err) return NULL;
+	conn = redisConnect(host, port);
+	if (!conn) return NULL;
+
+	if (conn->err) {
+		ERROR("rlm_redis (%s): Failed connecting to %s:%u: %s",
+		      inst->xlat_name, host, port, conn->errstr);
+		redisFree(conn);
+		return NULL;
+	}
 
 	if (inst->password) {
 		snprintf(buffer, sizeof(buffer), "AUTH %s", inst->password);
@@ -90,6 +108,9 @@ static void *mod_conn_create(TALLOC_CTX *ctx, void *instance)
 			       inst->xlat_name);
 			goto do_close;
 		}
+
+		freeReplyObject(reply);
+		reply = NULL;
 	}
 
 	if (inst->database) {
@@ -118,15 +139,239 @@ static void *mod_conn_create(TALLOC_CTX *ctx, void *instance)
 			       inst->xlat_name);
 			goto do_close;
 		}
+
+		freeReplyObject(reply);
 	}
 
+	return conn;
+}
+
+static void *mod_conn_create(TALLOC_CTX *ctx, void *instance)
+{
+	REDIS_INST *inst = instance;
+	REDISSOCK *dissocket = NULL;
+	redisContext *conn;
+
+	conn = redis_connect(inst, inst->hostname, inst->port);
+	if (!conn) return NULL;
+
 	dissocket = talloc_zero(ctx, REDISSOCK);
 	dissocket->conn = conn;
+	dissocket->nodes[0] = conn;
 	talloc_set_destructor(dissocket, _mod_conn_free);
 
 	return dissocket;
 }
 
+/*
+ *	CRC16 (XMODEM), as used by Redis Cluster to map keys to slots.
+ */
+static uint16_t redis_crc16(uint8_t const *p, size_t len)
+{
+	uint16_t crc = 0;
+	int i;
+
+	while (len--) {
+		crc ^= ((uint16_t) *p++) << 8;
+
+		for (i = 0; i < 8; i++) {
+			crc = (crc & 0x8000) ? ((crc << 1) ^ 0x1021) : (crc << 1);
+		}
+	}
+
+	return crc;
+}
+
+/*
+ *	Only the part of the key between the first '{' and the next
+ *	'}' is hashed, if there is one, so that related keys can be
+ *	put in the same slot.
+ */
+static unsigned int redis_key_slot(char const *key, size_t len)
+{
+	char const *p, *q;
+
+	p = memchr(key, '{', len);
+	if (p) {
+		q = memchr(p + 1, '}', len - ((p + 1) - key));
+		if (q && (q > (p + 1))) {
+			key = p + 1;
+			len = q - key;
+		}
+	}
+
+	return redis_crc16((uint8_t const *) key, len) & (REDIS_CLUSTER_SLOTS - 1);
+}
+
+/*
+ *	Find a node, adding it if it's new.  Must be called with the
+ *	slot mutex held.
+ */
+static int redis_node_find(REDIS_INST *inst, char const *host, size_t hostlen, uint16_t port)
+{
+	int i;
+
+	if (!hostlen || (hostlen >= sizeof(inst->nodes[0].host))) return -1;
+
+	for (i = 0; i < inst->num_nodes; i++) {
+		if ((inst->nodes[i].port == port) &&
+		    (strncmp(inst->nodes[i].host, host, hostlen) == 0) &&
+		    (inst->nodes[i].host[hostlen] == '\0')) return i;
+	}
+
+	if (inst->num_nodes == REDIS_MAX_NODES) return -1;
+
+	memcpy(inst->nodes[i].host, host, hostlen);
+	inst->nodes[i].host[hostlen] = '\0';
+	inst->nodes[i].port = port;
+	inst->num_nodes++;
+
+	return i;
+}
+
+/*
+ *	Get this socket's connection to a node, opening it if necessary.
+ */
+static redisContext *redis_node_conn(REDISSOCK *dissocket, REDIS_INST *inst, int node)
+{
+	redis_node_t this;
+
+	if (dissocket->nodes[node]) return dissocket->nodes[node];
+
+	PTHREAD_MUTEX_LOCK(&inst->slot_mutex);
+	this = inst->nodes[node];
+	PTHREAD_MUTEX_UNLOCK(&inst->slot_mutex);
+
+	DEBUG2("rlm_redis (%s): Opening connection to cluster node %s:%u",
+	       inst->xlat_name, this.host, this.port);
+
+	dissocket->nodes[node] = redis_connect(inst, this.host, this.port);
+	if (node == 0) dissocket->conn = dissocket->nodes[0];
+
+	return dissocket->nodes[node];
+}
+
+static void redis_node_close(REDISSOCK *dissocket, int node)
+{
+	if (!dissocket->nodes[node]) return;
+
+	redisFree(dissocket->nodes[node]);
+	dissocket->nodes[node] = NULL;
+	if (node == 0) dissocket->conn = NULL;
+}
+
+/*
+ *	Load the slot map from a node, with CLUSTER SLOTS.
+ *
+ *	Each entry in the reply is [start, end, [host, port, ...], replicas...].
+ *	An empty host means the node we asked.
+ */
+static int redis_cluster_load(REDIS_INST *inst, redisContext *conn, char const *conn_host)
+{
+	redisReply *reply, *range, *master;
+	char const *host;
+	size_t hostlen;
+	long long start, end;
+	int node;
+	size_t i;
+
+	reply = redisCommand(conn, "CLUSTER SLOTS");
+	if (!reply) {
+		ERROR("rlm_redis (%s): Failed to run CLUSTER SLOTS: %s", inst->xlat_name, conn->errstr);
+		return -1;
+	}
+
+	if (reply->type != REDIS_REPLY_ARRAY) {
+		ERROR("rlm_redis (%s): Unexpected reply to CLUSTER SLOTS%s%s", inst->xlat_name,
+		      (reply->type == REDIS_REPLY_ERROR) ? ": " : "",
+		      (reply->type == REDIS_REPLY_ERROR) ? reply->str : "");
+		freeReplyObject(reply);
+		return -1;
+	}
+
+	PTHREAD_MUTEX_LOCK(&inst->slot_mutex);
+	for (i = 0; i < reply->elements; i++) {
+		range = reply->element[i];
+
+		if ((range->type != REDIS_REPLY_ARRAY) || (range->elements < 3) ||
+		    (range->element[0]->type != REDIS_REPLY_INTEGER) ||
+		    (range->element[1]->type != REDIS_REPLY_INTEGER)) continue;
+
+		master = range->element[2];
+		if ((master->type != REDIS_REPLY_ARRAY) || (master->elements < 2) ||
+		    (master->element[0]->type != REDIS_REPLY_STRING) ||
+		    (master->element[1]->type != REDIS_REPLY_INTEGER)) continue;
+
+		start = range->element[0]->integer;
+		end = range->element[1]->integer;
+		if ((start < 0) || (end >= REDIS_CLUSTER_SLOTS) || (start > end)) continue;
+
+		host = master->element[0]->str;
+		hostlen = master->element[0]->len;
+		if (!hostlen) {
+			host = conn_host;
+			hostlen = strlen(conn_host);
+		}
+
+		node = redis_node_find(inst, host, hostlen, master->element[1]->integer);
+		if (node < 0) {
+			WARN("rlm_redis (%s): Too many cluster nodes, ignoring slots %lld-%lld",
+			     inst->xlat_name, start, end);
+			continue;
+		}
+
+		memset(&inst->slots[start], node, (end - start) + 1);
+	}
+	inst->slots_loaded = time(NULL);
+	PTHREAD_MUTEX_UNLOCK(&inst->slot_mutex);
+
+	freeReplyObject(reply);
+
+	return 0;
+}
+
+/*
+ *	Parse a "MOVED <slot> <host>:<port>" or "ASK <slot> <host>:<port>"
+ *	error.  MOVED also updates the slot map.
+ *
+ *	Returns the node the command should be sent to.
+ */
+static int redis_cluster_redirect(REDIS_INST *inst, redisReply *reply, bool *ask)
+{
+	char const *p;
+	char *q;
+	unsigned long slot, port;
+	int node;
+
+	if (reply->type != REDIS_REPLY_ERROR) return -1;
+
+	if (strncmp(reply->str, "MOVED ", 6) == 0) {
+		*ask = false;
+	} else if (strncmp(reply->str, "ASK ", 4) == 0) {
+		*ask = true;
+	} else {
+		return -1;
+	}
+
+	p = strchr(reply->str, ' ') + 1;
+	slot = strtoul(p, &q, 10);
+	if ((*q != ' ') || (slot >= REDIS_CLUSTER_SLOTS)) return -1;
+
+	p = q + 1;
+	q = strrchr(p, ':');
+	if (!q) return -1;
+
+	port = strtoul(q + 1, NULL, 10);
+	if (!port || (port > 65535)) return -1;
+
+	PTHREAD_MUTEX_LOCK(&inst->slot_mutex);
+	node = redis_node_find(inst, p, q - p, port);
+	if ((node >= 0) && !*ask) inst->slots[slot] = node;
+	PTHREAD_MUTEX_UNLOCK(&inst->slot_mutex);
+
+	return node;
+}
+
 static ssize_t redis_xlat(void *instance, REQUEST *request, char const *fmt, char *out, size_t freespace)
 {
 	REDIS_INST *inst = instance;
@@ -173,8 +418,10 @@ static ssize_t redis_xlat(void *instance, REQUEST *request, char const *fmt, cha
 	strlcpy(out, buffer_ptr, freespace);
 
 release:
-	rlm_redis_finish_query(dissocket);
-	fr_connection_release(inst->pool, dissocket);
+	if (dissocket) {
+		rlm_redis_finish_query(dissocket);
+		fr_connection_release(inst->pool, dissocket);
+	}
 
 	return ret;
 }
@@ -189,72 +436,302 @@ static int mod_detach(void *instance)
 
 	fr_connection_pool_delete(inst->pool);
 
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_destroy(&inst->slot_mutex);
+#endif
+
 	return 0;
 }
 
+static int redis_expand(REQUEST *request, char const *query, char **argv, char *argv_buf)
+{
+	int argc;
+
+	argc = rad_expand_xlat(request, query, MAX_REDIS_ARGS, argv, false,
+			       MAX_QUERY_LEN, argv_buf);
+	if (argc <= 0) return -1;
+
+	DEBUG2("executing %s ...", argv[0]);
+
+	return argc;
+}
+
 /*
- *	Query the redis database
+ *	Send a command which was redirected to another cluster node,
+ *	and replace its reply.
  */
-int rlm_redis_query(REDISSOCK **dissocket_p, REDIS_INST *inst,
-		    char const *query, REQUEST *request)
+static int redis_cluster_resend(REDISSOCK *dissocket, REDIS_INST *inst, char const *query,
+				redisReply **reply_p, REQUEST *request)
 {
-	REDISSOCK *dissocket;
-	int argc;
+	int argc, node, redirects;
 	char *argv[MAX_REDIS_ARGS];
 	char argv_buf[MAX_QUERY_LEN];
+	redisContext *conn;
+	redisReply *reply;
+	char host[sizeof(inst->nodes[0].host)];
+	bool ask, reload;
+	time_t now;
 
-	if (!query || !*query || !inst || !dissocket_p) {
-		return -1;
+	for (redirects = 0; ; redirects++) {
+		node = redis_cluster_redirect(inst, *reply_p, &ask);
+		if (node < 0) return 0;		/* Not a redirect */
+
+		if (redirects == REDIS_MAX_REDIRECTS) {
+			RERROR("Too many redirects for %s", query);
+			return -1;
+		}
+
+		RDEBUG2("%s, resending", (*reply_p)->str);
+
+		argc = redis_expand(request, query, argv, argv_buf);
+		if (argc < 0) return -1;
+
+		conn = redis_node_conn(dissocket, inst, node);
+		if (!conn) return -1;
+
+		if ((ask && (redisAppendCommand(conn, "ASKING") != REDIS_OK)) ||
+		    (redisAppendCommandArgv(conn, argc, (char const **)(void **)argv, NULL) != REDIS_OK)) {
+		conn_error:
+			RERROR("%s", conn->errstr);
+			redis_node_close(dissocket, node);
+			return -1;
+		}
+
+		if (ask) {
+			if (redisGetReply(conn, (void **) &reply) != REDIS_OK) goto conn_error;
+			freeReplyObject(reply);
+		}
+
+		if (redisGetReply(conn, (void **) &reply) != REDIS_OK) goto conn_error;
+
+		freeReplyObject(*reply_p);
+		*reply_p = reply;
+
+		if (ask) continue;
+
+		/*
+		 *	The cluster has been resharded, so the rest of
+		 *	the map is probably out of date too.  Reload it,
+		 *	at most once a second.
+		 */
+		now = time(NULL);
+		PTHREAD_MUTEX_LOCK(&inst->slot_mutex);
+		reload = (inst->slots_loaded != now);
+		if (reload) inst->slots_loaded = now;
+		memcpy(host, inst->nodes[node].host, sizeof(host));
+		PTHREAD_MUTEX_UNLOCK(&inst->slot_mutex);
+
+		if (!reload) continue;
+
+		if ((redis_cluster_load(inst, conn, host) < 0) && conn->err) redis_node_close(dissocket, node);
 	}
+}
 
-	argc = rad_expand_xlat(request, query, MAX_REDIS_ARGS, argv, false,
-				sizeof(argv_buf), argv_buf);
-	if (argc <= 0)
+/*
+ *	Send the commands, and read their replies.  Commands for the same
+ *	connection are written together, before any of the replies are read.
+ *
+ *	Returns -1 on error, and sets *failed to the node whose
+ *	connection failed, or -1 if nothing was sent.
+ */
+static int redis_send_recv(REDISSOCK *dissocket, REDIS_INST *inst, char const **queries, int num,
+			   int *failed, REQUEST *request)
+{
+	int i, argc, done, ret = -1;
+	int node[MAX_REDIS_PIPELINE];
+	char *cmd[MAX_REDIS_PIPELINE];
+	int cmd_len[MAX_REDIS_PIPELINE];
+	bool flushed[REDIS_MAX_NODES];
+	char *argv[MAX_REDIS_ARGS];
+	char argv_buf[MAX_QUERY_LEN];
+	redisContext *conn;
+	unsigned int slot;
+
+	*failed = -1;
+	memset(cmd, 0, sizeof(cmd));
+
+	/*
+	 *	Expand and format all of the commands first, so that
+	 *	nothing is left in the output buffers if one fails.
+	 */
+	for (i = 0; i < num; i++) {
+		if (!queries[i] || !*queries[i]) goto finish;
+
+		argc = redis_expand(request, queries[i], argv, argv_buf);
+		if (argc < 0) goto finish;
+
+		cmd_len[i] = redisFormatCommandArgv(&cmd[i], argc, (char const **)(void **)argv, NULL);
+		if (cmd_len[i] < 0) {
+			cmd[i] = NULL;
+			goto finish;
+		}
+
+		node[i] = 0;
+		if (inst->cluster && (argc > 1)) {
+			slot = redis_key_slot(argv[1], strlen(argv[1]));
+
+			PTHREAD_MUTEX_LOCK(&inst->slot_mutex);
+			node[i] = inst->slots[slot];
+			PTHREAD_MUTEX_UNLOCK(&inst->slot_mutex);
+		}
+
+		if (!redis_node_conn(dissocket, inst, node[i])) {
+			*failed = node[i];
+			goto finish;
+		}
+	}
+
+	for (i = 0; i < num; i++) {
+		*failed = node[i];
+		conn = dissocket->nodes[node[i]];
+		if (redisAppendFormattedCommand(conn, cmd[i], cmd_len[i]) != REDIS_OK) {
+		conn_error:
+			RERROR("%s", conn->errstr);
+			goto finish;
+		}
+	}
+
+	memset(flushed, 0, sizeof(flushed));
+	for (i = 0; i < num; i++) {
+		if (flushed[node[i]]) continue;
+		flushed[node[i]] = true;
+
+		*failed = node[i];
+		conn = dissocket->nodes[node[i]];
+		do {
+			if (redisBufferWrite(conn, &done) != REDIS_OK) goto conn_error;
+		} while (!done);
+	}
+
+	for (i = 0; i < num; i++) {
+		*failed = node[i];
+		conn = dissocket->nodes[node[i]];
+		if (redisGetReply(conn, (void **) &dissocket->replies[i]) != REDIS_OK) goto conn_error;
+		dissocket->num_replies++;
+	}
+
+	ret = 0;
+
+finish:
+	for (i = 0; i < num; i++) free(cmd[i]);
+
+	return ret;
+}
+
+/*
+ *	Run several commands, with one round trip to the database (per
+ *	cluster node).  The replies are left in dissocket->replies.
+ */
+int rlm_redis_pipeline(REDISSOCK **dissocket_p, REDIS_INST *inst,
+		       char const **queries, int num, REQUEST *request)
+{
+	REDISSOCK *dissocket;
+	int i, failed, ret = 0;
+	bool retried = false;
+
+	if (!queries || (num <= 0) || (num > MAX_REDIS_PIPELINE) || !inst || !dissocket_p || !*dissocket_p) {
 		return -1;
+	}
 
 	dissocket = *dissocket_p;
+	rlm_redis_finish_query(dissocket);
 
-	DEBUG2("executing %s ...", argv[0]);
-	dissocket->reply = redisCommandArgv(dissocket->conn, argc, (char const **)(void **)argv, NULL);
-	if (!dissocket->reply) {
-		RERROR("%s", dissocket->conn->errstr);
-
-		dissocket = fr_connection_reconnect(inst->pool, dissocket);
-		if (!dissocket) {
-		error:
-			*dissocket_p = NULL;
-			return -1;
+retry:
+	if (redis_send_recv(dissocket, inst, queries, num, &failed, request) < 0) {
+		if (failed < 0) return -1;
+
+		/*
+		 *	The connection is now out of step with its
+		 *	replies.  Only retry if nothing was read, as the
+		 *	commands may otherwise have been run.
+		 */
+		if (!retried && (dissocket->num_replies == 0)) {
+			retried = true;
+		} else {
+			ret = -1;
+		}
+		rlm_redis_finish_query(dissocket);
+
+		if (inst->cluster) {
+			for (i = 0; i < REDIS_MAX_NODES; i++) redis_node_close(dissocket, i);
+		} else {
+			dissocket = fr_connection_reconnect(inst->pool, dissocket);
+			if (!dissocket) {
+				*dissocket_p = NULL;
+				return -1;
+			}
+			*dissocket_p = dissocket;
 		}
 
-		dissocket->reply = redisCommand(dissocket->conn, query);
-		if (!dissocket->reply) {
-			RERROR("Failed after re-connect");
-			fr_connection_del(inst->pool, dissocket);
-			goto error;
+		if (ret < 0) return -1;
+		goto retry;
+	}
+
+	for (i = 0; i < num; i++) {
+		if (inst->cluster && (redis_cluster_resend(dissocket, inst, queries[i],
+							   &dissocket->replies[i], request) < 0)) {
+			ret = -1;
+			continue;
 		}
 
-		*dissocket_p = dissocket;
+		if (dissocket->replies[i]->type == REDIS_REPLY_ERROR) {
+			RERROR("Query failed, %s: %s", queries[i], dissocket->replies[i]->str);
+			ret = -1;
+		}
 	}
 
-	if (dissocket->reply->type == REDIS_REPLY_ERROR) {
-		RERROR("Query failed, %s", query);
+	return ret;
+}
+
+/*
+ *	Query the redis database
+ */
+int rlm_redis_query(REDISSOCK **dissocket_p, REDIS_INST *inst,
+		    char const *query, REQUEST *request)
+{
+	REDISSOCK *dissocket;
+	int ret;
+
+	if (!query || !*query || !inst || !dissocket_p) {
 		return -1;
 	}
 
+	ret = rlm_redis_pipeline(dissocket_p, inst, &query, 1, request);
+
+	dissocket = *dissocket_p;
+	if (dissocket && (dissocket->num_replies == 1)) {
+		dissocket->reply = dissocket->replies[0];
+		dissocket->replies[0] = NULL;
+		dissocket->num_replies = 0;
+	}
+
+	if (ret < 0) return -1;
+
 	return 0;
 }
 
 /*
- *	Clear the redis reply object if any
+ *	Clear the redis reply objects if any
  */
 int rlm_redis_finish_query(REDISSOCK *dissocket)
 {
-	if (!dissocket || !dissocket->reply) {
+	int i;
+
+	if (!dissocket || (!dissocket->reply && !dissocket->num_replies)) {
 		return -1;
 	}
 
-	freeReplyObject(dissocket->reply);
-	dissocket->reply = NULL;
+	if (dissocket->reply) {
+		freeReplyObject(dissocket->reply);
+		dissocket->reply = NULL;
+	}
+
+	for (i = 0; i < dissocket->num_replies; i++) {
+		if (dissocket->replies[i]) freeReplyObject(dissocket->replies[i]);
+		dissocket->replies[i] = NULL;
+	}
+	dissocket->num_replies = 0;
+
 	return 0;
 }
 
@@ -276,12 +753,48 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 
 	xlat_register(inst->xlat_name, redis_xlat, NULL, inst); /* FIXME! */
 
+	if (inst->cluster && inst->database) {
+		cf_log_err_cs(conf, "'database' must be 0 when 'cluster = yes'");
+		return -1;
+	}
+
+	if (strlen(inst->hostname) >= sizeof(inst->nodes[0].host)) {
+		cf_log_err_cs(conf, "'server' is too long");
+		return -1;
+	}
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_init(&inst->slot_mutex, NULL);
+#endif
+
+	/*
+	 *	Every slot starts off on the configured server, which
+	 *	will redirect us if it's wrong.
+	 */
+	strlcpy(inst->nodes[0].host, inst->hostname, sizeof(inst->nodes[0].host));
+	inst->nodes[0].port = inst->port;
+	inst->num_nodes = 1;
+
+	if (inst->cluster) {
+		redisContext *conn;
+
+		conn = redis_connect(inst, inst->hostname, inst->port);
+		if (!conn || (redis_cluster_load(inst, conn, inst->hostname) < 0)) {
+			WARN("rlm_redis (%s): Failed loading the cluster slot map, it will be learned from redirects",
+			     inst->xlat_name);
+		} else {
+			DEBUG("rlm_redis (%s): Loaded cluster slot map, %i nodes", inst->xlat_name, inst->num_nodes);
+		}
+		if (conn) redisFree(conn);
+	}
+
 	inst->pool = fr_connection_pool_module_init(conf, inst, mod_conn_create, NULL, NULL);
 	if (!inst->pool) {
 		return -1;
 	}
 
 	inst->redis_query = rlm_redis_query;
+	inst->redis_pipeline = rlm_redis_pipeline;
 	inst->redis_finish_query = rlm_redis_finish_query;
 
 	return 0;
@@ -305,4 +818,8 @@ module_t rlm_redis = {
 		NULL, /* post-proxy */
 		NULL /* post-auth */
 	},
+	0,				/* thread_inst_size */
+	NULL,				/* thread_instantiate */
+	NULL,				/* thread_detach */
+	NULL				/* cache_flush */
 };
@@ -33,9 +33,33 @@ RCSIDH(rlm_redis_h, "$Id$")
 #include <freeradius-devel/modpriv.h>
 #include <hiredis/hiredis.h>
 
+#define MAX_QUERY_LEN			4096
+#define MAX_REDIS_ARGS			16
+#define MAX_REDIS_PIPELINE		16	//!< Most commands sent together by rlm_redis_pipeline().
+
+#define REDIS_CLUSTER_SLOTS		16384
+#define REDIS_MAX_NODES			64	//!< Most cluster nodes we'll keep connections to.
+#define REDIS_MAX_REDIRECTS		5
+
+/** A node in a Redis Cluster
+ *
+ * Node 0 is always the configured server.  Other nodes are added as
+ * they're found in the slot map, or in MOVED and ASK redirects, and
+ * are never removed, so their index is stable.
+ */
+typedef struct redis_node_t {
+	char			host[256];
+	uint16_t		port;
+} redis_node_t;
+
 typedef struct redis_socket_t {
-	redisContext	*conn;
+	redisContext	*conn;				//!< To the configured server (node 0).
 	redisReply      *reply;
+
+	int		num_replies;			//!< From the last rlm_redis_pipeline().
+	redisReply	*replies[MAX_REDIS_PIPELINE];
+
+	redisContext	*nodes[REDIS_MAX_NODES];	//!< Cluster mode connections, opened as needed.
 } REDISSOCK;
 
 typedef struct rlm_redis_t REDIS_INST;
@@ -47,18 +71,31 @@ typedef struct rlm_redis_t {
 	uint16_t		port;
 	uint32_t		database;
 	char const		*password;
+	bool			cluster;
 	fr_connection_pool_t	*pool;
 
+	/*
+	 *	Cluster slot map.  Index into nodes for each slot.
+	 */
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t		slot_mutex;
+#endif
+	int			num_nodes;
+	redis_node_t		nodes[REDIS_MAX_NODES];
+	uint8_t			slots[REDIS_CLUSTER_SLOTS];
+	time_t			slots_loaded;
+
 	int (*redis_query)(REDISSOCK **dissocket_p, REDIS_INST *inst, char const *query, REQUEST *request);
+	int (*redis_pipeline)(REDISSOCK **dissocket_p, REDIS_INST *inst, char const **queries, int num,
+			      REQUEST *request);
 	int (*redis_finish_query)(REDISSOCK *dissocket);
 
 } rlm_redis_t;
 
-#define MAX_QUERY_LEN			4096
-#define MAX_REDIS_ARGS			16
-
 int rlm_redis_query(REDISSOCK **dissocket_p, REDIS_INST *inst,
 		    char const *query, REQUEST *request);
+int rlm_redis_pipeline(REDISSOCK **dissocket_p, REDIS_INST *inst,
+		       char const **queries, int num, REQUEST *request);
 int rlm_redis_finish_query(REDISSOCK *dissocket);
 
 #endif	/* RLM_REDIS_H */
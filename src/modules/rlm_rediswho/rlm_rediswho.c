@@ -58,62 +58,35 @@ static CONF_PARSER module_config[] = {
 	{ "trim-count", FR_CONF_OFFSET(PW_TYPE_SIGNED | PW_TYPE_DEPRECATED, rlm_rediswho_t, trim_count), NULL },
 	{ "trim_count", FR_CONF_OFFSET(PW_TYPE_SIGNED, rlm_rediswho_t, trim_count), "-1" },
 
-	{ "insert", FR_CONF_OFFSET(PW_TYPE_STRING | PW_TYPE_REQUIRED | PW_TYPE_XLAT, rlm_rediswho_t, insert), NULL },
+	/*
+	 *	Defaults for the Acct-Status-Type subsections.  insert and
+	 *	expire have to be set here, or in every subsection.
+	 */
+	{ "insert", FR_CONF_OFFSET(PW_TYPE_STRING | PW_TYPE_XLAT, rlm_rediswho_t, insert), NULL },
 	{ "trim", FR_CONF_OFFSET(PW_TYPE_STRING | PW_TYPE_XLAT, rlm_rediswho_t, trim), NULL }, /* required only if trim_count > 0 */
-	{ "expire", FR_CONF_OFFSET(PW_TYPE_STRING | PW_TYPE_REQUIRED | PW_TYPE_XLAT, rlm_rediswho_t, expire), NULL },
+	{ "expire", FR_CONF_OFFSET(PW_TYPE_STRING | PW_TYPE_XLAT, rlm_rediswho_t, expire), NULL },
 
 	{ NULL, -1, 0, NULL, NULL}
 };
 
 /*
- *	Query the database executing a command with no result rows
+ *	Get a query from the Acct-Status-Type subsection, or the default
  */
-static int rediswho_command(char const *fmt, REDISSOCK **dissocket_p,
-			    rlm_rediswho_t *inst, REQUEST *request)
+static char const *rediswho_query(CONF_SECTION *cs, char const *name, char const *dflt)
 {
-	REDISSOCK *dissocket;
-	int result = 0;
-
-	if (!fmt) {
-		return 0;
-	}
-
-	if (inst->redis_inst->redis_query(dissocket_p, inst->redis_inst,
-					  fmt, request) < 0) {
-
-		ERROR("rediswho_command: database query error in: '%s'", fmt);
-		return -1;
+	CONF_PAIR *cp;
 
-	}
-	dissocket = *dissocket_p;
-
-	switch (dissocket->reply->type) {
-	case REDIS_REPLY_INTEGER:
-		DEBUG("rediswho_command: query response %lld\n",
-		      dissocket->reply->integer);
-		if (dissocket->reply->integer > 0)
-			result = dissocket->reply->integer;
-		break;
-
-	case REDIS_REPLY_STATUS:
-	case REDIS_REPLY_STRING:
-		DEBUG("rediswho_command: query response %s\n",
-		      dissocket->reply->str);
-		break;
-
-	default:
-		break;
-	}
+	cp = cf_pair_find(cs, name);
+	if (!cp) return dflt;
 
-	(inst->redis_inst->redis_finish_query)(dissocket);
-
-	return result;
+	return cf_pair_value(cp);
 }
 
 static int mod_instantiate(CONF_SECTION *conf, void *instance)
 {
 	module_instance_t *modinst;
 	rlm_rediswho_t *inst = instance;
+	CONF_SECTION *cs;
 
 	inst->xlat_name = cf_section_name2(conf);
 
@@ -139,30 +112,79 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 
 	inst->redis_inst = (REDIS_INST *) modinst->insthandle;
 
+	/*
+	 *	These used to be required at the top level.  They can
+	 *	now be in the subsections instead, but one or the other
+	 *	is still required.
+	 */
+	for (cs = cf_subsection_find_next(conf, NULL, NULL);
+	     cs != NULL;
+	     cs = cf_subsection_find_next(conf, cs, NULL)) {
+		if (!rediswho_query(cs, "insert", inst->insert)) {
+			cf_log_err_cs(cs, "No 'insert' query in %s, or in %s", cf_section_name1(cs), inst->xlat_name);
+			return -1;
+		}
+
+		if (!rediswho_query(cs, "expire", inst->expire)) {
+			cf_log_err_cs(cs, "No 'expire' query in %s, or in %s", cf_section_name1(cs), inst->xlat_name);
+			return -1;
+		}
+	}
+
 	return 0;
 }
 
-static int mod_accounting_all(REDISSOCK **dissocket_p,
+/*
+ *	The insert, trim and expire commands are sent together, with one
+ *	round trip to the database.  LTRIM doesn't change a list which is
+ *	already short enough, so it's sent whether or not it's needed.
+ */
+static int mod_accounting_all(REDISSOCK **dissocket_p, CONF_SECTION *cs,
 			      rlm_rediswho_t *inst, REQUEST *request)
 {
-	int result;
+	char const *queries[3];
+	char const *trim;
+	int i, num = 0;
+	redisReply *reply;
+	int ret;
 
-	result = rediswho_command(inst->insert, dissocket_p, inst, request);
-	if (result < 0) {
-		return RLM_MODULE_FAIL;
+	queries[num] = rediswho_query(cs, "insert", inst->insert);
+	if (!queries[num]) {
+		RDEBUG("No insert query in %s", cf_section_name1(cs));
+		return RLM_MODULE_NOOP;
 	}
+	num++;
+
+	trim = rediswho_query(cs, "trim", inst->trim);
+	if ((inst->trim_count >= 0) && trim) queries[num++] = trim;
 
-	/* Only trim if necessary */
-	if (inst->trim_count >= 0 && result > inst->trim_count) {
-		if (rediswho_command(inst->trim, dissocket_p,
-				     inst, request) < 0) {
-			return RLM_MODULE_FAIL;
+	queries[num] = rediswho_query(cs, "expire", inst->expire);
+	if (queries[num]) num++;
+
+	ret = inst->redis_inst->redis_pipeline(dissocket_p, inst->redis_inst, queries, num, request);
+	if (!*dissocket_p) return RLM_MODULE_FAIL;
+
+	for (i = 0; i < (*dissocket_p)->num_replies; i++) {
+		reply = (*dissocket_p)->replies[i];
+
+		switch (reply->type) {
+		case REDIS_REPLY_INTEGER:
+			RDEBUG2("Query response %lld", reply->integer);
+			break;
+
+		case REDIS_REPLY_STATUS:
+		case REDIS_REPLY_STRING:
+			RDEBUG2("Query response %s", reply->str);
+			break;
+
+		default:
+			break;
 		}
 	}
 
-	if (rediswho_command(inst->expire, dissocket_p, inst, request) < 0) {
-		return RLM_MODULE_FAIL;
-	}
+	inst->redis_inst->redis_finish_query(*dissocket_p);
+
+	if (ret < 0) return RLM_MODULE_FAIL;
 
 	return RLM_MODULE_OK;
 }
@@ -197,7 +219,7 @@ static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void * instance, REQUEST * re
 	dissocket = fr_connection_get(inst->redis_inst->pool);
 	if (!dissocket) return RLM_MODULE_FAIL;
 
-	rcode = mod_accounting_all(&dissocket, inst, request);
+	rcode = mod_accounting_all(&dissocket, cs, inst, request);
 
 	if (dissocket) fr_connection_release(inst->redis_inst->pool, dissocket);
 
@@ -223,4 +245,8 @@ module_t rlm_rediswho = {
 		NULL, /* post-proxy */
 		NULL /* post-auth */
 	},
+	0,				/* thread_inst_size */
+	NULL,				/* thread_instantiate */
+	NULL,				/* thread_detach */
+	NULL				/* cache_flush */
 };
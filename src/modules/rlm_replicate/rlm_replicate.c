@@ -25,6 +25,639 @@ RCSID("$Id$")
 #include <freeradius-devel/radiusd.h>
 #include <freeradius-devel/modules.h>
 
+#include <fcntl.h>
+
+typedef struct rlm_replicate_t rlm_replicate_t;
+
+#if defined(WITH_PROXY) && defined(HAVE_PTHREAD_H)
+/*
+ *	Replication queue.
+ *
+ *	With "queue_size" set, the request thread only copies the
+ *	packet onto a queue for each target home server.  Sender
+ *	threads encode and send whatever has been queued, in batches.
+ *	If a target can't keep up, its queue fills, and further
+ *	packets for it are dropped (and counted) rather than making
+ *	requests wait.
+ *
+ *	With "window" set, the senders also wait for replies, keeping
+ *	at most "window" packets outstanding to each target, and
+ *	retransmitting those which haven't been answered.
+ */
+#  define REPLICATE_MAX_THREADS	(32)
+#  define REPLICATE_BATCH_SIZE	(64)
+
+typedef struct replicate_entry {
+	RADIUS_PACKET		*packet;
+	struct timeval		sent;		//!< When it was last sent.
+	uint32_t		tries;
+	struct replicate_entry	*next;
+} replicate_entry_t;
+
+typedef struct replicate_thread replicate_thread_t;
+
+typedef struct replicate_target {
+	home_server_t		*home;
+	replicate_thread_t	*thread;	//!< Which sends the packets for this target.
+	int			sockfd;
+
+	pthread_mutex_t		mutex;		//!< Protects the queue.
+	replicate_entry_t	*head;
+	replicate_entry_t	*tail;
+	uint32_t		num_queued;
+
+	/*
+	 *	Only used by the sender thread.
+	 */
+	replicate_entry_t	*outstanding[256];	//!< Packets waiting for a reply, by ID.
+	uint32_t		num_outstanding;
+	uint8_t			next_id;
+	uint64_t		dropped_logged;	//!< Drops already reported.
+
+	uint64_t		sent;
+	uint64_t		acked;
+	uint64_t		retransmits;
+	uint64_t		timeouts;
+	uint64_t		dropped;	//!< Because the queue was full.
+
+	struct replicate_target	*next;
+} replicate_target_t;
+
+struct replicate_thread {
+	rlm_replicate_t		*inst;
+	pthread_t		thread;
+	int			pipe[2];	//!< Woken when packets are queued.
+	bool			running;
+};
+#endif
+
+struct rlm_replicate_t {
+	char const		*name;
+
+	uint32_t		queue_size;	//!< Packets queued per target.  0 sends from the request.
+	uint32_t		num_threads;
+	uint32_t		window;		//!< Unacknowledged packets per target.  0 doesn't wait for replies.
+	uint32_t		retry_delay;
+	uint32_t		retry_count;
+
+#if defined(WITH_PROXY) && defined(HAVE_PTHREAD_H)
+	bool			stop;
+	pthread_mutex_t		mutex;		//!< Protects the targets.
+	fr_hash_table_t		*target_hash;
+	replicate_target_t	*targets;
+	uint32_t		next_thread;
+	replicate_thread_t	*threads;
+#endif
+};
+
+static const CONF_PARSER module_config[] = {
+	{ "queue_size", FR_CONF_OFFSET(PW_TYPE_INTEGER, rlm_replicate_t, queue_size), "0" },
+	{ "threads", FR_CONF_OFFSET(PW_TYPE_INTEGER, rlm_replicate_t, num_threads), "1" },
+	{ "window", FR_CONF_OFFSET(PW_TYPE_INTEGER, rlm_replicate_t, window), "0" },
+	{ "retry_delay", FR_CONF_OFFSET(PW_TYPE_INTEGER, rlm_replicate_t, retry_delay), "1" },
+	{ "retry_count", FR_CONF_OFFSET(PW_TYPE_INTEGER, rlm_replicate_t, retry_count), "2" },
+	{ NULL, -1, 0, NULL, NULL }		/* end the list */
+};
+
+#if defined(WITH_PROXY) && defined(HAVE_PTHREAD_H)
+static uint32_t replicate_target_hash(void const *data)
+{
+	replicate_target_t const *target = data;
+
+	return fr_hash(&target->home, sizeof(target->home));
+}
+
+static int replicate_target_cmp(void const *one, void const *two)
+{
+	replicate_target_t const *a = one;
+	replicate_target_t const *b = two;
+
+	if (a->home < b->home) return -1;
+	if (a->home > b->home) return +1;
+	return 0;
+}
+
+static void *replicate_thread(void *arg);
+
+static void replicate_wake(replicate_thread_t *thread)
+{
+	if (write(thread->pipe[1], "", 1) < 0) {
+		/* Full, so it's going to wake up anyway */
+	}
+}
+
+/** Find the target for a home server, creating it if necessary
+ *
+ */
+static replicate_target_t *replicate_target_find(rlm_replicate_t *inst, home_server_t *home)
+{
+	replicate_target_t my_target, *target;
+	int flags;
+
+	my_target.home = home;
+
+	pthread_mutex_lock(&inst->mutex);
+	target = fr_hash_table_finddata(inst->target_hash, &my_target);
+	if (target) {
+		pthread_mutex_unlock(&inst->mutex);
+		return target;
+	}
+
+	target = talloc_zero(inst, replicate_target_t);
+	if (!target) goto error;
+
+	target->home = home;
+	target->next_id = fr_rand() & 0xff;
+
+	target->sockfd = fr_socket(&home->src_ipaddr, 0);
+	if (target->sockfd < 0) {
+		talloc_free(target);
+		goto error;
+	}
+
+	flags = fcntl(target->sockfd, F_GETFL, NULL);
+	if ((flags < 0) || (fcntl(target->sockfd, F_SETFL, flags | O_NONBLOCK) < 0)) {
+		fr_strerror_printf("Failed setting socket non-blocking: %s", fr_syserror(errno));
+		close(target->sockfd);
+		talloc_free(target);
+		goto error;
+	}
+
+	pthread_mutex_init(&target->mutex, NULL);
+
+	if (!fr_hash_table_insert(inst->target_hash, target)) {
+		fr_strerror_printf("Failed inserting target");
+		pthread_mutex_destroy(&target->mutex);
+		close(target->sockfd);
+		talloc_free(target);
+		goto error;
+	}
+
+	target->thread = &inst->threads[inst->next_thread++ % inst->num_threads];
+
+	/*
+	 *	The threads are started here instead of in
+	 *	mod_instantiate(), as the server may fork after
+	 *	the modules have been instantiated.
+	 */
+	if (!target->thread->running) {
+		int ret;
+
+		ret = pthread_create(&target->thread->thread, NULL, replicate_thread, target->thread);
+		if (ret != 0) {
+			fr_strerror_printf("Failed creating sender thread: %s", fr_syserror(ret));
+			fr_hash_table_delete(inst->target_hash, target);
+			pthread_mutex_destroy(&target->mutex);
+			close(target->sockfd);
+			talloc_free(target);
+			goto error;
+		}
+		target->thread->running = true;
+	}
+
+	/*
+	 *	Published last.  The senders walk the list without
+	 *	the mutex.
+	 */
+	target->next = inst->targets;
+	__atomic_store_n(&inst->targets, target, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&inst->mutex);
+
+	return target;
+
+error:
+	pthread_mutex_unlock(&inst->mutex);
+	return NULL;
+}
+
+/** Queue a copy of the packet for a home server
+ *
+ * @return 0 on success, -1 if the packet was dropped.
+ */
+static int replicate_enqueue(rlm_replicate_t *inst, REQUEST *request, RADIUS_PACKET *packet, home_server_t *home)
+{
+	replicate_target_t	*target;
+	replicate_entry_t	*entry;
+
+	target = replicate_target_find(inst, home);
+	if (!target) {
+		REDEBUG("Failed creating replication target: %s", fr_strerror());
+		return -1;
+	}
+
+	/*
+	 *	Cheap check first, so that a slow target doesn't cost
+	 *	us a copy of every packet.
+	 */
+	if (__atomic_load_n(&target->num_queued, __ATOMIC_RELAXED) >= inst->queue_size) goto drop;
+
+	entry = talloc_zero(NULL, replicate_entry_t);
+	if (!entry) return -1;
+
+	entry->packet = rad_alloc(entry, true);
+	if (!entry->packet) {
+		talloc_free(entry);
+		return -1;
+	}
+	entry->packet->code = packet->code;
+	if (packet->vps) {
+		entry->packet->vps = paircopy(entry->packet, packet->vps);
+		if (!entry->packet->vps) {
+			talloc_free(entry);
+			return -1;
+		}
+	}
+
+	pthread_mutex_lock(&target->mutex);
+	if (target->num_queued >= inst->queue_size) {
+		pthread_mutex_unlock(&target->mutex);
+		talloc_free(entry);
+		goto drop;
+	}
+
+	if (target->tail) {
+		target->tail->next = entry;
+	} else {
+		target->head = entry;
+	}
+	target->tail = entry;
+	target->num_queued++;
+	pthread_mutex_unlock(&target->mutex);
+
+	replicate_wake(target->thread);
+	return 0;
+
+drop:
+	__atomic_fetch_add(&target->dropped, 1, __ATOMIC_RELAXED);
+	RWDEBUG("Replication queue for home server %s is full.  Dropping packet", home->name);
+	return -1;
+}
+
+static void replicate_send(replicate_target_t *target, replicate_entry_t *entry,
+#ifdef WITH_RADIUS_BATCH
+			   rad_batch_t *batch,
+#endif
+			   struct timeval const *now)
+{
+	int rcode;
+
+#ifdef WITH_RADIUS_BATCH
+	rcode = rad_batch_send(batch, entry->packet, NULL, target->home->secret);
+#else
+	rcode = rad_send(entry->packet, NULL, target->home->secret);
+#endif
+	if (rcode < 0) {
+		DEBUG("rlm_replicate: Failed replicating packet to home server %s: %s",
+		      target->home->name, fr_strerror());
+	}
+
+	entry->sent = *now;
+	entry->tries++;
+}
+
+/** Read replies, and forget the packets they're for
+ *
+ */
+static void replicate_recv(replicate_target_t *target)
+{
+	RADIUS_PACKET		*reply;
+	replicate_entry_t	*entry;
+
+	while ((reply = rad_recv(target->sockfd, 0)) != NULL) {
+		entry = target->outstanding[reply->id];
+		if (entry && (fr_ipaddr_cmp(&reply->src_ipaddr, &target->home->ipaddr) == 0) &&
+		    (reply->src_port == target->home->port) &&
+		    (rad_verify(reply, entry->packet, target->home->secret) == 0)) {
+			target->outstanding[reply->id] = NULL;
+			target->num_outstanding--;
+			target->acked++;
+			talloc_free(entry);
+		}
+		rad_free(&reply);
+	}
+}
+
+/** Send what's queued for a target, and retransmit what hasn't been answered
+ *
+ * @return the earliest time at which a retransmission is due, in "when".
+ */
+static void replicate_service(rlm_replicate_t *inst, replicate_target_t *target,
+#ifdef WITH_RADIUS_BATCH
+			      rad_batch_t *batch,
+#endif
+			      struct timeval const *now, struct timeval *when)
+{
+	replicate_entry_t	*head, *entry;
+	uint32_t		i, max;
+	struct timeval		due;
+
+	/*
+	 *	Retransmit, or give up on, packets which haven't been
+	 *	answered.
+	 */
+	for (i = 0; (i < 256) && inst->window && target->num_outstanding; i++) {
+		entry = target->outstanding[i];
+		if (!entry) continue;
+
+		due = entry->sent;
+		due.tv_sec += inst->retry_delay;
+		if (timercmp(&due, now, >)) {
+			if (timercmp(&due, when, <)) *when = due;
+			continue;
+		}
+
+		if (entry->tries > inst->retry_count) {
+			target->outstanding[i] = NULL;
+			target->num_outstanding--;
+			target->timeouts++;
+			talloc_free(entry);
+			continue;
+		}
+
+		target->retransmits++;
+		replicate_send(target, entry,
+#ifdef WITH_RADIUS_BATCH
+			       batch,
+#endif
+			       now);
+
+		due = *now;
+		due.tv_sec += inst->retry_delay;
+		if (timercmp(&due, when, <)) *when = due;
+	}
+
+	/*
+	 *	Take as many packets off the queue as we can send.
+	 */
+	max = inst->window ? (inst->window - target->num_outstanding) : UINT32_MAX;
+	if (!max) return;
+
+	pthread_mutex_lock(&target->mutex);
+	head = target->head;
+	for (i = 0, entry = NULL; (i < max) && (i < target->num_queued); i++) {
+		entry = entry ? entry->next : head;
+	}
+	if (!entry) {
+		pthread_mutex_unlock(&target->mutex);
+		return;
+	}
+	target->head = entry->next;
+	if (!target->head) target->tail = NULL;
+	target->num_queued -= i;
+	entry->next = NULL;
+	pthread_mutex_unlock(&target->mutex);
+
+	while (head) {
+		entry = head;
+		head = entry->next;
+		entry->next = NULL;
+
+		if (inst->window) {
+			while (target->outstanding[target->next_id]) target->next_id++;
+		}
+
+		entry->packet->id = target->next_id++;
+		entry->packet->sockfd = target->sockfd;
+		entry->packet->dst_ipaddr = target->home->ipaddr;
+		entry->packet->dst_port = target->home->port;
+
+		replicate_send(target, entry,
+#ifdef WITH_RADIUS_BATCH
+			       batch,
+#endif
+			       now);
+		target->sent++;
+
+		if (!inst->window) {
+			talloc_free(entry);
+			continue;
+		}
+
+		target->outstanding[entry->packet->id] = entry;
+		target->num_outstanding++;
+
+		due = *now;
+		due.tv_sec += inst->retry_delay;
+		if (timercmp(&due, when, <)) *when = due;
+	}
+}
+
+static void *replicate_thread(void *arg)
+{
+	replicate_thread_t	*thread = arg;
+	rlm_replicate_t		*inst = thread->inst;
+	replicate_target_t	*target;
+	struct timeval		now, when, wait;
+	time_t			last_report = 0;
+	char			buffer[256];
+#ifdef WITH_RADIUS_BATCH
+	rad_batch_t		*batch;
+
+	batch = rad_batch_alloc(NULL, REPLICATE_BATCH_SIZE);
+	if (!batch) {
+		ERROR("rlm_replicate (%s): Failed allocating batch: %s", inst->name, fr_strerror());
+		return NULL;
+	}
+#endif
+
+	while (!__atomic_load_n(&inst->stop, __ATOMIC_ACQUIRE)) {
+		fd_set	fds;
+		int	maxfd;
+
+		FD_ZERO(&fds);
+		FD_SET(thread->pipe[0], &fds);
+		maxfd = thread->pipe[0];
+
+		gettimeofday(&now, NULL);
+		when = now;
+		when.tv_sec++;
+
+		for (target = __atomic_load_n(&inst->targets, __ATOMIC_ACQUIRE); target; target = target->next) {
+			if (target->thread != thread) continue;
+
+			replicate_service(inst, target,
+#ifdef WITH_RADIUS_BATCH
+					  batch,
+#endif
+					  &now, &when);
+
+			if (target->num_outstanding) {
+				FD_SET(target->sockfd, &fds);
+				if (target->sockfd > maxfd) maxfd = target->sockfd;
+			}
+		}
+#ifdef WITH_RADIUS_BATCH
+		rad_batch_flush(batch);
+#endif
+
+		/*
+		 *	Complain about slow targets, but not too often.
+		 */
+		if ((now.tv_sec - last_report) >= 10) {
+			last_report = now.tv_sec;
+
+			for (target = __atomic_load_n(&inst->targets, __ATOMIC_ACQUIRE); target; target = target->next) {
+				uint64_t dropped;
+
+				if (target->thread != thread) continue;
+
+				dropped = __atomic_load_n(&target->dropped, __ATOMIC_RELAXED);
+				if (dropped == target->dropped_logged) continue;
+
+				WARN("rlm_replicate (%s): Dropped %" PRIu64 " packets for home server %s, as it "
+				     "isn't keeping up", inst->name, dropped - target->dropped_logged,
+				     target->home->name);
+				target->dropped_logged = dropped;
+			}
+		}
+
+		if (timercmp(&when, &now, >)) {
+			timersub(&when, &now, &wait);
+		} else {
+			timerclear(&wait);
+		}
+
+		if (select(maxfd + 1, &fds, NULL, NULL, &wait) <= 0) continue;
+
+		if (FD_ISSET(thread->pipe[0], &fds)) {
+			while (read(thread->pipe[0], buffer, sizeof(buffer)) > 0);
+		}
+
+		for (target = __atomic_load_n(&inst->targets, __ATOMIC_ACQUIRE); target; target = target->next) {
+			if ((target->thread != thread) || !FD_ISSET(target->sockfd, &fds)) continue;
+
+			replicate_recv(target);
+		}
+	}
+
+#ifdef WITH_RADIUS_BATCH
+	talloc_free(batch);
+#endif
+
+	return NULL;
+}
+
+static int replicate_threads_init(rlm_replicate_t *inst)
+{
+	uint32_t i;
+
+	inst->target_hash = fr_hash_table_create(replicate_target_hash, replicate_target_cmp, NULL);
+	if (!inst->target_hash) {
+		ERROR("rlm_replicate (%s): Failed creating target table", inst->name);
+		return -1;
+	}
+	pthread_mutex_init(&inst->mutex, NULL);
+
+	inst->threads = talloc_zero_array(inst, replicate_thread_t, inst->num_threads);
+	if (!inst->threads) return -1;
+
+	for (i = 0; i < inst->num_threads; i++) {
+		replicate_thread_t *thread = &inst->threads[i];
+		int j;
+
+		thread->inst = inst;
+		thread->pipe[0] = thread->pipe[1] = -1;
+		if (pipe(thread->pipe) < 0) {
+			ERROR("rlm_replicate (%s): Failed creating pipe: %s", inst->name, fr_syserror(errno));
+			return -1;
+		}
+
+		for (j = 0; j < 2; j++) {
+			int flags = fcntl(thread->pipe[j], F_GETFL, NULL);
+
+			if (flags >= 0) (void) fcntl(thread->pipe[j], F_SETFL, flags | O_NONBLOCK);
+		}
+
+	}
+
+	return 0;
+}
+
+static void replicate_threads_stop(rlm_replicate_t *inst)
+{
+	replicate_target_t	*target;
+	replicate_entry_t	*entry;
+	uint32_t		i;
+
+	__atomic_store_n(&inst->stop, true, __ATOMIC_RELEASE);
+
+	for (i = 0; inst->threads && (i < inst->num_threads); i++) {
+		replicate_thread_t *thread = &inst->threads[i];
+
+		if (thread->running) {
+			replicate_wake(thread);
+			pthread_join(thread->thread, NULL);
+		}
+		if (thread->pipe[0] >= 0) close(thread->pipe[0]);
+		if (thread->pipe[1] >= 0) close(thread->pipe[1]);
+	}
+
+	for (target = inst->targets; target; target = target->next) {
+		DEBUG("rlm_replicate (%s): home server %s: sent %" PRIu64 ", acknowledged %" PRIu64
+		      ", retransmitted %" PRIu64 ", timed out %" PRIu64 ", dropped %" PRIu64,
+		      inst->name, target->home->name, target->sent, target->acked,
+		      target->retransmits, target->timeouts, target->dropped);
+
+		while ((entry = target->head) != NULL) {
+			target->head = entry->next;
+			talloc_free(entry);
+		}
+		for (i = 0; i < 256; i++) talloc_free(target->outstanding[i]);
+
+		close(target->sockfd);
+		pthread_mutex_destroy(&target->mutex);
+	}
+
+	if (inst->target_hash) {
+		fr_hash_table_free(inst->target_hash);
+		pthread_mutex_destroy(&inst->mutex);
+	}
+}
+#endif
+
+static int mod_instantiate(CONF_SECTION *conf, void *instance)
+{
+	rlm_replicate_t *inst = instance;
+
+	inst->name = cf_section_name2(conf);
+	if (!inst->name) inst->name = cf_section_name1(conf);
+
+	if (!inst->queue_size) return 0;
+
+#if defined(WITH_PROXY) && defined(HAVE_PTHREAD_H)
+	if ((inst->num_threads == 0) || (inst->num_threads > REPLICATE_MAX_THREADS)) {
+		cf_log_err_cs(conf, "'threads' must be between 1 and %d", REPLICATE_MAX_THREADS);
+		return -1;
+	}
+
+	if (inst->window > 256) {
+		cf_log_err_cs(conf, "'window' must be no more than 256");
+		return -1;
+	}
+
+	if (inst->window && !inst->retry_delay) {
+		cf_log_err_cs(conf, "'retry_delay' must be at least 1");
+		return -1;
+	}
+
+	return replicate_threads_init(inst);
+#else
+	cf_log_err_cs(conf, "'queue_size' requires threads");
+	return -1;
+#endif
+}
+
+static int mod_detach(UNUSED void *instance)
+{
+#if defined(WITH_PROXY) && defined(HAVE_PTHREAD_H)
+	rlm_replicate_t *inst = instance;
+
+	if (inst->queue_size) replicate_threads_stop(inst);
+#endif
+
+	return 0;
+}
+
 #ifdef WITH_PROXY
 
 /** Allocate a request packet
@@ -102,6 +735,9 @@ error:
  */
 static rlm_rcode_t replicate_packet(UNUSED void *instance, REQUEST *request, pair_lists_t list, PW_CODE code)
 {
+#ifdef HAVE_PTHREAD_H
+	rlm_replicate_t *inst = instance;
+#endif
 	int rcode;
 	bool pass1 = true;
 
@@ -169,6 +805,18 @@ static rlm_rcode_t replicate_packet(UNUSED void *instance, REQUEST *request, pai
 			continue;
 		}
 
+#ifdef HAVE_PTHREAD_H
+		/*
+		 *	Leave it to the sender threads.
+		 */
+		if (inst->queue_size) {
+			RDEBUG("Queueing list '%s' for replication to Realm '%s'",
+			       fr_int2str(pair_lists, list, "<INVALID>"), realm->name);
+			if (replicate_enqueue(inst, request, packet, home) == 0) rcode = RLM_MODULE_OK;
+			continue;
+		}
+#endif
+
 		/*
 		 *	For replication to multiple servers we re-use the packet
 		 *	we built here.
@@ -271,10 +919,10 @@ module_t rlm_replicate = {
 	RLM_MODULE_INIT,
 	"replicate",
 	RLM_TYPE_THREAD_SAFE,		/* type */
-	0,
-	NULL,				/* CONF_PARSER */
-	NULL,				/* instantiation */
-	NULL,				/* detach */
+	sizeof(rlm_replicate_t),
+	module_config,
+	mod_instantiate,		/* instantiation */
+	mod_detach,			/* detach */
 	{
 		NULL,			/* authentication */
 		mod_authorize,		/* authorization */
@@ -293,4 +941,8 @@ module_t rlm_replicate = {
 		NULL
 #endif
 	},
+	0,				/* thread_inst_size */
+	NULL,				/* thread_instantiate */
+	NULL,				/* thread_detach */
+	NULL				/* cache_flush */
 };
@@ -0,0 +1,550 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ *
+ * @brief Cache of authorize responses.
+ * @file cache.c
+ *
+ * Entries are found by the method, the expanded URI and a hash of the body
+ * of the request, and hold the VALUE_PAIRs the response was decoded into,
+ * and the module return code.  Responses are cached for as long as their
+ * Cache-Control header allows.  Stale responses with an ETag are revalidated
+ * with If-None-Match, and re-used if the server says they're unmodified.
+ *
+ * @copyright 2016 The FreeRADIUS Server Project.
+ */
+RCSID("$Id$")
+
+#include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/rad_assert.h>
+
+#include "rest.h"
+
+#ifdef HAVE_PTHREAD_H
+#  define CACHE_LOCK(_inst)	pthread_mutex_lock(&(_inst)->cache_mutex)
+#  define CACHE_UNLOCK(_inst)	pthread_mutex_unlock(&(_inst)->cache_mutex)
+#else
+#  define CACHE_LOCK(_inst)
+#  define CACHE_UNLOCK(_inst)
+#endif
+
+/** A decoded response
+ *
+ */
+struct rest_cache_entry {
+	char const		*key;		//!< Method, URI and body hash.
+	char const		*uri;		//!< Expanded URI, for flushing.
+	time_t			expires;	//!< When the response becomes stale.
+	time_t			removes;	//!< When the entry is removed from the cache.
+	int			heap_id;	//!< Position in the removal heap.
+
+	rlm_rcode_t		rcode;		//!< What authorize returned.
+	char const		*etag;		//!< To revalidate with, may be NULL.
+	rest_cache_pair_t	*pairs;		//!< Decoded VALUE_PAIRs.
+	int			num_pairs;
+};
+
+static int rest_cache_cmp(void const *one, void const *two)
+{
+	rest_cache_entry_t const *a = one;
+	rest_cache_entry_t const *b = two;
+
+	return strcmp(a->key, b->key);
+}
+
+static int rest_cache_heap_cmp(void const *one, void const *two)
+{
+	rest_cache_entry_t const *a = one;
+	rest_cache_entry_t const *b = two;
+
+	if (a->removes < b->removes) return -1;
+	if (a->removes > b->removes) return +1;
+
+	return 0;
+}
+
+/** Remove an entry from the cache, and free it
+ *
+ * Must be called with the cache mutex held.
+ */
+static void rest_cache_remove(rlm_rest_t *inst, rest_cache_entry_t *entry)
+{
+	fr_heap_extract(inst->cache_heap, entry);
+	rbtree_deletebydata(inst->cache, entry);
+	talloc_free(entry);
+}
+
+/** Remove entries which are past their removal time
+ *
+ * Must be called with the cache mutex held.
+ */
+static void rest_cache_expire(rlm_rest_t *inst, time_t now)
+{
+	rest_cache_entry_t *entry;
+
+	while ((entry = fr_heap_peek(inst->cache_heap)) && (entry->removes <= now)) {
+		rest_cache_remove(inst, entry);
+	}
+}
+
+/** Add the cached VALUE_PAIRs to the request
+ *
+ * The pairs are added to the same lists, in the same way, as the decoders
+ * added them.
+ */
+static void rest_cache_apply(REQUEST *request, rest_cache_entry_t const *entry)
+{
+	int		i;
+	REQUEST		*current;
+	VALUE_PAIR	**vps, *vp;
+	TALLOC_CTX	*ctx;
+
+	for (i = 0; i < entry->num_pairs; i++) {
+		rest_cache_pair_t const *pair = &entry->pairs[i];
+
+		current = request;
+		if (radius_request(&current, pair->request) < 0) continue;
+
+		vps = radius_list(current, pair->list);
+		if (!vps) continue;
+		ctx = radius_list_ctx(current, pair->list);
+
+		vp = paircopyvp(ctx, pair->vp);
+		if (!vp) continue;
+
+		debug_pair(vp);
+		if (pair->move) {
+			radius_pairmove(current, vps, vp, false);
+		} else {
+			pairadd(vps, vp);
+		}
+	}
+}
+
+/** Create the cache
+ *
+ * @param[in] instance rlm_rest configuration.
+ * @return 0 on success, -1 on error.
+ */
+int rest_cache_init(rlm_rest_t *instance)
+{
+#ifdef HAVE_PTHREAD_H
+	if (pthread_mutex_init(&instance->cache_mutex, NULL) < 0) {
+		ERROR("rlm_rest (%s): Failed initializing cache mutex: %s",
+		      instance->xlat_name, fr_syserror(errno));
+		return -1;
+	}
+#endif
+
+	instance->cache = rbtree_create(NULL, rest_cache_cmp, NULL, 0);
+	if (!instance->cache) {
+		ERROR("rlm_rest (%s): Failed creating cache", instance->xlat_name);
+		return -1;
+	}
+
+	instance->cache_heap = fr_heap_create(rest_cache_heap_cmp, offsetof(rest_cache_entry_t, heap_id));
+	if (!instance->cache_heap) {
+		ERROR("rlm_rest (%s): Failed creating heap for the cache", instance->xlat_name);
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Free the cache, and all of the entries in it
+ *
+ * @param[in] instance rlm_rest configuration.
+ */
+void rest_cache_free(rlm_rest_t *instance)
+{
+	rest_cache_entry_t *entry;
+
+	if (!instance->cache) return;
+
+	if (instance->cache_heap) {
+		while ((entry = fr_heap_peek(instance->cache_heap))) rest_cache_remove(instance, entry);
+		fr_heap_delete(instance->cache_heap);
+		instance->cache_heap = NULL;
+	}
+
+	rbtree_free(instance->cache);
+	instance->cache = NULL;
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_destroy(&instance->cache_mutex);
+#endif
+}
+
+/** Build the cache key for a configured request
+ *
+ * The body is only available if it's sent in one go (chunk = 0).
+ *
+ * @param[in] request Current request.  The key is parented by it.
+ * @param[in] handle configured with rest_request_config.
+ * @param[in] method of the request.
+ * @param[in] uri the request is sent to.
+ * @return the key, or NULL on error.
+ */
+char *rest_cache_key(REQUEST *request, void *handle, http_method_t method, char const *uri)
+{
+	rlm_rest_handle_t	*randle = handle;
+	rlm_rest_curl_context_t	*ctx = randle->ctx;
+	uint8_t			digest[16];
+	char			hash[(sizeof(digest) * 2) + 1];
+
+	hash[0] = '\0';
+	if (ctx->body && ctx->body_len) {
+		fr_md5_calc(digest, (uint8_t const *) ctx->body, ctx->body_len);
+		fr_bin2hex(hash, digest, sizeof(digest));
+	}
+
+	return talloc_asprintf(request, "%s %s\n%s", fr_int2str(http_method_table, method, "<UNKNOWN>"), uri, hash);
+}
+
+/** Find a cached response
+ *
+ * If the response is fresh, its VALUE_PAIRs are added to the request.  If it's
+ * stale and has an ETag, If-None-Match is added to the request, and a copy of
+ * the entry is returned, to be used if the server says it's unmodified.
+ *
+ * @param[in] instance rlm_rest configuration.
+ * @param[in] request Current request.
+ * @param[in] handle configured with rest_request_config.
+ * @param[in] key from rest_cache_key.
+ * @param[out] stale Where to write the copy of a stale entry.  Parented by the request.
+ * @param[out] rcode Where to write the cached return code, if the response was fresh.
+ * @return 1 if the response was fresh, 0 if it's being revalidated, -1 if the request should be sent.
+ */
+int rest_cache_find(rlm_rest_t *instance, REQUEST *request, void *handle, char const *key,
+		    rest_cache_entry_t **stale, rlm_rcode_t *rcode)
+{
+	rest_cache_entry_t	*entry, my_entry, *copy;
+	char			header[REST_ETAG_MAX_LEN + 32];
+	int			i;
+
+	*stale = NULL;
+	my_entry.key = key;
+
+	CACHE_LOCK(instance);
+	rest_cache_expire(instance, request->timestamp);
+
+	entry = rbtree_finddata(instance->cache, &my_entry);
+	if (!entry) {
+		instance->cache_misses++;
+		CACHE_UNLOCK(instance);
+		return -1;
+	}
+
+	if (entry->expires > request->timestamp) {
+		instance->cache_hits++;
+		RDEBUG("Using cached response (expires in %i seconds)", (int) (entry->expires - request->timestamp));
+		*rcode = entry->rcode;
+		rest_cache_apply(request, entry);
+		CACHE_UNLOCK(instance);
+		return 1;
+	}
+
+	/*
+	 *	Only entries with an ETag outlive their expiry.
+	 */
+	rad_assert(entry->etag);
+
+	copy = talloc_zero(request, rest_cache_entry_t);
+	if (!copy) goto error;
+
+	copy->key = talloc_typed_strdup(copy, entry->key);
+	copy->uri = talloc_typed_strdup(copy, entry->uri);
+	copy->rcode = entry->rcode;
+	copy->etag = talloc_typed_strdup(copy, entry->etag);
+	copy->num_pairs = entry->num_pairs;
+	if (entry->num_pairs) {
+		copy->pairs = talloc_array(copy, rest_cache_pair_t, entry->num_pairs);
+		if (!copy->pairs) goto error;
+
+		for (i = 0; i < entry->num_pairs; i++) {
+			copy->pairs[i] = entry->pairs[i];
+			copy->pairs[i].vp = paircopyvp(copy->pairs, entry->pairs[i].vp);
+			if (!copy->pairs[i].vp) goto error;
+		}
+	}
+	instance->cache_misses++;
+	CACHE_UNLOCK(instance);
+
+	RDEBUG("Cached response is stale, revalidating");
+
+	snprintf(header, sizeof(header), "If-None-Match: %s", copy->etag);
+	if (rest_request_header_add(request, handle, header) < 0) {
+		talloc_free(copy);
+		return -1;
+	}
+
+	*stale = copy;
+	return 0;
+
+error:
+	instance->cache_misses++;
+	CACHE_UNLOCK(instance);
+	talloc_free(copy);
+
+	return -1;
+}
+
+/** Work out how long a response may be cached for
+ *
+ * @return the number of seconds, 0 if the response must be revalidated before it's used, or
+ *	-1 if it mustn't be cached.
+ */
+static int rest_cache_lifetime(rlm_rest_t *instance, rlm_rest_response_t const *response)
+{
+	if (response->no_store) return -1;
+	if (response->no_cache) return 0;
+
+	if (response->max_age >= 0) {
+		if ((uint32_t) response->max_age > instance->cache_max_ttl) return instance->cache_max_ttl;
+
+		return response->max_age;
+	}
+
+	return instance->cache_ttl;
+}
+
+/** Put an entry into the cache, replacing any entry with the same key
+ *
+ * The cache takes ownership of the entry, which is freed if it can't be added.
+ */
+static void rest_cache_insert(rlm_rest_t *instance, REQUEST *request, rest_cache_entry_t *entry, int lifetime)
+{
+	rest_cache_entry_t *old;
+
+	entry->expires = request->timestamp + lifetime;
+	entry->removes = entry->expires + (entry->etag ? instance->cache_max_ttl : 0);
+
+	CACHE_LOCK(instance);
+	rest_cache_expire(instance, request->timestamp);
+
+	old = rbtree_finddata(instance->cache, entry);
+	if (old) rest_cache_remove(instance, old);
+
+	/*
+	 *	Make room by removing the entry which would be
+	 *	removed soonest.
+	 */
+	if (rbtree_num_elements(instance->cache) >= instance->cache_max_entries) {
+		old = fr_heap_peek(instance->cache_heap);
+		if (old) rest_cache_remove(instance, old);
+	}
+
+	if (!rbtree_insert(instance->cache, entry)) {
+		RWDEBUG("Failed adding response to the cache");
+		talloc_free(entry);
+	} else if (!fr_heap_insert(instance->cache_heap, entry)) {
+		RWDEBUG("Failed adding response to the cache");
+		rbtree_deletebydata(instance->cache, entry);
+		talloc_free(entry);
+	}
+	CACHE_UNLOCK(instance);
+}
+
+/** Discard the entry with a given key
+ *
+ */
+static void rest_cache_invalidate(rlm_rest_t *instance, char const *key)
+{
+	rest_cache_entry_t *entry, my_entry;
+
+	my_entry.key = key;
+
+	CACHE_LOCK(instance);
+	entry = rbtree_finddata(instance->cache, &my_entry);
+	if (entry) rest_cache_remove(instance, entry);
+	CACHE_UNLOCK(instance);
+}
+
+/** Use a stale response the server said was unmodified
+ *
+ * The entry is put back into the cache, with a lifetime taken from the 304
+ * response, and its VALUE_PAIRs are added to the request.
+ *
+ * @param[in] instance rlm_rest configuration.
+ * @param[in] request Current request.
+ * @param[in] handle the 304 response was received on.
+ * @param[in] stale from rest_cache_find.
+ * @return the cached return code.
+ */
+rlm_rcode_t rest_cache_revalidated(rlm_rest_t *instance, REQUEST *request, void *handle,
+				   rest_cache_entry_t *stale)
+{
+	rlm_rest_handle_t	*randle = handle;
+	rlm_rcode_t		rcode = stale->rcode;
+	int			lifetime;
+
+	RDEBUG("Server says cached response is unmodified");
+	rest_cache_apply(request, stale);
+
+	CACHE_LOCK(instance);
+	instance->cache_revalidated++;
+	CACHE_UNLOCK(instance);
+
+	lifetime = rest_cache_lifetime(instance, &randle->ctx->response);
+	if (lifetime < 0) {
+		rest_cache_invalidate(instance, stale->key);
+		talloc_free(stale);
+		return rcode;
+	}
+
+	rest_cache_insert(instance, request, talloc_steal(NULL, stale), lifetime);
+
+	return rcode;
+}
+
+/** Cache a decoded response
+ *
+ * Only successful responses, and "not found" responses, are cached.
+ *
+ * @param[in] instance rlm_rest configuration.
+ * @param[in] request Current request.
+ * @param[in] handle the response was received and decoded on.
+ * @param[in] key from rest_cache_key.
+ * @param[in] rcode authorize is returning.
+ */
+void rest_cache_store(rlm_rest_t *instance, REQUEST *request, void *handle, char const *key, rlm_rcode_t rcode)
+{
+	rlm_rest_handle_t	*randle = handle;
+	rlm_rest_response_t	*response = &randle->ctx->response;
+	rest_cache_entry_t	*entry;
+	char const		*p, *q;
+	int			lifetime;
+
+	switch (rcode) {
+	case RLM_MODULE_OK:
+	case RLM_MODULE_UPDATED:
+	case RLM_MODULE_NOTFOUND:
+		break;
+
+	default:
+		return;
+	}
+
+	lifetime = rest_cache_lifetime(instance, response);
+	if ((lifetime < 0) || ((lifetime == 0) && !response->etag[0])) {
+		RDEBUG2("Response can't be cached");
+		rest_cache_invalidate(instance, key);
+		return;
+	}
+
+	entry = talloc_zero(NULL, rest_cache_entry_t);
+	if (!entry) return;
+
+	entry->key = talloc_typed_strdup(entry, key);
+
+	p = strchr(key, ' ');
+	q = strchr(key, '\n');
+	if (p && q && (q > p)) entry->uri = talloc_strndup(entry, p + 1, q - (p + 1));
+
+	entry->rcode = rcode;
+	if (response->etag[0]) entry->etag = talloc_typed_strdup(entry, response->etag);
+
+	if (response->num_captured) {
+		entry->pairs = talloc_steal(entry, response->captured);
+		entry->num_pairs = response->num_captured;
+		response->captured = NULL;
+		response->num_captured = 0;
+	}
+
+	RDEBUG2("Caching response for %i seconds", lifetime);
+	rest_cache_insert(instance, request, entry, lifetime);
+}
+
+typedef struct rest_cache_flush {
+	fr_heap_t	*heap;
+	char const	*uri;
+	int		count;
+} rest_cache_flush_t;
+
+static int rest_cache_flush_walk(void *ctx, void *data)
+{
+	rest_cache_flush_t	*flush = ctx;
+	rest_cache_entry_t	*entry = data;
+
+	if (flush->uri && (!entry->uri || (strcmp(entry->uri, flush->uri) != 0))) return 0;
+
+	fr_heap_extract(flush->heap, entry);
+	talloc_free(entry);
+	flush->count++;
+
+	return 2;	/* Delete and continue */
+}
+
+/** Discard cached responses
+ *
+ * Called by "radmin flush module <module> [<key>]".
+ *
+ * @param[in] instance rlm_rest configuration.
+ * @param[in] key URI of the responses to discard, or NULL to discard all entries.
+ * @return the number of entries discarded.
+ */
+int rest_cache_flush(void *instance, char const *key)
+{
+	rlm_rest_t		*inst = instance;
+	rest_cache_flush_t	flush;
+
+	if (!inst->cache) return 0;
+
+	flush.heap = inst->cache_heap;
+	flush.uri = key;
+	flush.count = 0;
+
+	CACHE_LOCK(inst);
+	rbtree_walk(inst->cache, RBTREE_DELETE_ORDER, rest_cache_flush_walk, &flush);
+	INFO("rlm_rest (%s): Flushed %i cached responses (hits %" PRIu64 ", misses %" PRIu64
+	     ", revalidated %" PRIu64 ")", inst->xlat_name, flush.count,
+	     inst->cache_hits, inst->cache_misses, inst->cache_revalidated);
+	CACHE_UNLOCK(inst);
+
+	return flush.count;
+}
+
+/** Return cache statistics
+ *
+ * %{<inst>_cache:hits}, %{<inst>_cache:misses}, %{<inst>_cache:revalidated}
+ * or %{<inst>_cache:entries}.
+ */
+ssize_t rest_cache_xlat(void *instance, REQUEST *request, char const *fmt, char *out, size_t freespace)
+{
+	rlm_rest_t	*inst = instance;
+	uint64_t	value;
+
+	CACHE_LOCK(inst);
+	if (strcmp(fmt, "hits") == 0) {
+		value = inst->cache_hits;
+	} else if (strcmp(fmt, "misses") == 0) {
+		value = inst->cache_misses;
+	} else if (strcmp(fmt, "revalidated") == 0) {
+		value = inst->cache_revalidated;
+	} else if (strcmp(fmt, "entries") == 0) {
+		value = rbtree_num_elements(inst->cache);
+	} else {
+		CACHE_UNLOCK(inst);
+		REDEBUG("Unknown cache statistic \"%s\"", fmt);
+		*out = '\0';
+		return -1;
+	}
+	CACHE_UNLOCK(inst);
+
+	return snprintf(out, freespace, "%" PRIu64, value);
+}
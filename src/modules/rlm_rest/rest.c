@@ -52,11 +52,7 @@ const http_body_type_t http_body_type_supported[HTTP_BODY_NUM_ENTRIES] = {
 	HTTP_BODY_CUSTOM_XLAT,		// HTTP_BODY_CUSTOM_XLAT
 	HTTP_BODY_CUSTOM_LITERAL,	// HTTP_BODY_CUSTOM_LITERAL
 	HTTP_BODY_POST,			// HTTP_BODY_POST
-#ifdef HAVE_JSON
 	HTTP_BODY_JSON,			// HTTP_BODY_JSON
-#else
-	HTTP_BODY_UNAVAILABLE,
-#endif
 	HTTP_BODY_UNSUPPORTED,		// HTTP_BODY_XML
 	HTTP_BODY_UNSUPPORTED,		// HTTP_BODY_YAML
 	HTTP_BODY_INVALID,		// HTTP_BODY_HTML
@@ -209,14 +205,13 @@ typedef struct rest_custom_data {
 	char const *p;		//!< how much text we've sent so far.
 } rest_custom_data_t;
 
-#ifdef HAVE_JSON
 /** Flags to control the conversion of JSON values to VALUE_PAIRs.
  *
  * These fields are set when parsing the expanded format for value pairs in
- * JSON, and control how json_pairmake_leaf and json_pairmake convert the JSON
- * value, and move the new VALUE_PAIR into an attribute list.
+ * JSON, and control how json_pairmake_leaf and rest_decode_json convert the
+ * JSON value, and move the new VALUE_PAIR into an attribute list.
  *
- * @see json_pairmake
+ * @see rest_decode_json
  * @see json_pairmake_leaf
  */
 typedef struct json_flags {
@@ -226,7 +221,69 @@ typedef struct json_flags {
 	FR_TOKEN op;		//!< The operator that determines how the new VP
 				// is processed. @see fr_tokens
 } json_flags_t;
-#endif
+
+/** An attribute declaration from a JSON response, waiting to become VALUE_PAIRs.
+ *
+ * Values are stored one after another, \0 terminated, in the decoder's value
+ * buffer.
+ */
+typedef struct json_attr {
+	size_t			name;		//!< Offset of the attribute name in the value buffer.
+	DICT_ATTR const		*da;		//!< NULL if the attribute is unknown, and must
+						//!< be resolved again from its name.
+	request_refs_t		request;
+	pair_lists_t		list;
+	json_flags_t		flags;
+
+	size_t			value;		//!< Offset of the first value in the value buffer.
+	int			count;		//!< Number of values.
+} json_attr_t;
+
+typedef enum {
+	JSON_DECODE_ATTR = 0,			//!< Expecting an attribute name.
+	JSON_DECODE_VALUE,			//!< Expecting the value of an attribute.
+	JSON_DECODE_ARRAY,			//!< Processing an array of values.
+	JSON_DECODE_EXPANDED,			//!< Expecting a key of the expanded format.
+	JSON_DECODE_OP,				//!< Expecting the value of "op".
+	JSON_DECODE_DO_XLAT,			//!< Expecting the value of "do_xlat".
+	JSON_DECODE_IS_JSON,			//!< Expecting the value of "is_json".
+	JSON_DECODE_EXPANDED_VALUE		//!< Expecting the value of "value".
+} json_decode_state_t;
+
+/** Incremental JSON response decoder
+ *
+ * Fed from rest_response_body as the body arrives.  Attribute names are
+ * resolved as they're seen, the values of unknown attributes are skipped,
+ * and the values of known attributes are staged in the value buffer.
+ * The staged attributes are converted to VALUE_PAIRs by rest_decode_json,
+ * once the server has decided what to do with the response.
+ *
+ * One decoder belongs to each connection handle, and is re-used.
+ */
+typedef struct rest_json_decoder {
+	REQUEST			*request;	//!< Current request.
+	fr_json_parser_t	*parser;
+
+	json_decode_state_t	state;
+	int			array_depth;	//!< Depth of the values in the current array.
+	bool			has_value;	//!< Expanded format had a "value" key.
+	bool			invalid;	//!< Current attribute will be discarded.
+	bool			at_max;		//!< Values were discarded because of
+						//!< REST_BODY_MAX_ATTRS.
+	bool			malformed;	//!< The parser returned an error.
+	char			error[128];	//!< Parser error message.
+
+	json_attr_t		*attrs;		//!< Staged attributes.
+	int			num_attrs;
+	int			max_attrs;	//!< Space allocated for attrs.
+	int			num_values;	//!< Across all attributes.
+
+	char			*buffer;	//!< Value buffer.
+	size_t			used;
+	size_t			alloc;
+} rest_json_decoder_t;
+
+static rest_json_decoder_t *rest_json_decoder_alloc(TALLOC_CTX *ctx);
 
 /** Initialises libcurl.
  *
@@ -287,6 +344,261 @@ void rest_cleanup(void)
 	curl_global_cleanup();
 }
 
+/*
+ *	A transfer queued by a thread, which waits until the driver has
+ *	performed it.
+ */
+struct rest_transfer {
+	CURL			*candle;	//!< Easy handle to perform.
+	CURLcode		ret;		//!< Result of the transfer.
+	bool			done;		//!< The transfer has completed.
+	rest_transfer_t		*next;
+};
+
+#ifdef HAVE_PTHREAD_H
+/** Hand the result of a transfer back to the thread waiting for it
+ *
+ */
+static void rest_multi_done(rest_multi_t *multi, rest_transfer_t *transfer, CURLcode ret)
+{
+	pthread_mutex_lock(&multi->mutex);
+	transfer->ret = ret;
+	transfer->done = true;
+	pthread_cond_broadcast(&multi->cond);
+	pthread_mutex_unlock(&multi->mutex);
+}
+
+/** Drive the shared multi handle
+ *
+ * Adds any transfers which have been queued, lets libcurl make progress on
+ * all of them, then waits for activity on their sockets, or for more
+ * transfers to be queued.
+ */
+static void *rest_multi_driver(void *arg)
+{
+	rlm_rest_t		*inst = arg;
+	rest_multi_t		*multi = inst->multi;
+	rest_transfer_t		*transfer, *next;
+	struct curl_waitfd	wake;
+	CURLMsg			*msg;
+	CURLMcode		mret;
+	CURLcode		ret;
+	char			*private;
+	char			buffer[64];
+	int			running, left, numfds;
+
+	wake.fd = multi->wake[0];
+	wake.events = CURL_WAIT_POLLIN;
+
+	while (true) {
+		pthread_mutex_lock(&multi->mutex);
+		if (multi->exiting) {
+			pthread_mutex_unlock(&multi->mutex);
+			break;
+		}
+		transfer = multi->pending;
+		multi->pending = NULL;
+		pthread_mutex_unlock(&multi->mutex);
+
+		for (; transfer; transfer = next) {
+			next = transfer->next;
+
+			mret = curl_multi_add_handle(multi->mandle, transfer->candle);
+			if (mret != CURLM_OK) {
+				ERROR("rlm_rest (%s): Failed adding transfer: %s", inst->xlat_name,
+				      curl_multi_strerror(mret));
+				rest_multi_done(multi, transfer, CURLE_FAILED_INIT);
+			}
+		}
+
+		curl_multi_perform(multi->mandle, &running);
+
+		while ((msg = curl_multi_info_read(multi->mandle, &left))) {
+			if (msg->msg != CURLMSG_DONE) continue;
+
+			/*
+			 *	msg is invalid once the handle is removed.
+			 */
+			ret = msg->data.result;
+			curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &private);
+			curl_multi_remove_handle(multi->mandle, msg->easy_handle);
+
+			rest_multi_done(multi, (rest_transfer_t *) private, ret);
+		}
+
+		wake.revents = 0;
+		curl_multi_wait(multi->mandle, &wake, 1, 1000, &numfds);
+		if (wake.revents) {
+			while (read(multi->wake[0], buffer, sizeof(buffer)) > 0);
+		}
+	}
+
+	return NULL;
+}
+
+/** Queue a transfer for the driver, and wait for it to complete
+ *
+ */
+static CURLcode rest_multi_perform(rlm_rest_t *inst, REQUEST *request, CURL *candle)
+{
+	rest_multi_t	*multi = inst->multi;
+	rest_transfer_t	transfer;
+	CURLcode	ret;
+	int		rcode;
+
+	memset(&transfer, 0, sizeof(transfer));
+	transfer.candle = candle;
+
+	ret = curl_easy_setopt(candle, CURLOPT_PRIVATE, &transfer);
+	if (ret != CURLE_OK) return ret;
+
+	pthread_mutex_lock(&multi->mutex);
+
+	/*
+	 *	The driver is started here instead of in
+	 *	mod_instantiate(), as the server may fork after
+	 *	the modules have been instantiated.
+	 */
+	if (!multi->running) {
+		rcode = pthread_create(&multi->driver, NULL, rest_multi_driver, inst);
+		if (rcode != 0) {
+			pthread_mutex_unlock(&multi->mutex);
+			REDEBUG("Failed creating driver thread: %s", fr_syserror(rcode));
+			return CURLE_FAILED_INIT;
+		}
+		multi->running = true;
+	}
+
+	transfer.next = multi->pending;
+	multi->pending = &transfer;
+	pthread_mutex_unlock(&multi->mutex);
+
+	/*
+	 *	If the pipe is full, the driver has been woken already.
+	 */
+	if ((write(multi->wake[1], "", 1) < 0) && (errno != EAGAIN)) {
+		RWDEBUG("Failed waking driver thread: %s", fr_syserror(errno));
+	}
+
+	pthread_mutex_lock(&multi->mutex);
+	while (!transfer.done) pthread_cond_wait(&multi->cond, &multi->mutex);
+	pthread_mutex_unlock(&multi->mutex);
+
+	return transfer.ret;
+}
+#endif
+
+/** Creates the multi handle shared by all threads
+ *
+ * @param[in] instance configuration data.
+ * @return 0 on success, -1 on error.
+ */
+int rest_multi_init(rlm_rest_t *instance)
+{
+#ifdef HAVE_PTHREAD_H
+	rest_multi_t	*multi;
+	CURLMcode	mret;
+	curl_version_info_data *curlversion;
+
+	multi = talloc_zero(instance, rest_multi_t);
+	multi->wake[0] = multi->wake[1] = -1;
+	instance->multi = multi;
+
+	multi->mandle = curl_multi_init();
+	if (!multi->mandle) {
+		ERROR("rlm_rest (%s): Failed to create CURL multi handle", instance->xlat_name);
+		return -1;
+	}
+
+#ifdef CURLPIPE_MULTIPLEX
+	mret = curl_multi_setopt(multi->mandle, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+	if (mret != CURLM_OK) {
+		ERROR("rlm_rest (%s): Failed enabling multiplexing: %s", instance->xlat_name,
+		      curl_multi_strerror(mret));
+		return -1;
+	}
+#endif
+
+	if (instance->max_host_connections) {
+		mret = curl_multi_setopt(multi->mandle, CURLMOPT_MAX_HOST_CONNECTIONS,
+					 (long) instance->max_host_connections);
+		if (mret != CURLM_OK) {
+			ERROR("rlm_rest (%s): Failed setting max_host_connections: %s", instance->xlat_name,
+			      curl_multi_strerror(mret));
+			return -1;
+		}
+	}
+
+	curlversion = curl_version_info(CURLVERSION_NOW);
+#ifdef CURL_VERSION_HTTP2
+	if (curlversion->features & CURL_VERSION_HTTP2) {
+		DEBUG("rlm_rest (%s): Transfers will be multiplexed over HTTP/2 where the server supports it",
+		      instance->xlat_name);
+	} else
+#endif
+	{
+		WARN("rlm_rest (%s): libcurl %s does not support HTTP/2, transfers will share connections "
+		     "but can't be multiplexed over them", instance->xlat_name, curlversion->version);
+	}
+
+	if (pipe(multi->wake) < 0) {
+		ERROR("rlm_rest (%s): Failed creating pipe: %s", instance->xlat_name, fr_syserror(errno));
+		return -1;
+	}
+
+	if ((fr_nonblock(multi->wake[0]) < 0) || (fr_nonblock(multi->wake[1]) < 0)) {
+		ERROR("rlm_rest (%s): Failed setting pipe non-blocking: %s", instance->xlat_name,
+		      fr_syserror(errno));
+		return -1;
+	}
+
+	pthread_mutex_init(&multi->mutex, NULL);
+	pthread_cond_init(&multi->cond, NULL);
+
+	return 0;
+#else
+	ERROR("rlm_rest (%s): 'multiplex' requires a server built with threads", instance->xlat_name);
+	return -1;
+#endif
+}
+
+/** Stops the driver, and frees the multi handle
+ *
+ * @param[in] instance configuration data.
+ */
+void rest_multi_free(rlm_rest_t *instance)
+{
+	rest_multi_t *multi = instance->multi;
+
+	if (!multi) return;
+
+#ifdef HAVE_PTHREAD_H
+	if (multi->running) {
+		pthread_mutex_lock(&multi->mutex);
+		multi->exiting = true;
+		pthread_mutex_unlock(&multi->mutex);
+
+		if (write(multi->wake[1], "", 1) < 0) {
+			/* The driver still exits after its next timeout */
+		}
+
+		pthread_join(multi->driver, NULL);
+	}
+
+	if (multi->wake[0] >= 0) {
+		pthread_mutex_destroy(&multi->mutex);
+		pthread_cond_destroy(&multi->cond);
+	}
+#endif
+
+	if (multi->wake[0] >= 0) close(multi->wake[0]);
+	if (multi->wake[1] >= 0) close(multi->wake[1]);
+	if (multi->mandle) curl_multi_cleanup(multi->mandle);
+
+	talloc_free(multi);
+	instance->multi = NULL;
+}
+
 
 /** Frees a libcurl handle, and any additional memory used by context data.
  *
@@ -336,17 +648,19 @@ void *mod_conn_create(TALLOC_CTX *ctx, void *instance)
 		return NULL;
 	}
 
-	if (inst->connect_uri) {
+	if (inst->multi) {
+		DEBUG2("rlm_rest (%s): Skipping pre-connect, connections belong to the multi handle", inst->xlat_name);
+	} else if (inst->connect_uri) {
 		/*
 		 *  re-establish TCP connection to webserver. This would usually be
 		 *  done on the first request, but we do it here to minimise
 		 *  latency.
 		 */
-		SET_OPTION(CURLOPT_SSL_VERIFYPEER, 0);
-		SET_OPTION(CURLOPT_SSL_VERIFYHOST, 0);
-		SET_OPTION(CURLOPT_CONNECT_ONLY, 1);
+		SET_OPTION(CURLOPT_SSL_VERIFYPEER, 0L);
+		SET_OPTION(CURLOPT_SSL_VERIFYHOST, 0L);
+		SET_OPTION(CURLOPT_CONNECT_ONLY, 1L);
 		SET_OPTION(CURLOPT_URL, inst->connect_uri);
-		SET_OPTION(CURLOPT_NOSIGNAL, 1);
+		SET_OPTION(CURLOPT_NOSIGNAL, 1L);
 
 		DEBUG("rlm_rest (%s): Connecting to \"%s\"", inst->xlat_name, inst->connect_uri);
 
@@ -369,6 +683,12 @@ void *mod_conn_create(TALLOC_CTX *ctx, void *instance)
 	curl_ctx->headers = NULL; /* CURL needs this to be NULL */
 	curl_ctx->request.instance = inst;
 
+	curl_ctx->response.decoder = rest_json_decoder_alloc(curl_ctx);
+	if (!curl_ctx->response.decoder) {
+		ERROR("rlm_rest (%s): Failed allocating JSON decoder", inst->xlat_name);
+		goto connection_error;
+	}
+
 	randle->ctx = curl_ctx;
 	randle->handle = candle;
 	talloc_set_destructor(randle, _mod_conn_free);
@@ -413,10 +733,24 @@ int mod_conn_alive(void *instance, void *handle)
 	rlm_rest_handle_t	*randle = handle;
 	CURL			*candle = randle->handle;
 
+#if LIBCURL_VERSION_NUM >= 0x072d00
+	curl_socket_t last_socket;
+#else
 	long last_socket;
+#endif
 	CURLcode ret;
 
+	/*
+	 *  The handle doesn't own any connections, they're all
+	 *  cached by the multi handle.
+	 */
+	if (inst->multi) return true;
+
+#if LIBCURL_VERSION_NUM >= 0x072d00
+	ret = curl_easy_getinfo(candle, CURLINFO_ACTIVESOCKET, &last_socket);
+#else
 	ret = curl_easy_getinfo(candle, CURLINFO_LASTSOCKET, &last_socket);
+#endif
 	if (ret != CURLE_OK) {
 		ERROR("rlm_rest (%s): Couldn't determine socket state: %i - %s", inst->xlat_name, ret,
 		      curl_easy_strerror(ret));
@@ -424,7 +758,11 @@ int mod_conn_alive(void *instance, void *handle)
 		return false;
 	}
 
+#if LIBCURL_VERSION_NUM >= 0x072d00
+	if (last_socket == CURL_SOCKET_BAD) {
+#else
 	if (last_socket == -1) {
+#endif
 		return false;
 	}
 
@@ -626,7 +964,6 @@ no_space:
 	return len;
 }
 
-#ifdef HAVE_JSON
 /** Encodes VALUE_PAIR linked list in JSON format
  *
  * This is a stream function matching the rest_read_t prototype. Multiple
@@ -822,7 +1159,6 @@ no_space:
 
 	return len;
 }
-#endif
 
 /** Emulates successive libcurl calls to an encoding function
  *
@@ -907,6 +1243,44 @@ static void rest_request_init(REQUEST *request, rlm_rest_request_t *ctx, bool so
 	fr_cursor_init(&ctx->cursor, &request->packet->vps);
 }
 
+/** Record a VALUE_PAIR a decoder is adding to the request, so it can be cached
+ *
+ * If the copy can't be made, nothing is recorded, and the response isn't cached.
+ *
+ * @param[in] ctx Response context.
+ * @param[in] request_ref the pair was added to.
+ * @param[in] list the pair was added to.
+ * @param[in] move whether the pair was added with radius_pairmove, or appended.
+ * @param[in] vp being added.
+ */
+static void rest_response_capture(rlm_rest_response_t *ctx, request_refs_t request_ref, pair_lists_t list,
+				  bool move, VALUE_PAIR const *vp)
+{
+	rest_cache_pair_t *captured;
+
+	if (!ctx->capture) return;
+
+	captured = talloc_realloc(NULL, ctx->captured, rest_cache_pair_t, ctx->num_captured + 1);
+	if (!captured) goto error;
+	ctx->captured = captured;
+
+	captured = &ctx->captured[ctx->num_captured];
+	captured->request = request_ref;
+	captured->list = list;
+	captured->move = move;
+	captured->vp = paircopyvp(ctx->captured, vp);
+	if (!captured->vp) goto error;
+
+	ctx->num_captured++;
+	return;
+
+error:
+	TALLOC_FREE(ctx->captured);
+	ctx->num_captured = 0;
+	ctx->capture = false;
+	ctx->no_store = true;
+}
+
 /** Converts plain response into a single VALUE_PAIR
  *
  * @param[in] instance configuration data.
@@ -918,9 +1292,10 @@ static void rest_request_init(REQUEST *request, rlm_rest_request_t *ctx, bool so
  * @return the number of VALUE_PAIRs processed or -1 on unrecoverable error.
  */
 static int rest_decode_plain(UNUSED rlm_rest_t *instance, UNUSED rlm_rest_section_t *section,
-			     REQUEST *request, UNUSED void *handle, char *raw, size_t rawlen)
+			     REQUEST *request, void *handle, char *raw, size_t rawlen)
 {
-	VALUE_PAIR *vp;
+	rlm_rest_handle_t	*randle = handle;
+	VALUE_PAIR		*vp;
 
 	/*
 	 *  Empty response?
@@ -934,6 +1309,7 @@ static int rest_decode_plain(UNUSED rlm_rest_t *instance, UNUSED rlm_rest_sectio
 	pairstrncpy(vp, raw, rawlen);
 
 	RDEBUG2("Adding reply:REST-HTTP-Body += \"%s\"", vp->vp_strvalue);
+	rest_response_capture(&randle->ctx->response, REQUEST_CURRENT, PAIR_LIST_REPLY, false, vp);
 
 	return 1;
 }
@@ -1088,6 +1464,7 @@ static int rest_decode_post(UNUSED rlm_rest_t *instance, UNUSED rlm_rest_section
 			goto skip;
 		}
 
+		rest_response_capture(&randle->ctx->response, request_name, list_name, false, vp);
 		pairadd(vps, vp);
 
 		count++;
@@ -1113,11 +1490,11 @@ static int rest_decode_post(UNUSED rlm_rest_t *instance, UNUSED rlm_rest_section
 
 }
 
-#ifdef HAVE_JSON
-/** Converts JSON "value" key into VALUE_PAIR.
+/** Converts a JSON value into a VALUE_PAIR.
  *
- * If leaf is not in fact a leaf node, but contains JSON data, the data will
- * written to the attribute in JSON string format.
+ * If the value was a nested JSON structure, which is only converted to a
+ * value if is_json was set, or if it was an array nested in an array of
+ * values, the JSON text will be written to the attribute.
  *
  * @param[in] instance configuration data.
  * @param[in] section configuration data.
@@ -1126,37 +1503,19 @@ static int rest_decode_post(UNUSED rlm_rest_t *instance, UNUSED rlm_rest_section
  * @param[in] da Attribute to create.
  * @param[in] flags containing the operator other flags controlling value
  *	expansion.
- * @param[in] leaf object containing the VALUE_PAIR value.
+ * @param[in] value the JSON value in string form.
  * @return The VALUE_PAIR just created, or NULL on error.
  */
 static VALUE_PAIR *json_pairmake_leaf(UNUSED rlm_rest_t *instance, UNUSED rlm_rest_section_t *section,
 				      TALLOC_CTX *ctx, REQUEST *request, DICT_ATTR const *da,
-				      json_flags_t *flags, json_object *leaf)
+				      json_flags_t *flags, char const *value)
 {
-	char const *value, *to_parse;
+	char const *to_parse;
 	char *expanded = NULL;
 	int ret;
 
 	VALUE_PAIR *vp;
 
-	if (json_object_is_type(leaf, json_type_null)) {
-		RDEBUG3("Got null value for attribute \"%s\", skipping...", da->name);
-
-		return NULL;
-	}
-
-	/*
-	 *	Should encode any nested JSON structures into JSON strings.
-	 *
-	 *	"I knew you liked JSON so I put JSON in your JSON!"
-	 */
-	value = json_object_get_string(leaf);
-	if (!value) {
-		RWDEBUG("Failed getting string value for attribute \"%s\", skipping...", da->name);
-
-		return NULL;
-	}
-
 	RINDENT();
 	RDEBUG3("Type   : %s", fr_int2str(dict_attr_types, da->type, "<INVALID>"));
 	RDEBUG3("Length : %zu", strlen(value));
@@ -1195,18 +1554,168 @@ static VALUE_PAIR *json_pairmake_leaf(UNUSED rlm_rest_t *instance, UNUSED rlm_re
 	return vp;
 }
 
-/** Processes JSON response and converts it into multiple VALUE_PAIRs
+/** Copy a string into the decoder's value buffer
+ *
+ * @return the offset of the string in the buffer, or -1 on error.
+ */
+static ssize_t json_decoder_store(rest_json_decoder_t *dec, char const *value, size_t len)
+{
+	size_t offset = dec->used;
+
+	if ((dec->used + len + 1) > dec->alloc) {
+		size_t alloc = dec->alloc ? dec->alloc : REST_BODY_INIT;
+		char *buffer;
+
+		while (alloc < (dec->used + len + 1)) alloc *= 2;
+
+		buffer = talloc_realloc(dec, dec->buffer, char, alloc);
+		if (!buffer) return -1;
+
+		dec->buffer = buffer;
+		dec->alloc = alloc;
+	}
+
+	memcpy(dec->buffer + dec->used, value, len);
+	dec->buffer[dec->used + len] = '\0';
+	dec->used += len + 1;
+
+	return offset;
+}
+
+/** Start staging a new attribute, if its name can be resolved
  *
- * Processes JSON attribute declarations in the format below. Will recurse when
- * processing nested attributes. When processing nested attributes flags and
- * operators from previous attributes are not inherited.
+ */
+static fr_json_action_t json_decoder_attr(rest_json_decoder_t *dec, char const *name, size_t len)
+{
+	REQUEST *request = dec->request;
+	value_pair_tmpl_t dst;
+	json_attr_t *attr;
+	ssize_t offset;
+
+	RDEBUG2("Parsing attribute \"%s\"", name);
+
+	memset(&dst, 0, sizeof(dst));
+	if (tmpl_from_attr_str(&dst, name, REQUEST_CURRENT, PAIR_LIST_REPLY) <= 0) {
+		RWDEBUG("Failed parsing attribute: %s, skipping...", fr_strerror());
+		return FR_JSON_SKIP;
+	}
+
+	if (dst.type != TMPL_TYPE_ATTR) {
+		RWDEBUG("Unknown attribute \"%s\", skipping...", name);
+		return FR_JSON_SKIP;
+	}
+
+	if (dec->num_attrs == dec->max_attrs) {
+		int max_attrs = dec->max_attrs ? (dec->max_attrs * 2) : 16;
+
+		attr = talloc_realloc(dec, dec->attrs, json_attr_t, max_attrs);
+		if (!attr) return FR_JSON_ABORT;
+
+		dec->attrs = attr;
+		dec->max_attrs = max_attrs;
+	}
+
+	offset = json_decoder_store(dec, name, len);
+	if (offset < 0) return FR_JSON_ABORT;
+
+	attr = &dec->attrs[dec->num_attrs];
+	memset(attr, 0, sizeof(*attr));
+
+	attr->name = offset;
+	/*
+	 *	Unknown attributes point into the template, so have
+	 *	to be resolved again when the VALUE_PAIRs are created.
+	 */
+	attr->da = dst.tmpl_da->flags.is_unknown ? NULL : dst.tmpl_da;
+	attr->request = dst.tmpl_request;
+	attr->list = dst.tmpl_list;
+	attr->flags.op = T_OP_SET;
+	attr->flags.do_xlat = 1;
+	attr->flags.is_json = 0;
+	attr->value = dec->used;
+
+	dec->state = JSON_DECODE_VALUE;
+	dec->has_value = false;
+	dec->invalid = false;
+
+	return FR_JSON_CONTINUE;
+}
+
+/** Finish the current attribute, and keep it if it has any values
+ *
+ */
+static void json_decoder_attr_done(rest_json_decoder_t *dec)
+{
+	json_attr_t *attr = &dec->attrs[dec->num_attrs];
+
+	dec->state = JSON_DECODE_ATTR;
+
+	if (dec->invalid || !attr->count) {
+		dec->num_values -= attr->count;
+		dec->used = attr->name;
+		return;
+	}
+
+	dec->num_attrs++;
+}
+
+/** Add a scalar (or captured) value to the current attribute
+ *
+ */
+static fr_json_action_t json_decoder_value(rest_json_decoder_t *dec, fr_json_event_t event,
+					   char const *value, size_t len)
+{
+	REQUEST *request = dec->request;
+	json_attr_t *attr = &dec->attrs[dec->num_attrs];
+
+	if (event == FR_JSON_NULL) {
+		RDEBUG3("Got null value for attribute \"%s\", skipping...", dec->buffer + attr->name);
+		return FR_JSON_CONTINUE;
+	}
+
+	if (dec->num_values >= REST_BODY_MAX_ATTRS) {
+		dec->at_max = true;
+		return FR_JSON_CONTINUE;
+	}
+
+	if (json_decoder_store(dec, value, len) < 0) return FR_JSON_ABORT;
+	attr->count++;
+	dec->num_values++;
+
+	return FR_JSON_CONTINUE;
+}
+
+/*
+ *	Same rules as json_object_get_boolean.
+ */
+static int json_decoder_bool(fr_json_event_t event, char const *value, size_t len)
+{
+	switch (event) {
+	case FR_JSON_TRUE:
+		return 1;
+
+	case FR_JSON_NUMBER:
+		return (strtod(value, NULL) != 0);
+
+	case FR_JSON_STRING:
+		return (len != 0);
+
+	default:
+		return 0;
+	}
+}
+
+/** Processes events from the JSON parser, matching the fr_json_callback_t prototype
+ *
+ * Processes JSON attribute declarations in the format below.  Nested
+ * attributes are not yet supported, and are skipped.
  *
  * JSON response format is:
 @verbatim
 {
 	"<attribute0>":{
-		do_xlat:<bool>,
-		is_json:<bool>,
+		"do_xlat":<bool>,
+		"is_json":<bool>,
 		"op":"<operator>",
 		"value":[<value0>,<value1>,<valueN>]
 	},
@@ -1219,14 +1728,16 @@ static VALUE_PAIR *json_pairmake_leaf(UNUSED rlm_rest_t *instance, UNUSED rlm_re
 		}
 	},
 	"<attribute2>":"<value0>",
-	"<attributeN>":"[<value0>,<value1>,<valueN>]"
+	"<attributeN>":[<value0>,<value1>,<valueN>]
 }
 @endverbatim
  *
  * JSON valuepair flags (bools):
  *  - do_xlat	(optional) Controls xlat expansion of values. Defaults to true.
  *  - is_json	(optional) If true, any nested JSON data will be copied to the
- *			   VALUE_PAIR in string form. Defaults to true.
+ *			   VALUE_PAIR in string form. Defaults to false.  As the
+ *			   response is decoded as it arrives, is_json must come
+ *			   before "value" to have any effect.
  *  - op	(optional) Controls how the attribute is inserted into
  *			   the target list. Defaults to ':=' (T_OP_SET).
  *
@@ -1234,207 +1745,228 @@ static VALUE_PAIR *json_pairmake_leaf(UNUSED rlm_rest_t *instance, UNUSED rlm_re
  * second and subsequent values in multivalued attributes. This does not work
  * between multiple attribute declarations.
  *
- * @see fr_tokens
+ * The values of unknown attributes, unknown keys and nested attributes are
+ * skipped by the parser without being copied.
  *
- * @param[in] instance configuration data.
- * @param[in] section configuration data.
- * @param[in] request Current request.
- * @param[in] object containing root node, or parent node.
- * @param[in] level Current nesting level.
- * @param[in] max counter, decremented after each VALUE_PAIR is created,
- * 	      when 0 no more attributes will be processed.
- * @return number of attributes created or < 0 on error.
+ * @see fr_tokens
  */
-static int json_pairmake(rlm_rest_t *instance, UNUSED rlm_rest_section_t *section,
-			 REQUEST *request, json_object *object, UNUSED int level, int max)
+static fr_json_action_t json_decoder_event(void *uctx, fr_json_event_t event, int depth,
+					   char const *value, size_t len)
 {
-	struct lh_entry *entry;
-	int max_attrs = max;
-
-	if (!json_object_is_type(object, json_type_object)) {
-		REDEBUG("Can't process VP container, expected JSON object"
-#ifdef HAVE_JSON_TYPE_TO_NAME
-			"got \"%s\", skipping...",
-			json_type_to_name(json_object_get_type(object)));
-#else
-			", skipping...");
-#endif
-		return -1;
+	rest_json_decoder_t *dec = uctx;
+	REQUEST *request = dec->request;
+	json_attr_t *attr;
+
+	if (dec->state == JSON_DECODE_ATTR) {
+		if (depth == 0) {
+			if ((event == FR_JSON_OBJECT_START) || (event == FR_JSON_OBJECT_END)) return FR_JSON_CONTINUE;
+
+			REDEBUG("Can't process VP container, expected JSON object, skipping...");
+			return FR_JSON_ABORT;
+		}
+
+		rad_assert(event == FR_JSON_KEY);
+
+		return json_decoder_attr(dec, value, len);
 	}
 
+	attr = &dec->attrs[dec->num_attrs];
+
+	switch (dec->state) {
 	/*
-	 *	Process VP container
+	 *	"<name>":<value>, "<name>":[<values>] or "<name>":{<expanded>}
 	 */
-	for (entry = json_object_get_object(object)->head;
-	     entry;
-	     entry = entry->next) {
-		int i = 0, elements;
-		struct json_object *value, *element, *tmp;
-		TALLOC_CTX *ctx;
-
-		char const *name = (char const *)entry->k;
-
-		json_flags_t flags = {
-			.op = T_OP_SET,
-			.do_xlat = 1,
-			.is_json = 0
-		};
+	case JSON_DECODE_VALUE:
+		switch (event) {
+		case FR_JSON_OBJECT_START:
+			dec->state = JSON_DECODE_EXPANDED;
+			return FR_JSON_CONTINUE;
+
+		case FR_JSON_ARRAY_START:
+			dec->state = JSON_DECODE_ARRAY;
+			dec->array_depth = depth + 1;
+			return FR_JSON_CONTINUE;
+
+		default:
+			if (json_decoder_value(dec, event, value, len) == FR_JSON_ABORT) return FR_JSON_ABORT;
+			json_decoder_attr_done(dec);
+			return FR_JSON_CONTINUE;
+		}
 
-		value_pair_tmpl_t dst;
-		REQUEST *current = request;
-		VALUE_PAIR **vps, *vp = NULL;
+	case JSON_DECODE_ARRAY:
+		switch (event) {
+		case FR_JSON_ARRAY_END:
+			if (!attr->count && !dec->invalid) RWDEBUG("Zero length value array, skipping...");
 
-		memset(&dst, 0, sizeof(dst));
+			if (depth == 1) {
+				json_decoder_attr_done(dec);
+			} else {
+				dec->state = JSON_DECODE_EXPANDED;
+			}
+			return FR_JSON_CONTINUE;
 
-		/* Fix the compiler warnings regarding const... */
-		memcpy(&value, &entry->v, sizeof(value));
+		case FR_JSON_OBJECT_START:
+			RWDEBUG("Found nested VP, these are not yet supported, skipping...");
+			return FR_JSON_SKIP;
 
 		/*
-		 *  Resolve attribute name to a dictionary entry and pairlist.
+		 *	Nested arrays are added as JSON strings.
 		 */
-		RDEBUG2("Parsing attribute \"%s\"", name);
+		case FR_JSON_ARRAY_START:
+			return FR_JSON_CAPTURE;
 
-		if (tmpl_from_attr_str(&dst, name, REQUEST_CURRENT, PAIR_LIST_REPLY) <= 0) {
-			RWDEBUG("Failed parsing attribute: %s, skipping...", fr_strerror());
-			continue;
+		default:
+			return json_decoder_value(dec, event, value, len);
 		}
 
-		if (radius_request(&current, dst.tmpl_request) < 0) {
-			RWDEBUG("Attribute name refers to outer request but not in a tunnel, skipping...");
-			continue;
-		}
-
-		vps = radius_list(current, dst.tmpl_list);
-		if (!vps) {
-			RWDEBUG("List not valid in this context, skipping...");
-			continue;
+	/*
+	 *	"<name>":{
+	 *		"do_xlat":<bool>,
+	 *		"is_json":<bool>,
+	 *		"op":"<op>",
+	 *		"value":<value>
+	 *	}
+	 */
+	case JSON_DECODE_EXPANDED:
+		if (event == FR_JSON_OBJECT_END) {
+			if (!dec->has_value) {
+				RWDEBUG("Value key missing, skipping...");
+				dec->invalid = true;
+			}
+			json_decoder_attr_done(dec);
+			return FR_JSON_CONTINUE;
 		}
-		ctx = radius_list_ctx(current, dst.tmpl_list);
 
-		/*
-		 *  Alternative JSON structure which allows operator,
-		 *  and other flags to be specified.
-		 *
-		 *	"<name>":{
-		 *		"do_xlat":<bool>,
-		 *		"is_json":<bool>,
-		 *		"op":"<op>",
-		 *		"value":<value>
-		 *	}
-		 *
-		 *	Where value is a:
-		 *	  - []	Multivalued array
-		 *	  - {}	Nested Valuepair
-		 *	  - *	Integer or string value
-		 */
-		if (json_object_is_type(value, json_type_object)) {
-			/*
-			 *  Process operator if present.
-			 */
-			tmp = json_object_object_get(value, "op");
-			if (tmp) {
-				flags.op = fr_str2int(fr_tokens, json_object_get_string(tmp), 0);
-				if (!flags.op) {
-					RWDEBUG("Invalid operator value \"%s\", skipping...",
-						json_object_get_string(tmp));
-					continue;
-				}
-			}
+		rad_assert(event == FR_JSON_KEY);
 
-			/*
-			 *  Process optional do_xlat bool.
-			 */
-			tmp = json_object_object_get(value, "do_xlat");
-			if (tmp) {
-				flags.do_xlat = json_object_get_boolean(tmp);
-			}
+		if (strcmp(value, "op") == 0) {
+			dec->state = JSON_DECODE_OP;
+		} else if (strcmp(value, "do_xlat") == 0) {
+			dec->state = JSON_DECODE_DO_XLAT;
+		} else if (strcmp(value, "is_json") == 0) {
+			dec->state = JSON_DECODE_IS_JSON;
+		} else if (strcmp(value, "value") == 0) {
+			dec->state = JSON_DECODE_EXPANDED_VALUE;
+		} else {
+			return FR_JSON_SKIP;
+		}
+		return FR_JSON_CONTINUE;
 
-			/*
-			 *  Process optional is_json bool.
-			 */
-			tmp = json_object_object_get(value, "is_json");
-			if (tmp) {
-				flags.is_json = json_object_get_boolean(tmp);
-			}
+	case JSON_DECODE_OP:
+		dec->state = JSON_DECODE_EXPANDED;
 
-			/*
-			 *  Value key must be present if were using the expanded syntax.
-			 */
-			value = json_object_object_get(value, "value");
-			if (!value) {
-				RWDEBUG("Value key missing, skipping...");
-				continue;
-			}
+		if ((event == FR_JSON_OBJECT_START) || (event == FR_JSON_ARRAY_START)) {
+			RWDEBUG("Invalid operator value, skipping...");
+			dec->invalid = true;
+			return FR_JSON_SKIP;
 		}
 
-		/*
-		 *  Setup pairmake / recursion loop.
-		 */
-		if (!flags.is_json && json_object_is_type(value, json_type_array)) {
-			elements = json_object_array_length(value);
-			if (!elements) {
-				RWDEBUG("Zero length value array, skipping...");
-				continue;
-			}
-			element = json_object_array_get_idx(value, 0);
-		} else {
-			elements = 1;
-			element = value;
+		attr->flags.op = fr_str2int(fr_tokens, value, 0);
+		if (!attr->flags.op) {
+			RWDEBUG("Invalid operator value \"%s\", skipping...", value);
+			dec->invalid = true;
 		}
+		return FR_JSON_CONTINUE;
 
-		/*
-		 *  A JSON 'value' key, may have multiple elements, iterate
-		 *  over each of them, creating a new VALUE_PAIR.
-		 */
-		do {
-			if (max_attrs-- <= 0) {
-				RWDEBUG("At maximum attribute limit");
-				return max;
-			}
+	case JSON_DECODE_DO_XLAT:
+	case JSON_DECODE_IS_JSON:
+	{
+		int *flag = (dec->state == JSON_DECODE_DO_XLAT) ? &attr->flags.do_xlat : &attr->flags.is_json;
 
-			/*
-			 *  Automagically switch the op for multivalued attributes.
-			 */
-			if (((flags.op == T_OP_SET) || (flags.op == T_OP_EQ)) && (i >= 1)) {
-				flags.op = T_OP_ADD;
-			}
+		dec->state = JSON_DECODE_EXPANDED;
 
-			if (json_object_is_type(element, json_type_object) && !flags.is_json) {
-				/* TODO: Insert nested VP into VP structure...*/
-				RWDEBUG("Found nested VP, these are not yet supported, skipping...");
+		*flag = json_decoder_bool(event, value, len);
+		if ((event == FR_JSON_OBJECT_START) || (event == FR_JSON_ARRAY_START)) return FR_JSON_SKIP;
 
-				continue;
+		return FR_JSON_CONTINUE;
+	}
 
-				/*
-				vp = json_pairmake(instance, section,
-						   request, value,
-						   level + 1, max_attrs);*/
-			} else {
-				vp = json_pairmake_leaf(instance, section, ctx, request,
-							dst.tmpl_da, &flags, element);
-				if (!vp) continue;
+	case JSON_DECODE_EXPANDED_VALUE:
+		dec->has_value = true;
+
+		switch (event) {
+		case FR_JSON_OBJECT_START:
+		case FR_JSON_ARRAY_START:
+			if (attr->flags.is_json) return FR_JSON_CAPTURE;	/* Becomes FR_JSON_RAW */
+
+			if (event == FR_JSON_ARRAY_START) {
+				dec->state = JSON_DECODE_ARRAY;
+				dec->array_depth = depth + 1;
+				return FR_JSON_CONTINUE;
 			}
-			debug_pair(vp);
-			radius_pairmove(current, vps, vp, false);
-		/*
-		 *  If we call json_object_array_get_idx on something that's not an array
-		 *  the behaviour appears to be to occasionally segfault.
-		 */
-		} while ((++i < elements) && (element = json_object_array_get_idx(value, i)));
+
+			/* TODO: Insert nested VP into VP structure...*/
+			RWDEBUG("Found nested VP, these are not yet supported, skipping...");
+			dec->state = JSON_DECODE_EXPANDED;
+			return FR_JSON_SKIP;
+
+		default:
+			dec->state = JSON_DECODE_EXPANDED;
+			return json_decoder_value(dec, event, value, len);
+		}
+
+	default:
+		rad_assert(0);
+		return FR_JSON_ABORT;
+	}
+}
+
+static rest_json_decoder_t *rest_json_decoder_alloc(TALLOC_CTX *ctx)
+{
+	rest_json_decoder_t *dec;
+
+	dec = talloc_zero(ctx, rest_json_decoder_t);
+	if (!dec) return NULL;
+
+	dec->parser = fr_json_parser_alloc(dec, json_decoder_event, dec);
+	if (!dec->parser) {
+		talloc_free(dec);
+		return NULL;
 	}
 
-	return max - max_attrs;
+	return dec;
 }
 
-/** Converts JSON response into VALUE_PAIRs and adds them to the request.
+/** Prepare the decoder for a new response
  *
- * Converts the raw JSON string into a json-c object tree and passes it to
- * json_pairmake. After the tree has been parsed json_object_put is called
- * which decrements the reference count of the root node by one, and frees
- * the entire tree.
+ * Buffers from previous responses are kept, so decoding a response
+ * doesn't normally allocate memory.
+ */
+static void rest_json_decoder_reset(rest_json_decoder_t *dec, REQUEST *request)
+{
+	fr_json_parser_reset(dec->parser);
+
+	dec->request = request;
+	dec->state = JSON_DECODE_ATTR;
+	dec->at_max = false;
+	dec->malformed = false;
+	dec->num_attrs = 0;
+	dec->num_values = 0;
+	dec->used = 0;
+}
+
+/** Feed the next chunk of a JSON response to the decoder
+ *
+ * Errors are remembered, and reported by rest_decode_json, so that the
+ * body is still read (and available to rest_response_error).
+ */
+static void rest_json_decoder_feed(rest_json_decoder_t *dec, char const *in, size_t inlen)
+{
+	if (dec->malformed) return;
+
+	if (fr_json_parse(dec->parser, in, inlen) < 0) {
+		strlcpy(dec->error, fr_strerror(), sizeof(dec->error));
+		dec->malformed = true;
+	}
+}
+
+/** Converts the staged JSON attributes into VALUE_PAIRs and adds them to the request.
+ *
+ * The response body was parsed as it arrived by rest_response_body, and
+ * only the values of known attributes were kept.
  *
  * @see rest_encode_json
- * @see json_pairmake
+ * @see json_decoder_event
  *
  * @param[in] instance configuration data.
  * @param[in] section configuration data.
@@ -1445,36 +1977,124 @@ static int json_pairmake(rlm_rest_t *instance, UNUSED rlm_rest_section_t *sectio
  * @return the number of VALUE_PAIRs processed or -1 on unrecoverable error.
  */
 static int rest_decode_json(rlm_rest_t *instance, UNUSED rlm_rest_section_t *section,
-			    REQUEST *request, UNUSED void *handle, char *raw, UNUSED size_t rawlen)
+			    REQUEST *request, void *handle, char *raw, UNUSED size_t rawlen)
 {
-	char const *p = raw;
-
-	struct json_object *json;
+	rlm_rest_handle_t	*randle = handle;
+	rest_json_decoder_t	*dec = randle->ctx->response.decoder;
 
-	int ret;
+	int i, ret, count = 0;
 
-	/*
-	 *  Empty response?
-	 */
-	while (isspace(*p)) p++;
-	if (*p == '\0') return 0;
+	if (!dec->malformed) {
+		ret = fr_json_parse_end(dec->parser);
+		if (ret == 0) return 0;		/* Empty response */
+		if (ret < 0) {
+			strlcpy(dec->error, fr_strerror(), sizeof(dec->error));
+			dec->malformed = true;
+		}
+	}
 
-	json = json_tokener_parse(p);
-	if (!json) {
-		REDEBUG("Malformed JSON data \"%s\"", raw);
+	if (dec->malformed) {
+		REDEBUG("Malformed JSON data \"%s\": %s", raw, dec->error);
 		return -1;
 	}
 
-	ret = json_pairmake(instance, section, request, json, 0, REST_BODY_MAX_ATTRS);
+	for (i = 0; i < dec->num_attrs; i++) {
+		json_attr_t	*attr = &dec->attrs[i];
+		char const	*value = dec->buffer + attr->value;
+		DICT_ATTR const	*da = attr->da;
+		json_flags_t	flags = attr->flags;
+		value_pair_tmpl_t dst;
 
-	/*
-	 *  Decrement reference count for root object, should free entire JSON tree.
-	 */
-	json_object_put(json);
+		REQUEST		*current = request;
+		VALUE_PAIR	**vps, *vp;
+		TALLOC_CTX	*ctx;
+		int		j;
 
-	return ret;
+		if (!da) {
+			memset(&dst, 0, sizeof(dst));
+			if (tmpl_from_attr_str(&dst, dec->buffer + attr->name, REQUEST_CURRENT, PAIR_LIST_REPLY) <= 0) {
+				continue;
+			}
+			da = dst.tmpl_da;
+		}
+
+		if (radius_request(&current, attr->request) < 0) {
+			RWDEBUG("Attribute name refers to outer request but not in a tunnel, skipping...");
+			continue;
+		}
+
+		vps = radius_list(current, attr->list);
+		if (!vps) {
+			RWDEBUG("List not valid in this context, skipping...");
+			continue;
+		}
+		ctx = radius_list_ctx(current, attr->list);
+
+		/*
+		 *  Each value creates a new VALUE_PAIR.
+		 */
+		for (j = 0; j < attr->count; j++, value += strlen(value) + 1) {
+			/*
+			 *  Automagically switch the op for multivalued attributes.
+			 */
+			if (((flags.op == T_OP_SET) || (flags.op == T_OP_EQ)) && (j >= 1)) {
+				flags.op = T_OP_ADD;
+			}
+
+			vp = json_pairmake_leaf(instance, section, ctx, request, da, &flags, value);
+			if (!vp) continue;
+
+			debug_pair(vp);
+			rest_response_capture(&randle->ctx->response, attr->request, attr->list, true, vp);
+			radius_pairmove(current, vps, vp, false);
+			count++;
+		}
+	}
+
+	if (dec->at_max) RWDEBUG("At maximum attribute limit");
+
+	return count;
+}
+
+/** Processes a Cache-Control header
+ *
+ * Only the directives which matter to a client are used.  s-maxage takes
+ * precedence over max-age, as the cache is shared by many users.
+ *
+ * @param[in] ctx Response context.
+ * @param[in] p the header value.
+ * @param[in] s length of the header value.
+ */
+static void rest_response_cache_control(rlm_rest_response_t *ctx, char const *p, size_t s)
+{
+	char const	*end = p + s, *q;
+	size_t		len;
+	bool		shared = false;
+
+	while (p < end) {
+		while ((p < end) && ((*p == ' ') || (*p == '\t') || (*p == ','))) p++;
+		if ((p == end) || (*p == '\r') || (*p == '\n')) break;
+
+		q = p;
+		while ((q < end) && (*q != ',') && (*q != '\r')) q++;
+		len = q - p;
+
+		if ((len > 9) && (strncasecmp(p, "s-maxage=", 9) == 0)) {
+			ctx->max_age = atoi(p + 9);
+			shared = true;
+		} else if ((len > 8) && (strncasecmp(p, "max-age=", 8) == 0)) {
+			if (!shared) ctx->max_age = atoi(p + 8);
+		} else if ((len == 8) && (strncasecmp(p, "no-store", 8) == 0)) {
+			ctx->no_store = true;
+		} else if ((len >= 8) && (strncasecmp(p, "no-cache", 8) == 0)) {
+			ctx->no_cache = true;
+		}
+
+		p = q;
+	}
+
+	if (ctx->max_age < -1) ctx->max_age = 0;
 }
-#endif
 
 /** Processes incoming HTTP header data from libcurl.
  *
@@ -1586,6 +2206,26 @@ static size_t rest_response_header(void *in, size_t size, size_t nmemb, void *us
 		break;
 
 	case WRITE_STATE_PARSE_HEADERS:
+		if ((s >= 15) &&
+		    (strncasecmp("Cache-Control: ", p, 15) == 0)) {
+			rest_response_cache_control(ctx, p + 15, s - 15);
+			break;
+		}
+
+		if ((s >= 6) &&
+		    (strncasecmp("ETag: ", p, 6) == 0)) {
+			p += 6;
+			s -= 6;
+
+			q = memchr(p, '\r', s);
+			len = !q ? s : (size_t) (q - p);
+			if (len < sizeof(ctx->etag)) {
+				memcpy(ctx->etag, p, len);
+				ctx->etag[len] = '\0';
+			}
+			break;
+		}
+
 		if ((s >= 14) &&
 		    (strncasecmp("Content-Type: ", p, 14) == 0)) {
 			p += 14;
@@ -1755,6 +2395,8 @@ static size_t rest_response_body(void *ptr, size_t size, size_t nmemb, void *use
 		strlcpy(ctx->buffer + ctx->used, p, t + 1);
 		ctx->used += t;
 
+		if (ctx->type == HTTP_BODY_JSON) rest_json_decoder_feed(ctx->decoder, p, t);
+
 		break;
 	}
 
@@ -1806,6 +2448,15 @@ static void rest_response_init(REQUEST *request, rlm_rest_response_t *ctx, http_
 	ctx->alloc = 0;
 	ctx->used = 0;
 	ctx->buffer = NULL;
+
+	ctx->max_age = -1;
+	ctx->no_store = false;
+	ctx->no_cache = false;
+	ctx->etag[0] = '\0';
+	ctx->capture = false;
+	ctx->num_captured = 0;
+
+	rest_json_decoder_reset(ctx->decoder, request);
 }
 
 /** Extracts pointer to buffer containing response data
@@ -1854,7 +2505,7 @@ static int rest_request_config_body(UNUSED rlm_rest_t *instance, rlm_rest_sectio
 	 *  no body should be sent.
 	 */
 	if (!func) {
-		SET_OPTION(CURLOPT_POSTFIELDSIZE, 0);
+		SET_OPTION(CURLOPT_POSTFIELDSIZE, 0L);
 		return 0;
 	}
 
@@ -1879,6 +2530,7 @@ static int rest_request_config_body(UNUSED rlm_rest_t *instance, rlm_rest_sectio
 		return -1;
 	}
 
+	ctx->body_len = len;
 	SET_OPTION(CURLOPT_POSTFIELDS, ctx->body);
 	SET_OPTION(CURLOPT_POSTFIELDSIZE, len);
 
@@ -1943,7 +2595,7 @@ int rest_request_config(rlm_rest_t *instance, rlm_rest_section_t *section,
 	 *	Setup any header options and generic headers.
 	 */
 	SET_OPTION(CURLOPT_URL, uri);
-	SET_OPTION(CURLOPT_NOSIGNAL, 1);
+	SET_OPTION(CURLOPT_NOSIGNAL, 1L);
 	SET_OPTION(CURLOPT_USERAGENT, "FreeRADIUS " RADIUSD_VERSION_STRING);
 
 	content_type = fr_int2str(http_content_type_table, type, section->body_str);
@@ -1952,10 +2604,29 @@ int rest_request_config(rlm_rest_t *instance, rlm_rest_section_t *section,
 	if (!ctx->headers) goto error_header;
 
 	if (section->timeout) {
-		SET_OPTION(CURLOPT_TIMEOUT, section->timeout);
+		SET_OPTION(CURLOPT_TIMEOUT, (long) section->timeout);
 	}
 
-	SET_OPTION(CURLOPT_PROTOCOLS, (CURLPROTO_HTTP | CURLPROTO_HTTPS));
+#if LIBCURL_VERSION_NUM >= 0x075500
+	SET_OPTION(CURLOPT_PROTOCOLS_STR, "http,https");
+#else
+	SET_OPTION(CURLOPT_PROTOCOLS, (long) (CURLPROTO_HTTP | CURLPROTO_HTTPS));
+#endif
+
+	/*
+	 *	Prefer waiting for a connection that can be
+	 *	multiplexed, over opening a new one.
+	 */
+	if (instance->multi) {
+#if defined(CURL_VERSION_HTTP2) && (LIBCURL_VERSION_NUM >= 0x072f00)
+		if (curl_version_info(CURLVERSION_NOW)->features & CURL_VERSION_HTTP2) {
+			SET_OPTION(CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+		}
+#endif
+#if LIBCURL_VERSION_NUM >= 0x072b00
+		SET_OPTION(CURLOPT_PIPEWAIT, 1L);
+#endif
+	}
 
 	/*
 	 *	FreeRADIUS custom headers
@@ -2000,7 +2671,7 @@ int rest_request_config(rlm_rest_t *instance, rlm_rest_section_t *section,
 		break;
 
 	case HTTP_METHOD_PUT :
-		SET_OPTION(CURLOPT_PUT, val);
+		SET_OPTION(CURLOPT_UPLOAD, val);
 		break;
 
 	case HTTP_METHOD_DELETE :
@@ -2095,12 +2766,17 @@ int rest_request_config(rlm_rest_t *instance, rlm_rest_section_t *section,
 		SET_OPTION(CURLOPT_CAPATH, section->tls_ca_path);
 	}
 
+	/*
+	 *	Newer versions of curl don't use it.
+	 */
+#if LIBCURL_VERSION_NUM < 0x075400
 	if (section->tls_random_file) {
 		SET_OPTION(CURLOPT_RANDOM_FILE, section->tls_random_file);
 	}
+#endif
 
-	SET_OPTION(CURLOPT_SSL_VERIFYPEER, (section->tls_check_cert == true) ? 1 : 0);
-	SET_OPTION(CURLOPT_SSL_VERIFYHOST, (section->tls_check_cert_cn == true) ? 2 : 0);
+	SET_OPTION(CURLOPT_SSL_VERIFYPEER, (section->tls_check_cert == true) ? 1L : 0L);
+	SET_OPTION(CURLOPT_SSL_VERIFYHOST, (section->tls_check_cert_cn == true) ? 2L : 0L);
 
 	/*
 	 *	Tell CURL how to get HTTP body content, and how to process incoming data.
@@ -2196,7 +2872,6 @@ int rest_request_config(rlm_rest_t *instance, rlm_rest_section_t *section,
 	}
 		break;
 
-#ifdef HAVE_JSON
 	case HTTP_BODY_JSON:
 		rest_request_init(request, &ctx->request, true);
 
@@ -2206,7 +2881,6 @@ int rest_request_config(rlm_rest_t *instance, rlm_rest_section_t *section,
 		}
 
 		break;
-#endif
 
 	case HTTP_BODY_POST:
 		rest_request_init(request, &ctx->request, false);
@@ -2238,25 +2912,64 @@ error_header:
 	return -1;
 }
 
+/** Adds a header to a request which has been configured
+ *
+ * @param[in] request Current request.
+ * @param[in] handle configured with rest_request_config.
+ * @param[in] header to add, in the format "<name>: <value>".
+ * @return 0 on success -1 on error.
+ */
+int rest_request_header_add(REQUEST *request, void *handle, char const *header)
+{
+	rlm_rest_handle_t	*randle = handle;
+	rlm_rest_curl_context_t	*ctx = randle->ctx;
+	struct curl_slist	*headers;
+
+	/*
+	 *	There's always a Content-Type header, so the head of
+	 *	the list passed to CURLOPT_HTTPHEADER doesn't change.
+	 */
+	rad_assert(ctx->headers);
+
+	RDEBUG3("%s", header);
+	headers = curl_slist_append(ctx->headers, header);
+	if (!headers) {
+		REDEBUG("Failed creating header");
+		return -1;
+	}
+
+	return 0;
+}
+
 /** Sends a REST (HTTP) request.
  *
  * Send the actual REST request to the server. The response will be handled by
  * the numerous callbacks configured in rest_request_config.
  *
+ * If the instance has a multi handle, the transfer is performed by its driver
+ * thread, using the connections it shares between all threads.
+ *
  * @param[in] instance configuration data.
  * @param[in] section configuration data.
  * @param[in] request Current request.
  * @param[in] handle to use.
  * @return 0 on success or -1 on error.
  */
-int rest_request_perform(UNUSED rlm_rest_t *instance, UNUSED rlm_rest_section_t *section,
+int rest_request_perform(rlm_rest_t *instance, UNUSED rlm_rest_section_t *section,
 			 REQUEST *request, void *handle)
 {
 	rlm_rest_handle_t	*randle = handle;
 	CURL			*candle = randle->handle;
 	CURLcode		ret;
 
-	ret = curl_easy_perform(candle);
+#ifdef HAVE_PTHREAD_H
+	if (instance->multi) {
+		ret = rest_multi_perform(instance, request, candle);
+	} else
+#endif
+	{
+		ret = curl_easy_perform(candle);
+	}
 	if (ret != CURLE_OK) {
 		REDEBUG("Request failed: %i - %s", ret, curl_easy_strerror(ret));
 
@@ -2303,11 +3016,9 @@ int rest_response_decode(rlm_rest_t *instance, UNUSED rlm_rest_section_t *sectio
 		ret = rest_decode_post(instance, section, request, handle, ctx->response.buffer, ctx->response.used);
 		break;
 
-#ifdef HAVE_JSON
 	case HTTP_BODY_JSON:
 		ret = rest_decode_json(instance, section, request, handle, ctx->response.buffer, ctx->response.used);
 		break;
-#endif
 
 	case HTTP_BODY_UNSUPPORTED:
 	case HTTP_BODY_UNAVAILABLE:
@@ -2359,6 +3070,7 @@ void rest_request_cleanup(UNUSED rlm_rest_t *instance, UNUSED rlm_rest_section_t
 		free(ctx->body);
 		ctx->body = NULL;
 	}
+	ctx->body_len = 0;
 
 	/*
 	 *  Free response data
@@ -2367,9 +3079,10 @@ void rest_request_cleanup(UNUSED rlm_rest_t *instance, UNUSED rlm_rest_section_t
 		free(ctx->response.buffer);
 		ctx->response.buffer = NULL;
 	}
+	TALLOC_FREE(ctx->response.captured);
+	ctx->response.num_captured = 0;
 
 	TALLOC_FREE(ctx->request.encoder);
-	TALLOC_FREE(ctx->response.decoder);
 }
 
 /** URL encodes a string.
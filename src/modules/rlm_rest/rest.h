@@ -26,23 +26,17 @@
 RCSIDH(other_h, "$Id$")
 
 #include <freeradius-devel/connection.h>
+#include <freeradius-devel/heap.h>
 #include "config.h"
 
-#ifdef HAVE_JSON_JSONH
-#define HAVE_JSON
-#endif
-
 #define CURL_NO_OLDIES 1
 #include <curl/curl.h>
 
-#ifdef HAVE_JSON
-#include <json/json.h>
-#endif
-
 #define REST_URI_MAX_LEN		2048
 #define REST_BODY_MAX_LEN		8192
 #define REST_BODY_INIT			1024
 #define REST_BODY_MAX_ATTRS		256
+#define REST_ETAG_MAX_LEN		256
 
 typedef enum {
 	HTTP_METHOD_UNKNOWN = 0,
@@ -139,6 +133,38 @@ typedef struct rlm_rest_section_t {
 	uint32_t		chunk;		//!< Max chunk-size (mainly for testing the encoders)
 } rlm_rest_section_t;
 
+typedef struct rest_transfer rest_transfer_t;
+
+/*
+ *	A VALUE_PAIR decoded from a response, and the list it was added to.
+ */
+typedef struct rest_cache_pair_t {
+	request_refs_t		request;	//!< Request qualifier.
+	pair_lists_t		list;		//!< List qualifier.
+	bool			move;		//!< Added with radius_pairmove (respecting the operator),
+						//!< rather than appended.
+	VALUE_PAIR		*vp;		//!< After xlat expansion.
+} rest_cache_pair_t;
+
+typedef struct rest_cache_entry rest_cache_entry_t;
+
+/*
+ *	Multi handle shared by all threads.  One thread drives it, and performs
+ *	the transfers other threads queue, so they share its connections.
+ */
+typedef struct rest_multi_t {
+	CURLM			*mandle;	//!< Multi handle.
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t		mutex;		//!< Protects the fields below.
+	pthread_cond_t		cond;		//!< Signalled when transfers complete.
+	pthread_t		driver;		//!< Thread driving the multi handle.
+	bool			running;	//!< The driver has been started.
+	bool			exiting;	//!< The driver should exit.
+#endif
+	int			wake[2];	//!< Pipe used to wake the driver when transfers are queued.
+	rest_transfer_t		*pending;	//!< Transfers to add to the multi handle.
+} rest_multi_t;
+
 /*
  *	Structure for module configuration
  */
@@ -150,12 +176,36 @@ typedef struct rlm_rest_t {
 
 	fr_connection_pool_t	*conn_pool;	//!< Pointer to the connection pool.
 
+	bool			multiplex;	//!< Perform all transfers with one shared multi handle.
+	uint32_t		max_host_connections;	//!< Limit on connections the multi handle opens
+						//!< to each host, 0 for no limit.
+	rest_multi_t		*multi;		//!< The shared multi handle.
+
 	rlm_rest_section_t	authorize;	//!< Configuration specific to authorisation.
 	rlm_rest_section_t	authenticate;	//!< Configuration specific to authentication.
 	rlm_rest_section_t	accounting;	//!< Configuration specific to accounting.
 	rlm_rest_section_t	checksimul;	//!< Configuration specific to simultaneous session
 						//!< checking.
 	rlm_rest_section_t	post_auth;	//!< Configuration specific to Post-auth
+
+	/*
+	 *	Cache of authorize responses
+	 */
+	uint32_t		cache_ttl;	//!< How long responses without max-age are cached for.
+						//!< 0 disables the cache.
+	uint32_t		cache_max_ttl;	//!< Upper bound on max-age, and how long responses with
+						//!< an ETag are kept for revalidation once stale.
+	uint32_t		cache_max_entries;	//!< Maximum number of responses in the cache.
+
+	char const		*cache_xlat_name;	//!< Name of the statistics xlat.
+	rbtree_t		*cache;		//!< Cached responses, by method, URI and body hash.
+	fr_heap_t		*cache_heap;	//!< The same entries, by the time they're removed.
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t		cache_mutex;	//!< Protects the cache, and the counters below.
+#endif
+	uint64_t		cache_hits;	//!< Fresh responses used from the cache.
+	uint64_t		cache_misses;	//!< Requests sent, with nothing usable in the cache.
+	uint64_t		cache_revalidated;	//!< Stale responses the server said were unmodified.
 } rlm_rest_t;
 
 /*
@@ -211,7 +261,17 @@ typedef struct rlm_rest_response_t {
 	http_body_type_t	type;		//!< HTTP Content Type.
 	http_body_type_t	force_to;	//!< Force decoding the body type as a particular encoding.
 
-	void			*decoder;	//!< Decoder specific data.
+	void			*decoder;	//!< JSON decoder, fed as the body arrives.
+						//!< Belongs to the handle, and is re-used.
+
+	int32_t			max_age;	//!< From Cache-Control, -1 if there wasn't one.
+	bool			no_store;	//!< Cache-Control: no-store.
+	bool			no_cache;	//!< Cache-Control: no-cache.
+	char			etag[REST_ETAG_MAX_LEN];	//!< ETag header, empty if there wasn't one.
+
+	bool			capture;	//!< Record the VALUE_PAIRs the decoders add.
+	rest_cache_pair_t	*captured;	//!< The recorded VALUE_PAIRs.
+	int			num_captured;	//!< Number of recorded VALUE_PAIRs.
 } rlm_rest_response_t;
 
 /*
@@ -223,6 +283,7 @@ typedef struct rlm_rest_curl_context_t {
 
 	char			*body;		//!< Pointer to the buffer which contains body data/
 						//!< Only used when not performing chunked encoding.
+	size_t			body_len;	//!< Length of body data.
 
 	rlm_rest_request_t	request;	//!< Request context data.
 	rlm_rest_response_t	response;	//!< Response context data.
@@ -250,6 +311,10 @@ int rest_init(rlm_rest_t *instance);
 
 void rest_cleanup(void);
 
+int rest_multi_init(rlm_rest_t *instance);
+
+void rest_multi_free(rlm_rest_t *instance);
+
 void *mod_conn_create(TALLOC_CTX *ctx, void *instance);
 
 int mod_conn_alive(void *instance, void *handle);
@@ -276,12 +341,36 @@ void rest_response_error(REQUEST *request, rlm_rest_handle_t *handle);
 void rest_request_cleanup(rlm_rest_t *instance, rlm_rest_section_t *section,
 			  void *handle);
 
+int rest_request_header_add(REQUEST *request, void *handle, char const *header);
+
 #define rest_get_handle_code(handle)(((rlm_rest_curl_context_t*)((rlm_rest_handle_t*)handle)->ctx)->response.code)
 
 #define rest_get_handle_type(handle)(((rlm_rest_curl_context_t*)((rlm_rest_handle_t*)handle)->ctx)->response.type)
 
 size_t rest_get_handle_data(char const **out, rlm_rest_handle_t *handle);
 
+/*
+ *	Cache of authorize responses (cache.c)
+ */
+int rest_cache_init(rlm_rest_t *instance);
+
+void rest_cache_free(rlm_rest_t *instance);
+
+char *rest_cache_key(REQUEST *request, void *handle, http_method_t method, char const *uri);
+
+int rest_cache_find(rlm_rest_t *instance, REQUEST *request, void *handle, char const *key,
+		    rest_cache_entry_t **stale, rlm_rcode_t *rcode);
+
+rlm_rcode_t rest_cache_revalidated(rlm_rest_t *instance, REQUEST *request, void *handle,
+				   rest_cache_entry_t *stale);
+
+void rest_cache_store(rlm_rest_t *instance, REQUEST *request, void *handle, char const *key,
+		      rlm_rcode_t rcode);
+
+int rest_cache_flush(void *instance, char const *key);
+
+ssize_t rest_cache_xlat(void *instance, REQUEST *request, char const *fmt, char *out, size_t freespace);
+
 /*
  *	Helper functions
  */
@@ -78,14 +78,29 @@ static const CONF_PARSER section_config[] = {
 	{ NULL, -1, 0, NULL, NULL }
 };
 
+/*
+ *	Cache of authorize responses
+ */
+static const CONF_PARSER cache_config[] = {
+	{ "ttl", FR_CONF_OFFSET(PW_TYPE_INTEGER, rlm_rest_t, cache_ttl), "0" },
+	{ "max_ttl", FR_CONF_OFFSET(PW_TYPE_INTEGER, rlm_rest_t, cache_max_ttl), "3600" },
+	{ "max_entries", FR_CONF_OFFSET(PW_TYPE_INTEGER, rlm_rest_t, cache_max_entries), "16384" },
+
+	{ NULL, -1, 0, NULL, NULL }
+};
+
 static const CONF_PARSER module_config[] = {
 	{ "connect_uri", FR_CONF_OFFSET(PW_TYPE_STRING, rlm_rest_t, connect_uri), NULL },
+	{ "multiplex", FR_CONF_OFFSET(PW_TYPE_BOOLEAN, rlm_rest_t, multiplex), "no" },
+	{ "max_host_connections", FR_CONF_OFFSET(PW_TYPE_INTEGER, rlm_rest_t, max_host_connections), "0" },
+
+	{ "cache", FR_CONF_POINTER(PW_TYPE_SUBSECTION, NULL), (void const *) cache_config },
 
 	{ NULL, -1, 0, NULL, NULL }
 };
 
-static int rlm_rest_perform(rlm_rest_t *instance, rlm_rest_section_t *section, void *handle, REQUEST *request,
-			    char const *username, char const *password)
+static int rlm_rest_config(rlm_rest_t *instance, rlm_rest_section_t *section, void *handle, REQUEST *request,
+			   char const *username, char const *password, char **key)
 {
 	ssize_t uri_len;
 	char *uri = NULL;
@@ -109,7 +124,35 @@ static int rlm_rest_perform(rlm_rest_t *instance, rlm_rest_section_t *section, v
 	 */
 	ret = rest_request_config(instance, section, request, handle, section->method, section->body,
 				  uri, username, password);
+	if (ret < 0) {
+		talloc_free(uri);
+		return -1;
+	}
+
+	/*
+	 *  The response may be cached, so record what it's
+	 *  decoded into.
+	 */
+	if (key) {
+		*key = rest_cache_key(request, handle, section->method, uri);
+		if (!*key) {
+			talloc_free(uri);
+			return -1;
+		}
+
+		((rlm_rest_handle_t *) handle)->ctx->response.capture = true;
+	}
 	talloc_free(uri);
+
+	return 0;
+}
+
+static int rlm_rest_perform(rlm_rest_t *instance, rlm_rest_section_t *section, void *handle, REQUEST *request,
+			    char const *username, char const *password)
+{
+	int ret;
+
+	ret = rlm_rest_config(instance, section, handle, request, username, password, NULL);
 	if (ret < 0) return -1;
 
 	/*
@@ -281,12 +324,35 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authorize(void *instance, REQUEST *reque
 	int rcode = RLM_MODULE_OK;
 	int ret;
 
+	char *key = NULL;
+	rest_cache_entry_t *stale = NULL;
+	rlm_rcode_t cached;
+
 	if (!section->name) return RLM_MODULE_NOOP;
 
 	handle = fr_connection_get(inst->conn_pool);
 	if (!handle) return RLM_MODULE_FAIL;
 
-	ret = rlm_rest_perform(instance, section, handle, request, NULL, NULL);
+	ret = rlm_rest_config(instance, section, handle, request, NULL, NULL, inst->cache ? &key : NULL);
+	if (ret < 0) {
+		rcode = RLM_MODULE_FAIL;
+		goto finish;
+	}
+
+	/*
+	 *	The same request was sent recently, and the response
+	 *	can be used again.
+	 */
+	if (key && (rest_cache_find(inst, request, handle, key, &stale, &cached) == 1)) {
+		rcode = cached;
+		goto finish;
+	}
+
+	/*
+	 *  Send the CURL request, pre-parse headers, aggregate incoming
+	 *  HTTP body data into a single contiguous buffer.
+	 */
+	ret = rest_request_perform(instance, section, request, handle);
 	if (ret < 0) {
 		rcode = RLM_MODULE_FAIL;
 		goto finish;
@@ -294,6 +360,16 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authorize(void *instance, REQUEST *reque
 
 	hcode = rest_get_handle_code(handle);
 	switch (hcode) {
+	case 304:
+		if (!stale) {
+			rcode = RLM_MODULE_INVALID;
+			break;
+		}
+
+		rcode = rest_cache_revalidated(inst, request, handle, stale);
+		stale = NULL;
+		goto finish;
+
 	case 404:
 	case 410:
 		rcode = RLM_MODULE_NOTFOUND;
@@ -337,6 +413,8 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authorize(void *instance, REQUEST *reque
 		}
 	}
 
+	if (key) rest_cache_store(inst, request, handle, key, rcode);
+
 finish:
 	switch (rcode) {
 	case RLM_MODULE_INVALID:
@@ -349,6 +427,9 @@ finish:
 		break;
 	}
 
+	talloc_free(stale);
+	talloc_free(key);
+
 	rlm_rest_cleanup(instance, section, handle);
 
 	fr_connection_release(inst->conn_pool, handle);
@@ -753,11 +834,36 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 		return -1;
 	}
 
+	/*
+	 *	Share connections between all threads.
+	 */
+	if (inst->multiplex && (rest_multi_init(inst) < 0)) {
+		return -1;
+	}
+
 	inst->conn_pool = fr_connection_pool_module_init(conf, inst, mod_conn_create, mod_conn_alive, NULL);
 	if (!inst->conn_pool) {
 		return -1;
 	}
 
+	/*
+	 *	Cache authorize responses, so the same request isn't
+	 *	sent over and over.
+	 */
+	if (inst->cache_ttl && inst->authorize.name) {
+		if ((inst->authorize.chunk > 0) && (inst->authorize.body != HTTP_BODY_NONE)) {
+			cf_log_err_cs(conf, "The cache can't be used with chunked authorize requests");
+			return -1;
+		}
+
+		FR_INTEGER_BOUND_CHECK("cache.max_ttl", inst->cache_max_ttl, >=, inst->cache_ttl);
+		FR_INTEGER_BOUND_CHECK("cache.max_entries", inst->cache_max_entries, >=, 1);
+		if (rest_cache_init(inst) < 0) return -1;
+
+		inst->cache_xlat_name = talloc_asprintf(inst, "%s_cache", inst->xlat_name);
+		xlat_register(inst->cache_xlat_name, rest_cache_xlat, NULL, inst);
+	}
+
 	return 0;
 }
 
@@ -771,7 +877,12 @@ static int mod_detach(void *instance)
 
 	fr_connection_pool_delete(inst->conn_pool);
 
+	rest_multi_free(inst);
+
 	xlat_unregister(inst->xlat_name, rest_xlat, instance);
+	if (inst->cache_xlat_name) xlat_unregister(inst->cache_xlat_name, rest_cache_xlat, instance);
+
+	rest_cache_free(inst);
 
 	/* Free any memory used by libcurl */
 	rest_cleanup();
@@ -806,4 +917,8 @@ module_t rlm_rest = {
 		NULL,			/* post-proxy */
 		mod_post_auth		/* post-auth */
 	},
+	0,				/* thread_inst_size */
+	NULL,				/* thread_instantiate */
+	NULL,				/* thread_detach */
+	rest_cache_flush		/* cache_flush */
 };
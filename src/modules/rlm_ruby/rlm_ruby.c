@@ -70,7 +70,9 @@ typedef struct rlm_ruby_t {
 
 	char const *filename;
 	char const *module_name;
+	bool pass_by_reference;
 	VALUE module;
+	VALUE pairs_class;
 
 } rlm_ruby_t;
 
@@ -86,6 +88,7 @@ typedef struct rlm_ruby_t {
 static const CONF_PARSER module_config[] = {
 	{ "filename", FR_CONF_OFFSET(PW_TYPE_FILE_INPUT | PW_TYPE_REQUIRED, struct rlm_ruby_t, filename), NULL },
 	{ "module", FR_CONF_OFFSET(PW_TYPE_STRING, struct rlm_ruby_t, module_name), "Radiusd" },
+	{ "pass_by_reference", FR_CONF_OFFSET(PW_TYPE_BOOLEAN, struct rlm_ruby_t, pass_by_reference), "no" },
 	{ NULL, -1, 0, NULL, NULL } /* end of module_config */
 };
 
@@ -186,14 +189,315 @@ static void add_vp_tuple(TALLOC_CTX *ctx, REQUEST *request, VALUE_PAIR **vpp, VA
 
 }
 
+#define BUF_SIZE 1024
+
+/*
+ *	Radiusd::Pairs
+ *
+ *	Gives Ruby the request's attribute lists by reference, instead
+ *	of printing every attribute into an array on each call.
+ *	Attributes are only converted when they're looked at, and
+ *	writes go straight into the list.
+ *
+ *	"each" yields [name, value] arrays, so with Enumerable the
+ *	object can be used where the array of arrays was.
+ */
+typedef struct rb_pairs {
+	REQUEST		*request;	//!< Request the list belongs to, NULL once the call has returned.
+	TALLOC_CTX	*ctx;		//!< Context to allocate new attributes in.
+	VALUE_PAIR	**vps;		//!< The list.
+	VALUE		reply;		//!< Pairs object for the reply list.
+	VALUE		config;		//!< Pairs object for the control list.
+} rb_pairs_t;
+
+static void rb_pairs_mark(void *ptr)
+{
+	rb_pairs_t *t = ptr;
+
+	rb_gc_mark(t->reply);
+	rb_gc_mark(t->config);
+}
+
+static VALUE rb_pairs_alloc(VALUE klass, REQUEST *request, TALLOC_CTX *ctx, VALUE_PAIR **vps)
+{
+	rb_pairs_t *t;
+
+	t = ALLOC(rb_pairs_t);
+	t->request = request;
+	t->ctx = ctx;
+	t->vps = vps;
+	t->reply = Qnil;
+	t->config = Qnil;
+
+	return Data_Wrap_Struct(klass, rb_pairs_mark, RUBY_DEFAULT_FREE, t);
+}
+
+static VALUE rb_pairs_new(VALUE klass, REQUEST *request)
+{
+	VALUE		self;
+	rb_pairs_t	*t;
+
+	self = rb_pairs_alloc(klass, request, request->packet, &request->packet->vps);
+	Data_Get_Struct(self, rb_pairs_t, t);
+
+	t->reply = rb_pairs_alloc(klass, request, request->reply, &request->reply->vps);
+	t->config = rb_pairs_alloc(klass, request, request, &request->config_items);
+
+	return self;
+}
+
+/** Stop a function from touching the request after it's returned
+ *
+ */
+static void rb_pairs_release(VALUE self)
+{
+	rb_pairs_t *t;
+
+	Data_Get_Struct(self, rb_pairs_t, t);
+	t->request = NULL;
+	t->vps = NULL;
+	if (!NIL_P(t->reply)) rb_pairs_release(t->reply);
+	if (!NIL_P(t->config)) rb_pairs_release(t->config);
+}
+
+static rb_pairs_t *rb_pairs_get(VALUE self)
+{
+	rb_pairs_t *t;
+
+	Data_Get_Struct(self, rb_pairs_t, t);
+	if (!t->vps) rb_raise(rb_eRuntimeError, "Radiusd::Pairs used after the function returned");
+
+	return t;
+}
+
+/** Resolve "Attribute-Name" or "Attribute-Name:tag"
+ *
+ */
+static DICT_ATTR const *rb_pairs_attr(char const *name, int8_t *tag)
+{
+	char const	*p;
+	char		buf[256];
+	DICT_ATTR const	*da;
+
+	*tag = TAG_ANY;
+
+	p = strchr(name, ':');
+	if (!p) return dict_attrbyname(name);
+
+	if ((size_t) (p - name) >= sizeof(buf)) return NULL;
+
+	memcpy(buf, name, p - name);
+	buf[p - name] = '\0';
+	da = dict_attrbyname(buf);
+	if (da && da->flags.has_tag) *tag = atoi(p + 1);
+
+	return da;
+}
+
+/** Convert the value of an attribute to the closest Ruby type
+ *
+ */
+static VALUE rb_pairs_value(VALUE_PAIR const *vp)
+{
+	char buf[BUF_SIZE];
+
+	switch (vp->da->type) {
+	case PW_TYPE_STRING:
+		return rb_str_new(vp->vp_strvalue, vp->length);
+
+	case PW_TYPE_OCTETS:
+		return rb_str_new((char const *) vp->vp_octets, vp->length);
+
+	case PW_TYPE_INTEGER:
+	case PW_TYPE_DATE:
+		return UINT2NUM(vp->vp_integer);
+
+	case PW_TYPE_SHORT:
+		return INT2FIX(vp->vp_short);
+
+	case PW_TYPE_BYTE:
+		return INT2FIX(vp->vp_byte);
+
+	case PW_TYPE_SIGNED:
+		return INT2NUM(vp->vp_signed);
+
+	case PW_TYPE_INTEGER64:
+		return ULL2NUM(vp->vp_integer64);
+
+	default:
+		vp_prints_value(buf, sizeof(buf), vp, '\0');
+		return rb_str_new2(buf);
+	}
+}
+
+/** Build the [name, value] array the array interface passed
+ *
+ */
+static VALUE rb_pairs_tuple(VALUE_PAIR const *vp)
+{
+	char name[BUF_SIZE];
+	char buf[BUF_SIZE];
+
+	if (vp->da->flags.has_tag) {
+		snprintf(name, sizeof(name), "%s:%d", vp->da->name, vp->tag);
+	} else {
+		strlcpy(name, vp->da->name, sizeof(name));
+	}
+	vp_prints_value(buf, sizeof(buf), vp, '"');
+
+	return rb_assoc_new(rb_str_new2(name), rb_str_new2(buf));
+}
+
+/* pairs[name], or pairs[index] for the [name, value] array at that index */
+static VALUE rb_pairs_aref(VALUE self, VALUE key)
+{
+	rb_pairs_t	*t = rb_pairs_get(self);
+	DICT_ATTR const	*da;
+	VALUE_PAIR	*vp;
+	int8_t		tag;
+
+	if (FIXNUM_P(key)) {
+		long i = FIX2LONG(key);
+
+		for (vp = *t->vps; vp && (i > 0); vp = vp->next, i--);
+		if (!vp || (i < 0)) return Qnil;
+
+		return rb_pairs_tuple(vp);
+	}
+
+	da = rb_pairs_attr(StringValueCStr(key), &tag);
+	if (!da) return Qnil;
+
+	vp = pairfind_da(*t->vps, da, tag);
+	if (!vp) return Qnil;
+
+	return rb_pairs_value(vp);
+}
+
+/* pairs[name] = value replaces every attribute of that name, nil deletes them */
+static VALUE rb_pairs_aset(VALUE self, VALUE key, VALUE value)
+{
+	rb_pairs_t	*t = rb_pairs_get(self);
+	DICT_ATTR const	*da;
+	int8_t		tag;
+	char const	*name;
+
+	name = StringValueCStr(key);
+	da = rb_pairs_attr(name, &tag);
+	if (!da) rb_raise(rb_eKeyError, "Unknown attribute '%s'", name);
+
+	pairdelete(t->vps, da->attr, da->vendor, tag);
+	if (NIL_P(value)) return value;
+
+	value = rb_obj_as_string(value);
+	if (!pairmake(t->ctx, t->vps, name, StringValueCStr(value), T_OP_EQ)) {
+		rb_raise(rb_eArgError, "%s", fr_strerror());
+	}
+
+	return value;
+}
+
+static VALUE rb_pairs_delete(VALUE self, VALUE key)
+{
+	return rb_pairs_aset(self, key, Qnil);
+}
+
+static VALUE rb_pairs_has_key(VALUE self, VALUE key)
+{
+	rb_pairs_t	*t = rb_pairs_get(self);
+	DICT_ATTR const	*da;
+	int8_t		tag;
+
+	da = rb_pairs_attr(StringValueCStr(key), &tag);
+	if (!da) return Qfalse;
+
+	return pairfind_da(*t->vps, da, tag) ? Qtrue : Qfalse;
+}
+
+static VALUE rb_pairs_each(VALUE self)
+{
+	rb_pairs_t	*t = rb_pairs_get(self);
+	VALUE_PAIR	*vp;
+
+	for (vp = *t->vps; vp; vp = vp->next) {
+		rb_yield(rb_pairs_tuple(vp));
+
+		/* The block may have used this object after the call, or changed the list */
+		if (!t->vps) break;
+	}
+
+	return self;
+}
+
+static VALUE rb_pairs_keys(VALUE self)
+{
+	rb_pairs_t	*t = rb_pairs_get(self);
+	VALUE_PAIR	*vp;
+	VALUE		keys;
+	char		name[BUF_SIZE];
+
+	keys = rb_ary_new();
+	for (vp = *t->vps; vp; vp = vp->next) {
+		if (vp->da->flags.has_tag) {
+			snprintf(name, sizeof(name), "%s:%d", vp->da->name, vp->tag);
+		} else {
+			strlcpy(name, vp->da->name, sizeof(name));
+		}
+		rb_ary_push(keys, rb_str_new2(name));
+	}
+
+	return keys;
+}
+
+static VALUE rb_pairs_size(VALUE self)
+{
+	rb_pairs_t	*t = rb_pairs_get(self);
+	VALUE_PAIR	*vp;
+	long		len = 0;
+
+	for (vp = *t->vps; vp; vp = vp->next) len++;
+
+	return LONG2NUM(len);
+}
+
+static VALUE rb_pairs_reply(VALUE self)
+{
+	return rb_pairs_get(self)->reply;
+}
+
+static VALUE rb_pairs_config(VALUE self)
+{
+	return rb_pairs_get(self)->config;
+}
+
+static VALUE rb_pairs_define(VALUE module)
+{
+	VALUE klass;
+
+	klass = rb_define_class_under(module, "Pairs", rb_cObject);
+	rb_undef_alloc_func(klass);
+	rb_include_module(klass, rb_mEnumerable);
+
+	rb_define_method(klass, "[]", rb_pairs_aref, 1);
+	rb_define_method(klass, "[]=", rb_pairs_aset, 2);
+	rb_define_method(klass, "delete", rb_pairs_delete, 1);
+	rb_define_method(klass, "has_key?", rb_pairs_has_key, 1);
+	rb_define_method(klass, "each", rb_pairs_each, 0);
+	rb_define_method(klass, "keys", rb_pairs_keys, 0);
+	rb_define_method(klass, "size", rb_pairs_size, 0);
+	rb_define_method(klass, "length", rb_pairs_size, 0);
+	rb_define_method(klass, "reply", rb_pairs_reply, 0);
+	rb_define_method(klass, "config", rb_pairs_config, 0);
+
+	return klass;
+}
+
 /* This is the core Ruby function that the others wrap around.
  * Pass the value-pair print strings in a tuple.
  * xxx We're not checking the errors. If we have errors, what do we do?
  */
-
-#define BUF_SIZE 1024
-static rlm_rcode_t CC_HINT(nonnull (4)) do_ruby(REQUEST *request, unsigned long func,
-						VALUE module, char const *function_name)
+static rlm_rcode_t CC_HINT(nonnull (2,4)) do_ruby(REQUEST *request, rlm_ruby_t *inst, unsigned long func,
+						  char const *function_name)
 {
 	rlm_rcode_t rcode = RLM_MODULE_OK;
 	vp_cursor_t cursor;
@@ -213,6 +517,17 @@ static rlm_rcode_t CC_HINT(nonnull (4)) do_ruby(REQUEST *request, unsigned long
 		return rcode;
 	}
 
+	/*
+	 *	Pass the lists by reference, and the function changes
+	 *	them in place.
+	 */
+	if (inst->pass_by_reference && request) {
+		rb_request = rb_pairs_new(inst->pairs_class, request);
+		rb_result = rb_funcall(inst->module, func, 1, rb_request);
+		rb_pairs_release(rb_request);
+		goto result;
+	}
+
 	n_tuple = 0;
 	if (request) {
 		for (vp = fr_cursor_init(&cursor, &request->packet->vps);
@@ -251,7 +566,9 @@ static rlm_rcode_t CC_HINT(nonnull (4)) do_ruby(REQUEST *request, unsigned long
 	}
 
 	/* Calling corresponding ruby function, passing request and catching result */
-	rb_result = rb_funcall(module, func, 1, rb_request);
+	rb_result = rb_funcall(inst->module, func, 1, rb_request);
+
+result:
 
 	/*
 	 *	Checking result, it can be array of type [result,
@@ -378,6 +695,7 @@ static int mod_instantiate(UNUSED CONF_SECTION *conf, void *instance)
 	 *	Expose some FreeRADIUS API functions as ruby functions
 	 */
 	rb_define_module_function(module, "radlog", radlog_rb, 2);
+	inst->pairs_class = rb_pairs_define(module);
 
 	DEBUG("Loading file %s...", inst->filename);
 	rb_load_protect(rb_str_new2(inst->filename), 0, &status);
@@ -411,14 +729,13 @@ static int mod_instantiate(UNUSED CONF_SECTION *conf, void *instance)
 	RLM_RUBY_LOAD(detach);
 
 	/* Call the instantiate function.  No request.  Use the return value. */
-	return do_ruby(NULL, inst->func_instantiate, inst->module, "instantiate");
+	return do_ruby(NULL, inst, inst->func_instantiate, "instantiate");
 }
 
 #define RLM_RUBY_FUNC(foo) static rlm_rcode_t CC_HINT(nonnull) mod_##foo(void *instance, REQUEST *request) \
 	{ \
-		return do_ruby(request,	\
-			       ((struct rlm_ruby_t *)instance)->func_##foo,((struct rlm_ruby_t *)instance)->module, \
-			       #foo); \
+		return do_ruby(request,	(struct rlm_ruby_t *)instance, \
+			       ((struct rlm_ruby_t *)instance)->func_##foo, #foo); \
 	}
 
 RLM_RUBY_FUNC(authorize)
@@ -473,4 +790,8 @@ module_t rlm_ruby = {
 		mod_send_coa
 #endif
 	},
+	0,				/* thread_inst_size */
+	NULL,				/* thread_instantiate */
+	NULL,				/* thread_detach */
+	NULL				/* cache_flush */
 };
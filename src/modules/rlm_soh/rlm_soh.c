@@ -228,4 +228,8 @@ module_t rlm_soh = {
 		NULL,			/* post-proxy */
 		mod_post_auth		/* post-auth */
 	},
+	0,				/* thread_inst_size */
+	NULL,				/* thread_instantiate */
+	NULL,				/* thread_detach */
+	NULL				/* cache_flush */
 };
@@ -195,4 +195,8 @@ module_t rlm_sometimes = {
 		mod_sometimes_reply	/* send-coa */
 #endif
 	},
+	0,				/* thread_inst_size */
+	NULL,				/* thread_instantiate */
+	NULL,				/* thread_detach */
+	NULL				/* cache_flush */
 };
@@ -0,0 +1,378 @@
+/*
+ *   This program is is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License, version 2 if the
+ *   License as published by the Free Software Foundation.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+/**
+ * $Id$
+ * @file cache.c
+ * @brief SQL module cache of authorize_query results.
+ *
+ * Entries are found by the expanded SQL-User-Name, and hold the rows which
+ * authorize_query returned for that user.  The rows are parsed again for
+ * each request, so xlat values and check items behave as if they'd been
+ * read from the database.  Users who had no rows are remembered for a
+ * shorter time.
+ *
+ * @copyright 2016 The FreeRADIUS Server Project.
+ */
+RCSID("$Id$")
+
+#include	<freeradius-devel/radiusd.h>
+#include	<freeradius-devel/rad_assert.h>
+
+#include	"rlm_sql.h"
+
+#ifdef HAVE_PTHREAD_H
+#  define CACHE_LOCK(_inst)	pthread_mutex_lock(&(_inst)->cache_mutex)
+#  define CACHE_UNLOCK(_inst)	pthread_mutex_unlock(&(_inst)->cache_mutex)
+#else
+#  define CACHE_LOCK(_inst)
+#  define CACHE_UNLOCK(_inst)
+#endif
+
+/** The rows authorize_query returned for one user
+ *
+ */
+struct sql_cache_entry {
+	char const		*key;		//!< Expanded SQL-User-Name.
+	time_t			expires;	//!< When the entry is removed from the cache.
+	int			heap_id;	//!< Position in the expiry heap.
+
+	rlm_sql_row_t		*rows;		//!< SQL_CACHE_COLUMNS columns each.
+	int			num_rows;
+};
+
+static int sql_cache_cmp(void const *one, void const *two)
+{
+	sql_cache_entry_t const *a = one;
+	sql_cache_entry_t const *b = two;
+
+	return strcmp(a->key, b->key);
+}
+
+static int sql_cache_heap_cmp(void const *one, void const *two)
+{
+	sql_cache_entry_t const *a = one;
+	sql_cache_entry_t const *b = two;
+
+	if (a->expires < b->expires) return -1;
+	if (a->expires > b->expires) return +1;
+
+	return 0;
+}
+
+/*
+ *	Copy the columns we use from a row.
+ */
+static rlm_sql_row_t sql_cache_row_copy(TALLOC_CTX *ctx, rlm_sql_row_t row)
+{
+	rlm_sql_row_t	copy;
+	int		i;
+
+	copy = talloc_zero_array(ctx, char *, SQL_CACHE_COLUMNS);
+	if (!copy) return NULL;
+
+	for (i = 0; i < SQL_CACHE_COLUMNS; i++) {
+		if (row[i]) copy[i] = talloc_typed_strdup(copy, row[i]);
+	}
+
+	return copy;
+}
+
+/** Remove an entry from the cache, and free it
+ *
+ * Must be called with the cache mutex held.
+ */
+static void sql_cache_remove(rlm_sql_t *inst, sql_cache_entry_t *entry)
+{
+	fr_heap_extract(inst->cache_heap, entry);
+	rbtree_deletebydata(inst->cache, entry);
+	talloc_free(entry);
+}
+
+/** Remove expired entries from the cache
+ *
+ * Must be called with the cache mutex held.
+ */
+static void sql_cache_expire(rlm_sql_t *inst, time_t now)
+{
+	sql_cache_entry_t *entry;
+
+	while ((entry = fr_heap_peek(inst->cache_heap)) && (entry->expires <= now)) {
+		sql_cache_remove(inst, entry);
+	}
+}
+
+/** Create the cache
+ *
+ * @param[in] inst rlm_sql configuration.
+ * @return 0 on success, -1 on error.
+ */
+int sql_cache_init(rlm_sql_t *inst)
+{
+#ifdef HAVE_PTHREAD_H
+	if (pthread_mutex_init(&inst->cache_mutex, NULL) < 0) {
+		ERROR("rlm_sql (%s): Failed initializing cache mutex: %s",
+		      inst->config->xlat_name, fr_syserror(errno));
+		return -1;
+	}
+#endif
+
+	inst->cache = rbtree_create(NULL, sql_cache_cmp, NULL, 0);
+	if (!inst->cache) {
+		ERROR("rlm_sql (%s): Failed creating cache", inst->config->xlat_name);
+		return -1;
+	}
+
+	inst->cache_heap = fr_heap_create(sql_cache_heap_cmp, offsetof(sql_cache_entry_t, heap_id));
+	if (!inst->cache_heap) {
+		ERROR("rlm_sql (%s): Failed creating heap for the cache", inst->config->xlat_name);
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Free the cache, and all of the entries in it
+ *
+ * @param[in] inst rlm_sql configuration.
+ */
+void sql_cache_free(rlm_sql_t *inst)
+{
+	sql_cache_entry_t *entry;
+
+	if (!inst->cache) return;
+
+	if (inst->cache_heap) {
+		while ((entry = fr_heap_peek(inst->cache_heap))) sql_cache_remove(inst, entry);
+		fr_heap_delete(inst->cache_heap);
+		inst->cache_heap = NULL;
+	}
+
+	rbtree_free(inst->cache);
+	inst->cache = NULL;
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_destroy(&inst->cache_mutex);
+#endif
+}
+
+/** Find the cached rows for a user
+ *
+ * The rows are copied, so they can be used after the entry expires.
+ *
+ * @param[in] inst rlm_sql configuration.
+ * @param[in] request Current request.  The copies are parented by it.
+ * @param[in] key Expanded SQL-User-Name.
+ * @param[out] out Where to write the rows.
+ * @return the number of rows, or -1 if the user isn't cached.
+ */
+int sql_cache_find(rlm_sql_t *inst, REQUEST *request, char const *key, rlm_sql_row_t **out)
+{
+	sql_cache_entry_t	*entry, my_entry;
+	rlm_sql_row_t		*rows = NULL;
+	int			i, num;
+
+	my_entry.key = key;
+
+	CACHE_LOCK(inst);
+	sql_cache_expire(inst, request->timestamp);
+
+	entry = rbtree_finddata(inst->cache, &my_entry);
+	if (!entry) {
+		CACHE_UNLOCK(inst);
+		return -1;
+	}
+
+	num = entry->num_rows;
+	if (num > 0) {
+		rows = talloc_array(request, rlm_sql_row_t, num);
+		if (!rows) {
+			CACHE_UNLOCK(inst);
+			return -1;
+		}
+
+		for (i = 0; i < num; i++) {
+			rows[i] = sql_cache_row_copy(rows, entry->rows[i]);
+			if (!rows[i]) {
+				CACHE_UNLOCK(inst);
+				talloc_free(rows);
+				return -1;
+			}
+		}
+	}
+	CACHE_UNLOCK(inst);
+
+	*out = rows;
+	return num;
+}
+
+/** Start a new entry
+ *
+ * Rows are added with sql_cache_entry_row(), and then the entry is put into
+ * the cache with sql_cache_add().
+ *
+ * @param[in] key Expanded SQL-User-Name.
+ * @return the new entry, or NULL on error.
+ */
+sql_cache_entry_t *sql_cache_entry_alloc(char const *key)
+{
+	sql_cache_entry_t *entry;
+
+	entry = talloc_zero(NULL, sql_cache_entry_t);
+	if (!entry) return NULL;
+
+	entry->key = talloc_typed_strdup(entry, key);
+
+	return entry;
+}
+
+/** Add a copy of a row to an entry
+ *
+ * @param[in] entry to add the row to.
+ * @param[in] row from authorize_query.
+ * @return 0 on success, -1 on error.
+ */
+int sql_cache_entry_row(sql_cache_entry_t *entry, rlm_sql_row_t row)
+{
+	rlm_sql_row_t *rows;
+
+	rows = talloc_realloc(entry, entry->rows, rlm_sql_row_t, entry->num_rows + 1);
+	if (!rows) return -1;
+	entry->rows = rows;
+
+	rows[entry->num_rows] = sql_cache_row_copy(rows, row);
+	if (!rows[entry->num_rows]) return -1;
+	entry->num_rows++;
+
+	return 0;
+}
+
+/** Put an entry into the cache
+ *
+ * The cache takes ownership of the entry, which is freed if it can't be
+ * added.
+ *
+ * @param[in] inst rlm_sql configuration.
+ * @param[in] request Current request.
+ * @param[in] entry to add.
+ */
+void sql_cache_add(rlm_sql_t *inst, REQUEST *request, sql_cache_entry_t *entry)
+{
+	sql_cache_entry_t *old;
+
+	if (!entry->num_rows && !inst->config->cache_negative_ttl) {
+		talloc_free(entry);
+		return;
+	}
+
+	entry->expires = request->timestamp +
+			 (entry->num_rows ? inst->config->cache_ttl : inst->config->cache_negative_ttl);
+
+	CACHE_LOCK(inst);
+	sql_cache_expire(inst, request->timestamp);
+
+	/*
+	 *	Another request for the same user got there first,
+	 *	or the user has been updated.  Ours is newer.
+	 */
+	old = rbtree_finddata(inst->cache, entry);
+	if (old) sql_cache_remove(inst, old);
+
+	/*
+	 *	Make room by removing the entry which would expire
+	 *	soonest.
+	 */
+	if (rbtree_num_elements(inst->cache) >= inst->config->cache_max_entries) {
+		old = fr_heap_peek(inst->cache_heap);
+		if (old) sql_cache_remove(inst, old);
+	}
+
+	if (!rbtree_insert(inst->cache, entry)) {
+		RWDEBUG("Failed adding user to the cache");
+		talloc_free(entry);
+	} else if (!fr_heap_insert(inst->cache_heap, entry)) {
+		RWDEBUG("Failed adding user to the cache");
+		rbtree_deletebydata(inst->cache, entry);
+		talloc_free(entry);
+	}
+	CACHE_UNLOCK(inst);
+}
+
+typedef struct sql_cache_flush {
+	fr_heap_t	*heap;
+	char const	*key;
+	int		count;
+} sql_cache_flush_t;
+
+static int sql_cache_flush_walk(void *ctx, void *data)
+{
+	sql_cache_flush_t	*flush = ctx;
+	sql_cache_entry_t	*entry = data;
+
+	if (flush->key && (strcmp(entry->key, flush->key) != 0)) return 0;
+
+	fr_heap_extract(flush->heap, entry);
+	talloc_free(entry);
+	flush->count++;
+
+	return 2;	/* Delete and continue */
+}
+
+/** Discard the cached rows for a user
+ *
+ * @param[in] inst rlm_sql configuration.
+ * @param[in] key Expanded SQL-User-Name.
+ */
+void sql_cache_invalidate(rlm_sql_t *inst, char const *key)
+{
+	sql_cache_entry_t	*entry, my_entry;
+
+	if (!inst->cache) return;
+
+	my_entry.key = key;
+
+	CACHE_LOCK(inst);
+	entry = rbtree_finddata(inst->cache, &my_entry);
+	if (entry) sql_cache_remove(inst, entry);
+	CACHE_UNLOCK(inst);
+}
+
+/** Discard cached users
+ *
+ * Called by "radmin flush module <module> [<key>]".
+ *
+ * @param[in] instance rlm_sql configuration.
+ * @param[in] key SQL-User-Name of the user to discard, or NULL to discard all entries.
+ * @return the number of entries discarded.
+ */
+int sql_cache_flush(void *instance, char const *key)
+{
+	rlm_sql_t		*inst = instance;
+	sql_cache_flush_t	flush;
+
+	if (!inst->cache) return 0;
+
+	flush.heap = inst->cache_heap;
+	flush.key = key;
+	flush.count = 0;
+
+	CACHE_LOCK(inst);
+	rbtree_walk(inst->cache, RBTREE_DELETE_ORDER, sql_cache_flush_walk, &flush);
+	CACHE_UNLOCK(inst);
+
+	INFO("rlm_sql (%s): Flushed %i cached users", inst->config->xlat_name, flush.count);
+
+	return flush.count;
+}
@@ -329,4 +329,7 @@ rlm_sql_module_t rlm_sql_db2 = {
 	sql_finish_query,
 	sql_finish_select_query,
 	sql_affected_rows,
+	NULL, /* sql_prepare */
+	NULL, /* sql_execute */
+	NULL /* sql_pipeline */
 };
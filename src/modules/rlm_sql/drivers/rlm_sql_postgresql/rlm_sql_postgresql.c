@@ -42,6 +42,7 @@ RCSID("$Id$")
 #include <freeradius-devel/radiusd.h>
 
 #include <sys/stat.h>
+#include <poll.h>
 
 #include <libpq-fe.h>
 #include <postgres_ext.h>
@@ -258,35 +259,14 @@ static int CC_HINT(nonnull) sql_init_socket(rlm_sql_handle_t *handle, rlm_sql_co
 	return 0;
 }
 
-/*************************************************************************
- *
- *	Function: sql_query
- *
- *	Purpose: Issue a query to the database
- *
- *************************************************************************/
-static CC_HINT(nonnull) sql_rcode_t sql_query(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config,
-					      char const *query)
+/*
+ *	Check the result of a query, or of a prepared statement.
+ */
+static sql_rcode_t sql_check_result(rlm_sql_postgres_conn_t *conn)
 {
-	rlm_sql_postgres_conn_t *conn = handle->conn;
 	ExecStatusType status;
 	int numfields = 0;
 
-	if (!conn->db) {
-		ERROR("rlm_sql_postgresql: Socket not connected");
-		return RLM_SQL_RECONNECT;
-	}
-
-	/*
-	 *  Returns a PGresult pointer or possibly a null pointer.
-	 *  A non-null pointer will generally be returned except in
-	 *  out-of-memory conditions or serious errors such as inability
-	 *  to send the command to the server. If a null pointer is
-	 *  returned, it should be treated like a PGRES_FATAL_ERROR
-	 *  result.
-	 */
-	conn->result = PQexec(conn->db, query);
-
 	/*
 	 *  As this error COULD be a connection error OR an out-of-memory
 	 *  condition return value WILL be wrong SOME of the time
@@ -356,6 +336,294 @@ static CC_HINT(nonnull) sql_rcode_t sql_query(rlm_sql_handle_t *handle, UNUSED r
 	return RLM_SQL_ERROR;
 }
 
+/*************************************************************************
+ *
+ *	Function: sql_query
+ *
+ *	Purpose: Issue a query to the database
+ *
+ *************************************************************************/
+static CC_HINT(nonnull) sql_rcode_t sql_query(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config,
+					      char const *query)
+{
+	rlm_sql_postgres_conn_t *conn = handle->conn;
+
+	if (!conn->db) {
+		ERROR("rlm_sql_postgresql: Socket not connected");
+		return RLM_SQL_RECONNECT;
+	}
+
+	/*
+	 *  Returns a PGresult pointer or possibly a null pointer.
+	 *  A non-null pointer will generally be returned except in
+	 *  out-of-memory conditions or serious errors such as inability
+	 *  to send the command to the server. If a null pointer is
+	 *  returned, it should be treated like a PGRES_FATAL_ERROR
+	 *  result.
+	 */
+	conn->result = PQexec(conn->db, query);
+
+	return sql_check_result(conn);
+}
+
+/*************************************************************************
+ *
+ *	Function: sql_prepare
+ *
+ *	Purpose: Prepare a statement on the connection.  The statement
+ *	       is named from its id, and lasts as long as the connection,
+ *	       or until a newer statement with the same id replaces it.
+ *
+ *************************************************************************/
+static CC_HINT(nonnull) sql_rcode_t sql_prepare(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config,
+						sql_prepared_t const *stmt)
+{
+	rlm_sql_postgres_conn_t *conn = handle->conn;
+	char name[32];
+	sql_rcode_t rcode;
+
+	if (!conn->db) {
+		ERROR("rlm_sql_postgresql: Socket not connected");
+		return RLM_SQL_RECONNECT;
+	}
+
+	snprintf(name, sizeof(name), "fr_%u", stmt->id);
+
+	/*
+	 *  An older statement which had the same id.
+	 */
+	if (handle->prepared[stmt->id]) {
+		char query[64];
+
+		snprintf(query, sizeof(query), "DEALLOCATE %s", name);
+		conn->result = PQexec(conn->db, query);
+		rcode = sql_check_result(conn);
+
+		PQclear(conn->result);
+		conn->result = NULL;
+
+		if (rcode != RLM_SQL_OK) return rcode;
+		handle->prepared[stmt->id] = 0;
+	}
+
+	/*
+	 *  The parameter types are left for the server to infer.
+	 */
+	conn->result = PQprepare(conn->db, name, stmt->query, stmt->num_params, NULL);
+	rcode = sql_check_result(conn);
+
+	PQclear(conn->result);
+	conn->result = NULL;
+
+	return rcode;
+}
+
+/*************************************************************************
+ *
+ *	Function: sql_execute
+ *
+ *	Purpose: Run a prepared statement, with its parameters sent
+ *	       separately from the query, as text.
+ *
+ *************************************************************************/
+static CC_HINT(nonnull) sql_rcode_t sql_execute(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config,
+						sql_prepared_t const *stmt, char const * const *values)
+{
+	rlm_sql_postgres_conn_t *conn = handle->conn;
+	char name[32];
+
+	if (!conn->db) {
+		ERROR("rlm_sql_postgresql: Socket not connected");
+		return RLM_SQL_RECONNECT;
+	}
+
+	snprintf(name, sizeof(name), "fr_%u", stmt->id);
+
+	conn->result = PQexecPrepared(conn->db, name, stmt->num_params, values, NULL, NULL, 0);
+
+	return sql_check_result(conn);
+}
+
+#ifdef HAVE_PQENTERPIPELINEMODE
+/*
+ *	Wait until a result can be read without blocking, sending any
+ *	queries which are still buffered.  Both sides can have a lot of
+ *	data in flight, so we can't just block in PQgetResult().
+ */
+static sql_rcode_t sql_pipeline_wait(rlm_sql_postgres_conn_t *conn, rlm_sql_config_t *config)
+{
+	int timeout = config->query_timeout ? (int) config->query_timeout * 1000 : -1;
+
+	for (;;) {
+		struct pollfd	pfd;
+		int		flush, rcode;
+
+		flush = PQflush(conn->db);
+		if (flush < 0) {
+			ERROR("rlm_sql_postgresql: Failed sending queries: %s", PQerrorMessage(conn->db));
+			return RLM_SQL_RECONNECT;
+		}
+
+		if (!PQisBusy(conn->db)) return RLM_SQL_OK;
+
+		pfd.fd = PQsocket(conn->db);
+		pfd.events = POLLIN | (flush ? POLLOUT : 0);
+		pfd.revents = 0;
+
+		rcode = poll(&pfd, 1, timeout);
+		if (rcode < 0) {
+			if (errno == EINTR) continue;
+
+			ERROR("rlm_sql_postgresql: Failed waiting for results: %s", fr_syserror(errno));
+			return RLM_SQL_RECONNECT;
+		}
+
+		if (rcode == 0) {
+			ERROR("rlm_sql_postgresql: Timed out waiting for results");
+			return RLM_SQL_RECONNECT;
+		}
+
+		if ((pfd.revents & (POLLIN | POLLERR | POLLHUP)) && !PQconsumeInput(conn->db)) {
+			ERROR("rlm_sql_postgresql: Failed reading results: %s", PQerrorMessage(conn->db));
+			return RLM_SQL_RECONNECT;
+		}
+	}
+}
+
+/*************************************************************************
+ *
+ *	Function: sql_pipeline
+ *
+ *	Purpose: Send several queries without waiting for the result
+ *	       of each one, and then read all of the results.  The
+ *	       number of rows affected by each query is written to
+ *	       'affected', or -1 if it failed.
+ *
+ *************************************************************************/
+static CC_HINT(nonnull) sql_rcode_t sql_pipeline(rlm_sql_handle_t *handle, rlm_sql_config_t *config,
+						 char const * const *queries, int num, int *affected)
+{
+	rlm_sql_postgres_conn_t *conn = handle->conn;
+	sql_rcode_t rcode = RLM_SQL_OK;
+	PGresult *result;
+	int i;
+
+	if (!conn->db) {
+		ERROR("rlm_sql_postgresql: Socket not connected");
+		return RLM_SQL_RECONNECT;
+	}
+
+	if (!PQenterPipelineMode(conn->db)) {
+		ERROR("rlm_sql_postgresql: Failed entering pipeline mode: %s", PQerrorMessage(conn->db));
+		return RLM_SQL_ERROR;
+	}
+
+	if (PQsetnonblocking(conn->db, 1) != 0) {
+		ERROR("rlm_sql_postgresql: Failed setting socket non-blocking: %s", PQerrorMessage(conn->db));
+		rcode = RLM_SQL_ERROR;
+		goto finish;
+	}
+
+	/*
+	 *  Only the extended query protocol can be used in a
+	 *  pipeline, so the queries are sent without parameters.
+	 */
+	for (i = 0; i < num; i++) {
+		affected[i] = -1;
+
+		if (!PQsendQueryParams(conn->db, queries[i], 0, NULL, NULL, NULL, NULL, 0)) {
+			ERROR("rlm_sql_postgresql: Failed sending query: %s", PQerrorMessage(conn->db));
+			rcode = RLM_SQL_RECONNECT;
+			goto finish;
+		}
+	}
+
+	if (!PQpipelineSync(conn->db)) {
+		ERROR("rlm_sql_postgresql: Failed sending pipeline sync: %s", PQerrorMessage(conn->db));
+		rcode = RLM_SQL_RECONNECT;
+		goto finish;
+	}
+
+	/*
+	 *  The result of each query is followed by a NULL.  Once a
+	 *  query has failed, the ones after it are aborted.  The sync
+	 *  comes last.
+	 */
+	for (i = 0; i <= num; i++) {
+		sql_rcode_t ret;
+
+		ret = sql_pipeline_wait(conn, config);
+		if (ret != RLM_SQL_OK) {
+			rcode = ret;
+			goto finish;
+		}
+
+		result = PQgetResult(conn->db);
+		if (!result) {
+			ERROR("rlm_sql_postgresql: Failed getting query result: %s", PQerrorMessage(conn->db));
+			rcode = RLM_SQL_RECONNECT;
+			goto finish;
+		}
+
+		if (i == num) {
+			if (PQresultStatus(result) != PGRES_PIPELINE_SYNC) {
+				ERROR("rlm_sql_postgresql: Expected pipeline sync, got %s",
+				      PQresStatus(PQresultStatus(result)));
+				rcode = RLM_SQL_RECONNECT;
+			}
+			PQclear(result);
+			break;
+		}
+
+		switch (PQresultStatus(result)) {
+		case PGRES_COMMAND_OK:
+			affected[i] = affected_rows(result);
+			break;
+
+		case PGRES_TUPLES_OK:
+			affected[i] = PQntuples(result);
+			break;
+
+		case PGRES_PIPELINE_ABORTED:
+			break;
+
+		case PGRES_NONFATAL_ERROR:
+		case PGRES_FATAL_ERROR:
+			if (rcode == RLM_SQL_OK) rcode = sql_classify_error(result);
+			break;
+
+		default:
+			if (rcode == RLM_SQL_OK) rcode = RLM_SQL_ERROR;
+			break;
+		}
+		PQclear(result);
+
+		ret = sql_pipeline_wait(conn, config);
+		if (ret != RLM_SQL_OK) {
+			rcode = ret;
+			goto finish;
+		}
+
+		result = PQgetResult(conn->db);
+		if (result) {
+			ERROR("rlm_sql_postgresql: Query returned more than one result");
+			PQclear(result);
+			rcode = RLM_SQL_RECONNECT;
+			goto finish;
+		}
+	}
+
+finish:
+	/*
+	 *  If the results weren't all read, the connection can't
+	 *  leave pipeline mode, and has to be re-opened.
+	 */
+	if (!PQexitPipelineMode(conn->db)) rcode = RLM_SQL_RECONNECT;
+	(void) PQsetnonblocking(conn->db, 0);
+
+	return rcode;
+}
+#endif
 
 /*************************************************************************
  *
@@ -379,7 +647,7 @@ static sql_rcode_t sql_select_query(rlm_sql_handle_t * handle, rlm_sql_config_t
  *************************************************************************/
 static sql_rcode_t sql_fetch_row(rlm_sql_handle_t * handle, UNUSED rlm_sql_config_t *config) {
 
-	int records, i, len;
+	int records, i;
 	rlm_sql_postgres_conn_t *conn = handle->conn;
 
 	handle->row = NULL;
@@ -387,17 +655,22 @@ static sql_rcode_t sql_fetch_row(rlm_sql_handle_t * handle, UNUSED rlm_sql_confi
 	if (conn->cur_row >= PQntuples(conn->result))
 		return 0;
 
-	free_result_row(conn);
-
 	records = PQnfields(conn->result);
-	conn->num_fields = records;
 
 	if ((PQntuples(conn->result) > 0) && (records > 0)) {
-		conn->row = talloc_zero_array(conn, char *, records + 1);
+		/*
+		 *	The values stay in the result until it's
+		 *	cleared, so the row just points to them.  The
+		 *	array is allocated once for the whole result.
+		 */
+		if (!conn->row || (conn->num_fields != records)) {
+			free_result_row(conn);
+			conn->row = talloc_zero_array(conn, char *, records + 1);
+			conn->num_fields = records;
+		}
+
 		for (i = 0; i < records; i++) {
-			len = PQgetlength(conn->result, conn->cur_row, i);
-			conn->row[i] = talloc_array(conn->row, char, len + 1);
-			strlcpy(conn->row[i], PQgetvalue(conn->result, conn->cur_row, i),len + 1);
+			conn->row[i] = PQgetvalue(conn->result, conn->cur_row, i);
 		}
 		conn->cur_row++;
 		handle->row = conn->row;
@@ -495,4 +768,11 @@ rlm_sql_module_t rlm_sql_postgresql = {
 	sql_free_result,
 	sql_free_result,
 	sql_affected_rows,
+	sql_prepare,
+	sql_execute,
+#ifdef HAVE_PQENTERPIPELINEMODE
+	sql_pipeline
+#else
+	NULL /* sql_pipeline */
+#endif
 };
@@ -25,6 +25,7 @@
 RCSID("$Id$")
 
 #include <freeradius-devel/radiusd.h>
+#include <freeradius-devel/rad_assert.h>
 
 #include <fcntl.h>
 #include <sys/stat.h>
@@ -51,6 +52,8 @@ typedef struct rlm_sql_sqlite_conn {
 	sqlite3 *db;
 	sqlite3_stmt *statement;
 	int col_count;
+	bool cached;					//!< statement is one of the prepared statements.
+	sqlite3_stmt *prepared[SQL_PREPARED_MAX];	//!< Indexed by sql_prepared_t id.
 } rlm_sql_sqlite_conn_t;
 
 typedef struct rlm_sql_sqlite_config {
@@ -66,7 +69,12 @@ static const CONF_PARSER driver_config[] = {
 static int sql_check_error(sqlite3 *db)
 {
 	int error = sqlite3_errcode(db);
-	switch(error) {
+
+	/*
+	 *	Extended result codes are enabled, so mask off the
+	 *	extended part before checking the primary code.
+	 */
+	switch(error & 0xff) {
 	/*
 	 *	Not errors
 	 */
@@ -352,10 +360,16 @@ static int mod_instantiate(CONF_SECTION *conf, rlm_sql_config_t *config)
 static int _sql_socket_destructor(rlm_sql_sqlite_conn_t *conn)
 {
 	int status = 0;
+	int i;
 
 	DEBUG2("rlm_sql_sqlite: Socket destructor called, closing socket");
 
 	if (conn->db) {
+		for (i = 0; i < SQL_PREPARED_MAX; i++) {
+			if (conn->prepared[i]) (void) sqlite3_finalize(conn->prepared[i]);
+		}
+
+
 		status = sqlite3_close(conn->db);
 		if (status != SQLITE_OK) {
 			WARN("rlm_sql_sqlite: Got SQLite error when closing socket: %s", sqlite3_errmsg(conn->db));
@@ -472,6 +486,59 @@ static sql_rcode_t sql_query(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *
 	return sql_check_error(conn->db);
 }
 
+static sql_rcode_t sql_prepare(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config,
+				sql_prepared_t const *stmt)
+{
+	rlm_sql_sqlite_conn_t *conn = handle->conn;
+	char const *z_tail;
+
+	rad_assert(stmt->id < SQL_PREPARED_MAX);
+
+	/*
+	 *	An older statement which had the same id.
+	 */
+	if (conn->prepared[stmt->id]) {
+		(void) sqlite3_finalize(conn->prepared[stmt->id]);
+		conn->prepared[stmt->id] = NULL;
+	}
+
+#ifdef HAVE_SQLITE3_PREPARE_V2
+	(void) sqlite3_prepare_v2(conn->db, stmt->query, strlen(stmt->query), &conn->prepared[stmt->id], &z_tail);
+#else
+	(void) sqlite3_prepare(conn->db, stmt->query, strlen(stmt->query), &conn->prepared[stmt->id], &z_tail);
+#endif
+
+	return sql_check_error(conn->db);
+}
+
+static sql_rcode_t sql_execute(rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config,
+				sql_prepared_t const *stmt, char const * const *values)
+{
+	rlm_sql_sqlite_conn_t *conn = handle->conn;
+	sqlite3_stmt *statement = conn->prepared[stmt->id];
+	int i;
+
+	if (!statement) return RLM_SQL_ERROR;
+
+	/*
+	 *	The placeholders each appear once, and in order, so
+	 *	$n is parameter n.
+	 */
+	(void) sqlite3_reset(statement);
+	(void) sqlite3_clear_bindings(statement);
+	for (i = 0; i < stmt->num_params; i++) {
+		if (sqlite3_bind_text(statement, i + 1, values[i], -1, SQLITE_TRANSIENT) != SQLITE_OK) {
+			return sql_check_error(conn->db);
+		}
+	}
+
+	conn->statement = statement;
+	conn->cached = true;
+	conn->col_count = 0;
+
+	return RLM_SQL_OK;
+}
+
 static sql_rcode_t sql_store_result(UNUSED rlm_sql_handle_t *handle, UNUSED rlm_sql_config_t *config)
 {
 	return 0;
@@ -529,43 +596,47 @@ static sql_rcode_t sql_fetch_row(rlm_sql_handle_t *handle, rlm_sql_config_t *con
 
 	/*
 	 *	We only need to do this once per result set, because
-	 *	the number of columns won't change.
+	 *	the number of columns won't change.  Neither does the
+	 *	row array.
 	 */
 	if (conn->col_count == 0) {
 		conn->col_count = sql_num_fields(handle, config);
 		if (conn->col_count == 0) {
 			return -1;
 		}
+
+		talloc_free(handle->row);
+		MEM(handle->row = talloc_zero_array(handle->conn, char *, conn->col_count + 1));
 	}
 
 	/*
-	 *	Free the previous result (also gets called on finish_query)
+	 *	Free the values we copied for the previous row.
 	 */
-	talloc_free(handle->row);
-
-	MEM(row = handle->row = talloc_zero_array(handle->conn, char *, conn->col_count + 1));
+	row = handle->row;
+	talloc_free_children(row);
 
 	for (i = 0; i < conn->col_count; i++) {
+		row[i] = NULL;
+
 		switch (sqlite3_column_type(conn->statement, i)) {
+		/*
+		 *	SQLite keeps the text of integers and strings
+		 *	until the next step, so the row points to it.
+		 */
 		case SQLITE_INTEGER:
-			MEM(row[i] = talloc_typed_asprintf(row, "%d", sqlite3_column_int(conn->statement, i)));
-			break;
-
-		case SQLITE_FLOAT:
-			MEM(row[i] = talloc_typed_asprintf(row, "%f", sqlite3_column_double(conn->statement, i)));
-			break;
-
 		case SQLITE_TEXT:
 			{
 				char const *p;
 				p = (char const *) sqlite3_column_text(conn->statement, i);
 
-				if (p) {
-					MEM(row[i] = talloc_typed_strdup(row, p));
-				}
+				if (p) memcpy(&row[i], &p, sizeof(row[i]));
 			}
 			break;
 
+		case SQLITE_FLOAT:
+			MEM(row[i] = talloc_typed_asprintf(row, "%f", sqlite3_column_double(conn->statement, i)));
+			break;
+
 		case SQLITE_BLOB:
 			{
 				uint8_t const *p;
@@ -597,7 +668,16 @@ static sql_rcode_t sql_free_result(rlm_sql_handle_t *handle,
 	if (conn->statement) {
 		TALLOC_FREE(handle->row);
 
-		(void) sqlite3_finalize(conn->statement);
+		/*
+		 *	Prepared statements are kept until the
+		 *	connection is closed.
+		 */
+		if (conn->cached) {
+			(void) sqlite3_reset(conn->statement);
+			conn->cached = false;
+		} else {
+			(void) sqlite3_finalize(conn->statement);
+		}
 		conn->statement = NULL;
 		conn->col_count = 0;
 	}
@@ -658,5 +738,8 @@ rlm_sql_module_t rlm_sql_sqlite = {
 	sql_error,
 	sql_finish_query,
 	sql_finish_query,
-	sql_affected_rows
+	sql_affected_rows,
+	sql_prepare,
+	sql_execute,
+	NULL /* sql_pipeline */
 };
@@ -69,6 +69,14 @@ static const CONF_PARSER acct_config[] = {
 
 	{ "type", FR_CONF_POINTER(PW_TYPE_SUBSECTION, NULL), (void const *) type_config },
 
+	{ "write_behind", FR_CONF_OFFSET(PW_TYPE_BOOLEAN, rlm_sql_config_t, write_behind), "no" },
+	{ "flush_interval", FR_CONF_OFFSET(PW_TYPE_INTEGER, rlm_sql_config_t, flush_interval), "5" },
+	{ "max_pending", FR_CONF_OFFSET(PW_TYPE_INTEGER, rlm_sql_config_t, max_pending), "65536" },
+	{ "batch_size", FR_CONF_OFFSET(PW_TYPE_INTEGER, rlm_sql_config_t, batch_size), "0" },
+	{ "batch_interval", FR_CONF_OFFSET(PW_TYPE_INTEGER, rlm_sql_config_t, batch_interval), "10" },
+	{ "overflow_file", FR_CONF_OFFSET(PW_TYPE_FILE_OUTPUT, rlm_sql_config_t, overflow_file), NULL },
+	{ "overflow_threshold", FR_CONF_OFFSET(PW_TYPE_INTEGER, rlm_sql_config_t, overflow_threshold), "1000" },
+
 	{NULL, -1, 0, NULL, NULL}
 };
 
@@ -81,6 +89,26 @@ static const CONF_PARSER postauth_config[] = {
 	{NULL, -1, 0, NULL, NULL}
 };
 
+static const CONF_PARSER read_pool_config[] = {
+	{ "lag_query", FR_CONF_OFFSET(PW_TYPE_STRING, rlm_sql_config_t, lag_query), NULL },
+	{ "max_lag", FR_CONF_OFFSET(PW_TYPE_INTEGER, rlm_sql_config_t, max_lag), "30" },
+	{ "lag_check_interval", FR_CONF_OFFSET(PW_TYPE_INTEGER, rlm_sql_config_t, lag_check_interval), "10" },
+	{ "retry_delay", FR_CONF_OFFSET(PW_TYPE_INTEGER, rlm_sql_config_t, retry_delay), "30" },
+
+	{NULL, -1, 0, NULL, NULL}
+};
+
+/*
+ *	Cache of authorize_query results
+ */
+static const CONF_PARSER cache_config[] = {
+	{ "ttl", FR_CONF_OFFSET(PW_TYPE_INTEGER, rlm_sql_config_t, cache_ttl), "0" },
+	{ "negative_ttl", FR_CONF_OFFSET(PW_TYPE_INTEGER, rlm_sql_config_t, cache_negative_ttl), "0" },
+	{ "max_entries", FR_CONF_OFFSET(PW_TYPE_INTEGER, rlm_sql_config_t, cache_max_entries), "16384" },
+
+	{NULL, -1, 0, NULL, NULL}
+};
+
 static const CONF_PARSER module_config[] = {
 	{ "driver", FR_CONF_OFFSET(PW_TYPE_STRING, rlm_sql_config_t, sql_driver_name), "rlm_sql_null" },
 	{ "server", FR_CONF_OFFSET(PW_TYPE_STRING, rlm_sql_config_t, sql_server), "localhost" },
@@ -92,6 +120,7 @@ static const CONF_PARSER module_config[] = {
 	{ "read_profiles", FR_CONF_OFFSET(PW_TYPE_BOOLEAN, rlm_sql_config_t, read_profiles), "yes" },
 	{ "readclients", FR_CONF_OFFSET(PW_TYPE_BOOLEAN | PW_TYPE_DEPRECATED, rlm_sql_config_t, do_clients), NULL },
 	{ "read_clients", FR_CONF_OFFSET(PW_TYPE_BOOLEAN, rlm_sql_config_t, do_clients), "no" },
+	{ "prepared_statements", FR_CONF_OFFSET(PW_TYPE_BOOLEAN, rlm_sql_config_t, prepared), "no" },
 	{ "deletestalesessions", FR_CONF_OFFSET(PW_TYPE_BOOLEAN | PW_TYPE_DEPRECATED, rlm_sql_config_t, deletestalesessions), NULL },
 	{ "delete_stale_sessions", FR_CONF_OFFSET(PW_TYPE_BOOLEAN, rlm_sql_config_t, deletestalesessions), "yes" },
 	{ "sql_user_name", FR_CONF_OFFSET(PW_TYPE_STRING, rlm_sql_config_t, query_user), "" },
@@ -107,6 +136,7 @@ static const CONF_PARSER module_config[] = {
 	{ "authorize_group_check_query", FR_CONF_OFFSET(PW_TYPE_STRING | PW_TYPE_XLAT, rlm_sql_config_t, authorize_group_check_query), "" },
 	{ "authorize_group_reply_query", FR_CONF_OFFSET(PW_TYPE_STRING | PW_TYPE_XLAT, rlm_sql_config_t, authorize_group_reply_query), "" },
 	{ "group_membership_query", FR_CONF_OFFSET(PW_TYPE_STRING | PW_TYPE_XLAT, rlm_sql_config_t, groupmemb_query), NULL },
+	{ "authorize_query", FR_CONF_OFFSET(PW_TYPE_STRING | PW_TYPE_XLAT, rlm_sql_config_t, authorize_query), NULL },
 #ifdef WITH_SESSION_MGMT
 	{ "simul_count_query", FR_CONF_OFFSET(PW_TYPE_STRING | PW_TYPE_XLAT, rlm_sql_config_t, simul_count_query), "" },
 	{ "simul_verify_query", FR_CONF_OFFSET(PW_TYPE_STRING | PW_TYPE_XLAT, rlm_sql_config_t, simul_verify_query), "" },
@@ -123,6 +153,10 @@ static const CONF_PARSER module_config[] = {
 
 	{ "post-auth", FR_CONF_POINTER(PW_TYPE_SUBSECTION, NULL), (void const *) postauth_config },
 
+	{ "read_pool", FR_CONF_POINTER(PW_TYPE_SUBSECTION, NULL), (void const *) read_pool_config },
+
+	{ "cache", FR_CONF_POINTER(PW_TYPE_SUBSECTION, NULL), (void const *) cache_config },
+
 	{NULL, -1, 0, NULL, NULL}
 };
 
@@ -142,6 +176,10 @@ static sql_fall_through_t fall_through(VALUE_PAIR *vp)
  */
 static int generate_sql_clients(rlm_sql_t *inst);
 static size_t sql_escape_func(REQUEST *, char *out, size_t outlen, char const *in, void *arg);
+static void sql_cache_invalidate_user(rlm_sql_t *inst, REQUEST *request);
+#if defined(WITH_ACCOUNTING) && defined(HAVE_PTHREAD_H)
+static rbtree_t *pending_create(void);
+#endif
 
 /*
  *			SQL xlat function
@@ -157,6 +195,7 @@ static ssize_t sql_xlat(void *instance, REQUEST *request, char const *query, cha
 	rlm_sql_t *inst = instance;
 	ssize_t ret = 0;
 	size_t len = 0;
+	bool is_write;
 
 	/*
 	 *	Add SQL-User-Name attribute just in case it is needed
@@ -165,20 +204,24 @@ static ssize_t sql_xlat(void *instance, REQUEST *request, char const *query, cha
 	 */
 	sql_set_user(inst, request, NULL);
 
-	handle = sql_get_socket(inst);
+	/*
+	 *	If the query starts with any of the following prefixes,
+	 *	then return the number of rows affected.  Those have
+	 *	to go to the primary, everything else can be read
+	 *	from a replica.
+	 */
+	is_write = ((strncasecmp(query, "insert", 6) == 0) ||
+		 (strncasecmp(query, "update", 6) == 0) ||
+		 (strncasecmp(query, "delete", 6) == 0));
+
+	handle = is_write ? sql_get_socket(inst) : sql_get_read_socket(inst);
 	if (!handle) {
 		return 0;
 	}
 
 	rlm_sql_query_log(inst, request, NULL, query);
 
-	/*
-	 *	If the query starts with any of the following prefixes,
-	 *	then return the number of rows affected
-	 */
-	if ((strncasecmp(query, "insert", 6) == 0) ||
-	    (strncasecmp(query, "update", 6) == 0) ||
-	    (strncasecmp(query, "delete", 6) == 0)) {
+	if (is_write) {
 		int numaffected;
 		char buffer[21]; /* 64bit max is 20 decimal chars + null byte */
 
@@ -190,6 +233,8 @@ static ssize_t sql_xlat(void *instance, REQUEST *request, char const *query, cha
 			goto finish;
 		}
 
+		sql_cache_invalidate_user(inst, request);
+
 		numaffected = (inst->module->sql_affected_rows)(handle, inst->config);
 		if (numaffected < 1) {
 			RDEBUG("SQL query affected no rows");
@@ -284,7 +329,8 @@ static int generate_sql_clients(rlm_sql_t *inst)
 	rlm_sql_handle_t *handle;
 	rlm_sql_row_t row;
 	unsigned int i = 0;
-	RADCLIENT *c;
+	int num = 0, added;
+	RADCLIENT *c, **clients = NULL;
 
 	DEBUG("rlm_sql (%s): Processing generate_sql_clients",
 	      inst->config->xlat_name);
@@ -352,20 +398,36 @@ static int generate_sql_clients(rlm_sql_t *inst)
 			continue;
 		}
 
-		if (!client_add(NULL, c)) {
-			WARN("Failed to add client, possible duplicate?");
+		/*
+		 *	Collect the clients, and add them all at once
+		 *	when we're done with the connection.
+		 */
+		if ((num & 0xff) == 0) {
+			RADCLIENT **tmp;
 
-			client_free(c);
-			continue;
+			tmp = talloc_realloc(inst, clients, RADCLIENT *, num + 256);
+			if (!tmp) {
+				ERROR("rlm_sql (%s): Out of memory", inst->config->xlat_name);
+				client_free(c);
+				break;
+			}
+			clients = tmp;
 		}
-
-		DEBUG("rlm_sql (%s): Client \"%s\" (%s) added", c->longname, c->shortname,
-		      inst->config->xlat_name);
+		clients[num++] = c;
 	}
 
 	(inst->module->sql_finish_select_query)(handle, inst->config);
 	sql_release_socket(inst, handle);
 
+	added = client_add_bulk(NULL, clients, num, false);
+	talloc_free(clients);
+
+	if (added < num) {
+		WARN("rlm_sql (%s): Failed to add %d client(s), possible duplicates?",
+		     inst->config->xlat_name, num - added);
+	}
+	DEBUG("rlm_sql (%s): Added %d client(s)", inst->config->xlat_name, added);
+
 	return 0;
 }
 
@@ -470,10 +532,27 @@ int sql_set_user(rlm_sql_t *inst, REQUEST *request, char const *username)
  */
 #define sql_unset_user(_i, _r) pairdelete(&_r->packet->vps, _i->sql_user->attr, _i->sql_user->vendor, TAG_ANY)
 
+/*
+ *	Something wrote to the database for this user.  Discard
+ *	what we have cached for them.  sql_set_user() must have
+ *	been called.
+ */
+static void sql_cache_invalidate_user(rlm_sql_t *inst, REQUEST *request)
+{
+	VALUE_PAIR *vp;
+
+	if (!inst->cache) return;
+
+	vp = pairfind(request->packet->vps, inst->sql_user->attr, inst->sql_user->vendor, TAG_ANY);
+	if (!vp) return;
+
+	RDEBUG3("Discarding cached rows for \"%s\"", vp->vp_strvalue);
+	sql_cache_invalidate(inst, vp->vp_strvalue);
+}
+
 static int sql_get_grouplist(rlm_sql_t *inst, rlm_sql_handle_t **handle, REQUEST *request,
 			     rlm_sql_grouplist_t **phead)
 {
-	char    *expanded = NULL;
 	int     num_groups = 0;
 	rlm_sql_row_t row;
 	rlm_sql_grouplist_t *entry;
@@ -487,12 +566,7 @@ static int sql_get_grouplist(rlm_sql_t *inst, rlm_sql_handle_t **handle, REQUEST
 		return 0;
 	}
 
-	if (radius_axlat(&expanded, request, inst->config->groupmemb_query, sql_escape_func, inst) < 0) {
-		return -1;
-	}
-
-	ret = rlm_sql_select_query(handle, inst, expanded);
-	talloc_free(expanded);
+	ret = rlm_sql_select_xlat(handle, inst, request, inst->config->groupmemb_query);
 	if (ret != RLM_SQL_OK) {
 		return -1;
 	}
@@ -559,7 +633,7 @@ static int CC_HINT(nonnull (1, 2, 4)) sql_groupcmp(void *instance, REQUEST *requ
 	/*
 	 *	Get a socket for this lookup
 	 */
-	handle = sql_get_socket(inst);
+	handle = sql_get_read_socket(inst);
 	if (!handle) {
 		return 1;
 	}
@@ -599,7 +673,6 @@ static rlm_rcode_t rlm_sql_process_groups(rlm_sql_t *inst, REQUEST *request, rlm
 	VALUE_PAIR		*check_tmp = NULL, *reply_tmp = NULL, *sql_group = NULL;
 	rlm_sql_grouplist_t	*head = NULL, *entry = NULL;
 
-	char			*expanded = NULL;
 	int			rows;
 
 	rad_assert(request->packet != NULL);
@@ -642,15 +715,8 @@ static rlm_rcode_t rlm_sql_process_groups(rlm_sql_t *inst, REQUEST *request, rlm
 			/*
 			 *	Expand the group query
 			 */
-			if (radius_axlat(&expanded, request, inst->config->authorize_group_check_query,
-					 sql_escape_func, inst) < 0) {
-				REDEBUG("Error generating query");
-				rcode = RLM_MODULE_FAIL;
-				goto finish;
-			}
-
-			rows = sql_getvpdata(request, inst, handle, &check_tmp, expanded);
-			TALLOC_FREE(expanded);
+			rows = sql_getvpdata(request, inst, request, handle, &check_tmp,
+					     inst->config->authorize_group_check_query);
 			if (rows < 0) {
 				REDEBUG("Error retrieving check pairs for group %s", entry->name);
 				rcode = RLM_MODULE_FAIL;
@@ -689,15 +755,8 @@ static rlm_rcode_t rlm_sql_process_groups(rlm_sql_t *inst, REQUEST *request, rlm
 			/*
 			 *	Now get the reply pairs since the paircompare matched
 			 */
-			if (radius_axlat(&expanded, request, inst->config->authorize_group_reply_query,
-					 sql_escape_func, inst) < 0) {
-				REDEBUG("Error generating query");
-				rcode = RLM_MODULE_FAIL;
-				goto finish;
-			}
-
-			rows = sql_getvpdata(request->reply, inst, handle, &reply_tmp, expanded);
-			TALLOC_FREE(expanded);
+			rows = sql_getvpdata(request->reply, inst, request, handle, &reply_tmp,
+					     inst->config->authorize_group_reply_query);
 			if (rows < 0) {
 				REDEBUG("Error retrieving reply pairs for group %s", entry->name);
 				rcode = RLM_MODULE_FAIL;
@@ -726,14 +785,420 @@ finish:
 }
 
 
+/*
+ *	Check and reply items for one group, from authorize_query.
+ */
+typedef struct sql_authorize_group {
+	char const			*name;
+	VALUE_PAIR			*check;
+	VALUE_PAIR			*reply;
+	struct sql_authorize_group	*next;
+} sql_authorize_group_t;
+
+/*
+ *	Sort a row from authorize_query by its source.
+ *
+ *	The rows are in the usual radcheck format, with a sixth column
+ *	saying where they came from: "check", "reply", "group",
+ *	"group_check" or "group_reply".  For the group rows, column
+ *	1 is the group name.  "group" rows are for membership only,
+ *	and have no attribute.  Groups are processed in the order in
+ *	which they're first seen.
+ */
+static int sql_authorize_row(rlm_sql_t *inst, REQUEST *request, rlm_sql_row_t row,
+			     VALUE_PAIR **check, VALUE_PAIR **reply, sql_authorize_group_t **groups)
+{
+	sql_authorize_group_t	*group, **last;
+	char const		*source = row[5];
+
+	if (!source) {
+		REDEBUG("authorize_query returned a row with no source");
+		return -1;
+	}
+
+	if (strcmp(source, "check") == 0) {
+		if (sql_userparse(request, check, row) != 0) goto parse_error;
+
+		return 0;
+	}
+
+	if (strcmp(source, "reply") == 0) {
+		if (sql_userparse(request->reply, reply, row) != 0) goto parse_error;
+
+		return 0;
+	}
+
+	if (strncmp(source, "group", 5) != 0) {
+	bad_source:
+		REDEBUG("authorize_query returned unknown source \"%s\"", source);
+		return -1;
+	}
+
+	if (!row[1]) {
+		REDEBUG("authorize_query returned a group row with no group name");
+		return -1;
+	}
+
+	for (last = groups, group = *groups; group; last = &group->next, group = group->next) {
+		if (strcmp(group->name, row[1]) == 0) break;
+	}
+
+	if (!group) {
+		group = talloc_zero(request, sql_authorize_group_t);
+		if (!group) return -1;
+
+		group->name = talloc_typed_strdup(group, row[1]);
+		*last = group;
+	}
+
+	if (strcmp(source, "group_check") == 0) {
+		if (sql_userparse(request, &group->check, row) != 0) goto parse_error;
+
+	} else if (strcmp(source, "group_reply") == 0) {
+		if (sql_userparse(request->reply, &group->reply, row) != 0) goto parse_error;
+
+	} else if (strcmp(source, "group") != 0) {
+		goto bad_source;
+	}
+
+	return 0;
+
+parse_error:
+	ERROR("rlm_sql (%s): Error parsing user data from database result", inst->config->xlat_name);
+	return -1;
+}
+
+/*
+ *	Get the rows for the user from the cache, or by running
+ *	authorize_query, and sort them by their source.
+ */
+static int sql_authorize_fetch(rlm_sql_t *inst, REQUEST *request, rlm_sql_handle_t **handle,
+			       VALUE_PAIR **check, VALUE_PAIR **reply, sql_authorize_group_t **groups)
+{
+	rlm_sql_row_t		row, *cached;
+	VALUE_PAIR		*user = NULL;
+	sql_cache_entry_t	*entry = NULL;
+	int			i, rows = 0;
+
+	if (inst->cache) {
+		user = pairfind(request->packet->vps, inst->sql_user->attr, inst->sql_user->vendor, TAG_ANY);
+	}
+
+	if (user) {
+		rows = sql_cache_find(inst, request, user->vp_strvalue, &cached);
+		if (rows >= 0) {
+			RDEBUG2("Found %i cached rows for \"%s\"", rows, user->vp_strvalue);
+
+			for (i = 0; i < rows; i++) {
+				if (sql_authorize_row(inst, request, cached[i], check, reply, groups) < 0) break;
+			}
+			talloc_free(cached);
+
+			return (i == rows) ? rows : -1;
+		}
+		rows = 0;
+
+		entry = sql_cache_entry_alloc(user->vp_strvalue);
+	}
+
+	if (rlm_sql_select_xlat(handle, inst, request, inst->config->authorize_query) != RLM_SQL_OK) {
+		talloc_free(entry);
+		return -1;
+	}
+
+	if (inst->module->sql_num_fields &&
+	    ((inst->module->sql_num_fields)(*handle, inst->config) < SQL_CACHE_COLUMNS)) {
+		REDEBUG("authorize_query must return at least %i columns", SQL_CACHE_COLUMNS);
+	error:
+		(inst->module->sql_finish_select_query)(*handle, inst->config);
+		talloc_free(entry);
+		return -1;
+	}
+
+	while (rlm_sql_fetch_row(handle, inst) == 0) {
+		row = (*handle)->row;
+		if (!row) break;
+
+		if (sql_authorize_row(inst, request, row, check, reply, groups) < 0) goto error;
+
+		/*
+		 *	If the row can't be cached, don't cache
+		 *	any of them.
+		 */
+		if (entry && (sql_cache_entry_row(entry, row) < 0)) {
+			talloc_free(entry);
+			entry = NULL;
+		}
+
+		rows++;
+	}
+
+	(inst->module->sql_finish_select_query)(*handle, inst->config);
+
+	if (entry) sql_cache_add(inst, request, entry);
+
+	return rows;
+}
+
+/*
+ *	The same as the check/reply/group queries in mod_authorize(),
+ *	and rlm_sql_process_groups(), but with everything fetched by
+ *	one query.  The rows are then processed locally, with the
+ *	same Fall-Through rules.
+ */
+static rlm_rcode_t rlm_sql_authorize_combined(rlm_sql_t *inst, REQUEST *request, rlm_sql_handle_t **handle,
+					      bool *user_found, sql_fall_through_t *do_fall_through)
+{
+	rlm_rcode_t		rcode = RLM_MODULE_NOOP;
+	VALUE_PAIR		*check_tmp = NULL, *reply_tmp = NULL, *vp;
+	sql_authorize_group_t	*groups = NULL, *group, *next;
+	vp_cursor_t		cursor;
+
+	if (sql_authorize_fetch(inst, request, handle, &check_tmp, &reply_tmp, &groups) < 0) {
+		REDEBUG("SQL query error");
+		rcode = RLM_MODULE_FAIL;
+		goto finish;
+	}
+
+	/*
+	 *	No check items means the reply items are skipped,
+	 *	as with authorize_check_query.
+	 */
+	if (!check_tmp) goto groups;
+
+	RDEBUG2("User found in radcheck table");
+	*user_found = true;
+	if (paircompare(request, request->packet->vps, check_tmp, &request->reply->vps) != 0) goto groups;
+
+	RDEBUG2("Conditional check items matched, merging assignment check items");
+	RINDENT();
+	for (vp = fr_cursor_init(&cursor, &check_tmp);
+	     vp;
+	     vp = fr_cursor_next(&cursor)) {
+		if (!fr_assignment_op[vp->op]) continue;
+
+		rdebug_pair(2, request, vp);
+	}
+	REXDENT();
+	radius_pairmove(request, &request->config_items, check_tmp, true);
+	check_tmp = NULL;
+	rcode = RLM_MODULE_OK;
+
+	if (reply_tmp) {
+		*do_fall_through = fall_through(reply_tmp);
+
+		RDEBUG2("User found in radreply table, merging reply items");
+
+		rdebug_pair_list(L_DBG_LVL_2, request, reply_tmp);
+
+		radius_pairmove(request, &request->reply->vps, reply_tmp, true);
+		reply_tmp = NULL;
+	}
+
+groups:
+	if ((*do_fall_through != FALL_THROUGH_YES) &&
+	    (!inst->config->read_groups || (*do_fall_through != FALL_THROUGH_DEFAULT))) goto finish;
+
+	RDEBUG3("... falling-through to group processing");
+	if (!groups) {
+		RDEBUG2("User not found in any groups");
+		goto finish;
+	}
+
+	RDEBUG2("User found in the group table");
+	*user_found = true;
+
+	for (group = groups; group; group = group->next) {
+		/*
+		 *	Add the Sql-Group attribute to the request list so we know
+		 *	which group we're retrieving attributes for
+		 */
+		if (!pairmake_packet("Sql-Group", group->name, T_OP_EQ)) {
+			REDEBUG("Error creating Sql-Group attribute");
+			rcode = RLM_MODULE_FAIL;
+			goto finish;
+		}
+
+		if (group->check &&
+		    (paircompare(request, request->packet->vps, group->check, &request->reply->vps) != 0)) {
+			pairdelete(&request->packet->vps, PW_SQL_GROUP, 0, TAG_ANY);
+			continue;
+		}
+
+		RDEBUG2("Group \"%s\": Conditional check items matched", group->name);
+		rcode = RLM_MODULE_OK;
+
+		if (group->check) {
+			RDEBUG2("Group \"%s\": Merging assignment check items", group->name);
+			RINDENT();
+			for (vp = fr_cursor_init(&cursor, &group->check);
+			     vp;
+			     vp = fr_cursor_next(&cursor)) {
+				if (!fr_assignment_op[vp->op]) continue;
+
+				rdebug_pair(2, request, vp);
+			}
+			REXDENT();
+			radius_pairmove(request, &request->config_items, group->check, true);
+			group->check = NULL;
+		}
+
+		*do_fall_through = fall_through(group->reply);
+
+		if (group->reply) {
+			RDEBUG2("Group \"%s\": Merging reply items", group->name);
+
+			rdebug_pair_list(L_DBG_LVL_2, request, group->reply);
+
+			radius_pairmove(request, &request->reply->vps, group->reply, true);
+			group->reply = NULL;
+		}
+
+		pairdelete(&request->packet->vps, PW_SQL_GROUP, 0, TAG_ANY);
+
+		if (*do_fall_through != FALL_THROUGH_YES) break;
+	}
+
+finish:
+	pairfree(&check_tmp);
+	pairfree(&reply_tmp);
+
+	for (group = groups; group; group = next) {
+		next = group->next;
+
+		pairfree(&group->check);
+		pairfree(&group->reply);
+		talloc_free(group);
+	}
+	pairdelete(&request->packet->vps, PW_SQL_GROUP, 0, TAG_ANY);
+
+	return rcode;
+}
+
+/*
+ *	Each "server" in the "read_pool" section is a replica.  It
+ *	gets a copy of the instance config with its own server name,
+ *	so it uses the same login, database and driver options as
+ *	the primary.
+ */
+static int sql_replicas_init(rlm_sql_t *inst, CONF_SECTION *conf, CONF_SECTION *driver_cs)
+{
+	int i;
+	CONF_SECTION *cs;
+	CONF_PAIR *cp;
+
+	cs = cf_section_sub_find(conf, "read_pool");
+	if (!cs) return 0;
+
+	for (cp = cf_pair_find(cs, "server"); cp; cp = cf_pair_find_next(cs, cp, "server")) {
+		inst->num_replicas++;
+	}
+	if (!inst->num_replicas) return 0;
+
+	if (inst->config->lag_query && !inst->config->lag_check_interval) {
+		cf_log_err_cs(cs, "'lag_check_interval' must be non-zero");
+		return -1;
+	}
+
+	inst->replicas = talloc_zero_array(inst, sql_replica_t, inst->num_replicas);
+	if (!inst->replicas) return -1;
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_init(&inst->replica_mutex, NULL);
+#endif
+
+	for (i = 0, cp = cf_pair_find(cs, "server");
+	     cp;
+	     i++, cp = cf_pair_find_next(cs, cp, "server")) {
+		sql_replica_t *replica = &inst->replicas[i];
+
+		replica->inst = inst;
+		replica->config = talloc_memdup(inst, inst->config, sizeof(*inst->config));
+		if (!replica->config) return -1;
+
+		replica->config->sql_server = cf_pair_value(cp);
+
+		if (driver_cs && (inst->module->mod_instantiate(driver_cs, replica->config) < 0)) {
+			return -1;
+		}
+
+		DEBUG("rlm_sql (%s): Using %s as a read replica",
+		      inst->config->xlat_name, replica->config->sql_server);
+	}
+
+	return 0;
+}
+
 static int mod_detach(void *instance)
 {
 	rlm_sql_t *inst = instance;
 
+#if defined(WITH_ACCOUNTING) && defined(HAVE_PTHREAD_H)
+	/*
+	 *	Write any queued updates before closing the
+	 *	connections.
+	 */
+	if (inst->pending) {
+		if (inst->flusher_running) {
+			pthread_mutex_lock(&inst->pending_mutex);
+			inst->flusher_exiting = true;
+			pthread_cond_signal(&inst->pending_cond);
+			pthread_mutex_unlock(&inst->pending_mutex);
+
+			pthread_join(inst->flusher, NULL);
+		}
+
+		rbtree_free(inst->pending);
+		pthread_mutex_destroy(&inst->pending_mutex);
+		pthread_cond_destroy(&inst->pending_cond);
+		pthread_cond_destroy(&inst->flushed_cond);
+	}
+
+	if (inst->batch_tail) {
+		if (inst->batcher_running) {
+			pthread_mutex_lock(&inst->batch_mutex);
+			inst->batcher_exiting = true;
+			pthread_cond_signal(&inst->batch_cond);
+			pthread_mutex_unlock(&inst->batch_mutex);
+
+			pthread_join(inst->batcher, NULL);
+		}
+
+		pthread_mutex_destroy(&inst->batch_mutex);
+		pthread_cond_destroy(&inst->batch_cond);
+		pthread_cond_destroy(&inst->batch_done_cond);
+	}
+
+	/*
+	 *	Anything left in the spool is replayed when the
+	 *	server next starts.
+	 */
+	if (inst->overflow_work) {
+		if (inst->replayer_running) {
+			pthread_mutex_lock(&inst->overflow_mutex);
+			inst->replayer_exiting = true;
+			pthread_cond_signal(&inst->overflow_cond);
+			pthread_mutex_unlock(&inst->overflow_mutex);
+
+			pthread_join(inst->replayer, NULL);
+		}
+
+		if (inst->overflow_fp) fclose(inst->overflow_fp);
+		pthread_mutex_destroy(&inst->overflow_mutex);
+		pthread_cond_destroy(&inst->overflow_cond);
+	}
+#endif
+
 	if (inst->config) {
 		if (inst->pool) sql_poolfree(inst);
 	}
 
+#ifdef HAVE_PTHREAD_H
+	if (inst->replicas) pthread_mutex_destroy(&inst->replica_mutex);
+#endif
+
+	sql_cache_free(inst);
+
 	if (inst->handle) {
 #if 0
 		/*
@@ -749,6 +1214,7 @@ static int mod_detach(void *instance)
 static int mod_instantiate(CONF_SECTION *conf, void *instance)
 {
 	rlm_sql_t *inst = instance;
+	CONF_SECTION *driver_cs = NULL;
 
 	/*
 	 *	Hack...
@@ -810,17 +1276,80 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 	inst->config->postauth.cs = cf_section_sub_find(conf, "post-auth");
 	inst->config->postauth.reference_cp = (cf_pair_find(inst->config->postauth.cs, "reference") != NULL);
 
-	/*
-	 *	Cache the SQL-User-Name DICT_ATTR, so we can be slightly
-	 *	more efficient about creating SQL-User-Name attributes.
-	 */
-	inst->sql_user = dict_attrbyname("SQL-User-Name");
-	if (!inst->sql_user) {
-		return -1;
-	}
+	if (inst->config->write_behind) {
+#if defined(WITH_ACCOUNTING) && defined(HAVE_PTHREAD_H)
+		FR_INTEGER_BOUND_CHECK("flush_interval", inst->config->flush_interval, >=, 1);
+		FR_INTEGER_BOUND_CHECK("flush_interval", inst->config->flush_interval, <=, 300);
+		FR_INTEGER_BOUND_CHECK("max_pending", inst->config->max_pending, >=, 1);
 
-	/*
-	 *	Export these methods, too.  This avoids RTDL_GLOBAL.
+		inst->pending = pending_create();
+		if (!inst->pending) {
+			cf_log_err_cs(conf, "Failed creating queue for interim updates");
+			return -1;
+		}
+
+		pthread_mutex_init(&inst->pending_mutex, NULL);
+		pthread_cond_init(&inst->pending_cond, NULL);
+		pthread_cond_init(&inst->flushed_cond, NULL);
+#else
+		cf_log_err_cs(conf, "'write_behind = yes' requires a server built with threads");
+		return -1;
+#endif
+	}
+
+	if (inst->config->batch_size > 0) {
+#if defined(WITH_ACCOUNTING) && defined(HAVE_PTHREAD_H)
+		FR_INTEGER_BOUND_CHECK("batch_size", inst->config->batch_size, <=, 1000);
+		FR_INTEGER_BOUND_CHECK("batch_interval", inst->config->batch_interval, <=, 1000);
+
+		inst->batch_tail = &inst->batch_head;
+		pthread_mutex_init(&inst->batch_mutex, NULL);
+		pthread_cond_init(&inst->batch_cond, NULL);
+		pthread_cond_init(&inst->batch_done_cond, NULL);
+#else
+		cf_log_err_cs(conf, "'batch_size' requires a server built with threads");
+		return -1;
+#endif
+	}
+
+	if (inst->config->overflow_file) {
+#if defined(WITH_ACCOUNTING) && defined(HAVE_PTHREAD_H)
+		struct stat st;
+
+		FR_INTEGER_BOUND_CHECK("overflow_threshold", inst->config->overflow_threshold, <=, 60000);
+
+		inst->overflow_work = talloc_typed_asprintf(inst, "%s.work", inst->config->overflow_file);
+
+		/*
+		 *	Packets left over from the last time the
+		 *	server ran go before any new ones.
+		 */
+		if (((stat(inst->config->overflow_file, &st) == 0) && (st.st_size > 0)) ||
+		    ((stat(inst->overflow_work, &st) == 0) && (st.st_size > 0))) {
+			WARN("rlm_sql (%s): Accounting packets from %s will be replayed",
+			     inst->config->xlat_name, inst->config->overflow_file);
+			inst->overflowing = true;
+		}
+
+		pthread_mutex_init(&inst->overflow_mutex, NULL);
+		pthread_cond_init(&inst->overflow_cond, NULL);
+#else
+		cf_log_err_cs(conf, "'overflow_file' requires a server built with threads");
+		return -1;
+#endif
+	}
+
+	/*
+	 *	Cache the SQL-User-Name DICT_ATTR, so we can be slightly
+	 *	more efficient about creating SQL-User-Name attributes.
+	 */
+	inst->sql_user = dict_attrbyname("SQL-User-Name");
+	if (!inst->sql_user) {
+		return -1;
+	}
+
+	/*
+	 *	Export these methods, too.  This avoids RTDL_GLOBAL.
 	 */
 	inst->sql_set_user		= sql_set_user;
 	inst->sql_get_socket		= sql_get_socket;
@@ -867,7 +1396,6 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 	}
 
 	if (inst->module->mod_instantiate) {
-		CONF_SECTION *cs;
 		char const *name;
 
 		name = strrchr(inst->config->sql_driver_name, '_');
@@ -877,10 +1405,10 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 			name++;
 		}
 
-		cs = cf_section_sub_find(conf, name);
-		if (!cs) {
-			cs = cf_section_alloc(conf, name, NULL);
-			if (!cs) {
+		driver_cs = cf_section_sub_find(conf, name);
+		if (!driver_cs) {
+			driver_cs = cf_section_alloc(conf, name, NULL);
+			if (!driver_cs) {
 				return -1;
 			}
 		}
@@ -888,9 +1416,26 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 		/*
 		 *	It's up to the driver to register a destructor
 		 */
-		if (inst->module->mod_instantiate(cs, inst->config) < 0) {
+		if (inst->module->mod_instantiate(driver_cs, inst->config) < 0) {
+			return -1;
+		}
+	}
+
+	if (sql_replicas_init(inst, conf, driver_cs) < 0) return -1;
+
+	if (inst->config->cache_ttl) {
+		if (!inst->config->authorize_query || !*inst->config->authorize_query) {
+			cf_log_err_cs(conf, "The cache can only be used with 'authorize_query'");
 			return -1;
 		}
+
+		if (inst->config->cache_negative_ttl > inst->config->cache_ttl) {
+			inst->config->cache_negative_ttl = inst->config->cache_ttl;
+		}
+
+		if (!inst->config->cache_max_entries) inst->config->cache_max_entries = 1;
+
+		if (sql_cache_init(inst) < 0) return -1;
 	}
 
 	inst->lf = fr_logfile_init(inst);
@@ -903,6 +1448,48 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 	       inst->config->xlat_name, inst->config->sql_driver_name,
 	       inst->module->name);
 
+	/*
+	 *	Compile the SELECT queries which are run for every
+	 *	request, so that the driver only has to parse them
+	 *	once per connection.
+	 */
+	if (inst->config->prepared) {
+		char const *queries[] = {
+			inst->config->authorize_check_query,
+			inst->config->authorize_reply_query,
+			inst->config->authorize_group_check_query,
+			inst->config->authorize_group_reply_query,
+			inst->config->groupmemb_query,
+			inst->config->authorize_query,
+			inst->config->simul_count_query,
+			inst->config->simul_verify_query
+		};
+		size_t i;
+
+		if (!inst->module->sql_prepare || !inst->module->sql_execute) {
+			cf_log_err_cs(conf, "Driver %s does not support prepared statements",
+				      inst->config->sql_driver_name);
+			return -1;
+		}
+
+		inst->prepared = talloc_array(inst, sql_prepared_t *, sizeof(queries) / sizeof(*queries));
+		for (i = 0; i < sizeof(queries) / sizeof(*queries); i++) {
+			sql_prepared_t *stmt;
+
+			if (!queries[i] || !*queries[i]) continue;
+
+			stmt = sql_prepared_compile(inst, queries[i]);
+			if (!stmt) {
+				WARN("rlm_sql (%s): Can't prepare query '%s', it will be run as text",
+				     inst->config->xlat_name, queries[i]);
+				continue;
+			}
+			DEBUG2("rlm_sql (%s): Prepared query '%s'", inst->config->xlat_name, stmt->query);
+
+			inst->prepared[inst->num_prepared++] = stmt;
+		}
+	}
+
 	/*
 	 *	Initialise the connection pool for this instance
 	 */
@@ -945,13 +1532,11 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authorize(void *instance, REQUEST *reque
 
 	int	rows;
 
-	char	*expanded = NULL;
-
 	rad_assert(request->packet != NULL);
 	rad_assert(request->reply != NULL);
 
 	if (!inst->config->authorize_check_query && !inst->config->authorize_reply_query &&
-	    !inst->config->read_groups && !inst->config->read_profiles) {
+	    !inst->config->authorize_query && !inst->config->read_groups && !inst->config->read_profiles) {
 	 	RWDEBUG("No authorization checks configured, returning noop");
 
 	 	return RLM_MODULE_NOOP;
@@ -970,12 +1555,22 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authorize(void *instance, REQUEST *reque
 	 *	After this point use goto error or goto release to cleanup socket temporary pairlists and
 	 *	temporary attributes.
 	 */
-	handle = sql_get_socket(inst);
+	handle = sql_get_read_socket(inst);
 	if (!handle) {
 		rcode = RLM_MODULE_FAIL;
 		goto error;
 	}
 
+	/*
+	 *	Get the user and group items in one round trip.
+	 */
+	if (inst->config->authorize_query && *inst->config->authorize_query) {
+		rcode = rlm_sql_authorize_combined(inst, request, &handle, &user_found, &do_fall_through);
+		if (rcode == RLM_MODULE_FAIL) goto error;
+
+		goto profiles;
+	}
+
 	/*
 	 *	Query the check table to find any conditions associated with this user/realm/whatever...
 	 */
@@ -983,15 +1578,7 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authorize(void *instance, REQUEST *reque
 		vp_cursor_t cursor;
 		VALUE_PAIR *vp;
 
-		if (radius_axlat(&expanded, request, inst->config->authorize_check_query,
-				 sql_escape_func, inst) < 0) {
-			REDEBUG("Error generating query");
-			rcode = RLM_MODULE_FAIL;
-			goto error;
-		}
-
-		rows = sql_getvpdata(request, inst, &handle, &check_tmp, expanded);
-		TALLOC_FREE(expanded);
+		rows = sql_getvpdata(request, inst, request, &handle, &check_tmp, inst->config->authorize_check_query);
 		if (rows < 0) {
 			REDEBUG("SQL query error");
 			rcode = RLM_MODULE_FAIL;
@@ -1031,15 +1618,7 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authorize(void *instance, REQUEST *reque
 		/*
 		 *	Now get the reply pairs since the paircompare matched
 		 */
-		if (radius_axlat(&expanded, request, inst->config->authorize_reply_query,
-				 sql_escape_func, inst) < 0) {
-			REDEBUG("Error generating query");
-			rcode = RLM_MODULE_FAIL;
-			goto error;
-		}
-
-		rows = sql_getvpdata(request->reply, inst, &handle, &reply_tmp, expanded);
-		TALLOC_FREE(expanded);
+		rows = sql_getvpdata(request->reply, inst, request, &handle, &reply_tmp, inst->config->authorize_reply_query);
 		if (rows < 0) {
 			REDEBUG("SQL query error");
 			rcode = RLM_MODULE_FAIL;
@@ -1096,6 +1675,7 @@ skipreply:
 	/*
 	 *	Repeat the above process with the default profile or User-Profile
 	 */
+profiles:
 	if ((do_fall_through == FALL_THROUGH_YES) ||
 	    (inst->config->read_profiles && (do_fall_through == FALL_THROUGH_DEFAULT))) {
 		rlm_rcode_t ret;
@@ -1172,6 +1752,37 @@ error:
 	return rcode;
 }
 
+/*
+ *	Find the first query in a section by expanding its 'reference'.
+ */
+static CONF_PAIR *acct_reference(REQUEST *request, sql_acct_section_t *section)
+{
+	CONF_ITEM		*item;
+
+	char			path[MAX_STRING_LEN];
+	char			*p = path;
+
+	rad_assert(section);
+
+	if (section->reference[0] != '.') {
+		*p++ = '.';
+	}
+
+	if (radius_xlat(p, sizeof(path) - (p - path), request, section->reference, NULL, NULL) < 0) {
+		return NULL;
+	}
+
+	item = cf_reference_item(NULL, section->cs, path);
+	if (!item) return NULL;
+
+	if (cf_item_is_section(item)){
+		REDEBUG("Sections are not supported as references");
+		return NULL;
+	}
+
+	return cf_itemtopair(item);
+}
+
 /*
  *	Generic function for failing between a bunch of queries.
  *
@@ -1190,42 +1801,19 @@ static int acct_redundant(rlm_sql_t *inst, REQUEST *request, sql_acct_section_t
 	int			sql_ret;
 	int			numaffected = 0;
 
-	CONF_ITEM		*item;
 	CONF_PAIR 		*pair;
 	char const		*attr = NULL;
 	char const		*value;
 
-	char			path[MAX_STRING_LEN];
-	char			*p = path;
 	char			*expanded = NULL;
 
-	rad_assert(section);
-
-	if (section->reference[0] != '.') {
-		*p++ = '.';
-	}
-
-	if (radius_xlat(p, sizeof(path) - (p - path), request, section->reference, NULL, NULL) < 0) {
-		rcode = RLM_MODULE_FAIL;
-
-		goto finish;
-	}
-
-	item = cf_reference_item(NULL, section->cs, path);
-	if (!item) {
-		rcode = RLM_MODULE_FAIL;
-
-		goto finish;
-	}
-
-	if (cf_item_is_section(item)){
-		REDEBUG("Sections are not supported as references");
+	pair = acct_reference(request, section);
+	if (!pair) {
 		rcode = RLM_MODULE_FAIL;
 
 		goto finish;
 	}
 
-	pair = cf_itemtopair(item);
 	attr = cf_pair_attr(pair);
 
 	RDEBUG2("Using query template '%s'", attr);
@@ -1240,6 +1828,13 @@ static int acct_redundant(rlm_sql_t *inst, REQUEST *request, sql_acct_section_t
 	sql_set_user(inst, request, NULL);
 
 	while (true) {
+		if (request_expired(request)) {
+			REDEBUG("Request has passed its deadline, not running query");
+			rcode = RLM_MODULE_FAIL;
+
+			goto finish;
+		}
+
 		value = cf_pair_value(pair);
 		if (!value) {
 			RDEBUG("Ignoring null query");
@@ -1326,6 +1921,888 @@ finish:
 }
 
 #ifdef WITH_ACCOUNTING
+#ifdef HAVE_PTHREAD_H
+/*
+ *	Accounting queries which have been expanded, and are waiting to
+ *	be written by the write-behind flusher, or by the batcher.
+ */
+typedef struct sql_pending_t {
+	char const		*key;		//!< Acct-Unique-Session-Id, or NULL if there isn't one.
+	char			**queries;	//!< Tried in order, as with acct_redundant().
+	int			num_queries;
+
+	struct sql_pending_t	*next;		//!< In the batch queue.
+	rlm_rcode_t		rcode;		//!< Of writing the queries.
+	bool			done;
+} sql_pending_t;
+
+static int pending_cmp(void const *one, void const *two)
+{
+	sql_pending_t const *a = one;
+	sql_pending_t const *b = two;
+
+	return strcmp(a->key, b->key);
+}
+
+static void pending_free(void *data)
+{
+	talloc_free(data);
+}
+
+static rbtree_t *pending_create(void)
+{
+	/*
+	 *	A newer update for the same session replaces the
+	 *	older one.
+	 */
+	return rbtree_create(NULL, pending_cmp, pending_free, RBTREE_FLAG_REPLACE);
+}
+
+/*
+ *	Expand the queries which acct_redundant() would try, so they
+ *	can be written without the request.
+ */
+static rlm_rcode_t acct_expand(sql_pending_t **out, TALLOC_CTX *ctx, rlm_sql_t *inst, REQUEST *request,
+			       sql_acct_section_t *section)
+{
+	CONF_PAIR	*pair;
+	char const	*attr;
+	char const	*value;
+	char		*expanded = NULL;
+	sql_pending_t	*entry;
+
+	pair = acct_reference(request, section);
+	if (!pair) return RLM_MODULE_FAIL;
+
+	attr = cf_pair_attr(pair);
+
+	RDEBUG2("Using query template '%s'", attr);
+
+	entry = talloc_zero(ctx, sql_pending_t);
+
+	sql_set_user(inst, request, NULL);
+
+	for (; pair; pair = cf_pair_find_next(section->cs, pair, attr)) {
+		value = cf_pair_value(pair);
+		if (!value) break;
+
+		if (radius_axlat(&expanded, request, value, sql_escape_func, inst) < 0) {
+			sql_unset_user(inst, request);
+			talloc_free(entry);
+			return RLM_MODULE_FAIL;
+		}
+
+		if (!*expanded) {
+			talloc_free(expanded);
+			break;
+		}
+
+		/*
+		 *	Only the first query is logged, as the others
+		 *	are used only if it fails.
+		 */
+		if (entry->num_queries == 0) rlm_sql_query_log(inst, request, section, expanded);
+
+		entry->queries = talloc_realloc(entry, entry->queries, char *, entry->num_queries + 1);
+		entry->queries[entry->num_queries++] = talloc_steal(entry, expanded);
+	}
+
+	sql_unset_user(inst, request);
+
+	if (entry->num_queries == 0) {
+		RDEBUG("Ignoring null query");
+		talloc_free(entry);
+		return RLM_MODULE_NOOP;
+	}
+
+	*out = entry;
+	return RLM_MODULE_OK;
+}
+
+/*
+ *	Run a query which doesn't update anything.
+ */
+static sql_rcode_t sql_batch_query(rlm_sql_handle_t **handle, rlm_sql_t *inst, char const *query)
+{
+	sql_rcode_t sql_ret;
+
+	sql_ret = rlm_sql_query(handle, inst, query);
+	if (*handle) (inst->module->sql_finish_query)(*handle, inst->config);
+
+	return sql_ret;
+}
+
+/*
+ *	Write one entry, failing over between its queries in the same
+ *	way as acct_redundant().
+ *
+ *	Inside a transaction, an error means that the whole transaction
+ *	has to be abandoned, so we return the error instead of trying the
+ *	next query.
+ */
+static sql_rcode_t sql_write_entry(rlm_sql_t *inst, rlm_sql_handle_t **handle, sql_pending_t *entry,
+				   bool transaction)
+{
+	int		i;
+	sql_rcode_t	sql_ret;
+
+	entry->rcode = RLM_MODULE_FAIL;
+
+	for (i = 0; i < entry->num_queries; i++) {
+		if (transaction) {
+			sql_ret = rlm_sql_transaction_query(handle, inst, entry->queries[i]);
+		} else {
+			sql_ret = rlm_sql_query(handle, inst, entry->queries[i]);
+		}
+		if (sql_ret == RLM_SQL_RECONNECT) return sql_ret;
+		rad_assert(*handle);
+
+		if (sql_ret == RLM_SQL_OK) {
+			if ((inst->module->sql_affected_rows)(*handle, inst->config) > 0) {
+				(inst->module->sql_finish_query)(*handle, inst->config);
+				entry->rcode = RLM_MODULE_OK;
+				return RLM_SQL_OK;
+			}
+		} else if (transaction) {
+			(inst->module->sql_finish_query)(*handle, inst->config);
+			return sql_ret;
+		}
+
+		(inst->module->sql_finish_query)(*handle, inst->config);
+	}
+
+	entry->rcode = RLM_MODULE_NOOP;
+	return RLM_SQL_OK;
+}
+
+/*
+ *	Whether an entry has to wait for an earlier one in the batch,
+ *	which is for the same session, and hasn't been written yet.
+ *	Entries without a session are written strictly in order.
+ */
+static bool sql_pending_blocked(sql_pending_t **entries, int const *next, uint32_t i)
+{
+	uint32_t j;
+
+	for (j = 0; j < i; j++) {
+		if ((entries[j]->rcode == RLM_MODULE_OK) || (next[j] >= entries[j]->num_queries)) continue;
+
+		if (!entries[i]->key || !entries[j]->key || (strcmp(entries[i]->key, entries[j]->key) == 0)) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ *	Write a set of entries inside of a transaction, with the driver's
+ *	pipeline.  Each round sends the next query of every entry which
+ *	hasn't been written yet, and waits once for all of their results,
+ *	instead of once per query.
+ *
+ *	An entry isn't sent while an earlier entry for the same session
+ *	is still trying its queries, so that its writes can't overtake
+ *	the earlier entry's fallback queries.
+ */
+static sql_rcode_t sql_write_pipelined(rlm_sql_t *inst, rlm_sql_handle_t **handle, sql_pending_t **entries,
+				       uint32_t num)
+{
+	char const	**queries;
+	int		*affected, *next;
+	uint32_t	*round;
+	uint32_t	i, count;
+	sql_rcode_t	sql_ret = RLM_SQL_OK;
+
+	queries = talloc_array(NULL, char const *, num);
+	affected = talloc_array(queries, int, num);
+	next = talloc_zero_array(queries, int, num);
+	round = talloc_array(queries, uint32_t, num);
+
+	for (i = 0; i < num; i++) entries[i]->rcode = RLM_MODULE_NOOP;
+
+	while (true) {
+		count = 0;
+		for (i = 0; i < num; i++) {
+			if ((entries[i]->rcode == RLM_MODULE_OK) || (next[i] >= entries[i]->num_queries)) continue;
+			if (sql_pending_blocked(entries, next, i)) continue;
+
+			round[count] = i;
+			queries[count] = entries[i]->queries[next[i]];
+			count++;
+		}
+		if (!count) break;
+
+		sql_ret = rlm_sql_pipeline(handle, inst, queries, count, affected);
+		if (sql_ret != RLM_SQL_OK) break;
+
+		for (i = 0; i < count; i++) {
+			if (affected[i] > 0) entries[round[i]]->rcode = RLM_MODULE_OK;
+			next[round[i]]++;
+		}
+	}
+
+	talloc_free(queries);
+	return sql_ret;
+}
+
+/*
+ *	Write a set of entries in one transaction.
+ *
+ *	If the connection is lost, so is the transaction, and nothing in
+ *	it was written.  *handle is then the new connection (or NULL),
+ *	and we return RLM_SQL_RECONNECT so that the caller can retry the
+ *	whole batch.  Nothing is ever written outside of the transaction.
+ */
+static sql_rcode_t sql_write_transaction(rlm_sql_t *inst, rlm_sql_handle_t **handle, sql_pending_t **entries,
+					 uint32_t num)
+{
+	uint32_t	i;
+	sql_rcode_t	sql_ret;
+
+	/*
+	 *	This may reconnect, but there's nothing to lose yet.
+	 */
+	sql_ret = sql_batch_query(handle, inst, "BEGIN");
+	if (sql_ret != RLM_SQL_OK) return sql_ret;
+
+	if (inst->module->sql_pipeline) {
+		sql_ret = sql_write_pipelined(inst, handle, entries, num);
+	} else {
+		for (i = 0; i < num; i++) {
+			sql_ret = sql_write_entry(inst, handle, entries[i], true);
+			if (sql_ret != RLM_SQL_OK) break;
+		}
+	}
+
+	if (sql_ret == RLM_SQL_OK) {
+		sql_ret = rlm_sql_transaction_query(handle, inst, "COMMIT");
+		if (sql_ret == RLM_SQL_OK) {
+			(inst->module->sql_finish_query)(*handle, inst->config);
+			return RLM_SQL_OK;
+		}
+	}
+
+	if (sql_ret == RLM_SQL_RECONNECT) return sql_ret;
+
+	sql_batch_query(handle, inst, "ROLLBACK");
+	return sql_ret;
+}
+
+/*
+ *	Write a set of entries over one connection.  More than one
+ *	entry is written in a transaction, so the database only has to
+ *	commit once.  If the connection is lost, the transaction is
+ *	retried once on the new connection.  If anything else in the
+ *	transaction fails, it's rolled back, and the entries are written
+ *	one at a time, so that one bad entry can't take the others with
+ *	it.
+ */
+static void sql_write_entries(rlm_sql_t *inst, sql_pending_t **entries, uint32_t num)
+{
+	uint32_t		i;
+	int			tries;
+	rlm_sql_handle_t	*handle;
+	sql_rcode_t		sql_ret;
+
+	handle = sql_get_socket(inst);
+
+	if (num > 1) {
+		for (tries = 0; handle && (tries < 2); tries++) {
+			sql_ret = sql_write_transaction(inst, &handle, entries, num);
+			if (sql_ret == RLM_SQL_OK) goto done;
+			if (sql_ret != RLM_SQL_RECONNECT) break;
+
+			WARN("rlm_sql (%s): Lost connection while writing batch of %u entries",
+			     inst->config->xlat_name, num);
+		}
+
+		WARN("rlm_sql (%s): Failed writing batch of %u entries, writing them separately",
+		     inst->config->xlat_name, num);
+	}
+
+	/*
+	 *	With no handle, each entry fails.
+	 */
+	for (i = 0; i < num; i++) {
+		sql_write_entry(inst, &handle, entries[i], false);
+	}
+
+done:
+	if (handle) sql_release_socket(inst, handle);
+}
+
+typedef struct sql_flush_t {
+	sql_pending_t		**entries;
+	uint32_t		num;
+} sql_flush_t;
+
+static int _pending_collect(void *ctx, void *data)
+{
+	sql_flush_t *flush = ctx;
+
+	flush->entries[flush->num++] = data;
+	return 0;
+}
+
+/*
+ *	Every flush_interval seconds, swap the queue for an empty one,
+ *	and write everything which was in it.
+ */
+static void *sql_flusher(void *arg)
+{
+	rlm_sql_t	*inst = arg;
+	rbtree_t	*tree, *empty = NULL;
+	bool		exiting;
+	struct timeval	now;
+	struct timespec	when;
+	sql_flush_t	flush;
+	uint32_t	i, chunk, written;
+
+	chunk = inst->config->batch_size ? inst->config->batch_size : 1;
+
+	pthread_mutex_lock(&inst->pending_mutex);
+	while (true) {
+		if (!inst->flusher_exiting) {
+			gettimeofday(&now, NULL);
+			when.tv_sec = now.tv_sec + inst->config->flush_interval;
+			when.tv_nsec = now.tv_usec * 1000;
+			pthread_cond_timedwait(&inst->pending_cond, &inst->pending_mutex, &when);
+		}
+		exiting = inst->flusher_exiting;
+
+		if (!empty) empty = pending_create();
+		if (!empty || (rbtree_num_elements(inst->pending) == 0)) {
+			if (exiting) break;
+			continue;
+		}
+
+		tree = inst->flushing = inst->pending;
+		inst->pending = empty;
+		empty = NULL;
+		pthread_mutex_unlock(&inst->pending_mutex);
+
+		flush.num = 0;
+		flush.entries = talloc_array(NULL, sql_pending_t *, rbtree_num_elements(tree));
+		if (flush.entries) rbtree_walk(tree, RBTREE_IN_ORDER, _pending_collect, &flush);
+
+		for (i = 0; i < flush.num; i += chunk) {
+			sql_write_entries(inst, flush.entries + i, ((flush.num - i) < chunk) ? (flush.num - i) : chunk);
+		}
+
+		written = 0;
+		for (i = 0; i < flush.num; i++) {
+			if (flush.entries[i]->rcode == RLM_MODULE_OK) written++;
+		}
+		talloc_free(flush.entries);
+
+		DEBUG("rlm_sql (%s): Wrote %u queued interim updates",
+		      inst->config->xlat_name, written);
+		if (written < rbtree_num_elements(tree)) {
+			ERROR("rlm_sql (%s): Failed writing %u queued interim updates",
+			      inst->config->xlat_name, rbtree_num_elements(tree) - written);
+		}
+
+		pthread_mutex_lock(&inst->pending_mutex);
+		inst->flushing = NULL;
+		pthread_cond_broadcast(&inst->flushed_cond);
+		pthread_mutex_unlock(&inst->pending_mutex);
+
+		rbtree_free(tree);
+
+		pthread_mutex_lock(&inst->pending_mutex);
+		if (exiting) break;
+	}
+	pthread_mutex_unlock(&inst->pending_mutex);
+
+	if (empty) rbtree_free(empty);
+
+	return NULL;
+}
+
+/*
+ *	Expand the queries for an interim update, and queue them.  If
+ *	the session already has a queued update, it's replaced.
+ */
+static rlm_rcode_t acct_write_behind(rlm_sql_t *inst, REQUEST *request, sql_acct_section_t *section,
+				     char const *key)
+{
+	sql_pending_t	*entry, my_entry;
+	rlm_rcode_t	rcode;
+	int		ret;
+
+	rcode = acct_expand(&entry, NULL, inst, request, section);
+	if (rcode != RLM_MODULE_OK) return rcode;
+
+	entry->key = talloc_typed_strdup(entry, key);
+
+	pthread_mutex_lock(&inst->pending_mutex);
+
+	/*
+	 *	The thread is started here instead of in
+	 *	mod_instantiate(), as the server may fork after
+	 *	the modules have been instantiated.
+	 */
+	if (!inst->flusher_running) {
+		ret = pthread_create(&inst->flusher, NULL, sql_flusher, inst);
+		if (ret != 0) {
+			pthread_mutex_unlock(&inst->pending_mutex);
+			talloc_free(entry);
+			REDEBUG("Failed creating flusher thread: %s", fr_syserror(ret));
+			return acct_redundant(inst, request, section);
+		}
+		inst->flusher_running = true;
+	}
+
+	my_entry.key = key;
+	if ((rbtree_num_elements(inst->pending) >= inst->config->max_pending) &&
+	    !rbtree_finddata(inst->pending, &my_entry)) {
+		pthread_mutex_unlock(&inst->pending_mutex);
+		talloc_free(entry);
+		RWDEBUG("Too many queued interim updates, writing now");
+		return acct_redundant(inst, request, section);
+	}
+
+	if (!rbtree_insert(inst->pending, entry)) {
+		pthread_mutex_unlock(&inst->pending_mutex);
+		talloc_free(entry);
+		return acct_redundant(inst, request, section);
+	}
+	pthread_mutex_unlock(&inst->pending_mutex);
+
+	RDEBUG2("Queued interim update for session %s", key);
+
+	return RLM_MODULE_OK;
+}
+
+/*
+ *	Start and Stop packets are written immediately.  Any update
+ *	which is queued for the session is older, so it's discarded.
+ *	If one is being written, wait for it, so that it can't
+ *	overwrite what we're about to write.
+ */
+static void acct_write_behind_discard(rlm_sql_t *inst, REQUEST *request, char const *key)
+{
+	sql_pending_t my_entry;
+
+	my_entry.key = key;
+
+	pthread_mutex_lock(&inst->pending_mutex);
+	if (rbtree_deletebydata(inst->pending, &my_entry)) {
+		RDEBUG2("Discarding queued interim update for session %s", key);
+	}
+
+	while (inst->flushing && rbtree_finddata(inst->flushing, &my_entry)) {
+		pthread_cond_wait(&inst->flushed_cond, &inst->pending_mutex);
+	}
+	pthread_mutex_unlock(&inst->pending_mutex);
+}
+
+/*
+ *	Collect entries from many requests, and write up to batch_size
+ *	of them at a time.  The batcher waits up to batch_interval
+ *	milliseconds after the first entry for more to arrive.
+ */
+static void *sql_batcher(void *arg)
+{
+	rlm_sql_t	*inst = arg;
+	sql_pending_t	**entries, *entry, *one[1];
+	uint32_t	i, num, max;
+	struct timeval	now;
+	struct timespec	when;
+
+	/*
+	 *	If we can't allocate the array, write entries one at
+	 *	a time.
+	 */
+	max = inst->config->batch_size;
+	entries = talloc_array(NULL, sql_pending_t *, max);
+	if (!entries) {
+		entries = one;
+		max = 1;
+	}
+
+	pthread_mutex_lock(&inst->batch_mutex);
+	while (true) {
+		while (!inst->batch_head && !inst->batcher_exiting) {
+			pthread_cond_wait(&inst->batch_cond, &inst->batch_mutex);
+		}
+		if (!inst->batch_head) break;
+
+		gettimeofday(&now, NULL);
+		now.tv_usec += inst->config->batch_interval * 1000;
+		when.tv_sec = now.tv_sec + (now.tv_usec / 1000000);
+		when.tv_nsec = (now.tv_usec % 1000000) * 1000;
+
+		while ((inst->batch_queued < max) && !inst->batcher_exiting) {
+			if (pthread_cond_timedwait(&inst->batch_cond, &inst->batch_mutex, &when) == ETIMEDOUT) break;
+		}
+
+		num = 0;
+		for (entry = inst->batch_head; entry && (num < max); entry = entry->next) {
+			entries[num++] = entry;
+		}
+
+		inst->batch_head = entry;
+		if (!entry) inst->batch_tail = &inst->batch_head;
+		inst->batch_queued -= num;
+		pthread_mutex_unlock(&inst->batch_mutex);
+
+		sql_write_entries(inst, entries, num);
+
+		pthread_mutex_lock(&inst->batch_mutex);
+		for (i = 0; i < num; i++) entries[i]->done = true;
+		pthread_cond_broadcast(&inst->batch_done_cond);
+	}
+	pthread_mutex_unlock(&inst->batch_mutex);
+
+	if (entries != one) talloc_free(entries);
+
+	return NULL;
+}
+
+/*
+ *	Queue the queries for the batcher, and wait for them to be
+ *	written.
+ */
+static rlm_rcode_t acct_batch(rlm_sql_t *inst, REQUEST *request, sql_acct_section_t *section)
+{
+	sql_pending_t	*entry;
+	VALUE_PAIR	*vp;
+	rlm_rcode_t	rcode;
+	int		ret;
+
+	rcode = acct_expand(&entry, request, inst, request, section);
+	if (rcode != RLM_MODULE_OK) return rcode;
+
+	/*
+	 *	So that the pipeline can tell which entries have to
+	 *	be written in order.
+	 */
+	vp = pairfind(request->packet->vps, PW_ACCT_UNIQUE_SESSION_ID, 0, TAG_ANY);
+	if (vp) entry->key = talloc_typed_strdup(entry, vp->vp_strvalue);
+
+	pthread_mutex_lock(&inst->batch_mutex);
+	if (!inst->batcher_running) {
+		ret = pthread_create(&inst->batcher, NULL, sql_batcher, inst);
+		if (ret != 0) {
+			pthread_mutex_unlock(&inst->batch_mutex);
+			talloc_free(entry);
+			REDEBUG("Failed creating batcher thread: %s", fr_syserror(ret));
+			return acct_redundant(inst, request, section);
+		}
+		inst->batcher_running = true;
+	}
+
+	*inst->batch_tail = entry;
+	inst->batch_tail = &entry->next;
+	inst->batch_queued++;
+	if ((inst->batch_queued == 1) || (inst->batch_queued >= inst->config->batch_size)) {
+		pthread_cond_signal(&inst->batch_cond);
+	}
+
+	while (!entry->done) pthread_cond_wait(&inst->batch_done_cond, &inst->batch_mutex);
+	pthread_mutex_unlock(&inst->batch_mutex);
+
+	rcode = entry->rcode;
+	talloc_free(entry);
+
+	return rcode;
+}
+
+/*
+ *	Whether a request would have to wait for a connection.
+ */
+static bool acct_pool_busy(rlm_sql_t *inst)
+{
+	fr_connection_pool_stats_t stats;
+
+	fr_connection_pool_stats(inst->pool, &stats);
+
+	return (stats.waiting > 0) || (stats.max && (stats.active >= stats.max));
+}
+
+/*
+ *	Whether the database is too slow to write to now.
+ */
+static bool acct_overflow_busy(rlm_sql_t *inst)
+{
+	if (inst->config->overflow_threshold &&
+	    (__atomic_load_n(&inst->latency, __ATOMIC_RELAXED) > (inst->config->overflow_threshold * 1000))) {
+		return true;
+	}
+
+	return acct_pool_busy(inst);
+}
+
+/*
+ *	Read one packet from the spool.  The format is the same as
+ *	rlm_detail's, with a header line, "Attribute = value" lines,
+ *	and a blank line.  Returns false at the end of the file.
+ */
+static bool acct_replay_read(RADIUS_PACKET *packet, FILE *fp, time_t *timestamp)
+{
+	char		buffer[8192];
+	bool		found = false;
+	VALUE_PAIR	*vp;
+	vp_cursor_t	cursor;
+
+	fr_cursor_init(&cursor, &packet->vps);
+
+	while (fgets(buffer, sizeof(buffer), fp)) {
+		if (buffer[0] == '\n') {
+			if (found) break;
+			continue;
+		}
+		found = true;
+
+		/*
+		 *	The header.
+		 */
+		if (buffer[0] != '\t') continue;
+
+		if (strncmp(buffer, "\tTimestamp = ", 13) == 0) {
+			*timestamp = strtoul(buffer + 13, NULL, 10);
+			continue;
+		}
+
+		vp = NULL;
+		if ((userparse(packet, buffer, &vp) > 0) && vp) fr_cursor_merge(&cursor, vp);
+	}
+
+	return found;
+}
+
+/*
+ *	Write the packets in the work file, oldest first.  Returns true
+ *	once they've all been written, and the file has been removed.
+ *	If the database becomes slow, or can't be reached, we stop, and
+ *	the next call starts again from the packet which wasn't written.
+ */
+static bool acct_replay(rlm_sql_t *inst, off_t *offset)
+{
+	FILE			*fp;
+	REQUEST			*request;
+	VALUE_PAIR		*vp;
+	time_t			timestamp;
+	rlm_rcode_t		rcode;
+	uint32_t		written = 0;
+	fr_connection_pool_stats_t stats;
+
+	fp = fopen(inst->overflow_work, "r");
+	if (!fp) {
+		if (errno == ENOENT) {
+			*offset = 0;
+			return true;
+		}
+
+		ERROR("rlm_sql (%s): Failed opening %s: %s", inst->config->xlat_name,
+		      inst->overflow_work, fr_syserror(errno));
+		return false;
+	}
+
+	if (fseeko(fp, *offset, SEEK_SET) < 0) {
+		fclose(fp);
+		return false;
+	}
+
+	while (!__atomic_load_n(&inst->replayer_exiting, __ATOMIC_RELAXED)) {
+		/*
+		 *	The latency is only measured by our own writes
+		 *	while we're replaying, so always try one packet.
+		 */
+		if (written ? acct_overflow_busy(inst) : acct_pool_busy(inst)) break;
+
+		request = request_alloc(NULL);
+		request->packet = rad_alloc(request, false);
+		request->reply = rad_alloc(request, false);
+		request->packet->code = PW_CODE_ACCOUNTING_REQUEST;
+
+		timestamp = 0;
+		if (!acct_replay_read(request->packet, fp, &timestamp)) {
+			talloc_free(request);
+			fclose(fp);
+
+			DEBUG("rlm_sql (%s): Replayed %u spooled accounting packets", inst->config->xlat_name, written);
+			unlink(inst->overflow_work);
+			*offset = 0;
+			return true;
+		}
+
+		/*
+		 *	As with the detail file reader, the packet was
+		 *	delayed by the time it spent in the spool.
+		 */
+		if (timestamp) {
+			request->timestamp = timestamp;
+			request->packet->timestamp.tv_sec = timestamp;
+
+			vp = pairfind(request->packet->vps, PW_ACCT_DELAY_TIME, 0, TAG_ANY);
+			if (!vp) {
+				vp = paircreate(request->packet, PW_ACCT_DELAY_TIME, 0);
+				if (vp) pairadd(&request->packet->vps, vp);
+			}
+			if (vp) vp->vp_integer += time(NULL) - timestamp;
+		}
+		request->username = pairfind(request->packet->vps, PW_USER_NAME, 0, TAG_ANY);
+
+		rcode = acct_redundant(inst, request, &inst->config->accounting);
+		talloc_free(request);
+
+		/*
+		 *	If there are no connections, the database is down,
+		 *	so try the packet again later.  Otherwise the query
+		 *	itself failed, and it would fail again.
+		 */
+		if (rcode == RLM_MODULE_FAIL) {
+			fr_connection_pool_stats(inst->pool, &stats);
+			if (stats.num == 0) break;
+
+			ERROR("rlm_sql (%s): Failed writing spooled accounting packet", inst->config->xlat_name);
+		}
+
+		*offset = ftello(fp);
+		written++;
+	}
+
+	fclose(fp);
+
+	return false;
+}
+
+/*
+ *	Move the spool aside, and replay it once the database has
+ *	recovered.  New packets go into a new spool until both files
+ *	are empty, so that they are written in the order they arrived.
+ */
+static void *acct_replayer(void *arg)
+{
+	rlm_sql_t	*inst = arg;
+	off_t		offset = 0;
+	bool		done = false;
+	struct stat	st;
+	struct timeval	now;
+	struct timespec	when;
+
+	pthread_mutex_lock(&inst->overflow_mutex);
+	while (!inst->replayer_exiting) {
+		if (!done) {
+			gettimeofday(&now, NULL);
+			when.tv_sec = now.tv_sec + 1;
+			when.tv_nsec = now.tv_usec * 1000;
+			pthread_cond_timedwait(&inst->overflow_cond, &inst->overflow_mutex, &when);
+			if (inst->replayer_exiting) break;
+		}
+		done = false;
+
+		if (!inst->overflowing) continue;
+
+		if (stat(inst->overflow_work, &st) < 0) {
+			if (inst->overflow_fp) {
+				fclose(inst->overflow_fp);
+				inst->overflow_fp = NULL;
+			}
+
+			/*
+			 *	Both files are empty, so the packets can go
+			 *	to the database again.
+			 */
+			if (rename(inst->config->overflow_file, inst->overflow_work) < 0) {
+				if (errno == ENOENT) {
+					inst->overflowing = false;
+				} else {
+					ERROR("rlm_sql (%s): Failed renaming %s: %s", inst->config->xlat_name,
+					      inst->config->overflow_file, fr_syserror(errno));
+				}
+				continue;
+			}
+		}
+		pthread_mutex_unlock(&inst->overflow_mutex);
+
+		done = acct_replay(inst, &offset);
+
+		pthread_mutex_lock(&inst->overflow_mutex);
+	}
+	pthread_mutex_unlock(&inst->overflow_mutex);
+
+	return NULL;
+}
+
+/*
+ *	Append the packet to the spool, and acknowledge it.  The
+ *	replayer writes it to the database later.
+ */
+static rlm_rcode_t acct_overflow(rlm_sql_t *inst, REQUEST *request)
+{
+	char		*entry;
+	char		buffer[1024];
+	VALUE_PAIR	*vp;
+	vp_cursor_t	cursor;
+	size_t		len;
+	int		ret;
+
+	CTIME_R(&request->timestamp, buffer, sizeof(buffer));
+	entry = talloc_typed_strdup(request, buffer);
+
+	for (vp = fr_cursor_init(&cursor, &request->packet->vps);
+	     vp;
+	     vp = fr_cursor_next(&cursor)) {
+		FR_TOKEN op = vp->op;
+
+		vp->op = T_OP_EQ;
+		len = vp_prints(buffer, sizeof(buffer), vp);
+		vp->op = op;
+		if (!len || (len >= sizeof(buffer))) continue;
+
+		entry = talloc_asprintf_append_buffer(entry, "\t%s\n", buffer);
+	}
+	entry = talloc_asprintf_append_buffer(entry, "\tTimestamp = %ld\n\n", (long) request->timestamp);
+	len = talloc_array_length(entry) - 1;
+
+	pthread_mutex_lock(&inst->overflow_mutex);
+
+	/*
+	 *	The thread is started here instead of in
+	 *	mod_instantiate(), as the server may fork after
+	 *	the modules have been instantiated.
+	 */
+	if (!inst->replayer_running) {
+		ret = pthread_create(&inst->replayer, NULL, acct_replayer, inst);
+		if (ret != 0) {
+			pthread_mutex_unlock(&inst->overflow_mutex);
+			talloc_free(entry);
+			REDEBUG("Failed creating replayer thread: %s", fr_syserror(ret));
+			return acct_redundant(inst, request, &inst->config->accounting);
+		}
+		inst->replayer_running = true;
+	}
+
+	if (!inst->overflow_fp) {
+		inst->overflow_fp = fopen(inst->config->overflow_file, "a");
+		if (!inst->overflow_fp) {
+			pthread_mutex_unlock(&inst->overflow_mutex);
+			talloc_free(entry);
+			REDEBUG("Failed opening %s: %s", inst->config->overflow_file, fr_syserror(errno));
+			return acct_redundant(inst, request, &inst->config->accounting);
+		}
+	}
+
+	if ((fwrite(entry, 1, len, inst->overflow_fp) != len) || (fflush(inst->overflow_fp) != 0)) {
+		pthread_mutex_unlock(&inst->overflow_mutex);
+		talloc_free(entry);
+		REDEBUG("Failed writing to %s: %s", inst->config->overflow_file, fr_syserror(errno));
+		return RLM_MODULE_FAIL;
+	}
+	inst->overflowing = true;
+	pthread_mutex_unlock(&inst->overflow_mutex);
+
+	talloc_free(entry);
+
+	RDEBUG2("Database is slow, spooled packet to %s", inst->config->overflow_file);
+
+	return RLM_MODULE_OK;
+}
+#endif
 
 /*
  *	Accounting: Insert or update session data in our sql table
@@ -1333,11 +2810,42 @@ finish:
 static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, REQUEST * request) {
 	rlm_sql_t *inst = instance;
 
-	if (inst->config->accounting.reference_cp) {
-		return acct_redundant(inst, request, &inst->config->accounting);
+	if (!inst->config->accounting.reference_cp) return RLM_MODULE_NOOP;
+
+	if (inst->cache && (sql_set_user(inst, request, NULL) == 0)) {
+		sql_cache_invalidate_user(inst, request);
+		sql_unset_user(inst, request);
 	}
 
-	return RLM_MODULE_NOOP;
+#ifdef HAVE_PTHREAD_H
+	/*
+	 *	Once one packet has been spooled, the rest are too,
+	 *	until the replayer has caught up.
+	 */
+	if (inst->config->overflow_file &&
+	    (__atomic_load_n(&inst->overflowing, __ATOMIC_RELAXED) || acct_overflow_busy(inst))) {
+		return acct_overflow(inst, request);
+	}
+
+	if (inst->config->write_behind) {
+		VALUE_PAIR *key, *status;
+
+		key = pairfind(request->packet->vps, PW_ACCT_UNIQUE_SESSION_ID, 0, TAG_ANY);
+		status = pairfind(request->packet->vps, PW_ACCT_STATUS_TYPE, 0, TAG_ANY);
+
+		if (key && status) {
+			if (status->vp_integer == PW_STATUS_ALIVE) {
+				return acct_write_behind(inst, request, &inst->config->accounting, key->vp_strvalue);
+			}
+
+			acct_write_behind_discard(inst, request, key->vp_strvalue);
+		}
+	}
+
+	if (inst->config->batch_size > 0) return acct_batch(inst, request, &inst->config->accounting);
+#endif
+
+	return acct_redundant(inst, request, &inst->config->accounting);
 }
 
 #endif
@@ -1365,8 +2873,6 @@ static rlm_rcode_t CC_HINT(nonnull) mod_checksimul(void *instance, REQUEST * req
 	uint32_t		nas_addr = 0;
 	uint32_t		nas_port = 0;
 
-	char 			*expanded = NULL;
-
 	/* If simul_count_query is not defined, we don't do any checking */
 	if (!inst->config->simul_count_query || (inst->config->simul_count_query[0] == '\0')) {
 		return RLM_MODULE_NOOP;
@@ -1383,20 +2889,14 @@ static rlm_rcode_t CC_HINT(nonnull) mod_checksimul(void *instance, REQUEST * req
 		return RLM_MODULE_FAIL;
 	}
 
-	if (radius_axlat(&expanded, request, inst->config->simul_count_query, sql_escape_func, inst) < 0) {
-		sql_unset_user(inst, request);
-		return RLM_MODULE_FAIL;
-	}
-
 	/* initialize the sql socket */
 	handle = sql_get_socket(inst);
 	if (!handle) {
-		talloc_free(expanded);
 		sql_unset_user(inst, request);
 		return RLM_MODULE_FAIL;
 	}
 
-	if (rlm_sql_select_query(&handle, inst, expanded) != RLM_SQL_OK) {
+	if (rlm_sql_select_xlat(&handle, inst, request, inst->config->simul_count_query) != RLM_SQL_OK) {
 		rcode = RLM_MODULE_FAIL;
 		goto finish;
 	}
@@ -1416,7 +2916,6 @@ static rlm_rcode_t CC_HINT(nonnull) mod_checksimul(void *instance, REQUEST * req
 	request->simul_count = atoi(row[0]);
 
 	(inst->module->sql_finish_select_query)(handle, inst->config);
-	TALLOC_FREE(expanded);
 
 	if (request->simul_count < request->simul_max) {
 		rcode = RLM_MODULE_OK;
@@ -1433,13 +2932,7 @@ static rlm_rcode_t CC_HINT(nonnull) mod_checksimul(void *instance, REQUEST * req
 		goto finish;
 	}
 
-	if (radius_axlat(&expanded, request, inst->config->simul_verify_query, sql_escape_func, inst) < 0) {
-		rcode = RLM_MODULE_FAIL;
-
-		goto finish;
-	}
-
-	if (rlm_sql_select_query(&handle, inst, expanded) != RLM_SQL_OK) {
+	if (rlm_sql_select_xlat(&handle, inst, request, inst->config->simul_verify_query) != RLM_SQL_OK) {
 		goto finish;
 	}
 
@@ -1539,7 +3032,6 @@ static rlm_rcode_t CC_HINT(nonnull) mod_checksimul(void *instance, REQUEST * req
 
 	(inst->module->sql_finish_select_query)(handle, inst->config);
 	sql_release_socket(inst, handle);
-	talloc_free(expanded);
 	sql_unset_user(inst, request);
 
 	/*
@@ -1596,4 +3088,8 @@ module_t rlm_sql = {
 		NULL,			/* post-proxy */
 		mod_post_auth	/* post-auth */
 	},
+	0,			/* thread_inst_size */
+	NULL,			/* thread_instantiate */
+	NULL,			/* thread_detach */
+	sql_cache_flush		/* cache_flush */
 };
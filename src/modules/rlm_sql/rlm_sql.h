@@ -13,6 +13,7 @@ RCSIDH(rlm_sql_h, "$Id$")
 #include	<freeradius-devel/radiusd.h>
 #include	<freeradius-devel/connection.h>
 #include	<freeradius-devel/modpriv.h>
+#include	<freeradius-devel/heap.h>
 
 #define PW_ITEM_CHECK		0
 #define PW_ITEM_REPLY		1
@@ -36,6 +37,26 @@ typedef enum {
 
 typedef char **rlm_sql_row_t;
 
+#define SQL_PREPARED_MAX	64	//!< Most templates which can be prepared at once, across all instances.
+
+/*
+ *	A query template which has been compiled, so that the values
+ *	can be sent to the database separately from the query.  Each
+ *	single-quoted string in the template which contains an expansion
+ *	becomes a parameter ($1, $2, ...).
+ */
+typedef struct sql_prepared {
+	char const	*fmt;		//!< The template the statement was compiled from.
+	unsigned int	id;		//!< Unique across instances, as they may share connections.
+					//!< Released when the statement is freed, and then reused.
+	uint64_t	gen;		//!< Never reused, so a connection can tell whether it has
+					//!< prepared this statement, or an older one with the same id.
+	char const	*query;		//!< With placeholders instead of the quoted strings.
+	char const	**params;	//!< xlat format of each parameter.
+	int		num_params;
+	bool		disabled;	//!< The database couldn't prepare it.
+} sql_prepared_t;
+
 /*
  * Sections where we dynamically resolve the config entry to use,
  * by xlating reference.
@@ -74,8 +95,10 @@ typedef struct sql_config {
 	char const	*simul_count_query;
 	char const	*simul_verify_query;
 	char const 	*groupmemb_query;
+	char const	*authorize_query;	//!< User and group check/reply rows in one query.
 
 	bool		do_clients;
+	bool		prepared;	//!< Use prepared statements for SELECT queries.
 	bool		read_groups;
 	bool		read_profiles;
 	char const	*logfile;
@@ -97,14 +120,55 @@ typedef struct sql_config {
 	 */
 	sql_acct_section_t	postauth;
 	sql_acct_section_t	accounting;
+
+	bool		write_behind;		//!< Queue interim updates, and write them later.
+	uint32_t	flush_interval;		//!< How often queued updates are written.
+	uint32_t	max_pending;		//!< Most sessions with a queued update.
+
+	uint32_t	batch_size;		//!< Most entries to write in one transaction.
+	uint32_t	batch_interval;		//!< How long to wait for a batch to fill.
+
+	char const	*overflow_file;		//!< Spool for accounting packets when the database is slow.
+	uint32_t	overflow_threshold;	//!< Spool when writes take longer than this (ms).
+
+	char const	*lag_query;		//!< Returns a replica's replication lag, in seconds.
+	uint32_t	max_lag;		//!< Skip replicas which are further behind than this.
+	uint32_t	lag_check_interval;	//!< How often to run lag_query on each replica.
+	uint32_t	retry_delay;		//!< How long to skip a replica which failed.
+
+	uint32_t	cache_ttl;		//!< How long authorize_query results are cached for.
+						//!< 0 disables the cache.
+	uint32_t	cache_negative_ttl;	//!< How long users with no rows are remembered for.
+	uint32_t	cache_max_entries;	//!< Maximum number of users in the cache.
 } rlm_sql_config_t;
 
 typedef struct sql_inst rlm_sql_t;
+typedef struct sql_cache_entry sql_cache_entry_t;
+
+#define SQL_CACHE_COLUMNS	6	//!< Columns of authorize_query which are cached.
+
+/** A read-only replica of the database, used for SELECTs
+ *
+ */
+typedef struct sql_replica {
+	rlm_sql_t		*inst;		//!< The instance this replica belongs to.
+	rlm_sql_config_t	*config;	//!< Copy of the instance config, with this server.
+	fr_connection_pool_t	*pool;		//!< Connections to this replica.
+
+	uint32_t		latency;	//!< Moving average of query times, in microseconds.
+	time_t			skip_until;	//!< Failed, or lagging.  Don't use it until then.
+	time_t			next_lag_check;	//!< When lag_query should next be run.
+} sql_replica_t;
 
 typedef struct rlm_sql_handle {
 	void		*conn;	//!< Database specific connection handle.
-	rlm_sql_row_t	row;	//!< Row data from the last query.
+	rlm_sql_row_t	row;	//!< Row data from the last query.  Owned by the driver, and only
+				//!< valid until the next fetch, or the end of the query.
 	rlm_sql_t	*inst;	//!< The rlm_sql instance this connection belongs to.
+	sql_replica_t	*replica; //!< The replica this connection is to, or NULL for the primary.
+	uint64_t	prepared[SQL_PREPARED_MAX]; //!< gen of the sql_prepared_t prepared on this connection
+						    //!< with each id, or 0.  A driver preparing a statement
+						    //!< whose id is already in use must replace the old one.
 } rlm_sql_handle_t;
 
 typedef struct rlm_sql_module_t {
@@ -123,6 +187,13 @@ typedef struct rlm_sql_module_t {
 	sql_rcode_t (*sql_finish_query)(rlm_sql_handle_t *handle, rlm_sql_config_t *config);
 	sql_rcode_t (*sql_finish_select_query)(rlm_sql_handle_t *handle, rlm_sql_config_t *config);
 	int (*sql_affected_rows)(rlm_sql_handle_t *handle, rlm_sql_config_t *config);
+
+	sql_rcode_t (*sql_prepare)(rlm_sql_handle_t *handle, rlm_sql_config_t *config, sql_prepared_t const *stmt);
+	sql_rcode_t (*sql_execute)(rlm_sql_handle_t *handle, rlm_sql_config_t *config, sql_prepared_t const *stmt,
+				   char const * const *values);
+
+	sql_rcode_t (*sql_pipeline)(rlm_sql_handle_t *handle, rlm_sql_config_t *config,
+				    char const * const *queries, int num, int *affected);
 } rlm_sql_module_t;
 
 struct sql_inst {
@@ -135,9 +206,53 @@ struct sql_inst {
 						//!< dictionary attribute.
 	fr_logfile_t		*lf;
 
+	sql_prepared_t		**prepared;	//!< Compiled SELECT templates.
+	int			num_prepared;
+
+	sql_replica_t		*replicas;	//!< Servers from the "read_pool" section.
+	int			num_replicas;
+
+	uint32_t		latency;	//!< Moving average of write query times, in microseconds.
+
+	rbtree_t		*cache;		//!< Cached authorize_query rows, by SQL-User-Name.
+	fr_heap_t		*cache_heap;	//!< The same entries, by expiry time.
+
 	void *handle;
 	rlm_sql_module_t *module;
 
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t		replica_mutex;
+	pthread_mutex_t		cache_mutex;	//!< Protects the cache and the entries in it.
+
+	rbtree_t		*pending;	//!< Queued interim updates, by Acct-Unique-Session-Id.
+	rbtree_t		*flushing;	//!< Updates which are being written.
+	pthread_mutex_t		pending_mutex;
+	pthread_cond_t		pending_cond;	//!< Wakes the flusher when we're exiting.
+	pthread_cond_t		flushed_cond;	//!< Signalled when "flushing" has been written.
+	pthread_t		flusher;
+	bool			flusher_running;
+	bool			flusher_exiting;
+
+	struct sql_pending_t	*batch_head;	//!< Entries waiting for the batcher.
+	struct sql_pending_t	**batch_tail;
+	uint32_t		batch_queued;
+	pthread_mutex_t		batch_mutex;
+	pthread_cond_t		batch_cond;	//!< Wakes the batcher.
+	pthread_cond_t		batch_done_cond; //!< Signalled when a batch has been written.
+	pthread_t		batcher;
+	bool			batcher_running;
+	bool			batcher_exiting;
+
+	FILE			*overflow_fp;	//!< Spool file which packets are being appended to.
+	char			*overflow_work;	//!< Spool file which is being replayed.
+	bool			overflowing;	//!< Packets are in the spool, so new ones go there too.
+	pthread_mutex_t		overflow_mutex;
+	pthread_cond_t		overflow_cond;	//!< Wakes the replayer when we're exiting.
+	pthread_t		replayer;
+	bool			replayer_running;
+	bool			replayer_exiting;
+#endif
+
 	int (*sql_set_user)(rlm_sql_t *inst, REQUEST *request, char const *username);
 	rlm_sql_handle_t *(*sql_get_socket)(rlm_sql_t *inst);
 	int (*sql_release_socket)(rlm_sql_t *inst, rlm_sql_handle_t *handle);
@@ -156,16 +271,36 @@ int		sql_socket_pool_init(rlm_sql_t *inst);
 void		sql_poolfree(rlm_sql_t *inst);
 int		sql_close_socket(rlm_sql_t *inst, rlm_sql_handle_t *handle);
 rlm_sql_handle_t *sql_get_socket(rlm_sql_t *inst);
+rlm_sql_handle_t *sql_get_read_socket(rlm_sql_t *inst);
 int		sql_release_socket(rlm_sql_t *inst, rlm_sql_handle_t *handle);
 int		sql_userparse(TALLOC_CTX *ctx, VALUE_PAIR **first_pair, rlm_sql_row_t row);
 int		sql_read_realms(rlm_sql_handle_t *handle);
-int		sql_getvpdata(TALLOC_CTX *ctx, rlm_sql_t *inst, rlm_sql_handle_t **handle, VALUE_PAIR **pair, char const *query);
+int		sql_getvpdata(TALLOC_CTX *ctx, rlm_sql_t *inst, REQUEST *request, rlm_sql_handle_t **handle,
+			      VALUE_PAIR **pair, char const *fmt);
 int		sql_read_naslist(rlm_sql_handle_t *handle);
 int		sql_read_clients(rlm_sql_handle_t *handle);
 int		sql_dict_init(rlm_sql_handle_t *handle);
 void 		CC_HINT(nonnull (1, 2, 4)) rlm_sql_query_log(rlm_sql_t *inst, REQUEST *request, sql_acct_section_t *section, char const *query);
 sql_rcode_t	CC_HINT(nonnull) rlm_sql_select_query(rlm_sql_handle_t **handle, rlm_sql_t *inst, char const *query);
 sql_rcode_t	CC_HINT(nonnull) rlm_sql_query(rlm_sql_handle_t **handle, rlm_sql_t *inst, char const *query);
+sql_rcode_t	CC_HINT(nonnull) rlm_sql_transaction_query(rlm_sql_handle_t **handle, rlm_sql_t *inst, char const *query);
+sql_rcode_t	CC_HINT(nonnull) rlm_sql_pipeline(rlm_sql_handle_t **handle, rlm_sql_t *inst,
+						  char const * const *queries, int num, int *affected);
+sql_prepared_t	*sql_prepared_compile(TALLOC_CTX *ctx, char const *fmt);
+sql_rcode_t	CC_HINT(nonnull) rlm_sql_select_xlat(rlm_sql_handle_t **handle, rlm_sql_t *inst, REQUEST *request,
+						     char const *fmt);
 int		rlm_sql_fetch_row(rlm_sql_handle_t **handle, rlm_sql_t *inst);
 int		sql_set_user(rlm_sql_t *inst, REQUEST *request, char const *username);
+
+/*
+ *	cache.c - Cache of authorize_query results.
+ */
+int		sql_cache_init(rlm_sql_t *inst);
+void		sql_cache_free(rlm_sql_t *inst);
+int		sql_cache_find(rlm_sql_t *inst, REQUEST *request, char const *key, rlm_sql_row_t **out);
+sql_cache_entry_t *sql_cache_entry_alloc(char const *key);
+int		sql_cache_entry_row(sql_cache_entry_t *entry, rlm_sql_row_t row);
+void		sql_cache_add(rlm_sql_t *inst, REQUEST *request, sql_cache_entry_t *entry);
+void		sql_cache_invalidate(rlm_sql_t *inst, char const *key);
+int		sql_cache_flush(void *instance, char const *key);
 #endif
@@ -50,10 +50,9 @@ static int _sql_conn_free(rlm_sql_handle_t *conn)
 	return 0;
 }
 
-static void *mod_conn_create(TALLOC_CTX *ctx, void *instance)
+static void *sql_conn_create(TALLOC_CTX *ctx, rlm_sql_t *inst, sql_replica_t *replica)
 {
 	int rcode;
-	rlm_sql_t *inst = instance;
 	rlm_sql_handle_t *handle;
 
 	/*
@@ -68,6 +67,7 @@ static void *mod_conn_create(TALLOC_CTX *ctx, void *instance)
 	 *	destructor has access to the module configuration.
 	 */
 	handle->inst = inst;
+	handle->replica = replica;
 
 	/*
 	 *	When something frees this handle the destructor set by
@@ -77,7 +77,7 @@ static void *mod_conn_create(TALLOC_CTX *ctx, void *instance)
 	 */
 	talloc_set_destructor(handle, _sql_conn_free);
 
-	rcode = (inst->module->sql_socket_init)(handle, inst->config);
+	rcode = (inst->module->sql_socket_init)(handle, replica ? replica->config : inst->config);
 	if (rcode != 0) {
 	fail:
 		exec_trigger(NULL, inst->cs, "modules.sql.fail", true);
@@ -100,6 +100,93 @@ static void *mod_conn_create(TALLOC_CTX *ctx, void *instance)
 	return handle;
 }
 
+static void *mod_conn_create(TALLOC_CTX *ctx, void *instance)
+{
+	return sql_conn_create(ctx, instance, NULL);
+}
+
+static void *mod_replica_conn_create(TALLOC_CTX *ctx, void *instance)
+{
+	sql_replica_t *replica = instance;
+
+	return sql_conn_create(ctx, replica->inst, replica);
+}
+
+/*
+ *	The pool which a handle was taken from.
+ */
+static inline fr_connection_pool_t *sql_handle_pool(rlm_sql_t *inst, rlm_sql_handle_t *handle)
+{
+	return handle->replica ? handle->replica->pool : inst->pool;
+}
+
+#ifdef HAVE_PTHREAD_H
+#  define REPLICA_LOCK(_inst) pthread_mutex_lock(&(_inst)->replica_mutex)
+#  define REPLICA_UNLOCK(_inst) pthread_mutex_unlock(&(_inst)->replica_mutex)
+#else
+#  define REPLICA_LOCK(_inst)
+#  define REPLICA_UNLOCK(_inst)
+#endif
+
+/*
+ *	Don't use a replica for a while.  When it comes back, it
+ *	starts with no latency history, so that it's tried again.
+ */
+static void sql_replica_skip(sql_replica_t *replica, time_t now, uint32_t delay)
+{
+	rlm_sql_t *inst = replica->inst;
+
+	REPLICA_LOCK(inst);
+	replica->skip_until = now + delay;
+	replica->latency = 0;
+	REPLICA_UNLOCK(inst);
+}
+
+/*
+ *	Add a query time to the replica's moving average.
+ */
+static void sql_replica_latency(sql_replica_t *replica, struct timeval const *start)
+{
+	rlm_sql_t *inst = replica->inst;
+	struct timeval now, elapsed;
+	uint32_t usec;
+
+	gettimeofday(&now, NULL);
+	if (timercmp(&now, start, <)) return;
+
+	timersub(&now, start, &elapsed);
+	usec = (elapsed.tv_sec >= 60) ? (60 * 1000000) : (elapsed.tv_sec * 1000000) + elapsed.tv_usec;
+
+	REPLICA_LOCK(inst);
+	if (!replica->latency) {
+		replica->latency = usec;
+	} else {
+		replica->latency = ((replica->latency * 7) + usec) / 8;
+	}
+	REPLICA_UNLOCK(inst);
+}
+
+/*
+ *	Add a write query time to the primary's moving average, which
+ *	rlm_sql uses to decide whether to spool accounting packets.
+ *	Updates can race, but losing the odd sample doesn't matter.
+ */
+static void sql_write_latency(rlm_sql_t *inst, struct timeval const *start)
+{
+	struct timeval now, elapsed;
+	uint32_t usec, latency;
+
+	gettimeofday(&now, NULL);
+	if (timercmp(&now, start, <)) return;
+
+	timersub(&now, start, &elapsed);
+	usec = (elapsed.tv_sec >= 60) ? (60 * 1000000) : (elapsed.tv_sec * 1000000) + elapsed.tv_usec;
+
+	latency = __atomic_load_n(&inst->latency, __ATOMIC_RELAXED);
+	latency = latency ? ((latency * 7) + usec) / 8 : usec;
+	__atomic_store_n(&inst->latency, latency, __ATOMIC_RELAXED);
+}
+
 /*************************************************************************
  *
  *	Function: sql_socket_pool_init
@@ -109,9 +196,37 @@ static void *mod_conn_create(TALLOC_CTX *ctx, void *instance)
  *************************************************************************/
 int sql_socket_pool_init(rlm_sql_t * inst)
 {
+	int i;
+	CONF_SECTION *cs;
+	char log_prefix[256];
+
 	inst->pool = fr_connection_pool_module_init(inst->cs, inst, mod_conn_create, NULL, NULL);
 	if (!inst->pool) return -1;
 
+	if (!inst->num_replicas) return 1;
+
+	/*
+	 *	Each replica gets its own pool, with the same limits
+	 *	as the primary's.  If the primary shares another
+	 *	module's pool, the replicas use the default limits.
+	 */
+	cs = cf_section_sub_find(inst->cs, "pool");
+	if (!cs) {
+		cs = cf_section_alloc(inst->cs, "pool", NULL);
+		if (!cs) return -1;
+	}
+
+	for (i = 0; i < inst->num_replicas; i++) {
+		sql_replica_t *replica = &inst->replicas[i];
+
+		snprintf(log_prefix, sizeof(log_prefix), "rlm_sql (%s) replica %s",
+			 inst->config->xlat_name, replica->config->sql_server);
+
+		replica->pool = fr_connection_pool_init(inst->cs, cs, replica, mod_replica_conn_create, NULL,
+							log_prefix, "modules.sql.");
+		if (!replica->pool) return -1;
+	}
+
 	return 1;
 }
 
@@ -124,6 +239,12 @@ int sql_socket_pool_init(rlm_sql_t * inst)
  *************************************************************************/
 void sql_poolfree(rlm_sql_t * inst)
 {
+	int i;
+
+	for (i = 0; i < inst->num_replicas; i++) {
+		if (inst->replicas[i].pool) fr_connection_pool_delete(inst->replicas[i].pool);
+	}
+
 	fr_connection_pool_delete(inst->pool);
 }
 
@@ -140,6 +261,131 @@ rlm_sql_handle_t * sql_get_socket(rlm_sql_t * inst)
 	return fr_connection_get(inst->pool);
 }
 
+/*
+ *	Replace a handle whose connection failed.  If it was to a
+ *	replica which can't be reconnected to, fail over to the
+ *	primary.
+ */
+static rlm_sql_handle_t *sql_reconnect(rlm_sql_t *inst, rlm_sql_handle_t *handle)
+{
+	sql_replica_t *replica = handle->replica;
+
+	handle = fr_connection_reconnect(sql_handle_pool(inst, handle), handle);
+	if (handle || !replica) return handle;
+
+	WARN("rlm_sql (%s): Lost connection to replica %s, using the primary",
+	     inst->config->xlat_name, replica->config->sql_server);
+	sql_replica_skip(replica, time(NULL), inst->config->retry_delay);
+
+	return fr_connection_get(inst->pool);
+}
+
+/*
+ *	Pick the usable replica with the lowest latency.  If its
+ *	lag is due to be checked, the caller checks it.
+ */
+static sql_replica_t *sql_replica_pick(rlm_sql_t *inst, time_t now, bool *check_lag)
+{
+	int i;
+	sql_replica_t *replica, *best = NULL;
+
+	*check_lag = false;
+
+	REPLICA_LOCK(inst);
+	for (i = 0; i < inst->num_replicas; i++) {
+		replica = &inst->replicas[i];
+
+		if (replica->skip_until > now) continue;
+
+		if (!best || (replica->latency < best->latency)) best = replica;
+	}
+
+	if (best && inst->config->lag_query && (best->next_lag_check <= now)) {
+		best->next_lag_check = now + inst->config->lag_check_interval;
+		*check_lag = true;
+	}
+	REPLICA_UNLOCK(inst);
+
+	return best;
+}
+
+/*
+ *	Run lag_query on a replica.  Returns false if it's too far
+ *	behind the primary, or if we couldn't tell.
+ */
+static bool sql_replica_lag_ok(rlm_sql_t *inst, rlm_sql_handle_t **handle)
+{
+	bool ok = false;
+	sql_replica_t *replica = (*handle)->replica;
+	unsigned long lag;
+	char *end;
+
+	if (rlm_sql_select_query(handle, inst, inst->config->lag_query) != RLM_SQL_OK) return false;
+
+	/*
+	 *	A reconnect may have failed over to the primary.
+	 */
+	if ((*handle)->replica != replica) {
+		(inst->module->sql_finish_select_query)(*handle, inst->config);
+		return false;
+	}
+
+	if ((rlm_sql_fetch_row(handle, inst) == 0) && (*handle)->row && (*handle)->row[0]) {
+		lag = strtoul((*handle)->row[0], &end, 10);
+		if ((end != (*handle)->row[0]) && (lag <= inst->config->max_lag)) ok = true;
+
+		if (!ok) WARN("rlm_sql (%s): Replica %s is %s seconds behind, not using it",
+			      inst->config->xlat_name, replica->config->sql_server, (*handle)->row[0]);
+	} else {
+		WARN("rlm_sql (%s): Replica %s returned no result for lag_query, not using it",
+		     inst->config->xlat_name, replica->config->sql_server);
+	}
+
+	(inst->module->sql_finish_select_query)(*handle, inst->config);
+
+	return ok;
+}
+
+/*************************************************************************
+ *
+ *	Function: sql_get_read_socket
+ *
+ *	Purpose: Return a SQL handle for SELECTs, from a replica if
+ *		 there is one which can be used, else from the primary.
+ *
+ *************************************************************************/
+rlm_sql_handle_t *sql_get_read_socket(rlm_sql_t *inst)
+{
+	int tries;
+	bool check_lag;
+	time_t now;
+	sql_replica_t *replica;
+	rlm_sql_handle_t *handle;
+
+	for (tries = inst->num_replicas; tries > 0; tries--) {
+		now = time(NULL);
+
+		replica = sql_replica_pick(inst, now, &check_lag);
+		if (!replica) break;
+
+		handle = fr_connection_get(replica->pool);
+		if (!handle) {
+			sql_replica_skip(replica, now, inst->config->retry_delay);
+			continue;
+		}
+
+		if (check_lag && !sql_replica_lag_ok(inst, &handle)) {
+			if (handle) sql_release_socket(inst, handle);
+			sql_replica_skip(replica, now, inst->config->lag_check_interval);
+			continue;
+		}
+
+		return handle;
+	}
+
+	return fr_connection_get(inst->pool);
+}
+
 /*************************************************************************
  *
  *	Function: sql_release_socket
@@ -149,7 +395,7 @@ rlm_sql_handle_t * sql_get_socket(rlm_sql_t * inst)
  *************************************************************************/
 int sql_release_socket(rlm_sql_t * inst, rlm_sql_handle_t * handle)
 {
-	fr_connection_release(inst->pool, handle);
+	fr_connection_release(sql_handle_pool(inst, handle), handle);
 	return 0;
 }
 
@@ -164,6 +410,7 @@ int sql_release_socket(rlm_sql_t * inst, rlm_sql_handle_t * handle)
 int sql_userparse(TALLOC_CTX *ctx, VALUE_PAIR **head, rlm_sql_row_t row)
 {
 	VALUE_PAIR *vp;
+	DICT_ATTR const *da;
 	char const *ptr, *value;
 	char buf[MAX_STRING_LEN];
 	char do_xlat = 0;
@@ -238,9 +485,17 @@ int sql_userparse(TALLOC_CTX *ctx, VALUE_PAIR **head, rlm_sql_row_t row)
 	}
 
 	/*
-	 *	Create the pair
+	 *	Create the pair.  Almost all names are in the
+	 *	dictionary, so only unknown attributes and tags need
+	 *	pairmake() to pick the name apart.
 	 */
-	vp = pairmake(ctx, NULL, row[2], NULL, operator);
+	da = dict_attrbyname(row[2]);
+	if (da) {
+		vp = pairalloc(ctx, da);
+		if (vp) vp->op = operator;
+	} else {
+		vp = pairmake(ctx, NULL, row[2], NULL, operator);
+	}
 	if (!vp) {
 		ERROR("rlm_sql: Failed to create the pair: %s",
 		       fr_strerror());
@@ -377,9 +632,16 @@ sql_rcode_t rlm_sql_query(rlm_sql_handle_t **handle, rlm_sql_t *inst, char const
 
 	/* For sanity, for when no connections are viable, and we can't make a new one */
 	for (i = fr_connection_get_num(inst->pool); i >= 0; i--) {
+		struct timeval start;
+		bool timed = (inst->config->overflow_file && !(*handle)->replica);
+
 		DEBUG("rlm_sql (%s): Executing query: '%s'", inst->config->xlat_name, query);
 
+		if (timed) gettimeofday(&start, NULL);
+
 		ret = (inst->module->sql_query)(*handle, inst->config, query);
+		if (timed && (ret != RLM_SQL_RECONNECT)) sql_write_latency(inst, &start);
+
 		switch (ret) {
 		case RLM_SQL_OK:
 			break;
@@ -389,7 +651,7 @@ sql_rcode_t rlm_sql_query(rlm_sql_handle_t **handle, rlm_sql_t *inst, char const
 		 *	sockets in the pool and fail to establish a *new* connection.
 		 */
 		case RLM_SQL_RECONNECT:
-			*handle = fr_connection_reconnect(inst->pool, *handle);
+			*handle = sql_reconnect(inst, *handle);
 			/* Reconnection failed */
 			if (!*handle) return RLM_SQL_RECONNECT;
 			/* Reconnection succeeded, try again with the new handle */
@@ -436,11 +698,17 @@ sql_rcode_t rlm_sql_select_query(rlm_sql_handle_t **handle, rlm_sql_t *inst, cha
 
 	/* For sanity, for when no connections are viable, and we can't make a new one */
 	for (i = fr_connection_get_num(inst->pool); i >= 0; i--) {
+		struct timeval start;
+		sql_replica_t *replica = (*handle)->replica;
+
 		DEBUG("rlm_sql (%s): Executing query: '%s'", inst->config->xlat_name, query);
 
+		if (replica) gettimeofday(&start, NULL);
+
 		ret = (inst->module->sql_select_query)(*handle, inst->config, query);
 		switch (ret) {
 		case RLM_SQL_OK:
+			if (replica) sql_replica_latency(replica, &start);
 			break;
 
 		/*
@@ -448,7 +716,304 @@ sql_rcode_t rlm_sql_select_query(rlm_sql_handle_t **handle, rlm_sql_t *inst, cha
 		 *	sockets in the pool and fail to establish a *new* connection.
 		 */
 		case RLM_SQL_RECONNECT:
-			*handle = fr_connection_reconnect(inst->pool, *handle);
+			*handle = sql_reconnect(inst, *handle);
+			/* Reconnection failed */
+			if (!*handle) return RLM_SQL_RECONNECT;
+			/* Reconnection succeeded, try again with the new handle */
+			continue;
+
+		case RLM_SQL_QUERY_ERROR:
+		case RLM_SQL_ERROR:
+		default:
+			rlm_sql_query_error(*handle, inst);
+			break;
+		}
+
+		return ret;
+	}
+
+	ERROR("rlm_sql (%s): Hit reconnection limit", inst->config->xlat_name);
+
+	return RLM_SQL_ERROR;
+}
+
+/** Call the driver's sql_query method, inside of a transaction
+ *
+ * The query isn't retried if the connection was lost, as the transaction
+ * was lost with it.  Running the query on a new connection would commit
+ * it on its own, and the caller would then write it again when it retries
+ * the transaction.
+ *
+ * @param handle to query the database with.  If the connection was lost,
+ *	  it's replaced with a new handle, or NULL if there isn't one.
+ * @param inst rlm_sql instance data.
+ * @param query to execute.
+ * @return RLM_SQL_OK on success, RLM_SQL_RECONNECT if the connection (and
+ *	   the transaction) was lost, otherwise the error from the driver.
+ */
+sql_rcode_t rlm_sql_transaction_query(rlm_sql_handle_t **handle, rlm_sql_t *inst, char const *query)
+{
+	sql_rcode_t ret;
+
+	if (query[0] == '\0') return RLM_SQL_QUERY_ERROR;
+
+	DEBUG("rlm_sql (%s): Executing query: '%s'", inst->config->xlat_name, query);
+
+	ret = (inst->module->sql_query)(*handle, inst->config, query);
+	switch (ret) {
+	case RLM_SQL_OK:
+		break;
+
+	case RLM_SQL_RECONNECT:
+		*handle = sql_reconnect(inst, *handle);
+		break;
+
+	case RLM_SQL_DUPLICATE:
+		rlm_sql_query_debug(*handle, inst);
+		break;
+
+	default:
+		rlm_sql_query_error(*handle, inst);
+		break;
+	}
+
+	return ret;
+}
+
+/** Call the driver's sql_pipeline method
+ *
+ * As with rlm_sql_transaction_query(), the queries aren't retried if the
+ * connection was lost.
+ *
+ * @param handle to query the database with.  If the connection was lost,
+ *	  it's replaced with a new handle, or NULL if there isn't one.
+ * @param inst rlm_sql instance data.
+ * @param queries to send.
+ * @param num number of queries.
+ * @param affected where to write the number of rows affected by each query,
+ *	  or -1 if it failed.
+ * @return RLM_SQL_OK if all of the queries succeeded, otherwise the error from
+ *	   the first which failed.
+ */
+sql_rcode_t rlm_sql_pipeline(rlm_sql_handle_t **handle, rlm_sql_t *inst, char const * const *queries,
+			     int num, int *affected)
+{
+	int		i;
+	sql_rcode_t	ret;
+
+	for (i = 0; i < num; i++) {
+		DEBUG("rlm_sql (%s): Executing query: '%s'", inst->config->xlat_name, queries[i]);
+	}
+
+	ret = (inst->module->sql_pipeline)(*handle, inst->config, queries, num, affected);
+	switch (ret) {
+	case RLM_SQL_OK:
+		break;
+
+	case RLM_SQL_RECONNECT:
+		*handle = sql_reconnect(inst, *handle);
+		break;
+
+	case RLM_SQL_DUPLICATE:
+		rlm_sql_query_debug(*handle, inst);
+		break;
+
+	default:
+		rlm_sql_query_error(*handle, inst);
+		break;
+	}
+
+	return ret;
+}
+
+/*
+ *	Ids are allocated from a bitmap, and released when the statement
+ *	is freed with its instance, so they aren't used up by HUPs.
+ */
+static uint64_t prepared_ids;
+static uint64_t prepared_gen;
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t prepared_mutex = PTHREAD_MUTEX_INITIALIZER;
+#  define PREPARED_LOCK		pthread_mutex_lock(&prepared_mutex)
+#  define PREPARED_UNLOCK	pthread_mutex_unlock(&prepared_mutex)
+#else
+#  define PREPARED_LOCK
+#  define PREPARED_UNLOCK
+#endif
+
+static int _sql_prepared_free(sql_prepared_t *stmt)
+{
+	PREPARED_LOCK;
+	prepared_ids &= ~(((uint64_t) 1) << stmt->id);
+	PREPARED_UNLOCK;
+
+	return 0;
+}
+
+/*
+ *	Give the statement the lowest free id.
+ */
+static bool sql_prepared_id_alloc(sql_prepared_t *stmt)
+{
+	unsigned int id;
+
+	PREPARED_LOCK;
+	for (id = 0; id < SQL_PREPARED_MAX; id++) {
+		if (!(prepared_ids & (((uint64_t) 1) << id))) break;
+	}
+	if (id == SQL_PREPARED_MAX) {
+		PREPARED_UNLOCK;
+		return false;
+	}
+	prepared_ids |= ((uint64_t) 1) << id;
+	stmt->id = id;
+	stmt->gen = ++prepared_gen;
+	PREPARED_UNLOCK;
+
+	talloc_set_destructor(stmt, _sql_prepared_free);
+
+	return true;
+}
+
+/** Compile a SELECT query template into a statement which can be prepared
+ *
+ * Each single-quoted string in the template which contains an expansion
+ * becomes a parameter, and its contents are expanded separately for each
+ * request.  Templates with expansions anywhere else (e.g. table names, or
+ * numbers outside quotes) can't be prepared, and are run as text.
+ *
+ * @param ctx to allocate the statement in.
+ * @param fmt query template.
+ * @return the statement, or NULL if the template can't be prepared.
+ */
+sql_prepared_t *sql_prepared_compile(TALLOC_CTX *ctx, char const *fmt)
+{
+	char const	*p, *q;
+	char		*query, *param, *r, *w;
+	bool		xlat;
+	sql_prepared_t	*stmt;
+
+	stmt = talloc_zero(ctx, sql_prepared_t);
+	stmt->fmt = fmt;
+	query = talloc_strdup(stmt, "");
+
+	p = fmt;
+	while (*p) {
+		switch (*p) {
+		case '%':
+			goto not_prepared;
+
+		case '"':
+		case '`':
+			q = strchr(p + 1, *p);
+			if (!q) goto not_prepared;
+			if (memchr(p, '%', q - p)) goto not_prepared;
+
+			query = talloc_asprintf_append_buffer(query, "%.*s", (int) (q - p) + 1, p);
+			p = q + 1;
+			continue;
+
+		case '\'':
+			xlat = false;
+			for (q = p + 1; *q; q++) {
+				if (*q == '\\') goto not_prepared;
+				if (*q == '%') xlat = true;
+				if (*q != '\'') continue;
+				if (q[1] != '\'') break;
+				q++;
+			}
+			if (!*q) goto not_prepared;
+
+			if (!xlat) {
+				query = talloc_asprintf_append_buffer(query, "%.*s", (int) (q - p) + 1, p);
+				p = q + 1;
+				continue;
+			}
+
+			/*
+			 *	Strip the quotes, and un-double any quotes
+			 *	inside of the string.
+			 */
+			param = talloc_strndup(stmt, p + 1, q - (p + 1));
+			for (r = w = param; *r; r++, w++) {
+				*w = *r;
+				if ((r[0] == '\'') && (r[1] == '\'')) r++;
+			}
+			*w = '\0';
+
+			stmt->params = talloc_realloc(stmt, stmt->params, char const *, stmt->num_params + 1);
+			stmt->params[stmt->num_params++] = param;
+			query = talloc_asprintf_append_buffer(query, "$%i", stmt->num_params);
+			p = q + 1;
+			continue;
+
+		default:
+			q = p + strcspn(p, "%\"`'");
+			query = talloc_asprintf_append_buffer(query, "%.*s", (int) (q - p), p);
+			p = q;
+			continue;
+		}
+	}
+
+	stmt->query = query;
+	if (!sql_prepared_id_alloc(stmt)) goto not_prepared;
+
+	return stmt;
+
+not_prepared:
+	talloc_free(stmt);
+	return NULL;
+}
+
+/** Execute a prepared statement, preparing it on the connection if necessary.
+ *
+ * @param handle to query the database with. *handle should not be NULL, as this indicates
+ *	  previous reconnection attempt has failed.
+ * @param inst rlm_sql instance data.
+ * @param stmt to execute.
+ * @param values of the statement's parameters.
+ * @return as for rlm_sql_select_query.  If the statement couldn't be prepared, its
+ *	   gen will not be set in (*handle)->prepared.
+ */
+static sql_rcode_t rlm_sql_execute(rlm_sql_handle_t **handle, rlm_sql_t *inst, sql_prepared_t const *stmt,
+				   char const * const *values)
+{
+	int ret = RLM_SQL_ERROR;
+	int i;
+	struct timeval start;
+	sql_replica_t *replica;
+
+	/* There's no handle, we need a new one */
+	if (!*handle) return RLM_SQL_RECONNECT;
+
+	/* For sanity, for when no connections are viable, and we can't make a new one */
+	for (i = fr_connection_get_num(inst->pool); i >= 0; i--) {
+		if ((*handle)->prepared[stmt->id] != stmt->gen) {
+			DEBUG("rlm_sql (%s): Preparing query: '%s'", inst->config->xlat_name, stmt->query);
+
+			ret = (inst->module->sql_prepare)(*handle, inst->config, stmt);
+			if (ret == RLM_SQL_RECONNECT) goto reconnect;
+			if (ret != RLM_SQL_OK) {
+				rlm_sql_query_error(*handle, inst);
+				return ret;
+			}
+			(*handle)->prepared[stmt->id] = stmt->gen;
+		}
+
+		DEBUG("rlm_sql (%s): Executing prepared query: '%s'", inst->config->xlat_name, stmt->query);
+
+		replica = (*handle)->replica;
+		if (replica) gettimeofday(&start, NULL);
+
+		ret = (inst->module->sql_execute)(*handle, inst->config, stmt, values);
+		switch (ret) {
+		case RLM_SQL_OK:
+			if (replica) sql_replica_latency(replica, &start);
+			break;
+
+		case RLM_SQL_RECONNECT:
+		reconnect:
+			*handle = sql_reconnect(inst, *handle);
 			/* Reconnection failed */
 			if (!*handle) return RLM_SQL_RECONNECT;
 			/* Reconnection succeeded, try again with the new handle */
@@ -469,6 +1034,79 @@ sql_rcode_t rlm_sql_select_query(rlm_sql_handle_t **handle, rlm_sql_t *inst, cha
 	return RLM_SQL_ERROR;
 }
 
+/** Expand a SELECT query template, and run it
+ *
+ * If the template was compiled at instantiation, its parameters are expanded
+ * without escaping, and sent to the database separately from the query.
+ * Otherwise the template is expanded with escaping, and run as text.
+ *
+ * @param handle to query the database with.
+ * @param inst rlm_sql instance data.
+ * @param request the current request.
+ * @param fmt query template, as found in the instance configuration.
+ * @return as for rlm_sql_select_query.
+ */
+sql_rcode_t rlm_sql_select_xlat(rlm_sql_handle_t **handle, rlm_sql_t *inst, REQUEST *request, char const *fmt)
+{
+	int		i;
+	sql_rcode_t	ret;
+	char		*expanded = NULL;
+	char		**values;
+	sql_prepared_t	*stmt = NULL;
+
+	/*
+	 *	Don't bother the database if no one is waiting for
+	 *	the answer.
+	 */
+	if (request_expired(request)) {
+		REDEBUG("Request has passed its deadline, not running query");
+		return RLM_SQL_QUERY_ERROR;
+	}
+
+	for (i = 0; i < inst->num_prepared; i++) {
+		if (inst->prepared[i]->fmt == fmt) {
+			stmt = inst->prepared[i];
+			break;
+		}
+	}
+
+	if (!stmt || stmt->disabled) goto text;
+
+	values = talloc_zero_array(request, char *, stmt->num_params + 1);
+	for (i = 0; i < stmt->num_params; i++) {
+		if (radius_axlat(&values[i], request, stmt->params[i], NULL, NULL) < 0) {
+			REDEBUG("Error generating query");
+			talloc_free(values);
+			return RLM_SQL_QUERY_ERROR;
+		}
+	}
+
+	ret = rlm_sql_execute(handle, inst, stmt, (char const * const *) values);
+	talloc_free(values);
+
+	/*
+	 *	The database won't prepare the statement, so don't
+	 *	try again.
+	 */
+	if ((ret != RLM_SQL_OK) && *handle && ((*handle)->prepared[stmt->id] != stmt->gen)) {
+		WARN("rlm_sql (%s): Failed preparing query, it will be run as text", inst->config->xlat_name);
+		stmt->disabled = true;
+		goto text;
+	}
+
+	return ret;
+
+text:
+	if (radius_axlat(&expanded, request, fmt, inst->sql_escape_func, inst) < 0) {
+		REDEBUG("Error generating query");
+		return RLM_SQL_QUERY_ERROR;
+	}
+
+	ret = rlm_sql_select_query(handle, inst, expanded);
+	talloc_free(expanded);
+
+	return ret;
+}
 
 /*************************************************************************
  *
@@ -477,13 +1115,13 @@ sql_rcode_t rlm_sql_select_query(rlm_sql_handle_t **handle, rlm_sql_t *inst, cha
  *	Purpose: Get any group check or reply pairs
  *
  *************************************************************************/
-int sql_getvpdata(TALLOC_CTX *ctx, rlm_sql_t *inst, rlm_sql_handle_t **handle,
-		  VALUE_PAIR **pair, char const *query)
+int sql_getvpdata(TALLOC_CTX *ctx, rlm_sql_t *inst, REQUEST *request, rlm_sql_handle_t **handle,
+		  VALUE_PAIR **pair, char const *fmt)
 {
 	rlm_sql_row_t row;
 	int     rows = 0;
 
-	if (rlm_sql_select_query(handle, inst, query)) {
+	if (rlm_sql_select_xlat(handle, inst, request, fmt)) {
 		return -1;
 	}
 
@@ -26,6 +26,7 @@ RCSID("$Id$")
 #include <freeradius-devel/radiusd.h>
 #include <freeradius-devel/modules.h>
 #include <freeradius-devel/rad_assert.h>
+#include <freeradius-devel/heap.h>
 
 #include <ctype.h>
 
@@ -72,8 +73,51 @@ typedef struct rlm_sqlcounter_t {
 	DICT_ATTR const	*key_attr;	//!< Attribute number for key field.
 	DICT_ATTR const	*dict_attr;	//!< Attribute number for the counter.
 	DICT_ATTR const	*reply_attr;	//!< Attribute number for the reply.
+
+	uint32_t	cache_ttl;	//!< How long a cached counter is used for,
+					//!< before the query is run again.
+	char const	*cache_name;	//!< Accounting attribute the counter sums,
+					//!< usually Acct-Session-Time.
+	uint32_t	cache_max_entries;
+	DICT_ATTR const	*cache_attr;
+	rbtree_t	*cache;
+	fr_heap_t	*heap;		//!< Cached counters, by expiry time.
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t	cache_mutex;
+#endif
 } rlm_sqlcounter_t;
 
+/*
+ *	The result of the query for one key, plus what accounting
+ *	packets have added to it since.
+ */
+typedef struct sqlcounter_entry_t {
+	char const	*key;
+	int		offset;		//!< For the heap.
+	uint64_t	counter;
+	time_t		period;		//!< last_reset when the query was run.
+	time_t		expires;
+	struct sqlcounter_session_t *sessions;
+} sqlcounter_entry_t;
+
+/*
+ *	The last value seen for each session, so that interim updates
+ *	(which carry totals for the session) only add the difference.
+ */
+typedef struct sqlcounter_session_t {
+	struct sqlcounter_session_t *next;
+	char const	*id;
+	uint64_t	value;
+} sqlcounter_session_t;
+
+#ifdef HAVE_PTHREAD_H
+#define PTHREAD_MUTEX_LOCK pthread_mutex_lock
+#define PTHREAD_MUTEX_UNLOCK pthread_mutex_unlock
+#else
+#define PTHREAD_MUTEX_LOCK(_x)
+#define PTHREAD_MUTEX_UNLOCK(_x)
+#endif
+
 /*
  *	A mapping of configuration file names to internal variables.
  *
@@ -100,6 +144,10 @@ static const CONF_PARSER module_config[] = {
 	{ "reply-name", FR_CONF_OFFSET(PW_TYPE_STRING | PW_TYPE_DEPRECATED, rlm_sqlcounter_t, reply_name), NULL },
 	{ "reply_name", FR_CONF_OFFSET(PW_TYPE_STRING | PW_TYPE_ATTRIBUTE, rlm_sqlcounter_t, reply_name), "Session-Timeout" },
 
+	{ "cache_ttl", FR_CONF_OFFSET(PW_TYPE_INTEGER, rlm_sqlcounter_t, cache_ttl), "0" },
+	{ "cache_attribute", FR_CONF_OFFSET(PW_TYPE_STRING, rlm_sqlcounter_t, cache_name), "Acct-Session-Time" },
+	{ "cache_max_entries", FR_CONF_OFFSET(PW_TYPE_INTEGER, rlm_sqlcounter_t, cache_max_entries), "16384" },
+
 	{ NULL, -1, 0, NULL, NULL }
 };
 
@@ -298,44 +346,198 @@ static size_t sqlcounter_expand(char *out, int outlen, char const *fmt, rlm_sqlc
 }
 
 
+static int sqlcounter_entry_cmp(void const *one, void const *two)
+{
+	sqlcounter_entry_t const *a = one;
+	sqlcounter_entry_t const *b = two;
+
+	return strcmp(a->key, b->key);
+}
+
+static void sqlcounter_entry_free(void *data)
+{
+	talloc_free(data);
+}
+
+static int sqlcounter_heap_cmp(void const *one, void const *two)
+{
+	sqlcounter_entry_t const *a = one;
+	sqlcounter_entry_t const *b = two;
+
+	if (a->expires < b->expires) return -1;
+	if (a->expires > b->expires) return +1;
+
+	return 0;
+}
+
 /*
- *	See if the counter matches.
+ *	Find the cached counter for a key.  Must be called with the
+ *	cache mutex held.
  */
-static int sqlcounter_cmp(void *instance, REQUEST *request, UNUSED VALUE_PAIR *req , VALUE_PAIR *check,
-			  UNUSED VALUE_PAIR *check_pairs, UNUSED VALUE_PAIR **reply_pairs)
+static sqlcounter_entry_t *cache_find(rlm_sqlcounter_t *inst, REQUEST *request, char const *key)
+{
+	sqlcounter_entry_t *c, my_c;
+
+	/*
+	 *	Expire old entries, so that the counters are checked
+	 *	against the database every cache_ttl seconds, and a
+	 *	full cache doesn't refuse new entries.
+	 */
+	while ((c = fr_heap_peek(inst->heap)) && (c->expires <= request->timestamp)) {
+		fr_heap_extract(inst->heap, c);
+		rbtree_deletebydata(inst->cache, c);
+	}
+
+	my_c.key = key;
+	c = rbtree_finddata(inst->cache, &my_c);
+	if (!c) return NULL;
+
+	/*
+	 *	The counters were reset after the query was run.
+	 */
+	if (c->period != inst->last_reset) {
+		fr_heap_extract(inst->heap, c);
+		rbtree_deletebydata(inst->cache, c);
+		return NULL;
+	}
+
+	return c;
+}
+
+/*
+ *	Cache the result of the query.  Must be called with the cache
+ *	mutex held.
+ */
+static void cache_add(rlm_sqlcounter_t *inst, REQUEST *request, char const *key, uint64_t counter)
+{
+	sqlcounter_entry_t *c;
+
+	/*
+	 *	Another request ran the query at the same time.
+	 */
+	c = cache_find(inst, request, key);
+	if (c) {
+		c->counter = counter;
+		return;
+	}
+
+	if (rbtree_num_elements(inst->cache) >= inst->cache_max_entries) {
+		RDEBUG("Counter cache is full: %u entries", inst->cache_max_entries);
+		return;
+	}
+
+	c = talloc_zero(NULL, sqlcounter_entry_t);
+	if (!c) return;
+
+	c->key = talloc_typed_strdup(c, key);
+	c->counter = counter;
+	c->period = inst->last_reset;
+	c->expires = request->timestamp + inst->cache_ttl;
+
+	if (!rbtree_insert(inst->cache, c)) {
+		talloc_free(c);
+		return;
+	}
+
+	if (!fr_heap_insert(inst->heap, c)) {
+		rbtree_deletebydata(inst->cache, c);
+		return;
+	}
+}
+
+/*
+ *      Look for the key.  User-Name is special.  It means
+ *      The REAL username, after stripping.
+ */
+static VALUE_PAIR *sqlcounter_key(rlm_sqlcounter_t *inst, REQUEST *request)
+{
+	if ((inst->key_attr->vendor == 0) && (inst->key_attr->attr == PW_USER_NAME)) {
+		return request->username;
+	}
+
+	return pairfind(request->packet->vps, inst->key_attr->attr, inst->key_attr->vendor, TAG_ANY);
+}
+
+/*
+ *	Get the current value of the counter, from the cache if
+ *	there's an entry for the key, otherwise by running the query.
+ */
+static int sqlcounter_value(rlm_sqlcounter_t *inst, REQUEST *request, VALUE_PAIR *key_vp, uint64_t *out)
 {
-	rlm_sqlcounter_t *inst = instance;
 	uint64_t counter;
 
 	char query[MAX_QUERY_LEN], subst[MAX_QUERY_LEN];
+	char key[MAX_STRING_LEN];
 	char *expanded = NULL;
 	size_t len;
 
+	if (inst->cache && key_vp) {
+		sqlcounter_entry_t *c;
+
+		vp_prints_value(key, sizeof(key), key_vp, '\0');
+
+		PTHREAD_MUTEX_LOCK(&inst->cache_mutex);
+		c = cache_find(inst, request, key);
+		if (c) {
+			*out = c->counter;
+			PTHREAD_MUTEX_UNLOCK(&inst->cache_mutex);
+
+			RDEBUG2("Using cached counter value (%" PRIu64 ")", *out);
+			return 0;
+		}
+		PTHREAD_MUTEX_UNLOCK(&inst->cache_mutex);
+	}
+
 	/* First, expand %k, %b and %e in query */
 	if (sqlcounter_expand(subst, sizeof(subst), inst->query, inst) <= 0) {
 		REDEBUG("Insufficient query buffer space");
 
-		return RLM_MODULE_FAIL;
+		return -1;
 	}
 
 	/* Then combine that with the name of the module were using to do the query */
 	len = snprintf(query, sizeof(query), "%%{%s:%s}", inst->sqlmod_inst, subst);
-	if (len >= sizeof(query) - 1) {
+	if (len >= (sizeof(query) - 1)) {
 		REDEBUG("Insufficient query buffer space");
 
-		return RLM_MODULE_FAIL;
+		return -1;
 	}
 
 	/* Finally, xlat resulting SQL query */
 	if (radius_axlat(&expanded, request, query, NULL, NULL) < 0) {
-		return RLM_MODULE_FAIL;
+		return -1;
 	}
 
 	if (sscanf(expanded, "%" PRIu64, &counter) != 1) {
-		RDEBUG2("No integer found in string \"%s\"", expanded);
+		RDEBUG2("No integer found in result string \"%s\".  May be first session, setting counter to 0",
+			expanded);
+		counter = 0;
 	}
 	talloc_free(expanded);
 
+	if (inst->cache && key_vp) {
+		PTHREAD_MUTEX_LOCK(&inst->cache_mutex);
+		cache_add(inst, request, key, counter);
+		PTHREAD_MUTEX_UNLOCK(&inst->cache_mutex);
+	}
+
+	*out = counter;
+	return 0;
+}
+
+/*
+ *	See if the counter matches.
+ */
+static int sqlcounter_cmp(void *instance, REQUEST *request, UNUSED VALUE_PAIR *req , VALUE_PAIR *check,
+			  UNUSED VALUE_PAIR *check_pairs, UNUSED VALUE_PAIR **reply_pairs)
+{
+	rlm_sqlcounter_t *inst = instance;
+	uint64_t counter;
+
+	if (sqlcounter_value(inst, request, sqlcounter_key(inst, request), &counter) < 0) {
+		return RLM_MODULE_FAIL;
+	}
+
 	if (counter < check->vp_integer64) {
 		return -1;
 	}
@@ -379,6 +581,37 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 	}
 	inst->reply_attr = da;
 
+	if (inst->cache_ttl) {
+		da = dict_attrbyname(inst->cache_name);
+		if (!da || ((da->type != PW_TYPE_INTEGER) && (da->type != PW_TYPE_INTEGER64))) {
+			cf_log_err_cs(conf, "Invalid cache_attribute '%s', it must be an integer attribute",
+				      inst->cache_name);
+			return -1;
+		}
+		inst->cache_attr = da;
+
+		FR_INTEGER_BOUND_CHECK("cache_max_entries", inst->cache_max_entries, >=, 1);
+
+#ifdef HAVE_PTHREAD_H
+		if (pthread_mutex_init(&inst->cache_mutex, NULL) < 0) {
+			ERROR("Failed initializing mutex: %s", fr_syserror(errno));
+			return -1;
+		}
+#endif
+
+		inst->cache = rbtree_create(NULL, sqlcounter_entry_cmp, sqlcounter_entry_free, 0);
+		if (!inst->cache) {
+			ERROR("Failed to create counter cache");
+			return -1;
+		}
+
+		inst->heap = fr_heap_create(sqlcounter_heap_cmp, offsetof(sqlcounter_entry_t, offset));
+		if (!inst->heap) {
+			ERROR("Failed to create heap for the counter cache");
+			return -1;
+		}
+	}
+
 	/*
 	 *  Create a new attribute for the counter.
 	 */
@@ -445,11 +678,6 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authorize(void *instance, REQUEST *reque
 	VALUE_PAIR *reply_item;
 	char msg[128];
 
-	char query[MAX_QUERY_LEN], subst[MAX_QUERY_LEN];
-	char *expanded = NULL;
-
-	size_t len;
-
 	/*
 	 *	Before doing anything else, see if we have to reset
 	 *	the counters.
@@ -462,15 +690,7 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authorize(void *instance, REQUEST *reque
 		find_next_reset(inst,request->timestamp);
 	}
 
-	/*
-	 *      Look for the key.  User-Name is special.  It means
-	 *      The REAL username, after stripping.
-	 */
-	if ((inst->key_attr->vendor == 0) && (inst->key_attr->attr == PW_USER_NAME)) {
-		key_vp = request->username;
-	} else {
-		key_vp = pairfind(request->packet->vps, inst->key_attr->attr, inst->key_attr->vendor, TAG_ANY);
-	}
+	key_vp = sqlcounter_key(inst, request);
 	if (!key_vp) {
 		RWDEBUG2("Couldn't find key attribute, request:%s, doing nothing...", inst->key_attr->name);
 		return rcode;
@@ -490,33 +710,10 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authorize(void *instance, REQUEST *reque
 		return rcode;
 	}
 
-	/* First, expand %k, %b and %e in query */
-	if (sqlcounter_expand(subst, sizeof(subst), inst->query, inst) <= 0) {
-		REDEBUG("Insufficient query buffer space");
-
+	if (sqlcounter_value(inst, request, key_vp, &counter) < 0) {
 		return RLM_MODULE_FAIL;
 	}
 
-	/* Then combine that with the name of the module were using to do the query */
-	len = snprintf(query, sizeof(query), "%%{%s:%s}", inst->sqlmod_inst, subst);
-	if (len >= (sizeof(query) - 1)) {
-		REDEBUG("Insufficient query buffer space");
-
-		return RLM_MODULE_FAIL;
-	}
-
-	/* Finally, xlat resulting SQL query */
-	if (radius_axlat(&expanded, request, query, NULL, NULL) < 0) {
-		return RLM_MODULE_FAIL;
-	}
-	talloc_free(expanded);
-
-	if (sscanf(expanded, "%" PRIu64, &counter) != 1) {
-		RDEBUG2("No integer found in result string \"%s\".  May be first session, setting counter to 0",
-			expanded);
-		counter = 0;
-	}
-
 	/*
 	 *	Check if check item > counter
 	 */
@@ -575,6 +772,111 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authorize(void *instance, REQUEST *reque
 	return RLM_MODULE_OK;
 }
 
+/*
+ *	Add the usage in accounting packets to the cached counters, so
+ *	that authorize doesn't have to run the query again until the
+ *	entry expires.
+ */
+static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, REQUEST *request)
+{
+	rlm_sqlcounter_t *inst = instance;
+	sqlcounter_entry_t *c;
+	sqlcounter_session_t *session, **last;
+	VALUE_PAIR *vp, *key_vp;
+	char const *id;
+	uint64_t value = 0;
+	uint32_t status;
+	char key[MAX_STRING_LEN];
+
+	if (!inst->cache) return RLM_MODULE_NOOP;
+
+	vp = pairfind(request->packet->vps, PW_ACCT_STATUS_TYPE, 0, TAG_ANY);
+	if (!vp) return RLM_MODULE_NOOP;
+
+	status = vp->vp_integer;
+	if ((status != PW_STATUS_START) && (status != PW_STATUS_ALIVE) && (status != PW_STATUS_STOP)) {
+		return RLM_MODULE_NOOP;
+	}
+
+	key_vp = sqlcounter_key(inst, request);
+	if (!key_vp) return RLM_MODULE_NOOP;
+
+	vp = pairfind(request->packet->vps, PW_ACCT_UNIQUE_SESSION_ID, 0, TAG_ANY);
+	if (!vp) vp = pairfind(request->packet->vps, PW_ACCT_SESSION_ID, 0, TAG_ANY);
+	if (!vp) return RLM_MODULE_NOOP;
+	id = vp->vp_strvalue;
+
+	vp = pairfind(request->packet->vps, inst->cache_attr->attr, inst->cache_attr->vendor, TAG_ANY);
+	if (vp) value = (vp->da->type == PW_TYPE_INTEGER64) ? vp->vp_integer64 : vp->vp_integer;
+
+	vp_prints_value(key, sizeof(key), key_vp, '\0');
+
+	PTHREAD_MUTEX_LOCK(&inst->cache_mutex);
+	c = cache_find(inst, request, key);
+	if (!c) {
+		PTHREAD_MUTEX_UNLOCK(&inst->cache_mutex);
+		return RLM_MODULE_NOOP;
+	}
+
+	for (last = &c->sessions; (session = *last) != NULL; last = &session->next) {
+		if (strcmp(session->id, id) == 0) break;
+	}
+
+	if (!session) {
+		/*
+		 *	A session which started before the query was run
+		 *	has already been counted, up to the last update
+		 *	the database saw.  So we only add what comes after
+		 *	this packet.
+		 */
+		if (status == PW_STATUS_STOP) {
+			PTHREAD_MUTEX_UNLOCK(&inst->cache_mutex);
+			return RLM_MODULE_NOOP;
+		}
+
+		session = talloc_zero(c, sqlcounter_session_t);
+		if (!session) {
+			PTHREAD_MUTEX_UNLOCK(&inst->cache_mutex);
+			return RLM_MODULE_FAIL;
+		}
+		session->id = talloc_typed_strdup(session, id);
+		session->value = (status == PW_STATUS_START) ? 0 : value;
+		session->next = c->sessions;
+		c->sessions = session;
+		last = &c->sessions;
+	}
+
+	if (value > session->value) {
+		c->counter += value - session->value;
+		session->value = value;
+	}
+
+	if (status == PW_STATUS_STOP) {
+		*last = session->next;
+		talloc_free(session);
+	}
+
+	RDEBUG2("Cached counter for \"%s\" is now %" PRIu64, key, c->counter);
+	PTHREAD_MUTEX_UNLOCK(&inst->cache_mutex);
+
+	return RLM_MODULE_OK;
+}
+
+static int mod_detach(void *instance)
+{
+	rlm_sqlcounter_t *inst = instance;
+
+	if (!inst->cache) return 0;
+
+	fr_heap_delete(inst->heap);
+	rbtree_free(inst->cache);
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_destroy(&inst->cache_mutex);
+#endif
+	return 0;
+}
+
 /*
  *	The module name should be the only globally exported symbol.
  *	That is, everything else should be 'static'.
@@ -591,16 +893,20 @@ module_t rlm_sqlcounter = {
 	sizeof(rlm_sqlcounter_t),
 	module_config,
 	mod_instantiate,		/* instantiation */
-	NULL,				/* detach */
+	mod_detach,			/* detach */
 	{
 		NULL,			/* authentication */
 		mod_authorize,		/* authorization */
 		NULL,			/* preaccounting */
-		NULL,			/* accounting */
+		mod_accounting,		/* accounting */
 		NULL,			/* checksimul */
 		NULL,			/* pre-proxy */
 		NULL,			/* post-proxy */
 		NULL			/* post-auth */
 	},
+	0,				/* thread_inst_size */
+	NULL,				/* thread_instantiate */
+	NULL,				/* thread_detach */
+	NULL				/* cache_flush */
 };
 
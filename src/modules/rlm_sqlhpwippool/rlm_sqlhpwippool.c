@@ -782,4 +782,8 @@ module_t rlm_sqlhpwippool = {
 		NULL,			/* post-proxy */
 		mod_post_auth	/* post-auth */
 	},
+	0,				/* thread_inst_size */
+	NULL,				/* thread_instantiate */
+	NULL,				/* thread_detach */
+	NULL				/* cache_flush */
 };
@@ -33,6 +33,45 @@ RCSID("$Id$")
 
 #define MAX_QUERY_LEN 4096
 
+#ifdef HAVE_PTHREAD_H
+/*
+ *	Addresses reserved in the database for this server, which
+ *	haven't been handed out yet.
+ */
+typedef struct sqlippool_reserved_t {
+	char const	*pool_name;	//!< Pool-Name the addresses are from.
+	pthread_mutex_t	mutex;		//!< Protects the rest of the entry.
+	char		**addrs;	//!< Reserved addresses.
+	uint32_t	num;		//!< Number of addresses in 'addrs'.
+	time_t		expires;	//!< When the addresses shouldn't be handed out anymore.
+	time_t		reserved_until;	//!< When the reservation in the database runs out.
+} sqlippool_reserved_t;
+
+/*
+ *	A query waiting to be written by the writer thread.
+ */
+typedef struct sqlippool_write_t sqlippool_write_t;
+struct sqlippool_write_t {
+	sqlippool_write_t	*next;
+	char			*query;
+	char			*addr;		//!< The address which was allocated.
+	time_t			expires;	//!< When the reservation runs out.  The write
+						//!< is retried until then.
+};
+
+/*
+ *	Reserved addresses are only handed out for this long (or a
+ *	quarter of lease_duration, if that's shorter), so that a failed
+ *	allocation write has most of the reservation to be retried in.
+ */
+#define SQLIPPOOL_RESERVE_HANDOUT	(60)
+
+/*
+ *	How long the writer waits before retrying failed writes.
+ */
+#define SQLIPPOOL_WRITE_RETRY		(1)
+#endif
+
 /*
  *	Define a structure for our module configuration.
  */
@@ -91,6 +130,24 @@ typedef struct rlm_sqlippool_t {
 					//!< Reserved to handle 255.255.255.254 Requests.
 	char const *defaultpool;	//!< Default Pool-Name if there is none in the check items.
 
+					//!< Reserve sequence.
+	uint32_t reserve_size;		//!< Number of addresses to reserve at a time.
+	char const *reserve_find;	//!< SQL query to find free addresses.
+	char const *reserve_update;	//!< SQL query to reserve an address.
+	char const *reserve_allocate;	//!< SQL query to record an allocation.
+
+#ifdef HAVE_PTHREAD_H
+	rbtree_t	*reserved;	//!< Reserved addresses, by Pool-Name.
+	pthread_mutex_t	reserved_mutex;	//!< Protects the tree.
+
+	sqlippool_write_t	*write_head;	//!< Allocations waiting to be written.
+	sqlippool_write_t	**write_tail;
+	pthread_mutex_t	write_mutex;
+	pthread_cond_t	write_cond;	//!< Wakes the writer.
+	pthread_t	writer;
+	bool		writer_running;
+	bool		writer_exiting;
+#endif
 } rlm_sqlippool_t;
 
 static CONF_PARSER message_config[] = {
@@ -197,6 +254,11 @@ static CONF_PARSER module_config[] = {
 	{ "off-commit", FR_CONF_OFFSET(PW_TYPE_STRING | PW_TYPE_DEPRECATED, rlm_sqlippool_t, off_commit), NULL },
 	{ "off_commit", FR_CONF_OFFSET(PW_TYPE_STRING, rlm_sqlippool_t, off_commit), "COMMIT" },
 
+	{ "reserve_size", FR_CONF_OFFSET(PW_TYPE_INTEGER, rlm_sqlippool_t, reserve_size), "0" },
+	{ "reserve_find", FR_CONF_OFFSET(PW_TYPE_STRING, rlm_sqlippool_t, reserve_find), ""  },
+	{ "reserve_update", FR_CONF_OFFSET(PW_TYPE_STRING, rlm_sqlippool_t, reserve_update), ""  },
+	{ "reserve_allocate", FR_CONF_OFFSET(PW_TYPE_STRING, rlm_sqlippool_t, reserve_allocate), ""  },
+
 	{ "messages", FR_CONF_POINTER(PW_TYPE_SUBSECTION, NULL), (void const *) message_config },
 
 	{ NULL, -1, 0, NULL, NULL }
@@ -208,6 +270,7 @@ static CONF_PARSER module_config[] = {
  *	%P	pool_name
  *	%I	param
  *	%J	lease_duration
+ *	%R	reserve_size
  *
  */
 static int sqlippool_expand(char * out, int outlen, char const * fmt,
@@ -260,6 +323,11 @@ static int sqlippool_expand(char * out, int outlen, char const * fmt,
 				strlcpy(q, tmp, freespace);
 				q += strlen(q);
 				break;
+			case 'R': /* reserve size */
+				sprintf(tmp, "%u", data->reserve_size);
+				strlcpy(q, tmp, freespace);
+				q += strlen(q);
+				break;
 
 			default:
 				*q++ = '%';
@@ -288,7 +356,7 @@ static int sqlippool_expand(char * out, int outlen, char const * fmt,
  * @param request Current request.
  * @param param ip address string.
  * @param param_len ip address string len.
- * @return 0 on success or < 0 on error.
+ * @return the number of rows affected, or < 0 on error.
  */
 static int sqlippool_command(char const * fmt, rlm_sql_handle_t * handle, rlm_sqlippool_t *data, REQUEST *request,
 			     char *param, int param_len)
@@ -319,8 +387,9 @@ static int sqlippool_command(char const * fmt, rlm_sql_handle_t * handle, rlm_sq
 	}
 	talloc_free(expanded);
 
+	ret = (data->sql_inst->module->sql_affected_rows)(handle, data->sql_inst->config);
 	(data->sql_inst->module->sql_finish_query)(handle, data->sql_inst->config);
-	return 0;
+	return ret;
 }
 
 /*
@@ -391,6 +460,319 @@ finish:
 	return retval;
 }
 
+#ifdef HAVE_PTHREAD_H
+static int reserved_cmp(void const *one, void const *two)
+{
+	sqlippool_reserved_t const *a = one;
+	sqlippool_reserved_t const *b = two;
+
+	return strcmp(a->pool_name, b->pool_name);
+}
+
+static int _reserved_free(sqlippool_reserved_t *entry)
+{
+	pthread_mutex_destroy(&entry->mutex);
+
+	return 0;
+}
+
+/*
+ *	Find the reserved addresses for a pool, adding an empty entry
+ *	if we haven't seen the pool before.
+ */
+static sqlippool_reserved_t *reserved_find(rlm_sqlippool_t *inst, char const *pool_name)
+{
+	sqlippool_reserved_t *entry, my_entry;
+
+	my_entry.pool_name = pool_name;
+
+	pthread_mutex_lock(&inst->reserved_mutex);
+	entry = rbtree_finddata(inst->reserved, &my_entry);
+	if (!entry) {
+		entry = talloc_zero(inst, sqlippool_reserved_t);
+		if (entry) {
+			entry->pool_name = talloc_typed_strdup(entry, pool_name);
+			pthread_mutex_init(&entry->mutex, NULL);
+			talloc_set_destructor(entry, _reserved_free);
+
+			if (!rbtree_insert(inst->reserved, entry)) {
+				talloc_free(entry);
+				entry = NULL;
+			}
+		}
+	}
+	pthread_mutex_unlock(&inst->reserved_mutex);
+
+	return entry;
+}
+
+/*
+ *	Reserve up to "reserve_size" free addresses for this server,
+ *	in one transaction.  The reservation lasts for lease_duration,
+ *	and we stop handing the addresses out after
+ *	SQLIPPOOL_RESERVE_HANDOUT seconds, so that an allocation whose
+ *	write fails has the rest of the reservation to be retried in.
+ *
+ *	Must be called with the entry's mutex held.
+ *
+ *	Returns the number of addresses reserved, or -1 on error.
+ */
+static int reserved_fill(rlm_sqlippool_t *inst, REQUEST *request, rlm_sql_handle_t *handle,
+			 sqlippool_reserved_t *entry)
+{
+	char query[MAX_QUERY_LEN];
+	char *expanded = NULL;
+	char **found;
+	uint32_t i, num_found = 0;
+	time_t now;
+	int ret;
+
+	now = request->timestamp;
+	if (inst->last_clear < now) {
+		inst->last_clear = now;
+
+		DO(allocate_begin);
+		DO(allocate_clear);
+		DO(allocate_commit);
+	}
+
+	DO(allocate_begin);
+
+	sqlippool_expand(query, sizeof(query), inst->reserve_find, inst, NULL, 0);
+	if (radius_axlat(&expanded, request, query, inst->sql_inst->sql_escape_func, inst->sql_inst) < 0) {
+		DO(allocate_commit);
+		return -1;
+	}
+
+	ret = inst->sql_inst->sql_select_query(&handle, inst->sql_inst, expanded);
+	talloc_free(expanded);
+	if (ret != 0) {
+		REDEBUG("database query error on '%s'", query);
+		DO(allocate_commit);
+		return -1;
+	}
+
+	found = talloc_array(request, char *, inst->reserve_size);
+	while ((num_found < inst->reserve_size) &&
+	       (inst->sql_inst->sql_fetch_row(&handle, inst->sql_inst) == 0) && handle->row) {
+		if (!handle->row[0]) continue;
+
+		found[num_found++] = talloc_typed_strdup(found, handle->row[0]);
+	}
+	(inst->sql_inst->module->sql_finish_select_query)(handle, inst->sql_inst->config);
+
+	/*
+	 *	Another server may have taken some of the addresses
+	 *	since we found them, so only keep the ones we could
+	 *	update.
+	 */
+	talloc_free(entry->addrs);
+	entry->addrs = talloc_array(entry, char *, num_found);
+	entry->num = 0;
+
+	for (i = num_found; i > 0; i--) {
+		if (sqlippool_command(inst->reserve_update, handle, inst, request,
+				      found[i - 1], strlen(found[i - 1])) <= 0) continue;
+
+		entry->addrs[entry->num++] = talloc_steal(entry->addrs, found[i - 1]);
+	}
+
+	DO(allocate_commit);
+	talloc_free(found);
+
+	entry->expires = now + ((inst->lease_duration / 4) < SQLIPPOOL_RESERVE_HANDOUT ?
+				(inst->lease_duration / 4) : SQLIPPOOL_RESERVE_HANDOUT);
+	entry->reserved_until = now + inst->lease_duration;
+
+	return entry->num;
+}
+
+/*
+ *	Run one of the writer's queries.
+ */
+static bool reserved_write_query(rlm_sqlippool_t *inst, rlm_sql_handle_t **handle, char const *query)
+{
+	if (!*handle) return false;
+
+	if (inst->sql_inst->sql_query(handle, inst->sql_inst, query) != RLM_SQL_OK) return false;
+	(inst->sql_inst->module->sql_finish_query)(*handle, inst->sql_inst->config);
+
+	return true;
+}
+
+/*
+ *	Write queued allocations, in one transaction.  If anything in
+ *	the transaction fails, they're written one at a time, so that
+ *	one bad write can't hold up the others.
+ *
+ *	reserve_allocate only updates the address it was given, so
+ *	writing an allocation twice is harmless.
+ *
+ *	Returns the allocations which couldn't be written.
+ */
+static sqlippool_write_t *reserved_write(rlm_sqlippool_t *inst, sqlippool_write_t *head)
+{
+	rlm_sql_handle_t *handle;
+	sqlippool_write_t *this, *next, *failed = NULL, **failed_tail = &failed;
+	uint32_t written = 0, num_failed = 0;
+	bool ok = true;
+
+	handle = inst->sql_inst->sql_get_socket(inst->sql_inst);
+
+	if (*inst->allocate_begin) ok = reserved_write_query(inst, &handle, inst->allocate_begin);
+	for (this = head; ok && (this != NULL); this = this->next) {
+		ok = reserved_write_query(inst, &handle, this->query);
+	}
+	if (*inst->allocate_commit) {
+		if (!reserved_write_query(inst, &handle, inst->allocate_commit)) ok = false;
+	}
+
+	for (this = head; this != NULL; this = next) {
+		next = this->next;
+		this->next = NULL;
+
+		if (ok || reserved_write_query(inst, &handle, this->query)) {
+			written++;
+			talloc_free(this);
+			continue;
+		}
+
+		num_failed++;
+		*failed_tail = this;
+		failed_tail = &this->next;
+	}
+
+	if (handle) inst->sql_inst->sql_release_socket(inst->sql_inst, handle);
+
+	DEBUG("rlm_sqlippool (%s): Wrote %u allocations", inst->pool_name, written);
+	if (num_failed) ERROR("rlm_sqlippool (%s): Failed writing %u allocations, will retry",
+			      inst->pool_name, num_failed);
+
+	return failed;
+}
+
+/*
+ *	Write allocations as they are queued.  Allocations queued while
+ *	we're writing are written together, in the next transaction.
+ *
+ *	Allocations which couldn't be written are put back at the head
+ *	of the queue, and retried every SQLIPPOOL_WRITE_RETRY seconds,
+ *	until their reservation runs out.  After that, the address may
+ *	be given to someone else, so we complain loudly.
+ */
+static void *reserved_writer(void *arg)
+{
+	rlm_sqlippool_t		*inst = arg;
+	sqlippool_write_t	*head, *failed, *this, **last;
+	bool			exiting;
+	struct timespec		when;
+	struct timeval		tv;
+	time_t			now;
+
+	pthread_mutex_lock(&inst->write_mutex);
+	while (true) {
+		while (!inst->write_head && !inst->writer_exiting) {
+			pthread_cond_wait(&inst->write_cond, &inst->write_mutex);
+		}
+		exiting = inst->writer_exiting;
+
+		head = inst->write_head;
+		inst->write_head = NULL;
+		inst->write_tail = &inst->write_head;
+		pthread_mutex_unlock(&inst->write_mutex);
+
+		failed = head ? reserved_write(inst, head) : NULL;
+
+		now = time(NULL);
+		last = &failed;
+		while (*last) {
+			this = *last;
+			if (!exiting && (this->expires > now)) {
+				last = &this->next;
+				continue;
+			}
+
+			ERROR("rlm_sqlippool (%s): Lost allocation of %s, it may be allocated again",
+			      inst->pool_name, this->addr);
+			*last = this->next;
+			talloc_free(this);
+		}
+
+		if (exiting) break;
+
+		pthread_mutex_lock(&inst->write_mutex);
+		if (!failed) continue;
+
+		/*
+		 *	Retry them before anything queued since.
+		 */
+		*last = inst->write_head;
+		if (!inst->write_head) inst->write_tail = last;
+		inst->write_head = failed;
+
+		gettimeofday(&tv, NULL);
+		when.tv_sec = tv.tv_sec + SQLIPPOOL_WRITE_RETRY;
+		when.tv_nsec = tv.tv_usec * 1000;
+		while (!inst->writer_exiting) {
+			if (pthread_cond_timedwait(&inst->write_cond, &inst->write_mutex, &when) == ETIMEDOUT) break;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ *	Expand the query which records an allocation, and queue it
+ *	for the writer.
+ */
+static int reserved_queue(rlm_sqlippool_t *inst, REQUEST *request, char *addr, int addr_len, time_t expires)
+{
+	char query[MAX_QUERY_LEN];
+	char *expanded = NULL;
+	sqlippool_write_t *entry;
+	int ret;
+
+	sqlippool_expand(query, sizeof(query), inst->reserve_allocate, inst, addr, addr_len);
+	if (radius_axlat(&expanded, request, query, inst->sql_inst->sql_escape_func, inst->sql_inst) < 0) {
+		return -1;
+	}
+
+	entry = talloc_zero(NULL, sqlippool_write_t);
+	if (!entry) {
+		talloc_free(expanded);
+		return -1;
+	}
+	entry->query = talloc_steal(entry, expanded);
+	entry->addr = talloc_typed_strdup(entry, addr);
+	entry->expires = expires;
+
+	pthread_mutex_lock(&inst->write_mutex);
+
+	/*
+	 *	The thread is started here instead of in
+	 *	mod_instantiate(), as the server may fork after
+	 *	the modules have been instantiated.
+	 */
+	if (!inst->writer_running) {
+		ret = pthread_create(&inst->writer, NULL, reserved_writer, inst);
+		if (ret != 0) {
+			pthread_mutex_unlock(&inst->write_mutex);
+			talloc_free(entry);
+			REDEBUG("Failed creating writer thread: %s", fr_syserror(ret));
+			return -1;
+		}
+		inst->writer_running = true;
+	}
+
+	*inst->write_tail = entry;
+	inst->write_tail = &entry->next;
+	pthread_cond_signal(&inst->write_cond);
+	pthread_mutex_unlock(&inst->write_mutex);
+
+	return 0;
+}
+#endif
+
 /*
  *	Do any per-module initialization that is separate to each
  *	configured instance of the module.  e.g. set up connections
@@ -435,6 +817,33 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 	}
 
 	inst->sql_inst = (rlm_sql_t *) sqlinst->insthandle;
+
+	if (inst->reserve_size > 0) {
+#ifdef HAVE_PTHREAD_H
+		FR_INTEGER_BOUND_CHECK("reserve_size", inst->reserve_size, <=, 10000);
+
+		if (!*inst->reserve_find || !*inst->reserve_update || !*inst->reserve_allocate) {
+			cf_log_err_cs(conf, "'reserve_size' requires 'reserve_find', 'reserve_update' "
+				      "and 'reserve_allocate'");
+			return -1;
+		}
+
+		inst->reserved = rbtree_create(inst, reserved_cmp, NULL, 0);
+		if (!inst->reserved) {
+			cf_log_err_cs(conf, "Failed creating tree for reserved addresses");
+			return -1;
+		}
+
+		inst->write_tail = &inst->write_head;
+		pthread_mutex_init(&inst->reserved_mutex, NULL);
+		pthread_mutex_init(&inst->write_mutex, NULL);
+		pthread_cond_init(&inst->write_cond, NULL);
+#else
+		cf_log_err_cs(conf, "'reserve_size' requires a server built with threads");
+		return -1;
+#endif
+	}
+
 	return 0;
 }
 
@@ -461,6 +870,152 @@ static int do_logging(REQUEST *request, char const *str, int rcode)
 }
 
 
+/*
+ *	No address could be allocated.  Figure out why, and release
+ *	the handle.
+ */
+static rlm_rcode_t sqlippool_not_found(rlm_sqlippool_t *inst, REQUEST *request, rlm_sql_handle_t *handle)
+{
+	char allocation[MAX_STRING_LEN];
+	int allocation_len;
+
+	/*
+	 *Should we perform pool-check ?
+	 */
+	if (inst->pool_check && *inst->pool_check) {
+
+		/*
+		 *Ok, so the allocate-find query found nothing ...
+		 *Let's check if the pool exists at all
+		 */
+		allocation_len = sqlippool_query1(allocation, sizeof(allocation),
+						  inst->pool_check, handle, inst, request,
+						  (char *) NULL, 0);
+
+		inst->sql_inst->sql_release_socket(inst->sql_inst, handle);
+
+		if (allocation_len) {
+
+			/*
+			 *	Pool exists after all... So,
+			 *	the failure to allocate the IP
+			 *	address was most likely due to
+			 *	the depletion of the pool. In
+			 *	that case, we should return
+			 *	NOTFOUND
+			 */
+			RDEBUG("pool appears to be full");
+			return do_logging(request, inst->log_failed, RLM_MODULE_NOTFOUND);
+
+		}
+
+		/*
+		 *	Pool doesn't exist in the table. It
+		 *	may be handled by some other instance of
+		 *	sqlippool, so we should just ignore this
+		 *	allocation failure and return NOOP
+		 */
+		RDEBUG("IP address could not be allocated as no pool exists with that name");
+		return RLM_MODULE_NOOP;
+
+	}
+
+	inst->sql_inst->sql_release_socket(inst->sql_inst, handle);
+
+	RDEBUG("IP address could not be allocated");
+	return do_logging(request, inst->log_failed, RLM_MODULE_NOOP);
+}
+
+#ifdef HAVE_PTHREAD_H
+/*
+ *	Allocate an IP number from the addresses reserved for this
+ *	server, reserving more if we've run out.  The allocation is
+ *	written to the database by the writer thread.
+ */
+static rlm_rcode_t post_auth_reserved(rlm_sqlippool_t *inst, REQUEST *request, char const *pool_name)
+{
+	sqlippool_reserved_t *entry;
+	rlm_sql_handle_t *handle;
+	VALUE_PAIR *vp;
+	char *allocation;
+	int allocation_len;
+	time_t reserved_until;
+	int ret;
+
+	if (inst->sql_inst->sql_set_user(inst->sql_inst, request, NULL) < 0) {
+		return RLM_MODULE_FAIL;
+	}
+
+	entry = reserved_find(inst, pool_name);
+	if (!entry) return RLM_MODULE_FAIL;
+
+	pthread_mutex_lock(&entry->mutex);
+	if (entry->num && (entry->expires <= request->timestamp)) {
+		RDEBUG2("Discarding %u reserved addresses, as their reservation is about to expire", entry->num);
+		entry->num = 0;
+	}
+
+	if (!entry->num) {
+		handle = inst->sql_inst->sql_get_socket(inst->sql_inst);
+		if (!handle) {
+			pthread_mutex_unlock(&entry->mutex);
+			REDEBUG("cannot get sql connection");
+			return RLM_MODULE_FAIL;
+		}
+
+		ret = reserved_fill(inst, request, handle, entry);
+		if (ret <= 0) {
+			pthread_mutex_unlock(&entry->mutex);
+			if (ret == 0) return sqlippool_not_found(inst, request, handle);
+
+			inst->sql_inst->sql_release_socket(inst->sql_inst, handle);
+			return RLM_MODULE_FAIL;
+		}
+		inst->sql_inst->sql_release_socket(inst->sql_inst, handle);
+
+		RDEBUG2("Reserved %i addresses from pool %s", ret, pool_name);
+	}
+
+	allocation = talloc_steal(request, entry->addrs[--entry->num]);
+	reserved_until = entry->reserved_until;
+	pthread_mutex_unlock(&entry->mutex);
+	allocation_len = strlen(allocation);
+
+	/*
+	 *	If the address is invalid, it stays reserved until the
+	 *	reservation expires.
+	 */
+	vp = paircreate(request->reply, inst->framed_ip_address, 0);
+	if (pairparsevalue(vp, allocation, allocation_len) < 0) {
+		talloc_free(vp);
+		RDEBUG("Invalid IP number [%s] returned from instbase query.", allocation);
+		return do_logging(request, inst->log_failed, RLM_MODULE_NOOP);
+	}
+
+	RDEBUG("Allocated IP %s", allocation);
+	pairadd(&request->reply->vps, vp);
+
+	/*
+	 *	If it can't be queued, write it now.  If that fails,
+	 *	the address can't be used, as it will be given to
+	 *	someone else when the reservation runs out.
+	 */
+	if (reserved_queue(inst, request, allocation, allocation_len, reserved_until) < 0) {
+		handle = inst->sql_inst->sql_get_socket(inst->sql_inst);
+		if (!handle ||
+		    (sqlippool_command(inst->reserve_allocate, handle, inst, request, allocation, allocation_len) < 0)) {
+			if (handle) inst->sql_inst->sql_release_socket(inst->sql_inst, handle);
+			pairdelete(&request->reply->vps, inst->framed_ip_address, 0, TAG_ANY);
+			REDEBUG("Failed recording allocation of IP %s", allocation);
+			return do_logging(request, inst->log_failed, RLM_MODULE_FAIL);
+		}
+		inst->sql_inst->sql_release_socket(inst->sql_inst, handle);
+	}
+
+	return do_logging(request, inst->log_success, RLM_MODULE_OK);
+}
+#endif
+
 /*
  *	Allocate an IP number from the pool.
  */
@@ -482,12 +1037,17 @@ static rlm_rcode_t CC_HINT(nonnull) mod_post_auth(void *instance, REQUEST *reque
 		return do_logging(request, inst->log_exists, RLM_MODULE_NOOP);
 	}
 
-	if (pairfind(request->config_items, PW_POOL_NAME, 0, TAG_ANY) == NULL) {
+	vp = pairfind(request->config_items, PW_POOL_NAME, 0, TAG_ANY);
+	if (!vp) {
 		RDEBUG("No Pool-Name defined");
 
 		return do_logging(request, inst->log_nopool, RLM_MODULE_NOOP);
 	}
 
+#ifdef HAVE_PTHREAD_H
+	if (inst->reserve_size > 0) return post_auth_reserved(inst, request, vp->vp_strvalue);
+#endif
+
 	handle = inst->sql_inst->sql_get_socket(inst->sql_inst);
 	if (!handle) {
 		REDEBUG("cannot get sql connection");
@@ -505,7 +1065,7 @@ static rlm_rcode_t CC_HINT(nonnull) mod_post_auth(void *instance, REQUEST *reque
 	 *	here is that if we're allocating 100 IPs a second,
 	 *	we're only do 1 CLEAR per second.
 	 */
-	now = time(NULL);
+	now = request->timestamp;
 	if (inst->last_clear < now) {
 		inst->last_clear = now;
 
@@ -526,51 +1086,7 @@ static rlm_rcode_t CC_HINT(nonnull) mod_post_auth(void *instance, REQUEST *reque
 	if (allocation_len == 0) {
 		DO(allocate_commit);
 
-		/*
-		 *Should we perform pool-check ?
-		 */
-		if (inst->pool_check && *inst->pool_check) {
-
-			/*
-			 *Ok, so the allocate-find query found nothing ...
-			 *Let's check if the pool exists at all
-			 */
-			allocation_len = sqlippool_query1(allocation, sizeof(allocation),
-							  inst->pool_check, handle, inst, request,
-							  (char *) NULL, 0);
-
-			inst->sql_inst->sql_release_socket(inst->sql_inst, handle);
-
-			if (allocation_len) {
-
-				/*
-				 *	Pool exists after all... So,
-				 *	the failure to allocate the IP
-				 *	address was most likely due to
-				 *	the depletion of the pool. In
-				 *	that case, we should return
-				 *	NOTFOUND
-				 */
-				RDEBUG("pool appears to be full");
-				return do_logging(request, inst->log_failed, RLM_MODULE_NOTFOUND);
-
-			}
-
-			/*
-			 *	Pool doesn't exist in the table. It
-			 *	may be handled by some other instance of
-			 *	sqlippool, so we should just ignore this
-			 *	allocation failure and return NOOP
-			 */
-			RDEBUG("IP address could not be allocated as no pool exists with that name");
-			return RLM_MODULE_NOOP;
-
-		}
-
-		inst->sql_inst->sql_release_socket(inst->sql_inst, handle);
-
-		RDEBUG("IP address could not be allocated");
-		return do_logging(request, inst->log_failed, RLM_MODULE_NOOP);
+		return sqlippool_not_found(inst, request, handle);
 	}
 
 	/*
@@ -721,6 +1237,39 @@ static rlm_rcode_t CC_HINT(nonnull) mod_accounting(void *instance, REQUEST *requ
 	return rcode;
 }
 
+static int mod_detach(void *instance)
+{
+#ifdef HAVE_PTHREAD_H
+	rlm_sqlippool_t *inst = instance;
+
+	if (!inst->reserved) return 0;
+
+	/*
+	 *	Write any queued allocations.  Addresses which were
+	 *	reserved but not handed out are released when their
+	 *	reservation expires.
+	 */
+	if (inst->writer_running) {
+		pthread_mutex_lock(&inst->write_mutex);
+		inst->writer_exiting = true;
+		pthread_cond_signal(&inst->write_cond);
+		pthread_mutex_unlock(&inst->write_mutex);
+
+		pthread_join(inst->writer, NULL);
+	}
+
+	rbtree_free(inst->reserved);
+	inst->reserved = NULL;
+	pthread_mutex_destroy(&inst->reserved_mutex);
+	pthread_mutex_destroy(&inst->write_mutex);
+	pthread_cond_destroy(&inst->write_cond);
+#else
+	(void) instance;
+#endif
+
+	return 0;
+}
+
 /*
  *	The module name should be the only globally exported symbol.
  *	That is, everything else should be 'static'.
@@ -737,7 +1286,7 @@ module_t rlm_sqlippool = {
 	sizeof(rlm_sqlippool_t),
 	module_config,
 	mod_instantiate,		/* instantiation */
-	NULL,				/* detach */
+	mod_detach,			/* detach */
 	{
 		NULL,			/* authentication */
 		NULL,			/* authorization */
@@ -748,4 +1297,8 @@ module_t rlm_sqlippool = {
 		NULL,			/* post-proxy */
 		mod_post_auth	/* post-auth */
 	},
+	0,				/* thread_inst_size */
+	NULL,				/* thread_instantiate */
+	NULL,				/* thread_detach */
+	NULL				/* cache_flush */
 };
@@ -149,28 +149,39 @@ static int rrlabels_tostr(char *out, char *rr, size_t left)
 
 static int ub_common_wait(rlm_unbound_t *inst, REQUEST *request, char const *tag, struct ub_result **ub, int async_id)
 {
-	useconds_t iv, waited;
+	struct timeval now, end, iv, wait;
 
-	iv = inst->timeout > 64 ? 64000 : inst->timeout * 1000;
-	ub_process(inst->ub);
+	gettimeofday(&end, NULL);
+	end.tv_sec += inst->timeout / 1000;
+	end.tv_usec += (inst->timeout % 1000) * 1000;
+	if (end.tv_usec >= 1000000) {
+		end.tv_sec++;
+		end.tv_usec -= 1000000;
+	}
 
-	for (waited = 0; (void*)*ub == (void *)inst; waited += iv, iv *= 2) {
+	iv.tv_sec = 0;
+	iv.tv_usec = inst->timeout > 64 ? 64000 : inst->timeout * 1000;
+	ub_process(inst->ub);
 
-		if (waited + iv > (useconds_t)inst->timeout * 1000) {
-			usleep(inst->timeout * 1000 - waited);
-			ub_process(inst->ub);
-			break;
-		}
+	while ((void *)*ub == (void *)inst) {
+		gettimeofday(&now, NULL);
+		if (!timercmp(&now, &end, <)) break;
 
-		usleep(iv);
+		timersub(&end, &now, &wait);
+		if (timercmp(&iv, &wait, <)) wait = iv;
 
-		/* Check if already handled by event loop */
-		if ((void *)*ub != (void *)inst) {
-			break;
-		}
+		/*
+		 *	Wait for unbound to have an answer for someone,
+		 *	without holding up the thread.  The event loop may
+		 *	get to it first, so don't wait too long before
+		 *	checking again.
+		 */
+		if (module_yield(request, inst->log_fd, &wait) < 0) break;
 
 		/* In case we are running single threaded */
 		ub_process(inst->ub);
+
+		timeradd(&iv, &iv, &iv);
 	}
 
 	if ((void *)*ub == (void *)inst) {
@@ -763,4 +774,8 @@ module_t rlm_unbound = {
 	mod_detach,			/* detach */
 	/* This module does not directly interact with requests */
 	{ NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL },
+	0,				/* thread_inst_size */
+	NULL,				/* thread_instantiate */
+	NULL,				/* thread_detach */
+	NULL				/* cache_flush */
 };
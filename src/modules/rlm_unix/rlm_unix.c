@@ -58,14 +58,49 @@ static char trans[64] =
    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 #define ENC(c) trans[c]
 
+#ifdef HAVE_PTHREAD_H
+#define PTHREAD_MUTEX_LOCK pthread_mutex_lock
+#define PTHREAD_MUTEX_UNLOCK pthread_mutex_unlock
+#else
+#define PTHREAD_MUTEX_LOCK(_x)
+#define PTHREAD_MUTEX_UNLOCK(_x)
+#endif
+
+/*
+ *	A cached passwd or group lookup.  Entries for names which
+ *	don't exist are cached too, with found = false.
+ */
+typedef struct unix_cache_entry {
+	char const	*name;
+	bool		found;
+	gid_t		gid;		//!< pw_gid, or gr_gid.
+	char		**members;	//!< Of the group, sorted.
+	int		num_members;
+	time_t		expires;
+} unix_cache_entry_t;
+
 struct unix_instance {
 	char const *name;	//!< Instance name.
 	char const *radwtmp;
+
+	uint32_t	cache_lifetime;		//!< For entries which were found.
+	uint32_t	cache_negative_lifetime;	//!< For entries which weren't.
+	uint32_t	cache_size;		//!< Maximum entries in each table.
+
+	fr_hash_table_t	*pwd_cache;
+	fr_hash_table_t	*grp_cache;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t	mutex;
+#endif
 };
 
 static const CONF_PARSER module_config[] = {
 	{ "radwtmp", FR_CONF_OFFSET(PW_TYPE_FILE_OUTPUT | PW_TYPE_REQUIRED, struct unix_instance, radwtmp), "NULL" },
 
+	{ "cache_lifetime", FR_CONF_OFFSET(PW_TYPE_INTEGER, struct unix_instance, cache_lifetime), "0" },
+	{ "cache_negative_lifetime", FR_CONF_OFFSET(PW_TYPE_INTEGER, struct unix_instance, cache_negative_lifetime), "0" },
+	{ "cache_size", FR_CONF_OFFSET(PW_TYPE_INTEGER, struct unix_instance, cache_size), "10000" },
+
 	{ NULL, -1, 0, NULL, NULL }		/* end the list */
 };
 
@@ -75,7 +110,7 @@ static const CONF_PARSER module_config[] = {
 #else
 static struct group *fr_getgrnam(TALLOC_CTX *ctx, char const *name)
 {
-	struct group	*grp, *result;
+	struct group	*grp, *result = NULL;
 	char		*group_buffer;
 	size_t		group_size = 1024;
 
@@ -96,67 +131,237 @@ static struct group *fr_getgrnam(TALLOC_CTX *ctx, char const *name)
 		break;
 	}
 
+	if (!result) {
+		talloc_free(grp);
+		return NULL;
+	}
+
 	return grp;
 }
 #endif	/* HAVE_GETGRNAM_R */
 
+static uint32_t unix_cache_hash(void const *data)
+{
+	return fr_hash_string(((unix_cache_entry_t const *)data)->name);
+}
+
+static int unix_cache_cmp(void const *a, void const *b)
+{
+	return strcmp(((unix_cache_entry_t const *)a)->name,
+		      ((unix_cache_entry_t const *)b)->name);
+}
+
+static void unix_cache_free(void *data)
+{
+	talloc_free(data);
+}
+
+static int unix_member_cmp(void const *a, void const *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
 /*
- *	The Group = handler.
+ *	Look up a user's primary group.
  */
-static int groupcmp(UNUSED void *instance, REQUEST *req, UNUSED VALUE_PAIR *request,
-		    VALUE_PAIR *check, UNUSED VALUE_PAIR *check_pairs,
-		    UNUSED VALUE_PAIR **reply_pairs)
+static unix_cache_entry_t *unix_pwd_fetch(char const *name)
 {
+	unix_cache_entry_t *entry;
 	struct passwd	*pwd;
-	struct group	*grp;
-	char		**member;
-	int		retval;
 #ifdef HAVE_GETPWNAM_R
 	struct passwd	my_pwd;
 	char		pwd_buffer[1024];
+
+	if (getpwnam_r(name, &my_pwd, pwd_buffer, sizeof(pwd_buffer), &pwd) != 0) {
+		pwd = NULL;
+	}
+#else
+	pwd = getpwnam(name);
 #endif
 
+	entry = talloc_zero(NULL, unix_cache_entry_t);
+	if (!entry) return NULL;
+
+	entry->name = talloc_typed_strdup(entry, name);
+	if (pwd) {
+		entry->found = true;
+		entry->gid = pwd->pw_gid;
+	}
+
+	return entry;
+}
+
+/*
+ *	Look up a group, and sort its members so that they can be
+ *	searched quickly.
+ */
+static unix_cache_entry_t *unix_grp_fetch(char const *name)
+{
+	unix_cache_entry_t *entry;
+	struct group	*grp;
+	char		**member;
+	int		i;
+
+	entry = talloc_zero(NULL, unix_cache_entry_t);
+	if (!entry) return NULL;
+
+	entry->name = talloc_typed_strdup(entry, name);
+
+	grp = fr_getgrnam(entry, name);
+	if (!grp) return entry;
+
+	entry->found = true;
+	entry->gid = grp->gr_gid;
+
+	for (member = grp->gr_mem; *member; member++) entry->num_members++;
+
+	entry->members = talloc_array(entry, char *, entry->num_members + 1);
+	if (!entry->members) {
+		talloc_free(entry);
+		return NULL;
+	}
+
+	for (i = 0; i < entry->num_members; i++) {
+		entry->members[i] = talloc_typed_strdup(entry->members, grp->gr_mem[i]);
+	}
+	qsort(entry->members, entry->num_members, sizeof(entry->members[0]), unix_member_cmp);
+
+#ifdef HAVE_GETGRNAM_R
+	talloc_free(grp);
+#endif
+
+	return entry;
+}
+
+/*
+ *	Find an entry in a cache, or fetch it and add it.
+ *
+ *	Must be called with the mutex held.  It's released while NSS
+ *	is called, so that slow lookups don't hold up requests for
+ *	entries which are already cached.  The entry is only valid
+ *	until the mutex is released.  If the cache is disabled or
+ *	full, the entry must be freed by the caller, which is told
+ *	by "*uncached".
+ */
+static unix_cache_entry_t *unix_cache_find(struct unix_instance *inst, fr_hash_table_t *ht,
+					   unix_cache_entry_t *(*fetch)(char const *),
+					   char const *name, bool *uncached)
+{
+	unix_cache_entry_t *entry, *found, my_entry;
+	time_t now;
+
+	*uncached = false;
+
+	if (!ht) {
+		*uncached = true;
+
+		PTHREAD_MUTEX_UNLOCK(&inst->mutex);
+		entry = fetch(name);
+		PTHREAD_MUTEX_LOCK(&inst->mutex);
+
+		return entry;
+	}
+
+	my_entry.name = name;
+	found = fr_hash_table_finddata(ht, &my_entry);
+	if (found && (found->expires > fr_clock_time())) return found;
+
+	PTHREAD_MUTEX_UNLOCK(&inst->mutex);
+	entry = fetch(name);
+	PTHREAD_MUTEX_LOCK(&inst->mutex);
+	if (!entry) return NULL;
+
+	now = fr_clock_time();
+	entry->expires = now + (entry->found ? inst->cache_lifetime : inst->cache_negative_lifetime);
+
+	/*
+	 *	Another request may have replaced the entry while the
+	 *	mutex was released.
+	 */
+	found = fr_hash_table_finddata(ht, &my_entry);
+	if (found) fr_hash_table_delete(ht, found);
+
+	/*
+	 *	Don't cache things which would expire immediately,
+	 *	and don't let the cache grow without bound.
+	 */
+	if ((entry->expires <= now) ||
+	    ((uint32_t) fr_hash_table_num_elements(ht) >= inst->cache_size) ||
+	    !fr_hash_table_insert(ht, entry)) {
+		*uncached = true;
+	}
+
+	return entry;
+}
+
+/*
+ *	The Group = handler.
+ */
+static int groupcmp(void *instance, REQUEST *req, UNUSED VALUE_PAIR *request,
+		    VALUE_PAIR *check, UNUSED VALUE_PAIR *check_pairs,
+		    UNUSED VALUE_PAIR **reply_pairs)
+{
+	struct unix_instance *inst = instance;
+	unix_cache_entry_t *pwd, *grp;
+	bool		uncached;
+	bool		found;
+	gid_t		gid = 0;
+	int		retval = -1;
+	char const	*name;
+
 	/*
 	 *	No user name, doesn't compare.
 	 */
 	if (!req->username) {
 		return -1;
 	}
+	name = req->username->vp_strvalue;
 
-#ifdef HAVE_GETPWNAM_R
-	if (getpwnam_r(req->username->vp_strvalue, &my_pwd, pwd_buffer, sizeof(pwd_buffer), &pwd) != 0) {
-		pwd = NULL;
+	PTHREAD_MUTEX_LOCK(&inst->mutex);
+
+	/*
+	 *	The mutex is released while the group is fetched,
+	 *	so copy what we need from the passwd entry first.
+	 */
+	pwd = unix_cache_find(inst, inst->pwd_cache, unix_pwd_fetch, name, &uncached);
+	found = pwd && pwd->found;
+	if (found) gid = pwd->gid;
+	if (uncached) talloc_free(pwd);
+	if (!found) goto done;
+
+	grp = unix_cache_find(inst, inst->grp_cache, unix_grp_fetch, check->vp_strvalue, &uncached);
+	if (grp && grp->found &&
+	    ((gid == grp->gid) ||
+	     bsearch(&name, grp->members, grp->num_members, sizeof(grp->members[0]), unix_member_cmp))) {
+		retval = 0;
 	}
-#else
-	pwd = getpwnam(req->username->vp_strvalue);
-#endif
-	if (!pwd)
-		return -1;
+	if (uncached) talloc_free(grp);
 
-	grp = fr_getgrnam(req, check->vp_strvalue);
-	if (!grp)
-		return -1;
+done:
+	PTHREAD_MUTEX_UNLOCK(&inst->mutex);
 
-	retval = (pwd->pw_gid == grp->gr_gid) ? 0 : -1;
-	if (retval < 0) {
-		for (member = grp->gr_mem; *member && retval; member++) {
-			if (strcmp(*member, pwd->pw_name) == 0)
-				retval = 0;
-		}
-	}
+	return retval;
+}
 
-#ifdef HAVE_GETGRNAM_R
-	talloc_free(grp);
+static int mod_detach(void *instance)
+{
+	struct unix_instance *inst = instance;
+
+	fr_hash_table_free(inst->pwd_cache);
+	fr_hash_table_free(inst->grp_cache);
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_destroy(&inst->mutex);
 #endif
 
-	return retval;
+	return 0;
 }
 
 
 /*
  *	Read the config
  */
-static int mod_instantiate(UNUSED CONF_SECTION *conf, void *instance)
+static int mod_instantiate(CONF_SECTION *conf, void *instance)
 {
 	struct unix_instance *inst = instance;
 
@@ -167,6 +372,19 @@ static int mod_instantiate(UNUSED CONF_SECTION *conf, void *instance)
 		inst->name = cf_section_name1(conf);
 	}
 
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_init(&inst->mutex, NULL);
+#endif
+
+	if (inst->cache_lifetime || inst->cache_negative_lifetime) {
+		inst->pwd_cache = fr_hash_table_create(unix_cache_hash, unix_cache_cmp, unix_cache_free);
+		inst->grp_cache = fr_hash_table_create(unix_cache_hash, unix_cache_cmp, unix_cache_free);
+		if (!inst->pwd_cache || !inst->grp_cache) {
+			ERROR("rlm_unix (%s): Failed creating lookup cache", inst->name);
+			return -1;
+		}
+	}
+
 	group_da = dict_attrbyvalue(PW_GROUP, 0);
 	if (!group_da) {
 		ERROR("rlm_unix (%s): 'Group' attribute not found in dictionary", inst->name);
@@ -563,7 +781,7 @@ module_t rlm_unix = {
 	sizeof(struct unix_instance),
 	module_config,
 	mod_instantiate,		/* instantiation */
-	NULL,				/* detach */
+	mod_detach,			/* detach */
 	{
 		NULL,		    /* authentication */
 		mod_authorize,       /* authorization */
@@ -574,4 +792,8 @@ module_t rlm_unix = {
 		NULL,			/* post-proxy */
 		NULL			/* post-auth */
 	},
+	0,				/* thread_inst_size */
+	NULL,				/* thread_instantiate */
+	NULL,				/* thread_detach */
+	NULL				/* cache_flush */
 };
@@ -30,7 +30,6 @@ RCSID("$Id$")
  */
 static rlm_rcode_t CC_HINT(nonnull) mod_utf8_clean(UNUSED void *instance, REQUEST *request)
 {
-	size_t i, len;
 	VALUE_PAIR *vp;
 	vp_cursor_t cursor;
 
@@ -39,10 +38,7 @@ static rlm_rcode_t CC_HINT(nonnull) mod_utf8_clean(UNUSED void *instance, REQUES
 	     vp = fr_cursor_next(&cursor)) {
 		if (vp->da->type != PW_TYPE_STRING) continue;
 
-		for (i = 0; i < vp->length; i += len) {
-			len = fr_utf8_char(&vp->vp_octets[i]);
-			if (len == 0) return RLM_MODULE_FAIL;
-		}
+		if (fr_utf8_valid(vp->vp_octets, vp->length) != vp->length) return RLM_MODULE_FAIL;
 	}
 
 	return RLM_MODULE_NOOP;
@@ -79,4 +75,8 @@ module_t rlm_utf8 = {
 		NULL
 #endif
 	},
+	0,				/* thread_inst_size */
+	NULL,				/* thread_instantiate */
+	NULL,				/* thread_detach */
+	NULL				/* cache_flush */
 };
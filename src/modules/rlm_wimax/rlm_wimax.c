@@ -480,4 +480,8 @@ module_t rlm_wimax = {
 		NULL,			/* post-proxy */
 		mod_post_auth 		/* post-auth */
 	},
+	0,				/* thread_inst_size */
+	NULL,				/* thread_instantiate */
+	NULL,				/* thread_detach */
+	NULL				/* cache_flush */
 };
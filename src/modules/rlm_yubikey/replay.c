@@ -0,0 +1,236 @@
+/**
+ * $Id$
+ * @file replay.c
+ * @brief Local replay detection for yubikey OTP tokens.
+ *
+ * Remembers the last OTP accepted for each public ID, and its counter if the
+ * OTP was decrypted, so that replayed OTPs can be rejected without asking the
+ * validation servers.
+ *
+ * @copyright 2016 The FreeRADIUS server project
+ */
+#include "rlm_yubikey.h"
+
+#ifdef HAVE_PTHREAD_H
+#  define REPLAY_LOCK(_inst)	pthread_mutex_lock(&(_inst)->replay_mutex)
+#  define REPLAY_UNLOCK(_inst)	pthread_mutex_unlock(&(_inst)->replay_mutex)
+#else
+#  define REPLAY_LOCK(_inst)
+#  define REPLAY_UNLOCK(_inst)
+#endif
+
+/** The last OTP accepted for a public ID
+ *
+ */
+typedef struct rlm_yubikey_replay {
+	char const	*public_id;			//!< Public ID of the token.
+	char		otp[YUBIKEY_TOKEN_LEN + 1];	//!< aes-block of the last OTP accepted.
+	bool		has_counter;			//!< Whether we know the counter.
+	uint32_t	counter;			//!< Counter of the last OTP accepted.
+	time_t		expires;			//!< When the entry is removed.
+	int		heap_id;			//!< Position in the expiry heap.
+} rlm_yubikey_replay_t;
+
+static int replay_cmp(void const *one, void const *two)
+{
+	rlm_yubikey_replay_t const *a = one;
+	rlm_yubikey_replay_t const *b = two;
+
+	return strcmp(a->public_id, b->public_id);
+}
+
+static int replay_heap_cmp(void const *one, void const *two)
+{
+	rlm_yubikey_replay_t const *a = one;
+	rlm_yubikey_replay_t const *b = two;
+
+	if (a->expires < b->expires) return -1;
+	if (a->expires > b->expires) return +1;
+
+	return 0;
+}
+
+/** Remove an entry, must be called with the mutex held
+ *
+ */
+static void replay_remove(rlm_yubikey_t *inst, rlm_yubikey_replay_t *entry)
+{
+	fr_heap_extract(inst->replay_heap, entry);
+	rbtree_deletebydata(inst->replay, entry);
+	talloc_free(entry);
+}
+
+/** Remove expired entries, must be called with the mutex held
+ *
+ */
+static void replay_expire(rlm_yubikey_t *inst, time_t now)
+{
+	rlm_yubikey_replay_t *entry;
+
+	while ((entry = fr_heap_peek(inst->replay_heap)) && (entry->expires <= now)) {
+		replay_remove(inst, entry);
+	}
+}
+
+/** Find the counter the OTP was decrypted with, if any
+ *
+ */
+static VALUE_PAIR *replay_counter(rlm_yubikey_t *inst, REQUEST *request)
+{
+	if (!inst->counter_da) return NULL;
+
+	return pairfind_da(request->packet->vps, inst->counter_da, TAG_ANY);
+}
+
+int rlm_yubikey_replay_init(rlm_yubikey_t *inst)
+{
+	if (!inst->id_len) {
+		ERROR("rlm_yubikey (%s): replay_cache requires the Public ID, id_length must be > 0", inst->name);
+		return -1;
+	}
+
+#ifdef HAVE_PTHREAD_H
+	if (pthread_mutex_init(&inst->replay_mutex, NULL) < 0) {
+		ERROR("rlm_yubikey (%s): Failed initializing replay cache mutex: %s", inst->name, fr_syserror(errno));
+		return -1;
+	}
+#endif
+
+	inst->replay = rbtree_create(NULL, replay_cmp, NULL, 0);
+	if (!inst->replay) {
+		ERROR("rlm_yubikey (%s): Failed creating replay cache", inst->name);
+		return -1;
+	}
+
+	inst->replay_heap = fr_heap_create(replay_heap_cmp, offsetof(rlm_yubikey_replay_t, heap_id));
+	if (!inst->replay_heap) {
+		ERROR("rlm_yubikey (%s): Failed creating heap for the replay cache", inst->name);
+		return -1;
+	}
+
+	inst->counter_da = dict_attrbyname("Yubikey-Counter");
+
+	return 0;
+}
+
+void rlm_yubikey_replay_free(rlm_yubikey_t *inst)
+{
+	rlm_yubikey_replay_t *entry;
+
+	if (!inst->replay) return;
+
+	if (inst->replay_heap) {
+		while ((entry = fr_heap_peek(inst->replay_heap))) replay_remove(inst, entry);
+		fr_heap_delete(inst->replay_heap);
+		inst->replay_heap = NULL;
+	}
+
+	rbtree_free(inst->replay);
+	inst->replay = NULL;
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_destroy(&inst->replay_mutex);
+#endif
+}
+
+/** Check whether an OTP has already been accepted
+ *
+ * @param[in] inst rlm_yubikey configuration.
+ * @param[in] request Current request.
+ * @param[in] passcode <public_id> + <aes-block>.
+ * @return 0 if the OTP may be new, -1 if it's a replay.
+ */
+int rlm_yubikey_replay_check(rlm_yubikey_t *inst, REQUEST *request, char const *passcode)
+{
+	rlm_yubikey_replay_t my_entry, *entry;
+	char public_id[inst->id_len + 1];
+	VALUE_PAIR *vp;
+	int ret = 0;
+
+	strlcpy(public_id, passcode, sizeof(public_id));
+	my_entry.public_id = public_id;
+
+	vp = replay_counter(inst, request);
+
+	REPLAY_LOCK(inst);
+	replay_expire(inst, request->timestamp);
+
+	entry = rbtree_finddata(inst->replay, &my_entry);
+	if (entry) {
+		if (strcmp(entry->otp, passcode + inst->id_len) == 0) {
+			REDEBUG("Replay attack detected! OTP was already accepted for public ID %s", public_id);
+			ret = -1;
+
+		} else if (vp && entry->has_counter && (vp->vp_integer <= entry->counter)) {
+			REDEBUG("Replay attack detected! Counter value %u, is lt or eq to last accepted counter "
+				"value %u", vp->vp_integer, entry->counter);
+			ret = -1;
+		}
+	}
+	REPLAY_UNLOCK(inst);
+
+	return ret;
+}
+
+/** Record an OTP which was accepted
+ *
+ * @param[in] inst rlm_yubikey configuration.
+ * @param[in] request Current request.
+ * @param[in] passcode <public_id> + <aes-block>.
+ */
+void rlm_yubikey_replay_update(rlm_yubikey_t *inst, REQUEST *request, char const *passcode)
+{
+	rlm_yubikey_replay_t my_entry, *entry;
+	char public_id[inst->id_len + 1];
+	VALUE_PAIR *vp;
+
+	strlcpy(public_id, passcode, sizeof(public_id));
+	my_entry.public_id = public_id;
+
+	vp = replay_counter(inst, request);
+
+	REPLAY_LOCK(inst);
+	replay_expire(inst, request->timestamp);
+
+	entry = rbtree_finddata(inst->replay, &my_entry);
+	if (entry) {
+		fr_heap_extract(inst->replay_heap, entry);
+	} else {
+		/*
+		 *	Make room by removing the entry used least
+		 *	recently.
+		 */
+		if (rbtree_num_elements(inst->replay) >= inst->replay_max_entries) {
+			entry = fr_heap_peek(inst->replay_heap);
+			if (entry) replay_remove(inst, entry);
+		}
+
+		entry = talloc_zero(NULL, rlm_yubikey_replay_t);
+		if (!entry) {
+			REPLAY_UNLOCK(inst);
+			return;
+		}
+		entry->public_id = talloc_typed_strdup(entry, public_id);
+
+		if (!rbtree_insert(inst->replay, entry)) {
+			RWDEBUG("Failed adding public ID to the replay cache");
+			talloc_free(entry);
+			REPLAY_UNLOCK(inst);
+			return;
+		}
+	}
+
+	strlcpy(entry->otp, passcode + inst->id_len, sizeof(entry->otp));
+	if (vp) {
+		entry->has_counter = true;
+		entry->counter = vp->vp_integer;
+	}
+	entry->expires = request->timestamp + inst->replay_lifetime;
+
+	if (!fr_heap_insert(inst->replay_heap, entry)) {
+		RWDEBUG("Failed adding public ID to the replay cache");
+		rbtree_deletebydata(inst->replay, entry);
+		talloc_free(entry);
+	}
+	REPLAY_UNLOCK(inst);
+}
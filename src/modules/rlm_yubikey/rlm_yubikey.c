@@ -44,11 +44,18 @@ static const CONF_PARSER validation_config[] = {
 };
 #endif
 
+static const CONF_PARSER replay_config[] = {
+	{ "max_entries", FR_CONF_OFFSET(PW_TYPE_INTEGER, rlm_yubikey_t, replay_max_entries), "0" },
+	{ "lifetime", FR_CONF_OFFSET(PW_TYPE_INTEGER, rlm_yubikey_t, replay_lifetime), "86400" },
+	{ NULL, -1, 0, NULL, NULL }		/* end the list */
+};
+
 static const CONF_PARSER module_config[] = {
 	{ "id_length", FR_CONF_OFFSET(PW_TYPE_INTEGER, rlm_yubikey_t, id_len), "12" },
 	{ "split", FR_CONF_OFFSET(PW_TYPE_BOOLEAN, rlm_yubikey_t, split), "yes" },
 	{ "decrypt", FR_CONF_OFFSET(PW_TYPE_BOOLEAN, rlm_yubikey_t, decrypt), "no" },
 	{ "validate", FR_CONF_OFFSET(PW_TYPE_BOOLEAN, rlm_yubikey_t, validate), "no" },
+	{ "replay_cache", FR_CONF_POINTER(PW_TYPE_SUBSECTION, NULL), (void const *) replay_config },
 #ifdef HAVE_YKCLIENT
 	{ "validation", FR_CONF_POINTER(PW_TYPE_SUBSECTION, NULL), (void const *) validation_config },
 #endif
@@ -171,6 +178,12 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
 #endif
 	}
 
+	if (inst->replay_max_entries) {
+		FR_INTEGER_BOUND_CHECK("replay_cache.lifetime", inst->replay_lifetime, >=, 1);
+
+		if (rlm_yubikey_replay_init(inst) < 0) return -1;
+	}
+
 	xlat_register("modhextohex", modhex_to_hex_xlat, NULL, inst);
 
 	return 0;
@@ -180,13 +193,17 @@ static int mod_instantiate(CONF_SECTION *conf, void *instance)
  *	Only free memory we allocated.  The strings allocated via
  *	cf_section_parse() do not need to be freed.
  */
-#ifdef HAVE_YKCLIENT
 static int mod_detach(void *instance)
 {
-	rlm_yubikey_ykclient_detach((rlm_yubikey_t *) instance);
+	rlm_yubikey_t *inst = instance;
+
+#ifdef HAVE_YKCLIENT
+	if (inst->validate) rlm_yubikey_ykclient_detach(inst);
+#endif
+	rlm_yubikey_replay_free(inst);
+
 	return 0;
 }
-#endif
 
 static int CC_HINT(nonnull) otp_string_valid(rlm_yubikey_t *inst, char const *otp, size_t len)
 {
@@ -404,11 +421,22 @@ static rlm_rcode_t CC_HINT(nonnull) mod_authenticate(void *instance, REQUEST *re
 	}
 #endif
 
+	/*
+	 *	Reject OTPs we've already accepted, without asking
+	 *	the validation servers.
+	 */
+	if (inst->replay && (rlm_yubikey_replay_check(inst, request, passcode) < 0)) {
+		return RLM_MODULE_REJECT;
+	}
+
 #ifdef HAVE_YKCLIENT
 	if (inst->validate) {
-		return rlm_yubikey_validate(inst, request, passcode);
+		rcode = rlm_yubikey_validate(inst, request, passcode);
 	}
 #endif
+
+	if (inst->replay && (rcode == RLM_MODULE_OK)) rlm_yubikey_replay_update(inst, request, passcode);
+
 	return rcode;
 }
 
@@ -428,11 +456,7 @@ module_t rlm_yubikey = {
 	sizeof(rlm_yubikey_t),
 	module_config,
 	mod_instantiate,		/* instantiation */
-#ifdef HAVE_YKCLIENT
 	mod_detach,			/* detach */
-#else
-	NULL,
-#endif
 	{
 		mod_authenticate,	/* authentication */
 		mod_authorize,		/* authorization */
@@ -443,4 +467,8 @@ module_t rlm_yubikey = {
 		NULL,			/* post-proxy */
 		NULL			/* post-auth */
 	},
+	0,				/* thread_inst_size */
+	NULL,				/* thread_instantiate */
+	NULL,				/* thread_detach */
+	NULL				/* cache_flush */
 };
@@ -1,5 +1,6 @@
 #include <freeradius-devel/radiusd.h>
 #include <freeradius-devel/modules.h>
+#include <freeradius-devel/heap.h>
 #include <ctype.h>
 
 #include "config.h"
@@ -30,6 +31,17 @@ typedef struct rlm_yubikey_t {
 	bool			validate;		//!< Validate the OTP string using the ykclient library.
 	char const		**uris;			//!< Yubicloud URLs to validate the token against.
 
+	uint32_t		replay_max_entries;	//!< Maximum number of public IDs in the replay cache.
+							//!< 0 disables the replay cache.
+	uint32_t		replay_lifetime;	//!< How long a public ID is remembered after an OTP
+							//!< for it was last accepted.
+	rbtree_t		*replay;		//!< Last OTP accepted for each public ID.
+	fr_heap_t		*replay_heap;		//!< Replay cache entries ordered by expiry.
+	DICT_ATTR const		*counter_da;		//!< Yubikey-Counter.
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t		replay_mutex;		//!< Protects the replay cache.
+#endif
+
 #ifdef HAVE_YKCLIENT
 	unsigned int		client_id;		//!< Validation API client ID.
 	char const		*api_key;		//!< Validation API signing key.
@@ -44,6 +56,17 @@ typedef struct rlm_yubikey_t {
  */
 rlm_rcode_t rlm_yubikey_decrypt(rlm_yubikey_t *inst, REQUEST *request, char const *passcode);
 
+/*
+ *	replay.c - Local replay detection
+ */
+int rlm_yubikey_replay_init(rlm_yubikey_t *inst);
+
+void rlm_yubikey_replay_free(rlm_yubikey_t *inst);
+
+int rlm_yubikey_replay_check(rlm_yubikey_t *inst, REQUEST *request, char const *passcode);
+
+void rlm_yubikey_replay_update(rlm_yubikey_t *inst, REQUEST *request, char const *passcode);
+
 /*
  *	validate.c - Connection pool and validation functions
  */
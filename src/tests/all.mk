@@ -1,4 +1,4 @@
-SUBMAKEFILES := rbmonkey.mk unit/all.mk keywords/all.mk auth/all.mk
+SUBMAKEFILES := rbmonkey.mk unit/all.mk lib/all.mk keywords/all.mk auth/all.mk bench/all.mk radsec/all.mk cluster/all.mk ippool/all.mk sqlippool/all.mk cache/all.mk metrics/all.mk dhcp_lease/all.mk nats/all.mk
 
 #
 #  Include all of the autoconf definitions into the Make variable space
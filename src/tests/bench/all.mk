@@ -0,0 +1,83 @@
+#
+#  Benchmarks for the packet path.
+#
+#	make bench
+#
+#  runs all of them, one after the other, and writes the results to
+#  build/tests/bench/results.json, one JSON object per line.  Compare
+#  the files from two builds to look for regressions.
+#
+#	bench.micro	library code, via radbench
+#	bench.xlat	string expansion, via unittest
+#	bench.modcall	an authorize policy, via unittest
+#	bench.radiusd	a real server, under load from radclient -R
+#
+#  The inputs are fixed, so every run does the same work.  The
+#  numbers are only comparable between runs on the same machine.
+#
+SUBMAKEFILES := radbench.mk
+
+BENCH_FILES	:= xlat modcall
+BENCH_COUNT	?= 20000
+BENCH_PORT	?= 12380
+BENCH_RATE	?= 5000
+BENCH_SECONDS	?= 5
+
+#
+#  Create the output directory
+#
+.PHONY: $(BUILD_DIR)/tests/bench
+$(BUILD_DIR)/tests/bench:
+	@mkdir -p $@
+
+BENCH_MODULES	:= $(shell grep -- mods-enabled src/tests/bench/radiusd.conf  | sed 's,.*/,,')
+BENCH_RADDB	:= $(addprefix raddb/mods-enabled/,$(BENCH_MODULES))
+BENCH_LIBS	:= $(addsuffix .la,$(addprefix rlm_,$(BENCH_MODULES)))
+
+#
+#  All of the unlang benchmarks use the same input.
+#
+$(BUILD_DIR)/tests/bench/%.attrs: $(DIR)/default-input.attrs | $(BUILD_DIR)/tests/bench
+	@cp $< $@
+
+.PRECIOUS: $(BUILD_DIR)/tests/bench/%.attrs
+
+.PHONY: bench.micro
+bench.micro: $(TESTBINDIR)/radbench | $(BUILD_DIR)/tests/bench
+	@echo BENCH radbench
+	@$(TESTBIN)/radbench -D share > $(BUILD_DIR)/tests/bench/micro.json
+
+#
+#  The first pass checks the reply against the filter in the .attrs
+#  file, so a broken policy fails, rather than being timed.
+#
+BENCH_UNLANG	:= $(addprefix bench.,$(BENCH_FILES))
+
+.PHONY: $(BENCH_UNLANG)
+$(BENCH_UNLANG): bench.%: $(BUILD_DIR)/tests/bench/%.attrs $(TESTBINDIR)/unittest | $(BENCH_RADDB) $(BENCH_LIBS) build.raddb
+	@echo BENCH $*
+	@if ! BENCH=$* $(TESTBIN)/unittest -D share -d src/tests/bench/ -i $< -f $< -o /dev/null -b $(BENCH_COUNT) > $(BUILD_DIR)/tests/bench/$*.log 2>&1; then \
+		cat $(BUILD_DIR)/tests/bench/$*.log; \
+		echo "# $(BUILD_DIR)/tests/bench/$*.log"; \
+		exit 1; \
+	fi
+	@grep '^{' $(BUILD_DIR)/tests/bench/$*.log > $(BUILD_DIR)/tests/bench/$*.json
+
+.PHONY: bench.radiusd
+bench.radiusd: $(TESTBINDIR)/radiusd $(TESTBINDIR)/radclient | $(BENCH_RADDB) $(BENCH_LIBS) build.raddb $(BUILD_DIR)/tests/bench
+	@echo BENCH radiusd
+	@TESTBIN="$(TESTBIN)" OUTPUT=$(BUILD_DIR)/tests/bench sh src/tests/bench/macro.sh $(BENCH_PORT) $(BENCH_RATE) $(BENCH_SECONDS) > $(BUILD_DIR)/tests/bench/radiusd.json
+
+#
+#  Timings are disturbed by anything else running, so the
+#  benchmarks are run one at a time, even with "make -j".
+#
+.PHONY: bench
+bench:
+	@$(MAKE) --no-print-directory -j1 bench.micro $(BENCH_UNLANG) bench.radiusd
+	@cat $(addprefix $(BUILD_DIR)/tests/bench/,micro.json $(addsuffix .json,$(BENCH_FILES)) radiusd.json) > $(BUILD_DIR)/tests/bench/results.json
+	@cat $(BUILD_DIR)/tests/bench/results.json
+
+.PHONY: clean.tests.bench
+clean.tests.bench:
+	@rm -rf $(BUILD_DIR)/tests/bench/
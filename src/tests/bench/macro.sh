@@ -0,0 +1,66 @@
+#!/bin/sh
+#
+#  Run radiusd with the "modcall" policy, load it with radclient -R,
+#  and print the results as one line of JSON.
+#
+#  Usage: macro.sh <port> <rate> <seconds>
+#
+#  TESTBIN is the command prefix used to run the binaries from the
+#  build tree, and OUTPUT is where the logs are written.
+#
+: ${TESTBIN=./build/bin}
+: ${OUTPUT=./build/tests/bench}
+
+PORT=$1
+RATE=$2
+DURATION=$3
+SECRET=testing123
+
+rm -f $OUTPUT/radiusd.pid $OUTPUT/radiusd.log
+BENCH=modcall BENCH_PORT=$PORT $TESTBIN/radiusd -fP -d src/tests/bench -n macro -D share \
+	-l $OUTPUT/radiusd.log > /dev/null 2>&1 &
+
+#
+#  Wait for the server to answer.
+#
+TRIES=0
+until echo 'User-Name = "bob@example.com", User-Password = "hello", NAS-IP-Address = 192.0.2.1, Service-Type = Framed-User' | \
+	$TESTBIN/radclient -q -r 1 -t 1 -D share 127.0.0.1:$PORT auth $SECRET; do
+	TRIES=`expr $TRIES + 1`
+	if [ $TRIES -ge 10 ]; then
+		echo "radiusd did not start" >&2
+		tail -20 $OUTPUT/radiusd.log >&2
+		[ -f $OUTPUT/radiusd.pid ] && kill `cat $OUTPUT/radiusd.pid`
+		exit 1
+	fi
+	sleep 1
+done
+
+$TESTBIN/radclient -D share -f src/tests/bench/macro.attrs -R $RATE -L $DURATION -T 2 -N 4 -t 2 \
+	127.0.0.1:$PORT auth $SECRET > $OUTPUT/radclient.log
+
+kill `cat $OUTPUT/radiusd.pid`
+wait
+
+#
+#  Turn the radclient summary into JSON.
+#
+field() {
+	sed -n "s/^	$1 *: \([0-9]*\).*/\1/p" $OUTPUT/radclient.log
+}
+
+latency() {
+	X=`sed -n "s/^	min.* $1 \([0-9]*\).*/\1/p" $OUTPUT/radclient.log`
+	echo ${X:-0}
+}
+
+SENT=`field Sent`
+if [ "$SENT" = "" ]; then
+	echo "radclient failed" >&2
+	cat $OUTPUT/radclient.log >&2
+	exit 1
+fi
+
+echo "{\"benchmark\": \"radiusd\", \"rate\": $RATE, \"seconds\": $DURATION, \"sent\": $SENT," \
+	"\"received\": `field Received`, \"lost\": `field Lost`," \
+	"\"p50_usec\": `latency p50`, \"p99_usec\": `latency p99`, \"max_usec\": `latency max`}"
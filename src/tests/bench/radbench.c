@@ -0,0 +1,363 @@
+/*
+ * radbench.c	Microbenchmarks for the library code on the packet path.
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2026  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include <freeradius-devel/libradius.h>
+#include <freeradius-devel/conf.h>
+#include <freeradius-devel/heap.h>
+
+#ifdef HAVE_GETOPT_H
+#  include <getopt.h>
+#endif
+
+/*
+ *	Each benchmark prints one line of JSON to stdout:
+ *
+ *	{"benchmark": "rad_encode", "iterations": 100000, "ns_per_op": 812.4}
+ *
+ *	The inputs are fixed, and the keys are generated from the
+ *	iteration number, so every run does exactly the same work.
+ */
+static char const *secret = "testing123";
+static int iterations = 100000;
+
+static char const *packet_attrs =
+	"User-Name = \"bob@example.com\", "
+	"User-Password = \"hello\", "
+	"NAS-IP-Address = 192.0.2.1, "
+	"NAS-Port = 42, "
+	"NAS-Port-Type = Ethernet, "
+	"Service-Type = Framed-User, "
+	"Framed-Protocol = PPP, "
+	"Called-Station-Id = \"00-00-5e-00-53-00:ssid\", "
+	"Calling-Station-Id = \"00-00-5e-00-53-01\", "
+	"Acct-Session-Id = \"0123456789abcdef\", "
+	"Message-Authenticator = 0x00";
+
+typedef struct bench_node {
+	uint32_t	key;
+	int		heap;		//!< Position in the heap.
+} bench_node_t;
+
+static uint64_t bench_now(void)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+
+	return ((uint64_t) now.tv_sec * 1000000) + now.tv_usec;
+}
+
+static void bench_result(char const *name, int count, uint64_t start)
+{
+	uint64_t usec = bench_now() - start;
+
+	printf("{\"benchmark\": \"%s\", \"iterations\": %d, \"ns_per_op\": %.1f}\n",
+	       name, count, (usec * 1000.0) / count);
+	fflush(stdout);
+}
+
+static uint32_t node_hash(void const *data)
+{
+	return fr_hash(&((bench_node_t const *) data)->key, sizeof(uint32_t));
+}
+
+static int node_cmp(void const *one, void const *two)
+{
+	bench_node_t const *a = one, *b = two;
+
+	if (a->key < b->key) return -1;
+	if (a->key > b->key) return +1;
+
+	return 0;
+}
+
+static int bench_packet(void)
+{
+	int i;
+	RADIUS_PACKET *packet;
+	VALUE_PAIR *vps = NULL;
+	uint8_t *data;
+	size_t data_len;
+	uint64_t start;
+
+	packet = rad_alloc(NULL, false);
+	if (!packet) return -1;
+
+	if (userparse(packet, packet_attrs, &vps) == T_INVALID) {
+		fr_perror("radbench");
+		return -1;
+	}
+
+	packet->code = PW_CODE_ACCESS_REQUEST;
+	packet->id = 1;
+	packet->vps = vps;
+
+	start = bench_now();
+	for (i = 0; i < iterations; i++) {
+		TALLOC_FREE(packet->data);
+		if ((rad_encode(packet, NULL, secret) < 0) ||
+		    (rad_sign(packet, NULL, secret) < 0)) {
+			fr_perror("radbench");
+			return -1;
+		}
+	}
+	bench_result("rad_encode", iterations, start);
+
+	/*
+	 *	Decode the packet we just built, over and over.
+	 */
+	data = packet->data;
+	data_len = packet->data_len;
+	packet->vps = NULL;
+
+	start = bench_now();
+	for (i = 0; i < iterations; i++) {
+		if (rad_decode(packet, NULL, secret) < 0) {
+			fr_perror("radbench");
+			return -1;
+		}
+		pairfree(&packet->vps);
+		packet->data = data;
+		packet->data_len = data_len;
+	}
+	bench_result("rad_decode", iterations, start);
+
+	pairfree(&vps);
+	rad_free(&packet);
+
+	return 0;
+}
+
+static int bench_hash(bench_node_t *nodes)
+{
+	int i;
+	fr_hash_table_t *ht;
+	uint64_t start;
+
+	ht = fr_hash_table_create(node_hash, node_cmp, NULL);
+	if (!ht) return -1;
+
+	start = bench_now();
+	for (i = 0; i < iterations; i++) fr_hash_table_insert(ht, &nodes[i]);
+	bench_result("fr_hash_table_insert", iterations, start);
+
+	start = bench_now();
+	for (i = 0; i < iterations; i++) {
+		if (!fr_hash_table_finddata(ht, &nodes[i])) return -1;
+	}
+	bench_result("fr_hash_table_finddata", iterations, start);
+
+	start = bench_now();
+	for (i = 0; i < iterations; i++) fr_hash_table_delete(ht, &nodes[i]);
+	bench_result("fr_hash_table_delete", iterations, start);
+
+	fr_hash_table_free(ht);
+
+	return 0;
+}
+
+static int bench_rbtree(bench_node_t *nodes)
+{
+	int i;
+	rbtree_t *tree;
+	uint64_t start;
+
+	tree = rbtree_create(NULL, node_cmp, NULL, 0);
+	if (!tree) return -1;
+
+	start = bench_now();
+	for (i = 0; i < iterations; i++) rbtree_insert(tree, &nodes[i]);
+	bench_result("rbtree_insert", iterations, start);
+
+	start = bench_now();
+	for (i = 0; i < iterations; i++) {
+		if (!rbtree_finddata(tree, &nodes[i])) return -1;
+	}
+	bench_result("rbtree_finddata", iterations, start);
+
+	start = bench_now();
+	for (i = 0; i < iterations; i++) rbtree_deletebydata(tree, &nodes[i]);
+	bench_result("rbtree_deletebydata", iterations, start);
+
+	rbtree_free(tree);
+
+	return 0;
+}
+
+static int bench_heap(bench_node_t *nodes)
+{
+	int i;
+	fr_heap_t *hp;
+	uint64_t start;
+
+	hp = fr_heap_create(node_cmp, offsetof(bench_node_t, heap));
+	if (!hp) return -1;
+
+	start = bench_now();
+	for (i = 0; i < iterations; i++) fr_heap_insert(hp, &nodes[i]);
+	bench_result("fr_heap_insert", iterations, start);
+
+	start = bench_now();
+	for (i = 0; i < iterations; i++) fr_heap_extract(hp, fr_heap_peek(hp));
+	bench_result("fr_heap_extract", iterations, start);
+
+	fr_heap_delete(hp);
+
+	return 0;
+}
+
+/*
+ *	One request through the outgoing packet list: allocate an Id,
+ *	find the request from its reply, and free the Id.
+ */
+static int bench_packet_list(void)
+{
+	int i, sockfd;
+	fr_packet_list_t *pl;
+	fr_ipaddr_t ipaddr;
+	RADIUS_PACKET *packet, *reply, **packet_p;
+	uint64_t start;
+
+	memset(&ipaddr, 0, sizeof(ipaddr));
+	ipaddr.af = AF_INET;
+	ipaddr.ipaddr.ip4addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	sockfd = fr_socket(&ipaddr, 0);
+	if (sockfd < 0) {
+		fr_perror("radbench");
+		return -1;
+	}
+
+	pl = fr_packet_list_create(1);
+	if (!pl) return -1;
+
+	if (!fr_packet_list_socket_add(pl, sockfd, IPPROTO_UDP, &ipaddr, 1812, NULL)) {
+		fr_perror("radbench");
+		return -1;
+	}
+
+	packet = rad_alloc(NULL, false);
+	reply = rad_alloc(NULL, false);
+	if (!packet || !reply) return -1;
+
+	start = bench_now();
+	for (i = 0; i < iterations; i++) {
+		packet->id = -1;
+		packet->sockfd = -1;
+		packet->dst_ipaddr = ipaddr;
+		packet->dst_port = 1812;
+		packet->src_ipaddr.af = AF_UNSPEC;
+		packet->src_port = 0;
+
+		if (!fr_packet_list_id_alloc(pl, IPPROTO_UDP, &packet, NULL)) {
+			fr_perror("radbench");
+			return -1;
+		}
+
+		reply->sockfd = packet->sockfd;
+		reply->id = packet->id;
+		reply->src_ipaddr = packet->dst_ipaddr;
+		reply->src_port = packet->dst_port;
+		reply->dst_ipaddr = packet->src_ipaddr;
+		reply->dst_port = packet->src_port;
+
+		packet_p = fr_packet_list_find_byreply(pl, reply);
+		if (!packet_p || (*packet_p != packet)) return -1;
+
+		fr_packet_list_id_free(pl, packet, true);
+	}
+	bench_result("fr_packet_list", iterations, start);
+
+	rad_free(&reply);
+	rad_free(&packet);
+	fr_packet_list_free(pl);
+	close(sockfd);
+
+	return 0;
+}
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "Usage: radbench [options]\n");
+	fprintf(stderr, "  -D <dictdir>           Set main dictionary directory (defaults to " DICTDIR ").\n");
+	fprintf(stderr, "  -h                     Print usage help information.\n");
+	fprintf(stderr, "  -n <num>               Run each benchmark 'num' times (defaults to 100000).\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int c, i;
+	char const *dict_dir = DICTDIR;
+	bench_node_t *nodes;
+
+	while ((c = getopt(argc, argv, "D:hn:")) != EOF) switch (c) {
+		case 'D':
+			dict_dir = optarg;
+			break;
+
+		case 'n':
+			iterations = atoi(optarg);
+			if (iterations <= 0) usage();
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+
+	if (fr_check_lib_magic(RADIUSD_MAGIC_NUMBER) < 0) {
+		fr_perror("radbench");
+		exit(1);
+	}
+
+	if (dict_init(dict_dir, RADIUS_DICTIONARY) < 0) {
+		fr_perror("radbench");
+		exit(1);
+	}
+
+	/*
+	 *	Distinct keys, in a scrambled but fixed order.
+	 */
+	nodes = talloc_zero_array(NULL, bench_node_t, iterations);
+	if (!nodes) {
+		fprintf(stderr, "radbench: Out of memory\n");
+		exit(1);
+	}
+	for (i = 0; i < iterations; i++) nodes[i].key = (uint32_t) i * 2654435761U;
+
+	if ((bench_packet() < 0) ||
+	    (bench_hash(nodes) < 0) ||
+	    (bench_rbtree(nodes) < 0) ||
+	    (bench_heap(nodes) < 0) ||
+	    (bench_packet_list() < 0)) {
+		fprintf(stderr, "radbench: Benchmark failed\n");
+		exit(1);
+	}
+
+	talloc_free(nodes);
+	dict_free();
+
+	return 0;
+}
@@ -0,0 +1,6 @@
+TARGET		:= radbench
+SOURCES		:= radbench.c
+
+TGT_INSTALLDIR	:=
+TGT_PREREQS	:= libfreeradius-radius.a
+TGT_LDLIBS	:= $(LIBS)
@@ -0,0 +1,26 @@
+#
+#  Tests for rlm_cache
+#
+#	make tests.cache
+#
+#  starts a server which caches entries in memory, and checks that
+#  they're the same after being saved to the snapshot file, and
+#  loaded again.  See cache.sh.
+#
+CACHE_PORT	?= 12398
+
+#
+#  Create the output directory
+#
+.PHONY: $(BUILD_DIR)/tests/cache
+$(BUILD_DIR)/tests/cache:
+	@mkdir -p $@
+
+.PHONY: tests.cache
+tests.cache: $(TESTBINDIR)/radiusd $(TESTBINDIR)/radclient | rlm_cache.la build.raddb $(BUILD_DIR)/tests/cache
+	@echo TEST-CACHE
+	@TESTBIN="$(TESTBIN)" OUTPUT=$(BUILD_DIR)/tests/cache sh src/tests/cache/cache.sh $(CACHE_PORT)
+
+.PHONY: clean.tests.cache
+clean.tests.cache:
+	@rm -rf $(BUILD_DIR)/tests/cache/
@@ -0,0 +1,86 @@
+#!/bin/sh
+#
+#  Check that rlm_cache entries are the same after they've been
+#  saved to the snapshot file and loaded again, that expired entries
+#  aren't loaded, and that a damaged file is loaded up to the damage.
+#  Also that a request doesn't wait forever for another one to create
+#  an entry.
+#
+#  Usage: cache.sh <port>
+#
+#  OUTPUT is where the logs and the snapshot file are written.  See
+#  src/tests/server.sh.
+#
+NAME=cache
+PORT=$1
+
+CACHE_PORT=$PORT
+export CACHE_PORT
+
+. src/tests/server.sh
+
+SNAPSHOT=$OUTPUT/cache.snapshot
+
+#
+#  Send an Access-Request for a user, and check the reply against
+#  the attributes given on the command line.
+#
+send() {
+	USER=$1
+	shift
+	echo "User-Name = $USER" > $OUTPUT/packet
+	echo "$*" > $OUTPUT/filter
+	$TESTBIN/radclient -D share -r 1 -t 20 -f $OUTPUT/packet:$OUTPUT/filter 127.0.0.1:$PORT auth testing123 > $OUTPUT/radclient.log 2>&1
+}
+
+REPLY='Reply-Message == "cached for bob", Reply-Message == "second", Session-Timeout == 3600, Framed-IP-Address == 192.0.2.7, Class == 0x0102ff00, Tunnel-Type:1 == VLAN, Tunnel-Private-Group-Id:1 == "10", Tunnel-Private-Group-Id:2 == "20"'
+
+rm -f $OUTPUT/radiusd.pid $OUTPUT/radiusd.log $SNAPSHOT
+
+#
+#  The first request creates the entry, and the second finds it.
+#
+start
+send bob 'Reply-Message == "cached for bob"' || fail "Creating the entry for bob failed"
+send bob "$REPLY, Filter-Id == hit" || fail "The entry for bob was not found"
+send alice 'Reply-Message == "cached for alice"' || fail "Creating the entry for alice failed"
+
+#
+#  The entries are saved when the server exits, and loaded when it
+#  starts.  alice's entry has expired by then.
+#
+stop
+grep -q "Wrote 2 entries" $OUTPUT/radiusd.log || fail "The snapshot was not written"
+ls -l $SNAPSHOT | grep -q '^-rw-------' || fail "The snapshot can be read by other users"
+sleep 2
+start
+grep -q "Loaded 1 entries from .*, 1 had expired" $OUTPUT/radiusd.log || fail "The snapshot was not loaded"
+send bob "$REPLY, Filter-Id == hit" || fail "The entry for bob was different after a restart"
+
+#
+#  A damaged file is loaded up to the damage, and the server still
+#  starts.
+#
+stop
+SIZE=`wc -c < $SNAPSHOT`
+dd if=$SNAPSHOT of=$SNAPSHOT.tmp bs=1 count=`expr $SIZE - 3` 2> /dev/null
+mv $SNAPSHOT.tmp $SNAPSHOT
+start
+grep -q "is truncated" $OUTPUT/radiusd.log || fail "The damaged snapshot was not noticed"
+grep -q "Loaded 0 entries" $OUTPUT/radiusd.log || fail "The damaged entry was loaded"
+: > $OUTPUT/radiusd.log
+send bob 'Reply-Message == "cached for bob"' || fail "The entry for bob was not created again"
+grep -q "Filter-Id" $OUTPUT/radiusd.log && fail "The damaged entry for bob was used"
+
+#
+#  A request which waits too long for another one to create an
+#  entry creates it itself.
+#
+echo "User-Name = slow" | \
+	$TESTBIN/radclient -D share -r 1 -t 20 127.0.0.1:$PORT auth testing123 > /dev/null 2>&1 &
+sleep 1
+send slow 'Reply-Message == "slow"' || fail "The second request for the slow entry failed"
+grep -q "Timed out waiting for another request" $OUTPUT/radiusd.log || fail "The second request didn't stop waiting"
+
+stop
+exit 0
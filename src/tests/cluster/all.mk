@@ -0,0 +1,26 @@
+#
+#  Tests for sharing home server state in a proxy cluster
+#
+#	make tests.cluster
+#
+#  starts a server with a cluster peer, sends it packets as the peer
+#  would, and checks that replayed packets are ignored.  See cluster.sh.
+#
+CLUSTER_PORT		?= 12392
+CLUSTER_HOME_PORT	?= 12393
+
+#
+#  Create the output directory
+#
+.PHONY: $(BUILD_DIR)/tests/cluster
+$(BUILD_DIR)/tests/cluster:
+	@mkdir -p $@
+
+.PHONY: tests.cluster
+tests.cluster: $(TESTBINDIR)/radiusd | build.raddb $(BUILD_DIR)/tests/cluster
+	@echo TEST-CLUSTER
+	@TESTBIN="$(TESTBIN)" OUTPUT=$(BUILD_DIR)/tests/cluster sh src/tests/cluster/cluster.sh $(CLUSTER_PORT) $(CLUSTER_HOME_PORT)
+
+.PHONY: clean.tests.cluster
+clean.tests.cluster:
+	@rm -rf $(BUILD_DIR)/tests/cluster/
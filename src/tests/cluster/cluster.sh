@@ -0,0 +1,90 @@
+#!/bin/sh
+#
+#  Check that the server acts on home server state sent by a cluster
+#  peer, and ignores packets which are replayed.
+#
+#  Usage: cluster.sh <cluster port> <home server port>
+#
+#  OUTPUT is where the logs are written.  See src/tests/server.sh.
+#
+NAME=cluster
+PORT=$1
+HOME_PORT=$2
+NOW=`date +%s`
+
+CLUSTER_PORT=$PORT
+CLUSTER_HOME_PORT=$HOME_PORT
+export CLUSTER_PORT CLUSTER_HOME_PORT
+
+. src/tests/server.sh
+
+#
+#  Send a packet from the peer, and give the server time to read it.
+#
+send() {
+	perl src/tests/cluster/send.pl 127.0.0.2 127.0.0.1 $PORT cluster123 $1 $NOW $2 $3 home1 || \
+		fail "Failed sending cluster packet"
+	sleep 1
+}
+
+#
+#  Check how many times a message has been logged.
+#
+count() {
+	n=`grep -c "$1" $OUTPUT/radiusd.log`
+	[ "$n" = "$2" ] || fail "Expected \"$1\" $2 time(s), got $n"
+}
+
+DEAD=3
+ALIVE=1
+
+rm -f $OUTPUT/radiusd.pid $OUTPUT/radiusd.log
+
+#
+#  The cluster timer is always pending, so the server never says
+#  "Ready to process requests".
+#
+start "Waking up in"
+
+send 1000 1 $DEAD
+count "reports home server home1 as dead" 1
+
+send 1000 2 $ALIVE
+count "reports home server home1 as alive" 1
+
+#
+#  The same packet again.
+#
+send 1000 1 $DEAD
+count "reports home server home1 as dead" 1
+count "Replayed" 1
+
+#
+#  Out of order, but not seen before.
+#
+send 1000 4 $DEAD
+send 1000 3 $ALIVE
+count "reports home server home1 as dead" 2
+count "reports home server home1 as alive" 2
+count "Replayed" 1
+
+send 1000 4 $DEAD
+count "Replayed" 2
+
+#
+#  Too far behind the highest sequence number.
+#
+send 1000 100 $DEAD
+send 1000 20 $ALIVE
+count "reports home server home1 as dead" 3
+count "Replayed" 3
+
+#
+#  The peer restarted, and has a new ID.
+#
+send 2000 1 $ALIVE
+count "reports home server home1 as alive" 3
+count "Replayed" 3
+
+stop
+exit 0
@@ -0,0 +1,33 @@
+#!/usr/bin/env perl
+#
+#  Send one cluster packet to the server, as a peer would.
+#
+#  Usage: send.pl <src ip> <dst ip> <port> <secret> <node> <time> <seq> <state> <home server>
+#
+#  <state> is 1 for alive, 2 for zombie, and 3 for dead.  The home
+#  server is an auth one.
+#
+use strict;
+use warnings;
+use IO::Socket::INET;
+use Digest::MD5 qw(md5);
+
+sub hmac_md5 {
+	my ($data, $key) = @_;
+
+	$key = md5($key) if (length($key) > 64);
+	$key .= "\0" x (64 - length($key));
+
+	return md5(($key ^ ("\x5c" x 64)) . md5(($key ^ ("\x36" x 64)) . $data));
+}
+
+my ($src, $dst, $port, $secret, $node, $time, $seq, $state, $name) = @ARGV;
+die "Usage: $0 <src ip> <dst ip> <port> <secret> <node> <time> <seq> <state> <home server>\n" unless defined $name;
+
+my $packet = "FRc2" . pack("NNN", $node, $time, $seq) . ("\0" x 16) .
+	pack("CCCN", $state, 1, length($name), 0) . $name;
+substr($packet, 16, 16) = hmac_md5($packet, $secret);
+
+my $sock = IO::Socket::INET->new(LocalAddr => $src, PeerAddr => "$dst:$port", Proto => 'udp')
+	or die "Failed opening socket: $!\n";
+$sock->send($packet) or die "Failed sending: $!\n";
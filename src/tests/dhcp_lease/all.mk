@@ -0,0 +1,30 @@
+#
+#  Tests for rlm_dhcp_lease
+#
+#	make tests.dhcp_lease
+#
+#  starts a DHCP server which hands out addresses from a subnet of
+#  three, and checks them with dhcpclient.  See dhcp_lease.sh.
+#
+DHCP_LEASE_PORT	?= 12386
+
+#
+#  Create the output directory
+#
+.PHONY: $(BUILD_DIR)/tests/dhcp_lease
+$(BUILD_DIR)/tests/dhcp_lease:
+	@mkdir -p $@
+
+.PHONY: tests.dhcp_lease
+ifneq "$(AC_WITH_DHCP)" ""
+tests.dhcp_lease: $(TESTBINDIR)/radiusd $(TESTBINDIR)/dhcpclient | rlm_dhcp_lease.la build.raddb $(BUILD_DIR)/tests/dhcp_lease
+	@echo TEST-DHCP-LEASE
+	@TESTBIN="$(TESTBIN)" OUTPUT=$(BUILD_DIR)/tests/dhcp_lease sh src/tests/dhcp_lease/dhcp_lease.sh $(DHCP_LEASE_PORT)
+else
+tests.dhcp_lease:
+	@echo "TEST-DHCP-LEASE skipped, the server was built without DHCP"
+endif
+
+.PHONY: clean.tests.dhcp_lease
+clean.tests.dhcp_lease:
+	@rm -rf $(BUILD_DIR)/tests/dhcp_lease/
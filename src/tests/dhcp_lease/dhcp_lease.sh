@@ -0,0 +1,117 @@
+#!/bin/sh
+#
+#  Check that rlm_dhcp_lease offers and acks each address to one
+#  client, offers a client the address it had before, NAKs requests
+#  for addresses other clients have, gives addresses back on Release
+#  and Decline, and keeps its leases across a restart.
+#
+#  Usage: dhcp_lease.sh <port>
+#
+#  OUTPUT is where the logs and the journal are written.  See
+#  src/tests/server.sh.
+#
+NAME=dhcp_lease
+PORT=$1
+
+DHCP_LEASE_PORT=$PORT
+export DHCP_LEASE_PORT
+
+. src/tests/server.sh
+
+JOURNAL=$OUTPUT/dhcp_lease.journal
+
+#
+#  Send a DHCP packet from client <n>, and print the reply type and
+#  the address in it, e.g. "Offer 192.0.2.10", or "none" if there's
+#  no reply.  They're taken from the reply which dhcpclient prints
+#  with -x, where the attributes are indented with a tab.
+#
+#  Usage: dhcp <type> <n> [attributes]
+#
+dhcp() {
+	type=$1
+	mac=02:00:00:00:00:0$2
+	shift 2
+	( echo "DHCP-Client-Hardware-Address = $mac"
+	  echo "DHCP-Transaction-Id = $$"
+	  for attr in "$@"; do echo "$attr"; done ) > $OUTPUT/packet
+
+	$TESTBIN/dhcpclient -d share -D share -x -t 2 -f $OUTPUT/packet 127.0.0.1:$PORT $type > $OUTPUT/dhcpclient.log 2>&1
+
+	awk '/^\tDHCP-Message-Type / { sub("DHCP-", "", $3); code = $3 }
+	/^\tDHCP-Your-IP-Address / { yiaddr = $3 }
+	END {
+		if (code == "") print "none"
+		else if (yiaddr == "0.0.0.0") print code
+		else print code, yiaddr
+	}' $OUTPUT/dhcpclient.log
+}
+
+#
+#  Check the reply to a packet.
+#
+#  Usage: expect "<reply>" <type> <n> [attributes]
+#
+expect() {
+	want=$1
+	shift
+	got=`dhcp "$@"`
+	[ "$got" = "$want" ] || fail "Expected \"$want\" for $1 from client $2, got \"$got\""
+}
+
+rm -f $OUTPUT/radiusd.pid $OUTPUT/radiusd.log $JOURNAL
+
+start
+
+#
+#  Client 1 is offered an address, and gets it.
+#
+expect "Offer 192.0.2.10" discover 1
+expect "Ack 192.0.2.10" request 1 "DHCP-Requested-IP-Address = 192.0.2.10"
+
+#
+#  The other two addresses are offered to clients 2 and 3, and then
+#  there are none left.  A returning client is offered its address.
+#
+expect "Offer 192.0.2.11" discover 2
+expect "Offer 192.0.2.12" discover 3
+expect "none" discover 4
+expect "Offer 192.0.2.10" discover 1
+
+#
+#  Client 4 can't have addresses which were acked or offered to
+#  another client, or which aren't in the range.
+#
+expect "NAK" request 4 "DHCP-Requested-IP-Address = 192.0.2.10"
+expect "NAK" request 4 "DHCP-Requested-IP-Address = 192.0.2.11"
+expect "NAK" request 4 "DHCP-Requested-IP-Address = 192.0.2.13"
+expect "Ack 192.0.2.11" request 2 "DHCP-Requested-IP-Address = 192.0.2.11"
+
+#
+#  An address which is given back can be used by someone else.
+#
+dhcp release 1 "DHCP-Client-IP-Address = 192.0.2.10" > /dev/null
+expect "Offer 192.0.2.10" discover 4
+expect "Ack 192.0.2.10" request 4 "DHCP-Requested-IP-Address = 192.0.2.10"
+
+#
+#  A declined address isn't offered again until it expires.
+#
+dhcp decline 3 "DHCP-Requested-IP-Address = 192.0.2.12" > /dev/null
+expect "none" discover 3
+
+#
+#  The acks are in the journal, and are read back on start.  The
+#  offers aren't, so client 3 could have had 192.0.2.12, but it
+#  declined it, and that is in the journal, too.
+#
+stop
+[ -s $JOURNAL ] || fail "The journal wasn't written"
+start
+expect "Offer 192.0.2.11" discover 2
+expect "Offer 192.0.2.10" discover 4
+expect "NAK" request 1 "DHCP-Requested-IP-Address = 192.0.2.11"
+expect "none" discover 1
+
+stop
+exit 0
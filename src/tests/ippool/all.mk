@@ -0,0 +1,25 @@
+#
+#  Tests for rlm_ippool
+#
+#	make tests.ippool
+#
+#  starts a server which allocates addresses from a small pool, and
+#  checks the pool file with rlm_ippool_tool.  See ippool.sh.
+#
+IPPOOL_PORT	?= 12396
+
+#
+#  Create the output directory
+#
+.PHONY: $(BUILD_DIR)/tests/ippool
+$(BUILD_DIR)/tests/ippool:
+	@mkdir -p $@
+
+.PHONY: tests.ippool
+tests.ippool: $(TESTBINDIR)/radiusd $(TESTBINDIR)/radclient $(TESTBINDIR)/rlm_ippool_tool | rlm_ippool.la build.raddb $(BUILD_DIR)/tests/ippool
+	@echo TEST-IPPOOL
+	@TESTBIN="$(TESTBIN)" OUTPUT=$(BUILD_DIR)/tests/ippool sh src/tests/ippool/ippool.sh $(IPPOOL_PORT)
+
+.PHONY: clean.tests.ippool
+clean.tests.ippool:
+	@rm -rf $(BUILD_DIR)/tests/ippool/
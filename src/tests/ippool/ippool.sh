@@ -0,0 +1,121 @@
+#!/bin/sh
+#
+#  Check that rlm_ippool hands out each address once, gives them
+#  back on Accounting-Stop, gives a key the address it had before,
+#  and keeps its allocations across a clean restart, and across a
+#  crash (when the index is rebuilt from the entries).
+#
+#  Usage: ippool.sh <port>
+#
+#  Accounting is sent to <port> + 1.
+#
+#  OUTPUT is where the logs and the pool file are written.  See
+#  src/tests/server.sh.
+#
+NAME=ippool
+PORT=$1
+ACCT_PORT=`expr $PORT + 1`
+
+IPPOOL_PORT=$PORT
+IPPOOL_ACCT_PORT=$ACCT_PORT
+export IPPOOL_PORT IPPOOL_ACCT_PORT
+
+. src/tests/server.sh
+
+POOL=$OUTPUT/db.ippool
+
+#
+#  Send an Access-Request for a NAS-Port, and print the address
+#  which was allocated.  radclient doesn't print the reply
+#  attributes, so the address is taken from the server's log.
+#  This runs in a subshell, so it prints nothing rather than
+#  failing.
+#
+allocate() {
+	: > $OUTPUT/radiusd.log
+	echo "User-Name = bob, NAS-IP-Address = 127.0.0.1, NAS-Port = $1" | \
+		$TESTBIN/radclient -D share -r 1 -t 2 127.0.0.1:$PORT auth testing123 > $OUTPUT/radclient.log 2>&1 && \
+		sed -n 's/.*Allocated ip \([0-9.]*\) to client key.*/\1/p' $OUTPUT/radiusd.log
+}
+
+release() {
+	echo "User-Name = bob, NAS-IP-Address = 127.0.0.1, NAS-Port = $1, Acct-Status-Type = Stop, Acct-Session-Id = $1" | \
+		$TESTBIN/radclient -D share -r 1 -t 2 127.0.0.1:$ACCT_PORT acct testing123 > $OUTPUT/radclient.log 2>&1 || \
+		fail "No reply to the Accounting-Stop for port $1"
+}
+
+#
+#  Check the number of active entries in the pool file.
+#
+active() {
+	num=`$TESTBIN/rlm_ippool_tool -c $POOL | tail -1`
+	[ "$num" = "$1" ] || fail "Expected $1 active entries, got \"$num\""
+}
+
+rm -f $OUTPUT/radiusd.pid $OUTPUT/radiusd.log $POOL
+
+start
+
+#
+#  Every address is handed out once, and then there are none left.
+#
+ADDRS=
+for i in 1 2 3 4; do
+	ADDR=`allocate $i`
+	[ -n "$ADDR" ] || fail "No address was allocated for port $i"
+	for a in $ADDRS; do
+		[ "$a" != "$ADDR" ] || fail "$ADDR was allocated twice"
+	done
+	ADDRS="$ADDRS $ADDR"
+done
+set -- $ADDRS
+active 4
+
+ADDR=`allocate 5`
+[ -z "$ADDR" ] || fail "Port 5 was given $ADDR from a full pool"
+grep -q "No available ip addresses in pool" $OUTPUT/radiusd.log || fail "The pool was not full"
+
+#
+#  The file can't be changed while the server is using it.
+#
+$TESTBIN/rlm_ippool_tool -r $POOL | grep -q "is in use" || fail "rlm_ippool_tool changed a file in use"
+
+#
+#  A stopped session's address can be given to someone else.
+#
+release 2
+active 3
+ADDR=`allocate 5`
+[ "$ADDR" = "$2" ] || fail "Expected port 5 to get $2, got \"$ADDR\""
+
+#
+#  A key which asks again gets the same address.
+#
+ADDR=`allocate 1`
+[ "$ADDR" = "$1" ] || fail "Expected port 1 to keep $1, got \"$ADDR\""
+active 4
+
+#
+#  After a clean restart, the file is used as it is.
+#
+stop
+active 4
+start
+grep -q "was not closed cleanly" $OUTPUT/radiusd.log && fail "The index was rebuilt after a clean restart"
+ADDR=`allocate 3`
+[ "$ADDR" = "$3" ] || fail "Expected port 3 to keep $3 after a restart, got \"$ADDR\""
+
+#
+#  After a crash, the index is rebuilt from the entries.
+#
+stop -9
+active 4
+start
+grep -q "was not closed cleanly" $OUTPUT/radiusd.log || fail "The index was not rebuilt after a crash"
+ADDR=`allocate 4`
+[ "$ADDR" = "$4" ] || fail "Expected port 4 to keep $4 after a crash, got \"$ADDR\""
+release 4
+active 3
+
+stop
+exit 0
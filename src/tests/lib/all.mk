@@ -0,0 +1,14 @@
+#
+#  Tests for the library code
+#
+#	make tests.lib
+#
+#  runs libtest, which calls the functions directly.  Each test is
+#  in its own file, and "libtest <name> ..." runs only those tests.
+#
+SUBMAKEFILES := libtest.mk
+
+.PHONY: tests.lib
+tests.lib: $(TESTBINDIR)/libtest
+	@echo TEST-LIB
+	@$(TESTBIN)/libtest -D share
@@ -0,0 +1,146 @@
+/*
+ * clock.c	Tests for the cached clock.
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2026  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include "libtest.h"
+
+#define USEC (1000000)
+
+static int64_t clock_usec(struct timeval const *tv)
+{
+	return ((int64_t) tv->tv_sec * USEC) + tv->tv_usec;
+}
+
+/*
+ *	Whether the cached wall clock is within "slop" microseconds
+ *	of the system clock.
+ */
+static bool clock_near(int64_t slop)
+{
+	struct timeval cached, now;
+
+	fr_clock_gettime(&cached);
+	gettimeofday(&now, NULL);
+
+	return (clock_usec(&now) - clock_usec(&cached) <= slop) &&
+	       (clock_usec(&cached) - clock_usec(&now) <= slop);
+}
+
+/*
+ *	A thread which hasn't called fr_clock_update() reads the
+ *	system clock every time.
+ */
+static int clock_uncached(void)
+{
+	uint64_t	mono;
+
+	TEST_CHECK(clock_near(USEC / 10));
+
+	mono = fr_clock_monotonic();
+	usleep(20000);
+	TEST_CHECK(fr_clock_monotonic() >= mono + 20000);
+	TEST_CHECK(clock_near(USEC / 10));
+
+	return 0;
+}
+
+#ifdef HAVE_PTHREAD_H
+static void *clock_thread(void *arg)
+{
+	int *rcode = arg;
+
+	*rcode = clock_uncached();
+	if (*rcode < 0) return NULL;
+
+	/*
+	 *	This thread's copy doesn't change the other's.
+	 */
+	fr_clock_update();
+
+	return NULL;
+}
+#endif
+
+int test_clock(void)
+{
+	struct timeval	one, two;
+	uint64_t	mono;
+
+#ifdef HAVE_PTHREAD_H
+	pthread_t	thread;
+	int		rcode = -1;
+
+	/*
+	 *	Run in a new thread, in case another test updated
+	 *	the clock in this one.
+	 */
+	TEST_CHECK(pthread_create(&thread, NULL, clock_thread, &rcode) == 0);
+	TEST_CHECK(pthread_join(thread, NULL) == 0);
+	TEST_CHECK(rcode == 0);
+#endif
+
+	/*
+	 *	After an update, the time stays the same until the
+	 *	next one.
+	 */
+	fr_clock_update();
+	fr_clock_gettime(&one);
+	mono = fr_clock_monotonic();
+	TEST_CHECK(clock_near(USEC / 10));
+
+	usleep(50000);
+	fr_clock_gettime(&two);
+	TEST_CHECK(clock_usec(&one) == clock_usec(&two));
+	TEST_CHECK(fr_clock_monotonic() == mono);
+	TEST_CHECK(fr_clock_time() == one.tv_sec);
+
+#ifdef HAVE_PTHREAD_H
+	TEST_CHECK(pthread_create(&thread, NULL, clock_thread, &rcode) == 0);
+	TEST_CHECK(pthread_join(thread, NULL) == 0);
+	TEST_CHECK(rcode == 0);
+
+	fr_clock_gettime(&two);
+	TEST_CHECK(clock_usec(&one) == clock_usec(&two));
+	TEST_CHECK(fr_clock_monotonic() == mono);
+#endif
+
+	fr_clock_update();
+	fr_clock_gettime(&two);
+	TEST_CHECK(clock_usec(&two) - clock_usec(&one) >= 50000);
+	TEST_CHECK(fr_clock_monotonic() - mono >= 50000);
+	TEST_CHECK(clock_near(USEC / 10));
+
+	/*
+	 *	The coarse clocks are only as good as the kernel
+	 *	tick, which is at most 10ms on any sane system.
+	 */
+	fr_clock_coarse(true);
+	mono = fr_clock_monotonic();
+	usleep(50000);
+	fr_clock_update();
+	TEST_CHECK(clock_near(USEC / 10));
+	TEST_CHECK(fr_clock_monotonic() - mono >= 40000);
+	fr_clock_coarse(false);
+
+	return 0;
+}
@@ -0,0 +1,292 @@
+/*
+ * dns.c	Tests for the DNS cache.
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2026  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include "libtest.h"
+
+#include <netdb.h>
+
+/*
+ *	This getaddrinfo() is used instead of the one in libc, so the
+ *	tests don't need a resolver, and can count the lookups.
+ *
+ *	"host-<n>.test" is 192.0.2.<n>, or 2001:db8::<n> for AF_INET6.
+ *	"slow-<n>.test" is the same, but isn't answered between
+ *	dns_hold() and dns_release().  Anything else isn't found.
+ */
+static int		lookups = 0;
+static bool		released = true;
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t	dns_test_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	dns_test_cond = PTHREAD_COND_INITIALIZER;
+#endif
+
+int getaddrinfo(char const *node, UNUSED char const *service, struct addrinfo const *hints, struct addrinfo **res)
+{
+	struct addrinfo		*ai;
+	struct sockaddr_storage	*sa;
+	unsigned int		n;
+	char			type[8];
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&dns_test_mutex);
+	lookups++;
+	if (strncmp(node, "slow-", 5) == 0) {
+		while (!released) pthread_cond_wait(&dns_test_cond, &dns_test_mutex);
+	}
+	pthread_mutex_unlock(&dns_test_mutex);
+#else
+	lookups++;
+#endif
+
+	if ((sscanf(node, "%4[a-z]-%u.test", type, &n) != 2) || (n > 255) ||
+	    ((strcmp(type, "host") != 0) && (strcmp(type, "slow") != 0))) {
+		return EAI_NONAME;
+	}
+
+	ai = calloc(1, sizeof(*ai) + sizeof(*sa));
+	if (!ai) return EAI_MEMORY;
+	sa = (struct sockaddr_storage *) (ai + 1);
+
+	if (hints && (hints->ai_family == AF_INET6)) {
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) sa;
+
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_addr.s6_addr[0] = 0x20;
+		sin6->sin6_addr.s6_addr[1] = 0x01;
+		sin6->sin6_addr.s6_addr[2] = 0x0d;
+		sin6->sin6_addr.s6_addr[3] = 0xb8;
+		sin6->sin6_addr.s6_addr[15] = n;
+		ai->ai_addrlen = sizeof(*sin6);
+	} else {
+		struct sockaddr_in *sin = (struct sockaddr_in *) sa;
+
+		sin->sin_family = AF_INET;
+		sin->sin_addr.s_addr = htonl(0xc0000200 | n);
+		ai->ai_addrlen = sizeof(*sin);
+	}
+
+	ai->ai_family = sa->ss_family;
+	ai->ai_addr = (struct sockaddr *) sa;
+	*res = ai;
+
+	return 0;
+}
+
+void freeaddrinfo(struct addrinfo *res)
+{
+	free(res);
+}
+
+static int dns_lookups(void)
+{
+	int count;
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&dns_test_mutex);
+#endif
+	count = lookups;
+	lookups = 0;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_unlock(&dns_test_mutex);
+#endif
+
+	return count;
+}
+
+#ifdef HAVE_PTHREAD_H
+static void dns_hold(void)
+{
+	pthread_mutex_lock(&dns_test_mutex);
+	released = false;
+	pthread_mutex_unlock(&dns_test_mutex);
+}
+
+static void dns_release(void)
+{
+	pthread_mutex_lock(&dns_test_mutex);
+	released = true;
+	pthread_cond_broadcast(&dns_test_cond);
+	pthread_mutex_unlock(&dns_test_mutex);
+}
+
+static bool dns_readable(int fd, int timeout)
+{
+	fd_set		fds;
+	struct timeval	tv;
+
+	FD_ZERO(&fds);
+	FD_SET(fd, &fds);
+	tv.tv_sec = timeout;
+	tv.tv_usec = 0;
+
+	return (select(fd + 1, &fds, NULL, NULL, &tv) > 0);
+}
+#endif
+
+/*
+ *	Whether a lookup of the name found 192.0.2.<n>.  The lookups
+ *	of other families are checked in test_dns_cache().
+ */
+static bool dns_is(char const *name, unsigned int n)
+{
+	fr_ipaddr_t ipaddr;
+
+	if (fr_dns_lookup(&ipaddr, AF_INET, name, false) < 0) return false;
+
+	return (ipaddr.af == AF_INET) && (ipaddr.ipaddr.ip4addr.s_addr == htonl(0xc0000200 | n));
+}
+
+int test_dns_cache(void)
+{
+	fr_ipaddr_t	ipaddr;
+
+	/*
+	 *	Without the cache, every lookup is done.
+	 */
+	TEST_CHECK(fr_dns_cache_init(0, 300, 30, 0, 0) == 0);
+	TEST_CHECK(dns_is("host-1.test", 1));
+	TEST_CHECK(dns_is("host-1.test", 1));
+	TEST_CHECK(dns_lookups() == 2);
+
+	/*
+	 *	With it, the address is remembered, and so is the
+	 *	failure to find one.  Names are case insensitive, and
+	 *	each address family is looked up separately.
+	 */
+	TEST_CHECK(fr_dns_cache_init(3, 300, 30, 0, 0) == 0);
+	TEST_CHECK(dns_is("host-1.test", 1));
+	TEST_CHECK(dns_is("host-1.test", 1));
+	TEST_CHECK(dns_is("HOST-1.Test", 1));
+	TEST_CHECK(dns_lookups() == 1);
+
+	TEST_CHECK(fr_dns_lookup(&ipaddr, AF_INET, "missing.test", false) < 0);
+	TEST_CHECK(fr_dns_lookup(&ipaddr, AF_INET, "missing.test", false) < 0);
+	TEST_CHECK(dns_lookups() == 1);
+
+	TEST_CHECK(fr_dns_lookup(&ipaddr, AF_INET6, "host-1.test", false) == 0);
+	TEST_CHECK((ipaddr.af == AF_INET6) && (ipaddr.ipaddr.ip6addr.s6_addr[15] == 1));
+	TEST_CHECK(dns_lookups() == 1);
+
+	/*
+	 *	Addresses aren't looked up, or cached.
+	 */
+	TEST_CHECK(fr_dns_lookup(&ipaddr, AF_INET, "192.0.2.99", false) == 0);
+	TEST_CHECK(ipaddr.ipaddr.ip4addr.s_addr == htonl(0xc0000263));
+	TEST_CHECK(fr_dns_lookup(&ipaddr, AF_INET6, "2001:db8::99", false) == 0);
+	TEST_CHECK(ipaddr.af == AF_INET6);
+	TEST_CHECK(dns_lookups() == 0);
+
+	/*
+	 *	When it's full, the least recently used name is
+	 *	forgotten.  Here that's "missing.test", as "host-1.test"
+	 *	has just been used.
+	 */
+	TEST_CHECK(dns_is("host-1.test", 1));
+	TEST_CHECK(dns_is("host-2.test", 2));
+	TEST_CHECK(dns_lookups() == 1);
+	TEST_CHECK(dns_is("host-1.test", 1));
+	TEST_CHECK(fr_dns_lookup(&ipaddr, AF_INET6, "host-1.test", false) == 0);
+	TEST_CHECK(dns_lookups() == 0);
+	TEST_CHECK(fr_dns_lookup(&ipaddr, AF_INET, "missing.test", false) < 0);
+	TEST_CHECK(dns_lookups() == 1);
+
+	/*
+	 *	Setting it up again forgets everything.
+	 */
+	TEST_CHECK(fr_dns_cache_init(3, 1, 1, 0, 0) == 0);
+	TEST_CHECK(dns_is("host-1.test", 1));
+	TEST_CHECK(dns_lookups() == 1);
+
+	/*
+	 *	Names are looked up again when they expire.
+	 */
+	sleep(2);
+	TEST_CHECK(dns_is("host-1.test", 1));
+	TEST_CHECK(dns_lookups() == 1);
+
+#ifdef HAVE_PTHREAD_H
+	{
+		fr_dns_query_t	*one = NULL, *two = NULL;
+		fr_ipaddr_t	other;
+
+		/*
+		 *	Asynchronous lookups don't wait for the answer,
+		 *	and a second lookup of the same name shares the
+		 *	first one's query.
+		 */
+		TEST_CHECK(fr_dns_cache_init(3, 300, 30, 0, 2) == 0);
+		dns_hold();
+		TEST_CHECK(fr_dns_lookup_async(&ipaddr, AF_INET, "slow-3.test", false, &one) == 1);
+		TEST_CHECK(fr_dns_lookup_async(&other, AF_INET, "slow-3.test", false, &two) == 1);
+		TEST_CHECK(one == two);
+		TEST_CHECK(!dns_readable(fr_dns_query_fd(one), 0));
+		TEST_CHECK(fr_dns_query_result(&ipaddr, one) == 1);
+
+		dns_release();
+		TEST_CHECK(dns_readable(fr_dns_query_fd(one), 5));
+		TEST_CHECK(fr_dns_query_result(&ipaddr, one) == 0);
+		TEST_CHECK(fr_dns_query_result(&other, two) == 0);
+		TEST_CHECK(ipaddr.ipaddr.ip4addr.s_addr == htonl(0xc0000203));
+		TEST_CHECK(fr_ipaddr_cmp(&ipaddr, &other) == 0);
+		TEST_CHECK(dns_lookups() == 1);
+
+		/*
+		 *	The answer is cached, so there's nothing to
+		 *	wait for.
+		 */
+		two = NULL;
+		TEST_CHECK(fr_dns_lookup_async(&ipaddr, AF_INET, "slow-3.test", false, &two) == 0);
+		TEST_CHECK(!two);
+		TEST_CHECK(ipaddr.ipaddr.ip4addr.s_addr == htonl(0xc0000203));
+		TEST_CHECK(dns_lookups() == 0);
+
+		/*
+		 *	A name which is used shortly before it expires
+		 *	is looked up again in the background.  The user
+		 *	gets the cached address without waiting, and
+		 *	the new answer is cached after the old one
+		 *	would have expired.
+		 */
+		TEST_CHECK(fr_dns_cache_init(3, 3, 30, 2, 2) == 0);
+		TEST_CHECK(dns_is("slow-4.test", 4));
+		TEST_CHECK(dns_lookups() == 1);
+
+		dns_hold();
+		sleep(2);
+		TEST_CHECK(dns_is("slow-4.test", 4));
+		usleep(200000);
+		TEST_CHECK(dns_lookups() == 1);
+		dns_release();
+
+		sleep(2);
+		two = NULL;
+		TEST_CHECK(fr_dns_lookup_async(&ipaddr, AF_INET, "slow-4.test", false, &two) == 0);
+		TEST_CHECK(!two);
+	}
+#endif
+
+	TEST_CHECK(fr_dns_cache_init(0, 300, 30, 0, 0) == 0);
+
+	return 0;
+}
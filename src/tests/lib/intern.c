@@ -0,0 +1,305 @@
+/*
+ * intern.c	Tests for shared attribute values.
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2026  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include "libtest.h"
+
+/*
+ *	As in intern.c
+ */
+#define INTERN_MAX_ENTRIES	(1024)
+
+/*
+ *	The entries are private to intern.c, so we find out when one
+ *	is freed by giving it a child with a destructor.
+ */
+typedef struct intern_marker {
+	bool	*freed;
+} intern_marker_t;
+
+static int _intern_marker_free(intern_marker_t *marker)
+{
+	*marker->freed = true;
+
+	return 0;
+}
+
+static void intern_mark(void const *value, bool *freed)
+{
+	intern_marker_t *marker;
+
+	*freed = false;
+
+	marker = talloc(talloc_parent(value), intern_marker_t);
+	marker->freed = freed;
+	talloc_set_destructor(marker, _intern_marker_free);
+}
+
+static void const *intern_string(fr_intern_t *it, char const *value)
+{
+	return fr_intern_value(it, (uint8_t const *) value, strlen(value));
+}
+
+/*
+ *	Add "num" values which aren't used anywhere else, and release
+ *	them straight away.
+ */
+static int intern_fill(fr_intern_t *it, char const *prefix, int num)
+{
+	char		buffer[64];
+	void const	*value;
+	int		i;
+
+	for (i = 0; i < num; i++) {
+		snprintf(buffer, sizeof(buffer), "%s-%d", prefix, i);
+
+		value = intern_string(it, buffer);
+		TEST_CHECK(value != NULL);
+		fr_intern_release(value);
+	}
+
+	return 0;
+}
+
+static int intern_table(void)
+{
+	fr_intern_t	*it;
+	void const	*a, *b, *c, *p;
+	uint8_t		octets[4] = { 0x00, 0x01, 0x00, 0x02 };
+	char		*plain;
+	bool		a_freed, b_freed, c_freed;
+
+	TEST_CHECK(fr_intern_create(NULL, PW_TYPE_INTEGER) == NULL);
+
+	it = fr_intern_create(NULL, PW_TYPE_STRING);
+	TEST_CHECK(it != NULL);
+
+	/*
+	 *	The same value is the same buffer.
+	 */
+	a = intern_string(it, "alpha");
+	TEST_CHECK(a != NULL);
+	TEST_CHECK(strcmp(a, "alpha") == 0);
+	TEST_CHECK(fr_intern_is(a));
+
+	p = intern_string(it, "alpha");
+	TEST_CHECK(p == a);
+	fr_intern_release(p);
+
+	p = intern_string(it, "alphabet");
+	TEST_CHECK((p != NULL) && (p != a));
+	fr_intern_release(p);
+
+	p = fr_intern_value(it, (uint8_t const *) "alphabet", 5);
+	TEST_CHECK(p == a);
+	fr_intern_release(p);
+
+	TEST_CHECK(fr_intern_value(it, (uint8_t const *) "", 0) == NULL);
+
+	plain = talloc_typed_strdup(NULL, "alpha");
+	TEST_CHECK(!fr_intern_is(plain));
+	TEST_CHECK(!fr_intern_is(NULL));
+	talloc_free(plain);
+
+	/*
+	 *	From the least recently used: "alphabet", "a", "c",
+	 *	then "b".
+	 */
+	b = intern_string(it, "beta");
+	c = intern_string(it, "gamma");
+	TEST_CHECK(b && c);
+	intern_mark(a, &a_freed);
+	intern_mark(b, &b_freed);
+	intern_mark(c, &c_freed);
+
+	fr_intern_ref(a);
+	fr_intern_release(a);
+	fr_intern_release(c);
+
+	p = intern_string(it, "beta");
+	TEST_CHECK(p == b);
+	fr_intern_release(p);
+	fr_intern_release(b);
+
+	/*
+	 *	Fill the table up, without evicting anything.
+	 */
+	if (intern_fill(it, "fill", INTERN_MAX_ENTRIES - 4) < 0) return -1;
+	TEST_CHECK(!a_freed && !b_freed && !c_freed);
+
+	/*
+	 *	"alphabet" and "a" are evicted, but we still hold "a".
+	 */
+	if (intern_fill(it, "more", 2) < 0) return -1;
+	TEST_CHECK(!a_freed);
+	TEST_CHECK(strcmp(a, "alpha") == 0);
+
+	/*
+	 *	So looking it up again gives a new buffer.  That evicts
+	 *	"c", which nothing holds, so it's freed.  "b" was used
+	 *	more recently, so it stays.
+	 */
+	p = intern_string(it, "alpha");
+	TEST_CHECK((p != NULL) && (p != a));
+	fr_intern_release(p);
+	TEST_CHECK(c_freed);
+	TEST_CHECK(!b_freed);
+
+	fr_intern_release(a);
+	TEST_CHECK(a_freed);
+
+	/*
+	 *	Values outlive the table, while they're held.
+	 */
+	b = intern_string(it, "beta");
+	TEST_CHECK(b != NULL);
+	talloc_free(it);
+	TEST_CHECK(!b_freed);
+	TEST_CHECK(strcmp(b, "beta") == 0);
+	fr_intern_release(b);
+	TEST_CHECK(b_freed);
+
+	/*
+	 *	Octets aren't terminated.
+	 */
+	it = fr_intern_create(NULL, PW_TYPE_OCTETS);
+	TEST_CHECK(it != NULL);
+
+	a = fr_intern_value(it, octets, sizeof(octets));
+	TEST_CHECK(a != NULL);
+	TEST_CHECK(talloc_array_length((uint8_t const *) a) == sizeof(octets));
+	TEST_CHECK(memcmp(a, octets, sizeof(octets)) == 0);
+
+	p = fr_intern_value(it, octets, 2);
+	TEST_CHECK((p != NULL) && (p != a));
+	fr_intern_release(p);
+
+	fr_intern_release(a);
+	talloc_free(it);
+
+	return 0;
+}
+
+/*
+ *	Decode a value, as if it came from a packet.
+ */
+static VALUE_PAIR *intern_decode(DICT_ATTR const *da, char const *value)
+{
+	VALUE_PAIR *vp = NULL;
+
+	if (data2vp(NULL, NULL, NULL, NULL, da, (uint8_t const *) value,
+		    strlen(value), strlen(value), &vp) < 0) return NULL;
+
+	return vp;
+}
+
+static int intern_pairs(void)
+{
+	ATTR_FLAGS	flags;
+	DICT_ATTR const	*da;
+	VALUE_PAIR	*vp, *copy, *other;
+	char		buffer[64];
+	bool		freed;
+	int		i;
+
+	memset(&flags, 0, sizeof(flags));
+	flags.intern = 1;
+
+	da = dict_attrbyname("Test-Intern-String");
+	if (!da) {
+		TEST_CHECK(dict_addattr("Test-Intern-String", 3990, 0, PW_TYPE_STRING, flags) == 0);
+		da = dict_attrbyname("Test-Intern-String");
+	}
+	TEST_CHECK(da && da->intern);
+
+	/*
+	 *	Decoded values are shared, and copies share them too.
+	 */
+	vp = intern_decode(da, "nas1.example.com");
+	other = intern_decode(da, "nas1.example.com");
+	TEST_CHECK(vp && other);
+	TEST_CHECK(vp->vp_strvalue == other->vp_strvalue);
+	TEST_CHECK(fr_intern_is(vp->vp_strvalue));
+	talloc_free(other);
+
+	copy = paircopyvp(NULL, vp);
+	TEST_CHECK(copy != NULL);
+	TEST_CHECK(copy->vp_strvalue == vp->vp_strvalue);
+	TEST_CHECK(copy->length == vp->length);
+
+	intern_mark(vp->vp_strvalue, &freed);
+
+	/*
+	 *	Push the value out of the table.  It's kept until the
+	 *	last VP using it has been freed.
+	 */
+	for (i = 0; i < INTERN_MAX_ENTRIES; i++) {
+		snprintf(buffer, sizeof(buffer), "nas-%d.example.com", i);
+
+		other = intern_decode(da, buffer);
+		TEST_CHECK(other != NULL);
+		talloc_free(other);
+	}
+	TEST_CHECK(!freed);
+
+	talloc_free(vp);
+	TEST_CHECK(!freed);
+	TEST_CHECK(strcmp(copy->vp_strvalue, "nas1.example.com") == 0);
+
+	/*
+	 *	Setting a new value releases the shared one.
+	 */
+	pairstrcpy(copy, "changed");
+	TEST_CHECK(freed);
+	TEST_CHECK(!fr_intern_is(copy->vp_strvalue));
+	TEST_CHECK(strcmp(copy->vp_strvalue, "changed") == 0);
+	talloc_free(copy);
+
+	/*
+	 *	Freeing the last VP frees an evicted value.
+	 */
+	vp = intern_decode(da, "nas2.example.com");
+	TEST_CHECK(vp != NULL);
+	intern_mark(vp->vp_strvalue, &freed);
+
+	for (i = 0; i < INTERN_MAX_ENTRIES; i++) {
+		snprintf(buffer, sizeof(buffer), "nas-%d.example.net", i);
+
+		other = intern_decode(da, buffer);
+		TEST_CHECK(other != NULL);
+		talloc_free(other);
+	}
+	TEST_CHECK(!freed);
+
+	talloc_free(vp);
+	TEST_CHECK(freed);
+
+	return 0;
+}
+
+int test_intern(void)
+{
+	if (intern_table() < 0) return -1;
+
+	return intern_pairs();
+}
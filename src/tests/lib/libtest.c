@@ -0,0 +1,100 @@
+/*
+ * libtest.c	Tests for the library code.
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2026  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include "libtest.h"
+
+#include <freeradius-devel/conf.h>
+
+#ifdef HAVE_GETOPT_H
+#  include <getopt.h>
+#endif
+
+static struct {
+	char const	*name;
+	libtest_t	func;
+} tests[] = {
+	{ "clock",		test_clock },
+	{ "dns_cache",		test_dns_cache },
+	{ "intern",		test_intern },
+	{ "utf8_valid",		test_utf8_valid },
+	{ "value_parse",	test_value_parse },
+
+	{ NULL, NULL }
+};
+
+static void NEVER_RETURNS usage(void)
+{
+	fprintf(stderr, "usage: libtest [OPTS] [test ...]\n");
+	fprintf(stderr, "  -D <dictdir>           Set the directory where the dictionaries are stored (defaults to " DICTDIR ").\n");
+	fprintf(stderr, "  -h                     Print this help message.\n");
+
+	exit(1);
+}
+
+/*
+ *	Run the tests named on the command line, or all of them.
+ */
+int main(int argc, char **argv)
+{
+	int		c, i, j, failed = 0;
+	char const	*dict_dir = DICTDIR;
+
+	while ((c = getopt(argc, argv, "D:h")) != EOF) switch (c) {
+		case 'D':
+			dict_dir = optarg;
+			break;
+
+		case 'h':
+		default:
+			usage();
+	}
+	argc -= (optind - 1);
+	argv += (optind - 1);
+
+	if (fr_check_lib_magic(RADIUSD_MAGIC_NUMBER) < 0) {
+		fr_perror("libtest");
+		exit(1);
+	}
+
+	if (dict_init(dict_dir, RADIUS_DICTIONARY) < 0) {
+		fr_perror("libtest");
+		exit(1);
+	}
+
+	for (i = 0; tests[i].name; i++) {
+		if (argc > 1) {
+			for (j = 1; j < argc; j++) {
+				if (strcmp(argv[j], tests[i].name) == 0) break;
+			}
+			if (j == argc) continue;
+		}
+
+		if (tests[i].func() < 0) {
+			fprintf(stderr, "libtest: %s failed\n", tests[i].name);
+			failed++;
+		}
+	}
+
+	return (failed > 0);
+}
@@ -0,0 +1,49 @@
+/*
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+#ifndef LIBTEST_H
+#define LIBTEST_H
+/*
+ * $Id$
+ *
+ * @file libtest.h
+ * @brief Tests for the library code, run by "make tests.lib".
+ *
+ * @copyright 2026  The FreeRADIUS server project
+ */
+RCSIDH(libtest_h, "$Id$")
+
+#include <freeradius-devel/libradius.h>
+
+/*
+ *	Each test returns 0 on success.  TEST_CHECK() prints the
+ *	condition which failed, and fails the test.
+ */
+#define TEST_CHECK(_x) do { \
+	if (!(_x)) { \
+		fprintf(stderr, "%s[%u]: Failed %s\n", __FILE__, __LINE__, #_x); \
+		return -1; \
+	} \
+} while (0)
+
+typedef int (*libtest_t)(void);
+
+int	test_clock(void);
+int	test_dns_cache(void);
+int	test_intern(void);
+int	test_utf8_valid(void);
+int	test_value_parse(void);
+
+#endif /* LIBTEST_H */
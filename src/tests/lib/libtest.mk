@@ -0,0 +1,6 @@
+TARGET		:= libtest
+SOURCES		:= libtest.c clock.c dns.c intern.c utf8.c value.c
+
+TGT_INSTALLDIR	:=
+TGT_PREREQS	:= libfreeradius-radius.a
+TGT_LDLIBS	:= $(LIBS)
@@ -0,0 +1,206 @@
+/*
+ * utf8.c	Tests for checking UTF-8 strings.
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2026  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include "libtest.h"
+
+#include <sys/mman.h>
+
+#ifndef MAP_ANONYMOUS
+#  define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#define UTF8_MAX (64)
+
+/*
+ *	The input is copied to the end of a page, with an unreadable
+ *	page after it, so that reading past the end crashes the test.
+ */
+static uint8_t	*utf8_page = NULL;
+static size_t	utf8_page_size;
+
+static size_t utf8_valid(uint8_t const *str, size_t inlen)
+{
+	uint8_t *p = utf8_page + utf8_page_size - inlen;
+
+	memcpy(p, str, inlen);
+
+	return fr_utf8_valid(p, inlen);
+}
+
+/*
+ *	One character at a time, with zeros after the end of the input,
+ *	so that a truncated character is invalid.
+ */
+static size_t utf8_valid_slow(uint8_t const *str, size_t inlen)
+{
+	uint8_t	buffer[UTF8_MAX + 4];
+	size_t	i = 0;
+	int	len;
+
+	memset(buffer, 0, sizeof(buffer));
+	memcpy(buffer, str, inlen);
+
+	while (i < inlen) {
+		len = fr_utf8_char(buffer + i);
+		if (!len) break;
+		i += len;
+	}
+
+	return i;
+}
+
+/*
+ *	Characters which are valid, and sequences which aren't, from
+ *	each of the ranges fr_utf8_char() checks.
+ */
+static char const *valid[] = {
+	"a", " ", "~",
+	"\xc2\x80", "\xdf\xbf",				/* U+0080, U+07FF */
+	"\xe0\xa0\x80", "\xe1\x80\x80", "\xec\xbf\xbf",	/* U+0800, U+1000, U+CFFF */
+	"\xed\x80\x80", "\xed\x9f\xbf",			/* U+D000, U+D7FF */
+	"\xee\x80\x80", "\xef\xbf\xbf",			/* U+E000, U+FFFF */
+	"\xf0\x90\x80\x80", "\xf3\xbf\xbf\xbf",		/* U+10000, U+FFFFF */
+	"\xf4\x80\x80\x80", "\xf4\x8f\xbf\xbf",		/* U+100000, U+10FFFF */
+	NULL
+};
+
+static char const *invalid[] = {
+	"\x1f", "\x7f", "\x80", "\xbf", "\xc0\x80", "\xc1\xbf",	/* control, DEL, continuation, overlong */
+	"\xc2\x7f", "\xc2\xc0",
+	"\xe0\x80\x80", "\xe0\x9f\xbf",				/* overlong */
+	"\xed\xa0\x80", "\xed\xbf\xbf",				/* surrogates */
+	"\xe1\x80\x7f",
+	"\xf0\x80\x80\x80", "\xf0\x8f\xbf\xbf",			/* overlong */
+	"\xf4\x90\x80\x80", "\xf5\x80\x80\x80", "\xff",		/* over U+10FFFF */
+	"\xc2", "\xe1\x80", "\xf1\x80\x80",			/* truncated */
+	NULL
+};
+
+/*
+ *	Put the sequence at each offset in a run of ASCII, so that it
+ *	crosses every word boundary, and check where the valid prefix
+ *	ends.
+ */
+static int utf8_check_offsets(char const *seq, bool ok)
+{
+	uint8_t	buffer[UTF8_MAX];
+	size_t	len = strlen(seq), offset, total;
+
+	for (offset = 0; offset <= 24; offset++) {
+		for (total = offset + len; total <= offset + len + 17; total++) {
+			memset(buffer, 'x', sizeof(buffer));
+			memcpy(buffer + offset, seq, len);
+
+			TEST_CHECK(utf8_valid(buffer, total) == utf8_valid_slow(buffer, total));
+			if (ok) {
+				TEST_CHECK(utf8_valid(buffer, total) == total);
+			} else {
+				TEST_CHECK(utf8_valid(buffer, total) == offset);
+			}
+		}
+
+		/*
+		 *	Cut short at the end of the input.
+		 */
+		TEST_CHECK(utf8_valid(buffer, offset + len - 1) == offset);
+	}
+
+	return 0;
+}
+
+int test_utf8_valid(void)
+{
+	uint8_t		buffer[UTF8_MAX];
+	size_t		i, len;
+	uint32_t	seed = 1;
+	int		j;
+
+	utf8_page_size = sysconf(_SC_PAGESIZE);
+	utf8_page = mmap(NULL, utf8_page_size * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	TEST_CHECK(utf8_page != MAP_FAILED);
+	TEST_CHECK(mprotect(utf8_page + utf8_page_size, utf8_page_size, PROT_NONE) == 0);
+
+	/*
+	 *	Printable ASCII of every length is valid, and a bad
+	 *	byte anywhere ends the valid prefix there.
+	 */
+	TEST_CHECK(utf8_valid((uint8_t const *) "", 0) == 0);
+
+	for (len = 1; len <= UTF8_MAX; len++) {
+		for (i = 0; i < len; i++) buffer[i] = 0x20 + ((i * 7) % 0x5f);
+		TEST_CHECK(utf8_valid(buffer, len) == len);
+
+		for (i = 0; i < len; i++) {
+			uint8_t c = buffer[i];
+
+			buffer[i] = 0x00;
+			TEST_CHECK(utf8_valid(buffer, len) == i);
+			buffer[i] = 0x7f;
+			TEST_CHECK(utf8_valid(buffer, len) == i);
+			buffer[i] = 0x80;
+			TEST_CHECK(utf8_valid(buffer, len) == i);
+			buffer[i] = c;
+		}
+	}
+
+	for (j = 0; valid[j]; j++) {
+		if (utf8_check_offsets(valid[j], true) < 0) {
+			fprintf(stderr, "utf8_valid: Failed on valid sequence %d\n", j);
+			return -1;
+		}
+	}
+
+	for (j = 0; invalid[j]; j++) {
+		if (utf8_check_offsets(invalid[j], false) < 0) {
+			fprintf(stderr, "utf8_valid: Failed on invalid sequence %d\n", j);
+			return -1;
+		}
+	}
+
+	/*
+	 *	Random mixes of ASCII and the bytes used in multi-byte
+	 *	characters give the same answer as checking one
+	 *	character at a time.
+	 */
+	for (j = 0; j < 100000; j++) {
+		len = 0;
+		while (len < UTF8_MAX) {
+			seed = (seed * 1103515245) + 12345;
+
+			if ((seed >> 28) < 10) {
+				buffer[len++] = 'a' + ((seed >> 16) % 26);
+			} else {
+				buffer[len++] = 0x80 + ((seed >> 16) & 0x7f);
+			}
+		}
+		len = (seed >> 8) % (UTF8_MAX + 1);
+
+		TEST_CHECK(utf8_valid(buffer, len) == utf8_valid_slow(buffer, len));
+	}
+
+	munmap(utf8_page, utf8_page_size * 2);
+	utf8_page = NULL;
+
+	return 0;
+}
@@ -0,0 +1,201 @@
+/*
+ * value.c	Tests for parsing attribute values.
+ *
+ * Version:	$Id$
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ *
+ * Copyright 2026  The FreeRADIUS server project
+ */
+
+RCSID("$Id$")
+
+#include "libtest.h"
+
+/*
+ *	pairparsevalue() has fast paths for plain decimal integers,
+ *	dotted quads, and xx:xx:xx:xx:xx:xx.  Everything else goes to
+ *	the general parsers, so each input here is checked against
+ *	what the general parser makes of it, as well as against the
+ *	expected value where there is one.
+ */
+static char const *integers[] = {
+	"0", "1", "007", "42", "255", "256", "65535", "65536",
+	"4294967295",			/* largest 32 bit value */
+	"4294967296",			/* truncated, as strtoul() is */
+	"9999999999999999999",		/* the most digits the fast path takes */
+	"10000000000000000000",		/* one digit too many */
+	"99999999999999999999",
+	"0x10",
+	NULL
+};
+
+static char const *integers64[] = {
+	"0", "4294967296",
+	"9999999999999999999",
+	"10000000000000000000",
+	"18446744073709551615",		/* largest 64 bit value */
+	NULL
+};
+
+static char const *ipv4s[] = {
+	"0.0.0.0", "255.255.255.255", "192.0.2.1", "10.0.0.0",
+	"01.2.3.4", "1.2.3.04", "1.2.3.4/32",
+	"256.0.0.1", "1.2.3.256", "1000.0.0.1", "1.2.3.4294967297",
+	"1.2.3.4.5", "1..3.4", "1.2.3.", ".1.2.3", "1.2.3.-1", "1.2.3.4 ",
+	NULL
+};
+
+static VALUE_PAIR *value_parse(char const *attr, char const *value)
+{
+	VALUE_PAIR	*vp;
+	DICT_ATTR const	*da;
+
+	da = dict_attrbyname(attr);
+	if (!da) return NULL;
+
+	vp = pairalloc(NULL, da);
+	if (!vp) return NULL;
+
+	if (pairparsevalue(vp, value, 0) < 0) {
+		talloc_free(vp);
+		return NULL;
+	}
+
+	return vp;
+}
+
+/*
+ *	Whether the value parses to the same thing as it does with
+ *	the general parser.
+ */
+static int value_check_integer(char const *value)
+{
+	VALUE_PAIR	*vp;
+	char		*end;
+	uint32_t	num;
+
+	num = fr_strtoul(value, &end);
+
+	vp = value_parse("Tmp-Integer-0", value);
+	TEST_CHECK(vp);
+	TEST_CHECK(vp->vp_integer == num);
+	talloc_free(vp);
+
+	vp = value_parse("PKM-SAID", value);
+	TEST_CHECK(!vp == (num > 65535));
+	if (vp) TEST_CHECK(vp->vp_short == num);
+	talloc_free(vp);
+
+	vp = value_parse("3GPP-RAT-Type", value);
+	TEST_CHECK(!vp == (num > 255));
+	if (vp) TEST_CHECK(vp->vp_byte == num);
+	talloc_free(vp);
+
+	return 0;
+}
+
+static int value_check_ipv4(char const *value)
+{
+	VALUE_PAIR	*vp;
+	fr_ipaddr_t	ipaddr;
+	int		rcode;
+
+	rcode = fr_pton4(&ipaddr, value, 0, false, false);
+
+	vp = value_parse("Tmp-IP-Address-0", value);
+	TEST_CHECK(!vp == (rcode < 0));
+	if (vp) TEST_CHECK(vp->vp_ipaddr == ipaddr.ipaddr.ip4addr.s_addr);
+	talloc_free(vp);
+
+	return 0;
+}
+
+static bool value_is(char const *attr, char const *value, char const *expected)
+{
+	VALUE_PAIR	*vp;
+	char		buffer[256];
+
+	vp = value_parse(attr, value);
+	if (!vp) return false;
+
+	vp_prints_value(buffer, sizeof(buffer), vp, '\0');
+	talloc_free(vp);
+
+	return (strcmp(buffer, expected) == 0);
+}
+
+int test_value_parse(void)
+{
+	int		i;
+	VALUE_PAIR	*vp;
+	bool		lookups = fr_hostname_lookups;
+
+	/*
+	 *	Invalid addresses would otherwise be looked up as names.
+	 */
+	fr_hostname_lookups = false;
+
+	for (i = 0; integers[i]; i++) {
+		if (value_check_integer(integers[i]) < 0) {
+			fprintf(stderr, "value_parse: Failed parsing integer \"%s\"\n", integers[i]);
+			return -1;
+		}
+	}
+
+	for (i = 0; integers64[i]; i++) {
+		vp = value_parse("Tmp-Integer64-0", integers64[i]);
+		TEST_CHECK(vp);
+		TEST_CHECK(vp->vp_integer64 == strtoull(integers64[i], NULL, 10));
+		talloc_free(vp);
+	}
+
+	for (i = 0; ipv4s[i]; i++) {
+		if (value_check_ipv4(ipv4s[i]) < 0) {
+			fprintf(stderr, "value_parse: Failed parsing IPv4 address \"%s\"\n", ipv4s[i]);
+			return -1;
+		}
+	}
+
+	/*
+	 *	The boundaries, and values which must not be accepted.
+	 */
+	TEST_CHECK(value_is("Tmp-Integer-0", "4294967295", "4294967295"));
+	TEST_CHECK(value_is("Tmp-Integer64-0", "9999999999999999999", "9999999999999999999"));
+	TEST_CHECK(value_is("Tmp-Integer64-0", "18446744073709551615", "18446744073709551615"));
+	TEST_CHECK(value_is("PKM-SAID", "65535", "65535"));
+	TEST_CHECK(!value_parse("PKM-SAID", "65536"));
+	TEST_CHECK(value_is("3GPP-RAT-Type", "255", "255"));
+	TEST_CHECK(!value_parse("3GPP-RAT-Type", "256"));
+	TEST_CHECK(!value_parse("Tmp-Integer-0", "12a"));
+	TEST_CHECK(value_is("Service-Type", "1", "Login-User"));
+	TEST_CHECK(value_is("Service-Type", "Login-User", "Login-User"));
+
+	TEST_CHECK(value_is("Tmp-IP-Address-0", "0.0.0.0", "0.0.0.0"));
+	TEST_CHECK(value_is("Tmp-IP-Address-0", "255.255.255.255", "255.255.255.255"));
+	TEST_CHECK(!value_parse("Tmp-IP-Address-0", "01.2.3.4"));
+	TEST_CHECK(!value_parse("Tmp-IP-Address-0", "256.0.0.1"));
+	TEST_CHECK(!value_parse("Tmp-IP-Address-0", "1.2.3.256"));
+	TEST_CHECK(!value_parse("Tmp-IP-Address-0", "1.2.3.4.5"));
+
+	TEST_CHECK(value_is("Tmp-Cast-Ethernet", "00:11:22:aa:BB:ff", "00:11:22:aa:bb:ff"));
+	TEST_CHECK(value_is("Tmp-Cast-Ethernet", "0:1:2:3:4:05", "00:01:02:03:04:05"));
+	TEST_CHECK(!value_parse("Tmp-Cast-Ethernet", "00:11:22:33:44:55:66"));
+	TEST_CHECK(!value_parse("Tmp-Cast-Ethernet", "00:11:22:33:44:gg"));
+
+	fr_hostname_lookups = lookups;
+
+	return 0;
+}
@@ -0,0 +1,25 @@
+#
+#  Tests for the "metrics" listener
+#
+#	make tests.metrics
+#
+#  starts a server with two metrics listeners, sends it some requests,
+#  and checks what the listeners serve.  See metrics.sh.
+#
+METRICS_PORT	?= 12384
+
+#
+#  Create the output directory
+#
+.PHONY: $(BUILD_DIR)/tests/metrics
+$(BUILD_DIR)/tests/metrics:
+	@mkdir -p $@
+
+.PHONY: tests.metrics
+tests.metrics: $(TESTBINDIR)/radiusd $(TESTBINDIR)/radclient | rlm_pap.la build.raddb $(BUILD_DIR)/tests/metrics
+	@echo TEST-METRICS
+	@TESTBIN="$(TESTBIN)" OUTPUT=$(BUILD_DIR)/tests/metrics sh src/tests/metrics/metrics.sh $(METRICS_PORT)
+
+.PHONY: clean.tests.metrics
+clean.tests.metrics:
+	@rm -rf $(BUILD_DIR)/tests/metrics/
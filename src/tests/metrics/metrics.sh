@@ -0,0 +1,118 @@
+#!/bin/sh
+#
+#  Check that the "metrics" listener serves the statistics of the
+#  requests which were sent, in the OpenMetrics format, and that it
+#  refuses scrapers which aren't in its "allow" list.
+#
+#  Usage: metrics.sh <port>
+#
+#  The metrics listeners are on <port> + 1 and <port> + 2.  The
+#  second one doesn't allow the loopback addresses.
+#
+#  OUTPUT is where the logs and the scraped metrics are written.  See
+#  src/tests/server.sh.  "curl" is used to scrape them.
+#
+: ${CURL=curl}
+
+NAME=metrics
+PORT=$1
+LOCAL_PORT=`expr $PORT + 1`
+REMOTE_PORT=`expr $PORT + 2`
+
+METRICS_PORT=$PORT
+METRICS_LOCAL_PORT=$LOCAL_PORT
+METRICS_REMOTE_PORT=$REMOTE_PORT
+export METRICS_PORT METRICS_LOCAL_PORT METRICS_REMOTE_PORT
+
+. src/tests/server.sh
+
+if ! $CURL --version > /dev/null 2>&1; then
+	echo "TEST-METRICS skipped, \"$CURL\" wasn't found"
+	exit 0
+fi
+
+check() {
+	echo "User-Name = \"$1\", User-Password = \"$2\", Response-Packet-Type = $3" | \
+		$TESTBIN/radclient -r 1 -t 5 -D share 127.0.0.1:$PORT auth testing123 > $OUTPUT/radclient.log 2>&1 || \
+		fail "Expected $3 for $1/$2: `cat $OUTPUT/radclient.log`"
+}
+
+#
+#  Fetch a path from a metrics listener, and print the HTTP status.
+#  The headers and the body are written to $OUTPUT/headers and
+#  $OUTPUT/metrics.
+#
+#  Usage: scrape <port> <path> [curl options]
+#
+scrape() {
+	port=$1
+	path=$2
+	shift 2
+	$CURL -s -m 5 -D $OUTPUT/headers -o $OUTPUT/metrics -w '%{http_code}' "$@" \
+		http://127.0.0.1:$port$path
+}
+
+#
+#  Check that a sample has the given value.
+#
+sample() {
+	grep -qF "$1 $2" $OUTPUT/metrics || fail "Expected \"$1 $2\", got \"`grep -F "$1" $OUTPUT/metrics`\""
+}
+
+rm -f $OUTPUT/radiusd.pid $OUTPUT/radiusd.log $OUTPUT/metrics $OUTPUT/headers
+
+start
+
+check bob hello Access-Accept
+check bob hello Access-Accept
+check bob wrong Access-Reject
+
+#
+#  The requests are counted once they've been cleaned up, which
+#  happens a little after the replies are sent.
+#
+TRIES=0
+while ! grep -qF 'freeradius_access_rejects_total{type="auth"} 1' $OUTPUT/metrics 2>/dev/null; do
+	TRIES=`expr $TRIES + 1`
+	[ $TRIES -ge 10 ] && break
+	sleep 1
+	scrape $LOCAL_PORT /metrics > /dev/null
+done
+
+[ "`scrape $LOCAL_PORT /metrics`" = 200 ] || fail "The metrics weren't served"
+grep -qi "^Content-Type: application/openmetrics-text" $OUTPUT/headers || fail "Wrong Content-Type: `cat $OUTPUT/headers`"
+[ "`tail -1 $OUTPUT/metrics`" = "# EOF" ] || fail "The metrics don't end with \"# EOF\""
+
+sample 'freeradius_requests_total{type="auth"}' 3
+sample 'freeradius_access_accepts_total{type="auth"}' 2
+sample 'freeradius_access_rejects_total{type="auth"}' 1
+sample 'freeradius_client_access_accepts_total{client="localhost",address="127.0.0.1",type="auth"}' 2
+grep -q '^# TYPE freeradius_latency_seconds summary$' $OUTPUT/metrics || fail "There's no latency summary"
+grep -q '^freeradius_module_calls_total{module="pap"' $OUTPUT/metrics || fail "There are no counters for \"pap\""
+
+#
+#  Every family is declared once, and every sample belongs to the
+#  family declared before it.
+#
+DUPS=`sed -n 's/^# TYPE \([^ ]*\) .*/\1/p' $OUTPUT/metrics | sort | uniq -d`
+[ -z "$DUPS" ] || fail "These families are declared twice: $DUPS"
+
+BAD=`awk '/^# TYPE / { family = $3; next }
+	/^#/ { next }
+	index($0, family) != 1 { print; exit }' $OUTPUT/metrics`
+[ -z "$BAD" ] || fail "This sample is outside its family: $BAD"
+
+#
+#  Other paths and methods.
+#
+[ "`scrape $LOCAL_PORT /other`" = 404 ] || fail "/other wasn't \"404 Not Found\""
+[ "`scrape $LOCAL_PORT /metrics -X POST`" = 405 ] || fail "POST wasn't \"405 Method Not Allowed\""
+
+#
+#  127.0.0.1 isn't in the second listener's "allow" list.
+#
+[ "`scrape $REMOTE_PORT /metrics`" = 403 ] || fail "A scraper which isn't allowed wasn't refused"
+grep -q "freeradius_" $OUTPUT/metrics && fail "The metrics were sent to a scraper which isn't allowed"
+
+stop
+exit 0
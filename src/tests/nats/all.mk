@@ -0,0 +1,26 @@
+#
+#  Tests for rlm_nats
+#
+#	make tests.nats
+#
+#  starts a server which publishes accounting requests with rlm_nats,
+#  to a fake NATS server, and checks what it receives.  See nats.sh.
+#
+NATS_PORT		?= 12382
+NATS_SERVER_PORT	?= 12383
+
+#
+#  Create the output directory
+#
+.PHONY: $(BUILD_DIR)/tests/nats
+$(BUILD_DIR)/tests/nats:
+	@mkdir -p $@
+
+.PHONY: tests.nats
+tests.nats: $(TESTBINDIR)/radiusd $(TESTBINDIR)/radclient | rlm_nats.la build.raddb $(BUILD_DIR)/tests/nats
+	@echo TEST-NATS
+	@TESTBIN="$(TESTBIN)" OUTPUT=$(BUILD_DIR)/tests/nats sh src/tests/nats/nats.sh $(NATS_PORT) $(NATS_SERVER_PORT)
+
+.PHONY: clean.tests.nats
+clean.tests.nats:
+	@rm -rf $(BUILD_DIR)/tests/nats/
@@ -0,0 +1,72 @@
+#!/usr/bin/env perl
+#
+#  Pretend to be a NATS server, for one client at a time.
+#
+#  Usage: nats.pl <port> <output directory>
+#
+#  The CONNECT options are decoded, and written to "connect" as
+#  "key=value" lines.  Each published message is written to
+#  "messages" as one line, "<subject> <payload>", or "<subject>
+#  INVALID" if the payload isn't a JSON object.
+#
+use strict;
+use warnings;
+use IO::Socket::INET;
+use JSON::PP;
+
+my ($port, $dir) = @ARGV;
+die "Usage: $0 <port> <output directory>\n" unless defined $dir;
+
+my $listen = IO::Socket::INET->new(LocalAddr => "127.0.0.1:$port", Listen => 5, ReuseAddr => 1)
+	or die "Failed opening socket: $!\n";
+
+sub output {
+	my ($file, $text) = @_;
+
+	open(my $fh, '>>', "$dir/$file") or die "Failed opening $dir/$file: $!\n";
+	print $fh $text;
+	close($fh);
+}
+
+while (my $sock = $listen->accept) {
+	my $buf = '';
+
+	print $sock "INFO {\"server_id\":\"test\",\"max_payload\":1048576}\r\n";
+
+	while (sysread($sock, $buf, 65536, length($buf))) {
+		while ($buf =~ /^(.*?)\r\n/s) {
+			my $line = $1;
+			my $used = length($line) + 2;
+
+			if ($line =~ /^CONNECT (.*)$/) {
+				my $opts = eval { decode_json($1) };
+				if (!$opts) {
+					output("connect", "INVALID\n");
+				} else {
+					output("connect", join('', map { "$_=$opts->{$_}\n" } sort keys %$opts));
+				}
+
+			} elsif ($line =~ /^PUB (\S+) (\d+)$/) {
+				my ($subject, $len) = ($1, $2);
+
+				last if length($buf) < $used + $len + 2;
+
+				my $payload = substr($buf, $used, $len);
+				my $msg = eval { decode_json($payload) };
+				$used += $len + 2;
+
+				output("messages", "$subject " . ((ref($msg) eq 'HASH') ? $payload : "INVALID") . "\n");
+
+			} elsif ($line eq 'PING') {
+				print $sock "PONG\r\n";
+
+			} elsif ($line ne 'PONG') {
+				print $sock "-ERR 'Unknown Protocol Operation'\r\n";
+			}
+
+			substr($buf, 0, $used) = '';
+		}
+	}
+
+	close($sock);
+}
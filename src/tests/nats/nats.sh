@@ -0,0 +1,117 @@
+#!/bin/sh
+#
+#  Check that rlm_nats spools accounting requests while the NATS
+#  server is down, and publishes them, in order, when it comes up.
+#  Lines in the spool file which are too long to be messages are
+#  skipped, and the user name and password are escaped in the
+#  CONNECT options.
+#
+#  Usage: nats.sh <port> <NATS server port>
+#
+#  OUTPUT is where the logs, the spool file, and what nats.pl
+#  received are written.  See src/tests/server.sh.
+#
+NAME=nats
+PORT=$1
+SERVER_PORT=$2
+
+NATS_PORT=$PORT
+NATS_SERVER_PORT=$SERVER_PORT
+export NATS_PORT NATS_SERVER_PORT
+
+. src/tests/server.sh
+
+#
+#  Send an accounting request.
+#
+#  Usage: send <Acct-Session-Id> <User-Name>
+#
+send() {
+	printf 'Acct-Session-Id = "%s", Acct-Status-Type = Start, User-Name = "%s"\n' "$1" "$2" | \
+		$TESTBIN/radclient -r 1 -t 5 -D share 127.0.0.1:$PORT acct testing123 > $OUTPUT/radclient.log 2>&1 || \
+		fail "No response to $1: `cat $OUTPUT/radclient.log`"
+}
+
+#
+#  Wait for a file to contain a string.
+#
+wait_for() {
+	TRIES=0
+	while ! grep -qF "$2" $OUTPUT/$1 2>/dev/null; do
+		TRIES=`expr $TRIES + 1`
+		[ $TRIES -ge 10 ] && fail "Expected \"$2\" in $1"
+		sleep 1
+	done
+}
+
+#
+#  A line in a file must be exactly as given.
+#
+line() {
+	got=`sed -n "$2p" $OUTPUT/$1`
+	[ "$got" = "$3" ] || fail "Expected line $2 of $1 to be \"$3\", got \"$got\""
+}
+
+rm -f $OUTPUT/radiusd.pid $OUTPUT/radiusd.log $OUTPUT/connect $OUTPUT/messages
+
+#
+#  Left over from last time.  The long lines can't have been written
+#  by rlm_nats.  The second is longer than its write buffer.
+#
+{
+	echo '{"timestamp":1,"spooled":"before"}'
+	head -c 9000 /dev/zero | tr '\0' 'x'; echo
+	head -c 70000 /dev/zero | tr '\0' 'y'; echo
+	echo '{"timestamp":2,"spooled":"after"}'
+} > $OUTPUT/nats.spool
+
+#
+#  Start without a NATS server, so the request is spooled.
+#
+start
+
+send one bob
+wait_for nats.spool '"sessionId":"one"'
+
+#
+#  Everything in the spool file is published once the server is up,
+#  oldest first, and the file is emptied.
+#
+perl src/tests/nats/nats.pl $SERVER_PORT $OUTPUT &
+HELPERS=$!
+
+wait_for messages '"sessionId":"one"'
+line messages 1 'test.accounting {"timestamp":1,"spooled":"before"}'
+line messages 2 'test.accounting {"timestamp":2,"spooled":"after"}'
+grep -q '^test.accounting {"timestamp":[0-9]*,"sessionId":"one","userName":"bob"}$' $OUTPUT/messages || \
+	fail "Spooled request was wrong: `sed -n 3p $OUTPUT/messages`"
+[ `wc -l < $OUTPUT/messages` -eq 3 ] || fail "Expected 3 messages, got `wc -l < $OUTPUT/messages`"
+[ `grep -c "Skipping line of more than" $OUTPUT/radiusd.log` -eq 2 ] || fail "Long lines weren't skipped"
+
+TRIES=0
+while [ -s $OUTPUT/nats.spool ]; do
+	TRIES=`expr $TRIES + 1`
+	[ $TRIES -ge 10 ] && fail "Spool file wasn't emptied"
+	sleep 1
+done
+
+grep -qxF 'user=radius "test" \\ user' $OUTPUT/connect || fail "Wrong user name in CONNECT: `cat $OUTPUT/connect`"
+grep -qxF 'pass=pass	word' $OUTPUT/connect || fail "Wrong password in CONNECT: `cat $OUTPUT/connect`"
+
+#
+#  Now it's connected, requests are published directly.  The
+#  values are escaped, too.
+#
+send two 'a\"b\\c'
+wait_for messages '"sessionId":"two"'
+grep -qF '"sessionId":"two","userName":"a\"b\\c"}' $OUTPUT/messages || \
+	fail "Request wasn't escaped: `sed -n 4p $OUTPUT/messages`"
+grep -q INVALID $OUTPUT/messages && fail "Invalid JSON was published: `grep INVALID $OUTPUT/messages`"
+[ ! -s $OUTPUT/nats.spool ] || fail "Request was spooled while connected"
+
+kill -0 `cat $OUTPUT/radiusd.pid` 2> /dev/null || fail "radiusd exited"
+
+stop
+kill $HELPERS
+wait $HELPERS
+exit 0
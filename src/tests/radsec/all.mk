@@ -0,0 +1,38 @@
+#
+#  Tests for RADIUS/TLS
+#
+#	make tests.radsec
+#
+#  starts a server which proxies requests to itself over RADIUS/TLS,
+#  and checks the replies.  Also checks client certificates against
+#  CRLs, and with an OCSP responder.  See radsec.sh.
+#
+RADSEC_PORT	?= 12390
+RADSEC_TLS_PORT	?= 12391
+RADSEC_CHECK_PORT ?= 12388
+RADSEC_OCSP_PORT ?= 12389
+
+RADSEC_MODULES	:= $(shell grep -- mods-enabled src/tests/radsec/radiusd.conf  | sed 's,.*/,,')
+RADSEC_RADDB	:= $(addprefix raddb/mods-enabled/,$(RADSEC_MODULES))
+RADSEC_LIBS	:= $(addsuffix .la,$(addprefix rlm_,$(RADSEC_MODULES)))
+
+#
+#  Create the output directory
+#
+.PHONY: $(BUILD_DIR)/tests/radsec
+$(BUILD_DIR)/tests/radsec:
+	@mkdir -p $@
+
+.PHONY: tests.radsec
+ifneq "$(OPENSSL_LIBS)" ""
+tests.radsec: $(TESTBINDIR)/radiusd $(TESTBINDIR)/radclient | $(RADSEC_RADDB) $(RADSEC_LIBS) build.raddb $(BUILD_DIR)/tests/radsec
+	@echo TEST-RADSEC
+	@TESTBIN="$(TESTBIN)" OUTPUT=$(BUILD_DIR)/tests/radsec sh src/tests/radsec/radsec.sh $(RADSEC_PORT) $(RADSEC_TLS_PORT) $(RADSEC_CHECK_PORT) $(RADSEC_OCSP_PORT)
+else
+tests.radsec:
+	@echo "TEST-RADSEC skipped, the server was built without OpenSSL"
+endif
+
+.PHONY: clean.tests.radsec
+clean.tests.radsec:
+	@rm -rf $(BUILD_DIR)/tests/radsec/
@@ -0,0 +1,216 @@
+#!/bin/sh
+#
+#  Run radiusd with a RADIUS/TLS listener, and check that requests
+#  proxied to it over TLS are answered.  Also check that TLS sessions
+#  can be resumed from a session ticket, but not after a restart, as
+#  the ticket keys are random.
+#
+#  A second TLS listener checks client certificates against a CRL
+#  directory, and with OCSP.  "openssl ocsp" is run as the responder.
+#  Check that revoked certificates are refused by each, that OCSP
+#  responses are cached, and that the CRLs are reloaded.
+#
+#  Usage: radsec.sh <port> <tls port> <check port> <ocsp port>
+#
+#  OUTPUT is where the certificates and logs are written.  See
+#  src/tests/server.sh.
+#
+: ${OPENSSL=openssl}
+
+NAME=radsec
+PORT=$1
+TLS_PORT=$2
+CHECK_PORT=$3
+OCSP_PORT=$4
+SECRET=testing123
+
+. src/tests/server.sh
+
+RADSEC_CERTS=$OUTPUT/certs
+RADSEC_PORT=$PORT
+RADSEC_TLS_PORT=$TLS_PORT
+RADSEC_CHECK_PORT=$CHECK_PORT
+RADSEC_OCSP_PORT=$OCSP_PORT
+export RADSEC_CERTS RADSEC_PORT RADSEC_TLS_PORT RADSEC_CHECK_PORT RADSEC_OCSP_PORT
+
+#
+#  A throwaway CA, and server and client certificates signed by it.
+#
+#  "revoked" is in the CRL, and "ocsp" is only revoked in the
+#  database used by the OCSP responder.  "later" is added to the
+#  CRL while the server is running.
+#
+certs() {
+	mkdir -p $OUTPUT/certs/crl
+	cd $OUTPUT/certs || exit 1
+
+	$OPENSSL req -x509 -newkey rsa:2048 -nodes -days 2 -subj "/CN=radsec test CA" \
+		-keyout ca.key -out ca.pem || exit 1
+
+	cat > ca.cnf <<EOF
+[ ca ]
+default_ca = test
+
+[ test ]
+database = index.txt
+crlnumber = crlnumber
+default_md = sha256
+default_crl_days = 2
+EOF
+	: > index.txt
+	echo 01 > crlnumber
+
+	for x in server client revoked ocsp later; do
+		$OPENSSL req -newkey rsa:2048 -nodes -subj "/CN=radsec test $x" \
+			-keyout $x.key -out $x.csr || exit 1
+		$OPENSSL x509 -req -in $x.csr -CA ca.pem -CAkey ca.key -CAcreateserial \
+			-days 2 -out $x.pem || exit 1
+		$OPENSSL ca -config ca.cnf -cert ca.pem -keyfile ca.key -valid $x.pem || exit 1
+	done
+
+	revoke revoked || exit 1
+	crl || exit 1
+	revoke ocsp || exit 1
+
+	cd - > /dev/null
+}
+
+#
+#  Mark a certificate as revoked in the CA database, and write a
+#  CRL with the certificates revoked so far.  The server may read
+#  the CRL directory at any time, so the CRL is renamed into place.
+#  These run in $OUTPUT/certs.
+#
+revoke() {
+	$OPENSSL ca -config ca.cnf -cert ca.pem -keyfile ca.key -revoke $1.pem
+}
+
+crl() {
+	$OPENSSL ca -config ca.cnf -cert ca.pem -keyfile ca.key -gencrl -out crl.tmp && \
+		mv crl.tmp crl/ca.crl
+}
+
+#
+#  Send a request, and check that we get the expected reply.
+#  radclient fails if the reply code isn't Response-Packet-Type.
+#
+check() {
+	echo "User-Name = \"$1\", User-Password = \"$2\", Response-Packet-Type = $3" | \
+		$TESTBIN/radclient -r 1 -t 5 -D share 127.0.0.1:$PORT auth $SECRET > $OUTPUT/radclient.log 2>&1 || \
+		fail "Expected $3 for $1/$2: `cat $OUTPUT/radclient.log`"
+}
+
+#
+#  Open a TLS connection to a listener with one of the client
+#  certificates, and close it again once the handshake is done.
+#
+#  Usage: handshake <port> <certificate> [s_client options]
+#
+handshake() {
+	port=$1
+	cert=$2
+	shift 2
+	$OPENSSL s_client -connect 127.0.0.1:$port -tls1_2 -CAfile $OUTPUT/certs/ca.pem \
+		-cert $OUTPUT/certs/$cert.pem -key $OUTPUT/certs/$cert.key "$@" \
+		< /dev/null > $OUTPUT/s_client.log 2>&1
+}
+
+#
+#  Check that the listener with the CRL and OCSP checks accepts, or
+#  refuses, a client certificate.  A refusal must be logged with
+#  the given message.
+#
+accepted() {
+	handshake $CHECK_PORT $1
+	grep -q "^New, TLS" $OUTPUT/s_client.log || fail "The \"$1\" certificate was refused"
+}
+
+refused() {
+	: > $OUTPUT/radiusd.log
+	handshake $CHECK_PORT $1
+	grep -q "^New, TLS" $OUTPUT/s_client.log && fail "The \"$1\" certificate was accepted"
+	grep -q "$2" $OUTPUT/radiusd.log || fail "The \"$1\" certificate wasn't refused with \"$2\""
+}
+
+#
+#  The number of requests the OCSP responder has answered.
+#
+ocsp_requests() {
+	grep -c "Received request" $OUTPUT/ocsp.log
+}
+
+rm -rf $OUTPUT/certs $OUTPUT/radiusd.pid $OUTPUT/radiusd.log $OUTPUT/session.pem $OUTPUT/ocsp.log
+certs > $OUTPUT/certs.log 2>&1 || { cat $OUTPUT/certs.log >&2; exit 1; }
+
+(cd $OUTPUT/certs && exec $OPENSSL ocsp -index index.txt -port $OCSP_PORT \
+	-rsigner ca.pem -rkey ca.key -CA ca.pem -ndays 1) > $OUTPUT/ocsp.log 2>&1 &
+HELPERS=$!
+
+TRIES=0
+while ! grep -q "waiting for OCSP client connections" $OUTPUT/ocsp.log 2>/dev/null; do
+	TRIES=`expr $TRIES + 1`
+	[ $TRIES -ge 20 ] && fail "The OCSP responder did not start"
+	sleep 1
+done
+
+start
+
+check bob hello Access-Accept
+check bob wrong Access-Reject
+
+#
+#  A second request goes over the same TLS connection.
+#
+check bob hello Access-Accept
+
+#
+#  A session is resumed from its ticket, without the session
+#  being looked up in the cache.
+#
+handshake $TLS_PORT client -sess_out $OUTPUT/session.pem
+grep -q "TLS session ticket:" $OUTPUT/s_client.log || fail "No session ticket was issued"
+handshake $TLS_PORT client -sess_in $OUTPUT/session.pem
+grep -q "^Reused," $OUTPUT/s_client.log || fail "The session was not resumed from its ticket"
+
+#
+#  A good certificate passes both checks, and the second time its
+#  OCSP response comes from the cache.
+#
+accepted client
+[ "`ocsp_requests`" = 1 ] || fail "Expected one OCSP request, got `ocsp_requests`"
+accepted client
+[ "`ocsp_requests`" = 1 ] || fail "The OCSP response was not cached"
+grep -q "Using cached response" $OUTPUT/radiusd.log || fail "The OCSP response was not cached"
+
+refused revoked "Certificate has been revoked"
+refused ocsp "Certificate has been expired/revoked"
+
+#
+#  Once "later" is in the CRL, it's refused after the CRLs are
+#  reloaded, even though its good OCSP response is still cached.
+#
+accepted later
+(cd $OUTPUT/certs && revoke later && crl) >> $OUTPUT/certs.log 2>&1 || \
+	fail "Failed adding the \"later\" certificate to the CRL"
+
+TRIES=0
+while handshake $CHECK_PORT later && grep -q "^New, TLS" $OUTPUT/s_client.log; do
+	TRIES=`expr $TRIES + 1`
+	[ $TRIES -ge 30 ] && fail "The CRLs were not reloaded"
+	sleep 1
+done
+grep -q "Certificate has been revoked" $OUTPUT/radiusd.log || fail "The \"later\" certificate wasn't refused by the CRL"
+
+#
+#  The ticket keys are made when the server starts, so the ticket
+#  can't be used after a restart.
+#
+stop
+start
+handshake $TLS_PORT client -sess_in $OUTPUT/session.pem
+grep -q "^New," $OUTPUT/s_client.log || fail "A ticket issued before a restart was accepted"
+
+stop
+kill $HELPERS
+wait $HELPERS
+exit 0
@@ -0,0 +1,69 @@
+#
+#  Functions for the tests which run radiusd, and check what it does.
+#
+#  A test sets NAME, and any environment variables used by its
+#  radiusd.conf, then sources this file:
+#
+#	NAME=cache
+#	CACHE_PORT=$1
+#	export CACHE_PORT
+#
+#	. src/tests/server.sh
+#
+#  radiusd reads its configuration from src/tests/$NAME.  TESTBIN is
+#  the command prefix used to run the binaries from the build tree,
+#  and OUTPUT is where the logs are written.  HELPERS may be set to
+#  the PIDs of other programs the test starts, which are killed if
+#  it fails.
+#
+: ${TESTBIN=./build/bin}
+: ${OUTPUT=./build/tests/$NAME}
+
+RADIUSD=
+
+#
+#  Start radiusd, and wait until it logs that it's ready, or the
+#  given message.
+#
+#  Usage: start [message]
+#
+start() {
+	ready=${1-Ready to process requests}
+
+	: > $OUTPUT/radiusd.log
+	$TESTBIN/radiusd -fxxP -d src/tests/$NAME -D share -l $OUTPUT/radiusd.log > /dev/null 2>&1 &
+	RADIUSD=$!
+
+	TRIES=0
+	while ! grep -q "$ready" $OUTPUT/radiusd.log 2>/dev/null; do
+		TRIES=`expr $TRIES + 1`
+		[ $TRIES -ge 20 ] && fail "radiusd did not start"
+		sleep 1
+	done
+}
+
+#
+#  Stop radiusd, with SIGTERM, or the given signal.
+#
+#  Usage: stop [-signal]
+#
+stop() {
+	[ -f $OUTPUT/radiusd.pid ] && kill $1 `cat $OUTPUT/radiusd.pid` 2> /dev/null
+	[ -n "$RADIUSD" ] && wait $RADIUSD
+	RADIUSD=
+	rm -f $OUTPUT/radiusd.pid
+}
+
+#
+#  Print a message, and the end of the log, then stop everything
+#  and exit.
+#
+#  Usage: fail <message>
+#
+fail() {
+	echo "$1" >&2
+	tail -40 $OUTPUT/radiusd.log >&2
+	[ -n "$HELPERS" ] && kill $HELPERS 2> /dev/null
+	stop
+	exit 1
+}
@@ -0,0 +1,40 @@
+#
+#  Tests for rlm_sqlippool
+#
+#	make tests.sqlippool
+#
+#  starts a server which allocates addresses from blocks reserved in
+#  an SQLite database, and checks that failed allocation writes are
+#  retried.  See sqlippool.sh.
+#
+SQLIPPOOL_PORT	?= 12394
+
+#
+#  The SQLite driver is only built if configure found libsqlite3.
+#
+SQLIPPOOL_SQLITE := $(shell grep -s '^TARGETNAME.*rlm_sql_sqlite' src/modules/rlm_sql/drivers/rlm_sql_sqlite/all.mk)
+
+#
+#  Create the output directory
+#
+.PHONY: $(BUILD_DIR)/tests/sqlippool
+$(BUILD_DIR)/tests/sqlippool:
+	@mkdir -p $@
+
+.PHONY: tests.sqlippool
+ifneq "$(SQLIPPOOL_SQLITE)" ""
+tests.sqlippool: $(TESTBINDIR)/radiusd $(TESTBINDIR)/radclient | rlm_sql.la rlm_sql_sqlite.la rlm_sqlippool.la build.raddb $(BUILD_DIR)/tests/sqlippool
+	@if ! which sqlite3 > /dev/null 2>&1; then \
+		echo "TEST-SQLIPPOOL skipped, the sqlite3 command was not found"; \
+	else \
+		echo TEST-SQLIPPOOL; \
+		TESTBIN="$(TESTBIN)" OUTPUT=$(BUILD_DIR)/tests/sqlippool sh src/tests/sqlippool/sqlippool.sh $(SQLIPPOOL_PORT); \
+	fi
+else
+tests.sqlippool:
+	@echo "TEST-SQLIPPOOL skipped, rlm_sql_sqlite was not built"
+endif
+
+.PHONY: clean.tests.sqlippool
+clean.tests.sqlippool:
+	@rm -rf $(BUILD_DIR)/tests/sqlippool/
@@ -0,0 +1,102 @@
+#!/bin/sh
+#
+#  Check that addresses allocated from a reservation are written to
+#  the database, that failed writes are retried, and that a write
+#  which still fails when the reservation runs out is reported.
+#
+#  Usage: sqlippool.sh <port>
+#
+#  OUTPUT is where the logs and the database are written.  See
+#  src/tests/server.sh.
+#
+NAME=sqlippool
+PORT=$1
+
+SQLIPPOOL_PORT=$PORT
+export SQLIPPOOL_PORT
+
+. src/tests/server.sh
+
+DB=$OUTPUT/ippool.sqlite
+
+sql() {
+	sqlite3 -cmd ".timeout 5000" $DB "$1"
+}
+
+#
+#  Send an Access-Request, and print the address which was
+#  allocated.  radclient doesn't print the reply attributes, so
+#  the address is taken from the server's log.  This runs in a
+#  subshell, so it prints nothing rather than failing.
+#
+allocate() {
+	echo "User-Name = $1, NAS-IP-Address = 127.0.0.1, NAS-Port = $2" | \
+		$TESTBIN/radclient -D share -r 1 -t 2 127.0.0.1:$PORT auth testing123 > $OUTPUT/radclient.log 2>&1 && \
+		sed -n 's/.*sqlippool: Allocated IP \([0-9.]*\).*/\1/p' $OUTPUT/radiusd.log | tail -1
+}
+
+#
+#  Check who an address is recorded as being allocated to.
+#
+owner() {
+	user=`sql "SELECT username FROM radippool WHERE framedipaddress = '$1'"`
+	[ "$user" = "$2" ] || fail "Expected $1 to be allocated to \"$2\", got \"$user\""
+}
+
+rm -f $OUTPUT/radiusd.pid $OUTPUT/radiusd.log $DB
+
+#
+#  The address table, and a trigger which makes the allocation
+#  writes (but not the reservations) fail while fail.on is 1.
+#
+sql "CREATE TABLE radippool (
+	id INTEGER PRIMARY KEY,
+	pool_name varchar(30) NOT NULL,
+	framedipaddress varchar(15) NOT NULL default '',
+	nasipaddress varchar(15) NOT NULL default '',
+	calledstationid VARCHAR(30) NOT NULL default '',
+	callingstationid VARCHAR(30) NOT NULL default '',
+	expiry_time DATETIME NULL default NULL,
+	username varchar(64) NOT NULL default '',
+	pool_key varchar(30) NOT NULL default '');
+CREATE TABLE fail (on_ INTEGER);
+INSERT INTO fail VALUES (1);
+CREATE TRIGGER fail_allocate BEFORE UPDATE ON radippool
+	WHEN NEW.username != '' AND (SELECT on_ FROM fail) = 1
+	BEGIN SELECT RAISE(ABORT, 'injected failure'); END;" || fail "Failed creating the database"
+
+for i in 1 2 3 4 5 6 7 8; do
+	sql "INSERT INTO radippool (pool_name, framedipaddress) VALUES ('test', '192.0.2.$i')"
+done
+
+start
+
+#
+#  The write fails, and is retried until it works.
+#
+FIRST=`allocate bob 1`
+[ -n "$FIRST" ] || fail "No address was allocated for bob"
+sleep 2
+grep -q "Failed writing 1 allocations, will retry" $OUTPUT/radiusd.log || fail "The write did not fail"
+owner $FIRST ""
+
+sql "UPDATE fail SET on_ = 0"
+sleep 2
+owner $FIRST bob
+
+#
+#  The reservation has stopped being handed out, so this comes
+#  from a new one.  Its write fails until the reservation runs
+#  out, and then it's reported as lost.
+#
+sql "UPDATE fail SET on_ = 1"
+SECOND=`allocate alice 2`
+[ -n "$SECOND" ] || fail "No address was allocated for alice"
+[ "$SECOND" != "$FIRST" ] || fail "alice was given bob's address $FIRST"
+sleep 8
+grep -q "Lost allocation of $SECOND" $OUTPUT/radiusd.log || fail "The lost write was not reported"
+owner $SECOND ""
+owner $FIRST bob
+
+stop
+exit 0
@@ -7,7 +7,7 @@
 #  functionality from earlier tests.
 #
 FILES  := rfc.txt errors.txt extended.txt lucent.txt wimax.txt \
-	condition.txt xlat.txt vendor.txt
+	condition.txt xlat.txt vendor.txt json.txt
 
 #
 #  Create the output directory